@@ -5,6 +5,8 @@ import sys
 
 def print_usage():
 	print 'Usage: ./flexisip_stats.py [-p/--pid <pid>] [-s/--server "proxy"/"presence"] <GET/SET/LIST> <"all"/path_to_value> [value_to_set]'
+	print '       ./flexisip_stats.py [-p/--pid <pid>] [-s/--server "proxy"/"presence"] PROFILE <seconds>'
+	print '       ./flexisip_stats.py [-p/--pid <pid>] [-s/--server "proxy"/"presence"] TENANTS'
 
 def getpid(serverType):
 	from subprocess import check_output, CalledProcessError
@@ -33,7 +35,14 @@ def sendMessage(remote_socket, message):
 		s.connect(remote_socket)
 		s.send(message)
 		
-		print s.recv(8192)
+		# the answer may be longer than a read, the server closes the socket once it is sent
+		answer = ''
+		while True:
+			data = s.recv(8192)
+			if not data:
+				break
+			answer += data
+		print answer
 	except socket.error:
 		print 'Error: could not connect to the socket.'
 	s.close()
@@ -52,13 +61,13 @@ def main():
 		print_usage()
 		sys.exit(2)
 		
-	if len(args) < 2:
+	if len(args) < 2 and args[:1] != ['TENANTS']:
 		print 'Error: at least 2 arguments expected'
 		print_usage()
 		sys.exit(2)
 		
-	if not args[0] in ['GET', 'SET', 'LIST']:
-		print 'Error: command must be either GET, SET or LIST'
+	if not args[0] in ['GET', 'SET', 'LIST', 'PROFILE', 'TENANTS']:
+		print 'Error: command must be either GET, SET, LIST, PROFILE or TENANTS'
 		print_usage()
 		sys.exit(2)
 		
@@ -0,0 +1,370 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "account-registrations.hh"
+#include "agent.hh"
+
+#include <sofia-sip/msg_header.h>
+#include <sofia-sip/sip_protos.h>
+#include <sofia-sip/sip_status.h>
+#include <sofia-sip/sip_tag.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+AccountRegistrationManager::AccountRegistrationManager(Agent *agent)
+	: mAgent(agent), mRegistrationRate(0), mTokens(0), mRandom(random_device()()) {
+	// declared among the domain registrations, the other registrations made to remote servers
+	GenericStruct *area = GenericManager::get()->getRoot()->get<GenericStruct>("inter-domain-connections");
+	ConfigItemDescriptor configs[] = {
+		{String, "account-registrations",
+		 "Path to a text file describing the accounts to register to upstream registrars, such as trunks or gateways. "
+		 "This file must contain lines like:\n"
+		 " <account SIP URI> <SIP URI of the registrar> <username> <password> [<expires>]\n"
+		 "The contact registered for an account is its user at the preferred route of this proxy. The accounts of a "
+		 "registrar share the connection to it and the digest challenges of its realms.\n"
+		 "If the file is empty, no accounts are registered.",
+		 ""},
+		{Integer, "account-registration-rate",
+		 "Maximum number of account REGISTERs sent per second, challenges excepted. The refreshes are spread "
+		 "randomly between 80 and 90% of the expiration delays, and the failed registrations retried with an "
+		 "exponential backoff.",
+		 "100"},
+		config_item_end};
+	area->addChildrenValues(configs);
+	mCountRegisters = area->createStat("count-account-registers", "Number of account REGISTERs sent.");
+	mCountChallenges =
+		area->createStat("count-account-challenges", "Number of challenges received for the account REGISTERs.");
+	mCountRegistered = area->createStat("count-registered-accounts", "Number of accounts currently registered.");
+}
+
+AccountRegistrationManager::~AccountRegistrationManager() {
+	for (auto &account : mAccounts) {
+		if (account.orq)
+			nta_outgoing_destroy(account.orq);
+	}
+	for (auto &upstream : mUpstreams)
+		releaseTport(upstream.second);
+}
+
+int AccountRegistrationManager::load() {
+	GenericStruct *area = GenericManager::get()->getRoot()->get<GenericStruct>("inter-domain-connections");
+	string configFile = area->get<ConfigString>("account-registrations")->read();
+	mRegistrationRate = max(1, area->get<ConfigInt>("account-registration-rate")->read());
+	if (configFile.empty())
+		return 0;
+
+	ifstream ifs(configFile);
+	if (!ifs.is_open()) {
+		LOGE("Cannot open account registration configuration file '%s'", configFile.c_str());
+		return -1;
+	}
+	LOGD("Loading account registrations from %s", configFile.c_str());
+	string line;
+	int lineNumber = 0;
+	while (getline(ifs, line)) {
+		SofiaAutoHome home;
+		string uri, registrar, username, password, expires;
+		++lineNumber;
+		size_t first = line.find_first_not_of(" \t");
+		if (first == string::npos || line[first] == '#')
+			continue;
+		istringstream istr(line);
+		istr >> uri >> registrar >> username >> password;
+		if (password.empty()) {
+			LOGE("Missing fields at line %i of '%s'", lineNumber, configFile.c_str());
+			return -1;
+		}
+		istr >> expires;
+		url_t *url = url_make(home.home(), uri.c_str());
+		url_t *registrarUrl = url_make(home.home(), registrar.c_str());
+		if (!url || !url->url_user || !url->url_host || !registrarUrl || !registrarUrl->url_host) {
+			LOGE("Bad URI at line %i of '%s'", lineNumber, configFile.c_str());
+			return -1;
+		}
+		mAccounts.emplace_back();
+		Account &account = mAccounts.back();
+		account.user = url->url_user;
+		account.domain = url->url_host;
+		account.username = username;
+		account.password = password;
+		account.upstream = getUpstream(registrarUrl);
+		account.realm = NULL;
+		account.orq = NULL;
+		account.index = mAccounts.size() - 1;
+		account.cseq = 0;
+		account.expires = expires.empty() ? 3600 : max(60, atoi(expires.c_str()));
+		account.failures = 0;
+		account.challenges = 0;
+		account.queued = false;
+		account.registered = false;
+		account.upstream->accounts.push_back(&account);
+	}
+
+	const url_t *route = mAgent->getPreferredRouteUrl();
+	if (route) {
+		mContactHost = route->url_host;
+		if (route->url_port)
+			mContactHost += string(":") + route->url_port;
+		if (route->url_params)
+			mContactHost += string(";") + route->url_params;
+	} else {
+		mContactHost = mAgent->getPublicIp();
+	}
+	mCallIdSuffix = mAgent->getUniqueId().empty() ? "flexisip" : mAgent->getUniqueId();
+	LOGI("Registering %zu accounts to %zu registrars", mAccounts.size(), mUpstreams.size());
+	// the rate limit spreads the first registrations
+	for (auto &account : mAccounts)
+		enqueue(account);
+	return 0;
+}
+
+AccountRegistrationManager::Upstream *AccountRegistrationManager::getUpstream(const url_t *registrar) {
+	SofiaAutoHome home;
+	string key = url_as_string(home.home(), registrar);
+	auto it = mUpstreams.find(key);
+	if (it != mUpstreams.end())
+		return &it->second;
+	Upstream &upstream = mUpstreams[key];
+	upstream.manager = this;
+	upstream.registrar = url_hdup(mHome.home(), registrar);
+	upstream.tport = NULL;
+	upstream.pendId = 0;
+	return &upstream;
+}
+
+void AccountRegistrationManager::schedule(Account &account, int seconds) {
+	account.timer = mAgent->getTimers()->schedule(seconds, [this, &account]() {
+		account.timer.reset();
+		enqueue(account);
+	});
+}
+
+void AccountRegistrationManager::enqueue(Account &account) {
+	if (account.queued)
+		return;
+	account.queued = true;
+	mQueue.push_back(&account);
+	pump();
+}
+
+void AccountRegistrationManager::pump() {
+	if (!mPumpTimer) {
+		// a new second of sending
+		mTokens = mRegistrationRate;
+	}
+	while (!mQueue.empty() && mTokens > 0) {
+		Account *account = mQueue.front();
+		mQueue.pop_front();
+		account->queued = false;
+		if (account->orq)
+			continue; // answered soon, the next refresh is scheduled then
+		--mTokens;
+		if (!send(*account))
+			schedule(*account, backoff(account->failures++));
+	}
+	if (!mPumpTimer) {
+		mPumpTimer = mAgent->getTimers()->schedule(1, [this]() {
+			mPumpTimer.reset();
+			if (!mQueue.empty())
+				pump();
+		});
+	}
+}
+
+int AccountRegistrationManager::jitter(int min, int max) {
+	if (max <= min)
+		return min;
+	return uniform_int_distribution<int>(min, max)(mRandom);
+}
+
+int AccountRegistrationManager::backoff(int failures) {
+	// from 1 second to 10 minutes
+	int delay = min(600, 1 << min(failures, 10));
+	return jitter((delay + 1) / 2, delay);
+}
+
+bool AccountRegistrationManager::send(Account &account) {
+	Upstream &upstream = *account.upstream;
+	nta_agent_t *nta = mAgent->getSofiaAgent();
+	msg_t *msg = nta_msg_create(nta, 0);
+	sip_t *sip = sip_object(msg);
+	su_home_t *home = msg_home(msg);
+	url_t *uri = url_format(home, "%s:%s", upstream.registrar->url_type == url_sips ? "sips" : "sip",
+							account.domain.c_str());
+	string aor = "<sip:" + account.user + "@" + account.domain + ">";
+	string tag = ";tag=" + to_string(account.index);
+	string contact = "<sip:" + account.user + "@" + mContactHost + ">";
+	string callId = to_string(account.index) + "-" + mCallIdSuffix;
+
+	msg_header_t *authorization = NULL;
+	if (!account.realm && upstream.realms.size() == 1) {
+		// most likely the realm of the accounts of the registrar already challenged
+		account.realm = &upstream.realms.begin()->second;
+	}
+	if (account.realm) {
+		// computed from the nonce the realm was last challenged with, the nonce count shared by all its accounts
+		auc_all_credentials(account.realm, "Digest", NULL, account.username.c_str(), account.password.c_str());
+		auc_authorization_headers(account.realm, home, "REGISTER", (url_t *)uri, NULL, &authorization);
+	}
+	sip_request_t *request = sip_request_create(home, SIP_METHOD_REGISTER, (url_string_t *)uri, NULL);
+	if (!request || msg_header_insert(msg, (msg_pub_t *)sip, (msg_header_t *)request) < 0 ||
+		sip_add_tl(msg, sip, SIPTAG_FROM_STR((aor + tag).c_str()), SIPTAG_TO_STR(aor.c_str()),
+				   SIPTAG_CALL_ID_STR(callId.c_str()),
+				   SIPTAG_CSEQ(sip_cseq_create(home, ++account.cseq, SIP_METHOD_REGISTER)),
+				   SIPTAG_CONTACT_STR(contact.c_str()), SIPTAG_EXPIRES(sip_expires_create(home, account.expires)),
+				   TAG_IF(authorization, SIPTAG_HEADER((sip_header_t *)authorization)), TAG_END()) < 0) {
+		LOGE("Cannot make the REGISTER of account %s@%s", account.user.c_str(), account.domain.c_str());
+		msg_destroy(msg);
+		return false;
+	}
+
+	if (mAgent->getResolverCache())
+		mAgent->getResolverCache()->touch(upstream.registrar);
+	account.orq = nta_outgoing_mcreate(nta, &AccountRegistrationManager::sOnResponse, (nta_outgoing_magic_t *)&account,
+									   (url_string_t *)upstream.registrar, msg,
+									   TAG_IF(upstream.tport, NTATAG_TPORT(upstream.tport)), TAG_END());
+	if (!account.orq) {
+		LOGE("Could not create the REGISTER transaction of account %s@%s", account.user.c_str(),
+			 account.domain.c_str());
+		return false;
+	}
+	++*mCountRegisters;
+	return true;
+}
+
+int AccountRegistrationManager::sOnResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip) {
+	Account *account = reinterpret_cast<Account *>(magic);
+	if (sip && sip->sip_status->st_status < 200)
+		return 0;
+	account->upstream->manager->onResponse(*account, orq, sip);
+	return 0;
+}
+
+bool AccountRegistrationManager::onChallenge(Account &account, const sip_t *sip, int status) {
+	++*mCountChallenges;
+	msg_auth_t *challenge =
+		status == 401 ? (msg_auth_t *)sip->sip_www_authenticate : (msg_auth_t *)sip->sip_proxy_authenticate;
+	msg_hclass_t *credentialClass = status == 401 ? sip_authorization_class : sip_proxy_authorization_class;
+	const char *realm = challenge ? msg_params_find(challenge->au_params, "realm=") : NULL;
+	if (!realm)
+		return false;
+	// a second challenge in a row is a refusal of the credentials, unless the nonce used was stale
+	if (account.challenges++ > 0 && !(account.challenges == 2 && msg_params_find(challenge->au_params, "stale=")))
+		return false;
+	auth_client_t **auth = &account.upstream->realms[realm];
+	if (auc_challenge(auth, mHome.home(), challenge, credentialClass) < 0)
+		return false;
+	account.realm = auth;
+	return send(account);
+}
+
+void AccountRegistrationManager::onResponse(Account &account, nta_outgoing_t *orq, const sip_t *sip) {
+	Upstream &upstream = *account.upstream;
+	int status = sip ? sip->sip_status->st_status : 408;
+	account.orq = NULL;
+	if (status == 401 || status == 407) {
+		if (onChallenge(account, sip, status)) {
+			nta_outgoing_destroy(orq);
+			return;
+		}
+	}
+	account.challenges = 0;
+	if (status == 200) {
+		if (!upstream.tport) {
+			// the next REGISTERs of the accounts of the registrar go through this connection
+			tport_t *tport = nta_outgoing_transport(orq);
+			if (tport && tport_is_secondary(tport) && tport_is_reliable(tport)) {
+				upstream.tport = tport;
+				upstream.pendId = tport_pend(tport, NULL, &AccountRegistrationManager::sOnConnectionBroken,
+											 (tp_client_t *)&upstream);
+			} else if (tport) {
+				tport_unref(tport);
+			}
+		}
+		if (!account.registered) {
+			account.registered = true;
+			++*mCountRegistered;
+		}
+		account.failures = 0;
+		int expires = getExpires(account, sip);
+		schedule(account, jitter((expires * 80) / 100, (expires * 90) / 100) + 1);
+	} else {
+		if (account.registered) {
+			account.registered = false;
+			--*mCountRegistered;
+		}
+		int delay = backoff(account.failures++);
+		LOGD("Registration of account %s@%s failed with %i, retrying in %i seconds", account.user.c_str(),
+			 account.domain.c_str(), status, delay);
+		schedule(account, delay);
+	}
+	nta_outgoing_destroy(orq);
+}
+
+int AccountRegistrationManager::getExpires(const Account &account, const sip_t *response) {
+	if (response->sip_expires)
+		return response->sip_expires->ex_delta;
+	if (response->sip_contact && response->sip_contact->m_expires) {
+		int expires = atoi(response->sip_contact->m_expires);
+		if (expires > 0)
+			return expires;
+	}
+	return account.expires;
+}
+
+void AccountRegistrationManager::sOnConnectionBroken(tp_stack_t *stack, tp_client_t *client, tport_t *tport,
+													 msg_t *msg, int error) {
+	Upstream *upstream = reinterpret_cast<Upstream *>(client);
+	upstream->manager->onConnectionBroken(*upstream);
+}
+
+void AccountRegistrationManager::onConnectionBroken(Upstream &upstream) {
+	SofiaAutoHome home;
+	if (!upstream.tport)
+		return;
+	LOGD("Connection to registrar %s broken, registering its %zu accounts again",
+		 url_as_string(home.home(), upstream.registrar), upstream.accounts.size());
+	// released out of the notification of the tport
+	tport_t *tport = upstream.tport;
+	int pendId = upstream.pendId;
+	upstream.tport = NULL;
+	upstream.pendId = 0;
+	upstream.release = mAgent->getTimers()->defer([&upstream, tport, pendId]() {
+		tport_release(tport, pendId, NULL, NULL, (tp_client_t *)&upstream, 0);
+		tport_unref(tport);
+	});
+	// spread over the time the rate limit needs to send them all, so that they do not all wait in the queue
+	int spread = (int)(upstream.accounts.size() / mRegistrationRate) + 4;
+	for (Account *account : upstream.accounts) {
+		if (!account->orq)
+			schedule(*account, jitter(1, spread));
+	}
+}
+
+void AccountRegistrationManager::releaseTport(Upstream &upstream) {
+	if (upstream.tport) {
+		tport_release(upstream.tport, upstream.pendId, NULL, NULL, (tp_client_t *)&upstream, 0);
+		tport_unref(upstream.tport);
+		upstream.tport = NULL;
+		upstream.pendId = 0;
+	}
+}
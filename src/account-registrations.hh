@@ -0,0 +1,118 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef accountregistrations_hh
+#define accountregistrations_hh
+
+#include <sofia-sip/auth_client.h>
+#include <sofia-sip/nta.h>
+#include <sofia-sip/tport.h>
+
+#include "common.hh"
+#include "configmanager.hh"
+#include "timerservice.hh"
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+
+class Agent;
+
+/*
+ * Registers the accounts listed in the account-registrations file (trunks, gateways) to their upstream registrars, by
+ * tens of thousands. The accounts of a registrar share its connection, kept from the first REGISTER that succeeded
+ * through it, and its challenges: the nonce of a realm, got by the first account challenged, authenticates the
+ * REGISTERs of the other accounts of the realm without a round trip, until the registrar declares it stale.
+ * The REGISTERs are rate limited, and the refreshes spread randomly between 80 and 90% of the expiration delays.
+ * An account keeps a few strings and counters: its transaction lives no longer than one REGISTER, and it has neither
+ * leg nor home of its own.
+ */
+class AccountRegistrationManager {
+  public:
+	AccountRegistrationManager(Agent *agent);
+	~AccountRegistrationManager();
+	int load();
+
+  private:
+	struct Upstream;
+	struct Account {
+		std::string user;
+		std::string domain;
+		std::string username; // of the credentials, may differ from user
+		std::string password;
+		Upstream *upstream;
+		auth_client_t **realm; // challenge of the realm of the account, NULL until challenged
+		nta_outgoing_t *orq;   // REGISTER in progress
+		std::shared_ptr<TimerService::Timer> timer;
+		uint32_t index; // the Call-ID and From tag are derived from it, so that the refreshes keep them
+		uint32_t cseq;
+		int expires;
+		uint16_t failures;  // in a row, for the backoff of the retries
+		uint8_t challenges; // in a row, for the REGISTER in progress
+		bool queued;
+		bool registered;
+	};
+	struct Upstream {
+		AccountRegistrationManager *manager;
+		url_t *registrar;
+		tport_t *tport; // connection to the registrar, NULL until a REGISTER succeeds
+		int pendId;
+		std::map<std::string, auth_client_t *> realms; // challenges by realm
+		std::list<Account *> accounts;
+		std::shared_ptr<TimerService::Timer> release; // of the broken connection
+	};
+
+	static int sOnResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip);
+	static void sOnConnectionBroken(tp_stack_t *stack, tp_client_t *client, tport_t *tport, msg_t *msg, int error);
+	Upstream *getUpstream(const url_t *registrar);
+	void onResponse(Account &account, nta_outgoing_t *orq, const sip_t *sip);
+	bool onChallenge(Account &account, const sip_t *sip, int status);
+	void onConnectionBroken(Upstream &upstream);
+	void releaseTport(Upstream &upstream);
+	void schedule(Account &account, int seconds);
+	/* Sends the REGISTER of account as soon as the rate limit allows it. */
+	void enqueue(Account &account);
+	void pump();
+	bool send(Account &account);
+	static int getExpires(const Account &account, const sip_t *response);
+	/* Random delay in [min, max]. */
+	int jitter(int min, int max);
+	/* Delay before the retry following the given number of failures in a row. */
+	int backoff(int failures);
+
+	Agent *mAgent;
+	SofiaAutoHome mHome;
+	std::deque<Account> mAccounts; // never moved, referenced by the queue, the timers and the transactions
+	std::map<std::string, Upstream> mUpstreams; // by registrar uri
+	std::string mContactHost; // host part of the contacts registered, with its port and parameters
+	std::string mCallIdSuffix;
+	int mRegistrationRate;
+	int mTokens;
+	std::deque<Account *> mQueue;
+	std::shared_ptr<TimerService::Timer> mPumpTimer;
+	std::minstd_rand mRandom;
+	StatCounter64 *mCountRegisters;
+	StatCounter64 *mCountChallenges;
+	StatCounter64 *mCountRegistered;
+};
+
+#endif
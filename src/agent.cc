@@ -23,13 +23,21 @@
 #include "agent.hh"
 #include "module.hh"
 #include "domain-registrations.hh"
+#include "account-registrations.hh"
 #include "registrardb.hh"
 
 #include "log/logmanager.hh"
 #include "sipattrextractor.hh"
 
 #include "etchosts.hh"
+#include "utils/allocationcounter.hh"
+#include "tracing.hh"
+#include "profiler.hh"
+#include "tenantstats.hh"
+#include "utils/objectpool.hh"
+#include "utils/startup.hh"
 #include <algorithm>
+#include <set>
 #include <sstream>
 #include <sofia-sip/tport_tag.h>
 #include <sofia-sip/su_tagarg.h>
@@ -39,6 +47,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
 #include <net/if.h>
@@ -46,6 +55,27 @@
 
 #define IPADDR_SIZE 64
 
+#ifdef HAVE_TPORT_TLS_SET_SESSION_REUSE
+/* from patches/sofia/sofia_tls_session_reuse.patch */
+extern "C" void tport_tls_set_session_reuse(char const *ticket_keys_file, int client_cache_size);
+#endif
+#ifdef HAVE_TPORT_TLS_SET_HANDSHAKE_THREADS
+/* from patches/sofia/sofia_tls_handshake_threads.patch */
+extern "C" void tport_tls_set_handshake_threads(int threads, int timeout_ms);
+#endif
+#ifdef HAVE_TPORT_SET_REUSEPORT
+/* from patches/sofia/sofia_tport_reuseport.patch */
+extern "C" void tport_set_reuseport(int enable);
+#endif
+#ifdef HAVE_TPORT_SET_WRITE_COALESCING
+/* from patches/sofia/sofia_tport_write_coalescing.patch */
+extern "C" void tport_set_write_coalescing(int enable);
+#endif
+#ifdef HAVE_TPORT_SET_PRESCAN
+/* from patches/sofia/sofia_tport_prescan.patch */
+extern "C" void tport_set_prescan(int (*prescan)(void *arg, char const *data, size_t len), void *arg);
+#endif
+
 using namespace std;
 
 static StatCounter64 *createCounter(GenericStruct *global, string keyprefix, string helpprefix, string value) {
@@ -98,6 +128,60 @@ void Agent::onDeclare(GenericStruct *root) {
 	mCountReply487 = createCounter(global, key, help, "487"); // Request canceled
 	mCountReply488 = createCounter(global, key, help, "488");
 	mCountReplyResUnknown = createCounter(global, key, help, "unknown");
+
+	mCountAllocationsRequest.clear();
+	mCountAllocationsResponse = NULL;
+	if (AllocationCounter::enabled()) {
+		key = "count-allocations-request-";
+		help = "Number of heap allocations made while processing the incoming requests with method name ";
+		for (int method = sip_method_unknown; method <= sip_method_publish; ++method) {
+			string name = sip_method_name((sip_method_t)method, "unknown");
+			transform(name.begin(), name.end(), name.begin(), ::tolower);
+			mCountAllocationsRequest.push_back(createCounter(global, key, help, name));
+		}
+		mCountAllocationsResponse = global->createStat(
+			"count-allocations-response", "Number of heap allocations made while processing the incoming responses.");
+	}
+	mCountPrescanRejected = global->createStat(
+		"count-prescan-rejected", "Number of datagrams dropped by the check preceding their parsing.");
+	global->createStat("count-dns-cache-hits", "Number of lookups of the outgoing routing found in the DNS cache.");
+	global->createStat("count-dns-cache-misses", "Number of lookups of the outgoing routing not found in the DNS cache.");
+	global->createStat("count-dns-prefetches", "Number of DNS queries sent to refresh a record before its expiry.");
+	for (const char *name : {"invite", "message", "register", "options"}) {
+		global->createStat(string("count-overload-rejected-") + name,
+						   string("Number of requests of the ") + name + " class answered with 503 by the overload control.");
+	}
+	global->createStat("count-overload-queued-requests", "Number of requests waiting in the overload control queue.");
+	for (int type = 0; type < ObjectCounter::TypeCount; ++type) {
+		const char *name = ObjectCounter::getName((ObjectCounter::Type)type);
+		mCountLiveObjects[type] = global->createStat(string("count-live-") + name,
+													 string("Number of ") + name + " in memory, to spot a leak.");
+	}
+	mHeapAllocated = mHeapActive = mHeapResident = NULL;
+	if (HeapStats::enabled()) {
+		mHeapAllocated =
+			global->createStat("heap-allocated-bytes", "Bytes allocated on the heap, as told by jemalloc.");
+		mHeapActive =
+			global->createStat("heap-active-bytes", "Bytes of the pages holding the allocations of the heap.");
+		mHeapResident = global->createStat("heap-resident-bytes",
+										   "Bytes of the pages of the heap mapped in memory, the allocator included.");
+	}
+	global->createStat("count-compacted-messages",
+					   "Number of messages forwarded with compact headers on the transports of compact-headers.");
+	global->createStat("compacted-saved-bytes", "Number of bytes saved by writing the messages with compact headers.");
+	global->createStat("count-request-batches", "Number of batches of requests dispatched when batch-dispatch is enabled.");
+	global->createStat("count-stateless-forwarded",
+					   "Number of requests forwarded without transaction nor module keeping a state, see stateless-forward.");
+	global->createStat("count-batched-requests", "Number of requests dispatched by batch when batch-dispatch is enabled.");
+	global->createStat("main-loop-busy-permille",
+					   "Share of the last second the SIP thread spent running, in per mille, the SIP thread saturating "
+					   "long before the CPU usage of the whole machine shows it.");
+	global->createStat("main-loop-lag-us", "Longest lag of the timers of the main loop during the last second, in "
+										   "microseconds: how long the events ready wait before being processed.");
+	global->createStat("headroom-permille",
+					   "Capacity left on the most loaded of the main loop, its lag, the relay threads, the thread "
+					   "pools, the commands sent to redis and the push notifications queued, in per mille. The signal "
+					   "to scale horizontally on, see saturation-max-delay.");
 	mLogWriter = NULL;
 
 	std::string uniqueId = global->get<ConfigString>("unique-id")->read();
@@ -126,7 +210,9 @@ void Agent::startLogWriter() {
 				cr->get<ConfigString>("database-backend")->read(),
 				cr->get<ConfigString>("database-connection-string")->read(),
 				cr->get<ConfigInt>("database-max-queue-size")->read(),
-				cr->get<ConfigInt>("database-nb-threads-max")->read()
+				cr->get<ConfigInt>("database-nb-threads-max")->read(),
+				cr->get<ConfigInt>("database-batch-size")->read(),
+				cr->get<ConfigInt>("database-compression-threshold")->read()
 			);
 			if (!dbw->isReady()) {
 				LOGF("DataBaseEventLogWriter: unable to use database.");
@@ -136,9 +222,27 @@ void Agent::startLogWriter() {
 			#else
 				LOGF("DataBaseEventLogWriter: unable to use database (`ENABLE_SOCI` is not defined).");
 			#endif
+		} else if (cr->get<ConfigString>("logger")->read() == "stream") {
+			StreamEventLogWriter *sw = new StreamEventLogWriter(
+				cr->get<ConfigString>("stream-address")->read(),
+				cr->get<ConfigInt>("stream-max-queue-size")->read(),
+				cr->get<ConfigInt>("stream-batch-size")->read(),
+				cr->get<ConfigInt>("stream-batch-delay")->read(),
+				cr->get<ConfigInt>("stream-compression-threshold")->read()
+			);
+			if (!sw->isReady()) {
+				delete sw;
+			} else {
+				mLogWriter = sw;
+			}
 		} else {
 			string logdir = cr->get<ConfigString>("dir")->read();
-			FilesystemEventLogWriter *lw = new FilesystemEventLogWriter(logdir);
+			FilesystemEventLogWriter *lw = new FilesystemEventLogWriter(
+				logdir,
+				cr->get<ConfigBoolean>("filesystem-segments")->read(),
+				(size_t)cr->get<ConfigInt>("filesystem-segment-max-size")->read() * 1024 * 1024,
+				cr->get<ConfigInt>("filesystem-max-queue-size")->read()
+			);
 			if (!lw->isReady()) {
 				delete lw;
 			} else {
@@ -215,9 +319,54 @@ void Agent::start(const std::string &transport_override, const std::string passp
 	unsigned int t1x64 = (unsigned int)global->get<ConfigInt>("transaction-timeout")->read();
 	int udpmtu = global->get<ConfigInt>("udp-mtu")->read();
 	unsigned int incompleteIncomingMessageTimeout = 600 * 1000; /*milliseconds*/
-	unsigned int keepAliveInterval = 30 * 60 * 1000;			/*30mn*/
+	unsigned int keepAliveInterval = 1000 * (unsigned int)global->get<ConfigInt>("keepalive-interval")->read();
+	// the queue only holds the messages waiting for a writable socket, rarely more than a few on a client connection
+	bool connectionScaling = global->get<ConfigBoolean>("connection-scaling")->read();
+	unsigned int queueSize = 8;
 
 	mainTlsCertsDir = absolutePath(currDir, mainTlsCertsDir);
+	string ticketKeyFile = global->get<ConfigString>("tls-session-ticket-key-file")->read();
+	int clientSessionCacheSize = global->get<ConfigInt>("tls-client-session-cache-size")->read();
+	if (!ticketKeyFile.empty())
+		ticketKeyFile = absolutePath(currDir, ticketKeyFile);
+#ifdef HAVE_TPORT_TLS_SET_SESSION_REUSE
+	// applies to the tls transports added below, and to the connections they open
+	tport_tls_set_session_reuse(ticketKeyFile.c_str(), clientSessionCacheSize);
+#else
+	if (!ticketKeyFile.empty())
+		LOGW("tls-session-ticket-key-file is ignored: sofia-sip lacks the sofia_tls_session_reuse patch");
+	(void)clientSessionCacheSize;
+#endif
+	int handshakeThreads = global->get<ConfigInt>("tls-handshake-threads")->read();
+#ifdef HAVE_TPORT_TLS_SET_HANDSHAKE_THREADS
+	tport_tls_set_handshake_threads(handshakeThreads, 10000);
+#else
+	if (handshakeThreads > 0)
+		LOGW("tls-handshake-threads is ignored: sofia-sip lacks the sofia_tls_handshake_threads patch");
+#endif
+	bool reusePort = global->get<ConfigBoolean>("reuse-port")->read();
+#ifdef HAVE_TPORT_SET_REUSEPORT
+	tport_set_reuseport(reusePort);
+#else
+	if (reusePort)
+		LOGW("reuse-port is ignored: sofia-sip lacks the sofia_tport_reuseport patch");
+#endif
+	bool writeCoalescing = global->get<ConfigBoolean>("write-coalescing")->read();
+#ifdef HAVE_TPORT_SET_WRITE_COALESCING
+	tport_set_write_coalescing(writeCoalescing);
+#else
+	if (writeCoalescing)
+		LOGW("write-coalescing is ignored: sofia-sip lacks the sofia_tport_write_coalescing patch");
+#endif
+	bool prescan = global->get<ConfigBoolean>("prescan-datagrams")->read();
+	mPrescanLimits.maxSize = (size_t)global->get<ConfigByteSize>("prescan-max-size")->read();
+	mPrescanLimits.maxHeaders = (size_t)global->get<ConfigInt>("prescan-max-headers")->read();
+#ifdef HAVE_TPORT_SET_PRESCAN
+	tport_set_prescan(prescan ? sOnPrescan : NULL, this);
+#else
+	if (prescan)
+		LOGW("prescan-datagrams is ignored: sofia-sip lacks the sofia_tport_prescan patch");
+#endif
 
 	SLOGD << "Main tls certs dir : " << mainTlsCertsDir;
 
@@ -264,11 +413,13 @@ void Agent::start(const std::string &transport_override, const std::string passp
 			err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_CERTIFICATE(keys.c_str()), TPTAG_TLS_PASSPHRASE(mPassphrase.c_str()),
 									  TPTAG_TLS_VERIFY_POLICY(tls_policy), TPTAG_IDLE(tports_idle_timeout),
 									  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
-									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1), TAG_END());
+									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_PONG2PING(1), TPTAG_SDWN_ERROR(1),
+									  TAG_IF(connectionScaling, TPTAG_QUEUESIZE(queueSize)), TAG_END());
 		} else {
 			err = nta_agent_add_tport(mAgent, (const url_string_t *)url, TPTAG_IDLE(tports_idle_timeout),
 									  TPTAG_TIMEOUT(incompleteIncomingMessageTimeout),
-									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_SDWN_ERROR(1), TAG_END());
+									  TPTAG_KEEPALIVE(keepAliveInterval), TPTAG_PONG2PING(1), TPTAG_SDWN_ERROR(1),
+									  TAG_IF(connectionScaling, TPTAG_QUEUESIZE(queueSize)), TAG_END());
 		}
 		if (err == -1) {
 			LOGE("Could not enable transport %s: %s", uri.c_str(), strerror(errno));
@@ -394,6 +545,7 @@ void Agent::start(const std::string &transport_override, const std::string passp
 	if (mPreferredRouteV6)
 		url_e(prefUrl6, sizeof(prefUrl6), mPreferredRouteV6);
 	LOGD("Agent's preferred IP for internal routing: v4: %s v6: %s", prefUrl4, prefUrl6);
+	indexTransportHosts();
 	startLogWriter();
 }
 
@@ -415,6 +567,7 @@ Agent::Agent(su_root_t *root) : mBaseConfigListener(NULL), mTerminating(false) {
 	mModules.push_back(ModuleFactory::get()->createModuleInstance(this, "GatewayAdapter"));
 
 	mModules.push_back(ModuleFactory::get()->createModuleInstance(this, "Presence"));
+	mModules.push_back(ModuleFactory::get()->createModuleInstance(this, "RegEvent"));
 
 	mModules.push_back(ModuleFactory::get()->createModuleInstance(this, "Registrar"));
 	mModules.push_back(ModuleFactory::get()->createModuleInstance(this, "StatisticsCollector"));
@@ -441,36 +594,94 @@ Agent::Agent(su_root_t *root) : mBaseConfigListener(NULL), mTerminating(false) {
 
 	onDeclare(cr);
 
-	struct ifaddrs *net_addrs;
-	int err = getifaddrs(&net_addrs);
-	if (err == 0) {
-		struct ifaddrs *ifa = net_addrs;
-		while (ifa != NULL) {
-			if (ifa->ifa_netmask != NULL && ifa->ifa_addr != NULL) {
-				LOGD("New network: %s", Network::print(ifa).c_str());
-				mNetworks.push_front(Network(ifa));
-			}
-			ifa = ifa->ifa_next;
-		}
-		freeifaddrs(net_addrs);
-	} else {
-		LOGE("Can't find interface addresses: %s", strerror(err));
-	}
+	memset(&mNetworksMaskV4, 0, sizeof(mNetworksMaskV4));
+	memset(&mNetworksMaskV6, 0, sizeof(mNetworksMaskV6));
+	discoverInterfaces();
 	mRoot = root;
-	mAgent = nta_agent_create(root, (url_string_t *)-1, &Agent::messageCallback, (nta_agent_magic_t *)this, TAG_END());
+	GenericStruct *global = cr->get<GenericStruct>("global");
+	ConfigBooleanExpression *debugFilter = global->get<ConfigBooleanExpression>("debug-filter");
+	if (!debugFilter->get().empty())
+		mDebugFilter = debugFilter->read();
+	ConfigBooleanExpression *statelessForward = global->get<ConfigBooleanExpression>("stateless-forward");
+	if (!statelessForward->get().empty())
+		mStatelessForward = statelessForward->read();
+	mCountStatelessForwarded = global->get<StatCounter64>("count-stateless-forwarded");
+	mResolverCache = NULL;
+	if (global->get<ConfigBoolean>("dns-prefetch")->read()) {
+		mResolverCache = new ResolverCache(root, global->get<ConfigInt>("dns-prefetch-idle-time")->read(),
+										   global->get<ConfigInt>("dns-negative-ttl")->read());
+		mResolverCache->setStats(global->get<StatCounter64>("count-dns-cache-hits"),
+								 global->get<StatCounter64>("count-dns-cache-misses"),
+								 global->get<StatCounter64>("count-dns-prefetches"));
+	}
+	// the resolver of the SIP stack shares the cache kept warm by the prefetching
+	sres_cache_t *dnsCache = mResolverCache ? mResolverCache->getCache() : NULL;
+	mAgent = nta_agent_create(root, (url_string_t *)-1, &Agent::messageCallback, (nta_agent_magic_t *)this,
+							  TAG_IF(dnsCache != NULL, SRESTAG_CACHE(dnsCache)), TAG_END());
 	su_home_init(&mHome);
 	mPreferredRouteV4 = NULL;
 	mPreferredRouteV6 = NULL;
+	mTimers = new TimerService(root);
+	mOverloadControl = NULL;
+	if (global->get<ConfigBoolean>("overload-control")->read()) {
+		auto processor = [this](const shared_ptr<RequestSipEvent> &ev) { processRequestEvent(ev); };
+		mOverloadControl =
+			new OverloadControl(this, processor, global->get<ConfigInt>("overload-max-queue-delay")->read(),
+								(size_t)max(1, global->get<ConfigInt>("overload-max-queue-size")->read()));
+		StatCounter64 *rejected[OverloadControl::ClassCount] = {
+			NULL, global->get<StatCounter64>("count-overload-rejected-invite"),
+			global->get<StatCounter64>("count-overload-rejected-message"),
+			global->get<StatCounter64>("count-overload-rejected-register"),
+			global->get<StatCounter64>("count-overload-rejected-options")};
+		mOverloadControl->setStats(rejected, global->get<StatCounter64>("count-overload-queued-requests"));
+	}
+	mSaturation = new SaturationMonitor(root, global->get<ConfigInt>("saturation-max-delay")->read());
+	mSaturation->setStats(global->get<StatCounter64>("main-loop-busy-permille"),
+						  global->get<StatCounter64>("main-loop-lag-us"), global->get<StatCounter64>("headroom-permille"));
+	mHeaderCompactor = NULL;
+	list<string> compactTransports = global->get<ConfigStringList>("compact-headers")->read();
+	if (!compactTransports.empty()) {
+		mHeaderCompactor =
+			new HeaderCompactor(this, compactTransports, global->get<StatCounter64>("count-compacted-messages"),
+								global->get<StatCounter64>("compacted-saved-bytes"));
+	}
+	mBatchTimer = NULL;
+	if (global->get<ConfigBoolean>("batch-dispatch")->read()) {
+		mBatchTimer =
+			su_timer_create(su_root_task(root), max(0, global->get<ConfigInt>("batch-dispatch-max-delay")->read()));
+		mBatchSize = (size_t)max(1, global->get<ConfigInt>("batch-dispatch-size")->read());
+		mCountRequestBatches = global->get<StatCounter64>("count-request-batches");
+		mCountBatchedRequests = global->get<StatCounter64>("count-batched-requests");
+	}
+	mSweepTimer = NULL;
+	int sweepInterval = global->get<ConfigInt>("idle-sweep-interval")->read();
+	if (sweepInterval > 0) {
+		mSweepBudget = chrono::microseconds(max(1, global->get<ConfigInt>("idle-sweep-budget")->read()));
+		mSweepTimer = su_timer_create(su_root_task(root), sweepInterval);
+		su_timer_set_for_ever(mSweepTimer, &Agent::sOnSweepTimer, this);
+	}
 	mDrm = new DomainRegistrationManager(this);
+	mArm = new AccountRegistrationManager(this);
 }
 
 Agent::~Agent() {
 	mTerminating = true;
+	Tracer::get()->stop();
 	for_each(mModules.begin(), mModules.end(), delete_functor<Module>());
 	if (mDrm)
 		delete mDrm;
+	delete mArm;
+	delete mOverloadControl;
+	delete mHeaderCompactor;
+	delete mSaturation;
+	if (mBatchTimer)
+		su_timer_destroy(mBatchTimer);
+	if (mSweepTimer)
+		su_timer_destroy(mSweepTimer);
+	delete mTimers;
 	if (mAgent)
 		nta_agent_destroy(mAgent);
+	delete mResolverCache;
 	if (mHttpEngine)
 		nth_engine_destroy(mHttpEngine);
 	su_home_deinit(&mHome);
@@ -489,9 +700,42 @@ std::string Agent::getPreferredRoute() const {
 bool Agent::doOnConfigStateChanged(const ConfigValue &conf, ConfigState state) {
 	LOGD("Configuration of agent changed for key %s to %s", conf.getName().c_str(), conf.get().c_str());
 
-	if (conf.getName() == "aliases" && state == ConfigState::Commited) {
-		mAliases = ((ConfigStringList *)(&conf))->read();
-		LOGD("Global aliases updated");
+	if (conf.getName() == "aliases") {
+		if (state == ConfigState::Commited) {
+			mAliases = ((ConfigStringList *)(&conf))->read();
+			indexAliases();
+			LOGD("Global aliases updated");
+		}
+		return true;
+	}
+	if (conf.getName() == "debug-filter") {
+		try {
+			if (state == ConfigState::Check) {
+				if (!conf.getNextValue().empty())
+					BooleanExpression::parse(conf.getNextValue());
+			} else if (state == ConfigState::Commited) {
+				mDebugFilter = conf.get().empty() ? nullptr : ((ConfigBooleanExpression *)(&conf))->read();
+				LOGD("Debug filter updated");
+			}
+		} catch (exception &e) {
+			LOGE("Invalid debug-filter \"%s\": %s", conf.getNextValue().c_str(), e.what());
+			return false;
+		}
+		return true;
+	}
+	if (conf.getName() == "stateless-forward") {
+		try {
+			if (state == ConfigState::Check) {
+				if (!conf.getNextValue().empty())
+					BooleanExpression::parse(conf.getNextValue());
+			} else if (state == ConfigState::Commited) {
+				mStatelessForward = conf.get().empty() ? nullptr : ((ConfigBooleanExpression *)(&conf))->read();
+				LOGD("Stateless forward rule updated");
+			}
+		} catch (exception &e) {
+			LOGE("Invalid stateless-forward \"%s\": %s", conf.getNextValue().c_str(), e.what());
+			return false;
+		}
 		return true;
 	}
 
@@ -505,23 +749,94 @@ void Agent::loadConfig(GenericManager *cm) {
 	}
 	cm->getRoot()->get<GenericStruct>("global")->setConfigListener(this);
 	mAliases = cm->getGlobal()->get<ConfigStringList>("aliases")->read();
+	indexAliases();
 	LOGD("List of host aliases:");
 	for (list<string>::iterator it = mAliases.begin(); it != mAliases.end(); ++it) {
 		LOGD("%s", (*it).c_str());
 	}
 
-	RegistrarDb::initialize(this);
+	Tracer::get()->start(cm->getGlobal()->get<ConfigInt>("trace-sample-rate")->read(),
+						 cm->getGlobal()->get<ConfigString>("trace-file")->read());
+	Profiler::get()->configure(cm->getGlobal()->get<ConfigString>("profiler-dir")->read(),
+							   cm->getGlobal()->get<ConfigInt>("profiler-frequency")->read());
+	TenantStats::get()->configure(cm->getGlobal()->get<ConfigInt>("tenant-stats-max-domains")->read());
+	Startup::get()->step("registrar database", [this]() { RegistrarDb::initialize(this); });
 
 	list<Module *>::iterator it;
 	for (it = mModules.begin(); it != mModules.end(); ++it) {
-		// Check in all cases, even if not enabled,
-		// to allow safe dynamic activation of the module
-		(*it)->checkConfig();
-		(*it)->load();
+		Module *module = *it;
+		Startup::get()->step("module::" + module->getModuleName(), [module]() {
+			// Check in all cases, even if not enabled,
+			// to allow safe dynamic activation of the module
+			module->checkConfig();
+			module->load();
+		});
 	}
+	updateDispatchTables();
 	if (mDrm)
-		mDrm->load(mPassphrase);
+		Startup::get()->step("domain registrations", [this]() { mDrm->load(mPassphrase); });
 		mPassphrase = "";
+	Startup::get()->step("account registrations", [this]() { mArm->load(); });
+	// the domain registrations may have added transports
+	indexTransportHosts();
+}
+
+/*
+ * Works out once which modules the requests of each method and the responses may enter, so that the others are not
+ * even asked for each message.
+ */
+void Agent::updateDispatchTables() {
+	// the modules guarding the proxy, which keep no state about the requests they let through
+	static const set<string> statelessModules = {"SanityChecker", "DoSProtection", "GarbageIn", "NatHelper", "Forward"};
+	mRequestModules.assign(sip_method_publish + 1, list<Module *>());
+	mStatelessRequestModules.assign(sip_method_publish + 1, list<Module *>());
+	mResponseModules.clear();
+	for (int method = sip_method_unknown; method <= sip_method_publish; ++method) {
+		// the unknown methods have no name: their table only holds the modules the filter of which ignores the method
+		string name = (method == sip_method_unknown) ? "" : sip_method_name((sip_method_t)method, "");
+		for (auto module : mModules) {
+			if (!module->mayProcess(true, name))
+				continue;
+			mRequestModules[method].push_back(module);
+			if (statelessModules.count(module->getModuleName()))
+				mStatelessRequestModules[method].push_back(module);
+		}
+	}
+	for (auto module : mModules) {
+		if (module->mayProcess(false, ""))
+			mResponseModules.push_back(module);
+	}
+	for (int method = sip_method_unknown + 1; method <= sip_method_publish; ++method) {
+		SLOGD << "Modules for " << sip_method_name((sip_method_t)method, "") << " requests: "
+			  << mRequestModules[method].size() << "/" << mModules.size();
+	}
+}
+
+list<Module *> &Agent::getRequestModules(const shared_ptr<RequestSipEvent> &ev) {
+	if (mRequestModules.empty())
+		return mModules;
+	int method = ev->getMsgSip()->getSip()->sip_request->rq_method;
+	if (method < sip_method_unknown || method >= (int)mRequestModules.size())
+		method = sip_method_unknown;
+	return ev->mStateless ? mStatelessRequestModules[method] : mRequestModules[method];
+}
+
+/*
+ * Decides once, when a request arrives, whether it skips the modules keeping a state about it, such as the
+ * authentication and the media relay creating transactions, or the router creating fork contexts.
+ */
+void Agent::checkStatelessForward(const shared_ptr<RequestSipEvent> &ev) {
+	if (!mStatelessForward)
+		return;
+	try {
+		ev->mStateless = mStatelessForward->eval(ev->getMsgSip()->getSipAttr());
+	} catch (FlexisipException &e) {
+		// the attribute is missing from the message
+	} catch (invalid_argument &e) {
+		LOGE("Cannot evaluate stateless-forward: %s", e.what());
+	}
+	if (ev->mStateless)
+		++*mCountStatelessForwarded;
 }
 
 void Agent::unloadConfig() {
@@ -560,10 +875,66 @@ std::string Agent::computeResolvedPublicIp(const std::string &host) const {
 	return dest;
 }
 
+void Agent::discoverInterfaces() {
+	struct ifaddrs *net_addrs;
+	if (getifaddrs(&net_addrs) != 0) {
+		LOGE("Can't find interface addresses: %s", strerror(errno));
+		return;
+	}
+	list<Network> networks;
+	list<string> descriptions;
+	for (struct ifaddrs *ifa = net_addrs; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_netmask != NULL && ifa->ifa_addr != NULL &&
+			(ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6)) {
+			networks.push_front(Network(ifa));
+			descriptions.push_back(Network::print(ifa));
+		}
+	}
+	freeifaddrs(net_addrs);
+	if (networks == mNetworks)
+		return;
+
+	if (!mNetworks.empty())
+		LOGI("The network interfaces changed, forgetting the preferred IPs");
+	for (const string &description : descriptions)
+		LOGD("New network: %s", description.c_str());
+	mNetworks = networks;
+	memset(&mNetworksMaskV4, 0, sizeof(mNetworksMaskV4));
+	memset(&mNetworksMaskV6, 0, sizeof(mNetworksMaskV6));
+	for (const Network &network : mNetworks)
+		network.addMaskTo(mNetworksMaskV4, mNetworksMaskV6);
+	mPreferredIps.clear();
+}
+
 std::pair<std::string, std::string> Agent::getPreferredIp(const std::string &destination) const {
+	static const size_t sMaxPreferredIps = 10000;
+	string dest = (destination[0] == '[') ? destination.substr(1, destination.size() - 2) : destination;
+	// two addresses equal under the union of the netmasks are in the same networks
+	string key;
+	struct in_addr v4;
+	struct in6_addr v6;
+	if (inet_pton(AF_INET, dest.c_str(), &v4) == 1) {
+		v4.s_addr &= mNetworksMaskV4.s_addr;
+		key.assign((const char *)&v4, sizeof(v4));
+	} else if (inet_pton(AF_INET6, dest.c_str(), &v6) == 1) {
+		for (size_t i = 0; i < sizeof(v6.s6_addr); ++i)
+			v6.s6_addr[i] &= mNetworksMaskV6.s6_addr[i];
+		key.assign((const char *)&v6, sizeof(v6));
+	}
+	if (key.empty())
+		return computePreferredIp(dest);
+
+	auto it = mPreferredIps.find(key);
+	if (it != mPreferredIps.end())
+		return it->second;
+	if (mPreferredIps.size() >= sMaxPreferredIps)
+		mPreferredIps.clear();
+	return mPreferredIps[key] = computePreferredIp(dest);
+}
+
+std::pair<std::string, std::string> Agent::computePreferredIp(const std::string &dest) const {
 	int err;
 	struct addrinfo hints;
-	string dest = (destination[0] == '[') ? destination.substr(1, destination.size() - 2) : destination;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_flags = AI_NUMERICHOST;
@@ -631,6 +1002,21 @@ const string Agent::Network::getIP() const {
 	return mIP;
 }
 
+void Agent::Network::addMaskTo(struct in_addr &maskV4, struct in6_addr &maskV6) const {
+	if (mPrefix.ss_family == AF_INET) {
+		maskV4.s_addr |= ((const struct sockaddr_in *)&mMask)->sin_addr.s_addr;
+	} else if (mPrefix.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *mask = (const struct sockaddr_in6 *)&mMask;
+		for (size_t i = 0; i < sizeof(maskV6.s6_addr); ++i)
+			maskV6.s6_addr[i] |= mask->sin6_addr.s6_addr[i];
+	}
+}
+
+bool Agent::Network::operator==(const Network &other) const {
+	return mIP == other.mIP && memcmp(&mPrefix, &other.mPrefix, sizeof(mPrefix)) == 0 &&
+		   memcmp(&mMask, &other.mMask, sizeof(mMask)) == 0;
+}
+
 bool Agent::Network::isInNetwork(const struct sockaddr *addr) const {
 	if (addr->sa_family != mPrefix.ss_family) {
 		return false;
@@ -697,45 +1083,62 @@ int Agent::countUsInVia(sip_via_t *via) const {
 	return count;
 }
 
-bool Agent::isUs(const char *host, const char *port, bool check_aliases) const {
-	char *tmp = NULL;
-	size_t end;
-	tport_t *tport = tport_primaries(nta_agent_tports(mAgent));
-
-	// skip possibly trailing '.' at the end of host
-	if (host[end = (strlen(host) - 1)] == '.') {
-		tmp = (char *)alloca(end + 1);
-		memcpy(tmp, host, end);
-		tmp[end] = '\0';
-		host = tmp;
-	}
-	const char *matched_port = port;
-
-	if (check_aliases) {
-		/*the checking of aliases ignores the port number, since a domain name in a Route header might resolve to
-		 * multiple ports
-			* thanks to SRV records*/
-		list<string>::const_iterator it;
-		for (it = mAliases.begin(); it != mAliases.end(); ++it) {
-			if (ModuleToolbox::urlHostMatch(host, (*it).c_str()))
-				return true;
-		}
+/*
+ * Host as compared by isUs(): lower case without the trailing '.', and IPv6 addresses without brackets in their
+ * canonical text form, as they have several representations.
+ */
+string Agent::normalizeHost(const char *host) {
+	size_t len = strlen(host);
+	if (len > 0 && host[len - 1] == '.')
+		--len;
+	if (len > 2 && host[0] == '[' && host[len - 1] == ']') {
+		++host;
+		len -= 2;
 	}
+	string normalized(host, len);
+	if (normalized.find(':') != string::npos) {
+		struct in6_addr addr;
+		char canonical[INET6_ADDRSTRLEN];
+		if (inet_pton(AF_INET6, normalized.c_str(), &addr) == 1 &&
+			inet_ntop(AF_INET6, &addr, canonical, sizeof(canonical)) != NULL)
+			return canonical;
+	}
+	transform(normalized.begin(), normalized.end(), normalized.begin(), ::tolower);
+	return normalized;
+}
 
-	for (; tport != NULL; tport = tport_next(tport)) {
+void Agent::indexAliases() {
+	mAliasHosts.clear();
+	for (const auto &alias : mAliases)
+		mAliasHosts.insert(normalizeHost(alias.c_str()));
+}
+
+/* The transports are the primaries of the agent, created by start() and by the domain registrations. */
+void Agent::indexTransportHosts() {
+	mTransportHosts.clear();
+	for (tport_t *tport = tport_primaries(nta_agent_tports(mAgent)); tport != NULL; tport = tport_next(tport)) {
 		const tp_name_t *tn = tport_name(tport);
-		if (port == NULL) {
-			if (strcasecmp(tn->tpn_proto, "tls") == 0)
-				matched_port = "5061";
-			else
-				matched_port = "5060";
-		}
-		if (strcmp(matched_port, tn->tpn_port) == 0) {
-			if (ModuleToolbox::urlHostMatch(host, tn->tpn_canon) || ModuleToolbox::urlHostMatch(host, tn->tpn_host))
-				return true;
+		const char *defaultPort = strcasecmp(tn->tpn_proto, "tls") == 0 ? "5061" : "5060";
+		bool onDefaultPort = strcmp(tn->tpn_port, defaultPort) == 0;
+		for (const char *host : {tn->tpn_canon, tn->tpn_host}) {
+			string normalized = normalizeHost(host);
+			mTransportHosts.insert(normalized + ":" + tn->tpn_port);
+			if (onDefaultPort)
+				mTransportHosts.insert(normalized + ":");
 		}
 	}
-	return false;
+}
+
+bool Agent::isUs(const char *host, const char *port, bool check_aliases) const {
+	string normalized = normalizeHost(host);
+	/*the checking of aliases ignores the port number, since a domain name in a Route header might resolve to
+	 * multiple ports thanks to SRV records*/
+	if (check_aliases && mAliasHosts.find(normalized) != mAliasHosts.end())
+		return true;
+	normalized += ':';
+	if (port)
+		normalized += port;
+	return mTransportHosts.find(normalized) != mTransportHosts.end();
 }
 
 sip_via_t *Agent::getNextVia(sip_t *response) {
@@ -771,6 +1174,11 @@ void Agent::logEvent(const shared_ptr<SipEvent> &ev) {
 	}
 }
 
+void Agent::logEvents(const vector<shared_ptr<EventLog>> &evlogs) {
+	if (mLogWriter && !evlogs.empty())
+		mLogWriter->writeBatch(evlogs);
+}
+
 struct ModuleHasName {
 	ModuleHasName(const string &ref) : match(ref) {
 	}
@@ -785,7 +1193,7 @@ Module *Agent::findModule(const string &modname) const {
 }
 
 template <typename SipEventT>
-inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, const list<Module *>::iterator &begin,
+inline void Agent::doSendEvent(shared_ptr<SipEventT> &ev, const list<Module *>::iterator &begin,
 							   const list<Module *>::iterator &end) {
 #define LOG_SCOPED_EV_THREAD(ssargs, key) LOG_SCOPED_THREAD(key, ssargs->getOrEmpty(key));
 
@@ -797,9 +1205,11 @@ inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, const list<Module *>::i
 	LOG_SCOPED_EV_THREAD(ssargs, "method_or_status");
 	LOG_SCOPED_EV_THREAD(ssargs, "callid");
 
+	// a single read of the clock per module, the end of one being the start of the next
+	auto now = chrono::steady_clock::now();
 	for (auto it = begin; it != end; ++it) {
 		ev->mCurrModule = (*it);
-		(*it)->process(ev);
+		(*it)->process(ev, now);
 		if (ev->isTerminated() || ev->isSuspended())
 			break;
 	}
@@ -808,7 +1218,7 @@ inline void Agent::doSendEvent(shared_ptr<SipEventT> ev, const list<Module *>::i
 	}
 }
 
-void Agent::sendRequestEvent(shared_ptr<RequestSipEvent> ev) {
+void Agent::countIncomingRequest(const shared_ptr<RequestSipEvent> &ev) {
 	sip_t *sip = ev->getMsgSip()->getSip();
 	const sip_request_t *req = sip->sip_request;
 	const url_t *from_url = sip->sip_from ? sip->sip_from->a_url : NULL;
@@ -849,11 +1259,82 @@ void Agent::sendRequestEvent(shared_ptr<RequestSipEvent> ev) {
 			}
 			break;
 	}
+}
+
+void Agent::sendRequestEvent(shared_ptr<RequestSipEvent> ev) {
+	flexisip::log::DebugScope debugScope(ev->isDebugForced());
+	countIncomingRequest(ev);
+	checkStatelessForward(ev);
+	auto &modules = getRequestModules(ev);
+	doSendEvent(ev, modules.begin(), modules.end());
+}
+
+/*
+ * Processes the batch module by module rather than request by request, so that the work of a module is done for all
+ * the requests at once, such as the fetches of the registrar sent together to Redis. The requests going through the
+ * same table of modules are grouped, and go through each module in their order of arrival.
+ */
+void Agent::sendRequestBatch() {
+	su_timer_reset(mBatchTimer);
+	vector<shared_ptr<RequestSipEvent>> batch;
+	batch.swap(mRequestBatch);
+	++*mCountRequestBatches;
+	mCountBatchedRequests->set(mCountBatchedRequests->read() + batch.size());
+
+	vector<pair<list<Module *> *, vector<size_t>>> groups;
+	for (size_t i = 0; i < batch.size(); ++i) {
+		flexisip::log::DebugScope debugScope(batch[i]->isDebugForced());
+		countIncomingRequest(batch[i]);
+		checkStatelessForward(batch[i]);
+		list<Module *> *modules = &getRequestModules(batch[i]);
+		auto group = find_if(groups.begin(), groups.end(),
+							 [modules](const pair<list<Module *> *, vector<size_t>> &g) { return g.first == modules; });
+		if (group == groups.end()) {
+			groups.emplace_back(modules, vector<size_t>());
+			group = groups.end() - 1;
+		}
+		group->second.push_back(i);
+	}
+
+	vector<uint64_t> allocations(mCountAllocationsResponse ? batch.size() : 0, 0);
+	auto now = chrono::steady_clock::now();
+	for (auto &group : groups) {
+		size_t pending = group.second.size();
+		for (auto it = group.first->begin(); it != group.first->end() && pending > 0; ++it) {
+			for (size_t i : group.second) {
+				auto &ev = batch[i];
+				if (ev->isTerminated() || ev->isSuspended())
+					continue;
+				flexisip::log::DebugScope debugScope(ev->isDebugForced());
+				uint64_t before = allocations.empty() ? 0 : AllocationCounter::get();
+				ev->mCurrModule = (*it);
+				(*it)->process(ev, now);
+				if (!allocations.empty())
+					allocations[i] += AllocationCounter::get() - before;
+				if (ev->isTerminated() || ev->isSuspended())
+					--pending;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < batch.size(); ++i) {
+		if (!batch[i]->isTerminated() && !batch[i]->isSuspended()) {
+			LOGA("Event not handled");
+		}
+		if (allocations.empty())
+			continue;
+		size_t method = (size_t)batch[i]->getMsgSip()->getSip()->sip_request->rq_method;
+		StatCounter64 *counter = mCountAllocationsRequest[method < mCountAllocationsRequest.size() ? method : 0];
+		counter->set(counter->read() + allocations[i]);
+	}
+}
 
-	doSendEvent(ev, mModules.begin(), mModules.end());
+void Agent::sOnBatchTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<Agent *>(arg)->sendRequestBatch();
 }
 
 void Agent::sendResponseEvent(shared_ptr<ResponseSipEvent> ev) {
+	flexisip::log::DebugScope debugScope(ev->isDebugForced());
 	SLOGD << "Receiving new Response SIP message: " << ev->getMsgSip()->getSip()->sip_status->st_status << "\n"
 		  << *ev->getMsgSip();
 
@@ -903,36 +1384,53 @@ void Agent::sendResponseEvent(shared_ptr<ResponseSipEvent> ev) {
 			break;
 	}
 
-	doSendEvent(ev, mModules.begin(), mModules.end());
+	doSendEvent(ev, mResponseModules.empty() ? mModules.begin() : mResponseModules.begin(),
+				mResponseModules.empty() ? mModules.end() : mResponseModules.end());
+}
+
+/*
+ * Resumes the processing after the module that suspended it, with the modules of the table the event went through.
+ * The table may no longer hold that module if it was updated since, in which case all of them are gone through.
+ */
+template <typename SipEventT> void Agent::doInjectEvent(shared_ptr<SipEventT> &ev, list<Module *> &modules) {
+	list<Module *> *chain = &modules;
+	auto it = find(chain->begin(), chain->end(), ev->mCurrModule);
+	if (it == chain->end()) {
+		chain = &mModules;
+		it = find(chain->begin(), chain->end(), ev->mCurrModule);
+	}
+	if (it != chain->end())
+		++it;
+	doSendEvent(ev, it, chain->end());
 }
 
 void Agent::injectRequestEvent(shared_ptr<RequestSipEvent> ev) {
+	flexisip::log::DebugScope debugScope(ev->isDebugForced());
 	SLOGD << "Inject Request SIP message:\n" << *ev->getMsgSip();
 	ev->restartProcessing();
 	SLOGD << "Injecting request event after " << ev->mCurrModule->getModuleName();
-	list<Module *>::iterator it;
-	for (it = mModules.begin(); it != mModules.end(); ++it) {
-		if (ev->mCurrModule == *it) {
-			++it;
-			break;
-		}
-	}
-	doSendEvent(ev, it, mModules.end());
+	doInjectEvent(ev, getRequestModules(ev));
 }
 
 void Agent::injectResponseEvent(shared_ptr<ResponseSipEvent> ev) {
+	flexisip::log::DebugScope debugScope(ev->isDebugForced());
 	SLOGD << "Inject Response SIP message:\n" << *ev->getMsgSip();
-	list<Module *>::iterator it;
 	ev->restartProcessing();
 	SLOGD << "Injecting response event after " << ev->mCurrModule->getModuleName();
-	for (it = mModules.begin(); it != mModules.end(); ++it) {
-		if (ev->mCurrModule == *it) {
-			++it;
-			break;
-		}
-	}
+	doInjectEvent(ev, mResponseModules.empty() ? mModules : mResponseModules);
+}
 
-	doSendEvent(ev, it, mModules.end());
+bool Agent::matchesDebugFilter(const shared_ptr<MsgSip> &ms) const {
+	if (!mDebugFilter)
+		return false;
+	try {
+		return mDebugFilter->eval(ms->getSipAttr());
+	} catch (FlexisipException &e) {
+		return false; // the attribute is missing from the message
+	} catch (invalid_argument &e) {
+		LOGE("Cannot evaluate debug-filter: %s", e.what());
+		return false;
+	}
 }
 
 /**
@@ -954,19 +1452,63 @@ int Agent::onIncomingMessage(msg_t *msg, const sip_t *sip) {
 		LOGI("Skipping incoming message on expired agent");
 		return -1;
 	}
+	if (!sip->sip_request && !sip->sip_status) {
+		LOGD("Dropping incoming message %p without start line", msg);
+		msg_destroy(msg);
+		return 0;
+	}
+	if (mIncomingMessageFilter && !mIncomingMessageFilter(msg, sip)) {
+		msg_destroy(msg);
+		return 0;
+	}
+	uint64_t allocations = AllocationCounter::get();
 	// Assuming sip is derived from msg
-	shared_ptr<MsgSip> ms = make_shared<MsgSip>(msg);
+	shared_ptr<MsgSip> ms = allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
+	Tenant *tenant = sip->sip_from ? TenantStats::get()->find(sip->sip_from->a_url->url_host) : NULL;
+	if (tenant) {
+		ms->setTenant(tenant);
+		tenant->count(tenant->messages);
+	}
 	if (sip->sip_request) {
-		auto ev = make_shared<RequestSipEvent>(shared_from_this(), ms, getIncomingTport(msg, this));
-		sendRequestEvent(ev);
+		ms->setTrace(Tracer::get()->sample(sip->sip_request->rq_method_name));
+		if (ms->getTrace())
+			ms->getTrace()->addEvent("received");
+		auto ev = allocate_shared<RequestSipEvent>(PoolAllocator<RequestSipEvent>(), shared_from_this(), ms,
+												   getIncomingTport(msg, this));
+		if (mOverloadControl)
+			mOverloadControl->push(ev);
+		else
+			processRequestEvent(ev);
 	} else {
-		auto ev = make_shared<ResponseSipEvent>(shared_from_this(), ms);
+		auto ev = allocate_shared<ResponseSipEvent>(PoolAllocator<ResponseSipEvent>(), shared_from_this(), ms);
 		sendResponseEvent(ev);
+		if (mCountAllocationsResponse) {
+			mCountAllocationsResponse->set(mCountAllocationsResponse->read() + AllocationCounter::get() -
+										   allocations);
+		}
 	}
 	msg_destroy(msg);
 	return 0;
 }
 
+void Agent::processRequestEvent(const shared_ptr<RequestSipEvent> &ev) {
+	if (mBatchTimer) {
+		mRequestBatch.push_back(ev);
+		if (mRequestBatch.size() >= mBatchSize)
+			sendRequestBatch();
+		else if (mRequestBatch.size() == 1)
+			su_timer_set(mBatchTimer, &Agent::sOnBatchTimer, this);
+		return;
+	}
+	uint64_t allocations = AllocationCounter::get();
+	sendRequestEvent(ev);
+	if (!mCountAllocationsResponse)
+		return;
+	size_t method = (size_t)ev->getMsgSip()->getSip()->sip_request->rq_method;
+	StatCounter64 *counter = mCountAllocationsRequest[method < mCountAllocationsRequest.size() ? method : 0];
+	counter->set(counter->read() + AllocationCounter::get() - allocations);
+}
+
 int Agent::messageCallback(nta_agent_magic_t *context, nta_agent_t *agent, msg_t *msg, sip_t *sip) {
 	Agent *a = (Agent *)context;
 	return a->onIncomingMessage(msg, sip);
@@ -974,11 +1516,36 @@ int Agent::messageCallback(nta_agent_magic_t *context, nta_agent_t *agent, msg_t
 
 void Agent::idle() {
 	for_each(mModules.begin(), mModules.end(), mem_fun(&Module::idle));
+	discoverInterfaces();
+	for (int type = 0; type < ObjectCounter::TypeCount; ++type)
+		mCountLiveObjects[type]->set(ObjectCounter::get((ObjectCounter::Type)type));
+	HeapStats heap;
+	if (mHeapAllocated && heap.read()) {
+		mHeapAllocated->set(heap.allocated);
+		mHeapActive->set(heap.active);
+		mHeapResident->set(heap.resident);
+	}
 	if (GenericManager::get()->mNeedRestart) {
 		exit(RESTART_EXIT_CODE);
 	}
 }
 
+void Agent::sOnSweepTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	Agent *zis = static_cast<Agent *>(arg);
+	for (auto module : zis->mModules)
+		module->sweep(zis->mSweepBudget);
+}
+
+int Agent::sOnPrescan(void *arg, const char *data, size_t size) {
+	Agent *zis = static_cast<Agent *>(arg);
+	const char *reason = SipPrescan::check(data, size, zis->mPrescanLimits);
+	if (!reason)
+		return 0;
+	++*zis->mCountPrescanRejected;
+	LOGD("Dropping a datagram of %zu bytes before parsing: %s", size, reason);
+	return -1;
+}
+
 const string &Agent::getUniqueId() const {
 	return mUniqueId;
 }
@@ -994,6 +1561,8 @@ void Agent::stopTimer(su_timer_t *t) {
 }
 
 void Agent::send(const shared_ptr<MsgSip> &ms, url_string_t const *u, tag_type_t tag, tag_value_t value, ...) {
+	if (mOutgoingMessageFilter && !mOutgoingMessageFilter(ms))
+		return;
 	ta_list ta;
 	ta_start(ta, tag, value);
 	msg_t *msg = msg_ref_create(ms->getMsg());
@@ -1047,6 +1616,8 @@ void Agent::incrReplyStat(int status) {
 void Agent::reply(const shared_ptr<MsgSip> &ms, int status, char const *phrase, tag_type_t tag, tag_value_t value,
 				  ...) {
 	incrReplyStat(status);
+	if (mOutgoingMessageFilter && !mOutgoingMessageFilter(ms))
+		return;
 	ta_list ta;
 	ta_start(ta, tag, value);
 	msg_t *msg = msg_ref_create(ms->getMsg());
@@ -19,9 +19,16 @@
 #ifndef agent_hh
 #define agent_hh
 
+#include <chrono>
 #include <string>
 #include <sstream>
 #include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <netinet/in.h>
 
 #include <sofia-sip/sip.h>
 #include <sofia-sip/sip_protos.h>
@@ -36,10 +43,18 @@
 #include "configmanager.hh"
 #include "event.hh"
 #include "transaction.hh"
+#include "timerservice.hh"
+#include "resolvercache.hh"
+#include "overloadcontrol.hh"
+#include "header-compactor.hh"
+#include "saturation.hh"
+#include "utils/memorystats.hh"
+#include "utils/sipprescan.hh"
 #include "eventlogs/eventlogs.hh"
 
 class Module;
 class DomainRegistrationManager;
+class AccountRegistrationManager;
 
 /**
  * The agent class represents a SIP agent.
@@ -99,13 +114,33 @@ class Agent : public IncomingAgent,
 	StatCounter64 *mCountReply407; // proxy auth
 	StatCounter64 *mCountReply408; // request timeout
 	StatCounter64 *mCountReplyResUnknown;
+	// heap allocations made while processing the incoming messages, only counted when built with ENABLE_ALLOC_STATS
+	std::vector<StatCounter64 *> mCountAllocationsRequest; // indexed by sip_method_t
+	StatCounter64 *mCountAllocationsResponse;
+	StatCounter64 *mCountPrescanRejected; // datagrams dropped before parsing, see prescan-datagrams
+	// refreshed by idle()
+	StatCounter64 *mCountLiveObjects[ObjectCounter::TypeCount];
+	StatCounter64 *mHeapAllocated; // NULL unless built with jemalloc
+	StatCounter64 *mHeapActive;
+	StatCounter64 *mHeapResident;
 	void onDeclare(GenericStruct *root);
 	ConfigValueListener *mBaseConfigListener;
 
   private:
+	/* The event is referenced, not copied: the caller holds it until the end of the processing by the modules. */
 	template <typename SipEventT>
-	void doSendEvent(std::shared_ptr<SipEventT> ev, const std::list<Module *>::iterator &begin,
+	void doSendEvent(std::shared_ptr<SipEventT> &ev, const std::list<Module *>::iterator &begin,
 					 const std::list<Module *>::iterator &end);
+	template <typename SipEventT>
+	void doInjectEvent(std::shared_ptr<SipEventT> &ev, std::list<Module *> &modules);
+	void updateDispatchTables();
+	std::list<Module *> &getRequestModules(const std::shared_ptr<RequestSipEvent> &ev);
+	void checkStatelessForward(const std::shared_ptr<RequestSipEvent> &ev);
+	void countIncomingRequest(const std::shared_ptr<RequestSipEvent> &ev);
+	void sendRequestBatch();
+	static void sOnBatchTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	static void sOnSweepTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	static int sOnPrescan(void *arg, const char *data, size_t size);
 
   public:
 	Agent(su_root_t *root);
@@ -175,18 +210,51 @@ class Agent : public IncomingAgent,
 	void injectRequestEvent(std::shared_ptr<RequestSipEvent> ev);
 	void injectResponseEvent(std::shared_ptr<ResponseSipEvent> ev);
 	void sendRequestEvent(std::shared_ptr<RequestSipEvent> ev);
+	/* Processes an incoming request, after the admission control if enabled. */
+	void processRequestEvent(const std::shared_ptr<RequestSipEvent> &ev);
 	void sendResponseEvent(std::shared_ptr<ResponseSipEvent> ev);
 	void incrReplyStat(int status);
 	bool doOnConfigStateChanged(const ConfigValue &conf, ConfigState state);
 	void logEvent(const std::shared_ptr<SipEvent> &ev);
+	/* Writes events completed outside of the processing of a SipEvent. */
+	void logEvents(const std::vector<std::shared_ptr<EventLog>> &evlogs);
 	Module *findModule(const std::string &modname) const;
 	int onIncomingMessage(msg_t *msg, const sip_t *sip);
+	/* Checks the incoming messages before any event is created for them; those it returns false for are dropped. */
+	typedef std::function<bool(msg_t *msg, const sip_t *sip)> IncomingMessageFilter;
+	void setIncomingMessageFilter(const IncomingMessageFilter &filter) {
+		mIncomingMessageFilter = filter;
+	}
+	/* Checks the messages sent statelessly or by new outgoing transactions, and the requests replied statelessly;
+	 * those it returns false for are not given to the transports. */
+	typedef std::function<bool(const std::shared_ptr<MsgSip> &ms)> OutgoingMessageFilter;
+	void setOutgoingMessageFilter(const OutgoingMessageFilter &filter) {
+		mOutgoingMessageFilter = filter;
+	}
 	nth_engine_t *getHttpEngine() {
 		return mHttpEngine;
 	}
+	/* Coarse timers for the contexts that may wait for long, rather than one su_timer each. */
+	TimerService *getTimers() {
+		return mTimers;
+	}
 	DomainRegistrationManager *getDRM() {
 		return mDrm;
 	}
+	/* NULL unless dns-prefetch is enabled. */
+	ResolverCache *getResolverCache() {
+		return mResolverCache;
+	}
+	/* NULL unless compact-headers is set. */
+	HeaderCompactor *getHeaderCompactor() {
+		return mHeaderCompactor;
+	}
+	/* Where the modules report the load of the resources they use. */
+	SaturationMonitor *getSaturation() {
+		return mSaturation;
+	}
+	/* Whether the processing of a message is to be logged at the debug level, whatever the log level. */
+	bool matchesDebugFilter(const std::shared_ptr<MsgSip> &ms) const;
 
   private:
 	virtual void send(const std::shared_ptr<MsgSip> &msg, url_string_t const *u, tag_type_t tag, tag_value_t value,
@@ -196,10 +264,27 @@ class Agent : public IncomingAgent,
 	void discoverInterfaces();
 	void startLogWriter();
 	std::string computeResolvedPublicIp(const std::string &host) const;
+	std::pair<std::string, std::string> computePreferredIp(const std::string &dest) const;
 	void checkAllowedParams(const url_t *uri);
+	static std::string normalizeHost(const char *host);
+	void indexAliases();
+	void indexTransportHosts();
 	std::string mServerString;
 	std::list<Module *> mModules;
+	// modules that requests of each method (indexed by sip_method_t from sip_method_unknown) or responses may enter,
+	// in the order of mModules
+	std::vector<std::list<Module *>> mRequestModules;
+	// the same restricted to the checks and the Forward module, for the requests matching stateless-forward
+	std::vector<std::list<Module *>> mStatelessRequestModules;
+	std::list<Module *> mResponseModules;
+	IncomingMessageFilter mIncomingMessageFilter;
+	SipPrescan::Limits mPrescanLimits;
+	OutgoingMessageFilter mOutgoingMessageFilter;
 	std::list<std::string> mAliases;
+	// normalized by normalizeHost(), so that isUs() is a hash lookup: the aliases whatever the port, and the transports
+	// as "<host>:<port>", or "<host>:" when listening on the default port of their protocol
+	std::unordered_set<std::string> mAliasHosts;
+	std::unordered_set<std::string> mTransportHosts;
 	url_t *mPreferredRouteV4;
 	url_t *mPreferredRouteV6;
 	const url_t *mNodeUri = NULL;
@@ -215,9 +300,17 @@ class Agent : public IncomingAgent,
 		Network(const struct ifaddrs *ifaddr);
 		bool isInNetwork(const struct sockaddr *addr) const;
 		const std::string getIP() const;
+		/* Adds the bits of the mask of the network to those of its family. */
+		void addMaskTo(struct in_addr &maskV4, struct in6_addr &maskV6) const;
+		bool operator==(const Network &other) const;
 		static std::string print(const struct ifaddrs *ifaddr);
 	};
 	std::list<Network> mNetworks;
+	// decisions of getPreferredIp(), keyed on the destination address masked by all the netmasks of its family, so that
+	// the destinations of a same network share theirs; cleared by discoverInterfaces() when the networks change
+	mutable std::unordered_map<std::string, std::pair<std::string, std::string>> mPreferredIps;
+	struct in_addr mNetworksMaskV4;
+	struct in6_addr mNetworksMaskV6;
 	std::string mUniqueId;
 	std::string mRtpBindIp, mRtpBindIp6, mPublicIpV4, mPublicIpV6, mPublicResolvedIpV4, mPublicResolvedIpV6;
 	nta_agent_t *mAgent;
@@ -226,6 +319,23 @@ class Agent : public IncomingAgent,
 	su_home_t mHome;
 	EventLogWriter *mLogWriter;
 	DomainRegistrationManager *mDrm;
+	AccountRegistrationManager *mArm;
+	TimerService *mTimers;
+	ResolverCache *mResolverCache;
+	OverloadControl *mOverloadControl; // NULL unless overload-control is enabled
+	HeaderCompactor *mHeaderCompactor; // NULL unless compact-headers is set
+	SaturationMonitor *mSaturation;
+	// requests waiting for their dispatch by batch, see batch-dispatch
+	std::vector<std::shared_ptr<RequestSipEvent>> mRequestBatch;
+	su_timer_t *mBatchTimer; // NULL unless batch-dispatch is enabled
+	size_t mBatchSize;
+	StatCounter64 *mCountRequestBatches;
+	StatCounter64 *mCountBatchedRequests;
+	su_timer_t *mSweepTimer; // NULL unless idle-sweep-interval is set
+	std::chrono::microseconds mSweepBudget;
+	std::shared_ptr<BooleanExpression> mDebugFilter; // NULL unless debug-filter is set
+	std::shared_ptr<BooleanExpression> mStatelessForward; // NULL unless stateless-forward is set
+	StatCounter64 *mCountStatelessForwarded;
 	std::string mPassphrase;
 	static int messageCallback(nta_agent_magic_t *context, nta_agent_t *agent, msg_t *msg, sip_t *sip);
 	bool mTerminating;
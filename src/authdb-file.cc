@@ -19,29 +19,273 @@
 #define SU_MSG_ARG_T struct auth_splugin_t
 
 #include "authdb.hh"
-#include <iostream>
-#include <fstream>
-#include <sstream>
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-FileAuthDb::FileAuthDb() {
+/* Fields of a line of the file, pointing into the mapping. */
+struct FileAccount {
+	string user;
+	string domain;
+	string password;
+	string userid;
+	string phone;
+};
+
+/* Parses the line as the former stream-based reader did, false if it is malformed. */
+static bool parseAccount(const char *line, const char *end, FileAccount &account) {
+	const char *at = (const char *)memchr(line, '@', end - line);
+	if (at == NULL)
+		return false;
+	const char *space = (const char *)memchr(at + 1, ' ', end - at - 1);
+	if (space == NULL)
+		return false;
+	account.user.assign(line, at);
+	account.domain.assign(at + 1, space);
+	const char *p = space + 1;
+	space = (const char *)memchr(p, ' ', end - p);
+	if (space == NULL) {
+		account.password.assign(p, end);
+		account.userid = account.user;
+		account.phone.clear();
+		return true;
+	}
+	account.password.assign(p, space);
+	p = space + 1;
+	space = (const char *)memchr(p, ' ', end - p);
+	if (space == NULL) {
+		account.userid.assign(p, end);
+		account.phone.clear();
+	} else {
+		account.userid.assign(p, space);
+		account.phone.assign(space + 1, end);
+	}
+	return true;
+}
+
+/*
+ * Open addressing hash tables of the offsets of the lines: by "domain\nuser#userid" for the passwords, and by
+ * "user@domain" or "phone@domain;user=phone" for the users, as in the cache of AuthDbBackend. A slot holds the hash of
+ * its key and the offset of the line plus one, zero for an empty slot; the key is checked against the line itself.
+ */
+class FileAuthDb::Index {
+  public:
+	~Index() {
+		if (mData)
+			munmap((void *)mData, mSize);
+	}
+
+	/* Maps the file and indexes it, reusing previous when the file only grew since. NULL if it cannot be read. */
+	static shared_ptr<const Index> load(const string &path, const list<string> &domains,
+										const shared_ptr<const Index> &previous) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			LOGE("Can't open file %s: %s", path.c_str(), strerror(errno));
+			return nullptr;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			LOGE("Can't stat file %s: %s", path.c_str(), strerror(errno));
+			close(fd);
+			return nullptr;
+		}
+		bool sameFile = previous && previous->mDevice == st.st_dev && previous->mInode == st.st_ino;
+		if (sameFile && previous->mSize == (size_t)st.st_size && previous->mModified == st.st_mtime) {
+			close(fd);
+			return previous; // unchanged
+		}
+		shared_ptr<Index> index = make_shared<Index>();
+		index->mDevice = st.st_dev;
+		index->mInode = st.st_ino;
+		index->mModified = st.st_mtime;
+		index->mSize = st.st_size;
+		if (index->mSize > 0) {
+			void *data = mmap(NULL, index->mSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (data == MAP_FAILED) {
+				LOGE("Can't map file %s: %s", path.c_str(), strerror(errno));
+				close(fd);
+				return nullptr;
+			}
+			index->mData = (const char *)data;
+			madvise(data, index->mSize, MADV_SEQUENTIAL);
+		}
+		close(fd);
+
+		size_t from = 0;
+		// appended in place: the lines already indexed are kept, if they are still there
+		if (sameFile && previous->mSize < index->mSize && previous->mParsedSize > 0 &&
+			memcmp(previous->mData, index->mData, previous->mParsedSize) == 0) {
+			index->mPasswords = previous->mPasswords;
+			index->mPasswordCount = previous->mPasswordCount;
+			index->mUsers = previous->mUsers;
+			index->mUserCount = previous->mUserCount;
+			from = previous->mParsedSize;
+		}
+		index->parse(from, domains);
+		madvise((void *)index->mData, index->mSize, MADV_RANDOM);
+		LOGD("Indexed %zu accounts of %s from offset %zu", index->mPasswordCount, path.c_str(), from);
+		return index;
+	}
+
+	bool findPassword(const string &user, const string &userid, const string &domain, string &password) const {
+		string key = domain + '\n' + user + '#' + userid;
+		FileAccount account;
+		return find(mPasswords, key, false, account) && (password = account.password, true);
+	}
+	bool findUserWithPhone(const string &phone, const string &domain, string &user) const {
+		FileAccount account;
+		if (find(mUsers, phone + "@" + domain, false, account) ||
+			find(mUsers, phone + "@" + domain + ";user=phone", true, account)) {
+			user = account.user;
+			return true;
+		}
+		return false;
+	}
+
+  private:
+	struct Slot {
+		uint64_t hash;
+		uint64_t line; // offset + 1, and for the users whether the key is the phone in the lowest bit
+	};
+
+	static string passwordKey(const FileAccount &account) {
+		return account.domain + '\n' + account.user + '#' + account.userid;
+	}
+	static string userKey(const FileAccount &account, bool phone) {
+		return phone ? account.phone + "@" + account.domain + ";user=phone" : account.user + "@" + account.domain;
+	}
+
+	bool accountAt(uint64_t offset, FileAccount &account) const {
+		const char *line = mData + offset;
+		const char *end = (const char *)memchr(line, '\n', mData + mSize - line);
+		return parseAccount(line, end ? end : mData + mSize, account);
+	}
+
+	/* Slot of the key in the table, an empty one if it is not there. */
+	size_t probe(const vector<Slot> &table, uint64_t hash, const string &key, bool isUsers, bool phone) const {
+		size_t mask = table.size() - 1;
+		FileAccount account;
+		for (size_t i = hash & mask;; i = (i + 1) & mask) {
+			const Slot &slot = table[i];
+			if (slot.line == 0)
+				return i;
+			if (slot.hash != hash)
+				continue;
+			uint64_t offset = isUsers ? (slot.line >> 1) - 1 : slot.line - 1;
+			bool slotPhone = isUsers && (slot.line & 1);
+			if (isUsers && slotPhone != phone)
+				continue;
+			if (accountAt(offset, account) &&
+				(isUsers ? userKey(account, phone) : passwordKey(account)) == key)
+				return i;
+		}
+	}
+
+	bool find(const vector<Slot> &table, const string &key, bool phone, FileAccount &account) const {
+		if (table.empty())
+			return false;
+		bool isUsers = &table == &mUsers;
+		const Slot &slot = table[probe(table, hash<string>()(key), key, isUsers, phone)];
+		if (slot.line == 0)
+			return false;
+		return accountAt(isUsers ? (slot.line >> 1) - 1 : slot.line - 1, account);
+	}
+
+	/* Later lines replace the former ones of the same key, as they did in the cache. */
+	void insert(vector<Slot> &table, size_t &count, const string &key, uint64_t line, bool isUsers, bool phone) {
+		if ((count + 1) * 2 > table.size())
+			grow(table);
+		uint64_t h = hash<string>()(key);
+		Slot &slot = table[probe(table, h, key, isUsers, phone)];
+		if (slot.line == 0)
+			++count;
+		slot.hash = h;
+		slot.line = line;
+	}
+
+	static void grow(vector<Slot> &table) {
+		vector<Slot> grown(max<size_t>(1024, table.size() * 2), Slot{0, 0});
+		size_t mask = grown.size() - 1;
+		for (const Slot &slot : table) {
+			if (slot.line == 0)
+				continue;
+			size_t i = slot.hash & mask;
+			while (grown[i].line != 0)
+				i = (i + 1) & mask;
+			grown[i] = slot;
+		}
+		table.swap(grown);
+	}
+
+	void parse(size_t from, const list<string> &domains) {
+		bool anyDomain = std::find(domains.begin(), domains.end(), "*") != domains.end();
+		FileAccount account;
+		size_t offset = from;
+		while (offset < mSize) {
+			const char *line = mData + offset;
+			const char *end = (const char *)memchr(line, '\n', mSize - offset);
+			if (end == NULL)
+				break; // being written, parsed with the next version
+			size_t next = end - mData + 1;
+			if (end != line) {
+				if (!parseAccount(line, end, account)) {
+					LOGW("Incorrect line format: %s", string(line, end).c_str());
+				} else {
+					if (!account.phone.empty())
+						insert(mUsers, mUserCount, userKey(account, true), ((offset + 1) << 1) | 1, true, true);
+					insert(mUsers, mUserCount, userKey(account, false), (offset + 1) << 1, true, false);
+					if (anyDomain || std::find(domains.begin(), domains.end(), account.domain) != domains.end())
+						insert(mPasswords, mPasswordCount, passwordKey(account), offset + 1, false, false);
+					else
+						LOGW("Not handled domain: %s", account.domain.c_str());
+				}
+			}
+			offset = next;
+		}
+		mParsedSize = offset;
+	}
+
+	const char *mData = NULL;
+	size_t mSize = 0;
+	size_t mParsedSize = 0; // up to the last complete line
+	dev_t mDevice = 0;
+	ino_t mInode = 0;
+	time_t mModified = 0;
+	vector<Slot> mPasswords;
+	size_t mPasswordCount = 0;
+	vector<Slot> mUsers;
+	size_t mUserCount = 0;
+};
+
+FileAuthDb::FileAuthDb() : mLoading(false) {
 	GenericStruct *cr = GenericManager::get()->getRoot();
 	GenericStruct *ma = cr->get<GenericStruct>("module::Authentication");
 
-	mLastSync = 0;
 	mFileString = ma->get<ConfigString>("datasource")->read();
-	sync();
+	// the accounts are looked up in the index of the file, the cache only holds those created otherwise
+	mCacheMaxMemory = 0;
+	// the first version is indexed before answering
+	mLastSync = getCurrentTime();
+	load(readDomains());
+}
+
+FileAuthDb::~FileAuthDb() {
+	if (mLoader.joinable())
+		mLoader.join();
 }
 
 void FileAuthDb::getUserWithPhoneFromBackend(const std::string &phone, const std::string &domain, AuthDbListener *listener) {
 	AuthDbResult res = AuthDbResult::PASSWORD_NOT_FOUND;
-	if (mLastSync == 0) {
-		sync();
-	}
+	shared_ptr<const Index> index = getIndex();
 	std::string user;
-	if (getCachedUserWithPhone(phone, domain, user) == VALID_PASS_FOUND) {
+	if (index && index->findUserWithPhone(phone, domain, user) && !user.empty()) {
 		res = AuthDbResult::PASSWORD_FOUND;
 	}
 	if (listener) listener->onResult(res, user);
@@ -56,80 +300,41 @@ void FileAuthDb::getPasswordFromBackend(const std::string &id, const std::string
 		sync();
 	}
 
-	string key(createPasswordKey(id, authid));
-
+	shared_ptr<const Index> index = getIndex();
 	std::string passwd;
-	if (getCachedPassword(key, domain, passwd) == VALID_PASS_FOUND) {
+	if (index && index->findPassword(id, authid, domain, passwd)) {
 		res = AuthDbResult::PASSWORD_FOUND;
 	}
 	if (listener) listener->onResult(res, passwd);
 }
 
-void FileAuthDb::sync() {
-	LOGD("Syncing password file");
+static list<string> readDomains() {
 	GenericStruct *cr = GenericManager::get()->getRoot();
 	GenericStruct *ma = cr->get<GenericStruct>("module::Authentication");
-	list<string> domains = ma->get<ConfigStringList>("auth-domains")->read();
-
-	mLastSync = getCurrentTime();
-
-	ifstream file;
-
-	stringstream ss;
-	ss.exceptions(ifstream::failbit | ifstream::badbit);
-
-	string line;
-	string user;
-	string domain;
-	string password;
-	string userid;
-	string phone;
+	return ma->get<ConfigStringList>("auth-domains")->read();
+}
 
+void FileAuthDb::load(const list<string> &domains) {
 	LOGD("Opening file %s", mFileString.c_str());
-	file.open(mFileString);
-	if (file.is_open()) {
-		while (file.good() && getline(file, line)) {
-			if (line.empty()) continue;
-			ss.clear();
-			ss.str(line);
-			user.clear();
-			domain.clear();
-			password.clear();
-			userid.clear();
-			phone.clear();
-			try {
-				getline(ss, user, '@');
-				getline(ss, domain, ' ');
-				getline(ss, password, ' ');
-				if (!ss.eof()) {
-					getline(ss, userid, ' ');
-					if (!ss.eof()) {
-						getline(ss, phone);
-					} else {
-						phone = "";
-					}
-				} else {
-					userid = user;
-					phone = "";
-				}
-
-				cacheUserWithPhone(phone, domain, user);
-
-				if (find(domains.begin(), domains.end(), domain) != domains.end()) {
-					string key(createPasswordKey(user, userid));
-					cachePassword(key, domain, password, mCacheExpire);
-				} else if (find(domains.begin(), domains.end(), "*") != domains.end()) {
-					string key(createPasswordKey(user, userid));
-					cachePassword(key, domain, password, mCacheExpire);
-				} else {
-					LOGW("Not handled domain: %s", domain.c_str());
-				}
-			} catch (const stringstream::failure &e) {
-				LOGW("Incorrect line format: %s (error: %s)", line.c_str(), e.what());
-			}
-		}
-	} else {
-		LOGE("Can't open file %s", mFileString.c_str());
-	}
+	shared_ptr<const Index> index = Index::load(mFileString, domains, getIndex());
+	// the former index is kept if the file cannot be read anymore
+	if (index)
+		atomic_store(&mIndex, index);
 	LOGD("Syncing done");
 }
+
+/* Indexes the file again in the background, the former index answering meanwhile. */
+void FileAuthDb::sync() {
+	mLastSync = getCurrentTime();
+	if (mLoading)
+		return;
+	if (mLoader.joinable())
+		mLoader.join();
+	LOGD("Syncing password file");
+	mLoading = true;
+	list<string> domains = readDomains();
+	mLoader = thread([this, domains]() {
+		load(domains);
+		mLoading = false;
+	});
+}
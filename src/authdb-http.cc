@@ -0,0 +1,647 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "authdb.hh"
+#include "cJSON.h"
+#include "utils/threadplacement.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+using namespace std;
+using namespace chrono;
+
+#define DURATION_MS(start, stop) (unsigned long) duration_cast<milliseconds>((stop) - (start)).count()
+
+// the servers usually close the idle connections after a minute, so they are not reused long before
+static const time_t sIdleTimeout = 30;
+static const size_t sMaxLineLength = 8192;
+static const size_t sMaxBodySize = 4 * 1024 * 1024;
+
+/* A keep-alive connection to a server, reading the responses through a buffer. */
+class HttpAuthDb::Connection {
+  public:
+	Connection(const string &origin) : mOrigin(origin), mBio(NULL), mLastUse(0), mPos(0) {
+	}
+	~Connection() {
+		if (mBio)
+			BIO_free_all(mBio);
+	}
+	bool send(const string &data) {
+		for (size_t sent = 0; sent < data.size();) {
+			int n = BIO_write(mBio, data.data() + sent, data.size() - sent);
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+	/* Reads the response to a request, false when the connection failed before it was complete. */
+	bool receive(int &status, string &body, bool &keepAlive);
+
+	string mOrigin;
+	BIO *mBio;
+	time_t mLastUse;
+
+  private:
+	bool fill();
+	bool readLine(string &line);
+	bool readBytes(size_t count, string &out);
+
+	string mBuffer;
+	size_t mPos;
+};
+
+bool HttpAuthDb::Connection::fill() {
+	if (mPos > 0) {
+		mBuffer.erase(0, mPos);
+		mPos = 0;
+	}
+	char buf[4096];
+	int n = BIO_read(mBio, buf, sizeof(buf));
+	if (n <= 0)
+		return false;
+	mBuffer.append(buf, n);
+	return true;
+}
+
+bool HttpAuthDb::Connection::readLine(string &line) {
+	size_t end;
+	while ((end = mBuffer.find('\n', mPos)) == string::npos) {
+		if (mBuffer.size() - mPos > sMaxLineLength || !fill())
+			return false;
+	}
+	line.assign(mBuffer, mPos, end - mPos);
+	if (!line.empty() && line.back() == '\r')
+		line.pop_back();
+	mPos = end + 1;
+	return true;
+}
+
+bool HttpAuthDb::Connection::readBytes(size_t count, string &out) {
+	if (out.size() + count > sMaxBodySize)
+		return false;
+	while (mBuffer.size() - mPos < count) {
+		if (!fill())
+			return false;
+	}
+	out.append(mBuffer, mPos, count);
+	mPos += count;
+	return true;
+}
+
+bool HttpAuthDb::Connection::receive(int &status, string &body, bool &keepAlive) {
+	string line;
+	if (!readLine(line) || line.compare(0, 5, "HTTP/") != 0 || line.size() < 12)
+		return false;
+	keepAlive = line.compare(0, 8, "HTTP/1.1") == 0;
+	status = atoi(line.c_str() + 9);
+	long contentLength = -1;
+	bool chunked = false;
+	while (true) {
+		if (!readLine(line))
+			return false;
+		if (line.empty())
+			break;
+		size_t colon = line.find(':');
+		if (colon == string::npos)
+			continue;
+		string name = line.substr(0, colon);
+		size_t start = line.find_first_not_of(" \t", colon + 1);
+		string value = start == string::npos ? "" : line.substr(start);
+		if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+			contentLength = atol(value.c_str());
+		} else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+			chunked = strcasestr(value.c_str(), "chunked") != NULL;
+		} else if (strcasecmp(name.c_str(), "Connection") == 0) {
+			if (strcasestr(value.c_str(), "close"))
+				keepAlive = false;
+			else if (strcasestr(value.c_str(), "keep-alive"))
+				keepAlive = true;
+		}
+	}
+
+	body.clear();
+	if (status == 204 || status == 304)
+		return true;
+	if (chunked) {
+		while (true) {
+			if (!readLine(line))
+				return false;
+			size_t size = strtoul(line.c_str(), NULL, 16);
+			if (size == 0)
+				break;
+			if (!readBytes(size, body) || !readLine(line))
+				return false;
+		}
+		// trailers
+		do {
+			if (!readLine(line))
+				return false;
+		} while (!line.empty());
+		return true;
+	}
+	if (contentLength >= 0)
+		return readBytes(contentLength, body);
+	// the body ends with the connection
+	keepAlive = false;
+	while (fill()) {
+		if (mBuffer.size() > sMaxBodySize)
+			return false;
+	}
+	body.assign(mBuffer, mPos, string::npos);
+	mPos = mBuffer.size();
+	return true;
+}
+
+static bool parseUrl(const string &url, bool &secure, string &host, string &port, string &target) {
+	size_t hostStart;
+	if (url.compare(0, 7, "http://") == 0) {
+		secure = false;
+		hostStart = 7;
+	} else if (url.compare(0, 8, "https://") == 0) {
+		secure = true;
+		hostStart = 8;
+	} else {
+		return false;
+	}
+	size_t pathStart = url.find('/', hostStart);
+	string authority = url.substr(hostStart, pathStart == string::npos ? string::npos : pathStart - hostStart);
+	target = pathStart == string::npos ? "/" : url.substr(pathStart);
+	size_t colon = authority.rfind(':');
+	if (colon != string::npos && authority.find(']', colon) == string::npos) {
+		host = authority.substr(0, colon);
+		port = authority.substr(colon + 1);
+	} else {
+		host = authority;
+		port = secure ? "443" : "80";
+	}
+	return !host.empty() && !port.empty();
+}
+
+static string urlEncode(const string &value) {
+	static const char sHex[] = "0123456789ABCDEF";
+	string encoded;
+	for (auto it = value.begin(); it != value.end(); ++it) {
+		unsigned char c = *it;
+		if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+			encoded += c;
+		} else {
+			encoded += '%';
+			encoded += sHex[c >> 4];
+			encoded += sHex[c & 0xf];
+		}
+	}
+	return encoded;
+}
+
+/* Replaces the $name parameters of the URL with their URL-encoded value. */
+static string expandUrl(const string &url, const vector<pair<string, string>> &params) {
+	string expanded;
+	for (size_t i = 0; i < url.size();) {
+		bool replaced = false;
+		if (url[i] == '$') {
+			for (auto it = params.begin(); it != params.end(); ++it) {
+				if (url.compare(i + 1, it->first.size(), it->first) == 0) {
+					expanded += urlEncode(it->second);
+					i += 1 + it->first.size();
+					replaced = true;
+					break;
+				}
+			}
+		}
+		if (!replaced)
+			expanded += url[i++];
+	}
+	return expanded;
+}
+
+static string pendingPasswordKey(const string &id, const string &domain, const string &authid) {
+	return id + '\n' + domain + '\n' + authid;
+}
+
+void HttpAuthDb::declareConfig(GenericStruct *mc) {
+	ConfigItemDescriptor items[] = {
+		{String, "http-password-url",
+		 "URL requested with a GET to obtain the password of a user, http or https.\n"
+		 "Parameters are:\n -'$id' : the user found in the from header,\n -'$domain' : the authorization realm, "
+		 "and\n -'$authid' : the authorization username.\n"
+		 "The server answers with 200 and a JSON object holding the password, as {\"password\": \"secret\"}, or with "
+		 "404 when the user is unknown.\n"
+		 "Example : https://accounts.example.org/sip/password?id=$id&domain=$domain&authid=$authid",
+		 ""},
+		{String, "http-passwords-url",
+		 "URL to which the credentials of several users are posted at once, when password requests are waiting for a "
+		 "thread, as a JSON array of {\"id\", \"domain\", \"authid\"} objects.\n"
+		 "The server answers with 200 and a JSON array holding, in the same order, the password of each user or null "
+		 "when the user is unknown.\n"
+		 "When empty, the passwords are requested one by one with http-password-url.",
+		 ""},
+		{String, "http-user-with-phone-url",
+		 "URL requested with a GET to obtain the username associated with a phone alias.\n"
+		 "Parameters are:\n -'$phone' : the phone number to search for, and\n -'$domain' : the domain.\n"
+		 "The server answers with 200 and a JSON object holding the username, as {\"user\": \"alice\"}, or with "
+		 "404 when no user has this phone.",
+		 ""},
+		{String, "http-authorization",
+		 "Value of the Authorization header of the requests to the accounts API, such as 'Bearer <token>'. Empty for "
+		 "none.",
+		 ""},
+		{Integer, "http-passwords-batch-size", "Maximum number of users whose passwords are requested at once.",
+		 "50"},
+		{Integer, "http-poolsize",
+		 "Maximum number of threads requesting the accounts API, each one on its own keep-alive connection.", "20"},
+		{Integer, "http-timeout", "Timeout of the requests to the accounts API, in seconds.", "5"},
+		{Integer, "http-max-queue-size",
+		 "Amount of queries that will be allowed to be queued before bailing password requests.", "1000"},
+		config_item_end};
+
+	mc->addChildrenValues(items);
+
+	mc->createStat("count-http-queued-requests", "Number of accounts API requests waiting for a thread.");
+	mc->createStat("count-http-threads", "Number of threads running accounts API requests.");
+	mc->createStat("count-http-rejected-requests",
+				   "Number of accounts API requests refused because the queue was full.");
+	mc->createStat("count-http-connections", "Number of connections opened to the accounts API.");
+	mc->createStat("http-max-wait-ms", "Longest time an accounts API request waited for a thread since the previous "
+									   "update, in milliseconds.");
+}
+
+HttpAuthDb::HttpAuthDb() : mTlsContext(NULL), mConnections(0) {
+	GenericStruct *cr = GenericManager::get()->getRoot();
+	GenericStruct *ma = cr->get<GenericStruct>("module::Authentication");
+
+	mPasswordUrl = ma->get<ConfigString>("http-password-url")->read();
+	mPasswordsUrl = ma->get<ConfigString>("http-passwords-url")->read();
+	mUserWithPhoneUrl = ma->get<ConfigString>("http-user-with-phone-url")->read();
+	mAuthorization = ma->get<ConfigString>("http-authorization")->read();
+	mTimeout = max(1, ma->get<ConfigInt>("http-timeout")->read());
+	int batchSize = ma->get<ConfigInt>("http-passwords-batch-size")->read();
+	mMaxBatchSize = batchSize > 0 ? (size_t)batchSize : 1;
+	int poolSize = max(1, ma->get<ConfigInt>("http-poolsize")->read());
+	unsigned int maxQueueSize = (unsigned int)ma->get<ConfigInt>("http-max-queue-size")->read();
+	mCountQueued = ma->get<StatCounter64>("count-http-queued-requests");
+	mCountThreads = ma->get<StatCounter64>("count-http-threads");
+	mCountRejected = ma->get<StatCounter64>("count-http-rejected-requests");
+	mCountConnections = ma->get<StatCounter64>("count-http-connections");
+	mMaxWaitMs = ma->get<StatCounter64>("http-max-wait-ms");
+
+	Url url;
+	if (!parseUrl(mPasswordUrl, url.secure, url.host, url.port, url.target))
+		LOGE("[HTTP] Invalid http-password-url '%s', the passwords cannot be requested", mPasswordUrl.c_str());
+
+	SSL_library_init();
+	SSL_load_error_strings();
+	mTlsContext = SSL_CTX_new(SSLv23_client_method());
+	SSL_CTX_set_options(mTlsContext, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+	SSL_CTX_set_default_verify_paths(mTlsContext);
+	SSL_CTX_set_verify(mTlsContext, SSL_VERIFY_PEER, NULL);
+
+	// the threads beyond a quarter of the pool are only started when the requests pile up
+	mThreadPool = new ThreadPool(max(1, poolSize / 4), poolSize, maxQueueSize,
+								 []() { ThreadPlacement::placeCurrentThread(ThreadPlacement::Db); });
+	LOGD("[HTTP] Authentication provider created, with up to %d connections", poolSize);
+}
+
+HttpAuthDb::~HttpAuthDb() {
+	delete mThreadPool; // the connections are released by the threads
+	mIdleConnections.clear();
+	SSL_CTX_free(mTlsContext);
+}
+
+unique_ptr<HttpAuthDb::Connection> HttpAuthDb::openConnection(const Url &url) {
+	unique_ptr<Connection> conn(new Connection(url.origin));
+	string hostPort = url.host + ":" + url.port;
+	conn->mBio = BIO_new_connect((char *)hostPort.c_str());
+	if (!conn->mBio || BIO_do_connect(conn->mBio) <= 0) {
+		SLOGE << "[HTTP] Cannot connect to " << hostPort << ": " << strerror(errno);
+		return nullptr;
+	}
+	int fd = -1;
+	if (BIO_get_fd(conn->mBio, &fd) >= 0) {
+		timeval timeout = {mTimeout, 0};
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	if (url.secure) {
+		BIO *sslBio = BIO_new_ssl(mTlsContext, 1);
+		SSL *ssl = NULL;
+		BIO_get_ssl(sslBio, &ssl);
+		SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+		SSL_set_tlsext_host_name(ssl, url.host.c_str());
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), url.host.c_str(), 0);
+#endif
+		conn->mBio = BIO_push(sslBio, conn->mBio);
+		if (BIO_do_handshake(conn->mBio) <= 0) {
+			SLOGE << "[HTTP] TLS handshake with " << hostPort << " failed: "
+				  << ERR_error_string(ERR_get_error(), NULL);
+			return nullptr;
+		}
+	}
+	++mConnections;
+	return conn;
+}
+
+unique_ptr<HttpAuthDb::Connection> HttpAuthDb::acquireConnection(const Url &url, bool &reused) {
+	{
+		unique_lock<mutex> lock(mConnectionsMutex);
+		time_t now = getCurrentTime();
+		auto it = mIdleConnections.find(url.origin);
+		while (it != mIdleConnections.end() && it->first == url.origin) {
+			unique_ptr<Connection> conn = move(it->second);
+			it = mIdleConnections.erase(it);
+			if (now - conn->mLastUse < sIdleTimeout) {
+				reused = true;
+				return conn;
+			}
+		}
+	}
+	reused = false;
+	return openConnection(url);
+}
+
+void HttpAuthDb::releaseConnection(unique_ptr<Connection> conn) {
+	conn->mLastUse = getCurrentTime();
+	unique_lock<mutex> lock(mConnectionsMutex);
+	string origin = conn->mOrigin;
+	mIdleConnections.emplace(origin, move(conn));
+}
+
+int HttpAuthDb::request(const char *method, const string &urlString, const string &body, string &response) {
+	Url url;
+	if (!parseUrl(urlString, url.secure, url.host, url.port, url.target)) {
+		SLOGE << "[HTTP] Invalid URL " << urlString;
+		return 0;
+	}
+	url.origin = (url.secure ? "https://" : "http://") + url.host + ":" + url.port;
+
+	ostringstream message;
+	message << method << " " << url.target << " HTTP/1.1\r\n"
+			<< "Host: " << url.host << "\r\n"
+			<< "Accept: application/json\r\n";
+	if (!mAuthorization.empty())
+		message << "Authorization: " << mAuthorization << "\r\n";
+	if (strcmp(method, "GET") != 0)
+		message << "Content-Type: application/json\r\nContent-Length: " << body.size() << "\r\n";
+	message << "\r\n" << body;
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		bool reused = false;
+		unique_ptr<Connection> conn = acquireConnection(url, reused);
+		if (!conn)
+			return 0;
+		int status = 0;
+		bool keepAlive = false;
+		if (conn->send(message.str()) && conn->receive(status, response, keepAlive)) {
+			if (keepAlive)
+				releaseConnection(move(conn));
+			return status;
+		}
+		// the lookups being idempotent, a connection closed by the server while it was idle is replaced for a retry
+		if (!reused) {
+			SLOGE << "[HTTP] No response from " << url.origin;
+			break;
+		}
+	}
+	return 0;
+}
+
+AuthDbResult HttpAuthDb::getPassword(const PendingPassword &cred, string &pass) {
+	steady_clock::time_point start = steady_clock::now();
+	string response;
+	string url = expandUrl(mPasswordUrl, {{"id", cred.id}, {"domain", cred.domain}, {"authid", cred.authid}});
+	int status = request("GET", url, "", response);
+	steady_clock::time_point stop = steady_clock::now();
+	if (status == 404) {
+		SLOGD << "[HTTP] No user " << cred.id << " in " << DURATION_MS(start, stop) << "ms";
+		cachePassword(createPasswordKey(cred.id, cred.authid), cred.domain, "", mCacheExpire);
+		return PASSWORD_NOT_FOUND;
+	}
+	if (status != 200) {
+		SLOGE << "[HTTP] Password request for " << cred.id << " failed after " << DURATION_MS(start, stop)
+			  << "ms, status " << status;
+		return AUTH_ERROR;
+	}
+	cJSON *root = cJSON_Parse(response.c_str());
+	cJSON *password = root ? cJSON_GetObjectItem(root, "password") : NULL;
+	AuthDbResult result = AUTH_ERROR;
+	if (password && password->type == cJSON_String) {
+		pass = password->valuestring;
+		SLOGD << "[HTTP] Got password for " << cred.id << " in " << DURATION_MS(start, stop) << "ms";
+		cachePassword(createPasswordKey(cred.id, cred.authid), cred.domain, pass, mCacheExpire);
+		result = pass.empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND;
+	} else {
+		SLOGE << "[HTTP] Invalid password response for " << cred.id << ": " << response;
+	}
+	if (root)
+		cJSON_Delete(root);
+	return result;
+}
+
+/* Fills passwords with the password of each of the credentials, empty when the user is unknown. */
+bool HttpAuthDb::getPasswords(const vector<PendingPassword> &creds, vector<string> &passwords) {
+	cJSON *array = cJSON_CreateArray();
+	for (auto it = creds.begin(); it != creds.end(); ++it) {
+		cJSON *cred = cJSON_CreateObject();
+		cJSON_AddStringToObject(cred, "id", it->id.c_str());
+		cJSON_AddStringToObject(cred, "domain", it->domain.c_str());
+		cJSON_AddStringToObject(cred, "authid", it->authid.c_str());
+		cJSON_AddItemToArray(array, cred);
+	}
+	char *body = cJSON_PrintUnformatted(array);
+	cJSON_Delete(array);
+	string request(body);
+	free(body);
+
+	steady_clock::time_point start = steady_clock::now();
+	string response;
+	int status = this->request("POST", mPasswordsUrl, request, response);
+	steady_clock::time_point stop = steady_clock::now();
+	if (status != 200) {
+		SLOGE << "[HTTP] Passwords request for " << creds.size() << " users failed after "
+			  << DURATION_MS(start, stop) << "ms, status " << status;
+		return false;
+	}
+	cJSON *root = cJSON_Parse(response.c_str());
+	bool ok = root && root->type == cJSON_Array && cJSON_GetArraySize(root) == (int)creds.size();
+	for (int i = 0; ok && i < (int)creds.size(); ++i) {
+		cJSON *password = cJSON_GetArrayItem(root, i);
+		if (password->type == cJSON_String)
+			passwords.push_back(password->valuestring);
+		else if (password->type == cJSON_NULL)
+			passwords.push_back("");
+		else
+			ok = false;
+	}
+	if (root)
+		cJSON_Delete(root);
+	if (!ok) {
+		SLOGE << "[HTTP] Invalid passwords response for " << creds.size() << " users: " << response;
+		return false;
+	}
+	SLOGD << "[HTTP] Got passwords for " << creds.size() << " users in " << DURATION_MS(start, stop) << "ms";
+	return true;
+}
+
+void HttpAuthDb::notifyPassword(const string &key, AuthDbResult result, const string &pass) {
+	list<AuthDbListener *> listeners;
+	{
+		unique_lock<mutex> lock(mPendingMutex);
+		auto it = mPendingPasswords.find(key);
+		if (it == mPendingPasswords.end())
+			return;
+		listeners.swap(it->second.listeners);
+		mPendingPasswords.erase(it);
+	}
+	for (auto it = listeners.begin(); it != listeners.end(); ++it) {
+		(*it)->onResult(result, pass);
+	}
+}
+
+/* Run by the threads of the pool: takes the lookups queued so far, which were left waiting for a thread, and requests
+ * them together. When the pool keeps up, each batch has a single user. */
+void HttpAuthDb::processPasswordBatch() {
+	vector<PendingPassword> batch;
+	{
+		unique_lock<mutex> lock(mPendingMutex);
+		size_t maxBatchSize = mPasswordsUrl.empty() ? 1 : mMaxBatchSize;
+		while (!mQueuedPasswords.empty() && batch.size() < maxBatchSize) {
+			auto it = mPendingPasswords.find(mQueuedPasswords.front());
+			mQueuedPasswords.pop_front();
+			if (it != mPendingPasswords.end())
+				batch.push_back(PendingPassword{it->second.id, it->second.domain, it->second.authid, {}});
+		}
+	}
+
+	if (batch.size() > 1) {
+		vector<string> passwords;
+		bool ok = getPasswords(batch, passwords);
+		for (size_t i = 0; i < batch.size(); ++i) {
+			const PendingPassword &cred = batch[i];
+			string key = pendingPasswordKey(cred.id, cred.domain, cred.authid);
+			if (!ok) {
+				notifyPassword(key, AUTH_ERROR, "");
+				continue;
+			}
+			cachePassword(createPasswordKey(cred.id, cred.authid), cred.domain, passwords[i], mCacheExpire);
+			notifyPassword(key, passwords[i].empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND, passwords[i]);
+		}
+	} else if (batch.size() == 1) {
+		string pass;
+		AuthDbResult result = getPassword(batch.front(), pass);
+		notifyPassword(pendingPasswordKey(batch.front().id, batch.front().domain, batch.front().authid), result, pass);
+	}
+}
+
+void HttpAuthDb::getPasswordFromBackend(const string &id, const string &domain, const string &authid,
+										AuthDbListener *listener) {
+	string key = pendingPasswordKey(id, domain, authid);
+	{
+		unique_lock<mutex> lock(mPendingMutex);
+		auto it = mPendingPasswords.find(key);
+		if (it != mPendingPasswords.end()) {
+			// the same credentials are already being looked up, they will answer this one too
+			if (listener)
+				it->second.listeners.push_back(listener);
+			return;
+		}
+		PendingPassword &pending = mPendingPasswords[key];
+		pending.id = id;
+		pending.domain = domain;
+		pending.authid = authid;
+		if (listener)
+			pending.listeners.push_back(listener);
+		mQueuedPasswords.push_back(key);
+	}
+
+	// each lookup queues a task, which takes all the lookups queued meanwhile if it had to wait for a thread
+	if (!mThreadPool->Enqueue(bind(&HttpAuthDb::processPasswordBatch, this), ThreadPool::High)) {
+		SLOGE << "[HTTP] Auth queue is full, cannot fullfil password request for " << id << " / " << domain << " / "
+			  << authid;
+		{
+			unique_lock<mutex> lock(mPendingMutex);
+			auto it = find(mQueuedPasswords.begin(), mQueuedPasswords.end(), key);
+			if (it != mQueuedPasswords.end())
+				mQueuedPasswords.erase(it);
+		}
+		notifyPassword(key, AUTH_ERROR, "");
+	}
+}
+
+void HttpAuthDb::getUserWithPhoneWithPool(const string &phone, const string &domain, AuthDbListener *listener) {
+	string user;
+	AuthDbResult result = PASSWORD_NOT_FOUND;
+	if (mUserWithPhoneUrl.empty()) {
+		SLOGE << "[HTTP] http-user-with-phone-url is empty, cannot find the user of " << phone;
+	} else {
+		string response;
+		int status = request("GET", expandUrl(mUserWithPhoneUrl, {{"phone", phone}, {"domain", domain}}), "", response);
+		if (status == 200) {
+			cJSON *root = cJSON_Parse(response.c_str());
+			cJSON *item = root ? cJSON_GetObjectItem(root, "user") : NULL;
+			if (item && item->type == cJSON_String)
+				user = item->valuestring;
+			else
+				SLOGE << "[HTTP] Invalid user response for " << phone << ": " << response;
+			if (root)
+				cJSON_Delete(root);
+		} else if (status != 404) {
+			SLOGE << "[HTTP] User request for " << phone << " failed, status " << status;
+			result = AUTH_ERROR;
+		}
+		if (!user.empty()) {
+			cacheUserWithPhone(phone, domain, user);
+			result = PASSWORD_FOUND;
+		} else if (status == 404) {
+			cacheUnknownPhone(phone, domain);
+		}
+	}
+	if (listener)
+		listener->onResult(result, user);
+}
+
+void HttpAuthDb::getUserWithPhoneFromBackend(const string &phone, const string &domain, AuthDbListener *listener) {
+	if (!mThreadPool->Enqueue(bind(&HttpAuthDb::getUserWithPhoneWithPool, this, phone, domain, listener))) {
+		SLOGE << "[HTTP] Auth queue is full, cannot fullfil user request for " << phone;
+		if (listener)
+			listener->onResult(AUTH_ERROR, "");
+	}
+}
+
+void HttpAuthDb::updateStats() {
+	AuthDbBackend::updateStats();
+	ThreadPool::Metrics metrics = mThreadPool->getMetrics();
+	mCountQueued->set(metrics.queued);
+	mCountThreads->set(metrics.threads);
+	mCountRejected->set(metrics.rejected);
+	mCountConnections->set(mConnections);
+	mMaxWaitMs->set(metrics.maxWaitMs);
+}
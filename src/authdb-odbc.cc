@@ -18,6 +18,8 @@
 #define SU_MSG_ARG_T void
 
 #include "authdb.hh"
+#include "utils/threadplacement.hh"
+#include <algorithm>
 #include <vector>
 #include <set>
 #include <chrono>
@@ -75,6 +77,13 @@ struct AuthDbTimingsAnalyzer {
 	long maxLineWidth;
 	float durations[steps + 1];
 
+	// never reset, exported as statistics
+	uint64_t totalCount;
+	uint64_t totalErrors;
+	uint64_t totalSlow;
+	uint64_t totalSlowest;
+	uint64_t totalDurations[steps + 1];
+
 	void reset() {
 		lastDisplay = steady_clock::now();
 		count = 0;
@@ -88,7 +97,8 @@ struct AuthDbTimingsAnalyzer {
 		maxLineWidth = 0;
 	}
 
-	AuthDbTimingsAnalyzer() {
+	AuthDbTimingsAnalyzer() : totalCount(0), totalErrors(0), totalSlow(0), totalSlowest(0) {
+		memset(totalDurations, 0, sizeof(totalDurations));
 		reset();
 	}
 
@@ -96,29 +106,33 @@ struct AuthDbTimingsAnalyzer {
 		if (error) {
 			tMutex.lock();
 			++errorCount;
+			++totalErrors;
 			tMutex.unlock();
 			return;
 		}
 
-		// microseconds duration = t2-t1;
-		long ticks = /*duration*/ (t2 - t1).count();
+		long ticks = (long)duration_cast<microseconds>(t2 - t1).count();
 
 		tMutex.lock();
 
 		average = (count * average + ticks) / (count + 1);
 		++count;
+		++totalCount;
 		if (ticks > maxDuration) {
 			// LOGI("bigger max: %f", duration);
 			if (ticks > maxDurationSlow) {
 				slowestAverage = (slowestCount * slowestAverage + ticks) / (slowestCount + 1);
 				++slowestCount;
+				++totalSlowest;
 			}
 			slowAverage = (slowCount * slowAverage + ticks) / (slowCount + 1);
 			++slowCount;
+			++totalSlow;
 			ticks = maxDuration;
 		}
-		long index = (long)(ticks / stepSize);
+		long index = min((long)(ticks / stepSize), (long)steps);
 		++(durations[index]);
+		++(totalDurations[index]);
 		if (durations[index] > maxLineWidth)
 			++maxLineWidth;
 
@@ -165,6 +179,59 @@ void AuthDbTimings::done() {
 	analyzerRetr.compute("pass retrieving", tGotConnection, tGotResult, error);
 }
 
+/*
+ * The timings of an analyzer as statistics, in this order: count, errors, slow ones, slowest ones, then the histogram,
+ * one counter per step of the durations below maxDuration.
+ */
+static const int sTimingStatsPerAnalyzer = 4 + AuthDbTimingsAnalyzer::steps;
+static const char *sTimingAnalyzers[] = {"full", "retrieving"};
+
+static string timingStatName(const char *analyzer, int i) {
+	string prefix = string("count-odbc-") + analyzer;
+	switch (i) {
+		case 0:
+			return prefix + "-timings";
+		case 1:
+			return prefix + "-errors";
+		case 2:
+			return prefix + "-slow";
+		case 3:
+			return prefix + "-slowest";
+		default:
+			return prefix + "-under-" + to_string((i - 3) * AuthDbTimingsAnalyzer::stepSize) + "us";
+	}
+}
+
+static void declareTimingStats(GenericStruct *mc) {
+	for (const char *analyzer : sTimingAnalyzers) {
+		string what = strcmp(analyzer, "full") == 0 ? "password requests" : "executions of the request";
+		mc->createStat(timingStatName(analyzer, 0), "Number of " + what + " timed.");
+		mc->createStat(timingStatName(analyzer, 1), "Number of " + what + " failed.");
+		mc->createStat(timingStatName(analyzer, 2), "Number of " + what + " longer than " +
+														to_string(AuthDbTimingsAnalyzer::maxDuration) +
+														" microseconds.");
+		mc->createStat(timingStatName(analyzer, 3), "Number of " + what + " longer than " +
+														to_string(AuthDbTimingsAnalyzer::maxDurationSlow) +
+														" microseconds.");
+		for (int i = 4; i < sTimingStatsPerAnalyzer; ++i) {
+			long from = (i - 4) * AuthDbTimingsAnalyzer::stepSize;
+			mc->createStat(timingStatName(analyzer, i), "Number of " + what + " between " + to_string(from) +
+															" and " + to_string(from + AuthDbTimingsAnalyzer::stepSize) +
+															" microseconds.");
+		}
+	}
+}
+
+static void exportTimings(AuthDbTimingsAnalyzer &analyzer, StatCounter64 **stats) {
+	lock_guard<mutex> lock(AuthDbTimingsAnalyzer::tMutex);
+	stats[0]->set(analyzer.totalCount);
+	stats[1]->set(analyzer.totalErrors);
+	stats[2]->set(analyzer.totalSlow);
+	stats[3]->set(analyzer.totalSlowest);
+	for (int i = 4; i < sTimingStatsPerAnalyzer; ++i)
+		stats[i]->set(analyzer.totalDurations[i - 4]);
+}
+
 static vector<string> parseAndUpdateRequestConfig(string &request) {
 	vector<string> found_parameters;
 	bool hasIdParameter = false;
@@ -202,7 +269,9 @@ static vector<string> parseAndUpdateRequestConfig(string &request) {
  * See documentation on ODBC on Microsoft pages:
  * http://msdn.microsoft.com/en-us/library/ms716319%28v=VS.85%29.aspx
  */
-OdbcAuthDb::OdbcAuthDb() : mAsynchronousRetrieving(true), env(NULL), execDirect(false) {
+OdbcAuthDb::OdbcAuthDb()
+	: mAsynchronousRetrieving(true), env(NULL), execDirect(false), mThreadPool(NULL), mConnections(0),
+	  mBrokenConnections(0) {
 	GenericStruct *cr = GenericManager::get()->getRoot();
 	GenericStruct *ma = cr->get<GenericStruct>("module::Authentication");
 
@@ -228,6 +297,18 @@ OdbcAuthDb::OdbcAuthDb() : mAsynchronousRetrieving(true), env(NULL), execDirect(
 	LOGD("%s password retrieving", mAsynchronousRetrieving ? "Asynchronous" : "Synchronous");
 
 	asPooling = ma->get<ConfigBoolean>("odbc-pooling")->read();
+	int poolSize = ma->get<ConfigInt>("odbc-poolsize")->read();
+	mPoolSize = poolSize > 0 ? (size_t)poolSize : 1;
+	unsigned int maxQueueSize = (unsigned int)ma->get<ConfigInt>("odbc-max-queue-size")->read();
+	mCountConnections = ma->get<StatCounter64>("count-odbc-connections");
+	mCountBrokenConnections = ma->get<StatCounter64>("count-odbc-broken-connections");
+	mCountQueued = ma->get<StatCounter64>("count-odbc-queued-requests");
+	mCountRejected = ma->get<StatCounter64>("count-odbc-rejected-requests");
+	mMaxWaitMs = ma->get<StatCounter64>("odbc-max-wait-ms");
+	for (const char *analyzer : sTimingAnalyzers) {
+		for (int i = 0; i < sTimingStatsPerAnalyzer; ++i)
+			mTimingStats.push_back(ma->get<StatCounter64>(timingStatName(analyzer, i)));
+	}
 
 	SQLRETURN retcode;
 	// 1. Enable or disable connection pooling.
@@ -260,12 +341,18 @@ OdbcAuthDb::OdbcAuthDb() : mAsynchronousRetrieving(true), env(NULL), execDirect(
  *  However it is required because mysql client lib segfaults like a shit when used from a thread for the first.
  **/
 #if 1
-	// Make sure the driver library is loaded.
+	// Make sure the driver library is loaded, and give the connection to the pool.
 	AuthDbTimings timings;
-	ConnectionCtx ctx;
 	string init = "init";
-	getConnection(init, ctx, timings);
+	unique_ptr<ConnectionCtx> ctx(new ConnectionCtx());
+	if (getConnection(init, *ctx, timings)) {
+		++mConnections;
+		releaseConnection(move(ctx));
+	}
 #endif
+	// at most one connection per thread
+	mThreadPool = new ThreadPool(1, mPoolSize, maxQueueSize,
+								 []() { ThreadPlacement::placeCurrentThread(ThreadPlacement::Db); });
 }
 
 void OdbcAuthDb::declareConfig(GenericStruct *mc) {
@@ -282,10 +369,21 @@ void OdbcAuthDb::declareConfig(GenericStruct *mc) {
 		{Boolean, "odbc-pooling", "Use pooling in ODBC (improves performances). This is not guaranteed to succeed, "
 								  "because if you are using unixODBC, it consults the /etc/odbcinst.ini"
 								  "file in section [ODBC] to check for Pooling=yes/no option. You should make sure "
-								  "that this flag is set before expecting this option to work.",
+								  "that this flag is set before expecting this option to work. "
+								  "Flexisip keeps its own pool of connections anyway, see odbc-poolsize.",
 		 "true"},
 
-		{Integer, "odbc-display-timings-interval", "Display timing statistics after this count of seconds", "0"},
+		{Integer, "odbc-poolsize",
+		 "Maximum number of connections to the database, each used by one thread at a time to run the prepared "
+		 "request. The connections are opened as the requests pile up and kept open.",
+		 "20"},
+
+		{Integer, "odbc-max-queue-size",
+		 "Number of password requests allowed to wait for a connection, beyond which they fail.", "1000"},
+
+		{Integer, "odbc-display-timings-interval",
+		 "Display timing statistics after this count of seconds. The timings are also available as statistics.",
+		 "0"},
 
 		{Integer, "odbc-display-timings-after-count",
 		 "Display timing statistics once the number of samples reach this number.", "0"},
@@ -293,6 +391,16 @@ void OdbcAuthDb::declareConfig(GenericStruct *mc) {
 		config_item_end};
 
 	mc->addChildrenValues(items);
+
+	mc->createStat("count-odbc-connections", "Number of connections to the database opened.");
+	mc->createStat("count-odbc-broken-connections", "Number of connections to the database found dead and closed.");
+	mc->createStat("count-odbc-queued-requests", "Number of password requests waiting for a connection.");
+	mc->createStat("count-odbc-rejected-requests",
+				   "Number of password requests refused because too many were waiting for a connection.");
+	mc->createStat("odbc-max-wait-ms",
+				   "Longest time a password request waited for a connection since the previous update, in "
+				   "milliseconds.");
+	declareTimingStats(mc);
 }
 
 void OdbcAuthDb::setExecuteDirect(const bool value) {
@@ -345,8 +453,10 @@ static void logSqlError(string fn, SQLHANDLE handle, SQLSMALLINT handleType) {
 }
 
 OdbcAuthDb::~OdbcAuthDb() {
+	// the connections in use are released by the threads
+	delete mThreadPool;
+	mIdleConnections.clear();
 	// Destroy environment
-	// All connection should be destroyed already
 	LOGD("Disconnecting odbc connector");
 	if (env)
 		SQLFreeHandle(SQL_HANDLE_ENV, env);
@@ -447,23 +557,54 @@ static void closeCursor(SQLHSTMT &stmt) {
 	}
 }
 
+unique_ptr<OdbcAuthDb::ConnectionCtx> OdbcAuthDb::acquireConnection(const string &id, AuthDbTimings &timings) {
+	while (true) {
+		unique_ptr<ConnectionCtx> ctx;
+		{
+			lock_guard<mutex> lock(mConnectionsMutex);
+			if (mIdleConnections.empty())
+				break;
+			ctx = move(mIdleConnections.back());
+			mIdleConnections.pop_back();
+		}
+		// answered by the driver from what it knows of the link, without a round trip
+		SQLUINTEGER dead = SQL_CD_FALSE;
+		SQLRETURN retcode = SQLGetConnectAttr(ctx->dbc, SQL_ATTR_CONNECTION_DEAD, &dead, 0, NULL);
+		if (SQL_SUCCEEDED(retcode) && dead == SQL_CD_FALSE)
+			return ctx;
+		LOGW("Odbc connection found dead, closed");
+		++mBrokenConnections;
+	}
+	unique_ptr<ConnectionCtx> ctx(new ConnectionCtx());
+	if (!getConnection(id, *ctx, timings))
+		return nullptr;
+	++mConnections;
+	return ctx;
+}
+
+void OdbcAuthDb::releaseConnection(unique_ptr<ConnectionCtx> ctx) {
+	lock_guard<mutex> lock(mConnectionsMutex);
+	mIdleConnections.push_back(move(ctx));
+}
+
 void OdbcAuthDb::getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener) {
 
 	if (mAsynchronousRetrieving) {
-		// Asynchronously retrieve password in a new thread.
-		// Allocate on the stack and detach. It is lawful since:
-		// "When detach() returns, *this no longer represents the possibly continuing thread of execution."
-
-		thread t = thread(bind(&OdbcAuthDb::doAsyncRetrievePassword, this, id, domain, authid, listener));
-		t.detach(); // Thread will continue running in detached mode
+		// Asynchronously retrieve password in a thread of the pool
+		auto func = bind(&OdbcAuthDb::doAsyncRetrievePassword, this, id, domain, authid, listener);
+		if (!mThreadPool->Enqueue(func, ThreadPool::High)) {
+			// Enqueue() can fail when the queue is full, so we have to act on that
+			SLOGE << "[ODBC] Auth queue is full, cannot fullfil password request for " << id << " / " << domain
+				  << " / " << authid;
+			if (listener) listener->onResult(AUTH_ERROR, "");
+		}
 		return;
 	} else {
 		AuthDbTimings timings;
 		string foundPassword;
 		timings.tStart = steady_clock::now();
-		ConnectionCtx ctx;
-		AuthDbResult ret = doRetrievePassword(ctx, id, domain, authid, foundPassword, timings);
+		AuthDbResult ret = doRetrievePassword(id, domain, authid, foundPassword, timings);
 		timings.tEnd = steady_clock::now();
 		if (ret == AUTH_ERROR) {
 			timings.error = true;
@@ -473,22 +614,12 @@ void OdbcAuthDb::getPasswordFromBackend(const std::string &id, const std::string
 	}
 }
 
-/*
-static unsigned long threadCount=0;
-static mutex threadCountMutex;
-*/
 void OdbcAuthDb::doAsyncRetrievePassword(string id, string domain, string auth,
 										 AuthDbListener *listener) {
-	/*	unsigned long localThreadCountCopy=0;
-		threadCountMutex.lock();
-		++threadCount;
-		localThreadCountCopy=threadCount;
-		threadCountMutex.unlock();*/
-	ConnectionCtx ctx;
 	string password;
 	AuthDbTimings timings;
 	timings.tStart = steady_clock::now();
-	AuthDbResult ret = doRetrievePassword(ctx, id, domain, auth, password, timings);
+	AuthDbResult ret = doRetrievePassword(id, domain, auth, password, timings);
 	timings.tEnd = steady_clock::now();
 	if (ret == AUTH_ERROR) {
 		timings.error = true;
@@ -496,22 +627,43 @@ void OdbcAuthDb::doAsyncRetrievePassword(string id, string domain, string auth,
 	timings.done();
 
 	if (listener) listener->onResult(ret, password);
+}
 
-	/*
-	threadCountMutex.lock();
-	--threadCount;
-	localThreadCountCopy=threadCount;
-	threadCountMutex.unlock();
-	*/
+void OdbcAuthDb::updateStats() {
+	AuthDbBackend::updateStats();
+	ThreadPool::Metrics metrics = mThreadPool->getMetrics();
+	mCountQueued->set(metrics.queued);
+	mCountRejected->set(metrics.rejected);
+	mMaxWaitMs->set(metrics.maxWaitMs);
+	mCountConnections->set(mConnections);
+	mCountBrokenConnections->set(mBrokenConnections);
+	exportTimings(AuthDbTimings::analyzerFull, &mTimingStats[0]);
+	exportTimings(AuthDbTimings::analyzerRetr, &mTimingStats[sTimingStatsPerAnalyzer]);
 }
 
-AuthDbResult OdbcAuthDb::doRetrievePassword(ConnectionCtx &ctx, const string &id, const string &domain,
-											const string &auth, string &foundPassword, AuthDbTimings &timings) {
-	if (!getConnection(id, ctx, timings)) {
-		LOGE("ConnectionCtx creation error");
-		return AUTH_ERROR;
+AuthDbResult OdbcAuthDb::doRetrievePassword(const string &id, const string &domain, const string &auth,
+											string &foundPassword, AuthDbTimings &timings) {
+	// a link broken since the connection was released is only seen when executing the request: retried once on a new
+	// connection
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		unique_ptr<ConnectionCtx> ctx = acquireConnection(id, timings);
+		if (!ctx) {
+			LOGE("ConnectionCtx creation error");
+			return AUTH_ERROR;
+		}
+		bool broken = false;
+		AuthDbResult ret = executeRequest(*ctx, id, domain, auth, foundPassword, timings, broken);
+		if (!broken) {
+			releaseConnection(move(ctx));
+			return ret;
+		}
+		++mBrokenConnections;
 	}
+	return AUTH_ERROR;
+}
 
+AuthDbResult OdbcAuthDb::executeRequest(ConnectionCtx &ctx, const string &id, const string &domain, const string &auth,
+										string &foundPassword, AuthDbTimings &timings, bool &broken) {
 	timings.tGotConnection = steady_clock::now();
 	SQLHANDLE stmt = ctx.stmt;
 
@@ -526,7 +678,7 @@ AuthDbResult OdbcAuthDb::doRetrievePassword(ConnectionCtx &ctx, const string &id
 		retcode = SQLExecDirect(stmt, (SQLCHAR *)request.c_str(), SQL_NTS);
 		if (!SQL_SUCCEEDED(retcode)) {
 			stmtError(ctx, "SQLExecDirect");
-			linkFailed("SQLExecDirect", stmt, SQL_HANDLE_STMT);
+			broken = linkFailed("SQLExecDirect", stmt, SQL_HANDLE_STMT);
 			return AUTH_ERROR;
 		}
 		LOGD("SQLExecDirect OK");
@@ -536,7 +688,7 @@ AuthDbResult OdbcAuthDb::doRetrievePassword(ConnectionCtx &ctx, const string &id
 		retcode = SQLExecute(stmt);
 		if (!SQL_SUCCEEDED(retcode)) {
 			stmtError(ctx, "SQLExecute");
-			linkFailed("SQLExecute", stmt, SQL_HANDLE_STMT);
+			broken = linkFailed("SQLExecute", stmt, SQL_HANDLE_STMT);
 			return AUTH_ERROR;
 		}
 		LOGD("SQLExecute OK");
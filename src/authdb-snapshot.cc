@@ -0,0 +1,229 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "authdb.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+using namespace std;
+
+/*
+ * Snapshot of the credentials cache.
+ *
+ * Layout: 'F' 'X' 'C' <version:u8> <salt:16> <iv:12> <tag:16> <ciphertext>
+ * The plain text is a sequence of entries: <expire date:i64> <key length:u32> <key> <password length:u32> <password>,
+ * integers little endian. It is encrypted with AES-256-GCM, with a key derived from cache-snapshot-key by PBKDF2.
+ * Users known not to exist are not saved, as they are only cached for a short time.
+ */
+
+static const unsigned char sSnapshotMagic[3] = {'F', 'X', 'C'};
+static const unsigned char sSnapshotVersion = 1;
+static const size_t sSaltSize = 16;
+static const size_t sIvSize = 12;
+static const size_t sTagSize = 16;
+static const size_t sSnapshotHeaderSize = 4 + sSaltSize + sIvSize + sTagSize;
+static const int sKeyIterations = 10000;
+
+static bool deriveSnapshotKey(const string &passphrase, const unsigned char *salt, unsigned char *key) {
+	return PKCS5_PBKDF2_HMAC(passphrase.c_str(), passphrase.size(), salt, sSaltSize, sKeyIterations, EVP_sha256(), 32,
+							 key) == 1;
+}
+
+/* AES-256-GCM, the tag is written when encrypting and checked when decrypting. */
+static bool snapshotCipher(bool encrypt, const unsigned char *key, const unsigned char *iv, const unsigned char *in,
+						   size_t len, unsigned char *out, unsigned char *tag) {
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return false;
+	int outlen = 0;
+	bool ok = EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, encrypt ? 1 : 0) == 1 &&
+			  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, sIvSize, NULL) == 1 &&
+			  EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, encrypt ? 1 : 0) == 1 &&
+			  (len == 0 || EVP_CipherUpdate(ctx, out, &outlen, in, len) == 1);
+	if (ok && !encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, sTagSize, tag) == 1;
+	ok = ok && EVP_CipherFinal_ex(ctx, out + outlen, &outlen) == 1;
+	if (ok && encrypt)
+		ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sTagSize, tag) == 1;
+	EVP_CIPHER_CTX_free(ctx);
+	return ok;
+}
+
+static void putU32(string &out, uint32_t v) {
+	for (int i = 0; i < 4; ++i)
+		out.push_back((char)((v >> (8 * i)) & 0xff));
+}
+
+static bool getU32(const unsigned char *buf, size_t len, size_t &pos, uint32_t &v) {
+	if (pos + 4 > len)
+		return false;
+	v = (uint32_t)buf[pos] | ((uint32_t)buf[pos + 1] << 8) | ((uint32_t)buf[pos + 2] << 16) |
+		((uint32_t)buf[pos + 3] << 24);
+	pos += 4;
+	return true;
+}
+
+static bool getString(const unsigned char *buf, size_t len, size_t &pos, string &s) {
+	uint32_t size;
+	if (!getU32(buf, len, pos, size) || size > len - pos)
+		return false;
+	s.assign((const char *)buf + pos, size);
+	pos += size;
+	return true;
+}
+
+void AuthDbBackend::loadCacheSnapshot() {
+	int fd = open(mSnapshotFile.c_str(), O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			LOGE("Cannot open credentials cache snapshot %s: %s", mSnapshotFile.c_str(), strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sSnapshotHeaderSize) {
+		LOGE("Invalid credentials cache snapshot %s", mSnapshotFile.c_str());
+		close(fd);
+		return;
+	}
+	size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGE("Cannot map credentials cache snapshot %s: %s", mSnapshotFile.c_str(), strerror(errno));
+		return;
+	}
+	const unsigned char *data = (const unsigned char *)map;
+	unsigned char key[32];
+	vector<unsigned char> plain(size - sSnapshotHeaderSize + 1);
+	unsigned char tag[sTagSize];
+	memcpy(tag, data + 4 + sSaltSize + sIvSize, sTagSize);
+	if (memcmp(data, sSnapshotMagic, sizeof(sSnapshotMagic)) != 0 || data[3] != sSnapshotVersion ||
+		!deriveSnapshotKey(mSnapshotKey, data + 4, key) ||
+		!snapshotCipher(false, key, data + 4 + sSaltSize, data + sSnapshotHeaderSize, size - sSnapshotHeaderSize,
+						plain.data(), tag)) {
+		LOGE("Cannot decrypt credentials cache snapshot %s: bad format or key", mSnapshotFile.c_str());
+		munmap(map, size);
+		return;
+	}
+	munmap(map, size);
+
+	size_t len = size - sSnapshotHeaderSize;
+	size_t pos = 0;
+	size_t count = 0;
+	time_t now = getCurrentTime();
+	while (pos < len) {
+		uint32_t low, high;
+		string cacheKey, pass;
+		if (!getU32(plain.data(), len, pos, low) || !getU32(plain.data(), len, pos, high) ||
+			!getString(plain.data(), len, pos, cacheKey) || !getString(plain.data(), len, pos, pass)) {
+			LOGE("Truncated credentials cache snapshot %s", mSnapshotFile.c_str());
+			break;
+		}
+		time_t expireDate = (time_t)(((uint64_t)high << 32) | low);
+		if (expireDate <= now)
+			continue;
+		CacheShard &shard = getCacheShard(cacheKey);
+		unique_lock<mutex> lck(shard.mutex);
+		insertCachedPassword(shard, cacheKey, pass, expireDate);
+		++count;
+	}
+	OPENSSL_cleanse(plain.data(), plain.size());
+	LOGI("Loaded %zu credentials from the cache snapshot %s", count, mSnapshotFile.c_str());
+}
+
+void AuthDbBackend::saveCacheSnapshot() {
+	time_t now = getCurrentTime();
+	if (mSnapshotFile.empty() || mSnapshotRunning || now - mLastSnapshot < mSnapshotInterval)
+		return;
+	mLastSnapshot = now;
+	if (mSnapshotThread.joinable())
+		mSnapshotThread.join();
+
+	// only the copy is made under the locks, the encryption and the write are left to the thread
+	string plain;
+	for (int i = 0; i < sCacheShards; ++i) {
+		CacheShard &shard = mCacheShards[i];
+		unique_lock<mutex> lck(shard.mutex);
+		for (auto it = shard.lru.begin(); it != shard.lru.end(); ++it) {
+			if (it->pass.empty() || it->expire_date <= now)
+				continue;
+			uint64_t expireDate = (uint64_t)it->expire_date;
+			putU32(plain, (uint32_t)expireDate);
+			putU32(plain, (uint32_t)(expireDate >> 32));
+			putU32(plain, it->key.size());
+			plain += it->key;
+			putU32(plain, it->pass.size());
+			plain += it->pass;
+		}
+	}
+	mSnapshotRunning = true;
+	mSnapshotThread = thread(&AuthDbBackend::writeCacheSnapshot, this, move(plain));
+}
+
+void AuthDbBackend::writeCacheSnapshot(string plain) {
+	string out(sSnapshotHeaderSize + plain.size(), '\0');
+	unsigned char *header = (unsigned char *)&out[0];
+	unsigned char key[32];
+	memcpy(header, sSnapshotMagic, sizeof(sSnapshotMagic));
+	header[3] = sSnapshotVersion;
+	bool ok = RAND_bytes(header + 4, sSaltSize + sIvSize) == 1 && deriveSnapshotKey(mSnapshotKey, header + 4, key) &&
+			  snapshotCipher(true, key, header + 4 + sSaltSize, (const unsigned char *)plain.data(), plain.size(),
+							 header + sSnapshotHeaderSize, header + 4 + sSaltSize + sIvSize);
+	OPENSSL_cleanse(&plain[0], plain.size());
+	if (!ok) {
+		LOGE("Cannot encrypt the credentials cache snapshot");
+		mSnapshotRunning = false;
+		return;
+	}
+
+	// written aside then renamed, so that a crash never leaves a truncated snapshot
+	string tmp = mSnapshotFile + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		LOGE("Cannot create credentials cache snapshot %s: %s", tmp.c_str(), strerror(errno));
+		mSnapshotRunning = false;
+		return;
+	}
+	size_t written = 0;
+	while (written < out.size()) {
+		ssize_t ret = write(fd, out.data() + written, out.size() - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += ret;
+	}
+	ok = written == out.size() && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), mSnapshotFile.c_str()) == -1) {
+		LOGE("Cannot write credentials cache snapshot %s: %s", mSnapshotFile.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+	} else {
+		LOGD("Credentials cache snapshot written to %s (%zu bytes)", mSnapshotFile.c_str(), out.size());
+	}
+	mSnapshotRunning = false;
+}
@@ -17,7 +17,10 @@
 */
 
 #include "authdb.hh"
+#include "utils/threadplacement.hh"
+#include "utils/startup.hh"
 #include "mysql/soci-mysql.h"
+#include <algorithm>
 #include <thread>
 
 using namespace soci;
@@ -56,6 +59,31 @@ void SociAuthDB::declareConfig(GenericStruct *mc) {
 		 "Example : select login, domain, phone from accounts where phone in (:phones)",
 		 ""},
 
+		{String, "soci-passwords-request",
+		 "Soci SQL request to execute to obtain the passwords of several users at once, when many password requests "
+		 "are waiting for a connection.\n"
+		 "Named parameters are:\n -':credentials' : the list of the (id, domain, authid) tuples to search for.\n"
+		 "The request must select the id, domain, authid and password columns, in this order.\n"
+		 "Example : select id, domain, authid, password from accounts where (id, domain, authid) in (:credentials)\n"
+		 "When empty, the passwords are requested one by one with soci-password-request.",
+		 ""},
+
+		{String, "soci-prefetch-request",
+		 "Soci SQL request to execute to obtain the credentials of all the accounts of a domain listed in "
+		 "cache-prefetch-domains, at startup. The rows are read as they arrive.\n"
+		 "Named parameters are:\n -':domain' : the domain.\n"
+		 "The request must select the id, authid and password columns, in this order.\n"
+		 "Example : select id, authid, password from accounts where domain = :domain",
+		 ""},
+
+		{Integer, "soci-passwords-batch-size", "Maximum number of users whose passwords are requested at once.",
+		 "50"},
+
+		{Integer, "soci-users-with-phones-batch-size",
+		 "Maximum number of phones requested at once with soci-users-with-phones-request. The phones of a larger "
+		 "list are requested in several parts, in parallel, each part being delivered as soon as it is received.",
+		 "100"},
+
 		{Integer, "soci-poolsize",
 		 "Size of the pool of connections that Soci will use. We open a thread for each DB query, and this pool will "
 		 "allow each thread to get a connection.\n"
@@ -86,6 +114,12 @@ void SociAuthDB::declareConfig(GenericStruct *mc) {
 		config_item_end};
 
 	mc->addChildrenValues(items);
+
+	mc->createStat("count-soci-queued-requests", "Number of database requests waiting for a thread.");
+	mc->createStat("count-soci-threads", "Number of threads running database requests.");
+	mc->createStat("count-soci-rejected-requests", "Number of database requests refused because the queue was full.");
+	mc->createStat("soci-max-wait-ms",
+				   "Longest time a database request waited for a thread since the previous update, in milliseconds.");
 }
 
 SociAuthDB::SociAuthDB() : conn_pool(NULL) {
@@ -99,22 +133,44 @@ SociAuthDB::SociAuthDB() : conn_pool(NULL) {
 	get_password_request = ma->get<ConfigString>("soci-password-request")->read();
 	get_user_with_phone_request = ma->get<ConfigString>("soci-user-with-phone-request")->read();
 	get_users_with_phones_request = ma->get<ConfigString>("soci-users-with-phones-request")->read();
+	get_passwords_request = ma->get<ConfigString>("soci-passwords-request")->read();
+	get_prefetch_request = ma->get<ConfigString>("soci-prefetch-request")->read();
+	int batch_size = ma->get<ConfigInt>("soci-passwords-batch-size")->read();
+	max_batch_size = batch_size > 0 ? (size_t)batch_size : 1;
+	int phones_batch_size = ma->get<ConfigInt>("soci-users-with-phones-batch-size")->read();
+	max_phones_batch_size = phones_batch_size > 0 ? (size_t)phones_batch_size : 1;
 	unsigned int max_queue_size = (unsigned int)ma->get<ConfigInt>("soci-max-queue-size")->read();
+	mCountQueued = ma->get<StatCounter64>("count-soci-queued-requests");
+	mCountThreads = ma->get<StatCounter64>("count-soci-threads");
+	mCountRejected = ma->get<StatCounter64>("count-soci-rejected-requests");
+	mMaxWaitMs = ma->get<StatCounter64>("soci-max-wait-ms");
 
 	conn_pool = new connection_pool(poolSize);
-	thread_pool = new ThreadPool(poolSize, max_queue_size);
+	// the threads beyond a quarter of the connections are only started when the requests pile up
+	thread_pool = new ThreadPool(max((size_t)1, poolSize / 4), poolSize, max_queue_size,
+								 []() { ThreadPlacement::placeCurrentThread(ThreadPlacement::Db); });
 
 	LOGD("[SOCI] Authentication provider for backend %s created. Pooled for %d connections", backend.c_str(), (int)poolSize);
 
-	try {
-		for (size_t i = 0; i < poolSize; i++) {
-			conn_pool->at(i).open(backend, connection_string);
-		}
-	} catch (soci::mysql_soci_error const & e) {
-		SLOGE << "[SOCI] connection pool open MySQL error: " << e.err_num_ << " " << e.what() << endl;
-	} catch (exception const &e) {
-		SLOGE << "[SOCI] connection pool open error: " << e.what() << endl;
+	// The connections are opened in parallel in the background, the main loop handling the requests meanwhile: they
+	// are leased until opened, so that the lookups wait for them.
+	for (size_t i = 0; i < poolSize; i++) {
+		conn_pool->lease(); // all free: leased in their order
 	}
+	Startup::get()->background("authentication database", [this]() {
+		ThreadPlacement::placeCurrentThread(ThreadPlacement::Db);
+		Startup::parallel(poolSize, [this](size_t i) {
+			try {
+				conn_pool->at(i).open(backend, connection_string);
+			} catch (soci::mysql_soci_error const &e) {
+				SLOGE << "[SOCI] connection pool open MySQL error: " << e.err_num_ << " " << e.what() << endl;
+			} catch (exception const &e) {
+				SLOGE << "[SOCI] connection pool open error: " << e.what() << endl;
+			}
+			// a connection failing to open is reconnected by the lookup using it
+			conn_pool->give_back(i);
+		});
+	});
 }
 
 SociAuthDB::~SociAuthDB() {
@@ -137,11 +193,10 @@ void SociAuthDB::reconnectSession(soci::session &session) {
 
 #define DURATION_MS(start, stop) (unsigned long) duration_cast<milliseconds>((stop) - (start)).count()
 
-void SociAuthDB::getPasswordWithPool(const std::string &id, const std::string &domain,
-									 const std::string &authid, AuthDbListener *listener) {
+AuthDbResult SociAuthDB::getPasswordWithPool(const std::string &id, const std::string &domain,
+											 const std::string &authid, std::string &pass) {
 	steady_clock::time_point start;
 	steady_clock::time_point stop;
-	std::string pass;
 	session *sql = NULL;
 	int errorCount = 0;
 	bool retry = false;
@@ -162,9 +217,6 @@ void SociAuthDB::getPasswordWithPool(const std::string &id, const std::string &d
 			stop = steady_clock::now();
 			SLOGD << "[SOCI] Got pass for " << id << " in " << DURATION_MS(start, stop) << "ms";
 			cachePassword(createPasswordKey(id, authid), domain, pass, mCacheExpire);
-			if (listener){
-				listener->onResult(pass.empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND, pass);
-			}
 			errorCount = 0;
 		} catch (mysql_soci_error const &e) {
 			errorCount++;
@@ -189,13 +241,187 @@ void SociAuthDB::getPasswordWithPool(const std::string &id, const std::string &d
 			if (sql) reconnectSession(*sql);
 		}
 		if (sql) delete sql;
+		sql = NULL;
 		if (!retry){
-			if (errorCount){
-				if (listener) listener->onResult(AUTH_ERROR, pass);
-			}
 			break;
 		}
 	}
+	if (errorCount)
+		return AUTH_ERROR;
+	return pass.empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND;
+}
+
+static string pendingPasswordKey(const string &id, const string &domain, const string &authid) {
+	return id + '\n' + domain + '\n' + authid;
+}
+
+/* The credentials come from the SIP messages: only those which cannot end a quoted SQL string are batched, the others
+ * are requested with bound parameters. */
+static bool isBatchable(const string &value) {
+	for (auto c : value) {
+		if (c == '\'' || c == '\\' || (unsigned char)c < 0x20)
+			return false;
+	}
+	return true;
+}
+
+/* Fills passwords, by pending password key, with the rows of the batch request. */
+bool SociAuthDB::getPasswordsWithPool(const vector<PendingPassword> &creds, map<string, string> &passwords) {
+	steady_clock::time_point start;
+	steady_clock::time_point stop;
+	std::ostringstream in;
+	session *sql = NULL;
+	bool ok = false;
+	for (auto it = creds.begin(); it != creds.end(); ++it) {
+		in << (it == creds.begin() ? "" : ",") << "('" << it->id << "','" << it->domain << "','" << it->authid << "')";
+	}
+
+	string s = get_passwords_request;
+	size_t index = s.find(":credentials");
+	while (index != string::npos) {
+		s = s.replace(index, 12, in.str());
+		index = s.find(":credentials");
+	}
+
+	try {
+		start = steady_clock::now();
+		// will grab a connection from the pool. This is thread safe
+		sql = new session(*conn_pool); //this may raise a soci_error exception, so keep it in the try block.
+
+		stop = steady_clock::now();
+
+		SLOGD << "[SOCI] Pool acquired in " << DURATION_MS(start, stop) << "ms";
+		start = stop;
+		rowset<row> ret = (sql->prepare << s);
+		for (rowset<row>::const_iterator it = ret.begin(); it != ret.end(); ++it) {
+			row const& row = *it;
+			passwords[pendingPasswordKey(row.get<string>(0), row.get<string>(1), row.get<string>(2))] = row.get<string>(3);
+		}
+		stop = steady_clock::now();
+		SLOGD << "[SOCI] Got " << passwords.size() << " passwords for " << creds.size() << " users in "
+			  << DURATION_MS(start, stop) << "ms";
+		ok = true;
+	} catch (mysql_soci_error const &e) {
+		stop = steady_clock::now();
+		SLOGE << "[SOCI] getPasswordsWithPool MySQL error after " << DURATION_MS(start, stop) << "ms : " << e.err_num_ << " " << e.what();
+		if (sql) reconnectSession(*sql);
+	} catch (exception const &e) {
+		stop = steady_clock::now();
+		SLOGE << "[SOCI] getPasswordsWithPool error after " << DURATION_MS(start, stop) << "ms : " << e.what();
+		if (sql) reconnectSession(*sql);
+	}
+	if (sql) delete sql;
+	return ok;
+}
+
+void SociAuthDB::prefetchDomainWithPool(const std::string &domain) {
+	steady_clock::time_point start;
+	steady_clock::time_point stop;
+	session *sql = NULL;
+	size_t count = 0;
+
+	try {
+		start = steady_clock::now();
+		// will grab a connection from the pool. This is thread safe
+		sql = new session(*conn_pool); //this may raise a soci_error exception, so keep it in the try block.
+		rowset<row> ret = (sql->prepare << get_prefetch_request, use(domain, "domain"));
+		for (rowset<row>::const_iterator it = ret.begin(); it != ret.end(); ++it) {
+			row const& row = *it;
+			cachePassword(createPasswordKey(row.get<string>(0), row.get<string>(1)), domain, row.get<string>(2),
+						  mCacheExpire);
+			++count;
+		}
+		stop = steady_clock::now();
+		SLOGI << "[SOCI] Prefetched " << count << " credentials of " << domain << " in " << DURATION_MS(start, stop) << "ms";
+	} catch (mysql_soci_error const &e) {
+		stop = steady_clock::now();
+		SLOGE << "[SOCI] prefetchDomainWithPool MySQL error after " << DURATION_MS(start, stop) << "ms : " << e.err_num_ << " " << e.what();
+		if (sql) reconnectSession(*sql);
+	} catch (exception const &e) {
+		stop = steady_clock::now();
+		SLOGE << "[SOCI] prefetchDomainWithPool error after " << DURATION_MS(start, stop) << "ms : " << e.what();
+		if (sql) reconnectSession(*sql);
+	}
+	if (sql) delete sql;
+}
+
+/* Answers all the requests waiting for the credentials of the key. */
+void SociAuthDB::notifyPassword(const string &key, AuthDbResult result, const string &pass) {
+	list<AuthDbListener *> listeners;
+	{
+		unique_lock<mutex> lock(pending_mutex);
+		auto it = pending_passwords.find(key);
+		if (it == pending_passwords.end())
+			return;
+		listeners.swap(it->second.listeners);
+		pending_passwords.erase(it);
+	}
+	for (auto it = listeners.begin(); it != listeners.end(); ++it) {
+		(*it)->onResult(result, pass);
+	}
+}
+
+/* Run by the workers of the pool: takes the lookups queued so far, which were left waiting for a connection, and
+ * requests them together. When the pool keeps up, each batch has a single user. */
+void SociAuthDB::processPasswordBatch() {
+	vector<PendingPassword> batch;
+	vector<PendingPassword> single;
+	{
+		unique_lock<mutex> lock(pending_mutex);
+		while (!queued_passwords.empty() && batch.size() < max_batch_size) {
+			auto it = pending_passwords.find(queued_passwords.front());
+			queued_passwords.pop_front();
+			if (it == pending_passwords.end())
+				continue;
+			PendingPassword cred{it->second.id, it->second.domain, it->second.authid, {}};
+			if (!get_passwords_request.empty() && isBatchable(cred.id) && isBatchable(cred.domain) &&
+				isBatchable(cred.authid))
+				batch.push_back(cred);
+			else
+				single.push_back(cred);
+		}
+	}
+	if (batch.size() == 1) {
+		single.push_back(batch.front());
+		batch.clear();
+	}
+
+	if (!batch.empty()) {
+		map<string, string> passwords;
+		bool ok = getPasswordsWithPool(batch, passwords);
+		set<string> foldedKeys;
+		for (auto it = passwords.begin(); it != passwords.end(); ++it) {
+			string folded = it->first;
+			transform(folded.begin(), folded.end(), folded.begin(), ::tolower);
+			foldedKeys.insert(folded);
+		}
+		for (auto it = batch.begin(); it != batch.end(); ++it) {
+			string key = pendingPasswordKey(it->id, it->domain, it->authid);
+			auto found = passwords.find(key);
+			if (!ok) {
+				notifyPassword(key, AUTH_ERROR, "");
+			} else if (found != passwords.end()) {
+				cachePassword(createPasswordKey(it->id, it->authid), it->domain, found->second, mCacheExpire);
+				notifyPassword(key, found->second.empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND, found->second);
+			} else {
+				string folded = key;
+				transform(folded.begin(), folded.end(), folded.begin(), ::tolower);
+				if (foldedKeys.count(folded)) {
+					// the database matched with another case than the one of the request, let it decide alone
+					single.push_back(*it);
+					continue;
+				}
+				cachePassword(createPasswordKey(it->id, it->authid), it->domain, "", mCacheExpire);
+				notifyPassword(key, PASSWORD_NOT_FOUND, "");
+			}
+		}
+	}
+
+	for (auto it = single.begin(); it != single.end(); ++it) {
+		string pass;
+		AuthDbResult result = getPasswordWithPool(it->id, it->domain, it->authid, pass);
+		notifyPassword(pendingPasswordKey(it->id, it->domain, it->authid), result, pass);
+	}
 }
 
 void SociAuthDB::getUserWithPhoneWithPool(const std::string &phone, const std::string &domain, AuthDbListener *listener) {
@@ -232,6 +458,8 @@ void SociAuthDB::getUserWithPhoneWithPool(const std::string &phone, const std::s
 		if (!user.empty())  {
 			SLOGD << "[SOCI] Got user for " << phone << " in " << DURATION_MS(start, stop) << "ms";
 			cacheUserWithPhone(phone, domain, user);
+		} else {
+			cacheUnknownPhone(phone, domain);
 		}
 		if (listener){
 			listener->onResult(user.empty() ? PASSWORD_NOT_FOUND : PASSWORD_FOUND, user);
@@ -305,6 +533,10 @@ void SociAuthDB::getUsersWithPhonesWithPool(list<tuple<std::string,std::string,A
 			}
 		}
 
+		for (auto it = creds.begin(); it != creds.end(); ++it) {
+			if (users.find(std::get<0>(*it)) == users.end())
+				cacheUnknownPhone(std::get<0>(*it), std::get<1>(*it));
+		}
 		if (listener){
 			listener->onResults(phones, users);
 		}
@@ -330,19 +562,62 @@ void SociAuthDB::getUsersWithPhonesWithPool(list<tuple<std::string,std::string,A
 
 void SociAuthDB::getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener) {
+	string key = pendingPasswordKey(id, domain, authid);
+	{
+		unique_lock<mutex> lock(pending_mutex);
+		auto it = pending_passwords.find(key);
+		if (it != pending_passwords.end()) {
+			// the same credentials are already being looked up, they will answer this one too
+			if (listener)
+				it->second.listeners.push_back(listener);
+			return;
+		}
+		PendingPassword &pending = pending_passwords[key];
+		pending.id = id;
+		pending.domain = domain;
+		pending.authid = authid;
+		if (listener)
+			pending.listeners.push_back(listener);
+		queued_passwords.push_back(key);
+	}
 
-	// create a thread to grab a pool connection and use it to retrieve the auth information
-	auto func = bind(&SociAuthDB::getPasswordWithPool, this, id, domain, authid, listener);
+	// each lookup queues a worker, which takes all the lookups queued meanwhile if it had to wait for a thread
+	auto func = bind(&SociAuthDB::processPasswordBatch, this);
 
-	bool success = thread_pool->Enqueue(func);
+	bool success = thread_pool->Enqueue(func, ThreadPool::High);
 	if (success == FALSE) {
 		// Enqueue() can fail when the queue is full, so we have to act on that
 		SLOGE << "[SOCI] Auth queue is full, cannot fullfil password request for " << id << " / " << domain << " / "
 			  << authid;
-		if (listener) listener->onResult(AUTH_ERROR, "");
+		{
+			unique_lock<mutex> lock(pending_mutex);
+			auto it = find(queued_passwords.begin(), queued_passwords.end(), key);
+			if (it != queued_passwords.end())
+				queued_passwords.erase(it);
+		}
+		notifyPassword(key, AUTH_ERROR, "");
+	}
+}
+
+void SociAuthDB::prefetchDomain(const std::string &domain) {
+	if (get_prefetch_request.empty()) {
+		SLOGE << "[SOCI] soci-prefetch-request is empty, cannot prefetch the credentials of " << domain;
+		return;
+	}
+	if (!thread_pool->Enqueue(bind(&SociAuthDB::prefetchDomainWithPool, this, domain), ThreadPool::Low)) {
+		SLOGE << "[SOCI] Auth queue is full, cannot prefetch the credentials of " << domain;
 	}
 }
 
+void SociAuthDB::updateStats() {
+	AuthDbBackend::updateStats();
+	ThreadPool::Metrics metrics = thread_pool->getMetrics();
+	mCountQueued->set(metrics.queued);
+	mCountThreads->set(metrics.threads);
+	mCountRejected->set(metrics.rejected);
+	mMaxWaitMs->set(metrics.maxWaitMs);
+}
+
 void SociAuthDB::getUserWithPhoneFromBackend(const string &phone, const string &domain, AuthDbListener *listener) {
 
 	// create a thread to grab a pool connection and use it to retrieve the auth information
@@ -357,14 +632,35 @@ void SociAuthDB::getUserWithPhoneFromBackend(const string &phone, const string &
 }
 
 void SociAuthDB::getUsersWithPhonesFromBackend(list<tuple<std::string,std::string,AuthDbListener*>> &creds, AuthDbListener *listener) {
-	
-	// create a thread to grab a pool connection and use it to retrieve the auth information
-	auto func = bind(&SociAuthDB::getUsersWithPhonesWithPool, this, creds, listener);
-	
-	bool success = thread_pool->Enqueue(func);
-	if (success == FALSE) {
-		// Enqueue() can fail when the queue is full, so we have to act on that
-		SLOGE << "[SOCI] Auth queue is full, cannot fullfil user request for " << &creds;
-		if (listener) listener->onResult(AUTH_ERROR, "");
+	list<tuple<std::string,std::string,AuthDbListener*>> part;
+	list<std::string> rejected;
+	auto enqueuePart = [&]() {
+		// create a thread to grab a pool connection and use it to retrieve the auth information
+		auto func = bind(&SociAuthDB::getUsersWithPhonesWithPool, this, part, listener);
+
+		bool success = thread_pool->Enqueue(func);
+		if (success == FALSE) {
+			// Enqueue() can fail when the queue is full, so we have to act on that
+			SLOGE << "[SOCI] Auth queue is full, cannot fullfil user request for " << part.size() << " phones";
+			for (auto cred = part.begin(); cred != part.end(); ++cred)
+				rejected.push_back(std::get<0>(*cred));
+		}
+		part.clear();
+	};
+	for (auto it = creds.begin(); it != creds.end(); ++it) {
+		// the phones are inserted in the request as quoted strings
+		if (!isBatchable(std::get<0>(*it))) {
+			rejected.push_back(std::get<0>(*it));
+			continue;
+		}
+		part.push_back(*it);
+		if (part.size() >= max_phones_batch_size)
+			enqueuePart();
+	}
+	if (!part.empty())
+		enqueuePart();
+	if (!rejected.empty() && listener) {
+		set<std::string> users;
+		listener->onResults(rejected, users);
 	}
 }
@@ -17,6 +17,7 @@
 */
 
 #include "authdb.hh"
+#include "authdigest.hh"
 
 using namespace std;
 
@@ -29,6 +30,25 @@ void AuthDbListener::onResults(list<std::string> &phones, set<std::string> &user
 
 }
 
+/* Reports the result of the lookup of one phone of a batch to the listener of the batch. */
+class PhoneResultForwarder : public AuthDbListener {
+  public:
+	PhoneResultForwarder(const string &phone, AuthDbListener *listener) : mPhone(phone), mListener(listener) {
+	}
+	virtual void onResult(AuthDbResult result, const string &user) {
+		list<string> phones(1, mPhone);
+		set<string> users;
+		if (result == PASSWORD_FOUND)
+			users.insert(mPhone);
+		mListener->onResults(phones, users);
+		delete this;
+	}
+
+  private:
+	string mPhone;
+	AuthDbListener *mListener;
+};
+
 class FixedAuthDb : public AuthDbBackend {
   public:
 	FixedAuthDb() {
@@ -53,6 +73,8 @@ AuthDbBackend *AuthDbBackend::get() {
 			sUnique = new FixedAuthDb();
 		} else if (impl == "file") {
 			sUnique = new FileAuthDb();
+		} else if (impl == "http") {
+			sUnique = new HttpAuthDb();
 #if ENABLE_ODBC
 		} else if (impl == "odbc") {
 			sUnique = new OdbcAuthDb();
@@ -67,19 +89,87 @@ AuthDbBackend *AuthDbBackend::get() {
 	return sUnique;
 }
 
-AuthDbBackend::AuthDbBackend() {
+/* Approximate memory used by a cache entry besides its strings: list node, index node and bucket. */
+static const size_t sCachedPasswordOverhead = 160;
+
+AuthDbBackend::AuthDbBackend()
+	: mCacheHits(0), mCacheNegativeHits(0), mCacheMisses(0), mCacheEvictions(0), mUnknownPhonesPurgeDate(0) {
 	GenericStruct *cr = GenericManager::get()->getRoot();
 	GenericStruct *ma = cr->get<GenericStruct>("module::Authentication");
 	list<string> domains = ma->get<ConfigStringList>("auth-domains")->read();
 	mCacheExpire = ma->get<ConfigInt>("cache-expire")->read();
+	mNegativeCacheExpire = ma->get<ConfigInt>("cache-negative-expire")->read();
+	int maxMemory = ma->get<ConfigInt>("cache-max-memory")->read();
+	mCacheMaxMemory = maxMemory > 0 ? (size_t)maxMemory * 1024 / sCacheShards : 0;
+	mCountCacheHits = ma->get<StatCounter64>("count-password-cache-hits");
+	mCountCacheNegativeHits = ma->get<StatCounter64>("count-password-cache-negative-hits");
+	mCountCacheMisses = ma->get<StatCounter64>("count-password-cache-misses");
+	mCountCacheEvictions = ma->get<StatCounter64>("count-password-cache-evictions");
+	mCountCacheEntries = ma->get<StatCounter64>("count-password-cache-entries");
+
+	mHashCachedPasswords = ma->get<ConfigBoolean>("hash-cached-passwords")->read() &&
+						   !ma->get<ConfigBoolean>("hashed-passwords")->read();
+
+	mSnapshotFile = ma->get<ConfigString>("cache-snapshot-file")->read();
+	mSnapshotKey = ma->get<ConfigString>("cache-snapshot-key")->read();
+	mSnapshotInterval = ma->get<ConfigInt>("cache-snapshot-interval")->read();
+	mLastSnapshot = getCurrentTime();
+	mSnapshotRunning = false;
+	if (!mSnapshotFile.empty() && mSnapshotKey.empty()) {
+		LOGE("cache-snapshot-key is empty, the credentials cache snapshot is disabled.");
+		mSnapshotFile.clear();
+	}
+	if (!mSnapshotFile.empty())
+		loadCacheSnapshot();
 }
 
 AuthDbBackend::~AuthDbBackend() {
+	if (mSnapshotThread.joinable())
+		mSnapshotThread.join();
+}
+
+void AuthDbBackend::prefetchDomain(const std::string &domain) {
+	LOGW("The authentication backend can't prefetch the credentials of %s", domain.c_str());
 }
 
 void AuthDbBackend::declareConfig(GenericStruct *mc) {
+	ConfigItemDescriptor items[] = {
+		{Integer, "cache-negative-expire",
+		 "Duration of the caching of the users not found in the database, in seconds, so that repeated attempts with "
+		 "unknown users do not reach it. 0 disables the caching of unknown users.",
+		 "60"},
+		{Integer, "cache-max-memory",
+		 "Maximum memory used by the credentials cache, in kilobytes. The least recently used credentials are "
+		 "dropped beyond. 0 means unlimited.",
+		 "65536"},
+		{String, "cache-snapshot-file",
+		 "File where the credentials cache is saved periodically, encrypted, and reloaded from at startup, so that "
+		 "the database is not asked for the credentials of all the clients registering again after a restart. "
+		 "Empty disables the snapshot.",
+		 ""},
+		{String, "cache-snapshot-key", "Passphrase from which the encryption key of the snapshot is derived.", ""},
+		{Integer, "cache-snapshot-interval", "Interval between two snapshots of the credentials cache, in seconds.",
+		 "300"},
+		{Boolean, "hash-cached-passwords",
+		 "Keep the MD5 and SHA-256 HA1 of the clear text passwords in the credentials cache instead of the passwords, "
+		 "the domain being the realm. Ignored with hashed-passwords.",
+		 "false"},
+		{StringList, "cache-prefetch-domains",
+		 "List of whitespace separated domains of which all the credentials are loaded in the cache at startup, "
+		 "with a single request (soci backend only, see soci-prefetch-request).",
+		 ""},
+		config_item_end};
+	mc->addChildrenValues(items);
+
+	mc->createStat("count-password-cache-hits", "Number of passwords found in the cache.");
+	mc->createStat("count-password-cache-negative-hits", "Number of users known from the cache to not exist.");
+	mc->createStat("count-password-cache-misses", "Number of passwords not found in the cache.");
+	mc->createStat("count-password-cache-evictions",
+				   "Number of passwords dropped from the cache to keep it under cache-max-memory.");
+	mc->createStat("count-password-cache-entries", "Number of entries in the password cache.");
 
 	FileAuthDb::declareConfig(mc);
+	HttpAuthDb::declareConfig(mc);
 #if ENABLE_ODBC
 	OdbcAuthDb::declareConfig(mc);
 #endif
@@ -94,43 +184,105 @@ string AuthDbBackend::createPasswordKey(const string &user, const string &auth_u
 	return key.str();
 }
 
+AuthDbBackend::CacheShard &AuthDbBackend::getCacheShard(const string &key) {
+	return mCacheShards[hash<string>()(key) % sCacheShards];
+}
+
+void AuthDbBackend::eraseCachedPassword(CacheShard &shard, CacheLru::iterator it) {
+	shard.memory -= it->key.size() + it->pass.size() + sCachedPasswordOverhead;
+	shard.index.erase(it->key);
+	shard.lru.erase(it);
+}
+
 AuthDbBackend::CacheResult AuthDbBackend::getCachedPassword(const string &key, const string &domain, string &pass) {
 	time_t now = getCurrentTime();
-	auto &passwords = mCachedPasswords[domain];
-	unique_lock<mutex> lck(mCachedPasswordMutex);
-	auto it = passwords.find(key);
-	if (it != passwords.end()) {
-		pass.assign(it->second.pass);
-		if (now < it->second.expire_date) {
+	string cacheKey = domain + '\n' + key;
+	CacheShard &shard = getCacheShard(cacheKey);
+	unique_lock<mutex> lck(shard.mutex);
+	auto it = shard.index.find(cacheKey);
+	if (it != shard.index.end()) {
+		pass.assign(it->second->pass);
+		if (now < it->second->expire_date) {
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			if (pass.empty())
+				++mCacheNegativeHits;
+			else
+				++mCacheHits;
 			return VALID_PASS_FOUND;
 		} else {
-			passwords.erase(it);
+			eraseCachedPassword(shard, it->second);
+			++mCacheMisses;
 			return EXPIRED_PASS_FOUND;
 		}
 	}
+	++mCacheMisses;
 	return NO_PASS_FOUND;
 }
 
 void AuthDbBackend::clearCache() {
-	mCachedPasswords.clear();
+	for (int i = 0; i < sCacheShards; ++i) {
+		CacheShard &shard = mCacheShards[i];
+		unique_lock<mutex> lck(shard.mutex);
+		shard.index.clear();
+		shard.lru.clear();
+		shard.memory = 0;
+	}
 }
 
+/* An empty password records that the user does not exist, for cache-negative-expire. */
 bool AuthDbBackend::cachePassword(const string &key, const string &domain, const string &pass, int expires) {
 	time_t now = getCurrentTime();
-	map<string, CachedPassword> &passwords = mCachedPasswords[domain];
-	unique_lock<mutex> lck(mCachedPasswordMutex);
-	map<string, CachedPassword>::iterator it = passwords.find(key);
+	string cacheKey = domain + '\n' + key;
+	CacheShard &shard = getCacheShard(cacheKey);
 	if (expires == -1)
 		expires = mCacheExpire;
-	if (it != passwords.end()) {
-		it->second.pass = pass;
-		it->second.expire_date = now + expires;
-	} else {
-		passwords.insert(make_pair(key, CachedPassword(pass, now + expires)));
+	if (pass.empty())
+		expires = min(expires, mNegativeCacheExpire);
+	unique_lock<mutex> lck(shard.mutex);
+	if (expires <= 0) {
+		auto it = shard.index.find(cacheKey);
+		if (it != shard.index.end())
+			eraseCachedPassword(shard, it->second);
+		return false;
+	}
+	if (mHashCachedPasswords && !pass.empty() && !AuthDigest::isHashedCredentials(pass)) {
+		// the key is user#auth_username, sip user names having no '#'
+		string authUsername = key.substr(key.find('#') + 1);
+		insertCachedPassword(shard, cacheKey, AuthDigest::hashCredentials(authUsername, domain, pass), now + expires);
+		return true;
 	}
+	insertCachedPassword(shard, cacheKey, pass, now + expires);
 	return true;
 }
 
+/* Called with the lock of the shard held. */
+void AuthDbBackend::insertCachedPassword(CacheShard &shard, const string &cacheKey, const string &pass,
+										 time_t expireDate) {
+	auto it = shard.index.find(cacheKey);
+	if (it != shard.index.end())
+		eraseCachedPassword(shard, it->second);
+	shard.lru.push_front(CachedPassword(cacheKey, pass, expireDate));
+	shard.index[cacheKey] = shard.lru.begin();
+	shard.memory += cacheKey.size() + pass.size() + sCachedPasswordOverhead;
+	while (mCacheMaxMemory > 0 && shard.memory > mCacheMaxMemory && shard.lru.size() > 1) {
+		eraseCachedPassword(shard, prev(shard.lru.end()));
+		++mCacheEvictions;
+	}
+}
+
+void AuthDbBackend::updateStats() {
+	uint64_t entries = 0;
+	for (int i = 0; i < sCacheShards; ++i) {
+		unique_lock<mutex> lck(mCacheShards[i].mutex);
+		entries += mCacheShards[i].lru.size();
+	}
+	mCountCacheHits->set(mCacheHits);
+	mCountCacheNegativeHits->set(mCacheNegativeHits);
+	mCountCacheMisses->set(mCacheMisses);
+	mCountCacheEvictions->set(mCacheEvictions);
+	mCountCacheEntries->set(entries);
+}
+
 bool AuthDbBackend::cacheUserWithPhone(const std::string &phone, const std::string &domain, const std::string &user) {
 	unique_lock<mutex> lck(mCachedUserWithPhoneMutex);
 
@@ -142,9 +294,30 @@ bool AuthDbBackend::cacheUserWithPhone(const std::string &phone, const std::stri
 	ostringstream ostr;
 	ostr << user << "@" << domain;
 	mPhone2User[ostr.str()] = user;
+	mUnknownPhones.erase(ostr.str());
+	if (!phone.empty())
+		mUnknownPhones.erase(phone + "@" + domain);
 	return true;
 }
 
+void AuthDbBackend::cacheUnknownPhone(const std::string &phone, const std::string &domain) {
+	if (mNegativeCacheExpire <= 0)
+		return;
+	time_t now = getCurrentTime();
+	unique_lock<mutex> lck(mCachedUserWithPhoneMutex);
+	// the expired entries are otherwise only dropped when looked up
+	if (now >= mUnknownPhonesPurgeDate) {
+		mUnknownPhonesPurgeDate = now + mNegativeCacheExpire;
+		for (auto it = mUnknownPhones.begin(); it != mUnknownPhones.end();) {
+			if (it->second <= now)
+				it = mUnknownPhones.erase(it);
+			else
+				++it;
+		}
+	}
+	mUnknownPhones[phone + "@" + domain] = now + mNegativeCacheExpire;
+}
+
 void AuthDbBackend::getPassword(const std::string &user, const std::string &host, const std::string &auth_username,
 								AuthDbListener *listener) {
 	// Check for usable cached password
@@ -191,6 +364,15 @@ AuthDbBackend::CacheResult AuthDbBackend::getCachedUserWithPhone(const string &p
 		user.assign(it->second);
 		return VALID_PASS_FOUND;
 	}
+	auto unknown = mUnknownPhones.find(phone + "@" + domain);
+	if (unknown != mUnknownPhones.end()) {
+		if (getCurrentTime() < unknown->second) {
+			user.clear();
+			return VALID_PASS_FOUND;
+		}
+		mUnknownPhones.erase(unknown);
+		return EXPIRED_PASS_FOUND;
+	}
 	return NO_PASS_FOUND;
 }
 
@@ -199,7 +381,7 @@ void AuthDbBackend::getUserWithPhone(const std::string & phone, const std::strin
 	string user;
 	switch (getCachedUserWithPhone(phone, domain, user)) {
 		case VALID_PASS_FOUND:
-			if (listener) listener->onResult(AuthDbResult::PASSWORD_FOUND, user);
+			if (listener) listener->onResult(user.empty() ? AuthDbResult::PASSWORD_NOT_FOUND : AuthDbResult::PASSWORD_FOUND, user);
 			return;
 		case EXPIRED_PASS_FOUND:
 		case NO_PASS_FOUND:
@@ -212,6 +394,8 @@ void AuthDbBackend::getUserWithPhone(const std::string & phone, const std::strin
 
 void AuthDbBackend::getUsersWithPhone(list<tuple<std::string,std::string,AuthDbListener*>> & creds, AuthDbListener *listener) {
 	list<tuple<std::string,std::string,AuthDbListener*>> needed_creds;
+	list<string> cached_phones;
+	set<string> cached_users;
 	for (tuple<std::string,std::string,AuthDbListener*> cred : creds) {
 		// Check for usable cached password
 		string user;
@@ -220,7 +404,12 @@ void AuthDbBackend::getUsersWithPhone(list<tuple<std::string,std::string,AuthDbL
 		AuthDbListener* cred_listener = std::get<2>(cred);
 		switch (getCachedUserWithPhone(phone, domain, user)) {
 			case VALID_PASS_FOUND:
-				if (cred_listener) cred_listener->onResult(AuthDbResult::PASSWORD_FOUND, user);
+				if (cred_listener) {
+					cred_listener->onResult(user.empty() ? AuthDbResult::PASSWORD_NOT_FOUND : AuthDbResult::PASSWORD_FOUND, user);
+				} else {
+					cached_phones.push_back(phone);
+					if (!user.empty()) cached_users.insert(phone);
+				}
 				break;
 			case EXPIRED_PASS_FOUND:
 			case NO_PASS_FOUND:
@@ -228,9 +417,13 @@ void AuthDbBackend::getUsersWithPhone(list<tuple<std::string,std::string,AuthDbL
 				break;
 		}
 	}
-	
+	// the cached part of the batch is delivered without waiting for the backend
+	if (!cached_phones.empty() && listener)
+		listener->onResults(cached_phones, cached_users);
+
 	// if we reach here, password wasn't cached: we have to grab the password from the actual backend
-	getUsersWithPhonesFromBackend(needed_creds, listener);
+	if (!needed_creds.empty())
+		getUsersWithPhonesFromBackend(needed_creds, listener);
 }
 
 void AuthDbBackend::getUsersWithPhonesFromBackend(list<tuple<std::string,std::string,AuthDbListener*>> &creds, AuthDbListener *listener) {
@@ -238,6 +431,8 @@ void AuthDbBackend::getUsersWithPhonesFromBackend(list<tuple<std::string,std::st
 		string phone = std::get<0>(cred);
 		string domain = std::get<1>(cred);
 		AuthDbListener* l = std::get<2>(cred);
+		if (!l && listener)
+			l = new PhoneResultForwarder(phone, listener);
 		getUserWithPhoneFromBackend(phone,domain, l);
 	}
 }
@@ -19,8 +19,12 @@
 #ifndef _AUTHDB_HH_
 #define _AUTHDB_HH_
 
+#include <atomic>
+#include <list>
+#include <memory>
 #include <string>
 #include <mutex>
+#include <unordered_map>
 
 #include "common.hh"
 #include "agent.hh"
@@ -33,6 +37,7 @@
 #include <sqlext.h>
 #endif
 
+#include <deque>
 #include <map>
 #include <set>
 #include <thread>
@@ -40,6 +45,8 @@
 #include "sofia-sip/auth_module.h"
 #include "sofia-sip/auth_plugin.h"
 
+#include <openssl/ssl.h>
+
 enum AuthDbResult { PENDING, PASSWORD_FOUND, PASSWORD_NOT_FOUND, AUTH_ERROR };
 
 // Fw declaration
@@ -56,17 +63,54 @@ class AuthDbBackend {
 	static AuthDbBackend *sUnique;
 
 	struct CachedPassword {
+		std::string key; // domain and password key
 		std::string pass;
 		time_t expire_date;
-		CachedPassword(const std::string &ipass, time_t idate) : pass(ipass), expire_date(idate) {
+		CachedPassword(const std::string &ikey, const std::string &ipass, time_t idate)
+			: key(ikey), pass(ipass), expire_date(idate) {
+		}
+	};
+	typedef std::list<CachedPassword> CacheLru;
+	/* The cache is split in independently locked LRU lists, so that the lookups of the main thread and of the
+	 * backend threads seldom wait for each other. */
+	struct CacheShard {
+		std::mutex mutex;
+		CacheLru lru; // most recently used first
+		std::unordered_map<std::string, CacheLru::iterator> index;
+		size_t memory;
+		CacheShard() : memory(0) {
 		}
 	};
+	static const int sCacheShards = 16;
 
 	private:
-	std::map<std::string, std::map<std::string, CachedPassword>> mCachedPasswords;
-	std::mutex mCachedPasswordMutex;
+	CacheShard &getCacheShard(const std::string &key);
+	void eraseCachedPassword(CacheShard &shard, CacheLru::iterator it);
+	void insertCachedPassword(CacheShard &shard, const std::string &cacheKey, const std::string &pass,
+							  time_t expireDate);
+	void loadCacheSnapshot();
+	void writeCacheSnapshot(std::string plain);
+
+	CacheShard mCacheShards[sCacheShards];
+	std::atomic<uint64_t> mCacheHits;
+	std::atomic<uint64_t> mCacheNegativeHits;
+	std::atomic<uint64_t> mCacheMisses;
+	std::atomic<uint64_t> mCacheEvictions;
+	StatCounter64 *mCountCacheHits;
+	StatCounter64 *mCountCacheNegativeHits;
+	StatCounter64 *mCountCacheMisses;
+	StatCounter64 *mCountCacheEvictions;
+	StatCounter64 *mCountCacheEntries;
+	std::string mSnapshotFile;
+	std::string mSnapshotKey;
+	int mSnapshotInterval;
+	time_t mLastSnapshot;
+	std::thread mSnapshotThread;
+	std::atomic<bool> mSnapshotRunning;
 	std::mutex mCachedUserWithPhoneMutex;
 	std::map<std::string, std::string> mPhone2User;
+	std::unordered_map<std::string, time_t> mUnknownPhones; // phones without user, until the expire date
+	time_t mUnknownPhonesPurgeDate;
 
   protected:
 	AuthDbBackend();
@@ -74,41 +118,82 @@ class AuthDbBackend {
 	std::string createPasswordKey(const std::string &user, const std::string &auth);
 	bool cachePassword(const std::string &key, const std::string &domain, const std::string &pass, int expires);
 	bool cacheUserWithPhone(const std::string &phone, const std::string &domain, const std::string &user);
+	/* Records that no user has this phone, for cache-negative-expire. */
+	void cacheUnknownPhone(const std::string &phone, const std::string &domain);
 	CacheResult getCachedPassword(const std::string &key, const std::string &domain, std::string &pass);
-	CacheResult getCachedUserWithPhone(const std::string &phone, const std::string &domain, std::string &user);
 	void createCachedAccount(const std::string & user, const std::string & domain, const std::string &auth_username, const std::string &password, int expires, const std::string & phone_alias = "");
 	void clearCache();
 	int mCacheExpire;
+	int mNegativeCacheExpire; // for the users not found, 0 to not cache them
+	size_t mCacheMaxMemory; // per shard, 0 for unlimited
+	bool mHashCachedPasswords; // the HA1s of the passwords are cached instead of the passwords
   public:
 	virtual ~AuthDbBackend();
 	// warning: listener may be invoked on authdb backend thread, so listener must be threadsafe somehow!
 	void getPassword(const std::string & user, const std::string & domain, const std::string &auth_username, AuthDbListener *listener);
 	void getUserWithPhone(const std::string &phone, const std::string &domain, AuthDbListener *listener);
+	/*
+	 * The creds without listener are reported to the listener of the batch with onResults(), possibly in several
+	 * calls as the parts of the batch are resolved, a phone being reported exactly once.
+	 */
 	void getUsersWithPhone(std::list<std::tuple<std::string,std::string,AuthDbListener *>> & creds, AuthDbListener *listener);
 	virtual void getUserWithPhoneFromBackend(const std::string &, const std::string &, AuthDbListener *listener) = 0;
 	virtual void getUsersWithPhonesFromBackend(std::list<std::tuple<std::string,std::string,AuthDbListener*>> &creds, AuthDbListener *listener);
+	/* An empty user with VALID_PASS_FOUND means that the phone is known to have no user. */
+	CacheResult getCachedUserWithPhone(const std::string &phone, const std::string &domain, std::string &user);
 
 	virtual void createAccount(const std::string &user, const std::string & domain, const std::string &auth_username, const std::string &password, int expires, const std::string &phone_alias = "");
 
 	virtual void getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener) = 0;
 
+	/* Copies the counters to the statistics, they are updated by several threads. */
+	virtual void updateStats();
+	/* Longest wait of a request for a thread of the backend, as of the last updateStats(), in milliseconds. */
+	virtual uint64_t getMaxWaitMs() {
+		return 0;
+	}
+	/* Writes the snapshot of the cache in the background, if enabled and due. */
+	void saveCacheSnapshot();
+	/* Loads the credentials of all the accounts of the domain in the cache, asynchronously. */
+	virtual void prefetchDomain(const std::string &domain);
+
 	static AuthDbBackend *get();
+	/* Replaces the backend of the configuration, for the tools running the modules on a backend of their own. */
+	static void set(AuthDbBackend *backend) {
+		sUnique = backend;
+	}
 	/* called by module_auth so that backends can declare their configuration to the ConfigurationManager */
 	static void declareConfig(GenericStruct *mc);
 
 };
 
+/*
+ * The accounts of a file of "user@domain password [userid [phone]]" lines, looked up in an index of the file mapped in
+ * memory instead of being loaded in the cache. The index of a new version of the file is built by a thread, then
+ * swapped with the former one, and only the lines appended since the former version are parsed when the file grew in
+ * place. The file is to be replaced by a rename rather than truncated, as its former version stays mapped.
+ */
 class FileAuthDb : public AuthDbBackend {
   private:
+	class Index;
 	std::string mFileString;
 	time_t mLastSync;
+	std::shared_ptr<const Index> mIndex; // swapped with atomic_store()
+	std::thread mLoader;
+	std::atomic<bool> mLoading;
+
+	std::shared_ptr<const Index> getIndex() const {
+		return std::atomic_load(&mIndex);
+	}
+	void load(const std::list<std::string> &domains);
 
   protected:
 	void sync();
 
   public:
 	FileAuthDb();
+	~FileAuthDb();
 	virtual void getUserWithPhoneFromBackend(const std::string &phone, const std::string & domain, AuthDbListener *listener);
 	virtual void getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener);
@@ -116,8 +201,83 @@ class FileAuthDb : public AuthDbBackend {
 	static void declareConfig(GenericStruct *mc){};
 };
 
+#include "utils/threadpool.hh"
+
+/*
+ * Credentials requested from an HTTP API of the accounts, by a pool of threads sharing keep-alive HTTP/1.1
+ * connections to it, in clear or over TLS. The lookups of the same credentials are answered by a single request, and
+ * the lookups left waiting for a thread are requested together with http-passwords-url.
+ */
+class HttpAuthDb : public AuthDbBackend {
+  public:
+	HttpAuthDb();
+	virtual ~HttpAuthDb();
+	virtual void getUserWithPhoneFromBackend(const std::string &phone, const std::string &domain,
+											 AuthDbListener *listener);
+	virtual void getPasswordFromBackend(const std::string &id, const std::string &domain, const std::string &authid,
+										AuthDbListener *listener);
+	virtual void updateStats();
+	virtual uint64_t getMaxWaitMs() {
+		return mMaxWaitMs->read();
+	}
+
+	static void declareConfig(GenericStruct *mc);
+
+  private:
+	class Connection;
+	struct Url {
+		bool secure;
+		std::string host;
+		std::string port;
+		std::string target; // path and query
+		std::string origin;
+	};
+	/* A password lookup in progress, shared by all the requests for the same credentials. */
+	struct PendingPassword {
+		std::string id;
+		std::string domain;
+		std::string authid;
+		std::list<AuthDbListener *> listeners;
+	};
+
+	/* Sends a request, and returns the status of the response, 0 when none was received. */
+	int request(const char *method, const std::string &url, const std::string &body, std::string &response);
+	std::unique_ptr<Connection> acquireConnection(const Url &url, bool &reused);
+	std::unique_ptr<Connection> openConnection(const Url &url);
+	void releaseConnection(std::unique_ptr<Connection> conn);
+	AuthDbResult getPassword(const PendingPassword &cred, std::string &pass);
+	bool getPasswords(const std::vector<PendingPassword> &creds, std::vector<std::string> &passwords);
+	void processPasswordBatch();
+	void notifyPassword(const std::string &key, AuthDbResult result, const std::string &pass);
+	void getUserWithPhoneWithPool(const std::string &phone, const std::string &domain, AuthDbListener *listener);
+
+	std::string mPasswordUrl;
+	std::string mPasswordsUrl;
+	std::string mUserWithPhoneUrl;
+	std::string mAuthorization;
+	int mTimeout;
+	size_t mMaxBatchSize;
+	SSL_CTX *mTlsContext;
+	ThreadPool *mThreadPool;
+	std::mutex mConnectionsMutex;
+	std::multimap<std::string, std::unique_ptr<Connection>> mIdleConnections; // by origin
+	std::atomic<uint64_t> mConnections;
+	std::mutex mPendingMutex;
+	std::map<std::string, PendingPassword> mPendingPasswords; // by id, domain and authid
+	std::deque<std::string> mQueuedPasswords; // pending lookups not picked by a thread yet
+	StatCounter64 *mCountQueued;
+	StatCounter64 *mCountThreads;
+	StatCounter64 *mCountRejected;
+	StatCounter64 *mCountConnections;
+	StatCounter64 *mMaxWaitMs;
+};
+
 #if ENABLE_ODBC
 
+/*
+ * Passwords requested with the odbc request, run by a pool of threads on a pool of connections prepared once. A
+ * connection found dead or broken by a link failure is replaced by a new one.
+ */
 class OdbcAuthDb : public AuthDbBackend {
 	~OdbcAuthDb();
 	const static int fieldLength = 500;
@@ -150,9 +310,27 @@ class OdbcAuthDb : public AuthDbBackend {
 	void stmtError(ConnectionCtx &ctx, const char *doing);
 	void envError(const char *doing);
 	bool execDirect;
+	size_t mPoolSize;
+	ThreadPool *mThreadPool;
+	std::mutex mConnectionsMutex;
+	std::vector<std::unique_ptr<ConnectionCtx>> mIdleConnections;
+	StatCounter64 *mCountConnections;
+	StatCounter64 *mCountBrokenConnections;
+	StatCounter64 *mCountQueued;
+	StatCounter64 *mCountRejected;
+	StatCounter64 *mMaxWaitMs;
+	std::vector<StatCounter64 *> mTimingStats; // see exportTimings()
+	std::atomic<uint64_t> mConnections;
+	std::atomic<uint64_t> mBrokenConnections;
 	bool getConnection(const std::string &id, ConnectionCtx &ctx, AuthDbTimings &timings);
-	AuthDbResult doRetrievePassword(ConnectionCtx &ctx, const std::string &user, const std::string &domain,
-									const std::string &auth, std::string &foundPassword, AuthDbTimings &timings);
+	/* An idle connection still alive, or a new one. NULL if none can be established. */
+	std::unique_ptr<ConnectionCtx> acquireConnection(const std::string &id, AuthDbTimings &timings);
+	void releaseConnection(std::unique_ptr<ConnectionCtx> ctx);
+	AuthDbResult doRetrievePassword(const std::string &user, const std::string &domain, const std::string &auth,
+									std::string &foundPassword, AuthDbTimings &timings);
+	AuthDbResult executeRequest(ConnectionCtx &ctx, const std::string &user, const std::string &domain,
+								const std::string &auth, std::string &foundPassword, AuthDbTimings &timings,
+								bool &broken);
 	void doAsyncRetrievePassword(std::string id, std::string domain, std::string auth,
 								 AuthDbListener *listener);
 
@@ -160,6 +338,10 @@ class OdbcAuthDb : public AuthDbBackend {
 	virtual void getUserWithPhoneFromBackend(const std::string &phone, const std::string &domain, AuthDbListener *listener);
 	virtual void getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener);
+	virtual void updateStats();
+	virtual uint64_t getMaxWaitMs() {
+		return mMaxWaitMs->read();
+	}
 	std::map<std::string, std::string> cachedPasswords;
 	void setExecuteDirect(const bool value);
 	bool checkConnection();
@@ -185,25 +367,53 @@ class SociAuthDB : public AuthDbBackend {
 	virtual void getUsersWithPhonesFromBackend(std::list<std::tuple<std::string,std::string,AuthDbListener*>> &creds, AuthDbListener *listener);
 	virtual void getPasswordFromBackend(const std::string &id, const std::string &domain,
 										const std::string &authid, AuthDbListener *listener);
+	virtual void prefetchDomain(const std::string &domain);
+	virtual void updateStats();
+	virtual uint64_t getMaxWaitMs() {
+		return mMaxWaitMs->read();
+	}
 
 	static void declareConfig(GenericStruct *mc);
 
   private:
+	/* A password lookup in progress, shared by all the requests for the same credentials. */
+	struct PendingPassword {
+		std::string id;
+		std::string domain;
+		std::string authid;
+		std::list<AuthDbListener *> listeners;
+	};
+
 	void getUserWithPhoneWithPool(const std::string &phone, const std::string &domain, AuthDbListener *listener);
 	void getUsersWithPhonesWithPool(std::list<std::tuple<std::string,std::string,AuthDbListener*>> &creds, AuthDbListener *listener);
-	void getPasswordWithPool(const std::string &id, const std::string &domain,
-							 const std::string &authid, AuthDbListener *listener);
+	AuthDbResult getPasswordWithPool(const std::string &id, const std::string &domain, const std::string &authid,
+									 std::string &pass);
+	bool getPasswordsWithPool(const std::vector<PendingPassword> &creds, std::map<std::string, std::string> &passwords);
+	void processPasswordBatch();
+	void notifyPassword(const std::string &key, AuthDbResult result, const std::string &pass);
+	void prefetchDomainWithPool(const std::string &domain);
 
 	void reconnectSession( soci::session &session );
 
 	size_t poolSize;
 	soci::connection_pool *conn_pool;
 	ThreadPool *thread_pool;
+	StatCounter64 *mCountQueued;
+	StatCounter64 *mCountThreads;
+	StatCounter64 *mCountRejected;
+	StatCounter64 *mMaxWaitMs;
 	std::string connection_string;
 	std::string backend;
 	std::string get_password_request;
 	std::string get_user_with_phone_request;
 	std::string get_users_with_phones_request;
+	std::string get_passwords_request;
+	std::string get_prefetch_request;
+	size_t max_batch_size;
+	size_t max_phones_batch_size;
+	std::mutex pending_mutex;
+	std::map<std::string, PendingPassword> pending_passwords; // by id, domain and authid
+	std::deque<std::string> queued_passwords; // pending lookups not picked by a worker yet
 };
 
 #endif /* ENABLE_SOCI */
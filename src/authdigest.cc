@@ -0,0 +1,119 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "authdigest.hh"
+
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+
+#include <openssl/evp.h>
+
+using namespace std;
+
+static const char *sPrefixes[] = {"md5:", "sha256:"};
+static const size_t sHexLengths[] = {32, 64};
+
+string AuthDigest::hash(Hash h, const string &data) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int size = 0;
+	EVP_Digest(data.data(), data.size(), digest, &size, h == SHA256 ? EVP_sha256() : EVP_md5(), NULL);
+	static const char *sHex = "0123456789abcdef";
+	string hex(size * 2, '0');
+	for (unsigned int i = 0; i < size; ++i) {
+		hex[2 * i] = sHex[digest[i] >> 4];
+		hex[2 * i + 1] = sHex[digest[i] & 0xf];
+	}
+	return hex;
+}
+
+string AuthDigest::ha1(Hash h, const string &user, const string &realm, const string &password) {
+	return hash(h, user + ":" + realm + ":" + password);
+}
+
+bool AuthDigest::parseAlgorithm(const char *algorithm, Hash &h, bool &sess) {
+	h = MD5;
+	sess = false;
+	if (algorithm == NULL || strcasecmp(algorithm, "MD5") == 0)
+		return true;
+	if (strcasecmp(algorithm, "MD5-sess") == 0)
+		return sess = true;
+	h = SHA256;
+	if (strcasecmp(algorithm, "SHA-256") == 0)
+		return true;
+	if (strcasecmp(algorithm, "SHA-256-sess") == 0)
+		return sess = true;
+	return false;
+}
+
+string AuthDigest::response(Hash h, const string &ha1, bool sess, const char *nonce, const char *cnonce, const char *nc,
+							bool qop, bool authInt, const char *method, const char *uri, const void *body,
+							size_t bodyLen) {
+	string a1 = sess ? hash(h, ha1 + ":" + (nonce ? nonce : "") + ":" + (cnonce ? cnonce : "")) : ha1;
+	string a2 = string(method ? method : "") + ":" + (uri ? uri : "");
+	if (authInt)
+		a2 += ":" + hash(h, string((const char *)body, body ? bodyLen : 0));
+	string data = a1 + ":" + (nonce ? nonce : "") + ":";
+	if (qop)
+		data += string(nc ? nc : "") + ":" + (cnonce ? cnonce : "") + ":" + (authInt ? "auth-int" : "auth") + ":";
+	return hash(h, data + hash(h, a2));
+}
+
+string AuthDigest::hashCredentials(const string &user, const string &realm, const string &password) {
+	return string(sPrefixes[MD5]) + ha1(MD5, user, realm, password) + "," + sPrefixes[SHA256] +
+		   ha1(SHA256, user, realm, password);
+}
+
+/* Length of the part of the stored credentials at pos for the hash, 0 if it is not one. */
+static size_t partLength(const string &stored, size_t pos, AuthDigest::Hash h) {
+	size_t prefixLength = strlen(sPrefixes[h]);
+	size_t length = prefixLength + sHexLengths[h];
+	if (stored.compare(pos, prefixLength, sPrefixes[h]) != 0 || stored.size() < pos + length)
+		return 0;
+	for (size_t i = pos + prefixLength; i < pos + length; ++i) {
+		if (!isxdigit((unsigned char)stored[i]))
+			return 0;
+	}
+	return stored.size() == pos + length || stored[pos + length] == ',' ? length : 0;
+}
+
+bool AuthDigest::isHashedCredentials(const string &stored) {
+	size_t pos = 0;
+	while (pos < stored.size()) {
+		size_t length = partLength(stored, pos, MD5);
+		if (length == 0)
+			length = partLength(stored, pos, SHA256);
+		if (length == 0)
+			return false;
+		pos += length + 1;
+	}
+	return !stored.empty();
+}
+
+string AuthDigest::storedHA1(const string &stored, Hash h) {
+	for (size_t pos = 0; pos < stored.size();) {
+		size_t length = partLength(stored, pos, h);
+		if (length != 0)
+			return stored.substr(pos + strlen(sPrefixes[h]), sHexLengths[h]);
+		size_t comma = stored.find(',', pos);
+		if (comma == string::npos)
+			break;
+		pos = comma + 1;
+	}
+	return string();
+}
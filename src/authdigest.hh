@@ -0,0 +1,51 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef authdigest_hh
+#define authdigest_hh
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Digest computations of RFC 2617 and of RFC 7616 for SHA-256 (as used by SIP since RFC 8760), on hexadecimal
+ * strings, and the stored form of precomputed HA1s: "md5:<HA1>,sha256:<HA1>", either part being optional, so that
+ * the credentials hold no clear text password and a validation costs one hash less.
+ */
+class AuthDigest {
+  public:
+	enum Hash { MD5, SHA256 };
+
+	/* Hexadecimal hash of the data. */
+	static std::string hash(Hash h, const std::string &data);
+	static std::string ha1(Hash h, const std::string &user, const std::string &realm, const std::string &password);
+	/* Hash of the algorithm parameter of the credentials, MD5 when absent. False if it is not supported. */
+	static bool parseAlgorithm(const char *algorithm, Hash &h, bool &sess);
+	/* Expected response of the credentials, qop being auth or auth-int (RFC 2069 without qop). */
+	static std::string response(Hash h, const std::string &ha1, bool sess, const char *nonce, const char *cnonce,
+								const char *nc, bool qop, bool authInt, const char *method, const char *uri,
+								const void *body, size_t bodyLen);
+
+	/* Credentials with the MD5 and SHA-256 HA1 of a clear text password. */
+	static std::string hashCredentials(const std::string &user, const std::string &realm, const std::string &password);
+	static bool isHashedCredentials(const std::string &stored);
+	/* HA1 of the stored credentials for the hash, empty if they lack it. */
+	static std::string storedHA1(const std::string &stored, Hash h);
+};
+
+#endif /* authdigest_hh */
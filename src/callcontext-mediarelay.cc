@@ -22,6 +22,7 @@
 #include "mediarelay.hh"
 #include "h264iframefilter.hh"
 #include "telephone-event-filter.hh"
+#include "video-thinning-filter.hh"
 
 using namespace std;
 
@@ -30,6 +31,9 @@ RelayedCall::RelayedCall(const shared_ptr<MediaRelayServer> &server, sip_t *sip)
 					CallContextBase(sip), mServer(server), mBandwidthThres(0) {
 	LOGD("New RelayedCall %p", this);
 	mDropTelephoneEvents=false;
+	mVideoThinning=false;
+	mThinningMaxBitrate=0;
+	mThinningLossThreshold=0;
 	mIsEstablished=false;
 	mHasSendRecvBack=false;
 	mEarlyMediaRelayCount = 0;
@@ -42,6 +46,12 @@ void RelayedCall::enableH264IFrameFiltering(int bandwidth_threshold, int decim,
 	mH264DecimOnlyIfLastProxy=onlyIfLastProxy;
 }
 
+void RelayedCall::enableVideoThinning(int maxBitrate, int lossThreshold){
+	mVideoThinning=true;
+	mThinningMaxBitrate=maxBitrate;
+	mThinningLossThreshold=lossThreshold;
+}
+
 void RelayedCall::enableTelephoneEventDrooping(bool value){
 	mDropTelephoneEvents=value;
 }
@@ -58,6 +68,9 @@ void RelayedCall::initChannels(const shared_ptr<SdpModifier> &m, const string &t
 			hasMultipleTargets = true;
 		}
 	}
+	/* the branches forked again by the next hop need their own early media, and the ICE states are per channel */
+	bool share = mServer->mModule->mShareBranchPorts &&
+		!ModuleToolbox::getCustomHeaderByName(m->mSip, "X-Target-Uris") && !hasIce(m);
 	
 	for (i = 0; mline != NULL && i < sMaxSessions; mline = mline->m_next, ++i) {
 		if (mline->m_port == 0) {
@@ -76,21 +89,51 @@ void RelayedCall::initChannels(const shared_ptr<SdpModifier> &m, const string &t
 		shared_ptr<RelayChannel> chan = s->getChannel("",trid);
 		if (chan==NULL){
 			/*this is a new outgoing branch to be established*/
-			chan=s->createBranch(trid,backRelayIps, hasMultipleTargets);
+			if (share) chan=s->createSharedBranch(trid,backRelayIps);
+			else chan=s->createBranch(trid,backRelayIps, hasMultipleTargets);
 		}
 	}
 }
 
-MasqueradeContextPair RelayedCall::getMasqueradeContexts(int mline, const std::string &offererTag, 
-							 const std::string & offeredTag, const std::string &trid){
-	if (mline >= sMaxSessions) return MasqueradeContextPair(shared_ptr<SdpMasqueradeContext>(), shared_ptr<SdpMasqueradeContext>());
-	shared_ptr<RelaySession> s = mSessions[mline];
-	if (s == NULL) {
-		return MasqueradeContextPair(shared_ptr<SdpMasqueradeContext>(), shared_ptr<SdpMasqueradeContext>());
+bool RelayedCall::hasIce(const shared_ptr<SdpModifier> &m) {
+	if (m->hasAttribute("ice-ufrag"))
+		return true;
+	for (sdp_media_t *mline = m->mSession->sdp_media; mline != NULL; mline = mline->m_next) {
+		if (m->hasMediaAttribute(mline, "ice-ufrag"))
+			return true;
+	}
+	return false;
+}
+
+SdpRelayTable RelayedCall::getRelayTable(bool isOffer, const std::string &offererTag, const std::string &offeredTag,
+										 const std::string &trid) {
+	SdpRelayTable relays(sMaxSessions);
+	for (int mline = 0; mline < sMaxSessions; ++mline) {
+		shared_ptr<RelaySession> s = mSessions[mline];
+		if (s == NULL)
+			continue;
+		// each channel is looked up once for all the uses the SDP makes of it
+		auto offerer = s->getChannel(offererTag, "");
+		auto offered = s->getChannel(offeredTag, trid);
+		auto offererBranch = s->getChannel(offererTag, trid);
+		const shared_ptr<RelayChannel> &source = isOffer ? offered : offererBranch;
+		const shared_ptr<RelayChannel> &destination = isOffer ? offererBranch : offered;
+		SdpRelayAddress &relay = relays[mline];
+		if (source) {
+			relay.relayIp = source->getLocalIp();
+			relay.relayPort = source->getLocalPort();
+		} else {
+			// the streams without channel are declined ones, which are left as is
+			LOGD("RelayedCall::getRelayTable(): no channel for mline %i", mline);
+		}
+		if (destination) {
+			relay.destIp = destination->getRemoteIp();
+			relay.destPort = destination->getRemotePort();
+		}
+		relay.contexts = MasqueradeContextPair(static_pointer_cast<SdpMasqueradeContext>(offerer),
+											   static_pointer_cast<SdpMasqueradeContext>(offered));
 	}
-	auto offerer = s->getChannel(offererTag, "");
-	auto offered = s->getChannel(offeredTag, trid);
-	return MasqueradeContextPair(static_pointer_cast<SdpMasqueradeContext>(offerer), static_pointer_cast<SdpMasqueradeContext>(offered));
+	return relays;
 }
 
 bool RelayedCall::checkMediaValid() {
@@ -101,35 +144,6 @@ bool RelayedCall::checkMediaValid() {
 	return true;
 }
 
-/* Obtain the local address and port used for relaying */
-std::pair<string,int> RelayedCall::getChannelSources(int mline, const std::string & partyTag, const std::string &trId){
-	if (mline >= sMaxSessions) {
-		return make_pair("",0);
-	}
-	shared_ptr<RelaySession> s = mSessions[mline];
-	if (s != NULL) {
-		shared_ptr<RelayChannel> chan=s->getChannel(partyTag,trId);
-		if (chan==NULL) {
-			LOGW("RelayedCall::getChannelSources(): no channel");
-		}else return make_pair(chan->getLocalIp(),chan->getLocalPort());
-	}
-	return make_pair("",0);
-}
-	
-/* Obtain destination (previously set by setChannelDestinations()*/
-std::pair<string,int> RelayedCall::getChannelDestinations(int mline, const std::string & partyTag, const std::string &trId){
-	if (mline >= sMaxSessions) {
-		return make_pair("",0);
-	}
-	shared_ptr<RelaySession> s = mSessions[mline];
-	if (s != NULL) {
-		shared_ptr<RelayChannel> chan=s->getChannel(partyTag,trId);
-		if (chan) return make_pair(chan->getRemoteIp(),chan->getRemotePort());
-	}
-	return make_pair("",0);
-}
-
-
 void RelayedCall::setChannelDestinations(const shared_ptr<SdpModifier> &m, int mline, const string &ip, int port, const string & partyTag, const string &trId, bool isEarlyMedia){
 	if (mline >= sMaxSessions) {
 		return;
@@ -152,6 +166,10 @@ void RelayedCall::setChannelDestinations(const shared_ptr<SdpModifier> &m, int m
 			LOGW("RelayedCall::setChannelDestinations(): no channel");
 			return;
 		}
+		if (!s->claimChannel(partyTag, trId)) {
+			LOGD("RelayedCall [%p]: shared channel lent to another branch than [%s]", this, trId.c_str());
+			return;
+		}
 		if(chan->getLocalPort()>0) {
 			if (isEarlyMedia){
 				int maxEarlyRelays = mServer->mModule->mMaxRelayedEarlyMedia;
@@ -208,6 +226,33 @@ time_t RelayedCall::getLastActivity() {
 	return MAX(maxtime, CallContextBase::getLastActivity());
 }
 
+bool RelayedCall::isActivityWatched() {
+	for (int i = 0; i < sMaxSessions; ++i) {
+		if (mSessions[i])
+			return true;
+	}
+	return false;
+}
+
+vector<shared_ptr<RelaySession>> RelayedCall::getSessions() const {
+	vector<shared_ptr<RelaySession>> sessions;
+	for (int i = 0; i < sMaxSessions; ++i) {
+		if (mSessions[i])
+			sessions.push_back(mSessions[i]);
+	}
+	return sessions;
+}
+
+map<int, vector<pair<bool, RelayChannelQuality>>> RelayedCall::getQuality() const {
+	map<int, vector<pair<bool, RelayChannelQuality>>> quality;
+	for (int i = 0; i < sMaxSessions; ++i) {
+		shared_ptr<RelaySession> s = mSessions[i];
+		if (s)
+			quality[i] = s->getQuality();
+	}
+	return quality;
+}
+
 void RelayedCall::terminate(){
 	int i;
 	for (i = 0; i < sMaxSessions; ++i) {
@@ -254,6 +299,9 @@ void RelayedCall::configureRelayChannel(shared_ptr<RelayChannel> ms, sip_t *sip,
 	int i;
 	for(i=0,mline=session->sdp_media;i<mline_nr;mline=mline->m_next,++i){
 	}
+	if (mline->m_rtpmaps && mline->m_rtpmaps->rm_rate>0)
+		ms->setClockRate(mline->m_rtpmaps->rm_rate);
+	bool filtered=false;
 	if (mBandwidthThres>0){
 		if (mline->m_type==sdp_media_video){
 			if (mline->m_rtpmaps && strcmp(mline->m_rtpmaps->rm_encoding,"H264")==0){
@@ -267,11 +315,22 @@ void RelayedCall::configureRelayChannel(shared_ptr<RelayChannel> ms, sip_t *sip,
 					if (enabled) {
 						LOGI("Enabling H264 filtering for channel %p",ms.get());
 						ms->setFilter(make_shared<H264IFrameFilter>(mDecim));
+						filtered=true;
 					}
 				}
 			}
 		}
 	}
+	if (mVideoThinning && !filtered && mline->m_type==sdp_media_video && mline->m_rtpmaps
+		&& strcasecmp(mline->m_rtpmaps->rm_encoding,"H264")==0){
+		int maxBitrate=mThinningMaxBitrate;
+		for (sdp_bandwidth_t *b=mline->m_bandwidths;b!=NULL;b=b->b_next){
+			if (b->b_modifier==sdp_bw_as && b->b_value>0 && (maxBitrate==0 || (int)b->b_value<maxBitrate))
+				maxBitrate=(int)b->b_value;
+		}
+		LOGI("Enabling video thinning for channel %p, at most %i kbit/s",ms.get(),maxBitrate);
+		ms->setFilter(make_shared<VideoThinningFilter>(maxBitrate,mThinningLossThreshold));
+	}
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
 	if (mDropTelephoneEvents){
 		//only telephone event coming from tls clients are dropped.
@@ -40,14 +40,11 @@ public:
 	 */
 	void initChannels(const std::shared_ptr<SdpModifier> &m, const std::string &tag, const std::string &trid, const std::pair<std::string,std::string> &frontRelayIps, const std::pair<std::string,std::string> &backRelayIps);
 	
-	/* Obtain the masquerade contexts for given mline. The trid is used when offeredTag is not yet defined.*/
-	MasqueradeContextPair getMasqueradeContexts(int mline, const std::string &offererTag, const std::string &offeredTag, const std::string &trid);
-
-	/* Obtain the local address and port used for relaying */
-	std::pair<std::string,int> getChannelSources(int mline, const std::string & partyTag, const std::string &trId);
-
-	/* Obtain destination (previously set by setChannelDestinations()*/
-	std::pair<std::string,int> getChannelDestinations(int mline, const std::string & partyTag, const std::string &trId);
+	/* Obtain, for each mline of an offer or an answer, the local address and port used for relaying towards its
+	 * recipient, the destination of its sender (previously set by setChannelDestinations()) and the masquerade
+	 * contexts. The trid is used when offeredTag is not yet defined.*/
+	SdpRelayTable getRelayTable(bool isOffer, const std::string &offererTag, const std::string &offeredTag,
+								const std::string &trid);
 
 	void setChannelDestinations(const std::shared_ptr<SdpModifier> &m, int mline, const std::string &ip, int port, const std::string & partyTag, const std::string &trId,
 		bool isEarlyMedia);
@@ -56,7 +53,12 @@ public:
 	void setEstablished(const std::string &trId);
 
 	bool checkMediaValid();
+	std::vector<std::shared_ptr<RelaySession>> getSessions() const;
+	/* Reception quality of the channels of the media streams, by index of m-line, the caller side first. */
+	std::map<int, std::vector<std::pair<bool, RelayChannelQuality>>> getQuality() const;
 	virtual time_t getLastActivity();
+	/* The relay threads report the sessions without packets, the call is not swept once it has one. */
+	virtual bool isActivityWatched();
 	void terminate();
 
 	virtual ~RelayedCall();
@@ -65,16 +67,22 @@ public:
 
 	/*Enable filtering of H264 Iframes for low bandwidth.*/
 	void enableH264IFrameFiltering(int bandwidth_threshold, int decim, bool onlyIfLastProxy);
+	/*Enable the thinning of H264 video according to the receiver reports of each destination.*/
+	void enableVideoThinning(int maxBitrate, int lossThreshold);
 	/*Enable telephone-event dropping for tls clients*/
 	void enableTelephoneEventDrooping(bool value);
 	const std::shared_ptr<MediaRelayServer> & getServer()const{
 		return mServer;
 	}
 private:
+	static bool hasIce(const std::shared_ptr<SdpModifier> &m);
 	std::shared_ptr<RelaySession> mSessions[sMaxSessions];
 	const std::shared_ptr<MediaRelayServer> & mServer;
 	int mBandwidthThres;
 	int mDecim;
+	int mThinningMaxBitrate;
+	int mThinningLossThreshold;
+	bool mVideoThinning;
 	int mEarlyMediaRelayCount;
 	bool mH264DecimOnlyIfLastProxy;
 	bool mDropTelephoneEvents;
@@ -21,7 +21,13 @@
 #include "mediastreamer2/dtmfgen.h"
 #include "ortp/telephonyevents.h"
 
+#include "module.hh"
 #include "sdp-modifier.hh"
+#include "transcoder-filters.hh"
+#include "utils/threadplacement.hh"
+
+#include <pthread.h>
+#include <sched.h>
 
 using namespace std;
 
@@ -34,6 +40,7 @@ CallSide::CallSide(TranscodedCall *ctx, const CallContextParams &params) : mCall
 	mProfile = rtp_profile_new("Call profile");
 	mEncoder = NULL;
 	mDecoder = NULL;
+	mResampler = NULL;
 	mRc = NULL;
 	mReceiver = ms_factory_create_filter(factory, MS_RTP_RECV_ID);
 	mSender = ms_factory_create_filter(factory, MS_RTP_SEND_ID);
@@ -67,6 +74,7 @@ CallSide::CallSide(TranscodedCall *ctx, const CallContextParams &params) : mCall
 	mLastRecvCount = 0;
 	mPtime = 0;
 	mRcEnabled = false;
+	mPassthrough = false;
 	mLocalAddress = "0.0.0.0";
 }
 
@@ -93,6 +101,16 @@ int CallSide::getAudioPort() {
 	return port;
 }
 
+bool CallSide::bindAudioPort(int port) {
+	mLocalAddress = mCallCtx->getBindAddress();
+#if ORTP_ABI_VERSION >= 9
+	int err = rtp_session_set_local_addr(mSession, mLocalAddress.c_str(), port, port + 1);
+#else
+	int err = rtp_session_set_local_addr(mSession, mLocalAddress.c_str(), port);
+#endif
+	return err == 0;
+}
+
 void CallSide::setRemoteAddr(const char *addr, int port) {
 	rtp_session_set_remote_addr(mSession, addr, port);
 }
@@ -137,6 +155,8 @@ CallSide::~CallSide() {
 		ms_filter_destroy(mEncoder);
 	if (mDecoder)
 		ms_filter_destroy(mDecoder);
+	if (mResampler)
+		ms_filter_destroy(mResampler);
 	if (mRc)
 		ms_bitrate_controller_destroy(mRc);
 }
@@ -179,6 +199,57 @@ PayloadType *CallSide::getRecvFormat() {
 	return rtp_profile_get_payload(prof, pt);
 }
 
+/*
+ * The packets can be relayed without transcoding when both parties ended up with the same codec, and nothing has to be
+ * mixed in the audio: the DTMFs are either sent as telephone-events on this side, or there are none to receive.
+ */
+bool CallSide::canPassthrough(CallSide *recvSide, PayloadType *recvpt, PayloadType *sendpt) {
+	if (strcasecmp(recvpt->mime_type, sendpt->mime_type) != 0 || recvpt->clock_rate != sendpt->clock_rate ||
+		recvpt->channels != sendpt->channels)
+		return false;
+	if (mPtime > 0 && recvSide->mPtime > 0 && mPtime != recvSide->mPtime)
+		return false;
+	return rtp_session_telephone_events_supported(mSession) != -1 ||
+		   rtp_session_telephone_events_supported(recvSide->mSession) == -1;
+}
+
+void CallSide::destroyCodecs(MSTicker *ticker) {
+	if (mDecoder) {
+		if (ticker)
+			ms_filter_postprocess(mDecoder);
+		ms_filter_destroy(mDecoder);
+		mDecoder = NULL;
+	}
+	destroyResampler(ticker);
+	if (mEncoder) {
+		if (ticker)
+			ms_filter_postprocess(mEncoder);
+		ms_filter_destroy(mEncoder);
+		mEncoder = NULL;
+	}
+	if (mRc) {
+		ms_bitrate_controller_destroy(mRc);
+		mRc = NULL;
+	}
+}
+
+void CallSide::destroyResampler(MSTicker *ticker) {
+	if (mResampler) {
+		if (ticker)
+			ms_filter_postprocess(mResampler);
+		ms_filter_destroy(mResampler);
+		mResampler = NULL;
+	}
+}
+
+/* The rate of the samples of a codec, which may differ from the clock rate of its payload type, as for G.722. */
+static int getCodecRate(MSFilter *codec, PayloadType *pt) {
+	int rate = 0;
+	if (ms_filter_call_method(codec, MS_FILTER_GET_SAMPLE_RATE, &rate) != 0 || rate <= 0)
+		rate = pt->clock_rate;
+	return rate;
+}
+
 void CallSide::connect(CallSide *recvSide, MSTicker *ticker) {
 	MSFactory *factory = mCallCtx->getFactory();
 	MSConnectionHelper conHelper;
@@ -193,6 +264,14 @@ void CallSide::connect(CallSide *recvSide, MSTicker *ticker) {
 	LOGD("recvside (%p) enc=%i %s/%i sendside (%p) enc=%i %s/%i", recvSide, payload_type_get_number(recvpt),
 		 recvpt->mime_type, recvpt->clock_rate, this, payload_type_get_number(sendpt), sendpt->mime_type,
 		 sendpt->clock_rate);
+	// evaluated again each time the graph is redrawn, so that a codec change switches back to transcoding
+	mPassthrough = canPassthrough(recvSide, recvpt, sendpt);
+	if (mPassthrough) {
+		LOGD("Same codec on both sides, relaying packets without transcoding");
+		destroyCodecs(ticker);
+		ms_connection_helper_link(&conHelper, mSender, 0, -1);
+		return;
+	}
 	if (strcasecmp(recvpt->mime_type, sendpt->mime_type) != 0 || recvpt->clock_rate != sendpt->clock_rate ||
 		mToneGen != 0) {
 
@@ -242,10 +321,22 @@ void CallSide::connect(CallSide *recvSide, MSTicker *ticker) {
 			if (ticker)
 				ms_filter_preprocess(mEncoder, ticker);
 		}
+		destroyResampler(ticker);
+		if (mDecoder && mEncoder) {
+			int decRate = getCodecRate(mDecoder, recvpt);
+			int encRate = getCodecRate(mEncoder, sendpt);
+			if (decRate != encRate) {
+				mResampler = TranscoderFilters::createResampler(factory, decRate, encRate);
+				if (mResampler && ticker)
+					ms_filter_preprocess(mResampler, ticker);
+			}
+		}
 	}
 
 	if (mDecoder)
 		ms_connection_helper_link(&conHelper, mDecoder, 0, 0);
+	if (mResampler)
+		ms_connection_helper_link(&conHelper, mResampler, 0, 0);
 	if (mToneGen)
 		ms_connection_helper_link(&conHelper, mToneGen, 0, 0);
 	if (mEncoder)
@@ -265,8 +356,14 @@ void CallSide::disconnect(CallSide *recvSide) {
 
 	ms_connection_helper_start(&h);
 	ms_connection_helper_unlink(&h, recvSide->getRecvPoint().filter, -1, recvSide->getRecvPoint().pin);
+	if (mPassthrough) {
+		ms_connection_helper_unlink(&h, mSender, 0, -1);
+		return;
+	}
 	if (mDecoder)
 		ms_connection_helper_unlink(&h, mDecoder, 0, 0);
+	if (mResampler)
+		ms_connection_helper_unlink(&h, mResampler, 0, 0);
 	if (mToneGen)
 		ms_connection_helper_unlink(&h, mToneGen, 0, 0);
 	if (mEncoder)
@@ -338,6 +435,13 @@ TranscodedCall::TranscodedCall(MSFactory * factory, sip_t *sip, const string &bi
 	mCreateTime = getCurrentTime();
 }
 
+TranscodedCall::TranscodedCall(MSFactory *factory, const string &bind_address)
+	: CallContextBase(), mFactory(factory), mFrontSide(0), mBackSide(0), mInitialOffer(), mBindAddress(bind_address) {
+	mTicker = NULL;
+	mInfoCSeq = -1;
+	mCreateTime = getCurrentTime();
+}
+
 void TranscodedCall::prepare(const CallContextParams &params) {
 	LOGD("Preparing...");
 	if (mFrontSide) {
@@ -470,3 +574,98 @@ TranscodedCall::~TranscodedCall() {
 	}
 }
 
+
+TickerManager::TickerManager() : mStarted(false), mCpuAffinity(false) {
+}
+
+TickerManager::~TickerManager() {
+	for (auto &t : mTickers) {
+		ms_ticker_destroy(t.ticker);
+	}
+}
+
+void TickerManager::declareStats(GenericStruct *mc) {
+	int cpucount = ModuleToolbox::getCpuCount();
+	for (int i = 0; i < cpucount; ++i) {
+		string prefix = "ticker-" + to_string(i);
+		mLoadStats.push_back(
+			mc->createStat(prefix + "-load", "Average load of transcoding ticker " + to_string(i) + ", in per mille."));
+		mCallStats.push_back(
+			mc->createStat(prefix + "-calls", "Number of calls processed by transcoding ticker " + to_string(i) + "."));
+	}
+}
+
+MSTicker *TickerManager::chooseOne() {
+	if (!mStarted)
+		start();
+	float totalLoad = 0;
+	int totalCalls = 0;
+	for (auto &t : mTickers) {
+		totalLoad += ms_ticker_get_average_load(t.ticker);
+		totalCalls += t.calls;
+	}
+	float callCost = totalCalls > 0 ? max(totalLoad / totalCalls, sMinCallCost) : sDefaultCallCost;
+	Ticker *best = NULL;
+	float bestLoad = 0;
+	for (auto &t : mTickers) {
+		float load = ms_ticker_get_average_load(t.ticker) + t.recent * callCost;
+		if (!best || load < bestLoad) {
+			best = &t;
+			bestLoad = load;
+		}
+	}
+	best->recent++;
+	best->calls++;
+	return best->ticker;
+}
+
+void TickerManager::update(const map<MSTicker *, int> &calls) {
+	for (size_t i = 0; i < mTickers.size(); ++i) {
+		Ticker &t = mTickers[i];
+		auto it = calls.find(t.ticker);
+		t.calls = it != calls.end() ? it->second : 0;
+		t.recent = 0;
+		if (i < mLoadStats.size()) {
+			mLoadStats[i]->set((uint64_t)(ms_ticker_get_average_load(t.ticker) * 10));
+			mCallStats[i]->set(t.calls);
+		}
+	}
+}
+
+float TickerManager::getAverageLoad() const {
+	if (mTickers.empty())
+		return 0;
+	float totalLoad = 0;
+	for (auto &t : mTickers) {
+		totalLoad += ms_ticker_get_average_load(t.ticker);
+	}
+	return totalLoad / mTickers.size();
+}
+
+void TickerManager::start() {
+	// one ticker per CPU of the NUMA node of the transcoder if placed
+	const vector<int> &placed = ThreadPlacement::getCpus(ThreadPlacement::Transcoder);
+	int cpucount = placed.empty() ? ModuleToolbox::getCpuCount() : (int)placed.size();
+	for (int i = 0; i < cpucount; ++i) {
+		Ticker t = {ms_ticker_new(), 0, 0};
+#ifdef __linux__
+		if (mCpuAffinity || !placed.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (!mCpuAffinity) {
+				for (int cpu : placed)
+					CPU_SET(cpu, &set);
+			} else
+				CPU_SET(placed.empty() ? i : placed[i], &set);
+			int err = pthread_setaffinity_np(t.ticker->thread, sizeof(set), &set);
+			if (err != 0)
+				LOGW("Cannot pin transcoding ticker %i to its CPU: %s", i, strerror(err));
+		}
+#endif
+		mTickers.push_back(t);
+	}
+	mStarted = true;
+}
+
+constexpr float TickerManager::sDefaultCallCost;
+constexpr float TickerManager::sMinCallCost;
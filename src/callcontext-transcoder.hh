@@ -21,6 +21,8 @@
 
 #include "callstore.hh"
 #include <list>
+#include <map>
+#include <vector>
 
 #include <mediastreamer2/msfilter.h>
 #include <mediastreamer2/msticker.h>
@@ -46,6 +48,8 @@ class CallSide {
 	void disconnect(CallSide *recvSide);
 	const std::string &getLocalAddress();
 	int getAudioPort();
+	/* Binds the session to the given RTP port, and the next one for RTCP, instead of random ones. */
+	bool bindAudioPort(int port);
 	void setRemoteAddr(const char *addr, int port);
 	void assignPayloads(std::list<PayloadType *> &payloads);
 	void setPtime(int ptime);
@@ -53,8 +57,15 @@ class CallSide {
 	void playTone(char tone_name);
 	time_t getLastActivity();
 	void doBgTasks();
+	/* True when the packets received by recvSide are sent as is, without being decoded and encoded again. */
+	bool isPassthrough() const {
+		return mPassthrough;
+	}
 
   private:
+	bool canPassthrough(CallSide *recvSide, PayloadType *recvpt, PayloadType *sendpt);
+	void destroyCodecs(MSTicker *ticker);
+	void destroyResampler(MSTicker *ticker);
 	static void payloadTypeChanged(RtpSession *s, unsigned long data);
 	static void onTelephoneEvent(RtpSession *s, int dtmf, void *user_data);
 	TranscodedCall *mCallCtx;
@@ -65,6 +76,7 @@ class CallSide {
 	MSFilter *mSender;
 	MSFilter *mDecoder;
 	MSFilter *mEncoder;
+	MSFilter *mResampler; // between the decoder and the encoder, when their rates differ
 	MSBitrateController *mRc;
 	MSFilter *mToneGen;
 	time_t mLastCheck;
@@ -73,16 +85,22 @@ class CallSide {
 	int mPtime;
 	bool mRcEnabled;
 	bool mUsePlc;
+	bool mPassthrough;
 	std::string mLocalAddress;
 };
 
 class TranscodedCall : public CallContextBase {
   public:
 	TranscodedCall(MSFactory *factory, sip_t *invite, const std::string &bind_address);
+	/* A call processed by a transcoder worker on behalf of a proxy. */
+	TranscodedCall(MSFactory *factory, const std::string &bind_address);
 	void prepare(const CallContextParams &params);
 	void join(MSTicker *ticker);
 	void unjoin();
 	bool isJoined() const;
+	MSTicker *getTicker() const {
+		return mTicker;
+	}
 	void redraw(CallSide *receiver);
 	void setInitialOffer(std::list<PayloadType *> &payloads);
 	const std::list<PayloadType *> &getInitialOffer() const;
@@ -117,4 +135,40 @@ class TranscodedCall : public CallContextBase {
 	time_t mCreateTime;
 };
 
+/*
+ * One ticker per CPU. A new call goes to the ticker with the lowest estimated load: the load measured by the ticker,
+ * plus the expected cost of the calls it was given since the last measurement, which the average load does not
+ * reflect yet.
+ */
+class TickerManager {
+  public:
+	TickerManager();
+	~TickerManager();
+	void declareStats(GenericStruct *mc);
+	void enableCpuAffinity(bool value) {
+		mCpuAffinity = value;
+	}
+	MSTicker *chooseOne();
+	/* Gives the actual number of calls joined to each ticker, and publishes the stats. */
+	void update(const std::map<MSTicker *, int> &calls);
+	/* Average of the loads of the tickers, in percent. */
+	float getAverageLoad() const;
+
+  private:
+	struct Ticker {
+		MSTicker *ticker;
+		int calls;
+		int recent; // calls joined since the last update()
+	};
+	void start();
+	// load percentages used for calls whose cost is not measured yet
+	static constexpr float sDefaultCallCost = 2.0f;
+	static constexpr float sMinCallCost = 0.5f;
+	std::vector<Ticker> mTickers;
+	std::vector<StatCounter64 *> mLoadStats;
+	std::vector<StatCounter64 *> mCallStats;
+	bool mStarted;
+	bool mCpuAffinity;
+};
+
 #endif
@@ -24,12 +24,10 @@
 using namespace std;
 
 CallContextBase::CallContextBase(sip_t *sip) {
-	su_home_init(&mHome);
-	mFrom = sip_from_dup(&mHome, sip->sip_from);
 	mCallHash = sip->sip_call_id->i_hash;
 	mInvCseq = sip->sip_cseq->cs_seq;
 	mResCseq = (uint32_t)-1;
-	mInvite = NULL;
+	mLastInviteHasSdp = false;
 	mCallerTag = sip->sip_from->a_tag;
 	mViaCount = 0;
 	sip_via_t *via;
@@ -43,6 +41,16 @@ CallContextBase::CallContextBase(sip_t *sip) {
 	LOGD("CallContext %p created", this);
 }
 
+CallContextBase::CallContextBase() {
+	mCallHash = 0;
+	mInvCseq = 0;
+	mResCseq = (uint32_t)-1;
+	mLastInviteHasSdp = false;
+	mViaCount = 0;
+	updateActivity();
+	LOGD("CallContext %p created", this);
+}
+
 
 void CallContextBase::updateActivity() {
 	mLastSIPActivity = getCurrentTime();
@@ -103,32 +111,18 @@ bool CallContextBase::isNewInvite(sip_t *invite) {
 	return invite->sip_cseq->cs_seq != mInvCseq;
 }
 
-void CallContextBase::storeNewInvite(msg_t *msg) {
-	sip_t *sip = (sip_t *)msg_object(msg);
-	// serialize the message before copying it otherwise we might miss some content
-	msg_serialize(msg, (msg_pub_t *)sip);
-	mInvCseq = sip->sip_cseq->cs_seq;
-	if (mInvite != NULL) {
-		msg_destroy(mInvite);
-	}
-	mInvite = msg_copy(msg);
+void CallContextBase::storeNewInvite(const sip_t *invite) {
+	mInvCseq = invite->sip_cseq->cs_seq;
+	mLastInviteHasSdp = invite->sip_payload && invite->sip_payload->pl_data;
 	updateActivity();
 }
 
-msg_t *CallContextBase::getLastForwardedInvite() const {
-	return mInvite;
-}
-
 void CallContextBase::dump() {
 	LOGD("Call id %u", mCallHash);
 }
 
 CallContextBase::~CallContextBase() {
-	su_home_deinit(&mHome);
 	LOGD("CallContext %p with id %u destroyed.", this, mCallHash);
-	if (mInvite != NULL) {
-		msg_destroy(mInvite);
-	}
 }
 
 CallStore::CallStore() : mCountCalls(NULL), mCountCallsFinished(NULL) {
@@ -138,68 +132,124 @@ CallStore::~CallStore() {
 }
 
 void CallStore::store(const shared_ptr<CallContextBase> &ctx) {
+	if (mEntries.find(ctx.get()) != mEntries.end())
+		return;
 	if (mCountCalls)
 		++(*mCountCalls);
-	mCalls.push_back(ctx);
+	Entry entry;
+	entry.call = mCalls.insert(mCalls.end(), ctx);
+	entry.activity = mByActivity.insert(make_pair(ctx->getLastActivity(), ctx.get()));
+	mEntries[ctx.get()] = entry;
+	mByCallHash[ctx->getCallHash()].push_back(ctx.get());
+}
+
+list<CallContextBase *> *CallStore::chainFor(sip_t *sip) {
+	if (sip->sip_call_id == NULL)
+		return NULL;
+	auto it = mByCallHash.find(sip->sip_call_id->i_hash);
+	return it != mByCallHash.end() ? &it->second : NULL;
+}
+
+void CallStore::erase(EntryMap::iterator entry) {
+	CallContextBase *ctx = entry->second.call->get();
+	auto chain = mByCallHash.find(ctx->getCallHash());
+	if (chain != mByCallHash.end()) {
+		chain->second.remove(ctx);
+		if (chain->second.empty())
+			mByCallHash.erase(chain);
+	}
+	if (entry->second.activity != mByActivity.end())
+		mByActivity.erase(entry->second.activity);
+	// the context may be destroyed with the last reference held by mCalls
+	CallList::iterator call = entry->second.call;
+	mEntries.erase(entry);
+	mCalls.erase(call);
 }
 
 shared_ptr<CallContextBase> CallStore::find(Agent *ag, sip_t *sip, bool match_call_id_only) {
-	for (auto it = mCalls.begin(); it != mCalls.end(); ++it) {
-		if ((*it)->match(ag, sip, match_call_id_only))
-			return *it;
+	list<CallContextBase *> *chain = chainFor(sip);
+	if (chain) {
+		for (auto it = chain->begin(); it != chain->end(); ++it) {
+			if ((*it)->match(ag, sip, match_call_id_only))
+				return *mEntries[*it].call;
+		}
 	}
 	return shared_ptr<CallContextBase>();
 }
 
 shared_ptr<CallContextBase> CallStore::findEstablishedDialog(Agent *ag, sip_t *sip) {
-	for (auto it = mCalls.begin(); it != mCalls.end(); ++it) {
-		if ((*it)->match(ag, sip, false, true))
-			return *it;
+	list<CallContextBase *> *chain = chainFor(sip);
+	if (chain) {
+		for (auto it = chain->begin(); it != chain->end(); ++it) {
+			if ((*it)->match(ag, sip, false, true))
+				return *mEntries[*it].call;
+		}
 	}
 	return shared_ptr<CallContextBase>();
 }
 
 void CallStore::findAndRemoveExcept(Agent *ag, sip_t *sip, const shared_ptr<CallContextBase> &ctx, bool stateful) {
 	int removed = 0;
-	for (auto it = mCalls.begin(); it != mCalls.end();) {
-		if (*it != ctx && (*it)->match(ag, sip, stateful)) {
-			if (mCountCallsFinished)
-				++(*mCountCallsFinished);
-			LOGD("CallStore::findAndRemoveExcept() removing CallContext %p", ctx.get());
-			it = mCalls.erase(it);
-			++removed;
-		} else
-			++it;
+	list<CallContextBase *> *chain = chainFor(sip);
+	if (chain) {
+		// erase() may remove the chain itself
+		list<CallContextBase *> candidates(*chain);
+		for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+			if (*it != ctx.get() && (*it)->match(ag, sip, stateful)) {
+				if (mCountCallsFinished)
+					++(*mCountCallsFinished);
+				LOGD("CallStore::findAndRemoveExcept() removing CallContext %p", *it);
+				erase(mEntries.find(*it));
+				++removed;
+			}
+		}
 	}
 	LOGD("Removed %d maching call contexts from store", removed);
 }
 
 void CallStore::remove(const shared_ptr<CallContextBase> &ctx) {
-	auto it = std::find(mCalls.begin(), mCalls.end(), ctx);
-	if (it != mCalls.end()) {
+	auto it = mEntries.find(ctx.get());
+	if (it != mEntries.end()) {
 		LOGD("CallStore::remove() removing CallContext %p", ctx.get());
 		if (mCountCallsFinished)
 			++(*mCountCallsFinished);
-		(*it)->terminate();
-		mCalls.erase(it);
+		ctx->terminate();
+		erase(it);
 	}
 }
 
-void CallStore::removeAndDeleteInactives(time_t inactivityPeriod) {
+/* Only the contexts whose indexed activity is older than the period are examined: those which were active since
+ * they were indexed are indexed again with their current activity, those whose activity is watched by their owner
+ * leave the index. */
+void CallStore::removeAndDeleteInactives(time_t inactivityPeriod, SweepBudget *budget) {
 	time_t cur = getCurrentTime();
-	for (auto it = mCalls.begin(); it != mCalls.end();) {
-		if ((*it)->getLastActivity() + inactivityPeriod < cur) {
-			LOGD("CallStore::removeAndDeleteInactives() removing CallContext %p", (*it).get());
+	while (!mByActivity.empty() && mByActivity.begin()->first + inactivityPeriod < cur &&
+		   (budget == NULL || budget->next())) {
+		CallContextBase *ctx = mByActivity.begin()->second;
+		auto entry = mEntries.find(ctx);
+		if (ctx->isActivityWatched()) {
+			mByActivity.erase(entry->second.activity);
+			entry->second.activity = mByActivity.end();
+			continue;
+		}
+		time_t lastActivity = ctx->getLastActivity();
+		if (lastActivity + inactivityPeriod < cur) {
+			LOGD("CallStore::removeAndDeleteInactives() removing CallContext %p", ctx);
 			if (mCountCallsFinished)
 				++(*mCountCallsFinished);
-			(*it)->terminate();
-			it = mCalls.erase(it);
-		} else
-			++it;
+			ctx->terminate();
+			erase(entry);
+		} else {
+			mByActivity.erase(entry->second.activity);
+			entry->second.activity = mByActivity.insert(make_pair(lastActivity, ctx));
+		}
 	}
 }
 
 void CallStore::dump() {
+	// a walk through all the calls, for nothing unless they are logged
+	if (!FLEXISIP_LOG_ENABLED(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG))
+		return;
 	for_each(mCalls.begin(), mCalls.end(), bind(&CallContextBase::dump, placeholders::_1));
 }
 
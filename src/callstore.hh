@@ -20,22 +20,36 @@
 #define callstore_hh
 
 #include "agent.hh"
+#include "utils/memorystats.hh"
+#include "utils/sweepbudget.hh"
 #include <list>
+#include <map>
+#include <unordered_map>
 
-class CallContextBase {
+class CallContextBase : public CountedObject<ObjectCounter::CallContexts> {
   public:
 	CallContextBase(sip_t *sip);
+	/* For a call known by a transcoder worker through its id only, which is never stored in a CallStore. */
+	CallContextBase();
 	bool match(Agent *ag, sip_t *sip, bool match_call_id_only = false, bool match_established = false);
 	void establishDialogWith200Ok(Agent *ag, sip_t *sip);
 	bool isDialogEstablished() const;
 	bool isNewInvite(sip_t *sip);
-	void storeNewInvite(msg_t *orig);
+	/* Keeps from the INVITE forwarded what the modules need later, rather than a copy of it. */
+	void storeNewInvite(const sip_t *invite);
 	void updateActivity();
-	msg_t *getLastForwardedInvite() const;
+	bool lastForwardedInviteHasSdp() const {
+		return mLastInviteHasSdp;
+	}
 	virtual void dump();
 	virtual time_t getLastActivity() {
 		return mLastSIPActivity;
 	}
+	/* Whether the inactivity of the context is detected by its owner, which then removes it from the store: the
+	 * sweep of the store no longer examines it. */
+	virtual bool isActivityWatched() {
+		return false;
+	}
 	virtual void terminate() {
 	}
 	virtual ~CallContextBase();
@@ -48,11 +62,11 @@ class CallContextBase {
 	uint32_t getViaCount() const {
 		return mViaCount;
 	}
+	uint32_t getCallHash() const {
+		return mCallHash;
+	}
 
   private:
-	su_home_t mHome;
-	sip_from_t *mFrom;
-	msg_t *mInvite;
 	uint32_t mCallHash;
 	uint32_t mInvCseq;
 	uint32_t mResCseq;
@@ -61,6 +75,7 @@ class CallContextBase {
 	std::string mBranch; /*of the via of the first Invite request*/
 	uint32_t mViaCount;
 	time_t mLastSIPActivity;
+	bool mLastInviteHasSdp;
 };
 
 class CallStore {
@@ -73,7 +88,8 @@ class CallStore {
 	void findAndRemoveExcept(Agent *ag, sip_t *sip, const std::shared_ptr<CallContextBase> &ctx,
 							 bool match_call_id_only = false);
 	void remove(const std::shared_ptr<CallContextBase> &ctx);
-	void removeAndDeleteInactives(time_t inactivityPeriod);
+	/* Examines the contexts while the budget allows it when one is given, the others being left to the next call. */
+	void removeAndDeleteInactives(time_t inactivityPeriod, SweepBudget *budget = NULL);
 	void setCallStatCounters(StatCounter64 *invCount, StatCounter64 *invFinishedCount) {
 		mCountCalls = invCount;
 		mCountCallsFinished = invFinishedCount;
@@ -86,7 +102,23 @@ class CallStore {
 	int size();
 
   private:
-	std::list<std::shared_ptr<CallContextBase>> mCalls;
+	typedef std::list<std::shared_ptr<CallContextBase>> CallList;
+	typedef std::multimap<time_t, CallContextBase *> ActivityIndex;
+	struct Entry {
+		CallList::iterator call;
+		ActivityIndex::iterator activity;
+	};
+	typedef std::unordered_map<const CallContextBase *, Entry> EntryMap;
+	std::list<CallContextBase *> *chainFor(sip_t *sip);
+	void erase(EntryMap::iterator entry);
+
+	CallList mCalls;
+	/* Contexts by hash of their Call-ID, in the order they were stored. Collisions are resolved by match(). */
+	std::unordered_map<uint32_t, std::list<CallContextBase *>> mByCallHash;
+	/* Contexts by last activity known when indexed: the actual activity may be more recent, it is checked when the
+	 * indexed one expires. */
+	ActivityIndex mByActivity;
+	EntryMap mEntries;
 	StatCounter64 *mCountCalls;
 	StatCounter64 *mCountCallsFinished;
 };
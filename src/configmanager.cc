@@ -29,6 +29,7 @@
 #include <functional>
 
 #include <ctime>
+#include <set>
 #include <sstream>
 #include <fstream>
 
@@ -37,12 +38,13 @@
 using namespace std;
 
 bool ConfigValueListener::sDirty = false;
+bool ConfigValueListener::sWriteBack = true;
 ConfigValueListener::~ConfigValueListener() {
 }
 bool ConfigValueListener::onConfigStateChanged(const ConfigValue &conf, ConfigState state) {
 	switch (state) {
 		case ConfigState::Commited:
-			if (sDirty) {
+			if (sDirty && sWriteBack) {
 				// Write to disk
 				GenericStruct *rootStruct = GenericManager::get()->getRoot();
 				ofstream cfgfile;
@@ -52,8 +54,8 @@ bool ConfigValueListener::onConfigStateChanged(const ConfigValue &conf, ConfigSt
 				cfgfile << dumper;
 				cfgfile.close();
 				LOGI("New configuration wrote to %s .", GenericManager::get()->getConfigFile().c_str());
-				sDirty = false;
 			}
+			sDirty = false;
 			break;
 		case ConfigState::Changed:
 			sDirty = true;
@@ -512,9 +514,22 @@ GenericEntry *GenericStruct::find(const char *name) const {
 	auto it = find_if(mEntries.begin(), mEntries.end(), matchEntryName(name));
 	if (it != mEntries.end())
 		return *it;
+	if (mDeferredDeclaration) {
+		completeDeclaration();
+		return find(name);
+	}
 	return NULL;
 }
 
+void GenericStruct::completeDeclaration() const {
+	if (!mDeferredDeclaration)
+		return;
+	// released first, as the declaration looks up the children it adds
+	function<void(GenericStruct *)> declare;
+	declare.swap(mDeferredDeclaration);
+	declare(const_cast<GenericStruct *>(this));
+}
+
 struct matchEntryNameApprox {
 	const string mName;
 	matchEntryNameApprox(const char *name) : mName(name) {
@@ -539,6 +554,7 @@ struct matchEntryNameApprox {
 };
 
 GenericEntry *GenericStruct::findApproximate(const char *name) const {
+	completeDeclaration();
 	auto it = find_if(mEntries.begin(), mEntries.end(), matchEntryNameApprox(name));
 	if (it != mEntries.end())
 		return *it;
@@ -546,6 +562,7 @@ GenericEntry *GenericStruct::findApproximate(const char *name) const {
 }
 
 const list<GenericEntry *> &GenericStruct::getChildren() const {
+	completeDeclaration();
 	return mEntries;
 }
 
@@ -605,9 +622,12 @@ void ConfigInt::write(int value) {
 	set(oss.str());
 }
 
+atomic<int> StatCounter64::sNextSlot(0);
+
 StatCounter64::StatCounter64(const string &name, const string &help, oid oid_index)
 	: GenericEntry(name, Counter64, help, oid_index) {
-	mValue = 0;
+	for (Slot &slot : mSlots)
+		slot.value = 0;
 }
 
 ConfigString::ConfigString(const string &name, const string &help, const string &default_value, oid oid_index)
@@ -650,7 +670,8 @@ uint64_t ConfigByteSize::read() const {
 void ConfigRuntimeError::writeErrors(GenericEntry *entry, ostringstream &oss) const {
 	GenericStruct *cs = dynamic_cast<GenericStruct *>(entry);
 	if (cs) {
-		const auto &children = cs->getChildren();
+		// the entries not declared yet carry no error
+		const auto &children = cs->getDeclaredChildren();
 		for (auto it = children.begin(); it != children.end(); ++it) {
 			writeErrors(*it, oss);
 		}
@@ -761,7 +782,7 @@ RootConfigStruct::~RootConfigStruct() {
 
 oid company_id = SNMP_COMPANY_OID;
 GenericManager::GenericManager()
-	: mNeedRestart(false), mDirtyConfig(false),
+	: mNeedRestart(false), mDirtyConfig(false), mReloading(false),
 	  mConfigRoot("flexisip", "This is the default Flexisip configuration file", {1, 3, 6, 1, 4, 1, company_id}),
 	  mReader(&mConfigRoot), mNotifier(NULL) {
 	// to make sure global_conf is instanciated first
@@ -821,6 +842,18 @@ GenericManager::GenericManager()
 		 "The setup of agent.pem, and eventually cafile.pem is required for TLS transport to work.",
 		 "/etc/flexisip/tls/"},
 		{Integer, "idle-timeout", "Time interval in seconds after which inactive connections are closed.", "3600"},
+		{Integer, "keepalive-interval",
+		 "Time interval in seconds between the keepalives sent by the proxy on each of its connections. The CRLF pings of "
+		 "the clients are answered by a pong anyway, in the transport layer, without any SIP processing. With hundreds of "
+		 "thousands of connections kept alive by their clients, a value of 0 disables the keepalives of the proxy, and "
+		 "their timer on each connection.",
+		 "1800"},
+		{Boolean, "connection-scaling",
+		 "Tune the proxy for hundreds of thousands of TCP and TLS connections: the main loop waits for its sockets with "
+		 "epoll instead of poll, and the queue of the messages waiting to be sent on a connection starts smaller, "
+		 "growing on demand. Combine it with a large idle-timeout and a keepalive-interval of 0 when the clients keep "
+		 "their connections alive themselves.",
+		 "false"},
 		{Boolean, "require-peer-certificate", "Require client certificate from peer (inbound connections only).", "false"},
 		{Integer, "transaction-timeout", "SIP transaction timeout in milliseconds. It is T1*64 (32000 ms) by default.",
 		 "32000"},
@@ -836,6 +869,175 @@ GenericManager::GenericManager()
 			"16-sized hexadecimal number. If empty, it will be randomly generated at each start of Flexisip.", ""},
 		{Boolean, "use-maddr", "Allow flexisip to use maddr in sips connections to verify the CN of the TLS certificate", "false"},
 		{Boolean, "debug", "Outputs very detailed logs", "false"},
+		{Integer, "metrics-http-port", "Port of the HTTP server exporting the statistics in the Prometheus text format "
+									   "on /metrics, from its own thread. 0 to disable it.",
+		 "0"},
+		{String, "metrics-http-address", "Address the HTTP server exporting the statistics listens on.", "127.0.0.1"},
+		{Integer, "trace-sample-rate", "One out of how many incoming requests is traced: the spans of the modules and "
+									   "registrar database operations and the instants it is forked, sent and "
+									   "answered are written to [trace-file]. 0 to disable tracing.",
+		 "0"},
+		{String, "trace-file", "File the traces are appended to, one OTLP/JSON request per line, as read by the "
+							   "OpenTelemetry collector otlpjsonfile receiver.",
+		 "/var/log/flexisip/traces.json"},
+		{String, "profiler-dir", "Directory of the profiles of the sampling profiler, started for a while with the "
+								 "'PROFILE <seconds>' command of the statistics socket or for [profiler-duration] "
+								 "seconds with the SIGUSR2 signal. Each profile holds the stacks of the threads "
+								 "sampled, with the module processing a message, to be symbolized by "
+								 "tools/profile-symbolize.py. Empty to disable profiling.",
+		 ""},
+		{Integer, "profiler-frequency", "Samples per second of processor time of the sampling profiler.", "99"},
+		{Integer, "profiler-duration", "Duration in seconds of the profiles started by the SIGUSR2 signal.", "30"},
+		{Integer, "tenant-stats-max-domains", "Maximum number of domains whose load is accounted apart: messages, "
+											  "registrar operations, relayed media bytes, push notifications and "
+											  "time spent in the modules, per domain of the From of the messages, "
+											  "and the aors and contacts registered through this server per "
+											  "domain of the aor. "
+											  "The domains past it are accounted together as 'other'. Read with "
+											  "the 'TENANTS' command of the statistics socket and from the "
+											  "metrics exporter. 0 to disable the accounting.",
+		 "100"},
+		{Boolean, "dns-prefetch", "Keep the DNS records of the destinations of the forwarded requests and of the domain "
+								  "registrations in a cache shared with the SIP stack, and query them again before "
+								  "they expire, so that the outgoing routing rarely waits for a DNS answer.",
+		 "false"},
+		{Integer, "dns-prefetch-idle-time", "Time in seconds after which the records of a destination no longer used "
+											"stop being refreshed.",
+		 "300"},
+		{Integer, "dns-negative-ttl", "Time in seconds during which a name without records, or whose query failed, is "
+									  "not queried again by the prefetching.",
+		 "30"},
+		{String, "tls-session-ticket-key-file",
+		 "File of 48 random bytes (for example made by 'openssl rand 48') used to encrypt the TLS session tickets. "
+		 "When the nodes of a cluster share this file, a client can resume its TLS session on any of them without a full "
+		 "handshake. Empty to use keys of the process, lost at restart. Requires sofia-sip with the "
+		 "sofia_tls_session_reuse patch.",
+		 ""},
+		{Integer, "tls-client-session-cache-size",
+		 "Number of TLS sessions kept for the outgoing TLS connections, so that a reconnection to the same peer resumes "
+		 "its session. 0 to disable. Requires sofia-sip with the sofia_tls_session_reuse patch.",
+		 "256"},
+		{Integer, "tls-handshake-threads",
+		 "Number of threads negotiating the incoming TLS connections, so that a storm of reconnections does not stall "
+		 "the processing of the established ones. A connection is handed to the main loop once negotiated, or closed "
+		 "if its handshake does not complete within 10 seconds. 0 to negotiate in the main loop. Requires sofia-sip "
+		 "with the sofia_tls_handshake_threads patch.",
+		 "0"},
+		{Boolean, "reuse-port",
+		 "Bind the transports with SO_REUSEPORT, so that several flexisip instances started on the same host with the "
+		 "same transports, typically one per core, share their ports. The kernel spreads the incoming UDP datagrams and "
+		 "TCP connections among the instances on a hash of their source address and port, which keeps each client, its "
+		 "transactions and its dialogs on the same instance. The instances must share their registrations, through the "
+		 "redis registrar backend. Requires sofia-sip with the sofia_tport_reuseport patch.",
+		 "false"},
+		{Boolean, "write-coalescing",
+		 "Write the messages sent on a TCP or TLS connection within an iteration of the main loop together, such as "
+		 "the NOTIFYs of a list subscription or the messages delivered to a client reconnecting: a single writev() on "
+		 "TCP, and records shared by the messages on TLS, instead of a write and records per message. The first "
+		 "message of a burst waits for the next poll of the sockets, a fraction of a millisecond. Requires sofia-sip "
+		 "with the sofia_tport_write_coalescing patch.",
+		 "false"},
+		{Boolean, "prescan-datagrams",
+		 "Check the raw bytes of the SIP messages received over UDP before sofia-sip parses them, and drop those too "
+		 "large, with too many headers, with a malformed start or header line, lacking one of the Via, From, To, "
+		 "Call-ID and CSeq headers, or whose Content-Length exceeds the body received. Their parsing and their "
+		 "processing up to the SanityChecker are saved. The drops are counted in count-prescan-rejected. Requires "
+		 "sofia-sip with the sofia_tport_prescan patch.",
+		 "false"},
+		{ByteSize, "prescan-max-size", "Size above which prescan-datagrams drops a message.", "16K"},
+		{Integer, "prescan-max-headers", "Number of header lines above which prescan-datagrams drops a message.",
+		 "100"},
+		{String, "handover-socket",
+		 "Path of a unix socket through which a flexisip starting hands the listening sockets of the transports over "
+		 "from the flexisip it replaces, so that an upgrade loses neither datagrams nor pending connections. The new "
+		 "process takes the sockets of the transports it shares with the old one when it starts, then the old one "
+		 "keeps serving its established connections and transactions until they are over or handover-drain-time "
+		 "elapses, and exits. Empty to disable. Requires sofia-sip with the sofia_tport_handover patch.",
+		 ""},
+		{Integer, "handover-drain-time",
+		 "Maximum time in seconds a flexisip that handed its sockets over keeps serving its transactions before "
+		 "exiting.",
+		 "32"},
+		{Boolean, "log-async",
+		 "Write the logs from a background thread, the logging threads only copying their messages into a ring buffer. "
+		 "When a ring is full its new messages are dropped, and their number is logged.",
+		 "false"},
+		{ByteSize, "log-async-buffer-size",
+		 "Size of the ring buffer of each logging thread when log-async is enabled. A message larger than a quarter of "
+		 "it is truncated.",
+		 "4M"},
+		{StringList, "thread-placement",
+		 "Placement of the threads of the subsystems on the NUMA nodes, as subsystem=node entries separated by spaces, "
+		 "for example 'sip=0 relay=1 transcoder=1 db=0'. The subsystems are sip (the main loop processing the SIP "
+		 "messages), relay (the media relay threads), transcoder (the tickers of the transcoder, one per CPU of the "
+		 "node) and db (the threads of the authentication and event log databases). The threads of a subsystem are "
+		 "pinned to the CPUs of its node and allocate their memory from it. The other threads share the placement "
+		 "of sip. The topology and the placements are logged at startup. Empty to let the system place the threads.",
+		 ""},
+		{Boolean, "overload-control",
+		 "Queue the incoming requests by priority class before processing them, the most important first: in-dialog "
+		 "requests, INVITEs and their CANCELs, MESSAGEs and the other out of dialog requests, REGISTERs, then "
+		 "OPTIONS. Under overload, the requests of the less important classes are answered with 503 and a "
+		 "Retry-After header instead of delaying the others, as soon as they arrive when the estimated wait exceeds "
+		 "the delay allowed to their class.",
+		 "false"},
+		{Integer, "overload-max-queue-delay",
+		 "Time in milliseconds an INVITE may wait in the overload control queue. The MESSAGEs may wait 3/4 of it, the "
+		 "REGISTERs half of it and the OPTIONS a quarter of it, the in-dialog requests are never rejected.",
+		 "500"},
+		{Integer, "overload-max-queue-size",
+		 "Maximum number of requests waiting in the overload control queue, beyond which the new requests are answered "
+		 "with 503 but the in-dialog ones.",
+		 "10000"},
+		{Boolean, "batch-dispatch",
+		 "Dispatch the incoming requests to the modules by batch rather than one by one: the requests arriving within "
+		 "batch-dispatch-max-delay go through each module together, which keeps the work of a module hot in the caches "
+		 "and issues the registrar fetches of the batch together to Redis. It delays the processing of the requests "
+		 "by batch-dispatch-max-delay at most. With overload-control, it applies to the requests taken out of its "
+		 "queue.",
+		 "false"},
+		{Integer, "batch-dispatch-size",
+		 "Number of requests of a batch, beyond which it is dispatched without waiting for batch-dispatch-max-delay.",
+		 "32"},
+		{Integer, "batch-dispatch-max-delay",
+		 "Time in milliseconds the first request of a batch may wait for the following ones. 0 dispatches the batch at "
+		 "the next iteration of the main loop, with the requests received in the meantime.",
+		 "2"},
+		{Integer, "saturation-max-delay",
+		 "Lag of the timers of the main loop, or wait of a task for a thread of a pool, in milliseconds, taken as a "
+		 "full load by headroom-permille.",
+		 "100"},
+		{Integer, "idle-sweep-interval",
+		 "Interval in milliseconds between two slices of the incremental sweeps of the tables of the modules (expired "
+		 "DoS protection contexts, identities of the closed connections, inactive relayed calls...). 0 disables the "
+		 "sweeps, the tables then grow with the expired entries.",
+		 "100"},
+		{Integer, "idle-sweep-budget",
+		 "Time in microseconds each module may spend on a slice of its sweep, after which it resumes at the next "
+		 "slice. It bounds the time during which the main loop stops servicing the messages to clean the tables.",
+		 "500"},
+		{StringList, "compact-headers",
+		 "Transports among udp, tcp and tls on which the forwarded messages are written with compact headers: the one "
+		 "letter names of RFC 3261 for the headers having one, no space after the colons and in the lists, and no "
+		 "transport=udp parameter in the sip URIs of the Contact, Route and Record-Route headers. The transport of a "
+		 "response is the one of its next Via, the one of a request the one of its destination URI. It keeps the "
+		 "responses with long Via and Record-Route chains under the MTU and lightens the messages sent to mobile "
+		 "clients, for clients all parsing the compact forms, as RFC 3261 requires. Empty to disable.",
+		 ""},
+		{BooleanExpr, "debug-filter",
+		 "Filter on the SIP messages whose processing is logged at the debug level whatever the log level, for example "
+		 "from.uri.user == 'alice'. It is evaluated once when an event is created for a message, on the log domain "
+		 "flexisip-debug. Empty to disable.",
+		 ""},
+		{BooleanExpr, "stateless-forward",
+		 "Filter on the requests forwarded statelessly: they only go through the SanityChecker, DoSProtection, "
+		 "GarbageIn, NatHelper and Forward modules, without incoming nor outgoing transaction, fork context, "
+		 "authentication, relayed media or registrar lookup. It suits the in-dialog requests routed by their Route "
+		 "headers that need none of these, for example is_request && to.tag != '' && "
+		 "(request.method-name == 'ACK' || request.method-name == 'BYE' || request.method-name == 'INFO'). The requests "
+		 "of the dialogs whose media is relayed or transcoded must not match it. It is evaluated once when a request "
+		 "is received. Empty to disable.",
+		 ""},
 		config_item_end};
 
 	static ConfigItemDescriptor cluster_conf[] = {
@@ -894,6 +1096,9 @@ bool GenericManager::doOnConfigStateChanged(const ConfigValue &conf, ConfigState
 			return doIsValidNextConfig(conf);
 		case ConfigState::Changed:
 			mDirtyConfig = true;
+			if (mReloading && conf.getName() != "log-filter")
+				LOGW("%s/%s will only be applied at the next restart.", conf.getParent()->getName().c_str(),
+					 conf.getName().c_str());
 			break;
 		case ConfigState::Reset:
 			mDirtyConfig = false;
@@ -901,6 +1106,8 @@ bool GenericManager::doOnConfigStateChanged(const ConfigValue &conf, ConfigState
 		case ConfigState::Commited:
 			if (conf.getName() == "log-filter") {
 				flexisip::log::updateFilter(conf.getNextValue());
+			} else if (mReloading) {
+				mDirtyConfig = false;
 			} else if (mDirtyConfig) {
 				LOGI("Scheduling server restart to apply new config.");
 				mDirtyConfig = false;
@@ -924,6 +1131,70 @@ void GenericManager::loadStrict() {
 	applyOverrides(true);
 }
 
+bool GenericManager::reloadFile() {
+	list<pair<ConfigValue *, string>> changes;
+	if (mReader.readChanges(mConfigFile.c_str(), changes) != 0) {
+		LOGE("Cannot read %s, configuration left unchanged.", mConfigFile.c_str());
+		return false;
+	}
+	// the values set on the command line take precedence over the file
+	for (auto it = changes.begin(); it != changes.end();) {
+		auto override = mOverrides.find(it->first->getParent()->getName() + "/" + it->first->getName());
+		if (override != mOverrides.end() && !override->second.empty())
+			it = changes.erase(it);
+		else
+			++it;
+	}
+	if (changes.empty()) {
+		LOGI("Configuration reloaded from %s, nothing changed.", mConfigFile.c_str());
+		return true;
+	}
+
+	for (auto &change : changes) {
+		ConfigValue *cv = change.first;
+		bool valid = true;
+		if (cv->getType() == Boolean) {
+			// setNextValue() is fatal on a bad boolean
+			try {
+				ConfigBoolean::parse(change.second);
+			} catch (FlexisipException &) {
+				valid = false;
+			}
+		}
+		if (valid) {
+			cv->setNextValue(change.second);
+			valid = cv->invokeConfigStateChanged(ConfigState::Check);
+		}
+		if (!valid) {
+			LOGE("Invalid value \"%s\" for %s/%s in %s, configuration left unchanged.", change.second.c_str(),
+				 cv->getParent()->getName().c_str(), cv->getName().c_str(), mConfigFile.c_str());
+			for (auto &c : changes)
+				c.first->setNextValue(c.first->get());
+			return false;
+		}
+	}
+
+	mReloading = true;
+	sWriteBack = false;
+	for (auto &change : changes) {
+		ConfigValue *cv = change.first;
+		LOGI("Reloading %s/%s: \"%s\" -> \"%s\"", cv->getParent()->getName().c_str(), cv->getName().c_str(),
+			 cv->get().c_str(), change.second.c_str());
+		cv->set(change.second);
+		cv->invokeConfigStateChanged(ConfigState::Changed);
+	}
+	// once per section, a module being reloaded with all its new values at once
+	set<GenericEntry *> commited;
+	for (auto &change : changes) {
+		if (commited.insert(change.first->getParent()).second)
+			change.first->invokeConfigStateChanged(ConfigState::Commited);
+	}
+	sWriteBack = true;
+	mReloading = false;
+	LOGI("Configuration reloaded from %s, %zu values changed.", mConfigFile.c_str(), changes.size());
+	return true;
+}
+
 GenericStruct *GenericManager::getRoot() {
 	return &mConfigRoot;
 }
@@ -945,6 +1216,37 @@ int FileConfigReader::reload() {
 	return 0;
 }
 
+int FileConfigReader::readChanges(const char *filename, list<pair<ConfigValue *, string>> &changes) {
+	struct _LpConfig *cfg = lp_config_new(NULL);
+	if (lp_config_read_file(cfg, filename) != 0) {
+		lp_config_destroy(cfg);
+		return -1;
+	}
+	if (mCfg)
+		lp_config_destroy(mCfg);
+	mCfg = cfg;
+	collectChanges(mRoot, changes);
+	return 0;
+}
+
+void FileConfigReader::collectChanges(GenericEntry *entry, list<pair<ConfigValue *, string>> &changes) {
+	GenericStruct *cs = dynamic_cast<GenericStruct *>(entry);
+	ConfigValue *cv;
+	if (cs) {
+		if (!cs->isFullyDeclared())
+			lp_config_for_each_item(mCfg, cs->getName().c_str(), onSectionItem, cs);
+		auto &entries = cs->getDeclaredChildren();
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			collectChanges(*it, changes);
+		}
+	} else if ((cv = dynamic_cast<ConfigValue *>(entry)) && cv->getParent() && cv->getParent() != mRoot) {
+		string val = lp_config_get_string(mCfg, cv->getParent()->getName().c_str(), cv->getName().c_str(),
+										  cv->getDefault().c_str());
+		if (val != cv->get())
+			changes.push_back(make_pair(cv, val));
+	}
+}
+
 void FileConfigReader::onUnreadItem(void *p, const char *secname, const char *key, int lineno) {
 	FileConfigReader *zis = (FileConfigReader *)p;
 	zis->onUnreadItem(secname, key, lineno);
@@ -996,11 +1298,20 @@ void FileConfigReader::checkUnread() {
 		LOGF("Some items or section are invalid in the configuration file. Please check it.");
 }
 
+void FileConfigReader::onSectionItem(void *p, const char *secname, const char *key, int lineno) {
+	GenericStruct *cs = (GenericStruct *)p;
+	// completes the declaration of the struct if the file sets one of its undeclared items
+	cs->find(key);
+}
+
 int FileConfigReader::read2(GenericEntry *entry, int level) {
 	GenericStruct *cs = dynamic_cast<GenericStruct *>(entry);
 	ConfigValue *cv;
 	if (cs) {
-		auto &entries = cs->getChildren();
+		if (!cs->isFullyDeclared())
+			lp_config_for_each_item(mCfg, cs->getName().c_str(), onSectionItem, cs);
+		// the items of a struct whose declaration is still deferred keep their defaults
+		auto &entries = cs->getDeclaredChildren();
 		for (auto it = entries.begin(); it != entries.end(); ++it) {
 			read2(*it, level + 1);
 		}
@@ -1027,6 +1338,65 @@ FileConfigReader::~FileConfigReader() {
 GenericEntriesGetter *GenericEntriesGetter::sInstance = NULL;
 
 #ifdef ENABLE_SNMP
+static void snapshotEntries(const GenericStruct *gstruct, GenericManager::SnmpSnapshot &snapshot) {
+	// the entries not declared yet are not registered to the SNMP agent either
+	for (GenericEntry *entry : gstruct->getDeclaredChildren()) {
+		switch (entry->getType()) {
+			case Struct:
+				snapshotEntries(static_cast<GenericStruct *>(entry), snapshot);
+				break;
+			case Counter64:
+				snapshot.numbers[entry] = static_cast<StatCounter64 *>(entry)->read();
+				break;
+			case Boolean:
+				snapshot.numbers[entry] = static_cast<ConfigBoolean *>(entry)->read() ? 1 : 0;
+				break;
+			case Integer:
+				snapshot.numbers[entry] = (uint64_t)(int64_t) static_cast<ConfigInt *>(entry)->read();
+				break;
+			case RuntimeError:
+				snapshot.strings[entry] = static_cast<ConfigRuntimeError *>(entry)->generateErrors();
+				break;
+			case Notification:
+				break;
+			default:
+				snapshot.strings[entry] = static_cast<ConfigValue *>(entry)->get();
+				break;
+		}
+	}
+}
+
+void GenericManager::publishSnmpSnapshot() {
+	auto snapshot = make_shared<SnmpSnapshot>();
+	snapshotEntries(&mConfigRoot, *snapshot);
+	atomic_store(&mSnmpSnapshot, shared_ptr<const SnmpSnapshot>(snapshot));
+}
+
+/* Answers a read from the snapshot, false if the entry was registered after it. */
+static bool answerFromSnapshot(const GenericEntry *entry, const GenericManager::SnmpSnapshot &snapshot,
+							   netsnmp_request_info *requests) {
+	if (entry->getType() == Counter64 || entry->getType() == Boolean || entry->getType() == Integer) {
+		auto it = snapshot.numbers.find(entry);
+		if (it == snapshot.numbers.end())
+			return false;
+		if (entry->getType() == Counter64) {
+			struct counter64 counter;
+			counter.high = it->second >> 32;
+			counter.low = it->second & 0x00000000FFFFFFFF;
+			snmp_set_var_typed_value(requests->requestvb, ASN_COUNTER64, (const u_char *)&counter, sizeof(counter));
+		} else {
+			snmp_set_var_typed_integer(requests->requestvb, ASN_INTEGER, (long)(int64_t)it->second);
+		}
+		return true;
+	}
+	auto it = snapshot.strings.find(entry);
+	if (it == snapshot.strings.end())
+		return false;
+	snmp_set_var_typed_value(requests->requestvb, ASN_OCTET_STR, (const u_char *)it->second.c_str(),
+							 it->second.size());
+	return true;
+}
+
 int GenericEntry::sHandleSnmpRequest(netsnmp_mib_handler *handler, netsnmp_handler_registration *reginfo,
 									 netsnmp_agent_request_info *reqinfo, netsnmp_request_info *requests) {
 	if (!reginfo->my_reg_void) {
@@ -1034,6 +1404,11 @@ int GenericEntry::sHandleSnmpRequest(netsnmp_mib_handler *handler, netsnmp_handl
 		return SNMP_ERR_GENERR;
 	} else {
 		GenericEntry *cv = static_cast<GenericEntry *>(reginfo->my_reg_void);
+		if (reqinfo->mode == MODE_GET) {
+			auto snapshot = GenericManager::get()->getSnmpSnapshot();
+			if (snapshot && answerFromSnapshot(cv, *snapshot, requests))
+				return SNMP_ERR_NOERROR;
+		}
 		return cv->handleSnmpRequest(handler, reginfo, reqinfo, requests);
 	}
 }
@@ -44,6 +44,8 @@
 #include <typeinfo>
 #include <cxxabi.h>
 #include <memory>
+#include <atomic>
+#include <functional>
 
 #include "common.hh"
 
@@ -76,6 +78,8 @@ class ConfigValueListener {
 
   protected:
 	virtual bool doOnConfigStateChanged(const ConfigValue &conf, ConfigState state) = 0;
+	// false while the changes come from the file itself, which is then not rewritten
+	static bool sWriteBack;
 };
 
 enum GenericValueType {
@@ -311,6 +315,21 @@ class GenericStruct : public GenericEntry {
 	void deprecateChild(const char *name);
 	// void addChildrenValues(StatItemDescriptor *items);
 	const std::list<GenericEntry *> &getChildren() const;
+	/* Children declared so far, without completing a deferred declaration. */
+	const std::list<GenericEntry *> &getDeclaredChildren() const {
+		return mEntries;
+	}
+	/*
+	 * Defers the declaration of the rest of the children to the first lookup of a child not declared yet, or to the
+	 * first walk through all the children, so that the structs nobody looks into cost nothing at startup.
+	 */
+	void setDeferredDeclaration(const std::function<void(GenericStruct *)> &declare) {
+		mDeferredDeclaration = declare;
+	}
+	bool isFullyDeclared() const {
+		return !mDeferredDeclaration;
+	}
+	void completeDeclaration() const;
 	template <typename _retType> _retType *get(const char *name) const;
 	template <typename _retType> _retType *getDeep(const char *name, bool strict) const;
 	~GenericStruct();
@@ -324,6 +343,7 @@ class GenericStruct : public GenericEntry {
 
   private:
 	std::list<GenericEntry *> mEntries;
+	mutable std::function<void(GenericStruct *)> mDeferredDeclaration;
 };
 
 class RootConfigStruct : public GenericStruct {
@@ -341,30 +361,53 @@ class StatCounter64 : public GenericEntry {
 #endif
 	virtual void mibFragment(std::ostream &ost, std::string spacing) const;
 	void setParent(GenericEntry *parent);
-	uint64_t read() {
-		return mValue;
+	/*
+	 * The value is split into slots of their own cache line, each thread adding to one of them with relaxed atomics:
+	 * the threads incrementing the same counter do not contend, and the statistics can be read from other threads
+	 * without locking nor torn values. Reading adds the slots up.
+	 */
+	uint64_t read() const {
+		uint64_t value = 0;
+		for (const Slot &slot : mSlots)
+			value += slot.value.load(std::memory_order_relaxed);
+		return value;
 	}
+	/* For the gauges, whose value is set by a single thread at a time. */
 	void set(uint64_t val) {
-		mValue = val;
+		mSlots[0].value.store(val, std::memory_order_relaxed);
+		for (int i = 1; i < SlotCount; ++i)
+			mSlots[i].value.store(0, std::memory_order_relaxed);
 	}
 	void operator++() {
-		++mValue;
+		incr();
 	}
 	void operator++(int) {
-		mValue++;
+		incr();
 	}
 	void operator--() {
-		--mValue;
+		// unsigned arithmetic, the sum is right even if this slot goes below zero
+		mSlots[threadSlot()].value.fetch_sub(1, std::memory_order_relaxed);
 	}
 	void operator--(int) {
-		mValue--;
+		--*this;
 	}
 	inline void incr() {
-		mValue++;
+		mSlots[threadSlot()].value.fetch_add(1, std::memory_order_relaxed);
 	}
 
   private:
-	uint64_t mValue;
+	enum { SlotCount = 8 };
+	struct Slot {
+		std::atomic<uint64_t> value;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+	/* Slot of the calling thread, given in turn to the threads the first time they update a counter. */
+	static inline int threadSlot() {
+		static thread_local int slot = sNextSlot.fetch_add(1, std::memory_order_relaxed) % SlotCount;
+		return slot;
+	}
+	static std::atomic<int> sNextSlot;
+	Slot mSlots[SlotCount];
 };
 
 struct StatPair {
@@ -397,6 +440,8 @@ class StatFinishListener {
 };
 
 class ConfigValue : public GenericEntry {
+	friend class GenericManager;
+
   public:
 	ConfigValue(const std::string &name, GenericValueType vt, const std::string &help, const std::string &default_value,
 				oid oid_index);
@@ -570,13 +615,17 @@ class FileConfigReader {
 	}
 	int read(const char *filename);
 	int reload();
+	/* Reads the file again, and lists the values that differ from the current ones without changing them. */
+	int readChanges(const char *filename, std::list<std::pair<ConfigValue *, std::string>> &changes);
 	void checkUnread();
 	~FileConfigReader();
 
   private:
 	int read2(GenericEntry *entry, int level);
+	void collectChanges(GenericEntry *entry, std::list<std::pair<ConfigValue *, std::string>> &changes);
 	static void onUnreadItem(void *p, const char *secname, const char *key, int lineno);
 	void onUnreadItem(const char *secname, const char *key, int lineno);
+	static void onSectionItem(void *p, const char *secname, const char *key, int lineno);
 	GenericStruct *mRoot;
 	struct _LpConfig *mCfg;
 	bool mHaveUnreads;
@@ -616,11 +665,30 @@ class GenericManager : protected ConfigValueListener {
 
 	const GenericStruct *getGlobal();
 	void loadStrict();
+	/*
+	 * Reads the configuration file again and applies the values that changed, through the listeners of their
+	 * sections: the modules concerned are reloaded, while the settings that need a restart are only reported.
+	 * The values set on the command line are kept. Returns false, changing nothing, if a new value is invalid.
+	 */
+	bool reloadFile();
 	StatCounter64 &findStat(const std::string &key);
 	void addStat(const std::string &key, StatCounter64 &stat);
 	NotificationEntry *getSnmpNotifier() {
 		return mNotifier;
 	}
+#ifdef ENABLE_SNMP
+	/* Values served to the SNMP requests, copied from the entries by publishSnmpSnapshot(). */
+	struct SnmpSnapshot {
+		std::unordered_map<const GenericEntry *, uint64_t> numbers; // statistics, integers and booleans
+		std::unordered_map<const GenericEntry *, std::string> strings;
+	};
+	/* To call from the main thread: the SNMP thread answers the reads from the last snapshot published, without
+	 * touching the live entries. */
+	void publishSnmpSnapshot();
+	std::shared_ptr<const SnmpSnapshot> getSnmpSnapshot() const {
+		return std::atomic_load(&mSnmpSnapshot);
+	}
+#endif
 	void sendTrap(const GenericEntry *source, const std::string &msg) {
 		mNotifier->send(source, msg);
 	}
@@ -629,6 +697,7 @@ class GenericManager : protected ConfigValueListener {
 	}
 	bool mNeedRestart;
 	bool mDirtyConfig;
+	bool mReloading;
 	void applyOverrides(bool strict) {
 		for (auto it = mOverrides.begin(); it != mOverrides.end(); ++it) {
 			const std::string &key((*it).first);
@@ -660,6 +729,9 @@ class GenericManager : protected ConfigValueListener {
 	std::map<std::string, StatCounter64 *> mStatMap;
 	std::unordered_set<std::string> mStatOids;
 	NotificationEntry *mNotifier;
+#ifdef ENABLE_SNMP
+	std::shared_ptr<const SnmpSnapshot> mSnmpSnapshot;
+#endif
 };
 
 #endif
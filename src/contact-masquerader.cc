@@ -20,9 +20,18 @@
 
 using namespace std;
 
+// connections whose contact is cached, beyond which the cache is started again
+static const size_t sMaxCachedConnections = 1 << 20;
+
+ContactMasquerader::ContactMasquerader(Agent *agent, std::string paramName) : mAgent(agent), mCtRtParamName(paramName) {
+	char tport_value[64];
+	if (url_param(mAgent->getDefaultUri()->url_params, "transport", tport_value, sizeof(tport_value)) > 0)
+		mDefaultTransportParam = string("transport=") + tport_value;
+}
+
 /*add a parameter like "CtRt15.128.128.2=tcp:201.45.118.16:50025" in the contact, so that we know where is the client
  when we later have to route an INVITE to him */
-void ContactMasquerader::masquerade(su_home_t *home, sip_contact_t *c, const char *domain) {
+void ContactMasquerader::masquerade(su_home_t *home, sip_contact_t *c, const char *domain, const tport_t *tport) {
 	if (c == NULL || c->m_url->url_host == NULL) {
 		LOGD("Sip contact or url is null");
 		return;
@@ -34,6 +43,28 @@ void ContactMasquerader::masquerade(su_home_t *home, sip_contact_t *c, const cha
 		return;
 	}
 
+	const url_t *defaultUri = mAgent->getDefaultUri();
+	CachedContact *cached = NULL;
+	if (tport) {
+		if (mCache.size() >= sMaxCachedConnections && mCache.find(tport) == mCache.end())
+			mCache.clear();
+		cached = &mCache[tport];
+		const char *params = ct_url->url_params ? ct_url->url_params : "";
+		if (!cached->masqueradedParams.empty() && cached->host == ct_url->url_host &&
+			cached->port == url_port(ct_url) && cached->params == params && cached->domain == (domain ? domain : "")) {
+			ct_url->url_host = defaultUri->url_host;
+			ct_url->url_port = defaultUri->url_port;
+			ct_url->url_scheme = defaultUri->url_scheme;
+			ct_url->url_params = su_strdup(home, cached->masqueradedParams.c_str());
+			SLOGD << "Contact has been rewritten to " << url_as_string(home, ct_url);
+			return;
+		}
+		cached->host = ct_url->url_host;
+		cached->port = url_port(ct_url);
+		cached->params = params;
+		cached->domain = domain ? domain : "";
+	}
+
 	// grab the transport of the contact uri
 	char ct_tport[32] = "udp";
 	if (url_param(ct_url->url_params, "transport", ct_tport, sizeof(ct_tport)) > 0) {
@@ -58,21 +89,24 @@ void ContactMasquerader::masquerade(su_home_t *home, sip_contact_t *c, const cha
 	}
 
 	/*masquerade the contact, so that later requests (INVITEs) come to us */
-	const url_t *defaultUri = mAgent->getDefaultUri();
 	ct_url->url_host = defaultUri->url_host;
 	ct_url->url_port = defaultUri->url_port;
 	ct_url->url_scheme = defaultUri->url_scheme;
 	ct_url->url_params = url_strip_param_string(su_strdup(home, ct_url->url_params), "transport");
-	char tport_value[64];
-	if (url_param(defaultUri->url_params, "transport", tport_value, sizeof(tport_value)) > 0) {
-		char *lParam = su_sprintf(home, "transport=%s", tport_value);
-		url_param_add(home, ct_url, lParam);
-	}
+	if (!mDefaultTransportParam.empty())
+		url_param_add(home, ct_url, mDefaultTransportParam.c_str());
+	if (cached && ct_url->url_params)
+		cached->masqueradedParams = ct_url->url_params;
 	SLOGD << "Contact has been rewritten to " << url_as_string(home, ct_url);
 }
 
 void ContactMasquerader::masquerade(std::shared_ptr<SipEvent> ev, bool insertDomain) {
 		const char *domain = insertDomain ? ev->getSip()->sip_from->a_url->url_host : NULL;
+		// only the connections identify a client, not the shared UDP transport
+		const tport_t *tport = NULL;
+		auto request = dynamic_pointer_cast<RequestSipEvent>(ev);
+		if (request && request->getIncomingTport() && tport_is_secondary(request->getIncomingTport().get()))
+			tport = request->getIncomingTport().get();
 		sip_contact_t *contact = ev->getSip()->sip_contact;
 		while(contact) {
 			if(contact->m_expires && strcmp(contact->m_expires, "0") == 0 && (contact != ev->getSip()->sip_contact || contact->m_next)) {
@@ -81,7 +115,7 @@ void ContactMasquerader::masquerade(std::shared_ptr<SipEvent> ev, bool insertDom
 				msg_header_remove(ev->getMsgSip()->getMsg(), (msg_pub_t *)ev->getSip(), (msg_header_t *)contact);
 				contact = tmp;
 			} else {
-				masquerade(ev->getHome(), contact, domain);
+				masquerade(ev->getHome(), contact, domain, tport);
 				contact = contact->m_next;
 			}
 		}
@@ -23,19 +23,30 @@
 #include "event.hh"
 #include "agent.hh"
 #include <string>
+#include <unordered_map>
 
 class ContactMasquerader {
+	/* The contact last masqueraded for each connection, as a client keeps sending the same one over its connection. */
+	struct CachedContact {
+		std::string host;
+		std::string port;
+		std::string params;
+		std::string domain;
+		std::string masqueradedParams;
+	};
 	Agent *mAgent;
 	std::string mCtRtParamName;
+	std::string mDefaultTransportParam;
+	std::unordered_map<const tport_t *, CachedContact> mCache;
 
   public:
-	ContactMasquerader(Agent *agent, std::string paramName) : mAgent(agent), mCtRtParamName(paramName) {
-	}
+	ContactMasquerader(Agent *agent, std::string paramName);
 
 	/*add a parameter like "CtRt15.128.128.2=tcp:201.45.118.16:50025" in the contact, so that we know where is the
 	 client
-	 when we later have to route an INVITE to him */
-	void masquerade(su_home_t *home, sip_contact_t *c, const char *domain = NULL);
+	 when we later have to route an INVITE to him.
+	 With the connection the contact came from, the parameters are only formatted again when the contact changes. */
+	void masquerade(su_home_t *home, sip_contact_t *c, const char *domain = NULL, const tport_t *tport = NULL);
 	
 	/**
 	 * Masquerade each contact header of a REGISTER request except those
@@ -28,12 +28,14 @@
 #include <sofia-sip/sip_tag.h>
 #include <sofia-sip/nta_tport.h>
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
 using namespace std;
 
-DomainRegistrationManager::DomainRegistrationManager(Agent *agent) : mAgent(agent) {
+DomainRegistrationManager::DomainRegistrationManager(Agent *agent)
+	: mAgent(agent), mRegistrationRate(0), mTokens(0), mRandom(random_device()()) {
 	GenericManager *mgr = GenericManager::get();
 	mDomainRegistrationArea = new GenericStruct(
 		"inter-domain-connections",
@@ -91,6 +93,11 @@ DomainRegistrationManager::DomainRegistrationManager(Agent *agent) : mAgent(agen
 		 "Interval in seconds for sending \\r\\n\\r\\n keepalives throug the outgoing domain registration connection."
 		 "A value of zero disables keepalives.",
 		 "30"},
+		{Integer, "registration-rate",
+		 "Maximum number of domain REGISTERs sent per second. The refreshes are also spread randomly between 80 and "
+		 "90% of the expiration delays, and the failed registrations retried with an exponential backoff, so that "
+		 "the domains do not all register at once when the remote proxy restarts.",
+		 "10"},
 		config_item_end};
 
 	mDomainRegistrationArea->addChildrenValues(configs);
@@ -113,6 +120,7 @@ int DomainRegistrationManager::load(string passphrase) {
 	
 	mVerifyServerCerts = domainRegistrationCfg->get<ConfigBoolean>("verify-server-certs")->read();
 	mKeepaliveInterval = domainRegistrationCfg->get<ConfigInt>("keepalive-interval")->read();
+	mRegistrationRate = max(1, domainRegistrationCfg->get<ConfigInt>("registration-rate")->read());
 	
 	if (configFile.empty())
 		return 0;
@@ -174,6 +182,50 @@ error:
 	return -1;
 }
 
+void DomainRegistrationManager::enqueue(DomainRegistration *dr) {
+	dequeue(dr);
+	mQueue.push_back(dr);
+	pump();
+}
+
+void DomainRegistrationManager::dequeue(DomainRegistration *dr) {
+	auto it = find(mQueue.begin(), mQueue.end(), dr);
+	if (it != mQueue.end())
+		mQueue.erase(it);
+}
+
+void DomainRegistrationManager::pump() {
+	if (!mPumpTimer) {
+		// a new second of sending
+		mTokens = mRegistrationRate;
+	}
+	while (!mQueue.empty() && mTokens > 0) {
+		DomainRegistration *dr = mQueue.front();
+		mQueue.pop_front();
+		--mTokens;
+		dr->send();
+	}
+	if (!mPumpTimer) {
+		mPumpTimer = mAgent->getTimers()->schedule(1, [this]() {
+			mPumpTimer.reset();
+			if (!mQueue.empty())
+				pump();
+		});
+	}
+}
+
+int DomainRegistrationManager::jitter(int min, int max) {
+	if (max <= min)
+		return min;
+	return uniform_int_distribution<int>(min, max)(mRandom);
+}
+
+int DomainRegistrationManager::backoff(int failures) {
+	// from 1 second to 10 minutes
+	int delay = min(600, 1 << min(failures, 10));
+	return jitter((delay + 1) / 2, delay);
+}
+
 bool DomainRegistrationManager::isUs(const url_t *url) const {
 	for (auto it = mRegistrations.begin(); it != mRegistrations.end(); ++it) {
 		const shared_ptr<DomainRegistration> &dr = *it;
@@ -215,7 +267,13 @@ DomainRegistration::DomainRegistration(DomainRegistrationManager &mgr, const str
 			// Certs dir is the same as for the existing tport
 			LOGD("Domain registration certificates are the same as the one for existing tports, let's use them");
 			mPrimaryTport = nta_agent_tports(agent);
+		} else if (mgr.mClientTports.find(clientCertdir) != mgr.mClientTports.end()) {
+			// the domains presenting the same certificate share the tport, and so its connections
+			LOGD("Domain registration certificates already used by a tport, let's use it");
+			tpn.tpn_ident = mgr.mClientTports[clientCertdir].c_str();
+			mPrimaryTport = tport_by_name(nta_agent_tports(agent), &tpn);
 		} else {
+			mgr.mClientTports[clientCertdir] = localDomain;
 			list<string> canons;
 			tport_t *primaries = tport_primaries(nta_agent_tports(agent));
 			for (tport_t *tport = primaries; tport != NULL; tport = tport_next(tport)) {
@@ -251,8 +309,8 @@ DomainRegistration::DomainRegistration(DomainRegistrationManager &mgr, const str
 		LOGF("Could not create leg");
 	}
 	mCurrentTport = NULL;
-	mTimer = NULL;
 	mExternalContact = NULL;
+	mFailures = 0;
 
 	ostringstream domainRegistrationStatName;
 	domainRegistrationStatName<<"registration-status-"<<lineIndex;
@@ -275,8 +333,8 @@ int DomainRegistration::sLegCallback(nta_leg_magic_t *ctx, nta_leg_t *leg, nta_i
 	return 500;
 }
 
-void DomainRegistration::sRefreshRegistration(su_root_magic_t *magic, su_timer_t *timer, su_timer_arg_t *arg) {
-	static_cast<DomainRegistration *>(arg)->start();
+void DomainRegistration::scheduleRefresh(int seconds) {
+	mTimer = mManager.mAgent->getTimers()->schedule(seconds, [this]() { start(); });
 }
 
 int DomainRegistration::getExpires(nta_outgoing_t *orq, const sip_t *response) {
@@ -296,15 +354,11 @@ int DomainRegistration::getExpires(nta_outgoing_t *orq, const sip_t *response) {
 }
 
 void DomainRegistration::onConnectionBroken(tport_t *tport, msg_t *msg, int error) {
-	int nextSchedule = 5;
+	// the connections shared with other domains break for all of them at once
+	int nextSchedule = mManager.backoff(mFailures++) + 4;
 	// restart registration...
-	if (mTimer) {
-		su_timer_destroy(mTimer);
-		mTimer = NULL;
-	}
-	mTimer = su_timer_create(su_root_task(mManager.mAgent->getRoot()), 0);
 	LOGD("Scheduling next domain register refresh for %s in %i seconds", mFrom->url_host, nextSchedule);
-	su_timer_set_interval(mTimer, &DomainRegistration::sRefreshRegistration, this, (su_duration_t)nextSchedule * 1000);
+	scheduleRefresh(nextSchedule);
 	LOGD("DomainRegistration::onConnectionBroken(), restarting registration in %i seconds", nextSchedule);
 	mRegistrationStatus->set(503);
 }
@@ -318,11 +372,9 @@ void DomainRegistration::responseCallback(nta_outgoing_t *orq, const sip_t *resp
 	int nextSchedule;
 	SofiaAutoHome home;
 
-	if (mTimer) {
-		su_timer_destroy(mTimer);
-		mTimer = NULL;
-	}
-	mTimer = su_timer_create(su_root_task(mManager.mAgent->getRoot()), 0);
+	if (resp && resp->sip_status->st_status < 200)
+		return;
+	mTimer.reset();
 	if (resp) {
 		msg_t *msg = nta_outgoing_getresponse(orq);
 		SLOGD << "DomainRegistration::responseCallback(): receiving response:" << endl
@@ -334,16 +386,14 @@ void DomainRegistration::responseCallback(nta_outgoing_t *orq, const sip_t *resp
 
 	if (!resp || resp->sip_status->st_status != 200) {
 		/*the registration failed for whatever reason. Retry shortly.*/
+		nextSchedule = mManager.backoff(mFailures++);
 		if (!resp){
-			nextSchedule = 1;
 			SLOGUE << "Domain registration error for " << url_as_string(home.home(), mFrom);
 		}else{
-			nextSchedule = 30;
 			SLOGUE << "Domain registration error for " << url_as_string(home.home(), mFrom) << " : " << resp->sip_status->st_status;
 		}
 		LOGD("Domain registration for %s failed, will retry in %i seconds", mFrom->url_host, nextSchedule);
-		su_timer_set_interval(mTimer, &DomainRegistration::sRefreshRegistration, this,
-							  (su_duration_t)nextSchedule * 1000);
+		scheduleRefresh(nextSchedule);
 		if (!resp){
 			if (mCurrentTport){
 				LOGD("No domain registration response, connection might be broken. Shutting down current connection.");
@@ -359,10 +409,11 @@ void DomainRegistration::responseCallback(nta_outgoing_t *orq, const sip_t *resp
 		mCurrentTport = tport;
 		tport_set_params(tport, TPTAG_SDWN_ERROR(1), TPTAG_KEEPALIVE(keepAliveInterval), TAG_END());
 		mPendId = tport_pend(tport, NULL, &DomainRegistration::sOnConnectionBroken, (tp_client_t *)this);
-		nextSchedule = ((getExpires(orq, resp) * 90) / 100) + 1;
+		mFailures = 0;
+		int expires = getExpires(orq, resp);
+		nextSchedule = mManager.jitter((expires * 80) / 100, (expires * 90) / 100) + 1;
 		LOGD("Scheduling next domain register refresh for %s in %i seconds", mFrom->url_host, nextSchedule);
-		su_timer_set_interval(mTimer, &DomainRegistration::sRefreshRegistration, this,
-							  (su_duration_t)nextSchedule * 1000);
+		scheduleRefresh(nextSchedule);
 		/*store contact sent in response, as it gives information about our public IP/port*/
 		if (resp->sip_contact) {
 			if (mExternalContact) {
@@ -390,12 +441,13 @@ void DomainRegistration::setContact(msg_t *msg) {
 }
 
 void DomainRegistration::start() {
+	mTimer.reset();
+	mManager.enqueue(this);
+}
+
+void DomainRegistration::send() {
 	msg_t *msg;
 
-	if (mTimer) {
-		su_timer_destroy(mTimer);
-		mTimer = NULL;
-	}
 
 	msg = nta_msg_create(mManager.mAgent->getSofiaAgent(), 0);
 	if (nta_msg_request_complete(msg, mLeg, sip_method_register, NULL, (url_string_t *)mProxy) != 0) {
@@ -410,6 +462,8 @@ void DomainRegistration::start() {
 	LOGD("Domain registration about to be sent:\n%s", msg_as_string(&home, msg, msg_object(msg), 0, NULL));
 	su_home_deinit(&home);
 
+	if (mManager.mAgent->getResolverCache())
+		mManager.mAgent->getResolverCache()->touch(mProxy);
 	nta_outgoing_t *outgoing =
 		nta_outgoing_mcreate(mManager.mAgent->getSofiaAgent(), sResponseCallback, (nta_outgoing_magic_t *)this, NULL,
 							 msg, NTATAG_TPORT(mPrimaryTport), TAG_END());
@@ -430,10 +484,8 @@ void DomainRegistration::cleanCurrentTport() {
 
 void DomainRegistration::stop() {
 	cleanCurrentTport();
-	if (mTimer) {
-		su_timer_destroy(mTimer);
-		mTimer = NULL;
-	}
+	mTimer.reset();
+	mManager.dequeue(this);
 }
 
 bool DomainRegistration::isUs(const url_t *url) {
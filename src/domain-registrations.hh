@@ -26,8 +26,12 @@
 
 #include "common.hh"
 #include "configmanager.hh"
+#include "timerservice.hh"
 
+#include <deque>
 #include <list>
+#include <map>
+#include <random>
 
 class DomainRegistrationManager;
 class Agent;
@@ -49,10 +53,11 @@ class DomainRegistration {
 	static void sOnConnectionBroken(tp_stack_t *stack, tp_client_t *client, tport_t *tport, msg_t *msg, int error);
 	static int sLegCallback(nta_leg_magic_t *ctx, nta_leg_t *leg, nta_incoming_t *incoming, const sip_t *request);
 	static int sResponseCallback(nta_outgoing_magic_t *ctx, nta_outgoing_t *orq, const sip_t *resp);
-	static void sRefreshRegistration(su_root_magic_t *magic, su_timer_t *timer, su_timer_arg_t *arg);
+	void scheduleRefresh(int seconds);
 	void responseCallback(nta_outgoing_t *orq, const sip_t *resp);
 	void onConnectionBroken(tport_t *tport, msg_t *msg, int error);
 	void cleanCurrentTport();
+	void send();
 	DomainRegistrationManager &mManager;
 	StatCounter64 * mRegistrationStatus; //This contains the lastest SIP response code of the REGISTER transaction.
 	su_home_t mHome;
@@ -60,7 +65,8 @@ class DomainRegistration {
 	tport_t *mPrimaryTport; // the tport that has the configuration
 	tport_t *mCurrentTport; // the secondary tport that has the active connection.
 	int mPendId;
-	su_timer_t *mTimer;
+	std::shared_ptr<TimerService::Timer> mTimer;
+	int mFailures; // in a row, for the backoff of the retries
 	url_t *mFrom;
 	url_t *mProxy;
 	sip_contact_t *mExternalContact;
@@ -84,11 +90,25 @@ class DomainRegistrationManager {
 	~DomainRegistrationManager();
 
   private:
+	/* Sends the REGISTER of dr as soon as the rate limit allows it. */
+	void enqueue(DomainRegistration *dr);
+	void dequeue(DomainRegistration *dr);
+	void pump();
+	/* Random delay in [min, max]. */
+	int jitter(int min, int max);
+	/* Delay before the retry following the given number of failures in a row. */
+	int backoff(int failures);
 	Agent *mAgent;
 	std::list<std::shared_ptr<DomainRegistration>> mRegistrations;
 	GenericStruct *mDomainRegistrationArea; /*this is used to place statistics values*/
 	int mKeepaliveInterval;
 	bool mVerifyServerCerts;
+	int mRegistrationRate;
+	int mTokens;
+	std::deque<DomainRegistration *> mQueue;
+	std::shared_ptr<TimerService::Timer> mPumpTimer;
+	std::map<std::string, std::string> mClientTports; // ident of the tport added for each client certificate dir
+	std::minstd_rand mRandom;
 };
 
 #endif
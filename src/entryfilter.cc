@@ -72,9 +72,8 @@ bool ConfigEntryFilter::canEnter(const shared_ptr<MsgSip> &ms) {
 	if (!mEnabled)
 		return false;
 
-	auto attr = ms->getSipAttr();
 	try {
-		bool e = mBooleanExprFilter->eval(attr.get());
+		bool e = mBooleanExprFilter->eval(ms->getSipAttr());
 		if (e)
 			++*mCountEvalTrue;
 		else
@@ -88,6 +87,12 @@ bool ConfigEntryFilter::canEnter(const shared_ptr<MsgSip> &ms) {
 	}
 }
 
+bool ConfigEntryFilter::mayEnter(bool isRequest, const string &method) {
+	if (!mEnabled)
+		return false;
+	return !mBooleanExprFilter || mBooleanExprFilter->evalFor(isRequest, method) != BooleanExpression::AlwaysFalse;
+}
+
 bool ConfigEntryFilter::isEnabled() {
 	return mEnabled;
 }
@@ -36,6 +36,10 @@ class EntryFilter {
 	virtual void loadConfig(const GenericStruct *module_config) {
 	}
 	virtual bool canEnter(const std::shared_ptr<MsgSip> &ms) = 0;
+	/* False when no request of the method, or no response, can enter, whatever the rest of the message. */
+	virtual bool mayEnter(bool isRequest, const std::string &method) {
+		return isEnabled();
+	}
 	virtual bool isEnabled() = 0;
 	virtual ~EntryFilter() {
 	}
@@ -51,6 +55,7 @@ class ConfigEntryFilter : public EntryFilter {
 	virtual void declareConfig(GenericStruct *module_config);
 	virtual void loadConfig(const GenericStruct *module_config);
 	virtual bool canEnter(const std::shared_ptr<MsgSip> &ms);
+	virtual bool mayEnter(bool isRequest, const std::string &method);
 	virtual bool isEnabled();
 
   private:
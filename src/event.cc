@@ -25,36 +25,81 @@
 #include <sofia-sip/su_tagarg.h>
 #include <sofia-sip/msg_addr.h>
 #include "sipattrextractor.hh"
+#include "sdp-modifier.hh"
+#include "tracing.hh"
 
 using namespace std;
 
-void MsgSip::assignMsg(msg_t *msg) {
-	mMsg = msg_ref_create(msg);
-	mSipAttr = make_shared<SipAttributes>(getSip());
+MsgSip::MsgSip(msg_t *msg)
+	: mMsg(msg_ref_create(msg)), mSipAttr(getSip()), mSdpPayload(NULL), mSdpModified(false), mTenant(NULL) {
 }
 
-MsgSip::MsgSip(msg_t *msg) {
-	assignMsg(msg);
+msg_t *MsgSip::duplicate(const MsgSip &msgSip) {
+	msgSip.serialize();
+	return msg_dup(msgSip.mMsg);
 }
 
 /*Invoking the copy constructor of MsgSip implies the deep copy of the underlying msg_t */
-MsgSip::MsgSip(const MsgSip &msgSip) {
-	msgSip.serialize();
-	msg_t *freshCopy = msg_dup(msgSip.mMsg);
-	assignMsg(freshCopy);
-	msg_destroy(freshCopy);
+MsgSip::MsgSip(const MsgSip &msgSip)
+	: mMsg(duplicate(msgSip)), mSipAttr(getSip()), mSdpPayload(NULL), mSdpModified(false), mTrace(msgSip.mTrace),
+	  mTenant(msgSip.mTenant) {
 	LOGD("New MsgSip %p copied from MsgSip %p", this, &msgSip);
 }
 
+shared_ptr<MsgSip> MsgSip::createBranch(const MsgSip &msgSip) {
+	msgSip.serialize();
+	// the copy keeps a reference to the original, whose home holds the shared values
+	msg_t *msg = msg_copy(msgSip.mMsg);
+	sip_t *sip = (sip_t *)msg_object(msg);
+	msg_serialize(msg, (msg_pub_t *)sip);
+	for (msg_header_t *h = (msg_header_t *)sip->sip_request; h; h = (msg_header_t *)h->sh_succ)
+		msg_fragment_clear(h->sh_common);
+	shared_ptr<MsgSip> branch = make_shared<MsgSip>(msg);
+	msg_destroy(msg); // referenced by the MsgSip
+	branch->mTrace = msgSip.mTrace;
+	branch->mTenant = msgSip.mTenant;
+	LOGD("New MsgSip %p branched from MsgSip %p", branch.get(), &msgSip);
+	return branch;
+}
+
+void MsgSip::serialize() const {
+	if (mSdpModified) {
+		mSdpModified = false;
+		if (mSdp->update(mMsg, getSip()) == -1)
+			LOGE("Cannot update SDP in message %p", mMsg);
+		mSdpPayload = getSip()->sip_payload;
+	}
+	msg_serialize(mMsg, (msg_pub_t *)getSip());
+}
+
+shared_ptr<SdpModifier> MsgSip::getSdpModifier(const string &nortproxy) {
+	sip_t *sip = getSip();
+	if (mSdp && mSdpPayload != sip->sip_payload) {
+		// the body was replaced without going through the model, whose changes are lost
+		if (mSdpModified)
+			LOGW("SDP changes of message %p overridden by a new body", mMsg);
+		mSdp.reset();
+		mSdpModified = false;
+	}
+	if (!mSdp) {
+		mSdp = SdpModifier::createFromSipMsg(getHome(), sip, nortproxy);
+		mSdpPayload = sip->sip_payload;
+	} else {
+		mSdp->setNortproxy(nortproxy);
+	}
+	return mSdp;
+}
+
 const char *MsgSip::print() {
 	// make sure the message is serialized before showing it; it can be very confusing.
 	size_t msg_size;
-	msg_serialize(mMsg, (msg_pub_t *)getSip());
+	serialize();
 	return msg_as_string(getHome(), mMsg, NULL, 0, &msg_size);
 }
 
 MsgSip::~MsgSip() {
 	// LOGD("Destroy MsgSip %p", this);
+	mSdp.reset(); // its parser lives in the home of the message
 	msg_destroy(mMsg);
 }
 
@@ -63,7 +108,8 @@ SipEvent::SipEvent(const shared_ptr<IncomingAgent> &inAgent, const shared_ptr<Ms
 	LOGD("New SipEvent %p - msg %p", this, msgSip->getMsg());
 	mIncomingAgent = inAgent;
 	mAgent = inAgent->getAgent();
-	shared_ptr<IncomingTransaction> it = dynamic_pointer_cast<IncomingTransaction>(inAgent);
+	mDebugForced = mAgent->matchesDebugFilter(msgSip);
+	IncomingTransaction *it = dynamic_cast<IncomingTransaction *>(inAgent.get());
 	if (it) {
 		mOutgoingAgent = it->mOutgoing;
 	} else {
@@ -76,7 +122,8 @@ SipEvent::SipEvent(const shared_ptr<OutgoingAgent> &outAgent, const shared_ptr<M
 	LOGD("New SipEvent %p - %p", this, msgSip->getMsg());
 	mOutgoingAgent = outAgent;
 	mAgent = outAgent->getAgent();
-	shared_ptr<OutgoingTransaction> ot = dynamic_pointer_cast<OutgoingTransaction>(outAgent);
+	mDebugForced = mAgent->matchesDebugFilter(msgSip);
+	OutgoingTransaction *ot = dynamic_cast<OutgoingTransaction *>(outAgent.get());
 	if (ot) {
 		// retrieve the incoming transaction associated with the outgoing one, if any.
 		// A response SipEvent is generated either from a stateless response or from a response from an outgoing
@@ -88,12 +135,20 @@ SipEvent::SipEvent(const shared_ptr<OutgoingAgent> &outAgent, const shared_ptr<M
 
 SipEvent::SipEvent(const SipEvent &sipEvent)
 	: mCurrModule(sipEvent.mCurrModule), mIncomingAgent(sipEvent.mIncomingAgent),
-	  mOutgoingAgent(sipEvent.mOutgoingAgent), mAgent(sipEvent.mAgent), mState(sipEvent.mState) {
+	  mOutgoingAgent(sipEvent.mOutgoingAgent), mAgent(sipEvent.mAgent),
+	  mDebugForced(sipEvent.mDebugForced), mState(sipEvent.mState) {
 	LOGD("New SipEvent %p with state %s", this, stateStr(mState).c_str());
 	// make a copy of the msgsip when the SipEvent is copy-constructed
 	mMsgSip = make_shared<MsgSip>(*sipEvent.mMsgSip);
 }
 
+SipEvent::SipEvent(const SipEvent &sipEvent, const shared_ptr<MsgSip> &msgSip)
+	: mCurrModule(sipEvent.mCurrModule), mMsgSip(msgSip), mIncomingAgent(sipEvent.mIncomingAgent),
+	  mOutgoingAgent(sipEvent.mOutgoingAgent), mAgent(sipEvent.mAgent), mDebugForced(sipEvent.mDebugForced),
+	  mState(sipEvent.mState) {
+	LOGD("New SipEvent %p with state %s", this, stateStr(mState).c_str());
+}
+
 SipEvent::~SipEvent() {
 	// LOGD("Destroy SipEvent %p", this);
 }
@@ -168,19 +223,30 @@ void RequestSipEvent::checkContentLength(const url_t *url) {
 
 RequestSipEvent::RequestSipEvent(shared_ptr<IncomingAgent> incomingAgent, const shared_ptr<MsgSip> &msgSip,
 								 tport_t *tport)
-	: SipEvent(incomingAgent, msgSip), mRecordRouteAdded(false) {
+	: SipEvent(incomingAgent, msgSip), mRecordRouteAdded(false), mStateless(false) {
 
 	if (tport)
 		mIncomingTport = shared_ptr<tport_t>(tport_ref(tport), tport_unref);
 }
 
 RequestSipEvent::RequestSipEvent(const shared_ptr<RequestSipEvent> &sipEvent)
-	: SipEvent(*sipEvent), mRecordRouteAdded(sipEvent->mRecordRouteAdded), mIncomingTport(sipEvent->mIncomingTport) {
+	: SipEvent(*sipEvent), mRecordRouteAdded(sipEvent->mRecordRouteAdded), mStateless(sipEvent->mStateless),
+	  mIncomingTport(sipEvent->mIncomingTport) {
+}
+
+RequestSipEvent::RequestSipEvent(const shared_ptr<RequestSipEvent> &sipEvent, const shared_ptr<MsgSip> &msgSip)
+	: SipEvent(*sipEvent, msgSip), mRecordRouteAdded(sipEvent->mRecordRouteAdded),
+	  mStateless(sipEvent->mStateless), mIncomingTport(sipEvent->mIncomingTport) {
 }
 
 void RequestSipEvent::send(const shared_ptr<MsgSip> &msg, url_string_t const *u, tag_type_t tag, tag_value_t value,
 						   ...) {
 	if (mOutgoingAgent != NULL) {
+		msg->serialize();
+		if (mAgent->getHeaderCompactor())
+			mAgent->getHeaderCompactor()->process(msg, u);
+		if (msg->getTrace())
+			msg->getTrace()->addEvent("sent");
 		SLOGD << "Sending Request SIP message to " << (u ? url_as_string(msg->getHome(), (url_t const *)u) : "NULL")
 			  << "\n" << *msg;
 		ta_list ta;
@@ -196,6 +262,8 @@ void RequestSipEvent::send(const shared_ptr<MsgSip> &msg, url_string_t const *u,
 void RequestSipEvent::reply(int status, char const *phrase, tag_type_t tag, tag_value_t value, ...) {
 	if (mIncomingAgent != NULL) {
 		SLOGD << "Replying Request SIP message: " << status << " " << phrase;
+		if (mMsgSip->getTrace())
+			mMsgSip->getTrace()->addEvent("replied " + to_string(status));
 		ta_list ta;
 		ta_start(ta, tag, value);
 		mIncomingAgent->reply(getMsgSip(), status, phrase, ta_tags(ta));
@@ -308,8 +376,13 @@ void ResponseSipEvent::send(const shared_ptr<MsgSip> &msg, url_string_t const *u
 			sip_via_remove(msg->getMsg(), msg->getSip());
 			via_popped = true;
 		}
+		msg->serialize();
+		if (msg->getTrace() && msg->getSip()->sip_status)
+			msg->getTrace()->addEvent("response sent " + to_string(msg->getSip()->sip_status->st_status));
 		if (msg->getSip()->sip_via)
 			checkContentLength(msg, msg->getSip()->sip_via);
+		if (mAgent->getHeaderCompactor())
+			mAgent->getHeaderCompactor()->process(msg, NULL);
 		SLOGD << "Sending response:" << (via_popped ? " (via popped) " : "") << endl << *msg;
 		ta_list ta;
 		ta_start(ta, tag, value);
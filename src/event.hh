@@ -27,6 +27,7 @@
 #include <sofia-sip/msg.h>
 #include <sofia-sip/sip.h>
 #include <sofia-sip/nta.h>
+#include "sipattrextractor.hh"
 
 class Agent;
 class Module;
@@ -35,7 +36,9 @@ class OutgoingAgent;
 class IncomingTransaction;
 class OutgoingTransaction;
 class EventLog;
-class SipAttributes;
+class SdpModifier;
+class Trace;
+struct Tenant;
 
 class MsgSip {
 	friend class Agent;
@@ -49,6 +52,13 @@ class MsgSip {
 	MsgSip(msg_t *msg);
 	MsgSip(const MsgSip &msgSip);
 	~MsgSip();
+	/*
+	 * Copy of msgSip for a branch of a fork, sharing the values of its headers and its body instead of duplicating
+	 * them: only the header structures are copied. msgSip must not be modified while the copy exists, and the values
+	 * of the copy must be replaced rather than written to. Its headers are encoded again when it is sent, as those of
+	 * a deep copy.
+	 */
+	static std::shared_ptr<MsgSip> createBranch(const MsgSip &msgSip);
 
 	inline msg_t *getMsg() const {
 		return mMsg;
@@ -61,18 +71,46 @@ class MsgSip {
 	inline su_home_t *getHome() const {
 		return msg_home(mMsg);
 	}
-	void serialize() const {
-		msg_serialize(mMsg, (msg_pub_t *)getSip());
+	/* Brings the raw message up to date, the SDP body included. */
+	void serialize() const;
+	/**
+	 * SDP body parsed once and shared by all the modules editing it, NULL when there is no valid SDP.
+	 * Call setSdpModified() after editing it: the body is then printed from it once, when the message is serialized
+	 * or sent, rather than after each edit.
+	 */
+	std::shared_ptr<SdpModifier> getSdpModifier(const std::string &nortproxy = "");
+	void setSdpModified() {
+		mSdpModified = true;
 	}
-	inline std::shared_ptr<SipAttributes> getSipAttr() {
-		return mSipAttr;
+	/* Trace of the transaction of the message, when it is sampled. */
+	const std::shared_ptr<Trace> &getTrace() const {
+		return mTrace;
+	}
+	void setTrace(const std::shared_ptr<Trace> &trace) {
+		mTrace = trace;
+	}
+	/* Domain the message is accounted to, NULL when the accounting per domain is disabled. */
+	Tenant *getTenant() const {
+		return mTenant;
+	}
+	void setTenant(Tenant *tenant) {
+		mTenant = tenant;
+	}
+	inline const SipAttributes *getSipAttr() const {
+		return &mSipAttr;
 	}
 	const char *print();
 
   private:
-	void assignMsg(msg_t *msg);
+	static msg_t *duplicate(const MsgSip &msgSip);
 	msg_t *mMsg;
-	std::shared_ptr<SipAttributes> mSipAttr;
+	// part of the object rather than allocated aside, as every message needs it for the filters and the logs
+	SipAttributes mSipAttr;
+	std::shared_ptr<SdpModifier> mSdp;
+	mutable sip_payload_t *mSdpPayload; // body mSdp was parsed from or printed to
+	mutable bool mSdpModified;
+	std::shared_ptr<Trace> mTrace;
+	Tenant *mTenant;
 };
 
 class SipEvent : public std::enable_shared_from_this<SipEvent> {
@@ -82,6 +120,8 @@ class SipEvent : public std::enable_shared_from_this<SipEvent> {
 	SipEvent(const std::shared_ptr<IncomingAgent> &inAgent, const std::shared_ptr<MsgSip> &msgSip);
 	SipEvent(const std::shared_ptr<OutgoingAgent> &outAgent, const std::shared_ptr<MsgSip> &msgSip);
 	SipEvent(const SipEvent &sipEvent);
+	/* Copy of sipEvent carrying another message. */
+	SipEvent(const SipEvent &sipEvent, const std::shared_ptr<MsgSip> &msgSip);
 
 	inline const std::shared_ptr<MsgSip> &getMsgSip() const {
 		return mMsgSip;
@@ -136,6 +176,19 @@ class SipEvent : public std::enable_shared_from_this<SipEvent> {
 	Module *getCurrentModule() {
 		return mCurrModule;
 	}
+	/* Marks an event created outside of the modules, such as a request restored from a store, as suspended by module,
+	 * so that it can be injected after it. Unlike suspendProcessing(), no transaction is created. */
+	void setSuspendedBy(Module *module) {
+		mCurrModule = module;
+		mState = SUSPENDED;
+	}
+	/* Whether the event matched the debug-filter when received, its processing being logged at the debug level. */
+	bool isDebugForced() const {
+		return mDebugForced;
+	}
+	void setDebugForced(bool forced) {
+		mDebugForced = forced;
+	}
 
 	template <typename _eventLogT> std::shared_ptr<_eventLogT> getEventLog() {
 		return std::dynamic_pointer_cast<_eventLogT>(mEventLog);
@@ -153,6 +206,7 @@ class SipEvent : public std::enable_shared_from_this<SipEvent> {
 	std::shared_ptr<OutgoingAgent> mOutgoingAgent;
 	std::shared_ptr<EventLog> mEventLog;
 	Agent *mAgent;
+	bool mDebugForced;
 
 	enum State {
 		STARTED,
@@ -177,6 +231,7 @@ class RequestSipEvent : public SipEvent {
 	RequestSipEvent(std::shared_ptr<IncomingAgent> incomingAgent, const std::shared_ptr<MsgSip> &msgSip,
 					tport_t *tport = NULL);
 	RequestSipEvent(const std::shared_ptr<RequestSipEvent> &sipEvent);
+	RequestSipEvent(const std::shared_ptr<RequestSipEvent> &sipEvent, const std::shared_ptr<MsgSip> &msgSip);
 
 	virtual void suspendProcessing();
 	std::shared_ptr<IncomingTransaction> createIncomingTransaction();
@@ -199,6 +254,8 @@ class RequestSipEvent : public SipEvent {
 		return mIncomingTport;
 	}
 	bool mRecordRouteAdded;
+	/* Set when the request matched stateless-forward when received: only the checks and the Forward module see it. */
+	bool mStateless;
 
   private:
 	void checkContentLength(const url_t *url);
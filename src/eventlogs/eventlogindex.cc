@@ -0,0 +1,284 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "eventlogindex.hh"
+#include "log/logmanager.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <queue>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* Day name of the files: YYYY-MM-DD */
+static const size_t sDayLength = 10;
+
+struct DayFiles {
+	vector<string> segments; // <day>-<sequence>, by sequence
+	bool indexed = false;
+};
+
+static map<string, DayFiles> scan(const string &segmentsDir) {
+	map<string, DayFiles> days;
+	DIR *dirp = opendir(segmentsDir.c_str());
+	if (dirp == NULL) {
+		LOGE("Cannot open event log segments directory %s: %s", segmentsDir.c_str(), strerror(errno));
+		return days;
+	}
+	struct dirent *dirent;
+	while ((dirent = readdir(dirp)) != NULL) {
+		string name(dirent->d_name);
+		if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".idx") != 0)
+			continue;
+		string base = name.substr(0, name.size() - 4);
+		if (base.size() == sDayLength)
+			days[base].indexed = true;
+		else if (base.size() > sDayLength + 1 && base[sDayLength] == '-')
+			days[base.substr(0, sDayLength)].segments.push_back(base);
+	}
+	closedir(dirp);
+	for (auto &day : days) {
+		// the sequences are zero padded to 4 digits, but may grow beyond
+		sort(day.second.segments.begin(), day.second.segments.end(), [](const string &a, const string &b) {
+			return a.size() != b.size() ? a.size() < b.size() : a < b;
+		});
+	}
+	return days;
+}
+
+static string sequenceOf(const string &segment) {
+	return segment.substr(sDayLength + 1);
+}
+
+vector<string> EventLogIndex::listDays(const string &segmentsDir) {
+	vector<string> days;
+	for (const auto &day : scan(segmentsDir)) {
+		if (!day.second.segments.empty())
+			days.push_back(day.first);
+	}
+	return days;
+}
+
+/*
+ * Each segment index is sorted into a temporary file, then the sorted files are merged in the order of the segments, so
+ * that no more than one segment index is held in memory.
+ */
+bool EventLogIndex::build(const string &segmentsDir, const string &day) {
+	auto days = scan(segmentsDir);
+	const DayFiles &files = days[day];
+	vector<string> sortedPaths;
+	bool ok = true;
+	for (const string &segment : files.segments) {
+		ifstream in(segmentsDir + "/" + segment + ".idx");
+		vector<pair<string, string>> lines; // log, rest of the line
+		string line;
+		while (getline(in, line)) {
+			size_t tab = line.find('\t');
+			if (tab == string::npos)
+				continue; // truncated by a crash
+			lines.emplace_back(line.substr(0, tab), line.substr(tab));
+		}
+		stable_sort(lines.begin(), lines.end(),
+					[](const pair<string, string> &a, const pair<string, string> &b) { return a.first < b.first; });
+		string sortedPath = segmentsDir + "/" + segment + ".sorted.tmp";
+		ofstream out(sortedPath, ios::out | ios::trunc);
+		string sequence = sequenceOf(segment);
+		for (const auto &l : lines)
+			out << l.first << "\t" << sequence << l.second << "\n";
+		sortedPaths.push_back(sortedPath);
+		out.close();
+		if (!out) {
+			ok = false;
+			break;
+		}
+	}
+
+	string tmpPath = segmentsDir + "/" + day + ".idx.tmp";
+	if (ok) {
+		vector<unique_ptr<ifstream>> inputs;
+		for (const string &path : sortedPaths)
+			inputs.emplace_back(new ifstream(path));
+		struct Head {
+			string log;
+			string line;
+			size_t input;
+			bool operator<(const Head &other) const { // reversed for the priority queue, earlier segments first
+				return log != other.log ? log > other.log : input > other.input;
+			}
+		};
+		priority_queue<Head> heads;
+		auto next = [&](size_t input) {
+			Head head;
+			if (!getline(*inputs[input], head.line))
+				return;
+			head.log = head.line.substr(0, head.line.find('\t'));
+			head.input = input;
+			heads.push(move(head));
+		};
+		for (size_t i = 0; i < inputs.size(); ++i)
+			next(i);
+		ofstream out(tmpPath, ios::out | ios::trunc);
+		while (!heads.empty()) {
+			Head head = heads.top();
+			heads.pop();
+			out << head.line << "\n";
+			next(head.input);
+		}
+		out.close();
+		ok = (bool)out;
+	}
+	for (const string &path : sortedPaths)
+		unlink(path.c_str());
+	// renamed once complete, so that readers never see a partial index
+	string path = segmentsDir + "/" + day + ".idx";
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) == -1) {
+		LOGE("Cannot write event log index %s: %s", path.c_str(), strerror(errno));
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+void EventLogIndex::buildMissing(const string &segmentsDir, const string &today) {
+	for (const auto &day : scan(segmentsDir)) {
+		if (day.first < today && !day.second.indexed && !day.second.segments.empty()) {
+			LOGI("Building event log index of %s", day.first.c_str());
+			build(segmentsDir, day.first);
+		}
+	}
+}
+
+/* Reads the first line starting at pos or after, false at the end of the file. */
+static bool lineFrom(ifstream &in, streamoff pos, string &line) {
+	in.clear();
+	in.seekg(pos > 0 ? pos - 1 : 0);
+	if (pos > 0)
+		in.ignore(numeric_limits<streamsize>::max(), '\n');
+	return (bool)getline(in, line);
+}
+
+/* Reads the events of a day from its segments, keeping the last segment open as the events of a log follow each other. */
+class SegmentReader {
+  public:
+	SegmentReader(const string &segmentsDir) : mDir(segmentsDir) {
+	}
+	bool read(const string &segment, streamoff offset, size_t length, string &event) {
+		if (segment != mSegment) {
+			mIn.close();
+			mIn.clear();
+			mIn.open(mDir + "/" + segment + ".log", ios::in | ios::binary);
+			mSegment = segment;
+		}
+		event.resize(length);
+		mIn.clear();
+		mIn.seekg(offset);
+		return length == 0 || (bool)mIn.read(&event[0], length);
+	}
+
+  private:
+	string mDir;
+	string mSegment;
+	ifstream mIn;
+};
+
+/* Parses "<offset>\t<length>" at pos. */
+static bool parsePosition(const string &line, size_t pos, streamoff &offset, size_t &length) {
+	char *end;
+	offset = strtoll(line.c_str() + pos, &end, 10);
+	if (*end != '\t')
+		return false;
+	length = strtoul(end + 1, &end, 10);
+	return *end == '\0';
+}
+
+size_t EventLogIndex::find(const string &segmentsDir, const string &day, const string &prefix, const Callback &fn) {
+	auto days = scan(segmentsDir);
+	auto it = days.find(day);
+	if (it == days.end())
+		return 0;
+	SegmentReader reader(segmentsDir);
+	size_t found = 0;
+	string line;
+	string event;
+
+	if (!it->second.indexed) {
+		// the day is not over: its segment indexes are scanned
+		for (const string &segment : it->second.segments) {
+			ifstream in(segmentsDir + "/" + segment + ".idx");
+			while (getline(in, line)) {
+				if (line.compare(0, prefix.size(), prefix) != 0)
+					continue;
+				size_t tab = line.find('\t');
+				streamoff offset;
+				size_t length;
+				if (tab == string::npos || !parsePosition(line, tab + 1, offset, length))
+					continue;
+				if (!reader.read(segment, offset, length, event))
+					continue;
+				fn(line.substr(0, tab), event);
+				++found;
+			}
+		}
+		return found;
+	}
+
+	string path = segmentsDir + "/" + day + ".idx";
+	ifstream in(path);
+	if (!in.is_open()) {
+		LOGE("Cannot open event log index %s: %s", path.c_str(), strerror(errno));
+		return 0;
+	}
+	in.seekg(0, ios::end);
+	streamoff lo = 0, hi = in.tellg();
+	// smallest position whose next line is not before the prefix
+	while (lo < hi) {
+		streamoff mid = lo + (hi - lo) / 2;
+		if (!lineFrom(in, mid, line) || line.compare(0, prefix.size(), prefix) >= 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (!lineFrom(in, lo, line))
+		return 0;
+	do {
+		if (line.compare(0, prefix.size(), prefix) != 0)
+			break;
+		// <log>\t<sequence>\t<offset>\t<length>
+		size_t tab = line.find('\t');
+		size_t seqTab = tab == string::npos ? string::npos : line.find('\t', tab + 1);
+		streamoff offset;
+		size_t length;
+		if (seqTab == string::npos || !parsePosition(line, seqTab + 1, offset, length))
+			continue;
+		string segment = day + "-" + line.substr(tab + 1, seqTab - tab - 1);
+		if (!reader.read(segment, offset, length, event))
+			continue;
+		fn(line.substr(0, tab), event);
+		++found;
+	} while (getline(in, line));
+	return found;
+}
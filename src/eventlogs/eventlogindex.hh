@@ -0,0 +1,51 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef eventlogindex_hh
+#define eventlogindex_hh
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Per-day index of the segments written by FilesystemEventLogWriter: once a day is over, the indexes of its segments
+ * are merged into segments/<day>.idx, holding one "<log>\t<sequence>\t<offset>\t<length>" line per event sorted by
+ * log, so that the events of a user are found by a binary search in one file per day instead of a scan of every
+ * segment index. The events of a log keep the order in which they were written.
+ */
+class EventLogIndex {
+  public:
+	typedef std::function<void(const std::string &log, const std::string &event)> Callback;
+
+	/* Writes the index of a day whose segments are all closed. */
+	static bool build(const std::string &segmentsDir, const std::string &day);
+	/* Builds the missing indexes of the days before today. */
+	static void buildMissing(const std::string &segmentsDir, const std::string &today);
+	/* Days having segments, in order. */
+	static std::vector<std::string> listDays(const std::string &segmentsDir);
+	/*
+	 * Calls fn with each event of the day whose index line starts with prefix ("<log>" followed by a tab for one log,
+	 * or the start of a log name), as soon as it is read. Days without index have their segment indexes scanned.
+	 * Returns the number of events found.
+	 */
+	static size_t find(const std::string &segmentsDir, const std::string &day, const std::string &prefix,
+					   const Callback &fn);
+};
+
+#endif /* eventlogindex_hh */
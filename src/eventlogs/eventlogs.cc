@@ -18,14 +18,22 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <fcntl.h>
+#include <netdb.h>
 
 #include "eventlogs.hh"
+#include "eventlogindex.hh"
 #include "configmanager.hh"
+#include "utils/compression.hh"
+#include "utils/threadplacement.hh"
+#include "utils/startup.hh"
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <stdexcept>
 #include <typeinfo>
 
 using namespace std;
@@ -35,10 +43,27 @@ EventLog::Init EventLog::evStaticInit;
 EventLog::Init::Init() {
 	ConfigItemDescriptor items[] = {
 		{Boolean, "enabled", "Enable event logs.", "false"},
-		{String, "logger", "Define logger for storing logs. It supports \"filesystem\" and \"database\".",
+		{String, "logger", "Define logger for storing logs. It supports \"filesystem\", \"database\" and \"stream\".",
 		 "filesystem"},
+		{Boolean, "registration-refreshes",
+		 "Log the registrations that only refresh the expiry of the bindings of an aor. When false, only the "
+		 "registrations adding, changing or removing bindings are logged, the refreshes being counted by "
+		 "module::Registrar/count-refreshes.",
+		 "true"},
 		{String, "dir", "Directory where event logs are written as a filesystem (case when filesystem output is choosed).",
 		 "/var/log/flexisip"},
+		{Boolean, "filesystem-segments",
+		 "Write the event logs of the filesystem output in a background thread, appended to the segment files "
+		 "of the segments directory rather than to one file per user and kind of event. Each segment comes with an "
+		 "index file giving, for each event, the log it belongs to (users/<domain>/<user>/<kind> or "
+		 "errors/<kind>/<code>) with its offset and length in the segment.",
+		 "false"},
+		{Integer, "filesystem-segment-max-size",
+		 "Size in megabytes beyond which a new segment is started. A new segment is also started every day. "
+		 "0 means no limit.",
+		 "64"},
+		{Integer, "filesystem-max-queue-size",
+		 "Maximum number of events waiting to be written to the segments. The events beyond are dropped.", "10000"},
 		{String, "database-backend", "Choose the type of backend that Soci will use for the connection.\n"
 		 "Depending on your Soci package and the modules you installed, the supported databases are:"
 		 "`mysql`, `sqlite3` and `postgresql`",
@@ -60,6 +85,32 @@ EventLog::Init::Init() {
 		{Integer, "database-nb-threads-max", "Maximum number of threads for writing in database.\n"
 		 "If you get a `database is locked` error with sqlite3, you must set this variable to 1.",
 		 "10"},
+		{Integer, "database-batch-size",
+		 "Maximum number of events written in a single transaction. The events queued while a thread is writing "
+		 "are written together by the next one, so a batch never waits for more events to come.",
+		 "50"},
+		{Integer, "database-compression-threshold",
+		 "Size in bytes from which the contacts of the registration events and the call quality reports are written "
+		 "compressed with LZ4, base64 encoded behind a 'LZ4:1:' prefix. Requires flexisip to be built with lz4. "
+		 "0 disables the compression.",
+		 "0"},
+		{String, "stream-address",
+		 "host:port of the collector the events are streamed to over TCP (case when stream output is chosen), "
+		 "such as tools/eventlog-stream-bridge.py, which forwards them to a Kafka topic. The events are sent by "
+		 "batches of MessagePack maps, in frames of their size on 4 bytes, big endian, and the batch.",
+		 "127.0.0.1:9195"},
+		{Integer, "stream-max-queue-size",
+		 "Maximum number of events waiting to be streamed. The events beyond are dropped, while the collector is "
+		 "unreachable or slower than the proxy.",
+		 "100000"},
+		{Integer, "stream-batch-size", "Maximum number of events sent in a frame.", "500"},
+		{Integer, "stream-batch-delay",
+		 "Time in milliseconds an event may wait for others to be sent along with it, unless the batch is full.",
+		 "100"},
+		{Integer, "stream-compression-threshold",
+		 "Size in bytes from which the batches are sent LZ4 compressed, behind the marker 'LZ4' 0x01 0x00 and "
+		 "their size on 4 bytes, little endian. Requires flexisip to be built with lz4. 0 disables the compression.",
+		 "4096"},
 		config_item_end};
 	GenericStruct *ev = new GenericStruct(
 		"event-logs",
@@ -110,6 +161,10 @@ void CallLog::setCancelled() {
 	mCancelled = true;
 }
 
+void CallLog::setMediaQuality(const string &summary) {
+	mMediaQuality = summary;
+}
+
 MessageLog::MessageLog(const sip_t *sip, ReportType report): EventLog(sip) {
 	mUri = NULL;
 	mReportType = report;
@@ -232,17 +287,44 @@ inline ostream &operator<<(ostream &ostr, MessageLog::ReportType type) {
 EventLogWriter::~EventLogWriter() {
 }
 
-FilesystemEventLogWriter::FilesystemEventLogWriter(const std::string &rootpath) : mRootPath(rootpath), mIsReady(false) {
+void EventLogWriter::writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs) {
+	for (const auto &evlog : evlogs)
+		write(evlog);
+}
+
+FilesystemEventLogWriter::FilesystemEventLogWriter(const std::string &rootpath, bool segments, size_t segmentMaxSize,
+												   size_t maxQueueSize)
+	: mRootPath(rootpath), mIsReady(false), mSegments(segments), mSegmentMaxSize(segmentMaxSize),
+	  mMaxQueueSize(maxQueueSize), mRunning(false), mSegmentFd(-1), mIndexFd(-1), mSegmentEnd(0), mSegmentSeq(0),
+	  mSegmentSize(0) {
 	if (rootpath.c_str()[0] != '/') {
 		LOGE("Path for event log writer must be absolute.");
 		return;
 	}
 	if (!createDirectoryIfNotExist(rootpath.c_str()))
 		return;
+	if (mSegments) {
+		if (!createDirectoryIfNotExist((rootpath + "/segments").c_str()))
+			return;
+		mRunning = true;
+		mThread = thread(&FilesystemEventLogWriter::runSegmentWriter, this);
+	}
 
 	mIsReady = true;
 }
 
+FilesystemEventLogWriter::~FilesystemEventLogWriter() {
+	if (mRunning) {
+		{
+			unique_lock<mutex> lock(mMutex);
+			mRunning = false;
+			mCondVar.notify_one();
+		}
+		mThread.join();
+	}
+	closeSegment();
+}
+
 bool FilesystemEventLogWriter::isReady() const {
 	return mIsReady;
 }
@@ -300,11 +382,163 @@ int FilesystemEventLogWriter::openPath(const url_t *uri, const char *kind, time_
 	return fd;
 }
 
-void FilesystemEventLogWriter::writeRegistrationLog(const std::shared_ptr<RegistrationLog> &rlog) {
-	const char *label = "registers";
-	int fd = openPath(rlog->mFrom->a_url, label, rlog->mDate);
+/* Writes the line in the log of the user (or of the error code when uri is NULL), or queues it for the segments. */
+void FilesystemEventLogWriter::writeLine(const url_t *uri, const char *kind, time_t curtime, const std::string &line,
+										 int errorcode) {
+	if (mSegments) {
+		ostringstream key;
+		if (errorcode == 0)
+			key << "users/" << uri->url_host << "/" << (uri->url_user ? uri->url_user : "anonymous") << "/" << kind;
+		else
+			key << "errors/" << kind << "/" << errorcode;
+
+		unique_lock<mutex> lock(mMutex);
+		if (mQueue.size() >= mMaxQueueSize) {
+			lock.unlock();
+			LOGE("FilesystemEventLogWriter: too many events in queue! (%i)", (int)mMaxQueueSize);
+			return;
+		}
+		mQueue.push_back(Record{key.str(), curtime, line});
+		if (mQueue.size() == 1)
+			mCondVar.notify_one();
+		return;
+	}
+
+	int fd = openPath(uri, kind, curtime, errorcode);
 	if (fd == -1)
 		return;
+	if (::write(fd, line.c_str(), line.size()) == -1) {
+		LOGE("Fail to write %s log: %s", kind, strerror(errno));
+	}
+	close(fd);
+}
+
+/*
+ * Segment mode: the lines of all the logs are appended to segments/<day>-<sequence>.log, and each segment has an index
+ * segments/<day>-<sequence>.idx with one "<log>\t<offset>\t<length>" line per event, where <log> names the log it
+ * belongs to (users/<domain>/<user>/<kind> or errors/<kind>/<code>), so that the events of a user are found with a
+ * lookup of the indexes instead of one file per user and kind. When a day is over, its indexes are merged into the
+ * sorted index of the day (see EventLogIndex).
+ */
+static string formatDay(time_t curtime) {
+	struct tm tm;
+	localtime_r(&curtime, &tm);
+	ostringstream day;
+	day << 1900 + tm.tm_year << "-" << std::setfill('0') << std::setw(2) << tm.tm_mon + 1 << "-" << std::setfill('0')
+		<< std::setw(2) << tm.tm_mday;
+	return day.str();
+}
+
+void FilesystemEventLogWriter::runSegmentWriter() {
+	// days left unindexed by a stop, before the first event is written
+	EventLogIndex::buildMissing(mRootPath + "/segments", formatDay(time(NULL)));
+
+	vector<Record> records;
+	unique_lock<mutex> lock(mMutex);
+	while (true) {
+		if (mQueue.empty()) {
+			if (!mRunning)
+				break;
+			mCondVar.wait(lock);
+			continue;
+		}
+		records.swap(mQueue);
+		lock.unlock();
+
+		string data;
+		string index;
+		for (const Record &record : records) {
+			if (mSegmentFd == -1 || (mSegmentMaxSize > 0 && mSegmentSize + data.size() >= mSegmentMaxSize) ||
+				record.date >= mSegmentEnd) {
+				flushSegment(data, index);
+				if (!openSegment(record.date))
+					continue;
+			}
+			index += record.key + "\t" + to_string(mSegmentSize + data.size()) + "\t" + to_string(record.line.size()) +
+					 "\n";
+			data += record.line;
+		}
+		flushSegment(data, index);
+		records.clear();
+
+		lock.lock();
+	}
+}
+
+static bool writeFully(int fd, const string &data) {
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t ret = ::write(fd, data.data() + written, data.size() - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		written += ret;
+	}
+	return true;
+}
+
+void FilesystemEventLogWriter::flushSegment(string &data, string &index) {
+	if (data.empty())
+		return;
+	// the index is written after the data it refers to
+	if (!writeFully(mSegmentFd, data) || !writeFully(mIndexFd, index))
+		LOGE("Fail to write event log segment %s: %s", mSegmentName.c_str(), strerror(errno));
+	mSegmentSize += data.size();
+	data.clear();
+	index.clear();
+}
+
+/* Opens the next segment of the day, segments never being reopened for appending. */
+bool FilesystemEventLogWriter::openSegment(time_t curtime) {
+	closeSegment();
+	string day = formatDay(curtime);
+	if (day != mSegmentDay) {
+		if (!mSegmentDay.empty())
+			EventLogIndex::build(mRootPath + "/segments", mSegmentDay);
+		mSegmentDay = day;
+		mSegmentSeq = 0;
+	}
+	struct tm tm;
+	localtime_r(&curtime, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_mday += 1;
+	tm.tm_isdst = -1;
+	mSegmentEnd = mktime(&tm);
+
+	while (true) {
+		ostringstream name;
+		name << mRootPath << "/segments/" << mSegmentDay << "-" << std::setfill('0') << std::setw(4) << mSegmentSeq++;
+		mSegmentName = name.str();
+		mSegmentFd = open((mSegmentName + ".log").c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, S_IRUSR | S_IWUSR);
+		if (mSegmentFd != -1 || errno != EEXIST)
+			break;
+	}
+	if (mSegmentFd == -1) {
+		LOGE("Cannot open %s.log: %s", mSegmentName.c_str(), strerror(errno));
+		return false;
+	}
+	mIndexFd = open((mSegmentName + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+	if (mIndexFd == -1) {
+		LOGE("Cannot open %s.idx: %s", mSegmentName.c_str(), strerror(errno));
+		closeSegment();
+		return false;
+	}
+	mSegmentSize = 0;
+	return true;
+}
+
+void FilesystemEventLogWriter::closeSegment() {
+	if (mSegmentFd != -1)
+		close(mSegmentFd);
+	if (mIndexFd != -1)
+		close(mIndexFd);
+	mSegmentFd = mIndexFd = -1;
+}
+
+void FilesystemEventLogWriter::writeRegistrationLog(const std::shared_ptr<RegistrationLog> &rlog) {
+	const char *label = "registers";
 
 	ostringstream msg;
 	msg << PrettyTime(rlog->mDate) << ": " << rlog->mType << " " << rlog->mFrom;
@@ -313,10 +547,7 @@ void FilesystemEventLogWriter::writeRegistrationLog(const std::shared_ptr<Regist
 	if (rlog->mUA)
 		msg << rlog->mUA << endl;
 
-	if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-		LOGE("Fail to write registration log: %s", strerror(errno));
-	}
-	close(fd);
+	writeLine(rlog->mFrom->a_url, label, rlog->mDate, msg.str());
 	if (rlog->mStatusCode >= 300) {
 		writeErrorLog(rlog, label, msg.str());
 	}
@@ -324,32 +555,24 @@ void FilesystemEventLogWriter::writeRegistrationLog(const std::shared_ptr<Regist
 
 void FilesystemEventLogWriter::writeCallLog(const std::shared_ptr<CallLog> &calllog) {
 	const char *label = "calls";
-	int fd1 = openPath(calllog->mFrom->a_url, label, calllog->mDate);
-	int fd2 = openPath(calllog->mTo->a_url, label, calllog->mDate);
 
 	ostringstream msg;
 
 	msg << PrettyTime(calllog->mDate) << ": " << calllog->mFrom << " --> " << calllog->mTo << " ";
 	if (calllog->mCancelled)
 		msg << "Cancelled";
+	else if (!calllog->mMediaQuality.empty())
+		msg << "Ended, " << calllog->mMediaQuality;
 	else
 		msg << calllog->mStatusCode << " " << calllog->mReason;
 	msg << endl;
 
-	if (fd1 == -1 || ::write(fd1, msg.str().c_str(), msg.str().size()) == -1) {
-		LOGE("Fail to write registration log: %s", strerror(errno));
-	}
+	writeLine(calllog->mFrom->a_url, label, calllog->mDate, msg.str());
 	// Avoid to write logs for users that possibly do not exist.
 	// However the error will be reported in the errors directory.
 	if (calllog->mStatusCode != 404) {
-		if (fd2 == -1 || ::write(fd2, msg.str().c_str(), msg.str().size()) == -1) {
-			LOGE("Fail to write registration log: %s", strerror(errno));
-		}
+		writeLine(calllog->mTo->a_url, label, calllog->mDate, msg.str());
 	}
-	if (fd1 != -1)
-		close(fd1);
-	if (fd2 != -1)
-		close(fd2);
 	if (calllog->mStatusCode >= 300) {
 		writeErrorLog(calllog, label, msg.str());
 	}
@@ -367,32 +590,14 @@ void FilesystemEventLogWriter::writeMessageLog(const std::shared_ptr<MessageLog>
 	msg << mlog->mStatusCode << " " << mlog->mReason << endl;
 
 	if (mlog->mReportType == MessageLog::ReceivedFromUser){
-		int fd = openPath(mlog->mFrom->a_url, label, mlog->mDate);
-		if (fd != -1){
-			if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-				LOGE("Fail to write message log: %s", strerror(errno));
-			}
-			close(fd);
-		}
+		writeLine(mlog->mFrom->a_url, label, mlog->mDate, msg.str());
 	}else { //MessageLog::DeliveredToUser
 		/*the event is added into the sender's log file and the receiver's log file, for convenience*/
-		int fd = openPath(mlog->mFrom->a_url, label, mlog->mDate);
-		if (fd != -1){
-			if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-				LOGE("Fail to write message log: %s", strerror(errno));
-			}
-			close(fd);
-		}
+		writeLine(mlog->mFrom->a_url, label, mlog->mDate, msg.str());
 		// Avoid to write logs for users that possibly do not exist.
 		// However the error will be reported in the errors directory.
 		if (mlog->mStatusCode != 404){
-			fd = openPath(mlog->mTo->a_url, label, mlog->mDate);
-			if (fd != -1){
-				if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-					LOGE("Fail to write message log: %s", strerror(errno));
-				}
-				close(fd);
-			}
+			writeLine(mlog->mTo->a_url, label, mlog->mDate, msg.str());
 		}
 	}
 	if (mlog->mStatusCode >= 300) {
@@ -402,9 +607,6 @@ void FilesystemEventLogWriter::writeMessageLog(const std::shared_ptr<MessageLog>
 
 void FilesystemEventLogWriter::writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &mlog) {
 	const char *label = "statistics_reports";
-	int fd = openPath(mlog->mFrom->a_url, label, mlog->mDate);
-	if (fd == -1)
-		return;
 	ostringstream msg;
 
 	msg << PrettyTime(mlog->mDate) << " ";
@@ -412,11 +614,7 @@ void FilesystemEventLogWriter::writeCallQualityStatisticsLog(const std::shared_p
 	msg << mlog->mStatusCode << " " << mlog->mReason << ": ";
 	msg << mlog->mReport << endl;
 
-	if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-		LOGE("Fail to write registration log: %s", strerror(errno));
-	}
-
-	close(fd);
+	writeLine(mlog->mFrom->a_url, label, mlog->mDate, msg.str());
 	if (mlog->mStatusCode >= 300) {
 		writeErrorLog(mlog, label, msg.str());
 	}
@@ -434,13 +632,7 @@ void FilesystemEventLogWriter::writeAuthLog(const std::shared_ptr<AuthLog> &alog
 	msg << alog->mStatusCode << " " << alog->mReason << endl;
 
 	if (alog->mUserExists) {
-		int fd = openPath(alog->mFrom->a_url, label, alog->mDate);
-		if (fd != -1) {
-			if (::write(fd, msg.str().c_str(), msg.str().size()) == -1) {
-				LOGE("Fail to write auth log: %s", strerror(errno));
-			}
-			close(fd);
-		}
+		writeLine(alog->mFrom->a_url, label, alog->mDate, msg.str());
 	}
 	writeErrorLog(alog, "auth", msg.str());
 }
@@ -449,13 +641,7 @@ void FilesystemEventLogWriter::writeErrorLog(
 	const std::shared_ptr<EventLog> &log, const char *kind,
 	const std::string &logstr
 ) {
-	int fd = openPath(NULL, kind, log->mDate, log->mStatusCode);
-	if (fd == -1)
-		return;
-	if (::write(fd, logstr.c_str(), logstr.size()) == -1) {
-		LOGE("Fail to write error log: %s", strerror(errno));
-	}
-	close(fd);
+	writeLine(NULL, kind, log->mDate, logstr, log->mStatusCode);
 }
 
 void FilesystemEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
@@ -473,22 +659,8 @@ void FilesystemEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
 	}
 }
 
-#if ENABLE_SOCI
-
 #define BUFFER_SIZE 256
 
-#define SQL_REGISTRATION_EVENT_LOG_ID 0
-#define SQL_CALL_EVENT_LOG_ID 1
-#define SQL_MESSAGE_EVENT_LOG_ID 2
-#define SQL_AUTH_EVENT_LOG_ID 3
-#define SQL_CALL_QUALITY_EVENT_LOG_ID 4
-
-#define SQL_MYSQL_LAST_ID_FUN "LAST_INSERT_ID()"
-#define SQL_SQLITE3_LAST_ID_FUN "last_insert_rowid()"
-#define SQL_POSTGRESQL_LAST_ID_FUN "lastval()"
-
-using namespace soci;
-
 inline string sipDataToString(const url_t *url) {
 	if (!url) {
 		return string();
@@ -534,6 +706,296 @@ inline string sipDataToString(const sip_contact_t *contact) {
 	return sipDataToString(contact->m_url);
 }
 
+/*
+ * MessagePack encoding of the events for the StreamEventLogWriter, with only the types it needs.
+ */
+static void packRaw(string &out, uint8_t type, uint64_t value, int bytes) {
+	out += (char)type;
+	for (int i = bytes - 1; i >= 0; --i)
+		out += (char)(value >> (8 * i));
+}
+
+static void packUint(string &out, uint64_t value) {
+	if (value < 0x80)
+		out += (char)value;
+	else if (value <= 0xff)
+		packRaw(out, 0xcc, value, 1);
+	else if (value <= 0xffff)
+		packRaw(out, 0xcd, value, 2);
+	else if (value <= 0xffffffff)
+		packRaw(out, 0xce, value, 4);
+	else
+		packRaw(out, 0xcf, value, 8);
+}
+
+static void packString(string &out, const string &value) {
+	size_t len = value.size();
+	if (len < 32)
+		out += (char)(0xa0 | len);
+	else if (len <= 0xff)
+		packRaw(out, 0xd9, len, 1);
+	else if (len <= 0xffff)
+		packRaw(out, 0xda, len, 2);
+	else
+		packRaw(out, 0xdb, len, 4);
+	out += value;
+}
+
+static void packBool(string &out, bool value) {
+	out += (char)(value ? 0xc3 : 0xc2);
+}
+
+/* A fixmap: the maps of the events have less than 16 entries. */
+static void packMap(string &out, size_t entries) {
+	out += (char)(0x80 | entries);
+}
+
+static void packEntry(string &out, const char *key, const string &value) {
+	packString(out, key);
+	packString(out, value);
+}
+
+void StreamEventLogWriter::encode(const std::shared_ptr<EventLog> &evlog, string &out) {
+	EventLog *ev = evlog.get();
+	size_t entries = 8;
+	if (typeid(*ev) == typeid(RegistrationLog))
+		entries += 2;
+	else if (typeid(*ev) == typeid(CallLog))
+		entries += 2;
+	else if (typeid(*ev) == typeid(MessageLog))
+		entries += 2;
+	else if (typeid(*ev) == typeid(AuthLog))
+		entries += 3;
+	else if (typeid(*ev) == typeid(CallQualityStatisticsLog))
+		entries += 1;
+	else
+		return;
+
+	packMap(out, entries);
+	packString(out, "type");
+	if (typeid(*ev) == typeid(RegistrationLog))
+		packString(out, "registration");
+	else if (typeid(*ev) == typeid(CallLog))
+		packString(out, "call");
+	else if (typeid(*ev) == typeid(MessageLog))
+		packString(out, "message");
+	else if (typeid(*ev) == typeid(AuthLog))
+		packString(out, "auth");
+	else
+		packString(out, "call-quality");
+	packString(out, "date");
+	packUint(out, (uint64_t)ev->mDate);
+	packEntry(out, "from", sipDataToString(ev->mFrom));
+	packEntry(out, "to", sipDataToString(ev->mTo));
+	packEntry(out, "user-agent", sipDataToString(ev->mUA));
+	packEntry(out, "call-id", ev->mCallId);
+	packString(out, "status");
+	packUint(out, (uint64_t)max(ev->mStatusCode, 0));
+	packEntry(out, "reason", ev->mReason);
+
+	if (typeid(*ev) == typeid(RegistrationLog)) {
+		RegistrationLog *rlog = static_cast<RegistrationLog *>(ev);
+		packString(out, "kind");
+		packUint(out, rlog->mType);
+		packEntry(out, "contacts", sipDataToString(rlog->mContacts));
+	} else if (typeid(*ev) == typeid(CallLog)) {
+		CallLog *clog = static_cast<CallLog *>(ev);
+		packString(out, "cancelled");
+		packBool(out, clog->mCancelled);
+		packEntry(out, "media-quality", clog->mMediaQuality);
+	} else if (typeid(*ev) == typeid(MessageLog)) {
+		MessageLog *mlog = static_cast<MessageLog *>(ev);
+		packString(out, "report");
+		packUint(out, mlog->mReportType);
+		packEntry(out, "uri", sipDataToString(mlog->mUri));
+	} else if (typeid(*ev) == typeid(AuthLog)) {
+		AuthLog *alog = static_cast<AuthLog *>(ev);
+		packEntry(out, "method", alog->mMethod);
+		packEntry(out, "origin", sipDataToString(alog->mOrigin));
+		packString(out, "user-exists");
+		packBool(out, alog->mUserExists);
+	} else {
+		packEntry(out, "report", static_cast<CallQualityStatisticsLog *>(ev)->mReport);
+	}
+}
+
+StreamEventLogWriter::StreamEventLogWriter(const string &address, size_t maxQueueSize, size_t batchSize,
+										   int batchDelayMs, int compressionThreshold)
+	: mIsReady(false), mMaxQueueSize(maxQueueSize), mBatchSize(max(batchSize, (size_t)1)),
+	  mBatchDelay(batchDelayMs), mCompressionThreshold(compressionThreshold > 0 ? compressionThreshold : 0),
+	  mDropped(0), mRunning(false), mSocket(-1) {
+	if (mCompressionThreshold > 0 && !ValueCompression::isAvailable()) {
+		LOGW("StreamEventLogWriter: stream-compression-threshold is ignored: flexisip is built without lz4");
+		mCompressionThreshold = 0;
+	}
+	size_t colon = address.rfind(':');
+	if (colon == string::npos || colon == 0 || colon + 1 == address.size()) {
+		LOGE("StreamEventLogWriter: invalid address '%s', host:port expected.", address.c_str());
+		return;
+	}
+	mHost = address.substr(0, colon);
+	mPort = address.substr(colon + 1);
+	if (mHost.size() > 2 && mHost.front() == '[' && mHost.back() == ']')
+		mHost = mHost.substr(1, mHost.size() - 2);
+	// the collector may not be up yet: the thread connects, and retries
+	mRunning = true;
+	mThread = thread(&StreamEventLogWriter::run, this);
+	mIsReady = true;
+}
+
+StreamEventLogWriter::~StreamEventLogWriter() {
+	if (mRunning) {
+		{
+			unique_lock<mutex> lock(mMutex);
+			mRunning = false;
+			mCondVar.notify_one();
+		}
+		mThread.join();
+	}
+	if (mSocket != -1)
+		close(mSocket);
+}
+
+bool StreamEventLogWriter::isReady() const {
+	return mIsReady;
+}
+
+void StreamEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
+	unique_lock<mutex> lock(mMutex);
+	if (mQueue.size() >= mMaxQueueSize) {
+		++mDropped;
+		return;
+	}
+	mQueue.push_back(evlog);
+	if (mQueue.size() == 1 || mQueue.size() == mBatchSize)
+		mCondVar.notify_one();
+}
+
+void StreamEventLogWriter::writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs) {
+	unique_lock<mutex> lock(mMutex);
+	size_t room = mQueue.size() < mMaxQueueSize ? mMaxQueueSize - mQueue.size() : 0;
+	size_t count = min(room, evlogs.size());
+	mQueue.insert(mQueue.end(), evlogs.begin(), evlogs.begin() + count);
+	mDropped += evlogs.size() - count;
+	if (count > 0)
+		mCondVar.notify_one();
+}
+
+bool StreamEventLogWriter::connect() {
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &res);
+	if (err != 0) {
+		LOGE("StreamEventLogWriter: cannot resolve %s: %s", mHost.c_str(), gai_strerror(err));
+		return false;
+	}
+	for (struct addrinfo *ai = res; ai && mSocket == -1; ai = ai->ai_next) {
+		mSocket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (mSocket == -1)
+			continue;
+		if (::connect(mSocket, ai->ai_addr, ai->ai_addrlen) == -1) {
+			close(mSocket);
+			mSocket = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (mSocket == -1) {
+		LOGE("StreamEventLogWriter: cannot connect to %s:%s: %s", mHost.c_str(), mPort.c_str(), strerror(errno));
+		return false;
+	}
+	// a stalled collector must not block the stop
+	struct timeval timeout = {5, 0};
+	setsockopt(mSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	LOGI("StreamEventLogWriter: connected to %s:%s", mHost.c_str(), mPort.c_str());
+	return true;
+}
+
+bool StreamEventLogWriter::sendFrame(const string &frame) {
+	if (mSocket == -1 && !connect())
+		return false;
+	for (size_t sent = 0; sent < frame.size();) {
+		ssize_t n = send(mSocket, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOGE("StreamEventLogWriter: cannot send to %s:%s: %s", mHost.c_str(), mPort.c_str(), strerror(errno));
+			close(mSocket);
+			mSocket = -1;
+			return false;
+		}
+		sent += n;
+	}
+	return true;
+}
+
+void StreamEventLogWriter::run() {
+	static const chrono::seconds sMaxRetryDelay(30);
+	chrono::milliseconds retryDelay(500);
+	vector<shared_ptr<EventLog>> batch;
+	unique_lock<mutex> lock(mMutex);
+	while (true) {
+		if (mQueue.empty()) {
+			if (!mRunning)
+				break;
+			mCondVar.wait(lock);
+			continue;
+		}
+		// the batch waits a little for more events, so that the frames are not sent one event at a time
+		if (mQueue.size() < mBatchSize && mRunning)
+			mCondVar.wait_for(lock, mBatchDelay, [this]() { return mQueue.size() >= mBatchSize || !mRunning; });
+		size_t count = min(mQueue.size(), mBatchSize);
+		batch.assign(mQueue.begin(), mQueue.begin() + count);
+		mQueue.erase(mQueue.begin(), mQueue.begin() + count);
+		size_t dropped = mDropped;
+		mDropped = 0;
+		lock.unlock();
+
+		if (dropped > 0)
+			LOGE("StreamEventLogWriter: too many events in queue, %zu dropped (%zu)", dropped, mMaxQueueSize);
+		string events;
+		for (const auto &evlog : batch)
+			encode(evlog, events);
+		batch.clear();
+		string payload = mCompressionThreshold > 0 ? ValueCompression::compress(events, mCompressionThreshold) : events;
+		string frame;
+		frame.reserve(4 + payload.size());
+		for (int i = 3; i >= 0; --i)
+			frame += (char)(payload.size() >> (8 * i));
+		frame += payload;
+
+		// the frame is kept until sent, the events queued meanwhile being dropped beyond the maximum
+		while (!sendFrame(frame)) {
+			lock.lock();
+			bool stopping = mCondVar.wait_for(lock, retryDelay, [this]() { return !mRunning; });
+			lock.unlock();
+			if (stopping) {
+				LOGE("StreamEventLogWriter: stopping, the events not sent to %s:%s are lost", mHost.c_str(),
+					 mPort.c_str());
+				return;
+			}
+			retryDelay = min(chrono::duration_cast<chrono::milliseconds>(sMaxRetryDelay), retryDelay * 2);
+		}
+		retryDelay = chrono::milliseconds(500);
+		lock.lock();
+	}
+}
+
+#if ENABLE_SOCI
+
+#define SQL_REGISTRATION_EVENT_LOG_ID 0
+#define SQL_CALL_EVENT_LOG_ID 1
+#define SQL_MESSAGE_EVENT_LOG_ID 2
+#define SQL_AUTH_EVENT_LOG_ID 3
+#define SQL_CALL_QUALITY_EVENT_LOG_ID 4
+
+#define SQL_MYSQL_LAST_ID_FUN "LAST_INSERT_ID()"
+#define SQL_SQLITE3_LAST_ID_FUN "last_insert_rowid()"
+#define SQL_POSTGRESQL_LAST_ID_FUN "lastval()"
+
+using namespace soci;
+
 // `bool` type is not supported by `soci`.
 // Also, for future uses, no sql column is a bool type in this code.
 // A Oracle database doesn't support this type. It's better to use
@@ -714,11 +1176,19 @@ inline string createMessageTypesTable(DataBaseEventLogWriter::Backend backend) {
 
 DataBaseEventLogWriter::DataBaseEventLogWriter(
 	const std::string &backendString, const std::string &connectionString,
-	int maxQueueSize, int nbThreadsMax) {
+	int maxQueueSize, int nbThreadsMax, int batchSize, int compressionThreshold) {
 	mConnectionPool = nullptr;
 	mThreadPool = nullptr;
 	mIsReady = false;
 	mMaxQueueSize = maxQueueSize;
+	mMaxThreads = nbThreadsMax > 0 ? nbThreadsMax : 1;
+	mBatchSize = batchSize > 0 ? batchSize : 1;
+	mScheduledWrites = 0;
+	mCompressionThreshold = compressionThreshold > 0 ? compressionThreshold : 0;
+	if (mCompressionThreshold > 0 && !ValueCompression::isAvailable()) {
+		LOGW("DataBaseEventLogWriter: database-compression-threshold is ignored: flexisip is built without lz4");
+		mCompressionThreshold = 0;
+	}
 	try {
 		if (backendString != "mysql" && backendString != "sqlite3" && backendString != "postgresql") {
 			LOGE("DataBaseEventLogWriter: backend must be equals to `mysql`, `sqlite3` or `postgresql`.");
@@ -726,11 +1196,22 @@ DataBaseEventLogWriter::DataBaseEventLogWriter(
 		}
 
 		mConnectionPool = new connection_pool(nbThreadsMax);
-		mThreadPool = new ThreadPool(nbThreadsMax, maxQueueSize);
-
-		for (int i = 0; i < nbThreadsMax; i++) {
-			mConnectionPool->at(i).open(backendString, connectionString);
-		}
+		mThreadPool = new ThreadPool(nbThreadsMax, maxQueueSize,
+									 []() { ThreadPlacement::placeCurrentThread(ThreadPlacement::Db); });
+
+		// in parallel, the startup waiting for the slowest connection only
+		string error;
+		mutex errorMutex;
+		Startup::parallel(nbThreadsMax, [&](size_t i) {
+			try {
+				mConnectionPool->at(i).open(backendString, connectionString);
+			} catch (const exception &e) {
+				lock_guard<mutex> lock(errorMutex);
+				error = e.what();
+			}
+		});
+		if (!error.empty())
+			throw runtime_error(error);
 
 		// Init tables.
 		Backend backend = backendString == "mysql" ? Backend::Mysql : (backendString == "sqlite3" ? Backend::Sqlite3 : Backend::Postgresql);
@@ -970,85 +1451,109 @@ void DataBaseEventLogWriter::writeEventLog(const std::shared_ptr<EventLog> &evlo
 // So the choice here is to use the `LAST_INSERT_ID()` and `last_insert_rowid()`
 // from MySQL and SQlite3 directly in SQL.
 
-void DataBaseEventLogWriter::writeRegistrationLog(const std::shared_ptr<RegistrationLog> &evlog) {
-	session sql(*mConnectionPool);
-	transaction tr(sql);
-
+void DataBaseEventLogWriter::writeRegistrationLog(const std::shared_ptr<RegistrationLog> &evlog, session &sql) {
 	writeEventLog(evlog, SQL_REGISTRATION_EVENT_LOG_ID, sql);
 	sql << mInsertReq[SQL_REGISTRATION_EVENT_LOG_ID],
-		use(static_cast<int>(evlog->mType)), use(sipDataToString(evlog->mContacts));
-
-	tr.commit();
+		use(static_cast<int>(evlog->mType)),
+		use(ValueCompression::compressAsText(sipDataToString(evlog->mContacts), mCompressionThreshold));
 }
 
-void DataBaseEventLogWriter::writeCallLog(const std::shared_ptr<CallLog> &evlog) {
-	session sql(*mConnectionPool);
-	transaction tr(sql);
-
+void DataBaseEventLogWriter::writeCallLog(const std::shared_ptr<CallLog> &evlog, session &sql) {
 	writeEventLog(evlog, SQL_CALL_EVENT_LOG_ID, sql);
 	sql << mInsertReq[SQL_CALL_EVENT_LOG_ID],
 		use(boolToSqlString(evlog->mCancelled));
-
-	tr.commit();
 }
 
-void DataBaseEventLogWriter::writeMessageLog(const std::shared_ptr<MessageLog> &evlog) {
-	session sql(*mConnectionPool);
-	transaction tr(sql);
-
+void DataBaseEventLogWriter::writeMessageLog(const std::shared_ptr<MessageLog> &evlog, session &sql) {
 	writeEventLog(evlog, SQL_MESSAGE_EVENT_LOG_ID, sql);
 	sql << mInsertReq[SQL_MESSAGE_EVENT_LOG_ID],
 		use(static_cast<int>(evlog->mReportType)), use(sipDataToString(evlog->mUri));
-
-	tr.commit();
 }
 
-void DataBaseEventLogWriter::writeAuthLog(const std::shared_ptr<AuthLog> &evlog) {
-	session sql(*mConnectionPool);
-	transaction tr(sql);
-
+void DataBaseEventLogWriter::writeAuthLog(const std::shared_ptr<AuthLog> &evlog, session &sql) {
 	writeEventLog(evlog, SQL_AUTH_EVENT_LOG_ID, sql);
 	sql << mInsertReq[SQL_AUTH_EVENT_LOG_ID],
 		use(evlog->mMethod), use(sipDataToString(evlog->mOrigin)), use(boolToSqlString(evlog->mUserExists));
-
-	tr.commit();
 }
 
-void DataBaseEventLogWriter::writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &evlog) {
-	session sql(*mConnectionPool);
-	transaction tr(sql);
-
+void DataBaseEventLogWriter::writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &evlog, session &sql) {
 	writeEventLog(evlog, SQL_CALL_QUALITY_EVENT_LOG_ID, sql);
 	sql << mInsertReq[SQL_CALL_QUALITY_EVENT_LOG_ID],
-		use(evlog->mReport);
+		use(ValueCompression::compressAsText(evlog->mReport, mCompressionThreshold));
+}
 
-	tr.commit();
+void DataBaseEventLogWriter::writeEvent(const std::shared_ptr<EventLog> &evlog, session &sql) {
+	EventLog *ev = evlog.get();
+
+	if (typeid(*ev) == typeid(RegistrationLog)) {
+		writeRegistrationLog(static_pointer_cast<RegistrationLog>(evlog), sql);
+	} else if (typeid(*ev) == typeid(CallLog)) {
+		writeCallLog(static_pointer_cast<CallLog>(evlog), sql);
+	} else if (typeid(*ev) == typeid(MessageLog)) {
+		writeMessageLog(static_pointer_cast<MessageLog>(evlog), sql);
+	} else if (typeid(*ev) == typeid(AuthLog)) {
+		writeAuthLog(static_pointer_cast<AuthLog>(evlog), sql);
+	} else if (typeid(*ev) == typeid(CallQualityStatisticsLog)) {
+		writeCallQualityStatisticsLog(static_pointer_cast<CallQualityStatisticsLog>(evlog), sql);
+	}
 }
 
-void DataBaseEventLogWriter::writeEventFromQueue() {
-	mMutex.lock();
+// The rows of the specialized tables refer to the id of their event_log row, obtained with the last id function of
+// the backend, so the events are inserted one after the other: only the commit is shared by the batch.
+void DataBaseEventLogWriter::writeEvents(const std::vector<std::shared_ptr<EventLog>> &events) {
+	try {
+		session sql(*mConnectionPool);
+		try {
+			transaction tr(sql);
+			for (const auto &evlog : events) {
+				writeEvent(evlog, sql);
+			}
+			tr.commit();
+			return;
+		} catch (exception const &e) {
+			if (events.size() == 1) {
+				LOGE("DataBaseEventLogWriter: event write error: %s", e.what());
+				return;
+			}
+			LOGW("DataBaseEventLogWriter: write error of a batch of %zu events, writing them one by one: %s",
+				 events.size(), e.what());
+		}
 
-	shared_ptr<EventLog> evlog = mListLogs.front();
-	mListLogs.pop();
+		// so that a single faulty event does not lose the whole batch
+		for (const auto &evlog : events) {
+			try {
+				transaction tr(sql);
+				writeEvent(evlog, sql);
+				tr.commit();
+			} catch (exception const &e) {
+				LOGE("DataBaseEventLogWriter: event write error: %s", e.what());
+			}
+		}
+	} catch (exception const &e) {
+		LOGE("DataBaseEventLogWriter: unable to write %zu events: %s", events.size(), e.what());
+	}
+}
 
-	mMutex.unlock();
+void DataBaseEventLogWriter::writeEventFromQueue() {
+	vector<shared_ptr<EventLog>> events;
 
-	EventLog *ev = evlog.get();
+	while (true) {
+		mMutex.lock();
 
-	try {
-		if (typeid(*ev) == typeid(RegistrationLog)) {
-			writeRegistrationLog(static_pointer_cast<RegistrationLog>(evlog));
-		} else if (typeid(*ev) == typeid(CallLog)) {
-			writeCallLog(static_pointer_cast<CallLog>(evlog));
-		} else if (typeid(*ev) == typeid(MessageLog)) {
-			writeMessageLog(static_pointer_cast<MessageLog>(evlog));
-		} else if (typeid(*ev) == typeid(AuthLog)) {
-			writeAuthLog(static_pointer_cast<AuthLog>(evlog));
-		} else if (typeid(*ev) == typeid(CallQualityStatisticsLog)) {
-			writeCallQualityStatisticsLog(static_pointer_cast<CallQualityStatisticsLog>(evlog));
+		events.clear();
+		while (!mListLogs.empty() && events.size() < mBatchSize) {
+			events.push_back(mListLogs.front());
+			mListLogs.pop();
 		}
-	} catch (exception const &e) {
-		LOGE("DataBaseEventLogWriter: event write error: %s", e.what());
+		if (events.empty()) {
+			mScheduledWrites--;
+			mMutex.unlock();
+			return;
+		}
+
+		mMutex.unlock();
+
+		writeEvents(events);
 	}
 }
 
@@ -1057,11 +1562,18 @@ void DataBaseEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
 
 	if (mListLogs.size() < mMaxQueueSize) {
 		mListLogs.push(evlog);
+
+		// Another thread is only needed when the scheduled ones have more than a batch each to write.
+		bool schedule = mScheduledWrites < mMaxThreads && mScheduledWrites * mBatchSize < mListLogs.size();
+		if (schedule) mScheduledWrites++;
 		mMutex.unlock();
 
 		// Save event in database.
-		if (!mThreadPool->Enqueue(bind(&DataBaseEventLogWriter::writeEventFromQueue, this))) {
+		if (schedule && !mThreadPool->Enqueue(bind(&DataBaseEventLogWriter::writeEventFromQueue, this))) {
 			LOGE("DataBaseEventLogWriter: unable to enqueue event!");
+			mMutex.lock();
+			mScheduledWrites--;
+			mMutex.unlock();
 		}
 	} else {
 		mMutex.unlock();
@@ -1069,4 +1581,33 @@ void DataBaseEventLogWriter::write(const std::shared_ptr<EventLog> &evlog) {
 	}
 }
 
+void DataBaseEventLogWriter::writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs) {
+	size_t dropped = 0;
+	size_t schedule = 0;
+	mMutex.lock();
+	for (const auto &evlog : evlogs) {
+		if (mListLogs.size() < mMaxQueueSize)
+			mListLogs.push(evlog);
+		else
+			dropped++;
+	}
+	// As in write(), as many threads as needed for each to have no more than a batch to write.
+	while (mScheduledWrites < mMaxThreads && mScheduledWrites * mBatchSize < mListLogs.size()) {
+		mScheduledWrites++;
+		schedule++;
+	}
+	mMutex.unlock();
+
+	for (size_t i = 0; i < schedule; ++i) {
+		if (!mThreadPool->Enqueue(bind(&DataBaseEventLogWriter::writeEventFromQueue, this))) {
+			LOGE("DataBaseEventLogWriter: unable to enqueue event!");
+			mMutex.lock();
+			mScheduledWrites--;
+			mMutex.unlock();
+		}
+	}
+	if (dropped > 0)
+		LOGE("DataBaseEventLogWriter: too many events in queue! (%i), %zu dropped", (int)mMaxQueueSize, dropped);
+}
+
 #endif
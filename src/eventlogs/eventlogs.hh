@@ -26,11 +26,17 @@
 #include <string>
 #include <memory>
 #include <queue>
+#include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
 
 class EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class EventLogDb;
 
 public:
@@ -64,6 +70,7 @@ protected:
 class RegistrationLog : public EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class RegistrationLogDb;
 
 public:
@@ -85,19 +92,24 @@ private:
 class CallLog : public EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class CallLogDb;
 
 public:
 	CallLog(const sip_t *sip);
 	void setCancelled();
+	/* Summary of the reception quality of the media streams, logged when the call ends. */
+	void setMediaQuality(const std::string &summary);
 
 private:
 	bool mCancelled;
+	std::string mMediaQuality;
 };
 
 class MessageLog : public EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class MessageLogDb;
 
 public:
@@ -120,6 +132,7 @@ private:
 class AuthLog: public EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class AuthLogDb;
 
 public:
@@ -138,11 +151,15 @@ private:
 class CallQualityStatisticsLog: public EventLog {
 	friend class FilesystemEventLogWriter;
 	friend class DataBaseEventLogWriter;
+	friend class StreamEventLogWriter;
 	friend class CallQualityStatisticsLogDb;
 
 public:
 
 	CallQualityStatisticsLog(const sip_t *sip);
+	const std::string &getReport() const {
+		return mReport;
+	}
 
 private:
 
@@ -156,19 +173,34 @@ class EventLogWriter {
 public:
 
 	virtual void write(const std::shared_ptr<EventLog> &evlog) = 0;
+	virtual void writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs);
 	virtual ~EventLogWriter();
 };
 
 class FilesystemEventLogWriter: public EventLogWriter {
 public:
 
-	FilesystemEventLogWriter(const std::string &rootpath);
+	/* With segments, the events are written by a thread to the segment files rather than to one file per user. */
+	FilesystemEventLogWriter(const std::string &rootpath, bool segments = false, size_t segmentMaxSize = 0,
+							 size_t maxQueueSize = 0);
+	~FilesystemEventLogWriter();
 	virtual void write(const std::shared_ptr<EventLog> &evlog);
 	bool isReady() const;
 
 private:
 
+	struct Record {
+		std::string key; // log of the event, as the path of its file without segments
+		time_t date;
+		std::string line;
+	};
+
 	int openPath(const url_t *uri, const char *kind, time_t curtime, int errorcode = 0);
+	void writeLine(const url_t *uri, const char *kind, time_t curtime, const std::string &line, int errorcode = 0);
+	void runSegmentWriter();
+	bool openSegment(time_t curtime);
+	void flushSegment(std::string &data, std::string &index);
+	void closeSegment();
 	void writeRegistrationLog(const std::shared_ptr<RegistrationLog> &evlog);
 	void writeCallLog(const std::shared_ptr<CallLog> &clog);
 	void writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &mlog);
@@ -177,6 +209,67 @@ private:
 	void writeErrorLog(const std::shared_ptr<EventLog> &log, const char *kind, const std::string &logstr);
 	std::string mRootPath;
 	bool mIsReady;
+
+	bool mSegments;
+	size_t mSegmentMaxSize;
+	size_t mMaxQueueSize;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::vector<Record> mQueue;
+	std::thread mThread;
+	bool mRunning;
+	// used by the thread only
+	int mSegmentFd;
+	int mIndexFd;
+	std::string mSegmentName;
+	std::string mSegmentDay;
+	time_t mSegmentEnd;
+	int mSegmentSeq;
+	size_t mSegmentSize;
+};
+
+/*
+ * Streams the events to a collector over TCP, typically the bridge to a message bus (see
+ * tools/eventlog-stream-bridge.py): a thread sends them by batches, in frames of the size of the batch on 4 bytes, big
+ * endian, followed by the batch, the MessagePack maps of its events one after the other, LZ4 compressed from a
+ * threshold as ValueCompression does. A frame cut by a connection loss is sent again on the next connection. The
+ * events beyond the queue are dropped, while the collector is unreachable or too slow.
+ */
+class StreamEventLogWriter: public EventLogWriter {
+public:
+
+	/* address is host:port. */
+	StreamEventLogWriter(const std::string &address, size_t maxQueueSize, size_t batchSize, int batchDelayMs,
+						 int compressionThreshold);
+	~StreamEventLogWriter();
+	virtual void write(const std::shared_ptr<EventLog> &evlog);
+	virtual void writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs);
+	bool isReady() const;
+
+	/* Appends the MessagePack map of the event to out. */
+	static void encode(const std::shared_ptr<EventLog> &evlog, std::string &out);
+
+private:
+
+	void run();
+	bool connect();
+	bool sendFrame(const std::string &frame);
+
+	std::string mHost;
+	std::string mPort;
+	bool mIsReady;
+	size_t mMaxQueueSize;
+	size_t mBatchSize;
+	std::chrono::milliseconds mBatchDelay;
+	size_t mCompressionThreshold;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::deque<std::shared_ptr<EventLog>> mQueue;
+	size_t mDropped;
+	std::thread mThread;
+	bool mRunning;
+	// used by the thread only
+	int mSocket;
 };
 
 #if ENABLE_SOCI
@@ -195,11 +288,13 @@ public:
 
 	DataBaseEventLogWriter(
 		const std::string &backendString, const std::string &connectionString,
-		int maxQueueSize, int nbThreadsMax
+		int maxQueueSize, int nbThreadsMax, int batchSize = 1, int compressionThreshold = 0
 	);
 	~DataBaseEventLogWriter();
 
 	virtual void write(const std::shared_ptr<EventLog> &evlog);
+	/* Queues the events at once, the writing threads taking them by batches. */
+	virtual void writeBatch(const std::vector<std::shared_ptr<EventLog>> &evlogs);
 	bool isReady() const;
 
 private:
@@ -208,11 +303,13 @@ private:
 
 	static void writeEventLog(const std::shared_ptr<EventLog> &evlog, int typeId, soci::session &sql);
 
-	void writeRegistrationLog(const std::shared_ptr<RegistrationLog> &evlog);
-	void writeCallLog(const std::shared_ptr<CallLog> &evlog);
-	void writeMessageLog(const std::shared_ptr<MessageLog> &evlog);
-	void writeAuthLog(const std::shared_ptr<AuthLog> &evlog);
-	void writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &evlog);
+	void writeRegistrationLog(const std::shared_ptr<RegistrationLog> &evlog, soci::session &sql);
+	void writeCallLog(const std::shared_ptr<CallLog> &evlog, soci::session &sql);
+	void writeMessageLog(const std::shared_ptr<MessageLog> &evlog, soci::session &sql);
+	void writeAuthLog(const std::shared_ptr<AuthLog> &evlog, soci::session &sql);
+	void writeCallQualityStatisticsLog(const std::shared_ptr<CallQualityStatisticsLog> &evlog, soci::session &sql);
+	void writeEvent(const std::shared_ptr<EventLog> &evlog, soci::session &sql);
+	void writeEvents(const std::vector<std::shared_ptr<EventLog>> &events);
 
 	void writeEventFromQueue();
 
@@ -224,6 +321,10 @@ private:
 	ThreadPool *mThreadPool;
 
 	size_t mMaxQueueSize;
+	size_t mMaxThreads;
+	size_t mBatchSize;
+	size_t mScheduledWrites; // tasks of the thread pool emptying the queue
+	size_t mCompressionThreshold; // size from which the contacts and the reports are written compressed, 0 for never
 
 	std::string mInsertReq[5];
 };
@@ -32,6 +32,7 @@
 
 #include "log/logmanager.hh"
 #include "utils/flexisip-exception.hh"
+#include "utils/linearregex.hh"
 
 using namespace std;
 
@@ -59,16 +60,50 @@ bool BooleanExpression::eval(const sip_t *sip) throw(FlexisipException) {
 }
 #endif
 
-class EmptyBooleanExpression : public BooleanExpression {
+/*
+ * Node of a parsed expression.
+ * Nodes give an estimate of their evaluation cost and tell whether their evaluation may throw, so that the operands of
+ * && and || can be reordered to evaluate the cheapest first when it does not change the result.
+ */
+class ExpressionNode : public BooleanExpression {
+  public:
+	virtual int cost() const = 0;
+	virtual bool mayThrow() const {
+		return true;
+	}
+	/* True when the value of the node does not depend on the SIP message. */
+	virtual bool constantValue(bool *value) const {
+		return false;
+	}
+};
+
+class EmptyBooleanExpression : public ExpressionNode {
   public:
 	EmptyBooleanExpression() {
 	}
 	bool eval(const SipAttributes *args) {
 		return true;
 	}
+	virtual int cost() const {
+		return 0;
+	}
+	virtual bool mayThrow() const {
+		return false;
+	}
+	virtual bool constantValue(bool *value) const {
+		*value = true;
+		return true;
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		return AlwaysTrue;
+	}
 };
 
-shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos);
+static BooleanExpression::Outcome outcome(bool value) {
+	return value ? BooleanExpression::AlwaysTrue : BooleanExpression::AlwaysFalse;
+}
+
+shared_ptr<ExpressionNode> parseExpression(const string &expr, size_t *newpos);
 
 /*
  * May return empty expression
@@ -98,6 +133,27 @@ void log_boolean_expression_parsing(bool value) {
 	if (logEval)                                                                                                       \
 	SLOGI
 
+static void splitList(const string &s, list<string> &values) {
+	size_t pos1 = 0;
+	size_t pos2 = 0;
+	for (pos2 = 0; pos2 < s.size(); ++pos2) {
+		if (s[pos2] != ' ') {
+			if (s[pos1] == ' ')
+				pos1 = pos2;
+			continue;
+		}
+		if (s[pos2] == ' ' && s[pos1] == ' ') {
+			pos1 = pos2;
+			continue;
+		}
+		values.push_back(s.substr(pos1, pos2 - pos1));
+		pos1 = pos2;
+	}
+
+	if (pos1 != pos2)
+		values.push_back(s.substr(pos1, pos2 - pos1));
+}
+
 class VariableOrConstant {
 	list<string> mValueList;
 
@@ -105,6 +161,17 @@ class VariableOrConstant {
 	virtual ~VariableOrConstant() {
 	}
 	virtual const std::string &get(const SipAttributes *args) = 0;
+	virtual bool isConstant() const {
+		return false;
+	}
+	/* Whether get() may throw something else than the invalid_argument of a field missing in the message. */
+	virtual bool mayFail() const {
+		return true;
+	}
+	virtual int cost() const = 0;
+	virtual bool isRequestMethod() const {
+		return false;
+	}
 	bool defined(const SipAttributes *args) {
 		try {
 			get(args);
@@ -113,80 +180,144 @@ class VariableOrConstant {
 		}
 		return false;
 	}
-	const list<string> &getAsList(const SipAttributes *args) {
+	virtual const list<string> &getAsList(const SipAttributes *args) {
 		string s = get(args);
 		mValueList.clear();
-
-		size_t pos1 = 0;
-		size_t pos2 = 0;
-		for (pos2 = 0; pos2 < s.size(); ++pos2) {
-			if (s[pos2] != ' ') {
-				if (s[pos1] == ' ')
-					pos1 = pos2;
-				continue;
-			}
-			if (s[pos2] == ' ' && s[pos1] == ' ') {
-				pos1 = pos2;
-				continue;
-			}
-			mValueList.push_back(s.substr(pos1, pos2 - pos1));
-			pos1 = pos2;
-		}
-
-		if (pos1 != pos2)
-			mValueList.push_back(s.substr(pos1, pos2 - pos1));
-
+		splitList(s, mValueList);
 		return mValueList;
 	}
 };
 
 class Constant : public VariableOrConstant {
 	string mVal;
+	list<string> mValueList;
 
   public:
 	Constant(const std::string &val) : mVal(val) {
 		LOGPARSE << "Creating constant XX" << val << "XX";
+		splitList(mVal, mValueList);
 	}
 	virtual const std::string &get(const SipAttributes *args) {
 		return mVal;
 	}
+	virtual bool isConstant() const {
+		return true;
+	}
+	virtual bool mayFail() const {
+		return false;
+	}
+	virtual int cost() const {
+		return 0;
+	}
+	virtual const list<string> &getAsList(const SipAttributes *args) {
+		return mValueList;
+	}
 };
 
 class Variable : public VariableOrConstant {
 	string mId;
 	string mVal;
+#ifndef NO_SOFIA
+	SipAttributes::Attribute mAttr;
+#endif
 
   public:
 	Variable(const std::string &val) : mId(val) {
 		LOGPARSE << "Creating variable XX" << val << "XX";
+#ifndef NO_SOFIA
+		mAttr = SipAttributes::resolve(mId);
+#endif
 	}
 	virtual const std::string &get(const SipAttributes *args) {
+#ifndef NO_SOFIA
+		// the attributes keep the extracted value
+		if (mAttr != SipAttributes::UnknownAttribute)
+			return args->get(mAttr);
+#endif
 		mVal = args->get(mId);
 		return mVal;
 	}
+	virtual bool mayFail() const {
+#ifndef NO_SOFIA
+		return mAttr == SipAttributes::UnknownAttribute;
+#else
+		return true;
+#endif
+	}
+	virtual int cost() const {
+		return mayFail() ? 4 : 2;
+	}
+	virtual bool isRequestMethod() const {
+		return mId == "request.mn" || mId == "request.method-name";
+	}
 };
 
-class TrueFalseExpression : public BooleanExpression {
+/* The constant a request method is compared to, if the operands are a method and a constant. */
+static const string *comparedToMethod(const shared_ptr<VariableOrConstant> &var1,
+									  const shared_ptr<VariableOrConstant> &var2) {
+	if (var1->isRequestMethod() && var2->isConstant())
+		return &var2->get(NULL);
+	if (var2->isRequestMethod() && var1->isConstant())
+		return &var1->get(NULL);
+	return NULL;
+}
+
+class TrueFalseExpression : public ExpressionNode {
+	enum Kind { True, False, Attribute };
 	string mId;
+	Kind mKind;
 
   public:
 	TrueFalseExpression(const string &value) : mId(value) {
+		mKind = (mId == "true") ? True : (mId == "false") ? False : Attribute;
 	}
 	virtual bool eval(const SipAttributes *args) {
-		if (mId == "true")
-			return true;
-		if (mId == "false")
-			return false;
+		switch (mKind) {
+			case True:
+				return true;
+			case False:
+				return false;
+			case Attribute:
+				break;
+		}
 		return args->isTrue(mId);
 	}
+	virtual int cost() const {
+		return mKind == Attribute ? 1 : 0;
+	}
+	virtual bool mayThrow() const {
+#ifndef NO_SOFIA
+		return mKind == Attribute && mId != "is_request" && mId != "is_response";
+#else
+		return mKind == Attribute;
+#endif
+	}
+	virtual bool constantValue(bool *value) const {
+		if (mKind == Attribute)
+			return false;
+		*value = (mKind == True);
+		return true;
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		if (mKind != Attribute)
+			return outcome(mKind == True);
+		if (mId == "is_request")
+			return outcome(isRequest);
+		if (mId == "is_response")
+			return outcome(!isRequest);
+		return Depends;
+	}
 };
 
-class LogicalAnd : public BooleanExpression {
-	shared_ptr<BooleanExpression> mExp1, mExp2;
+class LogicalAnd : public ExpressionNode {
+	shared_ptr<ExpressionNode> mExp1, mExp2;
 
   public:
-	LogicalAnd(shared_ptr<BooleanExpression> exp1, shared_ptr<BooleanExpression> exp2) : mExp1(exp1), mExp2(exp2) {
+	LogicalAnd(shared_ptr<ExpressionNode> exp1, shared_ptr<ExpressionNode> exp2) : mExp1(exp1), mExp2(exp2) {
 		LOGPARSE << "Creating LogicalAnd";
+		// the left operand may guard the right one, e.g. is_request && request.mn == 'INVITE'
+		if (!mExp1->mayThrow() && !mExp2->mayThrow() && mExp2->cost() < mExp1->cost())
+			swap(mExp1, mExp2);
 	}
 	virtual bool eval(const SipAttributes *args) {
 		LOGEVAL << "eval && : " << ptr();
@@ -196,12 +327,30 @@ class LogicalAnd : public BooleanExpression {
 		LOGEVAL << "eval && : " << ptr() << tf(res);
 		return res;
 	}
+	virtual int cost() const {
+		return mExp1->cost() + mExp2->cost();
+	}
+	virtual bool mayThrow() const {
+		return mExp1->mayThrow() || mExp2->mayThrow();
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		Outcome left = mExp1->evalFor(isRequest, method);
+		if (left == AlwaysFalse)
+			return AlwaysFalse;
+		Outcome right = mExp2->evalFor(isRequest, method);
+		if (left == AlwaysTrue)
+			return right;
+		// the evaluation of the left operand could still throw
+		return (right == AlwaysFalse && !mExp1->mayThrow()) ? AlwaysFalse : Depends;
+	}
 };
 
-class LogicalOr : public BooleanExpression {
+class LogicalOr : public ExpressionNode {
   public:
-	LogicalOr(shared_ptr<BooleanExpression> exp1, shared_ptr<BooleanExpression> exp2) : mExp1(exp1), mExp2(exp2) {
+	LogicalOr(shared_ptr<ExpressionNode> exp1, shared_ptr<ExpressionNode> exp2) : mExp1(exp1), mExp2(exp2) {
 		LOGPARSE << "Creating LogicalOr";
+		if (!mExp1->mayThrow() && !mExp2->mayThrow() && mExp2->cost() < mExp1->cost())
+			swap(mExp1, mExp2);
 	}
 	virtual bool eval(const SipAttributes *args) {
 		LOGEVAL << "eval || : " << ptr();
@@ -212,14 +361,29 @@ class LogicalOr : public BooleanExpression {
 		LOGEVAL << "eval || : " << tf(res);
 		return res;
 	}
+	virtual int cost() const {
+		return mExp1->cost() + mExp2->cost();
+	}
+	virtual bool mayThrow() const {
+		return mExp1->mayThrow() || mExp2->mayThrow();
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		Outcome left = mExp1->evalFor(isRequest, method);
+		if (left == AlwaysTrue)
+			return AlwaysTrue;
+		Outcome right = mExp2->evalFor(isRequest, method);
+		if (left == AlwaysFalse)
+			return right;
+		return (right == AlwaysTrue && !mExp1->mayThrow()) ? AlwaysTrue : Depends;
+	}
 
   private:
-	shared_ptr<BooleanExpression> mExp1, mExp2;
+	shared_ptr<ExpressionNode> mExp1, mExp2;
 };
 
-class LogicalNot : public BooleanExpression {
+class LogicalNot : public ExpressionNode {
   public:
-	LogicalNot(shared_ptr<BooleanExpression> exp) : mExp(exp) {
+	LogicalNot(shared_ptr<ExpressionNode> exp) : mExp(exp) {
 		LOGPARSE << "Creating LogicalNot";
 	}
 	virtual bool eval(const SipAttributes *args) {
@@ -227,12 +391,22 @@ class LogicalNot : public BooleanExpression {
 		LOGEVAL << "evaluating logicalnot : " << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return mExp->cost();
+	}
+	virtual bool mayThrow() const {
+		return mExp->mayThrow();
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		Outcome value = mExp->evalFor(isRequest, method);
+		return value == Depends ? Depends : outcome(value == AlwaysFalse);
+	}
 
   private:
-	shared_ptr<BooleanExpression> mExp;
+	shared_ptr<ExpressionNode> mExp;
 };
 
-class EqualsOp : public BooleanExpression {
+class EqualsOp : public ExpressionNode {
   public:
 	EqualsOp(shared_ptr<VariableOrConstant> var1, shared_ptr<VariableOrConstant> var2) : mVar1(var1), mVar2(var2) {
 		LOGPARSE << "Creating EqualsOperator";
@@ -242,12 +416,21 @@ class EqualsOp : public BooleanExpression {
 		LOGEVAL << "evaluating " << mVar1->get(args) << " == " << mVar2->get(args) << " : " << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return 1 + mVar1->cost() + mVar2->cost();
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		const string *value = comparedToMethod(mVar1, mVar2);
+		if (!isRequest || method.empty() || !value)
+			return Depends;
+		return outcome(*value == method);
+	}
 
   private:
 	shared_ptr<VariableOrConstant> mVar1, mVar2;
 };
 
-class UnEqualsOp : public BooleanExpression {
+class UnEqualsOp : public ExpressionNode {
   public:
 	UnEqualsOp(shared_ptr<VariableOrConstant> var1, shared_ptr<VariableOrConstant> var2) : mVar1(var1), mVar2(var2) {
 		LOGPARSE << "Creating UnEqualsOperator";
@@ -257,12 +440,21 @@ class UnEqualsOp : public BooleanExpression {
 		LOGEVAL << "evaluating " << mVar1->get(args) << " != " << mVar2->get(args) << " : " << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return 1 + mVar1->cost() + mVar2->cost();
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		const string *value = comparedToMethod(mVar1, mVar2);
+		if (!isRequest || method.empty() || !value)
+			return Depends;
+		return outcome(*value != method);
+	}
 
   private:
 	shared_ptr<VariableOrConstant> mVar1, mVar2;
 };
 
-class NumericOp : public BooleanExpression {
+class NumericOp : public ExpressionNode {
 	shared_ptr<VariableOrConstant> mVar;
 
   public:
@@ -270,7 +462,7 @@ class NumericOp : public BooleanExpression {
 		LOGPARSE << "Creating NumericOperator";
 	}
 	virtual bool eval(const SipAttributes *args) {
-		string var = mVar->get(args);
+		const string &var = mVar->get(args);
 		bool res = true;
 		for (auto it = var.begin(); it != var.end(); ++it) {
 			if (!isdigit(*it)) {
@@ -281,9 +473,12 @@ class NumericOp : public BooleanExpression {
 		LOGEVAL << "evaluating " << var << " is numeric : " << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return 2 + mVar->cost();
+	}
 };
 
-class DefinedOp : public BooleanExpression {
+class DefinedOp : public ExpressionNode {
 	shared_ptr<VariableOrConstant> mVar;
 	string mName;
 
@@ -296,13 +491,28 @@ class DefinedOp : public BooleanExpression {
 		LOGEVAL << "evaluating is defined for " << mName << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return mVar->cost();
+	}
+	virtual bool mayThrow() const {
+		// defined() catches the std::exception, but the test attributes throw pointers
+#ifndef NO_SOFIA
+		return false;
+#else
+		return true;
+#endif
+	}
 };
 
-class Regex : public BooleanExpression {
+class Regex : public ExpressionNode {
 	shared_ptr<VariableOrConstant> mInput;
 	shared_ptr<Constant> mPattern;
 	regex_t preg;
 	char error_msg_buff[100];
+	// matched in a time linear in the length of the headers, whatever the pattern, regexec() being kept for the
+	// patterns it does not support
+	LinearRegex mLinearRegex;
+	bool mLinear;
 
   public:
 	Regex(shared_ptr<VariableOrConstant> input, shared_ptr<Constant> pattern) : mInput(input), mPattern(pattern) {
@@ -311,32 +521,44 @@ class Regex : public BooleanExpression {
 		int err = regcomp(&preg, p.c_str(), REG_NOSUB | REG_EXTENDED);
 		if (err != 0)
 			throw invalid_argument("couldn't compile regex " + p);
+		string error;
+		mLinear = mLinearRegex.compile(p, error);
+		if (!mLinear)
+			LOGPARSE << "Regex " << p << " evaluated by regexec(): " << error;
 	}
 	~Regex() {
 		regfree(&preg);
 	}
 	virtual bool eval(const SipAttributes *args) {
-		string input = mInput->get(args);
-		int match = regexec(&preg, input.c_str(), 0, NULL, 0);
+		const string &input = mInput->get(args);
 		bool res;
-		switch (match) {
-			case 0:
-				res = true;
-				break;
-			case REG_NOMATCH:
-				res = false;
-				break;
-			default:
-				regerror(match, &preg, error_msg_buff, sizeof(error_msg_buff));
-				throw invalid_argument("Error evaluating regex " + string(error_msg_buff));
+		if (mLinear) {
+			// regexec() stops at the first nul
+			res = mLinearRegex.search(input.c_str(), strlen(input.c_str()));
+		} else {
+			int match = regexec(&preg, input.c_str(), 0, NULL, 0);
+			switch (match) {
+				case 0:
+					res = true;
+					break;
+				case REG_NOMATCH:
+					res = false;
+					break;
+				default:
+					regerror(match, &preg, error_msg_buff, sizeof(error_msg_buff));
+					throw invalid_argument("Error evaluating regex " + string(error_msg_buff));
+			}
 		}
 
 		LOGEVAL << "evaluating " << input << " is regex  " << mPattern->get(NULL) << " : " << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return (mLinear ? 8 : 16) + mInput->cost();
+	}
 };
 
-class ContainsOp : public BooleanExpression {
+class ContainsOp : public ExpressionNode {
 	shared_ptr<VariableOrConstant> mVar1, mVar2;
 
   public:
@@ -345,8 +567,8 @@ class ContainsOp : public BooleanExpression {
 	virtual bool eval(const SipAttributes *args) {
 		bool res = false;
 		try {
-			string var1 = mVar1->get(args);
-			string var2 = mVar2->get(args);
+			const string &var1 = mVar1->get(args);
+			const string &var2 = mVar2->get(args);
 			res = var1.find(var2) != std::string::npos;
 
 			LOGEVAL << "evaluating " << mVar1->get(args) << " contains " << mVar2->get(args) << " : "
@@ -359,9 +581,15 @@ class ContainsOp : public BooleanExpression {
 		// we could get a runtime_error, which we let bubble up because this error denotes a badly written filter (instead of just a missing field in the SIP message.
 		return res;
 	}
+	virtual int cost() const {
+		return 4 + mVar1->cost() + mVar2->cost();
+	}
+	virtual bool mayThrow() const {
+		return mVar1->mayFail() || mVar2->mayFail();
+	}
 };
 
-class InOp : public BooleanExpression {
+class InOp : public ExpressionNode {
   public:
 	InOp(shared_ptr<VariableOrConstant> var1, shared_ptr<VariableOrConstant> var2) : mVar1(var1), mVar2(var2) {
 	}
@@ -381,11 +609,75 @@ class InOp : public BooleanExpression {
 		LOGEVAL << "->" << (res ? "true" : "false");
 		return res;
 	}
+	virtual int cost() const {
+		return 4 + mVar1->cost() + mVar2->cost() + (mVar2->isConstant() ? 0 : 8);
+	}
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		if (!isRequest || method.empty() || !mVar1->isRequestMethod() || !mVar2->isConstant())
+			return Depends;
+		const list<string> &values = mVar2->getAsList(NULL);
+		return outcome(find(values.begin(), values.end(), method) != values.end());
+	}
 
   private:
 	shared_ptr<VariableOrConstant> mVar1, mVar2;
 };
 
+static bool constantOperands(const shared_ptr<VariableOrConstant> &var) {
+	return var && var->isConstant();
+}
+
+static bool constantOperands(const shared_ptr<VariableOrConstant> &var1, const shared_ptr<VariableOrConstant> &var2) {
+	return constantOperands(var1) && constantOperands(var2);
+}
+
+/*
+ * Replaces the operators whose operands are all constants by their value.
+ * Those failing to evaluate are kept, so that the error is reported when the filter is used as before.
+ */
+static shared_ptr<ExpressionNode> fold(const shared_ptr<ExpressionNode> &exp, bool constant) {
+	if (!constant)
+		return exp;
+	try {
+		return make_shared<TrueFalseExpression>(exp->eval((const SipAttributes *)NULL) ? "true" : "false");
+	} catch (...) {
+	}
+	return exp;
+}
+
+static shared_ptr<ExpressionNode> makeAnd(const shared_ptr<ExpressionNode> &exp1,
+										  const shared_ptr<ExpressionNode> &exp2) {
+	if (!exp2)
+		throw invalid_argument("&& operator expects second operand.");
+	bool value;
+	if (exp1->constantValue(&value))
+		return value ? exp2 : exp1;
+	if (exp2->constantValue(&value) && (value || !exp1->mayThrow()))
+		return value ? exp1 : exp2;
+	return make_shared<LogicalAnd>(exp1, exp2);
+}
+
+static shared_ptr<ExpressionNode> makeOr(const shared_ptr<ExpressionNode> &exp1,
+										 const shared_ptr<ExpressionNode> &exp2) {
+	if (!exp2)
+		throw invalid_argument("|| operator expects second operand.");
+	bool value;
+	if (exp1->constantValue(&value))
+		return value ? exp1 : exp2;
+	if (exp2->constantValue(&value) && (!value || !exp1->mayThrow()))
+		return value ? exp2 : exp1;
+	return make_shared<LogicalOr>(exp1, exp2);
+}
+
+static shared_ptr<ExpressionNode> makeNot(const shared_ptr<ExpressionNode> &exp) {
+	if (!exp)
+		throw invalid_argument("! operator expects an operand.");
+	bool value;
+	if (exp->constantValue(&value))
+		return make_shared<TrueFalseExpression>(value ? "false" : "true");
+	return make_shared<LogicalNot>(exp);
+}
+
 static size_t find_first_non_word(const string &expr, size_t offset) {
 	size_t i;
 	for (i = offset; i < expr.size(); ++i) {
@@ -490,11 +782,11 @@ static void printState(const string &str, size_t pos) {
 	LOGPARSE << oss.str().c_str();
 }
 
-shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos) {
+shared_ptr<ExpressionNode> parseExpression(const string &expr, size_t *newpos) {
 	size_t i;
 
 	LOGPARSE << "Parsing expression " << expr;
-	shared_ptr<BooleanExpression> cur_exp;
+	shared_ptr<ExpressionNode> cur_exp;
 	shared_ptr<VariableOrConstant> cur_var;
 
 	for (i = 0; i < expr.size();) {
@@ -516,7 +808,7 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 						throw new logic_error("&& operator expects first operand.");
 					}
 					i += 2;
-					cur_exp = make_shared<LogicalAnd>(cur_exp, parseExpression(expr.substr(i), &j));
+					cur_exp = makeAnd(cur_exp, parseExpression(expr.substr(i), &j));
 					i += j;
 				} else {
 					throw new logic_error("Bad operator '&'");
@@ -528,7 +820,7 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 						throw new logic_error("|| operator expects first operand.");
 					}
 					i += 2;
-					cur_exp = make_shared<LogicalOr>(cur_exp, parseExpression(expr.substr(i), &j));
+					cur_exp = makeOr(cur_exp, parseExpression(expr.substr(i), &j));
 					i += j;
 				} else {
 					throw invalid_argument("Bad operator '|'");
@@ -540,7 +832,8 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 						throw invalid_argument("!= operator expects first variable or const operand.");
 					}
 					i += 2;
-					cur_exp = make_shared<UnEqualsOp>(cur_var, buildVariableOrConstant(expr.substr(i), &j));
+					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
+					cur_exp = fold(make_shared<UnEqualsOp>(cur_var, rightVar), constantOperands(cur_var, rightVar));
 				} else {
 					if (cur_exp) {
 						throw invalid_argument("Parsing error around '!'");
@@ -561,12 +854,12 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 						i += j;
 						j = 0;
 						auto var = buildVariableOrConstant(expr.substr(i), &j);
-						cur_exp = make_shared<NumericOp>(var);
+						cur_exp = fold(make_shared<NumericOp>(var), constantOperands(var));
 					} else if (isKeyword(expr.substr(i), &j, "defined")) {
 						i += j;
 						j = 0;
 						auto var = buildVariableOrConstant(expr.substr(i), &j);
-						cur_exp = make_shared<DefinedOp>(expr.substr(i, j), var);
+						cur_exp = fold(make_shared<DefinedOp>(expr.substr(i, j), var), constantOperands(var));
 					} else if (expr[i] == '(') {
 						size_t end = find_matching_closing_parenthesis(expr, i + 1);
 						if (end != string::npos) {
@@ -584,7 +877,7 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 					}
 
 					// Take the negation!
-					cur_exp = make_shared<LogicalNot>(cur_exp);
+					cur_exp = makeNot(cur_exp);
 				}
 				i += j;
 				break;
@@ -594,7 +887,8 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 						throw invalid_argument("== operator expects first variable or const operand.");
 					}
 					i += 2;
-					cur_exp = make_shared<EqualsOp>(cur_var, buildVariableOrConstant(expr.substr(i), &j));
+					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
+					cur_exp = fold(make_shared<EqualsOp>(cur_var, rightVar), constantOperands(cur_var, rightVar));
 					i += j;
 				} else {
 					throw invalid_argument("Bad operator =");
@@ -606,10 +900,13 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 				break;
 			case 'c':
 				if (isKeyword(expr.substr(i), &j, "contains")) {
+					if (!cur_var) {
+						throw invalid_argument("contains operator expects first variable or const operand.");
+					}
 					i += j;
 					j = 0;
 					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
-					cur_exp = make_shared<ContainsOp>(cur_var, rightVar);
+					cur_exp = fold(make_shared<ContainsOp>(cur_var, rightVar), constantOperands(cur_var, rightVar));
 					i += j;
 				} else {
 					cur_var = buildVariableOrConstant(expr.substr(i), &j);
@@ -622,7 +919,7 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 					i += j;
 					j = 0;
 					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
-					cur_exp = make_shared<DefinedOp>(expr.substr(i, j), rightVar);
+					cur_exp = fold(make_shared<DefinedOp>(expr.substr(i, j), rightVar), constantOperands(rightVar));
 					i += j;
 				} else {
 					cur_var = buildVariableOrConstant(expr.substr(i), &j);
@@ -632,10 +929,13 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 				break;
 			case 'r':
 				if (isKeyword(expr.substr(i), &j, "regex")) {
+					if (!cur_var) {
+						throw invalid_argument("regex operator expects first variable or const operand.");
+					}
 					i += j;
 					j = 0;
 					auto pattern = buildConstant(expr.substr(i), &j);
-					cur_exp = make_shared<Regex>(cur_var, pattern);
+					cur_exp = fold(make_shared<Regex>(cur_var, pattern), constantOperands(cur_var));
 					i += j;
 				} else {
 					cur_var = buildVariableOrConstant(expr.substr(i), &j);
@@ -645,10 +945,13 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 				break;
 			case 'i':
 				if (isKeyword(expr.substr(i), &j, "in")) {
+					if (!cur_var) {
+						throw invalid_argument("in operator expects first variable or const operand.");
+					}
 					i += j;
 					j = 0;
 					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
-					cur_exp = make_shared<InOp>(cur_var, rightVar);
+					cur_exp = fold(make_shared<InOp>(cur_var, rightVar), constantOperands(cur_var, rightVar));
 					i += j;
 				} else if (isKeyword(expr.substr(i), &j, "is_request")) {
 					i += j;
@@ -694,16 +997,19 @@ shared_ptr<BooleanExpression> parseExpression(const string &expr, size_t *newpos
 					i += j;
 					j = 0;
 					auto var = buildVariableOrConstant(expr.substr(i), &j);
-					cur_exp = make_shared<NumericOp>(var);
+					cur_exp = fold(make_shared<NumericOp>(var), constantOperands(var));
 					i += j;
 					j = 0;
 					// fixme should check all is finished now
 				} else if (isKeyword(expr.substr(i), &j, "nin") || isKeyword(expr.substr(i), &j, "notin")) {
+					if (!cur_var) {
+						throw invalid_argument("nin operator expects first variable or const operand.");
+					}
 					i += j;
 					j = 0;
 					auto rightVar = buildVariableOrConstant(expr.substr(i), &j);
-					auto in = make_shared<InOp>(cur_var, rightVar);
-					cur_exp = make_shared<LogicalNot>(in);
+					auto in = fold(make_shared<InOp>(cur_var, rightVar), constantOperands(cur_var, rightVar));
+					cur_exp = makeNot(in);
 					i += j;
 				} else {
 					cur_var = buildVariableOrConstant(expr.substr(i), &j);
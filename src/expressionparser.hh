@@ -43,6 +43,14 @@ class BooleanExpression {
 	bool eval(const sip_t *sip) throw(FlexisipException);
 #endif
 	virtual bool eval(const SipAttributes *args) = 0;
+	enum Outcome { AlwaysFalse, AlwaysTrue, Depends };
+	/*
+	 * Value of the expression for every request of a method, or every response when isRequest is false, as far as it
+	 * can be told without the message. An empty method stands for the methods without a name known in advance.
+	 */
+	virtual Outcome evalFor(bool isRequest, const std::string &method) const {
+		return Depends;
+	}
 	virtual ~BooleanExpression();
 	static std::shared_ptr<BooleanExpression> parse(const std::string &str);
 	long ptr();
@@ -18,6 +18,7 @@
 
 #include "forkcallcontext.hh"
 #include "common.hh"
+#include "responsehistory.hh"
 #include <algorithm>
 #include <sofia-sip/sip_status.h>
 
@@ -29,7 +30,7 @@ template <typename T> static bool contains(const list<T> &l, T value) {
 
 ForkCallContext::ForkCallContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event,
 								 shared_ptr<ForkContextConfig> cfg, ForkContextListener *listener)
-	: ForkContext(agent, event, cfg, listener), mShortTimer(NULL), mPushTimer(NULL), mCancelled(false) {
+	: ForkContext(agent, event, cfg, listener), mCancelled(false) {
 	LOGD("New ForkCallContext %p", this);
 	mLog = event->getEventLog<CallLog>();
 	mActivePushes = 0;
@@ -37,14 +38,84 @@ ForkCallContext::ForkCallContext(Agent *agent, const std::shared_ptr<RequestSipE
 
 ForkCallContext::~ForkCallContext() {
 	LOGD("Destroy ForkCallContext %p", this);
-	if (mShortTimer) {
-		su_timer_destroy(mShortTimer);
-		mShortTimer = NULL;
-	}
-	if (mPushTimer) {
-		su_timer_destroy(mPushTimer);
-		mPushTimer = NULL;
+}
+
+void CallBranchInfo::clear() {
+	mUnresponsiveTimer.reset();
+	BranchInfo::clear();
+}
+
+shared_ptr<BranchInfo> ForkCallContext::createBranchInfo() {
+	return make_shared<CallBranchInfo>(shared_from_this());
+}
+
+void ForkCallContext::onNewBranch(const shared_ptr<BranchInfo> &br) {
+	ResponseHistory *history = historyOf(br);
+	if (!history || !history->isUnresponsive(*br->mContact))
+		return;
+	// a device that rang before is given twice its usual delay, when shorter
+	int timeout = mCfg->mUnresponsiveTimeout;
+	chrono::milliseconds delay = history->getRingingDelay(*br->mContact);
+	if (delay.count() > 0)
+		timeout = min(timeout, (int)chrono::duration_cast<chrono::seconds>(delay * 2).count() + 1);
+	weak_ptr<BranchInfo> wbr(br);
+	static_pointer_cast<CallBranchInfo>(br)->mUnresponsiveTimer =
+		mAgent->getTimers()->schedule(timeout, [this, wbr]() { onUnresponsiveTimer(wbr); });
+}
+
+ResponseHistory *ForkCallContext::historyOf(const shared_ptr<BranchInfo> &br) const {
+	// aliases are not devices
+	if (!mCfg->mResponseHistory || !br->mContact || br->mContact->mAlias)
+		return NULL;
+	return mCfg->mResponseHistory.get();
+}
+
+void ForkCallContext::reportResponse(const shared_ptr<BranchInfo> &br) {
+	auto cbr = static_pointer_cast<CallBranchInfo>(br);
+	ResponseHistory *history = historyOf(br);
+	if (!history || cbr->mReported)
+		return;
+	int code = br->getStatus();
+	if (code == 408 || code == 503) {
+		// sent by sofia on timeouts and i/o errors
+		history->onUnanswered(*br->mContact);
+	} else if (code >= 180) {
+		auto delay = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - cbr->mStart);
+		history->onAnswered(*br->mContact, delay);
+	} else {
+		return;
 	}
+	cbr->mReported = true;
+}
+
+void ForkCallContext::reportRemoval(const shared_ptr<BranchInfo> &br) {
+	auto cbr = static_pointer_cast<CallBranchInfo>(br);
+	ResponseHistory *history = historyOf(br);
+	if (!history || cbr->mReported)
+		return;
+	cbr->mReported = true;
+	// a call given up early, or answered elsewhere before the device could ring, tells nothing about it
+	if (br->getStatus() < 180 &&
+		chrono::steady_clock::now() - cbr->mStart >= chrono::seconds(mCfg->mUnresponsiveTimeout))
+		history->onUnanswered(*br->mContact);
+}
+
+void ForkCallContext::onUnresponsiveTimer(const weak_ptr<BranchInfo> &wbr) {
+	shared_ptr<BranchInfo> br = wbr.lock();
+	if (!br || !br->mTransaction || br->getStatus() >= 180)
+		return;
+	const auto &branches = getBranches();
+	bool othersPending = any_of(branches.begin(), branches.end(), [&br](const shared_ptr<BranchInfo> &other) {
+		return other != br && other->getStatus() < 200;
+	});
+	if (!othersPending)
+		return; // left to the usual timeouts, being the last one that may answer
+	LOGD("ForkCallContext [%p]: giving up on unresponsive device %s", this, br->mUid.c_str());
+	auto cbr = static_pointer_cast<CallBranchInfo>(br);
+	cbr->mReported = true;
+	historyOf(br)->onUnanswered(*br->mContact);
+	// the branch stays, until the device or sofia answers the CANCEL
+	br->mTransaction->cancel();
 }
 
 void ForkCallContext::onCancel(const std::shared_ptr<RequestSipEvent> &ev) {
@@ -59,6 +130,7 @@ void ForkCallContext::cancelOthers(const shared_ptr<BranchInfo> &br, sip_t *rece
 	for (auto it = branches.begin(); it != branches.end(); ++it) {
 		shared_ptr<BranchInfo> brit = *it;
 		if (brit != br) {
+			reportRemoval(brit);
 			shared_ptr<OutgoingTransaction> tr = brit->mTransaction;
 			if (brit->getStatus() < 200 && tr) {
 				if(received_cancel && received_cancel->sip_reason) {
@@ -78,6 +150,7 @@ void ForkCallContext::cancelOthersWithStatus(const shared_ptr<BranchInfo> &br, F
 	for (auto it = branches.begin(); it != branches.end(); ++it) {
 		shared_ptr<BranchInfo> brit = *it;
 		if (brit != br) {
+			reportRemoval(brit);
 			shared_ptr<OutgoingTransaction> tr = brit->mTransaction;
 			if (tr && brit->getStatus() < 200 ){
 				if(status == FlexisipForkAcceptedElsewhere) {
@@ -110,6 +183,7 @@ void ForkCallContext::onResponse(const shared_ptr<BranchInfo> &br, const shared_
 	sip_t *sip = ms->getSip();
 	int code = sip->sip_status->st_status;
 
+	reportResponse(br);
 	if (code >= 300) {
 		/*in fork-late mode, we must not consider that 503 and 408 resonse codes (which are send by sofia in case of i/o
 		 * error or timeouts) are branches that are answered)
@@ -121,9 +195,7 @@ void ForkCallContext::onResponse(const shared_ptr<BranchInfo> &br, const shared_
 			return;
 		}
 		if (isUrgent(code, getUrgentCodes()) && mShortTimer == NULL) {
-			mShortTimer = su_timer_create(su_root_task(mAgent->getRoot()), 0);
-			su_timer_set_interval(mShortTimer, &ForkCallContext::sOnShortTimer, this,
-								  (su_duration_t)mCfg->mUrgentTimeout * 1000);
+			mShortTimer = mAgent->getTimers()->schedule(mCfg->mUrgentTimeout, [this]() { onShortTimer(); });
 			return;
 		}
 		if (code >= 600) {
@@ -155,12 +227,9 @@ void ForkCallContext::sendRinging() {
 				const char *totag = nta_agent_newtag(msgsip->getHome(), "%s", mAgent->getSofiaAgent());
 				sip_to_tag(msgsip->getHome(), msgsip->getSip()->sip_to, totag);
 			}
-			if (mPushTimer)
-				su_timer_destroy(mPushTimer), mPushTimer = NULL;
+			mPushTimer.reset();
 			if (mCfg->mPushResponseTimeout > 0) {
-				mPushTimer = su_timer_create(su_root_task(mAgent->getRoot()), 0);
-				su_timer_set_interval(mPushTimer, &ForkCallContext::sOnPushTimer, this,
-									  (su_duration_t)mCfg->mPushResponseTimeout * 1000);
+				mPushTimer = mAgent->getTimers()->schedule(mCfg->mPushResponseTimeout, [this]() { onPushTimer(); });
 			}
 			forwardResponse(ev);
 		}
@@ -201,9 +270,7 @@ bool ForkCallContext::isRingingSomewhere()const{
 
 void ForkCallContext::onShortTimer() {
 	LOGD("ForkCallContext [%p]: time to send urgent replies", this);
-	/*first stop the timer, it has to be one shot*/
-	su_timer_destroy(mShortTimer);
-	mShortTimer = NULL;
+	mShortTimer.reset();
 
 	if (isRingingSomewhere())
 		return; /*it's ringing somewhere*/
@@ -229,22 +296,11 @@ void ForkCallContext::onLateTimeout() {
 	cancelOthers(shared_ptr<BranchInfo>(), NULL);
 }
 
-void ForkCallContext::sOnShortTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
-	ForkCallContext *zis = static_cast<ForkCallContext *>(arg);
-	zis->onShortTimer();
-}
-
 void ForkCallContext::onPushTimer() {
 	if (!isCompleted() && getLastResponseCode() < 180) {
 		SLOGD << "ForkCallContext " << this << " push timer : no uac response";
 	}
-	su_timer_destroy(mPushTimer);
-	mPushTimer = NULL;
-}
-
-void ForkCallContext::sOnPushTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
-	ForkCallContext *zis = static_cast<ForkCallContext *>(arg);
-	zis->onPushTimer();
+	mPushTimer.reset();
 }
 void ForkCallContext::onPushInitiated(const string &key) {
 	++mActivePushes;
@@ -23,14 +23,26 @@
 #include "event.hh"
 #include "transaction.hh"
 #include "forkcontext.hh"
+#include <chrono>
 #include <list>
 
 enum FlexisipForkStatus {FlexisipForkAcceptedElsewhere, FlexisipForkDeclineElsewhere, FlexisipForkStandard};
 
+class CallBranchInfo : public BranchInfo {
+  public:
+	CallBranchInfo(std::shared_ptr<ForkContext> ctx)
+		: BranchInfo(ctx), mStart(std::chrono::steady_clock::now()), mReported(false) {
+	}
+	virtual void clear();
+	std::chrono::steady_clock::time_point mStart;
+	std::shared_ptr<TimerService::Timer> mUnresponsiveTimer; // gives up on a device that stopped answering the calls
+	bool mReported; // whether the outcome was added to the response history
+};
+
 class ForkCallContext : public ForkContext {
   private:
-	su_timer_t *mShortTimer; // optionaly used to send retryable responses
-	su_timer_t *mPushTimer; // used to track push responses
+	std::shared_ptr<TimerService::Timer> mShortTimer; // optionaly used to send retryable responses
+	std::shared_ptr<TimerService::Timer> mPushTimer; // used to track push responses
 	std::shared_ptr<CallLog> mLog;
 	bool mCancelled;
 
@@ -47,6 +59,8 @@ class ForkCallContext : public ForkContext {
 	virtual void onResponse(const std::shared_ptr<BranchInfo> &br, const std::shared_ptr<ResponseSipEvent> &event);
 	virtual bool onNewRegister(const url_t *url, const std::string &uid);
 	virtual void onCancel(const std::shared_ptr<RequestSipEvent> &ev);
+	virtual std::shared_ptr<BranchInfo> createBranchInfo();
+	virtual void onNewBranch(const std::shared_ptr<BranchInfo> &br);
 
   private:
 	bool isRingingSomewhere()const;
@@ -57,8 +71,10 @@ class ForkCallContext : public ForkContext {
 	void cancelOthers(const std::shared_ptr<BranchInfo> &br, sip_t* received_cancel);
 	void cancelOthersWithStatus(const std::shared_ptr<BranchInfo> &br, FlexisipForkStatus status);
 	void logResponse(const std::shared_ptr<ResponseSipEvent> &ev);
-	static void sOnShortTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
-	static void sOnPushTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onUnresponsiveTimer(const std::weak_ptr<BranchInfo> &br);
+	ResponseHistory *historyOf(const std::shared_ptr<BranchInfo> &br) const;
+	void reportResponse(const std::shared_ptr<BranchInfo> &br);
+	void reportRemoval(const std::shared_ptr<BranchInfo> &br);
 	int mActivePushes;
 	static const int sUrgentCodesWithout603[];
 };
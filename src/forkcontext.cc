@@ -18,6 +18,7 @@
 
 #include "forkcontext.hh"
 #include "registrardb.hh"
+#include "tracing.hh"
 #include <sofia-sip/sip_status.h>
 using namespace std;
 
@@ -27,34 +28,39 @@ const int ForkContext::sAllCodesUrgent[] = {-1, 0};
 
 ForkContextConfig::ForkContextConfig()
 	: mDeliveryTimeout(0), mUrgentTimeout(5), mForkLate(false), mTreatAllErrorsAsUrgent(false),
-	  mForkNoGlobalDecline(false), mTreatDeclineAsUrgent(false), mRemoveToTag(false) {
+	  mForkNoGlobalDecline(false), mTreatDeclineAsUrgent(false), mRemoveToTag(false), mUnresponsiveTimeout(5) {
 }
 
 ForkContextListener::~ForkContextListener() {
 }
 
-void ForkContext::__timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
-	(static_cast<ForkContext *>(arg))->processLateTimeout();
+bool ForkContextListener::onForkContextDormant(shared_ptr<ForkContext> ctx) {
+	return false;
 }
 
-void ForkContext::sOnFinished(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
-	(static_cast<ForkContext *>(arg))->onFinished();
+void ForkContextListener::onForkBranchAnswered(shared_ptr<ForkContext> ctx, const string &uid) {
 }
 
 ForkContext::ForkContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event, shared_ptr<ForkContextConfig> cfg,
 						 ForkContextListener *listener)
 	: mListener(listener), mAgent(agent),
 	  mEvent(make_shared<RequestSipEvent>(event)), // Is this deep copy really necessary ?
-	  mCfg(cfg), mLateTimer(NULL), mFinishTimer(NULL) {
-	init();
+	  mCfg(cfg) {
+	mIncoming = mEvent->createIncomingTransaction();
+	init(mCfg->mDeliveryTimeout);
+}
+
+ForkContext::ForkContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event, shared_ptr<ForkContextConfig> cfg,
+						 ForkContextListener *listener, int lateTimeout)
+	: mListener(listener), mAgent(agent), mEvent(make_shared<RequestSipEvent>(event)), mCfg(cfg) {
+	init(lateTimeout);
 }
 
 void ForkContext::onLateTimeout() {
 }
 
 void ForkContext::processLateTimeout() {
-	su_timer_destroy(mLateTimer);
-	mLateTimer = NULL;
+	mLateTimer.reset();
 	onLateTimeout();
 	setFinished();
 }
@@ -193,14 +199,11 @@ bool ForkContext::onNewRegister(const url_t *url, const string &uid) {
 	return true;
 }
 
-void ForkContext::init() {
-	mIncoming = mEvent->createIncomingTransaction();
+void ForkContext::init(int lateTimeout) {
 	if (mCfg->mForkLate && mLateTimer == NULL) {
 		/*this timer is for when outgoing transaction all die prematuraly, we still need to wait that late register
 		 * arrive.*/
-		mLateTimer = su_timer_create(su_root_task(mAgent->getRoot()), 0);
-		su_timer_set_interval(mLateTimer, &ForkContext::__timer_callback, this,
-							  (su_duration_t)mCfg->mDeliveryTimeout * (su_duration_t)1000);
+		mLateTimer = mAgent->getTimers()->schedule(lateTimeout, [this]() { processLateTimeout(); });
 	}
 }
 
@@ -221,6 +224,8 @@ void ForkContext::addBranch(const shared_ptr<RequestSipEvent> &ev, const shared_
 	br->mUid = contact->mUniqueId;
 	br->mContact = contact;
 	ot->setProperty("BranchInfo", br);
+	if (ev->getMsgSip()->getTrace())
+		ev->getMsgSip()->getTrace()->addEvent("fork branch " + contact->mUniqueId);
 	onNewBranch(br);
 	mBranches.push_back(br);
 	LOGD("ForkContext [%p] new fork branch [%p]", this, br.get());
@@ -257,8 +262,13 @@ bool ForkContext::processResponse(const shared_ptr<ResponseSipEvent> &ev) {
 		if (binfo) {
 			auto copyEv = make_shared<ResponseSipEvent>(ev); // make a copy
 			copyEv->suspendProcessing();
+			binfo->mLastStatus = copyEv->getMsgSip()->getSip()->sip_status->st_status;
 			binfo->mLastResponse = copyEv;
 			binfo->mForkCtx->onResponse(binfo, copyEv);
+			if (binfo->mLastResponse == copyEv && (!copyEv->isSuspended() || binfo->mLastStatus < 200)) {
+				// forwarded, or provisional and never chosen as best response: no need to keep more than its status
+				binfo->mLastResponse.reset();
+			}
 			// the event may go through but it will not be sent*/
 			ev->setIncomingAgent(shared_ptr<IncomingAgent>());
 			if (!copyEv->isSuspended()) {
@@ -281,13 +291,10 @@ const shared_ptr<RequestSipEvent> &ForkContext::getEvent() {
 }
 
 ForkContext::~ForkContext() {
-	if (mLateTimer)
-		su_timer_destroy(mLateTimer);
 }
 
 void ForkContext::onFinished() {
-	su_timer_destroy(mFinishTimer);
-	mFinishTimer = NULL;
+	mFinishTimer.reset();
 	// force references to be loosed immediately, to avoid circular dependencies.
 	mEvent.reset();
 	mIncoming.reset();
@@ -297,18 +304,21 @@ void ForkContext::onFinished() {
 	mSelf.reset(); // this must be the last thing to do
 }
 
+void ForkContext::setDormant() {
+	if (mFinishTimer)
+		return;
+	if (mListener->onForkContextDormant(shared_from_this()))
+		setFinished();
+}
+
 void ForkContext::setFinished() {
 	if (mFinishTimer) {
 		/*already finishing, ignore*/
 		return;
 	}
-	if (mLateTimer) {
-		su_timer_destroy(mLateTimer);
-		mLateTimer = NULL;
-	}
+	mLateTimer.reset();
 	mSelf = shared_from_this(); // to prevent destruction until finishTimer arrives
-	mFinishTimer = su_timer_create(su_root_task(mAgent->getRoot()), 0);
-	su_timer_set_interval(mFinishTimer, &ForkContext::sOnFinished, this, (su_duration_t)0);
+	mFinishTimer = mAgent->getTimers()->defer([this]() { onFinished(); });
 }
 
 bool ForkContext::shouldFinish() {
@@ -337,17 +347,21 @@ std::shared_ptr<BranchInfo> ForkContext::createBranchInfo() {
 // retained previously or not*/
 std::shared_ptr<ResponseSipEvent> ForkContext::forwardResponse(const std::shared_ptr<BranchInfo> &br) {
 	if (br->mLastResponse) {
+		shared_ptr<ResponseSipEvent> ev = br->mLastResponse;
+		br->mLastResponse.reset();
 		if (mIncoming) {
-			int code = br->mLastResponse->getMsgSip()->getSip()->sip_status->st_status;
-			forwardResponse(br->mLastResponse);
+			int code = ev->getMsgSip()->getSip()->sip_status->st_status;
+			forwardResponse(ev);
 			if (code >= 200) {
 				br->mTransaction.reset();
 			}
-			return br->mLastResponse;
+			return ev;
 		} else
-			br->mLastResponse->setIncomingAgent(shared_ptr<IncomingAgent>());
-	} else {
+			ev->setIncomingAgent(shared_ptr<IncomingAgent>());
+	} else if (br->getStatus() == 0) {
 		LOGE("ForkContext::forwardResponse(): no response received on this branch");
+	} else {
+		LOGD("ForkContext::forwardResponse(): response %i of this branch already forwarded", br->getStatus());
 	}
 	return std::shared_ptr<ResponseSipEvent>();
 }
@@ -23,6 +23,9 @@
 #include "event.hh"
 #include "transaction.hh"
 #include "registrardb.hh"
+#include "utils/memorystats.hh"
+
+class ResponseHistory;
 
 class ForkContextConfig {
   public:
@@ -35,6 +38,8 @@ class ForkContextConfig {
 	bool mForkNoGlobalDecline;
 	bool mTreatDeclineAsUrgent; /*treat 603 declined as a urgent response, only useful is mForkNoGlobalDecline==true*/
 	bool mRemoveToTag;			/*workaround buggy OVH which wrongly terminates wrong call*/
+	std::shared_ptr<ResponseHistory> mResponseHistory; /*how the devices answered the calls, null if not tracked*/
+	int mUnresponsiveTimeout; /*time given to ring to the devices that stopped answering the calls*/
 };
 
 class ForkContext;
@@ -43,35 +48,40 @@ class ForkContextListener {
   public:
 	virtual ~ForkContextListener();
 	virtual void onForkContextFinished(std::shared_ptr<ForkContext> ctx) = 0;
+	// Offered a fork that only waits for late registrations. Returns true if the listener stored it elsewhere, the
+	// fork is then finished.
+	virtual bool onForkContextDormant(std::shared_ptr<ForkContext> ctx);
+	// A branch of a message fork to the instance uid got its final response.
+	virtual void onForkBranchAnswered(std::shared_ptr<ForkContext> ctx, const std::string &uid);
 };
 
 class BranchInfo {
   public:
-	BranchInfo(std::shared_ptr<ForkContext> ctx) : mForkCtx(ctx) {
+	BranchInfo(std::shared_ptr<ForkContext> ctx) : mForkCtx(ctx), mLastStatus(0) {
 	}
 	virtual ~BranchInfo();
 	virtual void clear();
 	int getStatus() {
-		if (mLastResponse)
-			return mLastResponse->getMsgSip()->getSip()->sip_status->st_status;
-		return 0;
+		return mLastStatus;
 	}
 	std::shared_ptr<ForkContext> mForkCtx;
 	std::string mUid;
 	std::shared_ptr<RequestSipEvent> mRequest;
 	std::shared_ptr<OutgoingTransaction> mTransaction;
+	// The status of the last response received on this branch.
+	int mLastStatus;
+	// The last response, only while it is retained: once forwarded, or if provisional, only its status is kept.
 	std::shared_ptr<ResponseSipEvent> mLastResponse;
 	std::shared_ptr<ExtendedContact> mContact;
 };
 
-class ForkContext : public std::enable_shared_from_this<ForkContext> {
+class ForkContext : public std::enable_shared_from_this<ForkContext>,
+					public CountedObject<ObjectCounter::ForkContexts> {
   private:
-	static void __timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
-	static void sOnFinished(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
 	ForkContextListener *mListener;
 	std::list<std::shared_ptr<BranchInfo>> mBranches;
 	std::string mKey;
-	void init();
+	void init(int lateTimeout);
 	void processLateTimeout();
 	std::shared_ptr<BranchInfo> _findBestBranch(const int urgentReplies[], bool ignore503And408);
 
@@ -82,8 +92,8 @@ class ForkContext : public std::enable_shared_from_this<ForkContext> {
 	std::shared_ptr<IncomingTransaction> mIncoming;
 	std::shared_ptr<ForkContextConfig> mCfg;
 	std::shared_ptr<ForkContext> mSelf;
-	su_timer_t *mLateTimer;
-	su_timer_t *mFinishTimer;
+	std::shared_ptr<TimerService::Timer> mLateTimer;
+	std::shared_ptr<TimerService::Timer> mFinishTimer;
 	// Mark the fork process as terminated. The real destruction is performed asynchrously, in next main loop iteration.
 	void setFinished();
 	// Used by derived class to allocate a derived type of BranchInfo if necessary.
@@ -101,6 +111,8 @@ class ForkContext : public std::enable_shared_from_this<ForkContext> {
 	// Notifies the destruction of the fork context. Implementors should use it to perform their unitialization, but
 	// shall never forget to upcall to the parent class !*/
 	virtual void onFinished();
+	// Notifies the listener that the fork now only waits for late registrations, so that it may store it until then.
+	void setDormant();
 	// Request the forwarding the last response from a given branch
 	std::shared_ptr<ResponseSipEvent> forwardResponse(const std::shared_ptr<BranchInfo> &br);
 	// Request the forwarding of a response supplied in argument.
@@ -121,6 +133,10 @@ class ForkContext : public std::enable_shared_from_this<ForkContext> {
   public:
 	ForkContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event, std::shared_ptr<ForkContextConfig> cfg,
 				ForkContextListener *listener);
+	// Context of a request that was already answered, such as one restored from a store: it has no incoming
+	// transaction and waits for late registrations during lateTimeout seconds.
+	ForkContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event, std::shared_ptr<ForkContextConfig> cfg,
+				ForkContextListener *listener, int lateTimeout);
 	virtual ~ForkContext();
 	// Called by the Router module to create a new branch.
 	void addBranch(const std::shared_ptr<RequestSipEvent> &ev, const std::shared_ptr<ExtendedContact> &contact);
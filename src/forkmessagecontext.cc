@@ -41,19 +41,23 @@ ForkMessageContext::ForkMessageContext(Agent *agent, const std::shared_ptr<Reque
 									   shared_ptr<ForkContextConfig> cfg, ForkContextListener *listener)
 	: ForkContext(agent, event, cfg, listener) {
 	LOGD("New ForkMessageContext %p", this);
-	mAcceptanceTimer = NULL;
 	// start the acceptance timer immediately
 	if (mCfg->mForkLate && mCfg->mDeliveryTimeout > 30) {
-		mAcceptanceTimer = su_timer_create(su_root_task(mAgent->getRoot()), 0);
-		su_timer_set_interval(mAcceptanceTimer, &ForkMessageContext::sOnAcceptanceTimer, this,
-							  (su_duration_t)mCfg->mUrgentTimeout * 1000);
+		mAcceptanceTimer = mAgent->getTimers()->schedule(mCfg->mUrgentTimeout, [this]() { onAcceptanceTimer(); });
 	}
 	mDeliveredCount = 0;
+	mExpireAt = getCurrentTime() + mCfg->mDeliveryTimeout;
+}
+
+ForkMessageContext::ForkMessageContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event,
+									   shared_ptr<ForkContextConfig> cfg, ForkContextListener *listener,
+									   time_t expireAt, int deliveredCount, const list<string> &doneUids)
+	: ForkContext(agent, event, cfg, listener, (int)max<time_t>(expireAt - getCurrentTime(), 1)),
+	  mDeliveredCount(deliveredCount), mExpireAt(expireAt), mDoneUids(doneUids) {
+	LOGD("New ForkMessageContext %p restored, %zu instances already done", this, mDoneUids.size());
 }
 
 ForkMessageContext::~ForkMessageContext() {
-	if (mAcceptanceTimer)
-		su_timer_destroy(mAcceptanceTimer);
 	LOGD("Destroy ForkMessageContext %p", this);
 }
 
@@ -89,6 +93,28 @@ void ForkMessageContext::checkFinished() {
 	}
 }
 
+/* Once accepted, and while no branch awaits a response, the fork only waits for late registrations. */
+void ForkMessageContext::checkDormant() {
+	if (mIncoming != NULL || !mCfg->mForkLate || mAcceptanceTimer)
+		return;
+	auto branches = getBranches();
+	for (auto it = branches.begin(); it != branches.end(); ++it) {
+		if ((*it)->getStatus() < 200)
+			return;
+	}
+	setDormant();
+}
+
+list<string> ForkMessageContext::getDoneUids() {
+	list<string> uids(mDoneUids);
+	auto branches = getBranches();
+	for (auto it = branches.begin(); it != branches.end(); ++it) {
+		if (!(*it)->mUid.empty() && !needsDelivery((*it)->getStatus()))
+			uids.push_back((*it)->mUid);
+	}
+	return uids;
+}
+
 void ForkMessageContext::logDeliveredToUserEvent(const std::shared_ptr<BranchInfo> &br,
 										  const shared_ptr<ResponseSipEvent> &event) {
 	sip_t *sip = event->getMsgSip()->getSip();
@@ -111,8 +137,7 @@ void ForkMessageContext::onResponse(const std::shared_ptr<BranchInfo> &br, const
 			if (mAcceptanceTimer) {
 				if (mIncoming)
 					logReceivedFromUserEvent(event); /*in the sender's log will appear the status code from the receiver*/
-				su_timer_destroy(mAcceptanceTimer);
-				mAcceptanceTimer = NULL;
+				mAcceptanceTimer.reset();
 			}
 		}
 		logDeliveredToUserEvent(br, event);
@@ -125,6 +150,9 @@ void ForkMessageContext::onResponse(const std::shared_ptr<BranchInfo> &br, const
 		logDeliveredToUserEvent(br, event);
 	}
 	checkFinished();
+	checkDormant();
+	if (code >= 200 && !br->mUid.empty())
+		mListener->onForkBranchAnswered(shared_from_this(), br->mUid);
 }
 
 void ForkMessageContext::logReceivedFromUserEvent(const shared_ptr<ResponseSipEvent> &ev) {
@@ -152,12 +180,8 @@ void ForkMessageContext::acceptMessage() {
 void ForkMessageContext::onAcceptanceTimer() {
 	LOGD("ForkMessageContext::onAcceptanceTimer()");
 	acceptMessage();
-	su_timer_destroy(mAcceptanceTimer);
-	mAcceptanceTimer = NULL;
-}
-
-void ForkMessageContext::sOnAcceptanceTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
-	static_cast<ForkMessageContext *>(arg)->onAcceptanceTimer();
+	mAcceptanceTimer.reset();
+	checkDormant();
 }
 
 bool isMessageARCSFileTransferMessage(shared_ptr<RequestSipEvent> &ev) {
@@ -246,6 +270,10 @@ void ForkMessageContext::onNewBranch(const shared_ptr<BranchInfo> &br) {
 }
 
 bool ForkMessageContext::onNewRegister(const url_t *dest, const string &uid) {
+	if (find(mDoneUids.begin(), mDoneUids.end(), uid) != mDoneUids.end()) {
+		LOGD("ForkMessageContext::onNewRegister(): this client already received or declined the message.");
+		return false;
+	}
 	bool already_have_transaction = !ForkContext::onNewRegister(dest, uid);
 	if (already_have_transaction)
 		return false;
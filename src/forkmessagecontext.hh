@@ -26,19 +26,36 @@
 #include <list>
 #include <map>
 
-class ForkMessageContext : public ForkContext {
+class ForkMessageContext : public ForkContext, public CountedObject<ObjectCounter::ForkMessageContexts> {
   private:
-	su_timer_t
-		*mAcceptanceTimer; /*timeout after which an answer must be sent through the incoming transaction even if no
-							  success response was received on the outgoing transactions*/
+	std::shared_ptr<TimerService::Timer>
+		mAcceptanceTimer; /*timeout after which an answer must be sent through the incoming transaction even if no
+							 success response was received on the outgoing transactions*/
 	static const int sAcceptanceTimeout = 20; /* this must be less than the transaction time (32 seconds)*/
 	int mDeliveredCount;
+	time_t mExpireAt;
+	std::list<std::string> mDoneUids; /* instances which received or declined the message before it was stored */
 
   public:
 	ForkMessageContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event,
 					   std::shared_ptr<ForkContextConfig> cfg, ForkContextListener *listener);
+	/* Fork of a message restored from a ForkMessageStore, already accepted. */
+	ForkMessageContext(Agent *agent, const std::shared_ptr<RequestSipEvent> &event,
+					   std::shared_ptr<ForkContextConfig> cfg, ForkContextListener *listener, time_t expireAt,
+					   int deliveredCount, const std::list<std::string> &doneUids);
 	virtual ~ForkMessageContext();
 
+	time_t getExpireAt() const {
+		return mExpireAt;
+	}
+	int getDeliveredCount() const {
+		return mDeliveredCount;
+	}
+	/* Instances which must not receive the message again. */
+	std::list<std::string> getDoneUids();
+	/* Offers the fork to the listener if it only waits for late registrations. */
+	void checkDormant();
+
   protected:
 	virtual bool onNewRegister(const url_t *url, const std::string &uid);
 	virtual void onNewBranch(const std::shared_ptr<BranchInfo> &br);
@@ -46,7 +63,6 @@ class ForkMessageContext : public ForkContext {
 	virtual bool shouldFinish();
 
   private:
-	static void sOnAcceptanceTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
 	void acceptMessage();
 	void onAcceptanceTimer();
 	void logReceivedFromUserEvent(const std::shared_ptr<ResponseSipEvent> &ev);
@@ -0,0 +1,234 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "forkmessagestore.hh"
+#include "log/logmanager.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * File format: a header of "name: value" lines up to an empty line, then the request as received.
+ *   flexisip-fork-message: 1
+ *   expire: <unix time>
+ *   delivered: <count>
+ *   key: <routing key> <uri>      (one per key)
+ *   done: <unique id>             (one per instance)
+ */
+static const char *sMagic = "flexisip-fork-message: 1";
+static const char *sSuffix = ".msg";
+
+ForkMessageStore::ForkMessageStore(const string &dir) : mDir(dir), mCounter(0) {
+}
+
+string ForkMessageStore::path(const string &id) const {
+	return mDir + "/" + id + sSuffix;
+}
+
+bool ForkMessageStore::parse(istream &in, Message &message, bool headerOnly) {
+	string line;
+	if (!getline(in, line) || line != sMagic)
+		return false;
+	while (getline(in, line) && !line.empty()) {
+		size_t colon = line.find(": ");
+		if (colon == string::npos)
+			return false;
+		string name = line.substr(0, colon);
+		string value = line.substr(colon + 2);
+		if (name == "expire") {
+			message.expireAt = (time_t)strtoll(value.c_str(), NULL, 10);
+		} else if (name == "delivered") {
+			message.deliveredCount = atoi(value.c_str());
+		} else if (name == "key") {
+			size_t space = value.find(' ');
+			if (space == string::npos)
+				return false;
+			message.keys[value.substr(0, space)] = value.substr(space + 1);
+		} else if (name == "done") {
+			message.doneUids.push_back(value);
+		}
+	}
+	if (line.empty() && message.expireAt != 0 && !message.keys.empty()) {
+		if (!headerOnly)
+			message.request.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		return true;
+	}
+	return false;
+}
+
+void ForkMessageStore::index(const string &id, const Message &message) {
+	Entry &entry = mEntries[id];
+	entry.expireAt = message.expireAt;
+	for (const auto &key : message.keys) {
+		entry.keys.push_back(key.first);
+		Key &k = mKeys[key.first];
+		k.uri = key.second;
+		k.ids.insert(id);
+	}
+}
+
+bool ForkMessageStore::load() {
+	mEntries.clear();
+	mKeys.clear();
+	if (mkdir(mDir.c_str(), 0700) == -1 && errno != EEXIST) {
+		LOGE("Cannot create message store directory %s: %s", mDir.c_str(), strerror(errno));
+		return false;
+	}
+	DIR *dirp = opendir(mDir.c_str());
+	if (dirp == NULL) {
+		LOGE("Cannot open message store directory %s: %s", mDir.c_str(), strerror(errno));
+		return false;
+	}
+	size_t suffixLen = strlen(sSuffix);
+	struct dirent *dirent;
+	while ((dirent = readdir(dirp)) != NULL) {
+		string name(dirent->d_name);
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+			// left by a crash while it was written
+			unlink((mDir + "/" + name).c_str());
+			continue;
+		}
+		if (name.size() <= suffixLen || name.compare(name.size() - suffixLen, suffixLen, sSuffix) != 0)
+			continue;
+		string id = name.substr(0, name.size() - suffixLen);
+		ifstream in(path(id));
+		Message message;
+		if (!parse(in, message, true)) {
+			LOGE("Invalid stored message %s, removed", path(id).c_str());
+			unlink(path(id).c_str());
+			continue;
+		}
+		index(id, message);
+	}
+	closedir(dirp);
+	LOGI("%zu messages waiting for late registrations loaded from %s", mEntries.size(), mDir.c_str());
+	return true;
+}
+
+string ForkMessageStore::add(const Message &message) {
+	ostringstream out;
+	out << sMagic << "\n";
+	out << "expire: " << (long long)message.expireAt << "\n";
+	out << "delivered: " << message.deliveredCount << "\n";
+	for (const auto &key : message.keys)
+		out << "key: " << key.first << " " << key.second << "\n";
+	for (const auto &uid : message.doneUids)
+		out << "done: " << uid << "\n";
+	out << "\n" << message.request;
+	string data = out.str();
+
+	char id[64];
+	snprintf(id, sizeof(id), "%llx-%x-%x", (unsigned long long)time(NULL), (unsigned int)getpid(), mCounter++);
+	// written aside then renamed, so that a crash never leaves a truncated message
+	string tmp = mDir + "/" + id + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		LOGE("Cannot create stored message %s: %s", tmp.c_str(), strerror(errno));
+		return string();
+	}
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t ret = write(fd, data.data() + written, data.size() - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += ret;
+	}
+	bool ok = written == data.size() && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path(id).c_str()) == -1) {
+		LOGE("Cannot write stored message %s: %s", path(id).c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return string();
+	}
+	index(id, message);
+	return id;
+}
+
+bool ForkMessageStore::read(const string &id, Message &message) const {
+	ifstream in(path(id), ios::in | ios::binary);
+	if (!in.is_open()) {
+		LOGE("Cannot open stored message %s: %s", path(id).c_str(), strerror(errno));
+		return false;
+	}
+	if (!parse(in, message, false)) {
+		LOGE("Invalid stored message %s", path(id).c_str());
+		return false;
+	}
+	return true;
+}
+
+list<string> ForkMessageStore::remove(const string &id) {
+	list<string> emptied;
+	auto it = mEntries.find(id);
+	if (it == mEntries.end())
+		return emptied;
+	if (unlink(path(id).c_str()) == -1 && errno != ENOENT)
+		LOGE("Cannot remove stored message %s: %s", path(id).c_str(), strerror(errno));
+	for (const auto &key : it->second.keys) {
+		auto k = mKeys.find(key);
+		if (k == mKeys.end())
+			continue;
+		k->second.ids.erase(id);
+		if (k->second.ids.empty()) {
+			mKeys.erase(k);
+			emptied.push_back(key);
+		}
+	}
+	mEntries.erase(it);
+	return emptied;
+}
+
+list<string> ForkMessageStore::purge(time_t now, size_t &purged) {
+	vector<string> expired;
+	for (const auto &entry : mEntries) {
+		if (entry.second.expireAt <= now)
+			expired.push_back(entry.first);
+	}
+	list<string> emptied;
+	for (const auto &id : expired)
+		emptied.splice(emptied.end(), remove(id));
+	purged = expired.size();
+	return emptied;
+}
+
+vector<string> ForkMessageStore::find(const string &key) const {
+	auto it = mKeys.find(key);
+	if (it == mKeys.end())
+		return vector<string>();
+	return vector<string>(it->second.ids.begin(), it->second.ids.end());
+}
+
+map<string, string> ForkMessageStore::getKeys() const {
+	map<string, string> keys;
+	for (const auto &key : mKeys)
+		keys[key.first] = key.second.uri;
+	return keys;
+}
@@ -0,0 +1,91 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef forkmessagestore_hh
+#define forkmessagestore_hh
+
+#include <ctime>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * On-disk store of the message forks that only wait for late registrations, one file per message holding the
+ * original request and what the fork has to remember of its branches.
+ * Only the routing keys and the expiration dates of the messages stay in memory. The files are written aside then
+ * renamed, so that a crash leaves either the former state or the new one, and the index is rebuilt from them at start.
+ */
+class ForkMessageStore {
+  public:
+	struct Message {
+		Message() : expireAt(0), deliveredCount(0) {
+		}
+		std::map<std::string, std::string> keys; // routing key -> uri to fetch on the registrations of the key
+		time_t expireAt;
+		int deliveredCount;
+		std::list<std::string> doneUids; // instances which already received or declined the message
+		std::string request;
+	};
+
+	ForkMessageStore(const std::string &dir);
+
+	/* Rebuilds the index from the files of the directory, false if it cannot be read. */
+	bool load();
+	/* Returns the id of the stored message, empty if it could not be written. */
+	std::string add(const Message &message);
+	bool read(const std::string &id, Message &message) const;
+	/* Removes a message and returns the keys on which no message is stored anymore. */
+	std::list<std::string> remove(const std::string &id);
+	/* Removes the messages expired at now, and returns the keys on which no message is stored anymore. */
+	std::list<std::string> purge(time_t now, size_t &purged);
+
+	/* Ids of the messages stored for a key. */
+	std::vector<std::string> find(const std::string &key) const;
+	bool contains(const std::string &key) const {
+		return mKeys.find(key) != mKeys.end();
+	}
+	/* Routing keys of the stored messages, with the uri to fetch on their registrations. */
+	std::map<std::string, std::string> getKeys() const;
+	size_t size() const {
+		return mEntries.size();
+	}
+
+  private:
+	struct Entry {
+		std::vector<std::string> keys;
+		time_t expireAt;
+	};
+	struct Key {
+		std::string uri;
+		std::set<std::string> ids;
+	};
+	std::string path(const std::string &id) const;
+	static bool parse(std::istream &in, Message &message, bool headerOnly);
+	void index(const std::string &id, const Message &message);
+
+	std::string mDir;
+	unsigned int mCounter;
+	std::unordered_map<std::string, Entry> mEntries;
+	std::unordered_map<std::string, Key> mKeys;
+};
+
+#endif /* forkmessagestore_hh */
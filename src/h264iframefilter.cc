@@ -22,46 +22,24 @@
 #define TYPE_IDR 5
 #define TYPE_SPS 7
 #define TYPE_PPS 8
-#define TYPE_FU_A 28   /*fragmented unit 0x1C*/
 #define TYPE_STAP_A 24 /*single time aggregation packet  0x18*/
 
-static inline uint8_t nal_header_get_type(const uint8_t *h) {
-	return (*h) & ((1 << 5) - 1);
-}
-
 H264IFrameFilter::H264IFrameFilter(int skipcount) : mSkipCount(skipcount), mLastIframeTimestamp(0), mIframeCount(0) {
 }
 
-bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
-	const uint8_t *p = data;
+bool H264IFrameFilter::keep(const RtpPacketInfo &info) {
 	bool ret = false;
 	bool isIFrame = false;
-	if (size < 16)
+	if (!info.isRtp())
 		return true; // not a RTP h264 packet probably
-	uint32_t ts = ntohl(((uint32_t *)p)[1]);
-	p += 12;
-	uint8_t ptype = nal_header_get_type(p);
-	switch (ptype) {
+	// the type of the fragmented unit for a FU-A
+	switch (info.nalType) {
 		case TYPE_IDR:
 			isIFrame = true;
 		case TYPE_PPS:
 		case TYPE_SPS:
 			ret = true;
 			break;
-		case TYPE_FU_A: {
-			// need to go deeper in the packet
-			p++;
-			switch (nal_header_get_type(p)) {
-				case TYPE_IDR:
-					isIFrame = true;
-				case TYPE_PPS:
-				case TYPE_SPS:
-					ret = true;
-					break;
-				default:
-					break;
-			}
-		} break;
 		case TYPE_STAP_A:
 			LOGW("H264 STAP-A packets not properly handled.");
 			ret = true; // anyway these are usually small NALs
@@ -70,9 +48,9 @@ bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sock
 			break;
 	}
 	if (isIFrame) {
-		if (mLastIframeTimestamp != ts || mIframeCount == 0) {
+		if (mLastIframeTimestamp != info.timestamp || mIframeCount == 0) {
 			LOGD("Seeing a new I-frame");
-			mLastIframeTimestamp = ts;
+			mLastIframeTimestamp = info.timestamp;
 			mIframeCount++;
 		}
 		if ((mIframeCount - 1) % mSkipCount != 0)
@@ -82,6 +60,22 @@ bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sock
 	return ret;
 }
 
+bool H264IFrameFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
+	return keep(RtpPacketInfo::decode(data, size));
+}
+
 bool H264IFrameFilter::onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
 	return true;
 }
+
+void H264IFrameFilter::onIncomingBatch(RelayPacketBatch &batch, const sockaddr *addr, socklen_t addrlen) {
+}
+
+void H264IFrameFilter::onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr,
+									   socklen_t addrlen) {
+	// the packets of the batch are in reception order, so that the I-frame counting is the same as packet per packet
+	for (int k = 0; k < batch.size(); ++k) {
+		if (selected[k] && !keep(batch.info(k)))
+			selected[k] = false;
+	}
+}
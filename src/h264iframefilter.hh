@@ -28,8 +28,11 @@ class H264IFrameFilter : public MediaFilter {
 	bool onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
 	/// Should return false if the packet output must not be sent.
 	bool onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
+	void onIncomingBatch(RelayPacketBatch &batch, const sockaddr *addr, socklen_t addrlen);
+	void onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr, socklen_t addrlen);
 
   private:
+	bool keep(const RtpPacketInfo &info);
 	int mSkipCount;
 	uint32_t mLastIframeTimestamp;
 	int mIframeCount;
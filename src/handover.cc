@@ -0,0 +1,212 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if defined(HAVE_CONFIG_H) && !defined(FLEXISIP_INCLUDED)
+#include "flexisip-config.h"
+#define FLEXISIP_INCLUDED
+#endif
+#include "handover.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <sofia-sip/nta.h>
+#include <sofia-sip/nta_tport.h>
+#include <sofia-sip/tport.h>
+
+#ifdef HAVE_TPORT_INHERIT_SOCKETS
+/* from patches/sofia/sofia_tport_handover.patch */
+extern "C" int tport_inherit_sockets(int const *fds, int n);
+extern "C" int tport_handover_sockets(tport_t *self, int *fds, int max);
+#endif
+
+using namespace std;
+
+static const char sRequest[] = "handover";
+static const int sMaxSockets = 64;
+
+static bool makeAddress(const string &path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		LOGE("Handover socket path %s is too long", path.c_str());
+		return false;
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	return true;
+}
+
+int Handover::takeOver(const string &path) {
+#ifdef HAVE_TPORT_INHERIT_SOCKETS
+	struct sockaddr_un addr;
+	if (!makeAddress(path, addr))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		// no process to replace, a plain start
+		close(fd);
+		return -1;
+	}
+	struct timeval timeout = {5, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (write(fd, sRequest, sizeof(sRequest)) != sizeof(sRequest)) {
+		close(fd);
+		return -1;
+	}
+
+	uint32_t count = 0;
+	struct iovec iov = {&count, sizeof(count)};
+	char control[CMSG_SPACE(sMaxSockets * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t received = recvmsg(fd, &msg, 0);
+	close(fd);
+	if (received != sizeof(count)) {
+		LOGE("No sockets handed over through %s: %s", path.c_str(), received < 0 ? strerror(errno) : "closed");
+		return -1;
+	}
+	int fds[sMaxSockets];
+	int n = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int carried = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < carried && n < sMaxSockets; ++i)
+			memcpy(&fds[n++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	}
+	tport_inherit_sockets(fds, n);
+	LOGN("Took over %i listening sockets through %s", n, path.c_str());
+	return n;
+#else
+	LOGW("handover-socket is ignored: sofia-sip lacks the sofia_tport_handover patch");
+	return -1;
+#endif
+}
+
+Handover::Handover(Agent *agent, const string &path, int drainTime, const function<void()> &onDrained)
+	: mAgent(agent), mPath(path), mDrainTime(max(0, drainTime)), mOnDrained(onDrained), mSocket(-1), mWaitIndex(0) {
+}
+
+Handover::~Handover() {
+	stopListening();
+}
+
+bool Handover::start() {
+#ifdef HAVE_TPORT_INHERIT_SOCKETS
+	// the transports are created: the sockets of the previous process they did not take are of no use
+	tport_inherit_sockets(NULL, 0);
+	struct sockaddr_un addr;
+	if (!makeAddress(mPath, addr))
+		return false;
+	// the previous process, if any, has given its sockets and no longer accepts
+	unlink(mPath.c_str());
+	mSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (mSocket == -1 || bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(mSocket, 1) == -1) {
+		LOGE("Cannot listen on handover socket %s: %s", mPath.c_str(), strerror(errno));
+		if (mSocket != -1)
+			close(mSocket);
+		mSocket = -1;
+		return false;
+	}
+	su_wait_create(&mWait, mSocket, SU_WAIT_ACCEPT);
+	mWaitIndex = su_root_register(mAgent->getRoot(), &mWait, &Handover::sOnAccept, this, su_pri_normal);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Handover::stopListening() {
+	if (mSocket == -1)
+		return;
+	su_root_deregister(mAgent->getRoot(), mWaitIndex);
+	close(mSocket);
+	mSocket = -1;
+}
+
+void Handover::sOnAccept(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	reinterpret_cast<Handover *>(arg)->onAccept();
+}
+
+void Handover::onAccept() {
+#ifdef HAVE_TPORT_INHERIT_SOCKETS
+	int fd = accept(mSocket, NULL, NULL);
+	if (fd == -1)
+		return;
+	// sent right after the connection by the new process
+	struct timeval timeout = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char request[sizeof(sRequest)];
+	if (read(fd, request, sizeof(request)) != sizeof(request) || memcmp(request, sRequest, sizeof(request)) != 0) {
+		close(fd);
+		return;
+	}
+
+	int fds[sMaxSockets];
+	int n = tport_handover_sockets(nta_agent_tports(mAgent->getSofiaAgent()), fds, sMaxSockets);
+	uint32_t count = n;
+	struct iovec iov = {&count, sizeof(count)};
+	char control[CMSG_SPACE(sMaxSockets * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n > 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+	}
+	if (sendmsg(fd, &msg, 0) != sizeof(count))
+		LOGE("Cannot hand the listening sockets over: %s", strerror(errno));
+	close(fd);
+	for (int i = 0; i < n; ++i)
+		close(fds[i]);
+
+	LOGN("Handed %i listening sockets over, draining", n);
+	stopListening();
+	mDrainStart = chrono::steady_clock::now();
+	checkDrained();
+#endif
+}
+
+void Handover::checkDrained() {
+	usize_t incoming = 0, outgoing = 0;
+	nta_agent_get_stats(mAgent->getSofiaAgent(), NTATAG_S_IRQ_HASH_USED_REF(incoming),
+						NTATAG_S_ORQ_HASH_USED_REF(outgoing), TAG_END());
+	auto elapsed = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - mDrainStart).count();
+	if ((incoming == 0 && outgoing == 0) || elapsed >= mDrainTime) {
+		LOGN("Drained after %lis, %zu server and %zu client transactions left", (long)elapsed, (size_t)incoming,
+			 (size_t)outgoing);
+		mDrainTimer.reset();
+		mOnDrained();
+		return;
+	}
+	mDrainTimer = mAgent->getTimers()->schedule(1, [this]() { checkDrained(); });
+}
@@ -0,0 +1,67 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef handover_hh
+#define handover_hh
+
+#include "agent.hh"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sofia-sip/su_wait.h>
+
+/*
+ * Hands the listening sockets of the transports over to the flexisip replacing this one, through the unix socket at
+ * handover-socket, so that an upgrade loses neither queued datagrams nor pending connections. The new process takes
+ * the sockets before creating its transports, which adopt them instead of binding. The old one stops reading them and
+ * drains: it keeps serving its connections and transactions until none is left or handover-drain-time elapses, then
+ * stops. The established connections and the relay sockets stay with the old process, which closes them on exit.
+ * Requires sofia-sip with the sofia_tport_handover patch.
+ */
+class Handover {
+  public:
+	/* Takes the sockets of the process listening at path, for the transports created afterwards. Returns their number,
+	 * -1 if no process listens at path. */
+	static int takeOver(const std::string &path);
+
+	Handover(Agent *agent, const std::string &path, int drainTime, const std::function<void()> &onDrained);
+	~Handover();
+	/* Listens at path for the process that will replace this one. */
+	bool start();
+
+  private:
+	static void sOnAccept(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	void onAccept();
+	void stopListening();
+	void checkDrained();
+
+	Agent *mAgent;
+	std::string mPath;
+	int mDrainTime;
+	std::function<void()> mOnDrained;
+	int mSocket;
+	su_wait_t mWait;
+	int mWaitIndex;
+	std::chrono::steady_clock::time_point mDrainStart;
+	std::shared_ptr<TimerService::Timer> mDrainTimer;
+};
+
+#endif
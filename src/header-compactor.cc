@@ -0,0 +1,140 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "header-compactor.hh"
+#include "agent.hh"
+#include "log/logmanager.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sofia-sip/msg_header.h>
+
+using namespace std;
+
+static const char *sTransportNames[] = {"udp", "tcp", "tls"};
+
+static int transportIndex(const string &transport) {
+	for (int i = 0; i < 3; ++i) {
+		if (transport == sTransportNames[i])
+			return i;
+	}
+	return -1;
+}
+
+HeaderCompactor::HeaderCompactor(Agent *agent, const list<string> &transports, StatCounter64 *countMessages,
+								 StatCounter64 *savedBytes)
+	: mAgent(agent), mCountMessages(countMessages), mSavedBytes(savedBytes) {
+	fill(mTransports, mTransports + 3, false);
+	for (string transport : transports) {
+		transform(transport.begin(), transport.end(), transport.begin(), ::tolower);
+		int index = transportIndex(transport);
+		if (index < 0) {
+			LOGE("compact-headers: unknown transport '%s', expecting udp, tcp or tls", transport.c_str());
+			continue;
+		}
+		mTransports[index] = true;
+		LOGI("Messages forwarded on %s are written with compact headers", transport.c_str());
+	}
+}
+
+string HeaderCompactor::getTransport(const sip_t *sip, const url_string_t *destination) const {
+	string transport;
+	if (sip->sip_status) {
+		const sip_via_t *via = mAgent->getNextVia(const_cast<sip_t *>(sip));
+		if (!via || !via->v_protocol)
+			return transport;
+		const char *name = strrchr(via->v_protocol, '/'); // SIP/2.0/UDP
+		transport = name ? name + 1 : via->v_protocol;
+	} else {
+		const url_t *url = NULL;
+		if (destination && !URL_STRING_P(destination))
+			url = (const url_t *)destination;
+		else if (sip->sip_route)
+			url = sip->sip_route->r_url;
+		else if (sip->sip_request)
+			url = sip->sip_request->rq_url;
+		if (!url)
+			return transport;
+		char value[16];
+		if (url->url_params && url_param(url->url_params, "transport", value, sizeof(value)) > 0)
+			transport = value;
+		else
+			transport = url->url_type == url_sips ? "tls" : "udp";
+	}
+	transform(transport.begin(), transport.end(), transport.begin(), ::tolower);
+	return transport;
+}
+
+size_t HeaderCompactor::encodedSize(const msg_header_t *h, int flags) {
+	// the size needed is returned even when the header does not fit
+	char buffer[512];
+	issize_t size = msg_header_e(buffer, sizeof(buffer), h, flags);
+	return size > 0 ? (size_t)size : 0;
+}
+
+bool HeaderCompactor::dropUdpTransport(su_home_t *home, url_t *url) {
+	char value[8];
+	if (!url || url->url_type != url_sip || !url->url_params)
+		return false;
+	if (url_param(url->url_params, "transport", value, sizeof(value)) <= 0 || strcasecmp(value, "udp") != 0)
+		return false;
+	char *params = su_strdup(home, url->url_params);
+	url_strip_param_string(params, "transport");
+	url->url_params = params[0] ? params : NULL;
+	return true;
+}
+
+void HeaderCompactor::process(const shared_ptr<MsgSip> &ms, const url_string_t *destination) {
+	sip_t *sip = ms->getSip();
+	int index = transportIndex(getTransport(sip, destination));
+	if (index < 0 || !mTransports[index])
+		return;
+
+	msg_header_t *first = sip->sip_request ? (msg_header_t *)sip->sip_request : (msg_header_t *)sip->sip_status;
+	auto isHeader = [sip, first](const msg_header_t *h) {
+		return h != first && h != (msg_header_t *)sip->sip_separator && h != (msg_header_t *)sip->sip_payload;
+	};
+	size_t before = 0;
+	for (msg_header_t *h = first; h; h = (msg_header_t *)h->sh_succ) {
+		if (isHeader(h))
+			before += h->sh_data ? h->sh_len : encodedSize(h, 0);
+	}
+
+	su_home_t *home = ms->getHome();
+	for (sip_contact_t *contact = sip->sip_contact; contact; contact = contact->m_next)
+		dropUdpTransport(home, contact->m_url);
+	for (sip_route_t *route = sip->sip_route; route; route = route->r_next)
+		dropUdpTransport(home, route->r_url);
+	for (sip_record_route_t *route = sip->sip_record_route; route; route = route->r_next)
+		dropUdpTransport(home, route->r_url);
+
+	// the headers parsed keep their text unless cleared, all of them as the values of a list share the text of its
+	// first one
+	msg_set_flags(ms->getMsg(), MSG_FLG_COMPACT);
+	size_t after = 0;
+	for (msg_header_t *h = first; h; h = (msg_header_t *)h->sh_succ) {
+		if (!isHeader(h))
+			continue;
+		msg_fragment_clear(h->sh_common);
+		after += encodedSize(h, MSG_FLG_COMPACT);
+	}
+	++*mCountMessages;
+	if (before > after)
+		mSavedBytes->set(mSavedBytes->read() + before - after);
+}
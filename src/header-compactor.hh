@@ -0,0 +1,64 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef header_compactor_hh
+#define header_compactor_hh
+
+#include <list>
+#include <memory>
+#include <string>
+
+#include <sofia-sip/sip.h>
+#include <sofia-sip/url.h>
+
+#include "configmanager.hh"
+
+class Agent;
+class MsgSip;
+
+/*
+ * Egress stage writing the messages forwarded on the transports of the compact-headers setting in the compact form
+ * of RFC 3261 section 7.3.3: the one letter name of the headers having one, without the spaces after the colons and
+ * between the items of the lists. The transport=udp parameter of the sip URIs of the Contact, Route and Record-Route
+ * headers is dropped too, UDP being their default transport. It keeps the responses with long Via and Record-Route
+ * chains under the MTU, and lightens the messages sent to the mobile clients.
+ * The transport of a response is the one of its next Via; the one of a request is the one of its destination URI,
+ * UDP for a sip URI without transport parameter, as the transport chosen by a DNS lookup is not known yet.
+ */
+class HeaderCompactor {
+  public:
+	/* The transports among udp, tcp and tls. */
+	HeaderCompactor(Agent *agent, const std::list<std::string> &transports, StatCounter64 *countMessages,
+					StatCounter64 *savedBytes);
+
+	/* Called once the message is serialized, before it is given to the transports. The destination is the one of a
+	 * request, NULL for a response or to take the one of the request. */
+	void process(const std::shared_ptr<MsgSip> &ms, const url_string_t *destination);
+
+  private:
+	std::string getTransport(const sip_t *sip, const url_string_t *destination) const;
+	static size_t encodedSize(const msg_header_t *h, int flags);
+	static bool dropUdpTransport(su_home_t *home, url_t *url);
+
+	Agent *mAgent;
+	bool mTransports[3]; // udp, tcp and tls
+	StatCounter64 *mCountMessages;
+	StatCounter64 *mSavedBytes;
+};
+
+#endif
@@ -22,6 +22,15 @@
 #include "bctoolbox/logging.h"
 #include <syslog.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #ifndef DEFAULT_LOG_DIR
 #define DEFAULT_LOG_DIR "/var/opt/belledonne-communications/log/flexisip"
 #endif
@@ -34,8 +43,209 @@ BctbxLogLevel flexisip_sysLevelMin = BCTBX_LOG_ERROR;
 
 namespace flexisip {
 	namespace log {
+		/*
+		 * Single producer, single consumer ring of log records, one per logging thread. The producer only
+		 * publishes its head and the consumer its tail, so that neither waits for the other. A record is a header
+		 * followed by the formatted message, padded to the size of a header; a record that would cross the end of
+		 * the buffer is preceded by a filler reaching it.
+		 */
+		class LogRing {
+		  public:
+			LogRing(size_t size)
+				: mSize(size / sizeof(Header) * sizeof(Header)), mBuffer(new Header[size / sizeof(Header)]), mHead(0),
+				  mTail(0) {
+			}
+
+			/* Returns false if the record doesn't fit in the free part of the ring. */
+			bool push(const char *domain, BctbxLogLevel level, const char *msg, size_t len) {
+				len = std::min(len, mSize / 4 - sizeof(Header) - 1);
+				size_t need = (sizeof(Header) + len + 1 + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+				size_t head = mHead.load(std::memory_order_relaxed);
+				size_t tail = mTail.load(std::memory_order_acquire);
+				size_t offset = head % mSize;
+				size_t filler = need <= mSize - offset ? 0 : mSize - offset;
+				if (mSize - (head - tail) < filler + need)
+					return false;
+				if (filler) {
+					*at(offset) = Header{filler, -1, nullptr};
+					offset = 0;
+				}
+				Header *header = at(offset);
+				*header = Header{need, (int)level, domain};
+				char *text = reinterpret_cast<char *>(header + 1);
+				memcpy(text, msg, len);
+				text[len] = '\0';
+				mHead.store(head + filler + need, std::memory_order_release);
+				return true;
+			}
+
+			/* Calls fn(domain, level, message) for each record, which is released afterwards. */
+			template <typename _Fn> size_t drain(_Fn fn) {
+				size_t tail = mTail.load(std::memory_order_relaxed);
+				size_t head = mHead.load(std::memory_order_acquire);
+				size_t count = 0;
+				while (tail != head) {
+					const Header *header = at(tail % mSize);
+					if (header->level >= 0) {
+						fn(header->domain, (BctbxLogLevel)header->level, reinterpret_cast<const char *>(header + 1));
+						++count;
+					}
+					tail += header->size;
+				}
+				mTail.store(tail, std::memory_order_release);
+				return count;
+			}
+
+		  private:
+			struct Header {
+				size_t size;
+				int level; // -1 for a filler
+				const char *domain;
+			};
+			Header *at(size_t offset) {
+				return mBuffer.get() + offset / sizeof(Header);
+			}
+
+			const size_t mSize;
+			std::unique_ptr<Header[]> mBuffer;
+			std::atomic<size_t> mHead;
+			std::atomic<size_t> mTail;
+		};
+
+		/* State of the asynchronous logging, started by startAsync(). */
+		thread_local bool sDebugForced = false;
+
+		static std::atomic<bool> sAsyncStarted(false);
+		static size_t sAsyncBufferSize = 0;
+		static std::mutex sAsyncMutex; // the rings, and the writing of their records
+		static std::vector<std::unique_ptr<LogRing>> sAsyncRings;
+		static std::atomic<uint64_t> sAsyncDropped(0);
+		static std::thread sAsyncThread;
+		static std::condition_variable sAsyncCond;
+		static std::atomic<bool> sAsyncStopping(false);
+		// the ring of a thread outlives it, the logging threads being few and long-lived
+		static thread_local LogRing *sThreadRing = nullptr;
+
+		static void writeNow(const char *domain, BctbxLogLevel level, const char *fmt, ...) {
+			va_list args;
+			va_start(args, fmt);
+			bctbx_logv(domain, level, fmt, args);
+			va_end(args);
+		}
+
+		/* Writes the records of all the rings, then reports the messages dropped since the last call. */
+		static void drainRings(uint64_t &reportedDrops) {
+			std::lock_guard<std::mutex> lock(sAsyncMutex);
+			for (auto &ring : sAsyncRings) {
+				ring->drain([](const char *domain, BctbxLogLevel level, const char *msg) {
+					writeNow(domain, level, "%s", msg);
+				});
+			}
+			uint64_t dropped = sAsyncDropped.load(std::memory_order_relaxed);
+			if (dropped != reportedDrops) {
+				writeNow(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_WARNING, "%llu log messages dropped, the logging being late",
+						 (unsigned long long)(dropped - reportedDrops));
+				reportedDrops = dropped;
+			}
+		}
+
+		static void asyncLoop() {
+			uint64_t reportedDrops = 0;
+			std::mutex waitMutex;
+			std::unique_lock<std::mutex> lock(waitMutex);
+			while (true) {
+				drainRings(reportedDrops);
+				// the producers never signal, so that logging stays a copy in memory: the rings are polled
+				if (sAsyncCond.wait_for(lock, std::chrono::milliseconds(5), [] { return sAsyncStopping.load(); }))
+					break;
+			}
+			drainRings(reportedDrops);
+		}
+
+		static LogRing *threadRing() {
+			if (!sThreadRing) {
+				std::lock_guard<std::mutex> lock(sAsyncMutex);
+				sAsyncRings.emplace_back(new LogRing(sAsyncBufferSize));
+				sThreadRing = sAsyncRings.back().get();
+			}
+			return sThreadRing;
+		}
+
+		void logv(const char *domain, BctbxLogLevel level, const char *fmt, va_list args) {
+			// a level enabled for this event only goes to a domain that is always at the debug level
+			if (sDebugForced && !bctbx_get_log_level_mask(domain, level))
+				domain = FLEXISIP_DEBUG_LOG_DOMAIN;
+			if (!sAsyncStarted.load(std::memory_order_acquire)) {
+				bctbx_logv(domain, level, fmt, args);
+				return;
+			}
+			char buffer[1024];
+			va_list copy;
+			va_copy(copy, args);
+			int len = vsnprintf(buffer, sizeof(buffer), fmt, copy);
+			va_end(copy);
+			if (len < 0)
+				return;
+			bool queued;
+			if ((size_t)len < sizeof(buffer)) {
+				queued = threadRing()->push(domain, level, buffer, len);
+			} else {
+				std::unique_ptr<char[]> large(new char[len + 1]);
+				vsnprintf(large.get(), len + 1, fmt, args);
+				queued = threadRing()->push(domain, level, large.get(), len);
+			}
+			if (!queued)
+				sAsyncDropped.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void log(const char *domain, BctbxLogLevel level, const char *fmt, ...) {
+			va_list args;
+			va_start(args, fmt);
+			logv(domain, level, fmt, args);
+			va_end(args);
+		}
+
+		LogStream::~LogStream() {
+			log(mDomain, mLevel, "%s", str().c_str());
+		}
+
+		void startAsync(size_t bufferSize) {
+			if (sAsyncStarted)
+				return;
+			// the records are as large as a quarter of the ring at most
+			sAsyncBufferSize = max(bufferSize, (size_t)16384);
+			sAsyncStopping = false;
+			sAsyncThread = std::thread(asyncLoop);
+			sAsyncStarted.store(true, std::memory_order_release);
+		}
+
+		void stopAsync() {
+			if (!sAsyncStarted)
+				return;
+			sAsyncStarted.store(false, std::memory_order_release);
+			sAsyncStopping = true;
+			sAsyncCond.notify_one();
+			sAsyncThread.join();
+		}
+
+		void flushAsync() {
+			if (!sAsyncStarted)
+				return;
+			std::lock_guard<std::mutex> lock(sAsyncMutex);
+			for (auto &ring : sAsyncRings) {
+				ring->drain([](const char *domain, BctbxLogLevel level, const char *msg) {
+					writeNow(domain, level, "%s", msg);
+				});
+			}
+		}
+
+		uint64_t getAsyncDropCount() {
+			return sAsyncDropped.load(std::memory_order_relaxed);
+		}
+
 		static void syslogHandler(void *info, const char *domain, BctbxLogLevel log_level, const char *str, va_list l) {
-			if (log_level >= flexisip_sysLevelMin) {
+			// the messages of the debug-filter are meant to be seen whatever the syslog level
+			if (log_level >= flexisip_sysLevelMin || (domain && strcmp(domain, FLEXISIP_DEBUG_LOG_DOMAIN) == 0)) {
 				int syslev = LOG_ALERT;
 				switch (log_level) {
 					case BCTBX_LOG_DEBUG:
@@ -177,6 +387,7 @@ namespace flexisip {
 			}
 			bctbx_set_log_level(NULL /*any domain*/, min(log_level, flexisip_sysLevelMin));
 			
+			bctbx_set_log_level(FLEXISIP_DEBUG_LOG_DOMAIN, BCTBX_LOG_DEBUG);
 			if (user_errors) {
 				bctbx_set_log_level(FLEXISIP_USER_ERRORS_LOG_DOMAIN, BCTBX_LOG_WARNING);
 			} else {
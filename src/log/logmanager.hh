@@ -76,31 +76,96 @@ inline std::basic_istream<CharT, TraitsT> &operator>>(std::basic_istream<CharT,
 #ifndef FLEXISIP_USER_ERRORS_LOG_DOMAIN
 #define FLEXISIP_USER_ERRORS_LOG_DOMAIN "flexisip-users"
 #endif
+// domain of the messages logged because of a debug-filter match, always at the debug level
+#define FLEXISIP_DEBUG_LOG_DOMAIN "flexisip-debug"
 
 #define BCTBX_LOG_DOMAIN FLEXISIP_LOG_DOMAIN
 #include <syslog.h>
 #include "bctoolbox/logging.h"
+#include <cstdarg>
+#include <cstdint>
 #include <ostream>
 
 typedef std::ostream flexisip_record_type;
 
+namespace flexisip {
+namespace log {
+
+/* Set while the thread processes an event matching the debug-filter, all the levels being enabled meanwhile. */
+extern thread_local bool sDebugForced;
+
+/* Forces or not the debug level on the calling thread while it lives. */
+class DebugScope {
+  public:
+	DebugScope(bool forced) : mPrevious(sDebugForced) {
+		sDebugForced = forced;
+	}
+	~DebugScope() {
+		sDebugForced = mPrevious;
+	}
+
+  private:
+	bool mPrevious;
+};
+
+void log(const char *domain, BctbxLogLevel level, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 3, 4)))
+#endif
+	;
+void logv(const char *domain, BctbxLogLevel level, const char *fmt, va_list args);
+
+/* Stream of SLOGD and co, logging its content when destroyed. */
+class LogStream : public std::ostringstream {
+  public:
+	LogStream(const char *domain, BctbxLogLevel level) : mDomain(domain), mLevel(level) {
+	}
+	~LogStream();
+
+  private:
+	const char *mDomain;
+	BctbxLogLevel mLevel;
+};
+
+} // end log
+} // end flexisip
+
 #define SLOGA_FL(file, line) throw FlexisipException() << " " << file << ":" << line << " "
 
-#define SLOG(thelevel) BCTBX_SLOG(FLEXISIP_LOG_DOMAIN,thelevel)
-#define SLOGD BCTBX_SLOGD(FLEXISIP_LOG_DOMAIN)
-#define SLOGI BCTBX_SLOGI(FLEXISIP_LOG_DOMAIN)
-#define SLOGW BCTBX_SLOGW(FLEXISIP_LOG_DOMAIN)
-#define SLOGE BCTBX_SLOGE(FLEXISIP_LOG_DOMAIN)
-#define SLOGUE BCTBX_SLOGE(FLEXISIP_USER_ERRORS_LOG_DOMAIN)
+/*
+ * The levels are tested before the arguments are evaluated or any stream is built, so that a disabled level costs a
+ * test. The enabled messages go through flexisip::log::log(), which hands them to the background thread when the
+ * asynchronous logging is started.
+ */
+#define FLEXISIP_LOG_ENABLED(domain, thelevel)                                                                        \
+	(flexisip::log::sDebugForced || bctbx_get_log_level_mask((domain), (thelevel)) != 0)
+#define FLEXISIP_SLOG(domain, thelevel)                                                                               \
+	if (!FLEXISIP_LOG_ENABLED((domain), (thelevel)))                                                                   \
+		;                                                                                                              \
+	else                                                                                                               \
+		flexisip::log::LogStream((domain), (thelevel))
+#define FLEXISIP_LOG(domain, thelevel, ...)                                                                           \
+	do {                                                                                                               \
+		if (FLEXISIP_LOG_ENABLED((domain), (thelevel)))                                                               \
+			flexisip::log::log((domain), (thelevel), __VA_ARGS__);                                                     \
+	} while (0)
+
+#define SLOG(thelevel) FLEXISIP_SLOG(FLEXISIP_LOG_DOMAIN, thelevel)
+#define SLOGD FLEXISIP_SLOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG)
+#define SLOGI FLEXISIP_SLOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_MESSAGE)
+#define SLOGW FLEXISIP_SLOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_WARNING)
+#define SLOGE FLEXISIP_SLOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_ERROR)
+#define SLOGUE FLEXISIP_SLOG(FLEXISIP_USER_ERRORS_LOG_DOMAIN, BCTBX_LOG_ERROR)
 
 #define LOGV(thelevel, thefmt, theargs) LOGDV((thefmt), (theargs))
-#define LOGDV(thefmt, theargs) bctbx_logv(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG, (thefmt), (theargs))
+#define LOGDV(thefmt, theargs) flexisip::log::logv(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG, (thefmt), (theargs))
 
-#define LOGD bctbx_debug
-#define LOGI bctbx_message
-#define LOGW bctbx_warning
-#define LOGE bctbx_error
-#define LOGA bctbx_fatal
+#define LOGD(...) FLEXISIP_LOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG, __VA_ARGS__)
+#define LOGI(...) FLEXISIP_LOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_MESSAGE, __VA_ARGS__)
+#define LOGW(...) FLEXISIP_LOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_WARNING, __VA_ARGS__)
+#define LOGE(...) FLEXISIP_LOG(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_ERROR, __VA_ARGS__)
+// the pending messages are written before aborting
+#define LOGA(...) (flexisip::log::flushAsync(), bctbx_fatal(__VA_ARGS__))
 
 #define LOG_SCOPED_THREAD(key, value)
 
@@ -109,7 +174,7 @@ typedef std::ostream flexisip_record_type;
 #define LOGDFN(boolFn, streamFn)                                                                                       \
 do {                                                                                                               \
 	if (bctbx_get_log_level_mask(FLEXISIP_LOG_DOMAIN, (BCTBX_LOG_DEBUG)) && (boolFn())) {                                     \
-		pumpstream pump(BCTBX_LOG_DEBUG);                                                                               \
+		flexisip::log::LogStream pump(FLEXISIP_LOG_DOMAIN, BCTBX_LOG_DEBUG);                                          \
 		(streamFn)(pump);                                                                                          \
 	}                                                                                                              \
 } while (0)
@@ -163,6 +228,17 @@ do {
 
  		void disableGlobally();
 
+		/* Moves the writing of the logs to a background thread, fed by a ring buffer of bufferSize bytes per
+		 * logging thread. The messages that don't fit in the ring of their thread are dropped and counted. To be
+		 * called after the process is detached, as the thread does not survive a fork. */
+		void startAsync(size_t bufferSize);
+		/* Writes the pending messages and stops the background thread. */
+		void stopAsync();
+		/* Writes the pending messages, from any thread. */
+		void flushAsync();
+		/* Number of messages dropped since the start, the rings being full. */
+		uint64_t getAsyncDropCount();
+
 } // end log
 } // end flexisip
 
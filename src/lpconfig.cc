@@ -391,6 +391,15 @@ int lp_config_sync(LpConfig *lpconfig) {
 	return 0;
 }
 
+void lp_config_for_each_item(LpConfig *lpconfig, const char *section, LpConfigUnreadCallback cb, void *data) {
+	LpSection *sec = lp_config_find_section(lpconfig, section);
+	if (sec == NULL)
+		return;
+	for (auto it = sec->items.cbegin(); it != sec->items.cend(); ++it) {
+		cb(data, sec->name, (*it)->key, (*it)->lineno);
+	}
+}
+
 int lp_config_has_section(LpConfig *lpconfig, const char *section) {
 	if (lp_config_find_section(lpconfig, section) != NULL)
 		return 1;
@@ -107,6 +107,8 @@ void lp_config_clean_section(LpConfig *lpconfig, const char *section);
 
 typedef void (*LpConfigUnreadCallback)(void *data, const char *section, const char *item, int lineno);
 void lp_config_for_each_unread(LpConfig *lpconfig, LpConfigUnreadCallback cb, void *data);
+/* Calls cb for each item of a section, read or not. */
+void lp_config_for_each_item(LpConfig *lpconfig, const char *section, LpConfigUnreadCallback cb, void *data);
 
 /*tells whether uncommited (with lp_config_sync()) modifications exist*/
 int lp_config_needs_commit(const LpConfig *lpconfig);
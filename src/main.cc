@@ -34,12 +34,14 @@
 
 #ifdef ENABLE_TRANSCODER
 #include <mediastreamer2/msfactory.h>
+#include "transcoder-worker.hh"
 #endif
 
 #include "agent.hh"
 #include "stun.hh"
 #include "stats.hh"
 #include "module.hh"
+#include "profiler.hh"
 
 #include <cstdlib>
 #include <cstdio>
@@ -64,6 +66,8 @@
 #endif
 
 #include "log/logmanager.hh"
+#include "utils/threadplacement.hh"
+#include "utils/startup.hh"
 #include <ortp/ortp.h>
 #include <functional>
 #include <list>
@@ -78,6 +82,7 @@
 #endif // ENABLE_PRESENCE
 
 #include "monitor.hh"
+#include "handover.hh"
 
 #include <openssl/opensslconf.h>
 #if defined(OPENSSL_THREADS)
@@ -146,6 +151,27 @@ static void flexisip_stop(int signum) {
 static void flexisip_stat(int signum) {
 }
 
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t profile_requested = 0;
+
+static void flexisip_reload(int signum) {
+	if (flexisip_pid > 0) {
+		/*we are the watchdog, pass the signal to our child*/
+		kill(flexisip_pid, signum);
+	} else {
+		reload_requested = 1;
+	}
+}
+
+static void flexisip_profile(int signum) {
+	if (flexisip_pid > 0) {
+		/*we are the watchdog, pass the signal to our child*/
+		kill(flexisip_pid, signum);
+	} else {
+		profile_requested = 1;
+	}
+}
+
 static void sofiaLogHandler(void *, const char *fmt, va_list ap) {
 	// remove final \n from sofia
 	if (fmt) {
@@ -157,6 +183,18 @@ static void sofiaLogHandler(void *, const char *fmt, va_list ap) {
 }
 
 static void timerfunc(su_root_magic_t *magic, su_timer_t *t, Agent *a) {
+	if (reload_requested) {
+		// nothing can be done safely from the signal handler
+		reload_requested = 0;
+		GenericManager::get()->reloadFile();
+	}
+	if (profile_requested) {
+		profile_requested = 0;
+		string error;
+		if (Profiler::get()->start(GenericManager::get()->getGlobal()->get<ConfigInt>("profiler-duration")->read(),
+								   error).empty())
+			LOGE("Cannot start profiling: %s", error.c_str());
+	}
 	a->idle();
 }
 
@@ -595,6 +633,12 @@ int main(int argc, char *argv[]) {
 	shared_ptr<Agent> a;
 	StunServer *stun = NULL;
 	Stats *proxy_stats = NULL;
+	MetricsExporter *metrics_exporter = NULL;
+	MonitorProbe *monitor_probe = NULL;
+	Handover *handover = NULL;
+#ifdef ENABLE_SNMP
+	SnmpAgent *snmp_agent = NULL;
+#endif
 #ifdef ENABLE_PRESENCE
 	Stats *presence_stats = NULL;
 #endif
@@ -604,7 +648,7 @@ int main(int argc, char *argv[]) {
 	string versionString = version();
 	// clang-format off
 	TCLAP::CmdLine cmd("", ' ', versionString);
-	TCLAP::ValueArg<string>     functionName("", "server", 		"Specify the server function to operate: 'proxy', 'presence', or 'all'.", TCLAP::ValueArgOptional, "", "server function", cmd);
+	TCLAP::ValueArg<string>     functionName("", "server", 		"Specify the server function to operate: 'proxy', 'presence', 'all', or 'transcoder-worker'.", TCLAP::ValueArgOptional, "", "server function", cmd);
 	TCLAP::ValueArg<string>     configFile("c", "config", 			"Specify the location of the configuration file.", TCLAP::ValueArgOptional, CONFIG_DIR "/flexisip.conf", "file", cmd);
 	TCLAP::ValueArg<string>     pkcsFile("", "p12-passphrase-file", "Specify the location of the pkcs12 passphrase file.", TCLAP::ValueArgOptional,"", "file", cmd);
 	TCLAP::SwitchArg            daemonMode("",  "daemon", 			"Launch in daemon mode.", cmd);
@@ -721,7 +765,9 @@ int main(int argc, char *argv[]) {
 
 	GenericManager::get()->setOverrideMap(oset);
 
-	if (cfg->load(configFile.getValue().c_str()) == -1) {
+	int loaded = 0;
+	Startup::get()->step("configuration", [&]() { loaded = cfg->load(configFile.getValue().c_str()); });
+	if (loaded == -1) {
 		fprintf(stderr, "Flexisip version %s\n"
 						"No configuration file found at %s.\nPlease specify a valid configuration file.\n"
 						"A default flexisip.conf.sample configuration file should be installed in " CONFIG_DIR "\n"
@@ -741,6 +787,7 @@ int main(int argc, char *argv[]) {
 	
 	bool startProxy = false;
 	bool startPresence = false;
+	bool startTranscoderWorker = false;
 	
 	if (functionName.getValue() == "proxy"){
 		startProxy = true;
@@ -748,6 +795,11 @@ int main(int argc, char *argv[]) {
 		startPresence = true;
 #ifndef ENABLE_PRESENCE
 		LOGF("Flexisip was compiled without presence server extension.");
+#endif
+	}else if (functionName.getValue() == "transcoder-worker"){
+		startTranscoderWorker = true;
+#ifndef ENABLE_TRANSCODER
+		LOGF("Flexisip was compiled without transcoder support.");
 #endif
 	}else if (functionName.getValue() == "all"){
 		startPresence = true;
@@ -766,7 +818,7 @@ int main(int argc, char *argv[]) {
 	}else{
 		LOGF("There is no server function '%s'.", functionName.getValue().c_str());
 	}
-	string fName = getFunctionName(startProxy, startPresence);
+	string fName = startTranscoderWorker ? "transcoder-worker" : getFunctionName(startProxy, startPresence);
 	// Initialize
 	std::string log_level = cfg->getGlobal()->get<ConfigString>("log-level")->read();
 	std::string syslog_level = cfg->getGlobal()->get<ConfigString>("syslog-level")->read();
@@ -786,6 +838,8 @@ int main(int argc, char *argv[]) {
 	signal(SIGTERM, flexisip_stop);
 	signal(SIGINT, flexisip_stop);
 	signal(SIGUSR1, flexisip_stat);
+	signal(SIGHUP, flexisip_reload);
+	signal(SIGUSR2, flexisip_profile);
 
 	if (dump_cores) {
 		/*enable core dumps*/
@@ -797,6 +851,10 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (cfg->getGlobal()->get<ConfigBoolean>("connection-scaling")->read()) {
+		// read by sofia when the su_root is created: the cost of a wakeup no longer grows with the connections
+		setenv("SU_PORT", "epoll", 1);
+	}
 	su_init();
 	/*tell parser to support extra headers */
 	sip_update_default_mclass(sip_extend_mclass(NULL));
@@ -824,18 +882,26 @@ int main(int argc, char *argv[]) {
 	 NEVER NEVER create pthreads before this point : threads do not survive the fork below !!!!!!!!!!
 	*/
 	bool monitorEnabled = cfg->getRoot()->get<GenericStruct>("monitor")->get<ConfigBoolean>("enabled")->read();
+	bool monitorScript = cfg->getRoot()->get<GenericStruct>("monitor")->get<ConfigBoolean>("external-script")->read();
 	if (daemonMode) {
 		/*now that we have successfully loaded the config, there is nothing that can prevent us to start (normally).
 		So we can detach.*/
 		bool autoRespawn = cfg->getGlobal()->get<ConfigBoolean>("auto-respawn")->read();
 		if (!startProxy) monitorEnabled = false;
-		forkAndDetach(pidFile.getValue(), autoRespawn, monitorEnabled, fName);
+		forkAndDetach(pidFile.getValue(), autoRespawn, monitorEnabled && monitorScript, fName);
 	} else if (pidFile.getValue().length() != 0) {
 		// not daemon but we want a pidfile anyway
 		makePidFile(pidFile.getValue());
 	}
+	if (cfg->getGlobal()->get<ConfigBoolean>("log-async")->read()) {
+		// after the fork, that the thread writing the logs doesn't survive
+		flexisip::log::startAsync(cfg->getGlobal()->get<ConfigByteSize>("log-async-buffer-size")->read());
+	}
 
 	LOGN("Starting flexisip %s-server version %s (git %s)", fName.c_str(), VERSION, FLEXISIP_GIT_VERSION);
+	// before the agent, so that its memory is allocated on the node of the SIP loop
+	ThreadPlacement::configure(cfg->getGlobal()->get<ConfigStringList>("thread-placement")->read());
+	ThreadPlacement::placeCurrentThread(ThreadPlacement::Sip);
 	GenericManager::get()->sendTrap("Flexisip "+ fName + "-server starting");
 
 	root = su_root_create(NULL);
@@ -858,11 +924,16 @@ int main(int argc, char *argv[]) {
 				}
 			}
 		}
-		a->start(transportsArg.getValue(), passphrase);
+		string handoverSocket = cfg->getGlobal()->get<ConfigString>("handover-socket")->read();
+		if (!handoverSocket.empty()) {
+			// before the transports are created, so that they adopt the sockets of the process replaced
+			Handover::takeOver(handoverSocket);
+		}
+		Startup::get()->step("transports", [&]() { a->start(transportsArg.getValue(), passphrase); });
 	#ifdef ENABLE_SNMP
 		bool snmpEnabled = cfg->getGlobal()->get<ConfigBoolean>("enable-snmp")->read();
 		if (snmpEnabled) {
-			SnmpAgent lAgent(*a, *cfg, oset);
+			snmp_agent = new SnmpAgent(*a, *cfg, oset);
 		}
 	#endif
 		ortp_init();
@@ -879,6 +950,14 @@ int main(int argc, char *argv[]) {
 			} catch (const FlexisipException &e) {
 				LOGE("Could not create test accounts for the monitor. %s", e.str().c_str());
 			}
+			if (!monitorScript) {
+				monitor_probe = new MonitorProbe(a.get());
+				if (!monitor_probe->start()) {
+					LOGE("Could not start the monitor probe");
+					delete monitor_probe;
+					monitor_probe = NULL;
+				}
+			}
 		}
 
 		if (daemonMode) {
@@ -892,9 +971,25 @@ int main(int argc, char *argv[]) {
 		
 		proxy_stats = new Stats("proxy");
 		proxy_stats->start();
+
+		GenericStruct *global = cfg->getRoot()->get<GenericStruct>("global");
+		int metricsPort = global->get<ConfigInt>("metrics-http-port")->read();
+		if (metricsPort > 0) {
+			metrics_exporter = new MetricsExporter(global->get<ConfigString>("metrics-http-address")->read(), metricsPort);
+			metrics_exporter->start();
+		}
 		
 		if (trackAllocs)
 			msg_set_callbacks(flexisip_msg_create, flexisip_msg_destroy);
+
+		if (!handoverSocket.empty()) {
+			handover = new Handover(a.get(), handoverSocket, global->get<ConfigInt>("handover-drain-time")->read(),
+									[]() { flexisip_stop(SIGTERM); });
+			if (!handover->start()) {
+				delete handover;
+				handover = NULL;
+			}
+		}
 	}
 	if (startPresence){
 #ifdef ENABLE_PRESENCE
@@ -926,13 +1021,33 @@ int main(int argc, char *argv[]) {
 #endif
 	}
 	
+#ifdef ENABLE_TRANSCODER
+	if (startTranscoderWorker) {
+		cfg->loadStrict();
+		TranscoderWorker worker(root, cfg->getRoot()->get<GenericStruct>("module::Transcoder"));
+		if (!worker.start())
+			LOGF("Fail to start flexisip transcoder worker");
+		if (daemonMode) {
+			notifyWatchDog();
+		}
+		su_root_run(root);
+	}
+#endif
+
 	if (startProxy){
 		su_timer_t *timer = su_timer_create(su_root_task(root), 5000);
 		su_timer_set_for_ever(timer, (su_timer_f)timerfunc, a.get());
+		Startup::get()->ready();
 		su_root_run(root);
 		su_timer_destroy(timer);
+		Startup::get()->wait();
 		a->unloadConfig();
 	}
+	delete monitor_probe;
+	delete handover;
+#ifdef ENABLE_SNMP
+	delete snmp_agent;
+#endif
 	
 	a.reset();
 #ifdef ENABLE_PRESENCE
@@ -950,6 +1065,10 @@ int main(int argc, char *argv[]) {
 		proxy_stats->stop();
 		delete proxy_stats;
 	}
+	if (metrics_exporter) {
+		metrics_exporter->stop();
+		delete metrics_exporter;
+	}
 	su_root_destroy(root);
 
 	LOGN("Flexisip %s-server exiting normally.", fName.c_str());
@@ -957,6 +1076,7 @@ int main(int argc, char *argv[]) {
 		dump_remaining_msgs();
 	GenericManager::get()->sendTrap("Flexisip "+ fName + "-server exiting normally");
 	
+	flexisip::log::stopAsync();
 	bctbx_uninit_logger();
 	return 0;
 }
@@ -0,0 +1,300 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common.hh"
+#include "mediarelay-offload.hh"
+#include "utils/threadplacement.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char *sDnatChain = "FLEXISIP_RELAY_DNAT";
+static const char *sSnatChain = "FLEXISIP_RELAY_SNAT";
+static const char *sForwardChain = "FLEXISIP_RELAY";
+static const char *sCommentPrefix = "fxr-";
+
+static bool runCommand(const string &cmd) {
+	int status = system(cmd.c_str());
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static string endpointString(const RelayOffloader::Endpoint &e, bool ipv6) {
+	return (ipv6 ? "[" + e.ip + "]" : e.ip) + ":" + to_string(e.port);
+}
+
+static string udpMatch(const RelayOffloader::Endpoint &src, const RelayOffloader::Endpoint &dst) {
+	return "-p udp -s " + src.ip + " -d " + dst.ip + " --sport " + to_string(src.port) + " --dport " +
+		   to_string(dst.port);
+}
+
+RelayOffloader::RelayOffloader() : mRunning(false), mIpv6(false), mDirty(false), mNextId(1) {
+}
+
+RelayOffloader::~RelayOffloader() {
+	if (!mRunning)
+		return;
+	{
+		unique_lock<mutex> lock(mMutex);
+		mRunning = false;
+		mCondVar.notify_one();
+	}
+	mThread.join();
+	// the NAT state of the flows outlives the rules, so it has to go too
+	for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+		flushConntrack(it->second);
+	}
+	for (auto it = mRemoved.begin(); it != mRemoved.end(); ++it) {
+		flushConntrack(*it);
+	}
+	setupChains(false, false);
+	if (mIpv6)
+		setupChains(true, false);
+}
+
+bool RelayOffloader::start() {
+	if (getuid() != 0) {
+		LOGE("Flexisip not started with root privileges, media relay kernel offload disabled.");
+		return false;
+	}
+	if (!runCommand("iptables -V > /dev/null 2>&1") || !runCommand("iptables-restore -h > /dev/null 2>&1")) {
+		LOGE("iptables not found, media relay kernel offload disabled.");
+		return false;
+	}
+	if (!runCommand("conntrack -V > /dev/null 2>&1")) {
+		LOGE("conntrack not found, media relay kernel offload disabled.");
+		return false;
+	}
+	mWait = runCommand("iptables -w -V > /dev/null 2>&1") ? " -w" : "";
+	ifstream ipForward("/proc/sys/net/ipv4/ip_forward");
+	int forwarding = 0;
+	if (!(ipForward >> forwarding) || forwarding == 0) {
+		LOGW("IP forwarding is disabled (net.ipv4.ip_forward), offloaded media streams will not be forwarded.");
+	}
+	if (!setupChains(false, true))
+		return false;
+	mIpv6 = runCommand("ip6tables -V > /dev/null 2>&1") && setupChains(true, true);
+	mRunning = true;
+	mThread = thread(&RelayOffloader::run, this);
+	LOGI("Media relay kernel offload enabled%s.", mIpv6 ? "" : " (IPv4 only)");
+	return true;
+}
+
+uint64_t RelayOffloader::install(const Binding &binding) {
+	bool ipv6 = binding.frontLocal.ip.find(':') != string::npos;
+	if (ipv6 != (binding.frontRemote.ip.find(':') != string::npos) ||
+		ipv6 != (binding.backLocal.ip.find(':') != string::npos) ||
+		ipv6 != (binding.backRemote.ip.find(':') != string::npos) || (ipv6 && !mIpv6)) {
+		return 0;
+	}
+	unique_lock<mutex> lock(mMutex);
+	uint64_t id = mNextId++;
+	Entry &entry = mEntries[id];
+	entry.binding = binding;
+	entry.ipv6 = ipv6;
+	entry.installed = false;
+	entry.packets = 0;
+	mDirty = true;
+	mCondVar.notify_one();
+	return id;
+}
+
+void RelayOffloader::remove(uint64_t id) {
+	unique_lock<mutex> lock(mMutex);
+	auto it = mEntries.find(id);
+	if (it == mEntries.end())
+		return;
+	mRemoved.push_back(it->second);
+	mEntries.erase(it);
+	mDirty = true;
+	mCondVar.notify_one();
+}
+
+uint64_t RelayOffloader::getForwardedPackets(uint64_t id) {
+	unique_lock<mutex> lock(mMutex);
+	auto it = mEntries.find(id);
+	return it != mEntries.end() ? it->second.packets : 0;
+}
+
+bool RelayOffloader::isInstalled(uint64_t id) {
+	unique_lock<mutex> lock(mMutex);
+	auto it = mEntries.find(id);
+	return it != mEntries.end() && it->second.installed;
+}
+
+size_t RelayOffloader::getInstalledCount() {
+	unique_lock<mutex> lock(mMutex);
+	size_t count = 0;
+	for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+		if (it->second.installed)
+			++count;
+	}
+	return count;
+}
+
+bool RelayOffloader::setupChains(bool ipv6, bool create) {
+	const char *tool = ipv6 ? "ip6tables" : "iptables";
+	const struct {
+		const char *table;
+		const char *hook;
+		const char *chain;
+	} links[] = {{"nat", "PREROUTING", sDnatChain}, {"nat", "POSTROUTING", sSnatChain}, {"filter", "FORWARD", sForwardChain}};
+	bool ok = true;
+
+	for (auto &link : links) {
+		// leftovers of a previous run are removed first, failures are expected here
+		string prefix = string(tool) + mWait + " -t " + link.table;
+		runCommand(prefix + " -D " + link.hook + " -j " + link.chain + " > /dev/null 2>&1");
+		runCommand(prefix + " -F " + link.chain + " > /dev/null 2>&1");
+		runCommand(prefix + " -X " + link.chain + " > /dev/null 2>&1");
+		if (!create)
+			continue;
+		string cmd = prefix + " -N " + link.chain;
+		if (!runCommand(cmd) || !runCommand(prefix + " -I " + link.hook + " -j " + link.chain)) {
+			LOGE("%s command [%s] failed", tool, cmd.c_str());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/* Replaces the content of the chains with the rules of the entries, atomically. */
+bool RelayOffloader::applyRules(bool ipv6, const map<uint64_t, Entry> &entries) {
+	string nat = string("*nat\n-F ") + sDnatChain + "\n-F " + sSnatChain + "\n";
+	string filter = string("*filter\n-F ") + sForwardChain + "\n";
+	for (auto it = entries.begin(); it != entries.end(); ++it) {
+		if (it->second.ipv6 != ipv6)
+			continue;
+		const Binding &b = it->second.binding;
+		string comment = " -m comment --comment " + string(sCommentPrefix) + to_string(it->first);
+		nat += string("-A ") + sDnatChain + " " + udpMatch(b.frontRemote, b.frontLocal) +
+			   " -j DNAT --to-destination " + endpointString(b.backRemote, ipv6) + "\n";
+		nat += string("-A ") + sDnatChain + " " + udpMatch(b.backRemote, b.backLocal) +
+			   " -j DNAT --to-destination " + endpointString(b.frontRemote, ipv6) + "\n";
+		nat += string("-A ") + sSnatChain + " " + udpMatch(b.frontRemote, b.backRemote) + " -j SNAT --to-source " +
+			   endpointString(b.backLocal, ipv6) + "\n";
+		nat += string("-A ") + sSnatChain + " " + udpMatch(b.backRemote, b.frontRemote) + " -j SNAT --to-source " +
+			   endpointString(b.frontLocal, ipv6) + "\n";
+		filter += string("-A ") + sForwardChain + " " + udpMatch(b.frontRemote, b.backRemote) + comment + " -j ACCEPT\n";
+		filter += string("-A ") + sForwardChain + " " + udpMatch(b.backRemote, b.frontRemote) + comment + " -j ACCEPT\n";
+	}
+	nat += "COMMIT\n";
+	filter += "COMMIT\n";
+
+	const char *cmd = ipv6 ? "ip6tables-restore -n" : "iptables-restore -n";
+	FILE *f = popen(cmd, "w");
+	if (!f) {
+		LOGE("Cannot run %s: %s", cmd, strerror(errno));
+		return false;
+	}
+	fputs(nat.c_str(), f);
+	fputs(filter.c_str(), f);
+	int status = pclose(f);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		LOGE("%s failed to apply the media relay offload rules", cmd);
+		return false;
+	}
+	return true;
+}
+
+/* Drops the conntrack state of the binding: the flows relayed through the sockets so far would otherwise never go
+ * through the NAT rules, and the NATed ones would keep being forwarded after the removal of the rules. */
+void RelayOffloader::flushConntrack(const Entry &entry) {
+	const Binding &b = entry.binding;
+	string prefix = string("conntrack -D -f ") + (entry.ipv6 ? "ipv6" : "ipv4") + " -p udp";
+	runCommand(prefix + " --orig-dst " + b.frontLocal.ip + " --dport " + to_string(b.frontLocal.port) +
+			   " > /dev/null 2>&1");
+	runCommand(prefix + " --orig-dst " + b.backLocal.ip + " --dport " + to_string(b.backLocal.port) +
+			   " > /dev/null 2>&1");
+}
+
+void RelayOffloader::readCounters(bool ipv6, map<uint64_t, uint64_t> &counters) {
+	string cmd = string(ipv6 ? "ip6tables" : "iptables") + mWait + " -t filter -L " + sForwardChain + " -v -x -n";
+	FILE *f = popen(cmd.c_str(), "r");
+	if (!f)
+		return;
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		const char *comment = strstr(line, sCommentPrefix);
+		char *end = NULL;
+		unsigned long long packets = strtoull(line, &end, 10);
+		if (!comment || end == line)
+			continue;
+		counters[strtoull(comment + strlen(sCommentPrefix), NULL, 10)] += packets;
+	}
+	pclose(f);
+}
+
+void RelayOffloader::run() {
+	ThreadPlacement::placeCurrentThread(ThreadPlacement::Relay);
+	unique_lock<mutex> lock(mMutex);
+	while (mRunning) {
+		mCondVar.wait_for(lock, chrono::seconds(1));
+		if (!mRunning)
+			break;
+		if (mDirty) {
+			// let the changes of a burst of calls accumulate
+			lock.unlock();
+			this_thread::sleep_for(chrono::milliseconds(100));
+			lock.lock();
+			map<uint64_t, Entry> entries = mEntries;
+			list<Entry> removed;
+			removed.swap(mRemoved);
+			mDirty = false;
+			lock.unlock();
+
+			bool ok = applyRules(false, entries);
+			if (mIpv6)
+				ok = applyRules(true, entries) && ok;
+			for (auto it = removed.begin(); it != removed.end(); ++it) {
+				flushConntrack(*it);
+			}
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				if (!it->second.installed)
+					flushConntrack(it->second);
+			}
+
+			lock.lock();
+			if (ok) {
+				for (auto it = entries.begin(); it != entries.end(); ++it) {
+					auto entry = mEntries.find(it->first);
+					if (entry != mEntries.end())
+						entry->second.installed = true;
+				}
+			}
+		}
+		if (mEntries.empty())
+			continue;
+		map<uint64_t, uint64_t> counters;
+		lock.unlock();
+		readCounters(false, counters);
+		if (mIpv6)
+			readCounters(true, counters);
+		lock.lock();
+		for (auto it = counters.begin(); it != counters.end(); ++it) {
+			auto entry = mEntries.find(it->first);
+			if (entry != mEntries.end())
+				entry->second.packets = it->second;
+		}
+	}
+}
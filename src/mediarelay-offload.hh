@@ -0,0 +1,89 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef mediarelay_offload_hh
+#define mediarelay_offload_hh
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * Offloads the relaying of plain UDP streams to the kernel, with netfilter NAT rules: packets coming from one party to
+ * the relay port are rewritten to go from the relay port of the other party to it, and conntrack takes care of the
+ * opposite direction. The rules live in dedicated chains, and each stream also gets an accounting rule in the FORWARD
+ * chain so that the relay can still see which streams are active.
+ *
+ * iptables is run from a worker thread, so that the relay threads never wait for it.
+ */
+class RelayOffloader {
+  public:
+	struct Endpoint {
+		std::string ip;
+		int port;
+	};
+	/* One UDP stream (RTP or RTCP) between the two parties of a call. */
+	struct Binding {
+		Endpoint frontLocal;  // relay address seen by the front party
+		Endpoint frontRemote; // address of the front party
+		Endpoint backLocal;	  // relay address seen by the back party
+		Endpoint backRemote;  // address of the back party
+	};
+
+	RelayOffloader();
+	~RelayOffloader();
+	/* Checks the privileges and the tools required, and creates the chains. */
+	bool start();
+	/* Returns the identifier of the binding, which is installed asynchronously, or 0 if it cannot be offloaded. */
+	uint64_t install(const Binding &binding);
+	void remove(uint64_t id);
+	/* Number of packets forwarded by the kernel for the binding, as of the last accounting read. */
+	uint64_t getForwardedPackets(uint64_t id);
+	bool isInstalled(uint64_t id);
+	size_t getInstalledCount();
+
+  private:
+	struct Entry {
+		Binding binding;
+		bool ipv6;
+		bool installed;
+		uint64_t packets;
+	};
+	void run();
+	bool setupChains(bool ipv6, bool create);
+	bool applyRules(bool ipv6, const std::map<uint64_t, Entry> &entries);
+	void flushConntrack(const Entry &entry);
+	void readCounters(bool ipv6, std::map<uint64_t, uint64_t> &counters);
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::thread mThread;
+	std::string mWait;
+	bool mRunning;
+	bool mIpv6;
+	bool mDirty;
+	uint64_t mNextId;
+	std::map<uint64_t, Entry> mEntries;
+	std::list<Entry> mRemoved;
+};
+
+#endif
@@ -0,0 +1,327 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "mediarelay-replication.hh"
+#include "mediarelay.hh"
+#include "log/logmanager.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <random>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Datagram format: the magic, then records until the end of the datagram, integers in network order.
+ *   'U' id(8) front back    state of a session, each channel being:
+ *                           local ip(str) bind ip(str) local port(2) remote ip(str) remote port(2) direction(1)
+ *   'R' id(8)               removal of a session
+ * with str a length(1) followed by the characters.
+ */
+static const char sMagic[4] = {'F', 'R', 'R', '1'};
+static const size_t sMaxDatagram = 1400;
+
+RelayReplicator::RelayReplicator(su_root_t *root, function<void(const Session &)> onUpdate,
+								 function<void(uint64_t)> onRemove)
+	: mRoot(root), mOnUpdate(onUpdate), mOnRemove(onRemove), mSocket(-1), mWaitIndex(-1), mRefreshTimer(NULL),
+	  mPeerAddrLen(0) {
+	random_device rd;
+	mNextId = (uint64_t)rd() << 32;
+}
+
+RelayReplicator::~RelayReplicator() {
+	if (mRefreshTimer)
+		su_timer_destroy(mRefreshTimer);
+	if (mWaitIndex != -1)
+		su_root_deregister(mRoot, mWaitIndex);
+	if (mSocket != -1)
+		close(mSocket);
+}
+
+bool RelayReplicator::start(int port, const string &peer) {
+	// host:port, [ipv6]:port, or a host alone for the same port as ours
+	string host = peer;
+	string service;
+	size_t bracket = peer.find(']');
+	size_t colon = peer.rfind(':');
+	if (!peer.empty() && peer[0] == '[' && bracket != string::npos) {
+		host = peer.substr(1, bracket - 1);
+		if (colon == bracket + 1)
+			service = peer.substr(colon + 1);
+	} else if (colon != string::npos && peer.find(':') == colon) {
+		host = peer.substr(0, colon);
+		service = peer.substr(colon + 1);
+	}
+	if (service.empty())
+		service = to_string(port);
+
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+	if (err != 0) {
+		LOGE("Cannot resolve the media relay replication peer %s: %s", peer.c_str(), gai_strerror(err));
+		return false;
+	}
+	memcpy(&mPeerAddr, res->ai_addr, res->ai_addrlen);
+	mPeerAddrLen = res->ai_addrlen;
+	int family = res->ai_family;
+	freeaddrinfo(res);
+
+	mSocket = socket(family, SOCK_DGRAM, 0);
+	if (mSocket == -1) {
+		LOGE("Cannot create the media relay replication socket: %s", strerror(errno));
+		return false;
+	}
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) | O_NONBLOCK);
+	struct sockaddr_storage local;
+	socklen_t localLen;
+	memset(&local, 0, sizeof(local));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&local;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(port);
+		localLen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&local;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(port);
+		localLen = sizeof(*sin);
+	}
+	if (::bind(mSocket, (struct sockaddr *)&local, localLen) == -1) {
+		LOGE("Cannot bind the media relay replication socket to port %i: %s", port, strerror(errno));
+		return false;
+	}
+	su_wait_create(&mWait, mSocket, SU_WAIT_IN);
+	mWaitIndex = su_root_register(mRoot, &mWait, &RelayReplicator::sOnRead, this, su_pri_normal);
+	mRefreshTimer = su_timer_create(su_root_task(mRoot), sRefreshPeriod * 1000);
+	su_timer_set_for_ever(mRefreshTimer, &RelayReplicator::sOnRefresh, this);
+	LOGI("Replicating the relay sessions with %s from port %i", peer.c_str(), port);
+	return true;
+}
+
+static void writeInt(string &out, uint64_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; --i)
+		out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void writeString(string &out, const string &value) {
+	size_t length = min(value.size(), (size_t)255);
+	out.push_back((char)length);
+	out.append(value, 0, length);
+}
+
+static void writeChannel(string &out, const RelayReplicator::Channel &channel) {
+	writeString(out, channel.localIp);
+	writeString(out, channel.bindIp);
+	writeInt(out, channel.localPort, 2);
+	writeString(out, channel.remoteIp);
+	writeInt(out, channel.remotePort, 2);
+	writeInt(out, channel.dir, 1);
+}
+
+void RelayReplicator::writeUpdate(string &out, const Session &state) {
+	out.push_back('U');
+	writeInt(out, state.id, 8);
+	writeChannel(out, state.front);
+	writeChannel(out, state.back);
+}
+
+void RelayReplicator::writeRemove(string &out, uint64_t id) {
+	out.push_back('R');
+	writeInt(out, id, 8);
+}
+
+void RelayReplicator::send(const string &datagram) {
+	if (sendto(mSocket, datagram.data(), datagram.size(), 0, (struct sockaddr *)&mPeerAddr, mPeerAddrLen) == -1)
+		LOGD("Cannot send the relay sessions to the replication peer: %s", strerror(errno));
+}
+
+void RelayReplicator::publish(const shared_ptr<RelaySession> &session, const Session &state) {
+	auto it = mPublished.find(session.get());
+	if (it == mPublished.end() || it->second.session.lock() != session) {
+		// a new session, possibly at the address of a destroyed one
+		Published published;
+		published.session = session;
+		published.state.id = ++mNextId;
+		mPublished[session.get()] = published;
+		it = mPublished.find(session.get());
+	}
+	uint64_t id = it->second.state.id;
+	it->second.state = state;
+	it->second.state.id = id;
+	string datagram(sMagic, sizeof(sMagic));
+	writeUpdate(datagram, it->second.state);
+	send(datagram);
+}
+
+void RelayReplicator::withdraw(const shared_ptr<RelaySession> &session) {
+	auto it = mPublished.find(session.get());
+	if (it == mPublished.end())
+		return;
+	string datagram(sMagic, sizeof(sMagic));
+	writeRemove(datagram, it->second.state.id);
+	send(datagram);
+	mPublished.erase(it);
+}
+
+void RelayReplicator::refresh() {
+	string datagram(sMagic, sizeof(sMagic));
+	for (auto it = mPublished.begin(); it != mPublished.end();) {
+		size_t start = datagram.size();
+		shared_ptr<RelaySession> session = it->second.session.lock();
+		if (!session || !session->isUsed()) {
+			writeRemove(datagram, it->second.state.id);
+			it = mPublished.erase(it);
+		} else {
+			writeUpdate(datagram, it->second.state);
+			++it;
+		}
+		if (datagram.size() > sMaxDatagram) {
+			// the record goes to the next datagram
+			string record = datagram.substr(start);
+			datagram.resize(start);
+			send(datagram);
+			datagram.assign(sMagic, sizeof(sMagic));
+			datagram += record;
+		}
+	}
+	if (datagram.size() > sizeof(sMagic))
+		send(datagram);
+}
+
+/* Reads the records of a datagram, stopping at the first one that does not fit. */
+class RecordReader {
+  public:
+	RecordReader(const uint8_t *data, size_t size) : mData(data), mSize(size), mValid(true) {
+	}
+	bool valid() const {
+		return mValid;
+	}
+	bool atEnd() const {
+		return mSize == 0;
+	}
+	uint64_t readInt(int bytes) {
+		uint64_t value = 0;
+		if (!check(bytes))
+			return 0;
+		for (int i = 0; i < bytes; ++i)
+			value = (value << 8) | mData[i];
+		skip(bytes);
+		return value;
+	}
+	string readString() {
+		size_t length = readInt(1);
+		if (!check(length))
+			return string();
+		string value((const char *)mData, length);
+		skip(length);
+		return value;
+	}
+	void readChannel(RelayReplicator::Channel &channel) {
+		channel.localIp = readString();
+		channel.bindIp = readString();
+		channel.localPort = (int)readInt(2);
+		channel.remoteIp = readString();
+		channel.remotePort = (int)readInt(2);
+		channel.dir = (int)readInt(1);
+	}
+
+  private:
+	bool check(size_t bytes) {
+		if (mSize < bytes)
+			mValid = false;
+		return mValid;
+	}
+	void skip(size_t bytes) {
+		mData += bytes;
+		mSize -= bytes;
+	}
+	const uint8_t *mData;
+	size_t mSize;
+	bool mValid;
+};
+
+void RelayReplicator::parse(const uint8_t *data, size_t size) {
+	if (size < sizeof(sMagic) || memcmp(data, sMagic, sizeof(sMagic)) != 0) {
+		LOGW("Invalid datagram from the media relay replication peer");
+		return;
+	}
+	RecordReader reader(data + sizeof(sMagic), size - sizeof(sMagic));
+	while (reader.valid() && !reader.atEnd()) {
+		int type = (int)reader.readInt(1);
+		if (type == 'U') {
+			Session state;
+			state.id = reader.readInt(8);
+			reader.readChannel(state.front);
+			reader.readChannel(state.back);
+			if (reader.valid())
+				mOnUpdate(state);
+		} else if (type == 'R') {
+			uint64_t id = reader.readInt(8);
+			if (reader.valid())
+				mOnRemove(id);
+		} else {
+			LOGW("Unknown record in a datagram from the media relay replication peer");
+			break;
+		}
+	}
+}
+
+static bool sameHost(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+	if (a.ss_family != b.ss_family)
+		return false;
+	if (a.ss_family == AF_INET6) {
+		return memcmp(&((const struct sockaddr_in6 *)&a)->sin6_addr, &((const struct sockaddr_in6 *)&b)->sin6_addr,
+					  sizeof(struct in6_addr)) == 0;
+	}
+	return ((const struct sockaddr_in *)&a)->sin_addr.s_addr == ((const struct sockaddr_in *)&b)->sin_addr.s_addr;
+}
+
+void RelayReplicator::onRead() {
+	uint8_t buffer[65536];
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		ssize_t size = recvfrom(mSocket, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &fromLen);
+		if (size < 0)
+			break;
+		if (!sameHost(from, mPeerAddr)) {
+			LOGW("Ignoring a relay replication datagram from another host than the peer");
+			continue;
+		}
+		parse(buffer, size);
+	}
+}
+
+void RelayReplicator::sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	static_cast<RelayReplicator *>(arg)->onRead();
+}
+
+void RelayReplicator::sOnRefresh(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<RelayReplicator *>(arg)->refresh();
+}
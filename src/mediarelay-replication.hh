@@ -0,0 +1,97 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef mediarelay_replication_hh
+#define mediarelay_replication_hh
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+
+#include <sofia-sip/su_wait.h>
+
+class RelaySession;
+
+/*
+ * Replicates the established relay sessions to a peer relay, and receives those of the peer, so that each one can take
+ * over the streams of the other when its relay address moves to it.
+ * The peers exchange UDP datagrams of compact records: the state of a session each time it changes and again every
+ * few seconds, and its removal. A session the peer no longer refreshes is considered gone.
+ * SIP thread only.
+ */
+class RelayReplicator {
+  public:
+	struct Channel {
+		std::string localIp;
+		std::string bindIp;
+		int localPort;
+		std::string remoteIp;
+		int remotePort;
+		int dir;
+	};
+	struct Session {
+		uint64_t id;
+		Channel front;
+		Channel back;
+	};
+	/* Seconds between two refreshes of the published sessions. */
+	static const int sRefreshPeriod = 5;
+
+	/* Calls onUpdate with the sessions of the peer as they are created or changed, and onRemove when they are gone. */
+	RelayReplicator(su_root_t *root, std::function<void(const Session &)> onUpdate,
+					std::function<void(uint64_t)> onRemove);
+	~RelayReplicator();
+	/* Listens on the given UDP port for the datagrams of the peer at host:port. */
+	bool start(int port, const std::string &peer);
+	/* Sends the state of a session, and again at each refresh while the session is in use. */
+	void publish(const std::shared_ptr<RelaySession> &session, const Session &state);
+	void withdraw(const std::shared_ptr<RelaySession> &session);
+
+  private:
+	struct Published {
+		std::weak_ptr<RelaySession> session;
+		Session state;
+	};
+	static void sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	static void sOnRefresh(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onRead();
+	void refresh();
+	void send(const std::string &datagram);
+	static void writeUpdate(std::string &out, const Session &state);
+	static void writeRemove(std::string &out, uint64_t id);
+	void parse(const uint8_t *data, size_t size);
+
+	su_root_t *mRoot;
+	std::function<void(const Session &)> mOnUpdate;
+	std::function<void(uint64_t)> mOnRemove;
+	int mSocket;
+	su_wait_t mWait;
+	int mWaitIndex;
+	su_timer_t *mRefreshTimer;
+	struct sockaddr_storage mPeerAddr;
+	socklen_t mPeerAddrLen;
+	/* ids start from a random epoch, so that those of a restarted peer do not collide with its former ones */
+	uint64_t mNextId;
+	std::map<const RelaySession *, Published> mPublished;
+};
+
+#endif
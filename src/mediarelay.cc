@@ -19,16 +19,26 @@
 #include "flexisip-config.h"
 #include "agent.hh"
 #include "mediarelay.hh"
+#include "utils/threadplacement.hh"
 
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include <algorithm>
 #include <list>
 
 using namespace std;
 
+// seconds during which packets may still reach the relay sockets after a stream was offloaded to the kernel
+static const time_t sOffloadGracePeriod = 3;
+static const int sMaxOffloadAttempts = 3;
+
 PollFd::PollFd(int init_size) : mCurSize(init_size) {
 	mPfd = (struct pollfd *)malloc(mCurSize * sizeof(struct pollfd));
 	mCurIndex = 0;
@@ -62,10 +72,13 @@ unsigned int PollFd::getREvents(int index) const {
 }
 
 RelayChannel::RelayChannel(RelaySession *relaySession, const std::pair<std::string, std::string> &relayIps,
-						   bool preventLoops)
-	: mDir(SendRecv), mLocalIp(relayIps.first), mRemoteIp(std::string("undefined")), mRemotePort(-1) {
+						   bool preventLoops, int port)
+	: mDir(SendRecv), mLocalIp(relayIps.first), mBindIp(relayIps.second), mServer(relaySession->getRelayServer()),
+	  mRemoteIp(std::string("undefined")), mRemotePort(-1) {
 	mPfdIndex = -1;
-	mSession = relaySession->getRelayServer()->createRtpSession(relayIps.second);
+	// a pinned port is not for the pool: it belongs to a session of the replication peer
+	mPinned = port > 0;
+	mSession = mPinned ? mServer->bindRtpSession(mBindIp, port) : mServer->createRtpSession(mBindIp);
 	mSockets[0] = rtp_session_get_rtp_socket(mSession);
 	mSockets[1] = rtp_session_get_rtcp_socket(mSession);
 	mSockAddrSize[0] = mSockAddrSize[1] = 0;
@@ -73,7 +86,12 @@ RelayChannel::RelayChannel(RelaySession *relaySession, const std::pair<std::stri
 	mPacketsSent = 0;
 	mPreventLoop = preventLoops;
 	mHasMultipleTargets = false;
+	mShared = false;
 	mDestAddrChanged = false;
+	mReceivedOn[0] = mReceivedOn[1] = false;
+	mVersion = 0;
+	mClockRate = 8000;
+	mLastSrNtp = 0;
 }
 
 bool RelayChannel::checkSocketsValid() {
@@ -81,7 +99,10 @@ bool RelayChannel::checkSocketsValid() {
 }
 
 RelayChannel::~RelayChannel() {
-	rtp_session_destroy(mSession);
+	if (mPinned)
+		mServer->destroyRtpSession(mSession, mBindIp);
+	else
+		mServer->releaseRtpSession(mSession, mBindIp);
 }
 
 const char *RelayChannel::dirToString(Dir dir) {
@@ -111,6 +132,7 @@ void RelayChannel::setRemoteAddr(const string &ip, int port, Dir dir) {
 	mRemotePort = port;
 	mRemoteIp = ip;
 	mDir = dir;
+	mVersion++;
 
 	if (dest_ok && port != 0) {
 		struct addrinfo *res = NULL;
@@ -151,6 +173,11 @@ void RelayChannel::setRemoteAddr(const string &ip, int port, Dir dir) {
 	}
 }
 
+void RelayChannel::retarget() {
+	mDestAddrChanged = false;
+	mReceivedOn[0] = mReceivedOn[1] = false;
+}
+
 void RelayChannel::fillPollFd(PollFd *pfd) {
 	mPfdIndex = -1;
 	if (mSockets[0] == -1)
@@ -169,21 +196,129 @@ bool RelayChannel::checkPollFd(const PollFd *pfd, int i) {
 	return false;
 }
 
+RtpPacketInfo RtpPacketInfo::decode(const uint8_t *data, size_t size) {
+	RtpPacketInfo info;
+	info.timestamp = 0;
+	info.ssrc = 0;
+	info.payloadOffset = 0;
+	info.payloadType = 0;
+	info.marker = false;
+	info.nalType = 0;
+	info.nalRefIdc = 0;
+	if (size < 12 || (data[0] >> 6) != 2)
+		return info;
+	size_t offset = 12 + 4 * (data[0] & 0x0f);
+	if ((data[0] & 0x10) && offset + 4 <= size)
+		offset += 4 + 4 * ((data[offset + 2] << 8) | data[offset + 3]);
+	else if (data[0] & 0x10)
+		return info;
+	if (offset >= size)
+		return info;
+	info.timestamp = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) | ((uint32_t)data[6] << 8) | data[7];
+	info.ssrc = ((uint32_t)data[8] << 24) | ((uint32_t)data[9] << 16) | ((uint32_t)data[10] << 8) | data[11];
+	info.payloadOffset = (uint16_t)offset;
+	info.payloadType = data[1] & 0x7f;
+	info.marker = (data[1] & 0x80) != 0;
+	uint8_t nal = data[offset] & 0x1f;
+	info.nalRefIdc = (data[offset] >> 5) & 0x03;
+	// FU-A: the type of the fragmented unit is in the FU header
+	if (nal == 28 && offset + 1 < size)
+		nal = data[offset + 1] & 0x1f;
+	info.nalType = nal;
+	return info;
+}
+
+bool RtcpReportBlock::isRtcp(const uint8_t *data, size_t size) {
+	// the RTCP packet types are out of the payload types of RTP, marker bit included (RFC 5761)
+	return size >= 8 && (data[0] >> 6) == 2 && data[1] >= 192 && data[1] <= 223;
+}
+
+static uint32_t readUint32(const uint8_t *data) {
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+int RtcpReportBlock::decode(const uint8_t *data, size_t size, RtcpReportBlock *blocks, int max, uint32_t *srNtp) {
+	int n = 0;
+	*srNtp = 0;
+	// a compound packet: a SR or a RR, followed by the other RTCP packets
+	while (size >= 8) {
+		size_t length = 4 * ((((size_t)data[2] << 8) | data[3]) + 1);
+		if (length > size)
+			break;
+		size_t offset = 0;
+		if (data[1] == 200 && length >= 28) {
+			offset = 28;
+			*srNtp = (readUint32(data + 8) << 16) | (readUint32(data + 12) >> 16);
+		} else if (data[1] == 201) {
+			offset = 8;
+		}
+		int count = data[0] & 0x1f;
+		for (int k = 0; offset != 0 && k < count && offset + 24 <= length && n < max; ++k, offset += 24) {
+			const uint8_t *block = data + offset;
+			RtcpReportBlock &b = blocks[n++];
+			b.ssrc = readUint32(block);
+			b.fractionLost = block[4];
+			b.jitter = readUint32(block + 12);
+			b.lsr = readUint32(block + 16);
+			b.dlsr = readUint32(block + 20);
+		}
+		data += length;
+		size -= length;
+	}
+	return n;
+}
+
+void RelayPacketBatch::classify() {
+	for (int k = mClassified; k < mCount; ++k)
+		mInfos[k] = RtpPacketInfo::decode(mBuffers[k], mLengths[k]);
+	mClassified = mCount;
+}
+
+void MediaFilter::onIncomingBatch(RelayPacketBatch &batch, const sockaddr *addr, socklen_t addrlen) {
+	for (int k = 0; k < batch.size(); ++k) {
+		if (batch.isKept(k) && !onIncomingTransfer(batch.data(k), batch.length(k), addr, addrlen))
+			batch.drop(k);
+	}
+}
+
+void MediaFilter::onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr, socklen_t addrlen) {
+	for (int k = 0; k < batch.size(); ++k) {
+		if (selected[k] && !onOutgoingTransfer(batch.data(k), batch.length(k), addr, addrlen))
+			selected[k] = false;
+	}
+}
+
+bool RelayChannel::isFromRemoteIp(const struct sockaddr_storage &ss, socklen_t addrsize) const {
+	char host[NI_MAXHOST];
+	if (getnameinfo((const struct sockaddr *)&ss, addrsize, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+		return false;
+	return mRemoteIp == host;
+}
+
+/* Returns false if the packet is to be dropped, coming from another branch than the one a shared channel is lent to. */
+bool RelayChannel::checkSourceAddr(int i, const struct sockaddr_storage &ss, socklen_t addrsize) {
+	if (addrsize != mSockAddrSize[i] || memcmp(&ss, &mSockAddr[i], addrsize) != 0) {
+		// a shared channel follows the first source once it has a destination, or the destination itself
+		if (mShared && (mRemotePort <= 0 || (mReceivedOn[i] && !isFromRemoteIp(ss, addrsize))))
+			return false;
+		LOGD("RelayChannel[%p] destination address changed.", this);
+		mSockAddrSize[i] = addrsize;
+		memcpy(&mSockAddr[i], &ss, addrsize);
+		mDestAddrChanged = true;
+	}
+	mReceivedOn[i] = true;
+	return true;
+}
+
 int RelayChannel::recv(int i, uint8_t *buf, size_t buflen) {
 	struct sockaddr_storage ss;
 	socklen_t addrsize = sizeof(ss);
 	
 	int err = recvfrom(mSockets[i], buf, buflen, 0, (struct sockaddr *)&ss, &addrsize);
 	if (err > 0) {
-		mPacketsReceived++;
-		if (addrsize != mSockAddrSize[i] || memcmp(&ss, &mSockAddr[i], addrsize) != 0 ){
-			LOGD("RelayChannel[%p] destination address changed.", this);
-			mSockAddrSize[i] = addrsize;
-			memcpy(&mSockAddr[i], &ss, addrsize);
-			mDestAddrChanged = true;
-		}
-		
-		mSockAddrSize[i] = addrsize;
+		mPacketsReceived.fetch_add(1, memory_order_relaxed);
+		if (!checkSourceAddr(i, ss, addrsize))
+			return 0;
 		if (mDir == SendOnly || mDir == Inactive) {
 			/*LOGD("ignored packet");*/
 			return 0;
@@ -192,7 +327,7 @@ int RelayChannel::recv(int i, uint8_t *buf, size_t buflen) {
 			mFilter->onIncomingTransfer(buf, buflen, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]) == false) {
 			return 0;
 		}
-	} else if (err == -1) {
+	} else if (err == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
 		LOGW("Error receiving on port %i from %s:%i: %s", getLocalPort(), mRemoteIp.c_str(), mRemotePort + i,
 			 strerror(errno));
 		if (errno == ECONNREFUSED) {
@@ -209,7 +344,7 @@ int RelayChannel::send(int i, uint8_t *buf, size_t buflen) {
 	if (mRemotePort > 0 && mSockAddrSize[i] > 0 && mDir != Inactive) {
 		if (!mFilter || mFilter->onOutgoingTransfer(buf, buflen, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i])) {
 			err = sendto(mSockets[i], buf, buflen, 0, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]);
-			mPacketsSent++;
+			mPacketsSent.fetch_add(1, memory_order_relaxed);
 			if (err == -1) {
 				LOGW("Error sending %i bytes (localport=%i dest=%s:%i) : %s", (int)buflen, getLocalPort() + i,
 					 mRemoteIp.c_str(), mRemotePort, strerror(errno));
@@ -224,119 +359,515 @@ int RelayChannel::send(int i, uint8_t *buf, size_t buflen) {
 	return err;
 }
 
+int RelayChannel::recv(int i, RelayPacketBatch &batch) {
+	struct sockaddr_storage addrs[RelayPacketBatch::sMaxPackets];
+	int count = 0;
+
+	batch.clear();
+#if HAVE_RECVMMSG
+	struct mmsghdr msgs[RelayPacketBatch::sMaxPackets];
+	struct iovec iovs[RelayPacketBatch::sMaxPackets];
+	memset(msgs, 0, sizeof(msgs));
+	for (int k = 0; k < RelayPacketBatch::sMaxPackets; ++k) {
+		iovs[k].iov_base = batch.data(k);
+		iovs[k].iov_len = RelayPacketBatch::sMaxPacketSize;
+		msgs[k].msg_hdr.msg_iov = &iovs[k];
+		msgs[k].msg_hdr.msg_iovlen = 1;
+		msgs[k].msg_hdr.msg_name = &addrs[k];
+		msgs[k].msg_hdr.msg_namelen = sizeof(addrs[k]);
+	}
+	count = recvmmsg(mSockets[i], msgs, RelayPacketBatch::sMaxPackets, MSG_DONTWAIT, NULL);
+	for (int k = 0; k < count; ++k) {
+		batch.push(msgs[k].msg_len);
+		if (!checkSourceAddr(i, addrs[k], msgs[k].msg_hdr.msg_namelen))
+			batch.drop(k);
+	}
+#else
+	// one recvfrom() per packet, until the socket is drained or the batch is full
+	while (count < RelayPacketBatch::sMaxPackets) {
+		socklen_t addrsize = sizeof(addrs[count]);
+		int err = recvfrom(mSockets[i], batch.data(count), RelayPacketBatch::sMaxPacketSize, MSG_DONTWAIT,
+						   (struct sockaddr *)&addrs[count], &addrsize);
+		if (err < 0)
+			break;
+		batch.push(err);
+		if (!checkSourceAddr(i, addrs[count], addrsize))
+			batch.drop(count);
+		++count;
+	}
+	if (count == 0)
+		count = -1;
+#endif
+	if (count > 0) {
+		mPacketsReceived.fetch_add(count, memory_order_relaxed);
+		if (mDir == SendOnly || mDir == Inactive) {
+			for (int k = 0; k < count; ++k)
+				batch.drop(k);
+		} else if (mFilter) {
+			mFilter->onIncomingBatch(batch, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]);
+		}
+	} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		LOGW("Error receiving on port %i from %s:%i: %s", getLocalPort(), mRemoteIp.c_str(), mRemotePort + i,
+			 strerror(errno));
+		if (errno == ECONNREFUSED) {
+			/*this will avoid to continue sending if there are ICMP errors*/
+			mSockAddrSize[i] = 0;
+		}
+	}
+	return count;
+}
+
+int RelayChannel::send(int i, RelayPacketBatch &batch) {
+	bool selected[RelayPacketBatch::sMaxPackets];
+	int sent = 0;
+
+	/*if destination address is working mSockAddrSize>0*/
+	if (mRemotePort <= 0 || mSockAddrSize[i] <= 0 || mDir == Inactive)
+		return 0;
+	for (int k = 0; k < batch.size(); ++k)
+		selected[k] = batch.isKept(k);
+	if (mFilter)
+		mFilter->onOutgoingBatch(batch, selected, (struct sockaddr *)&mSockAddr[i], mSockAddrSize[i]);
+
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[RelayPacketBatch::sMaxPackets];
+	struct iovec iovs[RelayPacketBatch::sMaxPackets];
+	int count = 0;
+	memset(msgs, 0, sizeof(msgs));
+	for (int k = 0; k < batch.size(); ++k) {
+		if (!selected[k])
+			continue;
+		iovs[count].iov_base = batch.data(k);
+		iovs[count].iov_len = batch.length(k);
+		msgs[count].msg_hdr.msg_iov = &iovs[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		msgs[count].msg_hdr.msg_name = &mSockAddr[i];
+		msgs[count].msg_hdr.msg_namelen = mSockAddrSize[i];
+		++count;
+	}
+	// sendmmsg() may stop before the end of the vector: resume after the packets already sent
+	while (sent < count) {
+		int err = sendmmsg(mSockets[i], msgs + sent, count - sent, 0);
+		if (err <= 0) {
+			LOGW("Error sending %i packets (localport=%i dest=%s:%i) : %s", count - sent, getLocalPort() + i,
+				 mRemoteIp.c_str(), mRemotePort, strerror(errno));
+			break;
+		}
+		sent += err;
+	}
+	mPacketsSent.fetch_add(count, memory_order_relaxed);
+#else
+	for (int k = 0; k < batch.size(); ++k) {
+		if (!selected[k])
+			continue;
+		int err = sendto(mSockets[i], batch.data(k), batch.length(k), 0, (struct sockaddr *)&mSockAddr[i],
+						 mSockAddrSize[i]);
+		mPacketsSent.fetch_add(1, memory_order_relaxed);
+		if (err == -1) {
+			LOGW("Error sending %i bytes (localport=%i dest=%s:%i) : %s", (int)batch.length(k), getLocalPort() + i,
+				 mRemoteIp.c_str(), mRemotePort, strerror(errno));
+		} else {
+			++sent;
+		}
+	}
+#endif
+	return sent;
+}
+
+void RelayChannel::inspectRtcp(RelayPacketBatch &batch, bool received) {
+	for (int k = 0; k < batch.size(); ++k) {
+		if (!batch.isKept(k) || !RtcpReportBlock::isRtcp(batch.data(k), batch.length(k)))
+			continue;
+		RtcpReportBlock blocks[4];
+		uint32_t srNtp;
+		int count = RtcpReportBlock::decode(batch.data(k), batch.length(k), blocks, 4, &srNtp);
+		auto now = chrono::steady_clock::now();
+		if (!received) {
+			if (srNtp != 0) {
+				mLastSrNtp = srNtp;
+				mLastSrTime = now;
+			}
+			continue;
+		}
+		unsigned int rate = mClockRate;
+		mQualityMutex.lock();
+		for (int b = 0; b < count; ++b) {
+			const RtcpReportBlock &block = blocks[b];
+			uint64_t jitter = (uint64_t)block.jitter * 1000000 / rate;
+			++mQuality.reports;
+			mQuality.lossSum += block.fractionLost;
+			mQuality.maxLoss = max(mQuality.maxLoss, (unsigned int)block.fractionLost);
+			mQuality.jitterSum += jitter;
+			mQuality.maxJitter = max(mQuality.maxJitter, jitter);
+			if (block.lsr != 0 && block.lsr == mLastSrNtp) {
+				// the time elapsed since the SR was sent, less the time the remote party held it
+				int64_t rtt = chrono::duration_cast<chrono::microseconds>(now - mLastSrTime).count() -
+							  (int64_t)block.dlsr * 1000000 / 65536;
+				if (rtt >= 0) {
+					mQuality.rttSum += rtt;
+					++mQuality.rttCount;
+				}
+			}
+		}
+		mQualityMutex.unlock();
+	}
+}
+
+RelayChannelQuality RelayChannel::getQuality() const {
+	mQualityMutex.lock();
+	RelayChannelQuality quality = mQuality;
+	mQualityMutex.unlock();
+	return quality;
+}
+
 void RelayChannel::setFilter(shared_ptr<MediaFilter> filter) {
 	mFilter = filter;
+	mVersion++;
+}
+
+bool RelayChannel::getOffloadEndpoints(int i, RelayOffloader::Endpoint &local, RelayOffloader::Endpoint &remote) const {
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	if (mFilter || mDir != SendRecv || !mReceivedOn[i] || mSockAddrSize[i] == 0 || mRemotePort <= 0)
+		return false;
+	if (getnameinfo((const struct sockaddr *)&mSockAddr[i], mSockAddrSize[i], host, sizeof(host), serv, sizeof(serv),
+					NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return false;
+	remote.ip = host;
+	remote.port = atoi(serv);
+	// the rules need the address the packets are actually sent to
+	bool anyAddr = mBindIp.empty() || mBindIp == "0.0.0.0" || mBindIp == "::";
+	local.ip = anyAddr ? mLocalIp : mBindIp;
+	local.port = getLocalPort() + i;
+	return true;
 }
 
 RelaySession::RelaySession(MediaRelayServer *server, const string &frontId,
-						   const std::pair<std::string, std::string> &relayIps)
-	: mServer(server), mFrontId(frontId) {
+						   const std::pair<std::string, std::string> &relayIps, int frontPort)
+	: mServer(server), mFrontId(frontId), mChannelsVersion(0), mRelayChannelsVersion(0) {
 	mLastActivityTime = getCurrentTime();
 	mUsed = true;
-	mFront = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled());
+	mInactivityTimeout = 0;
+	mReplicaId = 0;
+	mTenant = NULL;
+	mOffloadIds[0] = mOffloadIds[1] = 0;
+	mOffloadVersions[0] = mOffloadVersions[1] = 0;
+	mOffloadPackets = 0;
+	mOffloadTime = 0;
+	mOffloadAttempts = 0;
+	shared_ptr<Channels> channels = make_shared<Channels>();
+	channels->front = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled(), frontPort);
+	channels->buildRoutes();
+	mChannels = channels;
+}
+
+/* The packets of the front channel go to the back one once established, to every branch before; those of the others
+ * go to the front channel. */
+void RelaySession::Channels::buildRoutes() {
+	vector<RelayChannel *> backOuts;
+	if (back) {
+		backOuts.push_back(back.get());
+	} else {
+		for (auto it = backs.begin(); it != backs.end(); ++it)
+			backOuts.push_back((*it).second.get());
+		if (shared)
+			backOuts.push_back(shared.get());
+	}
+	routes.clear();
+	for (int i = 0; i < 2; ++i) {
+		if (front)
+			routes.push_back(Route{front->getSocket(i), i, front.get(), backOuts});
+		vector<RelayChannel *> frontOuts;
+		if (front)
+			frontOuts.push_back(front.get());
+		for (RelayChannel *chan : backOuts)
+			routes.push_back(Route{chan->getSocket(i), i, chan, frontOuts});
+	}
+}
+
+shared_ptr<const RelaySession::Channels> RelaySession::getChannels() const {
+	return atomic_load(&mChannels);
+}
+
+/* Called with mMutex held, which only serializes the writers: the relay thread keeps using the previous set of
+ * channels until it loads the new one. */
+shared_ptr<RelaySession::Channels> RelaySession::copyChannels() const {
+	return make_shared<Channels>(*mChannels);
+}
+
+void RelaySession::publishChannels(const shared_ptr<Channels> &channels) {
+	channels->buildRoutes();
+	atomic_store(&mChannels, shared_ptr<const Channels>(channels));
+	mChannelsVersion.fetch_add(1, memory_order_release);
+}
+
+/* Loading a shared_ptr atomically takes a lock, which a version number spares for each packet. The channels of the
+ * previous snapshot live until the relay thread loads the next one. */
+const RelaySession::Channels &RelaySession::getRelayChannels() {
+	uint32_t version = mChannelsVersion.load(memory_order_acquire);
+	if (!mRelayChannels || version != mRelayChannelsVersion) {
+		mRelayChannels = getChannels();
+		mRelayChannelsVersion = version;
+	}
+	return *mRelayChannels;
 }
 
 shared_ptr<RelayChannel> RelaySession::getChannel(const string &partyId, const string &trId) {
+	shared_ptr<const Channels> channels = getChannels();
 	if (partyId == mFrontId)
-		return mFront;
-	if (mBack)
-		return mBack;
-
-	shared_ptr<RelayChannel> ret;
+		return channels->front;
+	if (channels->back)
+		return channels->back;
+
+	auto it = channels->backs.find(trId);
+	if (it != channels->backs.end())
+		return (*it).second;
+	return channels->sharedIds.count(trId) ? channels->shared : nullptr;
+}
 
+std::shared_ptr<RelayChannel> RelaySession::createBranch(const std::string &trId,
+		 const std::pair<std::string, std::string> &relayIps,
+		 bool hasMultipleTargets, int port) {
+	shared_ptr<RelayChannel> ret = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled(), port);
+	ret->setMultipleTargets(hasMultipleTargets);
 	mMutex.lock();
-	auto it = mBacks.find(trId);
-	if (it != mBacks.end()) {
-		ret = (*it).second;
-	}
+	shared_ptr<Channels> channels = copyChannels();
+	channels->backs.insert(make_pair(trId, ret));
+	publishChannels(channels);
 	mMutex.unlock();
+	mServer->watchChannel(shared_from_this(), ret);
+	LOGD("RelaySession [%p]: branch corresponding to transaction [%s] added.", this, trId.c_str());
 	return ret;
 }
 
-std::shared_ptr<RelayChannel> RelaySession::createBranch(const std::string &trId,
-		 const std::pair<std::string, std::string> &relayIps,
-		 bool hasMultipleTargets) {
+shared_ptr<RelayChannel> RelaySession::createSharedBranch(const string &trId, const pair<string, string> &relayIps) {
 	shared_ptr<RelayChannel> ret;
 	mMutex.lock();
-	ret = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled());
-	ret->setMultipleTargets(hasMultipleTargets);
-	mBacks.insert(make_pair(trId, ret));
+	shared_ptr<RelayChannel> shared = mChannels->shared;
+	if (!shared || (shared->getLocalIp() == relayIps.first && shared->getBindIp() == relayIps.second)) {
+		shared_ptr<Channels> channels = copyChannels();
+		if (!channels->shared) {
+			channels->shared = make_shared<RelayChannel>(this, relayIps, mServer->loopPreventionEnabled());
+			channels->shared->setShared(true);
+		}
+		channels->sharedIds.insert(trId);
+		ret = channels->shared;
+		publishChannels(channels);
+	}
 	mMutex.unlock();
-	LOGD("RelaySession [%p]: branch corresponding to transaction [%s] added.", this, trId.c_str());
+	if (!ret)
+		return createBranch(trId, relayIps, false); // forked through other relay addresses
+	if (!shared)
+		mServer->watchChannel(shared_from_this(), ret);
+	LOGD("RelaySession [%p]: branch corresponding to transaction [%s] added to the shared channel.", this, trId.c_str());
 	return ret;
 }
 
+bool RelaySession::claimChannel(const string &partyId, const string &trId) {
+	if (partyId == mFrontId)
+		return true;
+	bool claimed = true;
+	bool lent = false;
+	mMutex.lock();
+	if (!mChannels->back && mChannels->sharedIds.count(trId) && mChannels->sharedOwner != trId) {
+		claimed = lent = mChannels->sharedOwner.empty();
+		if (lent) {
+			shared_ptr<Channels> channels = copyChannels();
+			channels->sharedOwner = trId;
+			channels->shared->retarget();
+			publishChannels(channels);
+		}
+	}
+	mMutex.unlock();
+	if (lent)
+		LOGD("RelaySession [%p]: shared channel lent to transaction [%s].", this, trId.c_str());
+	return claimed;
+}
+
 void RelaySession::removeBranch(const std::string &trId) {
 	bool removed = false;
 	mMutex.lock();
-	auto it = mBacks.find(trId);
-	if (it != mBacks.end()) {
+	if (mChannels->backs.find(trId) != mChannels->backs.end() || mChannels->sharedIds.count(trId)) {
+		shared_ptr<Channels> channels = copyChannels();
+		channels->backs.erase(trId);
+		channels->sharedIds.erase(trId);
+		if (channels->sharedOwner == trId)
+			channels->sharedOwner.clear();
+		if (channels->sharedIds.empty())
+			channels->shared.reset();
+		publishChannels(channels);
 		removed = true;
-		mBacks.erase(it);
 	}
 	mMutex.unlock();
 	if (removed)
 		LOGD("RelaySession [%p]: branch corresponding to transaction [%s] removed.", this, trId.c_str());
 }
 
+vector<pair<bool, RelayChannelQuality>> RelaySession::getQuality() const {
+	vector<pair<bool, RelayChannelQuality>> quality;
+	shared_ptr<const Channels> channels = getChannels();
+	if (channels->front)
+		quality.push_back(make_pair(true, channels->front->getQuality()));
+	if (channels->back) {
+		quality.push_back(make_pair(false, channels->back->getQuality()));
+	} else {
+		for (auto it = channels->backs.begin(); it != channels->backs.end(); ++it)
+			quality.push_back(make_pair(false, (*it).second->getQuality()));
+		if (channels->shared)
+			quality.push_back(make_pair(false, channels->shared->getQuality()));
+	}
+	return quality;
+}
+
+static void getReplicaChannel(const RelayChannel &chan, RelayReplicator::Channel &state) {
+	state.localIp = chan.getLocalIp();
+	state.bindIp = chan.getBindIp();
+	state.localPort = chan.getLocalPort();
+	state.remoteIp = chan.getRemoteIp();
+	state.remotePort = chan.getRemotePort();
+	state.dir = chan.getDir();
+}
+
+bool RelaySession::getReplicaState(RelayReplicator::Session &state) const {
+	shared_ptr<const Channels> channels = getChannels();
+	if (!channels->front || !channels->back)
+		return false;
+	state.id = 0;
+	getReplicaChannel(*channels->front, state.front);
+	getReplicaChannel(*channels->back, state.back);
+	return true;
+}
+
 int RelaySession::getActiveBranchesCount() {
 	int count = 0;
-	mMutex.lock();
-	for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+	shared_ptr<const Channels> channels = getChannels();
+	for (auto it = channels->backs.begin(); it != channels->backs.end(); ++it) {
 		if ((*it).second->getRemotePort() > 0)
 			count++;
 	}
-	mMutex.unlock();
+	if (channels->shared && channels->shared->getRemotePort() > 0)
+		count++;
 	LOGD("getActiveBranchesCount(): %i", count);
 	return count;
 }
 
 void RelaySession::setEstablished(const std::string &tr_id) {
-	if (mBack)
+	if (getChannels()->back)
 		return;
 	shared_ptr<RelayChannel> winner = getChannel("", tr_id);
 	if (winner) {
 		LOGD("RelaySession [%p] is established.", this);
 		mMutex.lock();
-		mBack = winner;
-		mBacks.clear();
+		shared_ptr<Channels> channels = copyChannels();
+		if (winner == channels->shared) {
+			// its destination is now given by the answer of the winner, whoever it was lent to
+			if (channels->sharedOwner != tr_id)
+				winner->retarget();
+			winner->setShared(false);
+		}
+		channels->back = winner;
+		channels->backs.clear();
+		channels->shared.reset();
+		channels->sharedIds.clear();
+		channels->sharedOwner.clear();
+		publishChannels(channels);
 		mMutex.unlock();
 	} else
 		LOGE("RelaySession [%p] is with from an unknown branch [%s].", this, tr_id.c_str());
 }
 
 void RelaySession::fillPollFd(PollFd *pfd) {
-	mMutex.lock();
+	shared_ptr<const Channels> channels = getChannels();
 
-	if (mFront)
-		mFront->fillPollFd(pfd);
-	if (mBack)
-		mBack->fillPollFd(pfd);
+	if (channels->front)
+		channels->front->fillPollFd(pfd);
+	if (channels->back)
+		channels->back->fillPollFd(pfd);
 	else {
-		for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
+		for (auto it = channels->backs.begin(); it != channels->backs.end(); ++it) {
 			(*it).second->fillPollFd(pfd);
 		}
+		if (channels->shared)
+			channels->shared->fillPollFd(pfd);
 	}
-	mMutex.unlock();
 }
 
 void RelaySession::checkPollFd(const PollFd *pfd, time_t curtime) {
-	int i;
-	mMutex.lock();
-	for (i = 0; i < 2; ++i) {
-		if (mFront && mFront->checkPollFd(pfd, i))
-			transfer(curtime, mFront, i);
-		if (!mBack) {
-			for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
-				shared_ptr<RelayChannel> chan = (*it).second;
-				if (chan->checkPollFd(pfd, i))
-					transfer(curtime, chan, i);
+	const Channels &channels = getRelayChannels();
+	for (const Route &route : channels.routes) {
+		if (route.in->checkPollFd(pfd, route.index))
+			transfer(curtime, route);
+	}
+}
+
+void RelaySession::removeOffload() {
+	RelayOffloader *offloader = mServer->getOffloader();
+	for (int i = 0; i < 2; ++i) {
+		if (mOffloadIds[i] != 0) {
+			offloader->remove(mOffloadIds[i]);
+			mOffloadIds[i] = 0;
+		}
+	}
+}
+
+void RelaySession::checkOffload(time_t curtime) {
+	RelayOffloader *offloader = mServer->getOffloader();
+	if (!offloader)
+		return;
+	if (!mUsed) {
+		removeOffload();
+		return;
+	}
+	shared_ptr<const Channels> channels = getChannels();
+	const shared_ptr<RelayChannel> &front = channels->front;
+	const shared_ptr<RelayChannel> &back = channels->back;
+	if (mOffloadIds[0] != 0 || mOffloadIds[1] != 0) {
+		if (!back || front->getVersion() != mOffloadVersions[0] || back->getVersion() != mOffloadVersions[1]) {
+			LOGD("RelaySession [%p] was reconfigured, removing kernel offload.", this);
+			removeOffload();
+		} else {
+			uint64_t packets = 0;
+			for (int i = 0; i < 2; ++i) {
+				if (mOffloadIds[i] != 0)
+					packets += offloader->getForwardedPackets(mOffloadIds[i]);
+			}
+			if (packets != mOffloadPackets) {
+				mOffloadPackets = packets;
+				mLastActivityTime = curtime;
+			}
+		}
+	} else if (back && front && mOffloadAttempts < sMaxOffloadAttempts) {
+		RelayOffloader::Binding binding;
+		for (int i = 0; i < 2; ++i) {
+			if (front->getOffloadEndpoints(i, binding.frontLocal, binding.frontRemote) &&
+				back->getOffloadEndpoints(i, binding.backLocal, binding.backRemote)) {
+				mOffloadIds[i] = offloader->install(binding);
+			} else if (i == 0) {
+				break; // nothing to gain without the RTP stream
 			}
-		} else if (mBack->checkPollFd(pfd, i)) {
-			transfer(curtime, mBack, i);
+		}
+		if (mOffloadIds[0] != 0 || mOffloadIds[1] != 0) {
+			LOGD("RelaySession [%p] is offloaded to the kernel.", this);
+			mOffloadAttempts++;
+			mOffloadTime = curtime;
+			mOffloadPackets = 0;
+			mOffloadVersions[0] = front->getVersion();
+			mOffloadVersions[1] = back->getVersion();
 		}
 	}
-	mMutex.unlock();
+}
+
+void RelaySession::checkSocket(int fd, time_t curtime) {
+	const Channels &channels = getRelayChannels();
+	for (const Route &route : channels.routes) {
+		if (route.fd == fd) {
+			// Edge triggered: read until the socket is drained.
+			while (transfer(curtime, route) >= 0) {
+			}
+			return;
+		}
+	}
+	// the fd may be stale, if its channel was removed
 }
 
 RelaySession::~RelaySession() {
@@ -354,22 +885,21 @@ void RelaySession::unuse() {
 
 	mMutex.lock();
 	mUsed = false;
-	if (mFront) {
-		front.port = mFront->getLocalPort();
-		front.recv = mFront->getReceivedPackets();
-		front.sent = mFront->getSentPackets();
-	}
-	if (mBack) {
-		back.port = mBack->getLocalPort();
-		back.recv = mBack->getReceivedPackets();
-		back.sent = mBack->getSentPackets();
-	}
-	mFront.reset();
-	mBacks.clear();
-	mBack.reset();
+	shared_ptr<const Channels> channels = mChannels;
+	publishChannels(make_shared<Channels>());
 	mMutex.unlock();
+	// the kernel offload, if any, is removed by the relay thread when it drops the session
 
-	/*do not log while holding a mutex*/
+	if (channels->front) {
+		front.port = channels->front->getLocalPort();
+		front.recv = channels->front->getReceivedPackets();
+		front.sent = channels->front->getSentPackets();
+	}
+	if (channels->back) {
+		back.port = channels->back->getLocalPort();
+		back.recv = channels->back->getReceivedPackets();
+		back.sent = channels->back->getSentPackets();
+	}
 	if (front.port > 0)
 		LOGD("Front on port [%i] received [%lu] and sent [%lu] packets.", front.port, front.recv, front.sent);
 	if (back.port > 0)
@@ -377,49 +907,91 @@ void RelaySession::unuse() {
 }
 
 bool RelaySession::checkChannels() {
-	mMutex.lock();
-	for (auto itb = mBacks.begin(); itb != mBacks.end(); ++itb) {
+	shared_ptr<const Channels> channels = getChannels();
+	for (auto itb = channels->backs.begin(); itb != channels->backs.end(); ++itb) {
 		if (!(*itb).second->checkSocketsValid()) {
-			mMutex.unlock();
 			return false;
 		}
 	}
-	if (!mFront->checkSocketsValid()) {
-		mMutex.unlock();
+	if (channels->shared && !channels->shared->checkSocketsValid())
 		return false;
-	}
-	mMutex.unlock();
-	return true;
+	return channels->front && channels->front->checkSocketsValid();
 }
 
-void RelaySession::transfer(time_t curtime, const shared_ptr<RelayChannel> &chan, int i) {
-	uint8_t buf[1500];
-	const int maxsize = sizeof(buf);
-	int recv_len;
+int RelaySession::transfer(time_t curtime, const Route &route) {
+	RelayPacketBatch &batch = mServer->getPacketBatch();
+	int i = route.index;
+	int count;
 
 	mLastActivityTime = curtime;
-	recv_len = chan->recv(i, buf, maxsize);
-	if (recv_len > 0) {
-		if (chan == mFront) {
-			if (mBack) {
-				mBack->send(i, buf, recv_len);
-			} else {
-				for (auto it = mBacks.begin(); it != mBacks.end(); ++it) {
-					shared_ptr<RelayChannel> dest = (*it).second;
-					dest->send(i, buf, recv_len);
-				}
-			}
-		} else {
-			mFront->send(i, buf, recv_len);
+	count = route.in->recv(i, batch);
+	if (count > 0 && mOffloadIds[i] != 0 && curtime - mOffloadTime > sOffloadGracePeriod &&
+		mServer->getOffloader()->isInstalled(mOffloadIds[i])) {
+		// the kernel rules no longer match the stream, typically because of a new source address
+		LOGD("RelaySession [%p] stream %i is back to user space relaying.", this, i);
+		removeOffload();
+	}
+	if (count > 0) {
+		size_t bytes = 0;
+		for (int k = 0; k < count; ++k)
+			bytes += batch.length(k);
+		mServer->countRelayed(count, bytes);
+		Tenant *tenant = mTenant.load(std::memory_order_relaxed);
+		if (tenant)
+			tenant->count(tenant->relayedBytes, bytes);
+		// the RTCP of multiplexed streams come on the RTP socket
+		route.in->inspectRtcp(batch, true);
+		for (RelayChannel *out : route.outs) {
+			out->inspectRtcp(batch, false);
+			out->send(i, batch);
 		}
 	}
+	return count;
 }
 
-MediaRelayServer::MediaRelayServer(MediaRelay *module) : mModule(module) {
+MediaRelayServer::MediaRelayServer(MediaRelay *module, int minPort, int maxPort)
+	: mEpollFd(-1), mPacketsRelayed(0), mBytesRelayed(0), mBatch(new RelayPacketBatch()), mMinPort(minPort),
+	  mMaxPort(maxPort), mBindFailures(0), mActivityWheel(getCurrentTime()), mModule(module) {
 	mRunning = false;
 	if (pipe(mCtlPipe) == -1) {
 		LOGF("Could not create MediaRelayServer control pipe.");
 	}
+#if HAVE_SYS_EPOLL_H
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (mEpollFd == -1) {
+		LOGW("MediaRelayServer: epoll_create1() failed: %s, using poll()", strerror(errno));
+	} else {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = mCtlPipe[0];
+		epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mCtlPipe[0], &ev);
+	}
+#endif
+}
+
+void MediaRelayServer::watchChannel(const shared_ptr<RelaySession> &session, const shared_ptr<RelayChannel> &chan) {
+#if HAVE_SYS_EPOLL_H
+	if (mEpollFd == -1 || !chan || !chan->checkSocketsValid())
+		return;
+	for (int i = 0; i < 2; ++i) {
+		int fd = chan->getSocket(i);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		// queued before the registration, so that the relay thread knows the fd when its first event comes
+		mMutex.lock();
+		mPendingFds.push_back(make_pair(fd, weak_ptr<RelaySession>(session)));
+		mMutex.unlock();
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.fd = fd;
+		// closed sockets leave the epoll set by themselves, a reused fd may still be known though
+		if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+			(errno != EEXIST || epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+			LOGE("MediaRelayServer: cannot watch socket %i: %s", fd, strerror(errno));
+		}
+	}
+#endif
 }
 
 Agent *MediaRelayServer::getAgent() {
@@ -427,12 +999,133 @@ Agent *MediaRelayServer::getAgent() {
 }
 
 RtpSession *MediaRelayServer::createRtpSession(const std::string &bindIp) {
+	if (mModule->mPortPoolHigh > 0) {
+		mPoolMutex.lock();
+		// also makes the bind address known to refillPool()
+		deque<RtpSession *> &pool = mPool[bindIp];
+		if (!pool.empty()) {
+			RtpSession *session = pool.front();
+			pool.pop_front();
+			mPoolMutex.unlock();
+			return session;
+		}
+		mPoolMutex.unlock();
+		++*mModule->mCountPortPoolExhausted;
+	}
+	return bindRtpSession(bindIp);
+}
+
+void MediaRelayServer::releaseRtpSession(RtpSession *session, const std::string &bindIp) {
+	int sockets[2] = {rtp_session_get_rtp_socket(session), rtp_session_get_rtcp_socket(session)};
+	bool valid = sockets[0] != -1 && sockets[1] != -1;
+#if HAVE_SYS_EPOLL_H
+	if (mEpollFd != -1 && valid) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(mEpollFd, EPOLL_CTL_DEL, sockets[0], &ev);
+		epoll_ctl(mEpollFd, EPOLL_CTL_DEL, sockets[1], &ev);
+	}
+#endif
+	if (mModule->mPortPoolHigh > 0 && valid) {
+		// the packets still in flight for the previous call must not reach the next one
+		uint8_t buf[RelayPacketBatch::sMaxPacketSize];
+		for (int i = 0; i < 2; ++i) {
+			while (recv(sockets[i], buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+			}
+		}
+		mPoolMutex.lock();
+		deque<RtpSession *> &pool = mPool[bindIp];
+		if (pool.size() < (size_t)mModule->mPortPoolHigh) {
+			pool.push_back(session);
+			session = NULL;
+		}
+		mPoolMutex.unlock();
+	}
+	if (session)
+		destroyRtpSession(session, bindIp);
+}
+
+void MediaRelayServer::destroyRtpSession(RtpSession *session, const std::string &bindIp) {
+	int port = rtp_session_get_local_port(session);
+	rtp_session_destroy(session);
+	if (port > 0)
+		getPortAllocator(bindIp).release(port);
+}
+
+PortAllocator &MediaRelayServer::getPortAllocator(const std::string &bindIp) {
+	mPoolMutex.lock();
+	unique_ptr<PortAllocator> &ports = mPorts[bindIp];
+	if (!ports)
+		ports.reset(new PortAllocator(mMinPort, mMaxPort));
+	PortAllocator &ret = *ports;
+	mPoolMutex.unlock();
+	return ret;
+}
+
+size_t MediaRelayServer::getPortsUsed() {
+	size_t count = 0;
+	mPoolMutex.lock();
+	for (auto it = mPorts.begin(); it != mPorts.end(); ++it)
+		count += it->second->getUsed();
+	mPoolMutex.unlock();
+	return count;
+}
+
+size_t MediaRelayServer::getPoolAvailable() {
+	size_t count = 0;
+	mPoolMutex.lock();
+	for (auto it = mPool.begin(); it != mPool.end(); ++it) {
+		count += it->second.size();
+	}
+	mPoolMutex.unlock();
+	return count;
+}
+
+/* Tops the pool of each bind address up to the high watermark once it went below the low one. Called by the relay
+ * thread, so that the binding cost stays out of call setup. */
+void MediaRelayServer::refillPool() {
+	if (mModule->mPortPoolHigh <= 0)
+		return;
+	list<pair<string, size_t>> missing;
+	mPoolMutex.lock();
+	for (auto it = mPool.begin(); it != mPool.end(); ++it) {
+		if (it->second.size() < (size_t)mModule->mPortPoolLow)
+			missing.push_back(make_pair(it->first, mModule->mPortPoolHigh - it->second.size()));
+	}
+	mPoolMutex.unlock();
+	for (auto it = missing.begin(); it != missing.end(); ++it) {
+		for (size_t i = 0; i < it->second; ++i) {
+			RtpSession *session = bindRtpSession(it->first);
+			if (rtp_session_get_rtp_socket(session) == -1) {
+				destroyRtpSession(session, it->first);
+				break;
+			}
+			mPoolMutex.lock();
+			mPool[it->first].push_back(session);
+			mPoolMutex.unlock();
+		}
+	}
+}
+
+/* The ports come from the allocator of the bind address, a port still being bound by another process only being
+ * skipped. */
+RtpSession *MediaRelayServer::bindRtpSession(const std::string &bindIp, int fixedPort) {
 	RtpSession *session = rtp_session_new(RTP_SESSION_SENDRECV);
 #if ORTP_HAS_REUSEADDR
 	rtp_session_set_reuseaddr(session, FALSE);
 #endif
-	for (int i = 0; i < 100; ++i) {
-		int port = ((rand() % (mModule->mMaxPort - mModule->mMinPort)) + mModule->mMinPort) & 0xfffe;
+	PortAllocator &ports = getPortAllocator(bindIp);
+	for (int i = 0; i < (fixedPort > 0 ? 1 : 100); ++i) {
+		int port = fixedPort;
+		bool allocated;
+		if (fixedPort > 0) {
+			allocated = ports.reserve(fixedPort);
+		} else {
+			port = ports.allocate();
+			if (port == -1)
+				break;
+			allocated = true;
+		}
 
 #if ORTP_ABI_VERSION >= 9
 		if (rtp_session_set_local_addr(session, bindIp.c_str(), port, port + 1) == 0) {
@@ -441,12 +1134,27 @@ RtpSession *MediaRelayServer::createRtpSession(const std::string &bindIp) {
 #endif
 			return session;
 		}
+		mBindFailures.fetch_add(1, memory_order_relaxed);
+		if (allocated)
+			ports.release(port);
 	}
 
-	LOGE("Could not find a random port on interface %s !", bindIp.c_str());
+	if (fixedPort > 0)
+		LOGE("Could not bind port %i on interface %s !", fixedPort, bindIp.c_str());
+	else
+		LOGE("Could not find a free port on interface %s, %zu pairs of [%i, %i] in use !", bindIp.c_str(),
+			 ports.getUsed(), mMinPort, mMaxPort);
 	return session;
 }
 
+chrono::nanoseconds MediaRelayServer::getCpuTime() const {
+	clockid_t clock;
+	struct timespec ts;
+	if (!mRunning || pthread_getcpuclockid(mThread, &clock) != 0 || clock_gettime(clock, &ts) != 0)
+		return chrono::nanoseconds(0);
+	return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+}
+
 void MediaRelayServer::start() {
 	mRunning = true;
 	pthread_create(&mThread, NULL, &MediaRelayServer::threadFunc, this);
@@ -459,23 +1167,59 @@ MediaRelayServer::~MediaRelayServer() {
 			LOGE("MediaRelayServer: Fail to write to control pipe.");
 		pthread_join(mThread, NULL);
 	}
+	mPendingSessions.clear();
+	mInactiveSessions.clear();
 	mSessions.clear();
 	close(mCtlPipe[0]);
 	close(mCtlPipe[1]);
+	if (mEpollFd != -1)
+		close(mEpollFd);
+	for (auto it = mPool.begin(); it != mPool.end(); ++it) {
+		for (auto session = it->second.begin(); session != it->second.end(); ++session) {
+			rtp_session_destroy(*session);
+		}
+	}
 }
 
 shared_ptr<RelaySession> MediaRelayServer::createSession(const std::string &frontId,
 														 const std::pair<std::string, std::string> &frontRelayIps) {
 	shared_ptr<RelaySession> s = make_shared<RelaySession>(this, frontId, frontRelayIps);
+	s->setInactivityTimeout(mModule->mInactivityPeriod);
+	addSession(s);
+	return s;
+}
+
+void MediaRelayServer::addSession(const shared_ptr<RelaySession> &s) {
+	// the session list belongs to the relay thread, which takes the new session at its next wakeup
 	mMutex.lock();
-	mSessions.push_back(s);
+	mPendingSessions.push_back(s);
 	mMutex.unlock();
+	watchChannel(s, s->getFrontChannel());
 	if (!mRunning)
 		start();
 
-	LOGD("There are now %zu relay sessions running on MediaRelayServer [%p]", mSessions.size(), this);
 	/*write to the control pipe to wakeup the server thread */
 	update();
+}
+
+shared_ptr<RelaySession> MediaRelayServer::createReplicaSession(const RelayReplicator::Session &state) {
+	// the front id only has to differ from the empty party id used to find the branches
+	shared_ptr<RelaySession> s = make_shared<RelaySession>(
+		this, "replica", make_pair(state.front.localIp, state.front.bindIp), state.front.localPort);
+	// the peer refreshes the sessions it still has
+	s->setInactivityTimeout(3 * RelayReplicator::sRefreshPeriod);
+	s->setReplicaId(state.id);
+	addSession(s);
+	shared_ptr<RelayChannel> back =
+		s->createBranch("", make_pair(state.back.localIp, state.back.bindIp), false, state.back.localPort);
+	if (!s->getFrontChannel()->checkSocketsValid() || !back->checkSocketsValid()) {
+		s->unuse();
+		return nullptr;
+	}
+	s->getFrontChannel()->setRemoteAddr(state.front.remoteIp, state.front.remotePort, (RelayChannel::Dir)state.front.dir);
+	back->setRemoteAddr(state.back.remoteIp, state.back.remotePort, (RelayChannel::Dir)state.back.dir);
+	s->setEstablished("");
+	update();
 	return s;
 }
 
@@ -516,21 +1260,165 @@ static void set_high_prio() {
 	}
 }
 
+/* Takes the sessions and sockets queued by the SIP thread. */
+void MediaRelayServer::applyPendingChanges() {
+	list<shared_ptr<RelaySession>> sessions;
+	list<pair<int, weak_ptr<RelaySession>>> fds;
+	mMutex.lock();
+	sessions.swap(mPendingSessions);
+	fds.swap(mPendingFds);
+	mMutex.unlock();
+	if (!sessions.empty()) {
+		time_t curtime = getCurrentTime();
+		for (auto it = sessions.begin(); it != sessions.end(); ++it)
+			mActivityWheel.schedule(curtime + (*it)->getInactivityTimeout(), *it);
+		mSessions.splice(mSessions.end(), sessions);
+		LOGD("There are now %zu relay sessions running on MediaRelayServer [%p]", mSessions.size(), this);
+	}
+	for (auto it = fds.begin(); it != fds.end(); ++it) {
+		mFdSessions[it->first] = it->second;
+	}
+}
+
+void MediaRelayServer::removeUnusedSessions() {
+	size_t count = mSessions.size();
+	for (auto it = mSessions.begin(); it != mSessions.end();) {
+		if (!(*it)->isUsed()) {
+			(*it)->removeOffload();
+			it = mSessions.erase(it);
+		} else {
+			++it;
+		}
+	}
+	if (mSessions.size() != count) {
+		// drop the fds of the destroyed sessions
+		for (auto it = mFdSessions.begin(); it != mFdSessions.end();) {
+			if (it->second.expired())
+				it = mFdSessions.erase(it);
+			else
+				++it;
+		}
+		LOGD("There are now %i relay sessions running.", (int)mSessions.size());
+	}
+}
+
+/* The packets only update the activity time of their session: the session is scheduled again on the wheel when its
+ * entry fires, from the last activity, so that the wheel costs nothing per packet and an entry per timeout for the
+ * active sessions. Those inactive are reported again each timeout until the module ends them. */
+void MediaRelayServer::checkInactivity(time_t curtime) {
+	list<shared_ptr<RelaySession>> inactive;
+	mActivityWheel.advance(curtime, [this, curtime, &inactive](const weak_ptr<RelaySession> &entry, time_t when) {
+		shared_ptr<RelaySession> session = entry.lock();
+		if (!session || !session->isUsed())
+			return;
+		time_t deadline = session->getLastActivityTime() + session->getInactivityTimeout();
+		if (deadline <= curtime) {
+			inactive.push_back(session);
+			deadline = curtime + session->getInactivityTimeout();
+		}
+		mActivityWheel.schedule(deadline, session);
+	});
+	if (!inactive.empty()) {
+		mMutex.lock();
+		mInactiveSessions.splice(mInactiveSessions.end(), inactive);
+		mMutex.unlock();
+	}
+}
+
+list<shared_ptr<RelaySession>> MediaRelayServer::takeInactiveSessions() {
+	list<shared_ptr<RelaySession>> sessions;
+	mMutex.lock();
+	sessions.swap(mInactiveSessions);
+	mMutex.unlock();
+	return sessions;
+}
+
+void MediaRelayServer::checkOffloads(time_t curtime) {
+	if (!getOffloader())
+		return;
+	for (auto it = mSessions.begin(); it != mSessions.end(); ++it) {
+		(*it)->checkOffload(curtime);
+	}
+}
+
+#if HAVE_SYS_EPOLL_H
+/* The sockets stay registered in the epoll set as long as they exist, so an iteration only costs the sockets which
+ * actually received packets. */
+void MediaRelayServer::runEpoll() {
+	const int maxEvents = 256;
+	struct epoll_event events[maxEvents];
+	vector<pair<shared_ptr<RelaySession>, int>> ready;
+	time_t lastCleanup = 0;
+
+	while (mRunning) {
+		int count = epoll_wait(mEpollFd, events, maxEvents, 1000);
+		if (count == -1) {
+			if (errno != EINTR)
+				LOGE("MediaRelayServer: epoll_wait() failed: %s", strerror(errno));
+			continue;
+		}
+		bool wakeup = false;
+		ready.clear();
+		applyPendingChanges();
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == mCtlPipe[0]) {
+				wakeup = true;
+				continue;
+			}
+			auto it = mFdSessions.find(fd);
+			shared_ptr<RelaySession> session = it != mFdSessions.end() ? it->second.lock() : nullptr;
+			if (session && session->isUsed())
+				ready.push_back(make_pair(session, fd));
+		}
+
+		if (wakeup) {
+			char tmp;
+			if (read(mCtlPipe[0], &tmp, 1) == -1) {
+				LOGE("Fail to read from control pipe.");
+			}
+		}
+		time_t curtime = getCurrentTime();
+		for (auto it = ready.begin(); it != ready.end(); ++it) {
+			it->first->checkSocket(it->second, curtime);
+		}
+		ready.clear();
+		if (wakeup || curtime != lastCleanup) {
+			if (curtime != lastCleanup) {
+				checkOffloads(curtime);
+				checkInactivity(curtime);
+				refillPool();
+			}
+			lastCleanup = curtime;
+			removeUnusedSessions();
+		}
+	}
+}
+#endif
+
 void MediaRelayServer::run() {
 	PollFd pfd(512);
 	int ctl_index;
 	int err;
 
+	time_t lastCheck = 0;
+
+	ThreadPlacement::placeCurrentThread(ThreadPlacement::Relay);
 	set_high_prio();
+#if HAVE_SYS_EPOLL_H
+	if (mEpollFd != -1) {
+		runEpoll();
+		return;
+	}
+#endif
 	while (mRunning) {
 		pfd.reset();
+		applyPendingChanges();
 		// fill the pollfd table
-		mMutex.lock();
 		for (auto it = mSessions.begin(); it != mSessions.end(); ++it) {
 			if ((*it)->isUsed())
 				(*it)->fillPollFd(&pfd);
 		}
-		mMutex.unlock();
 
 		ctl_index = pfd.addFd(mCtlPipe[0], POLLIN);
 
@@ -544,9 +1432,9 @@ void MediaRelayServer::run() {
 				}
 			}
 			time_t curtime = getCurrentTime();
-			mMutex.lock();
 			for (auto it = mSessions.begin(); it != mSessions.end();) {
 				if (!(*it)->isUsed()) {
+					(*it)->removeOffload();
 					it = mSessions.erase(it);
 					LOGD("There are now %i relay sessions running.", (int)mSessions.size());
 				} else {
@@ -554,7 +1442,13 @@ void MediaRelayServer::run() {
 					++it;
 				}
 			}
-			mMutex.unlock();
+		}
+		time_t curtime = getCurrentTime();
+		if (curtime != lastCheck) {
+			lastCheck = curtime;
+			checkOffloads(curtime);
+			checkInactivity(curtime);
+			refillPool();
 		}
 	}
 }
@@ -23,7 +23,18 @@
 #include "agent.hh"
 #include "callstore.hh"
 #include "sdp-modifier.hh"
+#include "mediarelay-offload.hh"
+#include "mediarelay-replication.hh"
+#include "utils/memorystats.hh"
+#include "utils/portallocator.hh"
+#include "utils/timerwheel.hh"
+#include "tenantstats.hh"
 #include <ortp/rtpsession.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <set>
+#include <unordered_map>
 
 class RelayedCall;
 class MediaRelayServer;
@@ -40,6 +51,7 @@ class MediaRelay : public Module, protected ModuleToolbox {
 	virtual void onRequest(std::shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(std::shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 	virtual void onIdle();
+	virtual void onSweep(SweepBudget &budget);
 
   protected:
 	virtual void onDeclare(GenericStruct *mc);
@@ -51,12 +63,24 @@ class MediaRelay : public Module, protected ModuleToolbox {
 	void processResponseWithSDP(const std::shared_ptr<RelayedCall> &c, const std::shared_ptr<OutgoingTransaction> &transaction,
 								const std::shared_ptr<MsgSip> &msgSip);
 	void configureContext(std::shared_ptr<RelayedCall> &c);
+	/* Records the reception quality of the streams of a call ending, and logs its summary. */
+	void reportQuality(const std::shared_ptr<RelayedCall> &c, const sip_t *sip);
+	/* Sends the state of the established sessions of a call to the replication peer. */
+	void replicate(const std::shared_ptr<RelayedCall> &c);
+	void onReplicaUpdate(const RelayReplicator::Session &state);
+	void onReplicaRemove(uint64_t id);
+	/* Ends the calls and drops the replicas whose sessions the relay threads found inactive, unless their signaling
+	 * or their other sessions are still active. */
+	void removeInactiveSessions();
 	CallStore *mCalls;
 	std::vector<std::shared_ptr<MediaRelayServer>> mServers;
 	size_t mCurServer;
 	std::string mSdpMangledParam;
 	int mH264FilteringBandwidth;
 	bool mH264DecimOnlyIfLastProxy;
+	bool mVideoThinning;
+	int mVideoThinningMaxBitrate;
+	int mVideoThinningLossThreshold;
 
 	StatCounter64 *mCountCalls;
 	StatCounter64 *mCountCallsFinished;
@@ -64,16 +88,141 @@ class MediaRelay : public Module, protected ModuleToolbox {
 	int mMaxCalls;
 	int mMinPort, mMaxPort;
 	int mMaxRelayedEarlyMedia;
+	int mRelayThreads;
+	int mPortPoolLow, mPortPoolHigh;
 	time_t mInactivityPeriod;
+	StatCounter64 *mCountRelayedPackets;
+	StatCounter64 *mCountRelayedBytes;
+	StatCounter64 *mCountOffloadedStreams;
+	StatCounter64 *mCountPortPoolExhausted;
+	StatCounter64 *mCountPortPoolAvailable;
+	StatCounter64 *mCountPortsUsed;
+	StatCounter64 *mCountPortBindFailures;
+	StatCounter64 *mCountRelayBusy;
+	/* CPU time of each relay thread at the previous onIdle(), for their busy ratio */
+	std::vector<std::chrono::nanoseconds> mRelayCpuTimes;
+	std::chrono::steady_clock::time_point mRelayCpuCheck;
+	/* reception quality of the ended streams: loss in per mille, jitter and round trip time in microseconds */
+	LatencyHistogram mLossHistogram;
+	LatencyHistogram mJitterHistogram;
+	LatencyHistogram mRttHistogram;
+	StatCounter64 *mCountLossP50;
+	StatCounter64 *mCountLossP99;
+	StatCounter64 *mCountJitterP50;
+	StatCounter64 *mCountJitterP99;
+	StatCounter64 *mCountRttP50;
+	StatCounter64 *mCountRttP99;
+	std::shared_ptr<RelayOffloader> mOffloader;
+	/* sessions of the replication peer, ready to relay for it */
+	struct Replica {
+		std::shared_ptr<RelaySession> session;
+		RelayReplicator::Session state;
+		time_t refreshed;
+	};
+	std::unique_ptr<RelayReplicator> mReplicator;
+	std::map<uint64_t, Replica> mReplicas;
+	size_t mCurReplicaServer;
 	bool mDropTelephoneEvent;
 	bool mByeOrphanDialogs;
 	bool mEarlyMediaRelaySingle;
+	bool mShareBranchPorts;
 	bool mPreventLoop;
 	bool mForceRelayForNonIceTargets;
 	static ModuleInfo<MediaRelay> sInfo;
 };
 
 class RelaySession;
+
+/*
+ * What the media filters look at in an RTP packet, decoded once per packet rather than by each filter.
+ */
+struct RtpPacketInfo {
+	static RtpPacketInfo decode(const uint8_t *data, size_t size);
+	bool isRtp() const {
+		return payloadOffset != 0;
+	}
+	uint32_t timestamp;
+	uint32_t ssrc;
+	uint16_t payloadOffset; // past the CSRCs and the header extension, 0 if not an RTP packet
+	uint8_t payloadType;
+	bool marker;
+	// H264 NAL unit type of the payload, that of the fragmented unit for a FU-A; meaningless for other codecs
+	uint8_t nalType;
+	// nal_ref_idc of the NAL unit, 0 when no other frame refers to it
+	uint8_t nalRefIdc;
+};
+
+/*
+ * A report block of an RTCP SR or RR forwarded by the relay, about the reception of one stream by the sender of the
+ * report.
+ */
+struct RtcpReportBlock {
+	/* Whether the packet is RTCP rather than RTP, be the streams multiplexed or not. */
+	static bool isRtcp(const uint8_t *data, size_t size);
+	/* Decodes up to max report blocks of a compound packet and returns their number. srNtp is set to the middle 32 bits
+	 * of the NTP timestamp of its SR, 0 if there is none. */
+	static int decode(const uint8_t *data, size_t size, RtcpReportBlock *blocks, int max, uint32_t *srNtp);
+	uint32_t ssrc;
+	uint8_t fractionLost; // in 1/256
+	uint32_t jitter; // in timestamp units
+	uint32_t lsr;
+	uint32_t dlsr; // in 1/65536 seconds
+};
+
+/*
+ * The packets read from a socket in one go. Packets dropped by the channel or its filter stay in the batch and are
+ * only marked as not kept.
+ */
+class RelayPacketBatch {
+  public:
+	static const int sMaxPackets = 32;
+	static const size_t sMaxPacketSize = 1500;
+
+	RelayPacketBatch() : mCount(0), mClassified(0) {
+	}
+	int size() const {
+		return mCount;
+	}
+	uint8_t *data(int k) {
+		return mBuffers[k];
+	}
+	size_t length(int k) const {
+		return mLengths[k];
+	}
+	bool isKept(int k) const {
+		return mKept[k];
+	}
+	void drop(int k) {
+		mKept[k] = false;
+	}
+	/* RTP header of packet k, the packets pushed since the last call being decoded together. */
+	const RtpPacketInfo &info(int k) {
+		if (mClassified < mCount)
+			classify();
+		return mInfos[k];
+	}
+	void clear() {
+		mCount = 0;
+		mClassified = 0;
+	}
+	/* Registers the packet just written in the buffer of index size(). */
+	void push(size_t length) {
+		mLengths[mCount] = length;
+		mKept[mCount] = true;
+		++mCount;
+	}
+
+  private:
+	void classify();
+
+	uint8_t mBuffers[sMaxPackets][sMaxPacketSize];
+	size_t mLengths[sMaxPackets];
+	bool mKept[sMaxPackets];
+	RtpPacketInfo mInfos[sMaxPackets];
+	int mCount;
+	int mClassified;
+};
+
 class MediaRelay;
 
 class PollFd {
@@ -100,24 +249,94 @@ class MediaRelayServer {
 	friend class RelayedCall;
 
   public:
-	MediaRelayServer(MediaRelay *module);
+	/* The RTP ports of its channels are taken from [minPort, maxPort], its share of the range of the module. */
+	MediaRelayServer(MediaRelay *module, int minPort, int maxPort);
 	~MediaRelayServer();
 	std::shared_ptr<RelaySession> createSession(const std::string &frontId,
 												const std::pair<std::string, std::string> &frontRelayIps);
+	/* Binds the ports of an established session of the replication peer, and relays for it once packets come. */
+	std::shared_ptr<RelaySession> createReplicaSession(const RelayReplicator::Session &state);
 	void update();
 	Agent *getAgent();
+	/* Takes a bound RtpSession from the pool, or binds a new one if the pool is empty. */
 	RtpSession *createRtpSession(const std::string &bindIp);
+	/* Gives the RtpSession of a destroyed channel back to the pool. */
+	void releaseRtpSession(RtpSession *session, const std::string &bindIp);
+	/* Destroys the RtpSession and frees its ports. */
+	void destroyRtpSession(RtpSession *session, const std::string &bindIp);
+	size_t getPoolAvailable();
+	/* Port pairs bound by the relay thread, over all its bind addresses. */
+	size_t getPortsUsed();
+	uint64_t getBindFailures() const {
+		return mBindFailures.load(std::memory_order_relaxed);
+	}
+	/* CPU time used by the relay thread so far. */
+	std::chrono::nanoseconds getCpuTime() const;
 	void enableLoopPrevention(bool val);
 	bool loopPreventionEnabled() const {
 		return mModule->mPreventLoop;
 	}
+	/* NULL unless kernel offload is enabled. */
+	RelayOffloader *getOffloader() const {
+		return mModule->mOffloader.get();
+	}
+	/* Registers the sockets of a channel of the session for the lifetime of the channel. */
+	void watchChannel(const std::shared_ptr<RelaySession> &session, const std::shared_ptr<RelayChannel> &chan);
+	/* The sessions found without packets for their inactivity timeout since the last call. SIP thread. */
+	std::list<std::shared_ptr<RelaySession>> takeInactiveSessions();
+	/* Counts packets received by the relay thread. */
+	void countRelayed(size_t packets, size_t bytes) {
+		mPacketsRelayed.fetch_add(packets, std::memory_order_relaxed);
+		mBytesRelayed.fetch_add(bytes, std::memory_order_relaxed);
+	}
+	/* Packet buffers of the relay thread, only to be used from it. */
+	RelayPacketBatch &getPacketBatch() {
+		return *mBatch;
+	}
+	uint64_t getRelayedPackets() const {
+		return mPacketsRelayed.load(std::memory_order_relaxed);
+	}
+	uint64_t getRelayedBytes() const {
+		return mBytesRelayed.load(std::memory_order_relaxed);
+	}
 
   private:
 	void start();
 	void run();
+	void runEpoll();
+	void applyPendingChanges();
+	void removeUnusedSessions();
+	void checkOffloads(time_t curtime);
+	void checkInactivity(time_t curtime);
+	/* Binds a random port of the configured range unless port is given. */
+	RtpSession *bindRtpSession(const std::string &bindIp, int port = 0);
+	void addSession(const std::shared_ptr<RelaySession> &s);
+	void refillPool();
 	static void *threadFunc(void *arg);
+	/* Only protects the queues filled by the SIP thread, it is never held while relaying. */
 	Mutex mMutex;
+	std::list<std::shared_ptr<RelaySession>> mPendingSessions;
+	std::list<std::pair<int, std::weak_ptr<RelaySession>>> mPendingFds;
+	std::list<std::shared_ptr<RelaySession>> mInactiveSessions;
+	/* Owned by the relay thread. */
 	std::list<std::shared_ptr<RelaySession>> mSessions;
+	/* the sessions by the time they become inactive unless packets come, pushed back when they come */
+	TimerWheel<std::weak_ptr<RelaySession>> mActivityWheel;
+	/* epoll engine: the sockets are registered once, and events are mapped back to their session by fd */
+	int mEpollFd;
+	std::unordered_map<int, std::weak_ptr<RelaySession>> mFdSessions;
+	std::atomic<uint64_t> mPacketsRelayed;
+	std::atomic<uint64_t> mBytesRelayed;
+	std::unique_ptr<RelayPacketBatch> mBatch;
+	PortAllocator &getPortAllocator(const std::string &bindIp);
+	/* pre-bound RtpSessions, per bind address, taken from the front and recycled at the back */
+	Mutex mPoolMutex;
+	std::map<std::string, std::deque<RtpSession *>> mPool;
+	/* the ports of the partition of the relay thread, per bind address, also under mPoolMutex */
+	int mMinPort;
+	int mMaxPort;
+	std::map<std::string, std::unique_ptr<PortAllocator>> mPorts;
+	std::atomic<uint64_t> mBindFailures;
 	MediaRelay *mModule;
 	pthread_t mThread;
 	int mCtlPipe[2];
@@ -127,6 +346,22 @@ class MediaRelayServer {
 
 class RelayChannel;
 
+/*
+ * What the RTCP reports received from the remote party of a channel tell about the stream the relay sends to it.
+ */
+struct RelayChannelQuality {
+	RelayChannelQuality()
+		: reports(0), lossSum(0), maxLoss(0), jitterSum(0), maxJitter(0), rttSum(0), rttCount(0) {
+	}
+	unsigned int reports;
+	uint64_t lossSum; // fractions lost, in 1/256
+	unsigned int maxLoss;
+	uint64_t jitterSum; // in microseconds
+	uint64_t maxJitter;
+	uint64_t rttSum; // between the relay and the remote party, in microseconds
+	unsigned int rttCount;
+};
+
 /**
  * The RelaySession holds context for relaying for a single media stream, RTP and RTCP included.
  * It has one front channel (the one to communicate with the party that generated the SDP offer,
@@ -136,14 +371,21 @@ class RelayChannel;
  * When the call is established, a single back channel remains active, the one corresponding to the party that took the
  *call.
 **/
-class RelaySession : public std::enable_shared_from_this<RelaySession> {
+class RelaySession : public std::enable_shared_from_this<RelaySession>,
+					 public CountedObject<ObjectCounter::RelaySessions> {
   public:
 	RelaySession(MediaRelayServer *server, const std::string &frontId,
-				 const std::pair<std::string, std::string> &frontRelayIps);
+				 const std::pair<std::string, std::string> &frontRelayIps, int frontPort = 0);
 	~RelaySession();
 
 	void fillPollFd(PollFd *pfd);
 	void checkPollFd(const PollFd *pfd, time_t curtime);
+	/* Relays all the packets pending on the socket, which must belong to one of the channels of the session. */
+	void checkSocket(int fd, time_t curtime);
+	/* Moves the established stream to the kernel when possible, and follows the activity of offloaded ones. */
+	void checkOffload(time_t curtime);
+	/* Relay thread only. */
+	void removeOffload();
 	void unuse();
 	int getActiveBranchesCount();
 
@@ -154,12 +396,47 @@ class RelaySession : public std::enable_shared_from_this<RelaySession> {
 	time_t getLastActivityTime() const {
 		return mLastActivityTime;
 	}
+	/* Seconds without packets after which the relay thread reports the session as inactive. Set before the session is
+	 * given to the relay thread. */
+	void setInactivityTimeout(time_t timeout) {
+		mInactivityTimeout = timeout;
+	}
+	time_t getInactivityTimeout() const {
+		return mInactivityTimeout;
+	}
+	/* The call the session relays for, unset for the sessions of the replication peer. SIP thread. */
+	void setCall(const std::weak_ptr<CallContextBase> &call) {
+		mCall = call;
+	}
+	std::shared_ptr<CallContextBase> getCall() const {
+		return mCall.lock();
+	}
+	/* Id of the session of the replication peer, 0 for the others. */
+	void setReplicaId(uint64_t id) {
+		mReplicaId = id;
+	}
+	uint64_t getReplicaId() const {
+		return mReplicaId;
+	}
+	/* Domain the relayed bytes are accounted to, read by the relay thread. */
+	void setTenant(Tenant *tenant) {
+		mTenant.store(tenant, std::memory_order_relaxed);
+	}
 
 	/**
 	 * Called each time an INVITE is forked
 	 */
 	std::shared_ptr<RelayChannel> createBranch(const std::string &trId,
-				 const std::pair<std::string, std::string> &relayIps, bool hasMultipleTargets);
+				 const std::pair<std::string, std::string> &relayIps, bool hasMultipleTargets, int port = 0);
+	/**
+	 * Same as createBranch(), but the branches forked through the same relay addresses are all offered the ports of a
+	 * single channel. It is lent to the first branch answering with SDP, and goes to the branch the call is
+	 * established with.
+	 */
+	std::shared_ptr<RelayChannel> createSharedBranch(const std::string &trId,
+				 const std::pair<std::string, std::string> &relayIps);
+	/* Whether the answer of the party may set the destination of its channel, lending the shared one if available. */
+	bool claimChannel(const std::string &partyId, const std::string &trId);
 	void removeBranch(const std::string &trId);
 
 	/**
@@ -168,37 +445,95 @@ class RelaySession : public std::enable_shared_from_this<RelaySession> {
 	void setEstablished(const std::string &tr_id);
 
 	std::shared_ptr<RelayChannel> getChannel(const std::string &partyId, const std::string &trId);
+	std::shared_ptr<RelayChannel> getFrontChannel() const {
+		return getChannels()->front;
+	}
 
 	MediaRelayServer *getRelayServer() {
 		return mServer;
 	}
 	bool checkChannels();
+	/* Reception quality of the channels of the session, the front channel first. */
+	std::vector<std::pair<bool, RelayChannelQuality>> getQuality() const;
+	/* What the replication peer needs to take the session over, false until it is established. */
+	bool getReplicaState(RelayReplicator::Session &state) const;
 
   private:
-	void transfer(time_t current, const std::shared_ptr<RelayChannel> &org, int i);
+	/*
+	 * The channels are never modified in place: the SIP thread publishes a new copy, and the relay thread works on
+	 * the copy it loaded, so that neither waits for the other.
+	 */
+	/* Where the packets received on a socket of a channel are sent, the channels being held by the snapshot. */
+	struct Route {
+		int fd;
+		int index; // 0 for RTP, 1 for RTCP
+		RelayChannel *in;
+		std::vector<RelayChannel *> outs;
+	};
+	struct Channels {
+		std::shared_ptr<RelayChannel> front;
+		std::map<std::string, std::shared_ptr<RelayChannel>> backs;
+		std::shared_ptr<RelayChannel> back;
+		/* channel offered to several branches, and the branch whose answer gave its destination */
+		std::shared_ptr<RelayChannel> shared;
+		std::set<std::string> sharedIds;
+		std::string sharedOwner;
+		/* flattened from the above when published, all the relay thread looks at */
+		std::vector<Route> routes;
+		void buildRoutes();
+	};
+	std::shared_ptr<const Channels> getChannels() const;
+	std::shared_ptr<Channels> copyChannels() const;
+	void publishChannels(const std::shared_ptr<Channels> &channels);
+	/* The channels as last loaded by the relay thread, loaded again only once others are published. */
+	const Channels &getRelayChannels();
+	int transfer(time_t current, const Route &route);
+	/* Serializes the updates of the channels, the relay thread never takes it. */
 	Mutex mMutex;
 	MediaRelayServer *mServer;
-	time_t mLastActivityTime;
+	std::atomic<time_t> mLastActivityTime;
 	std::string mFrontId;
-	std::shared_ptr<RelayChannel> mFront;
-	std::map<std::string, std::shared_ptr<RelayChannel>> mBacks;
-	std::shared_ptr<RelayChannel> mBack;
-	bool_t mUsed;
+	std::shared_ptr<const Channels> mChannels;
+	std::atomic<uint32_t> mChannelsVersion;
+	/* relay thread only */
+	std::shared_ptr<const Channels> mRelayChannels;
+	uint32_t mRelayChannelsVersion;
+	std::atomic<bool> mUsed;
+	time_t mInactivityTimeout;
+	std::weak_ptr<CallContextBase> mCall;
+	uint64_t mReplicaId;
+	std::atomic<Tenant *> mTenant;
+	/* kernel offload of the RTP and RTCP streams, 0 when not offloaded */
+	uint64_t mOffloadIds[2];
+	uint32_t mOffloadVersions[2];
+	uint64_t mOffloadPackets;
+	time_t mOffloadTime;
+	int mOffloadAttempts;
 };
 
 class MediaFilter {
   public:
+	virtual ~MediaFilter() {
+	}
 	/// Should return false if the incoming packet must not be transfered.
 	virtual bool onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) = 0;
 	/// Should return false if the packet output must not be sent.
 	virtual bool onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) = 0;
+	/// Drops from the batch the incoming packets that must not be transfered.
+	/// The default implementation calls onIncomingTransfer() for each kept packet.
+	virtual void onIncomingBatch(RelayPacketBatch &batch, const sockaddr *addr, socklen_t addrlen);
+	/// Sets selected[k] to false for the kept packets of the batch that must not be sent.
+	/// The default implementation calls onOutgoingTransfer() for each selected packet.
+	virtual void onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr, socklen_t addrlen);
 };
 
 class RelayChannel : public SdpMasqueradeContext{
   public:
 	enum Dir { SendOnly, SendRecv, Inactive };
 
-	RelayChannel(RelaySession *relaySession, const std::pair<std::string, std::string> &relayIps, bool preventLoops);
+	/* Takes its ports from the pool of the relay server, unless the port of the pair to bind is given. */
+	RelayChannel(RelaySession *relaySession, const std::pair<std::string, std::string> &relayIps, bool preventLoops,
+				 int port = 0);
 	~RelayChannel();
 	bool checkSocketsValid();
 	void setRemoteAddr(const std::string &ip, int port, Dir dir);
@@ -211,11 +546,25 @@ class RelayChannel : public SdpMasqueradeContext{
 	const std::string &getLocalIp() const {
 		return mLocalIp;
 	}
+	const std::string &getBindIp() const {
+		return mBindIp;
+	}
+	Dir getDir() const {
+		return mDir;
+	}
 	int getLocalPort() const {
 		return rtp_session_get_local_port(mSession);
 	}
+	int getSocket(int i) const {
+		return mSockets[i];
+	}
 	int recv(int i, uint8_t *buf, size_t size);
 	int send(int i, uint8_t *buf, size_t size);
+	/* Reads the packets pending on socket i, up to the capacity of the batch. Returns the number of packets read, or
+	 * -1 if none could be read. */
+	int recv(int i, RelayPacketBatch &batch);
+	/* Sends the kept packets of the batch over socket i. Returns the number of packets sent. */
+	int send(int i, RelayPacketBatch &batch);
 	void fillPollFd(PollFd *pfd);
 	bool checkPollFd(const PollFd *pfd, int i);
 	void setFilter(std::shared_ptr<MediaFilter> filter);
@@ -231,11 +580,35 @@ class RelayChannel : public SdpMasqueradeContext{
 	bool hasMultipleTargets()const{
 		return mHasMultipleTargets;
 	}
+	/* Offered to several branches: the packets of the other sources than the destination are dropped. */
+	void setShared(bool val) {
+		mShared = val;
+	}
+	/* Forgets the address learnt from the packets received, before the channel is given another destination. */
+	void retarget();
 	static const char *dirToString(Dir dir);
+	/* Clock rate of the stream, for the jitter of the reports. */
+	void setClockRate(unsigned int rate) {
+		mClockRate = rate;
+	}
+	/* Follows the RTCP packets of the batch, received from the remote party or sent to it. Relay thread only. */
+	void inspectRtcp(RelayPacketBatch &batch, bool received);
+	RelayChannelQuality getQuality() const;
+	/* Incremented each time the destination or the filter of the channel changes. */
+	uint32_t getVersion() const {
+		return mVersion;
+	}
+	/* Gives the addresses of socket i if its packets could be forwarded by the kernel: no filter, sendrecv, and a
+	 * remote address learnt from the packets received. */
+	bool getOffloadEndpoints(int i, RelayOffloader::Endpoint &local, RelayOffloader::Endpoint &remote) const;
 
   private:
+	bool checkSourceAddr(int i, const struct sockaddr_storage &ss, socklen_t addrsize);
+	bool isFromRemoteIp(const struct sockaddr_storage &ss, socklen_t addrsize) const;
 	Dir mDir;
 	std::string mLocalIp;
+	std::string mBindIp;
+	MediaRelayServer *mServer;
 	std::string mRemoteIp;
 	int mRemotePort;
 	RtpSession *mSession;
@@ -244,11 +617,21 @@ class RelayChannel : public SdpMasqueradeContext{
 	socklen_t mSockAddrSize[2];
 	std::shared_ptr<MediaFilter> mFilter;
 	int mPfdIndex;
-	uint64_t mPacketsSent;
-	uint64_t mPacketsReceived;
+	std::atomic<uint64_t> mPacketsSent;
+	std::atomic<uint64_t> mPacketsReceived;
 	bool mPreventLoop;
 	bool mHasMultipleTargets;
+	bool mShared;
 	bool mDestAddrChanged;
+	bool mReceivedOn[2];
+	bool mPinned;
+	uint32_t mVersion;
+	std::atomic<unsigned int> mClockRate;
+	/* the last SR sent to the remote party, for the round trip time */
+	uint32_t mLastSrNtp;
+	std::chrono::steady_clock::time_point mLastSrTime;
+	mutable Mutex mQualityMutex;
+	RelayChannelQuality mQuality;
 };
 
 #endif
@@ -22,6 +22,7 @@
 #include <ctime>
 #include <map>
 #include <list>
+#include <unordered_map>
 #include <vector>
 #include "sofia-sip/auth_module.h"
 #include "sofia-sip/sip_status.h"
@@ -30,8 +31,14 @@
 #include "sofia-sip/su_tagarg.h"
 #include "sofia-sip/sip_extra.h"
 #include <sofia-sip/nua.h>
+#include <sofia-sip/tport.h>
 
 #include "authdb.hh"
+#include "authdigest.hh"
+#include "nonce-store.hh"
+#ifdef ENABLE_REDIS
+#include "registrardb-redis.hh"
+#endif
 
 using namespace std;
 class Authentication;
@@ -51,89 +58,6 @@ struct auth_mod_size {
 	auth_plugin_t plug[1];
 };
 
-class NonceStore {
-	struct NonceCount {
-		NonceCount(int c, time_t ex) : nc(c), expires(ex) {
-		}
-		int nc;
-		time_t expires;
-	};
-	map<string, NonceCount> mNc;
-	mutex mMutex;
-	int mNonceExpires;
-
-  public:
-	NonceStore() : mNonceExpires(3600) {
-	}
-	void setNonceExpires(int value) {
-		mNonceExpires = value;
-	}
-	int getNc(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
-		auto it = mNc.find(nonce);
-		if (it != mNc.end())
-			return (*it).second.nc;
-		return -1;
-	}
-
-	void insert(msg_header_t *response) {
-		const char *nonce = msg_header_find_param((msg_common_t const *)response, "nonce");
-		string snonce(nonce);
-		snonce = snonce.substr(1, snonce.length() - 2);
-		LOGD("New nonce %s", snonce.c_str());
-		insert(snonce);
-	}
-	void insert(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
-		time_t expiration = getCurrentTime() + mNonceExpires;
-		auto it = mNc.find(nonce);
-		if (it != mNc.end()) {
-			LOGE("Replacing nonce count for %s", nonce.c_str());
-			it->second.nc = 0;
-			it->second.expires = expiration;
-		} else {
-			mNc.insert(make_pair(nonce, NonceCount(0, expiration)));
-		}
-	}
-
-	void updateNc(const string &nonce, int newnc) {
-		unique_lock<mutex> lck(mMutex);
-		auto it = mNc.find(nonce);
-		if (it != mNc.end()) {
-			LOGD("Updating nonce %s with nc=%d", nonce.c_str(), newnc);
-			(*it).second.nc = newnc;
-		} else {
-			LOGE("Couldn't update nonce %s: not found", nonce.c_str());
-		}
-	}
-
-	void erase(const string &nonce) {
-		unique_lock<mutex> lck(mMutex);
-		LOGD("Erasing nonce %s", nonce.c_str());
-		mNc.erase(nonce);
-	}
-
-	void cleanExpired() {
-		unique_lock<mutex> lck(mMutex);
-		int count = 0;
-		time_t now = getCurrentTime();
-		size_t size = 0;
-		for (auto it = mNc.begin(); it != mNc.end();) {
-			if (now > it->second.expires) {
-				LOGD("Cleaning expired nonce %s", it->first.c_str());
-				auto eraseIt = it;
-				++it;
-				mNc.erase(eraseIt);
-				++count;
-			} else
-				++it;
-			size++;
-		}
-		if (count)
-			LOGD("Cleaned %d expired nonces, %zd remaining", count, size);
-	}
-};
-
 class Authentication : public Module {
   private:
 	class AuthenticationListener : public AuthDbListener {
@@ -191,6 +115,8 @@ class Authentication : public Module {
 	bool mNewAuthOn407;
 	bool mTestAccountsEnabled;
 	bool mDisableQOPAuth;
+	std::string mNonceMasterKey;
+	list<string> mDigestAlgorithms; // offered in the challenges, in order
 
 	static int authPluginInit(auth_mod_t *am, auth_scheme_t *base, su_root_t *root, tag_type_t tag, tag_value_t value,
 							  ...) {
@@ -277,10 +203,137 @@ class Authentication : public Module {
 	StatCounter64 *mCountSyncRetrieve;
 	StatCounter64 *mCountPassFound;
 	StatCounter64 *mCountPassNotFound;
-	NonceStore mNonceStore;
+	StatCounter64 *mCountConnectionIdentityHits;
+	unique_ptr<NonceStore> mNonceStore; /* NULL for stateless nonces */
+	/*
+	 * Identities (user@domain) authenticated by digest on each stream connection, with their expiration dates.
+	 * The tports are referenced as long as they are in the map, so that a closed connection cannot be mistaken for a
+	 * new one allocated at the same address.
+	 */
+	unordered_map<tport_t *, unordered_map<string, time_t>> mConnectionIdentities;
+	tport_t *mConnectionIdentitiesCursor; /* connection the purge resumes at, NULL to start over */
+	int mConnectionIdentityExpires; /* 0 when disabled */
+
+	static string identityKey(const url_t *uri) {
+		return string(uri->url_user) + "@" + uri->url_host;
+	}
+
+	/* True if uri already authenticated by digest on the connection of the request. */
+	bool isConnectionAuthenticated(const shared_ptr<RequestSipEvent> &ev, const url_t *uri) {
+		tport_t *tport = ev->getIncomingTport().get();
+		if (mConnectionIdentityExpires == 0 || tport == NULL || uri->url_user == NULL)
+			return false;
+		auto it = mConnectionIdentities.find(tport);
+		if (it == mConnectionIdentities.end())
+			return false;
+		if (tport_is_closed(tport) || tport_is_shutdown(tport)) {
+			tport_unref(tport);
+			mConnectionIdentities.erase(it);
+			return false;
+		}
+		auto identity = it->second.find(identityKey(uri));
+		if (identity == it->second.end())
+			return false;
+		if (identity->second <= getCurrentTime()) {
+			it->second.erase(identity);
+			return false;
+		}
+		++*mCountConnectionIdentityHits;
+		return true;
+	}
+
+	void rememberConnectionIdentity(const shared_ptr<RequestSipEvent> &ev, const url_t *uri) {
+		tport_t *tport = ev->getIncomingTport().get();
+		// datagrams all share the primary tport, there is no connection to bind the identity to
+		if (mConnectionIdentityExpires == 0 || tport == NULL || uri->url_user == NULL || tport_is_udp(tport) ||
+			!tport_is_secondary(tport))
+			return;
+		auto &identities = mConnectionIdentities[tport];
+		if (identities.empty())
+			tport_ref(tport);
+		identities[identityKey(uri)] = getCurrentTime() + mConnectionIdentityExpires;
+	}
+
+	/* Forgets the expired identities and the closed connections, from where the previous slice stopped. */
+	void purgeConnectionIdentities(SweepBudget &budget) {
+		time_t now = getCurrentTime();
+		auto it = mConnectionIdentities.begin();
+		if (mConnectionIdentitiesCursor) {
+			it = mConnectionIdentities.find(mConnectionIdentitiesCursor);
+			if (it == mConnectionIdentities.end())
+				it = mConnectionIdentities.begin();
+		}
+		while (it != mConnectionIdentities.end() && budget.next()) {
+			if (!tport_is_closed(it->first) && !tport_is_shutdown(it->first)) {
+				for (auto identity = it->second.begin(); identity != it->second.end();) {
+					if (identity->second <= now)
+						identity = it->second.erase(identity);
+					else
+						++identity;
+				}
+			} else {
+				it->second.clear();
+			}
+			if (it->second.empty()) {
+				tport_unref(it->first);
+				it = mConnectionIdentities.erase(it);
+			} else {
+				++it;
+			}
+		}
+		mConnectionIdentitiesCursor = it == mConnectionIdentities.end() ? NULL : it->first;
+	}
+
+	void storeNonce(msg_header_t *response) {
+		if (mNonceStore)
+			mNonceStore->insert(response);
+	}
+
+	/* Challenges the request, with one header per digest algorithm sharing the nonce of the one made by sofia. */
+	void challenge(auth_mod_t *am, auth_status_t *as, auth_challenger_t const *ach) {
+		auth_challenge_digest(am, as, ach);
+		storeNonce(as->as_response);
+		msg_auth_t *md5 = (msg_auth_t *)as->as_response;
+		if (md5 == NULL || (mDigestAlgorithms.size() == 1 && mDigestAlgorithms.front() == "MD5"))
+			return;
+		msg_auth_t *first = NULL;
+		msg_auth_t **next = &first;
+		for (const string &algorithm : mDigestAlgorithms) {
+			msg_auth_t *au = md5;
+			if (algorithm != "MD5") {
+				au = (msg_auth_t *)msg_header_dup_one(as->as_home, (msg_header_t *)md5);
+				if (au == NULL)
+					continue;
+				size_t count = 0;
+				while (au->au_params && au->au_params[count])
+					++count;
+				msg_param_t *params = (msg_param_t *)su_zalloc(as->as_home, (count + 2) * sizeof(msg_param_t));
+				bool replaced = false;
+				for (size_t i = 0; i < count; ++i) {
+					if (strncasecmp(au->au_params[i], "algorithm=", 10) == 0) {
+						params[i] = su_sprintf(as->as_home, "algorithm=%s", algorithm.c_str());
+						replaced = true;
+					} else {
+						params[i] = au->au_params[i];
+					}
+				}
+				if (!replaced)
+					params[count] = su_sprintf(as->as_home, "algorithm=%s", algorithm.c_str());
+				au->au_params = params;
+				msg_fragment_clear(au->au_common);
+			}
+			au->au_next = NULL;
+			*next = au;
+			next = &au->au_next;
+		}
+		if (first)
+			as->as_response = (msg_header_t *)first;
+	}
 
 	Authentication(Agent *ag) : Module(ag), mCountAsyncRetrieve(NULL), mCountSyncRetrieve(NULL) {
 		mNewAuthOn407 = false;
+		mConnectionIdentityExpires = 0;
+		mConnectionIdentitiesCursor = NULL;
 		mProxyChallenger.ach_status = 407; /*SIP_407_PROXY_AUTH_REQUIRED*/
 		mProxyChallenger.ach_phrase = sip_407_Proxy_auth_required;
 		mProxyChallenger.ach_header = sip_proxy_authenticate_class;
@@ -311,6 +364,8 @@ class Authentication : public Module {
 			auth_mod_destroy(it->second);
 		}
 		mAuthModules.clear();
+		for (auto &connection : mConnectionIdentities)
+			tport_unref(connection.first);
 
 		delete mOdbcAuthScheme;
 	}
@@ -323,7 +378,7 @@ class Authentication : public Module {
 
 			{StringList, "trusted-hosts", "List of whitespace separated IP which will not be challenged.", ""},
 
-			{String, "db-implementation", "Database backend implementation [odbc,soci,file,fixed].", "fixed"},
+			{String, "db-implementation", "Database backend implementation [odbc,soci,http,file,fixed].", "fixed"},
 
 			{String, "datasource",
 			 "Odbc connection string to use for connecting to database. "
@@ -334,6 +389,20 @@ class Authentication : public Module {
 
 			{Integer, "nonce-expires", "Expiration time of nonces, in seconds.", "3600"},
 
+			{String, "nonce-store",
+			 "How the nonces issued are tracked [local,redis,stateless]. 'local' keeps the nonce count of each nonce in "
+			 "memory, to reject replayed credentials. 'redis' keeps them in the redis server of the registrar, with keys "
+			 "expiring with the nonces, so that they are shared by all the nodes of a cluster. 'stateless' stores nothing and only checks the nonces against the "
+			 "signature and the expiration time they carry, so that a client challenged by one node of a cluster can "
+			 "answer to another one, provided all nodes share the same nonce-master-key; replays within the "
+			 "expiration time are not detected.",
+			 "local"},
+
+			{String, "nonce-master-key",
+			 "Secret used to sign the nonces. Empty means a random one, generated at startup. "
+			 "It must be the same on all the nodes of a cluster using stateless nonces.",
+			 ""},
+
 			{Integer, "cache-expire", "Duration of the validity of the credentials added to the cache in seconds.",
 			 "1800"},
 
@@ -341,6 +410,20 @@ class Authentication : public Module {
 			 "True if retrieved passwords from the database are hashed. HA1=MD5(A1) = MD5(username:realm:pass).",
 			 "false"},
 
+			{StringList, "digest-algorithms",
+			 "List of whitespace separated digest algorithms offered in the challenges, the preferred first, among MD5 "
+			 "and SHA-256 (RFC 8760). SHA-256 is checked against the SHA-256 HA1 of the stored credentials "
+			 "(sha256:<HA1>) or computed from the clear text password, so it does not work with hashed-passwords.",
+			 "MD5"},
+
+			{Integer, "connection-identity-expires",
+			 "Duration in seconds during which the requests received on a TCP or TLS connection on which a user has "
+			 "been authenticated by digest are accepted without credentials for this same user, until the connection "
+			 "is closed. This saves the challenges and the password checks of the requests following a registration, "
+			 "but a connection shared by several clients (an edge proxy not using trusted-hosts) must not enable it. "
+			 "0 disables it.",
+			 "0"},
+
 			{BooleanExpr, "no-403", "Don't reply 403, but 401 or 407 even in case of wrong authentication.", "false"},
 
 			{StringList, "trusted-client-certificates", "List of whitespace separated username or username@domain CN "
@@ -372,6 +455,9 @@ class Authentication : public Module {
 		mCountSyncRetrieve = mc->createStat("count-sync-retrieve", "Number of synchronous retrieves.");
 		mCountPassFound = mc->createStat("count-password-found", "Number of passwords found.");
 		mCountPassNotFound = mc->createStat("count-password-not-found", "Number of passwords not found.");
+		mCountConnectionIdentityHits =
+			mc->createStat("count-connection-identity-hits",
+						   "Number of requests accepted from the identity authenticated on their connection.");
 	}
 
 	void onLoad(const GenericStruct *mc) {
@@ -388,7 +474,36 @@ class Authentication : public Module {
 		mNo403Expr = mc->get<ConfigBooleanExpression>("no-403")->read();
 		mTestAccountsEnabled = mc->get<ConfigBoolean>("enable-test-accounts-creation")->read();
 		mDisableQOPAuth = mc->get<ConfigBoolean>("disable-qop-auth")->read();
-		mNonceStore.setNonceExpires(nonceExpires);
+		mConnectionIdentityExpires = mc->get<ConfigInt>("connection-identity-expires")->read();
+		mDigestAlgorithms.clear();
+		for (const string &algorithm : mc->get<ConfigStringList>("digest-algorithms")->read()) {
+			if (algorithm == "MD5" || algorithm == "SHA-256")
+				mDigestAlgorithms.push_back(algorithm);
+			else
+				LOGE("Unsupported digest algorithm %s ignored", algorithm.c_str());
+		}
+		if (mDigestAlgorithms.empty())
+			mDigestAlgorithms.push_back("MD5");
+		string nonceStore = mc->get<ConfigString>("nonce-store")->read();
+		if (nonceStore == "local") {
+			mNonceStore.reset(new LocalNonceStore());
+		} else if (nonceStore == "redis") {
+#ifdef ENABLE_REDIS
+			RegistrarDbRedisAsync *redis = dynamic_cast<RegistrarDbRedisAsync *>(RegistrarDb::get());
+			if (!redis)
+				LOGF("nonce-store 'redis' requires the redis implementation of the registrar database");
+			mNonceStore.reset(new RedisNonceStore(redis));
+#else
+			LOGF("nonce-store 'redis' requires flexisip to be built with redis support");
+#endif
+		} else if (nonceStore == "stateless") {
+			mNonceStore.reset();
+		} else {
+			LOGF("Unknown nonce-store '%s', expected local, redis or stateless", nonceStore.c_str());
+		}
+		if (mNonceStore)
+			mNonceStore->setNonceExpires(nonceExpires);
+		mNonceMasterKey = mc->get<ConfigString>("nonce-master-key")->read();
 
 		for (it = mDomains.begin(); it != mDomains.end(); ++it) {
 			auto domain = *it;
@@ -401,6 +516,11 @@ class Authentication : public Module {
 				LOGE("Cannot create auth module odbc");
 			}
 		}
+
+		list<string> prefetchDomains = mc->get<ConfigStringList>("cache-prefetch-domains")->read();
+		for (auto domain = prefetchDomains.begin(); domain != prefetchDomains.end(); ++domain) {
+			AuthDbBackend::get()->prefetchDomain(*domain);
+		}
 	}
 
 	auth_mod_t *findAuthModule(const char *name) {
@@ -414,16 +534,18 @@ class Authentication : public Module {
 	}
 
 	auth_mod_t *createAuthModule(const std::string &domain, int nonceExpires) {
+		const char *masterKey = mNonceMasterKey.empty() ? NULL : mNonceMasterKey.c_str();
 		if (mDisableQOPAuth) {
 			return auth_mod_create(NULL, AUTHTAG_METHOD("odbc"), AUTHTAG_REALM(domain.c_str()),
 								   AUTHTAG_OPAQUE("+GNywA=="), AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"),
-								   TAG_END());
+								   TAG_IF(masterKey, AUTHTAG_MASTER_KEY(masterKey)), TAG_END());
 		} else {
 			return auth_mod_create(NULL, AUTHTAG_METHOD("odbc"), AUTHTAG_REALM(domain.c_str()),
 								   AUTHTAG_OPAQUE("+GNywA=="), AUTHTAG_QOP("auth"),
 								   AUTHTAG_EXPIRES(nonceExpires),	  // in seconds
 								   AUTHTAG_NEXT_EXPIRES(nonceExpires), // in seconds
-								   AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"), TAG_END());
+								   AUTHTAG_FORBIDDEN(1), AUTHTAG_ALLOW("ACK CANCEL BYE"),
+								   TAG_IF(masterKey, AUTHTAG_MASTER_KEY(masterKey)), TAG_END());
 		}
 	}
 
@@ -558,6 +680,17 @@ class Authentication : public Module {
 		if (isTlsClientAuthenticated(ev))
 			return;
 
+		// already authenticated on this connection: the credentials, if any, are not checked again
+		const url_t *userUri = ppi ? ppi->ppid_url : sip->sip_from->a_url;
+		if (isConnectionAuthenticated(ev, userUri)) {
+			msg_auth_t *credentials =
+				sip->sip_request->rq_method == sip_method_register ? sip->sip_authorization : sip->sip_proxy_authorization;
+			msg_auth_t *au = ModuleToolbox::findAuthorizationForRealm(ms->getHome(), credentials, userUri->url_host);
+			if (au)
+				msg_header_remove(ms->getMsg(), (msg_pub_t *)sip, (msg_header_t *)au);
+			return;
+		}
+
 		// Check for the existence of username, which is required for proceeding with digest authentication in flexisip.
 		// Reject if absent.
 		if (sip->sip_from->a_url->url_user == NULL) {
@@ -623,8 +756,7 @@ class Authentication : public Module {
 			as->as_user_uri = sip->sip_from->a_url;
 			auth_mod_t *am = findAuthModule(as->as_realm);
 			if (am) {
-				auth_challenge_digest(am, as, &mProxyChallenger);
-				mNonceStore.insert(as->as_response);
+				challenge(am, as, &mProxyChallenger);
 				msg_header_insert(ev->getMsgSip()->getMsg(), (msg_pub_t *)sip, (msg_header_t *)as->as_response);
 			} else {
 				LOGD("Authentication module for %s not found", as->as_realm);
@@ -635,7 +767,19 @@ class Authentication : public Module {
 	}
 
 	void onIdle() {
-		mNonceStore.cleanExpired();
+		if (mNonceStore)
+			mNonceStore->cleanExpired();
+		AuthDbBackend *db = AuthDbBackend::get();
+		if (db) {
+			db->updateStats();
+			db->saveCacheSnapshot();
+			SaturationMonitor *saturation = getAgent()->getSaturation();
+			saturation->setLoad(SaturationMonitor::ThreadPools, saturation->getDelayLoad(db->getMaxWaitMs()));
+		}
+	}
+
+	void onSweep(SweepBudget &budget) {
+		purgeConnectionIdentities(budget);
 	}
 
 	virtual bool doOnConfigStateChanged(const ConfigValue &conf, ConfigState state) {
@@ -730,6 +874,7 @@ void Authentication::AuthenticationListener::finish() {
 				   SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
 	} else {
 		// Success
+		mModule->rememberConnectionIdentity(mEv, mAs->as_user_uri);
 		if (sip->sip_request->rq_method == sip_method_register) {
 			msg_auth_t *au =
 				ModuleToolbox::findAuthorizationForRealm(ms->getHome(), sip->sip_authorization, mAs->as_realm);
@@ -758,38 +903,64 @@ void Authentication::AuthenticationListener::finish() {
 void Authentication::AuthenticationListener::checkPassword(const char *passwd) {
 	char const *a1;
 	auth_hexmd5_t a1buf, response;
+	AuthDigest::Hash hash;
+	bool sess;
 
 	if (passwd && passwd[0] == '\0')
 		passwd = NULL;
+	if (!AuthDigest::parseAlgorithm(mAr.ar_algorithm, hash, sess)) {
+		LOGD("auth_method_digest: unsupported algorithm %s", mAr.ar_algorithm);
+		hash = AuthDigest::MD5;
+	}
+	// credentials stored as precomputed HA1s, see AuthDigest
+	bool storedHA1 = passwd && AuthDigest::isHashedCredentials(passwd);
 
 	if (passwd) {
 		mPasswordFound = true;
 		++*getModule()->mCountPassFound;
-		if (mHashedPass) {
+	} else {
+		++*getModule()->mCountPassNotFound;
+	}
+
+	bool matched;
+	if (hash == AuthDigest::SHA256) {
+		string ha1;
+		if (storedHA1)
+			ha1 = AuthDigest::storedHA1(passwd, hash);
+		else if (passwd && !mHashedPass)
+			ha1 = AuthDigest::ha1(hash, mAr.ar_username, mAr.ar_realm, passwd);
+		matched = !ha1.empty() && AuthDigest::response(hash, ha1, sess, mAr.ar_nonce, mAr.ar_cnonce, mAr.ar_nc,
+													   mAr.ar_qop != NULL, mAr.ar_auth_int, mAs->as_method, mAr.ar_uri,
+													   mAs->as_body, mAs->as_bodylen) == mAr.ar_response;
+	} else {
+		bool hasHA1 = true;
+		if (storedHA1) {
+			string ha1 = AuthDigest::storedHA1(passwd, hash);
+			hasHA1 = !ha1.empty();
+			strncpy(a1buf, ha1.c_str(), 33);
+			a1 = a1buf;
+		} else if (passwd && mHashedPass) {
 			strncpy(a1buf, passwd, 33); // remove trailing NULL character
 			a1 = a1buf;
 		} else {
-			auth_digest_a1(&mAr, a1buf, passwd), a1 = a1buf;
+			auth_digest_a1(&mAr, a1buf, passwd ? passwd : "xyzzy"), a1 = a1buf;
 		}
-	} else {
-		++*getModule()->mCountPassNotFound;
-		auth_digest_a1(&mAr, a1buf, "xyzzy"), a1 = a1buf;
-	}
 
-	if (mAr.ar_md5sess)
-		auth_digest_a1sess(&mAr, a1buf, a1), a1 = a1buf;
+		if (mAr.ar_md5sess)
+			auth_digest_a1sess(&mAr, a1buf, a1), a1 = a1buf;
 
-	auth_digest_response(&mAr, response, a1, mAs->as_method, mAs->as_body, mAs->as_bodylen);
+		auth_digest_response(&mAr, response, a1, mAs->as_method, mAs->as_body, mAs->as_bodylen);
+		matched = hasHA1 && strcmp(response, mAr.ar_response) == 0;
+	}
 
-	if (!passwd || strcmp(response, mAr.ar_response)) {
+	if (!passwd || !matched) {
 
 		if (mAm->am_forbidden && !mNo403) {
 			mAs->as_status = 403, mAs->as_phrase = "Forbidden";
 			mAs->as_response = NULL;
 			mAs->as_blacklist = mAm->am_blacklist;
 		} else {
-			auth_challenge_digest(mAm, mAs, mAch);
-			getModule()->mNonceStore.insert(mAs->as_response);
+			getModule()->challenge(mAm, mAs, mAch);
 			mAs->as_blacklist = mAm->am_blacklist;
 		}
 		if (passwd) {
@@ -893,35 +1064,34 @@ void Authentication::flexisip_auth_check_digest(auth_mod_t *am, auth_status_t *a
 	msg_time_t now = msg_now();
 	if (as->as_nonce_issued == 0 /* Already validated nonce */ && auth_validate_digest_nonce(am, as, ar, now) < 0) {
 		as->as_blacklist = am->am_blacklist;
-		auth_challenge_digest(am, as, ach);
-		module->mNonceStore.insert(as->as_response);
+		module->challenge(am, as, ach);
 		listener->finish();
 		return;
 	}
 
 	if (as->as_stale) {
-		auth_challenge_digest(am, as, ach);
-		module->mNonceStore.insert(as->as_response);
+		module->challenge(am, as, ach);
 		listener->finish();
 		return;
 	}
 
-	if (!listener->mModule->mDisableQOPAuth) {
-		int pnc = module->mNonceStore.getNc(ar->ar_nonce);
-		int nnc = (int)strtoul(ar->ar_nc, NULL, 16);
-		if (pnc == -1 || pnc >= nnc) {
-			LOGE("Bad nonce count %d -> %d for %s", pnc, nnc, ar->ar_nonce);
+	if (listener->mModule->mDisableQOPAuth || !module->mNonceStore) {
+		AuthDbBackend::get()->getPassword(as->as_user_uri->url_user, as->as_user_uri->url_host, ar->ar_username,
+										  listener);
+		return;
+	}
+
+	int nc = (int)strtoul(ar->ar_nc, NULL, 16);
+	module->mNonceStore->checkNc(ar->ar_nonce, nc, [module, listener, am, as, ar, ach](bool valid) {
+		if (!valid) {
 			as->as_blacklist = am->am_blacklist;
-			auth_challenge_digest(am, as, ach);
-			module->mNonceStore.insert(as->as_response);
+			module->challenge(am, as, ach);
 			listener->finish();
 			return;
-		} else {
-			module->mNonceStore.updateNc(ar->ar_nonce, nnc);
 		}
-	}
-
-	AuthDbBackend::get()->getPassword(as->as_user_uri->url_user, as->as_user_uri->url_host, ar->ar_username, listener);
+		AuthDbBackend::get()->getPassword(as->as_user_uri->url_user, as->as_user_uri->url_host, ar->ar_username,
+										  listener);
+	});
 }
 
 /** Authenticate a request with @b Digest authentication scheme.
@@ -957,8 +1127,7 @@ void Authentication::flexisip_auth_method_digest(auth_mod_t *am, auth_status_t *
 	} else {
 		/* There was no realm or credentials, send challenge */
 		SLOGD << __func__ << ": no credentials matched realm or no realm";
-		auth_challenge_digest(am, as, ach);
-		listener->getModule()->mNonceStore.insert(as->as_response);
+		listener->getModule()->challenge(am, as, ach);
 
 		// Retrieve the password in the hope it will be in cache when the remote UAC
 		// sends back its request; this time with the expected authentication credentials.
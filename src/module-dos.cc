@@ -20,16 +20,62 @@
 #include "agent.hh"
 #include "log/logmanager.hh"
 #include "utils/threadpool.hh"
+#include "utils/ratelimitsketch.hh"
 #include <sofia-sip/tport.h>
 #include <sofia-sip/msg_addr.h>
 #include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 
 using namespace std;
 
+/* Source of the packets, compared as raw bytes rather than formatted as an "ip:port" string for each packet. */
+typedef struct DosKey {
+	uint8_t address[16];
+	uint16_t port;
+	uint8_t family;
+
+	DosKey(const sockaddr *addr) {
+		memset(this, 0, sizeof(*this));
+		family = (uint8_t)addr->sa_family;
+		if (addr->sa_family == AF_INET6) {
+			const sockaddr_in6 *in6 = (const sockaddr_in6 *)addr;
+			memcpy(address, &in6->sin6_addr, sizeof(in6->sin6_addr));
+			port = in6->sin6_port;
+		} else if (addr->sa_family == AF_INET) {
+			const sockaddr_in *in = (const sockaddr_in *)addr;
+			memcpy(address, &in->sin_addr, sizeof(in->sin_addr));
+			port = in->sin_port;
+		}
+	}
+	bool operator==(const DosKey &other) const {
+		return memcmp(this, &other, sizeof(*this)) == 0;
+	}
+} DosKey;
+
+struct DosKeyHash {
+	size_t operator()(const DosKey &key) const {
+		// FNV-1a
+		const uint8_t *bytes = (const uint8_t *)&key;
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < sizeof(key); ++i) {
+			h ^= bytes[i];
+			h *= 1099511628211ULL;
+		}
+		return (size_t)h;
+	}
+};
+
+/*
+ * Packets counted over a sliding window of time-period: the count of the previous window is weighted by the part of
+ * it still in the sliding window, so that the rate neither drops to 0 at the start of each window nor lags a whole
+ * window behind.
+ */
 typedef struct DosContext {
-	uint64_t recv_msg_count_since_last_check;
-	double last_check_recv_msg_check_time;
-	double packet_count_rate;
+	uint64_t window_start; // in milliseconds
+	uint32_t count;
+	uint32_t previous_count;
 } DosContext;
 
 class DoSProtection;
@@ -52,10 +98,21 @@ class DoSProtection : public Module, ModuleToolbox {
 	bool mIptablesVersionChecked;
 	bool mIptablesSupportsWait;
 	list<string> mWhiteList;
-	unordered_map<string, DosContext> mDosContexts;
-	unordered_map<string, DosContext>::iterator mDOSHashtableIterator;
+	unordered_map<DosKey, DosContext, DosKeyHash> mDosContexts;
+	// key of the context the sweep of mDosContexts resumes at, NULL to start over
+	unique_ptr<DosKey> mSweepCursor;
 	ThreadPool *mThreadPool;
 	string mFlexisipChain;
+	bool mUseIpset;
+	FILE *mIpsetRestore; // only used from the thread of mThreadPool
+	// token buckets of the requests, answered with 503 when empty; NULL when not limited
+	unique_ptr<RateLimitSketch> mSourceLimit;
+	unique_ptr<RateLimitSketch> mAorLimit;
+	unordered_map<string, unique_ptr<RateLimitSketch>> mMethodLimits; // by method name, per source
+	StatCounter64 *mCountRateLimited;
+	// sources dropped by the agent before any processing until their ban is effective, with its end in milliseconds
+	unordered_map<DosKey, uint64_t, DosKeyHash> mBannedSources;
+	StatCounter64 *mCountDroppedBanned;
 
 	void onDeclare(GenericStruct *module_config) {
 		ConfigItemDescriptor configs[] = {
@@ -65,9 +122,54 @@ class DoSProtection : public Module, ModuleToolbox {
 			 "20"},
 			{Integer, "ban-time", "Number of minutes to ban the ip/port using iptables", "2"},
 			{String, "iptables-chain", "Name of the chain flexisip will create to store the banned IPs", "FLEXISIP"},
+			{String, "ban-backend", "How the ip/ports are banned: 'iptables' adds an iptables rule for each of them to "
+									"[iptables-chain], 'ipset' adds them to an ipset of the same name, matched by a single "
+									"rule. The ipset entries expire by themselves, and are added by a single long "
+									"running 'ipset restore' process rather than one command per ip/port. Only IPv4 "
+									"addresses can be banned with ipset.",
+			 "iptables"},
+			{Integer, "source-request-rate", "Number of requests per second allowed from a source IP before answering "
+											 "them with 503 and a Retry-After header, 0 for no limit. To be set below "
+											 "[packet-rate-limit], so that sources are slowed down before being banned.",
+			 "0"},
+			{StringList, "method-request-rates", "Number of requests per second allowed from a source IP for given "
+												 "methods before answering them with 503, as method:rate pairs, "
+												 "for example 'REGISTER:2 MESSAGE:10'.",
+			 ""},
+			{Integer, "aor-request-rate", "Number of requests per second allowed from an AOR before answering them "
+										  "with 503, 0 for no limit. Only the requests bearing credentials are counted, "
+										  "by the AOR of their From, so that unauthenticated requests cannot exhaust "
+										  "the allowance of a user.",
+			 "0"},
+			{Integer, "request-rate-burst", "Number of seconds of the request rates a source, method or AOR may send "
+											"at once.",
+			 "3"},
 			config_item_end};
 		module_config->get<ConfigBoolean>("enabled")->setDefault("true");
 		module_config->addChildrenValues(configs);
+		mCountRateLimited =
+			module_config->createStat("count-rate-limited", "Number of requests answered with 503 by the rate limits.");
+		mCountDroppedBanned = module_config->createStat(
+			"count-dropped-banned", "Number of messages from banned sources dropped before their processing.");
+	}
+
+	void loadRateLimits(const GenericStruct *mc) {
+		int burst = mc->get<ConfigInt>("request-rate-burst")->read();
+		if (burst < 1)
+			LOGF("request-rate-burst must be at least 1");
+		int sourceRate = mc->get<ConfigInt>("source-request-rate")->read();
+		mSourceLimit.reset(sourceRate > 0 ? new RateLimitSketch(sourceRate, sourceRate * burst) : NULL);
+		int aorRate = mc->get<ConfigInt>("aor-request-rate")->read();
+		mAorLimit.reset(aorRate > 0 ? new RateLimitSketch(aorRate, aorRate * burst) : NULL);
+		mMethodLimits.clear();
+		for (const string &methodRate : mc->get<ConfigStringList>("method-request-rates")->read()) {
+			size_t colon = methodRate.find(':');
+			int rate = colon == string::npos ? 0 : atoi(methodRate.c_str() + colon + 1);
+			if (rate <= 0)
+				LOGF("Invalid method-request-rates entry '%s', method:rate expected", methodRate.c_str());
+			string method = methodRate.substr(0, colon);
+			mMethodLimits[method].reset(new RateLimitSketch(rate, rate * burst));
+		}
 	}
 
 	void onLoad(const GenericStruct *mc) {
@@ -75,8 +177,15 @@ class DoSProtection : public Module, ModuleToolbox {
 		mPacketRateLimit = mc->get<ConfigInt>("packet-rate-limit")->read();
 		mBanTime = mc->get<ConfigInt>("ban-time")->read();
 		mFlexisipChain = mc->get<ConfigString>("iptables-chain")->read();
-		mDOSHashtableIterator = mDosContexts.begin();
-		
+		string backend = mc->get<ConfigString>("ban-backend")->read();
+		if (backend != "iptables" && backend != "ipset")
+			LOGF("Unknown ban-backend '%s'", backend.c_str());
+		mUseIpset = backend == "ipset";
+		loadRateLimits(mc);
+		mAgent->setIncomingMessageFilter(bind(&DoSProtection::acceptIncomingMessage, this, placeholders::_1,
+											  placeholders::_2));
+		mSweepCursor.reset();
+
 		GenericStruct *cluster = GenericManager::get()->getRoot()->get<GenericStruct>("cluster");
 		mWhiteList = cluster->get<ConfigStringList>("nodes")->read();
 		for (auto it = mWhiteList.begin(); it != mWhiteList.end(); ++it) {
@@ -130,9 +239,25 @@ class DoSProtection : public Module, ModuleToolbox {
 		if (system(iptables_cmd) != 0) {
 			LOGW("iptables command %s failed", iptables_cmd);
 		}
+
+		if (mUseIpset) {
+			// the entries of a previous run are kept, they expire by themselves
+			snprintf(iptables_cmd, sizeof(iptables_cmd), "ipset -exist create %s hash:ip,port timeout %i",
+					 mFlexisipChain.c_str(), mBanTime * 60);
+			if (system(iptables_cmd) != 0) {
+				LOGW("ipset command %s failed", iptables_cmd);
+			}
+			snprintf(iptables_cmd, sizeof(iptables_cmd), "iptables %s -A %s -m set --match-set %s src,src -j REJECT",
+					 mIptablesSupportsWait ? "-w" : "", mFlexisipChain.c_str(), mFlexisipChain.c_str());
+			if (system(iptables_cmd) != 0) {
+				LOGW("iptables command %s failed", iptables_cmd);
+			}
+		}
 	}
 
 	void onUnload() {
+		mAgent->setIncomingMessageFilter(nullptr);
+		mBannedSources.clear();
 		// Let's remove the Flexisip's chain
 		char iptables_cmd[512];
 		// First we have to empty the chain
@@ -151,6 +276,16 @@ class DoSProtection : public Module, ModuleToolbox {
 		if (system(iptables_cmd) != 0) {
 			LOGW("iptables command %s failed", iptables_cmd);
 		}
+
+		if (mUseIpset) {
+			mThreadPool->Enqueue([this] { closeIpsetRestore(); });
+			snprintf(iptables_cmd, sizeof(iptables_cmd), "ipset destroy %s", mFlexisipChain.c_str());
+			mThreadPool->Enqueue([iptables_cmd] {
+				if (system(iptables_cmd) != 0) {
+					LOGW("ipset command %s failed", iptables_cmd);
+				}
+			});
+		}
 	}
 
 	virtual bool isValidNextConfig( const ConfigValue &value ) {
@@ -176,37 +311,69 @@ class DoSProtection : public Module, ModuleToolbox {
 	}
 
 	void onIdle() {
-		struct timeval now;
-		double started_time_in_millis, time_elapsed;
-
-		gettimeofday(&now, NULL);
-		started_time_in_millis = now.tv_sec * 1000 + (now.tv_usec / 1000);
-
-		if (mDOSHashtableIterator == mDosContexts.end()) {
-			mDOSHashtableIterator = mDosContexts.begin();
+		uint64_t now = getCurrentTimeInMillis();
+		for (auto it = mBannedSources.begin(); it != mBannedSources.end();) {
+			if (now >= it->second)
+				it = mBannedSources.erase(it);
+			else
+				++it;
 		}
-		for (; mDOSHashtableIterator != mDosContexts.end();) {
-			double now_in_millis;
-			DosContext dos = mDOSHashtableIterator->second;
+	}
 
-			gettimeofday(&now, NULL);
-			now_in_millis = now.tv_sec * 1000 + (now.tv_usec / 1000);
-			time_elapsed = now_in_millis - dos.last_check_recv_msg_check_time;
+	/* Forgets the contexts of the sources that sent nothing in the past hour, from where the previous slice stopped. */
+	void onSweep(SweepBudget &budget) {
+		uint64_t now = getCurrentTimeInMillis();
+		auto it = mDosContexts.begin();
+		if (mSweepCursor) {
+			// an iterator would not survive the rehashes of the table in the meantime, the key does
+			it = mDosContexts.find(*mSweepCursor);
+			if (it == mDosContexts.end())
+				it = mDosContexts.begin();
+		}
+		while (it != mDosContexts.end() && budget.next()) {
+			if (now >= it->second.window_start + 3600 * 1000) // if no message received in the past hour
+				it = mDosContexts.erase(it);
+			else
+				++it;
+		}
+		if (it == mDosContexts.end())
+			mSweepCursor.reset();
+		else
+			mSweepCursor.reset(new DosKey(it->first));
+	}
 
-			if (time_elapsed >= 3600 * 1000) { // If no message received in the past hour
-				mDOSHashtableIterator = mDosContexts.erase(mDOSHashtableIterator);
-			} else {
-				++mDOSHashtableIterator;
-			}
+	static uint64_t getCurrentTimeInMillis() {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		return (uint64_t)now.tv_sec * 1000 + (now.tv_usec / 1000);
+	}
 
-			if (now_in_millis - started_time_in_millis >= 100) { // Do not use more than 100ms to clean the hashtable
-				LOGW("Started to clean dos hashtable %fms ago, let's stop for now a continue later",
-					 now_in_millis - started_time_in_millis);
-				break;
-			}
+	/*
+	 * Drops the messages of the banned sources, that keep arriving while the firewall rule is being added, before the
+	 * agent builds any event for them.
+	 */
+	bool acceptIncomingMessage(msg_t *msg, const sip_t *sip) {
+		if (mBannedSources.empty())
+			return true;
+		su_sockaddr_t su[1];
+		socklen_t len = sizeof su;
+		if (msg_get_address(msg, su, &len) != 0)
+			return true;
+		auto it = mBannedSources.find(DosKey(&su[0].su_sa));
+		if (it == mBannedSources.end())
+			return true;
+		if (getCurrentTimeInMillis() >= it->second) {
+			mBannedSources.erase(it);
+			return true;
 		}
+		++*mCountDroppedBanned;
+		return false;
 	}
-	
+
+	void addBannedSource(const sockaddr *addr) {
+		mBannedSources[DosKey(addr)] = getCurrentTimeInMillis() + (uint64_t)mBanTime * 60 * 1000;
+	}
+
 	bool isIpWhiteListed(const char *ip) {
 		if (!ip) return true; // If IP is null, is useless to try to add it in iptables...
 		
@@ -223,7 +390,42 @@ class DoSProtection : public Module, ModuleToolbox {
 		return false;
 	}
 
+	void closeIpsetRestore() {
+		if (mIpsetRestore) {
+			pclose(mIpsetRestore);
+			mIpsetRestore = NULL;
+		}
+	}
+
+	void banIPWithIpset(const char *ip, const char *port, const char *protocol) {
+		if (strchr(ip, ':')) {
+			LOGW("IP %s cannot be banned with ipset, only IPv4 addresses are supported", ip);
+			return;
+		}
+		for (int attempt = 0; attempt < 2; ++attempt) {
+			if (!mIpsetRestore) {
+				// -exist: a line adding an ip/port already banned must not end the process
+				mIpsetRestore = popen("ipset -exist restore", "w");
+				if (!mIpsetRestore) {
+					LOGW("Cannot start ipset restore: %s", strerror(errno));
+					return;
+				}
+			}
+			if (fprintf(mIpsetRestore, "add %s %s,%s:%s\n", mFlexisipChain.c_str(), ip, protocol, port) > 0 &&
+				fflush(mIpsetRestore) == 0) {
+				return;
+			}
+			// the process ended, most likely on an invalid line: start a new one
+			LOGW("ipset restore failed: %s", strerror(errno));
+			closeIpsetRestore();
+		}
+	}
+
 	void banIP(const char *ip, const char *port, const char *protocol) {
+		if (mUseIpset) {
+			banIPWithIpset(ip, port, protocol);
+			return;
+		}
 		char iptables_cmd[512];
 		snprintf(iptables_cmd, sizeof(iptables_cmd), "iptables %s -C %s -p %s -s %s -m multiport --sports %s -j REJECT", 
 				 mIptablesSupportsWait ? "-w" : "", mFlexisipChain.c_str(), protocol, ip, port);
@@ -262,6 +464,8 @@ class DoSProtection : public Module, ModuleToolbox {
 	}
 	
 	void createBanContextAndPostInFuture(const char *ip, const char *port, const string &protocol) {
+		if (mUseIpset)
+			return; // the ipset entries have a timeout
 		BanContext *ctx = new BanContext();
 		ctx->ip = ip;
 		ctx->port = port;
@@ -271,7 +475,55 @@ class DoSProtection : public Module, ModuleToolbox {
 		su_timer_set_interval(ctx->timer, invokeLambdaFromSofiaTimerCallback, ctx, mBanTime * 60 * 1000);
 	}
 
+	/* Answers 503 to the request when one of the buckets it takes a token from is empty. */
+	void checkRateLimits(shared_ptr<RequestSipEvent> &ev) {
+		sip_t *sip = ev->getSip();
+		if (sip->sip_request->rq_method == sip_method_ack || sip->sip_request->rq_method == sip_method_cancel)
+			return; // they end transactions rather than start new ones, and ACKs cannot be answered
+
+		su_sockaddr_t su[1];
+		socklen_t len = sizeof su;
+		if (msg_get_address(ev->getMsgSip()->getMsg(), su, &len) != 0)
+			return;
+		DosKey source(&su[0].su_sa);
+		source.port = 0; // per IP
+
+		uint64_t now_in_millis = getCurrentTimeInMillis();
+		RateLimitSketch *limit = NULL;
+		if (mSourceLimit && !mSourceLimit->take(&source, sizeof(source), now_in_millis)) {
+			limit = mSourceLimit.get();
+		}
+		if (!limit && !mMethodLimits.empty()) {
+			auto it = mMethodLimits.find(sip->sip_request->rq_method_name);
+			if (it != mMethodLimits.end() && !it->second->take(&source, sizeof(source), now_in_millis))
+				limit = it->second.get();
+		}
+		if (!limit && mAorLimit && (sip->sip_authorization || sip->sip_proxy_authorization) && sip->sip_from &&
+			sip->sip_from->a_url->url_host) {
+			string aor = string(sip->sip_from->a_url->url_user ? sip->sip_from->a_url->url_user : "") + "@" +
+						 sip->sip_from->a_url->url_host;
+			if (!mAorLimit->take(aor.data(), aor.size(), now_in_millis))
+				limit = mAorLimit.get();
+		}
+		if (!limit)
+			return;
+
+		char ip[NI_MAXHOST];
+		if (getnameinfo(&su[0].su_sa, len, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST) == 0 && isIpWhiteListed(ip))
+			return;
+		++*mCountRateLimited;
+		string retryAfter = to_string(limit->retryAfter());
+		ev->reply(503, "Service Unavailable", SIPTAG_RETRY_AFTER_STR(retryAfter.c_str()),
+				  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+	}
+
 	void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException) {
+		checkPacketRate(ev);
+		if (!ev->isTerminated() && (mSourceLimit || mAorLimit || !mMethodLimits.empty()))
+			checkRateLimits(ev);
+	}
+
+	void checkPacketRate(shared_ptr<RequestSipEvent> &ev) {
 		shared_ptr<tport_t> inTport = ev->getIncomingTport();
 		tport_t *tport = inTport.get();
 
@@ -293,45 +545,41 @@ class DoSProtection : public Module, ModuleToolbox {
 			msg_get_address(msgSip->getMsg(), su, &len);
 			addr = &(su[0].su_sa);
 
-			if ((err = getnameinfo(addr, len, ip, sizeof(ip), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) ==
-				0) {
-				string id = string(ip) + ":" + string(port);
-				struct timeval now;
-				DosContext &dosContext = mDosContexts[id];
-				double now_in_millis, time_elapsed;
-
-				dosContext.recv_msg_count_since_last_check++;
-				gettimeofday(&now, NULL);
-				now_in_millis = now.tv_sec * 1000 + (now.tv_usec / 1000);
-				if (dosContext.last_check_recv_msg_check_time == 0) {
-					dosContext.last_check_recv_msg_check_time = now_in_millis;
-				}
-
-				time_elapsed = now_in_millis - dosContext.last_check_recv_msg_check_time;
-				if (time_elapsed < 0) {
-					dosContext.packet_count_rate = 0;
-					dosContext.recv_msg_count_since_last_check = 0;
-					dosContext.last_check_recv_msg_check_time = now_in_millis;
-				} else if (time_elapsed >= mTimePeriod) {
-					dosContext.packet_count_rate = dosContext.recv_msg_count_since_last_check / time_elapsed * 1000;
-					dosContext.recv_msg_count_since_last_check = 0;
-					dosContext.last_check_recv_msg_check_time = now_in_millis;
-				}
+			uint64_t now_in_millis = getCurrentTimeInMillis();
+			DosContext &dosContext = mDosContexts[DosKey(addr)];
+			if (dosContext.window_start == 0 || now_in_millis < dosContext.window_start) {
+				dosContext.window_start = now_in_millis;
+			} else if (now_in_millis - dosContext.window_start >= (uint64_t)mTimePeriod) {
+				bool adjacent = now_in_millis - dosContext.window_start < 2 * (uint64_t)mTimePeriod;
+				dosContext.previous_count = adjacent ? dosContext.count : 0;
+				dosContext.count = 0;
+				dosContext.window_start = adjacent ? dosContext.window_start + mTimePeriod : now_in_millis;
+			}
+			dosContext.count++;
 
-				if (dosContext.packet_count_rate >= mPacketRateLimit) {
+			double previous_weight = 1 - (double)(now_in_millis - dosContext.window_start) / mTimePeriod;
+			double packet_count_rate =
+				(dosContext.previous_count * previous_weight + dosContext.count) * 1000 / mTimePeriod;
+			if (packet_count_rate >= mPacketRateLimit) {
+				if ((err = getnameinfo(addr, len, ip, sizeof(ip), port, sizeof(port),
+									   NI_NUMERICHOST | NI_NUMERICSERV)) == 0) {
 					LOGW("Packet count rate (%f) >= limit (%i), blocking ip/port %s/%s on protocol udp for %i minutes",
-						 dosContext.packet_count_rate, mPacketRateLimit, ip, port, mBanTime);
+						 packet_count_rate, mPacketRateLimit, ip, port, mBanTime);
 					if (!isIpWhiteListed(ip)) {
 						mThreadPool->Enqueue([&, ip, port] { banIP(ip, port, "udp"); });
 						createBanContextAndPostInFuture(ip, port, "udp");
+						addBannedSource(addr);
 						ev->terminateProcessing(); // the event is discarded
 					} else {
 						LOGW("IP %s should be banned but wasn't because in white list", ip);
 					}
-					dosContext.packet_count_rate = 0; // Reset it to not add the iptables rule twice by mistake
+				} else {
+					LOGW("getnameinfo() failed: %s", gai_strerror(err));
 				}
-			} else {
-				LOGW("getnameinfo() failed: %s", gai_strerror(err));
+				// Reset it to not add the iptables rule twice by mistake
+				dosContext.count = 0;
+				dosContext.previous_count = 0;
+				dosContext.window_start = now_in_millis;
 			}
 		} else {
 			unsigned long packet_count_rate = tport_get_packet_count_rate(tport);
@@ -348,6 +596,7 @@ class DoSProtection : public Module, ModuleToolbox {
 					if (!isIpWhiteListed(ip)) {
 						mThreadPool->Enqueue([&, ip, port] { banIP(ip, port, "tcp"); });
 						createBanContextAndPostInFuture(ip, port, "tcp");
+						addBannedSource(addr);
 						ev->terminateProcessing(); // the event is discarded
 					} else {
 						LOGW("IP %s should be banned but wasn't because in white list", ip);
@@ -368,16 +617,23 @@ class DoSProtection : public Module, ModuleToolbox {
 	DoSProtection(Agent *ag) : Module(ag) {
 		mIptablesVersionChecked = false;
 		mIptablesSupportsWait = false;
+		mUseIpset = false;
+		mIpsetRestore = NULL;
+		mCountRateLimited = NULL;
+		mCountDroppedBanned = NULL;
 		mThreadPool = new ThreadPool(1, 1000);
 	}
 
 	~DoSProtection() {
 		delete mThreadPool;
+		closeIpsetRestore();
 	}
 };
 
 ModuleInfo<DoSProtection>
 	DoSProtection::sInfo("DoSProtection",
 			    "This module bans user when they are sending too much packets within a given timeframe. "
-			    "To see the list of currently banned IPs/ports, use iptables -L. ",
+			    "To see the list of currently banned IPs/ports, use iptables -L. "
+			    "Before that, the requests exceeding the request rates set per source IP, method or AOR can be "
+			    "answered with 503 and a Retry-After header. ",
 			    ModuleInfoBase::ModuleOid::DoSProtection);
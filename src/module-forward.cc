@@ -20,7 +20,9 @@
 #include "agent.hh"
 #include "transaction.hh"
 #include "etchosts.hh"
+#include <map>
 #include <sstream>
+#include <unordered_map>
 
 #include <sofia-sip/su_md5.h>
 #include <sofia-sip/sip_status.h>
@@ -39,10 +41,21 @@ class ForwardModule : public Module, ModuleToolbox {
 	virtual void onLoad(const GenericStruct *root);
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+	virtual void onSweep(SweepBudget &budget);
 	~ForwardModule();
 	void sendRequest(shared_ptr<RequestSipEvent> &ev, url_t *dest);
+	/* Sends the request to the contact registered for its GRUU request uri, remembered for the dialog if found in the
+	 * registrar. */
+	void sendToGruuContact(shared_ptr<RequestSipEvent> &ev, const string &gruu, const url_t *contact, bool fetched);
 
   private:
+	/* Contacts of the GRUU request uris of the in-dialog requests of a call, by GRUU. */
+	struct DialogRoutes {
+		map<string, string> contacts;
+		time_t lastUse;
+	};
+	const string *findGruuContact(const sip_t *sip, const string &gruu);
+	void checkTargetRefresh(const sip_t *sip);
 	url_t *overrideDest(shared_ptr<RequestSipEvent> &ev, url_t *dest);
 	url_t *getDestinationFromRoute(su_home_t *home, sip_t *sip);
 	bool isLooping(shared_ptr<RequestSipEvent> &ev, const char *branch);
@@ -53,6 +66,8 @@ class ForwardModule : public Module, ModuleToolbox {
 	bool mAddPath;
 	string mDefaultTransport;
 	std::list<std::string> mParamsToRemove;
+	unordered_map<string, DialogRoutes> mDialogRoutes; // by Call-ID
+	unique_ptr<string> mSweepCursor;
 	static ModuleInfo<ForwardModule> sInfo;
 };
 
@@ -164,8 +179,8 @@ static bool isUs(Agent *ag, sip_route_t *r) {
 
 class RegistrarListener : public ContactUpdateListener {
 public:
-	RegistrarListener(ForwardModule *module, shared_ptr<RequestSipEvent> ev): ContactUpdateListener(), mModule(module), mEv(ev) {
-	
+	RegistrarListener(ForwardModule *module, shared_ptr<RequestSipEvent> ev, const string &gruu)
+		: ContactUpdateListener(), mModule(module), mEv(ev), mGruu(gruu) {
 	}
 	~RegistrarListener(){};
 	void onRecordFound(Record *r) {
@@ -179,13 +194,7 @@ public:
 			shared_ptr<ExtendedContact> contact = *r->getExtendedContacts().begin();
 			time_t now = getCurrentTime();
 			sip_contact_t *ct = contact->toSofiaContact(ms->getHome(), now);
-			url_t *dest = ct->m_url;
-			mEv->getSip()->sip_request->rq_url[0] = *url_hdup(msg_home(ms->getHome()), dest);
-			mEv->getSip()->sip_request->rq_url->url_params = url_strip_param_string(su_strdup(ms->getHome(),mEv->getSip()->sip_request->rq_url->url_params) , "gr");
-			if (url_has_param(mEv->getSip()->sip_request->rq_url, "regid")) {
-				mEv->getSip()->sip_request->rq_url->url_params = url_strip_param_string(su_strdup(ms->getHome(),mEv->getSip()->sip_request->rq_url->url_params) , "regid");
-			}
-			mModule->sendRequest(mEv,dest);
+			mModule->sendToGruuContact(mEv, mGruu, ct->m_url, true);
 			
 		} catch (FlexisipException &e) {
 			SLOGD << e;
@@ -204,6 +213,7 @@ public:
 	private :
 	ForwardModule *mModule;
 	shared_ptr<RequestSipEvent> mEv;
+	string mGruu;
 };
 
 void ForwardModule::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipException) {
@@ -253,16 +263,93 @@ void ForwardModule::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipExc
 
 	/*gruu processing in forward module is only done if dialog is not establish. In other cases, router mnodule is involved instead*/
 	if (url_has_param(dest,"gr") && (sip->sip_to != NULL && sip->sip_to->a_tag != NULL)) {
+		string gruu = url_as_string(ms->getHome(), dest);
+		const string *contact = findGruuContact(sip, gruu);
+		url_t *resolved = contact ? url_make(ms->getHome(), contact->c_str()) : NULL;
+		// the dialog ends or its target changes: the next requests go through the registrar again
+		checkTargetRefresh(sip);
+		if (resolved) {
+			// resolved for a previous request of the dialog
+			sendToGruuContact(ev, gruu, resolved, false);
+			return;
+		}
 		//gruu case, ask registrar db for AOR
 		ev->suspendProcessing();
-		auto listener = make_shared<RegistrarListener>(this,ev);
+		auto listener = make_shared<RegistrarListener>(this, ev, gruu);
 		RegistrarDb::get()->fetch(dest, listener, false, false /*no recursivity for gruu*/);
 		return;
 	}
+	checkTargetRefresh(sip);
 	
 	sendRequest(ev, dest);
 }
 
+/* Forgets the contacts of a dialog whose target may have changed, or which ends. */
+void ForwardModule::checkTargetRefresh(const sip_t *sip) {
+	if (mDialogRoutes.empty() || !sip->sip_call_id || !sip->sip_to || !sip->sip_to->a_tag)
+		return;
+	sip_method_t method = sip->sip_request->rq_method;
+	bool refresh = sip->sip_contact && (method == sip_method_invite || method == sip_method_update ||
+										method == sip_method_subscribe || method == sip_method_notify);
+	if (method == sip_method_bye || refresh)
+		mDialogRoutes.erase(sip->sip_call_id->i_id);
+}
+
+const string *ForwardModule::findGruuContact(const sip_t *sip, const string &gruu) {
+	if (!sip->sip_call_id)
+		return NULL;
+	auto it = mDialogRoutes.find(sip->sip_call_id->i_id);
+	if (it == mDialogRoutes.end())
+		return NULL;
+	auto contact = it->second.contacts.find(gruu);
+	if (contact == it->second.contacts.end())
+		return NULL;
+	it->second.lastUse = getCurrentTime();
+	return &contact->second;
+}
+
+void ForwardModule::sendToGruuContact(shared_ptr<RequestSipEvent> &ev, const string &gruu, const url_t *contact,
+									  bool fetched) {
+	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	sip_t *sip = ms->getSip();
+	url_t *dest = url_hdup(ms->getHome(), contact);
+	if (fetched && sip->sip_call_id && sip->sip_request->rq_method != sip_method_bye) {
+		DialogRoutes &routes = mDialogRoutes[sip->sip_call_id->i_id];
+		routes.contacts[gruu] = url_as_string(ms->getHome(), dest);
+		routes.lastUse = getCurrentTime();
+	}
+	sip->sip_request->rq_url[0] = *url_hdup(ms->getHome(), dest);
+	sip->sip_request->rq_url->url_params =
+		url_strip_param_string(su_strdup(ms->getHome(), sip->sip_request->rq_url->url_params), "gr");
+	if (url_has_param(sip->sip_request->rq_url, "regid")) {
+		sip->sip_request->rq_url->url_params =
+			url_strip_param_string(su_strdup(ms->getHome(), sip->sip_request->rq_url->url_params), "regid");
+	}
+	sendRequest(ev, dest);
+}
+
+/* Forgets the dialogs without request for two hours, from where the previous slice stopped. */
+void ForwardModule::onSweep(SweepBudget &budget) {
+	time_t now = getCurrentTime();
+	auto it = mDialogRoutes.begin();
+	if (mSweepCursor) {
+		// an iterator would not survive the rehashes of the table in the meantime, the key does
+		it = mDialogRoutes.find(*mSweepCursor);
+		if (it == mDialogRoutes.end())
+			it = mDialogRoutes.begin();
+	}
+	while (it != mDialogRoutes.end() && budget.next()) {
+		if (now >= it->second.lastUse + 2 * 3600)
+			it = mDialogRoutes.erase(it);
+		else
+			++it;
+	}
+	if (it == mDialogRoutes.end())
+		mSweepCursor.reset();
+	else
+		mSweepCursor.reset(new string(it->first));
+}
+
 void ForwardModule::sendRequest(shared_ptr<RequestSipEvent> &ev, url_t *dest) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
@@ -275,6 +362,8 @@ void ForwardModule::sendRequest(shared_ptr<RequestSipEvent> &ev, url_t *dest) {
 		/* duplication of dest because we don't want to modify the message with our name resolution result*/
 		dest = url_hdup(ms->getHome(), dest);
 		dest->url_host = ip.c_str();
+	} else if (getAgent()->getResolverCache()) {
+		getAgent()->getResolverCache()->touch(dest);
 	}
 	
 	// Check self-forwarding
@@ -375,6 +464,11 @@ bool ForwardModule::isLooping(shared_ptr<RequestSipEvent> &ev, const char *branc
 
 void ForwardModule::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(FlexisipException) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	sip_t *sip = ms->getSip();
+	int code = sip->sip_status->st_status;
+	// the contact of the GRUU may no longer be the right one
+	if ((code == 408 || code == 430 || code == 503) && sip->sip_call_id && !mDialogRoutes.empty())
+		mDialogRoutes.erase(sip->sip_call_id->i_id);
 	ev->send(ms);
 }
 
@@ -20,223 +20,243 @@
 #include "agent.hh"
 #include "authdb.hh"
 #include "registrardb.hh"
+#include "utils/timerwheel.hh"
 #include <sofia-sip/nua.h>
 #include <sofia-sip/sip_status.h>
 #include <limits.h>
 
+#include <deque>
+#include <memory>
+#include <random>
+#include <unordered_map>
+
 using namespace std;
 
 class GatewayAdapter;
 
-class GatewayRegister {
-	typedef enum { INITIAL, REGISTRING, REGISTRED } State;
-	State state;
-	Agent *mAgent;
-	su_home_t home;
-	nua_handle_t *nh;
-	sip_from_t *from;
-	sip_to_t *to;
-	string password;
-	string routingParam;
-	sip_contact_t *contact;
-
-	static StatCounter64 *mCountInitialMsg;
-	static StatCounter64 *mCountRegisteringMsg200;
-	static StatCounter64 *mCountRegisteringMsg408;
-	static StatCounter64 *mCountRegisteringMsg401;
-	static StatCounter64 *mCountRegisteringMsg407;
-	static StatCounter64 *mCountRegisteringMsgUnknown;
-	static StatCounter64 *mCountRegisteredUnknown;
-	static StatCounter64 *mCountStart;
-	static StatCounter64 *mCountError;
-	static StatCounter64 *mCountEnd;
-	static StatCounter64 *mCountForkToGateway;
-	static StatCounter64 *mCountDomainRewrite;
-
+/*
+ * Registrations of the users on the gateway, refreshed by this engine while the users stay registered on the proxy.
+ * A user costs a small record and a single entry of a timer wheel. The REGISTERs are sent at a bounded rate from a
+ * bounded number of nua handles, each destroyed once its transaction is over, and the refreshes are randomly spread
+ * between 60 and 90% of the expiration delays so that the users registered at once do not refresh at once.
+ */
+class GatewayRegistrations : public enable_shared_from_this<GatewayRegistrations> {
   public:
-	void sendRegister();
-	GatewayRegister(Agent *ag, nua_t *nua, sip_from_t *from, sip_to_t *to, sip_contact_t *contact,
-					const sip_expires_t *global_expire);
-	~GatewayRegister();
-	void onMessage(const sip_t *sip);
-	void onError(const char *message, ...);
-
-	void start();
-	void end();
-	void authenticate(const msg_param_t *au_params);
-
-	sip_from_t *getFrom() const {
-		return from;
-	}
+	GatewayRegistrations(Agent *ag, nua_t *nua, const GenericStruct *mc);
+	~GatewayRegistrations();
+	/* Registers on the gateway the user of an incoming REGISTER, or updates its registration. */
+	void onClientRegister(const sip_t *sip);
+	void onResponse(nua_handle_t *nh, int status, const sip_t *sip);
+	static void onDeclare(GenericStruct *mc);
 
-	sip_to_t *getTo() const {
-		return to;
-	}
-
-	void setPassword(const string &ipassword) {
-		this->password = ipassword;
-	}
+  private:
+	enum class State : unsigned char { Waiting, Queued, Registering };
+	struct Registration {
+		string domain;		// of the user, added to the contact for the routing of the calls from the gateway
+		string contactUser; // of the contact
+		string password;
+		time_t clientExpire; // end of the registration of the user on the proxy
+		time_t next;		 // time of the next REGISTER, while waiting
+		int expire;			 // asked to the gateway
+		unsigned short failures;
+		State state;
+		bool authenticated; // for the current transaction
+	};
 
-	const string &getPassword() {
-		return password;
-	}
-	static void onDeclare(GenericStruct *mc) {
-		mCountInitialMsg = mc->createStat("count-gr-initial-msg", "Number of msg received while in initial state");
-		mCountRegisteringMsg200 =
-			mc->createStat("count-gr-registering-200", "Number of 200 received while in registering state");
-		mCountRegisteringMsg408 =
-			mc->createStat("count-gr-registering-408", "Number of 408 received while in registering state");
-		mCountRegisteringMsg401 =
-			mc->createStat("count-gr-registering-401", "Number of 401 received while in registering state");
-		mCountRegisteringMsg407 =
-			mc->createStat("count-gr-registering-407", "Number of 407 received while in registering state");
-		mCountRegisteringMsgUnknown =
-			mc->createStat("count-gr-registering-unknown", "Number of unknown received while in registering state");
-		mCountRegisteredUnknown =
-			mc->createStat("count-gr-registered-unknown", "Number of msg received while in registered state");
-		mCountStart = mc->createStat("count-gr-start", "Number of calls to start()");
-		mCountError = mc->createStat("count-gr-error", "Number of calls to error()");
-		mCountEnd = mc->createStat("count-gr-end", "Number of calls to end()");
-	}
+	void schedule(const string &aor, Registration &reg, time_t delay);
+	void onPassword(const string &aor, AuthDbResult result, const string &password);
+	void send(const string &aor, Registration &reg);
+	void authenticate(nua_handle_t *nh, const string &aor, const msg_param_t *au_params, const string &password);
+	void pump();
+	void onTick();
+	static void sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
 
-  private:
-	// Listener class NEED to copy the shared pointer
 	class OnAuthListener : public AuthDbListener {
-	  private:
-		GatewayRegister *gw;
-
 	  public:
-		OnAuthListener(GatewayRegister *igw) : gw(igw) {
-		}
-
-		void checkPassword(const char *ipassword) {
-			LOGD("Found password");
-			gw->setPassword(ipassword);
-			gw->sendRegister();
+		OnAuthListener(const shared_ptr<GatewayRegistrations> &registrations, const string &aor)
+			: mRegistrations(registrations), mAor(aor) {
 		}
-
 		virtual void onResult(AuthDbResult result, const std::string &passwd) {
-			if (result == AuthDbResult::PASSWORD_FOUND) {
-				checkPassword(passwd.c_str());
-			} else {
-				LOGE("GatewayRegister onResult(): Can't find user password, give up.");
-			}
+			auto registrations = mRegistrations.lock();
+			if (registrations)
+				registrations->onPassword(mAor, result, passwd);
 			delete this;
 		}
-	};
 
-	// Listener class NEED to copy the shared pointer
-	class OnFetchListener : public ContactUpdateListener {
 	  private:
-		GatewayRegister *gw;
-
-	  public:
-		OnFetchListener(GatewayRegister *igw) : gw(igw) {
-		}
-
-		~OnFetchListener() {
-		}
-
-		void onInvalid() {
-			LOGD("GATEWAY: invalid");
-		}
-
-		void onRecordFound(Record *r) {
-			if (r == NULL) {
-				LOGD("Record doesn't exist. Fork");
-				AuthDbBackend *mAuthDb = AuthDbBackend::get();
-				url_t *url = gw->getFrom()->a_url;
-				mAuthDb->getPassword(url->url_user, url->url_host, url->url_user, new OnAuthListener(gw));
-			} else {
-				LOGD("Record already exists. Not forked");
-			}
-		}
+		weak_ptr<GatewayRegistrations> mRegistrations;
+		string mAor;
+	};
 
-		void onError() {
-			gw->onError("Fetch error.");
-		}
+	Agent *mAgent;
+	nua_t *mNua;
+	string mGatewayDomain;
+	int mForcedExpire;
+	string mRoutingParam;
+	unsigned int mRate;
+	size_t mMaxPending;
+	unsigned int mTokens;
+	unordered_map<string, Registration> mRegistrations; // by aor on the gateway
+	unordered_map<nua_handle_t *, string> mPending;	   // transactions in progress
+	deque<string> mQueue;							   // waiting for the rate limit or a free handle
+	TimerWheel<string> mWheel;
+	su_timer_t *mTimer;
+	minstd_rand mRandom;
 
-		void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
-		}
-	};
+	static StatCounter64 *mCountInitialMsg;
+	static StatCounter64 *mCountRegisteringMsg200;
+	static StatCounter64 *mCountRegisteringMsg408;
+	static StatCounter64 *mCountRegisteringMsg401;
+	static StatCounter64 *mCountRegisteringMsg407;
+	static StatCounter64 *mCountRegisteringMsgUnknown;
+	static StatCounter64 *mCountRegisteredUnknown;
+	static StatCounter64 *mCountStart;
+	static StatCounter64 *mCountError;
+	static StatCounter64 *mCountEnd;
 };
 
-StatCounter64 *GatewayRegister::mCountInitialMsg = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteringMsg200 = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteringMsg408 = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteringMsg401 = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteringMsg407 = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteringMsgUnknown = NULL;
-StatCounter64 *GatewayRegister::mCountRegisteredUnknown = NULL;
-StatCounter64 *GatewayRegister::mCountStart = NULL;
-StatCounter64 *GatewayRegister::mCountError = NULL;
-StatCounter64 *GatewayRegister::mCountEnd = NULL;
-StatCounter64 *GatewayRegister::mCountForkToGateway = NULL;
-StatCounter64 *GatewayRegister::mCountDomainRewrite = NULL;
-
-GatewayRegister::GatewayRegister(Agent *ag, nua_t *nua, sip_from_t *sip_from, sip_to_t *sip_to,
-								 sip_contact_t *sip_contact, const sip_expires_t *global_expire)
-	: mAgent(ag) {
-	su_home_init(&home);
+StatCounter64 *GatewayRegistrations::mCountInitialMsg = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteringMsg200 = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteringMsg408 = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteringMsg401 = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteringMsg407 = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteringMsgUnknown = NULL;
+StatCounter64 *GatewayRegistrations::mCountRegisteredUnknown = NULL;
+StatCounter64 *GatewayRegistrations::mCountStart = NULL;
+StatCounter64 *GatewayRegistrations::mCountError = NULL;
+StatCounter64 *GatewayRegistrations::mCountEnd = NULL;
+
+void GatewayRegistrations::onDeclare(GenericStruct *mc) {
+	mCountInitialMsg = mc->createStat("count-gr-initial-msg", "Number of responses to no pending REGISTER");
+	mCountRegisteringMsg200 =
+		mc->createStat("count-gr-registering-200", "Number of 200 received while in registering state");
+	mCountRegisteringMsg408 =
+		mc->createStat("count-gr-registering-408", "Number of 408 received while in registering state");
+	mCountRegisteringMsg401 =
+		mc->createStat("count-gr-registering-401", "Number of 401 received while in registering state");
+	mCountRegisteringMsg407 =
+		mc->createStat("count-gr-registering-407", "Number of 407 received while in registering state");
+	mCountRegisteringMsgUnknown =
+		mc->createStat("count-gr-registering-unknown", "Number of unknown received while in registering state");
+	mCountRegisteredUnknown =
+		mc->createStat("count-gr-registered-unknown", "Number of msg received while in registered state");
+	mCountStart = mc->createStat("count-gr-start", "Number of registrations started on the gateway");
+	mCountError = mc->createStat("count-gr-error", "Number of failed REGISTERs to the gateway");
+	mCountEnd = mc->createStat("count-gr-end", "Number of registrations ended on the gateway");
+}
 
-	url_t *domain = NULL;
-	GenericStruct *cr = GenericManager::get()->getRoot();
-	GenericStruct *ma = cr->get<GenericStruct>("module::GatewayAdapter");
-	string domainString = ma->get<ConfigString>("gateway-domain")->read();
-	int forcedExpireValue = ma->get<ConfigInt>("forced-expire")->read();
-	routingParam = ma->get<ConfigString>("routing-param")->read();
-	if (!domainString.empty()) {
-		domain = url_make(&home, domainString.c_str());
-	}
+GatewayRegistrations::GatewayRegistrations(Agent *ag, nua_t *nua, const GenericStruct *mc)
+	: mAgent(ag), mNua(nua), mTokens(0), mWheel(getCurrentTime()), mRandom(random_device()()) {
+	mGatewayDomain = mc->get<ConfigString>("gateway-domain")->read();
+	mForcedExpire = mc->get<ConfigInt>("forced-expire")->read();
+	mRoutingParam = mc->get<ConfigString>("routing-param")->read();
+	mRate = max(1, mc->get<ConfigInt>("register-rate")->read());
+	mMaxPending = max(1, mc->get<ConfigInt>("max-pending-registers")->read());
+	mTokens = mRate;
+	mTimer = su_timer_create(su_root_task(ag->getRoot()), 1000);
+	su_timer_set_for_ever(mTimer, &GatewayRegistrations::sOnTick, this);
+}
 
-	from = sip_from_dup(&home, sip_from);
-	to = sip_to_dup(&home, sip_to);
-
-	// Copy contact
-	const url_t *url = ag->getPreferredRouteUrl();
-	const char *port = url->url_port;
-	const char *user = sip_contact->m_url->url_user;
-	int expire = forcedExpireValue != -1
-					 ? forcedExpireValue
-					 : ExtendedContact::resolveExpire(sip_contact->m_expires,
-													  global_expire != NULL ? global_expire->ex_delta : -1);
-	if (port) {
-		contact =
-			sip_contact_format(&home, "<%s:%s@%s:%s>;expires=%i", url->url_scheme, user, url->url_host, port, expire);
-	} else {
-		contact = sip_contact_format(&home, "<%s:%s@%s>;expires=%i", url->url_scheme, user, url->url_host, expire);
-	}
+GatewayRegistrations::~GatewayRegistrations() {
+	su_timer_destroy(mTimer);
+	for (auto &pending : mPending)
+		nua_handle_destroy(pending.first);
+}
 
-	// Override domains?
-	if (domain != NULL) {
-		from->a_url->url_host = domain->url_host;
-		to->a_url->url_host = domain->url_host;
+void GatewayRegistrations::onClientRegister(const sip_t *sip) {
+	const url_t *from = sip->sip_from->a_url;
+	string domain = from->url_host;
+	string aor = string("sip:") + (from->url_user ? from->url_user : "") + "@" +
+				 (mGatewayDomain.empty() ? domain : mGatewayDomain);
+	int clientExpire = ExtendedContact::resolveExpire(sip->sip_contact->m_expires,
+													  sip->sip_expires != NULL ? sip->sip_expires->ex_delta : -1);
+	time_t now = getCurrentTime();
+
+	auto it = mRegistrations.find(aor);
+	if (it != mRegistrations.end()) {
+		// the registration on the gateway is left as it is, and ends at its first refresh after the user's one
+		it->second.clientExpire = now + clientExpire;
+		return;
 	}
+	if (clientExpire <= 0)
+		return;
 
-	state = State::INITIAL;
+	Registration &reg = mRegistrations[aor];
+	reg.domain = domain;
+	reg.contactUser = sip->sip_contact->m_url->url_user ? sip->sip_contact->m_url->url_user : "";
+	reg.clientExpire = now + clientExpire;
+	reg.next = 0;
+	reg.expire = mForcedExpire != -1 ? mForcedExpire : clientExpire;
+	reg.failures = 0;
+	reg.state = State::Waiting;
+	reg.authenticated = false;
+	++*mCountStart;
+	LOGD("Registering %s on the gateway", aor.c_str());
+	AuthDbBackend::get()->getPassword(from->url_user ? from->url_user : "",
+									  mGatewayDomain.empty() ? domain : mGatewayDomain,
+									  from->url_user ? from->url_user : "",
+									  new OnAuthListener(shared_from_this(), aor));
+}
 
-	nh = nua_handle(nua, this, SIPTAG_FROM(from), SIPTAG_TO(to), TAG_END());
+void GatewayRegistrations::onPassword(const string &aor, AuthDbResult result, const string &password) {
+	auto it = mRegistrations.find(aor);
+	if (it == mRegistrations.end())
+		return;
+	if (result != AuthDbResult::PASSWORD_FOUND) {
+		LOGE("Can't find the password of %s, not registered on the gateway.", aor.c_str());
+		++*mCountEnd;
+		mRegistrations.erase(it);
+		return;
+	}
+	it->second.password = password;
+	it->second.state = State::Queued;
+	mQueue.push_back(aor);
+	pump();
 }
 
-GatewayRegister::~GatewayRegister() {
-	nua_handle_destroy(nh);
-	su_home_deinit(&home);
+void GatewayRegistrations::schedule(const string &aor, Registration &reg, time_t delay) {
+	reg.state = State::Waiting;
+	reg.next = getCurrentTime() + max((time_t)1, delay);
+	mWheel.schedule(reg.next, aor);
 }
 
-void GatewayRegister::sendRegister() {
-	LOGD("Send REGISTER");
-	state = State::REGISTRING;
+void GatewayRegistrations::pump() {
+	while (!mQueue.empty() && mTokens > 0 && mPending.size() < mMaxPending) {
+		string aor = mQueue.front();
+		mQueue.pop_front();
+		auto it = mRegistrations.find(aor);
+		if (it == mRegistrations.end() || it->second.state != State::Queued)
+			continue;
+		--mTokens;
+		send(aor, it->second);
+	}
+}
 
+void GatewayRegistrations::send(const string &aor, Registration &reg) {
 	// Add a parameter with the domain so that when the gateway sends an INVITE
 	// to us we know where to route it.
-	ostringstream oss;
-	oss << routingParam << "=" << from->a_url->url_host;
-	string routing_param(oss.str());
-	url_param_add(&home, contact->m_url, routing_param.c_str());
-	nua_register(nh, SIPTAG_CONTACT(contact), TAG_END());
+	const url_t *url = mAgent->getPreferredRouteUrl();
+	ostringstream contact;
+	contact << "<" << url->url_scheme << ":" << reg.contactUser << "@" << url->url_host;
+	if (url->url_port)
+		contact << ":" << url->url_port;
+	contact << ";" << mRoutingParam << "=" << reg.domain << ">;expires=" << reg.expire;
+
+	LOGD("Send REGISTER of %s", aor.c_str());
+	nua_handle_t *nh = nua_handle(mNua, this, SIPTAG_FROM_STR(aor.c_str()), SIPTAG_TO_STR(aor.c_str()), TAG_END());
+	if (!nh) {
+		LOGE("Cannot create the nua handle of %s", aor.c_str());
+		schedule(aor, reg, 30);
+		return;
+	}
+	reg.state = State::Registering;
+	reg.authenticated = false;
+	mPending[nh] = aor;
+	nua_register(nh, SIPTAG_CONTACT_STR(contact.str().c_str()), TAG_END());
 }
 
-void GatewayRegister::authenticate(const msg_param_t *au_params) {
+void GatewayRegistrations::authenticate(nua_handle_t *nh, const string &aor, const msg_param_t *au_params,
+										const string &password) {
 	ostringstream digest;
 	digest << "Digest:";
 
@@ -247,7 +267,7 @@ void GatewayRegister::authenticate(const msg_param_t *au_params) {
 	if (realm[strlen(realm) - 1] != '"')
 		digest << "\"";
 
-	string user(getFrom()->a_url->url_user);
+	string user(aor.substr(4, aor.find('@') - 4));
 
 	digest << ":" << user << ":" << password;
 
@@ -256,70 +276,96 @@ void GatewayRegister::authenticate(const msg_param_t *au_params) {
 	nua_authenticate(nh, NUTAG_AUTH(digeststr.c_str()), TAG_END());
 }
 
-void GatewayRegister::onMessage(const sip_t *sip) {
-	switch (state) {
-		case State::INITIAL:
-			onError("Can't receive message in this state");
-			++*mCountInitialMsg;
-			break;
-
-		case State::REGISTRING:
-			switch (sip->sip_status->st_status) {
-				case 200:
-					++*mCountRegisteringMsg200;
-					LOGD("REGISTER done");
-					state = State::REGISTRED;
-					end(); // TODO: stop the dialog?
-					break;
-				case 408:
-					++*mCountRegisteringMsg408;
-					LOGD("REGISTER timeout");
-					end();
-					break;
-				case 401:
-					++*mCountRegisteringMsg401;
-					LOGD("REGISTER challenged 401");
-					authenticate(sip->sip_www_authenticate->au_params);
-					break;
-				case 407:
-					++*mCountRegisteringMsg407;
-					LOGD("REGISTER challenged 407");
-					authenticate(sip->sip_proxy_authenticate->au_params);
-					break;
-				default:
-					++*mCountRegisteringMsgUnknown;
-					LOGD("REGISTER not handled response: %i", sip->sip_status->st_status);
-					end();
-					break;
-			}
-			break;
-
-		case State::REGISTRED:
-			++*mCountRegisteredUnknown;
-			LOGD("new message %i", sip->sip_status->st_status);
-			break;
+void GatewayRegistrations::onResponse(nua_handle_t *nh, int status, const sip_t *sip) {
+	if (status < 200)
+		return;
+	auto pending = mPending.find(nh);
+	if (pending == mPending.end()) {
+		++*mCountInitialMsg;
+		return;
+	}
+	string aor = pending->second;
+	auto it = mRegistrations.find(aor);
+	if (it == mRegistrations.end()) {
+		mPending.erase(pending);
+		nua_handle_destroy(nh);
+		return;
+	}
+	Registration &reg = it->second;
+
+	if ((status == 401 || status == 407) && sip && !reg.authenticated) {
+		const msg_param_t *au_params = NULL;
+		if (status == 401 && sip->sip_www_authenticate) {
+			++*mCountRegisteringMsg401;
+			au_params = sip->sip_www_authenticate->au_params;
+		} else if (status == 407 && sip->sip_proxy_authenticate) {
+			++*mCountRegisteringMsg407;
+			au_params = sip->sip_proxy_authenticate->au_params;
+		}
+		if (au_params && msg_params_find(au_params, "realm=")) {
+			LOGD("REGISTER of %s challenged %i", aor.c_str(), status);
+			reg.authenticated = true;
+			authenticate(nh, aor, au_params, reg.password);
+			return;
+		}
 	}
-}
 
-void GatewayRegister::onError(const char *message, ...) {
-	++*mCountError;
-	va_list args;
-	va_start(args, message);
-	LOGE("%s", message);
-	va_end(args);
-	end();
+	// the handle is not kept: the registration is refreshed from a new one
+	mPending.erase(pending);
+	nua_handle_destroy(nh);
+
+	if (status == 200) {
+		++*mCountRegisteringMsg200;
+		int granted = reg.expire;
+		if (sip && sip->sip_contact && sip->sip_contact->m_expires)
+			granted = atoi(sip->sip_contact->m_expires);
+		else if (sip && sip->sip_expires)
+			granted = sip->sip_expires->ex_delta;
+		reg.failures = 0;
+		// the registrations made at once, as after a restart, are refreshed at different times
+		uniform_int_distribution<time_t> spread(granted * 6 / 10, granted * 9 / 10);
+		time_t delay = spread(mRandom);
+		LOGD("REGISTER of %s done, refreshed in %li seconds", aor.c_str(), (long)delay);
+		schedule(aor, reg, delay);
+	} else {
+		if (status == 408)
+			++*mCountRegisteringMsg408;
+		else if (status != 401 && status != 407)
+			++*mCountRegisteringMsgUnknown;
+		++*mCountError;
+		// exponential backoff from 30 seconds to 30 minutes
+		time_t delay = 30 << min<int>(reg.failures, 6);
+		if (reg.failures < USHRT_MAX)
+			++reg.failures;
+		uniform_int_distribution<time_t> spread(delay / 2, delay);
+		delay = spread(mRandom);
+		LOGD("REGISTER of %s failed with %i, retried in %li seconds", aor.c_str(), status, (long)delay);
+		schedule(aor, reg, delay);
+	}
+	pump();
 }
 
-void GatewayRegister::start() {
-	LOGD("GatewayRegister start");
-	LOGD("Fetching binding");
-	++*mCountStart;
-	RegistrarDb::get()->fetch(from->a_url, make_shared<OnFetchListener>(this));
+void GatewayRegistrations::onTick() {
+	time_t now = getCurrentTime();
+	mWheel.advance(now, [this, now](const string &aor, time_t when) {
+		auto it = mRegistrations.find(aor);
+		if (it == mRegistrations.end() || it->second.state != State::Waiting || it->second.next != when)
+			return; // rescheduled since
+		if (it->second.clientExpire <= now) {
+			LOGD("%s is not registered anymore, its registration on the gateway ends", aor.c_str());
+			++*mCountEnd;
+			mRegistrations.erase(it);
+			return;
+		}
+		it->second.state = State::Queued;
+		mQueue.push_back(aor);
+	});
+	mTokens = mRate;
+	pump();
 }
 
-void GatewayRegister::end() {
-	++*mCountEnd;
-	LOGD("GatewayRegister end");
+void GatewayRegistrations::sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<GatewayRegistrations *>(arg)->onTick();
 }
 
 class GatewayAdapter : public Module {
@@ -335,6 +381,8 @@ class GatewayAdapter : public Module {
 
 	virtual void onLoad(const GenericStruct *module_config);
 
+	virtual void onUnload();
+
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
@@ -347,6 +395,7 @@ class GatewayAdapter : public Module {
 
 	static ModuleInfo<GatewayAdapter> sInfo;
 	nua_t *nua;
+	shared_ptr<GatewayRegistrations> mRegistrations;
 	url_t *gateway_url;
 	bool mRegisterOnGateway, mForkToGateway;
 	string mRoutingParam;
@@ -358,6 +407,7 @@ GatewayAdapter::GatewayAdapter(Agent *ag) : Module(ag), nua(NULL) {
 }
 
 GatewayAdapter::~GatewayAdapter() {
+	mRegistrations.reset();
 	if (nua != NULL) {
 		nua_shutdown(nua);
 		su_root_run(mAgent->getRoot()); // Correctly wait for nua_destroy
@@ -381,9 +431,12 @@ void GatewayAdapter::onDeclare(GenericStruct *mc) {
 		{String, "routing-param",
 		 "Parameter name hosting the incoming domain that will be sent in the register to the gateway.",
 		 "routing-domain"},
+		{Integer, "register-rate", "Maximum number of REGISTERs sent to the gateway per second.", "50"},
+		{Integer, "max-pending-registers",
+		 "Maximum number of REGISTERs waiting for the answer of the gateway. The next ones wait for them.", "100"},
 		config_item_end};
 	mc->addChildrenValues(items);
-	GatewayRegister::onDeclare(mc);
+	GatewayRegistrations::onDeclare(mc);
 	mCountForkToGateway = mc->createStat("count-fork-to-gateway", "Number of forks to gateway.");
 	mCountDomainRewrite = mc->createStat("count-domain-rewrite", "Number of domain rewrite.");
 }
@@ -409,23 +462,32 @@ void GatewayAdapter::onLoad(const GenericStruct *module_config) {
 	mRoutingParam = module_config->get<ConfigString>("routing-param")->read();
 	gateway_url = url_make(&home, gateway.c_str());
 	if (mRegisterOnGateway) {
-		char *url = su_sprintf(&home, "sip:%s:*", mAgent->getPublicIp().c_str());
-		nua = nua_create(mAgent->getRoot(), nua_callback, this, NUTAG_URL(url),
-						 NUTAG_OUTBOUND("no-validate no-natify no-options-keepalive"), NUTAG_PROXY(gateway.c_str()),
-						 TAG_END());
+		if (nua == NULL) {
+			char *url = su_sprintf(&home, "sip:%s:*", mAgent->getPublicIp().c_str());
+			nua = nua_create(mAgent->getRoot(), nua_callback, this, NUTAG_URL(url),
+							 NUTAG_OUTBOUND("no-validate no-natify no-options-keepalive"), NUTAG_PROXY(gateway.c_str()),
+							 TAG_END());
+		} else {
+			// kept across the reloads of the module, as it is only destroyed with the agent
+			nua_set_params(nua, NUTAG_PROXY(gateway.c_str()), TAG_END());
+		}
+		mRegistrations = make_shared<GatewayRegistrations>(getAgent(), nua, module_config);
 	}
 }
 
+void GatewayAdapter::onUnload() {
+	mRegistrations.reset();
+}
+
 void GatewayAdapter::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipException) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
 
 	if (sip->sip_request->rq_method == sip_method_register) {
 		if (sip->sip_contact != NULL) {
-			GatewayRegister *gr = NULL;
-			if (mRegisterOnGateway) {
-				gr = new GatewayRegister(getAgent(), nua, sip->sip_from, sip->sip_to, sip->sip_contact,
-										 sip->sip_expires);
+			// before the contact of the gateway is added
+			if (mRegistrations) {
+				mRegistrations->onClientRegister(sip);
 			}
 
 			if (mForkToGateway) {
@@ -441,12 +503,10 @@ void GatewayAdapter::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipEx
 				sip->sip_contact = contact;
 				++*mCountForkToGateway;
 			}
-
-			if (mRegisterOnGateway && gr) {
-				gr->start();
-			}
 		}
 	} else {
+		/* nothing is fetched from the registrar here: the Router makes the only lookup of the request, the gateway
+		 * being reached through the contact added to the registrations */
 		/* check if request-uri contains a routing-domain parameter, so that we can route back to the client */
 		char routing_param[64];
 		url_t *dest = sip->sip_request->rq_url;
@@ -464,7 +524,7 @@ void GatewayAdapter::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(Flexisip
 
 void GatewayAdapter::nua_callback(nua_event_t event, int status, char const *phrase, nua_t *nua, nua_magic_t *ctx,
 								  nua_handle_t *nh, nua_hmagic_t *hmagic, sip_t const *sip, tagi_t tags[]) {
-	GatewayRegister *gr = (GatewayRegister *)hmagic;
+	GatewayRegistrations *registrations = (GatewayRegistrations *)hmagic;
 
 	if (event == nua_r_shutdown && status >= 200) {
 		GatewayAdapter *ga = (GatewayAdapter *)ctx;
@@ -475,10 +535,8 @@ void GatewayAdapter::nua_callback(nua_event_t event, int status, char const *phr
 		return;
 	}
 
-	if (gr != NULL) {
-		if (sip != NULL) {
-			gr->onMessage(sip);
-		}
+	if (registrations != NULL && event == nua_r_register) {
+		registrations->onResponse(nh, status, sip);
 	}
 }
 
@@ -1,3 +1,27 @@
+void LoadBalancer::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException){
+	if (!mLeastLoaded)
+		return;
+	auto transaction = dynamic_pointer_cast<OutgoingTransaction>(ev->getOutgoingAgent());
+	if (!transaction)
+		return;
+	auto pending = transaction->getProperty<PendingRequest>(getModuleName());
+	if (!pending)
+		return;
+	int status = ev->getMsgSip()->getSip()->sip_status->st_status;
+	if (!pending->answered) {
+		pending->answered = true;
+		shared_ptr<Route> route = pending->route.lock();
+		// 408 and 503 may be generated locally on a timeout or a connection failure, they tell nothing of the latency
+		if (route && status != 408 && status != 503) {
+			double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - pending->start).count();
+			// same smoothing as the TCP round-trip time estimator
+			route->latency = route->latency == 0 ? ms : route->latency + (ms - route->latency) / 8;
+		}
+	}
+	if (status >= 200)
+		pending->finish();
+}
+
 /*
 	Flexisip, a flexible SIP proxy server with media capabilities.
 	Copyright (C) 2011  Belledonne Communications SARL.
@@ -18,7 +42,14 @@
 
 #include "module.hh"
 #include "agent.hh"
+#include "transaction.hh"
+#include "utils/hashring.hh"
+
+#include <sofia-sip/nta.h>
 
+#include <chrono>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -29,59 +60,298 @@ class LoadBalancer : public Module, public ModuleToolbox {
 	virtual ~LoadBalancer();
 	virtual void onDeclare(GenericStruct *module_config);
 	virtual void onLoad(const GenericStruct *modconf);
+	virtual void onUnload();
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 
   private:
-	vector<string> mRoutes;
-	int mRoutesCount;
+	struct Route {
+		LoadBalancer *balancer;
+		string route; // as prepended, without the weight
+		string uri;	  // probed by the health checks
+		unsigned int weight;
+		bool alive;
+		int failures;
+		nta_outgoing_t *probe;
+		int inFlight;	// requests sent and not answered yet, by the least-loaded strategy
+		double latency; // moving average of the time to the first response, in milliseconds
+	};
+	/* Request sent to a route by the least-loaded strategy, attached to its outgoing transaction. */
+	struct PendingRequest {
+		PendingRequest(const shared_ptr<Route> &r)
+			: route(r), start(chrono::steady_clock::now()), answered(false), done(false) {
+			++r->inFlight;
+		}
+		~PendingRequest() {
+			finish();
+		}
+		void finish() {
+			shared_ptr<Route> r = route.lock();
+			if (!done && r)
+				--r->inFlight;
+			done = true;
+		}
+		weak_ptr<Route> route;
+		chrono::steady_clock::time_point start;
+		bool answered;
+		bool done;
+	};
+	struct Dialog {
+		shared_ptr<Route> route;
+		time_t lastUse;
+	};
+	shared_ptr<Route> routeByHash(sip_t *sip);
+	shared_ptr<Route> routeByLoad(shared_ptr<RequestSipEvent> &ev);
+	shared_ptr<Route> selectLeastLoaded();
+	void purgeDialogs();
+	void scheduleHealthCheck();
+	void checkHealth();
+	void onProbeResponse(Route *route, int status);
+	static int sOnProbeResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip);
+
+	vector<shared_ptr<Route>> mRoutes;
+	unique_ptr<HashRing<shared_ptr<Route>>> mRing;
+	bool mLeastLoaded;
+	int mDialogIdleTime;
+	unordered_map<string, Dialog> mDialogs; // by Call-ID, for the least-loaded strategy
+	shared_ptr<TimerService::Timer> mPurgeTimer;
+	int mHealthCheckInterval;
+	int mMaxFailures;
+	shared_ptr<TimerService::Timer> mHealthCheckTimer;
+	StatCounter64 *mCountRoutesDown;
 	static ModuleInfo<LoadBalancer> sInfo;
 };
 
-LoadBalancer::LoadBalancer(Agent *ag) : Module(ag) {
+LoadBalancer::LoadBalancer(Agent *ag)
+	: Module(ag), mLeastLoaded(false), mDialogIdleTime(0), mHealthCheckInterval(0), mMaxFailures(1), mCountRoutesDown(NULL) {
 }
 
 LoadBalancer::~LoadBalancer() {
+	onUnload();
 }
 
 void LoadBalancer::onDeclare(GenericStruct *module_config) {
 	/*we need to be disabled by default*/
 	module_config->get<ConfigBoolean>("enabled")->setDefault("false");
-	ConfigItemDescriptor items[] = {{StringList, "routes", "Whitespace separated list of sip routes to balance the "
-														   "requests. Example: <sip:192.168.0.22> <sip:192.168.0.23>",
-									 ""},
-									config_item_end};
+	ConfigItemDescriptor items[] = {
+		{StringList, "routes",
+		 "Whitespace separated list of sip routes to balance the requests, each optionally followed by a weight "
+		 "parameter, 1 by default. The calls are spread with a consistent hash of their Call-ID, so that adding or "
+		 "removing a route only moves the calls of this route. "
+		 "Example: <sip:192.168.0.22>;weight=2 <sip:192.168.0.23>",
+		 ""},
+		{String, "strategy",
+		 "How the route of a new call or out of dialog request is chosen, among the routes found alive:\n"
+		 " - hash: from the consistent hash of its Call-ID.\n"
+		 " - least-loaded: the route with the least requests waiting for an answer, weighted by its average response "
+		 "time and divided by its weight. The requests of a dialog follow its initial request, and those of the dialogs "
+		 "it does not know, for instance created before a restart, follow the hash of their Call-ID.",
+		 "hash"},
+		{Integer, "dialog-idle-time",
+		 "With the least-loaded strategy, time in seconds after which a dialog with no request is forgotten.", "3600"},
+		{Integer, "virtual-nodes",
+		 "Number of points of a route of weight 1 on the hash ring. More points spread the calls more evenly.", "100"},
+		{Integer, "health-check-interval",
+		 "Interval in seconds between the OPTIONS requests sent to each route to check that it is alive. The calls of "
+		 "a route found dead go to the other routes until it answers again. 0 disables the health checks.",
+		 "10"},
+		{Integer, "health-check-max-failures",
+		 "Number of consecutive health checks left unanswered, or answered with a 408 or 503, after which a route is "
+		 "considered dead.",
+		 "2"},
+		config_item_end};
 	module_config->addChildrenValues(items);
+	mCountRoutesDown = module_config->createStat("count-routes-down", "Number of times a route was found dead.");
 }
 
 void LoadBalancer::onLoad(const GenericStruct *modconf) {
 	list<string> routes = modconf->get<ConfigStringList>("routes")->read();
-	list<string>::iterator it;
+	mHealthCheckInterval = modconf->get<ConfigInt>("health-check-interval")->read();
+	mMaxFailures = max(1, modconf->get<ConfigInt>("health-check-max-failures")->read());
+	mRing.reset(new HashRing<shared_ptr<Route>>(max(1, modconf->get<ConfigInt>("virtual-nodes")->read())));
+	string strategy = modconf->get<ConfigString>("strategy")->read();
+	if (strategy != "hash" && strategy != "least-loaded") {
+		LOGF("Invalid strategy '%s' in module::LoadBalancer/strategy, must be hash or least-loaded", strategy.c_str());
+	}
+	mLeastLoaded = strategy == "least-loaded";
+	mDialogIdleTime = modconf->get<ConfigInt>("dialog-idle-time")->read();
 
 	LOGI("Load balancer configured to balance over:");
-	for (it = routes.begin(); it != routes.end(); ++it) {
-		mRoutes.push_back(*it);
-		LOGI("%s", (*it).c_str());
+	SofiaAutoHome home;
+	for (auto it = routes.begin(); it != routes.end(); ++it) {
+		sip_route_t *sipRoute = sip_route_make(home.home(), it->c_str());
+		if (!sipRoute) {
+			LOGF("Invalid route %s in module::LoadBalancer/routes", it->c_str());
+		}
+		unsigned int weight = 1;
+		const char *weightParam = msg_params_find(sipRoute->r_params, "weight=");
+		if (weightParam) {
+			weight = (unsigned int)strtoul(weightParam, NULL, 10);
+			msg_header_remove_param(sipRoute->r_common, "weight");
+		}
+		auto route = make_shared<Route>();
+		route->balancer = this;
+		route->route = sip_header_as_string(home.home(), (sip_header_t *)sipRoute);
+		route->uri = url_as_string(home.home(), sipRoute->r_url);
+		route->weight = weight;
+		route->alive = true;
+		route->failures = 0;
+		route->probe = NULL;
+		route->inFlight = 0;
+		route->latency = 0;
+		LOGI("%s weight %u", route->route.c_str(), weight);
+		// named after the route itself, the points of a route stay in place when the others change
+		if (weight > 0)
+			mRing->add(route->route, route, weight);
+		mRoutes.push_back(route);
+	}
+	if (mHealthCheckInterval > 0 && !mRoutes.empty())
+		scheduleHealthCheck();
+	if (mLeastLoaded)
+		mPurgeTimer = getAgent()->getTimers()->schedule(60, [this]() { purgeDialogs(); });
+}
+
+void LoadBalancer::onUnload() {
+	mHealthCheckTimer.reset();
+	mPurgeTimer.reset();
+	mDialogs.clear();
+	for (auto &route : mRoutes) {
+		if (route->probe)
+			nta_outgoing_destroy(route->probe);
+	}
+	mRoutes.clear();
+	mRing.reset();
+}
+
+void LoadBalancer::purgeDialogs() {
+	time_t now = getCurrentTime();
+	for (auto it = mDialogs.begin(); it != mDialogs.end();) {
+		if (now - it->second.lastUse > mDialogIdleTime)
+			it = mDialogs.erase(it);
+		else
+			++it;
+	}
+	mPurgeTimer = getAgent()->getTimers()->schedule(60, [this]() { purgeDialogs(); });
+}
+
+void LoadBalancer::scheduleHealthCheck() {
+	mHealthCheckTimer = getAgent()->getTimers()->schedule(mHealthCheckInterval, [this]() { checkHealth(); });
+}
+
+void LoadBalancer::checkHealth() {
+	const url_t *from = getAgent()->getNodeUri();
+	for (auto &route : mRoutes) {
+		if (route->probe)
+			continue; // the previous one is not answered yet
+		SofiaAutoHome home;
+		url_t *url = url_make(home.home(), route->uri.c_str());
+		sip_from_t *sipFrom = sip_from_create(home.home(), (const url_string_t *)from);
+		sip_from_tag(home.home(), sipFrom, nta_agent_newtag(home.home(), "%s", getAgent()->getSofiaAgent()));
+		route->probe = nta_outgoing_tcreate(getAgent()->getSofiaAgent(), sOnProbeResponse,
+											(nta_outgoing_magic_t *)route.get(), (const url_string_t *)url,
+											SIP_METHOD_OPTIONS, (const url_string_t *)url, SIPTAG_FROM(sipFrom),
+											SIPTAG_TO_STR(route->uri.c_str()), TAG_END());
+		if (!route->probe) {
+			LOGE("Cannot send the health check of route %s", route->route.c_str());
+			onProbeResponse(route.get(), 503);
+		}
+	}
+	scheduleHealthCheck();
+}
+
+int LoadBalancer::sOnProbeResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip) {
+	Route *route = reinterpret_cast<Route *>(magic);
+	int status = sip && sip->sip_status ? sip->sip_status->st_status : 408;
+	if (status < 200)
+		return 0;
+	nta_outgoing_destroy(orq);
+	route->probe = NULL;
+	route->balancer->onProbeResponse(route, status);
+	return 0;
+}
+
+void LoadBalancer::onProbeResponse(Route *route, int status) {
+	// any other answer shows that the route is there to process the requests
+	if (status != 408 && status != 503) {
+		route->failures = 0;
+		if (!route->alive) {
+			route->alive = true;
+			LOGI("Load balancer route %s is alive again", route->route.c_str());
+		}
+		return;
+	}
+	if (++route->failures >= mMaxFailures && route->alive) {
+		route->alive = false;
+		++*mCountRoutesDown;
+		LOGW("Load balancer route %s is dead after %d failed health checks, last one %d", route->route.c_str(),
+			 route->failures, status);
+	}
+}
+
+shared_ptr<LoadBalancer::Route> LoadBalancer::routeByHash(sip_t *sip) {
+	const shared_ptr<Route> *route =
+		mRing->find(sip->sip_call_id->i_hash, [](const shared_ptr<Route> &r) { return r->alive; });
+	if (!route) {
+		// better try one of them than reject the calls
+		LOGW("All the load balancer routes are dead");
+		route = mRing->find(sip->sip_call_id->i_hash);
+	}
+	return *route;
+}
+
+shared_ptr<LoadBalancer::Route> LoadBalancer::selectLeastLoaded() {
+	shared_ptr<Route> best;
+	double bestScore = 0;
+	for (auto &route : mRoutes) {
+		if (!route->alive || route->weight == 0)
+			continue;
+		// the millisecond added keeps comparing the loads of the routes not measured yet
+		double score = (route->inFlight + 1) * (route->latency + 1) / route->weight;
+		if (!best || score < bestScore) {
+			best = route;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+shared_ptr<LoadBalancer::Route> LoadBalancer::routeByLoad(shared_ptr<RequestSipEvent> &ev) {
+	sip_t *sip = ev->getMsgSip()->getSip();
+	sip_method_t method = sip->sip_request->rq_method;
+	shared_ptr<Route> route;
+	auto it = mDialogs.find(sip->sip_call_id->i_id);
+	if (it != mDialogs.end()) {
+		// even if the route is dead, as no other one knows the dialog
+		route = it->second.route;
+		it->second.lastUse = getCurrentTime();
+		if (method == sip_method_bye)
+			mDialogs.erase(it);
+	} else if ((!sip->sip_to || !sip->sip_to->a_tag) && method != sip_method_ack && method != sip_method_cancel) {
+		route = selectLeastLoaded();
+		if (route && (method == sip_method_invite || method == sip_method_subscribe || method == sip_method_refer))
+			mDialogs[sip->sip_call_id->i_id] = Dialog{route, getCurrentTime()};
+	}
+	if (route && method != sip_method_ack && method != sip_method_cancel) {
+		auto transaction = ev->createOutgoingTransaction();
+		transaction->setProperty(getModuleName(), make_shared<PendingRequest>(route));
 	}
-	mRoutesCount = mRoutes.size();
+	return route;
 }
 
 void LoadBalancer::onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException){
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
-	uint32_t call_hash;
 	sip_t *sip = ms->getSip();
-	int index;
 
-	if (mRoutesCount == 0)
+	if (!mRing || mRing->size() == 0)
 		return;
 
-	/* very simple load sharing algorithm, based on randomness of call id*/
 	if (sip->sip_call_id) {
-		const char *route;
-		call_hash = sip->sip_call_id->i_hash;
-		index = call_hash % mRoutesCount;
-		route = mRoutes[index].c_str();
-		cleanAndPrependRoute(getAgent(), ms->getMsg(), sip, sip_route_make(ms->getHome(), route));
+		shared_ptr<Route> route;
+		if (mLeastLoaded)
+			route = routeByLoad(ev);
+		if (!route)
+			route = routeByHash(sip);
+		cleanAndPrependRoute(getAgent(), ms->getMsg(), sip, sip_route_make(ms->getHome(), route->route.c_str()));
 	} else {
 		LOGW("request has no call id");
 	}
@@ -21,7 +21,9 @@
 #include "transaction.hh"
 #include "h264iframefilter.hh"
 #include "callcontext-mediarelay.hh"
+#include "utils/objectpool.hh"
 
+#include <sstream>
 #include <vector>
 #include <algorithm>
 
@@ -69,11 +71,38 @@ void MediaRelay::onDeclare(GenericStruct * mc) {
 						"You need to set this property to false if you are running test calls from clients running on the same "
 						"IP address as the flexisip server" , "true"},
 			{ Boolean, "early-media-relay-single", "In case multiples 183 Early media responses are received for a call, only the first one will have RTP streams forwarded back to caller. This feature prevents the caller to receive 'mixed' streams, but it breaks scenarios where multiple servers play early media announcement in sequence.", "true"},
+			{ Boolean, "share-branch-ports", "Offer the same relay ports to all the branches of a forked call, instead of a pair of ports "
+				"per branch and stream. The early media of the first branch answering with SDP is relayed, the one of the other branches "
+				"is dropped, and the ports go to the branch the call is established with. The offers using ICE and the branches forked "
+				"again by the next hop (X-Target-Uris) keep their own ports.", "false"},
 			{ Integer, "max-early-media-per-call", "Maximum number of relayed early media streams per call. This is useful to limit the cpu usage due to early media relaying on"
 				" embedded systems. A value of 0 stands for unlimited.", "0"},
 			{ Integer, "inactivity-period", "Period of time in seconds, after which a relayed call without any activity is "
 				"considered as no longer running. Activity counts RTP/RTCP packets exchanged through the relay and SIP messages.",
 				"3600"},
+			{ Integer, "relay-threads", "Number of threads relaying the RTP/RTCP packets, each one owning its own share of the relay sessions. "
+				"A value of 0 stands for one thread per CPU.", "0"},
+			{ Boolean, "kernel-offload", "Once a call is established, let the kernel forward the RTP/RTCP packets of the streams that need no "
+				"filtering, with netfilter NAT rules. The relay threads then only follow the activity and the address changes of these streams. "
+				"Requires root privileges, the iptables and conntrack tools, and IP forwarding to be enabled.", "false"},
+			{ Integer, "port-pool-low-watermark", "Each relay thread keeps pre-bound RTP/RTCP port pairs, so that no port has to be bound "
+				"when a call or a fork branch is created. The pool of an interface is refilled when it has fewer free pairs than this value.", "16"},
+			{ Integer, "port-pool-high-watermark", "Number of free port pairs the pool of an interface is refilled to, and the maximum "
+				"number of port pairs kept when calls end. A value of 0 disables the pool.", "64"},
+			{ Integer, "replication-port", "UDP port on which the state of the established relay sessions is exchanged with the "
+				"replication peer, so that each relay can take over the streams of the other when its relay addresses move to it, "
+				"with keepalived for example. The relays must bind their own relay addresses, not the wildcard one, and have "
+				"net.ipv4.ip_nonlocal_bind set so that they can bind the addresses of the peer in advance. A value of 0 disables "
+				"the replication.", "0"},
+			{ String, "replication-peer", "Address of the replication peer, as host:port. The port defaults to replication-port.", ""},
+			{ Boolean, "video-thinning", "Thin the H264 video sent to each destination according to the packet loss and the jitter "
+				"reported by its RTCP receiver reports, and to the bitrate cap below: the non-reference frames are dropped first, "
+				"then all but the key frames. Streams thinned this way are not offloaded to the kernel.", "false"},
+			{ Integer, "video-thinning-max-bitrate", "Maximum bitrate of the H264 video sent to each destination when video thinning "
+				"is enabled, in kbit/s. A lower b=AS bandwidth of the video stream of the destination takes precedence. "
+				"A value of 0 stands for no cap.", "0"},
+			{ Integer, "video-thinning-loss-threshold", "Percentage of lost packets reported by a destination from which the "
+				"non-reference frames are no longer sent to it. All but the key frames are dropped from twice this percentage.", "5"},
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
 			/*very specific features, useless for most people*/
 			{ Integer, "h264-filtering-bandwidth", "Enable I-frame only filtering for video H264 for clients annoucing a total bandwith below this value expressed in kbit/s. Use 0 to disable the feature", "0" },
@@ -87,15 +116,39 @@ void MediaRelay::onDeclare(GenericStruct * mc) {
 	auto p=mc->createStatPair("count-calls", "Number of relayed calls.");
 	mCountCalls=p.first;
 	mCountCallsFinished=p.second;
+	mCountRelayedPackets=mc->createStat("count-relayed-packets", "Number of RTP/RTCP packets received by the relay threads.");
+	mCountRelayedBytes=mc->createStat("count-relayed-bytes", "Number of bytes of RTP/RTCP packets received by the relay threads.");
+	mCountOffloadedStreams=mc->createStat("count-offloaded-streams", "Number of RTP/RTCP streams currently forwarded by the kernel.");
+	mCountPortPoolExhausted=mc->createStat("count-port-pool-exhausted", "Number of relay channels created while the port pool was empty.");
+	mCountPortPoolAvailable=mc->createStat("count-port-pool-available", "Number of pre-bound port pairs currently available.");
+	mCountPortsUsed=mc->createStat("count-relay-ports-used", "Number of port pairs of the sdp port range currently bound by the relay threads.");
+	mCountPortBindFailures=mc->createStat("count-relay-port-bind-failures", "Number of free port pairs of the sdp port range that could not be bound, being used by another process.");
+	mCountRelayBusy=mc->createStat("relay-busy-permille", "Share of the time the busiest relay thread spent running since the previous refresh of the statistics, in per mille.");
+	mCountLossP50=mc->createStat("count-relay-loss-p50", "Median of the packet loss reported by the RTCP of the ended relayed streams, in per mille.");
+	mCountLossP99=mc->createStat("count-relay-loss-p99", "99th percentile of the packet loss reported by the RTCP of the ended relayed streams, in per mille.");
+	mCountJitterP50=mc->createStat("count-relay-jitter-p50", "Median of the jitter reported by the RTCP of the ended relayed streams, in microseconds.");
+	mCountJitterP99=mc->createStat("count-relay-jitter-p99", "99th percentile of the jitter reported by the RTCP of the ended relayed streams, in microseconds.");
+	mCountRttP50=mc->createStat("count-relay-rtt-p50", "Median of the round trip time between the relay and the parties of the ended streams, in microseconds.");
+	mCountRttP99=mc->createStat("count-relay-rtt-p99", "99th percentile of the round trip time between the relay and the parties of the ended streams, in microseconds.");
 }
 
 void MediaRelay::createServers(){
-	int cpuCount = ModuleToolbox::getCpuCount();
+	int threadCount = mRelayThreads > 0 ? mRelayThreads : ModuleToolbox::getCpuCount();
 	int i;
-	for(i = 0; i<cpuCount; ++i){
-		mServers.push_back(make_shared<MediaRelayServer>(this));
+	// each relay thread binds its own share of the port range, in which it never competes with the others
+	int share = ((mMaxPort - mMinPort + 1) / threadCount) & ~1;
+	for(i = 0; i<threadCount; ++i){
+		if (share < 2) {
+			mServers.push_back(make_shared<MediaRelayServer>(this, mMinPort, mMaxPort));
+		} else {
+			int minPort = mMinPort + i * share;
+			int maxPort = i == threadCount - 1 ? mMaxPort : minPort + share - 1;
+			mServers.push_back(make_shared<MediaRelayServer>(this, minPort, maxPort));
+		}
 	}
 	mCurServer = 0;
+	mRelayCpuTimes.assign(mServers.size(), chrono::nanoseconds(0));
+	mRelayCpuCheck = chrono::steady_clock::now();
 }
 
 void MediaRelay::onLoad(const GenericStruct * modconf) {
@@ -106,6 +159,7 @@ void MediaRelay::onLoad(const GenericStruct * modconf) {
 	if (mSdpMangledParam == "disable") mSdpMangledParam.clear();
 	mByeOrphanDialogs = modconf->get<ConfigBoolean>("bye-orphan-dialogs")->read();
 	mEarlyMediaRelaySingle = modconf->get<ConfigBoolean>("early-media-relay-single")->read();
+	mShareBranchPorts = modconf->get<ConfigBoolean>("share-branch-ports")->read();
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
 	mH264FilteringBandwidth=modconf->get<ConfigInt>("h264-filtering-bandwidth")->read();
 	mH264Decim=modconf->get<ConfigInt>("h264-iframe-decim")->read();
@@ -117,6 +171,9 @@ void MediaRelay::onLoad(const GenericStruct * modconf) {
 	mDropTelephoneEvent=false;
 	mH264DecimOnlyIfLastProxy=true;
 #endif
+	mVideoThinning = modconf->get<ConfigBoolean>("video-thinning")->read();
+	mVideoThinningMaxBitrate = modconf->get<ConfigInt>("video-thinning-max-bitrate")->read();
+	mVideoThinningLossThreshold = modconf->get<ConfigInt>("video-thinning-loss-threshold")->read();
 	mMinPort = modconf->get<ConfigInt>("sdp-port-range-min")->read();
 	mMaxPort = modconf->get<ConfigInt>("sdp-port-range-max")->read();
 	mPreventLoop = modconf->get<ConfigBoolean>("prevent-loops")->read();
@@ -124,7 +181,24 @@ void MediaRelay::onLoad(const GenericStruct * modconf) {
 	mMaxRelayedEarlyMedia = modconf->get<ConfigInt>("max-early-media-per-call")->read();
 	mForceRelayForNonIceTargets = modconf->get<ConfigBoolean>("force-relay-for-non-ice-targets")->read();
 	mInactivityPeriod = modconf->get<ConfigInt>("inactivity-period")->read();
+	mRelayThreads = modconf->get<ConfigInt>("relay-threads")->read();
+	mPortPoolHigh = modconf->get<ConfigInt>("port-pool-high-watermark")->read();
+	mPortPoolLow = min(modconf->get<ConfigInt>("port-pool-low-watermark")->read(), mPortPoolHigh);
+	if (modconf->get<ConfigBoolean>("kernel-offload")->read()) {
+		mOffloader = make_shared<RelayOffloader>();
+		if (!mOffloader->start())
+			mOffloader.reset();
+	}
 	createServers();
+	int replicationPort = modconf->get<ConfigInt>("replication-port")->read();
+	string replicationPeer = modconf->get<ConfigString>("replication-peer")->read();
+	mCurReplicaServer = 0;
+	if (replicationPort > 0 && !replicationPeer.empty()) {
+		mReplicator.reset(new RelayReplicator(getAgent()->getRoot(), bind(&MediaRelay::onReplicaUpdate, this, _1),
+											  bind(&MediaRelay::onReplicaRemove, this, _1)));
+		if (!mReplicator->start(replicationPort, replicationPeer))
+			mReplicator.reset();
+	}
 }
 
 void MediaRelay::onUnload() {
@@ -132,20 +206,24 @@ void MediaRelay::onUnload() {
 		delete mCalls;
 		mCalls=NULL;
 	}
+	mReplicator.reset();
+	for (auto &replica : mReplicas)
+		replica.second.session->unuse();
+	mReplicas.clear();
 	mServers.clear();
+	mOffloader.reset();
 }
 
 
 bool MediaRelay::processNewInvite(const shared_ptr<RelayedCall> &c, const shared_ptr<OutgoingTransaction>& transaction, const shared_ptr<RequestSipEvent> &ev) {
 	sip_t *sip = ev->getMsgSip()->getSip();
-	msg_t *msg = ev->getMsgSip()->getMsg();
 
 	if (sip->sip_from == NULL || sip->sip_from->a_tag == NULL) {
 		LOGW("No tag in from !");
 		return false;
 	}
 	c->updateActivity();
-	shared_ptr<SdpModifier> m = SdpModifier::createFromSipMsg(ev->getMsgSip()->getHome(), sip, mSdpMangledParam);
+	shared_ptr<SdpModifier> m = ev->getMsgSip()->getSdpModifier(mSdpMangledParam);
 	if (m == NULL) {
 		LOGW("Invalid SDP");
 		return false;
@@ -173,6 +251,10 @@ bool MediaRelay::processNewInvite(const shared_ptr<RelayedCall> &c, const shared
 
 	// create channels if not already existing
 	c->initChannels(m, from_tag, transaction->getBranchId(), mAgent->getPreferredIp(from_host), mAgent->getPreferredIp(dest_host));
+	for (auto &s : c->getSessions()) {
+		s->setCall(c);
+		s->setTenant(ev->getMsgSip()->getTenant());
+	}
 
 	if (!c->checkMediaValid()) {
 		LOGE("The relay media are invalid, no RTP/RTCP port remaining?");
@@ -184,25 +266,146 @@ bool MediaRelay::processNewInvite(const shared_ptr<RelayedCall> &c, const shared
 	m->iterateInOffer(bind(&RelayedCall::setChannelDestinations, c, m, _1, _2, _3, from_tag, transaction->getBranchId(),false));
 
 	// Masquerade using ICE
-	m->addIceCandidateInOffer(bind(&RelayedCall::getChannelSources, c, _1, to_tag, transaction->getBranchId()),
-			   bind(&RelayedCall::getChannelDestinations, c, _1, from_tag, transaction->getBranchId()),
-			   bind(&RelayedCall::getMasqueradeContexts, c, _1, from_tag, to_tag, transaction->getBranchId()), mForceRelayForNonIceTargets);
+	SdpRelayTable relays = c->getRelayTable(true, from_tag, to_tag, transaction->getBranchId());
+	m->addIceCandidateInOffer(relays, mForceRelayForNonIceTargets);
 
 	// Modify sdp message to set relay address and ports for streams not handled by ICE
-	m->masqueradeInOffer(bind(&RelayedCall::getChannelSources, c, _1, to_tag, transaction->getBranchId()));
+	m->masqueradeInOffer(relays);
 
 	if (!mSdpMangledParam.empty()) m->addAttribute(mSdpMangledParam.c_str(), "yes");
-	if (m->update(msg, sip)==-1){
-		LOGE("Cannot update SDP in message.");
-		ev->reply(500, "Media relay SDP processing internal error", SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
-		return false;
-	}
+	ev->getMsgSip()->setSdpModified();
 	c->getServer()->update();
 	return true;
 }
 
 
+void MediaRelay::reportQuality(const shared_ptr<RelayedCall> &c, const sip_t *sip) {
+	ostringstream summary;
+	for (const auto &stream : c->getQuality()) {
+		for (const auto &channel : stream.second) {
+			const RelayChannelQuality &q = channel.second;
+			if (q.reports == 0)
+				continue;
+			uint64_t loss = q.lossSum * 1000 / 256 / q.reports;
+			uint64_t jitter = q.jitterSum / q.reports;
+			mLossHistogram.record(loss);
+			mJitterHistogram.record(jitter);
+			if (summary.tellp() > 0)
+				summary << "; ";
+			summary << "m" << stream.first << (channel.first ? " caller" : " callee") << ": loss " << loss / 10.0
+					<< "% (max " << q.maxLoss * 100 / 256 << "%), jitter " << jitter / 1000 << "ms (max "
+					<< q.maxJitter / 1000 << "ms)";
+			if (q.rttCount > 0) {
+				uint64_t rtt = q.rttSum / q.rttCount;
+				mRttHistogram.record(rtt);
+				summary << ", rtt " << rtt / 1000 << "ms";
+			}
+		}
+	}
+	if (summary.tellp() <= 0)
+		return; // no RTCP went through the relay
+	mCountLossP50->set(mLossHistogram.percentile(0.5));
+	mCountLossP99->set(mLossHistogram.percentile(0.99));
+	mCountJitterP50->set(mJitterHistogram.percentile(0.5));
+	mCountJitterP99->set(mJitterHistogram.percentile(0.99));
+	mCountRttP50->set(mRttHistogram.percentile(0.5));
+	mCountRttP99->set(mRttHistogram.percentile(0.99));
+	LOGD("RelayedCall [%p] media quality: %s", c.get(), summary.str().c_str());
+
+	auto log = make_shared<CallLog>(sip);
+	log->setMediaQuality(summary.str());
+	log->setCompleted();
+	getAgent()->logEvents(vector<shared_ptr<EventLog>>(1, log));
+}
+
+void MediaRelay::replicate(const shared_ptr<RelayedCall> &c) {
+	if (!mReplicator)
+		return;
+	for (const auto &s : c->getSessions()) {
+		RelayReplicator::Session state;
+		if (s->getReplicaState(state))
+			mReplicator->publish(s, state);
+	}
+}
+
+static bool sameLocalBinding(const RelayReplicator::Channel &a, const RelayReplicator::Channel &b) {
+	return a.localIp == b.localIp && a.bindIp == b.bindIp && a.localPort == b.localPort;
+}
+
+void MediaRelay::onReplicaUpdate(const RelayReplicator::Session &state) {
+	time_t now = getCurrentTime();
+	auto it = mReplicas.find(state.id);
+	if (it != mReplicas.end()) {
+		Replica &replica = it->second;
+		if (sameLocalBinding(replica.state.front, state.front) && sameLocalBinding(replica.state.back, state.back)) {
+			// the ports are kept, only the destinations may have changed with a re-INVITE
+			shared_ptr<RelayChannel> front = replica.session->getFrontChannel();
+			shared_ptr<RelayChannel> back = replica.session->getChannel("", "");
+			if (front && (replica.state.front.remoteIp != state.front.remoteIp ||
+						  replica.state.front.remotePort != state.front.remotePort || replica.state.front.dir != state.front.dir))
+				front->setRemoteAddr(state.front.remoteIp, state.front.remotePort, (RelayChannel::Dir)state.front.dir);
+			if (back && (replica.state.back.remoteIp != state.back.remoteIp ||
+						 replica.state.back.remotePort != state.back.remotePort || replica.state.back.dir != state.back.dir))
+				back->setRemoteAddr(state.back.remoteIp, state.back.remotePort, (RelayChannel::Dir)state.back.dir);
+			replica.state = state;
+			replica.refreshed = now;
+			return;
+		}
+		replica.session->unuse();
+		mReplicas.erase(it);
+	}
+	shared_ptr<MediaRelayServer> server = mServers[mCurReplicaServer];
+	mCurReplicaServer = (mCurReplicaServer + 1) % mServers.size();
+	shared_ptr<RelaySession> session = server->createReplicaSession(state);
+	if (!session) {
+		LOGW("Cannot bind the ports of a relay session of the replication peer");
+		return;
+	}
+	LOGD("Relay session %llx of the replication peer ready on ports %i and %i", (unsigned long long)state.id,
+		 state.front.localPort, state.back.localPort);
+	Replica &replica = mReplicas[state.id];
+	replica.session = session;
+	replica.state = state;
+	replica.refreshed = now;
+}
+
+void MediaRelay::onReplicaRemove(uint64_t id) {
+	auto it = mReplicas.find(id);
+	if (it == mReplicas.end())
+		return;
+	it->second.session->unuse();
+	mReplicas.erase(it);
+}
+
+void MediaRelay::removeInactiveSessions() {
+	time_t now = getCurrentTime();
+	time_t replicaTimeout = 3 * RelayReplicator::sRefreshPeriod;
+	for (auto it = mServers.begin(); it != mServers.end(); ++it) {
+		list<shared_ptr<RelaySession>> sessions = (*it)->takeInactiveSessions();
+		for (auto &session : sessions) {
+			shared_ptr<CallContextBase> call = session->getCall();
+			if (call) {
+				if (call->getLastActivity() + mInactivityPeriod < now) {
+					LOGD("Removing inactive relayed call %p", call.get());
+					mCalls->remove(call);
+				}
+				continue;
+			}
+			auto replica = mReplicas.find(session->getReplicaId());
+			if (replica == mReplicas.end() || replica->second.session != session)
+				continue;
+			if (now - replica->second.refreshed > replicaTimeout) {
+				LOGD("Relay session %llx of the replication peer is gone", (unsigned long long)replica->first);
+				session->unuse();
+				mReplicas.erase(replica);
+			}
+		}
+	}
+}
+
 void MediaRelay::configureContext(shared_ptr<RelayedCall> &c){
+	if (mVideoThinning)
+		c->enableVideoThinning(mVideoThinningMaxBitrate, mVideoThinningLossThreshold);
 #ifdef MEDIARELAY_SPECIFIC_FEATURES_ENABLED
 	if (mH264FilteringBandwidth)
 		c->enableH264IFrameFiltering(mH264FilteringBandwidth,mH264Decim,mH264DecimOnlyIfLastProxy);
@@ -233,7 +436,7 @@ void MediaRelay::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipExcept
 				return;
 			}
 
-			c = make_shared<RelayedCall>(mServers[mCurServer], sip);
+			c = allocate_shared<RelayedCall>(PoolAllocator<RelayedCall>(), mServers[mCurServer], sip);
 			mCurServer = (mCurServer + 1) % mServers.size();
 			newContext=true;
 			it->setProperty<RelayedCall>(getModuleName(), c);
@@ -247,6 +450,11 @@ void MediaRelay::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipExcept
 		}
 	}else if (sip->sip_request->rq_method == sip_method_bye) {
 		if ((c = dynamic_pointer_cast<RelayedCall>(mCalls->findEstablishedDialog(getAgent(), sip))) != NULL) {
+			reportQuality(c, sip);
+			if (mReplicator) {
+				for (const auto &s : c->getSessions())
+					mReplicator->withdraw(s);
+			}
 			mCalls->remove(c);
 		}
 	}else if (sip->sip_request->rq_method == sip_method_cancel) {
@@ -261,7 +469,6 @@ void MediaRelay::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipExcept
 
 void MediaRelay::processResponseWithSDP(const shared_ptr<RelayedCall> &c, const shared_ptr<OutgoingTransaction>& transaction, const shared_ptr<MsgSip> &msgSip) {
 	sip_t *sip = msgSip->getSip();
-	msg_t *msg = msgSip->getMsg();
 	bool isEarlyMedia=false;
 
 	LOGD("Processing 200 Ok or early media");
@@ -276,7 +483,7 @@ void MediaRelay::processResponseWithSDP(const shared_ptr<RelayedCall> &c, const
 		c->setEstablished(transaction->getBranchId());
 	}else isEarlyMedia=true;
 
-	shared_ptr<SdpModifier> m = SdpModifier::createFromSipMsg(msgSip->getHome(), sip, mSdpMangledParam);
+	shared_ptr<SdpModifier> m = msgSip->getSdpModifier(mSdpMangledParam);
 	if (m == NULL) {
 		LOGW("Invalid SDP");
 		return;
@@ -295,13 +502,14 @@ void MediaRelay::processResponseWithSDP(const shared_ptr<RelayedCall> &c, const
 	m->iterateInAnswer(bind(&RelayedCall::setChannelDestinations, c, m, _1, _2, _3, to_tag, transaction->getBranchId(),isEarlyMedia));
 
 	//push ICE relay candidates if necessary, and update the ICE states.
-	m->addIceCandidateInAnswer(bind(&RelayedCall::getChannelSources, c, _1, sip->sip_from->a_tag, transaction->getBranchId()),
-		bind(&RelayedCall::getChannelDestinations, c, _1, to_tag, transaction->getBranchId()),
-		bind(&RelayedCall::getMasqueradeContexts, c, _1, sip->sip_from->a_tag, to_tag, transaction->getBranchId()), mForceRelayForNonIceTargets);
+	SdpRelayTable relays = c->getRelayTable(false, sip->sip_from->a_tag, to_tag, transaction->getBranchId());
+	m->addIceCandidateInAnswer(relays, mForceRelayForNonIceTargets);
 
 	// masquerade c lines and ports for streams not handled by ICE.
-	m->masqueradeInAnswer(bind(&RelayedCall::getChannelSources, c, _1, sip->sip_from->a_tag, transaction->getBranchId()));
-	m->update(msg, sip);
+	m->masqueradeInAnswer(relays);
+	msgSip->setSdpModified();
+	if (!isEarlyMedia)
+		replicate(c);
 }
 
 void MediaRelay::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException) {
@@ -371,9 +579,40 @@ void MediaRelay::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipExc
 	}
 }
 
+void MediaRelay::onSweep(SweepBudget &budget) {
+	mCalls->removeAndDeleteInactives(mInactivityPeriod, &budget);
+}
+
 void MediaRelay::onIdle() {
 	mCalls->dump();
-	mCalls->removeAndDeleteInactives(mInactivityPeriod);
+	removeInactiveSessions();
+	uint64_t packets = 0, bytes = 0, available = 0, portsUsed = 0, bindFailures = 0;
+	for (auto it = mServers.begin(); it != mServers.end(); ++it) {
+		packets += (*it)->getRelayedPackets();
+		bytes += (*it)->getRelayedBytes();
+		available += (*it)->getPoolAvailable();
+		portsUsed += (*it)->getPortsUsed();
+		bindFailures += (*it)->getBindFailures();
+	}
+	mCountPortPoolAvailable->set(available);
+	mCountPortsUsed->set(portsUsed);
+	mCountPortBindFailures->set(bindFailures);
+	mCountRelayedPackets->set(packets);
+	mCountRelayedBytes->set(bytes);
+	mCountOffloadedStreams->set(mOffloader ? mOffloader->getInstalledCount() : 0);
+	// the busiest thread saturates first, the calls being spread over the threads evenly
+	auto now = chrono::steady_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(now - mRelayCpuCheck);
+	uint64_t busy = 0;
+	for (size_t i = 0; i < mServers.size(); ++i) {
+		chrono::nanoseconds cpu = mServers[i]->getCpuTime();
+		if (elapsed.count() > 0)
+			busy = max(busy, (uint64_t)((cpu - mRelayCpuTimes[i]).count() * 1000 / elapsed.count()));
+		mRelayCpuTimes[i] = cpu;
+	}
+	mRelayCpuCheck = now;
+	mCountRelayBusy->set(busy);
+	getAgent()->getSaturation()->setLoad(SaturationMonitor::RelayThreads, busy);
 	if (mCalls->size() > 0)
 		LOGD("There are %i calls active in the MediaRelay call list.",mCalls->size());
 }
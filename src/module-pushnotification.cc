@@ -27,8 +27,16 @@
 #include "pushnotification/microsoftpush.hh"
 #include "pushnotification/firebasepush.hh"
 #include "forkcallcontext.hh"
+#include "tenantstats.hh"
 
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <map>
+#include <sstream>
+#include <unistd.h>
 #include <sofia-sip/msg_mime.h>
 
 using namespace std;
@@ -43,7 +51,11 @@ class PushNotificationContext : public enable_shared_from_this<PushNotificationC
 	shared_ptr<PushNotificationRequest> mPushNotificationRequest;
 	shared_ptr<ForkCallContext> mForkContext;
 	string mKey; // unique key for the push notification, identifiying the device and the call.
+	PushInfo::Event mEvent;
+	Tenant *mTenant;
 	bool mSendRinging;
+	std::chrono::steady_clock::time_point mSentAt; // of the call notification, until the device rings
+	bool mSent;
 	void onTimeout();
 	void onError(const string &errormsg);
 	void onEnd();
@@ -54,10 +66,13 @@ class PushNotificationContext : public enable_shared_from_this<PushNotificationC
 
   public:
 	PushNotificationContext(const shared_ptr<OutgoingTransaction> &transaction, PushNotification *module,
-							const shared_ptr<PushNotificationRequest> &pnr, const string &pn_key);
+							const shared_ptr<PushNotificationRequest> &pnr, const string &pn_key,
+							PushInfo::Event event, Tenant *tenant);
 	~PushNotificationContext();
 	void start(int seconds, bool sendRinging);
 	void cancel();
+	/* Returns the time since the call notification was sent in ms, the first time the device rings, -1 otherwise. */
+	long onRinging();
 	const string &getKey() const {
 		return mKey;
 	}
@@ -71,12 +86,35 @@ class PushNotification : public Module, public ModuleToolbox {
 	virtual void onRequest(std::shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(std::shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 	virtual void onLoad(const GenericStruct *mc);
+	virtual void onUnload();
+	virtual void onIdle();
 	PushNotificationService *getService() const {
 		return mPNS;
 	}
 	void clearNotification(const shared_ptr<PushNotificationContext> &ctx);
+	/* Sends the push notification, unless one is already pending for the device. The message notifications are
+	 * held for the coalescing window, and only the last one of the device is sent. */
+	void sendPush(const shared_ptr<PushNotificationRequest> &pnr, PushInfo::Event event);
 
   private:
+	/* Message notifications of a device, merged during the coalescing window. */
+	struct CoalescedPush {
+		PushNotification *module;
+		string deviceKey;
+		shared_ptr<PushNotificationRequest> request;
+		su_timer_t *timer;
+		int count;
+	};
+	static void __coalescing_timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void flushCoalescedPush(const string &deviceKey);
+	void submitPush(const shared_ptr<PushNotificationRequest> &pnr);
+
+	static const vector<int> &getPushToRingBounds();
+	void countPushToRing(long ms);
+	shared_ptr<PushNotificationRequest> createRequest(const PushInfo &pinfo);
+	static void __retry_timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void saveRetries();
+	void loadRetries();
 	bool needsPush(const sip_t *sip);
 	void makePushNotification(const shared_ptr<MsgSip> &ms, const shared_ptr<OutgoingTransaction> &transaction);
 	map<string, shared_ptr<PushNotificationContext>> mPendingNotifications; // map of pending push notifications. Its
@@ -87,23 +125,38 @@ class PushNotification : public Module, public ModuleToolbox {
 	url_t *mExternalPushUri;
 	string mExternalPushMethod;
 	int mTimeout;
+	int mCallTimeout;
 	int mTtl;
 	map<string, string> mGoogleKeys;
 	map<string, string> mFirebaseKeys;
 	PushNotificationService *mPNS;
 	StatCounter64 *mCountFailed;
 	StatCounter64 *mCountSent;
+	map<string, vector<StatCounter64 *>> mLatencyCounters;
+	StatCounter64 *mCountCoalesced;
+	vector<StatCounter64 *> mPushToRingCounters;
+	map<string, unique_ptr<CoalescedPush>> mCoalescedPushes; // by app id and device token
+	int mCoalescingWindow;
 	bool mNoBadgeiOS;
+	su_timer_t *mRetryTimer; // dispatching the retries due, NULL without retries
+	string mRetryFile;
+	size_t mSavedRetries; // number of retries in mRetryFile
+	StatCounter64 *mCountRetried;
+	StatCounter64 *mCountRetryDropped;
+	StatCounter64 *mCountPending;
+	size_t mSaturationQueueSize; // pending requests taken as a full load
 };
 
 PushNotificationContext::PushNotificationContext(const shared_ptr<OutgoingTransaction> &transaction,
 												 PushNotification *module,
-												 const shared_ptr<PushNotificationRequest> &pnr, const string &key)
-	: mModule(module), mPushNotificationRequest(pnr), mKey(key) {
+												 const shared_ptr<PushNotificationRequest> &pnr, const string &key,
+												 PushInfo::Event event, Tenant *tenant)
+	: mModule(module), mPushNotificationRequest(pnr), mKey(key), mEvent(event), mTenant(tenant) {
 	mTimer = su_timer_create(su_root_task(mModule->getAgent()->getRoot()), 0);
 	mEndTimer = su_timer_create(su_root_task(mModule->getAgent()->getRoot()), 0);
 	mForkContext = dynamic_pointer_cast<ForkCallContext>(ForkContext::get(transaction));
 	mSendRinging = true;
+	mSent = false;
 }
 
 PushNotificationContext::~PushNotificationContext() {
@@ -128,6 +181,13 @@ void PushNotificationContext::cancel() {
 	}
 }
 
+long PushNotificationContext::onRinging() {
+	if (!mSent || mEvent != PushInfo::Call)
+		return -1;
+	mSent = false;
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - mSentAt).count();
+}
+
 void PushNotificationContext::onError(const string &errormsg) {
 	SLOGD << "PNR " << mPushNotificationRequest.get() << ": error " << errormsg;
 	if (mForkContext) {
@@ -152,7 +212,11 @@ void PushNotificationContext::onTimeout() {
 		if (mSendRinging) mForkContext->sendRinging();
 	}
 
-	mModule->getService()->sendPush(mPushNotificationRequest);
+	if (mTenant)
+		mTenant->count(mTenant->pushes);
+	mSentAt = chrono::steady_clock::now();
+	mSent = true;
+	mModule->sendPush(mPushNotificationRequest, mEvent);
 }
 
 void PushNotificationContext::clear() {
@@ -189,10 +253,17 @@ ModuleInfo<PushNotification>
 							ModuleInfoBase::ModuleOid::PushNotification);
 
 PushNotification::PushNotification(Agent *ag)
-	: Module(ag), mExternalPushUri(NULL), mPNS(NULL), mCountFailed(NULL), mCountSent(NULL), mNoBadgeiOS(false) {
+	: Module(ag), mExternalPushUri(NULL), mPNS(NULL), mCountFailed(NULL), mCountSent(NULL), mCountCoalesced(NULL),
+	  mCoalescingWindow(0), mNoBadgeiOS(false), mRetryTimer(NULL), mSavedRetries(0), mCountRetried(NULL),
+	  mCountRetryDropped(NULL) {
 }
 
 PushNotification::~PushNotification() {
+	if (mRetryTimer)
+		su_timer_destroy(mRetryTimer);
+	for (auto it = mCoalescedPushes.begin(); it != mCoalescedPushes.end(); ++it) {
+		su_timer_destroy(it->second->timer);
+	}
 	if (mPNS != NULL) {
 		delete mPNS;
 	}
@@ -203,7 +274,42 @@ void PushNotification::onDeclare(GenericStruct *module_config) {
 	ConfigItemDescriptor items[] = {
 		{Integer, "timeout",
 		 "Number of second to wait before sending a push notification to device(if <=0 then disabled)", "5"},
+		{Integer, "call-timeout",
+		 "Number of seconds to wait before sending the push notification of a call, -1 to use timeout. With 0 the "
+		 "notification is sent along with the INVITE forwarded to the device: the devices woken up by the push "
+		 "notifications keep no connection the INVITE could reach, so waiting only delays their ringing.",
+		 "-1"},
 		{Integer, "max-queue-size", "Maximum number of notifications queued for each client", "100"},
+		{Integer, "clients-per-app",
+		 "Number of clients sending the push notifications of each application in parallel, each one with its own "
+		 "connection to the push notification server. Every push notification is given to the least loaded client.",
+		 "1"},
+		{Integer, "coalescing-window",
+		 "Time in milliseconds during which the message notifications to a device are held and merged: only the "
+		 "last one is sent at the end of the window. A call notification is sent right away and replaces the "
+		 "pending message notifications of the device. 0 disables the coalescing.",
+		 "0"},
+		{Integer, "retry-count",
+		 "Number of times a push notification failed on a connection error or on a transient error of the push "
+		 "notification server (HTTP status 429 or 5xx) is sent again. 0 disables the retries.",
+		 "0"},
+		{Integer, "retry-delay",
+		 "Delay before a retry in milliseconds, doubled with each consecutive failure of the provider of the push "
+		 "notification up to retry-max-delay.",
+		 "500"},
+		{Integer, "retry-max-delay", "Maximum delay before a retry, in milliseconds.", "30000"},
+		{Integer, "retry-max-age",
+		 "Time after the first failure of a push notification after which it is not retried anymore, in seconds. "
+		 "It is shortened to the time to live of the push notification.",
+		 "120"},
+		{Integer, "retry-queue-size",
+		 "Maximum number of push notifications waiting for a retry. When the queue is full, a call notification "
+		 "takes the place of a message one, and the other notifications are given up.",
+		 "1000"},
+		{String, "retry-queue-file",
+		 "File where the push notifications waiting for a retry are saved, so that they are sent after a restart. "
+		 "Empty to keep them in memory only.",
+		 ""},
 		{Integer, "time-to-live", "Default time to live for the push notifications, in seconds. This parameter shall be set according to mDeliveryTimeout parameter in ForkContext.cc", "2592000"},
 		{Boolean, "apple", "Enable push notification for apple devices", "true"},
 		{String, "apple-certificate-dir",
@@ -251,15 +357,91 @@ void PushNotification::onDeclare(GenericStruct *module_config) {
 		{String, "external-push-method", "Method for reaching external-push-uri, typically GET or POST", "GET"},
 		config_item_end};
 	module_config->addChildrenValues(items);
+#ifdef ENABLE_HTTP2
+	ConfigItemDescriptor http2Items[] = {
+		{Boolean, "apple-http2",
+		 "Send the apple push notifications with the HTTP/2 API of APNs, which carries many notifications at once on "
+		 "each connection, instead of the legacy binary protocol.",
+		 "false"},
+		{String, "apple-auth-key",
+		 "Path to the .p8 authentication key of the Apple developer team, for token based authentication with the "
+		 "HTTP/2 API. The applications without a certificate in apple-certificate-dir are then authenticated with "
+		 "this key. Requires apple-http2.",
+		 ""},
+		{String, "apple-auth-key-id", "Identifier of the key of apple-auth-key, as given by Apple.", ""},
+		{String, "apple-team-id", "Identifier of the Apple developer team owning apple-auth-key.", ""},
+		{Boolean, "firebase-http2", "Send the firebase push notifications on HTTP/2 connections.", "false"},
+		{Integer, "http2-connections",
+		 "Maximum number of HTTP/2 connections opened to the push notification server, for each application.", "2"},
+		{Integer, "http2-max-streams",
+		 "Maximum number of push notifications sent at once on an HTTP/2 connection. The limit announced by the "
+		 "server applies if lower.",
+		 "100"},
+		{Integer, "http2-io-threads",
+		 "Number of threads driving the HTTP/2 connections of all the applications, which are spread over them.",
+		 "1"},
+		config_item_end};
+	module_config->addChildrenValues(http2Items);
+#endif
 	mCountFailed = module_config->createStat("count-pn-failed", "Number of push notifications failed to be sent");
 	mCountSent = module_config->createStat("count-pn-sent", "Number of push notifications successfully sent");
+	mCountCoalesced = module_config->createStat("count-pn-coalesced",
+		"Number of push notifications not sent because merged with a later one to the same device");
+	mCountRetried = module_config->createStat("count-pn-retried", "Number of retries of failed push notifications");
+	mCountRetryDropped = module_config->createStat("count-pn-retry-dropped",
+		"Number of failed push notifications given up because the retry queue was full");
+	mCountPending = module_config->createStat("count-pn-pending",
+		"Number of push notifications queued, being sent or waiting for a retry");
+
+	static const char *providers[] = {"apple", "google", "firebase", "wp", "generic"};
+	const vector<int> &bounds = PushNotificationService::getLatencyBounds();
+	for (auto provider : providers) {
+		vector<StatCounter64 *> &counters = mLatencyCounters[provider];
+		for (size_t i = 0; i < bounds.size(); ++i) {
+			string bound = to_string(bounds[i]) + "ms";
+			string help = string("Number of ") + provider + " push notifications answered within " + bound;
+			if (i > 0)
+				help += " and after " + to_string(bounds[i - 1]) + "ms";
+			counters.push_back(module_config->createStat(string("count-pn-") + provider + "-latency-" + bound, help + "."));
+		}
+		counters.push_back(module_config->createStat(string("count-pn-") + provider + "-latency-more",
+			string("Number of ") + provider + " push notifications answered after " + to_string(bounds.back()) + "ms."));
+	}
+	const vector<int> &ringBounds = getPushToRingBounds();
+	mPushToRingCounters.clear();
+	for (size_t i = 0; i < ringBounds.size(); ++i) {
+		string bound = to_string(ringBounds[i]) + "ms";
+		string help = "Number of devices ringing within " + bound + " of the push notification of a call";
+		if (i > 0)
+			help += " and after " + to_string(ringBounds[i - 1]) + "ms";
+		mPushToRingCounters.push_back(module_config->createStat("count-pn-call-ring-" + bound, help + "."));
+	}
+	mPushToRingCounters.push_back(module_config->createStat("count-pn-call-ring-more",
+		"Number of devices ringing after " + to_string(ringBounds.back()) + "ms of the push notification of a call."));
+}
+
+const vector<int> &PushNotification::getPushToRingBounds() {
+	static const vector<int> bounds = {1000, 2000, 5000, 10000};
+	return bounds;
+}
+
+void PushNotification::countPushToRing(long ms) {
+	const vector<int> &bounds = getPushToRingBounds();
+	size_t i = 0;
+	while (i < bounds.size() && ms > bounds[i])
+		++i;
+	mPushToRingCounters[i]->incr();
 }
 
 void PushNotification::onLoad(const GenericStruct *mc) {
 	mNoBadgeiOS = mc->get<ConfigBoolean>("no-badge")->read();
 	mTimeout = mc->get<ConfigInt>("timeout")->read();
+	mCallTimeout = mc->get<ConfigInt>("call-timeout")->read();
 	mTtl = mc->get<ConfigInt>("time-to-live")->read();
 	int maxQueueSize = mc->get<ConfigInt>("max-queue-size")->read();
+	int clientsPerApp = mc->get<ConfigInt>("clients-per-app")->read();
+	mSaturationQueueSize = (size_t)max(1, maxQueueSize * max(1, clientsPerApp));
+	mCoalescingWindow = mc->get<ConfigInt>("coalescing-window")->read();
 	string certdir = mc->get<ConfigString>("apple-certificate-dir")->read();
 	auto googleKeys = mc->get<ConfigStringList>("google-projects-api-keys")->read();
 	auto firebaseKeys = mc->get<ConfigStringList>("firebase-projects-api-keys")->read();
@@ -293,8 +475,33 @@ void PushNotification::onLoad(const GenericStruct *mc) {
 		mFirebaseKeys.insert(make_pair(keyval.substr(0, sep), keyval.substr(sep + 1)));
 	}
 
-	mPNS = new PushNotificationService(maxQueueSize);
+	mPNS = new PushNotificationService(maxQueueSize, clientsPerApp);
 	mPNS->setStatCounters(mCountFailed, mCountSent);
+	int retryCount = mc->get<ConfigInt>("retry-count")->read();
+	if (retryCount > 0) {
+		mPNS->setupRetries(retryCount, mc->get<ConfigInt>("retry-delay")->read(),
+						   mc->get<ConfigInt>("retry-max-delay")->read(), mc->get<ConfigInt>("retry-max-age")->read(),
+						   (size_t)max(1, mc->get<ConfigInt>("retry-queue-size")->read()));
+		mPNS->setRetryCounters(mCountRetried, mCountRetryDropped);
+		if (mRetryTimer)
+			su_timer_destroy(mRetryTimer);
+		mRetryTimer = su_timer_create(su_root_task(getAgent()->getRoot()), 100);
+		su_timer_set_for_ever(mRetryTimer, &PushNotification::__retry_timer_callback, this);
+		mRetryFile = mc->get<ConfigString>("retry-queue-file")->read();
+	}
+	for (auto it = mLatencyCounters.cbegin(); it != mLatencyCounters.cend(); ++it) {
+		mPNS->setLatencyCounters(it->first, it->second);
+	}
+#ifdef ENABLE_HTTP2
+	mPNS->setupHttp2(mc->get<ConfigBoolean>("apple-http2")->read(), mc->get<ConfigBoolean>("firebase-http2")->read(),
+					 mc->get<ConfigInt>("http2-connections")->read(), mc->get<ConfigInt>("http2-max-streams")->read(),
+					 mc->get<ConfigInt>("http2-io-threads")->read());
+	string appleAuthKey = mc->get<ConfigString>("apple-auth-key")->read();
+	if (appleEnabled && !appleAuthKey.empty()) {
+		mPNS->setAppleAuthenticationKey(appleAuthKey, mc->get<ConfigString>("apple-auth-key-id")->read(),
+										mc->get<ConfigString>("apple-team-id")->read());
+	}
+#endif
 	if (mExternalPushUri)
 		mPNS->setupGenericClient(mExternalPushUri);
 	if (appleEnabled)
@@ -305,6 +512,26 @@ void PushNotification::onLoad(const GenericStruct *mc) {
 		mPNS->setupFirebaseClient(mFirebaseKeys);
 	if(windowsPhoneEnabled) 
 		mPNS->setupWindowsPhoneClient(windowsPhonePackageSID, windowsPhoneApplicationSecret);
+	if (!mRetryFile.empty())
+		loadRetries();
+}
+
+void PushNotification::onUnload() {
+	if (!mRetryFile.empty())
+		saveRetries();
+}
+
+void PushNotification::onIdle() {
+	if (!mRetryFile.empty())
+		saveRetries();
+	size_t pending = mPNS->countPendingRequests();
+	mCountPending->set(pending);
+	getAgent()->getSaturation()->setLoad(SaturationMonitor::PushNotifications, pending * 1000 / mSaturationQueueSize);
+}
+
+void PushNotification::__retry_timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	PushNotification *module = (PushNotification *)arg;
+	module->mPNS->dispatchRetries();
 }
 
 void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
@@ -316,7 +543,7 @@ void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
 	pinfo.mCallId = ms->getSip()->sip_call_id->i_id;
 	pinfo.mEvent = sip->sip_request->rq_method == sip_method_invite ? PushInfo::Call : PushInfo::Message;
 	pinfo.mTtl = mTtl;
-	int time_out = mTimeout;
+	int time_out = (pinfo.mEvent == PushInfo::Call && mCallTimeout >= 0) ? mCallTimeout : mTimeout;
 
 	if (sip->sip_request->rq_url->url_params != NULL) {
 		char type[12];
@@ -416,18 +643,13 @@ void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
 				pinfo.mAlertMsgId = (sip->sip_request->rq_method == sip_method_invite) ? call_str : msg_str;
 				pinfo.mAlertSound = (sip->sip_request->rq_method == sip_method_invite) ? call_snd : msg_snd;
 				pinfo.mNoBadge = mNoBadgeiOS;
-				if (!mExternalPushUri)
-					pn = make_shared<ApplePushNotificationRequest>(pinfo);
 			} else if (strcmp(type, "wp") == 0 || strcmp(type, "w10") == 0) {
-				if (!mExternalPushUri)
-					pn = make_shared<WindowsPhonePushNotificationRequest>(pinfo);
+				/* no other parameter */
 			} else if (strcmp(type, "google") == 0) {
 				auto apiKeyIt = mGoogleKeys.find(appId);
 				if (apiKeyIt != mGoogleKeys.end()) {
 					pinfo.mApiKey = apiKeyIt->second;
 					SLOGD << "Creating Google push notif request";
-					if (!mExternalPushUri)
-						pn = make_shared<GooglePushNotificationRequest>(pinfo);
 				} else {
 					SLOGD << "No Key matching appId " << appId;
 				}
@@ -436,8 +658,6 @@ void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
 				if (apiKeyIt != mFirebaseKeys.end()) {
 					pinfo.mApiKey = apiKeyIt->second;
 					SLOGD << "Creating Firebase push notif request";
-					if (!mExternalPushUri)
-						pn = make_shared<FirebasePushNotificationRequest>(pinfo);
 				} else {
 					SLOGD << "No Key matching appId " << appId;
 				}
@@ -450,12 +670,13 @@ void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
 				if (br) {
 					pinfo.mUid = br->mUid;
 				}
-				pn = make_shared<GenericPushNotificationRequest>(pinfo, mExternalPushUri, mExternalPushMethod);
 			}
+			pn = createRequest(pinfo);
 
 			if (pn) {
 				SLOGD << "Creating a push notif context PNR " << pn.get() << " to send in " << time_out << "s";
-				context = make_shared<PushNotificationContext>(transaction, this, pn, pn_key);
+				context = make_shared<PushNotificationContext>(transaction, this, pn, pn_key, pinfo.mEvent,
+																ms->getTenant());
 				context->start(time_out, !pinfo.mSilent);
 				mPendingNotifications.insert(make_pair(pn_key, context));
 			}
@@ -465,6 +686,163 @@ void PushNotification::makePushNotification(const shared_ptr<MsgSip> &ms,
 	}
 }
 
+shared_ptr<PushNotificationRequest> PushNotification::createRequest(const PushInfo &pinfo) {
+	shared_ptr<PushNotificationRequest> pn;
+	if (mExternalPushUri)
+		pn = make_shared<GenericPushNotificationRequest>(pinfo, mExternalPushUri, mExternalPushMethod);
+	else if (pinfo.mType == "apple")
+		pn = make_shared<ApplePushNotificationRequest>(pinfo);
+	else if (pinfo.mType == "wp" || pinfo.mType == "w10")
+		pn = make_shared<WindowsPhonePushNotificationRequest>(pinfo);
+	else if (pinfo.mType == "google" && !pinfo.mApiKey.empty())
+		pn = make_shared<GooglePushNotificationRequest>(pinfo);
+	else if (pinfo.mType == "firebase" && !pinfo.mApiKey.empty())
+		pn = make_shared<FirebasePushNotificationRequest>(pinfo);
+	if (pn)
+		pn->setInfo(pinfo);
+	return pn;
+}
+
+/*
+ * File of the retries, written aside then renamed:
+ *   flexisip-push-retries: 1
+ * then a block per push notification, ended by an empty line, of "name: value" lines, the new lines and backslashes of
+ * the values being escaped.
+ */
+static const char *sRetriesMagic = "flexisip-push-retries: 1";
+
+static string escapeValue(const string &value) {
+	string escaped;
+	for (char c : value) {
+		if (c == '\\')
+			escaped += "\\\\";
+		else if (c == '\n')
+			escaped += "\\n";
+		else if (c == '\r')
+			escaped += "\\r";
+		else
+			escaped += c;
+	}
+	return escaped;
+}
+
+static string unescapeValue(const string &value) {
+	string unescaped;
+	for (size_t i = 0; i < value.size(); ++i) {
+		if (value[i] == '\\' && i + 1 < value.size()) {
+			char c = value[++i];
+			unescaped += c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+		} else {
+			unescaped += value[i];
+		}
+	}
+	return unescaped;
+}
+
+void PushNotification::saveRetries() {
+	auto retries = mPNS->getPendingRetries();
+	if (retries.empty() && mSavedRetries == 0)
+		return;
+	ostringstream out;
+	out << sRetriesMagic << "\n";
+	for (const auto &pn : retries) {
+		const PushInfo &info = pn->getInfo();
+		out << "deadline: " << pn->getRetryDeadline() << "\n"
+			<< "retries: " << pn->getRetries() << "\n"
+			<< "event: " << (info.mEvent == PushInfo::Call ? "call" : "message") << "\n"
+			<< "type: " << escapeValue(info.mType) << "\n"
+			<< "app-id: " << escapeValue(info.mAppId) << "\n"
+			<< "device-token: " << escapeValue(info.mDeviceToken) << "\n"
+			<< "alert-sound: " << escapeValue(info.mAlertSound) << "\n"
+			<< "alert-msg-id: " << escapeValue(info.mAlertMsgId) << "\n"
+			<< "from-name: " << escapeValue(info.mFromName) << "\n"
+			<< "from-uri: " << escapeValue(info.mFromUri) << "\n"
+			<< "from-tag: " << escapeValue(info.mFromTag) << "\n"
+			<< "to-uri: " << escapeValue(info.mToUri) << "\n"
+			<< "call-id: " << escapeValue(info.mCallId) << "\n"
+			<< "text: " << escapeValue(info.mText) << "\n"
+			<< "uid: " << escapeValue(info.mUid) << "\n"
+			<< "ttl: " << info.mTtl << "\n"
+			<< "no-badge: " << info.mNoBadge << "\n"
+			<< "silent: " << info.mSilent << "\n\n";
+	}
+	string tmp = mRetryFile + ".tmp";
+	{
+		ofstream file(tmp, ios::out | ios::trunc | ios::binary);
+		file << out.str();
+		if (!file.good()) {
+			LOGE("Cannot write the push notification retries to %s", tmp.c_str());
+			return;
+		}
+	}
+	if (rename(tmp.c_str(), mRetryFile.c_str()) == -1) {
+		LOGE("Cannot write the push notification retries to %s: %s", mRetryFile.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return;
+	}
+	mSavedRetries = retries.size();
+}
+
+void PushNotification::loadRetries() {
+	ifstream in(mRetryFile, ios::in | ios::binary);
+	string line;
+	if (!in || !getline(in, line))
+		return;
+	if (line != sRetriesMagic) {
+		LOGE("Ignoring the push notification retries of %s: unknown format", mRetryFile.c_str());
+		return;
+	}
+	time_t now = time(NULL);
+	size_t loaded = 0, expired = 0;
+	map<string, string> fields;
+	while (getline(in, line)) {
+		if (!line.empty()) {
+			size_t colon = line.find(": ");
+			if (colon != string::npos)
+				fields[line.substr(0, colon)] = unescapeValue(line.substr(colon + 2));
+			continue;
+		}
+		PushInfo info;
+		info.mEvent = fields["event"] == "call" ? PushInfo::Call : PushInfo::Message;
+		info.mType = fields["type"];
+		info.mAppId = fields["app-id"];
+		info.mDeviceToken = fields["device-token"];
+		// the api keys are taken from the configuration rather than saved
+		const map<string, string> &keys = info.mType == "google" ? mGoogleKeys : mFirebaseKeys;
+		auto key = keys.find(info.mAppId);
+		if (key != keys.end())
+			info.mApiKey = key->second;
+		info.mAlertSound = fields["alert-sound"];
+		info.mAlertMsgId = fields["alert-msg-id"];
+		info.mFromName = fields["from-name"];
+		info.mFromUri = fields["from-uri"];
+		info.mFromTag = fields["from-tag"];
+		info.mToUri = fields["to-uri"];
+		info.mCallId = fields["call-id"];
+		info.mText = fields["text"];
+		info.mUid = fields["uid"];
+		info.mTtl = atoi(fields["ttl"].c_str());
+		info.mNoBadge = atoi(fields["no-badge"].c_str()) != 0;
+		info.mSilent = atoi(fields["silent"].c_str()) != 0;
+		time_t deadline = (time_t)strtoll(fields["deadline"].c_str(), NULL, 10);
+		int retries = atoi(fields["retries"].c_str());
+		fields.clear();
+		if (deadline <= now) {
+			++expired;
+			continue;
+		}
+		shared_ptr<PushNotificationRequest> pn = createRequest(info);
+		if (!pn)
+			continue;
+		pn->setRetries(retries);
+		pn->setRetryDeadline(deadline);
+		mPNS->retryPush(pn);
+		++loaded;
+	}
+	mSavedRetries = loaded;
+	LOGI("%zu push notification retries loaded from %s, %zu expired", loaded, mRetryFile.c_str(), expired);
+}
+
 bool PushNotification::needsPush(const sip_t *sip) {
 	if (sip->sip_to->a_tag)
 		return false;
@@ -506,9 +884,76 @@ void PushNotification::onResponse(std::shared_ptr<ResponseSipEvent> &ev) throw(F
 		/*any response >=180 except 503 (which is sofia's internal response for broken transports) should cancel the
 		 * push*/
 		shared_ptr<PushNotificationContext> ctx = transaction->getProperty<PushNotificationContext>(getModuleName());
-		if (ctx)
+		if (ctx) {
 			ctx->cancel();
+			// the device woken up by the notification answers on the branch of its new registration, which is given
+			// the context of the notification too
+			long ms = code < 300 ? ctx->onRinging() : -1;
+			if (ms >= 0)
+				countPushToRing(ms);
+		}
+	}
+}
+
+void PushNotification::sendPush(const shared_ptr<PushNotificationRequest> &pnr, PushInfo::Event event) {
+	string deviceKey = pnr->getAppIdentifier() + ":" + pnr->getDeviceToken();
+	auto it = mCoalescedPushes.find(deviceKey);
+	if (event == PushInfo::Call) {
+		// the call notification wakes the application up, which then gets the messages too
+		if (it != mCoalescedPushes.end()) {
+			SLOGD << "PNR " << pnr.get() << ": replacing the pending message notification(s) of the device";
+			mCountCoalesced->incr();
+			su_timer_destroy(it->second->timer);
+			mCoalescedPushes.erase(it);
+		}
+		submitPush(pnr);
+		return;
+	}
+	if (mCoalescingWindow <= 0 || pnr->getDeviceToken().empty()) {
+		submitPush(pnr);
+		return;
+	}
+	if (it != mCoalescedPushes.end()) {
+		SLOGD << "PNR " << pnr.get() << ": replacing the pending notification PNR " << it->second->request.get();
+		mCountCoalesced->incr();
+		it->second->request = pnr;
+		it->second->count++;
+		return;
+	}
+	unique_ptr<CoalescedPush> push(new CoalescedPush());
+	push->module = this;
+	push->deviceKey = deviceKey;
+	push->request = pnr;
+	push->count = 1;
+	push->timer = su_timer_create(su_root_task(getAgent()->getRoot()), 0);
+	su_timer_set_interval(push->timer, &PushNotification::__coalescing_timer_callback, push.get(), mCoalescingWindow);
+	mCoalescedPushes[deviceKey] = move(push);
+}
+
+void PushNotification::__coalescing_timer_callback(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	CoalescedPush *push = (CoalescedPush *)arg;
+	push->module->flushCoalescedPush(push->deviceKey);
+}
+
+void PushNotification::flushCoalescedPush(const string &deviceKey) {
+	auto it = mCoalescedPushes.find(deviceKey);
+	if (it == mCoalescedPushes.end())
+		return;
+	shared_ptr<PushNotificationRequest> pnr = it->second->request;
+	SLOGD << "PNR " << pnr.get() << ": sending the last of " << it->second->count << " message notification(s)";
+	su_timer_destroy(it->second->timer);
+	mCoalescedPushes.erase(it);
+	submitPush(pnr);
+}
+
+void PushNotification::submitPush(const shared_ptr<PushNotificationRequest> &pnr) {
+	if (mPNS->isDeviceQueued(pnr->getAppIdentifier(), pnr->getDeviceToken())) {
+		// the device is about to be woken up by the previous push notification
+		SLOGD << "PNR " << pnr.get() << ": a push notification is already queued for this device, "
+			  << "not sending another one";
+		return;
 	}
+	mPNS->sendPush(pnr);
 }
 
 void PushNotification::clearNotification(const shared_ptr<PushNotificationContext> &ctx) {
@@ -18,23 +18,63 @@
 
 #include "module.hh"
 #include "agent.hh"
+#include "registrardb.hh"
 #include "log/logmanager.hh"
 #include "sofia-sip/sip_status.h"
+
+#include <list>
+#include <unordered_map>
+
 using namespace std;
 
 class ModuleRedirect : public Module, ModuleToolbox {
-
   private:
 	static ModuleInfo<ModuleRedirect> sInfo;
 	sip_contact_t *mContact;
 	su_home_t mHome;
 
+	/* The Contact headers of the redirections to the contacts registered for a request uri, kept for the next
+	 * requests to the same uri until they expire or the bindings change. */
+	struct Redirection {
+		Redirection() : contacts(NULL), expireAt(0) {
+		}
+		std::string key;
+		SofiaAutoHome home;
+		sip_contact_t *contacts; // NULL when nothing is registered
+		time_t expireAt;
+	};
+	typedef std::list<Redirection> RedirectionList;
+	RedirectionList mRedirections; // most recently used first
+	std::unordered_map<std::string, RedirectionList::iterator> mRedirectionIndex;
+	bool mRegisteredContacts;
+	int mCacheTtl;
+	size_t mCacheMaxSize;
+	bool mWatchingRecords;
+	StatCounter64 *mCountCacheHits;
+	StatCounter64 *mCountCacheMisses;
+
 	void onDeclare(GenericStruct *module_config) {
 		ConfigItemDescriptor configs[] = {
 			{String, "contact", "A contact where to redirect requests. ex: <sip:127.0.0.1:5065>;expires=100", ""},
+			{Boolean, "registered-contacts",
+			 "Redirect the requests to the contacts registered for their request uri instead of 'contact'. "
+			 "The requests to an uri without registered contact are answered with 404 Not Found.",
+			 "false"},
+			{Integer, "cache-ttl",
+			 "Duration in seconds the contacts registered for an uri are reused for the next requests to it, 0 to "
+			 "fetch them from the registrar for every request. An entry is dropped as soon as the bindings of the "
+			 "uri change on this proxy, or on another one when the fetch cache of the redis registrar is enabled.",
+			 "30"},
+			{Integer, "cache-max-size", "Maximum number of uris whose contacts are kept, the least recently used "
+										"ones being dropped first.",
+			 "10000"},
 			config_item_end};
 		module_config->get<ConfigBoolean>("enabled")->setDefault("false");
 		module_config->addChildrenValues(configs);
+		mCountCacheHits = module_config->createStat("count-redirect-cache-hits",
+													"Number of requests redirected without fetching the registrar.");
+		mCountCacheMisses = module_config->createStat(
+			"count-redirect-cache-misses", "Number of requests whose contacts were fetched from the registrar.");
 	}
 
 	bool isValidNextConfig(const ConfigValue &cv) {
@@ -54,27 +94,141 @@ class ModuleRedirect : public Module, ModuleToolbox {
 
 	void onLoad(const GenericStruct *mc) {
 		mContact = sip_contact_make(&mHome, mc->get<ConfigString>("contact")->read().c_str());
-		SLOGI << this->getModuleName() << ": redirect contact is [" << mc->get<ConfigString>("contact")->read().c_str()
-			  << "]";
+		mRegisteredContacts = mc->get<ConfigBoolean>("registered-contacts")->read();
+		mCacheTtl = mc->get<ConfigInt>("cache-ttl")->read();
+		mCacheMaxSize = (size_t)max(0, mc->get<ConfigInt>("cache-max-size")->read());
+		clearRedirections();
+		if (mRegisteredContacts) {
+			SLOGI << this->getModuleName() << ": redirecting to the registered contacts";
+			if (!mWatchingRecords) {
+				// the callbacks cannot be removed, the module living as long as the registrar
+				RegistrarDb::get()->addRecordChangedCallback([this](const string &key) { dropRedirection(key); });
+				mWatchingRecords = true;
+			}
+		} else {
+			SLOGI << this->getModuleName() << ": redirect contact is ["
+				  << mc->get<ConfigString>("contact")->read().c_str() << "]";
+		}
 	}
 
 	void onUnload() {
+		clearRedirections();
 	}
 
 	void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException){
-		ev->reply(SIP_302_MOVED_TEMPORARILY, SIPTAG_CONTACT(sip_contact_dup(&mHome, mContact)),
-				  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+		if (!mRegisteredContacts) {
+			// the contact is copied in the reply
+			ev->reply(SIP_302_MOVED_TEMPORARILY, SIPTAG_CONTACT(mContact),
+					  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+			return;
+		}
+		const url_t *uri = ev->getMsgSip()->getSip()->sip_request->rq_url;
+		string key = Record::defineKeyFromUrl(uri);
+		const Redirection *redirection = findRedirection(key, getCurrentTime());
+		if (redirection) {
+			mCountCacheHits->incr();
+			redirect(ev, redirection->contacts);
+			return;
+		}
+		mCountCacheMisses->incr();
+		RegistrarDb::get()->fetch(uri, make_shared<OnFetchForRedirectListener>(this, ev, key), true);
 	}
 	void onResponse(std::shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException){};
 
+	void redirect(shared_ptr<RequestSipEvent> &ev, const sip_contact_t *contacts) {
+		if (contacts)
+			ev->reply(SIP_302_MOVED_TEMPORARILY, SIPTAG_CONTACT(contacts),
+					  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+		else
+			ev->reply(SIP_404_NOT_FOUND, SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+	}
+
+	const Redirection *findRedirection(const string &key, time_t now) {
+		auto it = mRedirectionIndex.find(key);
+		if (it == mRedirectionIndex.end())
+			return NULL;
+		if (it->second->expireAt <= now) {
+			mRedirections.erase(it->second);
+			mRedirectionIndex.erase(it);
+			return NULL;
+		}
+		mRedirections.splice(mRedirections.begin(), mRedirections, it->second);
+		return &*it->second;
+	}
+
+	/* Builds the contacts of the redirection from the record fetched, and keeps them if the cache is enabled. */
+	const sip_contact_t *addRedirection(const string &key, Record *r, su_home_t *home) {
+		time_t now = getCurrentTime();
+		const sip_contact_t *contacts = r ? r->getContacts(home, now) : NULL;
+		if (mCacheTtl <= 0 || mCacheMaxSize == 0)
+			return contacts;
+		dropRedirection(key);
+		mRedirections.emplace_front();
+		Redirection &redirection = mRedirections.front();
+		redirection.key = key;
+		redirection.contacts = contacts ? sip_contact_dup(redirection.home.home(), contacts) : NULL;
+		// the expires parameters of the contacts are those computed now, they must not outlive them
+		redirection.expireAt = now + mCacheTtl;
+		if (r) {
+			for (const auto &ec : r->getExtendedContacts())
+				redirection.expireAt = min(redirection.expireAt, ec->mExpireAt);
+		}
+		mRedirectionIndex[key] = mRedirections.begin();
+		if (mRedirections.size() > mCacheMaxSize) {
+			mRedirectionIndex.erase(mRedirections.back().key);
+			mRedirections.pop_back();
+		}
+		return contacts;
+	}
+
+	void dropRedirection(const string &key) {
+		auto it = mRedirectionIndex.find(key);
+		if (it == mRedirectionIndex.end())
+			return;
+		mRedirections.erase(it->second);
+		mRedirectionIndex.erase(it);
+	}
+
+	void clearRedirections() {
+		mRedirectionIndex.clear();
+		mRedirections.clear();
+	}
+
   public:
-	ModuleRedirect(Agent *ag) : Module(ag) {
+	ModuleRedirect(Agent *ag)
+		: Module(ag), mContact(NULL), mRegisteredContacts(false), mCacheTtl(0), mCacheMaxSize(0),
+		  mWatchingRecords(false), mCountCacheHits(NULL), mCountCacheMisses(NULL) {
 		su_home_init(&mHome);
 	}
 
 	~ModuleRedirect() {
 		su_home_deinit(&mHome);
 	}
+
+  private:
+	class OnFetchForRedirectListener : public ContactUpdateListener {
+	  public:
+		OnFetchForRedirectListener(ModuleRedirect *module, shared_ptr<RequestSipEvent> ev, const string &key)
+			: mModule(module), mEv(ev), mKey(key) {
+			ev->suspendProcessing();
+		}
+		void onRecordFound(Record *r) {
+			mModule->redirect(mEv, mModule->addRedirection(mKey, r, mEv->getHome()));
+		}
+		void onError() {
+			mEv->reply(SIP_500_INTERNAL_SERVER_ERROR, TAG_END());
+		}
+		void onInvalid() {
+			mEv->reply(400, "Replayed CSeq", TAG_END());
+		}
+		void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+		}
+
+	  private:
+		ModuleRedirect *mModule;
+		shared_ptr<RequestSipEvent> mEv;
+		string mKey;
+	};
 };
 ModuleInfo<ModuleRedirect> ModuleRedirect::sInfo("Redirect",
 												 "This module redirect sip request with a 302 move temporarily.",
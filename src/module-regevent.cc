@@ -0,0 +1,556 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "module.hh"
+#include "agent.hh"
+#include "registrardb.hh"
+
+#include <sofia-sip/nta.h>
+#include <sofia-sip/sip_protos.h>
+#include <sofia-sip/tport.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+ * Notifier of the reg event package (RFC 3680): answers the SUBSCRIBEs with Event: reg to the aors of the managed
+ * domains, and notifies the state of their registrations as published by the Registrar on every change of their
+ * bindings, whatever the node of the cluster which handled the REGISTER.
+ * The changes of an aor are gathered during notify-delay seconds before its record is fetched once for all its
+ * subscriptions, and a subscription waits for the answer to its NOTIFY before sending the next one, so that a mass
+ * re-registration produces one NOTIFY per subscription and not one per REGISTER.
+ */
+class RegEvent : public Module, public ModuleToolbox {
+  public:
+	RegEvent(Agent *ag);
+	virtual ~RegEvent();
+	virtual void onDeclare(GenericStruct *module_config);
+	virtual void onLoad(const GenericStruct *modconf);
+	virtual void onUnload();
+	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
+	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
+
+  private:
+	/* A dialog created by a SUBSCRIBE, the headers being those of the NOTIFYs. */
+	struct Subscription {
+		RegEvent *module;
+		string id; // call-id, remote tag and local tag
+		string key; // registrar key of the aor
+		SofiaAutoHome home;
+		sip_from_t *from;
+		sip_to_t *to;
+		url_t *target;
+		sip_route_t *routes; // from the Record-Route of the SUBSCRIBE
+		string callId;
+		shared_ptr<tport_t> tport; // connection of the SUBSCRIBE, when not record-routed
+		uint32_t cseq;
+		unsigned int version;
+		time_t expireAt;
+		bool dirty; // the latest state is not notified yet
+		bool terminated;
+		nta_outgoing_t *notify; // waiting for its answer
+		shared_ptr<TimerService::Timer> expireTimer;
+	};
+	/* The subscriptions of an aor, and the latest state of its registrations. */
+	struct Aor {
+		string uri;
+		string topic;
+		shared_ptr<ContactRegisteredListener> listener;
+		list<shared_ptr<Subscription>> subscriptions;
+		string registration; // <registration> element, empty until the record is fetched
+		bool fetching;
+		bool refetch; // changed during the fetch
+		shared_ptr<TimerService::Timer> notifyTimer;
+		shared_ptr<TimerService::Timer> expiryTimer; // at the expiration of the earliest contact
+	};
+	class ChangeListener : public ContactRegisteredListener {
+	  public:
+		ChangeListener(RegEvent *module, const string &key) : mModule(module), mKey(key) {
+		}
+		virtual void onContactRegistered(string topic, string uid) {
+			mModule->onChange(mKey);
+		}
+
+	  private:
+		RegEvent *mModule;
+		string mKey;
+	};
+	class FetchListener : public ContactUpdateListener {
+	  public:
+		FetchListener(RegEvent *module, const string &key) : mModule(module), mKey(key) {
+		}
+		virtual void onRecordFound(Record *r) {
+			mModule->onRecordFetched(mKey, r, true);
+		}
+		virtual void onError() {
+			mModule->onRecordFetched(mKey, NULL, false);
+		}
+		virtual void onInvalid() {
+			mModule->onRecordFetched(mKey, NULL, false);
+		}
+		virtual void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+		}
+
+	  private:
+		RegEvent *mModule;
+		string mKey;
+	};
+
+	void subscribe(shared_ptr<RequestSipEvent> &ev, int expires);
+	void refresh(shared_ptr<RequestSipEvent> &ev, const shared_ptr<Subscription> &sub, int expires);
+	int requestedExpires(const sip_t *sip) const;
+	void scheduleExpiration(const shared_ptr<Subscription> &sub);
+	void onChange(const string &key);
+	void fetch(const string &key);
+	void onRecordFetched(const string &key, Record *r, bool ok);
+	static string registrationState(const string &key, const string &aor, Record *r, time_t now);
+	void sendNotify(const shared_ptr<Subscription> &sub);
+	void terminate(const shared_ptr<Subscription> &sub);
+	void remove(const shared_ptr<Subscription> &sub);
+	static int sOnNotifyResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip);
+	void onNotifyResponse(Subscription *sub, int status);
+
+	list<string> mDomains;
+	int mDefaultExpires;
+	int mMaxExpires;
+	int mNotifyDelay;
+	unordered_map<string, Aor> mAors;
+	unordered_map<string, shared_ptr<Subscription>> mSubscriptions;
+	StatCounter64 *mCountSubscriptions;
+	StatCounter64 *mCountNotifications;
+	StatCounter64 *mCountBatchedChanges;
+	static ModuleInfo<RegEvent> sInfo;
+};
+
+static const char *sContentType = "application/reginfo+xml";
+
+static string xmlEscape(const string &value) {
+	string escaped;
+	for (char c : value) {
+		switch (c) {
+			case '&':
+				escaped += "&amp;";
+				break;
+			case '<':
+				escaped += "&lt;";
+				break;
+			case '>':
+				escaped += "&gt;";
+				break;
+			case '"':
+				escaped += "&quot;";
+				break;
+			default:
+				escaped += c;
+		}
+	}
+	return escaped;
+}
+
+static string hashId(const string &value) {
+	char id[32];
+	snprintf(id, sizeof(id), "%zx", hash<string>()(value));
+	return id;
+}
+
+RegEvent::RegEvent(Agent *ag)
+	: Module(ag), mDefaultExpires(0), mMaxExpires(0), mNotifyDelay(0), mCountSubscriptions(NULL),
+	  mCountNotifications(NULL), mCountBatchedChanges(NULL) {
+}
+
+RegEvent::~RegEvent() {
+	onUnload();
+}
+
+void RegEvent::onDeclare(GenericStruct *module_config) {
+	/*we need to be disabled by default*/
+	module_config->get<ConfigBoolean>("enabled")->setDefault("false");
+	ConfigItemDescriptor items[] = {
+		{StringList, "reg-domains",
+		 "List of whitespace separated domains whose aors accept subscriptions to their registration state. "
+		 "A subscriber may only subscribe to its own aor. Use '*' to accept any domain.",
+		 "*"},
+		{Integer, "default-expires", "Duration in seconds of a subscription without Expires header.", "3600"},
+		{Integer, "max-expires", "Maximum duration in seconds of a subscription.", "86400"},
+		{Integer, "notify-delay",
+		 "Time in seconds during which the changes of the bindings of an aor are gathered into a single NOTIFY of "
+		 "each of its subscriptions. 0 notifies at the next iteration of the main loop.",
+		 "1"},
+		config_item_end};
+	module_config->addChildrenValues(items);
+	mCountSubscriptions =
+		module_config->createStat("count-reg-event-subscriptions", "Number of active reg event subscriptions.");
+	mCountNotifications = module_config->createStat("count-reg-event-notifications", "Number of NOTIFYs sent.");
+	mCountBatchedChanges = module_config->createStat(
+		"count-reg-event-batched-changes", "Number of changes of bindings gathered into the NOTIFY of a previous one.");
+}
+
+void RegEvent::onLoad(const GenericStruct *modconf) {
+	mDomains = modconf->get<ConfigStringList>("reg-domains")->read();
+	mDefaultExpires = max(0, modconf->get<ConfigInt>("default-expires")->read());
+	mMaxExpires = max(0, modconf->get<ConfigInt>("max-expires")->read());
+	mNotifyDelay = max(0, modconf->get<ConfigInt>("notify-delay")->read());
+}
+
+void RegEvent::onUnload() {
+	for (auto &it : mSubscriptions) {
+		if (it.second->notify)
+			nta_outgoing_destroy(it.second->notify);
+		it.second->notify = NULL;
+	}
+	mSubscriptions.clear();
+	for (auto &it : mAors)
+		RegistrarDb::get()->unsubscribe(it.second.topic);
+	mAors.clear();
+}
+
+void RegEvent::onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException) {
+	const sip_t *sip = ev->getMsgSip()->getSip();
+	if (sip->sip_request->rq_method != sip_method_subscribe || !sip->sip_event ||
+		strcmp(sip->sip_event->o_type, "reg") != 0)
+		return;
+	int expires = requestedExpires(sip);
+
+	if (sip->sip_to->a_tag) {
+		// refreshes are addressed to the Contact of our answer
+		if (!getAgent()->isUs(sip->sip_request->rq_url))
+			return;
+		string id = string(sip->sip_call_id->i_id) + ";" + (sip->sip_from->a_tag ? sip->sip_from->a_tag : "") + ";" +
+					sip->sip_to->a_tag;
+		auto it = mSubscriptions.find(id);
+		if (it == mSubscriptions.end()) {
+			ev->reply(SIP_481_NO_TRANSACTION, SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+			return;
+		}
+		refresh(ev, it->second, expires);
+		return;
+	}
+
+	const url_t *aor = sip->sip_request->rq_url;
+	if (!aor->url_user || !isManagedDomain(getAgent(), mDomains, aor))
+		return;
+	if (Record::defineKeyFromUrl(sip->sip_from->a_url) != Record::defineKeyFromUrl(aor)) {
+		ev->reply(403, "Subscription to another aor forbidden", SIPTAG_SERVER_STR(getAgent()->getServerString()),
+				  TAG_END());
+		return;
+	}
+	if (sip->sip_accept) {
+		bool accepted = false;
+		for (const sip_accept_t *accept = sip->sip_accept; accept && !accepted; accept = accept->ac_next)
+			accepted = accept->ac_type && strcasecmp(accept->ac_type, sContentType) == 0;
+		if (!accepted) {
+			ev->reply(SIP_406_NOT_ACCEPTABLE, SIPTAG_ACCEPT_STR(sContentType),
+					  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+			return;
+		}
+	}
+	if (!sip->sip_contact) {
+		ev->reply(400, "Missing Contact", SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+		return;
+	}
+	subscribe(ev, expires);
+}
+
+void RegEvent::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException) {
+}
+
+int RegEvent::requestedExpires(const sip_t *sip) const {
+	if (!sip->sip_expires)
+		return min(mDefaultExpires, mMaxExpires);
+	return min((int)sip->sip_expires->ex_delta, mMaxExpires);
+}
+
+void RegEvent::subscribe(shared_ptr<RequestSipEvent> &ev, int expires) {
+	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	sip_t *sip = ms->getSip();
+	const char *tag = nta_agent_newtag(ms->getHome(), "%s", getAgent()->getSofiaAgent());
+	sip_to_tag(ms->getHome(), sip->sip_to, tag);
+
+	auto sub = make_shared<Subscription>();
+	sub->module = this;
+	sub->id = string(sip->sip_call_id->i_id) + ";" + (sip->sip_from->a_tag ? sip->sip_from->a_tag : "") + ";" + tag;
+	sub->key = Record::defineKeyFromUrl(sip->sip_request->rq_url);
+	su_home_t *home = sub->home.home();
+	sub->from = (sip_from_t *)msg_header_dup_as(home, sip_from_class, (msg_header_t *)sip->sip_to);
+	sub->to = (sip_to_t *)msg_header_dup_as(home, sip_to_class, (msg_header_t *)sip->sip_from);
+	sub->target = url_hdup(home, sip->sip_contact->m_url);
+	sub->routes = sip->sip_record_route
+					  ? (sip_route_t *)msg_header_dup_as(home, sip_route_class, (msg_header_t *)sip->sip_record_route)
+					  : NULL;
+	sub->callId = sip->sip_call_id->i_id;
+	tport_t *tport = ev->getIncomingTport().get();
+	// a client behind a NAT only receives the NOTIFYs on its connection
+	if (!sub->routes && tport && tport_is_reliable(tport) && tport_is_secondary(tport))
+		sub->tport = ev->getIncomingTport();
+	sub->cseq = 0;
+	sub->version = 0;
+	sub->expireAt = getCurrentTime() + expires;
+	sub->dirty = true;
+	sub->terminated = expires == 0; // a fetch of the current state
+	sub->notify = NULL;
+
+	Aor &aor = mAors[sub->key];
+	if (!aor.listener) {
+		aor.uri = url_as_string(ms->getHome(), sip->sip_request->rq_url);
+		aor.topic = RegistrarDb::regEventTopic(sip->sip_request->rq_url);
+		aor.fetching = false;
+		aor.refetch = false;
+		aor.listener = make_shared<ChangeListener>(this, sub->key);
+		RegistrarDb::get()->subscribe(aor.topic, aor.listener);
+	}
+	aor.subscriptions.push_back(sub);
+	mSubscriptions[sub->id] = sub;
+	mCountSubscriptions->set(mSubscriptions.size());
+	if (!sub->terminated)
+		scheduleExpiration(sub);
+	ev->reply(200, "Subscription accepted", SIPTAG_EXPIRES(sip_expires_create(ms->getHome(), expires)),
+			  SIPTAG_CONTACT(sip_contact_create(ms->getHome(), (url_string_t *)getAgent()->getNodeUri(), NULL)),
+			  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+
+	LOGD("Reg event subscription %s to %s for %d seconds", sub->id.c_str(), aor.uri.c_str(), expires);
+	// the initial NOTIFY holds the current state, whatever the notify delay
+	fetch(sub->key);
+}
+
+void RegEvent::refresh(shared_ptr<RequestSipEvent> &ev, const shared_ptr<Subscription> &sub, int expires) {
+	ev->reply(200, "Subscription refreshed", SIPTAG_EXPIRES(sip_expires_create(ev->getMsgSip()->getHome(), expires)),
+			  SIPTAG_SERVER_STR(getAgent()->getServerString()), TAG_END());
+	if (expires == 0) {
+		terminate(sub);
+		return;
+	}
+	sub->expireAt = getCurrentTime() + expires;
+	scheduleExpiration(sub);
+	// a refresh notifies the current state
+	sub->dirty = true;
+	if (!sub->notify && !mAors[sub->key].registration.empty())
+		sendNotify(sub);
+}
+
+void RegEvent::scheduleExpiration(const shared_ptr<Subscription> &sub) {
+	weak_ptr<Subscription> weakSub = sub;
+	time_t delay = max((time_t)0, sub->expireAt - getCurrentTime());
+	sub->expireTimer = getAgent()->getTimers()->schedule((unsigned int)delay, [this, weakSub]() {
+		shared_ptr<Subscription> sub = weakSub.lock();
+		if (sub)
+			terminate(sub);
+	});
+}
+
+void RegEvent::onChange(const string &key) {
+	auto it = mAors.find(key);
+	if (it == mAors.end())
+		return;
+	Aor &aor = it->second;
+	for (auto &sub : aor.subscriptions)
+		sub->dirty = true;
+	if (aor.notifyTimer || aor.fetching) {
+		// notified with the change already waiting, or once the fetch is done
+		if (!aor.notifyTimer)
+			aor.refetch = true;
+		++*mCountBatchedChanges;
+		return;
+	}
+	auto callback = [this, key]() {
+		auto it = mAors.find(key);
+		if (it == mAors.end())
+			return;
+		it->second.notifyTimer.reset();
+		fetch(key);
+	};
+	if (mNotifyDelay > 0)
+		aor.notifyTimer = getAgent()->getTimers()->schedule(mNotifyDelay, callback);
+	else
+		aor.notifyTimer = getAgent()->getTimers()->defer(callback);
+}
+
+void RegEvent::fetch(const string &key) {
+	auto it = mAors.find(key);
+	if (it == mAors.end())
+		return;
+	if (it->second.fetching) {
+		it->second.refetch = true;
+		return;
+	}
+	it->second.fetching = true;
+	SofiaAutoHome home;
+	url_t *url = url_make(home.home(), it->second.uri.c_str());
+	RegistrarDb::get()->fetch(url, make_shared<FetchListener>(this, key), false);
+}
+
+void RegEvent::onRecordFetched(const string &key, Record *r, bool ok) {
+	auto it = mAors.find(key);
+	if (it == mAors.end())
+		return; // no subscription anymore
+	Aor &aor = it->second;
+	aor.fetching = false;
+	time_t now = getCurrentTime();
+	if (ok) {
+		aor.registration = registrationState(key, aor.uri, r, now);
+		// the state changes when the earliest contact expires
+		time_t earliest = 0;
+		if (r) {
+			for (const auto &ec : r->getExtendedContacts()) {
+				if (ec->mExpireAt > now && (earliest == 0 || ec->mExpireAt < earliest))
+					earliest = ec->mExpireAt;
+			}
+		}
+		aor.expiryTimer.reset();
+		if (earliest) {
+			aor.expiryTimer =
+				getAgent()->getTimers()->schedule((unsigned int)(earliest - now), [this, key]() { onChange(key); });
+		}
+	} else {
+		LOGE("Cannot fetch the record of %s for its reg event subscriptions", aor.uri.c_str());
+		if (aor.registration.empty())
+			aor.registration = registrationState(key, aor.uri, NULL, now);
+	}
+	bool refetch = aor.refetch;
+	aor.refetch = false;
+	// copied, as a terminated subscription is removed once notified
+	auto subscriptions = aor.subscriptions;
+	for (auto &sub : subscriptions) {
+		if (sub->dirty && !sub->notify)
+			sendNotify(sub);
+	}
+	if (refetch)
+		onChange(key);
+}
+
+string RegEvent::registrationState(const string &key, const string &aor, Record *r, time_t now) {
+	ostringstream xml;
+	bool active = false;
+	ostringstream contacts;
+	if (r) {
+		for (const auto &ec : r->getExtendedContacts()) {
+			if (ec->mExpireAt <= now)
+				continue;
+			active = true;
+			string uri = ExtendedContact::urlToString(ec->mSipUri);
+			contacts << "  <contact id=\"" << hashId(uri) << "\" state=\"active\" event=\"registered\" expires=\""
+					 << ec->mExpireAt - now << "\"";
+			if (ec->mQ != 1.0f)
+				contacts << " q=\"" << ec->mQ << "\"";
+			if (!ec->mCallId.empty())
+				contacts << " callid=\"" << xmlEscape(ec->mCallId) << "\" cseq=\"" << ec->mCSeq << "\"";
+			contacts << ">\n   <uri>" << xmlEscape(uri) << "</uri>\n  </contact>\n";
+		}
+	}
+	xml << " <registration aor=\"" << xmlEscape(aor) << "\" id=\"" << hashId(key) << "\" state=\""
+		<< (active ? "active" : "init") << "\">\n"
+		<< contacts.str() << " </registration>\n";
+	return xml.str();
+}
+
+void RegEvent::sendNotify(const shared_ptr<Subscription> &sub) {
+	const Aor &aor = mAors[sub->key];
+	SofiaAutoHome home;
+	ostringstream body;
+	body << "<?xml version=\"1.0\"?>\n"
+		 << "<reginfo xmlns=\"urn:ietf:params:xml:ns:reginfo\" version=\"" << sub->version++ << "\" state=\"full\">\n"
+		 << aor.registration << "</reginfo>\n";
+	string bodyStr = body.str();
+	string state = sub->terminated ? "terminated;reason=timeout"
+								   : "active;expires=" + to_string(max((time_t)0, sub->expireAt - getCurrentTime()));
+	const url_t *routeUrl = sub->routes ? sub->routes->r_url : sub->target;
+	sub->dirty = false;
+	sub->notify = nta_outgoing_tcreate(
+		getAgent()->getSofiaAgent(), sOnNotifyResponse, (nta_outgoing_magic_t *)sub.get(),
+		(const url_string_t *)routeUrl, SIP_METHOD_NOTIFY, (const url_string_t *)sub->target, SIPTAG_FROM(sub->from),
+		SIPTAG_TO(sub->to), SIPTAG_CALL_ID_STR(sub->callId.c_str()),
+		SIPTAG_CSEQ(sip_cseq_create(home.home(), ++sub->cseq, SIP_METHOD_NOTIFY)), SIPTAG_ROUTE(sub->routes),
+		SIPTAG_CONTACT(sip_contact_create(home.home(), (url_string_t *)getAgent()->getNodeUri(), NULL)),
+		SIPTAG_EVENT_STR("reg"), SIPTAG_SUBSCRIPTION_STATE_STR(state.c_str()), SIPTAG_CONTENT_TYPE_STR(sContentType),
+		SIPTAG_PAYLOAD_STR(bodyStr.c_str()), TAG_IF(sub->tport, NTATAG_TPORT(sub->tport.get())), TAG_END());
+	if (!sub->notify) {
+		LOGE("Cannot send the reg event NOTIFY of subscription %s", sub->id.c_str());
+		remove(sub);
+		return;
+	}
+	++*mCountNotifications;
+	// the answer to the final NOTIFY is not waited for
+	if (sub->terminated)
+		remove(sub);
+}
+
+void RegEvent::terminate(const shared_ptr<Subscription> &sub) {
+	sub->terminated = true;
+	sub->expireTimer.reset();
+	sub->dirty = true;
+	if (!sub->notify && !mAors[sub->key].registration.empty())
+		sendNotify(sub);
+}
+
+void RegEvent::remove(const shared_ptr<Subscription> &sub) {
+	if (sub->notify) {
+		// kept by sofia up to its completion, without calling us back
+		nta_outgoing_destroy(sub->notify);
+		sub->notify = NULL;
+	}
+	sub->expireTimer.reset();
+	mSubscriptions.erase(sub->id);
+	mCountSubscriptions->set(mSubscriptions.size());
+	auto it = mAors.find(sub->key);
+	if (it == mAors.end())
+		return;
+	it->second.subscriptions.remove(sub);
+	if (it->second.subscriptions.empty()) {
+		RegistrarDb::get()->unsubscribe(it->second.topic);
+		mAors.erase(it);
+	}
+}
+
+int RegEvent::sOnNotifyResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip) {
+	Subscription *sub = reinterpret_cast<Subscription *>(magic);
+	int status = sip && sip->sip_status ? sip->sip_status->st_status : 408;
+	if (status < 200)
+		return 0;
+	nta_outgoing_destroy(orq);
+	sub->notify = NULL;
+	sub->module->onNotifyResponse(sub, status);
+	return 0;
+}
+
+void RegEvent::onNotifyResponse(Subscription *sub, int status) {
+	auto it = mSubscriptions.find(sub->id);
+	if (it == mSubscriptions.end())
+		return;
+	shared_ptr<Subscription> subscription = it->second;
+	if (status >= 300) {
+		LOGD("Reg event subscription %s removed after a %d to its NOTIFY", sub->id.c_str(), status);
+		remove(subscription);
+		return;
+	}
+	// changed while the NOTIFY was in flight, and not waiting for the new state
+	const Aor &aor = mAors[subscription->key];
+	if (subscription->dirty && (subscription->terminated || (!aor.fetching && !aor.notifyTimer)))
+		sendNotify(subscription);
+}
+
+ModuleInfo<RegEvent> RegEvent::sInfo("RegEvent",
+									 "This module notifies the subscribers of the reg event package (RFC 3680) of the "
+									 "changes of the registrations of their aor.",
+									 ModuleInfoBase::ModuleOid::RegEvent, ModuleClassExperimental);
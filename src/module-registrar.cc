@@ -18,6 +18,7 @@
 
 #include "module-registrar.hh"
 #include "log/logmanager.hh"
+#include "tenantstats.hh"
 
 #include <fstream>
 #include <sstream>
@@ -72,6 +73,28 @@ static void _onContactUpdated(ModuleRegistrar *module, tport_t *new_tport, const
 	}
 }
 
+bool BindingChanges::isRefresh(Record *r, const sip_t *sip) const {
+	if (!r || !sip->sip_call_id || !sip->sip_cseq)
+		return false;
+	time_t now = getCurrentTime();
+	size_t bound = 0;
+	for (const auto &ec : r->getExtendedContacts()) {
+		if (ec->mCallId != sip->sip_call_id->i_id || ec->mCSeq != sip->sip_cseq->cs_seq)
+			continue;
+		// the contacts removed by the request are bound with an expiry in the past
+		if (ec->mExpireAt <= now)
+			return false;
+		auto same = find_if(mReplaced.begin(), mReplaced.end(), [&ec](const shared_ptr<ExtendedContact> &replaced) {
+			return url_cmp_all(replaced->mSipUri, ec->mSipUri) == 0 &&
+				   (const list<string> &)replaced->mPath == (const list<string> &)ec->mPath;
+		});
+		if (same == mReplaced.end())
+			return false;
+		++bound;
+	}
+	return bound > 0 && bound == mReplaced.size();
+}
+
 OnRequestBindListener::OnRequestBindListener(ModuleRegistrar *module, std::shared_ptr<RequestSipEvent> ev, const sip_from_t *sipuri,
 						sip_contact_t *contact, sip_path_t *path)
 	: mModule(module), mEv(ev), mSipFrom(NULL), mContact(NULL), mPath(NULL) {
@@ -90,6 +113,7 @@ OnRequestBindListener::~OnRequestBindListener() {
 }
 
 void OnRequestBindListener::onContactUpdated(const std::shared_ptr<ExtendedContact> &ec) {
+	mChanges.add(ec);
 	_onContactUpdated(this->mModule, this->mEv->getIncomingTport().get(), ec);
 }
 
@@ -97,7 +121,17 @@ void OnRequestBindListener::onRecordFound(Record *r) {
 	const shared_ptr<MsgSip> &ms = mEv->getMsgSip();
 	time_t now = getCurrentTime();
 	if (r) {
-		addEventLogRecordFound(mEv, mContact);
+		const sip_t *sip = ms->getSip();
+		// a bind or a clear, not a fetch
+		if (mModule->mPublishRegEvents && sip->sip_contact) {
+			string uid = mContact ? Record::extractUniqueId(mContact) : string();
+			RegistrarDb::get()->publish(RegistrarDb::regEventTopic(sip->sip_from->a_url), uid);
+		}
+		bool refresh = mContact && mChanges.isRefresh(r, sip);
+		if (refresh)
+			mModule->mStats.mCountRefreshes->incr();
+		if (!refresh || mModule->mLogRefreshes)
+			addEventLogRecordFound(mEv, mContact);
 		mModule->reply(mEv, 200, "Registration successful", r->getContacts(ms->getHome(), now));
 
 		const sip_expires_t *expires = mEv->getMsgSip()->getSip()->sip_expires;
@@ -136,11 +170,19 @@ void OnResponseBindListener::onRecordFound(Record *r) {
 			string topic = mModule->routingKey(mCtx->mFrom->a_url);
 			RegistrarDb::get()->publish(topic, uid);
 		}
+		if (mModule->mPublishRegEvents) {
+			RegistrarDb::get()->publish(RegistrarDb::regEventTopic(mCtx->mFrom->a_url),
+										Record::extractUniqueId(mCtx->mContacts));
+		}
 		const sip_contact_t *dbContacts = r->getContacts(ms->getHome(), now);
 		// Replace received contacts by our ones
 		auto &reMs = mEv->getMsgSip();
 		reMs->getSip()->sip_contact = sip_contact_dup(reMs->getHome(), dbContacts);
-		addEventLogRecordFound(mEv, dbContacts);
+		bool refresh = mChanges.isRefresh(r, reMs->getSip());
+		if (refresh)
+			mModule->mStats.mCountRefreshes->incr();
+		if (!refresh || mModule->mLogRefreshes)
+			addEventLogRecordFound(mEv, dbContacts);
 		mModule->getAgent()->injectResponseEvent(mEv);
 	} else {
 		LOGE("OnResponseBindListener::onRecordFound(): Record is null");
@@ -161,6 +203,7 @@ void OnResponseBindListener::onInvalid() {
 }
 
 void OnResponseBindListener::onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+	mChanges.add(ec);
 	_onContactUpdated(this->mModule, this->mCtx->reqSipEvent->getIncomingTport().get(), ec);
 }
 
@@ -262,6 +305,12 @@ static bool checkStarUse(const sip_contact_t *contact, int expires) {
 	return true;
 }
 
+static void countRegistrarOperation(const shared_ptr<MsgSip> &ms) {
+	Tenant *tenant = ms->getTenant();
+	if (tenant)
+		tenant->count(tenant->registrarOperations);
+}
+
 // Check an expire is present globally or in contact.
 static bool checkHaveExpire(const sip_contact_t *c, int expires) {
 	if (expires >= 0)
@@ -306,6 +355,9 @@ ModuleRegistrar::ModuleRegistrar(Agent *ag) : Module(ag), mStaticRecordsTimer(NU
 	sRegistrarInstanceForSigAction = this;
 	memset(&mSigaction, 0, sizeof(mSigaction));
 	mStaticRecordsVersion = 0;
+	mStaticRecordsCSeq = 0;
+	mLogRefreshes = true;
+	mPublishRegEvents = false;
 }
 
 void ModuleRegistrar::onDeclare(GenericStruct *mc) {
@@ -338,16 +390,37 @@ void ModuleRegistrar::onDeclare(GenericStruct *mc) {
 										"<sip:contact@domain> <sip:127.0.0.1:5460>,<sip:192.168.0.1:5160>",
 			""},
 		{Integer, "static-records-timeout",
-			"Timeout in seconds after which the static records file is re-read and the contacts updated.", "600"},
+			"Timeout in seconds after which the static records file is re-read and the contacts updated. Only the "
+			"contacts added, changed or removed since the previous reading are written to the registrar database, "
+			"the others being refreshed every few timeouts.", "600"},
 
 		{String, "db-implementation",
 			"Implementation used for storing address of records contact uris. [redis, internal]", "internal"},
+		{String, "internal-snapshot-file",
+			"File where the internal implementation keeps its records, so that a restarted proxy routes to the "
+			"contacts registered before without waiting for them to register again. Every bind and clear is appended "
+			"to it, and a snapshot of all the records replaces it every internal-snapshot-interval. "
+			"Empty to keep the records in memory only.", ""},
+		{Integer, "internal-snapshot-interval",
+			"Interval in seconds between the snapshots of the records of the internal implementation, which compact "
+			"the internal-snapshot-file.", "300"},
+		{StringList, "internal-replication-peers",
+			"List of whitespace separated host:port of the other proxies sharing the records of the internal "
+			"implementation without redis, the port defaulting to internal-replication-port. Each bind and clear is "
+			"sent to them at once over UDP, and the proxies compare digests of their records every few seconds to "
+			"repair what a partition or a lost datagram missed. Meant for a few nodes on a reliable network, each one "
+			"keeping all the records in memory. Two binds of the "
+			"same aor on two proxies within the same instant keep only the last one, the other contact coming back at "
+			"its next refresh. Empty to disable the replication.", ""},
+		{Integer, "internal-replication-port",
+			"UDP port on which the records of the internal implementation are replicated with the "
+			"internal-replication-peers, who must send from their own internal-replication-port.", "5090"},
 		// Redis config support
 		{String, "redis-server-domain", "Domain of the redis server. ", "localhost"},
 		{Integer, "redis-server-port", "Port of the redis server.", "6379"},
 		{String, "redis-auth-password", "Authentication password for redis. Empty to disable.", ""},
 		{Integer, "redis-server-timeout", "Timeout in milliseconds of the redis connection.", "1500"},
-		{String, "redis-record-serializer", "Serialize contacts with: [C, protobuf, json, msgpack]", "protobuf"},
+		{String, "redis-record-serializer", "Serialize contacts with: [C, protobuf, json, msgpack, flat]", "protobuf"},
 		{Integer, "redis-slave-check-period", "When Redis is configured in master-slave, flexisip will "
 												"periodically ask what are the slaves and the master."
 												"This is the period with which it will query the server."
@@ -356,6 +429,106 @@ void ModuleRegistrar::onDeclare(GenericStruct *mc) {
 												"Note: This requires that all redis instances have the same "
 												"password. Otherwise the authentication will fail.",
 			"60"},
+		{Integer, "redis-batch-window", "Time in milliseconds during which commands sent to redis are held back in order "
+										"to be written together as a single pipelined batch. 0 disables this delay: "
+										"commands issued during the same main loop iteration are still pipelined.",
+			"0"},
+		{Integer, "redis-batch-max-size", "Maximum number of commands in a redis batch. When reached, the batch is "
+										"written immediately without waiting for the end of redis-batch-window. "
+										"0 means no limit.",
+			"128"},
+		{Integer, "redis-fetch-cache-size", "Maximum number of records fetched from redis which are kept in a local "
+											"cache, so that routing several requests to the same address of record "
+											"does not query redis each time. Cached records are invalidated through "
+											"redis pub/sub when they are modified, so the cache must be enabled on all "
+											"the proxies sharing the redis database. 0 disables the cache.",
+			"0"},
+		{Integer, "redis-saturation-commands", "Number of commands waiting for the reply of redis taken as a full load "
+											   "by the headroom-permille statistic.",
+		 "1000"},
+		{Integer, "redis-fetch-cache-ttl", "Maximum time in seconds a record is kept in the local fetch cache.", "30"},
+		{Boolean, "redis-client-tracking", "Have redis itself notify the modifications of the records kept in the "
+										   "local fetch cache, with the client side caching of redis 6 in broadcast "
+										   "mode on the keys of the records, so that the records modified by other "
+										   "tools than flexisip, or expired, are invalidated too. The pub/sub "
+										   "notifications of the proxies are still sent and received. Not supported "
+										   "with redis-cluster nor redis-shards.",
+		 "false"},
+		{Boolean, "redis-cluster", "Use a redis cluster. redis-server-domain and redis-server-port then designate any node "
+								   "of the cluster, which is used to discover the assignment of the slots to the master "
+								   "nodes. Each record is read and written on the node owning its slot, and the "
+								   "redis-slave-check-period is used to refresh the assignment of the slots.",
+		 "false"},
+		{Integer, "redis-migration-budget", "Number of keys examined every second by the background migration of the "
+											"records stored in the format of previous versions.",
+		 "100"},
+		{Boolean, "redis-bind-script", "Do the binds with a lua script loaded in redis when connecting, which updates "
+									   "the record, removes its expired contacts, refreshes its expiration and "
+									   "replies the resulting contacts in a single command. Binds fall back to "
+									   "transactions while the script is not available. Requires redis 2.6 or later.",
+		 "false"},
+		{Boolean, "redis-replica-reads", "Send the fetches to the slaves of the redis master, found through its "
+										 "replication info, leaving the master for the writes. The records fetched "
+										 "from a slave are not kept in the fetch cache. Not supported with "
+										 "redis-cluster.",
+		 "false"},
+		{Integer, "redis-replica-max-lag", "Staleness tolerated for the fetches sent to slaves, in seconds: slaves "
+										   "lagging behind the master more are not read, and the records bound or "
+										   "cleared by this proxy are read from the master during this time plus one "
+										   "second. 0 accepts any lag.",
+		 "2"},
+		{Integer, "redis-aor-filter-size", "Number of records a local filter of the registered aors is sized for, "
+										   "so that the fetches of the aors which are not registered are answered "
+										   "without querying redis. The filter is built from a scan of the records in "
+										   "the background, and kept up to date through redis pub/sub: all the proxies "
+										   "sharing the redis database must enable it, or the fetch cache. "
+										   "About 10 bits per record, for 1% of false positives until more records are "
+										   "registered. 0 disables the filter.",
+		 "0"},
+		{Integer, "redis-aor-filter-rebuild-interval", "Interval in seconds between the rebuilds of the filter of the "
+													   "registered aors, which drop the aors whose records were "
+													   "removed.",
+		 "3600"},
+		{Integer, "redis-subscription-channels", "Number of redis pub/sub channels the notifications of the "
+												 "registered contacts, awaited by the forks of the late registrations, "
+												 "are hashed to. Each proxy then holds this many subscriptions whatever "
+												 "the number of forks waiting, and filters the notifications locally. "
+												 "All the proxies sharing the redis database must use the same value. "
+												 "0 subscribes a channel per awaited aor.",
+		 "0"},
+		{Integer, "redis-reconnect-min-delay", "Delay in milliseconds before the first attempt to reconnect to redis "
+											   "after the connection was lost. It doubles after every failed attempt "
+											   "up to redis-reconnect-max-delay, each delay being randomized by half "
+											   "of its value so that the proxies do not reconnect all together.",
+		 "100"},
+		{Integer, "redis-reconnect-max-delay", "Maximum delay in milliseconds between two attempts to reconnect to "
+											   "redis.",
+		 "2000"},
+		{Integer, "redis-outage-buffer-size", "Number of binds, fetches and clears kept while the connection to redis "
+											  "is lost, and sent once reconnected, the commands in flight when it was "
+											  "lost included. Once full, or once the outage lasts longer than "
+											  "redis-outage-buffer-timeout, the next ones fail at once until the "
+											  "reconnection. 0 fails them all during the outages.",
+		 "2000"},
+		{Integer, "redis-outage-buffer-timeout", "Time in milliseconds a command may wait for the reconnection to "
+												 "redis, after which it fails.",
+		 "5000"},
+		{Integer, "redis-compression-threshold", "Size in bytes from which the contacts are stored in redis compressed "
+												 "with LZ4. The compressed contacts can only be read by the proxies "
+												 "supporting them: to be enabled once all the proxies sharing the redis "
+												 "database do. Requires flexisip to be built with lz4. 0 disables the "
+												 "compression.",
+		 "0"},
+		{StringList, "redis-shards", "List of whitespace separated host:port of independent redis masters the records "
+									 "are spread over by consistent hashing of their aor, for deployments without "
+									 "redis-cluster. redis-server-domain and redis-server-port still designate the "
+									 "server used for pub/sub, which may be one of them. All the proxies must list the "
+									 "same masters, written the same way. The records stored before are not moved. "
+									 "Empty to keep all the records on redis-server-domain.",
+		 ""},
+		{StringList, "redis-shard-domains", "List of whitespace separated domain=host:port, storing the records of a "
+											"domain on one of the redis-shards instead of spreading them.",
+		 ""},
 		{String, "service-route",
 			"Sequence of proxies (space-separated) where requests will be redirected through (RFC3608)", ""},
 		{Integer, "register-expire-randomizer-max", "Maximum percentage of the REGISTER expire to randomly remove, 0 to disable", "0"},
@@ -365,6 +538,39 @@ void ModuleRegistrar::onDeclare(GenericStruct *mc) {
 	mStats.mCountClear = mc->createStats("count-clear", "Number of cleared registrations.");
 	mStats.mCountBind = mc->createStats("count-bind", "Number of registers.");
 	mStats.mCountLocalActives = mc->createStat("count-local-registered-users", "Number of users currently registered through this server.");
+	mStats.mCountRefreshes = mc->createStat("count-refreshes", "Number of registrations only refreshing the expiry of "
+															   "bindings, their contacts being unchanged.");
+	mc->createStat("count-redis-batches", "Number of batches of commands written to redis.");
+	mc->createStat("count-redis-batched-commands", "Number of commands written to redis as part of a batch.");
+	mc->createStat("count-redis-batches-full", "Number of batches written to redis because redis-batch-max-size was reached.");
+	mc->createStat("count-redis-fetch-cache-hits", "Number of fetches served from the local record cache.");
+	mc->createStat("count-redis-fetch-cache-misses", "Number of fetches not found in the local record cache.");
+	mc->createStat("count-redis-fetch-cache-evictions", "Number of records evicted from the local record cache.");
+	mc->createStat("count-redis-cluster-redirections", "Number of MOVED or ASK redirections followed in a redis cluster.");
+	mc->createStat("count-redis-migration-scanned-keys", "Number of previous records found by the background migration.");
+	mc->createStat("count-redis-migration-migrated-records", "Number of previous records migrated to the current format.");
+	mc->createStat("count-redis-replica-fetches", "Number of fetches sent to a redis slave.");
+	mc->createStat("count-redis-aor-filter-rejections",
+				   "Number of fetches answered without querying redis, the aor not being registered.");
+	mc->createStat("count-redis-aor-filter-rebuilds", "Number of rebuilds of the filter of the registered aors.");
+	mStats.mCountPendingCommands = mc->createStat("count-redis-pending-commands",
+												  "Number of commands sent to redis, or kept during an outage, "
+												  "waiting for their reply.");
+	mc->createStat("count-redis-reconnections", "Number of attempts to reconnect to redis after a connection loss.");
+	mc->createStat("count-redis-outage-buffered", "Number of commands kept while the connection to redis was lost.");
+	mc->createStat("count-redis-outage-replayed", "Number of kept commands sent once reconnected to redis.");
+	mc->createStat("count-redis-outage-failed",
+				   "Number of commands failed during a redis outage, because the buffer was full, the outage lasted "
+				   "or they waited longer than redis-outage-buffer-timeout.");
+	for (const char *operation : {"bind", "fetch", "clear"}) {
+		string prefix = string("registrardb-") + operation;
+		mc->createStat(prefix + "-latency-p50", string("Median duration of the ") + operation +
+													" operations of the registrar database, in microseconds.");
+		mc->createStat(prefix + "-latency-p99", string("99th percentile of the duration of the ") + operation +
+													" operations of the registrar database, in microseconds.");
+		mc->createStat(prefix + "-in-flight",
+					   string("Number of ") + operation + " operations of the registrar database in progress.");
+	}
 }
 
 void ModuleRegistrar::onLoad(const GenericStruct *mc) {
@@ -374,6 +580,7 @@ void ModuleRegistrar::onLoad(const GenericStruct *mc) {
 		LOGD("Found registrar domain: %s", (*it).c_str());
 	}
 	mUniqueIdParams = mc->get<ConfigStringList>("unique-id-parameters")->read();
+	mSaturationCommands = (size_t)max(1, mc->get<ConfigInt>("redis-saturation-commands")->read());
 	mServiceRoute = mc->get<ConfigString>("service-route")->read();
 	// replace space-separated to comma-separated since sofia-sip is expecting this way
 	std::replace(mServiceRoute.begin(), mServiceRoute.end(), ' ', ',');
@@ -407,10 +614,12 @@ void ModuleRegistrar::onLoad(const GenericStruct *mc) {
 								->get<ConfigBoolean>("assume-unique-domains")
 								->read();
 	mUseGlobalDomain = GenericManager::get()->getRoot()->get<GenericStruct>("module::Router")->get<ConfigBoolean>("use-global-domain")->read();
+	mPublishRegEvents = GenericManager::get()->getRoot()->get<GenericStruct>("module::RegEvent")->get<ConfigBoolean>("enabled")->read();
+	mLogRefreshes = GenericManager::get()->getRoot()->get<GenericStruct>("event-logs")->get<ConfigBoolean>("registration-refreshes")->read();
 	mSigaction.sa_sigaction = ModuleRegistrar::sighandler;
 	mSigaction.sa_flags = SA_SIGINFO;
 	sigaction(SIGUSR1, &mSigaction, NULL);
-	sigaction(SIGUSR2, &mSigaction, NULL);
+	// SIGUSR2 starts the profiler
 
 	mParamsToRemove = GenericManager::get()->getRoot()->get<GenericStruct>("module::Forward")->get<ConfigStringList>("params-to-remove")->read();
 }
@@ -421,6 +630,12 @@ void ModuleRegistrar::onUnload() {
 	}
 }
 
+void ModuleRegistrar::onIdle() {
+	size_t pending = RegistrarDb::get()->countPendingCommands();
+	mStats.mCountPendingCommands->set(pending);
+	getAgent()->getSaturation()->setLoad(SaturationMonitor::Redis, pending * 1000 / mSaturationCommands);
+}
+
 void ModuleRegistrar::idle() {
 	updateLocalRegExpire();
 }
@@ -575,6 +790,7 @@ void ModuleRegistrar::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipE
 	if (sip->sip_contact == NULL) {
 		LOGD("No sip contact, it is a fetch only request for %s.", url_as_string(ms->getHome(), sipurl));
 		auto listener = make_shared<OnRequestBindListener>(this, ev);
+		countRegistrarOperation(ms);
 		RegistrarDb::get()->fetch(sipurl, listener);
 		return;
 	}
@@ -610,6 +826,7 @@ void ModuleRegistrar::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipE
 
 	// Handle modifications
 	if (!mUpdateOnResponse) {
+		countRegistrarOperation(ms);
 		if ('*' == sip->sip_contact->m_url[0].url_scheme[0]) {
 			auto listener = make_shared<OnRequestBindListener>(this, ev);
 			mStats.mCountClear->incrStart();
@@ -696,6 +913,7 @@ void ModuleRegistrar::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(Flexisi
 		// Rewrite contacts in received msg (avoid reworking registrardb API)
 		reSip->sip_contact = context->mContacts;
 		reSip->sip_path = context->mPath;
+		countRegistrarOperation(reMs);
 
 		if ('*' == reSip->sip_contact->m_url[0].url_scheme[0]) {
 			mStats.mCountClear->incrStart();
@@ -715,6 +933,28 @@ void ModuleRegistrar::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(Flexisi
 	}
 }
 
+/*
+ * The static contacts are bound for sStaticLifetimeCycles to twice as many re-readings of the file, spread according to
+ * their key so that their refreshes do not all fall on the same reading, and refreshed when they expire before the
+ * next two ones.
+ */
+static const int sStaticLifetimeCycles = 10;
+
+void ModuleRegistrar::bindStaticContact(const string &key, const StaticContact &sc, int expire, su_home_t *home,
+										const sip_path_t *path) {
+	sip_contact_t *url = sip_contact_make(home, sc.aor.c_str());
+	sip_contact_t *contact = sip_contact_make(home, sc.contact.c_str());
+	if (!url || !contact)
+		return;
+	auto listener = make_shared<OnStaticBindListener>(url->m_url, contact);
+	bool alias = isManagedDomain(contact->m_url);
+	// the same call-id for all the bindings of the contact, so that each one replaces the former
+	const char *callId = su_sprintf(home, "static-record-%zx", hash<string>()(key));
+	mStaticRecordsCSeq = max(mStaticRecordsCSeq + 1, (uint32_t)getCurrentTime());
+	RegistrarDb::get()->bind(url->m_url, contact, callId, mStaticRecordsCSeq, path, NULL, NULL,
+							 contact->m_url->url_user == NULL, expire, alias, mStaticRecordsVersion, listener);
+}
+
 void ModuleRegistrar::readStaticRecords() {
 	if (mStaticRecordsFile.empty())
 		return;
@@ -735,6 +975,7 @@ void ModuleRegistrar::readStaticRecords() {
 		su_home_init(&home);
 		sip_path_t *path = sip_path_format(&home, "%s", getAgent()->getPreferredRoute().c_str());
 		mStaticRecordsVersion++;
+		unordered_map<string, StaticContact> contacts;
 		while (file.good() && !file.eof()) {
 			getline(file, line);
 			size_t i;
@@ -763,7 +1004,6 @@ void ModuleRegistrar::readStaticRecords() {
 				// Create
 				sip_contact_t *url = sip_contact_make(&home, from.c_str());
 				sip_contact_t *contact = sip_contact_make(&home, contact_header.c_str());
-				int expire = mStaticRecordsTimeout + 5; // 5s to avoid race conditions
 
 				if (!url || !contact) {
 					LOGF("Static records line %s doesn't respect the expected format: <identity> <identity>,<identity>", line.c_str());
@@ -773,18 +1013,47 @@ void ModuleRegistrar::readStaticRecords() {
 				while (contact != NULL) {
 					sip_contact_t single = *contact;
 					single.m_next = NULL;
-					auto listener = make_shared<OnStaticBindListener>(url->m_url, &single);
-					bool alias = isManagedDomain(contact->m_url);
-					const char *fakeCallId = su_sprintf(&home, "static-record-v%x", su_random());
-
-					RegistrarDb::get()->bind(url->m_url, &single, fakeCallId, 0, path, NULL, NULL,
-						single.m_url->url_user == NULL, expire, alias, mStaticRecordsVersion, listener);
+					StaticContact sc;
+					sc.aor = from;
+					sc.contact = sip_header_as_string(&home, (const sip_header_t *)&single);
+					sc.expireAt = 0;
+					contacts[from + " " + sc.contact] = sc;
 					contact = contact->m_next;
 				}
 				continue;
 			}
 			LOGW("Incorrect line format: %s", line.c_str());
 		}
+
+		// only the differences with the previous reading are written
+		time_t now = getCurrentTime();
+		int cycle = mStaticRecordsTimeout > 0 ? mStaticRecordsTimeout : 1;
+		size_t added = 0, refreshed = 0, removed = 0;
+		for (auto &it : contacts) {
+			auto previous = mStaticContacts.find(it.first);
+			if (previous == mStaticContacts.end()) {
+				int expire = cycle * (sStaticLifetimeCycles + (int)(hash<string>()(it.first) % sStaticLifetimeCycles)) + 5;
+				it.second.expireAt = now + expire;
+				bindStaticContact(it.first, it.second, expire, &home, path);
+				++added;
+			} else if (previous->second.expireAt - now <= 2 * cycle + 5) {
+				int expire = cycle * sStaticLifetimeCycles + 5;
+				it.second.expireAt = now + expire;
+				bindStaticContact(it.first, it.second, expire, &home, path);
+				++refreshed;
+			} else {
+				it.second.expireAt = previous->second.expireAt;
+			}
+		}
+		for (const auto &it : mStaticContacts) {
+			if (contacts.find(it.first) == contacts.end()) {
+				bindStaticContact(it.first, it.second, 0, &home, path);
+				++removed;
+			}
+		}
+		LOGI("Static records: %zu contacts added, %zu refreshed, %zu removed, %zu unchanged", added, refreshed, removed,
+			 contacts.size() - added - refreshed);
+		mStaticContacts.swap(contacts);
 		su_home_deinit(&home);
 	} else {
 		LOGE("Can't open file %s", mStaticRecordsFile.c_str());
@@ -795,14 +1064,6 @@ void ModuleRegistrar::sighandler(int signum, siginfo_t *info, void *ptr) {
 	if (signum == SIGUSR1) {
 		LOGI("Received signal triggering static records file re-read");
 		sRegistrarInstanceForSigAction->readStaticRecords();
-	} else if (signum == SIGUSR2) {
-		LOGI("Received signal triggering fake fetch");
-		su_home_t home;
-		su_home_init(&home);
-		url_t *url = url_make(&home, "sip:contact@domain");
-
-		auto listener = make_shared<FakeFetchListener>();
-		RegistrarDb::get()->fetch(url, listener, false);
 	}
 }
 
@@ -22,6 +22,7 @@
 #include <sofia-sip/sip_status.h>
 #include <sofia-sip/su_random.h>
 #include <signal.h> 
+#include <unordered_map>
 
 #include "module.hh"
 #include "agent.hh"
@@ -31,6 +32,24 @@ struct RegistrarStats {
 	std::unique_ptr<StatPair> mCountBind;
 	std::unique_ptr<StatPair> mCountClear;
 	StatCounter64 *mCountLocalActives;
+	StatCounter64 *mCountRefreshes;
+	StatCounter64 *mCountPendingCommands;
+};
+
+/*
+ * Bindings a bind replaced, as reported to its listener, to tell a refresh, which only pushes the expiry of the same
+ * contacts, from a change of the bindings of the aor.
+ */
+class BindingChanges {
+  public:
+	void add(const std::shared_ptr<ExtendedContact> &ec) {
+		mReplaced.push_back(ec);
+	}
+	/* Whether the bind of the request replaced each of its contacts by the same one, and nothing else. */
+	bool isRefresh(Record *r, const sip_t *sip) const;
+
+  private:
+	std::list<std::shared_ptr<ExtendedContact>> mReplaced;
 };
 
 class ModuleRegistrar;
@@ -44,6 +63,7 @@ class OnRequestBindListener : public ContactUpdateListener {
 	su_home_t mHome;
 	sip_contact_t *mContact;
 	sip_path_t *mPath;
+	BindingChanges mChanges;
 
   public:
 	OnRequestBindListener(ModuleRegistrar *module, std::shared_ptr<RequestSipEvent> ev, const sip_from_t *sipuri = NULL,
@@ -61,6 +81,7 @@ class OnResponseBindListener : public ContactUpdateListener {
 	std::shared_ptr<ResponseSipEvent> mEv;
 	std::shared_ptr<OutgoingTransaction> mTr;
 	std::shared_ptr<ResponseContext> mCtx;
+	BindingChanges mChanges;
 
   public:
 	OnResponseBindListener(ModuleRegistrar *module, std::shared_ptr<ResponseSipEvent> ev, std::shared_ptr<OutgoingTransaction> tr,
@@ -137,6 +158,8 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 	template <typename SipEventT, typename ListenerT>
 	void processUpdateRequest(std::shared_ptr<SipEventT> &ev, const sip_t *sip);
 
+	virtual void onIdle();
+
 	void idle();
 
 	void reply(std::shared_ptr<RequestSipEvent> &ev, int code, const char *reason, const sip_contact_t *contacts = NULL);
@@ -152,6 +175,15 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 
 	std::string routingKey(const url_t *sipUri);
 
+	/* A contact of the static records file, as bound by the previous reading of the file. */
+	struct StaticContact {
+		std::string aor;
+		std::string contact;
+		time_t expireAt;
+	};
+	void bindStaticContact(const std::string &key, const StaticContact &sc, int expire, su_home_t *home,
+						   const sip_path_t *path);
+
 	RegistrarStats mStats;
 	bool mUpdateOnResponse;
 	bool mAllowDomainRegistrations;
@@ -165,11 +197,16 @@ class ModuleRegistrar : public Module, public ModuleToolbox {
 	su_timer_t *mStaticRecordsTimer;
 	int mStaticRecordsTimeout;
 	int mStaticRecordsVersion;
+	uint32_t mStaticRecordsCSeq; // increasing, as the bindings of a static contact share a call-id
+	std::unordered_map<std::string, StaticContact> mStaticContacts; // by "aor contact"
 	bool mAssumeUniqueDomains;
+	size_t mSaturationCommands;
 	struct sigaction mSigaction;
 	static ModuleInfo<ModuleRegistrar> sInfo;
 	std::list<std::shared_ptr<ResponseContext>> mRespContexes;
 	bool mUseGlobalDomain;
+	bool mLogRefreshes; // event-logs/registration-refreshes
+	bool mPublishRegEvents; // the changes of the bindings, for the subscriptions of the RegEvent module
 	int mExpireRandomizer;
 	std::list<std::string> mParamsToRemove;
 };
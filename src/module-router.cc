@@ -22,8 +22,15 @@
 #include "forkcallcontext.hh"
 #include "forkmessagecontext.hh"
 #include "forkbasiccontext.hh"
+#include "forkmessagestore.hh"
+#include "responsehistory.hh"
 #include "log/logmanager.hh"
 #include <sofia-sip/sip_status.h>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 
@@ -34,6 +41,181 @@ struct RouterStats {
 	unique_ptr<StatPair> mCountForkTransactions;
 	StatCounter64 *mCountNonForks;
 	StatCounter64 *mCountLocalActives;
+	StatCounter64 *mCountPendingCallForks;
+	StatCounter64 *mCountPendingMessageForks;
+	StatCounter64 *mCountPendingBasicForks;
+	StatCounter64 *mCountStoredMessageForks;
+	StatCounter64 *mCountUnresponsiveSkips;
+	StatCounter64 *mCountImdnFastPath;
+	StatCounter64 *mCountWindowedDeliveries;
+};
+
+/*
+ * Index of the fork contexts waiting for late registrations, by routing key: the AOR of the request, or the contact
+ * uri of an alias. A context may be indexed under several keys; the position of each of its entries is remembered
+ * so that removing a context does not scan the lists of its keys. The uri fetched on the registrations of a key is
+ * kept along when the context may be stored.
+ */
+class ForkIndex {
+  public:
+	/* Returns true if ctx is the first fork pending on key. pendingCount is incremented while ctx is indexed. */
+	bool add(const string &key, const shared_ptr<ForkContext> &ctx, StatCounter64 *pendingCount, const string &uri) {
+		ForkList &forks = mForks[key];
+		bool first = forks.empty();
+		forks.push_back(ctx);
+		Entries &entries = mEntries[ctx.get()];
+		if (entries.handles.empty()) {
+			entries.pendingCount = pendingCount;
+			if (pendingCount) ++(*pendingCount);
+		}
+		entries.handles.push_back({key, prev(forks.end()), uri});
+		return first;
+	}
+
+	/* Removes every entry of ctx and returns the keys on which no fork is pending anymore. */
+	list<string> remove(const shared_ptr<ForkContext> &ctx) {
+		list<string> emptied;
+		auto it = mEntries.find(ctx.get());
+		if (it == mEntries.end())
+			return emptied;
+		for (auto &handle : it->second.handles) {
+			auto forks = mForks.find(handle.key);
+			forks->second.erase(handle.position);
+			if (forks->second.empty()) {
+				mForks.erase(forks);
+				emptied.push_back(handle.key);
+			}
+		}
+		if (it->second.pendingCount) --(*it->second.pendingCount);
+		mEntries.erase(it);
+		return emptied;
+	}
+
+	/* Returns a copy, as dispatching to a fork may end up modifying the index. */
+	vector<shared_ptr<ForkContext>> find(const string &key) const {
+		auto it = mForks.find(key);
+		if (it == mForks.end())
+			return vector<shared_ptr<ForkContext>>();
+		return vector<shared_ptr<ForkContext>>(it->second.begin(), it->second.end());
+	}
+
+	bool contains(const shared_ptr<ForkContext> &ctx) const {
+		return mEntries.find(ctx.get()) != mEntries.end();
+	}
+
+	bool contains(const string &key) const {
+		return mForks.find(key) != mForks.end();
+	}
+
+	/* Keys under which ctx is indexed, with their uris. */
+	map<string, string> keys(const shared_ptr<ForkContext> &ctx) const {
+		map<string, string> keys;
+		auto it = mEntries.find(ctx.get());
+		if (it != mEntries.end()) {
+			for (auto &handle : it->second.handles)
+				keys[handle.key] = handle.uri;
+		}
+		return keys;
+	}
+
+  private:
+	typedef list<shared_ptr<ForkContext>> ForkList;
+	struct Handle {
+		string key;
+		ForkList::iterator position;
+		string uri;
+	};
+	struct Entries {
+		Entries() : pendingCount(NULL) {
+		}
+		vector<Handle> handles;
+		StatCounter64 *pendingCount;
+	};
+	unordered_map<string, ForkList> mForks;
+	unordered_map<const ForkContext *, Entries> mEntries;
+};
+
+/*
+ * Message forks delivered to the devices registering while messages wait for them, by instance uid: at most a window
+ * of them are in flight to a device, the next ones being dispatched in their order of arrival as the device answers,
+ * rather than as a burst of transactions on the connection it just opened.
+ */
+class DeliveryWindows {
+  public:
+	struct Delivery {
+		shared_ptr<ForkContext> context;
+		shared_ptr<ExtendedContact> contact;
+		time_t expireAt; // the forks sharing a delivery timeout expire in their order of arrival
+	};
+
+	/* Replaces the deliveries waiting for uid by the ones found on its new registration, but those in flight. */
+	void queue(const string &uid, list<Delivery> &deliveries) {
+		Window &window = mWindows[uid];
+		deliveries.remove_if([&window](const Delivery &d) { return window.inFlight.count(d.context.get()) > 0; });
+		deliveries.sort([](const Delivery &a, const Delivery &b) { return a.expireAt < b.expireAt; });
+		window.pending.swap(deliveries);
+		release(uid);
+	}
+
+	/* Takes the next delivery waiting for uid, if its window has room. */
+	bool next(const string &uid, size_t size, Delivery &delivery) {
+		auto it = mWindows.find(uid);
+		if (it == mWindows.end() || it->second.pending.empty() || it->second.inFlight.size() >= size)
+			return false;
+		delivery = it->second.pending.front();
+		it->second.pending.pop_front();
+		it->second.inFlight.insert(delivery.context.get());
+		return true;
+	}
+
+	/* Frees the place of ctx in the window of uid. */
+	void answered(const string &uid, const ForkContext *ctx) {
+		auto it = mWindows.find(uid);
+		if (it == mWindows.end())
+			return;
+		it->second.inFlight.erase(ctx);
+		release(uid);
+	}
+
+	/* Forgets ctx, finished. */
+	void remove(const ForkContext *ctx) {
+		for (auto it = mWindows.begin(); it != mWindows.end();) {
+			it->second.inFlight.erase(ctx);
+			it->second.pending.remove_if([ctx](const Delivery &d) { return d.context.get() == ctx; });
+			if (it->second.pending.empty() && it->second.inFlight.empty())
+				it = mWindows.erase(it);
+			else
+				++it;
+		}
+	}
+
+	bool isPending(const string &uid, const ForkContext *ctx) const {
+		auto it = mWindows.find(uid);
+		if (it == mWindows.end())
+			return false;
+		const auto &pending = it->second.pending;
+		return find_if(pending.begin(), pending.end(), [ctx](const Delivery &d) { return d.context.get() == ctx; }) !=
+			   pending.end();
+	}
+
+	size_t size(const string &uid) const {
+		auto it = mWindows.find(uid);
+		return it == mWindows.end() ? 0 : it->second.pending.size();
+	}
+
+  private:
+	struct Window {
+		list<Delivery> pending;
+		unordered_set<const ForkContext *> inFlight;
+	};
+
+	void release(const string &uid) {
+		auto it = mWindows.find(uid);
+		if (it != mWindows.end() && it->second.pending.empty() && it->second.inFlight.empty())
+			mWindows.erase(it);
+	}
+
+	unordered_map<string, Window> mWindows;
 };
 
 class ModuleRouter : public Module, public ModuleToolbox, public ForkContextListener {
@@ -94,6 +276,36 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 			{Boolean, "remove-to-tag", "Remove to tag from 183, 180, and 101 responses to workaround buggy gateways",
 			 "false"},
 			{String, "preroute", "rewrite username with given value.", ""},
+			{String, "message-store-dir",
+			 "Directory where the messages forked to late registrations are stored once accepted and while none of the"
+			 " recipient devices is reachable, so that they only cost a small index in memory and survive a restart."
+			 " They are loaded back when a recipient registers. Empty to keep them in memory.",
+			 ""},
+			{Boolean, "message-imdn-fast-path",
+			 "Forward the IMDN (message/imdn+xml) MESSAGEs to a single registered device without push notification "
+			 "parameters without fork context: they are neither forked to late registrations nor stored, and are "
+			 "counted and logged every minute instead of producing an event log each.",
+			 "false"},
+			{Integer, "call-unanswered-threshold",
+			 "Number of consecutive calls a device may let go without ringing nor answering before it is considered "
+			 "unresponsive, until it rings or registers again. The calls are then not forked to an unresponsive device "
+			 "while another device of the callee is available, except once every call-unresponsive-probe-interval, and "
+			 "when they are, its branch is cancelled if it did not ring within call-unresponsive-timeout. "
+			 "The history of the devices is local to this proxy. 0 to disable.",
+			 "0"},
+			{Integer, "call-unresponsive-probe-interval",
+			 "Minimum time between two calls forked to a device considered unresponsive, in seconds.", "300"},
+			{Integer, "call-unresponsive-timeout",
+			 "Maximum time for a device considered unresponsive to ring, in seconds. It is shortened to twice the time "
+			 "the device used to take to ring, if known. Calls left pending for that long on a device without ringing "
+			 "count as unanswered.",
+			 "5"},
+			{Integer, "message-delivery-window",
+			 "Maximum number of the messages waiting for a device that are forwarded to it at once when it registers, "
+			 "the next ones being forwarded in their order of arrival as it answers the previous ones. It spreads the "
+			 "delivery of the messages accumulated while a device was offline instead of opening a burst of "
+			 "transactions on the connection it just established. 0 to forward them all at once.",
+			 "0"},
 			config_item_end};
 		mc->addChildrenValues(configs);
 
@@ -104,6 +316,21 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 		mStats.mCountNonForks = mc->createStat("count-non-forked", "Number of non forked invites.");
 		mStats.mCountLocalActives =
 			mc->createStat("count-local-registered-users", "Number of users currently registered through this server.");
+		mStats.mCountPendingCallForks =
+			mc->createStat("count-pending-call-forks", "Number of call forks currently waiting for late registrations.");
+		mStats.mCountPendingMessageForks = mc->createStat(
+			"count-pending-message-forks", "Number of message forks currently waiting for late registrations.");
+		mStats.mCountPendingBasicForks = mc->createStat(
+			"count-pending-basic-forks", "Number of other forks currently waiting for late registrations.");
+		mStats.mCountStoredMessageForks = mc->createStat(
+			"count-stored-message-forks", "Number of message forks stored until late registrations.");
+		mStats.mCountImdnFastPath = mc->createStat(
+			"count-imdn-fast-path", "Number of IMDN MESSAGEs forwarded to a single device without fork context.");
+		mStats.mCountUnresponsiveSkips = mc->createStat(
+			"count-unresponsive-skips", "Number of call branches not created to devices considered unresponsive.");
+		mStats.mCountWindowedDeliveries = mc->createStat(
+			"count-windowed-message-deliveries",
+			"Number of message forks held back by the delivery window of a registering device.");
 	}
 
 	virtual void onLoad(const GenericStruct *mc) {
@@ -131,12 +358,22 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 		mForkCfg->mDeliveryTimeout = mc->get<ConfigInt>("call-fork-timeout")->read();
 		mForkCfg->mTreatDeclineAsUrgent = mc->get<ConfigBoolean>("treat-decline-as-urgent")->read();
 		mForkCfg->mRemoveToTag = mc->get<ConfigBoolean>("remove-to-tag")->read();
+		int unansweredThreshold = mc->get<ConfigInt>("call-unanswered-threshold")->read();
+		if (unansweredThreshold > 0) {
+			int probeInterval = mc->get<ConfigInt>("call-unresponsive-probe-interval")->read();
+			mForkCfg->mResponseHistory = make_shared<ResponseHistory>(unansweredThreshold, max(0, probeInterval));
+		}
+		mForkCfg->mUnresponsiveTimeout = max(1, mc->get<ConfigInt>("call-unresponsive-timeout")->read());
+		mImdnFastPath = mc->get<ConfigBoolean>("message-imdn-fast-path")->read();
+		mImdnForwarded = 0;
+		mImdnSummaryTime = getCurrentTime();
 
 		//Forking configuration for MESSAGEs
 		mMessageForkCfg = make_shared<ForkContextConfig>();
 		mMessageForkCfg->mForkLate = mc->get<ConfigBoolean>("message-fork-late")->read();
 		mMessageForkCfg->mDeliveryTimeout = mc->get<ConfigInt>("message-delivery-timeout")->read();
 		mMessageForkCfg->mUrgentTimeout = mc->get<ConfigInt>("message-accept-timeout")->read();
+		mMessageDeliveryWindow = (size_t)max(0, mc->get<ConfigInt>("message-delivery-window")->read());
 
 		//Forking configuration for other kind of requests.
 		mOtherForkCfg = make_shared<ForkContextConfig>();
@@ -151,16 +388,33 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 										->get<ConfigBoolean>("accept-domain-registrations")
 										->read();
 		mAllowTargetFactorization = mc->get<ConfigBoolean>("allow-target-factorization")->read();
+
+		mMessageStore.reset();
+		string storeDir = mc->get<ConfigString>("message-store-dir")->read();
+		if (!storeDir.empty() && mMessageForkCfg->mForkLate)
+			loadMessageStore(storeDir);
 	}
 
 	virtual void onUnload() {
 	}
 
+	virtual void onIdle() {
+		purgeMessageStore();
+		logImdnSummary();
+	}
+
+	virtual void onSweep(SweepBudget &budget) {
+		if (mForkCfg && mForkCfg->mResponseHistory)
+			mForkCfg->mResponseHistory->sweep(budget);
+	}
+
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 
 	virtual void onForkContextFinished(shared_ptr<ForkContext> ctx);
+	virtual bool onForkContextDormant(shared_ptr<ForkContext> ctx);
+	virtual void onForkBranchAnswered(shared_ptr<ForkContext> ctx, const string &uid);
 	void extractContactByUniqueId(string uid);
 
   private:
@@ -171,6 +425,18 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 								   list<shared_ptr<ExtendedContact>> &ec_list);
 	bool dispatch(const shared_ptr<RequestSipEvent> &ev, const shared_ptr<ExtendedContact> &contact,
 				  shared_ptr<ForkContext> context, const string &targetUris);
+	bool isImdnFastPath(const sip_t *sip,
+						const list<pair<sip_contact_t *, shared_ptr<ExtendedContact>>> &usable_contacts) const;
+	void logImdnSummary();
+	void skipUnresponsiveContacts(list<pair<sip_contact_t *, shared_ptr<ExtendedContact>>> &usable_contacts);
+	void addPendingFork(const string &key, const shared_ptr<ForkContext> &context, const url_t *url);
+	void subscribe(const string &key, const url_t *url);
+	void loadMessageStore(const string &dir);
+	void purgeMessageStore();
+	void restoreMessageForks(const string &key, const string &uid, list<shared_ptr<ForkMessageContext>> &restored);
+	bool holdDelivery(const shared_ptr<ForkContext> &context, const shared_ptr<ExtendedContact> &ec,
+					  const string &uid, list<DeliveryWindows::Delivery> &windowed);
+	void fillDeliveryWindow(const string &uid);
 	string routingKey(const url_t *sipUri) {
 		ostringstream oss;
 		if (sipUri->url_user) {
@@ -193,8 +459,10 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 	shared_ptr<ForkContextConfig> mForkCfg;
 	shared_ptr<ForkContextConfig> mMessageForkCfg;
 	shared_ptr<ForkContextConfig> mOtherForkCfg;
-	typedef multimap<string, shared_ptr<ForkContext>> ForkMap;
-	ForkMap mForks;
+	ForkIndex mForks;
+	DeliveryWindows mDeliveryWindows;
+	size_t mMessageDeliveryWindow; // 0 if not limited
+	unique_ptr<ForkMessageStore> mMessageStore;
 	string mGeneratedContactRoute;
 	string mExpectedRealm;
 	bool mUseGlobalDomain;
@@ -204,6 +472,9 @@ class ModuleRouter : public Module, public ModuleToolbox, public ForkContextList
 	bool mGenerateContactEvenOnFilledAor;
 	bool mAllowDomainRegistrations;
 	bool mAllowTargetFactorization;
+	bool mImdnFastPath;
+	unsigned int mImdnForwarded; // since the last summary
+	time_t mImdnSummaryTime;
 	string mPreroute;
 };
 
@@ -298,8 +569,9 @@ bool ModuleRouter::dispatch(const shared_ptr<RequestSipEvent> &ev, const shared_
 	char *contact_url_string = url_as_string(ms->getHome(), dest);
 	shared_ptr<RequestSipEvent> new_ev;
 	if (context) {
-		// duplicate the SIP event
-		new_ev = make_shared<RequestSipEvent>(ev);
+		// copy of the SIP event sharing the values of the request, which is left as is once forked: only the request
+		// uri and the routes of the branch differ
+		new_ev = make_shared<RequestSipEvent>(ev, MsgSip::createBranch(*ev->getMsgSip()));
 	} else {
 		new_ev = ev;
 	}
@@ -417,7 +689,10 @@ void ModuleRouter::onContactRegistered(const std::string &uid, Record *aor, cons
 
 	// Find all contexts
 	const string key(routingKey(sipUri));
-	auto range = mForks.equal_range(key.c_str());
+	list<shared_ptr<ForkMessageContext>> restored;
+	list<DeliveryWindows::Delivery> windowed;
+	restoreMessageForks(key, uid, restored);
+	auto forks = mForks.find(key);
 	SLOGD << "Searching for fork context with key " << key;
 
 	const shared_ptr<ExtendedContact> ec = aor->extractContactByUniqueId(uid);
@@ -426,11 +701,12 @@ void ModuleRouter::onContactRegistered(const std::string &uid, Record *aor, cons
 		path = ec->toSofiaRoute(home.home());
 
 		// First use sipURI
-		for (auto it = range.first; it != range.second; ++it) {
-			shared_ptr<ForkContext> context = it->second;
+		for (auto it = forks.begin(); it != forks.end(); ++it) {
+			shared_ptr<ForkContext> context = *it;
 			if (context->onNewRegister(contact->m_url, uid)) {
 				SLOGD << "Found a pending context for key " << key << ": " << context.get();
-				dispatch(context->getEvent(), ec, context, "");
+				if (!holdDelivery(context, ec, uid, windowed))
+					dispatch(context->getEvent(), ec, context, "");
 			} else
 				LOGD("Found a pending context but not interested in this new register.");
 		}
@@ -446,16 +722,68 @@ void ModuleRouter::onContactRegistered(const std::string &uid, Record *aor, cons
 		// Find all contexts
 		contact = ec->toSofiaContact(home.home(), ec->mExpireAt - 1);
 		path = ec->toSofiaRoute(home.home());
-		auto rang = mForks.equal_range(ExtendedContact::urlToString(ec->mSipUri));
-		for (auto ite = rang.first; ite != rang.second; ++ite) {
-			shared_ptr<ForkContext> context = ite->second;
+		const string aliasKey(ExtendedContact::urlToString(ec->mSipUri));
+		restoreMessageForks(aliasKey, uid, restored);
+		auto aliasForks = mForks.find(aliasKey);
+		for (auto ite = aliasForks.begin(); ite != aliasForks.end(); ++ite) {
+			shared_ptr<ForkContext> context = *ite;
 			if (context->onNewRegister(contact->m_url, uid)) {
 				LOGD("Found a pending context for contact %s: %p", ExtendedContact::urlToString(ec->mSipUri).c_str(), context.get());
 				auto stlpath = Record::route_to_stl(context->getEvent()->getMsgSip()->getHome(), path);
-				dispatch(context->getEvent(), ec, context, "");
+				if (!holdDelivery(context, ec, uid, windowed))
+					dispatch(context->getEvent(), ec, context, "");
 			}
 		}
 	}
+	if (!windowed.empty()) {
+		mDeliveryWindows.queue(uid, windowed);
+		fillDeliveryWindow(uid);
+		size_t held = mDeliveryWindows.size(uid);
+		if (held > 0) {
+			LOGD("%zu messages held back by the delivery window of %s", held, uid.c_str());
+			mStats.mCountWindowedDeliveries->set(mStats.mCountWindowedDeliveries->read() + held);
+		}
+	}
+	// the restored forks which were not dispatched to this registration go back to the store, unless they wait in
+	// its delivery window
+	for (auto it = restored.begin(); it != restored.end(); ++it) {
+		if (!mDeliveryWindows.isPending(uid, it->get()))
+			(*it)->checkDormant();
+	}
+}
+
+/* Keeps the message fork to be delivered to uid in its delivery window, if limited. */
+bool ModuleRouter::holdDelivery(const shared_ptr<ForkContext> &context, const shared_ptr<ExtendedContact> &ec,
+								const string &uid, list<DeliveryWindows::Delivery> &windowed) {
+	auto messageCtx = dynamic_pointer_cast<ForkMessageContext>(context);
+	if (mMessageDeliveryWindow == 0 || !messageCtx || uid.empty())
+		return false;
+	windowed.push_back({context, ec, messageCtx->getExpireAt()});
+	return true;
+}
+
+/* Dispatches the next messages waiting for the instance uid while its delivery window has room. */
+void ModuleRouter::fillDeliveryWindow(const string &uid) {
+	DeliveryWindows::Delivery delivery;
+	while (mDeliveryWindows.next(uid, mMessageDeliveryWindow, delivery)) {
+		const shared_ptr<ForkContext> &context = delivery.context;
+		const shared_ptr<ExtendedContact> &ec = delivery.contact;
+		SofiaAutoHome home;
+		sip_contact_t *contact = ec->toSofiaContact(home.home(), ec->mExpireAt - 1);
+		// the fork may have been delivered, expired or stored meanwhile
+		if (mForks.contains(context) && context->onNewRegister(contact->m_url, uid) &&
+			dispatch(context->getEvent(), ec, context, ""))
+			continue;
+		mDeliveryWindows.answered(uid, context.get());
+		auto messageCtx = dynamic_pointer_cast<ForkMessageContext>(context);
+		if (messageCtx && mForks.contains(context))
+			messageCtx->checkDormant();
+	}
+}
+
+void ModuleRouter::onForkBranchAnswered(shared_ptr<ForkContext> ctx, const string &uid) {
+	mDeliveryWindows.answered(uid, ctx.get());
+	fillDeliveryWindow(uid);
 }
 
 bool ModuleRouter::makeGeneratedContactRoute(shared_ptr<RequestSipEvent> &ev, Record *aor,
@@ -568,6 +896,176 @@ class ForkGroupSorter {
 	list<pair<sip_contact_t *, shared_ptr<ExtendedContact>>> mAllContacts;
 };
 
+/*
+ * Whether the request is an IMDN that can go to its only destination without fork context: the device is registered,
+ * and is not woken up by the push notifications, which are sent for the fork branches.
+ */
+bool ModuleRouter::isImdnFastPath(
+	const sip_t *sip, const list<pair<sip_contact_t *, shared_ptr<ExtendedContact>>> &usable_contacts) const {
+	if (!mImdnFastPath || sip->sip_request->rq_method != sip_method_message || usable_contacts.size() != 1)
+		return false;
+	if (!sip->sip_content_type || !sip->sip_content_type->c_type ||
+		strcasecmp(sip->sip_content_type->c_type, "message/imdn+xml") != 0)
+		return false;
+	const auto &contact = usable_contacts.front();
+	return !contact.second->mAlias && !url_has_param(contact.first->m_url, "pn-tok");
+}
+
+void ModuleRouter::logImdnSummary() {
+	time_t now = getCurrentTime();
+	if (now - mImdnSummaryTime < 60)
+		return;
+	if (mImdnForwarded > 0)
+		SLOGI << mImdnForwarded << " IMDN forwarded without fork context in the last " << now - mImdnSummaryTime << "s";
+	mImdnForwarded = 0;
+	mImdnSummaryTime = now;
+}
+
+/* Leaves out the devices that stopped answering the calls, as long as another one may answer. */
+void ModuleRouter::skipUnresponsiveContacts(list<pair<sip_contact_t *, shared_ptr<ExtendedContact>>> &usable_contacts) {
+	const shared_ptr<ResponseHistory> &history = mForkCfg->mResponseHistory;
+	if (!history)
+		return;
+	auto isUnresponsive = [&history](const pair<sip_contact_t *, shared_ptr<ExtendedContact>> &contact) {
+		return !contact.second->mAlias && history->isUnresponsive(*contact.second);
+	};
+	if (all_of(usable_contacts.begin(), usable_contacts.end(), isUnresponsive))
+		return;
+	for (auto it = usable_contacts.begin(); it != usable_contacts.end();) {
+		if (isUnresponsive(*it) && history->shouldSkip(*it->second)) {
+			LOGD("Skip destination %s, unresponsive to the last calls.", it->second->mUniqueId.c_str());
+			mStats.mCountUnresponsiveSkips->incr();
+			it = usable_contacts.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void ModuleRouter::addPendingFork(const string &key, const shared_ptr<ForkContext> &context, const url_t *url) {
+	StatCounter64 *pendingCount = mStats.mCountPendingBasicForks;
+	if (dynamic_pointer_cast<ForkCallContext>(context)) {
+		pendingCount = mStats.mCountPendingCallForks;
+	} else if (dynamic_pointer_cast<ForkMessageContext>(context)) {
+		pendingCount = mStats.mCountPendingMessageForks;
+	}
+	context->setKey(key);
+	string uri;
+	if (mMessageStore && pendingCount == mStats.mCountPendingMessageForks) {
+		SofiaAutoHome home;
+		uri = url_as_string(home.home(), url);
+	}
+	// the subscription of a key on which messages are stored is already active
+	if (mForks.add(key, context, pendingCount, uri) && !(mMessageStore && mMessageStore->contains(key))) {
+		subscribe(key, url);
+	}
+}
+
+void ModuleRouter::subscribe(const string &key, const url_t *url) {
+	RegistrarDb::get()->subscribe(key, make_shared<OnContactRegisteredListener>(this, url));
+}
+
+void ModuleRouter::loadMessageStore(const string &dir) {
+	mMessageStore.reset(new ForkMessageStore(dir));
+	if (!mMessageStore->load()) {
+		LOGE("Message store disabled, the messages waiting for late registrations are kept in memory");
+		mMessageStore.reset();
+		return;
+	}
+	purgeMessageStore();
+	const auto keys = mMessageStore->getKeys();
+	for (auto it = keys.begin(); it != keys.end(); ++it) {
+		SofiaAutoHome home;
+		url_t *url = url_make(home.home(), it->second.c_str());
+		if (url)
+			subscribe(it->first, url);
+	}
+}
+
+void ModuleRouter::purgeMessageStore() {
+	if (!mMessageStore)
+		return;
+	size_t purged = 0;
+	list<string> emptied = mMessageStore->purge(getCurrentTime(), purged);
+	for (auto it = emptied.begin(); it != emptied.end(); ++it) {
+		if (!mForks.contains(*it))
+			RegistrarDb::get()->unsubscribe(*it);
+	}
+	for (size_t i = 0; i < purged; ++i)
+		mStats.mCountForks->incrFinish();
+	mStats.mCountStoredMessageForks->set(mMessageStore->size());
+}
+
+/* Stores the message forks that only wait for late registrations, finishing their context. */
+bool ModuleRouter::onForkContextDormant(shared_ptr<ForkContext> ctx) {
+	auto messageCtx = dynamic_pointer_cast<ForkMessageContext>(ctx);
+	if (!mMessageStore || !messageCtx || !mForks.contains(ctx))
+		return false;
+	ForkMessageStore::Message message;
+	message.keys = mForks.keys(ctx);
+	message.expireAt = messageCtx->getExpireAt();
+	message.deliveredCount = messageCtx->getDeliveredCount();
+	message.doneUids = messageCtx->getDoneUids();
+	message.request = ctx->getEvent()->getMsgSip()->print();
+	if (mMessageStore->add(message).empty())
+		return false; // kept in memory
+	LOGD("Fork %p stored until a late registration", ctx.get());
+	// the keys stay subscribed, as the store holds them
+	mForks.remove(ctx);
+	mStats.mCountStoredMessageForks->set(mMessageStore->size());
+	return true;
+}
+
+/* Brings the stored message forks of key back into memory, unless the instance uid already had the message. */
+void ModuleRouter::restoreMessageForks(const string &key, const string &uid,
+									   list<shared_ptr<ForkMessageContext>> &restored) {
+	if (!mMessageStore)
+		return;
+	const auto ids = mMessageStore->find(key);
+	for (auto it = ids.begin(); it != ids.end(); ++it) {
+		ForkMessageStore::Message message;
+		if (!mMessageStore->read(*it, message)) {
+			mMessageStore->remove(*it);
+			mStats.mCountForks->incrFinish();
+			continue;
+		}
+		if (find(message.doneUids.begin(), message.doneUids.end(), uid) != message.doneUids.end())
+			continue;
+		msg_t *msg = NULL;
+		if (message.expireAt > getCurrentTime()) {
+			msg = msg_make(sip_default_mclass(), 0, message.request.data(), message.request.size());
+			if (msg && (!sip_object(msg) || !sip_object(msg)->sip_request)) {
+				msg_destroy(msg);
+				msg = NULL;
+			}
+			if (!msg)
+				LOGE("Cannot parse stored message %s", it->c_str());
+		}
+		if (!msg) {
+			mMessageStore->remove(*it);
+			mStats.mCountForks->incrFinish();
+			continue;
+		}
+		auto ms = make_shared<MsgSip>(msg);
+		msg_destroy(msg);
+		auto ev = make_shared<RequestSipEvent>(dynamic_pointer_cast<IncomingAgent>(getAgent()->shared_from_this()), ms);
+		ev->setSuspendedBy(this);
+		auto context = make_shared<ForkMessageContext>(getAgent(), ev, mMessageForkCfg, this, message.expireAt,
+													   message.deliveredCount, message.doneUids);
+		for (auto k = message.keys.begin(); k != message.keys.end(); ++k) {
+			SofiaAutoHome home;
+			url_t *url = url_make(home.home(), k->second.c_str());
+			if (url)
+				addPendingFork(k->first, context, url);
+		}
+		// indexed in memory before leaving the store, which keeps the subscriptions of its keys
+		mMessageStore->remove(*it);
+		restored.push_back(context);
+		LOGD("Fork %p restored from the message store for key '%s'", context.get(), key.c_str());
+	}
+	mStats.mCountStoredMessageForks->set(mMessageStore->size());
+}
+
 void ModuleRouter::routeRequest(shared_ptr<RequestSipEvent> &ev, Record *aor, const url_t *sipUri) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
@@ -614,6 +1112,17 @@ void ModuleRouter::routeRequest(shared_ptr<RequestSipEvent> &ev, Record *aor, co
 		}
 		usable_contacts.push_back(make_pair(ct, ec));
 	}
+	if (mFork && sip->sip_request->rq_method == sip_method_invite)
+		skipUnresponsiveContacts(usable_contacts);
+
+	if (isImdnFastPath(sip, usable_contacts)) {
+		// the incoming transaction absorbs the retransmissions, and the forward module links an outgoing one to it
+		if (dispatch(ev, usable_contacts.front().second, shared_ptr<ForkContext>(), "")) {
+			mStats.mCountImdnFastPath->incr();
+			++mImdnForwarded;
+		}
+		return;
+	}
 
 	if (usable_contacts.size() == 0) {
 		if (nonSipsFound) {
@@ -652,11 +1161,7 @@ void ModuleRouter::routeRequest(shared_ptr<RequestSipEvent> &ev, Record *aor, co
 		if (context) {
 			if (context->getConfig()->mForkLate) {
 				const string key(routingKey(sipUri));
-				context->setKey(key);
-				mForks.insert(make_pair(key, context));
-				if (mForks.count(key) == 1) {
-					RegistrarDb::get()->subscribe(key, make_shared<OnContactRegisteredListener>(this, sipUri));
-				}
+				addPendingFork(key, context, sipUri);
 				SLOGD << "Add fork " << context.get() << " to store with key '" << key << "'";
 			}
 		}
@@ -689,11 +1194,7 @@ void ModuleRouter::routeRequest(shared_ptr<RequestSipEvent> &ev, Record *aor, co
 					temp_ctt->m_url->url_port = NULL;
 				}
 				const string key(routingKey(temp_ctt->m_url));
-				context->setKey(key);
-				mForks.insert(make_pair(key, context));
-				if (mForks.count(key) == 1) {
-					RegistrarDb::get()->subscribe(key, make_shared<OnContactRegisteredListener>(this, temp_ctt->m_url));
-				}
+				addPendingFork(key, context, temp_ctt->m_url);
 				LOGD("Add fork %p to store with key '%s' because it is an alias", context.get(), key.c_str());
 			} else {
 				if (dispatch(ev, ec, context, targetUris)) {
@@ -713,16 +1214,12 @@ class PreroutingFetcher : public ContactUpdateListener,
 	shared_ptr<RequestSipEvent> mEv;
 	shared_ptr<ContactUpdateListener> mListener;
 	vector<string> mPreroutes;
-	int pending;
-	bool error;
 	Record *m_record;
 
   public:
 	PreroutingFetcher(ModuleRouter *module, shared_ptr<RequestSipEvent> ev,
 					  const shared_ptr<ContactUpdateListener> &listener, const vector<string> &preroutes)
 		: mModule(module), mEv(ev), mListener(listener), mPreroutes(preroutes) {
-		pending = 0;
-		error = false;
 		m_record = new Record(NULL);
 	}
 
@@ -735,45 +1232,31 @@ class PreroutingFetcher : public ContactUpdateListener,
 		if (isNumeric(domain))
 			SLOGE << "Not handled: to is ip at " << __LINE__;
 
-		pending += mPreroutes.size();
+		vector<const url_t *> targets;
 		for (auto it = mPreroutes.cbegin(); it != mPreroutes.cend(); ++it) {
-			url_t *target = url_format(mEv->getHome(), "sip:%s@%s", it->c_str(), domain);
-			RegistrarDb::get()->fetch(target, this->shared_from_this(), true);
+			targets.push_back(url_format(mEv->getHome(), "sip:%s@%s", it->c_str(), domain));
 		}
+		RegistrarDb::get()->fetchList(targets, this->shared_from_this(), false, true);
 	}
 
 	void onRecordFound(Record *r) {
-		--pending;
 		if (r != NULL) {
 			const auto &ctlist = r->getExtendedContacts();
 			for (auto it = ctlist.begin(); it != ctlist.end(); ++it)
 				m_record->pushContact(*it);
 		}
-		checkFinished();
+		mListener->onRecordFound(m_record);
 	}
 	void onError() {
-		--pending;
-		error = true;
-		checkFinished();
+		mListener->onError();
 	}
 
 	void onInvalid() {
-		--pending;
-		error = true;
-		checkFinished();
+		mListener->onError();
 	}
 
 	void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
 	}
-
-	void checkFinished() {
-		if (pending != 0)
-			return;
-		if (error)
-			mListener->onError();
-		else
-			mListener->onRecordFound(m_record);
-	}
 };
 
 class TargetUriListFetcher : public ContactUpdateListener,
@@ -784,16 +1267,12 @@ class TargetUriListFetcher : public ContactUpdateListener,
 	shared_ptr<RequestSipEvent> mEv;
 	shared_ptr<ContactUpdateListener> mListener;
 	sip_route_t *mUriList; /*it is parsed as a route but is not a route*/
-	int mPending;
 	Record *mRecord;
-	bool mError;
 
   public:
 	TargetUriListFetcher(ModuleRouter *module, const shared_ptr<RequestSipEvent> &ev,
 						 const shared_ptr<ContactUpdateListener> &listener, sip_unknown_t *target_uris)
-		: mModule(module), mEv(ev), mListener(listener) {
-		mPending = 0;
-		mError = false;
+		: mModule(module), mEv(ev), mListener(listener), mUriList(NULL) {
 		mRecord = new Record(NULL);
 		if (target_uris && target_uris->un_value) {
 			/*the X-target-uris header is parsed like a route, as it is a list of URIs*/
@@ -806,61 +1285,42 @@ class TargetUriListFetcher : public ContactUpdateListener,
 	}
 
 	void fetch(bool allowDomainRegistrations, bool recursive) {
-		sip_route_t *iter;
-		/*compute the number of asynchronous queries we are going to make, to later know when we are done.*/
-		for (iter = mUriList; iter != NULL; iter = iter->r_next) {
-			mPending++;
-		}
-		/*start the queries for all uris of the target uri list*/
-		for (iter = mUriList; iter != NULL; iter = iter->r_next) {
-			RegistrarDb::get()
-				->fetch(iter->r_url, this->shared_from_this(), allowDomainRegistrations, recursive);
+		/*all the uris of the target uri list are fetched at once*/
+		vector<const url_t *> targets;
+		for (sip_route_t *iter = mUriList; iter != NULL; iter = iter->r_next) {
+			targets.push_back(iter->r_url);
 		}
+		RegistrarDb::get()->fetchList(targets, this->shared_from_this(), allowDomainRegistrations, recursive);
 	}
 
 	void onRecordFound(Record *r) {
-		--mPending;
 		if (r != NULL) {
 			const auto &ctlist = r->getExtendedContacts();
 			for (auto it = ctlist.begin(); it != ctlist.end(); ++it)
 				mRecord->pushContact(*it);
 		}
-		checkFinished();
+		if (mRecord->count() > 0) {
+			/*also add aliases in the ExtendedContact list for the searched AORs, so that they are added to the ForkMap.*/
+			sip_route_t *iter;
+			for (iter = mUriList; iter != NULL; iter = iter->r_next) {
+
+				shared_ptr<ExtendedContact> alias = make_shared<ExtendedContact>(iter->r_url, "");
+				alias->mAlias = true;
+				mRecord->pushContact(alias);
+			}
+		}
+		mListener->onRecordFound(mRecord);
 	}
 	void onError() {
-		--mPending;
-		mError = true;
-		checkFinished();
+		mListener->onError();
 	}
 
 	void onInvalid() {
-		--mPending;
-		mError = true;
-		checkFinished();
+		mListener->onError();
 	}
 
 	void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
 	}
-
-	void checkFinished() {
-		if (mPending != 0)
-			return;
-		if (mError){
-			mListener->onError();
-		}else{
-			if (mRecord->count() > 0){
-				/*also add aliases in the ExtendedContact list for the searched AORs, so that they are added to the ForkMap.*/
-				sip_route_t *iter;
-				for (iter = mUriList; iter != NULL; iter = iter->r_next) {
-
-					shared_ptr<ExtendedContact> alias = make_shared<ExtendedContact>(iter->r_url, "");
-					alias->mAlias = true;
-					mRecord->pushContact(alias);
-				}
-			}
-			mListener->onRecordFound(mRecord);
-		}
-	}
 };
 
 class OnFetchForRoutingListener : public ContactUpdateListener {
@@ -981,32 +1441,17 @@ void ModuleRouter::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(FlexisipEx
 }
 
 void ModuleRouter::onForkContextFinished(shared_ptr<ForkContext> ctx) {
+	mDeliveryWindows.remove(ctx.get());
 	if (!ctx->getConfig()->mForkLate) return;
 
-	string key = ctx->getKey();
-	LOGD("Looking at fork contexts with key %s", key.c_str());
-
-	auto range = mForks.equal_range(key.c_str());
-	int count = 0;
-	int removed = 0;
-	for (auto it = range.first; it != range.second;) {
-		count++;
-		if (it->second == ctx) {
-			LOGD("Remove fork %s from store", it->first.c_str());
-			mStats.mCountForks->incrFinish();
-			auto cur_it = it;
-			++it;
-			// for some reason the multimap erase does not return the next iterator !
-			mForks.erase(cur_it);
-			removed++;
-			// do not break, because a single fork context might appear several time in the map because of aliases.
-		} else {
-			++it;
-		}
-	}
-
-	if (count == removed && count > 0) {
-		RegistrarDb::get()->unsubscribe(key.c_str());
+	if (!mForks.contains(ctx)) return;
+	LOGD("Remove fork %p from store", ctx.get());
+	mStats.mCountForks->incrFinish();
+	// a single fork context might be indexed under several keys because of aliases
+	list<string> emptied = mForks.remove(ctx);
+	for (auto it = emptied.begin(); it != emptied.end(); ++it) {
+		if (!(mMessageStore && mMessageStore->contains(*it)))
+			RegistrarDb::get()->unsubscribe(*it);
 	}
 }
 
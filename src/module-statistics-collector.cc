@@ -1,3 +1,63 @@
+int StatisticsCollector::managePublishContent(const shared_ptr<RequestSipEvent> ev) {
+	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	const sip_t *sip = ms->getSip();
+
+	if (!sip) {
+		return 400;
+	}
+
+	// verify that packet contains data
+	if (!sip->sip_payload || sip->sip_payload->pl_len == 0 || !sip->sip_payload->pl_data) {
+		auto log = make_shared<CallQualityStatisticsLog>(sip);
+		log->setStatusCode(606, "No data in packet payload");
+		log->setCompleted();
+		ev->setEventLog(log);
+		return 606;
+	}
+
+	// the report is checked out of the processing of the SIP messages, it is accepted as it is
+	auto log = make_shared<CallQualityStatisticsLog>(sip);
+	if (!mThreadPool->Enqueue([this, log]() { processReport(log); })) {
+		LOGE("StatisticsCollector: too many reports waiting to be processed, report dropped");
+		return 503;
+	}
+	return 200;
+}
+
+void StatisticsCollector::processReport(const shared_ptr<CallQualityStatisticsLog> &log) {
+	const string &report = log->getReport();
+	if (!containsMandatoryFields(report.c_str(), report.size())) {
+		log->setStatusCode(606, "One or several mandatory fields missing");
+		log->setCompleted();
+		lock_guard<mutex> lock(mMutex);
+		mCompleted.push_back(log);
+		return;
+	}
+	log->setStatusCode(200, "OK");
+	log->setCompleted();
+
+	size_t start = report.find("CallID:") + strlen("CallID:");
+	size_t end = report.find_first_of("\r\n", start);
+	string callId = report.substr(start, end == string::npos ? string::npos : end - start);
+	bool session = report.compare(0, strlen("VQSessionReport"), "VQSessionReport") == 0;
+	bool callTerm = report.compare(0, strlen("VQSessionReport: CallTerm"), "VQSessionReport: CallTerm") == 0;
+
+	lock_guard<mutex> lock(mMutex);
+	if (callTerm) {
+		// the call is over, nothing else is expected for it
+		mCalls.erase(callId);
+		mCompleted.push_back(log);
+		return;
+	}
+	CallReports &call = mCalls[callId];
+	// a session report covers the whole call, the interval ones received after it do not replace it
+	if (!call.last || session || !call.lastIsSession) {
+		call.last = log;
+		call.lastIsSession = session;
+	}
+	call.lastReceived = getCurrentTime();
+}
+
 /*
 	Flexisip, a flexible SIP proxy server with media capabilities.
 	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
@@ -20,7 +80,12 @@
 #include "agent.hh"
 #include "transaction.hh"
 #include "etchosts.hh"
+#include "utils/threadpool.hh"
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 
 #include <sofia-sip/su_md5.h>
 #include <sofia-sip/sip_status.h>
@@ -37,20 +102,40 @@ class StatisticsCollector : public Module, ModuleToolbox {
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 
+	virtual void onUnload();
+
   private:
+	/* The reports received for a call, of which only the last one is written. */
+	struct CallReports {
+		shared_ptr<CallQualityStatisticsLog> last;
+		bool lastIsSession;
+		time_t lastReceived;
+	};
 	int managePublishContent(const shared_ptr<RequestSipEvent> ev);
-	bool containsMandatoryFields(char *data, usize_t len);
+	static bool containsMandatoryFields(const char *data, usize_t len);
+	void processReport(const shared_ptr<CallQualityStatisticsLog> &log);
+	void flush(bool all);
+	void scheduleFlush();
 
 	static ModuleInfo<StatisticsCollector> sInfo;
 	url_t *mCollectorAddress;
 	su_home_t mHome;
+	int mFlushInterval;
+	int mReportIdleTime;
+	unique_ptr<ThreadPool> mThreadPool;
+	shared_ptr<TimerService::Timer> mFlushTimer;
+	mutex mMutex; // the following ones are shared with the threads parsing the reports
+	unordered_map<string, CallReports> mCalls; // by CallID of the reports
+	vector<shared_ptr<EventLog>> mCompleted;
 };
 
-StatisticsCollector::StatisticsCollector(Agent *ag) : Module(ag), mCollectorAddress(NULL) {
+StatisticsCollector::StatisticsCollector(Agent *ag)
+	: Module(ag), mCollectorAddress(NULL), mFlushInterval(0), mReportIdleTime(0) {
 	su_home_init(&mHome);
 }
 
 StatisticsCollector::~StatisticsCollector() {
+	onUnload();
 	su_home_deinit(&mHome);
 }
 
@@ -60,7 +145,18 @@ void StatisticsCollector::onDeclare(GenericStruct *module_config) {
 									 "Note that application/vq-rtcpxr messages for this address will be deleted by "
 									 "this module and thus not be delivered.",
 									 ""},
-
+									{Integer, "parsing-threads",
+									 "Number of threads checking and aggregating the reports, out of the processing of "
+									 "the SIP messages.",
+									 "1"},
+									{Integer, "flush-interval",
+									 "Interval in seconds at which the reports of the ended calls are written to the "
+									 "event logs, in one batch.",
+									 "5"},
+									{Integer, "report-idle-time",
+									 "Time in seconds after which a call without new report is considered ended. Only "
+									 "the last report of each call is written, the session report if there is one.",
+									 "300"},
 									config_item_end};
 	module_config->addChildrenValues(items);
 
@@ -83,6 +179,45 @@ void StatisticsCollector::onLoad(const GenericStruct *mc) {
 		mCollectorAddress = NULL;
 	}
 	LOGI("StatisticsCollector: setup with collector address '%s'", value.c_str());
+	mFlushInterval = max(1, mc->get<ConfigInt>("flush-interval")->read());
+	mReportIdleTime = mc->get<ConfigInt>("report-idle-time")->read();
+	mThreadPool.reset(new ThreadPool(max(1, mc->get<ConfigInt>("parsing-threads")->read()), 10000));
+	scheduleFlush();
+}
+
+void StatisticsCollector::onUnload() {
+	mFlushTimer.reset();
+	if (mThreadPool) {
+		// the reports being processed are aggregated before the last flush
+		mThreadPool->ShutDown();
+		mThreadPool.reset();
+		flush(true);
+	}
+}
+
+void StatisticsCollector::scheduleFlush() {
+	mFlushTimer = getAgent()->getTimers()->schedule(mFlushInterval, [this]() {
+		flush(false);
+		scheduleFlush();
+	});
+}
+
+void StatisticsCollector::flush(bool all) {
+	vector<shared_ptr<EventLog>> completed;
+	time_t now = getCurrentTime();
+	{
+		lock_guard<mutex> lock(mMutex);
+		completed.swap(mCompleted);
+		for (auto it = mCalls.begin(); it != mCalls.end();) {
+			if (all || now - it->second.lastReceived >= mReportIdleTime) {
+				completed.push_back(it->second.last);
+				it = mCalls.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	getAgent()->logEvents(completed);
 }
 
 void StatisticsCollector::onRequest(shared_ptr<RequestSipEvent> &ev) throw(FlexisipException) {
@@ -109,8 +244,8 @@ void StatisticsCollector::onResponse(shared_ptr<ResponseSipEvent> &ev) throw(Fle
 /*avoid crash if x is NULL on libc versions <4.5.26 */
 #define __strstr(x, y) ((x == NULL) ? NULL : strstr(x, y))
 
-bool StatisticsCollector::containsMandatoryFields(char *body, usize_t len) {
-	char *remote_metrics_start = __strstr(body, "RemoteMetrics:");
+bool StatisticsCollector::containsMandatoryFields(const char *body, usize_t len) {
+	const char *remote_metrics_start = __strstr(body, "RemoteMetrics:");
 
 	if (!(__strstr(body, "VQIntervalReport\r\n") == body || __strstr(body, "VQSessionReport\r\n") == body ||
 		  __strstr(body, "VQSessionReport: CallTerm\r\n") == body))
@@ -26,44 +26,19 @@
 #ifdef ENABLE_TRANSCODER
 #include "callcontext-transcoder.hh"
 #include "sdp-modifier.hh"
+#include "transcoder-filters.hh"
+#include "transcoder-worker.hh"
+#include "utils/objectpool.hh"
 #endif
 
 #include <vector>
 #include <functional>
 #include <algorithm>
+#include <map>
 
 
 using namespace std;
 
-#ifdef ENABLE_TRANSCODER
-class TickerManager {
-  public:
-	TickerManager() : mLastTickerIndex(0), mStarted(false) {
-	}
-	MSTicker *chooseOne() {
-		if (!mStarted) {
-			int cpucount = ModuleToolbox::getCpuCount();
-			mLastTickerIndex = 0;
-			for (int i = 0; i < cpucount; ++i) {
-				mTickers.push_back(ms_ticker_new());
-			}
-			mStarted = true;
-		}
-		if (mLastTickerIndex >= mTickers.size())
-			mLastTickerIndex = 0;
-		return mTickers[mLastTickerIndex++];
-	}
-	~TickerManager() {
-		for_each(mTickers.begin(), mTickers.end(), ptr_fun(ms_ticker_destroy));
-	}
-
-  private:
-	vector<MSTicker *> mTickers;
-	unsigned int mLastTickerIndex;
-	bool mStarted;
-};
-#endif
-
 class Transcoder : public Module, protected ModuleToolbox {
   public:
 	Transcoder(Agent *ag);
@@ -72,16 +47,24 @@ class Transcoder : public Module, protected ModuleToolbox {
 	virtual void onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException);
 	virtual void onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException);
 	virtual void onIdle();
+	virtual void onSweep(SweepBudget &budget);
 	virtual void onDeclare(GenericStruct *mc);
 #ifdef ENABLE_TRANSCODER
   private:
 	TickerManager mTickerManager;
+	// the calls are processed the same way whether transcoded here or by a worker, but for their offers and answers
+	template <typename CallType> shared_ptr<CallType> createCall(sip_t *invite);
+	template <typename CallType> void processRequest(shared_ptr<RequestSipEvent> &ev);
+	template <typename CallType> void processResponse(shared_ptr<ResponseSipEvent> &ev);
 	int handleOffer(TranscodedCall *c, shared_ptr<SipEvent> ev);
+	int handleOffer(RemoteTranscodedCall *c, shared_ptr<SipEvent> ev);
 	int handleAnswer(TranscodedCall *c, shared_ptr<SipEvent> ev);
-	int processInvite(TranscodedCall *c, shared_ptr<RequestSipEvent> &ev);
-	void process200OkforInvite(TranscodedCall *ctx, shared_ptr<ResponseSipEvent> &ev);
-	void processAck(TranscodedCall *ctx, shared_ptr<RequestSipEvent> &ev);
-	bool processSipInfo(TranscodedCall *c, shared_ptr<RequestSipEvent> &ev);
+	int handleAnswer(RemoteTranscodedCall *c, shared_ptr<SipEvent> ev);
+	template <typename CallType> int processInvite(CallType *c, shared_ptr<RequestSipEvent> &ev);
+	template <typename CallType> void process200OkforInvite(CallType *ctx, shared_ptr<ResponseSipEvent> &ev);
+	template <typename CallType> void processAck(CallType *ctx, shared_ptr<RequestSipEvent> &ev);
+	template <typename CallType> bool processSipInfo(CallType *c, shared_ptr<RequestSipEvent> &ev);
+	void onWorkerGone(uint64_t id);
 	void onTimer();
 	static void sOnTimer(void *unused, su_timer_t *t, void *zis);
 	bool canDoRateControl(sip_t *sip);
@@ -89,6 +72,8 @@ class Transcoder : public Module, protected ModuleToolbox {
 	void normalizePayloads(std::list<PayloadType *> &l);
 	list<PayloadType *> orderList(const list<string> &config, const std::list<PayloadType *> &l);
 	list<PayloadType *> mSupportedAudioPayloads;
+	// before the calls, which release their ports on the workers when destroyed
+	unique_ptr<TranscoderWorkerPool> mWorkers;
 	CallStore mCalls;
 	su_timer_t *mTimer;
 	list<string> mRcUserAgents;
@@ -147,12 +132,35 @@ void Transcoder::onDeclare(GenericStruct *mc) {
 		 "If true, retransmissions of INVITEs will be blocked. "
 		 "The purpose of this option is to limit bandwidth usage and server load on reliable networks.",
 		 "false"},
+		{Boolean, "ticker-cpu-affinity",
+		 "Pin each of the transcoding threads (one per CPU) to its own CPU.", "false"},
+		{StringList, "workers",
+		 "Whitespace separated list of transcoder workers to which the processing of the media is delegated, each given "
+		 "as host:port of its control port, so that transcoding neither slows down nor crashes the proxy. "
+		 "A worker is a flexisip process started with '--server transcoder-worker' and the same configuration of this "
+		 "module, its codecs included. Each call goes to the worker with the lowest load. "
+		 "When empty, the calls are transcoded by the proxy itself.",
+		 ""},
+		{Integer, "worker-port",
+		 "UDP port on which a transcoder worker receives the commands of its proxy. It must only be reachable from it.",
+		 "5075"},
+		{String, "worker-bind-address", "Local address on which a transcoder worker binds the RTP ports of its calls.",
+		 "0.0.0.0"},
+		{String, "worker-public-address",
+		 "Address of a transcoder worker given to the parties of its calls. When empty, the host of the worker in the "
+		 "'workers' list of the proxy is used.",
+		 ""},
+		{String, "worker-rtp-ports",
+		 "Range of the RTP ports of a transcoder worker, as min-max. The ports of the calls are allocated in this range "
+		 "by the proxy, so that a worker must serve a single proxy.",
+		 "20000-40000"},
 		config_item_end};
 	mc->addChildrenValues(items);
 
 	auto p = mc->createStatPair("count-calls", "Number of transcoded calls.");
 #ifdef ENABLE_TRANSCODER
 	mCalls.setCallStatCounters(p.first, p.second);
+	mTickerManager.declareStats(mc);
 #endif
 	(void)p;
 }
@@ -209,8 +217,7 @@ bool Transcoder::hasSupportedCodec(const std::list<PayloadType *> &ioffer) {
 	return false;
 }
 
-Transcoder::Transcoder(Agent *ag) : Module(ag), mSupportedAudioPayloads(), mTimer(0) {
-	mFactory = ms_factory_new_with_voip();
+Transcoder::Transcoder(Agent *ag) : Module(ag), mSupportedAudioPayloads(), mTimer(0), mFactory(NULL) {
 }
 
 Transcoder::~Transcoder() {
@@ -257,17 +264,42 @@ list<PayloadType *> Transcoder::orderList(const list<string> &config, const list
 }
 
 void Transcoder::onLoad(const GenericStruct *mc) {
-	mTimer = mAgent->createTimer(20, &sOnTimer, this);
+	// created once enabled rather than with the module, as loading the codecs slows down the startup
+	if (!mFactory) {
+		mFactory = ms_factory_new_with_voip();
+		TranscoderFilters::registerIn(mFactory);
+	}
+	list<string> workers = mc->get<ConfigStringList>("workers")->read();
+	if (!workers.empty()) {
+		mWorkers.reset(new TranscoderWorkerPool(getAgent()->getRoot(), [this](uint64_t id) { onWorkerGone(id); }));
+		if (!mWorkers->start(workers))
+			LOGF("Cannot start the transcoder workers");
+	} else {
+		mTimer = mAgent->createTimer(20, &sOnTimer, this);
+	}
 	mCallParams.mJbNomSize = mc->get<ConfigInt>("jb-nom-size")->read();
 	mRcUserAgents = mc->get<ConfigStringList>("rc-user-agents")->read();
 	mRemoveBandwidthsLimits = mc->get<ConfigBoolean>("remove-bw-limits")->read();
+	mTickerManager.enableCpuAffinity(mc->get<ConfigBoolean>("ticker-cpu-affinity")->read());
 	list<PayloadType *> l = makeSupportedAudioPayloadList();
 	mSupportedAudioPayloads = orderList(mc->get<ConfigStringList>("audio-codecs")->read(), l);
 }
 
+void Transcoder::onSweep(SweepBudget &budget) {
+	mCalls.removeAndDeleteInactives(180, &budget);
+}
+
 void Transcoder::onIdle() {
 	mCalls.dump();
-	mCalls.removeAndDeleteInactives(180);
+	if (mWorkers)
+		return;
+	map<MSTicker *, int> calls;
+	for (auto it = mCalls.getList().begin(); it != mCalls.getList().end(); ++it) {
+		MSTicker *ticker = dynamic_pointer_cast<TranscodedCall>(*it)->getTicker();
+		if (ticker)
+			calls[ticker]++;
+	}
+	mTickerManager.update(calls);
 }
 
 bool Transcoder::canDoRateControl(sip_t *sip) {
@@ -283,7 +315,7 @@ bool Transcoder::canDoRateControl(sip_t *sip) {
 	return false;
 }
 
-bool Transcoder::processSipInfo(TranscodedCall *c, shared_ptr<RequestSipEvent> &ev) {
+template <typename CallType> bool Transcoder::processSipInfo(CallType *c, shared_ptr<RequestSipEvent> &ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
 	sip_payload_t *payload = sip->sip_payload;
@@ -329,9 +361,8 @@ static void removeBandwidths(sdp_session_t *sdp) {
 
 int Transcoder::handleOffer(TranscodedCall *c, shared_ptr<SipEvent> ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
-	msg_t *msg = ms->getMsg();
 	sip_t *sip = ms->getSip();
-	shared_ptr<SdpModifier> m = SdpModifier::createFromSipMsg(ms->getHome(), ms->getSip(), "");
+	shared_ptr<SdpModifier> m = ms->getSdpModifier();
 
 	if (m == NULL)
 		return -1;
@@ -375,7 +406,7 @@ int Transcoder::handleOffer(TranscodedCall *c, shared_ptr<SipEvent> ev) {
 			removeBandwidths(m->mSession);
 
 		m->replacePayloads(mSupportedAudioPayloads, c->getInitialOffer());
-		m->update(msg, sip);
+		ms->setSdpModified();
 
 		if (canDoRateControl(sip)) {
 			c->getFrontSide()->enableRc(true);
@@ -393,7 +424,52 @@ int Transcoder::handleOffer(TranscodedCall *c, shared_ptr<SipEvent> ev) {
 	return -1;
 }
 
-int Transcoder::processInvite(TranscodedCall *c, shared_ptr<RequestSipEvent> &ev) {
+/* Returns -2 when no worker can take the call. */
+int Transcoder::handleOffer(RemoteTranscodedCall *c, shared_ptr<SipEvent> ev) {
+	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	sip_t *sip = ms->getSip();
+	shared_ptr<SdpModifier> m = ms->getSdpModifier();
+
+	if (m == NULL)
+		return -1;
+
+	list<PayloadType *> ioffer = m->readPayloads();
+	int ret = 0;
+	if (!hasSupportedCodec(ioffer)) {
+		LOGW("No support for any of the codec offered by client, doing bypass.");
+		ret = -1;
+	} else if (!mWorkers->assign(c)) {
+		ret = -2;
+	}
+	if (ret != 0) {
+		for (auto it = ioffer.begin(); it != ioffer.cend(); ++it) {
+			payload_type_destroy(*it);
+		}
+		return ret;
+	}
+	c->setInitialOffer(ioffer);
+
+	string fraddr;
+	int frport;
+	m->getAudioIpPort(&fraddr, &frport);
+	int ptime = m->readPtime();
+	if (ptime > 0) {
+		m->setPtime(0); // remove the ptime attribute
+	}
+	mWorkers->offer(c, fraddr, frport, ptime, canDoRateControl(sip));
+
+	m->changeAudioIpPort(c->getMediaAddress().c_str(), c->getBackPort());
+	LOGD("Back side port on the worker: %s:%i <-> ?", c->getMediaAddress().c_str(), c->getBackPort());
+
+	if (mRemoveBandwidthsLimits)
+		removeBandwidths(m->mSession);
+
+	m->replacePayloads(mSupportedAudioPayloads, c->getInitialOffer());
+	ms->setSdpModified();
+	return 0;
+}
+
+template <typename CallType> int Transcoder::processInvite(CallType *c, shared_ptr<RequestSipEvent> &ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	int ret = 0;
 	if (SdpModifier::hasSdp(ms->getSip())) {
@@ -402,14 +478,17 @@ int Transcoder::processInvite(TranscodedCall *c, shared_ptr<RequestSipEvent> &ev
 	if (ret == 0) {
 		// be in the record-route
 		addRecordRouteIncoming(ms->getHome(), getAgent(), ev);
-		c->storeNewInvite(ms->getMsg());
+		c->storeNewInvite(ms->getSip());
 	} else {
-		ev->reply(415, "Unsupported codecs", TAG_END());
+		if (ret == -2)
+			ev->reply(503, "No transcoder available", TAG_END());
+		else
+			ev->reply(415, "Unsupported codecs", TAG_END());
 	}
 	return ret;
 }
 
-void Transcoder::processAck(TranscodedCall *ctx, shared_ptr<RequestSipEvent> &ev) {
+template <typename CallType> void Transcoder::processAck(CallType *ctx, shared_ptr<RequestSipEvent> &ev) {
 	LOGD("Processing ACK");
 	auto ioffer = ctx->getInitialOffer();
 	if (!ioffer.empty()) {
@@ -419,23 +498,38 @@ void Transcoder::processAck(TranscodedCall *ctx, shared_ptr<RequestSipEvent> &ev
 	}
 }
 
+template <> shared_ptr<TranscodedCall> Transcoder::createCall<TranscodedCall>(sip_t *invite) {
+	return allocate_shared<TranscodedCall>(PoolAllocator<TranscodedCall>(), mFactory, invite, getAgent()->getRtpBindIp());
+}
+
+template <> shared_ptr<RemoteTranscodedCall> Transcoder::createCall<RemoteTranscodedCall>(sip_t *invite) {
+	return allocate_shared<RemoteTranscodedCall>(PoolAllocator<RemoteTranscodedCall>(), mWorkers.get(), invite);
+}
+
 void Transcoder::onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipException){
+	if (mWorkers)
+		processRequest<RemoteTranscodedCall>(ev);
+	else
+		processRequest<TranscodedCall>(ev);
+}
+
+template <typename CallType> void Transcoder::processRequest(shared_ptr<RequestSipEvent> &ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
 
 	if (sip->sip_request->rq_method == sip_method_invite) {
 		ev->createIncomingTransaction();
 		auto ot = ev->createOutgoingTransaction();
-		auto c = make_shared<TranscodedCall>(mFactory, sip, getAgent()->getRtpBindIp());
+		auto c = createCall<CallType>(sip);
 		if (processInvite(c.get(), ev) == 0) {
 			mCalls.store(c);
-			ot->setProperty<TranscodedCall>(getModuleName(), c);
+			ot->setProperty<CallType>(getModuleName(), c);
 		} else {
 			LOGD("Transcoder: couldn't process invite, stopping processing");
 			return;
 		}
 	} else if (sip->sip_request->rq_method == sip_method_ack) {
-		auto c = dynamic_pointer_cast<TranscodedCall>(mCalls.find(getAgent(), sip, true));
+		auto c = dynamic_pointer_cast<CallType>(mCalls.find(getAgent(), sip, true));
 		if (c == NULL) {
 			LOGD("Transcoder: couldn't find call context for ack");
 			return;
@@ -443,7 +537,7 @@ void Transcoder::onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipExcep
 			processAck(c.get(), ev);
 		}
 	} else if (sip->sip_request->rq_method == sip_method_info) {
-		auto c = dynamic_pointer_cast<TranscodedCall>(mCalls.find(getAgent(), sip, true));
+		auto c = dynamic_pointer_cast<CallType>(mCalls.find(getAgent(), sip, true));
 		if (c == NULL) {
 			LOGD("Transcoder: couldn't find call context for info");
 			return;
@@ -452,7 +546,7 @@ void Transcoder::onRequest(shared_ptr<RequestSipEvent> &ev) throw (FlexisipExcep
 			return;
 		}
 	} else if (sip->sip_request->rq_method == sip_method_bye) {
-		auto c = dynamic_pointer_cast<TranscodedCall>(mCalls.find(getAgent(), sip, true));
+		auto c = dynamic_pointer_cast<CallType>(mCalls.find(getAgent(), sip, true));
 		if (c != NULL) {
 			mCalls.remove(c);
 		}
@@ -466,7 +560,7 @@ int Transcoder::handleAnswer(TranscodedCall *ctx, shared_ptr<SipEvent> ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	string addr;
 	int port;
-	shared_ptr<SdpModifier> m = SdpModifier::createFromSipMsg(ms->getHome(), ms->getSip());
+	shared_ptr<SdpModifier> m = ms->getSdpModifier();
 	int ptime;
 
 	if (m == NULL)
@@ -504,7 +598,7 @@ int Transcoder::handleAnswer(TranscodedCall *ctx, shared_ptr<SipEvent> ev) {
 	if (mRemoveBandwidthsLimits)
 		removeBandwidths(m->mSession);
 
-	m->update(ms->getMsg(), ms->getSip());
+	ms->setSdpModified();
 
 	normalizePayloads(common);
 	ctx->getFrontSide()->assignPayloads(common);
@@ -517,9 +611,54 @@ int Transcoder::handleAnswer(TranscodedCall *ctx, shared_ptr<SipEvent> ev) {
 	return 0;
 }
 
-void Transcoder::process200OkforInvite(TranscodedCall *ctx, shared_ptr<ResponseSipEvent> &ev) {
+template <typename CallType> int Transcoder::handleAnswer(RemoteTranscodedCall *ctx, shared_ptr<SipEvent> ev) {
+	LOGD("Transcoder::handleAnswer");
+	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
+	string addr;
+	int port;
+	shared_ptr<SdpModifier> m = ms->getSdpModifier();
+
+	if (m == NULL || !mWorkers->assign(ctx))
+		return -1;
+
+	m->getAudioIpPort(&addr, &port);
+	int ptime = m->readPtime();
+	LOGD("Backside remote address: %s:%i", addr.c_str(), port);
+	if (ptime > 0) {
+		m->setPtime(0); // remove the ptime attribute
+	}
+	m->changeAudioIpPort(ctx->getMediaAddress().c_str(), ctx->getFrontPort());
+
+	auto answer = m->readPayloads();
+	if (answer.empty()) {
+		LOGE("No payloads in 200Ok");
+		return -1;
+	}
+	normalizePayloads(answer);
+
+	auto common = SdpModifier::findCommon(mSupportedAudioPayloads, ctx->getInitialOffer(), false);
+	if (!common.empty()) {
+		m->replacePayloads(common, {});
+	}
+
+	if (mRemoveBandwidthsLimits)
+		removeBandwidths(m->mSession);
+
+	ms->setSdpModified();
+
+	normalizePayloads(common);
+	mWorkers->answer(ctx, addr, port, ptime, canDoRateControl(ms->getSip()), common, answer);
+	// unlike the call sides, the worker got copies
+	for (auto pt : common)
+		payload_type_destroy(pt);
+	for (auto pt : answer)
+		payload_type_destroy(pt);
+	return 0;
+}
+
+template <typename CallType> void Transcoder::process200OkforInvite(CallType *ctx, shared_ptr<ResponseSipEvent> &ev) {
 	LOGD("Processing 200 Ok");
-	if (SdpModifier::hasSdp((sip_t *)msg_object(ctx->getLastForwardedInvite()))) {
+	if (ctx->lastForwardedInviteHasSdp()) {
 		handleAnswer(ctx, ev);
 	} else {
 		handleOffer(ctx, ev);
@@ -534,6 +673,13 @@ static bool isEarlyMedia(sip_t *sip) {
 }
 
 void Transcoder::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipException) {
+	if (mWorkers)
+		processResponse<RemoteTranscodedCall>(ev);
+	else
+		processResponse<TranscodedCall>(ev);
+}
+
+template <typename CallType> void Transcoder::processResponse(shared_ptr<ResponseSipEvent> &ev) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	sip_t *sip = ms->getSip();
 	msg_t *msg = ms->getMsg();
@@ -553,7 +699,7 @@ void Transcoder::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipExc
 			return;
 		}
 
-		shared_ptr<TranscodedCall> c = transaction->getProperty<TranscodedCall>(getModuleName());
+		shared_ptr<CallType> c = transaction->getProperty<CallType>(getModuleName());
 		if (c == NULL) {
 			LOGD("No transcoded call context found");
 			return;
@@ -568,6 +714,17 @@ void Transcoder::onResponse(shared_ptr<ResponseSipEvent> &ev) throw (FlexisipExc
 	}
 }
 
+void Transcoder::onWorkerGone(uint64_t id) {
+	for (auto it = mCalls.getList().begin(); it != mCalls.getList().end(); ++it) {
+		auto c = dynamic_pointer_cast<RemoteTranscodedCall>(*it);
+		if (c && c->getId() == id) {
+			LOGD("Call %llx no longer transcoded by its worker", (unsigned long long)id);
+			mCalls.remove(c);
+			return;
+		}
+	}
+}
+
 void Transcoder::onTimer() {
 	for (auto it = mCalls.getList().begin(); it != mCalls.getList().end(); ++it) {
 		dynamic_pointer_cast<TranscodedCall>(*it)->doBgTasks();
@@ -27,6 +27,9 @@
 #include "expressionparser.hh"
 #include "domain-registrations.hh"
 #include "utils/signaling-exception.hh"
+#include "tracing.hh"
+#include "profiler.hh"
+#include "tenantstats.hh"
 
 #include <algorithm>
 using namespace std;
@@ -78,7 +81,10 @@ void ModuleFactory::registerModule(ModuleInfoBase *m) {
 	mModules.push_back(m);
 }
 
-Module::Module(Agent *ag) : mAgent(ag) {
+Module::Module(Agent *ag)
+	: mAgent(ag), mModuleConfig(NULL), mCountRequestLatencyP50(NULL), mCountRequestLatencyP99(NULL),
+	  mCountResponseLatencyP50(NULL), mCountResponseLatencyP99(NULL), mCountSweepLatencyP50(NULL),
+	  mCountSweepLatencyP99(NULL) {
 	su_home_init(&mHome);
 	mFilter = new ConfigEntryFilter();
 }
@@ -87,7 +93,14 @@ bool Module::isEnabled() const {
 	return mFilter->isEnabled();
 }
 
+bool Module::mayProcess(bool isRequest, const string &method) const {
+	return mFilter->mayEnter(isRequest, method);
+}
+
 Module::~Module() {
+	// the config outlives the module, which can no longer declare the rest of it
+	if (mModuleConfig)
+		mModuleConfig->setDeferredDeclaration(nullptr);
 	delete mFilter;
 	su_home_deinit(&mHome);
 }
@@ -136,11 +149,27 @@ void Module::declare(GenericStruct *root) {
 		//Experimental modules are forced to be disabled by default.
 		mModuleConfig->get<ConfigBoolean>("enabled")->setDefault("false");
 	}
-	onDeclare(mModuleConfig);
+	// the rest is only declared if the module is enabled, or if one of its settings or stats is looked up
+	mModuleConfig->setDeferredDeclaration([this](GenericStruct *mc) {
+		mCountRequestLatencyP50 =
+			mc->createStat("onrequest-latency-p50", "Median duration of onRequest() on the recent requests, in microseconds.");
+		mCountRequestLatencyP99 = mc->createStat(
+			"onrequest-latency-p99", "99th percentile of the duration of onRequest() on the recent requests, in microseconds.");
+		mCountResponseLatencyP50 = mc->createStat(
+			"onresponse-latency-p50", "Median duration of onResponse() on the recent responses, in microseconds.");
+		mCountResponseLatencyP99 = mc->createStat(
+			"onresponse-latency-p99", "99th percentile of the duration of onResponse() on the recent responses, in microseconds.");
+		mCountSweepLatencyP50 =
+			mc->createStat("onsweep-latency-p50", "Median duration of onSweep() on the recent sweeps, in microseconds.");
+		mCountSweepLatencyP99 = mc->createStat(
+			"onsweep-latency-p99", "99th percentile of the duration of onSweep() on the recent sweeps, in microseconds.");
+		onDeclare(mc);
+	});
 }
 
 void Module::checkConfig() {
-	list<GenericEntry *> children = mModuleConfig->getChildren();
+	// the settings still undeclared hold their defaults
+	list<GenericEntry *> children = mModuleConfig->getDeclaredChildren();
 	for (auto it = children.begin(); it != children.end(); ++it) {
 		const ConfigValue *cv = dynamic_cast<ConfigValue *>(*it);
 		if (cv && !isValidNextConfig(*cv)) {
@@ -151,8 +180,10 @@ void Module::checkConfig() {
 
 void Module::load() {
 	mFilter->loadConfig(mModuleConfig);
-	if (mFilter->isEnabled())
+	if (mFilter->isEnabled()) {
+		mModuleConfig->completeDeclaration();
 		onLoad(mModuleConfig);
+	}
 }
 
 void Module::unload() {
@@ -161,11 +192,25 @@ void Module::unload() {
 }
 
 void Module::reload() {
-	onUnload();
+	// the module may have been disabled or enabled by the new configuration
+	unload();
 	load();
+	mAgent->updateDispatchTables();
+}
+
+uint64_t Module::recordLatency(LatencyHistogram &histogram, StatCounter64 *p50, StatCounter64 *p99,
+							   chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+	auto us = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	histogram.record(us);
+	// the percentiles are only refreshed from time to time, the stats are read far less often than updated
+	if ((histogram.size() & 63) == 1) {
+		p50->set(histogram.percentile(0.5));
+		p99->set(histogram.percentile(0.99));
+	}
+	return us;
 }
 
-void Module::processRequest(shared_ptr<RequestSipEvent> &ev) {
+void Module::processRequest(shared_ptr<RequestSipEvent> &ev, chrono::steady_clock::time_point &now) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	LOG_SCOPED_THREAD("Module", getModuleName());
 
@@ -173,7 +218,17 @@ void Module::processRequest(shared_ptr<RequestSipEvent> &ev) {
 
 		if (mFilter->canEnter(ms)) {
 			SLOGD << "Invoking onRequest() on module " << getModuleName();
+			// the dispatch since the end of the previous module is accounted to this one
+			auto start = now;
+			Trace::Scope traceScope(ms->getTrace());
+			Profiler::ModuleScope profilerScope(getModuleName());
 			onRequest(ev);
+			now = chrono::steady_clock::now();
+			uint64_t us = recordLatency(mRequestLatency, mCountRequestLatencyP50, mCountRequestLatencyP99, start, now);
+			if (ms->getTenant())
+				ms->getTenant()->count(ms->getTenant()->cpuMicroseconds, us);
+			if (ms->getTrace())
+				ms->getTrace()->addSpan(getModuleName(), start);
 		} else {
 			SLOGD << "Skipping onRequest() on module " << getModuleName();
 		}
@@ -194,14 +249,24 @@ void Module::processRequest(shared_ptr<RequestSipEvent> &ev) {
 
 }
 
-void Module::processResponse(shared_ptr<ResponseSipEvent> &ev) {
+void Module::processResponse(shared_ptr<ResponseSipEvent> &ev, chrono::steady_clock::time_point &now) {
 	const shared_ptr<MsgSip> &ms = ev->getMsgSip();
 	LOG_SCOPED_THREAD("Module", getModuleName());
 
 	try {
 		if (mFilter->canEnter(ms)) {
 			LOGD("Invoking onResponse() on module %s", getModuleName().c_str());
+			auto start = now;
+			Trace::Scope traceScope(ms->getTrace());
+			Profiler::ModuleScope profilerScope(getModuleName());
 			onResponse(ev);
+			now = chrono::steady_clock::now();
+			uint64_t us =
+				recordLatency(mResponseLatency, mCountResponseLatencyP50, mCountResponseLatencyP99, start, now);
+			if (ms->getTenant())
+				ms->getTenant()->count(ms->getTenant()->cpuMicroseconds, us);
+			if (ms->getTrace())
+				ms->getTrace()->addSpan(getModuleName() + " response", start);
 		} else {
 			LOGD("Skipping onResponse() on module %s", getModuleName().c_str());
 		}
@@ -217,6 +282,16 @@ void Module::idle() {
 	}
 }
 
+void Module::sweep(chrono::microseconds budget) {
+	if (mFilter->isEnabled()) {
+		auto start = chrono::steady_clock::now();
+		SweepBudget sweepBudget(budget);
+		Profiler::ModuleScope profilerScope(getModuleName());
+		onSweep(sweepBudget);
+		recordLatency(mSweepLatency, mCountSweepLatencyP50, mCountSweepLatencyP99, start, chrono::steady_clock::now());
+	}
+}
+
 const string &Module::getModuleName() const {
 	return mInfo->getModuleName();
 }
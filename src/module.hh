@@ -23,12 +23,15 @@
 #include "sofia-sip/tport.h"
 #include "sofia-sip/msg_header.h"
 
+#include <chrono>
 #include <string>
 #include <memory>
 #include <list>
 #include "configmanager.hh"
 #include "event.hh"
 #include "transaction.hh"
+#include "utils/latencyhistogram.hh"
+#include "utils/sweepbudget.hh"
 
 class ModuleInfoBase;
 class Module;
@@ -85,6 +88,7 @@ class ModuleInfoBase {
 		DateHandler = 75,
 		GatewayAdapter = 90,
 		Registrar = 120,
+		RegEvent = 122,
 		StatisticsCollector = 123,
 		Router = 125,
 		PushNotification = 130,
@@ -140,18 +144,24 @@ class Module : protected ConfigValueListener {
 	void load();
 	void unload();
 	void reload();
-	void processRequest(std::shared_ptr<RequestSipEvent> &ev);
-	void processResponse(std::shared_ptr<ResponseSipEvent> &ev);
+	/* now is the time the previous module of the chain ended, read once per module: it is updated to the time this
+	 * one ends, when it processes the event. */
+	void processRequest(std::shared_ptr<RequestSipEvent> &ev, std::chrono::steady_clock::time_point &now);
+	void processResponse(std::shared_ptr<ResponseSipEvent> &ev, std::chrono::steady_clock::time_point &now);
 	StatCounter64 &findStat(const std::string &statName) const;
 	void idle();
+	/* Gives the module a slice of its incremental sweep, bounded by the budget. */
+	void sweep(std::chrono::microseconds budget);
 	bool isEnabled() const;
+	/* Whether some requests of the method, or some responses, can enter the module. */
+	bool mayProcess(bool isRequest, const std::string &method) const;
 	ModuleClass getClass() const;
 
-	inline void process(std::shared_ptr<RequestSipEvent> &ev) {
-		processRequest(ev);
+	inline void process(std::shared_ptr<RequestSipEvent> &ev, std::chrono::steady_clock::time_point &now) {
+		processRequest(ev, now);
 	}
-	inline void process(std::shared_ptr<ResponseSipEvent> &ev) {
-		processResponse(ev);
+	inline void process(std::shared_ptr<ResponseSipEvent> &ev, std::chrono::steady_clock::time_point &now) {
+		processResponse(ev, now);
 	}
 
   protected:
@@ -168,6 +178,13 @@ class Module : protected ConfigValueListener {
 	virtual bool doOnConfigStateChanged(const ConfigValue &conf, ConfigState state);
 	virtual void onIdle() {
 	}
+	/*
+	 * Cleans a slice of the tables of the module, called every idle-sweep-interval. It examines items while
+	 * budget.next() returns true, then keeps where it stopped for the next call, rather than scanning whole tables from
+	 * onIdle().
+	 */
+	virtual void onSweep(SweepBudget &budget) {
+	}
 	virtual bool onCheckValidNextConfig() {
 		return true;
 	}
@@ -186,11 +203,23 @@ class Module : protected ConfigValueListener {
 
   private:
 	void setInfo(ModuleInfoBase *i);
+	/* Returns the duration from start to end, in microseconds. */
+	uint64_t recordLatency(LatencyHistogram &histogram, StatCounter64 *p50, StatCounter64 *p99,
+						   std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
 	ModuleInfoBase *mInfo;
 	GenericStruct *mModuleConfig;
 	EntryFilter *mFilter;
 	bool mDirtyConfig;
 	su_home_t mHome;
+	LatencyHistogram mRequestLatency;
+	LatencyHistogram mResponseLatency;
+	StatCounter64 *mCountRequestLatencyP50;
+	StatCounter64 *mCountRequestLatencyP99;
+	StatCounter64 *mCountResponseLatencyP50;
+	StatCounter64 *mCountResponseLatencyP99;
+	LatencyHistogram mSweepLatency;
+	StatCounter64 *mCountSweepLatencyP50;
+	StatCounter64 *mCountSweepLatencyP99;
 };
 
 inline std::ostringstream &operator<<(std::ostringstream &__os, const Module &m) {
@@ -21,6 +21,8 @@
 #include "authdb.hh"
 #include <sofia-sip/su_md5.h>
 #include <ortp/rtpsession.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 using namespace std;
 
@@ -32,9 +34,16 @@ const int Monitor::PASSWORD_CACHE_EXPIRE = INT_MAX / 2;
 
 Monitor::Init::Init() {
 	ConfigItemDescriptor items[] = {
-		{Boolean, "enabled", "Enable or disable the Flexisip monitor daemon", "false"},
+		{Boolean, "enabled",
+		 "Enable or disable the Flexisip monitor, testing the proxy with registrations, messages and calls between the "
+		 "test accounts of the nodes of the cluster.",
+		 "false"},
+		{Boolean, "external-script",
+		 "Run the tests with the flexisip_monitor.py script, in a process of its own, instead of the built-in probe. "
+		 "Only the probe exports the latencies of the tests in the statistics.",
+		 "false"},
 		{Integer, "test-interval", "Time between two consecutive tests", "30"},
-		{String, "logfile", "Path to the log file", "/etc/flexisip/flexisip_monitor.log"},
+		{String, "logfile", "Path to the log file of flexisip_monitor.py", "/etc/flexisip/flexisip_monitor.log"},
 		{Integer, "switch-port", "Port to open/close folowing the test succeed or not", "12345"},
 		{String, "password-salt", "Salt used to generate the passwords of each test account", ""},
 		config_item_end};
@@ -171,3 +180,311 @@ string Monitor::findDomain() {
 	}
 	return *it;
 }
+
+static const char *sStageMethods[] = {"REGISTER", "MESSAGE", "INVITE", "BYE"};
+
+MonitorProbe::MonitorProbe(Agent *agent)
+	: mAgent(agent), mNta(NULL), mDefaultLeg(NULL), mProxy(NULL), mContact(NULL), mInterval(30), mSwitchPort(0),
+	  mRunning(false), mTarget(0), mStage(Register), mLeg(NULL), mOrq(NULL), mCallerAuth(NULL), mCalleeAuth(NULL), mChallenged(false),
+	  mSwitchSocket(-1), mSwitchWaitIndex(-1) {
+	GenericStruct *monitorConf = GenericManager::get()->getRoot()->get<GenericStruct>("monitor");
+	for (int i = 0; i < StageCount; ++i) {
+		string name(sStageMethods[i]);
+		transform(name.begin(), name.end(), name.begin(), ::tolower);
+		mStages[i].p50 = monitorConf->createStat(
+			name + "-latency-p50", "Median duration of the " + name + " stage of the recent tests, in microseconds.");
+		mStages[i].p99 = monitorConf->createStat(
+			name + "-latency-p99", "99th percentile of the duration of the " + name + " stage, in microseconds.");
+	}
+	mCountTests = monitorConf->createStat("count-tests", "Number of tests run by the monitor.");
+	mCountFailedTests = monitorConf->createStat("count-failed-tests", "Number of tests of the monitor that failed.");
+}
+
+MonitorProbe::~MonitorProbe() {
+	setSwitchPort(false);
+	mTestTimer.reset();
+	if (mOrq)
+		nta_outgoing_destroy(mOrq);
+	if (mLeg)
+		nta_leg_destroy(mLeg);
+	if (mDefaultLeg)
+		nta_leg_destroy(mDefaultLeg);
+	if (mNta)
+		nta_agent_destroy(mNta);
+}
+
+bool MonitorProbe::start() {
+	GenericStruct *monitorConf = GenericManager::get()->getRoot()->get<GenericStruct>("monitor");
+	GenericStruct *cluster = GenericManager::get()->getRoot()->get<GenericStruct>("cluster");
+	string salt = monitorConf->get<ConfigString>("password-salt")->read();
+	list<string> nodes = cluster->get<ConfigStringList>("nodes")->read();
+	mInterval = max(monitorConf->get<ConfigInt>("test-interval")->read(), 1);
+	mSwitchPort = monitorConf->get<ConfigInt>("switch-port")->read();
+	try {
+		mDomain = Monitor::findDomain();
+	} catch (const FlexisipException &e) {
+		LOGE("Monitor: cannot find domain. %s", e.str().c_str());
+		return false;
+	}
+	if (salt.empty()) {
+		LOGE("Monitor: no salt set");
+		return false;
+	}
+	string localIP = Monitor::findLocalAddress(nodes);
+	if (localIP.empty()) {
+		LOGE("Monitor: no node of the cluster section is a local address");
+		return false;
+	}
+
+	mPassword = Monitor::generatePassword(localIP, salt);
+	mCallerName = Monitor::generateUsername(Monitor::CALLER_PREFIX, localIP);
+	mCaller = "sip:" + mCallerName + "@" + mDomain;
+	mCalleeName = Monitor::generateUsername(Monitor::CALLEE_PREFIX, localIP);
+	mCallee = "sip:" + mCalleeName + "@" + mDomain;
+	for (const auto &node : nodes) {
+		if (node != localIP)
+			mTargets.push_back("sip:" + Monitor::generateUsername(Monitor::CALLEE_PREFIX, node) + "@" + mDomain);
+	}
+	if (mTargets.empty())
+		mTargets.push_back(mCallee);
+
+	string host = localIP.find(':') != string::npos ? "[" + localIP + "]" : localIP;
+	mProxy = url_make(mHome.home(), ("sip:" + host + ";transport=tcp").c_str());
+	mNta = nta_agent_create(mAgent->getRoot(), URL_STRING_MAKE(("sip:" + host + ":*;transport=tcp").c_str()), NULL,
+							NULL, TAG_END());
+	if (!mNta) {
+		LOGE("Monitor: cannot create the SIP agent of the probe on %s", host.c_str());
+		return false;
+	}
+	mDefaultLeg = nta_leg_tcreate(mNta, &MonitorProbe::sOnRequest, (nta_leg_magic_t *)this, NTATAG_NO_DIALOG(1),
+								  TAG_END());
+	const url_t *contact = nta_agent_contact(mNta)->m_url;
+	mContact = sip_contact_format(mHome.home(), "<sip:%s@%s:%s;transport=tcp>", mCalleeName.c_str(), contact->url_host,
+								  contact->url_port ? contact->url_port : "5060");
+	// no media is sent, the SDP only has the relays allocate their channels as for a real call
+	mSdp = "v=0\r\no=monitor 1 1 IN " + string(localIP.find(':') != string::npos ? "IP6 " : "IP4 ") + localIP +
+		   "\r\ns=-\r\nc=IN " + (localIP.find(':') != string::npos ? "IP6 " : "IP4 ") + localIP +
+		   "\r\nt=0 0\r\nm=audio 7078 RTP/AVP 0\r\n";
+
+	LOGI("Monitor: testing %zu callees every %i seconds from %s", mTargets.size(), mInterval, mCaller.c_str());
+	runTest();
+	return true;
+}
+
+int MonitorProbe::sOnRequest(nta_leg_magic_t *magic, nta_leg_t *leg, nta_incoming_t *irq, const sip_t *sip) {
+	return reinterpret_cast<MonitorProbe *>(magic)->onRequest(irq, sip);
+}
+
+int MonitorProbe::onRequest(nta_incoming_t *irq, const sip_t *sip) {
+	switch (sip->sip_request->rq_method) {
+		case sip_method_invite:
+			nta_incoming_tag(irq, NULL);
+			nta_incoming_treply(irq, SIP_200_OK, SIPTAG_CONTACT(mContact), SIPTAG_CONTENT_TYPE_STR("application/sdp"),
+								SIPTAG_PAYLOAD_STR(mSdp.c_str()), TAG_END());
+			return 0;
+		case sip_method_ack:
+			return 0;
+		case sip_method_message:
+		case sip_method_bye:
+		case sip_method_options:
+			nta_incoming_tag(irq, NULL);
+			return 200;
+		default:
+			return 501;
+	}
+}
+
+void MonitorProbe::runTest() {
+	mTestTimer = mAgent->getTimers()->schedule(mInterval, [this]() { runTest(); });
+	if (mRunning) {
+		LOGW("Monitor: previous test still running, skipping this one");
+		return;
+	}
+	mRunning = true;
+	mTarget = 0;
+	++*mCountTests;
+	if (!send(Register))
+		endTest(false, "cannot send the REGISTER");
+}
+
+bool MonitorProbe::send(Stage stage) {
+	SofiaAutoHome home;
+	const string &target = stage == Register ? mCallee : mTargets[mTarget];
+	if (stage != mStage || !mLeg) {
+		// a dialog of its own for each request, but the BYE that ends the call of the INVITE
+		mChallenged = false;
+		mStageStart = chrono::steady_clock::now();
+		if (stage != Bye) {
+			if (mLeg)
+				nta_leg_destroy(mLeg);
+			const string &from = stage == Register ? mCallee : mCaller;
+			mLeg = nta_leg_tcreate(mNta, NULL, NULL, SIPTAG_FROM_STR(from.c_str()), SIPTAG_TO_STR(target.c_str()),
+								   SIPTAG_CALL_ID(sip_call_id_create(home.home(), NULL)), TAG_END());
+			if (!mLeg)
+				return false;
+			nta_leg_tag(mLeg, NULL);
+		}
+	}
+	mStage = stage;
+
+	msg_header_t *authorization = NULL;
+	url_t *uri = stage == Register ? url_make(home.home(), ("sip:" + mDomain).c_str())
+								   : url_make(home.home(), target.c_str());
+	auth_client_t **auth = stage == Register ? &mCalleeAuth : &mCallerAuth;
+	if (*auth)
+		auc_authorization_headers(auth, home.home(), sStageMethods[stage], uri, NULL, &authorization);
+	switch (stage) {
+		case Register:
+			mOrq = nta_outgoing_tcreate(mLeg, &MonitorProbe::sOnResponse, (nta_outgoing_magic_t *)this,
+										(const url_string_t *)mProxy, SIP_METHOD_REGISTER, (const url_string_t *)uri,
+										SIPTAG_CONTACT(mContact), SIPTAG_EXPIRES_STR(to_string(3 * mInterval).c_str()),
+										TAG_IF(authorization, SIPTAG_HEADER((sip_header_t *)authorization)), TAG_END());
+			break;
+		case Message:
+			mOrq = nta_outgoing_tcreate(mLeg, &MonitorProbe::sOnResponse, (nta_outgoing_magic_t *)this,
+										(const url_string_t *)mProxy, SIP_METHOD_MESSAGE, (const url_string_t *)uri,
+										SIPTAG_CONTENT_TYPE_STR("text/plain"), SIPTAG_PAYLOAD_STR("monitor"),
+										TAG_IF(authorization, SIPTAG_HEADER((sip_header_t *)authorization)), TAG_END());
+			break;
+		case Invite:
+			mOrq = nta_outgoing_tcreate(mLeg, &MonitorProbe::sOnResponse, (nta_outgoing_magic_t *)this,
+										(const url_string_t *)mProxy, SIP_METHOD_INVITE, (const url_string_t *)uri,
+										SIPTAG_CONTACT(mContact), SIPTAG_CONTENT_TYPE_STR("application/sdp"),
+										SIPTAG_PAYLOAD_STR(mSdp.c_str()),
+										TAG_IF(authorization, SIPTAG_HEADER((sip_header_t *)authorization)), TAG_END());
+			break;
+		default:
+			// routed along the dialog
+			mOrq = nta_outgoing_tcreate(mLeg, &MonitorProbe::sOnResponse, (nta_outgoing_magic_t *)this, NULL,
+										SIP_METHOD_BYE, NULL,
+										TAG_IF(authorization, SIPTAG_HEADER((sip_header_t *)authorization)), TAG_END());
+			break;
+	}
+	return mOrq != NULL;
+}
+
+int MonitorProbe::sOnResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip) {
+	MonitorProbe *zis = reinterpret_cast<MonitorProbe *>(magic);
+	if (sip && sip->sip_status->st_status < 200)
+		return 0;
+	// the response outlives the transaction, destroyed before the leg may be
+	msg_t *response = sip ? nta_outgoing_getresponse(orq) : NULL;
+	nta_outgoing_destroy(orq);
+	if (orq == zis->mOrq)
+		zis->onResponse(sip);
+	if (response)
+		msg_unref(response);
+	return 0;
+}
+
+void MonitorProbe::onResponse(const sip_t *sip) {
+	mOrq = NULL;
+	int status = sip ? sip->sip_status->st_status : 408;
+	if ((status == 401 || status == 407) && !mChallenged) {
+		mChallenged = true;
+		msg_auth_t *challenge = status == 401 ? (msg_auth_t *)sip->sip_www_authenticate
+											  : (msg_auth_t *)sip->sip_proxy_authenticate;
+		msg_hclass_t *credentialClass = status == 401 ? sip_authorization_class : sip_proxy_authorization_class;
+		auth_client_t **auth = mStage == Register ? &mCalleeAuth : &mCallerAuth;
+		const string &username = mStage == Register ? mCalleeName : mCallerName;
+		if (challenge && auc_challenge(auth, mHome.home(), challenge, credentialClass) >= 0 &&
+			auc_all_credentials(auth, "Digest", NULL, username.c_str(), mPassword.c_str()) > 0 && send(mStage))
+			return;
+		endTest(false, "authentication failed");
+		return;
+	}
+	if (status >= 300) {
+		endTest(false, string(sStageMethods[mStage]) + " answered " + to_string(status));
+		return;
+	}
+
+	StageStats &stats = mStages[mStage];
+	stats.latency.record(
+		chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - mStageStart).count());
+	stats.p50->set(stats.latency.percentile(0.5));
+	stats.p99->set(stats.latency.percentile(0.99));
+	if (mStage == Invite) {
+		// acknowledged along the dialog, so that the BYE follows the same route
+		SofiaAutoHome home;
+		nta_leg_rtag(mLeg, sip->sip_to->a_tag);
+		nta_leg_client_route(mLeg, sip->sip_record_route, sip->sip_contact);
+		nta_outgoing_t *ack =
+			nta_outgoing_tcreate(mLeg, NULL, NULL, NULL, SIP_METHOD_ACK, NULL,
+								 SIPTAG_CSEQ(sip_cseq_create(home.home(), sip->sip_cseq->cs_seq, SIP_METHOD_ACK)),
+								 TAG_END());
+		if (ack)
+			nta_outgoing_destroy(ack);
+	}
+	nextStage();
+}
+
+void MonitorProbe::nextStage() {
+	Stage next;
+	switch (mStage) {
+		case Register:
+			next = Message;
+			break;
+		case Message:
+			next = Invite;
+			break;
+		case Invite:
+			next = Bye;
+			break;
+		default:
+			if (++mTarget == mTargets.size()) {
+				endTest(true, "");
+				return;
+			}
+			next = Message;
+			break;
+	}
+	if (!send(next))
+		endTest(false, "cannot send the request");
+}
+
+void MonitorProbe::endTest(bool success, const string &reason) {
+	mRunning = false;
+	if (mLeg) {
+		nta_leg_destroy(mLeg);
+		mLeg = NULL;
+	}
+	if (!success) {
+		++*mCountFailedTests;
+		LOGW("Monitor: test of %s failed, %s", mTargets[mTarget].c_str(), reason.c_str());
+	}
+	setSwitchPort(success);
+}
+
+void MonitorProbe::setSwitchPort(bool open) {
+	if (open == (mSwitchSocket != -1) || mSwitchPort <= 0)
+		return;
+	if (!open) {
+		su_root_deregister(mAgent->getRoot(), mSwitchWaitIndex);
+		close(mSwitchSocket);
+		mSwitchSocket = -1;
+		return;
+	}
+	mSwitchSocket = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(mSwitchSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(mSwitchPort);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(mSwitchSocket, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(mSwitchSocket, 16) == -1) {
+		LOGE("Monitor: cannot listen on switch port %i: %s", mSwitchPort, strerror(errno));
+		close(mSwitchSocket);
+		mSwitchSocket = -1;
+		return;
+	}
+	su_wait_create(&mSwitchWait, mSwitchSocket, SU_WAIT_ACCEPT);
+	mSwitchWaitIndex = su_root_register(mAgent->getRoot(), &mSwitchWait, &MonitorProbe::sOnSwitchPort, this,
+										su_pri_normal);
+}
+
+void MonitorProbe::sOnSwitchPort(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	// the health checks only look for the port being open
+	int fd = accept(reinterpret_cast<MonitorProbe *>(arg)->mSwitchSocket, NULL, NULL);
+	if (fd != -1)
+		close(fd);
+}
@@ -19,8 +19,13 @@
 #ifndef monitor_hh
 #define monitor_hh
 
+#include <chrono>
 #include <string>
+#include <vector>
 #include "agent.hh"
+#include "utils/latencyhistogram.hh"
+
+#include <sofia-sip/auth_client.h>
 
 class Monitor {
   public:
@@ -28,6 +33,7 @@ class Monitor {
 	static void createAccounts();
 
   private:
+	friend class MonitorProbe;
 	class Init {
 	  public:
 		Init();
@@ -48,4 +54,76 @@ class Monitor {
 	static const int PASSWORD_CACHE_EXPIRE;
 };
 
+/*
+ * In-process replacement of flexisip_monitor.py. Every test-interval, a SIP client of its own on the main loop registers
+ * the callee account of this node through the proxy, then sends a MESSAGE and makes a call (INVITE, ACK, BYE) from the
+ * caller account to the callees of the other nodes of the cluster, or to its own callee when alone. It answers the
+ * requests reaching its callee, from the probes of the other nodes as well.
+ * The latency of each stage, challenges included, is exported in the monitor statistics, and the switch port is
+ * listened as long as the last test succeeded.
+ */
+class MonitorProbe {
+  public:
+	MonitorProbe(Agent *agent);
+	~MonitorProbe();
+	/* Returns false if the probe cannot run with the monitor and cluster settings. */
+	bool start();
+
+  private:
+	enum Stage { Register, Message, Invite, Bye, StageCount };
+	struct StageStats {
+		LatencyHistogram latency;
+		StatCounter64 *p50;
+		StatCounter64 *p99;
+	};
+
+	static int sOnRequest(nta_leg_magic_t *magic, nta_leg_t *leg, nta_incoming_t *irq, const sip_t *sip);
+	static int sOnResponse(nta_outgoing_magic_t *magic, nta_outgoing_t *orq, const sip_t *sip);
+	static void sOnSwitchPort(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	int onRequest(nta_incoming_t *irq, const sip_t *sip);
+	void onResponse(const sip_t *sip);
+	void runTest();
+	bool send(Stage stage);
+	void nextStage();
+	void endTest(bool success, const std::string &reason);
+	void setSwitchPort(bool open);
+
+	Agent *mAgent;
+	SofiaAutoHome mHome;
+	nta_agent_t *mNta;
+	nta_leg_t *mDefaultLeg;
+	std::string mDomain;
+	std::string mCallerName;
+	std::string mCalleeName;
+	std::string mPassword;
+	std::string mCaller;
+	std::string mCallee;
+	url_t *mProxy;
+	sip_contact_t *mContact;
+	std::string mSdp;
+	std::vector<std::string> mTargets; // callees called by the tests
+	int mInterval;
+	int mSwitchPort;
+	std::shared_ptr<TimerService::Timer> mTestTimer;
+
+	// test in progress
+	bool mRunning;
+	size_t mTarget;
+	Stage mStage;
+	nta_leg_t *mLeg;
+	nta_outgoing_t *mOrq;
+	auth_client_t *mCallerAuth;
+	auth_client_t *mCalleeAuth; // the registrations are made with the credentials of the callee
+	bool mChallenged;
+	std::chrono::steady_clock::time_point mStageStart;
+
+	int mSwitchSocket;
+	su_wait_t mSwitchWait;
+	int mSwitchWaitIndex;
+
+	StageStats mStages[StageCount];
+	StatCounter64 *mCountTests;
+	StatCounter64 *mCountFailedTests;
+};
+
 #endif
@@ -0,0 +1,194 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "flexisip-config.h"
+#include "common.hh"
+#include "nonce-store.hh"
+#ifdef ENABLE_REDIS
+#include "registrardb-redis.hh"
+#endif
+
+#include <sofia-sip/msg_header.h>
+
+using namespace std;
+
+NonceStore::NonceStore() : mNonceExpires(3600) {
+}
+
+NonceStore::~NonceStore() {
+}
+
+void NonceStore::setNonceExpires(int value) {
+	mNonceExpires = value;
+}
+
+void NonceStore::insert(msg_header_t *response) {
+	const char *nonce = msg_header_find_param((msg_common_t const *)response, "nonce");
+	if (!nonce)
+		return;
+	string snonce(nonce);
+	snonce = snonce.substr(1, snonce.length() - 2);
+	LOGD("New nonce %s", snonce.c_str());
+	insert(snonce);
+}
+
+LocalNonceStore::Stripe &LocalNonceStore::getStripe(const string &nonce) {
+	return mStripes[hash<string>()(nonce) % sStripes];
+}
+
+int LocalNonceStore::getNc(const string &nonce) {
+	Stripe &stripe = getStripe(nonce);
+	unique_lock<mutex> lck(stripe.mutex);
+	auto it = stripe.nonces.find(nonce);
+	if (it != stripe.nonces.end() && getCurrentTime() <= it->second.expires)
+		return it->second.nc;
+	return -1;
+}
+
+void LocalNonceStore::insert(const string &nonce) {
+	Stripe &stripe = getStripe(nonce);
+	time_t expiration = getCurrentTime() + mNonceExpires;
+	time_t bucket = (expiration / sBucketDuration + 1) * sBucketDuration;
+	unique_lock<mutex> lck(stripe.mutex);
+	auto it = stripe.nonces.find(nonce);
+	if (it != stripe.nonces.end()) {
+		LOGE("Replacing nonce count for %s", nonce.c_str());
+		it->second.nc = 0;
+		it->second.expires = expiration;
+	} else {
+		stripe.nonces.insert(make_pair(nonce, NonceCount(0, expiration)));
+	}
+	stripe.buckets[bucket].push_back(nonce);
+}
+
+void LocalNonceStore::checkNc(const string &nonce, int nc, const CheckCallback &callback) {
+	bool valid = false;
+	{
+		Stripe &stripe = getStripe(nonce);
+		unique_lock<mutex> lck(stripe.mutex);
+		auto it = stripe.nonces.find(nonce);
+		if (it != stripe.nonces.end() && getCurrentTime() <= it->second.expires && it->second.nc < nc) {
+			it->second.nc = nc;
+			valid = true;
+		} else {
+			LOGE("Bad nonce count %d -> %d for %s", it != stripe.nonces.end() ? it->second.nc : -1, nc, nonce.c_str());
+		}
+	}
+	callback(valid);
+}
+
+void LocalNonceStore::updateNc(const string &nonce, int newnc) {
+	Stripe &stripe = getStripe(nonce);
+	unique_lock<mutex> lck(stripe.mutex);
+	auto it = stripe.nonces.find(nonce);
+	if (it != stripe.nonces.end()) {
+		LOGD("Updating nonce %s with nc=%d", nonce.c_str(), newnc);
+		it->second.nc = newnc;
+	} else {
+		LOGE("Couldn't update nonce %s: not found", nonce.c_str());
+	}
+}
+
+void LocalNonceStore::erase(const string &nonce) {
+	Stripe &stripe = getStripe(nonce);
+	unique_lock<mutex> lck(stripe.mutex);
+	LOGD("Erasing nonce %s", nonce.c_str());
+	// the bucket entry is left behind, and ignored when the bucket expires
+	stripe.nonces.erase(nonce);
+}
+
+void LocalNonceStore::cleanExpired() {
+	int count = 0;
+	size_t size = 0;
+	time_t now = getCurrentTime();
+	for (int i = 0; i < sStripes; ++i) {
+		Stripe &stripe = mStripes[i];
+		unique_lock<mutex> lck(stripe.mutex);
+		while (!stripe.buckets.empty() && stripe.buckets.begin()->first <= now) {
+			vector<string> &nonces = stripe.buckets.begin()->second;
+			for (auto nit = nonces.begin(); nit != nonces.end(); ++nit) {
+				auto it = stripe.nonces.find(*nit);
+				// the nonce may have been erased or reinserted with a later expiration since it was filed here
+				if (it != stripe.nonces.end() && now > it->second.expires) {
+					LOGD("Cleaning expired nonce %s", it->first.c_str());
+					stripe.nonces.erase(it);
+					++count;
+				}
+			}
+			stripe.buckets.erase(stripe.buckets.begin());
+		}
+		size += stripe.nonces.size();
+	}
+	if (count)
+		LOGD("Cleaned %d expired nonces, %zd remaining", count, size);
+}
+
+size_t LocalNonceStore::size() {
+	size_t size = 0;
+	for (int i = 0; i < sStripes; ++i) {
+		unique_lock<mutex> lck(mStripes[i].mutex);
+		size += mStripes[i].nonces.size();
+	}
+	return size;
+}
+
+#ifdef ENABLE_REDIS
+
+/* Returns the previous nonce count and records the new one, keeping the expiration of the key, or -1 if the nonce is
+ * unknown or the count is not greater. */
+const char *RedisNonceStore::sCheckNcScript =
+	"local nc = redis.call('GET', KEYS[1]) "
+	"if not nc or tonumber(nc) >= tonumber(ARGV[1]) then return -1 end "
+	"local ttl = redis.call('PTTL', KEYS[1]) "
+	"if ttl > 0 then redis.call('SET', KEYS[1], ARGV[1], 'PX', ttl) else redis.call('SET', KEYS[1], ARGV[1]) end "
+	"return tonumber(nc)";
+
+RedisNonceStore::RedisNonceStore(RegistrarDbRedisAsync *db) : mDb(db) {
+}
+
+void RedisNonceStore::insert(const string &nonce) {
+	string key = "nonce:" + nonce;
+	mDb->sendCommand(key,
+					 [key](redisReply *reply) {
+						 if (!reply || reply->type == REDIS_REPLY_ERROR)
+							 LOGE("Couldn't store %s in redis: %s", key.c_str(),
+								  reply && reply->str ? reply->str : "no reply");
+					 },
+					 "SET %s 0 EX %d", key.c_str(), mNonceExpires);
+}
+
+void RedisNonceStore::checkNc(const string &nonce, int nc, const CheckCallback &callback) {
+	string key = "nonce:" + nonce;
+	mDb->sendCommand(key,
+					 [key, nc, callback](redisReply *reply) {
+						 if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+							 // the nonce itself was already checked against its HMAC and expiration time
+							 LOGW("Couldn't check the nonce count of %s in redis (%s), accepting it", key.c_str(),
+								  reply && reply->str ? reply->str : "no reply");
+							 callback(true);
+						 } else if (reply->integer < 0) {
+							 LOGE("Bad nonce count %d for %s", nc, key.c_str());
+							 callback(false);
+						 } else {
+							 callback(true);
+						 }
+					 },
+					 "EVAL %s 1 %s %d", sCheckNcScript, key.c_str(), nc);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef nonce_store_hh
+#define nonce_store_hh
+
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sofia-sip/msg_types.h>
+
+#include "flexisip-config.h"
+
+/*
+ * Keeps the last nonce count seen for each nonce issued, to reject replayed digest responses.
+ *
+ * Without a store, nothing is kept: the nonces are then only checked against the HMAC and the expiration time they
+ * carry, which needs no state shared across the nodes of a cluster, but does not detect replays within the expiration
+ * time.
+ */
+class NonceStore {
+  public:
+	typedef std::function<void(bool)> CheckCallback;
+
+	NonceStore();
+	virtual ~NonceStore();
+	void setNonceExpires(int value);
+	/* Stores the nonce of the challenge in the WWW-Authenticate or Proxy-Authenticate header. */
+	void insert(msg_header_t *response);
+	virtual void insert(const std::string &nonce) = 0;
+	/* Checks that nc is greater than the last nonce count seen for the nonce and records it, atomically. The
+	 * callback may be called before the method returns. */
+	virtual void checkNc(const std::string &nonce, int nc, const CheckCallback &callback) = 0;
+	virtual void cleanExpired() {
+	}
+
+  protected:
+	int mNonceExpires;
+};
+
+/*
+ * The nonces are spread over independently locked stripes, so that concurrent challenges and authentications seldom
+ * wait for each other. Each stripe also files its nonces by expiration time, in buckets of a few seconds, so that
+ * cleaning only looks at the nonces which actually expired.
+ */
+class LocalNonceStore : public NonceStore {
+  public:
+	/* Returns the last nonce count seen for the nonce, or -1 if unknown or expired. */
+	int getNc(const std::string &nonce);
+	void insert(const std::string &nonce) override;
+	void checkNc(const std::string &nonce, int nc, const CheckCallback &callback) override;
+	void updateNc(const std::string &nonce, int newnc);
+	void erase(const std::string &nonce);
+	void cleanExpired() override;
+	size_t size();
+
+  private:
+	struct NonceCount {
+		NonceCount(int c, time_t ex) : nc(c), expires(ex) {
+		}
+		int nc;
+		time_t expires;
+	};
+	struct Stripe {
+		std::mutex mutex;
+		std::unordered_map<std::string, NonceCount> nonces;
+		// nonces by end of expiration bucket; a nonce may also be filed under an earlier bucket if it was reinserted
+		std::map<time_t, std::vector<std::string>> buckets;
+	};
+	static const int sStripes = 32;
+	static const int sBucketDuration = 16;
+
+	Stripe &getStripe(const std::string &nonce);
+
+	Stripe mStripes[sStripes];
+};
+
+#ifdef ENABLE_REDIS
+
+class RegistrarDbRedisAsync;
+
+/*
+ * Keeps the nonce counts in redis, with the connection of the registrar, so that a client challenged by one node of a
+ * cluster can answer to any other. Each nonce is a key expiring with the nonce. The commands are pipelined with the
+ * ones of the registrar. Must be used from the main thread.
+ */
+class RedisNonceStore : public NonceStore {
+  public:
+	RedisNonceStore(RegistrarDbRedisAsync *db);
+	void insert(const std::string &nonce) override;
+	void checkNc(const std::string &nonce, int nc, const CheckCallback &callback) override;
+
+  private:
+	static const char *sCheckNcScript;
+	RegistrarDbRedisAsync *mDb;
+};
+
+#endif
+
+#endif
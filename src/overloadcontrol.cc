@@ -0,0 +1,140 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "overloadcontrol.hh"
+#include "agent.hh"
+#include "event.hh"
+
+#include <string>
+
+using namespace std;
+
+/* Share of the delay allowed to the INVITEs given to each class, the in-dialog requests are never rejected. */
+static const double sDelayShares[OverloadControl::ClassCount] = {0, 1, 0.75, 0.5, 0.25};
+
+/* Time taken by the processing of the queue before the SIP stack reads the sockets again. */
+static const chrono::milliseconds sDrainSlice(10);
+
+/* Cost assumed for a request until some are measured, in microseconds. */
+static const double sInitialCost = 100;
+
+OverloadControl::OverloadControl(Agent *agent, const Processor &processor, int maxDelay, size_t maxQueueSize)
+	: mAgent(agent), mProcessor(processor), mMaxDelay(maxDelay * 1000.0), mMaxQueueSize(maxQueueSize), mSize(0),
+	  mCost(sInitialCost), mCountQueued(NULL) {
+	for (int c = 0; c < ClassCount; ++c)
+		mCountRejected[c] = NULL;
+}
+
+void OverloadControl::setStats(StatCounter64 *rejected[ClassCount], StatCounter64 *queued) {
+	for (int c = 0; c < ClassCount; ++c)
+		mCountRejected[c] = rejected[c];
+	mCountQueued = queued;
+}
+
+OverloadControl::Class OverloadControl::classify(const sip_t *sip) {
+	switch (sip->sip_request->rq_method) {
+		case sip_method_invite:
+			break;
+		case sip_method_cancel:
+			return Invite;
+		case sip_method_ack:
+			return InDialog;
+		case sip_method_register:
+			return Register;
+		case sip_method_options:
+			return sip->sip_to && sip->sip_to->a_tag ? InDialog : Options;
+		default:
+			if (sip->sip_to && sip->sip_to->a_tag)
+				return InDialog;
+			return Message;
+	}
+	return sip->sip_to && sip->sip_to->a_tag ? InDialog : Invite;
+}
+
+double OverloadControl::predictedWait(Class c) const {
+	size_t before = 0;
+	for (int i = 0; i <= c; ++i)
+		before += mQueues[i].size();
+	return before * mCost;
+}
+
+double OverloadControl::allowedDelay(Class c) const {
+	return mMaxDelay * sDelayShares[c];
+}
+
+void OverloadControl::push(const shared_ptr<RequestSipEvent> &ev) {
+	Class c = classify(ev->getMsgSip()->getSip());
+	if (c != InDialog && (mSize >= mMaxQueueSize || predictedWait(c) > allowedDelay(c))) {
+		reject(ev, c);
+		return;
+	}
+	if (mSize >= mMaxQueueSize) {
+		// room is made for the in-dialog request at the expense of the least important one
+		for (int i = ClassCount - 1; i > InDialog; --i) {
+			if (!mQueues[i].empty()) {
+				reject(mQueues[i].back().ev, (Class)i);
+				mQueues[i].pop_back();
+				--mSize;
+				break;
+			}
+		}
+	}
+	mQueues[c].push_back(Entry{ev, Clock::now()});
+	++mSize;
+	if (mCountQueued)
+		mCountQueued->set(mSize);
+	if (!mDrainTimer)
+		mDrainTimer = mAgent->getTimers()->defer([this]() { drain(); });
+}
+
+void OverloadControl::drain() {
+	mDrainTimer.reset();
+	auto start = Clock::now();
+	auto now = start;
+	while (mSize > 0 && now - start < sDrainSlice) {
+		int c = 0;
+		while (mQueues[c].empty())
+			++c;
+		Entry entry = mQueues[c].front();
+		mQueues[c].pop_front();
+		--mSize;
+		double waited = chrono::duration<double, micro>(now - entry.arrival).count();
+		if (c != InDialog && waited > allowedDelay((Class)c)) {
+			reject(entry.ev, (Class)c);
+			continue;
+		}
+		mProcessor(entry.ev);
+		auto end = Clock::now();
+		double cost = chrono::duration<double, micro>(end - now).count();
+		mCost += (cost - mCost) / 16;
+		now = end;
+	}
+	if (mCountQueued)
+		mCountQueued->set(mSize);
+	if (mSize > 0)
+		mDrainTimer = mAgent->getTimers()->defer([this]() { drain(); });
+}
+
+void OverloadControl::reject(const shared_ptr<RequestSipEvent> &ev, Class c) {
+	if (mCountRejected[c])
+		++*mCountRejected[c];
+	// the time to process the whole queue, at least one second
+	string retryAfter = to_string(1 + (unsigned long)(mSize * mCost / 1000000));
+	ev->reply(503, "Service Unavailable", SIPTAG_RETRY_AFTER_STR(retryAfter.c_str()),
+			  SIPTAG_SERVER_STR(mAgent->getServerString()), TAG_END());
+}
@@ -0,0 +1,87 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef overloadcontrol_hh
+#define overloadcontrol_hh
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include <sofia-sip/sip.h>
+
+#include "configmanager.hh"
+#include "timerservice.hh"
+
+class Agent;
+class RequestSipEvent;
+
+/*
+ * Admission control of the incoming requests, after the local overload control model of RFC 7339: the requests are
+ * queued by priority class and processed by slices of the main loop, the most important first, so that the SIP stack
+ * reads the sockets between the slices and the ordering covers what arrived meanwhile.
+ * The load is estimated from the average time taken to process a request: a request is answered with 503 and a
+ * Retry-After header as soon as it arrives if the requests queued before it in the order of processing would make
+ * it wait longer than the delay allowed to its class, or once it has waited longer than that. The less important the
+ * class, the shorter the delay, so that the OPTIONS are rejected first and the in-dialog requests, which complete
+ * what was already accepted, never are.
+ */
+class OverloadControl {
+  public:
+	/* In order of priority. A CANCEL is in the class of the INVITEs, whose order it must keep. */
+	enum Class { InDialog, Invite, Message, Register, Options, ClassCount };
+	typedef std::function<void(const std::shared_ptr<RequestSipEvent> &)> Processor;
+
+	/* maxDelay is the delay in milliseconds allowed to the INVITEs. */
+	OverloadControl(Agent *agent, const Processor &processor, int maxDelay, size_t maxQueueSize);
+
+	void push(const std::shared_ptr<RequestSipEvent> &ev);
+	static Class classify(const sip_t *sip);
+	/* One counter of rejections per class but the in-dialog one, and the gauge of the queued requests. */
+	void setStats(StatCounter64 *rejected[ClassCount], StatCounter64 *queued);
+	size_t size() const {
+		return mSize;
+	}
+
+  private:
+	typedef std::chrono::steady_clock Clock;
+	struct Entry {
+		std::shared_ptr<RequestSipEvent> ev;
+		Clock::time_point arrival;
+	};
+
+	void drain();
+	void reject(const std::shared_ptr<RequestSipEvent> &ev, Class c);
+	/* Microseconds the requests processed before one of class c would take. */
+	double predictedWait(Class c) const;
+	double allowedDelay(Class c) const;
+
+	Agent *mAgent;
+	Processor mProcessor;
+	double mMaxDelay; // in microseconds
+	size_t mMaxQueueSize;
+	std::deque<Entry> mQueues[ClassCount];
+	size_t mSize;
+	double mCost; // moving average of the time to process a request, in microseconds
+	std::shared_ptr<TimerService::Timer> mDrainTimer;
+	StatCounter64 *mCountRejected[ClassCount];
+	StatCounter64 *mCountQueued;
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "compressed-body.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include <zlib.h>
+
+using namespace std;
+
+namespace flexisip {
+
+CompressedBody::Segment CompressedBody::compress(const string &plain) {
+	Segment segment;
+	segment.length = plain.size();
+	segment.crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)plain.data(), plain.size());
+	segment.adler = adler32(adler32(0, Z_NULL, 0), (const Bytef *)plain.data(), plain.size());
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// raw deflate, the headers and checksums being written by assemble()
+	deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	// the sync flush ends the segment on a byte boundary, without marking its last block as the final one
+	segment.data.resize(deflateBound(&stream, plain.size()) + 16);
+	stream.next_in = (Bytef *)plain.data();
+	stream.avail_in = plain.size();
+	stream.next_out = (Bytef *)&segment.data[0];
+	stream.avail_out = segment.data.size();
+	deflate(&stream, Z_SYNC_FLUSH);
+	segment.data.resize(segment.data.size() - stream.avail_out);
+	deflateEnd(&stream);
+	return segment;
+}
+
+string CompressedBody::assemble(const vector<const Segment *> &segments, Encoding encoding) {
+	string out;
+	size_t size = 18;
+	for (auto segment : segments)
+		size += segment->data.size();
+	out.reserve(size);
+
+	if (encoding == Gzip) {
+		static const char sGzipHeader[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\x03'};
+		out.append(sGzipHeader, sizeof(sGzipHeader));
+	} else {
+		out.append("\x78\x9c", 2);
+	}
+	unsigned long crc = crc32(0, Z_NULL, 0);
+	unsigned long adler = adler32(0, Z_NULL, 0);
+	unsigned long length = 0;
+	for (auto segment : segments) {
+		out += segment->data;
+		crc = crc32_combine(crc, segment->crc, segment->length);
+		adler = adler32_combine(adler, segment->adler, segment->length);
+		length += segment->length;
+	}
+	// empty final block
+	out.append("\x03\x00", 2);
+
+	if (encoding == Gzip) {
+		for (int i = 0; i < 4; ++i)
+			out += (char)((crc >> (8 * i)) & 0xff);
+		for (int i = 0; i < 4; ++i)
+			out += (char)((length >> (8 * i)) & 0xff);
+	} else {
+		for (int i = 3; i >= 0; --i)
+			out += (char)((adler >> (8 * i)) & 0xff);
+	}
+	return out;
+}
+
+CompressedBody::Encoding CompressedBody::negotiate(const char *acceptEncoding) {
+	if (!acceptEncoding)
+		return Identity;
+	Encoding best = Identity;
+	double bestQ = 0;
+	string accept(acceptEncoding);
+	size_t pos = 0;
+	while (pos < accept.size()) {
+		size_t end = accept.find(',', pos);
+		if (end == string::npos)
+			end = accept.size();
+		size_t first = accept.find_first_not_of(" \t", pos);
+		size_t last = min(accept.find_first_of(" \t;", first), end);
+		if (first < end) {
+			string coding = accept.substr(first, last - first);
+			double q = 1;
+			size_t qPos = accept.find("q=", last);
+			if (qPos < end)
+				q = atof(accept.c_str() + qPos + 2);
+			Encoding encoding = Identity;
+			if (strcasecmp(coding.c_str(), "gzip") == 0 || strcasecmp(coding.c_str(), "x-gzip") == 0)
+				encoding = Gzip;
+			else if (strcasecmp(coding.c_str(), "deflate") == 0)
+				encoding = Deflate;
+			// gzip is preferred at equal weights, some clients taking deflate for raw deflate
+			if (encoding != Identity && q > 0 && (q > bestQ || (q == bestQ && encoding == Gzip))) {
+				best = encoding;
+				bestQ = q;
+			}
+		}
+		pos = end + 1;
+	}
+	return best;
+}
+
+const char *CompressedBody::toString(Encoding encoding) {
+	switch (encoding) {
+		case Gzip:
+			return "gzip";
+		case Deflate:
+			return "deflate";
+		case Identity:
+			break;
+	}
+	return "identity";
+}
+
+}
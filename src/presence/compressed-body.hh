@@ -0,0 +1,55 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef flexisip_compressed_body_hh
+#define flexisip_compressed_body_hh
+
+#include <string>
+#include <vector>
+
+namespace flexisip {
+
+/*
+ * Bodies compressed from parts compressed separately, so that the parts common to many bodies, such as the pidf
+ * documents of the presentities of the lists, are compressed once and then only copied.
+ * A segment is a raw deflate stream ended by a sync flush, which can be followed by another one. The segments of a
+ * body are joined in a gzip or zlib stream whose checksum is combined from theirs.
+ */
+class CompressedBody {
+  public:
+	enum Encoding { Identity, Deflate, Gzip };
+
+	struct Segment {
+		std::string data;
+		unsigned long crc;
+		unsigned long adler;
+		size_t length; // uncompressed
+	};
+
+	static Segment compress(const std::string &plain);
+	/* The body made of the segments, in this order, compressed with gzip or deflate. */
+	static std::string assemble(const std::vector<const Segment *> &segments, Encoding encoding);
+	/* The encoding preferred by an Accept-Encoding header among gzip and deflate, Identity if none. */
+	static Encoding negotiate(const char *acceptEncoding);
+	static const char *toString(Encoding encoding);
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "expiry-wheel.hh"
+#include "log/logmanager.hh"
+
+#include <chrono>
+#include <vector>
+
+#include <belle-sip/belle-sip.h>
+
+using namespace std;
+
+namespace flexisip {
+
+ExpiryWheel::ExpiryWheel(belle_sip_main_loop_t *mainLoop) : mWheel(now()) {
+	belle_sip_source_cpp_func_t *func = new belle_sip_source_cpp_func_t([this](unsigned int events) {
+		onTick();
+		return BELLE_SIP_CONTINUE;
+	});
+	mTickTimer = belle_sip_main_loop_create_cpp_timeout(mainLoop, func, 1000, "presence expiry wheel");
+}
+
+ExpiryWheel::~ExpiryWheel() {
+	belle_sip_source_cancel(mTickTimer);
+	belle_sip_object_unref(mTickTimer);
+}
+
+time_t ExpiryWheel::now() {
+	return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+shared_ptr<ExpiryWheel::Timer> ExpiryWheel::schedule(unsigned int delay, const Callback &fn) {
+	auto timer = make_shared<Timer>();
+	timer->mCallback = fn;
+	// the ticks are not aligned on the seconds of the clock
+	mWheel.schedule(now() + delay + 1, timer);
+	return timer;
+}
+
+void ExpiryWheel::onTick() {
+	// collected first, as the callbacks may schedule new timers
+	vector<weak_ptr<Timer>> due;
+	mWheel.advance(now(), [&due](const weak_ptr<Timer> &timer, time_t) { due.push_back(timer); });
+	size_t fired = 0;
+	for (auto &timer : due) {
+		// locked one at a time, as a callback may give up the timers of the next ones
+		shared_ptr<Timer> t = timer.lock();
+		if (!t)
+			continue;
+		// moved out, as the callback may release the timer
+		Callback callback;
+		callback.swap(t->mCallback);
+		if (callback) {
+			callback();
+			++fired;
+		}
+	}
+	if (fired > 0)
+		SLOGD << "[" << fired << "] presence expirations processed, [" << mWheel.size() << "] pending";
+}
+
+} /* namespace flexisip */
@@ -0,0 +1,70 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef flexisip_expiry_wheel_hh
+#define flexisip_expiry_wheel_hh
+
+#include <ctime>
+#include <functional>
+#include <memory>
+
+#include "utils/timerwheel.hh"
+
+typedef struct belle_sip_main_loop belle_sip_main_loop_t;
+typedef struct belle_sip_source belle_sip_source_t;
+
+namespace flexisip {
+
+/*
+ * Expirations of the presence server (subscriptions, publications of this server and of the others sharing the
+ * state): a TimerWheel advanced by a single belle-sip timer ticking every second, which fires all the entries due at
+ * once. Scheduling or refreshing an expiration costs an entry in the wheel instead of a source of the main loop, whose
+ * timers are kept in a sorted list.
+ * Used from the main loop only.
+ */
+class ExpiryWheel {
+  public:
+	typedef std::function<void()> Callback;
+	/* A scheduled expiration, given up when the last reference to it is released. One shot. */
+	class Timer {
+	  private:
+		friend class ExpiryWheel;
+		Callback mCallback;
+	};
+
+	ExpiryWheel(belle_sip_main_loop_t *mainLoop);
+	~ExpiryWheel();
+
+	/* Calls fn in delay seconds, one second late at most but never early. */
+	std::shared_ptr<Timer> schedule(unsigned int delay, const Callback &fn);
+	size_t size() const {
+		return mWheel.size();
+	}
+
+  private:
+	static time_t now();
+	void onTick();
+
+	belle_sip_source_t *mTickTimer;
+	TimerWheel<std::weak_ptr<Timer>> mWheel;
+};
+
+} /* namespace flexisip */
+
+#endif
@@ -16,14 +16,153 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <file-resource-list-manager.hh>
 
-#if 0
-FileResourceListManager::FileResourceListManager() {
-	// TODO Auto-generated constructor stub
+#include "file-resource-list-manager.hh"
+#include "belle-sip/belle-sip.h"
+#include "log/logmanager.hh"
+#include "resource-lists.hxx"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace flexisip {
+
+static string makeKey(const string &user, string host) {
+	transform(host.begin(), host.end(), host.begin(), ::tolower);
+	return user + "@" + host;
+}
+
+/* Splits "sip:user@host[:port][;params]", false if there is no user or host. */
+static bool parseResource(const string &uri, FileResourceListManager::Resource &resource) {
+	size_t userBegin = uri.find(':');
+	size_t at = uri.find('@');
+	if (userBegin == string::npos || at == string::npos || at <= userBegin + 1)
+		return false;
+	size_t hostEnd = uri.find_first_of(":;?>", at + 1);
+	resource.user = uri.substr(userBegin + 1, at - userBegin - 1);
+	resource.host = uri.substr(at + 1, hostEnd == string::npos ? string::npos : hostEnd - at - 1);
+	resource.phone = uri.find(";user=phone") != string::npos;
+	return !resource.host.empty();
+}
+
+FileResourceListManager::FileResourceListManager(const string &path, unsigned int reloadInterval)
+	: mPath(path), mReloadInterval(reloadInterval), mModificationTime(0), mFileSize(-2),
+	  mIndex(make_shared<Index>()), mRunning(true) {
+	reload();
+	if (reloadInterval > 0)
+		mThread = thread(&FileResourceListManager::run, this);
 }
 
 FileResourceListManager::~FileResourceListManager() {
-	// TODO Auto-generated destructor stub
+	{
+		unique_lock<mutex> lock(mMutex);
+		mRunning = false;
+		mCond.notify_one();
+	}
+	if (mThread.joinable())
+		mThread.join();
+}
+
+shared_ptr<const FileResourceListManager::List> FileResourceListManager::find(const belle_sip_uri_t *owner) const {
+	const char *user = belle_sip_uri_get_user(owner);
+	const char *host = belle_sip_uri_get_host(owner);
+	if (!user || !host)
+		return nullptr;
+	shared_ptr<const Index> index;
+	{
+		unique_lock<mutex> lock(mMutex);
+		index = mIndex;
+	}
+	auto it = index->find(makeKey(user, host));
+	return it == index->end() ? nullptr : it->second;
 }
-#endif
+
+size_t FileResourceListManager::size() const {
+	unique_lock<mutex> lock(mMutex);
+	return mIndex->size();
+}
+
+void FileResourceListManager::run() {
+	unique_lock<mutex> lock(mMutex);
+	while (mRunning) {
+		mCond.wait_for(lock, mReloadInterval);
+		if (!mRunning)
+			break;
+		// parsed unlocked, the lookups going on meanwhile with the previous index
+		lock.unlock();
+		reload();
+		lock.lock();
+	}
+}
+
+void FileResourceListManager::reload() {
+	struct stat st;
+	if (stat(mPath.c_str(), &st) != 0) {
+		// reported once, the lists loaded before being kept
+		if (mFileSize != -1)
+			SLOGE << "Cannot read resource lists file [" << mPath << "]: " << strerror(errno);
+		mFileSize = -1;
+		return;
+	}
+	if (st.st_mtime == mModificationTime && st.st_size == mFileSize)
+		return;
+	mModificationTime = st.st_mtime;
+	mFileSize = st.st_size;
+
+	unique_ptr<resource_lists::Resource_lists> document;
+	try {
+		ifstream data(mPath);
+		document = resource_lists::parseResource_lists(data, xml_schema::Flags::dont_validate);
+	} catch (const xml_schema::Exception &e) {
+		SLOGE << "Cannot parse resource lists file [" << mPath << "], previous lists kept: " << e;
+		return;
+	}
+
+	shared_ptr<const Index> previous;
+	{
+		unique_lock<mutex> lock(mMutex);
+		previous = mIndex;
+	}
+	auto index = make_shared<Index>();
+	size_t resources = 0;
+	for (const auto &list : document->getList()) {
+		Resource owner;
+		if (!list.getName().present() || !parseResource(list.getName().get(), owner)) {
+			SLOGW << "Resource list without owner uri in [" << mPath << "], ignored";
+			continue;
+		}
+		auto resourceList = make_shared<List>();
+		for (const auto &entry : list.getEntry()) {
+			Resource resource;
+			if (!parseResource(entry.getUri(), resource)) {
+				SLOGW << "Cannot parse entry [" << entry.getUri() << "] of the list of [" << list.getName().get()
+					  << "], ignored";
+				continue;
+			}
+			resourceList->push_back(resource);
+		}
+		if (resourceList->empty())
+			continue;
+		resources += resourceList->size();
+		string key = makeKey(owner.user, owner.host);
+		auto it = previous->find(key);
+		if (it != previous->end() && *it->second == *resourceList)
+			(*index)[key] = it->second;
+		else
+			(*index)[key] = resourceList;
+	}
+	{
+		unique_lock<mutex> lock(mMutex);
+		mIndex = index;
+	}
+	SLOGI << "[" << index->size() << "] resource lists of [" << resources << "] resources loaded from [" << mPath
+		  << "]";
+}
+
+} /* namespace flexisip */
@@ -1,31 +1,89 @@
 /*
-    Flexisip, a flexible SIP proxy server with media capabilities.
-    Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
 
-    This program is free software: you can redistribute it and/or modify
-    it under the terms of the GNU Affero General Public License as
-    published by the Free Software Foundation, either version 3 of the
-    License, or (at your option) any later version.
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
 
-    This program is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU Affero General Public License for more details.
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
 
-    You should have received a copy of the GNU Affero General Public License
-    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#pragma once
 
-#if 0
+#ifndef flexisip_file_resource_list_manager_hh
+#define flexisip_file_resource_list_manager_hh
 
-//#include "resource-list-manager.hh"
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-class FileResourceListManager: public ResourceListsManager {
-public:
-	FileResourceListManager();
-	virtual ~FileResourceListManager();
+#include <sys/types.h>
+
+typedef struct _belle_sip_uri belle_sip_uri_t;
+
+namespace flexisip {
+
+/*
+ * Resource lists (rfc4662) provisioned in a resource-lists document (rfc4826), for the list subscriptions whose
+ * SUBSCRIBE has no recipient-list body. Each top-level <list> is the list of the user whose uri is its "name"
+ * attribute, and is served to the SUBSCRIBE sent to that uri.
+ * The document is parsed once into an index of the lists by owner, whose lists are shared by all the subscriptions to
+ * them. A thread checks the file periodically and parses it again when it changed, the new index replacing the
+ * previous one at once; the lists unchanged by a reload are kept, so that the subscriptions to them share them still.
+ * A document that cannot be parsed leaves the index unchanged.
+ */
+class FileResourceListManager {
+  public:
+	struct Resource {
+		std::string user;
+		std::string host;
+		bool phone; // ;user=phone
+		bool operator==(const Resource &other) const {
+			return user == other.user && host == other.host && phone == other.phone;
+		}
+	};
+	typedef std::vector<Resource> List;
+
+	/* Loads the file, then checks it every reloadInterval seconds (never with 0). */
+	FileResourceListManager(const std::string &path, unsigned int reloadInterval);
+	~FileResourceListManager();
+
+	/* The list of the given owner, NULL if not provisioned. Thread-safe. */
+	std::shared_ptr<const List> find(const belle_sip_uri_t *owner) const;
+	size_t size() const;
+
+  private:
+	typedef std::unordered_map<std::string /*user@host*/, std::shared_ptr<const List>> Index;
+
+	void run();
+	/* Parses the file into a new index if it changed since the last load. */
+	void reload();
+
+	const std::string mPath;
+	const std::chrono::seconds mReloadInterval;
+	// of the file when last parsed, the size being -1 while the file cannot be read
+	time_t mModificationTime;
+	off_t mFileSize;
+	mutable std::mutex mMutex;
+	std::shared_ptr<const Index> mIndex; // replaced, never modified, under mMutex
+	std::condition_variable mCond;
+	bool mRunning;
+	std::thread mThread;
 };
 
+} /* namespace flexisip */
+
 #endif
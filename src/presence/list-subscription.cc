@@ -20,6 +20,7 @@
 #include "belle-sip/belle-sip.h"
 #include "bellesip-signaling-exception.hh"
 #include "log/logmanager.hh"
+#include "configmanager.hh"
 #include "resource-lists.hxx"
 #include <chrono>
 #include "rlmi+xml.hxx"
@@ -31,9 +32,10 @@ using namespace std;
 namespace flexisip {
 
 ListSubscription::ListSubscription(unsigned int expires, belle_sip_server_transaction_t *ist,
-								   belle_sip_provider_t *aProv) throw(FlexisipException)
+								   belle_sip_provider_t *aProv, chrono::seconds minNotifyInterval) throw(FlexisipException)
 	: Subscription("Presence", expires, belle_sip_transaction_get_dialog(BELLE_SIP_TRANSACTION(ist)), aProv),
-	  mLastNotify(chrono::system_clock::time_point::min()), mMinNotifyInterval(2 /*60*/), mVersion(0), mTimer(NULL) {
+	  mLastNotify(chrono::system_clock::time_point::min()), mMinNotifyInterval(minNotifyInterval), mPendingChanges(0),
+	  mCountNotifies(NULL), mCountCoalesced(NULL), mVersion(0), mTimer(NULL) {
 	belle_sip_request_t *request = belle_sip_transaction_get_request(BELLE_SIP_TRANSACTION(ist));
 	belle_sip_header_content_type_t *contentType =
 		belle_sip_message_get_header_by_type(request, belle_sip_header_content_type_t);
@@ -94,9 +96,32 @@ ListSubscription::ListSubscription(unsigned int expires, belle_sip_server_transa
 	belle_sip_object_ref((void *)mName);
 }
 
+ListSubscription::ListSubscription(unsigned int expires, belle_sip_server_transaction_t *ist,
+								   belle_sip_provider_t *aProv, const FileResourceListManager::List &resources,
+								   chrono::seconds minNotifyInterval) throw(FlexisipException)
+	: Subscription("Presence", expires, belle_sip_transaction_get_dialog(BELLE_SIP_TRANSACTION(ist)), aProv),
+	  mLastNotify(chrono::system_clock::time_point::min()), mMinNotifyInterval(minNotifyInterval), mPendingChanges(0),
+	  mCountNotifies(NULL), mCountCoalesced(NULL), mVersion(0), mTimer(NULL) {
+	belle_sip_request_t *request = belle_sip_transaction_get_request(BELLE_SIP_TRANSACTION(ist));
+	// already checked when the list was loaded
+	for (const auto &resource : resources) {
+		belle_sip_uri_t *uri = belle_sip_uri_create(resource.user.c_str(), resource.host.c_str());
+		if (resource.phone)
+			belle_sip_uri_set_user_param(uri, "phone");
+		mListeners.push_back(make_shared<PresentityResourceListener>(*this, uri));
+		belle_sip_object_unref(uri);
+	}
+	mName = (belle_sip_uri_t *)belle_sip_object_clone(BELLE_SIP_OBJECT(belle_sip_request_get_uri(request)));
+	belle_sip_object_ref((void *)mName);
+}
+
 list<shared_ptr<PresentityPresenceInformationListener>> &ListSubscription::getListeners() {
 	return mListeners;
 }
+void ListSubscription::setStatCounters(StatCounter64 *countNotifies, StatCounter64 *countCoalesced) {
+	mCountNotifies = countNotifies;
+	mCountCoalesced = countCoalesced;
+}
 ListSubscription::~ListSubscription() {
 	if (mTimer) {
 		belle_sip_source_cancel(mTimer);
@@ -106,36 +131,94 @@ ListSubscription::~ListSubscription() {
 	SLOGD << "List souscription ["<< this <<"] deleted";
 };
 
-void ListSubscription::addInstanceToResource(rlmi::Resource &resource, list<belle_sip_body_handler_t *> &multipartList,
+// the boundary of the multipart bodies, which the pidf parts cached by the presentities are formatted with
+static const char *sBoundary = "flexisip-rlmi-7b3e9c51a8d2";
+
+string ListSubscription::formatPart(const string &contentId, const char *contentType, const string &body) {
+	ostringstream part;
+	part << "--" << sBoundary << "\r\n"
+		 << "Content-Transfer-Encoding: binary\r\n"
+		 << "Content-Id: " << contentId << "\r\n"
+		 << "Content-Type: " << contentType << "\r\n\r\n"
+		 << body << "\r\n";
+	return part.str();
+}
+
+void ListSubscription::addInstanceToResource(rlmi::Resource &resource, PartList &parts,
 											 PresentityPresenceInformation &presentityInformation, bool extended) {
 
 	// we have a resource instance
 	// subscription state is always active until we implement ACL
 	rlmi::Instance instance("1", rlmi::State::active);
+	instance.setCid(presentityInformation.getContentId());
+	parts.push_back(make_pair(&presentityInformation, extended));
+	resource.getInstance().push_back(instance);
+	SLOGI << "Presence info added to list [" << mName << " for entity [" << presentityInformation.getEntity() << "]";
+}
+
+void ListSubscription::sendNotify(const string &rlmi, const PartList &parts) {
 	char cid_rand_part[8];
 	belle_sip_random_token(cid_rand_part, sizeof(cid_rand_part));
 	ostringstream cid;
 	cid << (const char *)cid_rand_part << "@" << belle_sip_uri_get_host(mName);
-	instance.setCid(cid.str());
-	string pidf = presentityInformation.getPidf(extended);
-	belle_sip_memory_body_handler_t *bodyPart =
-		belle_sip_memory_body_handler_new_copy_from_buffer((void *)pidf.c_str(), pidf.length(), NULL, NULL);
-	belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(bodyPart),
+	static const char *sRlmiType = "application/rlmi+xml;charset=\"UTF-8\"";
+	static const char *sPidfType = "application/pidf+xml;charset=\"UTF-8\"";
+
+	CompressedBody::Encoding encoding = getContentEncoding();
+	// belle-sip deflates the bodies itself on sending, so that only gzip bodies can be given already compressed
+	if (encoding == CompressedBody::Gzip) {
+		// only the rlmi document is compressed for this notify, the pidf parts being compressed once per version
+		CompressedBody::Segment head = CompressedBody::compress(formatPart(cid.str(), sRlmiType, rlmi));
+		CompressedBody::Segment tail = CompressedBody::compress(string("--") + sBoundary + "--\r\n");
+		vector<const CompressedBody::Segment *> segments(1, &head);
+		for (const auto &part : parts) {
+			segments.push_back(&part.first->getCompressedPidfPart(part.second, [&part](const string &pidf) {
+				return formatPart(part.first->getContentId(), sPidfType, pidf);
+			}));
+		}
+		segments.push_back(&tail);
+		string body = CompressedBody::assemble(segments, encoding);
+
+		belle_sip_header_content_type_t *contentType = belle_sip_header_content_type_create("multipart", "related");
+		belle_sip_parameters_t *params = BELLE_SIP_PARAMETERS(contentType);
+		belle_sip_parameters_set_parameter(params, "type", "\"application/rlmi+xml\"");
+		belle_sip_parameters_set_parameter(params, "start", ("\"<" + cid.str() + ">\"").c_str());
+		belle_sip_parameters_set_parameter(params, "boundary", sBoundary);
+		SLOGD << "List notify for [" << mName << "] compressed with " << CompressedBody::toString(encoding) << " to "
+			  << body.size() << " bytes";
+		Subscription::notify(contentType, body, CompressedBody::toString(encoding));
+		return;
+	}
+
+	belle_sip_memory_body_handler_t *firstBodyPart =
+		belle_sip_memory_body_handler_new_copy_from_buffer((void *)rlmi.c_str(), rlmi.length(), NULL, NULL);
+	belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(firstBodyPart),
 									  belle_sip_header_create("Content-Transfer-Encoding", "binary"));
-	ostringstream content_id;
-	content_id << "<" << cid.str() << ">";
-	belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(bodyPart),
+	belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(firstBodyPart),
 									  belle_sip_header_create("Content-Id", cid.str().c_str()));
-	belle_sip_body_handler_add_header(
-		BELLE_SIP_BODY_HANDLER(bodyPart),
-		belle_sip_header_create("Content-Type", "application/pidf+xml;charset=\"UTF-8\""));
-	multipartList.push_back(BELLE_SIP_BODY_HANDLER(bodyPart));
-	resource.getInstance().push_back(instance);
-	SLOGI << "Presence info added to list [" << mName << " for entity [" << presentityInformation.getEntity() << "]";
+	belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(firstBodyPart),
+									  belle_sip_header_create("Content-Type", sRlmiType));
+	belle_sip_multipart_body_handler_t *multiPartBody =
+		belle_sip_multipart_body_handler_new(NULL, NULL, BELLE_SIP_BODY_HANDLER(firstBodyPart), sBoundary);
+	for (const auto &part : parts) {
+		const string &pidf = part.first->getPidf(part.second);
+		belle_sip_memory_body_handler_t *bodyPart =
+			belle_sip_memory_body_handler_new_copy_from_buffer((void *)pidf.c_str(), pidf.length(), NULL, NULL);
+		belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(bodyPart),
+										  belle_sip_header_create("Content-Transfer-Encoding", "binary"));
+		belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(bodyPart),
+										  belle_sip_header_create("Content-Id", part.first->getContentId().c_str()));
+		belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(bodyPart),
+										  belle_sip_header_create("Content-Type", sPidfType));
+		belle_sip_multipart_body_handler_add_part(multiPartBody, BELLE_SIP_BODY_HANDLER(bodyPart));
+	}
+	if (encoding == CompressedBody::Deflate)
+		Subscription::notify(multiPartBody, CompressedBody::toString(encoding));
+	else
+		Subscription::notify(multiPartBody);
 }
 
 void ListSubscription::notify(bool isFullState) throw(FlexisipException) {
-	belle_sip_multipart_body_handler_t *multiPartBody;
 	try {
 		char *uri = belle_sip_uri_to_string(mName);
 		/* 5.2
@@ -159,7 +242,7 @@ void ListSubscription::notify(bool isFullState) throw(FlexisipException) {
 		}
 		rlmi::List resourceList(string(uri), mVersion, isFullState);
 		belle_sip_free(uri);
-		list<belle_sip_body_handler_t *> multipartList;
+		PartList parts;
 
 		if (isFullState) {
 			SLOGI << "Building full state rlmi for list name [" << mName << "]";
@@ -169,7 +252,7 @@ void ListSubscription::notify(bool isFullState) throw(FlexisipException) {
 				belle_sip_free(presentityUri);
 				PendingStateType::iterator it = mPendingStates.find(resourceListener->getPresentityUri());
 				if (it != mPendingStates.end() && it->second.first->isKnown()) {
-					addInstanceToResource(resource, multipartList, *it->second.first, resourceListener->extendedNotifyEnabled());
+					addInstanceToResource(resource, parts, *it->second.first, resourceListener->extendedNotifyEnabled());
 				} else {
 					SLOGI << "No presence info yet for uri [" << resourceListener->getPresentityUri() << "]";
 				}
@@ -185,18 +268,12 @@ void ListSubscription::notify(bool isFullState) throw(FlexisipException) {
 					char *presentityUri = belle_sip_uri_to_string(presenceInformation->getEntity());
 					rlmi::Resource resource(presentityUri);
 					belle_sip_free(presentityUri);
-					addInstanceToResource(resource, multipartList, *presenceInformation, presenceInformationPair.second.second);
+					addInstanceToResource(resource, parts, *presenceInformation, presenceInformationPair.second.second);
 					resourceList.getResource().push_back(resource);
 				}
 			}
 		}
 
-		// now building full body
-		char cid_rand_part[8];
-		belle_sip_random_token(cid_rand_part, sizeof(cid_rand_part));
-		ostringstream cid;
-		cid << (const char *)cid_rand_part << "@" << belle_sip_uri_get_host(mName);
-
 		// Serialize the object model to XML.
 		//
 		xml_schema::NamespaceInfomap map;
@@ -204,26 +281,16 @@ void ListSubscription::notify(bool isFullState) throw(FlexisipException) {
 		stringstream out;
 		rlmi::serializeList(out, resourceList, map);
 
-		belle_sip_memory_body_handler_t *firstBodyPart = belle_sip_memory_body_handler_new_copy_from_buffer(
-			(void *)out.str().c_str(), out.str().length(), NULL, NULL);
-		belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(firstBodyPart),
-										  belle_sip_header_create("Content-Transfer-Encoding", "binary"));
-		ostringstream content_id;
-		content_id << "<" << cid.str() << ">";
-		belle_sip_body_handler_add_header(BELLE_SIP_BODY_HANDLER(firstBodyPart),
-										  belle_sip_header_create("Content-Id", cid.str().c_str()));
-		belle_sip_body_handler_add_header(
-			BELLE_SIP_BODY_HANDLER(firstBodyPart),
-			belle_sip_header_create("Content-Type", "application/rlmi+xml;charset=\"UTF-8\""));
-		multiPartBody = belle_sip_multipart_body_handler_new(NULL, NULL, BELLE_SIP_BODY_HANDLER(firstBodyPart), NULL);
-		for (belle_sip_body_handler_t *additionalPart : multipartList) {
-			belle_sip_multipart_body_handler_add_part(multiPartBody, additionalPart);
-		}
-
-		Subscription::notify(multiPartBody, "deflate");
+		// the presentities are held by mPendingStates until the notify is sent
+		sendNotify(out.str(), parts);
 		mVersion++;
 		mLastNotify = chrono::system_clock::now();
 		mPendingStates.clear();
+		if (mCountNotifies)
+			mCountNotifies->incr();
+		if (mCountCoalesced && mPendingChanges > 1)
+			mCountCoalesced->set(mCountCoalesced->read() + mPendingChanges - 1);
+		mPendingChanges = 0;
 	} catch (const xml_schema::Serialization &e) {
 		throw FLEXISIP_EXCEPTION << "serialization error: " << e.diagnostics();
 	} catch (exception &e) {
@@ -234,6 +301,7 @@ void ListSubscription::onInformationChanged(PresentityPresenceInformation &prese
 	// store state, erase previous one if any
 	if (getState() == active) {
 		mPendingStates[presenceInformation.getEntity()] = std::make_pair(presenceInformation.shared_from_this(), extended);
+		++mPendingChanges;
 
 		if (isTimeToNotify()) {
 			notify(FALSE);
@@ -241,8 +309,12 @@ void ListSubscription::onInformationChanged(PresentityPresenceInformation &prese
 			if (mVersion > 0 /*special case for first notify */ && mTimer == NULL) {
 				// cb function to invalidate an unrefreshed etag;
 				belle_sip_source_cpp_func_t *func = new belle_sip_source_cpp_func_t([this](unsigned int events) {
-					this->notify(FALSE);
-					SLOGD << "defered notify sent on [" << this << "]";
+					try {
+						this->notify(FALSE);
+						SLOGD << "defered notify sent on [" << this << "]";
+					} catch (FlexisipException &e) {
+						SLOGE << "Cannot send defered notify on [" << this << "]: " << e;
+					}
 					belle_sip_object_unref(this->mTimer);
 					this->mTimer = NULL;
 					return BELLE_SIP_STOP;
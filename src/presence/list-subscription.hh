@@ -19,10 +19,13 @@
 #ifndef flexisip_rls_subscription_hh
 #define flexisip_rls_subscription_hh
 #include "subscription.hh"
+#include "file-resource-list-manager.hh"
 #include <unordered_map>
 #include <chrono>
+#include <vector>
 typedef struct _belle_sip_uri belle_sip_uri_t;
 typedef struct belle_sip_server_transaction belle_sip_server_transaction_t;
+class StatCounter64;
 namespace rlmi {
 class Resource;
 }
@@ -59,11 +62,23 @@ class ListSubscription : public Subscription {
   public:
 	// ListSubscription(unsigned int expires,list<const belle_sip_uri_t *> resources,belle_sip_dialog_t*
 	// aDialog,belle_sip_provider_t* aProv);
-	ListSubscription(unsigned int expires, belle_sip_server_transaction_t *ist,
-					 belle_sip_provider_t *aProv) throw(FlexisipException);
+	/*
+	 * The changes of the presentities are notified at most once every minNotifyInterval, the ones received meanwhile
+	 * being sent together in the next NOTIFY.
+	 */
+	ListSubscription(unsigned int expires, belle_sip_server_transaction_t *ist, belle_sip_provider_t *aProv,
+					 std::chrono::seconds minNotifyInterval = std::chrono::seconds(2)) throw(FlexisipException);
+	/*
+	 * For a list provisioned on the server, the SUBSCRIBE having no body.
+	 */
+	ListSubscription(unsigned int expires, belle_sip_server_transaction_t *ist, belle_sip_provider_t *aProv,
+					 const FileResourceListManager::List &resources,
+					 std::chrono::seconds minNotifyInterval = std::chrono::seconds(2)) throw(FlexisipException);
 
 	virtual ~ListSubscription();
 	std::list<std::shared_ptr<PresentityPresenceInformationListener>> &getListeners();
+	/* Counters of the NOTIFY sent and of the changes sent along with others rather than in their own NOTIFY. */
+	void setStatCounters(StatCounter64 *countNotifies, StatCounter64 *countCoalesced);
 	/* Notify taking state from all pending Presentity listener*/
 	void notify(bool isFullState) throw(FlexisipException);
 
@@ -76,8 +91,12 @@ class ListSubscription : public Subscription {
 	ListSubscription(const ListSubscription &);
 	// return true if a real notify can be sent.
 	bool isTimeToNotify();
-	void addInstanceToResource(rlmi::Resource &resource, std::list<belle_sip_body_handler_t *> &multipartList,
+	typedef std::vector<std::pair<PresentityPresenceInformation *, bool /*extended*/>> PartList;
+	void addInstanceToResource(rlmi::Resource &resource, PartList &parts,
 							   PresentityPresenceInformation &presentityInformation, bool extended);
+	/* Sends the rlmi document and the pidf of the parts in a multipart body, compressed when the subscriber accepts. */
+	void sendNotify(const std::string &rlmi, const PartList &parts);
+	static std::string formatPart(const std::string &contentId, const char *contentType, const std::string &body);
 
 	std::list<std::shared_ptr<PresentityPresenceInformationListener>> mListeners;
 	typedef std::unordered_map<const belle_sip_uri_t *, std::pair<std::shared_ptr<PresentityPresenceInformation>,bool>,
@@ -85,6 +104,10 @@ class ListSubscription : public Subscription {
 	PendingStateType mPendingStates; // map of Presentity to be notified by uri
 	std::chrono::time_point<std::chrono::system_clock> mLastNotify;
 	std::chrono::seconds mMinNotifyInterval;
+	// changes received since the last notify
+	unsigned int mPendingChanges;
+	StatCounter64 *mCountNotifies;
+	StatCounter64 *mCountCoalesced;
 	/*
 	 * rfc 4662
 	 * 5.2.  List Attributes
@@ -0,0 +1,203 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pidf-diff.hh"
+
+#include <map>
+#include <set>
+
+using namespace std;
+
+namespace flexisip {
+
+static const char *sPidfDiffNs = "urn:ietf:params:xml:ns:pidf-diff";
+
+/* Position of the '>' closing the tag starting at pos, quoted attribute values being skipped. */
+static size_t findTagEnd(const string &xml, size_t pos) {
+	char quote = 0;
+	for (; pos < xml.size(); ++pos) {
+		char c = xml[pos];
+		if (quote) {
+			if (c == quote)
+				quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '>') {
+			return pos;
+		}
+	}
+	return string::npos;
+}
+
+static string tagName(const string &xml, size_t pos) {
+	size_t end = xml.find_first_of(" \t\r\n/>", pos + 1);
+	return xml.substr(pos + 1, end == string::npos ? string::npos : end - pos - 1);
+}
+
+/* Value of the id attribute of the start tag between pos and end, if any. */
+static string tagId(const string &xml, size_t pos, size_t end) {
+	for (size_t i = xml.find("id=", pos); i != string::npos && i < end; i = xml.find("id=", i + 3)) {
+		char before = xml[i - 1];
+		if ((before != ' ' && before != '\t' && before != '\r' && before != '\n') || i + 3 >= end)
+			continue;
+		char quote = xml[i + 3];
+		size_t close = xml.find(quote, i + 4);
+		if (close == string::npos || close > end)
+			return "";
+		return xml.substr(i + 4, close - i - 4);
+	}
+	return "";
+}
+
+PidfDiff::PidfDiff() : mHasPrevious(false), mVersion(0) {
+}
+
+void PidfDiff::reset() {
+	mHasPrevious = false;
+}
+
+bool PidfDiff::parse(const string &pidf, Document &doc) {
+	// prolog, then the start tag of <presence>
+	size_t pos = 0;
+	while ((pos = pidf.find('<', pos)) != string::npos && (pidf[pos + 1] == '?' || pidf[pos + 1] == '!')) {
+		pos = pidf[pos + 1] == '!' && pidf.compare(pos, 4, "<!--") == 0 ? pidf.find("-->", pos) : findTagEnd(pidf, pos);
+		if (pos == string::npos)
+			return false;
+	}
+	if (pos == string::npos)
+		return false;
+	doc.prolog = pidf.substr(0, pos);
+	string root = tagName(pidf, pos);
+	size_t end = findTagEnd(pidf, pos);
+	if (end == string::npos)
+		return false;
+	bool empty = pidf[end - 1] == '/';
+	doc.rootAttributes = pidf.substr(pos + 1 + root.size(), end - pos - 1 - root.size() - (empty ? 1 : 0));
+	doc.elements.clear();
+	if (empty)
+		return true;
+
+	// children of <presence>, the text between them being formatting only
+	pos = end + 1;
+	while ((pos = pidf.find('<', pos)) != string::npos) {
+		if (pidf.compare(pos, 2, "</") == 0)
+			return true;
+		if (pidf.compare(pos, 4, "<!--") == 0) {
+			pos = pidf.find("-->", pos);
+			if (pos == string::npos)
+				return false;
+			continue;
+		}
+		size_t start = pos;
+		end = findTagEnd(pidf, pos);
+		if (end == string::npos)
+			return false;
+		string key = tagName(pidf, start) + "#" + tagId(pidf, start, end);
+		int depth = pidf[end - 1] == '/' ? 0 : 1;
+		pos = end + 1;
+		while (depth > 0) {
+			pos = pidf.find('<', pos);
+			if (pos == string::npos)
+				return false;
+			if (pidf.compare(pos, 4, "<!--") == 0) {
+				pos = pidf.find("-->", pos);
+				if (pos == string::npos)
+					return false;
+				continue;
+			}
+			end = findTagEnd(pidf, pos);
+			if (end == string::npos)
+				return false;
+			if (pidf[pos + 1] == '/')
+				--depth;
+			else if (pidf[end - 1] != '/')
+				++depth;
+			pos = end + 1;
+		}
+		doc.elements.push_back(make_pair(key, pidf.substr(start, pos - start)));
+	}
+	return false;
+}
+
+string PidfDiff::makeFull(const Document &doc) const {
+	string out = doc.prolog + "<p:pidf-full xmlns:p=\"" + sPidfDiffNs + "\"" + doc.rootAttributes + " version=\"" +
+				 to_string(mVersion) + "\">\n";
+	for (auto it = doc.elements.cbegin(); it != doc.elements.cend(); ++it) {
+		out += it->second + "\n";
+	}
+	return out + "</p:pidf-full>\n";
+}
+
+/* Invalid when an element cannot be designated without ambiguity by a selector. */
+string PidfDiff::makePatch(const Document &doc, bool &valid) const {
+	map<string, const string *> previous;
+	set<string> current;
+	valid = true;
+	for (auto it = mPrevious.elements.cbegin(); it != mPrevious.elements.cend(); ++it) {
+		valid = previous.insert(make_pair(it->first, &it->second)).second && valid;
+	}
+	for (auto it = doc.elements.cbegin(); it != doc.elements.cend(); ++it) {
+		valid = current.insert(it->first).second && valid;
+	}
+	if (!valid)
+		return "";
+
+	auto selector = [](const string &key) {
+		size_t sep = key.find('#');
+		string name = key.substr(0, sep);
+		string id = key.substr(sep + 1);
+		return "*/" + name + (id.empty() ? "" : "[@id='" + id + "']");
+	};
+	string ops;
+	for (auto it = previous.cbegin(); it != previous.cend(); ++it) {
+		if (current.find(it->first) == current.end())
+			ops += "<p:remove sel=\"" + selector(it->first) + "\"/>\n";
+	}
+	for (auto it = doc.elements.cbegin(); it != doc.elements.cend(); ++it) {
+		auto old = previous.find(it->first);
+		if (old == previous.end())
+			ops += "<p:add sel=\"*\">" + it->second + "</p:add>\n";
+		else if (*old->second != it->second)
+			ops += "<p:replace sel=\"" + selector(it->first) + "\">" + it->second + "</p:replace>\n";
+	}
+	return doc.prolog + "<p:patch xmlns:p=\"" + sPidfDiffNs + "\"" + doc.rootAttributes + " version=\"" +
+		   to_string(mVersion) + "\">\n" + ops + "</p:patch>\n";
+}
+
+string PidfDiff::update(const string &pidf) {
+	Document doc;
+	++mVersion;
+	if (!parse(pidf, doc)) {
+		// not understood, the subscriber gets the document as is and the next one is a full state
+		mHasPrevious = false;
+		return pidf;
+	}
+	string full = makeFull(doc);
+	string out = full;
+	if (mHasPrevious) {
+		bool valid;
+		string patch = makePatch(doc, valid);
+		if (valid && patch.size() < full.size())
+			out = patch;
+	}
+	mPrevious = doc;
+	mHasPrevious = true;
+	return out;
+}
+
+} /* namespace flexisip */
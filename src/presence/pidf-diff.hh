@@ -0,0 +1,62 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef flexisip_pidf_diff_hh
+#define flexisip_pidf_diff_hh
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace flexisip {
+
+/*
+ * Partial presence notifications (RFC 5262, RFC 5263): the successive PIDF documents notified to a subscriber are
+ * compared element by element, the children of <presence> being identified by their name and id attribute, and only
+ * the differences are sent as a patch of the previous version.
+ */
+class PidfDiff {
+  public:
+	PidfDiff();
+	/*
+	 * Returns the application/pidf-diff+xml document carrying the new state: a patch of the previously notified one
+	 * when it is known and the patch is smaller, the full state otherwise. The new state becomes the previous one.
+	 */
+	std::string update(const std::string &pidf);
+	/* The next document is a full state, as after a subscription refresh. */
+	void reset();
+
+  private:
+	struct Document {
+		std::string prolog;
+		std::string rootAttributes;
+		// key (name and id) and serialized element, in document order
+		std::vector<std::pair<std::string, std::string>> elements;
+	};
+	static bool parse(const std::string &pidf, Document &doc);
+	std::string makeFull(const Document &doc) const;
+	std::string makePatch(const Document &doc, bool &valid) const;
+
+	Document mPrevious;
+	bool mHasPrevious;
+	unsigned int mVersion;
+};
+
+} /* namespace flexisip */
+
+#endif
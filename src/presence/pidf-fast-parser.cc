@@ -0,0 +1,616 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "pidf-fast-parser.hh"
+#include "data-model.hxx"
+#include "rpid.hxx"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace flexisip {
+
+static const char *sPidfNs = "urn:ietf:params:xml:ns:pidf";
+static const char *sDataModelNs = "urn:ietf:params:xml:ns:pidf:data-model";
+static const char *sRpidNs = "urn:ietf:params:xml:ns:pidf:rpid";
+
+namespace {
+
+struct Tag {
+	string qname;
+	string ns;
+	string name;							 // local part of the name
+	vector<pair<string, string>> attributes; // without the namespace declarations
+	bool closing;
+	bool empty;
+
+	bool is(const char *ns_, const char *name_) const {
+		return ns == ns_ && name == name_;
+	}
+};
+
+/*
+ * Scanner of the document, every method returning false on what is not handled: DTD, CDATA sections, processing
+ * instructions, namespaces declared below the root element, entities other than the predefined and numeric ones.
+ */
+class Reader {
+  public:
+	Reader(const string &body) : mPos(body.data()), mEnd(body.data() + body.size()) {
+	}
+	/* Skips the BOM and the XML declaration, which must tell UTF-8 if it tells an encoding. */
+	bool readProlog();
+	/* Reads the next tag, only comments and white spaces may be found before it. */
+	bool readTag(Tag &tag, bool root = false);
+	/* Reads the text of an element up to its end tag. */
+	bool readText(const Tag &tag, string &text);
+	/* Skips an element that must be empty up to its end tag. */
+	bool skipContent(const Tag &tag);
+	bool atEnd();
+
+  private:
+	void skipMisc();
+	void skipSpaces();
+	bool readName(string &name);
+	bool decode(const char *begin, const char *end, string &out);
+	bool resolve(Tag &tag);
+
+	const char *mPos;
+	const char *mEnd;
+	string mDefaultNs;
+	vector<pair<string, string>> mPrefixes;
+};
+
+inline bool isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool startsWith(const char *pos, const char *end, const char *prefix) {
+	size_t len = strlen(prefix);
+	return (size_t)(end - pos) >= len && memcmp(pos, prefix, len) == 0;
+}
+
+void Reader::skipSpaces() {
+	while (mPos < mEnd && isSpace(*mPos))
+		++mPos;
+}
+
+void Reader::skipMisc() {
+	while (true) {
+		skipSpaces();
+		if (!startsWith(mPos, mEnd, "<!--"))
+			return;
+		static const char end[] = "-->";
+		const char *close = search(mPos + 4, mEnd, end, end + 3);
+		// an unterminated comment is reported as text, which is refused
+		if (close == mEnd)
+			return;
+		mPos = close + 3;
+	}
+}
+
+bool Reader::readProlog() {
+	if (startsWith(mPos, mEnd, "\xEF\xBB\xBF"))
+		mPos += 3;
+	if (startsWith(mPos, mEnd, "<?xml") && mEnd - mPos > 5 && isSpace(mPos[5])) {
+		static const char end[] = "?>";
+		const char *close = search(mPos, mEnd, end, end + 2);
+		if (close == mEnd)
+			return false;
+		string declaration(mPos, close);
+		size_t encoding = declaration.find("encoding");
+		if (encoding != string::npos) {
+			size_t quote = declaration.find_first_of("\"'", encoding);
+			if (quote == string::npos || quote + 6 >= declaration.size() ||
+				strncasecmp(declaration.c_str() + quote + 1, "utf-8", 5) != 0 ||
+				declaration[quote + 6] != declaration[quote])
+				return false;
+		}
+		mPos = close + 2;
+	}
+	return true;
+}
+
+bool Reader::readName(string &name) {
+	const char *begin = mPos;
+	while (mPos < mEnd && !isSpace(*mPos) && *mPos != '/' && *mPos != '>' && *mPos != '=' && *mPos != '<')
+		++mPos;
+	name.assign(begin, mPos);
+	return !name.empty();
+}
+
+bool Reader::decode(const char *begin, const char *end, string &out) {
+	out.clear();
+	while (begin < end) {
+		const char *amp = (const char *)memchr(begin, '&', end - begin);
+		if (amp == NULL) {
+			out.append(begin, end);
+			break;
+		}
+		out.append(begin, amp);
+		const char *semicolon = (const char *)memchr(amp, ';', min<ptrdiff_t>(end - amp, 12));
+		if (semicolon == NULL)
+			return false;
+		string entity(amp + 1, semicolon);
+		if (entity == "lt") {
+			out += '<';
+		} else if (entity == "gt") {
+			out += '>';
+		} else if (entity == "amp") {
+			out += '&';
+		} else if (entity == "quot") {
+			out += '"';
+		} else if (entity == "apos") {
+			out += '\'';
+		} else if (entity.size() > 1 && entity[0] == '#') {
+			bool hex = entity[1] == 'x';
+			const char *digits = entity.c_str() + (hex ? 2 : 1);
+			if (*digits == '\0' || strspn(digits, hex ? "0123456789abcdefABCDEF" : "0123456789") != strlen(digits))
+				return false;
+			unsigned long code = strtoul(digits, NULL, hex ? 16 : 10);
+			if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+				return false;
+			// to UTF-8
+			if (code < 0x80) {
+				out += (char)code;
+			} else if (code < 0x800) {
+				out += (char)(0xC0 | (code >> 6));
+				out += (char)(0x80 | (code & 0x3F));
+			} else if (code < 0x10000) {
+				out += (char)(0xE0 | (code >> 12));
+				out += (char)(0x80 | ((code >> 6) & 0x3F));
+				out += (char)(0x80 | (code & 0x3F));
+			} else {
+				out += (char)(0xF0 | (code >> 18));
+				out += (char)(0x80 | ((code >> 12) & 0x3F));
+				out += (char)(0x80 | ((code >> 6) & 0x3F));
+				out += (char)(0x80 | (code & 0x3F));
+			}
+		} else {
+			return false;
+		}
+		begin = semicolon + 1;
+	}
+	return true;
+}
+
+bool Reader::resolve(Tag &tag) {
+	size_t colon = tag.qname.find(':');
+	if (colon == string::npos) {
+		tag.ns = mDefaultNs;
+		tag.name = tag.qname;
+		return true;
+	}
+	string prefix = tag.qname.substr(0, colon);
+	tag.name = tag.qname.substr(colon + 1);
+	for (const auto &declared : mPrefixes) {
+		if (declared.first == prefix) {
+			tag.ns = declared.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Reader::readTag(Tag &tag, bool root) {
+	skipMisc();
+	if (mPos >= mEnd || *mPos != '<')
+		return false; // text where elements are expected
+	++mPos;
+	tag.attributes.clear();
+	tag.closing = mPos < mEnd && *mPos == '/';
+	tag.empty = false;
+	if (tag.closing) {
+		++mPos;
+		if (!readName(tag.qname))
+			return false;
+		skipSpaces();
+		if (mPos >= mEnd || *mPos != '>')
+			return false;
+		++mPos;
+		return resolve(tag);
+	}
+	if (!readName(tag.qname))
+		return false; // covers <! and <?, which start no name
+	if (tag.qname[0] == '!' || tag.qname[0] == '?')
+		return false;
+	while (true) {
+		skipSpaces();
+		if (mPos >= mEnd)
+			return false;
+		if (*mPos == '>') {
+			++mPos;
+			break;
+		}
+		if (*mPos == '/') {
+			if (mPos + 1 >= mEnd || mPos[1] != '>')
+				return false;
+			mPos += 2;
+			tag.empty = true;
+			break;
+		}
+		string name;
+		if (!readName(name))
+			return false;
+		skipSpaces();
+		if (mPos >= mEnd || *mPos != '=')
+			return false;
+		++mPos;
+		skipSpaces();
+		if (mPos >= mEnd || (*mPos != '"' && *mPos != '\''))
+			return false;
+		const char *close = (const char *)memchr(mPos + 1, *mPos, mEnd - mPos - 1);
+		if (close == NULL || memchr(mPos + 1, '<', close - mPos - 1) != NULL)
+			return false;
+		string value;
+		if (!decode(mPos + 1, close, value))
+			return false;
+		mPos = close + 1;
+		if (name == "xmlns" || name.compare(0, 6, "xmlns:") == 0) {
+			if (!root)
+				return false;
+			if (name.size() == 5)
+				mDefaultNs = value;
+			else
+				mPrefixes.emplace_back(name.substr(6), value);
+			continue;
+		}
+		tag.attributes.emplace_back(move(name), move(value));
+	}
+	return resolve(tag);
+}
+
+bool Reader::readText(const Tag &tag, string &text) {
+	if (tag.empty) {
+		text.clear();
+		return true;
+	}
+	const char *lt = (const char *)memchr(mPos, '<', mEnd - mPos);
+	if (lt == NULL || lt + 1 >= mEnd || lt[1] != '/')
+		return false; // child elements, comments or CDATA in the text
+	if (!decode(mPos, lt, text))
+		return false;
+	mPos = lt;
+	Tag end;
+	return readTag(end) && end.qname == tag.qname;
+}
+
+bool Reader::skipContent(const Tag &tag) {
+	if (tag.empty)
+		return true;
+	Tag end;
+	return readTag(end) && end.closing && end.qname == tag.qname;
+}
+
+bool Reader::atEnd() {
+	skipMisc();
+	return mPos == mEnd;
+}
+
+string trim(const string &value) {
+	size_t begin = 0, end = value.size();
+	while (begin < end && isSpace(value[begin]))
+		++begin;
+	while (end > begin && isSpace(value[end - 1]))
+		--end;
+	return value.substr(begin, end - begin);
+}
+
+bool readDigits(const char *p, int count, int &value) {
+	value = 0;
+	for (int i = 0; i < count; ++i) {
+		if (p[i] < '0' || p[i] > '9')
+			return false;
+		value = value * 10 + (p[i] - '0');
+	}
+	return true;
+}
+
+/* xs:dateTime, as YYYY-MM-DDThh:mm:ss[.s+][Z|(+|-)hh:mm] */
+unique_ptr<xml_schema::DateTime> parseDateTime(const string &value) {
+	const char *p = value.c_str();
+	int year, month, day, hours, minutes, secs;
+	if (value.size() < 19 || p[4] != '-' || p[7] != '-' || p[10] != 'T' || p[13] != ':' || p[16] != ':' ||
+		!readDigits(p, 4, year) || !readDigits(p + 5, 2, month) || !readDigits(p + 8, 2, day) ||
+		!readDigits(p + 11, 2, hours) || !readDigits(p + 14, 2, minutes) || !readDigits(p + 17, 2, secs))
+		return nullptr;
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hours > 23 || minutes > 59 || secs > 59)
+		return nullptr;
+	double seconds = secs;
+	p += 19;
+	if (*p == '.') {
+		double unit = 0.1;
+		if (p[1] < '0' || p[1] > '9')
+			return nullptr;
+		for (++p; *p >= '0' && *p <= '9'; ++p, unit /= 10)
+			seconds += (*p - '0') * unit;
+	}
+	if (*p == '\0')
+		return unique_ptr<xml_schema::DateTime>(new xml_schema::DateTime(year, month, day, hours, minutes, seconds));
+	if (p[0] == 'Z' && p[1] == '\0')
+		return unique_ptr<xml_schema::DateTime>(
+			new xml_schema::DateTime(year, month, day, hours, minutes, seconds, 0, 0));
+	int zoneHours, zoneMinutes;
+	if ((p[0] != '+' && p[0] != '-') || !readDigits(p + 1, 2, zoneHours) || p[3] != ':' ||
+		!readDigits(p + 4, 2, zoneMinutes) || p[6] != '\0' || zoneHours > 14 || zoneMinutes > 59)
+		return nullptr;
+	int sign = p[0] == '-' ? -1 : 1;
+	return unique_ptr<xml_schema::DateTime>(new xml_schema::DateTime(
+		year, month, day, hours, minutes, seconds, (short)(sign * zoneHours), (short)(sign * zoneMinutes)));
+}
+
+unique_ptr<pidf::Note> parseNote(Reader &reader, const Tag &tag) {
+	unique_ptr<pidf::Note> note(new pidf::Note());
+	for (const auto &attribute : tag.attributes) {
+		if (attribute.first != "xml:lang")
+			return nullptr;
+		note->setLang(namespace_::Lang(attribute.second));
+	}
+	string text;
+	if (!reader.readText(tag, text))
+		return nullptr;
+	*note += text;
+	return note;
+}
+
+/* pidf priority, a decimal between 0 and 1 */
+bool parsePriority(const string &value, double &priority) {
+	if (value.empty() || strspn(value.c_str(), "0123456789.") != value.size())
+		return false;
+	char *end;
+	priority = strtod(value.c_str(), &end);
+	return *end == '\0' && priority >= 0 && priority <= 1;
+}
+
+bool parseTuple(Reader &reader, const Tag &tag, pidf::Presence &presence) {
+	string id;
+	bool hasId = false;
+	for (const auto &attribute : tag.attributes) {
+		if (attribute.first != "id")
+			return false;
+		id = attribute.second;
+		hasId = true;
+	}
+	if (!hasId || tag.empty)
+		return false;
+
+	Tag child;
+	if (!reader.readTag(child) || child.closing || !child.is(sPidfNs, "status") || !child.attributes.empty())
+		return false;
+	pidf::Status status;
+	if (!child.empty) {
+		Tag basic;
+		if (!reader.readTag(basic))
+			return false;
+		if (!basic.closing) {
+			string value;
+			if (!basic.is(sPidfNs, "basic") || !basic.attributes.empty() || !reader.readText(basic, value) ||
+				(value != "open" && value != "closed"))
+				return false;
+			status.setBasic(pidf::Basic(value));
+			// the status extensions are left to the bindings
+			if (!reader.readTag(basic) || !basic.closing)
+				return false;
+		}
+		if (basic.qname != child.qname)
+			return false;
+	}
+
+	unique_ptr<pidf::Tuple> tuple(new pidf::Tuple(status, id));
+	int section = 0; // contact, notes then timestamp, as ordered by the schema
+	while (true) {
+		if (!reader.readTag(child))
+			return false;
+		if (child.closing) {
+			if (child.qname != tag.qname)
+				return false;
+			break;
+		}
+		if (child.is(sPidfNs, "contact") && section == 0) {
+			section = 1;
+			double priority = 0;
+			bool hasPriority = false;
+			for (const auto &attribute : child.attributes) {
+				if (attribute.first != "priority" || !parsePriority(attribute.second, priority))
+					return false;
+				hasPriority = true;
+			}
+			string value;
+			if (!reader.readText(child, value))
+				return false;
+			pidf::Contact contact(trim(value));
+			if (hasPriority)
+				contact.setPriority(pidf::Qvalue(priority));
+			tuple->setContact(contact);
+		} else if (child.is(sPidfNs, "note") && section <= 1) {
+			section = 1;
+			unique_ptr<pidf::Note> note = parseNote(reader, child);
+			if (!note)
+				return false;
+			tuple->getNote().push_back(move(note));
+		} else if (child.is(sPidfNs, "timestamp") && section <= 1) {
+			section = 2;
+			string value;
+			if (!child.attributes.empty() || !reader.readText(child, value))
+				return false;
+			unique_ptr<xml_schema::DateTime> timestamp = parseDateTime(trim(value));
+			if (!timestamp)
+				return false;
+			tuple->setTimestamp(move(timestamp));
+		} else {
+			return false;
+		}
+	}
+	presence.getTuple().push_back(move(tuple));
+	return true;
+}
+
+typedef void (*AddActivity)(rpid::Activities &activities);
+
+struct Activity {
+	const char *name;
+	AddActivity add;
+};
+
+/* the activities without content of rpid.xsd */
+const Activity sActivities[] = {
+	{"appointment", [](rpid::Activities &a) { a.getAppointment().push_back(rpid::Empty()); }},
+	{"away", [](rpid::Activities &a) { a.getAway().push_back(rpid::Empty()); }},
+	{"breakfast", [](rpid::Activities &a) { a.getBreakfast().push_back(rpid::Empty()); }},
+	{"busy", [](rpid::Activities &a) { a.getBusy().push_back(rpid::Empty()); }},
+	{"dinner", [](rpid::Activities &a) { a.getDinner().push_back(rpid::Empty()); }},
+	{"holiday", [](rpid::Activities &a) { a.getHoliday().push_back(rpid::Empty()); }},
+	{"in-transit", [](rpid::Activities &a) { a.getInTransit().push_back(rpid::Empty()); }},
+	{"looking-for-work", [](rpid::Activities &a) { a.getLookingForWork().push_back(rpid::Empty()); }},
+	{"meal", [](rpid::Activities &a) { a.getMeal().push_back(rpid::Empty()); }},
+	{"meeting", [](rpid::Activities &a) { a.getMeeting().push_back(rpid::Empty()); }},
+	{"on-the-phone", [](rpid::Activities &a) { a.getOnThePhone().push_back(rpid::Empty()); }},
+	{"performance", [](rpid::Activities &a) { a.getPerformance().push_back(rpid::Empty()); }},
+	{"permanent-absence", [](rpid::Activities &a) { a.getPermanentAbsence().push_back(rpid::Empty()); }},
+	{"playing", [](rpid::Activities &a) { a.getPlaying().push_back(rpid::Empty()); }},
+	{"presentation", [](rpid::Activities &a) { a.getPresentation().push_back(rpid::Empty()); }},
+	{"shopping", [](rpid::Activities &a) { a.getShopping().push_back(rpid::Empty()); }},
+	{"sleeping", [](rpid::Activities &a) { a.getSleeping().push_back(rpid::Empty()); }},
+	{"spectator", [](rpid::Activities &a) { a.getSpectator().push_back(rpid::Empty()); }},
+	{"steering", [](rpid::Activities &a) { a.getSteering().push_back(rpid::Empty()); }},
+	{"travel", [](rpid::Activities &a) { a.getTravel().push_back(rpid::Empty()); }},
+	{"tv", [](rpid::Activities &a) { a.getTv().push_back(rpid::Empty()); }},
+	{"vacation", [](rpid::Activities &a) { a.getVacation().push_back(rpid::Empty()); }},
+	{"working", [](rpid::Activities &a) { a.getWorking().push_back(rpid::Empty()); }},
+	{"worship", [](rpid::Activities &a) { a.getWorship().push_back(rpid::Empty()); }},
+	{"unknown", [](rpid::Activities &a) { a.setUnknown(rpid::Empty()); }},
+};
+
+AddActivity findActivity(const string &name) {
+	for (const auto &activity : sActivities) {
+		if (name == activity.name)
+			return activity.add;
+	}
+	return NULL;
+}
+
+bool parsePerson(Reader &reader, const Tag &tag, pidf::Presence &presence) {
+	string id;
+	bool hasId = false;
+	for (const auto &attribute : tag.attributes) {
+		if (attribute.first != "id")
+			return false;
+		id = attribute.second;
+		hasId = true;
+	}
+	if (!hasId)
+		return false;
+	unique_ptr<data_model::Person> person(new data_model::Person(id));
+	// the notes and the timestamp of the person are left to the bindings
+	while (!tag.empty) {
+		Tag child;
+		if (!reader.readTag(child))
+			return false;
+		if (child.closing) {
+			if (child.qname != tag.qname)
+				return false;
+			break;
+		}
+		if (!child.is(sRpidNs, "activities") || !child.attributes.empty())
+			return false;
+		unique_ptr<rpid::Activities> activities(new rpid::Activities());
+		while (!child.empty) {
+			Tag activity;
+			if (!reader.readTag(activity))
+				return false;
+			if (activity.closing) {
+				if (activity.qname != child.qname)
+					return false;
+				break;
+			}
+			AddActivity add = NULL;
+			if (activity.ns == sRpidNs && activity.attributes.empty())
+				add = findActivity(activity.name);
+			if (add == NULL || !reader.skipContent(activity))
+				return false;
+			add(*activities);
+		}
+		person->getActivities().push_back(move(activities));
+	}
+	presence.setPerson(move(person));
+	return true;
+}
+
+} // namespace
+
+unique_ptr<pidf::Presence> PidfFastParser::parse(const string &body) {
+	try {
+		Reader reader(body);
+		Tag root;
+		if (!reader.readProlog() || !reader.readTag(root, true) || root.closing || !root.is(sPidfNs, "presence"))
+			return nullptr;
+		string entity;
+		bool hasEntity = false;
+		for (const auto &attribute : root.attributes) {
+			if (attribute.first != "entity")
+				return nullptr;
+			entity = trim(attribute.second);
+			hasEntity = true;
+		}
+		if (!hasEntity)
+			return nullptr;
+		unique_ptr<pidf::Presence> presence(new pidf::Presence(entity));
+		int section = 0; // tuples, notes then person, as ordered by the schema
+		while (!root.empty) {
+			Tag tag;
+			if (!reader.readTag(tag))
+				return nullptr;
+			if (tag.closing) {
+				if (tag.qname != root.qname)
+					return nullptr;
+				break;
+			}
+			if (tag.is(sPidfNs, "tuple") && section == 0) {
+				if (!parseTuple(reader, tag, *presence))
+					return nullptr;
+			} else if (tag.is(sPidfNs, "note") && section <= 1) {
+				section = 1;
+				unique_ptr<pidf::Note> note = parseNote(reader, tag);
+				if (!note)
+					return nullptr;
+				presence->getNote().push_back(move(note));
+			} else if (tag.is(sDataModelNs, "person") && section <= 1) {
+				section = 2;
+				if (!parsePerson(reader, tag, *presence))
+					return nullptr;
+			} else {
+				return nullptr;
+			}
+		}
+		if (!reader.atEnd())
+			return nullptr;
+		return presence;
+	} catch (const xml_schema::Exception &) {
+		// a value refused by the model, the bindings tell why
+		return nullptr;
+	}
+}
+
+} /* namespace flexisip */
@@ -0,0 +1,44 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef flexisip_pidf_fast_parser_hh
+#define flexisip_pidf_fast_parser_hh
+
+#include <memory>
+#include <string>
+
+#include "pidf+xml.hxx"
+
+namespace flexisip {
+
+/*
+ * Streaming parser of the common shapes of the PIDF documents published by the clients: tuples made of a basic
+ * status, a contact, notes and a timestamp, plus a person with RPID activities. The object model is built while the
+ * document is scanned, instead of going through the DOM the xsd bindings first build with Xerces.
+ * Any other document, including the invalid ones, is left to the bindings, which report the errors: NULL is returned
+ * then, and whatever is not understood never ends up in the model.
+ */
+class PidfFastParser {
+  public:
+	static std::unique_ptr<pidf::Presence> parse(const std::string &body);
+};
+
+} /* namespace flexisip */
+
+#endif
@@ -12,6 +12,7 @@ public:
 	: mMainLoop(mainLoop), mInfo(info) {
 		AuthDbBackend::get(); /*this will initialize the database backend, which is good to know that it works at startup*/
 	}
+	/* For a batch, deleted once all the presentities have been resolved. */
 	PresenceAuthListener(belle_sip_main_loop_t *mainLoop, std::map<std::string,std::shared_ptr<PresentityPresenceInformation>> &dInfo)
 	: mMainLoop(mainLoop), mDInfo(dInfo) {
 		AuthDbBackend::get(); /*this will initialize the database backend, which is good to know that it works at startup*/
@@ -19,7 +20,8 @@ public:
 
 	virtual void onResult(AuthDbResult result, const std::string &passwd) {
 		belle_sip_source_cpp_func_t *func = new belle_sip_source_cpp_func_t([this, result, passwd](unsigned int events) {
-			this->processResponse(result, passwd);
+			this->processResponse(mInfo, result, passwd);
+			delete this;
 			return BELLE_SIP_STOP;
 		});
 		belle_sip_source_t *timer = belle_sip_main_loop_create_cpp_timeout(  mMainLoop
@@ -29,30 +31,43 @@ public:
 		belle_sip_object_unref(timer);
 	}
 	
+	/* Called once per part of the batch, each part being processed as soon as it is received. */
 	void onResults(list<std::string> &phones, set<std::string> &users) {
-		for(std::string phone : phones) {
-			if(users.size() == 0) {
-				this->onResult(PASSWORD_NOT_FOUND, phone);
-			} else if (users.find(phone) != users.end()){
-				this->onResult(PASSWORD_FOUND, phone);
-			} else {
-				this->onResult(PASSWORD_NOT_FOUND, phone);
-			}
-		}
+		belle_sip_source_cpp_func_t *func = new belle_sip_source_cpp_func_t([this, phones, users](unsigned int events) {
+			this->processResults(phones, users);
+			return BELLE_SIP_STOP;
+		});
+		belle_sip_source_t *timer = belle_sip_main_loop_create_cpp_timeout(  mMainLoop
+			, func
+			, 0
+			, "OnAuthListener to mainthread");
+		belle_sip_object_unref(timer);
 	}
 
 private:
 
-	void processResponse(AuthDbResult result, const std::string &user) {
-		std::shared_ptr<PresentityPresenceInformation> info;
-		bool must_delete = FALSE;
-		if(mInfo == nullptr) {
-			std::map<std::string,std::shared_ptr<PresentityPresenceInformation>>::iterator it = mDInfo.find(user);
-			info = it->second;
-		} else {
-			info = mInfo;
-			must_delete = TRUE;
+	void processResults(const list<std::string> &phones, const set<std::string> &users) {
+		for (const std::string &phone : phones) {
+			auto it = mDInfo.find(phone);
+			if (it == mDInfo.end())
+				continue;
+			std::shared_ptr<PresentityPresenceInformation> info = it->second;
+			mDInfo.erase(it);
+			if (users.find(phone) == users.end()) {
+				processResponse(info, PASSWORD_NOT_FOUND, phone);
+				continue;
+			}
+			// the user of a phone alias is in the cache once found
+			std::string user;
+			AuthDbBackend::get()->getCachedUserWithPhone(phone, belle_sip_uri_get_host(info->getEntity()), user);
+			processResponse(info, PASSWORD_FOUND, user.empty() ? phone : user);
+		}
+		if (mDInfo.empty()) {
+			delete this;
 		}
+	}
+
+	void processResponse(const std::shared_ptr<PresentityPresenceInformation> &info, AuthDbResult result, const std::string &user) {
 		const char* cuser = belle_sip_uri_get_user(info->getEntity());
 		if (result == AuthDbResult::PASSWORD_FOUND) {
 			// result is a phone alias if (and only if) user is not the same as the entity user
@@ -76,9 +91,6 @@ private:
 		} else {
 			SLOGD << __FILE__ << ": " << "Could not find user " << cuser << ".";
 		}
-		if(must_delete) {
-			delete this;
-		}
 	}
 	
 private:
@@ -108,11 +120,15 @@ void PresenceLongterm::onListenerEvents(list<std::shared_ptr<PresentityPresenceI
 	list<tuple<std::string,std::string,AuthDbListener*>> creds;
 	std::map<std::string,std::shared_ptr<PresentityPresenceInformation>> dInfo;
 	for (shared_ptr<PresentityPresenceInformation> &info : infos) {
-		if (!info->hasDefaultElement()) {
-			creds.push_back(make_tuple(belle_sip_uri_get_user(info->getEntity()), belle_sip_uri_get_host(info->getEntity()), new PresenceAuthListener(mMainLoop, info)));
-		}
-		dInfo.insert(std::pair<std::string,std::shared_ptr<PresentityPresenceInformation>>(belle_sip_uri_get_user(info->getEntity()), info));
+		const char *user = belle_sip_uri_get_user(info->getEntity());
+		if (!user || info->hasDefaultElement() || dInfo.find(user) != dInfo.end())
+			continue;
+		// reported to the listener of the batch, like the whole list
+		creds.push_back(make_tuple(user, belle_sip_uri_get_host(info->getEntity()), (AuthDbListener *)NULL));
+		dInfo.insert(std::pair<std::string,std::shared_ptr<PresentityPresenceInformation>>(user, info));
 	}
+	if (creds.empty())
+		return;
 	
 	AuthDbBackend::get()->getUsersWithPhone(creds
 										   , new PresenceAuthListener(mMainLoop, dInfo));
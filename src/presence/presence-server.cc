@@ -24,9 +24,11 @@
 #include "list-subscription.hh"
 #include "bellesip-signaling-exception.hh"
 #include "subscription.hh"
+#include "publish-workers.hh"
 #include "configmanager.hh"
 #include <string.h>
 #include <signal.h>
+#include <ctype.h>
 #include <algorithm>
 
 using namespace pidf;
@@ -69,10 +71,46 @@ PresenceServer::Init::Init() {
 									{Boolean, "leak-detector", "Enable belle-sip leak detector", "false"},
 									{Boolean, "long-term-enabled", "Enable long-term presence notifies", "true"},
 									{String, "bypass-condition", "If user agent contains it, can bypass extended notifiy verification.", "false"},
+									{Integer, "list-min-notify-interval",
+									 "Minimum time in seconds between two NOTIFY of a resource list subscription. The changes of the "
+									 "presentities received meanwhile are sent together in the next NOTIFY.",
+									 "2"},
+									{Integer, "publish-threads",
+									 "Number of threads parsing the bodies of the PUBLISH requests. The requests of a presentity "
+									 "are always parsed by the same thread, so that they are processed in order. With 0, they are "
+									 "parsed by the main thread.",
+									 "0"},
+									{Boolean, "redis-shared-state",
+									 "Share the publications with the other presence servers of the domain, through the Redis "
+									 "server of the registrar (module::Registrar/redis-server-domain, redis-server-port and "
+									 "redis-auth-password), so that several presence servers can serve the same domain. The "
+									 "publications received by each server are stored in Redis hashes, and their changes are "
+									 "announced on a pub/sub channel so that the subscribers of every server are notified of "
+									 "them. Requires a build with Redis support.",
+									 "false"},
+									{String, "resource-lists-file",
+									 "Path of a resource-lists document (RFC 4826) holding the resource lists served to the "
+									 "list subscriptions (RFC 4662) without resource list in their body. Each top-level list is "
+									 "the one of the user whose uri is its 'name' attribute, sent to the SUBSCRIBE for that uri. "
+									 "No list is provisioned if empty.",
+									 ""},
+									{Integer, "resource-lists-reload-interval",
+									 "Interval in seconds between two checks of the modification of the resource-lists-file, "
+									 "which is loaded again when it changed. Never checked again with 0.",
+									 "60"},
 									config_item_end};
 	GenericStruct *s = new GenericStruct("presence-server", "Flexisip presence server parameters.", 0);
 	GenericManager::get()->getRoot()->addChild(s);
 	s->addChildrenValues(items);
+	s->createStat("count-list-notifies", "Number of NOTIFY sent for resource list subscriptions.");
+	s->createStat("count-list-coalesced-changes",
+				  "Number of presentity changes sent in the NOTIFY of another change of the same resource list "
+				  "subscription.");
+	s->createStat("count-shared-state-writes",
+				  "Number of writes of the publications of a presentity to the state shared with the other presence "
+				  "servers.");
+	s->createStat("count-shared-state-updates",
+				  "Number of presentities updated with the publications received by the other presence servers.");
 }
 
 PresenceServer::PresenceServer() throw(FlexisipException)
@@ -84,6 +122,7 @@ PresenceServer::PresenceServer() throw(FlexisipException)
 	belle_sip_object_enable_leak_detector(GenericManager::get()->getRoot()->get<GenericStruct>("presence-server")->get<ConfigBoolean>("leak-detector")->read());
 	mStack = belle_sip_stack_new(NULL);
 	mProvider = belle_sip_stack_create_provider(mStack, NULL);
+	mExpiryWheel.reset(new ExpiryWheel(belle_sip_stack_get_main_loop(mStack)));
 	//bctbx_set_log_handler(_belle_sip_log);
 	//belle_sip_set_log_level(BELLE_SIP_LOG_MESSAGE);
 
@@ -114,6 +153,21 @@ PresenceServer::PresenceServer() throw(FlexisipException)
 	mDefaultExpires = config->get<ConfigInt>("expires")->read();
 	mBypass = config->get<ConfigString>("bypass-condition")->read();
 	mEnabled = config->get<ConfigBoolean>("enabled")->read();
+	mListMinNotifyInterval = config->get<ConfigInt>("list-min-notify-interval")->read();
+	mCountListNotifies = config->get<StatCounter64>("count-list-notifies");
+	mCountListCoalesced = config->get<StatCounter64>("count-list-coalesced-changes");
+	mCountSharedStateWrites = config->get<StatCounter64>("count-shared-state-writes");
+	mCountSharedStateUpdates = config->get<StatCounter64>("count-shared-state-updates");
+	string resourceListsFile = config->get<ConfigString>("resource-lists-file")->read();
+	if (!resourceListsFile.empty()) {
+		int reloadInterval = config->get<ConfigInt>("resource-lists-reload-interval")->read();
+		mResourceLists.reset(new FileResourceListManager(resourceListsFile, (unsigned int)max(reloadInterval, 0)));
+	}
+	int publishThreads = config->get<ConfigInt>("publish-threads")->read();
+	if (publishThreads > 0) {
+		mPublishWorkers.reset(new PublishWorkers(belle_sip_stack_get_main_loop(mStack), publishThreads,
+												 [this](PublishWorkers::Job &job) { onPublishParsed(job); }));
+	}
 }
 
 static void remove_listening_point(belle_sip_listening_point_t* lp,belle_sip_provider_t* prov) {
@@ -128,6 +182,10 @@ PresenceServer::~PresenceServer() {
 	belle_sip_list_free(tmp_list);
 
 	stop();
+	mPublishWorkers.reset();
+	mSharedState.reset();
+	mExpiryWheel.reset();
+	mResourceLists.reset();
 	belle_sip_object_unref(mProvider);
 	belle_sip_object_unref(mStack);
 	belle_sip_object_unref(mListener);
@@ -171,6 +229,7 @@ void PresenceServer::_start(bool withThread) throw(FlexisipException) {
 				throw FLEXISIP_EXCEPTION << "Cannot add lp for [" << *it << "]";
 		}
 	}
+	startSharedState();
 	if (withThread){
 		mIterateThread.reset (new thread([this]() {
 			while (mStarted)
@@ -179,6 +238,26 @@ void PresenceServer::_start(bool withThread) throw(FlexisipException) {
 	}
 }
 
+void PresenceServer::startSharedState() {
+	GenericStruct *cr = GenericManager::get()->getRoot();
+	if (!cr->get<GenericStruct>("presence-server")->get<ConfigBoolean>("redis-shared-state")->read())
+		return;
+#ifdef ENABLE_REDIS
+	// the settings of the registrar, whose Redis server is already deployed with the proxies
+	GenericStruct *registrar = cr->get<GenericStruct>("module::Registrar");
+	PresenceSharedState::Parameters params;
+	params.domain = registrar->get<ConfigString>("redis-server-domain")->read();
+	params.port = registrar->get<ConfigInt>("redis-server-port")->read();
+	params.auth = registrar->get<ConfigString>("redis-auth-password")->read();
+	params.reconnectMinDelay = registrar->get<ConfigInt>("redis-reconnect-min-delay")->read();
+	params.reconnectMaxDelay = registrar->get<ConfigInt>("redis-reconnect-max-delay")->read();
+	mSharedState.reset(new PresenceSharedState(belle_sip_stack_get_main_loop(mStack), params, *this));
+	mSharedState->connect();
+#else
+	LOGF("Unable to start presence server : redis-shared-state requires flexisip to be built with Redis support.");
+#endif
+}
+
 void PresenceServer::start() throw(FlexisipException) {
 	_start(true);
 }
@@ -230,24 +309,32 @@ void PresenceServer::processRequestEvent(PresenceServer *thiz, const belle_sip_r
 			throw BELLESIP_SIGNALING_EXCEPTION_1(405, BELLE_SIP_HEADER(belle_sip_header_allow_create("PUBLISH")))
 				<< "Unsupported method [" << belle_sip_request_get_method(request) << "]";
 		}
+	} catch (std::exception &) {
+		thiz->sendErrorResponse(request, NULL);
+	}
+}
+
+/* Answers the request with the exception being handled, statelessly when there is no transaction. */
+void PresenceServer::sendErrorResponse(belle_sip_request_t *request, belle_sip_server_transaction_t *transaction) {
+	belle_sip_response_t *resp;
+	try {
+		throw;
 	} catch (BelleSipSignalingException &e) {
 		SLOGE << e.what();
-		belle_sip_response_t *resp = belle_sip_response_create_from_request(request, e.getStatusCode());
+		resp = belle_sip_response_create_from_request(request, e.getStatusCode());
 		for (belle_sip_header_t *header : e.getHeaders())
 			belle_sip_message_add_header(BELLE_SIP_MESSAGE(resp), header);
-		belle_sip_provider_send_response(thiz->mProvider, resp);
-		return;
 	} catch (FlexisipException &e2) {
 		SLOGE << e2;
-		belle_sip_response_t *resp = belle_sip_response_create_from_request(request, 500);
-		belle_sip_provider_send_response(thiz->mProvider, resp);
-		return;
+		resp = belle_sip_response_create_from_request(request, 500);
 	} catch (std::exception &e3) {
 		SLOGE << "Unknown exception [" << e3.what() <<" <<use FlexisipException instead";
-		belle_sip_response_t *resp = belle_sip_response_create_from_request(request, 500);
-		belle_sip_provider_send_response(thiz->mProvider, resp);
-		return;
+		resp = belle_sip_response_create_from_request(request, 500);
 	}
+	if (transaction)
+		belle_sip_server_transaction_send_response(transaction, resp);
+	else
+		belle_sip_provider_send_response(mProvider, resp);
 }
 void PresenceServer::processResponseEvent(PresenceServer *thiz, const belle_sip_response_event_t *event) {
 	belle_sip_response_t* resp = belle_sip_response_event_get_response(event);
@@ -279,6 +366,35 @@ void PresenceServer::processTransactionTerminated(PresenceServer *thiz,
 void PresenceServer::processPublishRequestEvent(const belle_sip_request_event_t *event) throw(BelleSipSignalingException,
 																							  FlexisipException) {
 	belle_sip_request_t *request = belle_sip_request_event_get_request(event);
+	if (!mPublishWorkers) {
+		processPublishRequest(request, NULL, NULL);
+		return;
+	}
+	// the entity of the body must be the From, so it already tells the presentity
+	string presentity;
+	belle_sip_header_from_t *from = belle_sip_message_get_header_by_type(request, belle_sip_header_from_t);
+	if (from) {
+		const belle_sip_uri_t *uri = belle_sip_header_address_get_uri(BELLE_SIP_HEADER_ADDRESS(from));
+		if (belle_sip_uri_get_user(uri))
+			presentity = belle_sip_uri_get_user(uri);
+		string host = belle_sip_uri_get_host(uri) ? belle_sip_uri_get_host(uri) : "";
+		transform(host.begin(), host.end(), host.begin(), ::tolower);
+		presentity += "@" + host;
+	}
+	mPublishWorkers->submit(presentity, request, belle_sip_provider_create_server_transaction(mProvider, request));
+}
+
+void PresenceServer::onPublishParsed(PublishWorkers::Job &job) {
+	try {
+		processPublishRequest(job.request, job.transaction, &job);
+	} catch (std::exception &) {
+		sendErrorResponse(job.request, job.transaction);
+	}
+}
+
+void PresenceServer::processPublishRequest(belle_sip_request_t *request, belle_sip_server_transaction_t *transaction,
+										   PublishWorkers::Job *parsed) throw(BelleSipSignalingException,
+																			   FlexisipException) {
 	std::shared_ptr<PresentityPresenceInformation> presenceInfo;
 
 	/*rfc3903
@@ -432,12 +548,16 @@ void PresenceServer::processPublishRequestEvent(const belle_sip_request_event_t
 
 	if (belle_sip_message_get_body_size(BELLE_SIP_MESSAGE(request)) > 0) {
 		::std::unique_ptr<pidf::Presence> presence_body = NULL;
-		try {
-			istringstream data(belle_sip_message_get_body(BELLE_SIP_MESSAGE(request)));
-			presence_body = parsePresence(data, xml_schema::Flags::dont_validate);
-		} catch (const xml_schema::Exception &e) {
+		string error;
+		if (parsed) {
+			presence_body = move(parsed->presence);
+			error = parsed->error;
+		} else {
+			presence_body = PublishWorkers::parse(belle_sip_message_get_body(BELLE_SIP_MESSAGE(request)), error);
+		}
+		if (!presence_body) {
 			ostringstream os;
-			os << "Cannot parse body caused by [" << e << "]";
+			os << "Cannot parse body caused by [" << error << "]";
 			// todo check error code
 			throw BELLESIP_SIGNALING_EXCEPTION_1(400, belle_sip_header_create("Warning", os.str().c_str())) << os.str();
 		}
@@ -529,9 +649,9 @@ void PresenceServer::processPublishRequestEvent(const belle_sip_request_event_t
 		belle_sip_message_add_header(BELLE_SIP_MESSAGE(resp),
 									 (BELLE_SIP_HEADER(belle_sip_header_expires_create(expires))));
 	}
-	belle_sip_server_transaction_t *server_transaction =
-		belle_sip_provider_create_server_transaction(mProvider, request);
-	belle_sip_server_transaction_send_response(server_transaction, resp);
+	if (!transaction)
+		transaction = belle_sip_provider_create_server_transaction(mProvider, request);
+	belle_sip_server_transaction_send_response(transaction, resp);
 }
 
 void PresenceServer::processSubscribeRequestEvent(const belle_sip_request_event_t *event) throw(BelleSipSignalingException,
@@ -653,17 +773,28 @@ void PresenceServer::processSubscribeRequestEvent(const belle_sip_request_event_
 			belle_sip_message_add_header(BELLE_SIP_MESSAGE(resp),
 										 BELLE_SIP_HEADER(belle_sip_header_expires_create(expires)));
 
+			bool eventList = supported && belle_sip_list_find_custom(belle_sip_header_supported_get_supported(supported),
+																	  (belle_sip_compare_func)strcasecmp, "eventlist");
 			// case of rfc5367 (list subscription with resource list in body
-			if (supported && belle_sip_list_find_custom(belle_sip_header_supported_get_supported(supported),
-														(belle_sip_compare_func)strcasecmp, "eventlist") &&
-				content_disposition &&
+			bool recipientList = content_disposition &&
 				(strcasecmp(belle_sip_header_content_disposition_get_content_disposition(content_disposition),
-							"recipient-list") == 0)) {
-
-				SLOGD << "Subscribe for resource list "
+							"recipient-list") == 0);
+			// otherwise rfc4662, with the list of the request uri if provisioned
+			shared_ptr<const FileResourceListManager::List> provisionedList;
+			if (eventList && !recipientList && mResourceLists)
+				provisionedList = mResourceLists->find(belle_sip_request_get_uri(request));
+			if (eventList && (recipientList || provisionedList)) {
+
+				SLOGD << "Subscribe for " << (recipientList ? "" : "provisioned ") << "resource list "
 					  << "for dialog [" << BELLE_SIP_OBJECT(dialog) << "]";
 
-				shared_ptr<ListSubscription> listSubscription = make_shared<ListSubscription>(expires, server_transaction, mProvider); // will be release when last PresentityPresenceInformationListener is released
+				// will be release when last PresentityPresenceInformationListener is released
+				chrono::seconds minNotifyInterval(max(mListMinNotifyInterval, 0));
+				shared_ptr<ListSubscription> listSubscription = recipientList
+					? make_shared<ListSubscription>(expires, server_transaction, mProvider, minNotifyInterval)
+					: make_shared<ListSubscription>(expires, server_transaction, mProvider, *provisionedList,
+													minNotifyInterval);
+				listSubscription->setStatCounters(mCountListNotifies, mCountListCoalesced);
 				if (acceptEncodingHeader) listSubscription->setAcceptEncodingHeader(acceptEncodingHeader);
 				// send 200ok late to allow deeper anylise of request
 				belle_sip_server_transaction_send_response(server_transaction, resp);
@@ -685,6 +816,9 @@ void PresenceServer::processSubscribeRequestEvent(const belle_sip_request_event_
 
 				shared_ptr<PresentityPresenceInformationListener> subscription =
 					make_shared<PresenceSubscription>(expires, belle_sip_request_get_uri(request), dialog, mProvider);
+				shared_ptr<PresenceSubscription> presenceSubscription = dynamic_pointer_cast<PresenceSubscription>(subscription);
+				presenceSubscription->setAcceptHeader(belle_sip_message_get_header(BELLE_SIP_MESSAGE(request), "Accept"));
+				presenceSubscription->enablePartialNotify(presenceSubscription->isAccepted("application/pidf-diff+xml"));
 				belle_sip_dialog_set_application_data(dialog, new shared_ptr<Subscription>(dynamic_pointer_cast<Subscription>(subscription)));
 				SLOGD << " setting sub pointer [" << belle_sip_dialog_get_application_data(dialog) << "] to dialog ["
 					  << dialog << "]";
@@ -755,6 +889,10 @@ void PresenceServer::processSubscribeRequestEvent(const belle_sip_request_event_
 				if (dynamic_pointer_cast<PresentityPresenceInformationListener>(subscription)) {
 					shared_ptr<PresentityPresenceInformationListener> listener =
 						dynamic_pointer_cast<PresentityPresenceInformationListener>(subscription);
+					// the notification of a refresh carries the full state (rfc5263)
+					shared_ptr<PresenceSubscription> presenceSubscription = dynamic_pointer_cast<PresenceSubscription>(subscription);
+					if (presenceSubscription && presenceSubscription->isAccepted("application/pidf-diff+xml"))
+						presenceSubscription->enablePartialNotify(true);
 					addOrUpdateListener(listener, expires);
 				} else {
 					// list subscription case
@@ -800,6 +938,9 @@ void PresenceServer::addPresenceInfo(const std::shared_ptr<PresentityPresenceInf
 	for (auto& listener : mPresenceInfoObservers) {
 		listener->onNewPresenceInfo(presenceInfo);
 	}
+	// the publications received by the other servers, notified once fetched
+	if (mSharedState)
+		mSharedState->fetch(PresenceSharedState::getPresentity(presenceInfo->getEntity()));
 }
 
 void PresenceServer::addPresenceInfoObserver(const std::shared_ptr<PresenceInfoObserver> &observer) {
@@ -833,7 +974,7 @@ void PresenceServer::invalidateETag(const string &eTag) {
 			SLOGD << "Presentity [" << *presenceInfo << "] no longuer referenced by any SUBSCRIBE nor PUBLISH, removing";
 			mPresenceInformations.erase(presenceInfo->getEntity());
 		}
-		mPresenceInformationsByEtag.erase(eTag);
+		mPresenceInformationsByEtag.erase(presenceInformationsByEtagIt);
 		SLOGD <<"Etag manager size ["<<mPresenceInformationsByEtag.size()<<"]";
 	}
 
@@ -842,8 +983,9 @@ void PresenceServer::modifyEtag(const string &oldEtag, const string &newEtag) th
 	auto presenceInformationsByEtagIt = mPresenceInformationsByEtag.find(oldEtag);
 	if (presenceInformationsByEtagIt == mPresenceInformationsByEtag.end())
 		throw FLEXISIP_EXCEPTION << "Unknown etag [" << oldEtag << "]";
-	mPresenceInformationsByEtag[newEtag] = presenceInformationsByEtagIt->second;
-	mPresenceInformationsByEtag.erase(oldEtag);
+	shared_ptr<PresentityPresenceInformation> presenceInfo = presenceInformationsByEtagIt->second;
+	mPresenceInformationsByEtag.erase(presenceInformationsByEtagIt);
+	mPresenceInformationsByEtag[newEtag] = presenceInfo;
 }
 void PresenceServer::addEtag(const std::shared_ptr<PresentityPresenceInformation> &info,
 							 const string &etag) throw(FlexisipException) {
@@ -929,6 +1071,69 @@ void PresenceServer::removeListener(const shared_ptr<PresentityPresenceInformati
 			  << (long)&listener << "]";
 }
 
+void PresenceServer::onPublicationsChanged(const shared_ptr<PresentityPresenceInformation> &info) {
+	if (!mSharedState)
+		return;
+	time_t expireAt;
+	string pidf;
+	try {
+		pidf = info->getLocalPidf(expireAt);
+	} catch (FlexisipException &e) {
+		SLOGE << "Cannot share the publications of " << *info << ": " << e;
+		return;
+	}
+	mSharedState->publish(PresenceSharedState::getPresentity(info->getEntity()), expireAt, pidf);
+	mCountSharedStateWrites->incr();
+}
+
+void PresenceServer::onSharedStateConnected() {
+	// the changes announced while disconnected are lost, and Redis may have restarted without the local publications
+	for (auto &entry : mPresenceInformations) {
+		if (entry.second->getNumberOfInformationElements() > 0)
+			onPublicationsChanged(entry.second);
+		mSharedState->fetch(PresenceSharedState::getPresentity(entry.second->getEntity()));
+	}
+}
+
+shared_ptr<PresentityPresenceInformation> PresenceServer::getPresenceInfoByPresentity(const string &presentity) const {
+	belle_sip_uri_t *uri = belle_sip_uri_parse(("sip:" + presentity).c_str());
+	if (!uri)
+		return NULL;
+	belle_sip_object_ref(uri); // initial ref = 0;
+	shared_ptr<PresentityPresenceInformation> info = getPresenceInfo(uri);
+	belle_sip_object_unref(uri);
+	return info;
+}
+
+void PresenceServer::onSharedStateChanged(const string &presentity) {
+	// only the presentities known by this server are followed
+	if (getPresenceInfoByPresentity(presentity))
+		mSharedState->fetch(presentity);
+}
+
+void PresenceServer::onSharedStateFetched(const string &presentity,
+										  list<PresenceSharedState::Publication> &publications) {
+	shared_ptr<PresentityPresenceInformation> info = getPresenceInfoByPresentity(presentity);
+	if (!info)
+		return; // forgotten meanwhile
+	list<RemotePublication> remotes;
+	for (auto &publication : publications) {
+		RemotePublication remote;
+		string error;
+		remote.presence = PublishWorkers::parse(publication.pidf, error);
+		if (!remote.presence) {
+			SLOGE << "Invalid publications of server [" << publication.origin << "] for [" << presentity
+				  << "]: " << error;
+			continue;
+		}
+		remote.origin = publication.origin;
+		remote.expireAt = publication.expireAt;
+		remotes.push_back(move(remote));
+	}
+	info->setRemotePublications(remotes);
+	mCountSharedStateUpdates->incr();
+}
+
 void PresenceServer::removeSubscription(shared_ptr<Subscription> &subscription) throw() {
 	subscription->setState(Subscription::State::terminated);
 	if (dynamic_pointer_cast<PresenceSubscription>(subscription)) {
@@ -946,6 +1151,10 @@ void PresenceServer::removeSubscription(shared_ptr<Subscription> &subscription)
 	}
 }
 
+ExpiryWheel &PresenceServer::getExpiryWheel() {
+	return *mExpiryWheel;
+}
+
 belle_sip_main_loop_t* PresenceServer::getBelleSipMainLoop() {
 	return belle_sip_stack_get_main_loop(this->mStack);
 }
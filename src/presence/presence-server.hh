@@ -30,6 +30,10 @@
 //#include "presence-configmanager.hh"
 //#include "presentity-presenceinformation.hh"
 #include "presentity-manager.hh"
+#include "publish-workers.hh"
+#include "presence-shared-state.hh"
+#include "expiry-wheel.hh"
+#include "file-resource-list-manager.hh"
 #include "belle-sip/sip-uri.h"
 
 typedef struct belle_sip_main_loop belle_sip_main_loop_t;
@@ -42,6 +46,7 @@ typedef struct belle_sip_response_event belle_sip_response_event_t;
 typedef struct belle_sip_timeout_event belle_sip_timeout_event_t;
 typedef struct belle_sip_transaction_terminated_event belle_sip_transaction_terminated_event_t;
 typedef struct structbelle_sip_listener_t belle_sip_listener_t;
+class StatCounter64;
 
 
 
@@ -67,7 +72,7 @@ public:
 	virtual void onListenerEvents(std::list<std::shared_ptr<PresentityPresenceInformation>>& infos) const = 0;
 };
 
-class PresenceServer : public PresentityManager {
+class PresenceServer : public PresentityManager, private PresenceSharedState::Listener {
 public:
 	PresenceServer() throw (FlexisipException);
 	~PresenceServer();
@@ -94,6 +99,15 @@ private:
 	std::unique_ptr<std::thread> mIterateThread;
 	int mDefaultExpires;
 	std::string mBypass;
+	int mListMinNotifyInterval;
+	StatCounter64 *mCountListNotifies;
+	StatCounter64 *mCountListCoalesced;
+	std::unique_ptr<PublishWorkers> mPublishWorkers;
+	std::unique_ptr<PresenceSharedState> mSharedState;
+	std::unique_ptr<ExpiryWheel> mExpiryWheel;
+	std::unique_ptr<FileResourceListManager> mResourceLists;
+	StatCounter64 *mCountSharedStateWrites;
+	StatCounter64 *mCountSharedStateUpdates;
 
 	// belle sip cbs
 	static void processDialogTerminated(PresenceServer * thiz, const belle_sip_dialog_terminated_event_t *event);
@@ -104,7 +118,12 @@ private:
 	static void processTransactionTerminated(PresenceServer * thiz, const belle_sip_transaction_terminated_event_t *event);
 	void _start(bool withThread) throw (FlexisipException);
 	void processPublishRequestEvent(const belle_sip_request_event_t *event) throw (BelleSipSignalingException,FlexisipException);
+	// parsed is NULL when the body is still to be parsed
+	void processPublishRequest(belle_sip_request_t *request, belle_sip_server_transaction_t *transaction, PublishWorkers::Job *parsed) throw (BelleSipSignalingException,FlexisipException);
+	void onPublishParsed(PublishWorkers::Job &job);
+	void sendErrorResponse(belle_sip_request_t *request, belle_sip_server_transaction_t *transaction);
 	void processSubscribeRequestEvent(const belle_sip_request_event_t *event) throw (BelleSipSignalingException,FlexisipException);
+	void startSharedState();
 
 
 	/*
@@ -121,7 +140,7 @@ private:
 	void invalidateETag(const std::string& eTag) ;
 	void modifyEtag(const std::string& oldEtag, const std::string& newEtag) throw (FlexisipException);
 	void addEtag(const std::shared_ptr<PresentityPresenceInformation>& info,const std::string& etag) throw (FlexisipException);
-	std::map<std::string,std::shared_ptr<PresentityPresenceInformation>> mPresenceInformationsByEtag;
+	std::unordered_map<std::string,std::shared_ptr<PresentityPresenceInformation>> mPresenceInformationsByEtag;
 	std::unordered_map<const belle_sip_uri_t*,std::shared_ptr<PresentityPresenceInformation>,std::hash<const belle_sip_uri_t*>,bellesip::UriComparator> mPresenceInformations;
 
 	/*
@@ -134,6 +153,17 @@ private:
 	void addOrUpdateListeners(std::list<std::shared_ptr<PresentityPresenceInformationListener>>& listerner,int expires);
 	void addOrUpdateListeners(std::list<std::shared_ptr<PresentityPresenceInformationListener>>& listerner);
 	void removeListener(const std::shared_ptr<PresentityPresenceInformationListener>& listerner);
+	void onPublicationsChanged(const std::shared_ptr<PresentityPresenceInformation> &info);
+	ExpiryWheel &getExpiryWheel();
+
+	/*
+	 *Shared state API
+	 *
+	 */
+	void onSharedStateConnected();
+	void onSharedStateChanged(const std::string &presentity);
+	void onSharedStateFetched(const std::string &presentity, std::list<PresenceSharedState::Publication> &publications);
+	std::shared_ptr<PresentityPresenceInformation> getPresenceInfoByPresentity(const std::string &presentity) const;
 
 	void removeSubscription(std::shared_ptr<Subscription> &identity) throw();
 	//void notify(Subscription& subscription,PresentityPresenceInformation& presenceInformation) throw (FlexisipException);
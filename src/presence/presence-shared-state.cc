@@ -0,0 +1,274 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifdef ENABLE_REDIS
+
+#include "presence-shared-state.hh"
+#include "redis-bellesip-event.h"
+#include "log/logmanager.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+
+namespace flexisip {
+
+static const char *sChannel = "flexisip-presence";
+
+/*
+ * KEYS[1]: hash of the presentity, ARGV: server id, "<expire unix time>\n<pidf>" or empty to remove, ttl, channel,
+ * presentity. The hash lives as long as its latest publication.
+ */
+static const char *sPublishScript =
+	"if ARGV[2] == '' then redis.call('HDEL', KEYS[1], ARGV[1]) "
+	"else redis.call('HSET', KEYS[1], ARGV[1], ARGV[2]) "
+	"if redis.call('TTL', KEYS[1]) < tonumber(ARGV[3]) then redis.call('EXPIRE', KEYS[1], ARGV[3]) end end "
+	"redis.call('PUBLISH', ARGV[4], ARGV[1] .. ' ' .. ARGV[5]) return 0";
+
+static string getKey(const string &presentity) {
+	return "presence:" + presentity;
+}
+
+PresenceSharedState::PresenceSharedState(belle_sip_main_loop_t *mainLoop, const Parameters &params, Listener &listener)
+	: mMainLoop(mainLoop), mParams(params), mListener(listener), mContext(NULL), mSubscribeContext(NULL),
+	  mConnectedCount(0), mReconnectTimer(NULL), mReconnectDelay(0), mShuttingDown(false) {
+	char id[17];
+	belle_sip_random_token(id, sizeof(id));
+	mServerId = id;
+}
+
+PresenceSharedState::~PresenceSharedState() {
+	mShuttingDown = true;
+	if (mReconnectTimer) {
+		belle_sip_source_cancel(mReconnectTimer);
+		belle_sip_object_unref(mReconnectTimer);
+	}
+	// the pending callbacks are called with no reply, and the disconnection ones reset the contexts
+	if (mContext)
+		redisAsyncFree(mContext);
+	if (mSubscribeContext)
+		redisAsyncFree(mSubscribeContext);
+}
+
+string PresenceSharedState::getPresentity(const belle_sip_uri_t *entity) {
+	string presentity = belle_sip_uri_get_user(entity) ? belle_sip_uri_get_user(entity) : "";
+	string host = belle_sip_uri_get_host(entity) ? belle_sip_uri_get_host(entity) : "";
+	transform(host.begin(), host.end(), host.begin(), ::tolower);
+	return presentity + "@" + host;
+}
+
+redisAsyncContext *PresenceSharedState::connectContext() {
+	redisAsyncContext *c = redisAsyncConnect(mParams.domain.c_str(), mParams.port);
+	if (c->err) {
+		SLOGE << "Presence shared state: cannot connect to Redis [" << mParams.domain << ":" << mParams.port
+			  << "]: " << c->errstr;
+		redisAsyncFree(c);
+		return NULL;
+	}
+	c->data = this;
+	if (redisBelleSipAttach(c, mMainLoop) != REDIS_OK) {
+		SLOGE << "Presence shared state: cannot attach the Redis connection to the main loop";
+		redisAsyncFree(c);
+		return NULL;
+	}
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+	redisAsyncSetConnectCallback(c, sConnectCallback);
+#endif
+	redisAsyncSetDisconnectCallback(c, sDisconnectCallback);
+	if (!mParams.auth.empty())
+		redisAsyncCommand(c, sHandleAuth, NULL, "AUTH %s", mParams.auth.c_str());
+	return c;
+}
+
+void PresenceSharedState::connect() {
+	if (!mContext) {
+		mContext = connectContext();
+#ifdef WITHOUT_HIREDIS_CONNECT_CALLBACK
+		if (mContext)
+			onConnect(mContext, REDIS_OK);
+#endif
+	}
+	if (!mSubscribeContext) {
+		mSubscribeContext = connectContext();
+		if (mSubscribeContext) {
+			redisAsyncCommand(mSubscribeContext, sHandleMessage, NULL, "SUBSCRIBE %s", sChannel);
+#ifdef WITHOUT_HIREDIS_CONNECT_CALLBACK
+			onConnect(mSubscribeContext, REDIS_OK);
+#endif
+		}
+	}
+	if (!mContext || !mSubscribeContext)
+		scheduleReconnect();
+}
+
+bool PresenceSharedState::isConnected() const {
+	return mConnectedCount == 2;
+}
+
+void PresenceSharedState::scheduleReconnect() {
+	if (mShuttingDown || mReconnectTimer)
+		return;
+	mReconnectDelay = mReconnectDelay ? min(2 * mReconnectDelay, mParams.reconnectMaxDelay) : mParams.reconnectMinDelay;
+	SLOGI << "Presence shared state: reconnecting to Redis in " << mReconnectDelay << "ms";
+	belle_sip_source_cpp_func_t *func = new belle_sip_source_cpp_func_t([this](unsigned int events) {
+		// the main loop keeps its own reference until the timer is stopped
+		belle_sip_object_unref(mReconnectTimer);
+		mReconnectTimer = NULL;
+		connect();
+		return BELLE_SIP_STOP;
+	});
+	mReconnectTimer = belle_sip_main_loop_create_cpp_timeout(mMainLoop, func, mReconnectDelay,
+															 "presence shared state reconnection");
+}
+
+void PresenceSharedState::onConnect(const redisAsyncContext *c, int status) {
+	if (status != REDIS_OK) {
+		// freed by hiredis on return
+		SLOGE << "Presence shared state: cannot connect to Redis: " << c->errstr;
+		if (c == mContext)
+			mContext = NULL;
+		else if (c == mSubscribeContext)
+			mSubscribeContext = NULL;
+		scheduleReconnect();
+		return;
+	}
+	if (++mConnectedCount == 2) {
+		SLOGI << "Presence shared state connected to Redis [" << mParams.domain << ":" << mParams.port
+			  << "] as server [" << mServerId << "]";
+		mReconnectDelay = 0;
+		mListener.onSharedStateConnected();
+	}
+}
+
+void PresenceSharedState::onDisconnect(const redisAsyncContext *c, int status) {
+	if (c == mContext)
+		mContext = NULL;
+	else if (c == mSubscribeContext)
+		mSubscribeContext = NULL;
+	--mConnectedCount;
+	if (mShuttingDown)
+		return;
+	SLOGW << "Presence shared state disconnected from Redis: " << (status == REDIS_OK ? "" : c->errstr);
+	scheduleReconnect();
+}
+
+void PresenceSharedState::publish(const string &presentity, time_t expireAt, const string &pidf) {
+	if (!mContext)
+		return; // written again once connected
+	string value;
+	int ttl = 0;
+	if (!pidf.empty()) {
+		value = to_string((long long)expireAt) + "\n" + pidf;
+		ttl = max((int)(expireAt - time(NULL)), 1);
+	}
+	redisAsyncCommand(mContext, sHandlePublish, NULL, "EVAL %s 1 %s %s %b %d %s %s", sPublishScript,
+					  getKey(presentity).c_str(), mServerId.c_str(), value.data(), value.size(), ttl, sChannel,
+					  presentity.c_str());
+}
+
+void PresenceSharedState::fetch(const string &presentity) {
+	if (!mContext)
+		return; // fetched again once connected
+	string *data = new string(presentity);
+	if (redisAsyncCommand(mContext, sHandleFetch, data, "HGETALL %s", getKey(presentity).c_str()) != REDIS_OK)
+		delete data;
+}
+
+/* Static functions that are used as callbacks to redisAsync API */
+
+void PresenceSharedState::sConnectCallback(const redisAsyncContext *c, int status) {
+	PresenceSharedState *zis = (PresenceSharedState *)c->data;
+	if (zis)
+		zis->onConnect(c, status);
+}
+
+void PresenceSharedState::sDisconnectCallback(const redisAsyncContext *c, int status) {
+	PresenceSharedState *zis = (PresenceSharedState *)c->data;
+	if (zis)
+		zis->onDisconnect(c, status);
+}
+
+void PresenceSharedState::sHandleAuth(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	if (reply && reply->type == REDIS_REPLY_ERROR)
+		SLOGE << "Presence shared state: Redis authentication failed: " << reply->str;
+}
+
+void PresenceSharedState::sHandlePublish(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	if (reply && reply->type == REDIS_REPLY_ERROR)
+		SLOGE << "Presence shared state: cannot write the publications: " << reply->str;
+}
+
+void PresenceSharedState::sHandleFetch(redisAsyncContext *c, void *r, void *privdata) {
+	unique_ptr<string> presentity((string *)privdata);
+	redisReply *reply = (redisReply *)r;
+	PresenceSharedState *zis = (PresenceSharedState *)c->data;
+	if (reply == NULL || zis->mShuttingDown)
+		return;
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		SLOGE << "Presence shared state: cannot fetch the publications of [" << *presentity << "]"
+			  << (reply->type == REDIS_REPLY_ERROR ? string(": ") + reply->str : string());
+		return;
+	}
+	time_t now = time(NULL);
+	list<Publication> publications;
+	for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+		redisReply *field = reply->element[i];
+		redisReply *value = reply->element[i + 1];
+		if (field->type != REDIS_REPLY_STRING || value->type != REDIS_REPLY_STRING)
+			continue;
+		Publication publication;
+		publication.origin.assign(field->str, field->len);
+		if (publication.origin == zis->mServerId)
+			continue; // the local ones are known already
+		const char *end = value->str + value->len;
+		const char *newLine = (const char *)memchr(value->str, '\n', value->len);
+		if (newLine == NULL)
+			continue;
+		publication.expireAt = (time_t)strtoll(value->str, NULL, 10);
+		if (publication.expireAt <= now)
+			continue; // left by a stopped server
+		publication.pidf.assign(newLine + 1, end);
+		publications.push_back(move(publication));
+	}
+	zis->mListener.onSharedStateFetched(*presentity, publications);
+}
+
+void PresenceSharedState::sHandleMessage(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	PresenceSharedState *zis = (PresenceSharedState *)c->data;
+	if (reply == NULL || zis->mShuttingDown || reply->type != REDIS_REPLY_ARRAY || reply->elements < 3)
+		return;
+	// the subscription itself is confirmed by a "subscribe" reply
+	if (reply->element[0]->type != REDIS_REPLY_STRING || strcmp(reply->element[0]->str, "message") != 0 ||
+		reply->element[2]->type != REDIS_REPLY_STRING)
+		return;
+	string message(reply->element[2]->str, reply->element[2]->len);
+	size_t space = message.find(' ');
+	if (space == string::npos || message.compare(0, space, zis->mServerId) == 0)
+		return;
+	zis->mListener.onSharedStateChanged(message.substr(space + 1));
+}
+
+} /* namespace flexisip */
+
+#endif
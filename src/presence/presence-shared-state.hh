@@ -0,0 +1,109 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef flexisip_presence_shared_state_hh
+#define flexisip_presence_shared_state_hh
+
+#include <ctime>
+#include <list>
+#include <string>
+
+typedef struct belle_sip_main_loop belle_sip_main_loop_t;
+typedef struct belle_sip_source belle_sip_source_t;
+typedef struct _belle_sip_uri belle_sip_uri_t;
+struct redisAsyncContext;
+
+namespace flexisip {
+
+/*
+ * State of the presentities shared by the presence servers of a domain, in the Redis server of the registrar.
+ * Each server writes the publications it received for a presentity as a single PIDF document, in the field of its
+ * random id of the hash "presence:<user>@<host>", and announces the change on a pub/sub channel. The other servers
+ * fetch the hashes of the presentities they know on such announces, so that the subscribers of any server get the
+ * publications received by all of them.
+ * Each server keeps and expires its own publications: a field left by a stopped server is ignored once expired, and
+ * the hash itself expires with its last publication.
+ */
+class PresenceSharedState {
+  public:
+	struct Publication {
+		std::string origin; // id of the server that received the publications
+		time_t expireAt;
+		std::string pidf;
+	};
+	class Listener {
+	  public:
+		virtual ~Listener() {}
+		/* (re)connected: the local publications are to be written and the others fetched, changes may have been lost */
+		virtual void onSharedStateConnected() = 0;
+		/* another server announced a change of the publications of the presentity */
+		virtual void onSharedStateChanged(const std::string &presentity) = 0;
+		/* answer to fetch(), without the publications of this server nor the expired ones */
+		virtual void onSharedStateFetched(const std::string &presentity, std::list<Publication> &publications) = 0;
+	};
+	struct Parameters {
+		std::string domain;
+		int port;
+		std::string auth;
+		int reconnectMinDelay; // ms
+		int reconnectMaxDelay; // ms
+	};
+
+	PresenceSharedState(belle_sip_main_loop_t *mainLoop, const Parameters &params, Listener &listener);
+	~PresenceSharedState();
+	/* Retries in the background until it succeeds. */
+	void connect();
+	bool isConnected() const;
+	/* Replaces the publications of this server for the presentity, removed when pidf is empty. */
+	void publish(const std::string &presentity, time_t expireAt, const std::string &pidf);
+	void fetch(const std::string &presentity);
+	const std::string &getServerId() const {
+		return mServerId;
+	}
+	/* Name of a presentity in the shared state, user@host with the host in lower case. */
+	static std::string getPresentity(const belle_sip_uri_t *entity);
+
+  private:
+	redisAsyncContext *connectContext();
+	void scheduleReconnect();
+	void onConnect(const redisAsyncContext *c, int status);
+	void onDisconnect(const redisAsyncContext *c, int status);
+	static void sConnectCallback(const redisAsyncContext *c, int status);
+	static void sDisconnectCallback(const redisAsyncContext *c, int status);
+	static void sHandleAuth(redisAsyncContext *c, void *r, void *privdata);
+	static void sHandlePublish(redisAsyncContext *c, void *r, void *privdata);
+	static void sHandleFetch(redisAsyncContext *c, void *r, void *privdata);
+	static void sHandleMessage(redisAsyncContext *c, void *r, void *privdata);
+
+	belle_sip_main_loop_t *mMainLoop;
+	Parameters mParams;
+	Listener &mListener;
+	std::string mServerId;
+	redisAsyncContext *mContext;
+	redisAsyncContext *mSubscribeContext;
+	// contexts whose connection is established, the changes being followed once both are
+	int mConnectedCount;
+	belle_sip_source_t *mReconnectTimer;
+	int mReconnectDelay;
+	bool mShuttingDown;
+};
+
+} /* namespace flexisip */
+
+#endif
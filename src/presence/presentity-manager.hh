@@ -24,6 +24,7 @@
 
 namespace flexisip {
 class PresentityPresenceInformationListener;
+class ExpiryWheel;
 
 class PresentityManager : public EtagManager {
 	public:
@@ -33,6 +34,10 @@ class PresentityManager : public EtagManager {
 		virtual void addOrUpdateListener(std::shared_ptr<PresentityPresenceInformationListener> &listerner) = 0;
 		void addListenerIfNecessary(std::shared_ptr<PresentityPresenceInformationListener> &listerner);
 		virtual void removeListener(const std::shared_ptr<PresentityPresenceInformationListener> &listerner) = 0;
+		//notified when the publications received for a presentity are added, refreshed, removed or expired
+		virtual void onPublicationsChanged(const std::shared_ptr<PresentityPresenceInformation> &info) = 0;
+		//expirations of the publications and of the listeners
+		virtual ExpiryWheel &getExpiryWheel() = 0;
 };
 
 }
@@ -25,6 +25,7 @@
 #include "rpid.hxx"
 #include "data-model.hxx"
 #include <memory>
+#include <vector>
 #include "presentity-manager.hh"
 #include "log/logmanager.hh"
 
@@ -46,7 +47,8 @@ FlexisipException &operator<<(FlexisipException &e, const xml_schema::Exception
 }
 
 PresenceInformationElement::PresenceInformationElement(const belle_sip_uri_t *contact)
-	: mTuples(), mDomDocument(::xsd::cxx::xml::dom::create_document<char>()), mBelleSipMainloop(NULL), mTimer(NULL) {
+	: mTuples(), mDomDocument(::xsd::cxx::xml::dom::create_document<char>()), mBelleSipMainloop(NULL),
+	  mExpirationTime(0) {
 	char *contact_as_string = belle_sip_uri_to_string(contact);
 	std::time_t t;
 	std::time(&t);
@@ -69,23 +71,29 @@ PresenceInformationElement::PresenceInformationElement(const belle_sip_uri_t *co
 PresentityPresenceInformation::PresentityPresenceInformation(const belle_sip_uri_t *entity, PresentityManager &presentityManager,
 															 belle_sip_main_loop_t *mainloop)
 	: mEntity((belle_sip_uri_t *)belle_sip_object_clone(BELLE_SIP_OBJECT(entity))), mPresentityManager(presentityManager),
-	  mBelleSipMainloop(mainloop), mDefaultInformationElement(nullptr) {
+	  mBelleSipMainloop(mainloop), mDefaultInformationElement(nullptr), mStateVersion(0) {
+	mPidfCacheValid[0] = mPidfCacheValid[1] = false;
+	mPartCacheValid[0] = mPartCacheValid[1] = false;
 	belle_sip_object_ref(mainloop);
 	belle_sip_object_ref((void *)mEntity);
 }
 
 PresenceInformationElement::~PresenceInformationElement() {
-	if (mBelleSipMainloop)
-		setExpiresTimer(NULL);
-
 	SLOGD << "Presence information element [" << this << "] deleted";
 }
 
 PresentityPresenceInformation::~PresentityPresenceInformation() {
+	for (auto &listener : mSubscribers) {
+		if (listener->mSubscribedTo == this)
+			listener->mSubscribedTo = NULL;
+	}
 	for (auto it = mInformationElements.begin(); it != mInformationElements.end(); it++) {
 		delete it->second;
 	}
 	mInformationElements.clear();
+	for (auto &element : mRemoteElements)
+		delete element.second;
+	mRemoteElements.clear();
 	belle_sip_object_unref((void *)mEntity);
 	belle_sip_object_unref((void *)mBelleSipMainloop);
 	SLOGD << "Presence information [" << this << "] deleted";
@@ -161,23 +169,15 @@ string PresentityPresenceInformation::setOrUpdate(pidf::Presence::TupleSequence
 	// update etag for this information element
 	informationElement->setEtag(generatedETag);
 
-	// cb function to invalidate an unrefreshed etag;
-	belle_sip_source_cpp_func_t *func =
-		new belle_sip_source_cpp_func_t([this, generatedETag](unsigned int events) {
+	// cb function to invalidate an unrefreshed etag, replacing the timer of the previous one
+	informationElement->setExpiresTimer(
+		mPresentityManager.getExpiryWheel().schedule(expires, [this, generatedETag]() {
 			// find information element
 			this->removeTuplesForEtag(generatedETag);
 			mPresentityManager.invalidateETag(generatedETag);
 			SLOGD << "eTag [" << generatedETag << "] has expired";
-			return BELLE_SIP_STOP;
-		});
-	// create timer
-	belle_sip_source_t *timer = belle_sip_main_loop_create_cpp_timeout(  mBelleSipMainloop
-																	   , func
-																	   , expires * 1000
-																	   , "timer for presence Info");
-
-	// set expiration timer
-	informationElement->setExpiresTimer(timer);
+		}));
+	informationElement->setExpirationTime(time(NULL) + expires);
 
 	// modify global etag list
 	if (eTag && eTag->size() > 0) {
@@ -190,8 +190,10 @@ string PresentityPresenceInformation::setOrUpdate(pidf::Presence::TupleSequence
 	// modify etag list for this presenceInfo
 	mInformationElements[generatedETag] = informationElement;
 
-	// triger notify on all listeners
-	notifyAll();
+	// triger notify on all listeners, a refresh leaving the state as is (rfc3903 4.3)
+	if (tuples)
+		notifyAll();
+	mPresentityManager.onPublicationsChanged(shared_from_this());
 	SLOGD << "Etag [" << generatedETag << "] associated to Presentity [" << *this << "]";
 	return generatedETag;
 }
@@ -219,6 +221,7 @@ void PresentityPresenceInformation::removeTuplesForEtag(const string &eTag) {
 		mInformationElements.erase(it);
 		delete informationElement;
 		notifyAll(); // Removing an event state change global state, so it should be notified
+		mPresentityManager.onPublicationsChanged(shared_from_this());
 	} else
 		SLOGD << "No tuples found for etag [" << eTag << "]";
 }
@@ -234,70 +237,84 @@ const belle_sip_uri_t *PresentityPresenceInformation::getEntity() const {
 	return mEntity;
 }
 
+void PresentityPresenceInformation::setRemotePublications(list<RemotePublication> &publications) {
+	for (auto &element : mRemoteElements)
+		delete element.second;
+	mRemoteElements.clear();
+	time_t now = time(NULL);
+	for (auto &publication : publications) {
+		if (publication.expireAt <= now || mRemoteElements.count(publication.origin))
+			continue;
+		auto &person = publication.presence->getPerson();
+		PresenceInformationElement *element = new PresenceInformationElement(
+			&publication.presence->getTuple(), person.present() ? &person.get() : NULL, mBelleSipMainloop);
+		string origin = publication.origin;
+		element->setExpiresTimer(mPresentityManager.getExpiryWheel().schedule(
+			(unsigned int)(publication.expireAt - now), [this, origin]() {
+				SLOGD << "Publications of server [" << origin << "] for [" << *this << "] have expired";
+				this->removeRemotePublication(origin);
+			}));
+		element->setExpirationTime(publication.expireAt);
+		mRemoteElements[origin] = element;
+	}
+	SLOGD << "[" << mRemoteElements.size() << "] remote publications set for [" << *this << "]";
+	// only notified if the document changed
+	notifyAll();
+}
+
+void PresentityPresenceInformation::removeRemotePublication(const string &origin) {
+	auto it = mRemoteElements.find(origin);
+	if (it == mRemoteElements.end())
+		return;
+	PresenceInformationElement *element = it->second;
+	mRemoteElements.erase(it);
+	delete element;
+	notifyAll();
+}
+
+string PresentityPresenceInformation::getLocalPidf(time_t &expireAt) throw(FlexisipException) {
+	expireAt = 0;
+	if (mInformationElements.empty())
+		return string();
+	for (const auto &element : mInformationElements)
+		expireAt = max(expireAt, element.second->getExpitationTime());
+	return buildPidf(true, false);
+}
+
 void PresentityPresenceInformation::addOrUpdateListener(const shared_ptr<PresentityPresenceInformationListener> &listener) {
 	addOrUpdateListener(listener, -1);
 }
 
+bool PresentityPresenceInformation::insertListener(const shared_ptr<PresentityPresenceInformationListener> &listener) {
+	if (listener->mSubscribedTo == this)
+		return false;
+	// a listener follows a single presentity, the handle is only lost if it was moved to another one
+	mSubscribers.push_back(listener);
+	listener->mSubscribedTo = this;
+	listener->mSubscriberHandle = --mSubscribers.end();
+	return true;
+}
+
 void PresentityPresenceInformation::addListenerIfNecessary(const shared_ptr<PresentityPresenceInformationListener> &listener) {
-	// search if exist
-	string op;
-	bool listener_exist = false;
-	for (const shared_ptr<PresentityPresenceInformationListener> &existing_listener : mSubscribers) {
-		if (listener == existing_listener) {
-			listener_exist = true;
-			break;
-		}
-	}
-	if (listener_exist) {
-		op = "Updating";
-	} else {
-		// not found, adding
-		mSubscribers.push_back(listener);
-		op = "Adding";
-	}
+	insertListener(listener);
 }
 
 void PresentityPresenceInformation::addOrUpdateListener(const shared_ptr<PresentityPresenceInformationListener> &listener,
 														int expires) {
 
-	// search if exist
-	string op;
-	bool listener_exist = false;
-	for (const shared_ptr<PresentityPresenceInformationListener> &existing_listener : mSubscribers) {
-		if (listener == existing_listener) {
-			listener_exist = true;
-			break;
-		}
-	}
-	if (listener_exist) {
-		op = "Updating";
-	} else {
-		// not found, adding
-		mSubscribers.push_back(listener);
-		op = "Adding";
-	}
+	string op = insertListener(listener) ? "Adding" : "Updating";
 
 	SLOGD << op << " listener [" << listener.get() << "] on [" << *this << "] for [" << expires << "] seconds";
 
 	if (expires > 0) {
-		// PresentityPresenceInformationListener* listener_ptr=listener.get();
-		// cb function to invalidate an unrefreshed etag;
-		belle_sip_source_cpp_func_t *func =
-		new belle_sip_source_cpp_func_t([this, listener/*_ptr*/](unsigned int events) {
+		// cb function to expire an unrefreshed listener, replacing the timer of the previous subscription
+		listener->setExpiresTimer(mPresentityManager.getExpiryWheel().schedule(expires, [this, listener]() {
 			SLOGD << "Listener [" << listener.get() << "] on [" << *this << "] has expired";
 			listener->onExpired(*this);
 			this->mPresentityManager.removeListener(listener);
-			return BELLE_SIP_STOP;
-		});
-		// create timer
-		belle_sip_source_t *timer = belle_sip_main_loop_create_cpp_timeout(mBelleSipMainloop
-																		   , func
-																		   , expires * 1000, "timer for presence info listener");
-
-		// set expiration timer
-		listener->setExpiresTimer(mBelleSipMainloop, timer);
+		}));
 	} else {
-		listener->setExpiresTimer(mBelleSipMainloop,NULL);
+		listener->setExpiresTimer(nullptr);
 	}
 	/*
 	 *rfc 3265
@@ -313,9 +330,14 @@ void PresentityPresenceInformation::addOrUpdateListener(const shared_ptr<Present
 void PresentityPresenceInformation::removeListener(const shared_ptr<PresentityPresenceInformationListener> &listener) {
 	SLOGD << "removing listener [" << listener.get() << "] on [" << *this << "]";
 	// 1 cancel expiration time
-	listener->setExpiresTimer(mBelleSipMainloop, NULL);
+	listener->setExpiresTimer(nullptr);
 	// 2 remove listener
-	mSubscribers.remove(listener);
+	if (listener->mSubscribedTo == this) {
+		mSubscribers.erase(listener->mSubscriberHandle);
+		listener->mSubscribedTo = NULL;
+	} else {
+		mSubscribers.remove(listener);
+	}
 	//			 3.1.4.3. Unsubscribing
 	//
 	//			 Unsubscribing is handled in the same way as refreshing of a
@@ -330,7 +352,42 @@ bool PresentityPresenceInformation::hasDefaultElement() {
 bool PresentityPresenceInformation::isKnown() {
 	return mInformationElements.size() > 0 || hasDefaultElement();
 }
-string PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipException) {
+const string &PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipException) {
+	if (!mPidfCacheValid[extended] || mPidfCacheVersion[extended] != mStateVersion) {
+		mPidfCache[extended] = buildPidf(extended);
+		mPidfCacheVersion[extended] = mStateVersion;
+		mPidfCacheValid[extended] = true;
+		SLOGD << "Pidf of " << *this << " serialized for version [" << mStateVersion << "]"
+			  << (extended ? " (extended)" : "");
+	}
+	return mPidfCache[extended];
+}
+
+const CompressedBody::Segment &
+PresentityPresenceInformation::getCompressedPidfPart(bool extended, const function<string(const string &)> &format)
+	throw(FlexisipException) {
+	if (!mPartCacheValid[extended] || mPartCacheVersion[extended] != mStateVersion) {
+		mPartCache[extended] = CompressedBody::compress(format(getPidf(extended)));
+		mPartCacheVersion[extended] = mStateVersion;
+		mPartCacheValid[extended] = true;
+	}
+	return mPartCache[extended];
+}
+
+const string &PresentityPresenceInformation::getContentId() {
+	if (mContentId.empty()) {
+		char randPart[8];
+		belle_sip_random_token(randPart, sizeof(randPart));
+		mContentId = string(randPart) + "@" + belle_sip_uri_get_host(mEntity);
+	}
+	return mContentId;
+}
+
+unsigned int PresentityPresenceInformation::getStateVersion() const {
+	return mStateVersion;
+}
+
+string PresentityPresenceInformation::buildPidf(bool extended, bool withRemote) throw(FlexisipException) {
 	stringstream out;
 	try {
 		char *entity = belle_sip_uri_to_string(getEntity());
@@ -339,9 +396,16 @@ string PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipExcep
 		list<string> tupleList;
 
 		if(extended) {
-			for (auto element : mInformationElements) {
+			vector<PresenceInformationElement *> elements;
+			for (auto element : mInformationElements)
+				elements.push_back(element.second);
+			if (withRemote) {
+				for (auto element : mRemoteElements)
+					elements.push_back(element.second);
+			}
+			for (PresenceInformationElement *element : elements) {
 				// copy pidf
-				for (const unique_ptr<pidf::Tuple> &tup : element.second->getTuples()) {
+				for (const unique_ptr<pidf::Tuple> &tup : element->getTuples()) {
 					// check for multiple tupple id, may happend with buggy presence publisher
 					if (find(tupleList.begin(), tupleList.end(), tup.get()->getId()) == tupleList.end()) {
 						presence.getTuple().push_back(*tup);
@@ -351,7 +415,7 @@ string PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipExcep
 					}
 				}
 				// copy extensions
-				Person dm_person = element.second->getPerson();
+				Person dm_person = element->getPerson();
 				for(data_model::Person::ActivitiesIterator activity = dm_person.getActivities().begin(); activity != dm_person.getActivities().end();activity++) {
 					if(!presence.getPerson()) {
 						Person person = Person(dm_person.getId());
@@ -361,7 +425,8 @@ string PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipExcep
 				}
 			}
 		}
-		if ((mInformationElements.size() == 0 || !extended) && mDefaultInformationElement != nullptr) {
+		bool published = mInformationElements.size() > 0 || (withRemote && mRemoteElements.size() > 0);
+		if ((!published || !extended) && mDefaultInformationElement != nullptr) {
 			// insering default tuple
 			presence.getTuple().push_back(*mDefaultInformationElement->getTuples().begin()->get());
 
@@ -401,15 +466,39 @@ string PresentityPresenceInformation::getPidf(bool extended) throw(FlexisipExcep
 }
 
 void PresentityPresenceInformation::notifyAll() {
+	++mStateVersion;
+	// only the documents the listeners get are compared, the other ones being forgotten
+	bool checked[2] = {false, false};
+	bool changed[2] = {false, false};
+	size_t notified = 0;
 	for (shared_ptr<PresentityPresenceInformationListener> listener : mSubscribers) {
-		listener->onInformationChanged(*this, listener->extendedNotifyEnabled());
+		bool extended = listener->extendedNotifyEnabled();
+		if (!checked[extended]) {
+			checked[extended] = true;
+			try {
+				const string &pidf = getPidf(extended);
+				changed[extended] = pidf != mNotifiedPidf[extended];
+				mNotifiedPidf[extended] = pidf;
+			} catch (FlexisipException &e) {
+				changed[extended] = true;
+				mNotifiedPidf[extended].clear();
+			}
+		}
+		if (changed[extended]) {
+			listener->onInformationChanged(*this, extended);
+			++notified;
+		}
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (!checked[i])
+			mNotifiedPidf[i].clear();
 	}
-	SLOGD << *this << " has notified [" << mSubscribers.size() << " ] listeners";
+	SLOGD << *this << " has notified [" << notified << "/" << mSubscribers.size() << " ] listeners";
 }
-PresentityPresenceInformationListener::PresentityPresenceInformationListener() : mTimer(NULL), mExtendedNotify(false), mBypassEnabled(false) {
+PresentityPresenceInformationListener::PresentityPresenceInformationListener()
+	: mSubscribedTo(NULL), mExtendedNotify(false), mBypassEnabled(false) {
 }
 PresentityPresenceInformationListener::~PresentityPresenceInformationListener() {
-	setExpiresTimer(mBelleSipMainloop, NULL);
 }
 bool PresentityPresenceInformationListener::extendedNotifyEnabled() {
 	return mExtendedNotify;
@@ -423,13 +512,8 @@ bool PresentityPresenceInformationListener::bypassEnabled() {
 void PresentityPresenceInformationListener::enableBypass(bool enable) {
 	mBypassEnabled = enable;
 }
-void PresentityPresenceInformationListener::setExpiresTimer(belle_sip_main_loop_t *ml, belle_sip_source_t *timer) {
-	if (mTimer) {
-		// canceling previous timer
-		belle_sip_source_cancel(mTimer);
-		belle_sip_object_unref(mTimer);
-	}
-	mBelleSipMainloop=ml;
+void PresentityPresenceInformationListener::setExpiresTimer(const shared_ptr<ExpiryWheel::Timer> &timer) {
+	// the previous timer, if any, is given up
 	mTimer = timer;
 }
 
@@ -438,7 +522,8 @@ void PresentityPresenceInformationListener::setExpiresTimer(belle_sip_main_loop_
 PresenceInformationElement::PresenceInformationElement(pidf::Presence::TupleSequence *tuples,
 													   data_model::Person *person,
 													   belle_sip_main_loop_t *mainLoop)
-	: mDomDocument(::xsd::cxx::xml::dom::create_document<char>()), mBelleSipMainloop(mainLoop), mTimer(NULL) {
+	: mDomDocument(::xsd::cxx::xml::dom::create_document<char>()), mBelleSipMainloop(mainLoop),
+	  mExpirationTime(0) {
 
 	for (pidf::Presence::TupleSequence::iterator tupleIt = tuples->begin(); tupleIt != tuples->end();) {
 		SLOGD << "Adding tuple id [" << tupleIt->getId() << "] to presence info element [" << this << "]";
@@ -479,14 +564,15 @@ static string generate_presence_id(void) {
 	return id;
 }
 
-void PresenceInformationElement::setExpiresTimer(belle_sip_source_t *timer) {
-	if (mTimer) {
-		// canceling previous timer
-		belle_sip_source_cancel(mTimer);
-		belle_sip_object_unref(mTimer);
-	}
+time_t PresenceInformationElement::getExpitationTime() const {
+	return mExpirationTime;
+}
+void PresenceInformationElement::setExpirationTime(time_t expirationTime) {
+	mExpirationTime = expirationTime;
+}
+void PresenceInformationElement::setExpiresTimer(const shared_ptr<ExpiryWheel::Timer> &timer) {
+	// the previous timer, if any, is given up
 	mTimer = timer;
-
 }
 const std::unique_ptr<pidf::Tuple> &PresenceInformationElement::getTuple(const string &id) const {
 	for (const std::unique_ptr<Tuple> &tup : mTuples) {
@@ -23,7 +23,12 @@
 #include "pidf+xml.hxx"
 //#include "data-model.hxx"
 #include <list>
+#include <unordered_map>
 #include "utils/flexisip-exception.hh"
+#include "utils/memorystats.hh"
+#include "expiry-wheel.hh"
+#include "compressed-body.hh"
+#include <functional>
 
 typedef struct _belle_sip_uri belle_sip_uri_t;
 typedef struct belle_sip_source belle_sip_source_t;
@@ -38,7 +43,8 @@ class PresenceInformationElement {
 	PresenceInformationElement(const belle_sip_uri_t *contact);
 	~PresenceInformationElement();
 	time_t getExpitationTime() const;
-	void setExpiresTimer(belle_sip_source_t *timer);
+	void setExpirationTime(time_t expirationTime);
+	void setExpiresTimer(const std::shared_ptr<ExpiryWheel::Timer> &timer);
 	const std::unique_ptr<pidf::Tuple> &getTuple(const std::string &id) const;
 	const std::list<std::unique_ptr<pidf::Tuple>> &getTuples() const;
 	const data_model::Person getPerson() const;
@@ -53,8 +59,9 @@ class PresenceInformationElement {
 	data_model::Person mPerson = data_model::Person("");
 	::xml_schema::dom::unique_ptr<xercesc::DOMDocument> mDomDocument; // needed to store extension nodes
 	belle_sip_main_loop_t *mBelleSipMainloop;
-	belle_sip_source_t *mTimer;
+	std::shared_ptr<ExpiryWheel::Timer> mTimer;
 	std::string mEtag;
+	time_t mExpirationTime;
 };
 /*
  * Presence Information is the key class representy a presentity. This class can be either created bu a Publish for a
@@ -69,7 +76,7 @@ class PresentityPresenceInformationListener  {
   public:
 	PresentityPresenceInformationListener();
 	virtual ~PresentityPresenceInformationListener();
-	void setExpiresTimer(belle_sip_main_loop_t *ml, belle_sip_source_t *timer);
+	void setExpiresTimer(const std::shared_ptr<ExpiryWheel::Timer> &timer);
 	void enableExtendedNotify(bool enable);
 	bool extendedNotifyEnabled();
 	void enableBypass(bool enable);
@@ -83,13 +90,26 @@ class PresentityPresenceInformationListener  {
 	virtual const belle_sip_uri_t* getFrom() = 0;
 	virtual const belle_sip_uri_t* getTo() = 0;
   private:
-	belle_sip_main_loop_t *mBelleSipMainloop;
-	belle_sip_source_t *mTimer;
+	friend class PresentityPresenceInformation;
+	// position among the listeners of the presentity it was added to, for lookup and removal without a scan
+	PresentityPresenceInformation *mSubscribedTo;
+	std::list<std::shared_ptr<PresentityPresenceInformationListener>>::iterator mSubscriberHandle;
+	std::shared_ptr<ExpiryWheel::Timer> mTimer;
 	bool mExtendedNotify;
 	bool mBypassEnabled;
 };
 
-class PresentityPresenceInformation : public std::enable_shared_from_this<PresentityPresenceInformation> {
+/*
+ * publications of a presentity received by another presence server sharing the state
+ */
+struct RemotePublication {
+	std::string origin;
+	time_t expireAt;
+	std::unique_ptr<pidf::Presence> presence;
+};
+
+class PresentityPresenceInformation : public std::enable_shared_from_this<PresentityPresenceInformation>,
+									  public CountedObject<ObjectCounter::Presentities> {
 
   public:
 	PresentityPresenceInformation(const belle_sip_uri_t *entity, PresentityManager &presentityManager, belle_sip_main_loop_t *ml);
@@ -133,6 +153,17 @@ class PresentityPresenceInformation : public std::enable_shared_from_this<Presen
 
 	const belle_sip_uri_t *getEntity() const;
 
+	/*
+	 * replace the publications received by the other presence servers, each one being removed when it expires
+	 */
+	void setRemotePublications(std::list<RemotePublication> &publications);
+
+	/*
+	 * return the publications received by this server in a pidf serialized format, empty if there are none
+	 * @param expireAt set to the latest expiration of these publications
+	 */
+	std::string getLocalPidf(time_t &expireAt) throw(FlexisipException);
+
 	/**
 	 *add notity listener for an entity
 	 */
@@ -149,9 +180,30 @@ class PresentityPresenceInformation : public std::enable_shared_from_this<Presen
 	void removeListener(const std::shared_ptr<PresentityPresenceInformationListener> &listener);
 
 	/*
-	 * return the presence information for this entity in a pidf serilized format
+	 * return the presence information for this entity in a pidf serilized format. The document is serialized once per
+	 * version of the state, and shared by all the listeners with the same filter (extended or not).
 	 */
-	std::string getPidf(bool extended) throw(FlexisipException);
+	const std::string &getPidf(bool extended) throw(FlexisipException);
+
+	/*
+	 * return the pidf as a part of the multipart bodies of the list notifications, formatted by format then
+	 * compressed. Cached as the pidf, so that it is compressed once per version of the state for all the lists and
+	 * subscribers, format being the same for all of them.
+	 */
+	const CompressedBody::Segment &getCompressedPidfPart(bool extended,
+														 const std::function<std::string(const std::string &)> &format)
+		throw(FlexisipException);
+
+	/*
+	 * return the Content-Id of the pidf in the multipart bodies of the list notifications, kept for the lifetime of the
+	 * entity so that its part can be cached
+	 */
+	const std::string &getContentId();
+
+	/*
+	 * return the version of the presence state, increased on every change (PUBLISH, expiration, default element)
+	 */
+	unsigned int getStateVersion() const;
 
 	/*
 	 * return true if a presence info is already known from a publish
@@ -190,8 +242,14 @@ class PresentityPresenceInformation : public std::enable_shared_from_this<Presen
 	 */
 	std::string setOrUpdate(pidf::Presence::TupleSequence *tuples, data_model::Person *, const std::string *eTag,
 					   int expires) throw(FlexisipException);
+	std::string buildPidf(bool extended, bool withRemote = true) throw(FlexisipException);
+	void removeRemotePublication(const std::string &origin);
+	/*
+	 * add the listener if not already there, returns false if it was
+	 */
+	bool insertListener(const std::shared_ptr<PresentityPresenceInformationListener> &listener);
 	/*
-	 *Notify all listener
+	 *Notify all listener, unless the presence document they get is unchanged
 	 */
 	void notifyAll();
 
@@ -199,13 +257,27 @@ class PresentityPresenceInformation : public std::enable_shared_from_this<Presen
 	PresentityManager &mPresentityManager;
 	belle_sip_main_loop_t *mBelleSipMainloop;
 	// Tuples ordered by Etag.
-	std::map<std::string /*Etag*/, PresenceInformationElement *> mInformationElements;
+	std::unordered_map<std::string /*Etag*/, PresenceInformationElement *> mInformationElements;
+	// Tuples of the other presence servers, by server id.
+	std::unordered_map<std::string, PresenceInformationElement *> mRemoteElements;
 
 	// list of subscribers function to be called when a tuple changed
 	std::list<std::shared_ptr<PresentityPresenceInformationListener>> mSubscribers;
 	std::shared_ptr<PresenceInformationElement> mDefaultInformationElement; // purpose of this element is to have a
 																			// default presence status (I.E closed) when
 																			// all publish have expired.
+	unsigned int mStateVersion;
+	// serialized pidf, not extended and extended, with the state version they were built for, and the last notified
+	// ones
+	std::string mPidfCache[2];
+	unsigned int mPidfCacheVersion[2];
+	bool mPidfCacheValid[2];
+	std::string mNotifiedPidf[2];
+	// compressed parts of the list notifications, as the pidf
+	CompressedBody::Segment mPartCache[2];
+	unsigned int mPartCacheVersion[2];
+	bool mPartCacheValid[2];
+	std::string mContentId;
 };
 
 std::ostream &operator<<(std::ostream &__os, const PresentityPresenceInformation &);
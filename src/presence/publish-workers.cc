@@ -0,0 +1,161 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "publish-workers.hh"
+#include "pidf-fast-parser.hh"
+#include "belle-sip/belle-sip.h"
+#include "log/logmanager.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace flexisip {
+
+PublishWorkers::PublishWorkers(belle_sip_main_loop_t *mainLoop, int threadCount, const Callback &onParsed)
+	: mMainLoop(mainLoop), mSource(NULL), mOnParsed(onParsed), mRunning(true) {
+	if (pipe(mWakePipe) != 0) {
+		SLOGE << "PublishWorkers cannot create pipe: " << strerror(errno);
+		mWakePipe[0] = mWakePipe[1] = -1;
+		return;
+	}
+	fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+	mSource = belle_sip_socket_source_new((belle_sip_source_func_t)onWakeUp, this, mWakePipe[0], BELLE_SIP_EVENT_READ,
+										  (unsigned int)-1);
+	belle_sip_main_loop_add_source(mMainLoop, mSource);
+	for (int i = 0; i < threadCount; ++i) {
+		mWorkers.emplace_back(new Worker());
+		mWorkers.back()->thread = thread(&PublishWorkers::run, this, mWorkers.back().get());
+	}
+	SLOGD << "PUBLISH bodies parsed by " << threadCount << " threads";
+}
+
+PublishWorkers::~PublishWorkers() {
+	mRunning = false;
+	for (auto &worker : mWorkers) {
+		{
+			unique_lock<mutex> lock(worker->mutex);
+			worker->cond.notify_one();
+		}
+		worker->thread.join();
+		for (auto &job : worker->jobs)
+			release(*job);
+	}
+	for (auto &job : mDone)
+		release(*job);
+	if (mSource) {
+		belle_sip_main_loop_remove_source(mMainLoop, mSource);
+		belle_sip_object_unref(mSource);
+	}
+	if (mWakePipe[0] != -1) {
+		close(mWakePipe[0]);
+		close(mWakePipe[1]);
+	}
+}
+
+void PublishWorkers::submit(const string &presentity, belle_sip_request_t *request,
+							belle_sip_server_transaction_t *transaction) {
+	unique_ptr<Job> job(new Job());
+	job->request = (belle_sip_request_t *)belle_sip_object_ref(request);
+	job->transaction = (belle_sip_server_transaction_t *)belle_sip_object_ref(transaction);
+	if (belle_sip_message_get_body_size(BELLE_SIP_MESSAGE(request)) > 0)
+		job->body = belle_sip_message_get_body(BELLE_SIP_MESSAGE(request));
+	if (mWorkers.empty()) {
+		// no pipe, the job cannot be handed back asynchronously
+		job->presence = parse(job->body, job->error);
+		mOnParsed(*job);
+		release(*job);
+		return;
+	}
+	Worker &worker = *mWorkers[hash<string>()(presentity) % mWorkers.size()];
+	unique_lock<mutex> lock(worker.mutex);
+	worker.jobs.push_back(move(job));
+	worker.cond.notify_one();
+}
+
+unique_ptr<pidf::Presence> PublishWorkers::parse(const string &body, string &error) {
+	unique_ptr<pidf::Presence> presence = PidfFastParser::parse(body);
+	if (presence)
+		return presence;
+	try {
+		istringstream data(body);
+		return pidf::parsePresence(data, xml_schema::Flags::dont_validate);
+	} catch (const xml_schema::Exception &e) {
+		ostringstream os;
+		os << e;
+		error = os.str();
+	}
+	return nullptr;
+}
+
+void PublishWorkers::run(Worker *worker) {
+	unique_lock<mutex> lock(worker->mutex);
+	while (mRunning) {
+		if (worker->jobs.empty()) {
+			worker->cond.wait(lock);
+			continue;
+		}
+		unique_ptr<Job> job = move(worker->jobs.front());
+		worker->jobs.pop_front();
+		lock.unlock();
+
+		// bodyless refreshes go through the thread too, so that they are not processed before a previous PUBLISH
+		if (!job->body.empty())
+			job->presence = parse(job->body, job->error);
+		bool wasIdle;
+		{
+			unique_lock<mutex> doneLock(mDoneMutex);
+			wasIdle = mDone.empty();
+			mDone.push_back(move(job));
+		}
+		if (wasIdle) {
+			char c = 0;
+			if (write(mWakePipe[1], &c, 1) < 0 && errno != EAGAIN)
+				SLOGE << "PublishWorkers cannot wake up the main loop: " << strerror(errno);
+		}
+		lock.lock();
+	}
+}
+
+int PublishWorkers::onWakeUp(PublishWorkers *thiz, unsigned int events) {
+	char buf[64];
+	while (read(thiz->mWakePipe[0], buf, sizeof(buf)) > 0)
+		;
+	deque<unique_ptr<Job>> done;
+	{
+		unique_lock<mutex> lock(thiz->mDoneMutex);
+		done.swap(thiz->mDone);
+	}
+	for (auto &job : done) {
+		thiz->mOnParsed(*job);
+		release(*job);
+	}
+	return BELLE_SIP_CONTINUE;
+}
+
+void PublishWorkers::release(Job &job) {
+	belle_sip_object_unref(job.request);
+	belle_sip_object_unref(job.transaction);
+}
+
+} /* namespace flexisip */
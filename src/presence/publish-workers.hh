@@ -0,0 +1,91 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef flexisip_publish_workers_hh
+#define flexisip_publish_workers_hh
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pidf+xml.hxx"
+
+typedef struct belle_sip_main_loop belle_sip_main_loop_t;
+typedef struct belle_sip_source belle_sip_source_t;
+typedef struct belle_sip_request belle_sip_request_t;
+typedef struct belle_sip_server_transaction belle_sip_server_transaction_t;
+
+namespace flexisip {
+
+/*
+ * Threads parsing the PIDF bodies of the PUBLISH requests, which is the most CPU consuming part of their processing.
+ * The requests are sharded by presentity: those of a given presentity always go to the same thread, and their results
+ * are handed back to the main loop in the order they were submitted, as RFC 3903 requires.
+ * The belle-sip objects are only touched from the main loop.
+ */
+class PublishWorkers {
+  public:
+	struct Job {
+		belle_sip_request_t *request;
+		belle_sip_server_transaction_t *transaction;
+		std::string body;
+		std::unique_ptr<pidf::Presence> presence;
+		std::string error; // set when the body cannot be parsed
+	};
+	typedef std::function<void(Job &job)> Callback;
+
+	PublishWorkers(belle_sip_main_loop_t *mainLoop, int threadCount, const Callback &onParsed);
+	/* The jobs not handed back yet are dropped. */
+	~PublishWorkers();
+	/* Keeps a reference on the request and the transaction until the callback returns. */
+	void submit(const std::string &presentity, belle_sip_request_t *request,
+				belle_sip_server_transaction_t *transaction);
+
+	/* Goes through PidfFastParser first, then through the xsd bindings for the documents it does not handle. */
+	static std::unique_ptr<pidf::Presence> parse(const std::string &body, std::string &error);
+
+  private:
+	struct Worker {
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<std::unique_ptr<Job>> jobs;
+	};
+	void run(Worker *worker);
+	static int onWakeUp(PublishWorkers *thiz, unsigned int events);
+	static void release(Job &job);
+
+	belle_sip_main_loop_t *mMainLoop;
+	belle_sip_source_t *mSource;
+	Callback mOnParsed;
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	std::atomic<bool> mRunning;
+	std::mutex mDoneMutex;
+	std::deque<std::unique_ptr<Job>> mDone;
+	int mWakePipe[2];
+};
+
+} /* namespace flexisip */
+
+#endif
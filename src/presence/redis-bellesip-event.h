@@ -0,0 +1,106 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef bellesip_redis_event_h
+#define bellesip_redis_event_h
+
+/* Attaches a hiredis asynchronous context to a belle-sip main loop, as registrardb-redis-sofia-event.h does for
+ * su_root. */
+
+#include "belle-sip/belle-sip.h"
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <cstdlib>
+
+typedef struct redisBelleSipEvents {
+	redisAsyncContext *context;
+	belle_sip_main_loop_t *mainLoop;
+	belle_sip_source_t *source;
+	int events;
+} redisBelleSipEvents;
+
+static int redisBelleSipEvent(void *data, unsigned int events) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)data;
+	// a read may free the context on a disconnection, the writes are handled by the next iteration then
+	if (events & BELLE_SIP_EVENT_READ) {
+		redisAsyncHandleRead(e->context);
+	} else if (events & BELLE_SIP_EVENT_WRITE) {
+		redisAsyncHandleWrite(e->context);
+	}
+	return BELLE_SIP_CONTINUE;
+}
+
+static void redisBelleSipSetEvents(redisBelleSipEvents *e, int events) {
+	e->events = events;
+	belle_sip_source_set_events(e->source, events);
+}
+
+static void redisBelleSipAddRead(void *privdata) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)privdata;
+	redisBelleSipSetEvents(e, e->events | BELLE_SIP_EVENT_READ);
+}
+
+static void redisBelleSipDelRead(void *privdata) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)privdata;
+	redisBelleSipSetEvents(e, e->events & ~BELLE_SIP_EVENT_READ);
+}
+
+static void redisBelleSipAddWrite(void *privdata) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)privdata;
+	redisBelleSipSetEvents(e, e->events | BELLE_SIP_EVENT_WRITE);
+}
+
+static void redisBelleSipDelWrite(void *privdata) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)privdata;
+	redisBelleSipSetEvents(e, e->events & ~BELLE_SIP_EVENT_WRITE);
+}
+
+static void redisBelleSipCleanup(void *privdata) {
+	redisBelleSipEvents *e = (redisBelleSipEvents *)privdata;
+	belle_sip_main_loop_remove_source(e->mainLoop, e->source);
+	belle_sip_object_unref(e->source);
+	free(e);
+}
+
+static int redisBelleSipAttach(redisAsyncContext *ac, belle_sip_main_loop_t *mainLoop) {
+	/* Nothing should be attached when something is already attached */
+	if (ac->ev.data != NULL)
+		return REDIS_ERR;
+
+	redisBelleSipEvents *e = (redisBelleSipEvents *)malloc(sizeof(*e));
+	e->context = ac;
+	e->mainLoop = mainLoop;
+	e->events = 0;
+	e->source = belle_sip_socket_source_new(redisBelleSipEvent, e, ac->c.fd, 0, (unsigned int)-1);
+	if (e->source == NULL) {
+		free(e);
+		return REDIS_ERR;
+	}
+	belle_sip_main_loop_add_source(mainLoop, e->source);
+
+	ac->ev.addRead = redisBelleSipAddRead;
+	ac->ev.delRead = redisBelleSipDelRead;
+	ac->ev.addWrite = redisBelleSipAddWrite;
+	ac->ev.delWrite = redisBelleSipDelWrite;
+	ac->ev.cleanup = redisBelleSipCleanup;
+	ac->ev.data = e;
+	return REDIS_OK;
+}
+
+#endif
@@ -18,7 +18,9 @@
 
 #include "subscription.hh"
 #include "belle-sip/belle-sip.h"
+#include <algorithm>
 #include <time.h>
+#include <strings.h>
 #include "log/logmanager.hh"
 using namespace std;
 
@@ -34,12 +36,11 @@ Subscription::Subscription(const string &eventName, unsigned int expires, belle_
 	mExpirationTime = mCreationTime + expires;
 }
 void Subscription::setAcceptHeader(belle_sip_header_t *acceptHeader) {
+	if (acceptHeader)
+		belle_sip_object_ref(acceptHeader);
 	if (mAcceptHeader)
 		belle_sip_object_unref(mAcceptHeader);
-	if (acceptHeader) {
-		belle_sip_object_ref(acceptHeader);
-		mAcceptHeader = acceptHeader;
-	}
+	mAcceptHeader = acceptHeader;
 }
 void Subscription::setAcceptEncodingHeader(belle_sip_header_t *acceptEncodingHeader) {
 	if (mAcceptEncodingHeader)
@@ -49,6 +50,28 @@ void Subscription::setAcceptEncodingHeader(belle_sip_header_t *acceptEncodingHea
 		mAcceptEncodingHeader = acceptEncodingHeader;
 	}
 }
+bool Subscription::isAccepted(const string &contentType) const {
+	const char *value = mAcceptHeader ? belle_sip_header_get_unparsed_value(mAcceptHeader) : NULL;
+	if (!value)
+		return false;
+	string accept(value);
+	size_t pos = 0;
+	while (pos < accept.size()) {
+		size_t end = accept.find(',', pos);
+		if (end == string::npos)
+			end = accept.size();
+		// media range without its parameters
+		size_t first = accept.find_first_not_of(" \t", pos);
+		size_t last = accept.find_first_of(" \t;", first);
+		if (first < end) {
+			size_t len = min(last, end) - first;
+			if (len == contentType.size() && strncasecmp(accept.c_str() + first, contentType.c_str(), len) == 0)
+				return true;
+		}
+		pos = end + 1;
+	}
+	return false;
+}
 void Subscription::Subscription::setId(const string &id) {
 	mId = id;
 }
@@ -72,6 +95,14 @@ void Subscription::notify(belle_sip_multipart_body_handler_t *body, const string
 void Subscription::notify(belle_sip_header_content_type_t *content_type, const string &body) {
 	notify(content_type, &body, NULL, NULL);
 }
+void Subscription::notify(belle_sip_header_content_type_t *content_type, const string &body,
+						  const string &content_encoding) {
+	notify(content_type, &body, NULL, &content_encoding);
+}
+CompressedBody::Encoding Subscription::getContentEncoding() const {
+	return CompressedBody::negotiate(mAcceptEncodingHeader ? belle_sip_header_get_unparsed_value(mAcceptEncodingHeader)
+														   : NULL);
+}
 void Subscription::notify(belle_sip_header_content_type_t *content_type, const string *body,
 						  belle_sip_multipart_body_handler_t *multiPartBody, const string *content_encoding) {
 	if (belle_sip_dialog_get_state(mDialog) != BELLE_SIP_DIALOG_CONFIRMED) {
@@ -84,7 +115,13 @@ void Subscription::notify(belle_sip_header_content_type_t *content_type, const s
 	belle_sip_message_add_header((belle_sip_message_t *)notify, belle_sip_header_create("Event", mEventName.c_str()));
 
 	if (content_type && body) {
+		// the bodies of the lists, built already encoded
+		if (strcasecmp(belle_sip_header_content_type_get_type(content_type), "multipart") == 0)
+			belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify), belle_sip_header_create("Require", "eventlist"));
 		belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify), BELLE_SIP_HEADER(content_type));
+		if (content_encoding)
+			belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify),
+										 belle_sip_header_create("Content-Encoding", content_encoding->c_str()));
 		belle_sip_message_set_body(BELLE_SIP_MESSAGE(notify), body->c_str(), (int)body->length());
 		belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify),
 									 BELLE_SIP_HEADER(belle_sip_header_content_length_create((int)body->length())));
@@ -92,12 +129,9 @@ void Subscription::notify(belle_sip_header_content_type_t *content_type, const s
 		belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify), belle_sip_header_create("Require", "eventlist"));
 		belle_sip_multipart_body_handler_set_related(multiPartBody, TRUE);
 		belle_sip_message_set_body_handler(BELLE_SIP_MESSAGE(notify), BELLE_SIP_BODY_HANDLER(multiPartBody));
-		if (content_encoding && mAcceptEncodingHeader) {
-			const char *accept_encoding = belle_sip_header_get_unparsed_value(mAcceptEncodingHeader);
-			if (accept_encoding && (strcmp(accept_encoding, content_encoding->c_str()) == 0)) {
-				belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify), belle_sip_header_create("Content-Encoding", content_encoding->c_str()));
-			}
-		}
+		if (content_encoding)
+			belle_sip_message_add_header(BELLE_SIP_MESSAGE(notify),
+										 belle_sip_header_create("Content-Encoding", content_encoding->c_str()));
 	}
 
 	/*RFC 3265
@@ -139,6 +173,7 @@ void Subscription::notify(belle_sip_header_content_type_t *content_type, const s
 Subscription::~Subscription() {
 	belle_sip_object_unref(mDialog);
 	belle_sip_object_unref(mProv);
+	setAcceptHeader(NULL);
 	setAcceptEncodingHeader(NULL);
 }
 
@@ -176,13 +211,26 @@ PresenceSubscription::~PresenceSubscription() {
 const belle_sip_uri_t *PresenceSubscription::getPresentityUri() const {
 	return mPresentity;
 }
+void PresenceSubscription::enablePartialNotify(bool enable) {
+	if (enable && mPidfDiff)
+		mPidfDiff->reset();
+	else if (enable)
+		mPidfDiff.reset(new PidfDiff());
+	else
+		mPidfDiff.reset();
+}
 void PresenceSubscription::onInformationChanged(PresentityPresenceInformation &presenceInformation, bool extended) {
 	string body;
 	belle_sip_header_content_type_t *content_type = NULL;
 	try {
 		if (getState() == active) {
-			body += presenceInformation.getPidf(extended);
-			content_type = belle_sip_header_content_type_create("application", "pidf+xml");
+			if (mPidfDiff) {
+				body += mPidfDiff->update(presenceInformation.getPidf(extended));
+				content_type = belle_sip_header_content_type_create("application", "pidf-diff+xml");
+			} else {
+				body += presenceInformation.getPidf(extended);
+				content_type = belle_sip_header_content_type_create("application", "pidf+xml");
+			}
 		}
 	} catch (FlexisipException &e) {
 		SLOGD << "Cannot notify [" << this->getPresentityUri() << "] caused by [" << e << "]";
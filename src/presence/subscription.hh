@@ -21,6 +21,7 @@
 #include <string>
 #include "belle-sip/belle-sip.h"
 #include "presentity-presenceinformation.hh"
+#include "pidf-diff.hh"
 
 namespace flexisip {
 	class Subscription : public std::enable_shared_from_this<Subscription>{
@@ -31,10 +32,18 @@ namespace flexisip {
 	virtual ~Subscription();
 	void setAcceptHeader(belle_sip_header_t *acceptHeader);
 	void setAcceptEncodingHeader(belle_sip_header_t *acceptEncodingHeader);
+	/* Whether the Accept header of the subscription lists this type, as "application/pidf+xml". */
+	bool isAccepted(const std::string &contentType) const;
 	void setId(const std::string &id);
 	void notify(belle_sip_header_content_type_t *content_type, const std::string &body);
 	void notify(belle_sip_multipart_body_handler_t *body);
+	/* A body encoded by belle-sip on sending with content_encoding. */
 	void notify(belle_sip_multipart_body_handler_t *body, const std::string &content_encoding);
+	/* A body already encoded with content_encoding. */
+	void notify(belle_sip_header_content_type_t *content_type, const std::string &body,
+				const std::string &content_encoding);
+	/* The encoding of the bodies preferred by the Accept-Encoding header of the subscription. */
+	CompressedBody::Encoding getContentEncoding() const;
 	static const char *stateToString(State aState);
 	State getState() const;
 	void setState(Subscription::State state);
@@ -82,8 +91,12 @@ class PresenceSubscription : public Subscription, public PresentityPresenceInfor
 	void onExpired(PresentityPresenceInformation &presenceInformation);
 	const belle_sip_uri_t* getFrom();
 	const belle_sip_uri_t* getTo();
+	/* Partial notifications (rfc5263), when the subscriber accepts application/pidf-diff+xml. The next notification
+	 * carries the full state. */
+	void enablePartialNotify(bool enable);
   private:
 	const belle_sip_uri_t *mPresentity;
+	std::unique_ptr<PidfDiff> mPidfDiff;
 };
 }
 
@@ -0,0 +1,195 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profiler.hh"
+#include "log/logmanager.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <execinfo.h>
+#include <fstream>
+#include <map>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+thread_local const string *Profiler::sModule = NULL;
+
+/* Bounds the memory of a profile, the samples past it being counted as dropped. */
+static const size_t sMaxSamples = 65536;
+
+Profiler *Profiler::get() {
+	// never deleted, a profile may be written during the exit
+	static Profiler *sInstance = new Profiler();
+	return sInstance;
+}
+
+Profiler::Profiler() : mFrequency(0), mRunning(false), mSampling(false), mInHandler(0), mCapacity(0), mNext(0) {
+}
+
+void Profiler::configure(const string &dir, unsigned int frequency) {
+	lock_guard<mutex> lock(mMutex);
+	mDir = dir;
+	mFrequency = frequency;
+}
+
+string Profiler::start(unsigned int seconds, string &error) {
+	lock_guard<mutex> lock(mMutex);
+	if (mDir.empty() || mFrequency == 0) {
+		error = "profiling is disabled, see global/profiler-dir";
+		return "";
+	}
+	if (mRunning) {
+		error = "a profile is already in progress";
+		return "";
+	}
+	if (seconds == 0) {
+		error = "the duration of the profile must be positive";
+		return "";
+	}
+	if (mThread.joinable())
+		mThread.join();
+
+	// up to 4 threads busy at once, most of the time
+	mCapacity = min(sMaxSamples, (size_t)mFrequency * seconds * 4);
+	if (!mSamples)
+		mSamples.reset(new Sample[sMaxSamples]);
+	mNext = 0;
+	// backtrace() loads libgcc on its first call, which is not to happen in the signal handler
+	void *pcs[2];
+	backtrace(pcs, 2);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &Profiler::sOnSignal;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) == -1) {
+		error = string("cannot handle SIGPROF: ") + strerror(errno);
+		return "";
+	}
+
+	char name[64];
+	time_t now = time(NULL);
+	struct tm tm;
+	strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	string path = mDir + "/flexisip-" + name + "-" + to_string(getpid()) + ".profile";
+	mRunning = true;
+	mSampling = true;
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = max(1000000 / mFrequency, 1u);
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+	LOGI("Profiling for %u seconds at %u Hz to %s", seconds, mFrequency, path.c_str());
+	mThread = thread(&Profiler::run, this, seconds, path);
+	return path;
+}
+
+void Profiler::sOnSignal(int signum, siginfo_t *info, void *context) {
+	Profiler *zis = get();
+	int savedErrno = errno;
+	++zis->mInHandler;
+	if (zis->mSampling) {
+		size_t index = zis->mNext++;
+		if (index < zis->mCapacity) {
+			Sample &sample = zis->mSamples[index];
+			sample.tid = (pid_t)syscall(SYS_gettid);
+			sample.module = sModule;
+			sample.depth = backtrace(sample.pcs, sMaxDepth);
+		}
+	}
+	--zis->mInHandler;
+	errno = savedErrno;
+}
+
+void Profiler::run(unsigned int seconds, string path) {
+	this_thread::sleep_for(chrono::seconds(seconds));
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	mSampling = false;
+	// the signals already delivered
+	while (mInHandler > 0)
+		this_thread::yield();
+	size_t count = min((size_t)mNext, mCapacity);
+	write(path, count, seconds);
+	if (mNext > mCapacity)
+		LOGW("Profile %s lacks %zu samples past its %zu", path.c_str(), (size_t)mNext - mCapacity, mCapacity);
+	mRunning = false;
+}
+
+/*
+ * A text file of a header, then for each distinct stack of a thread and module a line of its count, the thread id,
+ * the module or '-', and the return addresses from the innermost frame, in hexadecimal, then the mappings of the
+ * process as in /proc/self/maps, and the names of the threads.
+ */
+void Profiler::write(const string &path, size_t count, unsigned int seconds) {
+	map<tuple<pid_t, const string *, vector<void *>>, size_t> stacks;
+	for (size_t i = 0; i < count; ++i) {
+		const Sample &sample = mSamples[i];
+		// the first frame is the handler
+		int skip = sample.depth > 1 ? 1 : 0;
+		++stacks[make_tuple(sample.tid, sample.module,
+							vector<void *>(sample.pcs + skip, sample.pcs + sample.depth))];
+	}
+
+	ofstream out(path);
+	if (!out.is_open()) {
+		LOGE("Cannot write profile %s", path.c_str());
+		return;
+	}
+	out << "# flexisip profile\n";
+	out << "frequency " << mFrequency << "\n";
+	out << "duration " << seconds << "\n";
+	out << "samples " << count << "\n";
+	out << "dropped " << ((size_t)mNext - count) << "\n";
+	out << "stacks\n";
+	map<pid_t, size_t> threads;
+	for (const auto &stack : stacks) {
+		const string *module = std::get<1>(stack.first);
+		threads[std::get<0>(stack.first)] += stack.second;
+		out << stack.second << " " << std::get<0>(stack.first) << " " << (module ? *module : "-");
+		char pc[24];
+		for (void *addr : std::get<2>(stack.first)) {
+			snprintf(pc, sizeof(pc), " %lx", (unsigned long)addr);
+			out << pc;
+		}
+		out << "\n";
+	}
+	out << "maps\n";
+	ifstream maps("/proc/self/maps");
+	string line;
+	while (getline(maps, line))
+		out << line << "\n";
+	out << "threads\n";
+	for (const auto &thread : threads) {
+		ifstream comm("/proc/self/task/" + to_string(thread.first) + "/comm");
+		string name;
+		if (!getline(comm, name))
+			name = "-";
+		out << thread.first << " " << name << "\n";
+	}
+	LOGI("Profile of %zu samples written to %s", count, path.c_str());
+}
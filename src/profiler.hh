@@ -0,0 +1,89 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef profiler_hh
+#define profiler_hh
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+
+/*
+ * Samples the stacks of the threads of the process for a given duration, on a SIGPROF every 1/frequency second of
+ * processor time, along with the thread and the module processing a message on it. The signal handler only copies the
+ * return addresses to a buffer allocated beforehand; the profile is written at the end of the duration by a thread of
+ * its own, one line per distinct stack with its count, followed by the memory mappings of the process so that the
+ * addresses are symbolized offline, by tools/profile-symbolize.py.
+ * Disabled until a directory is configured for the profiles.
+ */
+class Profiler {
+  public:
+	static Profiler *get();
+
+	void configure(const std::string &dir, unsigned int frequency);
+	/* Starts sampling for the given seconds. Returns the file the profile will be written to, or an empty string
+	 * with the reason in error when the profiler is disabled or already running. */
+	std::string start(unsigned int seconds, std::string &error);
+
+	/* Sets the module of the samples of the current thread for the lifetime of the scope. */
+	class ModuleScope {
+	  public:
+		ModuleScope(const std::string &module) : mPrevious(sModule) {
+			sModule = &module;
+		}
+		~ModuleScope() {
+			sModule = mPrevious;
+		}
+
+	  private:
+		const std::string *mPrevious;
+	};
+
+  private:
+	static const int sMaxDepth = 48;
+	struct Sample {
+		pid_t tid;
+		const std::string *module;
+		int depth;
+		void *pcs[sMaxDepth];
+	};
+
+	Profiler();
+	static void sOnSignal(int signum, siginfo_t *info, void *context);
+	void run(unsigned int seconds, std::string path);
+	void write(const std::string &path, size_t count, unsigned int seconds);
+
+	std::mutex mMutex;
+	std::string mDir;
+	unsigned int mFrequency;
+	std::thread mThread;
+	std::atomic<bool> mRunning;
+	std::atomic<bool> mSampling;
+	std::atomic<int> mInHandler;
+	std::unique_ptr<Sample[]> mSamples;
+	size_t mCapacity;
+	std::atomic<size_t> mNext;
+	// the name of the module is borrowed: the modules outlive the processing of their messages
+	static thread_local const std::string *sModule __attribute__((tls_model("initial-exec")));
+};
+
+#endif
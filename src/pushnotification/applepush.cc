@@ -1,6 +1,7 @@
 
 #include "applepush.hh"
 #include "common.hh"
+#include "payloadtemplate.hh"
 #include <sstream>
 #include <string>
 #include <stdexcept>
@@ -10,37 +11,54 @@ const unsigned int ApplePushNotificationRequest::DEVICE_BINARY_SIZE = 32;
 uint32_t ApplePushNotificationRequest::Identifier = 1;
 
 ApplePushNotificationRequest::ApplePushNotificationRequest(const PushInfo &info)
-: PushNotificationRequest(info.mAppId, "apple") {
+: PushNotificationRequest(info.mAppId, "apple", info.mDeviceToken) {
 	const std::string &deviceToken = info.mDeviceToken;
 	const std::string &msg_id = info.mAlertMsgId;
 	const std::string &arg = info.mFromName.empty() ? info.mFromUri : info.mFromName;
 	const std::string &sound = info.mAlertSound;
 	const std::string &callid = info.mCallId;
-	std::ostringstream payload;
+
+	mTtl = info.mTtl;
+	// the app id is the bundle id, suffixed by the release mode: the topic of the HTTP/2 API is the bundle id
+	mTopic = info.mAppId;
+	size_t dot = mTopic.rfind('.');
+	if (dot != std::string::npos && (mTopic.compare(dot, std::string::npos, ".dev") == 0 ||
+									 mTopic.compare(dot, std::string::npos, ".prod") == 0)) {
+		mTopic.resize(dot);
+	}
+	static const std::string voipSuffix = ".voip";
+	if (mTopic.size() > voipSuffix.size() &&
+		mTopic.compare(mTopic.size() - voipSuffix.size(), std::string::npos, voipSuffix) == 0) {
+		mPushType = "voip";
+	} else {
+		mPushType = (info.mSilent || msg_id == "IC_SIL") ? "background" : "alert";
+	}
 
 	int ret = formatDeviceToken(deviceToken);
 	if ((ret != 0) || (mDeviceToken.size() != DEVICE_BINARY_SIZE)) {
 		throw std::runtime_error("ApplePushNotification: Invalid deviceToken");
 	}
 
-	if (info.mSilent || msg_id == "IC_SIL") { 
+	if (info.mSilent || msg_id == "IC_SIL") {
 		// silent push: just send "content-available=1", the device will figure out what's happening
 		// We also need msg_id and callid in case the push is received but the device cannot register
-		payload << "{\"aps\":{\"sound\":\"\", \"loc-key\":\"" << msg_id << "\", \"call-id\":\"" << callid << "\", \"content-available\":1},\"pn_ttl\":"<< info.mTtl <<"}";
+		static const PayloadTemplate silent("{\"aps\":{\"sound\":\"\", \"loc-key\":\"$0\", \"call-id\":\"$1\", "
+											"\"content-available\":1},\"pn_ttl\":$2}",
+											PayloadTemplate::Escaping::Json);
+		silent.format(mPayload, {msg_id, callid, info.mTtl});
 	} else {
-
-		payload << "{\"aps\":{\"alert\":{\"loc-key\":\"" << msg_id << "\",\"loc-args\":[\"" << arg
-		<< "\"]},\"sound\":\"" << sound << "\"";
 		/* some apps don't want the push to update the badge - but if they do,
 		 we always put the badge value to 1 because we want to notify the user that
 		 he/she has unread messages even if we do not know the exact count */
-		payload << ",\"badge\":" << (info.mNoBadge ? 0 : 1);
-		payload << "},\"call-id\":\"" << callid << "\",\"pn_ttl\":" << info.mTtl <<"}";
+		static const PayloadTemplate alert("{\"aps\":{\"alert\":{\"loc-key\":\"$0\",\"loc-args\":[\"$1\"]},"
+										   "\"sound\":\"$2\",\"badge\":$3},\"call-id\":\"$4\",\"pn_ttl\":$5}",
+										   PayloadTemplate::Escaping::Json);
+		alert.format(mPayload, {msg_id, arg, sound, info.mNoBadge ? 0 : 1, callid, info.mTtl});
 	}
-	if (payload.str().length() > MAXPAYLOAD_SIZE) {
+	if (mPayload.length() > MAXPAYLOAD_SIZE) {
+		mPayload.clear();
 		return;
 	}
-	mPayload = payload.str();
 	LOGD("Push notification payload is %s", mPayload.c_str());
 }
 
@@ -147,3 +165,30 @@ std::string ApplePushNotificationRequest::isValidResponse(const std::string &str
 	}
 	return "";
 }
+
+bool ApplePushNotificationRequest::getHttp2Request(Http2Headers &headers, std::string &body) {
+	static const char hex[] = "0123456789abcdef";
+	std::string path = "/3/device/";
+	for (auto it = mDeviceToken.cbegin(); it != mDeviceToken.cend(); ++it) {
+		path.push_back(hex[(*it >> 4) & 0x0f]);
+		path.push_back(hex[*it & 0x0f]);
+	}
+	headers.push_back(std::make_pair(":method", "POST"));
+	headers.push_back(std::make_pair(":path", path));
+	headers.push_back(std::make_pair("apns-topic", mTopic));
+	headers.push_back(std::make_pair("apns-push-type", mPushType));
+	// Apple requires the low priority for the background notifications
+	headers.push_back(std::make_pair("apns-priority", mPushType == "background" ? "5" : "10"));
+	headers.push_back(std::make_pair("apns-expiration", std::to_string(time(0) + mTtl)));
+	body = mPayload;
+	return true;
+}
+
+std::string ApplePushNotificationRequest::isValidHttp2Response(int status, const std::string &body) {
+	// the body of an error response is a json object with the reason, such as {"reason":"BadDeviceToken"}
+	if (status == 200)
+		return "";
+	std::stringstream ss;
+	ss << "PNR " << this << " failed with HTTP status " << status << " " << body;
+	return ss.str();
+}
@@ -28,6 +28,8 @@ public:
 	virtual const std::vector<char> &getData();
 	virtual std::string isValidResponse(const std::string &str);
 	virtual bool isServerAlwaysResponding() { return false; }
+	virtual bool getHttp2Request(Http2Headers &headers, std::string &body);
+	virtual std::string isValidHttp2Response(int status, const std::string &body);
 protected:
 	int formatDeviceToken(const std::string &deviceToken);
 	void createPushNotification();
@@ -37,5 +39,8 @@ protected:
 	std::vector<char> mBuffer;
 	std::vector<char> mDeviceToken;
 	std::string mPayload;
+	std::string mTopic;
+	std::string mPushType;
+	int mTtl;
 	static uint32_t Identifier;
 };
@@ -3,23 +3,24 @@
 #include <iostream>
 #include <string.h>
 #include "log/logmanager.hh"
+#include "payloadtemplate.hh"
 
 using namespace std;
 
 FirebasePushNotificationRequest::FirebasePushNotificationRequest(const PushInfo &pinfo)
-: PushNotificationRequest(pinfo.mAppId, "firebase") {
+: PushNotificationRequest(pinfo.mAppId, "firebase", pinfo.mDeviceToken) {
 	const string &deviceToken = pinfo.mDeviceToken;
 	const string &apiKey = pinfo.mApiKey;
-	ostringstream httpBody;
-	httpBody << "{\"to\":\"" << deviceToken << "\", \"priority\":\"high\"}";
-	mHttpBody = httpBody.str();
+	static const PayloadTemplate body("{\"to\":\"$0\", \"priority\":\"high\"}", PayloadTemplate::Escaping::Json);
+	body.format(mHttpBody, {deviceToken});
+	mApiKey = apiKey;
 	LOGD("Push notification https post body is %s", mHttpBody.c_str());
 
-	ostringstream httpHeader;
-	httpHeader << "POST /fcm/send "
-	"HTTP/1.1\r\nHost:fcm.googleapis.com\r\nContent-Type:application/json\r\nAuthorization:key="
-	<< apiKey << "\r\nContent-Length:" << httpBody.str().size() << "\r\n\r\n";
-	mHttpHeader = httpHeader.str();
+	static const PayloadTemplate header("POST /fcm/send HTTP/1.1\r\nHost:fcm.googleapis.com\r\n"
+										"Content-Type:application/json\r\nAuthorization:key=$0\r\n"
+										"Content-Length:$1\r\n\r\n",
+										PayloadTemplate::Escaping::None);
+	header.format(mHttpHeader, {apiKey, mHttpBody.size()});
 	SLOGD << "PNR " << this << " https post header is " << mHttpHeader;
 }
 
@@ -49,3 +50,12 @@ string FirebasePushNotificationRequest::isValidResponse(const string &str) {
 	static const char expected[] = "HTTP/1.1 200";
 	return strncmp(expected, str.c_str(), sizeof(expected) - 1) == 0 ? "" : "Unexpected HTTP response value (not 200 OK)";
 }
+
+bool FirebasePushNotificationRequest::getHttp2Request(Http2Headers &headers, string &body) {
+	headers.push_back(make_pair(":method", "POST"));
+	headers.push_back(make_pair(":path", "/fcm/send"));
+	headers.push_back(make_pair("content-type", "application/json"));
+	headers.push_back(make_pair("authorization", "key=" + mApiKey));
+	body = mHttpBody;
+	return true;
+}
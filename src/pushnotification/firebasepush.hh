@@ -31,10 +31,12 @@ public:
 	virtual bool isServerAlwaysResponding() {
 		return true;
 	}
+	virtual bool getHttp2Request(Http2Headers &headers, std::string &body);
 
 protected:
 	void createPushNotification();
 	std::vector<char> mBuffer;
 	std::string mHttpHeader;
 	std::string mHttpBody;
+	std::string mApiKey;
 };
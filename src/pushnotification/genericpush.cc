@@ -21,41 +21,35 @@
 #include <string.h>
 #include <stdexcept>
 #include "common.hh"
+#include "payloadtemplate.hh"
 
 #include <iostream>
-#include <list>
 
 using namespace std;
 
 GenericPushNotificationRequest::GenericPushNotificationRequest(const PushInfo &pinfo, const url_t *url,
 															   const string &method)
-	: PushNotificationRequest("generic", "generic") {
-	ostringstream httpMessage;
+	: PushNotificationRequest("generic", "generic", pinfo.mDeviceToken) {
 	string path(url->url_path ? url->url_path : "");
 	string headers(url->url_headers ? url->url_headers : "");
 
 	substituteArgs(path, pinfo);
 	substituteArgs(headers, pinfo);
 
-	httpMessage << method << " /" << path;
-	if (!headers.empty())
-		httpMessage << "?" << headers;
-	httpMessage << " HTTP/1.1\r\n";
-	httpMessage << "Host: " << url->url_host;
+	string host(url->url_host);
 	if (url->url_port)
-		httpMessage << ":" << url->url_port;
-	httpMessage << "\r\n";
+		host.append(":").append(url->url_port);
+	const char *query = headers.empty() ? "" : "?";
 	if (!pinfo.mText.empty()) {
-		httpMessage << "Content-Type: text/plain\r\n";
-		httpMessage << "Content-Length: " << pinfo.mText.size() << "\r\n";
-	} else
-		httpMessage << "Content-Length: 0\r\n";
-	httpMessage << "\r\n";
-	if (!pinfo.mText.empty()) {
-		httpMessage << pinfo.mText;
-		httpMessage << "\r\n";
+		static const PayloadTemplate message("$0 /$1$2$3 HTTP/1.1\r\nHost: $4\r\nContent-Type: text/plain\r\n"
+											 "Content-Length: $5\r\n\r\n$6\r\n",
+											 PayloadTemplate::Escaping::None);
+		message.format(mHttpMessage, {method, path, query, headers, host, pinfo.mText.size(), pinfo.mText});
+	} else {
+		static const PayloadTemplate message("$0 /$1$2$3 HTTP/1.1\r\nHost: $4\r\nContent-Length: 0\r\n\r\n",
+											 PayloadTemplate::Escaping::None);
+		message.format(mHttpMessage, {method, path, query, headers, host});
 	}
-	mHttpMessage = httpMessage.str();
 	SLOGD << "GenericPushNotificationRequest" << this << " http message is " << mHttpMessage;
 }
 
@@ -83,40 +77,37 @@ string GenericPushNotificationRequest::isValidResponse(const string &str) {
 }
 
 struct KeyVal {
-	KeyVal(const char *keyword, const string &value) : mKeyword(keyword), mValue(value) {
-	}
 	const char *mKeyword;
-	const string mValue;
+	const string &mValue;
 };
 
 string &GenericPushNotificationRequest::substituteArgs(string &input, const PushInfo &pinfo) {
-	list<KeyVal> keyvals;
 	static const char *http_reserved = "!*'();:@&=+$,/?#[]";
-
-	keyvals.push_back(KeyVal("$type", pinfo.mType));
-	keyvals.push_back(KeyVal("$token", pinfo.mDeviceToken));
-	keyvals.push_back(KeyVal("$api-key", pinfo.mApiKey));
-	keyvals.push_back(KeyVal("$app-id", pinfo.mAppId));
-	keyvals.push_back(KeyVal("$from-name", pinfo.mFromName));
-	keyvals.push_back(KeyVal("$from-uri", pinfo.mFromUri));
-	keyvals.push_back(KeyVal("$from-tag", pinfo.mFromTag));
-	keyvals.push_back(KeyVal("$to-uri", pinfo.mToUri));
-	keyvals.push_back(KeyVal("$call-id", pinfo.mCallId));
-	keyvals.push_back(KeyVal("$event", pinfo.mEvent == PushInfo::Call ? "call" : "message"));
-	keyvals.push_back(KeyVal("$sound", pinfo.mAlertSound));
-	keyvals.push_back(KeyVal("$msgid", pinfo.mAlertMsgId));
-	keyvals.push_back(KeyVal("$uid", pinfo.mUid));
-
-	for (auto it = keyvals.begin(); it != keyvals.end(); ++it) {
-		size_t pos = input.find((*it).mKeyword);
+	static const string call("call"), message("message");
+	const KeyVal keyvals[] = {{"$type", pinfo.mType},
+							  {"$token", pinfo.mDeviceToken},
+							  {"$api-key", pinfo.mApiKey},
+							  {"$app-id", pinfo.mAppId},
+							  {"$from-name", pinfo.mFromName},
+							  {"$from-uri", pinfo.mFromUri},
+							  {"$from-tag", pinfo.mFromTag},
+							  {"$to-uri", pinfo.mToUri},
+							  {"$call-id", pinfo.mCallId},
+							  {"$event", pinfo.mEvent == PushInfo::Call ? call : message},
+							  {"$sound", pinfo.mAlertSound},
+							  {"$msgid", pinfo.mAlertMsgId},
+							  {"$uid", pinfo.mUid}};
+
+	for (const auto &kv : keyvals) {
+		size_t pos = input.find(kv.mKeyword);
 		if (pos != string::npos) {
 			string value;
-			if (url_reserved_p((*it).mValue.c_str())) {
-				value.resize(url_esclen((*it).mValue.c_str(), http_reserved));
-				url_escape(&value.at(0), (*it).mValue.c_str(), http_reserved);
+			if (url_reserved_p(kv.mValue.c_str())) {
+				value.resize(url_esclen(kv.mValue.c_str(), http_reserved));
+				url_escape(&value.at(0), kv.mValue.c_str(), http_reserved);
 			} else
-				value = (*it).mValue;
-			input.replace(pos, strlen((*it).mKeyword), value);
+				value = kv.mValue;
+			input.replace(pos, strlen(kv.mKeyword), value);
 		}
 	}
 	return input;
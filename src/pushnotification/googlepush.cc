@@ -3,29 +3,27 @@
 #include <iostream>
 #include <string.h>
 #include "log/logmanager.hh"
+#include "payloadtemplate.hh"
 
 using namespace std;
 
 GooglePushNotificationRequest::GooglePushNotificationRequest(const PushInfo &pinfo)
-: PushNotificationRequest(pinfo.mAppId, "google") {
+: PushNotificationRequest(pinfo.mAppId, "google", pinfo.mDeviceToken) {
 	const string &deviceToken = pinfo.mDeviceToken;
 	const string &apiKey = pinfo.mApiKey;
 	const string &arg = pinfo.mFromName.empty() ? pinfo.mFromUri : pinfo.mFromName;
 	const string &callid = pinfo.mCallId;
-	ostringstream httpBody;
-	httpBody << "{\"registration_ids\":[\"" << deviceToken << "\"],\"data\":{\"loc-args\":\"" << arg
-	<< "\"}"
-	",\"priority\":\"high\""
-	",\"call-id\":\""
-	<< callid << "\"}";
-	mHttpBody = httpBody.str();
+	static const PayloadTemplate body("{\"registration_ids\":[\"$0\"],\"data\":{\"loc-args\":\"$1\"},"
+									  "\"priority\":\"high\",\"call-id\":\"$2\"}",
+									  PayloadTemplate::Escaping::Json);
+	body.format(mHttpBody, {deviceToken, arg, callid});
 	LOGD("Push notification https post body is %s", mHttpBody.c_str());
 
-	ostringstream httpHeader;
-	httpHeader << "POST /gcm/send "
-	"HTTP/1.1\r\nHost:android.googleapis.com\r\nContent-Type:application/json\r\nAuthorization:key="
-	<< apiKey << "\r\nContent-Length:" << httpBody.str().size() << "\r\n\r\n";
-	mHttpHeader = httpHeader.str();
+	static const PayloadTemplate header("POST /gcm/send HTTP/1.1\r\nHost:android.googleapis.com\r\n"
+										"Content-Type:application/json\r\nAuthorization:key=$0\r\n"
+										"Content-Length:$1\r\n\r\n",
+										PayloadTemplate::Escaping::None);
+	header.format(mHttpHeader, {apiKey, mHttpBody.size()});
 	SLOGD << "PNR " << this << " https post header is " << mHttpHeader;
 }
 
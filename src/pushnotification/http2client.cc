@@ -0,0 +1,696 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2017  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "http2client.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+
+using namespace std;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static void ECDSA_SIG_get0(const ECDSA_SIG *sig, const BIGNUM **pr, const BIGNUM **ps) {
+	*pr = sig->r;
+	*ps = sig->s;
+}
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+static const time_t sRequestTimeout = 10;
+static const time_t sIdleTimeout = 300;
+static const time_t sConnectRetryDelay = 5;
+static const time_t sConnectTimeout = 5;
+static const time_t sResolveLifetime = 300;
+// APNs refuses the tokens older than one hour, and the ones renewed more than once every 20 minutes
+static const time_t sAuthTokenLifetime = 40 * 60;
+
+static string base64Url(const unsigned char *data, size_t len) {
+	vector<unsigned char> out(4 * ((len + 2) / 3) + 1);
+	int size = EVP_EncodeBlock(out.data(), data, len);
+	string encoded((const char *)out.data(), size);
+	while (!encoded.empty() && encoded.back() == '=')
+		encoded.pop_back();
+	for (auto it = encoded.begin(); it != encoded.end(); ++it) {
+		if (*it == '+')
+			*it = '-';
+		else if (*it == '/')
+			*it = '_';
+	}
+	return encoded;
+}
+
+static string base64Url(const string &data) {
+	return base64Url((const unsigned char *)data.data(), data.size());
+}
+
+static nghttp2_nv makeHeader(const string &name, const string &value) {
+	nghttp2_nv nv = {(uint8_t *)name.data(), (uint8_t *)value.data(), name.size(), value.size(), NGHTTP2_NV_FLAG_NONE};
+	return nv;
+}
+
+Http2IoThread::Http2IoThread() : mRunning(true) {
+	if (pipe(mWakePipe) == 0) {
+		fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+	} else {
+		SLOGE << "Http2IoThread cannot create pipe: " << strerror(errno);
+		mWakePipe[0] = mWakePipe[1] = -1;
+	}
+	mThread = thread(&Http2IoThread::run, this);
+}
+
+Http2IoThread::~Http2IoThread() {
+	mRunning = false;
+	wakeUp();
+	mThread.join();
+	if (mWakePipe[0] != -1) {
+		close(mWakePipe[0]);
+		close(mWakePipe[1]);
+	}
+}
+
+void Http2IoThread::addClient(Http2PushNotificationClient *client) {
+	unique_lock<mutex> lock(mMutex);
+	mClients.push_back(client);
+}
+
+void Http2IoThread::removeClient(Http2PushNotificationClient *client) {
+	unique_lock<mutex> lock(mMutex);
+	mClients.erase(remove(mClients.begin(), mClients.end(), client), mClients.end());
+	for (auto it = mPolled.begin(); it != mPolled.end(); ++it) {
+		if (it->first == client)
+			it->first = NULL;
+	}
+}
+
+void Http2IoThread::wakeUp() {
+	char c = 0;
+	if (mWakePipe[1] != -1 && write(mWakePipe[1], &c, 1) < 0 && errno != EAGAIN) {
+		SLOGE << "Http2IoThread cannot wake up the thread: " << strerror(errno);
+	}
+}
+
+void Http2IoThread::run() {
+	vector<pollfd> fds;
+	while (mRunning) {
+		fds.resize(1);
+		fds[0].fd = mWakePipe[0];
+		fds[0].events = POLLIN;
+		{
+			unique_lock<mutex> lock(mMutex);
+			mPolled.clear();
+			for (auto it = mClients.begin(); it != mClients.end(); ++it) {
+				mPolled.push_back(make_pair(*it, fds.size()));
+				(*it)->prepare(fds);
+			}
+		}
+		// the lock is not held while waiting, so that the clients can be removed meanwhile
+		int ret = poll(fds.data(), fds.size(), 1000);
+		if (ret < 0) {
+			if (errno != EINTR)
+				SLOGE << "Http2IoThread poll error: " << strerror(errno);
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(mWakePipe[0], buf, sizeof(buf)) > 0) {
+			}
+		}
+		unique_lock<mutex> lock(mMutex);
+		for (auto it = mPolled.begin(); it != mPolled.end(); ++it) {
+			if (it->first)
+				it->first->process(&fds[it->second]);
+		}
+		mPolled.clear();
+	}
+}
+
+Http2PushNotificationClient::Http2PushNotificationClient(const string &name, PushNotificationService *service,
+														 SSL_CTX *ctx, const string &host, const string &port,
+														 int maxQueueSize, int maxConnections, int maxStreams,
+														 Http2IoThread *ioThread)
+	: PushNotificationClient(name, service, ctx, host, port, maxQueueSize, true), mIoThread(ioThread), mInFlight(0),
+	  mMaxConnections(maxConnections > 0 ? maxConnections : 1), mMaxStreams(maxStreams > 0 ? maxStreams : 1),
+	  mLastConnectFailure(0), mAddressLen(0), mResolveDate(0), mTlsSession(NULL), mAuthKey(NULL), mAuthTokenDate(0) {
+	mIoThread->addClient(this);
+}
+
+Http2PushNotificationClient::~Http2PushNotificationClient() {
+	mIoThread->removeClient(this);
+	while (!mConnections.empty()) {
+		closeConnection(mConnections.begin(), "Client destroyed");
+	}
+	if (mTlsSession)
+		SSL_SESSION_free(mTlsSession);
+	if (mAuthKey)
+		EVP_PKEY_free(mAuthKey);
+}
+
+bool Http2PushNotificationClient::setupContext(SSL_CTX *ctx) {
+	static const unsigned char alpn[] = {2, 'h', '2'};
+	SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1 |
+								 SSL_OP_NO_COMPRESSION);
+	// nghttp2 may retry a write with another buffer, after a partial one
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	// the context is shared by the clients of a pool, so each client keeps its own session rather than the context
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, &Http2PushNotificationClient::onNewSession);
+	return SSL_CTX_set_alpn_protos(ctx, alpn, sizeof(alpn)) == 0;
+}
+
+bool Http2PushNotificationClient::setAuthenticationKey(const string &keyPath, const string &keyId,
+														const string &teamId) {
+	FILE *f = fopen(keyPath.c_str(), "r");
+	if (!f) {
+		SLOGE << "Cannot open push notification authentication key " << keyPath << ": " << strerror(errno);
+		return false;
+	}
+	EVP_PKEY *key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (!key || EVP_PKEY_base_id(key) != EVP_PKEY_EC) {
+		SLOGE << "Push notification authentication key " << keyPath << " is not an EC private key";
+		if (key)
+			EVP_PKEY_free(key);
+		return false;
+	}
+	if (mAuthKey)
+		EVP_PKEY_free(mAuthKey);
+	mAuthKey = key;
+	mAuthKeyId = keyId;
+	mTeamId = teamId;
+	mAuthToken.clear();
+	return true;
+}
+
+/* JSON web token signed with ES256, as required by APNs. */
+const string &Http2PushNotificationClient::getAuthenticationToken() {
+	time_t now = time(NULL);
+	if (!mAuthToken.empty() && now - mAuthTokenDate < sAuthTokenLifetime)
+		return mAuthToken;
+
+	string input = base64Url("{\"alg\":\"ES256\",\"kid\":\"" + mAuthKeyId + "\"}") + "." +
+				   base64Url("{\"iss\":\"" + mTeamId + "\",\"iat\":" + to_string(now) + "}");
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	size_t derLen = 0;
+	vector<unsigned char> der;
+	bool ok = ctx && EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, mAuthKey) == 1 &&
+			  EVP_DigestSignUpdate(ctx, input.data(), input.size()) == 1 &&
+			  EVP_DigestSignFinal(ctx, NULL, &derLen) == 1;
+	if (ok) {
+		der.resize(derLen);
+		ok = EVP_DigestSignFinal(ctx, der.data(), &derLen) == 1;
+	}
+	if (ctx)
+		EVP_MD_CTX_free(ctx);
+
+	// the signature is the raw concatenation of r and s, instead of the DER sequence made by OpenSSL
+	const unsigned char *p = der.data();
+	ECDSA_SIG *sig = ok ? d2i_ECDSA_SIG(NULL, &p, derLen) : NULL;
+	if (!sig) {
+		SLOGE << "Http2PushNotificationClient " << mName << " cannot sign the authentication token";
+		mAuthToken.clear();
+		return mAuthToken;
+	}
+	const BIGNUM *r, *s;
+	ECDSA_SIG_get0(sig, &r, &s);
+	unsigned char raw[64] = {0};
+	BN_bn2bin(r, raw + 32 - BN_num_bytes(r));
+	BN_bn2bin(s, raw + 64 - BN_num_bytes(s));
+	ECDSA_SIG_free(sig);
+
+	mAuthToken = input + "." + base64Url(raw, sizeof(raw));
+	mAuthTokenDate = now;
+	SLOGD << "Http2PushNotificationClient " << mName << " authentication token renewed";
+	return mAuthToken;
+}
+
+int Http2PushNotificationClient::sendPush(const shared_ptr<PushNotificationRequest> &req) {
+	unique_lock<mutex> lock(mQueueMutex);
+	int size = mRequestQueue.size();
+	if (size >= mMaxQueueSize) {
+		lock.unlock();
+		SLOGW << "Http2PushNotificationClient " << mName << " PNR " << req.get() << " queue full, push lost";
+		onError(req, "Error queue full");
+		return 0;
+	}
+	req->setState(PushNotificationRequest::InProgress);
+	mRequestQueue.push(req);
+	SLOGD << "Http2PushNotificationClient " << mName << " PNR " << req.get() << " queued, queue_size=" << size
+		  << " in_flight=" << mInFlight;
+	lock.unlock();
+	mIoThread->wakeUp();
+	return 1;
+}
+
+bool Http2PushNotificationClient::isIdle() {
+	unique_lock<mutex> lock(mQueueMutex);
+	return mRequestQueue.empty() && mInFlight == 0;
+}
+
+size_t Http2PushNotificationClient::getLoad() {
+	unique_lock<mutex> lock(mQueueMutex);
+	return mRequestQueue.size() + mInFlight;
+}
+
+void Http2PushNotificationClient::prepare(vector<pollfd> &fds) {
+	checkTimeouts();
+	dispatchRequests();
+	for (auto it = mConnections.begin(); it != mConnections.end(); ++it) {
+		Connection *conn = it->get();
+		pollfd pfd;
+		pfd.fd = conn->fd;
+		pfd.revents = 0;
+		if (conn->state == Connecting) {
+			pfd.events = POLLOUT;
+		} else if (conn->state == Handshaking) {
+			pfd.events = SSL_want_write(conn->ssl) ? POLLOUT : POLLIN;
+		} else {
+			pfd.events = POLLIN;
+			if (nghttp2_session_want_write(conn->session) || SSL_want_write(conn->ssl))
+				pfd.events |= POLLOUT;
+		}
+		fds.push_back(pfd);
+	}
+}
+
+void Http2PushNotificationClient::process(const pollfd *fds) {
+	size_t i = 0;
+	for (auto it = mConnections.begin(); it != mConnections.end(); ++i) {
+		Connection *conn = it->get();
+		short revents = fds[i].revents;
+		bool ok = true;
+		const char *error = "Connection error";
+		if (conn->state != Ready) {
+			if (revents)
+				ok = progressHandshake(conn, revents);
+			error = "Cannot create connection to server";
+		} else {
+			if (revents & (POLLIN | POLLERR | POLLHUP))
+				ok = nghttp2_session_recv(conn->session) == 0;
+			ok = ok && nghttp2_session_send(conn->session) == 0;
+			if (ok && !nghttp2_session_want_read(conn->session) && !nghttp2_session_want_write(conn->session)) {
+				ok = false;
+				error = "Connection closed by server";
+			}
+		}
+		if (!ok) {
+			auto closed = it++;
+			closeConnection(closed, error);
+		} else {
+			++it;
+		}
+	}
+}
+
+void Http2PushNotificationClient::dispatchRequests() {
+	unique_lock<mutex> lock(mQueueMutex);
+	while (!mRequestQueue.empty()) {
+		// least loaded connection which can take one more stream
+		Connection *conn = NULL;
+		size_t load = 0;
+		bool pending = false;
+		for (auto it = mConnections.begin(); it != mConnections.end(); ++it) {
+			if ((*it)->state != Ready) {
+				pending = true;
+				continue;
+			}
+			size_t limit = min((size_t)nghttp2_session_get_remote_settings(
+								   (*it)->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS),
+							   mMaxStreams);
+			size_t streams = (*it)->streams.size();
+			if (streams < limit && (!conn || streams < load)) {
+				conn = it->get();
+				load = streams;
+			}
+		}
+		if (!conn) {
+			// the requests wait for the connection being opened, if any
+			if (pending || mConnections.size() >= mMaxConnections)
+				break;
+			if (!mConnections.empty() && getCurrentTime() - mLastConnectFailure < sConnectRetryDelay)
+				break;
+			lock.unlock();
+			bool opened = openConnection();
+			lock.lock();
+			if (!opened && mConnections.empty()) {
+				lock.unlock();
+				failQueuedRequests("Cannot create connection to server");
+				return;
+			}
+			break;
+		}
+		auto req = mRequestQueue.front();
+		mRequestQueue.pop();
+		++mInFlight;
+		lock.unlock();
+		if (!submitRequest(conn, req)) {
+			--mInFlight;
+		}
+		lock.lock();
+	}
+}
+
+void Http2PushNotificationClient::failQueuedRequests(const string &reason) {
+	queue<shared_ptr<PushNotificationRequest>> failed;
+	{
+		unique_lock<mutex> lock(mQueueMutex);
+		failed.swap(mRequestQueue);
+	}
+	while (!failed.empty()) {
+		onError(failed.front(), reason);
+		failed.pop();
+	}
+}
+
+bool Http2PushNotificationClient::submitRequest(Connection *conn, const shared_ptr<PushNotificationRequest> &req) {
+	auto stream = make_shared<Stream>();
+	Http2Headers headers;
+	if (!req->getHttp2Request(headers, stream->body)) {
+		onError(req, "Request cannot be sent with HTTP/2");
+		return false;
+	}
+	headers.insert(headers.begin() + 1, make_pair(":scheme", "https"));
+	headers.insert(headers.begin() + 2, make_pair(":authority", mHost));
+	if (mAuthKey) {
+		const string &token = getAuthenticationToken();
+		if (!token.empty())
+			headers.push_back(make_pair("authorization", "bearer " + token));
+	}
+	string contentLength = to_string(stream->body.size());
+	headers.push_back(make_pair("content-length", contentLength));
+	vector<nghttp2_nv> nva;
+	for (auto it = headers.cbegin(); it != headers.cend(); ++it) {
+		nva.push_back(makeHeader(it->first, it->second));
+	}
+
+	stream->request = req;
+	stream->sent = 0;
+	stream->status = 0;
+	stream->startTime = getCurrentTime();
+	stream->timedOut = false;
+	nghttp2_data_provider provider;
+	provider.source.ptr = stream.get();
+	provider.read_callback = &Http2PushNotificationClient::readBody;
+	int32_t id = nghttp2_submit_request(conn->session, NULL, nva.data(), nva.size(), &provider, NULL);
+	if (id < 0) {
+		onError(req, string("Cannot submit request: ") + nghttp2_strerror(id));
+		return false;
+	}
+	conn->streams[id] = stream;
+	conn->lastUse = stream->startTime;
+	SLOGD << "Http2PushNotificationClient " << mName << " PNR " << req.get() << " sent on stream " << id;
+	return true;
+}
+
+/* The address is resolved again after a connection failure, and from time to time. */
+bool Http2PushNotificationClient::resolve() {
+	time_t now = getCurrentTime();
+	if (mAddressLen != 0 && now - mResolveDate < sResolveLifetime)
+		return true;
+	addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &res);
+	if (err != 0) {
+		SLOGE << "Http2PushNotificationClient " << mName << " cannot resolve " << mHost << ": " << gai_strerror(err);
+		mAddressLen = 0;
+		return false;
+	}
+	memcpy(&mAddress, res->ai_addr, res->ai_addrlen);
+	mAddressLen = res->ai_addrlen;
+	mResolveDate = now;
+	freeaddrinfo(res);
+	return true;
+}
+
+bool Http2PushNotificationClient::openConnection() {
+	if (!resolve()) {
+		mLastConnectFailure = getCurrentTime();
+		return false;
+	}
+	int fd = socket(mAddress.ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		SLOGE << "Http2PushNotificationClient " << mName << " cannot create socket: " << strerror(errno);
+		mLastConnectFailure = getCurrentTime();
+		return false;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	// even when connected at once, the socket is writable at the next poll, which starts the handshake
+	if (connect(fd, (const sockaddr *)&mAddress, mAddressLen) != 0 && errno != EINPROGRESS) {
+			SLOGE << "Http2PushNotificationClient " << mName << " cannot connect to " << mHost << ":" << mPort << ": "
+			  << strerror(errno);
+		close(fd);
+		mAddressLen = 0;
+		mLastConnectFailure = getCurrentTime();
+		return false;
+	}
+
+	unique_ptr<Connection> conn(new Connection());
+	conn->client = this;
+	conn->state = Connecting;
+	conn->fd = fd;
+	conn->ssl = SSL_new(mCtx);
+	conn->session = NULL;
+	conn->lastUse = getCurrentTime();
+	SSL_set_fd(conn->ssl, fd);
+	SSL_set_tlsext_host_name(conn->ssl, mHost.c_str());
+	SSL_set_app_data(conn->ssl, this);
+	if (mTlsSession)
+		SSL_set_session(conn->ssl, mTlsSession);
+	mConnections.push_back(move(conn));
+	return true;
+}
+
+/* Drives the TCP connection then the TLS handshake, and creates the HTTP/2 session once they are done. */
+bool Http2PushNotificationClient::progressHandshake(Connection *conn, short revents) {
+	if (conn->state == Connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+			SLOGE << "Http2PushNotificationClient " << mName << " cannot connect to " << mHost << ":" << mPort << ": "
+				  << strerror(err);
+			return false;
+		}
+		conn->state = Handshaking;
+	}
+
+	ERR_clear_error();
+	int ret = SSL_connect(conn->ssl);
+	if (ret != 1) {
+		int err = SSL_get_error(conn->ssl, ret);
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+			return true;
+		SLOGE << "Http2PushNotificationClient " << mName << " handshake with " << mHost << " failed";
+		ERR_print_errors_fp(stderr);
+		return false;
+	}
+	const unsigned char *alpn = NULL;
+	unsigned int alpnLen = 0;
+	SSL_get0_alpn_selected(conn->ssl, &alpn, &alpnLen);
+	if (alpnLen != 2 || memcmp(alpn, "h2", 2) != 0) {
+		SLOGE << "Http2PushNotificationClient " << mName << " server " << mHost << " does not support HTTP/2";
+		return false;
+	}
+	if (SSL_get_verify_mode(conn->ssl) == SSL_VERIFY_PEER && SSL_get_verify_result(conn->ssl) != X509_V_OK) {
+		SLOGE << "Certificate verification error: " << X509_verify_cert_error_string(SSL_get_verify_result(conn->ssl));
+		return false;
+	}
+
+	nghttp2_session_callbacks *callbacks;
+	nghttp2_session_callbacks_new(&callbacks);
+	nghttp2_session_callbacks_set_send_callback(callbacks, &Http2PushNotificationClient::onSend);
+	nghttp2_session_callbacks_set_recv_callback(callbacks, &Http2PushNotificationClient::onRecv);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks, &Http2PushNotificationClient::onHeader);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &Http2PushNotificationClient::onDataChunk);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &Http2PushNotificationClient::onStreamClose);
+	nghttp2_session_client_new(&conn->session, callbacks, conn);
+	nghttp2_session_callbacks_del(callbacks);
+
+	nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_ENABLE_PUSH, 0}};
+	nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, settings, 1);
+	conn->state = Ready;
+	conn->lastUse = getCurrentTime();
+
+	SLOGD << "Http2PushNotificationClient " << mName << " connected to " << mHost << ", " << mConnections.size()
+		  << " connection(s)" << (SSL_session_reused(conn->ssl) ? ", TLS session resumed" : "");
+	return nghttp2_session_send(conn->session) == 0;
+}
+
+int Http2PushNotificationClient::onNewSession(SSL *ssl, SSL_SESSION *session) {
+	Http2PushNotificationClient *client = (Http2PushNotificationClient *)SSL_get_app_data(ssl);
+	if (!client)
+		return 0;
+	if (client->mTlsSession)
+		SSL_SESSION_free(client->mTlsSession);
+	// the reference is kept by returning 1
+	client->mTlsSession = session;
+	return 1;
+}
+
+void Http2PushNotificationClient::closeConnection(list<unique_ptr<Connection>>::iterator it, const string &reason) {
+	Connection *conn = it->get();
+	bool established = conn->state == Ready;
+	map<int32_t, shared_ptr<Stream>> streams;
+	streams.swap(conn->streams);
+	if (conn->session)
+		nghttp2_session_del(conn->session);
+	SSL_free(conn->ssl);
+	close(conn->fd);
+	mConnections.erase(it);
+	SLOGD << "Http2PushNotificationClient " << mName << " connection closed: " << reason;
+	for (auto st = streams.begin(); st != streams.end(); ++st) {
+		--mInFlight;
+		onError(st->second->request, reason);
+	}
+	if (!established) {
+		mLastConnectFailure = getCurrentTime();
+		mAddressLen = 0;
+		// nothing can be sent until the server is reachable again
+		if (mConnections.empty())
+			failQueuedRequests(reason);
+	}
+}
+
+void Http2PushNotificationClient::checkTimeouts() {
+	time_t now = getCurrentTime();
+	for (auto it = mConnections.begin(); it != mConnections.end();) {
+		Connection *conn = it->get();
+		if (conn->state != Ready && now - conn->lastUse > sConnectTimeout) {
+			auto pending = it++;
+			closeConnection(pending, "Connection timeout");
+			continue;
+		}
+		if (conn->streams.empty() && now - conn->lastUse > sIdleTimeout) {
+			auto idle = it++;
+			closeConnection(idle, "Idle connection");
+			continue;
+		}
+		for (auto st = conn->streams.begin(); st != conn->streams.end(); ++st) {
+			Stream *stream = st->second.get();
+			if (!stream->timedOut && now - stream->startTime > sRequestTimeout) {
+				stream->timedOut = true;
+				nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, st->first, NGHTTP2_CANCEL);
+			}
+		}
+		++it;
+	}
+}
+
+void Http2PushNotificationClient::finishStream(Connection *conn, int32_t streamId, uint32_t errorCode) {
+	auto it = conn->streams.find(streamId);
+	if (it == conn->streams.end())
+		return;
+	shared_ptr<Stream> stream = it->second;
+	conn->streams.erase(it);
+	--mInFlight;
+	if (stream->timedOut) {
+		onError(stream->request, "No response from server");
+	} else if (stream->status == 0) {
+		onError(stream->request, string("Stream closed by server: ") + nghttp2_http2_strerror(errorCode));
+	} else {
+		string error = stream->request->isValidHttp2Response(stream->status, stream->response);
+		if (error.empty()) {
+			onSuccess(stream->request);
+		} else {
+			// the server is overloaded or failing: the request may succeed later
+			bool transient = stream->status == 429 || stream->status >= 500;
+			onError(stream->request, "Invalid server response: " + error, transient);
+		}
+	}
+}
+
+ssize_t Http2PushNotificationClient::onSend(nghttp2_session *session, const uint8_t *data, size_t length, int flags,
+											void *userData) {
+	Connection *conn = (Connection *)userData;
+	ERR_clear_error();
+	int ret = SSL_write(conn->ssl, data, length);
+	if (ret > 0)
+		return ret;
+	int err = SSL_get_error(conn->ssl, ret);
+	if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+		return NGHTTP2_ERR_WOULDBLOCK;
+	return NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+ssize_t Http2PushNotificationClient::onRecv(nghttp2_session *session, uint8_t *buf, size_t length, int flags,
+											void *userData) {
+	Connection *conn = (Connection *)userData;
+	ERR_clear_error();
+	int ret = SSL_read(conn->ssl, buf, length);
+	if (ret > 0)
+		return ret;
+	int err = SSL_get_error(conn->ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		return NGHTTP2_ERR_WOULDBLOCK;
+	if (err == SSL_ERROR_ZERO_RETURN)
+		return NGHTTP2_ERR_EOF;
+	return NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+int Http2PushNotificationClient::onHeader(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+										  size_t namelen, const uint8_t *value, size_t valuelen, uint8_t flags,
+										  void *userData) {
+	Connection *conn = (Connection *)userData;
+	if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE)
+		return 0;
+	auto it = conn->streams.find(frame->hd.stream_id);
+	if (it != conn->streams.end() && namelen == 7 && memcmp(name, ":status", 7) == 0)
+		it->second->status = atoi(string((const char *)value, valuelen).c_str());
+	return 0;
+}
+
+int Http2PushNotificationClient::onDataChunk(nghttp2_session *session, uint8_t flags, int32_t streamId,
+											 const uint8_t *data, size_t len, void *userData) {
+	Connection *conn = (Connection *)userData;
+	auto it = conn->streams.find(streamId);
+	if (it != conn->streams.end())
+		it->second->response.append((const char *)data, len);
+	return 0;
+}
+
+int Http2PushNotificationClient::onStreamClose(nghttp2_session *session, int32_t streamId, uint32_t errorCode,
+											   void *userData) {
+	Connection *conn = (Connection *)userData;
+	conn->client->finishStream(conn, streamId, errorCode);
+	return 0;
+}
+
+ssize_t Http2PushNotificationClient::readBody(nghttp2_session *session, int32_t streamId, uint8_t *buf, size_t length,
+											  uint32_t *dataFlags, nghttp2_data_source *source, void *userData) {
+	Stream *stream = (Stream *)source->ptr;
+	size_t size = min(length, stream->body.size() - stream->sent);
+	memcpy(buf, stream->body.data() + stream->sent, size);
+	stream->sent += size;
+	if (stream->sent == stream->body.size())
+		*dataFlags |= NGHTTP2_DATA_FLAG_EOF;
+	return size;
+}
@@ -0,0 +1,150 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2017  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "pushnotificationclient.hh"
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <openssl/evp.h>
+
+#include <nghttp2/nghttp2.h>
+
+class Http2PushNotificationClient;
+
+/*
+ * Thread driving the non-blocking connections of several HTTP/2 clients, so that the number of threads does not grow
+ * with the number of applications.
+ */
+class Http2IoThread {
+  public:
+	Http2IoThread();
+	~Http2IoThread();
+	void addClient(Http2PushNotificationClient *client);
+	/* Once it returns, the thread no longer uses the client. */
+	void removeClient(Http2PushNotificationClient *client);
+	void wakeUp();
+
+  private:
+	void run();
+
+	std::thread mThread;
+	std::mutex mMutex;
+	std::vector<Http2PushNotificationClient *> mClients;
+	// clients being polled, with the index of their first entry, reset when a client is removed
+	std::vector<std::pair<Http2PushNotificationClient *, size_t>> mPolled;
+	std::atomic<bool> mRunning;
+	int mWakePipe[2];
+};
+
+/*
+ * Push notification client multiplexing the requests on HTTP/2 connections to the push server (APNs, FCM).
+ * Each connection carries up to max-streams requests at once, within the limit announced by the server, and more
+ * connections are opened when they are all full, up to max-connections.
+ * The connections are non-blocking, driven by an Http2IoThread shared with other clients, and resume the previous TLS
+ * session when they are reopened.
+ */
+class Http2PushNotificationClient : public PushNotificationClient {
+	friend class Http2IoThread;
+
+  public:
+	Http2PushNotificationClient(const std::string &name, PushNotificationService *service, SSL_CTX *ctx,
+								const std::string &host, const std::string &port, int maxQueueSize, int maxConnections,
+								int maxStreams, Http2IoThread *ioThread);
+	virtual ~Http2PushNotificationClient();
+	virtual int sendPush(const std::shared_ptr<PushNotificationRequest> &req);
+	virtual bool isIdle();
+	virtual size_t getLoad();
+	/* Authenticates the requests with tokens signed by this key (APNs .p8 key) rather than with a certificate. */
+	bool setAuthenticationKey(const std::string &keyPath, const std::string &keyId, const std::string &teamId);
+
+	/* Requires TLS 1.2 and the negotiation of HTTP/2 with ALPN on the context, as HTTP/2 does, and enables the
+	 * resumption of the TLS sessions. */
+	static bool setupContext(SSL_CTX *ctx);
+
+  private:
+	struct Stream {
+		std::shared_ptr<PushNotificationRequest> request;
+		std::string body;
+		size_t sent;
+		std::string response;
+		int status;
+		time_t startTime;
+		bool timedOut;
+	};
+	enum ConnectionState { Connecting, Handshaking, Ready };
+	struct Connection {
+		Http2PushNotificationClient *client;
+		ConnectionState state;
+		int fd;
+		SSL *ssl;
+		nghttp2_session *session;
+		std::map<int32_t, std::shared_ptr<Stream>> streams;
+		time_t lastUse;
+	};
+
+	// called by the I/O thread: prepare() appends one entry per connection, which process() reads back after poll
+	void prepare(std::vector<pollfd> &fds);
+	void process(const pollfd *fds);
+	void dispatchRequests();
+	bool submitRequest(Connection *conn, const std::shared_ptr<PushNotificationRequest> &req);
+	bool openConnection();
+	bool resolve();
+	bool progressHandshake(Connection *conn, short revents);
+	void closeConnection(std::list<std::unique_ptr<Connection>>::iterator it, const std::string &reason);
+	void failQueuedRequests(const std::string &reason);
+	void checkTimeouts();
+	void finishStream(Connection *conn, int32_t streamId, uint32_t errorCode);
+	const std::string &getAuthenticationToken();
+
+	static int onNewSession(SSL *ssl, SSL_SESSION *session);
+	static ssize_t onSend(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *userData);
+	static ssize_t onRecv(nghttp2_session *session, uint8_t *buf, size_t length, int flags, void *userData);
+	static int onHeader(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t namelen,
+						const uint8_t *value, size_t valuelen, uint8_t flags, void *userData);
+	static int onDataChunk(nghttp2_session *session, uint8_t flags, int32_t streamId, const uint8_t *data, size_t len,
+						   void *userData);
+	static int onStreamClose(nghttp2_session *session, int32_t streamId, uint32_t errorCode, void *userData);
+	static ssize_t readBody(nghttp2_session *session, int32_t streamId, uint8_t *buf, size_t length,
+							uint32_t *dataFlags, nghttp2_data_source *source, void *userData);
+
+	Http2IoThread *mIoThread;
+	std::mutex mQueueMutex;
+	std::atomic<int> mInFlight;
+	size_t mMaxConnections;
+	size_t mMaxStreams;
+	std::list<std::unique_ptr<Connection>> mConnections;
+	time_t mLastConnectFailure;
+	sockaddr_storage mAddress;
+	socklen_t mAddressLen;
+	time_t mResolveDate;
+	SSL_SESSION *mTlsSession;
+	EVP_PKEY *mAuthKey;
+	std::string mAuthKeyId;
+	std::string mTeamId;
+	std::string mAuthToken;
+	time_t mAuthTokenDate;
+};
@@ -1,6 +1,7 @@
 
 #include "microsoftpush.hh"
 #include "log/logmanager.hh"
+#include "payloadtemplate.hh"
 #include "sofia-sip/base64.h"
 #include <string.h>
 #include <iostream>
@@ -9,7 +10,7 @@
 using namespace std;
 
 WindowsPhonePushNotificationRequest::WindowsPhonePushNotificationRequest(const PushInfo &pinfo)
-: PushNotificationRequest(pinfo.mAppId, pinfo.mType), mPushInfo(pinfo) {
+: PushNotificationRequest(pinfo.mAppId, pinfo.mType, pinfo.mDeviceToken), mPushInfo(pinfo) {
 
     if(pinfo.mType == "wp"){
         createHTTPRequest("");
@@ -24,9 +25,9 @@ void WindowsPhonePushNotificationRequest::createHTTPRequest(const std::string &a
     const std::string &message = mPushInfo.mText;
     const std::string &sender_name = mPushInfo.mFromName;
     const std::string &sender_uri = mPushInfo.mFromUri;
-    ostringstream httpBody;
-    ostringstream httpHeader;
-    
+    mHttpHeader.clear();
+    mHttpBody.clear();
+
     if(mPushInfo.mType == "w10") {
         char unescapedUrl[512];
         url_unescape(unescapedUrl, mPushInfo.mDeviceToken.c_str());
@@ -36,62 +37,45 @@ void WindowsPhonePushNotificationRequest::createHTTPRequest(const std::string &a
             // We have to send the content of the message and the name of the sender.
             // We also need the sender address to be able to display the full chat view in case the receiver click the
             // toast.
-            
-            httpBody << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-                << "<toast launch=\"" << "chat?sip=" << sender_uri  << "\">"
-                << "<visual>"
-                << "<binding template =\"ToastGeneric\">"
-                << "<text>"	<< sender_uri << "</text>"
-                << "<text>" << message << "</text>"
-                << "</binding>"
-                <<  "</visual>"
-                << "</toast>";
+            static const PayloadTemplate body("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                "<toast launch=\"chat?sip=$0\"><visual><binding template =\"ToastGeneric\">"
+                "<text>$0</text><text>$1</text></binding></visual></toast>", PayloadTemplate::Escaping::Xml);
+            body.format(mHttpBody, {sender_uri, message});
         } else {
             // No need to specify name or number, this PN will only wake up linphone.
-            httpBody << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-        		<< "<toast launch=\"" << sender_uri << "\" >"
-                << "<visual>"
-                << "<binding template=\"ToastGeneric\" >"
-                << "<text>Incoming Call</text>"
-                << "<text>" << sender_uri << "</text>"
-                << "</binding>"
-        		<< "</visual>"
-                << "</toast>";
+            static const PayloadTemplate body("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                "<toast launch=\"$0\" ><visual><binding template=\"ToastGeneric\" >"
+                "<text>Incoming Call</text><text>$0</text></binding></visual></toast>", PayloadTemplate::Escaping::Xml);
+            body.format(mHttpBody, {sender_uri});
         }
-        
-        httpHeader << "POST " << query << " HTTP/1.1\r\n"
-            << "Authorization: Bearer " << access_token << "\r\n"
-            << "X-WNS-RequestForStatus: true\r\n"
-            << "X-WNS-Type: wns/toast\r\n"
-            << "Content-Type: text/xml\r\n"
-            << "Host: " << host << "\r\n"
-            << "Content-Length: " << httpBody.str().size() << "\r\n\r\n";
-        
+
+        static const PayloadTemplate header("POST $0 HTTP/1.1\r\nAuthorization: Bearer $1\r\n"
+            "X-WNS-RequestForStatus: true\r\nX-WNS-Type: wns/toast\r\nContent-Type: text/xml\r\n"
+            "Host: $2\r\nContent-Length: $3\r\n\r\n", PayloadTemplate::Escaping::None);
+        header.format(mHttpHeader, {query, access_token, host, mHttpBody.size()});
+
     } else if(mPushInfo.mType == "wp"){
         if(is_message){
-            httpBody << "<?xml version=\"1.0\" encoding=\"utf-8\"?><wp:Notification "
-                "xmlns:wp=\"WPNotification\"><wp:Toast><wp:Text1>"
-                << sender_name << "</wp:Text1><wp:Text2>" << message << "</wp:Text2><wp:Param>"
-            	<< "/Views/Chat.xaml?sip=" << sender_uri << "</wp:Param></wp:Toast></wp:Notification>";
-            
+            static const PayloadTemplate body("<?xml version=\"1.0\" encoding=\"utf-8\"?><wp:Notification "
+                "xmlns:wp=\"WPNotification\"><wp:Toast><wp:Text1>$0</wp:Text1><wp:Text2>$1</wp:Text2><wp:Param>"
+                "/Views/Chat.xaml?sip=$2</wp:Param></wp:Toast></wp:Notification>", PayloadTemplate::Escaping::Xml);
+            body.format(mHttpBody, {sender_name, message, sender_uri});
+
             // Notification class 2 is the type for toast notifitcation.
-            httpHeader
-                << "POST " << mPushInfo.mDeviceToken << " HTTP/1.1\r\nHost:" << host
-                << "\r\nX-WindowsPhone-Target:toast\r\nX-NotificationClass:2\r\nContent-Type:text/xml\r\nContent-Length:"
-                << httpBody.str().size() << "\r\n\r\n";
+            static const PayloadTemplate header("POST $0 HTTP/1.1\r\nHost:$1\r\nX-WindowsPhone-Target:toast\r\n"
+                "X-NotificationClass:2\r\nContent-Type:text/xml\r\nContent-Length:$2\r\n\r\n",
+                PayloadTemplate::Escaping::None);
+            header.format(mHttpHeader, {mPushInfo.mDeviceToken, host, mHttpBody.size()});
         } else {
-            httpBody << "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-                << "<IncomingCall><Name></Name><Number></Number></IncomingCall>";
-            
+            mHttpBody = "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+                "<IncomingCall><Name></Name><Number></Number></IncomingCall>";
+
             // Notification class 4 is the type for VoIP incoming call.
-            httpHeader << "POST " << mPushInfo.mDeviceToken << " HTTP/1.1\r\nHost:" << host
-            	<< "\r\nX-NotificationClass:4\r\nContent-Type:text/xml\r\nContent-Length:" << httpBody.str().size()
-            	<< "\r\n\r\n";
+            static const PayloadTemplate header("POST $0 HTTP/1.1\r\nHost:$1\r\nX-NotificationClass:4\r\n"
+                "Content-Type:text/xml\r\nContent-Length:$2\r\n\r\n", PayloadTemplate::Escaping::None);
+            header.format(mHttpHeader, {mPushInfo.mDeviceToken, host, mHttpBody.size()});
         }
     }
-        
-    mHttpHeader = httpHeader.str();
-    mHttpBody = httpBody.str();
 
     SLOGD << "PNR " << this << " POST header is " << mHttpHeader;
     SLOGD << "PNR " << this << " POST body is " << mHttpBody;
@@ -0,0 +1,146 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "payloadtemplate.hh"
+
+using namespace std;
+
+PayloadTemplate::PayloadTemplate(const string &text, Escaping escaping) : mLiteralSize(0), mEscaping(escaping) {
+	Part part;
+	for (size_t i = 0; i < text.size(); ++i) {
+		char c = text[i];
+		if (c == '$' && i + 1 < text.size()) {
+			char next = text[i + 1];
+			if (next >= '0' && next <= '9') {
+				part.slot = next - '0';
+				mLiteralSize += part.literal.size();
+				mParts.push_back(part);
+				part.literal.clear();
+				++i;
+				continue;
+			}
+			if (next == '$')
+				++i;
+		}
+		part.literal.push_back(c);
+	}
+	part.slot = -1;
+	mLiteralSize += part.literal.size();
+	mParts.push_back(part);
+}
+
+/* Replacement of the character, NULL when it is kept as is. */
+static const char *escape(unsigned char c, PayloadTemplate::Escaping escaping, char unicode[7]) {
+	if (escaping == PayloadTemplate::Escaping::Json) {
+		switch (c) {
+			case '"':
+				return "\\\"";
+			case '\\':
+				return "\\\\";
+			case '\n':
+				return "\\n";
+			case '\r':
+				return "\\r";
+			case '\t':
+				return "\\t";
+			default:
+				if (c >= 0x20)
+					return NULL;
+				static const char hex[] = "0123456789abcdef";
+				memcpy(unicode, "\\u00", 4);
+				unicode[4] = hex[c >> 4];
+				unicode[5] = hex[c & 0x0f];
+				unicode[6] = '\0';
+				return unicode;
+		}
+	}
+	switch (c) {
+		case '&':
+			return "&amp;";
+		case '<':
+			return "&lt;";
+		case '>':
+			return "&gt;";
+		case '"':
+			return "&quot;";
+		case '\'':
+			return "&apos;";
+		default:
+			return NULL;
+	}
+}
+
+/* Whether the character may have to be escaped, a quick test ruling out most of them. */
+static inline bool isSpecial(unsigned char c) {
+	return c < 0x20 || c == '"' || c == '\\' || c == '&' || c == '<' || c == '>' || c == '\'';
+}
+
+size_t PayloadTemplate::escapedSize(const Value &value, Escaping escaping) {
+	size_t size = value.size();
+	if (escaping == Escaping::None)
+		return size;
+	const unsigned char *data = (const unsigned char *)value.data();
+	char unicode[7];
+	for (size_t i = 0; i < value.size(); ++i) {
+		if (isSpecial(data[i])) {
+			const char *replacement = escape(data[i], escaping, unicode);
+			if (replacement)
+				size += strlen(replacement) - 1;
+		}
+	}
+	return size;
+}
+
+void PayloadTemplate::appendEscaped(string &out, const Value &value, Escaping escaping) {
+	const char *data = value.data();
+	size_t size = value.size();
+	if (escaping == Escaping::None) {
+		out.append(data, size);
+		return;
+	}
+	// the runs of characters kept as is are appended at once
+	size_t run = 0;
+	char unicode[7];
+	for (size_t i = 0; i < size; ++i) {
+		if (!isSpecial((unsigned char)data[i]))
+			continue;
+		const char *replacement = escape((unsigned char)data[i], escaping, unicode);
+		if (replacement) {
+			out.append(data + run, i - run);
+			out.append(replacement);
+			run = i + 1;
+		}
+	}
+	out.append(data + run, size - run);
+}
+
+void PayloadTemplate::format(string &out, initializer_list<Value> values) const {
+	const Value *v = values.begin();
+	size_t size = mLiteralSize;
+	for (const auto &part : mParts) {
+		if (part.slot >= 0 && (size_t)part.slot < values.size())
+			size += escapedSize(v[part.slot], mEscaping);
+	}
+	out.reserve(out.size() + size);
+	for (const auto &part : mParts) {
+		out.append(part.literal);
+		if (part.slot >= 0 && (size_t)part.slot < values.size())
+			appendEscaped(out, v[part.slot], mEscaping);
+	}
+}
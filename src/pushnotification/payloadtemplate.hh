@@ -0,0 +1,98 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Preformatted payload of a push notification: the text of the template is split once into its literal parts and its
+ * slots, marked $0 to $9 ($$ for a dollar). Formatting computes the exact size of the result, reserves it once in the
+ * output buffer, then appends the parts and the escaped values, without any stream nor intermediate string.
+ */
+class PayloadTemplate {
+  public:
+	enum class Escaping {
+		None, // HTTP headers, values trusted or already escaped
+		Json, // inside a JSON string
+		Xml // inside an XML text or attribute value
+	};
+
+	/* Value of a slot, referencing a string or holding the decimal form of an integer. */
+	class Value {
+	  public:
+		Value(const std::string &s) : mData(s.data()), mSize(s.size()) {
+		}
+		Value(const char *s) : mData(s), mSize(strlen(s)) {
+		}
+		template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type> Value(T n) {
+			// digits written from the end of mDigits, faster than snprintf()
+			bool negative = std::is_signed<T>::value && n < 0;
+			unsigned long long u = negative ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+			char *p = mDigits + sizeof(mDigits);
+			do {
+				*--p = char('0' + u % 10);
+				u /= 10;
+			} while (u != 0);
+			if (negative)
+				*--p = '-';
+			mOffset = p - mDigits;
+			mSize = mDigits + sizeof(mDigits) - p;
+			mData = NULL;
+		}
+		const char *data() const {
+			return mData ? mData : mDigits + mOffset;
+		}
+		size_t size() const {
+			return mSize;
+		}
+
+	  private:
+		const char *mData; // NULL for an integer, whose digits are in mDigits
+		size_t mSize;
+		size_t mOffset;
+		char mDigits[24];
+	};
+
+	PayloadTemplate(const std::string &text, Escaping escaping);
+	/* Appends the template to out, the slot $i taking values[i]. The slots without a value are left empty. */
+	void format(std::string &out, std::initializer_list<Value> values) const;
+	std::string format(std::initializer_list<Value> values) const {
+		std::string out;
+		format(out, values);
+		return out;
+	}
+
+	/* Size of the value once escaped. */
+	static size_t escapedSize(const Value &value, Escaping escaping);
+	static void appendEscaped(std::string &out, const Value &value, Escaping escaping);
+
+  private:
+	struct Part {
+		std::string literal;
+		int slot; // -1 after the last literal
+	};
+	std::vector<Part> mParts;
+	size_t mLiteralSize;
+	Escaping mEscaping;
+};
@@ -17,6 +17,8 @@
 */
 #pragma once
 
+#include <chrono>
+#include <ctime>
 #include <string>
 #include <vector>
 #include <memory>
@@ -25,7 +27,7 @@
 
 struct PushInfo {
 	enum Event { Call, Message };
-	PushInfo() : mEvent(Event::Message), mNoBadge(false), mSilent(false){};
+	PushInfo() : mEvent(Event::Message), mTtl(0), mNoBadge(false), mSilent(false){};
 	Event mEvent; // Event to advertise: call or text message.
 	std::string mType; // type of push notif: apple, google, wp
 	std::string mAppId; // app id, as extracted from Contact
@@ -46,6 +48,9 @@ struct PushInfo {
 	bool mSilent;
 };
 
+/* Headers of a request sent on an HTTP/2 connection: the pseudo headers first, then the others, in lower case. */
+typedef std::vector<std::pair<std::string, std::string>> Http2Headers;
+
 class PushNotificationRequest {
 	public:
 		enum State{
@@ -60,22 +65,68 @@ class PushNotificationRequest {
 		const std::string &getType() {
 			return mType;
 		}
+		const std::string &getDeviceToken() {
+			return mDeviceToken;
+		}
+		/* Time at which the request was handed to the push notification service. */
+		std::chrono::steady_clock::time_point getSubmitTime() const {
+			return mSubmitTime;
+		}
+		void setSubmitTime(std::chrono::steady_clock::time_point time) {
+			mSubmitTime = time;
+		}
 		virtual const std::vector<char> &getData() = 0;
 		virtual std::string isValidResponse(const std::string &str) = 0;
 		virtual bool isServerAlwaysResponding() = 0;
+		/* HTTP/2 form of the request, without the :scheme and :authority headers which are set by the client.
+		 * Returns false when the request can only be sent as the data of getData(). */
+		virtual bool getHttp2Request(Http2Headers &headers, std::string &body) {
+			return false;
+		}
+		/* Returns an error message for an unsuccessful HTTP/2 response, an empty string otherwise. */
+		virtual std::string isValidHttp2Response(int status, const std::string &body) {
+			return status == 200 ? "" : "HTTP status " + std::to_string(status) + " " + body;
+		}
 		State getState()const{
 			return mState;
 		}
 		void setState(State state){
 			mState = state;
 		}
+		/* What the request notifies, to create it again: the call notifications are retried before the message ones,
+		 * and the retries pending at exit are saved from it. */
+		const PushInfo &getInfo() const {
+			return mInfo;
+		}
+		void setInfo(const PushInfo &info) {
+			mInfo = info;
+		}
+		int getRetries() const {
+			return mRetries;
+		}
+		void setRetries(int retries) {
+			mRetries = retries;
+		}
+		/* Wall clock time after which the request is not retried anymore, 0 until it first fails. */
+		time_t getRetryDeadline() const {
+			return mRetryDeadline;
+		}
+		void setRetryDeadline(time_t deadline) {
+			mRetryDeadline = deadline;
+		}
 	protected:
-		PushNotificationRequest(const std::string &appid, const std::string &type)
-			: mState( NotSubmitted), mAppId(appid), mType(type) {
+		PushNotificationRequest(const std::string &appid, const std::string &type, const std::string &deviceToken = "")
+			: mState( NotSubmitted), mAppId(appid), mType(type), mDeviceToken(deviceToken), mRetries(0),
+			  mRetryDeadline(0) {
 		}
 	private:
 		State mState;
 		const std::string mAppId;
 		const std::string mType;
+		const std::string mDeviceToken;
+		std::chrono::steady_clock::time_point mSubmitTime;
+		PushInfo mInfo;
+		int mRetries;
+		time_t mRetryDeadline;
 
 };
@@ -80,6 +80,11 @@ using namespace std;
 		return mThreadWaiting;
 	}
 
+	size_t PushNotificationClient::getLoad() {
+		std::unique_lock<std::mutex> lock(mMutex);
+		return mRequestQueue.size() + (mThreadWaiting ? 0 : 1);
+	}
+
 	void PushNotificationClient::recreateConnection() {
 
 		/* Setup the connection */
@@ -203,7 +208,7 @@ using namespace std;
 			string responsestr(r, p);
 			string error = req->isValidResponse(responsestr);
 			if (!error.empty()) {
-				onError(req, "Invalid server response: " + error);
+				onError(req, "Invalid server response: " + error, false);
 				// on iOS at least, when an error happens, the socket is semibroken (server ignore all future requests),
 				// so we force to recreate the connection
 				recreateConnection();
@@ -239,17 +244,13 @@ using namespace std;
 	}
 
 
-	void PushNotificationClient::onError(shared_ptr<PushNotificationRequest> req, const string &msg) {
+	void PushNotificationClient::onError(shared_ptr<PushNotificationRequest> req, const string &msg, bool transient) {
 		SLOGW << "PushNotificationClient " << mName << " PNR " << req.get() << " failed: " << msg;
 		req->setState(PushNotificationRequest::Failed);
-		if (mService->mCountFailed) {
-			mService->mCountFailed->incr();
-		}
+		mService->onRequestDone(req, false, transient);
 	}
 
 	void PushNotificationClient::onSuccess(shared_ptr<PushNotificationRequest> req) {
 		req->setState(PushNotificationRequest::Successful);
-		if (mService->mCountSent) {
-			mService->mCountSent->incr();
-		}
+		mService->onRequestDone(req, true);
 	}
@@ -36,13 +36,16 @@ class PushNotificationClient {
 							   int maxQueueSize, bool isSecure);
 		virtual ~PushNotificationClient();
 		virtual int sendPush(const std::shared_ptr<PushNotificationRequest> &req);
-		bool isIdle();
+		virtual bool isIdle();
+		/* Number of requests queued or being sent. */
+		virtual size_t getLoad();
 		void run();
 
 	protected:
 		void sendPushToServer(const std::shared_ptr<PushNotificationRequest> &req);
 		void recreateConnection();
-		void onError(std::shared_ptr<PushNotificationRequest> req, const std::string &msg);
+		/* A transient error, of the connection or of the server, lets the service retry the request. */
+		void onError(std::shared_ptr<PushNotificationRequest> req, const std::string &msg, bool transient = true);
 		void onSuccess(std::shared_ptr<PushNotificationRequest> req);
 
 	protected:
@@ -140,6 +140,7 @@ int PushNotificationClientWp::sendPush(const std::shared_ptr<PushNotificationReq
 		return PushNotificationClient::sendPush(req);
 	} else {
 		SLOGD << "Cannot send push since we do not access token yet";
+		onError(req, "No access token");
 	}
 	return 0;
 }
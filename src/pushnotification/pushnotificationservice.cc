@@ -21,8 +21,13 @@
 #include "pushnotificationservice.hh"
 #include "pushnotificationclient.hh"
 #include "pushnotificationclient_wp.hh"
+#ifdef ENABLE_HTTP2
+#include "http2client.hh"
+#endif
 #include "common.hh"
 
+#include <algorithm>
+#include <iterator>
 #include <sstream>
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
@@ -35,6 +40,10 @@ static const char *APN_DEV_ADDRESS = "gateway.sandbox.push.apple.com";
 static const char *APN_PROD_ADDRESS = "gateway.push.apple.com";
 static const char *APN_PORT = "2195";
 
+static const char *APN_HTTP2_DEV_ADDRESS = "api.development.push.apple.com";
+static const char *APN_HTTP2_PROD_ADDRESS = "api.push.apple.com";
+static const char *APN_HTTP2_PORT = "443";
+
 static const char *GPN_ADDRESS = "gcm-http.googleapis.com";
 static const char *GPN_PORT = "443";
 
@@ -43,20 +52,60 @@ static const char *FIREBASE_PORT = "443";
 
 static const char *WPPN_PORT = "443";
 
-PushNotificationService::PushNotificationService(int maxQueueSize)
-: mMaxQueueSize(maxQueueSize), mClients(), mCountFailed(NULL), mCountSent(NULL) {
+PushNotificationService::PushNotificationService(int maxQueueSize, int clientsPerApp)
+: mMaxQueueSize(maxQueueSize), mClientsPerApp(clientsPerApp > 0 ? clientsPerApp : 1), mClients(), mAppleHttp2(false),
+  mFirebaseHttp2(false), mHttp2Connections(1), mHttp2MaxStreams(1), mHttp2IoThreadCount(1),
+  mNextHttp2IoThread(0), mCountFailed(NULL), mCountSent(NULL), mPendingRequests(0), mMaxRetries(0), mRetryMinDelay(0),
+  mRetryMaxDelay(0), mRetryMaxAge(0), mRetryQueueSize(0), mCountRetried(NULL), mCountDropped(NULL) {
 	SSL_library_init();
 	SSL_load_error_strings();
 }
 
 PushNotificationService::~PushNotificationService() {
+	// the clients report their aborted requests, and the HTTP/2 ones use the I/O threads until they are destroyed
+	mClients.clear();
+	mHttp2IoThreads.clear();
 	ERR_free_strings();
 }
 
+const vector<int> &PushNotificationService::getLatencyBounds() {
+	static const vector<int> bounds = {100, 500, 1000, 5000};
+	return bounds;
+}
+
+void PushNotificationService::setLatencyCounters(const string &provider, const vector<StatCounter64 *> &counters) {
+	mLatencyCounters[provider] = counters;
+}
+
+static string queuedDeviceKey(const string &appId, const string &deviceToken) {
+	return appId + ":" + deviceToken;
+}
 
 int PushNotificationService::sendPush(const std::shared_ptr<PushNotificationRequest> &pn){	
-	std::shared_ptr<PushNotificationClient> client = mClients[pn->getAppIdentifier()];
-	if (client == 0) {
+	std::shared_ptr<PushNotificationClient> client = getClient(pn);
+	if (!client)
+		return -1;
+	pn->setSubmitTime(chrono::steady_clock::now());
+	{
+		unique_lock<mutex> lock(mMutex);
+		++mPendingRequests;
+		if (!pn->getDeviceToken().empty())
+			++mQueuedDevices[queuedDeviceKey(pn->getAppIdentifier(), pn->getDeviceToken())];
+	}
+	client->sendPush(pn);
+	return 0;
+}
+
+/* Least loaded client of the application of the request, created on demand for some providers. */
+shared_ptr<PushNotificationClient> PushNotificationService::getClient(const shared_ptr<PushNotificationRequest> &pn) {
+	auto pool = mClients.find(pn->getAppIdentifier());
+	if (pool == mClients.end() && pn->getType() == "apple" && !mAppleAuthKey.empty()) {
+		// with token based authentication, any application of the team can be served without a certificate
+		if (!createAppleTokenClients(pn->getAppIdentifier()))
+			return nullptr;
+		pool = mClients.find(pn->getAppIdentifier());
+	}
+	if (pool == mClients.end()) {
 		bool isW10 = (pn->getType().compare(string("w10")) == 0);
 		bool isWP = (pn->getType().compare(string("wp")) == 0);
 		if(isW10 || isWP) {
@@ -66,7 +115,7 @@ int PushNotificationService::sendPush(const std::shared_ptr<PushNotificationRequ
 				SLOGE << "Windows Phone not configured for push notifications ("
 					"package sid is " << (mWindowsPhonePackageSID.empty() ? "NOT configured" : "configured") << " and " <<
 					"application secret is " << (mWindowsPhoneApplicationSecret.empty() ? "NOT configured" : "configured") << ").";
-				return -1;
+				return nullptr;
 			} else {
 				string wpClient = pn->getAppIdentifier();
 			
@@ -74,41 +123,299 @@ int PushNotificationService::sendPush(const std::shared_ptr<PushNotificationRequ
 				SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 			
 				LOGD("Creating PN client for %s", pn->getAppIdentifier().c_str());
-				if(isW10) {
-					mClients[wpClient] = std::make_shared<PushNotificationClientWp>(wpClient, this, ctx,
-																					pn->getAppIdentifier(), WPPN_PORT, mMaxQueueSize, true, mWindowsPhonePackageSID, mWindowsPhoneApplicationSecret);
-				} else {
-					mClients[wpClient] = std::make_shared<PushNotificationClient>(wpClient, this, ctx,
-												pn->getAppIdentifier(), "80", mMaxQueueSize, false);
-				}
-				client = mClients[wpClient];
+				addClients(wpClient, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+					if(isW10) {
+						return std::make_shared<PushNotificationClientWp>(wpClient, this, clientCtx,
+							pn->getAppIdentifier(), WPPN_PORT, mMaxQueueSize, true, mWindowsPhonePackageSID, mWindowsPhoneApplicationSecret);
+					}
+					return std::make_shared<PushNotificationClient>(wpClient, this, clientCtx,
+						pn->getAppIdentifier(), "80", mMaxQueueSize, false);
+				});
+				pool = mClients.find(wpClient);
 			}
 		} else {
 			SLOGE << "No push notification client available for push notification request : " << pn;
-			return -1;
+			return nullptr;
 		}
 	}
-	client->sendPush(pn);
-	return 0;
+
+	// least loaded client of the application
+	std::shared_ptr<PushNotificationClient> client;
+	size_t load = 0;
+	for (auto it = pool->second.begin(); it != pool->second.end(); ++it) {
+		size_t clientLoad = (*it)->getLoad();
+		if (!client || clientLoad < load) {
+			client = *it;
+			load = clientLoad;
+		}
+	}
+	return client;
 }
 
-bool PushNotificationService::isIdle() {
-	map<string, std::shared_ptr<PushNotificationClient>>::const_iterator it;
-	for (it = mClients.begin(); it != mClients.end(); ++it) {
-		if (!it->second->isIdle()) {
+size_t PushNotificationService::countPendingRequests() {
+	unique_lock<mutex> lock(mMutex);
+	return mPendingRequests;
+}
+
+bool PushNotificationService::isDeviceQueued(const string &appId, const string &deviceToken) {
+	unique_lock<mutex> lock(mMutex);
+	return mQueuedDevices.find(queuedDeviceKey(appId, deviceToken)) != mQueuedDevices.end();
+}
+
+void PushNotificationService::onRequestDone(const shared_ptr<PushNotificationRequest> &req, bool success,
+											bool transient) {
+	unique_lock<mutex> lock(mMutex);
+	if (mMaxRetries > 0) {
+		int &failures = mProviderFailures[req->getType()];
+		failures = success ? 0 : failures + 1;
+		if (!success && transient) {
+			int delay = mRetryMinDelay;
+			for (int i = 1; i < failures && delay < mRetryMaxDelay; ++i)
+				delay *= 2;
+			delay = min(delay, mRetryMaxDelay);
+			// the device stays queued while its request waits for a retry
+			if (queueRetry(req, chrono::milliseconds(delay), false)) {
+				req->setRetries(req->getRetries() + 1);
+				if (mCountRetried)
+					mCountRetried->incr();
+				SLOGD << "PNR " << req.get() << " retry " << req->getRetries() << " in " << delay << "ms";
+				return;
+			}
+		}
+	}
+	finishRequest(req, success);
+}
+
+void PushNotificationService::finishRequest(const shared_ptr<PushNotificationRequest> &req, bool success) {
+	int64_t latency =
+		chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - req->getSubmitTime()).count();
+	// w10 is the new windows phone push notification system, sharing the provider of wp
+	string provider = req->getType() == "w10" ? "wp" : req->getType();
+
+	if (mPendingRequests > 0)
+		--mPendingRequests;
+	if (!req->getDeviceToken().empty()) {
+		auto it = mQueuedDevices.find(queuedDeviceKey(req->getAppIdentifier(), req->getDeviceToken()));
+		if (it != mQueuedDevices.end() && --it->second <= 0)
+			mQueuedDevices.erase(it);
+	}
+	StatCounter64 *counter = success ? mCountSent : mCountFailed;
+	if (counter)
+		counter->incr();
+	auto histogram = mLatencyCounters.find(provider);
+	if (histogram != mLatencyCounters.end()) {
+		const vector<int> &bounds = getLatencyBounds();
+		size_t i = 0;
+		while (i < bounds.size() && latency > bounds[i])
+			++i;
+		if (i < histogram->second.size())
+			histogram->second[i]->incr();
+	}
+}
+
+void PushNotificationService::setupRetries(int maxRetries, int minDelay, int maxDelay, int maxAge, size_t queueSize) {
+	unique_lock<mutex> lock(mMutex);
+	mMaxRetries = maxRetries;
+	mRetryMinDelay = max(minDelay, 1);
+	mRetryMaxDelay = max(maxDelay, mRetryMinDelay);
+	mRetryMaxAge = maxAge;
+	mRetryQueueSize = queueSize;
+}
+
+static bool isCall(const shared_ptr<PushNotificationRequest> &req) {
+	return req->getInfo().mEvent == PushInfo::Call;
+}
+
+bool PushNotificationService::queueRetry(const shared_ptr<PushNotificationRequest> &req, chrono::milliseconds delay,
+										 bool saved) {
+	// the retry of a saved request was already counted
+	if (!saved && req->getRetries() >= mMaxRetries)
+		return false;
+	time_t now = time(NULL);
+	if (req->getRetryDeadline() == 0) {
+		// a notification is useless once its time to live is over
+		int ttl = req->getInfo().mTtl;
+		req->setRetryDeadline(now + (ttl > 0 ? min(ttl, mRetryMaxAge) : mRetryMaxAge));
+	}
+	if (now + chrono::duration_cast<chrono::seconds>(delay).count() >= req->getRetryDeadline())
+		return false;
+	if (mRetries.size() >= mRetryQueueSize) {
+		// a call notification takes the place of the latest message one
+		auto victim = mRetries.end();
+		if (isCall(req)) {
+			for (auto it = mRetries.begin(); it != mRetries.end(); ++it) {
+				if (!isCall(it->request))
+					victim = it;
+			}
+		}
+		if (victim == mRetries.end()) {
+			if (mCountDropped)
+				mCountDropped->incr();
 			return false;
 		}
+		SLOGW << "PNR " << victim->request.get() << " retry dropped, the retry queue is full";
+		finishRequest(victim->request, false);
+		mRetries.erase(victim);
+		if (mCountDropped)
+			mCountDropped->incr();
+	}
+	req->setState(PushNotificationRequest::NotSubmitted);
+	Retry retry = {req, chrono::steady_clock::now() + delay};
+	auto position = mRetries.end();
+	while (position != mRetries.begin() && prev(position)->due > retry.due)
+		--position;
+	mRetries.insert(position, retry);
+	return true;
+}
+
+void PushNotificationService::dispatchRetries() {
+	list<shared_ptr<PushNotificationRequest>> due;
+	{
+		unique_lock<mutex> lock(mMutex);
+		auto now = chrono::steady_clock::now();
+		while (!mRetries.empty() && mRetries.front().due <= now) {
+			due.push_back(mRetries.front().request);
+			mRetries.pop_front();
+		}
+	}
+	// the call notifications first, as the caller is waiting
+	stable_partition(due.begin(), due.end(), isCall);
+	for (auto &req : due) {
+		shared_ptr<PushNotificationClient> client = getClient(req);
+		if (!client) {
+			unique_lock<mutex> lock(mMutex);
+			finishRequest(req, false);
+			continue;
+		}
+		req->setSubmitTime(chrono::steady_clock::now());
+		client->sendPush(req);
+	}
+}
+
+list<shared_ptr<PushNotificationRequest>> PushNotificationService::getPendingRetries() {
+	list<shared_ptr<PushNotificationRequest>> pending;
+	unique_lock<mutex> lock(mMutex);
+	for (const auto &retry : mRetries)
+		pending.push_back(retry.request);
+	return pending;
+}
+
+void PushNotificationService::retryPush(const shared_ptr<PushNotificationRequest> &pn) {
+	unique_lock<mutex> lock(mMutex);
+	++mPendingRequests;
+	if (!pn->getDeviceToken().empty())
+		++mQueuedDevices[queuedDeviceKey(pn->getAppIdentifier(), pn->getDeviceToken())];
+	pn->setSubmitTime(chrono::steady_clock::now());
+	if (!queueRetry(pn, chrono::milliseconds(0), true))
+		finishRequest(pn, false);
+}
+
+bool PushNotificationService::isIdle() {
+	for (auto it = mClients.begin(); it != mClients.end(); ++it) {
+		for (auto client = it->second.begin(); client != it->second.end(); ++client) {
+			if (!(*client)->isIdle()) {
+				return false;
+			}
+		}
 	}
 	return true;
 }
 
+void PushNotificationService::addClients(const string &appId, SSL_CTX *ctx,
+										 const function<shared_ptr<PushNotificationClient>(SSL_CTX *)> &create) {
+	auto &pool = mClients[appId];
+	pool.clear();
+	for (int i = 0; i < mClientsPerApp; ++i) {
+		// each client frees its reference on the context
+		if (i > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			SSL_CTX_up_ref(ctx);
+#else
+			CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+		}
+		pool.push_back(create(ctx));
+	}
+}
+
+void PushNotificationService::setupHttp2(bool apple, bool firebase, int maxConnections, int maxStreams,
+										 int ioThreads) {
+#ifdef ENABLE_HTTP2
+	mAppleHttp2 = apple;
+	mFirebaseHttp2 = firebase;
+	mHttp2Connections = maxConnections;
+	mHttp2MaxStreams = maxStreams;
+	mHttp2IoThreadCount = ioThreads > 0 ? ioThreads : 1;
+#else
+	if (apple || firebase)
+		SLOGE << "Flexisip built without HTTP/2 support, push notifications are sent with HTTP/1.1 and the legacy APNs "
+				 "protocol.";
+#endif
+}
+
+Http2IoThread *PushNotificationService::getHttp2IoThread() {
+#ifdef ENABLE_HTTP2
+	// started along with the first client
+	if (mHttp2IoThreads.empty()) {
+		for (int i = 0; i < mHttp2IoThreadCount; ++i)
+			mHttp2IoThreads.push_back(make_shared<Http2IoThread>());
+	}
+	return mHttp2IoThreads[mNextHttp2IoThread++ % mHttp2IoThreads.size()].get();
+#else
+	return NULL;
+#endif
+}
+
+void PushNotificationService::setAppleAuthenticationKey(const std::string &keyPath, const std::string &keyId,
+														const std::string &teamId) {
+	if (!mAppleHttp2) {
+		SLOGE << "Apple token based authentication requires HTTP/2, ignoring " << keyPath;
+		return;
+	}
+	mAppleAuthKey = keyPath;
+	mAppleAuthKeyId = keyId;
+	mAppleTeamId = teamId;
+}
+
+bool PushNotificationService::createAppleTokenClients(const std::string &appId) {
+#ifdef ENABLE_HTTP2
+	SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!ctx || !Http2PushNotificationClient::setupContext(ctx)) {
+		SLOGE << "Could not create ctx for " << appId;
+		if (ctx)
+			SSL_CTX_free(ctx);
+		return false;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_default_verify_paths(ctx);
+	const char *apn_server = (appId.find(".dev") != string::npos) ? APN_HTTP2_DEV_ADDRESS : APN_HTTP2_PROD_ADDRESS;
+	bool ok = true;
+	addClients(appId, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+		auto client = make_shared<Http2PushNotificationClient>(appId, this, clientCtx, apn_server, APN_HTTP2_PORT,
+															   mMaxQueueSize, mHttp2Connections, mHttp2MaxStreams,
+															   getHttp2IoThread());
+		ok = client->setAuthenticationKey(mAppleAuthKey, mAppleAuthKeyId, mAppleTeamId) && ok;
+		return client;
+	});
+	if (!ok) {
+		mClients.erase(appId);
+		return false;
+	}
+	SLOGD << "Adding ios push notification client [" << appId << "] with token based authentication";
+	return true;
+#else
+	return false;
+#endif
+}
 
 void PushNotificationService::setupGenericClient(const url_t *url) {
 	SSL_CTX* ctx = SSL_CTX_new(TLSv1_client_method());
 	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
-	mClients["generic"] = std::make_shared<PushNotificationClient>("generic", this, ctx, url->url_host, url_port(url),
-		mMaxQueueSize, url->url_type == url_https);
+	addClients("generic", ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+		return std::make_shared<PushNotificationClient>("generic", this, clientCtx, url->url_host, url_port(url),
+			mMaxQueueSize, url->url_type == url_https);
+	});
 }
 
 /* Utility function to convert ASN1_TIME to a printable string in a buffer */
@@ -227,12 +534,16 @@ void PushNotificationService::setupiOSClient(const std::string &certdir, const s
 			continue;
 		}
 		/*March 2016: Yes Apple production push server doesn't support TLS > 1.0*/
-		SSL_CTX* ctx = SSL_CTX_new(TLSv1_client_method());
+		SSL_CTX* ctx = SSL_CTX_new(mAppleHttp2 ? SSLv23_client_method() : TLSv1_client_method());
 		if (!ctx) {
 			SLOGE << "Could not create ctx!";
 			ERR_print_errors_fp(stderr);
 			continue;
 		}
+#ifdef ENABLE_HTTP2
+		if (mAppleHttp2)
+			Http2PushNotificationClient::setupContext(ctx);
+#endif
 
 		if (cafile.empty()) {
 			SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
@@ -267,8 +578,22 @@ void PushNotificationService::setupiOSClient(const std::string &certdir, const s
 		}
 
 		string certName = cert.substr(0, cert.size() - 4); // Remove .pem at the end of cert
-		const char *apn_server = (certName.find(".dev") != string::npos) ? APN_DEV_ADDRESS : APN_PROD_ADDRESS;
-		mClients[certName] = std::make_shared<PushNotificationClient>(cert, this, ctx, apn_server, APN_PORT, mMaxQueueSize, true);
+		bool dev = certName.find(".dev") != string::npos;
+#ifdef ENABLE_HTTP2
+		if (mAppleHttp2) {
+			addClients(certName, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+				return std::make_shared<Http2PushNotificationClient>(cert, this, clientCtx,
+					dev ? APN_HTTP2_DEV_ADDRESS : APN_HTTP2_PROD_ADDRESS, APN_HTTP2_PORT, mMaxQueueSize,
+					mHttp2Connections, mHttp2MaxStreams, getHttp2IoThread());
+			});
+			SLOGD << "Adding ios push notification client [" << certName << "] over HTTP/2";
+			continue;
+		}
+#endif
+		const char *apn_server = dev ? APN_DEV_ADDRESS : APN_PROD_ADDRESS;
+		addClients(certName, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+			return std::make_shared<PushNotificationClient>(cert, this, clientCtx, apn_server, APN_PORT, mMaxQueueSize, true);
+		});
 		SLOGD << "Adding ios push notification client [" << certName << "]";
 	}
 	closedir(dirp);
@@ -282,7 +607,9 @@ void PushNotificationService::setupAndroidClient(const std::map<std::string, std
 		SSL_CTX* ctx = SSL_CTX_new(SSLv23_client_method());
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
-		mClients[android_app_id] = std::make_shared<PushNotificationClient>("google", this, ctx, GPN_ADDRESS, GPN_PORT, mMaxQueueSize, true);
+		addClients(android_app_id, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+			return std::make_shared<PushNotificationClient>("google", this, clientCtx, GPN_ADDRESS, GPN_PORT, mMaxQueueSize, true);
+		});
 		SLOGD << "Adding android push notification client [" << android_app_id << "]";
 	}
 }
@@ -295,7 +622,20 @@ void PushNotificationService::setupFirebaseClient(const std::map<std::string, st
 		SSL_CTX* ctx = SSL_CTX_new(SSLv23_client_method());
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
 
-		mClients[firebase_app_id] = std::make_shared<PushNotificationClient>("firebase", this, ctx, FIREBASE_ADDRESS, FIREBASE_PORT, mMaxQueueSize, true);
+#ifdef ENABLE_HTTP2
+		if (mFirebaseHttp2) {
+			Http2PushNotificationClient::setupContext(ctx);
+			addClients(firebase_app_id, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+				return std::make_shared<Http2PushNotificationClient>("firebase", this, clientCtx, FIREBASE_ADDRESS,
+					FIREBASE_PORT, mMaxQueueSize, mHttp2Connections, mHttp2MaxStreams, getHttp2IoThread());
+			});
+			SLOGD << "Adding firebase push notification client [" << firebase_app_id << "] over HTTP/2";
+			continue;
+		}
+#endif
+		addClients(firebase_app_id, ctx, [&](SSL_CTX *clientCtx) -> shared_ptr<PushNotificationClient> {
+			return std::make_shared<PushNotificationClient>("firebase", this, clientCtx, FIREBASE_ADDRESS, FIREBASE_PORT, mMaxQueueSize, true);
+		});
 		SLOGD << "Adding firebase push notification client [" << firebase_app_id << "]";
 	}
 }
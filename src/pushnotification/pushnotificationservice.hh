@@ -20,7 +20,12 @@
 #include "pushnotification.hh"
 #include "configmanager.hh"
 
+#include <openssl/ssl.h>
+
+#include <chrono>
+#include <functional>
 #include <list>
+#include <unordered_map>
 
 #include <condition_variable>
 #include <mutex>
@@ -28,12 +33,13 @@
 #include <string>
 
 class PushNotificationClient;
+class Http2IoThread;
 
 class PushNotificationService {
 	friend class PushNotificationClient;
 
   public:
-	PushNotificationService(int maxQueueSize);
+	PushNotificationService(int maxQueueSize, int clientsPerApp = 1);
 	~PushNotificationService();
 
 	void setStatCounters(StatCounter64 *countFailed, StatCounter64 *countSent) {
@@ -41,26 +47,89 @@ class PushNotificationService {
 		mCountSent = countSent;
 	}
 
+	/* Latency histogram of a provider (apple, google, firebase, wp, generic): one counter per bound of
+	 * getLatencyBounds(), for the requests answered before it and after the previous one, and a last counter for the
+	 * slower ones. */
+	void setLatencyCounters(const std::string &provider, const std::vector<StatCounter64 *> &counters);
+	static const std::vector<int> &getLatencyBounds();
+
 	int sendPush(const std::shared_ptr<PushNotificationRequest> &pn);
+
+	/* Retries of the requests failed on an error of the connection or a transient error of the server (HTTP status
+	 * 429 or 5xx): a request is sent again up to maxRetries times, after a delay doubling with the consecutive
+	 * failures of its provider from minDelay to maxDelay ms, until maxAge seconds after its first failure. At most
+	 * queueSize requests wait for a retry, the message notifications being dropped before the call ones. */
+	void setupRetries(int maxRetries, int minDelay, int maxDelay, int maxAge, size_t queueSize);
+	void setRetryCounters(StatCounter64 *countRetried, StatCounter64 *countDropped) {
+		mCountRetried = countRetried;
+		mCountDropped = countDropped;
+	}
+	/* Sends the retries due, the call notifications first. Called from the main loop. */
+	void dispatchRetries();
+	/* Requests waiting for a retry, to be saved. */
+	std::list<std::shared_ptr<PushNotificationRequest>> getPendingRetries();
+	/* Queues a saved request for a retry as soon as possible. */
+	void retryPush(const std::shared_ptr<PushNotificationRequest> &pn);
+
+	/* Whether a push notification to the device is already queued or being sent. */
+	bool isDeviceQueued(const std::string &appId, const std::string &deviceToken);
 	void setupGenericClient(const url_t *url);
 	void setupiOSClient(const std::string &certdir, const std::string &cafile);
 	void setupAndroidClient(const std::map<std::string, std::string> googleKeys);
 	void setupFirebaseClient(const std::map<std::string, std::string> firebaseKeys);
 	void setupWindowsPhoneClient(const std::string& packageSID, const std::string& applicationSecret);
+	/* The Apple and Firebase clients set up afterwards send the requests on HTTP/2 connections, when enabled. */
+	void setupHttp2(bool apple, bool firebase, int maxConnections, int maxStreams, int ioThreads = 1);
+	/* Token based authentication for the Apple applications without a certificate, over HTTP/2. */
+	void setAppleAuthenticationKey(const std::string &keyPath, const std::string &keyId, const std::string &teamId);
 
 	bool isIdle();
+	/* Requests sent or waiting for a retry, not finished yet. */
+	size_t countPendingRequests();
   private:
 	void setupClients(const std::string &certdir, const std::string &ca, int maxQueueSize);
 	bool isCertExpired( const std::string &certPath );
+	bool createAppleTokenClients(const std::string &appId);
+	/* Creates the pool of clients of the application, all sharing the SSL context. */
+	void addClients(const std::string &appId, SSL_CTX *ctx,
+					const std::function<std::shared_ptr<PushNotificationClient>(SSL_CTX *)> &create);
+	/* Thread driving the connections of a new HTTP/2 client, the clients being spread over the threads. */
+	Http2IoThread *getHttp2IoThread();
+	std::shared_ptr<PushNotificationClient> getClient(const std::shared_ptr<PushNotificationRequest> &pn);
+	// called by the clients, from their threads
+	void onRequestDone(const std::shared_ptr<PushNotificationRequest> &req, bool success, bool transient = false);
+	// with mMutex held
+	void finishRequest(const std::shared_ptr<PushNotificationRequest> &req, bool success);
+	bool queueRetry(const std::shared_ptr<PushNotificationRequest> &req, std::chrono::milliseconds delay, bool saved);
 
 
   private:
 	std::thread *mThread;
 	int mMaxQueueSize;
 	bool mHaveToStop;
-	std::map<std::string, std::shared_ptr<PushNotificationClient>> mClients;
+	int mClientsPerApp;
+	std::map<std::string, std::vector<std::shared_ptr<PushNotificationClient>>> mClients;
 	std::string mPassword;
 	std::string mWindowsPhonePackageSID, mWindowsPhoneApplicationSecret;
+	bool mAppleHttp2, mFirebaseHttp2;
+	int mHttp2Connections, mHttp2MaxStreams, mHttp2IoThreadCount;
+	std::vector<std::shared_ptr<Http2IoThread>> mHttp2IoThreads;
+	size_t mNextHttp2IoThread;
+	std::string mAppleAuthKey, mAppleAuthKeyId, mAppleTeamId;
 	StatCounter64 *mCountFailed;
 	StatCounter64 *mCountSent;
+	std::map<std::string, std::vector<StatCounter64 *>> mLatencyCounters;
+	std::mutex mMutex;
+	std::unordered_map<std::string, int> mQueuedDevices;
+	size_t mPendingRequests;
+	struct Retry {
+		std::shared_ptr<PushNotificationRequest> request;
+		std::chrono::steady_clock::time_point due;
+	};
+	std::list<Retry> mRetries; // by due time
+	std::unordered_map<std::string, int> mProviderFailures; // consecutive failures of each provider
+	int mMaxRetries, mRetryMinDelay, mRetryMaxDelay, mRetryMaxAge;
+	size_t mRetryQueueSize;
+	StatCounter64 *mCountRetried;
+	StatCounter64 *mCountDropped;
 };
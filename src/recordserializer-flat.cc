@@ -0,0 +1,251 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include "common.hh"
+#include "registrardb.hh"
+#include "recordserializer.hh"
+
+using namespace std;
+
+/*
+ * Layout (all integers little endian):
+ *
+ * header:  'F' 'X' 'B' <version:u8> <contact count:u32>
+ * table:   one entry per contact, each one prefixed by its own size (u32) so that a reader can skip the fields
+ *          appended by a more recent minor version:
+ *            expireAt:i64 updatedTime:i64 q:f32 cseq:u32 flags:u32 (bit 0: alias, bit 1: used as route)
+ *            contactId, callId, uniqueId, sipUri: string references
+ *            path count:u32, path offset:u32, accept count:u32, accept offset:u32
+ * data:    the strings, each one NUL terminated, and the arrays of string references of the lists.
+ *
+ * A string reference is an offset from the start of the buffer and a length (u32 each) which does not include the
+ * terminating NUL, so that the parser can hand out pointers into the buffer without copying anything.
+ */
+
+static const char sFlatMagic[3] = {'F', 'X', 'B'};
+static const size_t sHeaderSize = 8;
+static const size_t sStringRefSize = 8;
+static const size_t sContactSize = 4 + 8 + 8 + 4 + 4 + 4 + 4 * sStringRefSize + 4 * 4;
+
+namespace {
+
+class FlatWriter {
+  public:
+	FlatWriter(string &out) : mOut(out) {
+	}
+	size_t size() const {
+		return mOut.size();
+	}
+	void putU32(uint32_t v) {
+		char b[4];
+		for (int i = 0; i < 4; ++i)
+			b[i] = (char)((v >> (8 * i)) & 0xff);
+		mOut.append(b, 4);
+	}
+	void putU64(uint64_t v) {
+		putU32((uint32_t)v);
+		putU32((uint32_t)(v >> 32));
+	}
+	void setU32(size_t pos, uint32_t v) {
+		for (int i = 0; i < 4; ++i)
+			mOut[pos + i] = (char)((v >> (8 * i)) & 0xff);
+	}
+	/* Appends a NUL terminated string to the data area and returns its offset. */
+	uint32_t putString(const char *s, size_t len) {
+		uint32_t offset = mOut.size();
+		mOut.append(s, len);
+		mOut.push_back('\0');
+		return offset;
+	}
+
+  private:
+	string &mOut;
+};
+
+class FlatReader {
+  public:
+	FlatReader(const char *buf, size_t len) : mBuf((const unsigned char *)buf), mLen(len) {
+	}
+	bool u32(size_t pos, uint32_t &v) const {
+		if (pos + 4 > mLen || pos + 4 < pos)
+			return false;
+		v = (uint32_t)mBuf[pos] | ((uint32_t)mBuf[pos + 1] << 8) | ((uint32_t)mBuf[pos + 2] << 16) |
+			((uint32_t)mBuf[pos + 3] << 24);
+		return true;
+	}
+	bool u64(size_t pos, uint64_t &v) const {
+		uint32_t low, high;
+		if (!u32(pos, low) || !u32(pos + 4, high))
+			return false;
+		v = ((uint64_t)high << 32) | low;
+		return true;
+	}
+	/* Resolves the string reference at pos, checking that it lies in the buffer and is NUL terminated. */
+	const char *readString(size_t pos) const {
+		uint32_t offset, len;
+		if (!u32(pos, offset) || !u32(pos + 4, len))
+			return NULL;
+		if ((size_t)offset + len >= mLen || mBuf[offset + len] != '\0')
+			return NULL;
+		return (const char *)mBuf + offset;
+	}
+	bool readList(size_t pos, list<string> &out) const {
+		uint32_t count, offset;
+		if (!u32(pos, count) || !u32(pos + 4, offset))
+			return false;
+		if (count > mLen / sStringRefSize)
+			return false;
+		for (uint32_t i = 0; i < count; ++i) {
+			const char *s = readString((size_t)offset + i * sStringRefSize);
+			if (!s)
+				return false;
+			out.push_back(s);
+		}
+		return true;
+	}
+
+  private:
+	const unsigned char *mBuf;
+	size_t mLen;
+};
+
+}
+
+static void putStringRef(FlatWriter &w, size_t tablePos, const char *s, size_t len) {
+	uint32_t offset = w.putString(s, len);
+	w.setU32(tablePos, offset);
+	w.setU32(tablePos + 4, len);
+}
+
+static uint32_t putList(FlatWriter &w, const SharedStringList &l) {
+	// reserve the references first, then the strings themselves
+	uint32_t refs = w.size();
+	for (size_t i = 0; i < l.size(); ++i) {
+		w.putU64(0);
+	}
+	size_t pos = refs;
+	for (auto it = l.cbegin(); it != l.cend(); ++it, pos += sStringRefSize) {
+		putStringRef(w, pos, it->c_str(), it->size());
+	}
+	return refs;
+}
+
+bool RecordSerializerFlat::parse(const char *str, int len, Record *r) {
+	if (!str)
+		return true;
+
+	FlatReader reader(str, len);
+	uint32_t count;
+	if (len < (int)sHeaderSize || memcmp(str, sFlatMagic, sizeof(sFlatMagic)) != 0 || !reader.u32(4, count)) {
+		SLOGE << "Invalid flat record: bad header";
+		return false;
+	}
+	unsigned int version = (unsigned char)str[3];
+	if (version > sVersion) {
+		SLOGE << "Unsupported flat record version " << version << " (max " << sVersion << ")";
+		return false;
+	}
+
+	size_t pos = sHeaderSize;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t size;
+		if (!reader.u32(pos, size) || size < sContactSize || pos + size > (size_t)len) {
+			SLOGE << "Invalid flat record: truncated contact " << i;
+			return false;
+		}
+		uint64_t expireAt, updatedTime;
+		uint32_t qbits, cseq, flags;
+		reader.u64(pos + 4, expireAt);
+		reader.u64(pos + 12, updatedTime);
+		reader.u32(pos + 20, qbits);
+		reader.u32(pos + 24, cseq);
+		reader.u32(pos + 28, flags);
+		float q;
+		memcpy(&q, &qbits, sizeof(q));
+
+		size_t refs = pos + 32;
+		const char *contactId = reader.readString(refs);
+		const char *callId = reader.readString(refs + sStringRefSize);
+		const char *uniqueId = reader.readString(refs + 2 * sStringRefSize);
+		const char *sipUri = reader.readString(refs + 3 * sStringRefSize);
+		size_t lists = refs + 4 * sStringRefSize;
+		list<string> path, accept;
+		if (!contactId || !callId || !uniqueId || !sipUri || sipUri[0] == '\0' || !reader.readList(lists, path) ||
+			!reader.readList(lists + 8, accept)) {
+			SLOGE << "Invalid flat record: bad reference in contact " << i;
+			return false;
+		}
+
+		ExtendedContactCommon ecc(contactId, path, callId, uniqueId);
+		r->update(ecc, sipUri, (long)expireAt, q, cseq, (time_t)updatedTime, (flags & 1) != 0, accept,
+				  (flags & 2) != 0, NULL);
+		pos += size;
+	}
+	return true;
+}
+
+bool RecordSerializerFlat::serialize(Record *r, string &serialized, bool log) {
+	if (!r)
+		return true;
+
+	auto contacts = r->getExtendedContacts();
+	string out;
+	FlatWriter w(out);
+	out.append(sFlatMagic, sizeof(sFlatMagic));
+	out.push_back((char)sVersion);
+	w.putU32(contacts.size());
+
+	// the table is written first with empty references, which are filled once the strings are appended
+	size_t table = out.size();
+	for (auto it = contacts.begin(); it != contacts.end(); ++it) {
+		const shared_ptr<ExtendedContact> &ec = *it;
+		uint32_t qbits;
+		float q = ec->mQ;
+		memcpy(&qbits, &q, sizeof(qbits));
+		w.putU32(sContactSize);
+		w.putU64((uint64_t)ec->mExpireAt);
+		w.putU64((uint64_t)ec->mUpdatedTime);
+		w.putU32(qbits);
+		w.putU32(ec->mCSeq);
+		w.putU32((ec->mAlias ? 1 : 0) | (ec->mUsedAsRoute ? 2 : 0));
+		out.append(4 * sStringRefSize + 4 * 4, '\0');
+	}
+
+	SofiaAutoHome home;
+	size_t pos = table;
+	for (auto it = contacts.begin(); it != contacts.end(); ++it, pos += sContactSize) {
+		const shared_ptr<ExtendedContact> &ec = *it;
+		size_t refs = pos + 32;
+		char *uri = url_as_string(home.home(), ec->mSipUri);
+		putStringRef(w, refs, ec->mContactId.c_str(), ec->mContactId.size());
+		putStringRef(w, refs + sStringRefSize, ec->mCallId.c_str(), ec->mCallId.size());
+		putStringRef(w, refs + 2 * sStringRefSize, ec->mUniqueId.c_str(), ec->mUniqueId.size());
+		putStringRef(w, refs + 3 * sStringRefSize, uri ? uri : "", uri ? strlen(uri) : 0);
+		size_t lists = refs + 4 * sStringRefSize;
+		w.setU32(lists, ec->mPath.size());
+		w.setU32(lists + 4, putList(w, ec->mPath));
+		w.setU32(lists + 8, ec->mAcceptHeader.size());
+		w.setU32(lists + 12, putList(w, ec->mAcceptHeader));
+	}
+
+	serialized.swap(out);
+	if (log)
+		SLOGI << "Serialized size: " << serialized.size();
+	return true;
+}
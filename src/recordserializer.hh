@@ -54,6 +54,17 @@ class RecordSerializerJson : public RecordSerializer {
 	virtual bool serialize(Record *r, std::string &serialized, bool log);
 };
 
+/*
+ * Binary serializer whose strings are referenced by offset, so that parsing reads them in place from the buffer.
+ * The version byte of the header is bumped on incompatible changes; new fields are appended to the contacts.
+ */
+class RecordSerializerFlat : public RecordSerializer {
+  public:
+	static const unsigned int sVersion = 1;
+	virtual bool parse(const char *str, int len, Record *r);
+	virtual bool serialize(Record *r, std::string &serialized, bool log);
+};
+
 #ifdef ENABLE_PROTOBUF
 class RecordSerializerPb : public RecordSerializer {
   public:
@@ -20,16 +20,236 @@
 #include "registrardb-internal.hh"
 #include "common.hh"
 
+#include <cerrno>
 #include <ctime>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <sofia-sip/sip_protos.h>
 
 using namespace std;
 
-RegistrarDbInternal::RegistrarDbInternal(const string &preferredRoute) : RegistrarDb(preferredRoute) {
+static const char sFileMagic[8] = {'F', 'L', 'X', 'R', 'E', 'G', '1', '\n'};
+
+RegistrarDbInternal::RegistrarDbInternal(const string &preferredRoute)
+	: RegistrarDb(preferredRoute), mFd(-1), mTimers(NULL), mInterval(0) {
+}
+
+RegistrarDbInternal::~RegistrarDbInternal() {
+	if (mFd != -1)
+		close(mFd);
+}
+
+bool RegistrarDbInternal::startPersistence(TimerService *timers, const string &path, int interval) {
+	mSerializer.reset(new RecordSerializerFlat());
+	mPath = path;
+	mTimers = timers;
+	mInterval = max(1, interval);
+	load();
+	// compacts what was loaded, and opens the file the changes are appended to
+	snapshot();
+	return mFd != -1;
+}
+
+void RegistrarDbInternal::load() {
+	int fd = open(mPath.c_str(), O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			LOGE("Cannot open registrar snapshot %s: %s", mPath.c_str(), strerror(errno));
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(sFileMagic)) {
+		close(fd);
+		return;
+	}
+	size_t size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGE("Cannot map registrar snapshot %s: %s", mPath.c_str(), strerror(errno));
+		return;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+	const char *data = (const char *)map;
+	if (memcmp(data, sFileMagic, sizeof(sFileMagic)) != 0) {
+		LOGE("%s is not a registrar snapshot, ignored", mPath.c_str());
+		munmap(map, size);
+		return;
+	}
+
+	// the records are parsed once, from the last entry of their key
+	unordered_map<string, pair<const char *, uint32_t>> latest;
+	size_t pos = sizeof(sFileMagic);
+	size_t entries = 0;
+	while (pos + 2 * sizeof(uint32_t) <= size) {
+		uint32_t keyLen, len;
+		memcpy(&keyLen, data + pos, sizeof(keyLen));
+		memcpy(&len, data + pos + sizeof(keyLen), sizeof(len));
+		size_t start = pos + 2 * sizeof(uint32_t);
+		if (start + keyLen + len > size)
+			break; // the end of an append interrupted by a crash
+		latest[string(data + start, keyLen)] = make_pair(data + start + keyLen, len);
+		pos = start + keyLen + len;
+		++entries;
+	}
+	if (pos != size)
+		LOGW("Registrar snapshot %s truncated after %zu entries", mPath.c_str(), entries);
+
+	time_t now = getCurrentTime();
+	size_t loaded = 0;
+	for (const auto &entry : latest) {
+		if (entry.second.second == 0)
+			continue; // cleared
+		Record *r = parseRecord(entry.first, entry.second.first, entry.second.second);
+		if (!r)
+			continue;
+		r->clean(now, nullptr);
+		if (r->isEmpty()) {
+			delete r;
+			continue;
+		}
+		Record *previous = NULL;
+		if (mRecords.find(entry.first, previous))
+			delete previous;
+		mRecords.set(entry.first, r);
+		mLocalRegExpire->update(*r);
+		++loaded;
+	}
+	munmap(map, size);
+	LOGI("Loaded %zu records from registrar snapshot %s", loaded, mPath.c_str());
+}
+
+Record *RegistrarDbInternal::parseRecord(const string &key, const char *data, size_t len) {
+	SofiaAutoHome home;
+	url_t *aor = url_make(home.home(), ("sip:" + key).c_str());
+	if (!aor)
+		return NULL;
+	Record *r = new Record(aor);
+	if (!mSerializer->parse(data, len, r)) {
+		LOGW("Cannot parse the record of %s", key.c_str());
+		delete r;
+		return NULL;
+	}
+	return r;
+}
+
+void RegistrarDbInternal::appendEntry(string &out, const string &key, const string &serialized) {
+	uint32_t lengths[2] = {(uint32_t)key.size(), (uint32_t)serialized.size()};
+	out.append((const char *)lengths, sizeof(lengths));
+	out.append(key);
+	out.append(serialized);
+}
+
+void RegistrarDbInternal::append(const string &key, Record *r) {
+	if (mFd == -1)
+		return;
+	string serialized;
+	if (r && !mSerializer->serialize(r, serialized)) {
+		LOGE("Cannot serialize the record of %s for the registrar snapshot", key.c_str());
+		return;
+	}
+	string entry;
+	appendEntry(entry, key, serialized);
+	// a single write, so that a crash leaves at most the last entry truncated
+	if (write(mFd, entry.data(), entry.size()) != (ssize_t)entry.size())
+		LOGE("Cannot append to registrar snapshot %s: %s", mPath.c_str(), strerror(errno));
+}
+
+void RegistrarDbInternal::snapshot() {
+	string tmpPath = mPath + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		LOGE("Cannot create registrar snapshot %s: %s", tmpPath.c_str(), strerror(errno));
+	} else {
+		string out(sFileMagic, sizeof(sFileMagic));
+		string serialized;
+		time_t now = getCurrentTime();
+		mRecords.forEach([&](const string &key, Record *r) {
+			if (r->latestExpire() <= now)
+				return;
+			serialized.clear();
+			if (mSerializer->serialize(r, serialized))
+				appendEntry(out, key, serialized);
+		});
+		bool written = write(fd, out.data(), out.size()) == (ssize_t)out.size();
+		close(fd);
+		if (written && rename(tmpPath.c_str(), mPath.c_str()) == 0) {
+			// the changes from now on are appended to the new snapshot
+			if (mFd != -1)
+				close(mFd);
+			mFd = open(mPath.c_str(), O_WRONLY | O_APPEND);
+		} else {
+			LOGE("Cannot write registrar snapshot %s: %s", mPath.c_str(), strerror(errno));
+			unlink(tmpPath.c_str());
+		}
+	}
+	mSnapshotTimer = mTimers->schedule(mInterval, [this]() { snapshot(); });
+}
+
+bool RegistrarDbInternal::startReplication(su_root_t *root, int port, const list<string> &peers) {
+	if (!mSerializer)
+		mSerializer.reset(new RecordSerializerFlat());
+	mReplicator.reset(new RegistrarReplicator(
+		root, [this](const string &key, const string &serialized) { onReplicatedChange(key, serialized); },
+		[this](const string &key, string &serialized) { return serializeRecord(key, serialized); },
+		[this](const string &topic, const string &uid) { notifyContactListener(topic, uid); }));
+	if (!mReplicator->start(port, peers)) {
+		mReplicator.reset();
+		return false;
+	}
+	return true;
+}
+
+bool RegistrarDbInternal::serializeRecord(const string &key, string &serialized) {
+	Record *r = NULL;
+	return mRecords.find(key, r) && mSerializer->serialize(r, serialized);
+}
+
+void RegistrarDbInternal::replicate(const string &key, Record *r, time_t expireAt) {
+	if (!mReplicator)
+		return;
+	string serialized;
+	if (r && !mSerializer->serialize(r, serialized)) {
+		LOGE("Cannot serialize the record of %s for the replication", key.c_str());
+		return;
+	}
+	mReplicator->change(key, serialized, expireAt);
+}
+
+/* The record of a peer replaces ours, the registrations made through this node included: they are part of it. */
+void RegistrarDbInternal::onReplicatedChange(const string &key, const string &serialized) {
+	Record *r = NULL;
+	if (!serialized.empty()) {
+		r = parseRecord(key, serialized.data(), serialized.size());
+		if (!r)
+			return;
+		r->clean(getCurrentTime(), nullptr);
+		if (r->isEmpty()) {
+			delete r;
+			r = NULL;
+		}
+	}
+	Record *previous = NULL;
+	if (mRecords.find(key, previous)) {
+		mRecords.erase(key);
+		delete previous;
+	}
+	if (r) {
+		LOGD("Record %s replicated", key.c_str());
+		mRecords.set(key, r);
+	} else {
+		LOGD("Record %s cleared by replication", key.c_str());
+	}
+	append(key, r);
 }
 
 void RegistrarDbInternal::doBind(const url_t *ifrom, sip_contact_t *icontact, const char *iid, uint32_t iseq,
@@ -37,15 +257,13 @@ void RegistrarDbInternal::doBind(const url_t *ifrom, sip_contact_t *icontact, co
 	string key = Record::defineKeyFromUrl(ifrom);
 	time_t now = getCurrentTime();
 
-	map<string, Record *>::iterator it = mRecords.find(key);
-	Record *r;
-	if (it == mRecords.end()) {
+	Record *r = NULL;
+	if (!mRecords.find(key, r)) {
 		r = new Record(ifrom);
-		mRecords.insert(make_pair(key, r));
+		mRecords.set(key, r);
 		LOGD("Creating AOR %s association", key.c_str());
 	} else {
 		LOGD("AOR %s found", key.c_str());
-		r = (*it).second;
 	}
 
 	if (r->isInvalidRegister(iid, iseq)) {
@@ -57,19 +275,20 @@ void RegistrarDbInternal::doBind(const url_t *ifrom, sip_contact_t *icontact, co
 	r->update(icontact, ipath, expire, iid, iseq, now, alias, acceptHeaders, usedAsRoute, listener);
 
 	mLocalRegExpire->update(*r);
+	append(key, r);
+	replicate(key, r, r->latestExpire());
 	listener->onRecordFound(r);
 }
 
 void RegistrarDbInternal::doFetch(const url_t *url, const shared_ptr<ContactUpdateListener> &listener) {
 	string key(Record::defineKeyFromUrl(url));
 
-	map<string, Record *>::iterator it = mRecords.find(key);
 	Record *r = NULL;
-	if (it != mRecords.end()) {
-		r = (*it).second;
+	if (mRecords.find(key, r)) {
 		r->clean(getCurrentTime(), listener);
 		if (r->isEmpty()) {
-			mRecords.erase(it);
+			mRecords.erase(key);
+			delete r;
 			r = NULL;
 		}
 	}
@@ -81,18 +300,17 @@ void RegistrarDbInternal::doFetchForGruu(const url_t *url, const string &gruu, c
 	string key(Record::defineKeyFromUrl(url));
 	SofiaAutoHome home;
 
-	map<string, Record *>::iterator it = mRecords.find(key);
 	Record *r = NULL;
 
-	if (it == mRecords.end()) {
+	if (!mRecords.find(key, r)) {
 		listener->onRecordFound(r);
 		return;
 	}
 
-	r = (*it).second;
 	r->clean(getCurrentTime(), listener);
 	if (r->isEmpty()) {
-		mRecords.erase(it);
+		mRecords.erase(key);
+		delete r;
 		r = NULL;
 		listener->onRecordFound(r);
 		return;
@@ -127,23 +345,26 @@ void RegistrarDbInternal::doClear(const sip_t *sip, const shared_ptr<ContactUpda
 		return;
 	}
 
-	map<string, Record *>::iterator it = mRecords.find(key);
+	Record *r = NULL;
 
-	if (it == mRecords.end()) {
+	if (!mRecords.find(key, r)) {
 		listener->onRecordFound(NULL);
 		return;
 	}
 
 	LOGD("AOR %s found", key.c_str());
-	Record *r = (*it).second;
 
 	if (r->isInvalidRegister(sip->sip_call_id->i_id, sip->sip_cseq->cs_seq)) {
 		listener->onInvalid();
 		return;
 	}
 
-	mRecords.erase(it);
+	time_t expireAt = r->latestExpire();
+	mRecords.erase(key);
+	delete r;
 	mLocalRegExpire->remove(key);
+	append(key, NULL);
+	replicate(key, NULL, expireAt);
 	listener->onRecordFound(NULL);
 }
 
@@ -152,11 +373,16 @@ void RegistrarDbInternal::doMigration() {
 }
 
 void RegistrarDbInternal::clearAll() {
-	mRecords.clear();
+	mRecords.eraseIf([](const string &key, Record *r) {
+		delete r;
+		return true;
+	});
 	mLocalRegExpire->clearAll();
 }
 
 void RegistrarDbInternal::publish(const std::string &topic, const std::string &uid) {
 	LOGD("Publish topic = %s, uid = %s", topic.c_str(), uid.c_str());
 	RegistrarDb::notifyContactListener(topic, uid);
+	if (mReplicator)
+		mReplicator->publish(topic, uid);
 }
@@ -21,14 +21,41 @@
 #define registrardb_internal_hh
 
 #include "registrardb.hh"
+#include "recordserializer.hh"
+#include "timerservice.hh"
+#include "registrardb-replication.hh"
 #include <sofia-sip/sip.h>
 
 class RegistrarDbInternal : public RegistrarDb {
   public:
 	RegistrarDbInternal(const std::string &preferredRoute);
+	~RegistrarDbInternal();
 	void clearAll();
+	/*
+	 * Loads the records kept in path, then appends every change of a record to it, and replaces it by a snapshot of
+	 * all the records every interval seconds. The file is a header followed by entries made of the lengths of the key
+	 * and of the record, the key and the record serialized by RecordSerializerFlat; a record of length zero clears
+	 * its key. The last entry of a key wins, and a truncated entry at the end, from a crash, is ignored.
+	 */
+	bool startPersistence(TimerService *timers, const std::string &path, int interval);
+	/*
+	 * Shares the records with the peers listed as host:port, listening for them on the given UDP port: each node keeps
+	 * all the records in memory, and the last bind or clear of a record on any node wins. The publications of topics
+	 * are also forwarded to the peers, for their forks waiting for a registration.
+	 */
+	bool startReplication(su_root_t *root, int port, const std::list<std::string> &peers);
 
   private:
+	void load();
+	void snapshot();
+	void append(const std::string &key, Record *r);
+	Record *parseRecord(const std::string &key, const char *data, size_t len);
+	void replicate(const std::string &key, Record *r, time_t expireAt);
+	void onReplicatedChange(const std::string &key, const std::string &serialized);
+	bool serializeRecord(const std::string &key, std::string &serialized);
+	static void appendEntry(std::string &out, const std::string &key, const std::string &serialized);
+
+  protected:
 	virtual void doBind(const url_t *ifrom, sip_contact_t *icontact, const char *iid, uint32_t iseq, const sip_path_t *ipath, 
 		std::list<std::string> acceptHeaders, bool usedAsRoute, int expire, int alias, int version, const std::shared_ptr<ContactUpdateListener> &listener);
 	virtual void doClear(const sip_t *sip, const std::shared_ptr<ContactUpdateListener> &listener);
@@ -36,6 +63,15 @@ class RegistrarDbInternal : public RegistrarDb {
 	virtual void doFetchForGruu(const url_t *url, const std::string &gruu, const std::shared_ptr<ContactUpdateListener> &listener);
 	virtual void doMigration();
 	virtual void publish(const std::string &topic, const std::string &uid);
+
+  private:
+	std::string mPath;
+	int mFd; // of the file appended to, -1 without persistence
+	std::unique_ptr<RecordSerializer> mSerializer;
+	std::shared_ptr<TimerService::Timer> mSnapshotTimer;
+	TimerService *mTimers;
+	int mInterval;
+	std::unique_ptr<RegistrarReplicator> mReplicator;
 };
 
 #endif
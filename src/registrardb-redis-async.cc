@@ -19,8 +19,11 @@
 #include "recordserializer.hh"
 #include "registrardb-redis.hh"
 #include "common.hh"
+#include "utils/compression.hh"
 
+#include <climits>
 #include <ctime>
+#include <cstdarg>
 #include <cstdio>
 #include <vector>
 #include <algorithm>
@@ -36,31 +39,258 @@
 using namespace std;
 
 RegistrarUserData::RegistrarUserData(RegistrarDbRedisAsync *s, const url_t *url, shared_ptr<ContactUpdateListener> listener)
-	: self(s), listener(listener), record(url), token(0), mUpdateExpire(false), mRetryCount(0), mGruu(""), mIsUnregister(false) {
+	: self(s), listener(listener), record(url), token(0), mUpdateExpire(false), mRetryCount(0), mGruu(""), mIsUnregister(false),
+	  mCacheSequence(0), mAskNode(-1), mFromReplica(false), mReplayCount(0) {
 	
 }
 RegistrarUserData::~RegistrarUserData() {
 	
 }
 
+/******
+ * RecordCache class
+ */
+
+/* Number of invalidations remembered to decide whether a pending fetch reply may be inserted in the cache. */
+static const size_t sMaxTrackedInvalidations = 1024;
+
+RecordCache::RecordCache(size_t maxSize, int ttl)
+	: mMaxSize(maxSize), mTtl(ttl), mSequence(0), mLastClear(0), mCountHits(NULL), mCountMisses(NULL),
+	  mCountEvictions(NULL) {
+}
+
+shared_ptr<Record> RecordCache::get(const string &key, time_t now) {
+	auto it = mIndex.find(key);
+	if (it == mIndex.end() || (mTtl > 0 && it->second->insertedAt + mTtl <= now)) {
+		if (it != mIndex.end()) erase(it);
+		if (mCountMisses) ++(*mCountMisses);
+		return nullptr;
+	}
+	mLru.splice(mLru.begin(), mLru, it->second);
+	if (mCountHits) ++(*mCountHits);
+	return make_shared<Record>(*it->second->record);
+}
+
+void RecordCache::put(const Record &record, uint64_t sequence, time_t now) {
+	const string &key = record.getKey();
+	if (mMaxSize == 0 || invalidatedSince(key, sequence))
+		return;
+
+	auto it = mIndex.find(key);
+	if (it != mIndex.end()) {
+		it->second->record = make_shared<Record>(record);
+		it->second->insertedAt = now;
+		mLru.splice(mLru.begin(), mLru, it->second);
+		return;
+	}
+	Entry entry;
+	entry.key = key;
+	entry.record = make_shared<Record>(record);
+	entry.insertedAt = now;
+	mLru.push_front(entry);
+	mIndex[key] = mLru.begin();
+	while (mIndex.size() > mMaxSize) {
+		erase(mIndex.find(mLru.back().key));
+		if (mCountEvictions) ++(*mCountEvictions);
+	}
+}
+
+void RecordCache::invalidate(const string &key) {
+	++mSequence;
+	mRecentInvalidations.push_back(make_pair(mSequence, key));
+	if (mRecentInvalidations.size() > sMaxTrackedInvalidations) {
+		mRecentInvalidations.pop_front();
+	}
+	auto it = mIndex.find(key);
+	if (it != mIndex.end()) erase(it);
+}
+
+void RecordCache::clear() {
+	++mSequence;
+	mLastClear = mSequence;
+	mRecentInvalidations.clear();
+	mIndex.clear();
+	mLru.clear();
+}
+
+bool RecordCache::invalidatedSince(const string &key, uint64_t sequence) const {
+	if (sequence == mSequence)
+		return false;
+	if (sequence < mLastClear)
+		return true;
+	// Some invalidations issued after this sequence are no longer tracked: be conservative
+	if (mRecentInvalidations.empty() || mRecentInvalidations.front().first > sequence + 1)
+		return true;
+	for (auto it = mRecentInvalidations.rbegin(); it != mRecentInvalidations.rend() && it->first > sequence; ++it) {
+		if (it->second == key)
+			return true;
+	}
+	return false;
+}
+
+void RecordCache::erase(unordered_map<string, LruList::iterator>::iterator it) {
+	mLru.erase(it->second);
+	mIndex.erase(it);
+}
+
 /******
  * RegistrarDbRedisAsync class
  */
 
+/* Key under which the progress of the migration of the previous records is saved. */
+const char *RegistrarDbRedisAsync::sMigrationCursorKey = "flexisip:migration:cursor";
+/* Period in milliseconds of the steps of the migration. */
+static const int sMigrationTickInterval = 1000;
+
+/* Period in milliseconds of the checks of the rebuild of the filter of the registered aors. */
+static const int sAorFilterTickInterval = 1000;
+
+/* Number of keys examined by each SCAN step of the rebuild of the filter of the registered aors. */
+static const int sAorFilterScanCount = 1000;
+
+/* Number of hash slots of a redis cluster. */
+static const int sClusterSlots = 16384;
+
+/* Channel on which the keys of the records modified by a bind or a clear are published. */
+const char *RegistrarDbRedisAsync::sRecordUpdatedChannel = "FLEXISIP_RECORD_UPDATED";
+/* Prefix of the channels the topics are hashed to, followed by the index of the channel. The publications are
+ * "<topic> <uid>", the topics being keys of records which never hold a space. */
+const char *RegistrarDbRedisAsync::sTopicChannelPrefix = "FLEXISIP_TOPICS:";
+/* Channel on which redis publishes the invalidations of the tracked keys to the connection they are redirected to, an
+ * array of keys or nil when the whole database is flushed. */
+const char *RegistrarDbRedisAsync::sInvalidateChannel = "__redis__:invalidate";
+
+/* Bind done on the server: KEYS[1] is the record, ARGV[1] the current time, ARGV[2] "bind" followed by the uid and
+ * serialized contact pairs to set, or "unbind" followed by the uid to remove. The expired contacts are removed, the
+ * expiration of the record is set to the latest one of its contacts, and the remaining contacts are returned as
+ * HGETALL does. Contacts without expiry parameters are returned as they are, for the proxy to parse them. */
+const char *RegistrarDbRedisAsync::sBindScript =
+	"local key = KEYS[1]\n"
+	"local now = tonumber(ARGV[1])\n"
+	"if ARGV[2] == 'unbind' then\n"
+	"  redis.call('HDEL', key, ARGV[3])\n"
+	"else\n"
+	"  for i = 3, #ARGV, 2 do redis.call('HSET', key, ARGV[i], ARGV[i + 1]) end\n"
+	"end\n"
+	"local fields = redis.call('HGETALL', key)\n"
+	"local contacts = {}\n"
+	"local latest = 0\n"
+	"for i = 1, #fields, 2 do\n"
+	"  local expires = tonumber(string.match(fields[i + 1], ';expires=(%-?%d+)'))\n"
+	"  local updated = tonumber(string.match(fields[i + 1], ';updatedAt=(%d+)'))\n"
+	"  local expireAt = (expires and updated) and updated + expires or nil\n"
+	"  if expireAt and expireAt <= now then\n"
+	"    redis.call('HDEL', key, fields[i])\n"
+	"  else\n"
+	"    if expireAt and expireAt > latest then latest = expireAt end\n"
+	"    contacts[#contacts + 1] = fields[i]\n"
+	"    contacts[#contacts + 1] = fields[i + 1]\n"
+	"  end\n"
+	"end\n"
+	"if latest > 0 then redis.call('EXPIREAT', key, latest) end\n"
+	"return contacts\n";
+
 RegistrarDbRedisAsync::RegistrarDbRedisAsync(Agent *ag, RedisParameters params)
 	: RegistrarDb(ag->getPreferredRoute()), mAgent(ag), mContext(NULL), mSubscribeContext(NULL),
 	  mDomain(params.domain), mAuthPassword(params.auth), mPort(params.port), mTimeout(params.timeout), mRoot(ag->getRoot()),
-	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout) {
+	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout), mBatchWindow(params.mBatchWindow),
+	  mBatchMaxSize(params.mBatchMaxSize), mBatchPending(0), mBatchTimer(NULL), mCluster(params.mCluster),
+	  mClusterSlotsPending(false), mCountClusterRedirections(NULL), mSharded(false), mMigrationCurrent(0),
+	  mMigrationInFlight(false),
+	  mMigrationBudget(params.mMigrationBudget), mMigrationTimer(NULL), mCountMigrationKeys(NULL),
+	  mCountMigratedRecords(NULL), mBindScript(params.mBindScript), mReplicaReads(params.mReplicaReads),
+	  mReplicaMaxLag(params.mReplicaMaxLag), mNextReplica(0), mCountReplicaFetches(NULL),
+	  mAorFilterSize(params.mAorFilterSize), mAorFilterRebuildInterval(params.mAorFilterRebuildInterval),
+	  mAorFilter(NULL), mAorFilterBuilding(NULL), mAorFilterCurrent(0), mAorFilterInFlight(false),
+	  mAorFilterRebuildAt(1), mAorFilterTimer(NULL), mCountAorFilterRejections(NULL), mCountAorFilterRebuilds(NULL),
+	  mSubscriptionChannels(max(0, params.mSubscriptionChannels)), mReconnectMinDelay(max(1, params.mReconnectMinDelay)),
+	  mReconnectMaxDelay(max(1, params.mReconnectMaxDelay)), mReconnectAttempts(0), mReconnectTimer(NULL),
+	  mReconnectPending(false), mOutageBufferSize((size_t)max(0, params.mOutageBufferSize)),
+	  mOutageBufferTimeout(max(0, params.mOutageBufferTimeout)), mInOutage(false), mPendingTimer(NULL),
+	  mCountReconnections(NULL), mCountOutageBuffered(NULL), mCountOutageReplayed(NULL), mCountOutageFailed(NULL),
+	  mCompressionThreshold((size_t)max(0, params.mCompressionThreshold)) {
 	mSerializer = RecordSerializer::get();
 	mCurSlave = 0;
+	if (mCluster) mClusterSlots.assign(sClusterSlots, -1);
+	if (mCluster && mReplicaReads) {
+		LOGW("Replica reads are not supported with a redis cluster, fetches are sent to the masters");
+		mReplicaReads = false;
+	}
+	setupShards(params);
+	if (mCompressionThreshold > 0 && !ValueCompression::isAvailable()) {
+		LOGW("redis-compression-threshold is ignored: flexisip is built without lz4");
+		mCompressionThreshold = 0;
+	}
+
+	GenericStruct *registrar = GenericManager::get()->getRoot()->get<GenericStruct>("module::Registrar");
+	mCountBatches = registrar->get<StatCounter64>("count-redis-batches");
+	mCountBatchedCommands = registrar->get<StatCounter64>("count-redis-batched-commands");
+	mCountBatchesFull = registrar->get<StatCounter64>("count-redis-batches-full");
+	mCountClusterRedirections = registrar->get<StatCounter64>("count-redis-cluster-redirections");
+	mCountMigrationKeys = registrar->get<StatCounter64>("count-redis-migration-scanned-keys");
+	mCountMigratedRecords = registrar->get<StatCounter64>("count-redis-migration-migrated-records");
+	mCountReplicaFetches = registrar->get<StatCounter64>("count-redis-replica-fetches");
+	mCountAorFilterRejections = registrar->get<StatCounter64>("count-redis-aor-filter-rejections");
+	mCountAorFilterRebuilds = registrar->get<StatCounter64>("count-redis-aor-filter-rebuilds");
+	mCountReconnections = registrar->get<StatCounter64>("count-redis-reconnections");
+	mCountOutageBuffered = registrar->get<StatCounter64>("count-redis-outage-buffered");
+	mCountOutageReplayed = registrar->get<StatCounter64>("count-redis-outage-replayed");
+	mCountOutageFailed = registrar->get<StatCounter64>("count-redis-outage-failed");
+
+	mRecordCache = NULL;
+	if (params.mFetchCacheSize > 0) {
+		mRecordCache = new RecordCache(params.mFetchCacheSize, params.mFetchCacheTtl);
+		mRecordCache->setStats(registrar->get<StatCounter64>("count-redis-fetch-cache-hits"),
+							   registrar->get<StatCounter64>("count-redis-fetch-cache-misses"),
+							   registrar->get<StatCounter64>("count-redis-fetch-cache-evictions"));
+	}
+	setupClientTracking(params);
+	if (mAorFilterSize > 0) {
+		mAorFilterTimer = su_timer_create(su_root_task(mRoot), sAorFilterTickInterval);
+		su_timer_run(mAorFilterTimer, (su_timer_f)sHandleAorFilterTimer, this);
+	}
 }
 
 RegistrarDbRedisAsync::RegistrarDbRedisAsync(const string &preferredRoute, su_root_t *root, RecordSerializer *serializer, RedisParameters params)
 	: RegistrarDb(preferredRoute), mAgent(NULL), mContext(NULL), mSubscribeContext(NULL),
 	  mDomain(params.domain), mAuthPassword(params.auth), mPort(params.port), mTimeout(params.timeout), mRoot(root),
-	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout) {
+	  mReplicationTimer(NULL), mSlaveCheckTimeout(params.mSlaveCheckTimeout), mBatchWindow(params.mBatchWindow),
+	  mBatchMaxSize(params.mBatchMaxSize), mBatchPending(0), mBatchTimer(NULL), mCountBatches(NULL),
+	  mCountBatchedCommands(NULL), mCountBatchesFull(NULL), mRecordCache(NULL), mCluster(params.mCluster),
+	  mClusterSlotsPending(false), mCountClusterRedirections(NULL), mSharded(false), mMigrationCurrent(0),
+	  mMigrationInFlight(false),
+	  mMigrationBudget(params.mMigrationBudget), mMigrationTimer(NULL), mCountMigrationKeys(NULL),
+	  mCountMigratedRecords(NULL), mBindScript(params.mBindScript), mReplicaReads(params.mReplicaReads),
+	  mReplicaMaxLag(params.mReplicaMaxLag), mNextReplica(0), mCountReplicaFetches(NULL),
+	  mAorFilterSize(params.mAorFilterSize), mAorFilterRebuildInterval(params.mAorFilterRebuildInterval),
+	  mAorFilter(NULL), mAorFilterBuilding(NULL), mAorFilterCurrent(0), mAorFilterInFlight(false),
+	  mAorFilterRebuildAt(1), mAorFilterTimer(NULL), mCountAorFilterRejections(NULL), mCountAorFilterRebuilds(NULL),
+	  mSubscriptionChannels(max(0, params.mSubscriptionChannels)), mReconnectMinDelay(max(1, params.mReconnectMinDelay)),
+	  mReconnectMaxDelay(max(1, params.mReconnectMaxDelay)), mReconnectAttempts(0), mReconnectTimer(NULL),
+	  mReconnectPending(false), mOutageBufferSize((size_t)max(0, params.mOutageBufferSize)),
+	  mOutageBufferTimeout(max(0, params.mOutageBufferTimeout)), mInOutage(false), mPendingTimer(NULL),
+	  mCountReconnections(NULL), mCountOutageBuffered(NULL), mCountOutageReplayed(NULL), mCountOutageFailed(NULL),
+	  mCompressionThreshold((size_t)max(0, params.mCompressionThreshold)) {
 	mSerializer = serializer;
 	mCurSlave = 0;
+	if (mCluster) mClusterSlots.assign(sClusterSlots, -1);
+	if (mCluster && mReplicaReads) {
+		LOGW("Replica reads are not supported with a redis cluster, fetches are sent to the masters");
+		mReplicaReads = false;
+	}
+	setupShards(params);
+	if (mCompressionThreshold > 0 && !ValueCompression::isAvailable()) {
+		LOGW("redis-compression-threshold is ignored: flexisip is built without lz4");
+		mCompressionThreshold = 0;
+	}
+	if (params.mFetchCacheSize > 0) {
+		mRecordCache = new RecordCache(params.mFetchCacheSize, params.mFetchCacheTtl);
+	}
+	setupClientTracking(params);
+	if (mAorFilterSize > 0) {
+		mAorFilterTimer = su_timer_create(su_root_task(mRoot), sAorFilterTickInterval);
+		su_timer_run(mAorFilterTimer, (su_timer_f)sHandleAorFilterTimer, this);
+	}
 }
 
 RegistrarDbRedisAsync::~RegistrarDbRedisAsync() {
@@ -70,10 +300,40 @@ RegistrarDbRedisAsync::~RegistrarDbRedisAsync() {
 	if (mSubscribeContext) {
 		redisAsyncDisconnect(mSubscribeContext);
 	}
+	for (auto it = mClusterNodes.begin(); it != mClusterNodes.end(); ++it) {
+		if (it->context) redisAsyncDisconnect(it->context);
+	}
+	for (auto it = mReplicas.begin(); it != mReplicas.end(); ++it) {
+		if (it->context) redisAsyncDisconnect(it->context);
+	}
 	if (mAgent && mReplicationTimer) {
 		mAgent->stopTimer(mReplicationTimer);
 		mReplicationTimer = NULL;
 	}
+	if (mBatchTimer) {
+		su_timer_destroy(mBatchTimer);
+		mBatchTimer = NULL;
+	}
+	if (mMigrationTimer) {
+		su_timer_destroy(mMigrationTimer);
+		mMigrationTimer = NULL;
+	}
+	if (mAorFilterTimer) {
+		su_timer_destroy(mAorFilterTimer);
+		mAorFilterTimer = NULL;
+	}
+	expirePendingCommands(true);
+	if (mReconnectTimer) {
+		su_timer_destroy(mReconnectTimer);
+		mReconnectTimer = NULL;
+	}
+	if (mPendingTimer) {
+		su_timer_destroy(mPendingTimer);
+		mPendingTimer = NULL;
+	}
+	delete mRecordCache;
+	delete mAorFilter;
+	delete mAorFilterBuilding;
 }
 
 void RegistrarDbRedisAsync::onDisconnect(const redisAsyncContext *c, int status) {
@@ -83,10 +343,18 @@ void RegistrarDbRedisAsync::onDisconnect(const redisAsyncContext *c, int status)
 	}
 
 	mContext = NULL;
+	mBatchPending = 0;
+	if (mBatchTimer) su_timer_reset(mBatchTimer);
+	// redis stops tracking the keys for the connection as soon as it is closed
+	if (mClientTracking) mRecordCache->clear();
 	LOGD("Disconnected %p...", c);
 	if (status != REDIS_OK) {
 		LOGE("Redis disconnection message: %s", c->errstr);
-		tryReconnect();
+		if (!mInOutage) {
+			mInOutage = true;
+			mOutageStart = chrono::steady_clock::now();
+		}
+		scheduleReconnect();
 		return;
 	}
 }
@@ -95,10 +363,11 @@ void RegistrarDbRedisAsync::onConnect(const redisAsyncContext *c, int status) {
 	if (status != REDIS_OK) {
 		LOGE("Couldn't connect to redis: %s", c->errstr);
 		mContext = NULL;
-		tryReconnect();
+		scheduleReconnect();
 		return;
 	}
 	LOGD("Connected... %p", c);
+	replayPendingCommands();
 }
 
 void RegistrarDbRedisAsync::onSubscribeDisconnect(const redisAsyncContext *c, int status) {
@@ -108,10 +377,13 @@ void RegistrarDbRedisAsync::onSubscribeDisconnect(const redisAsyncContext *c, in
 	}
 
 	mSubscribeContext = NULL;
+	// Record updates published while we are not subscribed would be missed
+	if (mRecordCache) mRecordCache->clear();
+	resetAorFilter();
 	LOGD("Disconnected %p...", c);
 	if (status != REDIS_OK) {
 		LOGE("Redis disconnection message: %s", c->errstr);
-		tryReconnect();
+		scheduleReconnect();
 		return;
 	}
 }
@@ -120,10 +392,40 @@ void RegistrarDbRedisAsync::onSubscribeConnect(const redisAsyncContext *c, int s
 	if (status != REDIS_OK) {
 		LOGE("Couldn't connect to redis: %s", c->errstr);
 		mSubscribeContext = NULL;
-		tryReconnect();
+		scheduleReconnect();
 		return;
 	}
 	LOGD("Connected... %p", c);
+	if (mSubscriptionChannels > 0) {
+		for (int i = 0; i < mSubscriptionChannels; ++i) {
+			string channel = sTopicChannelPrefix + to_string(i);
+			redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", channel.c_str());
+		}
+		return;
+	}
+	// the topics subscribed before the connection, or before a reconnection
+	for (auto it = mContactListenersMap.begin(); it != mContactListenersMap.end(); ++it) {
+		redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", it->first.c_str());
+	}
+}
+
+/* The callbacks of hiredis wait in a list, one per command sent and not answered yet. */
+static size_t countReplies(const redisAsyncContext *context) {
+	size_t count = 0;
+	if (context) {
+		for (const redisCallback *cb = context->replies.head; cb != NULL; cb = cb->next)
+			++count;
+	}
+	return count;
+}
+
+size_t RegistrarDbRedisAsync::countPendingCommands() {
+	size_t count = countReplies(mContext) + mPendingCommands.size();
+	for (auto it = mClusterNodes.begin(); it != mClusterNodes.end(); ++it)
+		count += countReplies(it->context);
+	for (auto it = mReplicas.begin(); it != mReplicas.end(); ++it)
+		count += countReplies(it->context);
+	return count;
 }
 
 bool RegistrarDbRedisAsync::isConnected() {
@@ -142,6 +444,7 @@ bool RegistrarDbRedisAsync::handleRedisStatus(const std::string &desc, int redis
 		}
 		return FALSE;
 	}
+	onCommandQueued();
 	return TRUE;
 }
 
@@ -152,6 +455,66 @@ bool RegistrarDbRedisAsync::handleRedisStatus(const std::string &desc, int redis
 		}                                                                                                              \
 	} while (0)
 
+/* Fails the operation of data, the master of its record being unreachable. */
+void RegistrarDbRedisAsync::onErrorData(RegistrarUserData *data) {
+	LOGE("No connection to the redis master of fs:%s [%lu]", data->record.getKey().c_str(), data->token);
+	if (data->listener) data->listener->onError();
+	delete data;
+}
+
+/* When a batch window is configured, the output of the main context is held back after the first command is queued
+ * and released either when the window expires or when enough commands are pending, so that bursts of commands
+ * issued over several event-loop iterations end up in a single pipelined write. Without a window, hiredis already
+ * pipelines the commands queued within the same iteration. */
+void RegistrarDbRedisAsync::onCommandQueued() {
+	if (mBatchWindow <= 0 || mContext == NULL)
+		return;
+	if (mBatchPending++ == 0) {
+		holdWrites(1);
+		if (mBatchTimer == NULL) {
+			mBatchTimer = su_timer_create(su_root_task(mRoot), mBatchWindow);
+		}
+		su_timer_set(mBatchTimer, (su_timer_f)sHandleBatchTimer, this);
+	}
+	if (mBatchMaxSize > 0 && mBatchPending >= mBatchMaxSize) {
+		flushBatch(true);
+	}
+}
+
+void RegistrarDbRedisAsync::flushBatch(bool full) {
+	if (mBatchPending == 0)
+		return;
+	if (mBatchTimer) su_timer_reset(mBatchTimer);
+	holdWrites(0);
+	if (mCountBatches) {
+		++(*mCountBatches);
+		mCountBatchedCommands->set(mCountBatchedCommands->read() + mBatchPending);
+		if (full) ++(*mCountBatchesFull);
+	}
+	mBatchPending = 0;
+}
+
+/* The fetches of a fetch list are complete, there is no point in waiting for the end of the window. */
+void RegistrarDbRedisAsync::flushFetches() {
+	flushBatch(false);
+}
+
+/* In cluster mode, the commands of a batch are spread over the connections to the nodes. */
+void RegistrarDbRedisAsync::holdWrites(int hold) {
+	if (mContext) redisSofiaHoldWrite(mContext, hold);
+	for (auto it = mClusterNodes.begin(); it != mClusterNodes.end(); ++it) {
+		if (it->context) redisSofiaHoldWrite(it->context, hold);
+	}
+	for (auto it = mReplicas.begin(); it != mReplicas.end(); ++it) {
+		if (it->context) redisSofiaHoldWrite(it->context, hold);
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleBatchTimer(void *unused, su_timer_t *t, void *data) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
+	zis->flushBatch(false);
+}
+
 static bool is_end_line_character(char c) {
 	return c == '\r' || c == '\n';
 }
@@ -215,7 +578,8 @@ RedisHost RedisHost::parseSlave(const string &slave, int id) {
 		auto m = parseKeyValue(slave, ',', '=');
 
 		if (m.find("ip") != m.end() && m.find("port") != m.end() && m.find("state") != m.end()) {
-			return RedisHost(id, m.at("ip"), atoi(m.at("port").c_str()), m.at("state"));
+			int lag = m.find("lag") != m.end() ? atoi(m.at("lag").c_str()) : 0;
+			return RedisHost(id, m.at("ip"), atoi(m.at("port").c_str()), m.at("state"), lag);
 		} else {
 			SLOGW << "Missing fields in the slaveline " << slave;
 		}
@@ -257,11 +621,121 @@ void RegistrarDbRedisAsync::updateSlavesList(const map<string, string> redisRepl
 	// replace the slaves array
 	mSlaves.clear();
 	mSlaves = newSlaves;
+	updateReplicas();
+}
+
+/* The replicas follow the slaves reported by the master, keeping the connections to the ones still reported. */
+void RegistrarDbRedisAsync::updateReplicas() {
+	if (!mReplicaReads)
+		return;
+	vector<RedisReplica> replicas;
+	for (const auto &host : mSlaves) {
+		RedisReplica replica(host);
+		for (auto &previous : mReplicas) {
+			if (previous.context && previous.host.address == host.address && previous.host.port == host.port) {
+				replica.context = previous.context;
+				previous.context = NULL;
+				break;
+			}
+		}
+		replicas.push_back(replica);
+	}
+	mReplicas.swap(replicas);
+	for (auto &previous : replicas) {
+		if (previous.context) {
+			LOGD("Replica %s:%d is not a slave anymore", previous.host.address.c_str(), previous.host.port);
+			redisAsyncDisconnect(previous.context);
+		}
+	}
+
+	// the keys written before the lag tolerance are read from the replicas again
+	time_t now = getCurrentTime();
+	for (auto it = mRecentWrites.begin(); it != mRecentWrites.end();) {
+		if (it->second <= now) {
+			it = mRecentWrites.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+/* Fetches are spread over the replicas which are online and not lagging, except for the keys written recently by this
+ * proxy, which are read from the master so that a fetch following a bind sees it. NULL when the master must be used.
+ */
+redisAsyncContext *RegistrarDbRedisAsync::replicaContextForKey(const string &key) {
+	if (!mReplicaReads || mReplicas.empty())
+		return NULL;
+	auto write = mRecentWrites.find(key);
+	if (write != mRecentWrites.end()) {
+		if (write->second > getCurrentTime())
+			return NULL;
+		mRecentWrites.erase(write);
+	}
+	for (size_t i = 0; i < mReplicas.size(); ++i) {
+		RedisReplica &replica = mReplicas[mNextReplica++ % mReplicas.size()];
+		if (replica.host.state != "online" || (mReplicaMaxLag > 0 && replica.host.lag > mReplicaMaxLag))
+			continue;
+		redisAsyncContext *context = connectReplica(replica);
+		if (context)
+			return context;
+	}
+	return NULL;
+}
+
+redisAsyncContext *RegistrarDbRedisAsync::connectReplica(RedisReplica &replica) {
+	if (replica.context)
+		return replica.context;
+
+	LOGD("Connecting to redis replica %s:%d", replica.host.address.c_str(), replica.host.port);
+	redisAsyncContext *context = redisAsyncConnect(replica.host.address.c_str(), replica.host.port);
+	if (context->err) {
+		SLOGE << "Redis Connection error to replica " << replica.host.address << ":" << replica.host.port << ": "
+			  << context->errstr;
+		redisAsyncFree(context);
+		return NULL;
+	}
+	context->data = this;
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+	redisAsyncSetConnectCallback(context, sReplicaConnectCallback);
+#endif
+	redisAsyncSetDisconnectCallback(context, sReplicaDisconnectCallback);
+	if (REDIS_OK != redisSofiaAttach(context, mRoot)) {
+		LOGE("Redis Connection error - %p", context);
+		redisAsyncDisconnect(context);
+		return NULL;
+	}
+	if (mBatchPending > 0) redisSofiaHoldWrite(context, 1);
+	if (!mAuthPassword.empty()) {
+		redisAsyncCommand(context, NULL, NULL, "AUTH %s", mAuthPassword.c_str());
+	}
+	replica.context = context;
+	return context;
+}
+
+void RegistrarDbRedisAsync::onReplicaDisconnect(const redisAsyncContext *c, int status) {
+	for (auto it = mReplicas.begin(); it != mReplicas.end(); ++it) {
+		if (it->context == c) {
+			it->context = NULL;
+			LOGD("Disconnected from redis replica %s:%d", it->host.address.c_str(), it->host.port);
+		}
+	}
+	if (status != REDIS_OK) {
+		// connected again by the next fetch routed to it, if the master still reports it
+		LOGE("Redis replica disconnection message: %s", c->errstr);
+	}
+}
+
+void RegistrarDbRedisAsync::noteLocalWrite(const string &key) {
+	if (!mReplicaReads)
+		return;
+	mRecentWrites[key] = getCurrentTime() + mReplicaMaxLag + 1;
 }
 
 void RegistrarDbRedisAsync::tryReconnect() {
+	if (isConnected())
+		return;
 	size_t slaveCount = mSlaves.size();
-	if (slaveCount > 0 && !isConnected()) {
+	if (slaveCount > 0) {
 		// we are disconnected, but we can try one of the previously determined slaves
 		mCurSlave++;
 		mCurSlave = mCurSlave % slaveCount;
@@ -272,11 +746,129 @@ void RegistrarDbRedisAsync::tryReconnect() {
 
 		mDomain = host.address;
 		mPort = host.port;
+	} else {
+		LOGW("Connection lost to %s:%d, no slave to try, reconnecting to it", mDomain.c_str(), mPort);
+	}
+	if (!connect())
+		scheduleReconnect();
+}
+
+/* The attempts to reconnect are spaced by a delay doubled after each failure, from redis-reconnect-min-delay up to
+ * redis-reconnect-max-delay. Each delay is randomized between half of it and all of it, so that the proxies which
+ * lost the same server do not all reconnect in the same instant. */
+void RegistrarDbRedisAsync::scheduleReconnect() {
+	if (mReconnectPending)
+		return;
+	long long delay = (long long)mReconnectMinDelay << min(mReconnectAttempts, 20);
+	delay = min(delay, (long long)mReconnectMaxDelay);
+	delay = delay / 2 + su_randint(0, (int)(delay / 2));
+	mReconnectAttempts++;
+	if (mReconnectTimer == NULL)
+		mReconnectTimer = su_timer_create(su_root_task(mRoot), 0);
+	mReconnectPending = true;
+	LOGD("Reconnecting to redis in %lldms", delay);
+	su_timer_set_interval(mReconnectTimer, (su_timer_f)sHandleReconnectTimer, this, (su_duration_t)delay);
+}
+
+void RegistrarDbRedisAsync::sHandleReconnectTimer(void *unused, su_timer_t *t, void *data) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
+	zis->mReconnectPending = false;
+	if (zis->mCountReconnections) ++(*zis->mCountReconnections);
+	zis->tryReconnect();
+}
 
-		connect();
+/* Whether commands can be sent now, connecting if needed, but not before the scheduled reconnection. */
+bool RegistrarDbRedisAsync::ensureConnected() {
+	return isConnected() || (!mReconnectPending && connect());
+}
+
+/* Keeps the command of data until the connection is back, or fails it at once when redis-outage-buffer-size commands
+ * are already waiting or when the outage already lasts longer than redis-outage-buffer-timeout: a long outage then
+ * costs an immediate error rather than a wait for nothing. */
+void RegistrarDbRedisAsync::bufferCommand(RegistrarUserData *data, SendFn send) {
+	auto now = chrono::steady_clock::now();
+	auto timeout = chrono::milliseconds(mOutageBufferTimeout);
+	if (!mInOutage) {
+		mInOutage = true;
+		mOutageStart = now;
+	}
+	if (mPendingCommands.size() >= mOutageBufferSize || now - mOutageStart >= timeout) {
+		LOGE("Not connected to redis server");
+		if (mCountOutageFailed) ++(*mCountOutageFailed);
+		if (data->listener) data->listener->onError();
+		delete data;
 	} else {
-		LOGW("No slave to try, giving up.");
+		LOGD("Not connected to redis server, keeping fs:%s [%lu] until reconnected", data->record.getKey().c_str(),
+			 data->token);
+		mPendingCommands.push_back(PendingCommand{data, send, now + timeout});
+		if (mCountOutageBuffered) ++(*mCountOutageBuffered);
+		if (mPendingCommands.size() == 1) {
+			if (mPendingTimer == NULL)
+				mPendingTimer = su_timer_create(su_root_task(mRoot), 0);
+			su_timer_set_interval(mPendingTimer, (su_timer_f)sHandlePendingTimer, this,
+								  (su_duration_t)mOutageBufferTimeout);
+		}
+	}
+	if (mContext == NULL)
+		scheduleReconnect();
+}
+
+/* A command whose reply is NULL was lost with its connection. When this is the main connection, the command is kept
+ * to be sent again once reconnected, a bounded number of times. Returns false when the command is left to the
+ * handling of its error. */
+bool RegistrarDbRedisAsync::holdLostCommand(const redisAsyncContext *ac, RegistrarUserData *data, SendFn send) {
+	if (mContext != NULL && ac != mContext)
+		return false;
+	if (data->mReplayCount >= sMaxReplays) {
+		LOGE("Connection to redis lost again for fs:%s [%lu], giving up", data->record.getKey().c_str(), data->token);
+		if (mCountOutageFailed) ++(*mCountOutageFailed);
+		if (data->listener) data->listener->onError();
+		delete data;
+		return true;
+	}
+	data->mReplayCount++;
+	data->mRetryCount = 0;
+	data->mAskNode = -1;
+	bufferCommand(data, send);
+	return true;
+}
+
+void RegistrarDbRedisAsync::replayPendingCommands() {
+	mInOutage = false;
+	mReconnectAttempts = 0;
+	if (mPendingTimer)
+		su_timer_reset(mPendingTimer);
+	if (mPendingCommands.empty())
+		return;
+	deque<PendingCommand> pending;
+	pending.swap(mPendingCommands);
+	LOGI("Reconnected to redis, sending %zu commands kept during the outage", pending.size());
+	for (auto &command : pending) {
+		if (mCountOutageReplayed) ++(*mCountOutageReplayed);
+		(this->*command.send)(command.data);
+	}
+}
+
+/* Fails the commands which waited too long, or all of them. */
+void RegistrarDbRedisAsync::expirePendingCommands(bool all) {
+	auto now = chrono::steady_clock::now();
+	while (!mPendingCommands.empty() && (all || mPendingCommands.front().deadline <= now)) {
+		RegistrarUserData *data = mPendingCommands.front().data;
+		mPendingCommands.pop_front();
+		LOGE("Redis still not reconnected, failing fs:%s [%lu]", data->record.getKey().c_str(), data->token);
+		if (mCountOutageFailed) ++(*mCountOutageFailed);
+		if (data->listener) data->listener->onError();
+		delete data;
 	}
+	if (!mPendingCommands.empty() && mPendingTimer) {
+		auto left = chrono::duration_cast<chrono::milliseconds>(mPendingCommands.front().deadline - now).count();
+		su_timer_set_interval(mPendingTimer, (su_timer_f)sHandlePendingTimer, this,
+							  (su_duration_t)max(1LL, (long long)left));
+	}
+}
+
+void RegistrarDbRedisAsync::sHandlePendingTimer(void *unused, su_timer_t *t, void *data) {
+	((RegistrarDbRedisAsync *)data)->expirePendingCommands(false);
 }
 
 /* This callback is called when the Redis instance answered our "INFO replication" message.
@@ -334,8 +926,46 @@ void RegistrarDbRedisAsync::handleAuthReply(const redisReply *reply) {
 	}
 }
 
+/* The keys of the records are tracked for mContext, which does the writes, and their invalidations redirected to the
+ * subscription connection whose id is replied. NOLOOP leaves out the writes of mContext, invalidated locally. */
+void RegistrarDbRedisAsync::handleClientIdReply(const redisAsyncContext *ac, const redisReply *reply) {
+	if (ac != mSubscribeContext || !mContext) return;
+	if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+		LOGE("Couldn't get the id of the redis subscription connection, client tracking requires redis 6: %s",
+			 reply && reply->type == REDIS_REPLY_ERROR ? reply->str : "no reply");
+		return;
+	}
+	redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", sInvalidateChannel);
+	redisAsyncCommand(mContext, sHandleClientTrackingReply, this,
+					  "CLIENT TRACKING on REDIRECT %lld BCAST PREFIX fs: NOLOOP", reply->integer);
+	onCommandQueued();
+}
+
+void RegistrarDbRedisAsync::handleInvalidation(const redisReply *keys) {
+	if (!mClientTracking) return;
+	if (keys->type != REDIS_REPLY_ARRAY) {
+		LOGD("Redis database flushed, clearing the fetch cache");
+		mRecordCache->clear();
+		return;
+	}
+	for (size_t i = 0; i < keys->elements; ++i) {
+		const redisReply *element = keys->element[i];
+		if (element->type != REDIS_REPLY_STRING || strncmp(element->str, "fs:", 3) != 0) continue;
+		string key(element->str + 3);
+		LOGD("Record %s invalidated by redis", key.c_str());
+		mRecordCache->invalidate(key);
+		addToAorFilter(key);
+		notifyRecordChanged(key);
+	}
+}
+
 void RegistrarDbRedisAsync::getReplicationInfo() {
-	redisAsyncCommand(mContext, sHandleReplicationInfoReply, this, "INFO replication");
+	if (mCluster) {
+		// The cluster handles the failover of its masters, we only have to follow the slot assignments
+		refreshClusterSlots();
+	} else {
+		redisAsyncCommand(mContext, sHandleReplicationInfoReply, this, "INFO replication");
+	}
 	// Workaround for issue https://github.com/redis/hiredis/issues/396
 	redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", "FLEXISIP");
 }
@@ -388,15 +1018,31 @@ bool RegistrarDbRedisAsync::connect() {
 	if (!mAuthPassword.empty()) {
 		redisAsyncCommand(mContext, shandleAuthReply, this, "AUTH %s", mAuthPassword.c_str());
 		redisAsyncCommand(mSubscribeContext, shandleAuthReply, this, "AUTH %s", mAuthPassword.c_str());
-	} else {
+	}
+	if (mClientTracking) {
+		// before the first SUBSCRIBE, after which the connection only accepts the pub/sub commands
+		redisAsyncCommand(mSubscribeContext, sHandleClientIdReply, this, "CLIENT ID");
+	}
+	if (mAuthPassword.empty()) {
 		getReplicationInfo();
 	}
+	if (mRecordCache) mRecordCache->clear();
+	resetAorFilter();
+	if (mRecordCache || mAorFilterSize > 0) {
+		redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", sRecordUpdatedChannel);
+	}
+	loadBindScript(mContext, true);
+#ifdef WITHOUT_HIREDIS_CONNECT_CALLBACK
+	// queued on the context until it is connected
+	replayPendingCommands();
+#endif
 	return true;
 }
 
 bool RegistrarDbRedisAsync::disconnect() {
 	LOGD("disconnect(%p)", mContext);
 	bool status = false;
+	flushBatch(false);
 	if (mContext) {
 		redisAsyncDisconnect(mContext);
 		mContext = NULL;
@@ -408,118 +1054,677 @@ bool RegistrarDbRedisAsync::disconnect() {
 		redisAsyncDisconnect(mSubscribeContext);
 		mSubscribeContext = NULL;
 	}
+	for (auto it = mClusterNodes.begin(); it != mClusterNodes.end(); ++it) {
+		if (it->context) {
+			redisAsyncDisconnect(it->context);
+			it->context = NULL;
+		}
+	}
+	for (auto it = mReplicas.begin(); it != mReplicas.end(); ++it) {
+		if (it->context) {
+			redisAsyncDisconnect(it->context);
+			it->context = NULL;
+		}
+	}
 	return status;
 }
 
 void RegistrarDbRedisAsync::subscribe(const std::string &topic, const std::shared_ptr<ContactRegisteredListener> &listener) {
 	RegistrarDb::subscribe(topic, listener);
-	redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", topic.c_str());
+	// otherwise subscribed once connected, the shared channels being subscribed for good
+	if (mSubscribeContext && mSubscriptionChannels == 0)
+		redisAsyncCommand(mSubscribeContext, sPublishCallback, NULL, "SUBSCRIBE %s", topic.c_str());
 }
 void RegistrarDbRedisAsync::unsubscribe(const std::string &topic) {
 	RegistrarDb::unsubscribe(topic);
-	redisAsyncCommand(mSubscribeContext, NULL, NULL, "UNSUBSCRIBE %s", topic.c_str());
+	if (mSubscribeContext && mSubscriptionChannels == 0)
+		redisAsyncCommand(mSubscribeContext, NULL, NULL, "UNSUBSCRIBE %s", topic.c_str());
 }
 void RegistrarDbRedisAsync::publish(const std::string &topic, const std::string &uid) {
 	LOGD("Publish topic = %s, uid = %s", topic.c_str(), uid.c_str());
-	redisAsyncCommand(mContext, NULL, NULL, "PUBLISH %s %s", topic.c_str(), uid.c_str());
-}
-
-/* Static functions that are used as callbacks to redisAsync API */
+	if (mSubscriptionChannels > 0) {
+		string message = topic + " " + uid;
+		redisAsyncCommand(mContext, NULL, NULL, "PUBLISH %s %s", topicChannel(topic).c_str(), message.c_str());
+	} else {
+		redisAsyncCommand(mContext, NULL, NULL, "PUBLISH %s %s", topic.c_str(), uid.c_str());
+	}
+	onCommandQueued();
 
-#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
-void RegistrarDbRedisAsync::sConnectCallback(const redisAsyncContext *c, int status) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
-	if (zis) {
-		zis->onConnect(c, status);
+	// a listener of this proxy, such as a fork waiting for the device woken up by a push notification, gets the
+	// registration without the round trip to redis
+	if (mContactListenersMap.find(topic) == mContactListenersMap.end())
+		return;
+	time_t now = getCurrentTime();
+	if (mLocalPublications.size() > 1000) {
+		for (auto it = mLocalPublications.begin(); it != mLocalPublications.end();) {
+			if (now - it->second.second > sLocalPublicationTtl)
+				it = mLocalPublications.erase(it);
+			else
+				++it;
+		}
 	}
+	auto &published = mLocalPublications[topic + " " + uid];
+	if (now - published.second > sLocalPublicationTtl)
+		published.first = 0;
+	++published.first;
+	published.second = now;
+	notifyContactListener(topic, uid);
 }
 
-void RegistrarDbRedisAsync::sSubscribeConnectCallback(const redisAsyncContext *c, int status) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
-	if (zis) {
-		zis->onSubscribeConnect(c, status);
+void RegistrarDbRedisAsync::notifyPublished(const std::string &topic, const std::string &uid) {
+	auto it = mLocalPublications.find(topic + " " + uid);
+	if (it != mLocalPublications.end()) {
+		bool awaited = getCurrentTime() - it->second.second <= sLocalPublicationTtl;
+		if (!awaited || --it->second.first <= 0)
+			mLocalPublications.erase(it);
+		if (awaited) {
+			LOGD("Publication of topic = %s, uid = %s already delivered locally", topic.c_str(), uid.c_str());
+			return;
+		}
 	}
+	notifyContactListener(topic, uid);
 }
-#endif
 
-void RegistrarDbRedisAsync::sDisconnectCallback(const redisAsyncContext *c, int status) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
-	if (zis) {
-		zis->onDisconnect(c, status);
+/* FNV-1a, for the channel of a topic or the shard of a record to be the same on all the proxies whatever their
+ * build. */
+static uint32_t fnv1aHash(const string &value) {
+	uint32_t hash = 2166136261u;
+	for (unsigned char c : value) {
+		hash ^= c;
+		hash *= 16777619u;
 	}
+	return hash;
 }
 
-void RegistrarDbRedisAsync::sSubscribeDisconnectCallback(const redisAsyncContext *c, int status) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
-	if (zis) {
-		zis->onSubscribeDisconnect(c, status);
+string RegistrarDbRedisAsync::topicChannel(const string &topic) const {
+	return sTopicChannelPrefix + to_string(fnv1aHash(topic) % (uint32_t)mSubscriptionChannels);
+}
+struct RedisCommandData {
+	RegistrarDbRedisAsync *self;
+	RegistrarDbRedisAsync::ReplyCallback callback;
+};
+
+void RegistrarDbRedisAsync::sendCommand(const string &redisKey, const ReplyCallback &callback, const char *format,
+										...) {
+	redisAsyncContext *context = contextForKey(redisKey);
+	if (!context) {
+		callback(NULL);
+		return;
 	}
+	RedisCommandData *data = new RedisCommandData{this, callback};
+	va_list args;
+	va_start(args, format);
+	int status = redisvAsyncCommand(context, sHandleCommandReply, data, format, args);
+	va_end(args);
+	if (status != REDIS_OK) {
+		LOGE("Redis error for command on %s: %d", redisKey.c_str(), status);
+		delete data;
+		callback(NULL);
+		return;
+	}
+	onCommandQueued();
 }
 
-void RegistrarDbRedisAsync::sPublishCallback(redisAsyncContext *c, void *r, void *privdata) {
+void RegistrarDbRedisAsync::sHandleCommandReply(redisAsyncContext *c, void *r, void *privdata) {
+	RedisCommandData *data = (RedisCommandData *)privdata;
 	redisReply *reply = (redisReply *)r;
-	if (reply == NULL) return;
-
-	if (reply->type == REDIS_REPLY_ARRAY) {
-		LOGD("Publish array received: [%s, %s, %s/%i]", reply->element[0]->str, reply->element[1]->str, reply->element[2]->str, (int)reply->element[2]->integer);
-		if (reply->element[2]->str != NULL) {
-			RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
-			if (zis) {
-				zis->notifyContactListener(reply->element[1]->str, reply->element[2]->str);
-			}
-		}
+	if (reply && reply->type == REDIS_REPLY_ERROR && reply->str &&
+		(strncmp(reply->str, "MOVED ", 6) == 0 || strncmp(reply->str, "ASK ", 4) == 0)) {
+		// the next commands about the key will go to the right node
+		data->self->refreshClusterSlots();
 	}
+	data->callback(reply);
+	delete data;
 }
 
-void RegistrarDbRedisAsync::sHandleBind(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
-	data->self->handleBind(reply, data);
+/* Drops the local copy of a record and tell the other proxies to do the same. The PUBLISH is queued on the context
+ * of the command modifying the record, after it, so it is delivered once the modification is effective. In a cluster,
+ * messages published on any node are forwarded to the subscribers of all the nodes. */
+void RegistrarDbRedisAsync::notifyRecordUpdated(const string &key) {
+	if (!mRecordCache && mAorFilterSize == 0)
+		return;
+	if (mRecordCache) mRecordCache->invalidate(key);
+	addToAorFilter(key);
+	if (mSharded) {
+		// The other proxies only listen to the main server: publish there once the shard replied to the commands
+		// queued before this PING, so that the notification still follows the modification.
+		sendCommand("fs:" + key,
+					[this, key](redisReply *) {
+						if (mContext) {
+							redisAsyncCommand(mContext, NULL, NULL, "PUBLISH %s %s", sRecordUpdatedChannel,
+											  key.c_str());
+							onCommandQueued();
+						}
+					},
+					"PING");
+		return;
+	}
+	redisAsyncCommand(contextForKey("fs:" + key), NULL, NULL, "PUBLISH %s %s", sRecordUpdatedChannel, key.c_str());
+	onCommandQueued();
 }
 
-void RegistrarDbRedisAsync::sHandleClear(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
-	data->self->handleClear(reply, data);
-}
+/******
+ * Sharding over independent masters
+ */
 
-void RegistrarDbRedisAsync::sHandleFetch(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
-	data->self->handleFetch(reply, data);
+/* Number of points of each master on the ring, enough for the records to be spread evenly. */
+static const int sShardPoints = 160;
+
+/* The FNV-1a hashes of close strings are close too: mix them (murmur3 finalizer) to spread the points. */
+static uint32_t shardHash(const string &value) {
+	uint32_t hash = fnv1aHash(value);
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
 }
 
-void RegistrarDbRedisAsync::sHandleMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
-	data->self->handleMigration(reply, data);
+void RedisShardRing::addShard(int node, const string &name) {
+	for (int i = 0; i < sShardPoints; ++i) {
+		mPoints.push_back(make_pair(shardHash(name + "#" + to_string(i)), node));
+	}
+	sort(mPoints.begin(), mPoints.end());
 }
 
-void RegistrarDbRedisAsync::sHandleRecordMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
-	data->self->handleRecordMigration(reply, data);
+void RedisShardRing::setDomainShard(const string &domain, int node) {
+	mDomainShards[domain] = node;
 }
 
-void RegistrarDbRedisAsync::sHandleReplicationInfoReply(redisAsyncContext *ac, void *r, void *privdata) {
-	redisReply *reply = (redisReply *)r;
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+int RedisShardRing::shardForAor(const string &aor) const {
+	if (mPoints.empty())
+		return -1;
+	if (!mDomainShards.empty()) {
+		// the key of the record of a domain is the domain itself
+		size_t at = aor.rfind('@');
+		auto it = mDomainShards.find(at == string::npos ? aor : aor.substr(at + 1));
+		if (it != mDomainShards.end())
+			return it->second;
+	}
+	auto point = upper_bound(mPoints.begin(), mPoints.end(), make_pair(shardHash(aor), INT_MAX));
+	return point != mPoints.end() ? point->second : mPoints.front().second;
+}
 
-	if (!reply || reply->type == REDIS_REPLY_ERROR) {
-		LOGE("Couldn't issue the INFO command, will try later");
+/* Each shard is an independent master, possibly with its own slaves, whose address must stay the one of the current
+ * master (virtual address, proxy...): only the main server is followed through its replication info. */
+void RegistrarDbRedisAsync::setupShards(const RedisParameters &params) {
+	if (params.mShards.empty())
 		return;
-	} else if (reply->str && zis) {
-		zis->handleReplicationInfoReply(reply->str);
+	if (mCluster) {
+		LOGW("redis-shards is ignored with a redis cluster, which shards the records itself");
+		return;
+	}
+	for (const auto &shard : params.mShards) {
+		size_t colon = shard.rfind(':');
+		int port = colon != string::npos ? atoi(shard.c_str() + colon + 1) : 0;
+		if (colon == string::npos || colon == 0 || port <= 0) {
+			LOGF("Invalid redis shard '%s', expected host:port", shard.c_str());
+		}
+		size_t nodes = mClusterNodes.size();
+		int node = findClusterNode(shard.substr(0, colon), port);
+		// listed twice, its points are already on the ring
+		if (mClusterNodes.size() != nodes) mShardRing.addShard(node, shard);
+	}
+	for (const auto &entry : params.mShardDomains) {
+		size_t equal = entry.find('=');
+		size_t colon = entry.rfind(':');
+		if (equal == string::npos || colon == string::npos || colon < equal) {
+			LOGF("Invalid redis shard domain '%s', expected domain=host:port", entry.c_str());
+		}
+		string address = entry.substr(equal + 1, colon - equal - 1);
+		int port = atoi(entry.c_str() + colon + 1);
+		size_t nodes = mClusterNodes.size();
+		int node = findClusterNode(address, port);
+		if (mClusterNodes.size() != nodes) {
+			LOGF("Redis shard domain '%s' designates a server which is not listed in redis-shards", entry.c_str());
+		}
+		mShardRing.setDomainShard(entry.substr(0, equal), node);
+	}
+	mSharded = true;
+	LOGI("Records sharded over %zu independent redis masters, %zu domains pinned", mClusterNodes.size(),
+		 params.mShardDomains.size());
+	if (mReplicaReads) {
+		LOGW("Replica reads are not supported with redis-shards, fetches are sent to the masters");
+		mReplicaReads = false;
 	}
 }
 
-/* this callback is called periodically to check if the current REDIS connection is valid */
-void RegistrarDbRedisAsync::sHandleInfoTimer(void *unused, su_timer_t *t, void *data) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
-	if (zis && zis->mContext) {
-		SLOGI << "Launching periodic INFO query on REDIS";
-		zis->getReplicationInfo();
+/* The tracking is only set up with the main server, which is the one receiving all the writes when there is neither
+ * cluster nor shards. */
+void RegistrarDbRedisAsync::setupClientTracking(const RedisParameters &params) {
+	mClientTracking = params.mClientTracking;
+	if (mClientTracking && !mRecordCache) {
+		LOGW("redis-client-tracking is ignored: the fetch cache is disabled");
+		mClientTracking = false;
+	} else if (mClientTracking && (mCluster || mSharded)) {
+		LOGW("redis-client-tracking is not supported with a redis cluster or shards, ignored");
+		mClientTracking = false;
 	}
 }
 
-void RegistrarDbRedisAsync::shandleAuthReply(redisAsyncContext *ac, void *r, void *privdata) {
-	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
-	if (zis) {
+/******
+ * Redis cluster
+ */
+
+/* Maximum number of MOVED or ASK redirections followed by a single operation. */
+static const int sMaxClusterRedirections = 5;
+
+/* CRC16 (XMODEM) as used by redis cluster to compute the slot of a key. */
+static uint16_t clusterCrc16(const char *buf, size_t len) {
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; ++i) {
+		crc ^= (uint16_t)((unsigned char)buf[i]) << 8;
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+/* Only the part between the first '{' and the next '}' is hashed when it is not empty (hash tag). */
+static int clusterKeySlot(const string &key) {
+	size_t start = key.find('{');
+	if (start != string::npos) {
+		size_t end = key.find('}', start + 1);
+		if (end != string::npos && end != start + 1) {
+			return clusterCrc16(key.c_str() + start + 1, end - start - 1) & (sClusterSlots - 1);
+		}
+	}
+	return clusterCrc16(key.c_str(), key.size()) & (sClusterSlots - 1);
+}
+
+/* In sharded mode, NULL when the master of the key cannot be connected: the command must not go anywhere else. */
+redisAsyncContext *RegistrarDbRedisAsync::contextForKey(const string &redisKey) {
+	if (mSharded) {
+		// "fs:" and "aor:" keys of the same record go to the same master
+		size_t colon = redisKey.find(':');
+		int node = mShardRing.shardForAor(colon != string::npos ? redisKey.substr(colon + 1) : redisKey);
+		return connectClusterNode(node);
+	}
+	if (!mCluster)
+		return mContext;
+	int node = mClusterSlots[clusterKeySlot(redisKey)];
+	redisAsyncContext *context = node >= 0 ? connectClusterNode(node) : NULL;
+	// Until the slots are known, the seed node answers with a redirection
+	return context ? context : mContext;
+}
+
+/* Context to which the next command about the record of data must be sent, taking a pending ASK redirection into
+ * account. */
+redisAsyncContext *RegistrarDbRedisAsync::contextForData(RegistrarUserData *data) {
+	if (data->mAskNode >= 0) {
+		redisAsyncContext *context = connectClusterNode(data->mAskNode);
+		data->mAskNode = -1;
+		if (context) {
+			redisAsyncCommand(context, NULL, NULL, "ASKING");
+			return context;
+		}
+	}
+	return contextForKey("fs:" + data->record.getKey());
+}
+
+int RegistrarDbRedisAsync::findClusterNode(const string &address, int port) {
+	for (size_t i = 0; i < mClusterNodes.size(); ++i) {
+		if (mClusterNodes[i].address == address && mClusterNodes[i].port == port)
+			return i;
+	}
+	mClusterNodes.push_back(RedisClusterNode(address, port));
+	return mClusterNodes.size() - 1;
+}
+
+redisAsyncContext *RegistrarDbRedisAsync::connectClusterNode(int index) {
+	RedisClusterNode &node = mClusterNodes[index];
+	if (node.context)
+		return node.context;
+
+	LOGD("Connecting to redis cluster node %s:%d", node.address.c_str(), node.port);
+	redisAsyncContext *context = redisAsyncConnect(node.address.c_str(), node.port);
+	if (context->err) {
+		SLOGE << "Redis Connection error to cluster node " << node.address << ":" << node.port << ": "
+			  << context->errstr;
+		redisAsyncFree(context);
+		return NULL;
+	}
+	context->data = this;
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+	redisAsyncSetConnectCallback(context, sClusterNodeConnectCallback);
+#endif
+	redisAsyncSetDisconnectCallback(context, sClusterNodeDisconnectCallback);
+	if (REDIS_OK != redisSofiaAttach(context, mRoot)) {
+		LOGE("Redis Connection error - %p", context);
+		redisAsyncDisconnect(context);
+		return NULL;
+	}
+	if (mBatchPending > 0) redisSofiaHoldWrite(context, 1);
+	if (!mAuthPassword.empty()) {
+		redisAsyncCommand(context, NULL, NULL, "AUTH %s", mAuthPassword.c_str());
+	}
+	loadBindScript(context, false);
+	node.context = context;
+	return context;
+}
+
+void RegistrarDbRedisAsync::refreshClusterSlots() {
+	if (!mCluster || !mContext || mClusterSlotsPending)
+		return;
+	mClusterSlotsPending = true;
+	redisAsyncCommand(mContext, sHandleClusterSlotsReply, this, "CLUSTER SLOTS");
+}
+
+/* Each element of the reply is [first slot, last slot, [master ip, master port, ...], replicas...]. */
+void RegistrarDbRedisAsync::handleClusterSlotsReply(redisReply *reply) {
+	mClusterSlotsPending = false;
+	if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+		LOGE("Couldn't issue the CLUSTER SLOTS command: %s, will try later",
+			 reply && reply->str ? reply->str : "null reply");
+		return;
+	}
+
+	vector<int> slots(sClusterSlots, -1);
+	for (size_t i = 0; i < reply->elements; ++i) {
+		redisReply *range = reply->element[i];
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 || range->element[2]->type != REDIS_REPLY_ARRAY ||
+			range->element[2]->elements < 2) {
+			LOGW("Invalid CLUSTER SLOTS entry %lu", (unsigned long)i);
+			continue;
+		}
+		redisReply *master = range->element[2];
+		// An empty address designates the node which answered
+		string address = master->element[0]->str && master->element[0]->len > 0 ? master->element[0]->str : mDomain;
+		int node = findClusterNode(address, (int)master->element[1]->integer);
+		long long first = range->element[0]->integer;
+		long long last = range->element[1]->integer;
+		for (long long slot = max(first, 0LL); slot <= last && slot < sClusterSlots; ++slot) {
+			slots[slot] = node;
+		}
+	}
+	mClusterSlots.swap(slots);
+	LOGD("Redis cluster: %lu slot ranges over %lu nodes", (unsigned long)reply->elements,
+		 (unsigned long)mClusterNodes.size());
+
+	if (mAgent && mReplicationTimer == NULL) {
+		SLOGD << "Creating cluster check timer with delay of " << mSlaveCheckTimeout << "s";
+		mReplicationTimer = mAgent->createTimer(mSlaveCheckTimeout * 1000, sHandleInfoTimer, this);
+	}
+}
+
+/* Follows a "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>" error. Returns true if the operation of data
+ * has to be sent again. */
+bool RegistrarDbRedisAsync::handleClusterRedirection(const char *error, RegistrarUserData *data) {
+	if (!mCluster || !error)
+		return false;
+	bool moved = strncmp(error, "MOVED ", 6) == 0;
+	bool ask = strncmp(error, "ASK ", 4) == 0;
+	if (!moved && !ask)
+		return false;
+
+	istringstream input(error);
+	string type, endpoint;
+	int slot = -1;
+	input >> type >> slot >> endpoint;
+	size_t colon = endpoint.rfind(':');
+	if (slot < 0 || slot >= sClusterSlots || colon == string::npos) {
+		LOGE("Invalid redis cluster redirection: %s", error);
+		return false;
+	}
+	if (data->mRetryCount >= sMaxClusterRedirections) {
+		LOGE("Too many redis cluster redirections for fs:%s, last one: %s", data->record.getKey().c_str(), error);
+		return false;
+	}
+	data->mRetryCount++;
+	if (mCountClusterRedirections) ++(*mCountClusterRedirections);
+
+	string address = endpoint.substr(0, colon);
+	int node = findClusterNode(address.empty() ? mDomain : address, atoi(endpoint.c_str() + colon + 1));
+	LOGD("Redis cluster redirection for fs:%s: %s", data->record.getKey().c_str(), error);
+	if (moved) {
+		// The slot was reassigned: learn the new owner right away, and the rest of the new layout from the cluster
+		mClusterSlots[slot] = node;
+		refreshClusterSlots();
+	} else {
+		// The slot is being migrated: only this attempt goes to the target node
+		data->mAskNode = node;
+	}
+	return true;
+}
+
+void RegistrarDbRedisAsync::onClusterNodeDisconnect(const redisAsyncContext *c, int status) {
+	for (auto it = mClusterNodes.begin(); it != mClusterNodes.end(); ++it) {
+		if (it->context == c) {
+			it->context = NULL;
+			LOGD("Disconnected from redis cluster node %s:%d", it->address.c_str(), it->port);
+		}
+	}
+	if (status != REDIS_OK) {
+		LOGE("Redis cluster node disconnection message: %s", c->errstr);
+		// The node may have failed over: the cluster knows its replacement
+		refreshClusterSlots();
+	}
+}
+
+/* Static functions that are used as callbacks to redisAsync API */
+
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+void RegistrarDbRedisAsync::sConnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onConnect(c, status);
+	}
+}
+
+void RegistrarDbRedisAsync::sSubscribeConnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onSubscribeConnect(c, status);
+	}
+}
+#endif
+
+void RegistrarDbRedisAsync::sDisconnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onDisconnect(c, status);
+	}
+}
+
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+void RegistrarDbRedisAsync::sClusterNodeConnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis && status != REDIS_OK) {
+		LOGE("Couldn't connect to redis cluster node: %s", c->errstr);
+		zis->onClusterNodeDisconnect(c, status);
+	}
+}
+#endif
+
+void RegistrarDbRedisAsync::sClusterNodeDisconnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onClusterNodeDisconnect(c, status);
+	}
+}
+
+#ifndef WITHOUT_HIREDIS_CONNECT_CALLBACK
+void RegistrarDbRedisAsync::sReplicaConnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis && status != REDIS_OK) {
+		LOGE("Couldn't connect to redis replica: %s", c->errstr);
+		zis->onReplicaDisconnect(c, status);
+	}
+}
+#endif
+
+void RegistrarDbRedisAsync::sReplicaDisconnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onReplicaDisconnect(c, status);
+	}
+}
+
+void RegistrarDbRedisAsync::sSubscribeDisconnectCallback(const redisAsyncContext *c, int status) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+	if (zis) {
+		zis->onSubscribeDisconnect(c, status);
+	}
+}
+
+void RegistrarDbRedisAsync::sPublishCallback(redisAsyncContext *c, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	if (reply == NULL) return;
+
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 && reply->element[1]->str != NULL &&
+		strcmp(reply->element[1]->str, sInvalidateChannel) == 0) {
+		RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+		// the confirmation of the SUBSCRIBE has the same channel
+		if (zis && strcmp(reply->element[0]->str, "message") == 0) zis->handleInvalidation(reply->element[2]);
+		return;
+	}
+	if (reply->type == REDIS_REPLY_ARRAY) {
+		LOGD("Publish array received: [%s, %s, %s/%i]", reply->element[0]->str, reply->element[1]->str, reply->element[2]->str, (int)reply->element[2]->integer);
+		if (reply->element[2]->str != NULL) {
+			RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)c->data;
+			if (zis && strcmp(reply->element[1]->str, sRecordUpdatedChannel) == 0) {
+				if (zis->mRecordCache) zis->mRecordCache->invalidate(reply->element[2]->str);
+				zis->addToAorFilter(reply->element[2]->str);
+				zis->notifyRecordChanged(reply->element[2]->str);
+			} else if (zis && strncmp(reply->element[1]->str, sTopicChannelPrefix, strlen(sTopicChannelPrefix)) == 0) {
+				// the topics without local listener are ignored by notifyContactListener()
+				const char *message = reply->element[2]->str;
+				const char *space = strchr(message, ' ');
+				if (space)
+					zis->notifyPublished(string(message, space - message), space + 1);
+			} else if (zis) {
+				zis->notifyPublished(reply->element[1]->str, reply->element[2]->str);
+			}
+		}
+	}
+}
+
+/* The binds, clears and fetches whose connection is lost are sent again once reconnected. */
+void RegistrarDbRedisAsync::sHandleBind(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	if (reply == NULL && data->self->holdLostCommand(ac, data, &RegistrarDbRedisAsync::sendBind))
+		return;
+	data->self->handleBind(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleBindScript(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	if (reply == NULL && data->self->holdLostCommand(ac, data, &RegistrarDbRedisAsync::sendBind))
+		return;
+	data->self->handleBindScript(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleBindScriptLoad(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)ac->data;
+	if (zis) {
+		zis->handleBindScriptLoad((redisReply *)r);
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleClear(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	if (reply == NULL && data->self->holdLostCommand(ac, data, &RegistrarDbRedisAsync::sendClear))
+		return;
+	data->self->handleClear(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleFetch(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	if (reply == NULL && !data->mFromReplica &&
+		data->self->holdLostCommand(ac, data, &RegistrarDbRedisAsync::sendFetch))
+		return;
+	data->self->handleFetch(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	data->self->handleMigration(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleRecordMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	data->self->handleRecordMigration(reply, data);
+}
+
+void RegistrarDbRedisAsync::sHandleQueued(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data) {
+	// Keep the redirection, the transaction will only fail with EXECABORT
+	if (reply && reply->type == REDIS_REPLY_ERROR && reply->str) {
+		data->mRedirection = reply->str;
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleClusterSlotsReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleClusterSlotsReply((redisReply *)r);
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleReplicationInfoReply(redisAsyncContext *ac, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+
+	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+		LOGE("Couldn't issue the INFO command, will try later");
+		return;
+	} else if (reply->str && zis) {
+		zis->handleReplicationInfoReply(reply->str);
+	}
+}
+
+/* this callback is called periodically to check if the current REDIS connection is valid */
+void RegistrarDbRedisAsync::sHandleInfoTimer(void *unused, su_timer_t *t, void *data) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
+	if (zis && zis->mContext) {
+		SLOGI << "Launching periodic INFO query on REDIS";
+		zis->getReplicationInfo();
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleClientIdReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleClientIdReply(ac, (const redisReply *)r);
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleClientTrackingReply(redisAsyncContext *ac, void *r, void *privdata) {
+	redisReply *reply = (redisReply *)r;
+	if (!reply) return;
+	if (reply->type == REDIS_REPLY_ERROR) {
+		LOGE("Couldn't enable the redis client tracking, the fetch cache relies on pub/sub: %s", reply->str);
+	} else {
+		LOGI("Redis client tracking enabled on the records");
+	}
+}
+
+void RegistrarDbRedisAsync::shandleAuthReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
 		zis->handleAuthReply((const redisReply *)r);
 	}
 }
 
-void RegistrarDbRedisAsync::serializeAndSendToRedis(RegistrarUserData *data, forwardFn *forward_fn) {
+string RegistrarDbRedisAsync::serializeContact(const shared_ptr<ExtendedContact> &ec) const {
+	string contact = ec->serializeAsUrlEncodedParams();
+	if (mCompressionThreshold == 0 || contact.size() < mCompressionThreshold)
+		return contact;
+	// the same fields as in the contact, read by the bind script
+	string expiry = ";expires=" + to_string(ec->mExpireAt - getCurrentTime()) + ";updatedAt=" +
+					to_string(ec->mUpdatedTime);
+	return ValueCompression::compress(contact, mCompressionThreshold, expiry);
+}
+
+/* The stored contact, decompressed into decompressed if it was compressed, NULL if it cannot be. */
+const char *RegistrarDbRedisAsync::parseContact(const redisReply *element, string &decompressed) {
+	if (!element->str || !ValueCompression::isCompressed(element->str, element->len))
+		return element->str;
+	if (!ValueCompression::decompress(element->str, element->len, decompressed)) {
+		LOGE("Cannot decompress a contact stored in redis%s",
+			 ValueCompression::isAvailable() ? "" : ": flexisip is built without lz4");
+		return NULL;
+	}
+	return decompressed.c_str();
+}
+
+bool RegistrarDbRedisAsync::serializeAndSendToRedis(redisAsyncContext *context, RegistrarUserData *data,
+													 forwardFn *forward_fn) {
 	const char *key = data->record.getKey().c_str();
 
 	int argc = 2; // HMSET key
@@ -530,6 +1735,8 @@ void RegistrarDbRedisAsync::serializeAndSendToRedis(RegistrarUserData *data, for
 
 	const char** argv = new const char*[argc];
 	size_t* argvlen = new size_t[argc];
+	vector<string> values;
+	values.reserve(contacts.size());
 
 	argv[0] = cmd.c_str();
 	argvlen[0] = strlen(argv[0]);
@@ -549,22 +1756,48 @@ void RegistrarDbRedisAsync::serializeAndSendToRedis(RegistrarUserData *data, for
 		argvlen[i] = strlen(argv[i]);
 		i += 1;
 
-		string contact = ec->serializeAsUrlEncodedParams();
-		argv[i] = strdup(contact.c_str());
-		argvlen[i] = strlen(argv[i]);
+		values.push_back(serializeContact(ec));
+		argv[i] = values.back().data();
+		argvlen[i] = values.back().size();
 		i += 1;
 	}
 
 	data->mUpdateExpire = true;
 	LOGD("Binding fs:%s [%lu], %lu contacts in record", key, data->token, (unsigned long)contacts.size());
-	check_redis_command(redisAsyncCommandArgv(mContext, (void (*)(redisAsyncContext*, void*, void*))forward_fn, 
-		data, argc, argv, argvlen), data);
+	int status = redisAsyncCommandArgv(context, (void (*)(redisAsyncContext*, void*, void*))forward_fn,
+		data, argc, argv, argvlen);
 
-	for (i = 2; i < argc; i++) {
+	for (i = 2; i < argc; i += 2) {
 		free((char *)argv[i]);
 	}
 	delete[] argv;
 	delete[] argvlen;
+	return handleRedisStatus("HMSET", status, data);
+}
+
+/* The update of the record and the fetch of the resulting contacts are sent as a single MULTI/EXEC transaction:
+ * a bind costs one round-trip, and no other node can modify the record between the two commands. */
+void RegistrarDbRedisAsync::sendBindTransaction(RegistrarUserData *data) {
+	const char *key = data->record.getKey().c_str();
+	redisAsyncContext *context = contextForData(data);
+	if (!context) {
+		onErrorData(data);
+		return;
+	}
+
+	data->mRedirection.clear();
+	check_redis_command(redisAsyncCommand(context, NULL, NULL, "MULTI"), data);
+	if (data->mIsUnregister) {
+		check_redis_command(redisAsyncCommand(context, (void (*)(redisAsyncContext*, void*, void*))sHandleQueued,
+			data, "HDEL fs:%s %s", key, data->mUnregisterUid.c_str()), data);
+	} else if (!serializeAndSendToRedis(context, data, sHandleQueued)) {
+		return;
+	}
+	check_redis_command(redisAsyncCommand(context, NULL, NULL, "HGETALL fs:%s", key), data);
+	check_redis_command(redisAsyncCommand(context, (void (*)(redisAsyncContext*, void*, void*))sHandleBind,
+		data, "EXEC"), data);
+	notifyRecordUpdated(data->record.getKey());
+	if (mRecordCache) data->mCacheSequence = mRecordCache->sequence();
 }
 
 /* Methods called by the callbacks */
@@ -572,14 +1805,114 @@ void RegistrarDbRedisAsync::serializeAndSendToRedis(RegistrarUserData *data, for
 void RegistrarDbRedisAsync::handleBind(redisReply *reply, RegistrarUserData *data) {
 	const char *key = data->record.getKey().c_str();
 
-	if ((!reply || reply->type == REDIS_REPLY_ERROR) && (data->mRetryCount < 2)) {
+	// EXEC replies with the results of the update and of the HGETALL, or with a nil/error if the transaction failed
+	bool success = reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2
+		&& reply->element[0]->type != REDIS_REPLY_ERROR && reply->element[1]->type == REDIS_REPLY_ARRAY;
+
+	if (success) {
+		data->mRetryCount = 0;
+		LOGD("Binding ok for fs:%s [%lu]", key, data->token);
+		handleFetch(reply->element[1], data);
+	} else if (!data->mRedirection.empty() && handleClusterRedirection(data->mRedirection.c_str(), data)) {
+		sendBindTransaction(data);
+	} else if (data->mRetryCount < 2) {
 		LOGE("Error while updating record fs:%s [%lu] hashmap in redis, trying again", key, data->token);
 		data->mRetryCount += 1;
-		serializeAndSendToRedis(data, sHandleBind);
+		sendBindTransaction(data);
+	} else {
+		data->mRetryCount = 0;
+		LOGE("Could not update record fs:%s [%lu] hashmap in redis, fetching it", key, data->token);
+		sendFetch(data);
+	}
+}
+
+/* The script has the same sha1 on every server, so the reply of the main context is enough to know it. Until it is
+ * known, and whenever a server replies it does not have it, binds are sent as transactions. */
+void RegistrarDbRedisAsync::loadBindScript(redisAsyncContext *context, bool learnSha) {
+	if (!mBindScript || context == NULL)
+		return;
+	redisAsyncCommand(context, learnSha ? sHandleBindScriptLoad : NULL, NULL, "SCRIPT LOAD %s", sBindScript);
+}
+
+void RegistrarDbRedisAsync::handleBindScriptLoad(redisReply *reply) {
+	if (!reply || reply->type != REDIS_REPLY_STRING) {
+		LOGE("Couldn't load the bind script in redis: %s, binds will use transactions",
+			 reply && reply->str ? reply->str : "null reply");
+		mBindScriptSha.clear();
+		return;
+	}
+	LOGD("Bind script loaded in redis as %s", reply->str);
+	mBindScriptSha = reply->str;
+}
+
+void RegistrarDbRedisAsync::sendBind(RegistrarUserData *data) {
+	if (mBindScriptSha.empty()) {
+		sendBindTransaction(data);
+	} else {
+		sendBindScript(data);
+	}
+}
+
+/* The update, the cleanup of the expired contacts, the refresh of the expiration and the fetch of the resulting
+ * contacts are all done by a single EVALSHA, in one round-trip and atomically. */
+void RegistrarDbRedisAsync::sendBindScript(RegistrarUserData *data) {
+	const char *key = data->record.getKey().c_str();
+	redisAsyncContext *context = contextForData(data);
+	if (!context) {
+		onErrorData(data);
+		return;
+	}
+
+	vector<string> args = {"EVALSHA", mBindScriptSha, "1", string("fs:") + key, to_string(getCurrentTime())};
+	if (data->mIsUnregister) {
+		args.push_back("unbind");
+		args.push_back(data->mUnregisterUid);
+	} else {
+		args.push_back("bind");
+		for (const auto &ec : data->record.getExtendedContacts()) {
+			args.push_back(ec->getUniqueId());
+			args.push_back(serializeContact(ec));
+		}
+	}
+	vector<const char *> argv;
+	vector<size_t> argvlen;
+	for (const auto &arg : args) {
+		argv.push_back(arg.c_str());
+		argvlen.push_back(arg.size());
+	}
+
+	// the script already refreshed the expiration
+	data->mUpdateExpire = false;
+	LOGD("Binding fs:%s [%lu] with the bind script", key, data->token);
+	check_redis_command(redisAsyncCommandArgv(context, (void (*)(redisAsyncContext*, void*, void*))sHandleBindScript,
+		data, argv.size(), argv.data(), argvlen.data()), data);
+	notifyRecordUpdated(data->record.getKey());
+	if (mRecordCache) data->mCacheSequence = mRecordCache->sequence();
+}
+
+void RegistrarDbRedisAsync::handleBindScript(redisReply *reply, RegistrarUserData *data) {
+	const char *key = data->record.getKey().c_str();
+
+	if (reply && reply->type == REDIS_REPLY_ARRAY) {
+		data->mRetryCount = 0;
+		LOGD("Binding ok for fs:%s [%lu]", key, data->token);
+		handleFetch(reply, data);
+	} else if (reply && reply->type == REDIS_REPLY_ERROR && handleClusterRedirection(reply->str, data)) {
+		sendBindScript(data);
+	} else if (reply && reply->type == REDIS_REPLY_ERROR && strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+		// flushed, or a failover to a server which never had it
+		LOGW("Bind script missing in redis for fs:%s [%lu], loading it again", key, data->token);
+		loadBindScript(contextForData(data), false);
+		sendBindTransaction(data);
+	} else if (data->mRetryCount < 2) {
+		LOGE("Error while binding fs:%s [%lu] with the bind script: %s, trying again", key, data->token,
+			 reply && reply->str ? reply->str : "null reply");
+		data->mRetryCount += 1;
+		sendBindScript(data);
 	} else {
 		data->mRetryCount = 0;
-		LOGD("Binding ok, fetching fs:%s [%lu]", key, data->token);
-		check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleFetch, data, "HGETALL fs:%s", key), data);
+		LOGE("Could not bind fs:%s [%lu] with the bind script, fetching it", key, data->token);
+		sendFetch(data);
 	}
 }
 
@@ -607,28 +1940,26 @@ void RegistrarDbRedisAsync::doBind(const url_t *ifrom, sip_contact_t *icontact,
 
 	data->record.update(icontact, ipath, expire, iid, iseq, now, alias, acceptHeaders, usedAsRoute, data->listener);
 	mLocalRegExpire->update(data->record);
+	noteLocalWrite(data->record.getKey());
 
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		if (data->listener) data->listener->onError();
-		delete data;
-		return;
-	}
-
-	if (expire > 0) {
-		serializeAndSendToRedis(data, sHandleBind);
-	} else {
-		const char *key = data->record.getKey().c_str();
-		string uid = extractUniqueId(data->record, icontact);
+	if (expire <= 0) {
 		data->mIsUnregister = true;
-		check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleBind, 
-			data, "HDEL fs:%s %s", key, uid.c_str()), data);
+		data->mUnregisterUid = extractUniqueId(data->record, icontact);
 	}
+	if (!ensureConnected()) {
+		bufferCommand(data, &RegistrarDbRedisAsync::sendBind);
+		return;
+	}
+	sendBind(data);
 }
 
 void RegistrarDbRedisAsync::handleClear(redisReply *reply, RegistrarUserData *data) {
 	const char *key = data->record.getKey().c_str();
 
+	if (reply && reply->type == REDIS_REPLY_ERROR && handleClusterRedirection(reply->str, data)) {
+		sendClear(data);
+		return;
+	}
 	if (!reply || reply->type == REDIS_REPLY_ERROR) {
 		LOGE("Redis error setting fs:%s [%lu] - %s", key, data->token, reply ? reply->str : "null reply");
 		if (reply && string(reply->str).find("READONLY") != string::npos) {
@@ -649,24 +1980,40 @@ void RegistrarDbRedisAsync::doClear(const sip_t *sip, const shared_ptr<ContactUp
 	// Once it is done, fetch all the contacts in the AOR and call the onRecordFound of the listener ?
 	RegistrarUserData *data = new RegistrarUserData(this, sip->sip_from->a_url, listener);
 
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		if (data->listener) data->listener->onError();
-		delete data;
-		return;
-	}
-
 	const char *key = data->record.getKey().c_str();
 	LOGD("Clearing fs:%s [%lu]", key, data->token);
 	mLocalRegExpire->remove(key);
-	check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleClear, 
-		data, "DEL fs:%s", key), data);
+	noteLocalWrite(data->record.getKey());
+	if (!ensureConnected()) {
+		bufferCommand(data, &RegistrarDbRedisAsync::sendClear);
+		return;
+	}
+	sendClear(data);
+}
+
+void RegistrarDbRedisAsync::sendClear(RegistrarUserData *data) {
+	string recordKey = data->record.getKey();
+	redisAsyncContext *context = contextForData(data);
+	if (!context) {
+		onErrorData(data);
+		return;
+	}
+	check_redis_command(redisAsyncCommand(context, (void (*)(redisAsyncContext*, void*, void*))sHandleClear,
+		data, "DEL fs:%s", recordKey.c_str()), data);
+	notifyRecordUpdated(recordKey);
 }
 
 void RegistrarDbRedisAsync::handleFetch(redisReply *reply, RegistrarUserData *data) {
 	const char *key = data->record.getKey().c_str();
 
-	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+	if (reply && reply->type == REDIS_REPLY_ERROR && handleClusterRedirection(reply->str, data)) {
+		sendFetch(data);
+	} else if ((!reply || reply->type == REDIS_REPLY_ERROR) && data->mFromReplica) {
+		LOGW("Redis replica error fetching fs:%s [%lu]: %s, fetching from the master", key, data->token,
+			 reply ? reply->str : "null reply");
+		data->mFromReplica = false;
+		sendFetch(data);
+	} else if (!reply || reply->type == REDIS_REPLY_ERROR) {
 		LOGE("Redis error: %s", reply ? reply->str : "null reply");
 		if (data->listener) data->listener->onError();
 		delete data;
@@ -674,40 +2021,68 @@ void RegistrarDbRedisAsync::handleFetch(redisReply *reply, RegistrarUserData *da
 		// This is the most common scenario: we want all contacts inside the record
 		LOGD("GOT fs:%s [%lu] --> %lu contacts", key, data->token, (reply->elements / 2));
 		if (reply->elements > 0) {
+			vector<const char *> outdated;
 			for (size_t i = 0; i < reply->elements; i+=2) {
 				// Elements list is twice the size of the contacts list because the key is an element of the list itself
 				redisReply *element = reply->element[i];
 				const char *uid = element->str;
-				element = reply->element[i+1];
-				const char *contact = element->str;
-				LOGD("Parsing contact %s => %s", uid, contact);
-				if (!data->record.updateFromUrlEncodedParams(key, uid, contact)) {
+				string decompressed;
+				const char *contact = parseContact(reply->element[i+1], decompressed);
+				LOGD("Contact %s => %s", uid, contact ? contact : "corrupted");
+				if (!contact || !data->record.addSerializedContact(uid, contact)) {
 					LOGD("Record %s seems to have an outdated contact %s, remove it from redis", key, uid);
-					check_redis_command(redisAsyncCommand(data->self->mContext, NULL, NULL, "HDEL fs:%s %s", key, uid), data);
+					outdated.push_back(uid);
 				}
 			}
 
+			// Cleanup and expire update are applied atomically when there is more than one of them
+			bool transaction = outdated.size() + (data->mUpdateExpire ? 1 : 0) > 1;
+			redisAsyncContext *context = contextForKey(string("fs:") + key);
+			if (!context) {
+				// the cleanup is done by a next fetch
+				outdated.clear();
+				data->mUpdateExpire = false;
+				transaction = false;
+			}
+			if (transaction) {
+				check_redis_command(redisAsyncCommand(context, NULL, NULL, "MULTI"), data);
+			}
+			for (auto it = outdated.begin(); it != outdated.end(); ++it) {
+				check_redis_command(redisAsyncCommand(context, NULL, NULL, "HDEL fs:%s %s", key, *it), data);
+			}
 			if (data->mUpdateExpire) {
 				time_t expireat = data->record.latestExpire();
-				check_redis_command(redisAsyncCommand(data->self->mContext, NULL, NULL, "EXPIREAT fs:%s %lu", key, expireat), data);
+				check_redis_command(redisAsyncCommand(context, NULL, NULL, "EXPIREAT fs:%s %lu", key, expireat), data);
+			}
+			if (transaction) {
+				check_redis_command(redisAsyncCommand(context, NULL, NULL, "EXEC"), data);
 			}
 
 			time_t now = getCurrentTime();
 			data->record.clean(now, data->listener);
+			// a replica may still hold a state older than an invalidation already received
+			if (mRecordCache && !data->mFromReplica) mRecordCache->put(data->record, data->mCacheSequence, now);
 			if (data->listener) data->listener->onRecordFound(&data->record);
 			delete data;
 		} else {
 			// We haven't found the record in redis, trying to find an old record
 			LOGD("Record fs:%s not found, trying aor:%s", key, key);
-			check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleRecordMigration, 
-				data, "GET aor:%s", key), data);
+			redisAsyncContext *context = contextForKey(string("aor:") + key);
+			if (!context) {
+				onErrorData(data);
+				return;
+			}
+			check_redis_command(redisAsyncCommand(context,
+				(void (*)(redisAsyncContext*, void*, void*))sHandleRecordMigration, data, "GET aor:%s", key), data);
 		}
 	} else {
 		// This is only when we want a contact matching a given gruu
 		const char *gruu = data->mGruu.c_str();
-		if (reply->len > 0) {
-			LOGD("GOT fs:%s [%lu] for gruu %s --> %s", key, data->token, gruu, reply->str);
-			data->record.updateFromUrlEncodedParams(key, gruu, reply->str);
+		string decompressed;
+		const char *contact = reply->len > 0 ? parseContact(reply, decompressed) : NULL;
+		if (contact) {
+			LOGD("GOT fs:%s [%lu] for gruu %s --> %s", key, data->token, gruu, contact);
+			data->record.addSerializedContact(gruu, contact);
 			time_t now = getCurrentTime();
 			data->record.clean(now, data->listener);
 			if (data->listener) data->listener->onRecordFound(&data->record);
@@ -723,36 +2098,67 @@ void RegistrarDbRedisAsync::doFetch(const url_t *url, const shared_ptr<ContactUp
 	// fetch all the contacts in the AOR (HGETALL) and call the onRecordFound of the listener
 	RegistrarUserData *data = new RegistrarUserData(this, url, listener);
 
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		if (data->listener) data->listener->onError();
-		delete data;
+	// the cache and the filter also answer during the outages
+	if (rejectedByAorFilter(data))
 		return;
+	const char *key = data->record.getKey().c_str();
+	if (mRecordCache) {
+		time_t now = getCurrentTime();
+		shared_ptr<Record> cached = mRecordCache->get(data->record.getKey(), now);
+		if (cached) {
+			LOGD("Fetching fs:%s [%lu] from local cache", key, data->token);
+			cached->clean(now, data->listener);
+			if (data->listener) data->listener->onRecordFound(cached.get());
+			delete data;
+			return;
+		}
+		data->mCacheSequence = mRecordCache->sequence();
 	}
+	data->mFromReplica = mReplicaReads;
+	if (!ensureConnected()) {
+		bufferCommand(data, &RegistrarDbRedisAsync::sendFetch);
+		return;
+	}
+	LOGD("Fetching fs:%s [%lu]", key, data->token);
+	sendFetch(data);
+}
 
+/* Fetches the whole record, or only the contact matching the gruu if one is set. */
+void RegistrarDbRedisAsync::sendFetch(RegistrarUserData *data) {
 	const char *key = data->record.getKey().c_str();
-	LOGD("Fetching fs:%s [%lu]", key, data->token);
-	check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleFetch, 
-		data, "HGETALL fs:%s", key), data);
+	redisAsyncContext *context = data->mFromReplica ? replicaContextForKey(data->record.getKey()) : NULL;
+	if (context) {
+		if (mCountReplicaFetches) ++(*mCountReplicaFetches);
+	} else {
+		data->mFromReplica = false;
+		context = contextForData(data);
+		if (!context) {
+			onErrorData(data);
+			return;
+		}
+	}
+	if (data->mGruu.empty()) {
+		check_redis_command(redisAsyncCommand(context, (void (*)(redisAsyncContext*, void*, void*))sHandleFetch,
+			data, "HGETALL fs:%s", key), data);
+	} else {
+		check_redis_command(redisAsyncCommand(context, (void (*)(redisAsyncContext*, void*, void*))sHandleFetch,
+			data, "HGET fs:%s %s", key, data->mGruu.c_str()), data);
+	}
 }
 
 void RegistrarDbRedisAsync::doFetchForGruu(const url_t *url, const string &gruu, const shared_ptr<ContactUpdateListener> &listener) {
 	// fetch only the contact in the AOR (HGET) and call the onRecordFound of the listener
 	RegistrarUserData *data = new RegistrarUserData(this, url, listener);
 	data->mGruu = gruu;
-	
-	if (!isConnected() && !connect()) {
-		LOGE("Not connected to redis server");
-		if (data->listener) data->listener->onError();
-		delete data;
+
+	if (rejectedByAorFilter(data))
+		return;
+	if (!ensureConnected()) {
+		bufferCommand(data, &RegistrarDbRedisAsync::sendFetch);
 		return;
 	}
-
-	const char *key = data->record.getKey().c_str();
-	const char *field = gruu.c_str();
-	LOGD("Fetching fs:%s [%lu] contact matching gruu %s", key, data->token, field);
-	check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleFetch, 
-		data, "HGET fs:%s %s", key, field), data);
+	LOGD("Fetching fs:%s [%lu] contact matching gruu %s", data->record.getKey().c_str(), data->token, gruu.c_str());
+	sendFetch(data);
 }
 
 /*
@@ -770,7 +2176,14 @@ void RegistrarDbRedisAsync::handleRecordMigration(redisReply *reply, RegistrarUs
 				if (data->listener) data->listener->onRecordFound(NULL); 
 			} else {
 				LOGD("Parsing stored contacts for aor:%s successful", data->record.getKey().c_str());
-				serializeAndSendToRedis(data, sHandleMigration);
+				redisAsyncContext *context = contextForData(data);
+				if (!context) {
+					onErrorData(data);
+					return;
+				}
+				// data is now owned by the pending HMSET (or already released if it could not be sent)
+				serializeAndSendToRedis(context, data, sHandleMigration);
+				return;
 			}
 		} else {
 			// This is a workaround required in case of unregister (expire set to 0) because
@@ -785,22 +2198,9 @@ void RegistrarDbRedisAsync::handleRecordMigration(redisReply *reply, RegistrarUs
 void RegistrarDbRedisAsync::handleMigration(redisReply *reply, RegistrarUserData *data) {
 	if (!reply || reply->type == REDIS_REPLY_ERROR) {
 		LOGE("Redis error: %s", reply ? reply->str : "null reply");
-	} else if (reply->type == REDIS_REPLY_ARRAY) {
-		LOGD("Fetching all previous records success: %lu record(s) found", (unsigned long)reply->elements);
-
-		su_home_t home;
-		su_home_init(&home);
-		for (size_t i = 0; i < reply->elements; i++) {
-			redisReply *element = reply->element[i];
-			url_t *url = url_make(&home, element->str);
-			RegistrarUserData *new_data = new RegistrarUserData(this, url, NULL);
-			LOGD("Fetching previous record: %s", element->str);
-			check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleRecordMigration, 
-				new_data, "GET %s", element->str), new_data);
-		}
-		su_home_deinit(&home);
 	} else {
 		LOGD("Record aor:%s successfully migrated", data->record.getKey().c_str());
+		if (mCountMigratedRecords) ++(*mCountMigratedRecords);
 		if (data->listener) data->listener->onRecordFound(&data->record); 
 		/*If we want someday to remove the previous record, uncomment the following and comment the delete data above
 		check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleClear, 
@@ -809,14 +2209,292 @@ void RegistrarDbRedisAsync::handleMigration(redisReply *reply, RegistrarUserData
 	delete data;
 }
 
+/* The previous records are migrated in the background, by walking the "aor:*" keys with SCAN: each tick of the
+ * migration timer handles at most one SCAN step of redis-migration-budget keys, so that redis is never blocked the
+ * way KEYS did. The cursor of each node is saved in redis after every step, a restarted proxy resumes where it
+ * stopped, and "done" is stored once the whole keyspace was walked. */
 void RegistrarDbRedisAsync::doMigration() {
 	if (!isConnected() && !connect()) {
 		LOGE("Not connected to redis server");
 		return;
 	}
+	if (!mMigrationScans.empty()) {
+		LOGW("Migration of the previous records already running");
+		return;
+	}
+
+	if (mCluster || mSharded) {
+		// SCAN only covers the keys of the node it is sent to
+		if (mClusterNodes.empty()) {
+			LOGW("Redis cluster nodes not known yet, cannot migrate the previous records");
+			return;
+		}
+		for (size_t i = 0; i < mClusterNodes.size(); ++i) {
+			ostringstream cursorKey;
+			cursorKey << sMigrationCursorKey << ":" << mClusterNodes[i].address << ":" << mClusterNodes[i].port;
+			mMigrationScans.push_back(MigrationScan{(int)i, cursorKey.str(), "", false});
+		}
+	} else {
+		mMigrationScans.push_back(MigrationScan{-1, sMigrationCursorKey, "", false});
+	}
+	mMigrationCurrent = 0;
+	mMigrationInFlight = false;
+
+	LOGD("Starting background migration of previous record(s), %d keys per step", mMigrationBudget);
+	if (mMigrationTimer == NULL) {
+		mMigrationTimer = su_timer_create(su_root_task(mRoot), sMigrationTickInterval);
+	}
+	su_timer_run(mMigrationTimer, (su_timer_f)sHandleMigrationTimer, this);
+	migrationTick();
+}
+
+/* Context of the node walked by a SCAN, the main server when not in cluster or sharded mode. */
+redisAsyncContext *RegistrarDbRedisAsync::scanContext(int node) {
+	return node >= 0 ? connectClusterNode(node) : mContext;
+}
+
+void RegistrarDbRedisAsync::migrationTick() {
+	if (mMigrationInFlight || !isConnected())
+		return;
+	while (mMigrationCurrent < mMigrationScans.size() && mMigrationScans[mMigrationCurrent].done)
+		++mMigrationCurrent;
+	if (mMigrationCurrent == mMigrationScans.size()) {
+		LOGI("Migration of the previous records finished");
+		su_timer_reset(mMigrationTimer);
+		mMigrationScans.clear();
+		return;
+	}
+
+	MigrationScan &scan = mMigrationScans[mMigrationCurrent];
+	redisAsyncContext *context = scanContext(scan.node);
+	if (!context)
+		return;
+	mMigrationInFlight = true;
+	if (scan.cursor.empty()) {
+		// in sharded mode, the cursor of a master is kept on it
+		redisAsyncContext *cursorContext = mSharded ? context : contextForKey(scan.cursorKey);
+		redisAsyncCommand(cursorContext, sHandleMigrationCursorReply, this, "GET %s", scan.cursorKey.c_str());
+	} else {
+		redisAsyncCommand(context, sHandleMigrationScanReply, this, "SCAN %s MATCH aor:* COUNT %d",
+						  scan.cursor.c_str(), mMigrationBudget);
+	}
+	onCommandQueued();
+}
+
+void RegistrarDbRedisAsync::handleMigrationCursorReply(redisReply *reply) {
+	mMigrationInFlight = false;
+	if (mMigrationCurrent >= mMigrationScans.size())
+		return;
+	MigrationScan &scan = mMigrationScans[mMigrationCurrent];
+	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+		LOGE("Couldn't read the migration cursor %s: %s, will try later", scan.cursorKey.c_str(),
+			 reply ? reply->str : "null reply");
+		return;
+	}
+	if (reply->type == REDIS_REPLY_STRING && strcmp(reply->str, "done") == 0) {
+		LOGD("Previous records of %s already migrated", scan.cursorKey.c_str());
+		scan.done = true;
+	} else {
+		scan.cursor = reply->type == REDIS_REPLY_STRING ? reply->str : "0";
+		LOGD("Migration of %s resumed at cursor %s", scan.cursorKey.c_str(), scan.cursor.c_str());
+	}
+	migrationTick();
+}
+
+/* SCAN replies with the next cursor and the keys found in this step. */
+void RegistrarDbRedisAsync::handleMigrationScanReply(redisReply *reply) {
+	mMigrationInFlight = false;
+	if (mMigrationCurrent >= mMigrationScans.size())
+		return;
+	MigrationScan &scan = mMigrationScans[mMigrationCurrent];
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+		reply->element[0]->type != REDIS_REPLY_STRING || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		LOGE("Redis error while scanning previous records: %s, will try later",
+			 reply && reply->str ? reply->str : "unexpected reply");
+		return;
+	}
+
+	redisAsyncContext *context = scanContext(scan.node);
+	if (!context) {
+		LOGE("Connection lost to the redis master scanned for previous records, will try later");
+		return;
+	}
+	redisReply *keys = reply->element[1];
+	SofiaAutoHome home;
+	for (size_t i = 0; i < keys->elements; i++) {
+		redisReply *element = keys->element[i];
+		url_t *url = url_make(home.home(), element->str);
+		RegistrarUserData *new_data = new RegistrarUserData(this, url, NULL);
+		LOGD("Fetching previous record: %s", element->str);
+		// in sharded mode, the previous record is read where it was found and migrated to the master of its aor
+		int status = redisAsyncCommand(mSharded ? context : contextForKey(element->str),
+			(void (*)(redisAsyncContext*, void*, void*))sHandleRecordMigration, new_data, "GET %s", element->str);
+		if (status != REDIS_OK) {
+			LOGE("Redis error for GET %s: %d", element->str, status);
+			delete new_data;
+			break;
+		}
+		onCommandQueued();
+	}
+	if (mCountMigrationKeys) mCountMigrationKeys->set(mCountMigrationKeys->read() + keys->elements);
+
+	scan.cursor = reply->element[0]->str;
+	if (scan.cursor == "0") {
+		scan.done = true;
+		LOGD("Scan of %s finished", scan.cursorKey.c_str());
+	}
+	redisAsyncContext *cursorContext = mSharded ? context : contextForKey(scan.cursorKey);
+	redisAsyncCommand(cursorContext, NULL, NULL, "SET %s %s", scan.cursorKey.c_str(),
+					  scan.done ? "done" : scan.cursor.c_str());
+	onCommandQueued();
+}
+
+void RegistrarDbRedisAsync::sHandleMigrationTimer(void *unused, su_timer_t *t, void *data) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
+	zis->migrationTick();
+}
+
+void RegistrarDbRedisAsync::sHandleMigrationCursorReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleMigrationCursorReply((redisReply *)r);
+	}
+}
+
+void RegistrarDbRedisAsync::sHandleMigrationScanReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleMigrationScanReply((redisReply *)r);
+	}
+}
+
+/*
+ * Filter of the registered aors
+ */
+
+/* The fetches of the aors which were never bound are answered without querying redis. The filter is built from a SCAN
+ * of the records, the former "aor:" ones included as they are migrated when fetched, and every record updated
+ * meanwhile is added to it, as published on the record updated channel. Removing a record does not remove it from
+ * the filter: it is rebuilt periodically instead, the previous one staying in use during the scan. As missing an
+ * update would reject the fetches of a registered aor, the filter is dropped while the pub/sub connection is down, and
+ * rebuilt once it is up again. */
+void RegistrarDbRedisAsync::resetAorFilter() {
+	if (mAorFilterSize == 0)
+		return;
+	delete mAorFilter;
+	mAorFilter = NULL;
+	delete mAorFilterBuilding;
+	mAorFilterBuilding = NULL;
+	mAorFilterScans.clear();
+	mAorFilterRebuildAt = 1;
+}
+
+void RegistrarDbRedisAsync::addToAorFilter(const string &key) {
+	if (mAorFilter) mAorFilter->add(key);
+	if (mAorFilterBuilding) mAorFilterBuilding->add(key);
+}
+
+/* Answers a fetch located by the filter, true if the record is not registered. */
+bool RegistrarDbRedisAsync::rejectedByAorFilter(RegistrarUserData *data) {
+	if (!mAorFilter || mAorFilter->mayContain(data->record.getKey()))
+		return false;
+	LOGD("Record fs:%s [%lu] not registered according to the filter of the registered aors",
+		 data->record.getKey().c_str(), data->token);
+	if (mCountAorFilterRejections) ++(*mCountAorFilterRejections);
+	if (data->listener) data->listener->onRecordFound(NULL);
+	delete data;
+	return true;
+}
+
+void RegistrarDbRedisAsync::aorFilterTick() {
+	// a reply of an aborted scan may still be pending
+	if (mAorFilterInFlight || mAorFilterRebuildAt == 0 || getCurrentTime() < mAorFilterRebuildAt)
+		return;
+	if (!isConnected() || !mSubscribeContext)
+		return;
+	mAorFilterScans.clear();
+	if (mCluster || mSharded) {
+		// SCAN only covers the keys of the node it is sent to
+		if (mClusterNodes.empty())
+			return;
+		for (size_t i = 0; i < mClusterNodes.size(); ++i)
+			mAorFilterScans.push_back(AorFilterScan{(int)i, "0"});
+	} else {
+		mAorFilterScans.push_back(AorFilterScan{-1, "0"});
+	}
+	LOGD("Building the filter of the registered aors");
+	mAorFilterBuilding = new BloomFilter(mAorFilterSize);
+	mAorFilterCurrent = 0;
+	mAorFilterRebuildAt = 0;
+	aorFilterScanStep();
+}
+
+void RegistrarDbRedisAsync::aorFilterScanStep() {
+	if (mAorFilterCurrent == mAorFilterScans.size()) {
+		delete mAorFilter;
+		mAorFilter = mAorFilterBuilding;
+		mAorFilterBuilding = NULL;
+		mAorFilterScans.clear();
+		mAorFilterRebuildAt = getCurrentTime() + mAorFilterRebuildInterval;
+		if (mCountAorFilterRebuilds) ++(*mCountAorFilterRebuilds);
+		LOGI("Filter of the registered aors built, %zu keys added", mAorFilter->count());
+		return;
+	}
+	const AorFilterScan &scan = mAorFilterScans[mAorFilterCurrent];
+	redisAsyncContext *context = scanContext(scan.node);
+	if (!context) {
+		LOGE("Cannot scan the records for the filter of the registered aors, will try later");
+		delete mAorFilterBuilding;
+		mAorFilterBuilding = NULL;
+		mAorFilterScans.clear();
+		mAorFilterRebuildAt = getCurrentTime() + mSlaveCheckTimeout;
+		return;
+	}
+	mAorFilterInFlight = true;
+	redisAsyncCommand(context, sHandleAorFilterScanReply, this, "SCAN %s COUNT %d", scan.cursor.c_str(),
+					  sAorFilterScanCount);
+	onCommandQueued();
+}
 
-	LOGD("Fetching previous record(s)");
-	RegistrarUserData *data = new RegistrarUserData(this, NULL, NULL);
-	check_redis_command(redisAsyncCommand(mContext, (void (*)(redisAsyncContext*, void*, void*))sHandleMigration, 
-		data, "KEYS aor:*"), data);
+void RegistrarDbRedisAsync::handleAorFilterScanReply(redisReply *reply) {
+	mAorFilterInFlight = false;
+	if (!mAorFilterBuilding)
+		return; // reset during the scan
+	if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+		reply->element[0]->type != REDIS_REPLY_STRING || reply->element[1]->type != REDIS_REPLY_ARRAY) {
+		LOGE("Redis error while scanning the records for the filter of the registered aors: %s, will try later",
+			 reply && reply->str ? reply->str : "unexpected reply");
+		delete mAorFilterBuilding;
+		mAorFilterBuilding = NULL;
+		mAorFilterScans.clear();
+		mAorFilterRebuildAt = getCurrentTime() + mSlaveCheckTimeout;
+		return;
+	}
+	redisReply *keys = reply->element[1];
+	for (size_t i = 0; i < keys->elements; i++) {
+		const char *key = keys->element[i]->str;
+		if (!key)
+			continue;
+		if (strncmp(key, "fs:", 3) == 0)
+			mAorFilterBuilding->add(key + 3);
+		else if (strncmp(key, "aor:", 4) == 0)
+			mAorFilterBuilding->add(key + 4);
+	}
+	AorFilterScan &scan = mAorFilterScans[mAorFilterCurrent];
+	scan.cursor = reply->element[0]->str;
+	if (scan.cursor == "0")
+		++mAorFilterCurrent;
+	aorFilterScanStep();
+}
+
+void RegistrarDbRedisAsync::sHandleAorFilterTimer(void *unused, su_timer_t *t, void *data) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)data;
+	zis->aorFilterTick();
+}
+
+void RegistrarDbRedisAsync::sHandleAorFilterScanReply(redisAsyncContext *ac, void *r, void *privdata) {
+	RegistrarDbRedisAsync *zis = (RegistrarDbRedisAsync *)privdata;
+	if (zis) {
+		zis->handleAorFilterScanReply((redisReply *)r);
+	}
 }
@@ -38,6 +38,8 @@ typedef struct redisSofiaEvents {
     su_root_t *root;
     su_wait_t wait;
     int index;
+    int holdWrite; /* when set, write requests are recorded but not forwarded to the root */
+    int pendingWrite;
 } redisSofiaEvents;
 
 static int redisSofiaEvent(su_root_magic_t *magic, su_wait_t *wait, su_wakeup_arg_t *e) {
@@ -77,14 +79,33 @@ static void redisSofiaDelRead(void *privdata) {
 }
 
 static void redisSofiaAddWrite(void *privdata) {
+	redisSofiaEvents *e = (redisSofiaEvents*)privdata;
+	if (e->holdWrite) {
+		e->pendingWrite = 1;
+		return;
+	}
 	addWaitMask(privdata, SU_WAIT_OUT);
 }
 
 static void redisSofiaDelWrite(void *privdata) {
+	redisSofiaEvents *e = (redisSofiaEvents*)privdata;
+	e->pendingWrite = 0;
 	delWaitMask(privdata, SU_WAIT_OUT);
 
 }
 
+/* Hold or release the output of an attached context, so that several commands end up in a single write. */
+static void redisSofiaHoldWrite(redisAsyncContext *ac, int hold) {
+	redisSofiaEvents *e = (redisSofiaEvents*)ac->ev.data;
+	if (e == NULL)
+		return;
+	e->holdWrite = hold;
+	if (!hold && e->pendingWrite) {
+		e->pendingWrite = 0;
+		addWaitMask(e, SU_WAIT_OUT);
+	}
+}
+
 // Note: async.h requires this method to be idempotent; it is not the case.
 static void redisSofiaCleanup(void *privdata) {
     redisSofiaEvents *e = (redisSofiaEvents*)privdata;
@@ -105,6 +126,8 @@ static int redisSofiaAttach(redisAsyncContext *ac, su_root_t *root) {
     e = (redisSofiaEvents*)malloc(sizeof(*e));
     e->context = ac;
     e->root = root;
+    e->holdWrite = 0;
+    e->pendingWrite = 0;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisSofiaAddRead;
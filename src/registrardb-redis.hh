@@ -25,29 +25,128 @@
 #include <sofia-sip/nta.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
+#include <unordered_map>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include "agent.hh"
+#include "utils/bloomfilter.hh"
 
 struct RedisParameters {
-	RedisParameters() : port(0), timeout(0) {
+	RedisParameters()
+		: port(0), timeout(0), mSlaveCheckTimeout(60), mBatchWindow(0), mBatchMaxSize(0), mFetchCacheSize(0),
+		  mFetchCacheTtl(0), mCluster(false), mMigrationBudget(100), mBindScript(false), mReplicaReads(false),
+		  mReplicaMaxLag(0), mAorFilterSize(0), mAorFilterRebuildInterval(3600), mSubscriptionChannels(0),
+		  mReconnectMinDelay(100), mReconnectMaxDelay(2000), mOutageBufferSize(0), mOutageBufferTimeout(5000),
+		  mCompressionThreshold(0), mClientTracking(false) {
 	}
 	std::string domain;
 	std::string auth;
 	int port;
 	int timeout;
 	int mSlaveCheckTimeout;
+	int mBatchWindow; /* in milliseconds, 0 to write as soon as the socket is ready */
+	int mBatchMaxSize; /* number of commands after which a pending batch is flushed immediately */
+	int mFetchCacheSize; /* number of records kept in the local fetch cache, 0 to disable it */
+	int mFetchCacheTtl; /* in seconds */
+	bool mCluster; /* domain and port designate a seed node of a redis cluster */
+	int mMigrationBudget; /* number of keys examined by each step of the migration of the previous records */
+	bool mBindScript; /* binds are done by a lua script loaded in redis, instead of a transaction */
+	bool mReplicaReads; /* fetches are sent to the replicas of the master */
+	int mReplicaMaxLag; /* in seconds, replicas lagging behind more are not read, nor the keys written more recently */
+	int mAorFilterSize; /* number of records the filter of the registered aors is sized for, 0 to disable it */
+	int mAorFilterRebuildInterval; /* in seconds */
+	int mSubscriptionChannels; /* channels the topics of the subscriptions are hashed to, 0 for a channel per topic */
+	int mReconnectMinDelay; /* in milliseconds, doubled after every failed reconnection */
+	int mReconnectMaxDelay; /* in milliseconds */
+	int mOutageBufferSize; /* number of commands kept while disconnected, 0 to fail them at once */
+	int mOutageBufferTimeout; /* in milliseconds */
+	int mCompressionThreshold; /* size in bytes from which the contacts are stored compressed, 0 to disable it */
+	bool mClientTracking; /* the fetch cache is also invalidated by redis 6 client side tracking of the fs: keys */
+	std::list<std::string> mShards; /* "host:port" of the independent masters the records are spread over */
+	std::list<std::string> mShardDomains; /* "domain=host:port", pinning the records of a domain to one of them */
+};
+
+/**
+ * @brief Local LRU cache of the records fetched from redis.
+ *
+ * Entries are invalidated when a bind or a clear is made on the record, locally or by another proxy
+ * (through redis pub/sub), and expire after a configurable time to bound staleness if a notification is lost.
+ * A sequence number taken when a fetch is issued allows to refuse inserting a reply that may be older than an
+ * invalidation received in the meantime.
+ */
+class RecordCache {
+  public:
+	RecordCache(size_t maxSize, int ttl);
+	std::shared_ptr<Record> get(const std::string &key, time_t now);
+	void put(const Record &record, uint64_t sequence, time_t now);
+	void invalidate(const std::string &key);
+	void clear();
+	uint64_t sequence() const {
+		return mSequence;
+	}
+	void setStats(StatCounter64 *hits, StatCounter64 *misses, StatCounter64 *evictions) {
+		mCountHits = hits;
+		mCountMisses = misses;
+		mCountEvictions = evictions;
+	}
+
+  private:
+	struct Entry {
+		std::string key;
+		std::shared_ptr<Record> record;
+		time_t insertedAt;
+	};
+	typedef std::list<Entry> LruList;
+	bool invalidatedSince(const std::string &key, uint64_t sequence) const;
+	void erase(std::unordered_map<std::string, LruList::iterator>::iterator it);
+	LruList mLru; /* most recently used first */
+	std::unordered_map<std::string, LruList::iterator> mIndex;
+	std::deque<std::pair<uint64_t, std::string>> mRecentInvalidations;
+	size_t mMaxSize;
+	int mTtl;
+	uint64_t mSequence;
+	uint64_t mLastClear;
+	StatCounter64 *mCountHits;
+	StatCounter64 *mCountMisses;
+	StatCounter64 *mCountEvictions;
+};
+
+/**
+ * @brief Consistent hashing of the records over independent redis masters.
+ *
+ * Each master is placed at several points of a ring of 32 bits hashes, derived from its address so that all the
+ * proxies agree whatever the order the masters are listed in. A record belongs to the master of the first point
+ * following the hash of its aor: adding or removing a master only moves the records of the ranges next to its points.
+ * The records of a domain can be pinned to one master instead.
+ */
+class RedisShardRing {
+  public:
+	void addShard(int node, const std::string &name);
+	void setDomainShard(const std::string &domain, int node);
+	/* Index of the master of the record of aor, -1 when there is no master. */
+	int shardForAor(const std::string &aor) const;
+	bool empty() const {
+		return mPoints.empty();
+	}
+
+  private:
+	std::vector<std::pair<uint32_t, int>> mPoints; /* hash -> node, sorted by hash */
+	std::unordered_map<std::string, int> mDomainShards;
 };
 
 /**
  * @brief The RedisHost struct, which is used to store redis slave description.
  */
 struct RedisHost {
-	RedisHost(int id, const std::string &address, unsigned short port, const std::string &state)
-		: id(id), address(address), port(port), state(state) {
+	RedisHost(int id, const std::string &address, unsigned short port, const std::string &state, int lag = 0)
+		: id(id), address(address), port(port), state(state), lag(lag) {
 	}
 
 	RedisHost() {
 		// invalid host
 		id = -1;
+		lag = 0;
 	}
 
 	inline bool operator==(const RedisHost &r) {
@@ -68,9 +167,31 @@ struct RedisHost {
 	std::string address;
 	unsigned short port;
 	std::string state;
+	int lag; /* seconds since the last acknowledgement of the slave, 0 if not reported */
 };
 
+/**
+ * @brief A master node of a redis cluster, or one of the independent masters the records are sharded over, to which a
+ * connection is opened when a command is first routed to it.
+ */
+struct RedisClusterNode {
+	RedisClusterNode(const std::string &address, int port) : address(address), port(port), context(NULL) {
+	}
+	std::string address;
+	int port;
+	redisAsyncContext *context;
+};
 
+/**
+ * @brief A slave of the master, from which records are fetched when replica reads are enabled. The connection is
+ * opened when a fetch is first routed to it.
+ */
+struct RedisReplica {
+	RedisReplica(const RedisHost &host) : host(host), context(NULL) {
+	}
+	RedisHost host;
+	redisAsyncContext *context;
+};
 
 /******
  * RegistrarUserData helper class
@@ -89,6 +210,12 @@ struct RegistrarUserData {
 	uint8_t mRetryCount;
 	std::string mGruu;
 	bool mIsUnregister;
+	std::string mUnregisterUid;
+	uint64_t mCacheSequence;
+	int mAskNode; /* cluster node designated by an ASK redirection, to which the next attempt is sent */
+	std::string mRedirection; /* MOVED or ASK error replied to a command queued in a transaction */
+	bool mFromReplica; /* the fetch was sent to a replica, and is sent again to the master if it fails */
+	uint8_t mReplayCount; /* number of times the command was kept during an outage after it was lost in flight */
 
 	RegistrarUserData(RegistrarDbRedisAsync *s, const url_t *url, std::shared_ptr<ContactUpdateListener> listener);
 	~RegistrarUserData();
@@ -110,10 +237,19 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	virtual void doFetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener);
 	virtual void doFetchForGruu(const url_t *url, const std::string &gruu, const std::shared_ptr<ContactUpdateListener> &listener);
 	virtual void doMigration();
+	virtual void flushFetches();
 	virtual void subscribe(const std::string &topic, const std::shared_ptr<ContactRegisteredListener> &listener);
 	virtual void unsubscribe(const std::string &topic);
+	virtual size_t countPendingCommands();
 	virtual void publish(const std::string &topic, const std::string &uid);
 
+  public:
+	typedef std::function<void(redisReply *)> ReplyCallback;
+	/* Sends a command about redisKey on the connection of the registrar, so that other modules can share it. The
+	 * callback is called once, with NULL if the command couldn't be sent or the connection was lost. Cluster
+	 * redirections are not followed, they are replied as errors. */
+	void sendCommand(const std::string &redisKey, const ReplyCallback &callback, const char *format, ...);
+
   private:
 	RegistrarDbRedisAsync(Agent *agent, RedisParameters params);
 	~RegistrarDbRedisAsync();
@@ -122,6 +258,7 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	static void sSubscribeConnectCallback(const redisAsyncContext *c, int status);
 	static void sSubscribeDisconnectCallback(const redisAsyncContext *c, int status);
 	static void sPublishCallback(redisAsyncContext *c, void *r, void *privdata);
+	static void sHandleCommandReply(redisAsyncContext *c, void *r, void *privdata);
 	bool isConnected();
 	friend class RegistrarDb;
 	Agent *mAgent;
@@ -136,37 +273,190 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	size_t mCurSlave;
 	su_timer_t *mReplicationTimer;
 	int mSlaveCheckTimeout;
+	/* command batching */
+	int mBatchWindow;
+	int mBatchMaxSize;
+	int mBatchPending;
+	su_timer_t *mBatchTimer;
+	StatCounter64 *mCountBatches;
+	StatCounter64 *mCountBatchedCommands;
+	StatCounter64 *mCountBatchesFull;
+	RecordCache *mRecordCache;
+	/* the invalidations of the fs: keys tracked by redis for mContext are redirected to mSubscribeContext */
+	bool mClientTracking;
+	/* redis cluster: mContext stays connected to the seed node, used for discovery and pub/sub */
+	bool mCluster;
+	std::vector<RedisClusterNode> mClusterNodes;
+	std::vector<int> mClusterSlots; /* index in mClusterNodes of the owner of each slot, -1 if unknown */
+	bool mClusterSlotsPending;
+	StatCounter64 *mCountClusterRedirections;
+	/* sharding over independent masters, kept in mClusterNodes: mContext stays connected to redis-server-domain, used
+	 * for the replication info and pub/sub */
+	bool mSharded;
+	RedisShardRing mShardRing;
+	void setupShards(const RedisParameters &params);
+	void setupClientTracking(const RedisParameters &params);
+	/* background migration of the records stored with the previous "aor:" format */
+	struct MigrationScan {
+		int node; /* index in mClusterNodes, -1 when not in cluster mode */
+		std::string cursorKey;
+		std::string cursor; /* empty until read from redis */
+		bool done;
+	};
+	std::vector<MigrationScan> mMigrationScans;
+	size_t mMigrationCurrent;
+	bool mMigrationInFlight;
+	int mMigrationBudget;
+	su_timer_t *mMigrationTimer;
+	redisAsyncContext *scanContext(int node);
+	StatCounter64 *mCountMigrationKeys;
+	StatCounter64 *mCountMigratedRecords;
+	static const char *sMigrationCursorKey;
+	static const char *sRecordUpdatedChannel;
+	/* bind script */
+	bool mBindScript;
+	std::string mBindScriptSha; /* empty until the script is loaded */
+	static const char *sBindScript;
+	/* replica reads */
+	bool mReplicaReads;
+	int mReplicaMaxLag;
+	std::vector<RedisReplica> mReplicas;
+	size_t mNextReplica;
+	std::unordered_map<std::string, time_t> mRecentWrites; /* key -> end of the period it is read from the master */
+	StatCounter64 *mCountReplicaFetches;
+	/* filter of the registered aors, rebuilt from a SCAN of the records and fed by the record updates */
+	struct AorFilterScan {
+		int node; /* index in mClusterNodes, -1 when not in cluster mode */
+		std::string cursor;
+	};
+	int mAorFilterSize;
+	int mAorFilterRebuildInterval;
+	BloomFilter *mAorFilter; /* NULL until a first scan is complete, and while updates may be missed */
+	BloomFilter *mAorFilterBuilding; /* fed by the scan in progress */
+	std::vector<AorFilterScan> mAorFilterScans;
+	size_t mAorFilterCurrent;
+	bool mAorFilterInFlight;
+	time_t mAorFilterRebuildAt; /* 0 while a scan is in progress */
+	su_timer_t *mAorFilterTimer;
+	StatCounter64 *mCountAorFilterRejections;
+	StatCounter64 *mCountAorFilterRebuilds;
+	/* the topics share mSubscriptionChannels channels, the publications being demultiplexed locally */
+	int mSubscriptionChannels;
+	std::string topicChannel(const std::string &topic) const;
+	static const char *sTopicChannelPrefix;
+	static const char *sInvalidateChannel;
+	/* publications already delivered to the local listeners, by topic and uid, with the time of the last one: their
+	 * echo from redis is skipped */
+	std::unordered_map<std::string, std::pair<int, time_t>> mLocalPublications;
+	static const int sLocalPublicationTtl = 10; /* in seconds, after which an echo is not awaited anymore */
+	void notifyPublished(const std::string &topic, const std::string &uid);
+	/* reconnection with backoff, the commands being kept until then within bounds */
+	typedef void (RegistrarDbRedisAsync::*SendFn)(RegistrarUserData *data);
+	struct PendingCommand {
+		RegistrarUserData *data;
+		SendFn send;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	int mReconnectMinDelay;
+	int mReconnectMaxDelay;
+	int mReconnectAttempts; /* since the connection was lost */
+	su_timer_t *mReconnectTimer;
+	bool mReconnectPending; /* mReconnectTimer is set */
+	size_t mOutageBufferSize;
+	int mOutageBufferTimeout;
+	bool mInOutage;
+	std::chrono::steady_clock::time_point mOutageStart;
+	std::deque<PendingCommand> mPendingCommands; /* oldest first */
+	su_timer_t *mPendingTimer;
+	StatCounter64 *mCountReconnections;
+	StatCounter64 *mCountOutageBuffered;
+	StatCounter64 *mCountOutageReplayed;
+	StatCounter64 *mCountOutageFailed;
+	static const int sMaxReplays = 2;
+	/* the large contacts are stored compressed, their expiry in clear for the bind script */
+	size_t mCompressionThreshold;
+	std::string serializeContact(const std::shared_ptr<ExtendedContact> &ec) const;
+	static const char *parseContact(const redisReply *element, std::string &decompressed);
 	/*std::list<RegistrarUserData*> mQueue;
 	bool mAddToQueue;*/
 
-	void serializeAndSendToRedis(RegistrarUserData *data, forwardFn *forward_fn);
+	bool serializeAndSendToRedis(redisAsyncContext *context, RegistrarUserData *data, forwardFn *forward_fn);
+	void sendBindTransaction(RegistrarUserData *data);
+	void sendBind(RegistrarUserData *data);
+	void sendBindScript(RegistrarUserData *data);
+	void loadBindScript(redisAsyncContext *context, bool learnSha);
+	void sendFetch(RegistrarUserData *data);
+	void sendClear(RegistrarUserData *data);
+	void onCommandQueued();
+	void holdWrites(int hold);
+	void flushBatch(bool full);
+	void notifyRecordUpdated(const std::string &key);
+	void handleInvalidation(const redisReply *keys);
 	bool handleRedisStatus(const std::string &desc, int redisStatus, RegistrarUserData *data);
 	void onErrorData(RegistrarUserData *data);
 	//void dequeueNextRedisCommand();
 
 	/* callbacks */
 	void handleAuthReply(const redisReply *reply);
+	void handleClientIdReply(const redisAsyncContext *ac, const redisReply *reply);
 	void handleBind(redisReply *reply, RegistrarUserData *data);
+	void handleBindScript(redisReply *reply, RegistrarUserData *data);
+	void handleBindScriptLoad(redisReply *reply);
 	void handleBindReplyAorSet(redisReply *reply, RegistrarUserData *data);
 	void handleClear(redisReply *reply, RegistrarUserData *data);
 	void handleFetch(redisReply *reply, RegistrarUserData *data);
 	void handleReplicationInfoReply(const char *str);
 	void handleMigration(redisReply *reply, RegistrarUserData *data);
 	void handleRecordMigration(redisReply *reply, RegistrarUserData *data);
+	void migrationTick();
+	void handleMigrationCursorReply(redisReply *reply);
+	void handleMigrationScanReply(redisReply *reply);
+	void aorFilterTick();
+	void aorFilterScanStep();
+	void resetAorFilter();
+	void addToAorFilter(const std::string &key);
+	bool rejectedByAorFilter(RegistrarUserData *data);
+	void handleAorFilterScanReply(redisReply *reply);
 	void onConnect(const redisAsyncContext *c, int status);
 	void onDisconnect(const redisAsyncContext *c, int status);
 	void onSubscribeConnect(const redisAsyncContext *c, int status);
 	void onSubscribeDisconnect(const redisAsyncContext *c, int status);
 
+	/* cluster */
+	redisAsyncContext *contextForKey(const std::string &redisKey);
+	redisAsyncContext *contextForData(RegistrarUserData *data);
+	int findClusterNode(const std::string &address, int port);
+	redisAsyncContext *connectClusterNode(int index);
+	void refreshClusterSlots();
+	void handleClusterSlotsReply(redisReply *reply);
+	bool handleClusterRedirection(const char *error, RegistrarUserData *data);
+	void onClusterNodeDisconnect(const redisAsyncContext *c, int status);
+
 	/* replication */
+	void updateReplicas();
+	redisAsyncContext *replicaContextForKey(const std::string &key);
+	redisAsyncContext *connectReplica(RedisReplica &replica);
+	void onReplicaDisconnect(const redisAsyncContext *c, int status);
+	void noteLocalWrite(const std::string &key);
 	void getReplicationInfo();
 	void updateSlavesList(const std::map<std::string, std::string> redisReply);
 	void tryReconnect();
+	void scheduleReconnect();
+	bool ensureConnected();
+	void bufferCommand(RegistrarUserData *data, SendFn send);
+	bool holdLostCommand(const redisAsyncContext *ac, RegistrarUserData *data, SendFn send);
+	void replayPendingCommands();
+	void expirePendingCommands(bool all);
 
 	/* static handlers */
 	//static void sHandleAorGetReply(struct redisAsyncContext *, void *r, void *privdata);
 	static void shandleAuthReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleClientIdReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleClientTrackingReply(redisAsyncContext *ac, void *r, void *privdata);
 	static void sHandleBind(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
+	static void sHandleBindScript(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
+	static void sHandleBindScriptLoad(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleBatchTimer(void *unused, su_timer_t *t, void *data);
 	static void sHandleClear(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
 	static void sHandleFetch(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
 	static void sHandleInfoTimer(void *unused, su_timer_t *t, void *data);
@@ -174,6 +464,19 @@ class RegistrarDbRedisAsync : public RegistrarDb {
 	static void sHandleSet(redisAsyncContext *ac, void *r, void *privdata);
 	static void sHandleMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
 	static void sHandleRecordMigration(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
+	static void sHandleMigrationTimer(void *unused, su_timer_t *t, void *data);
+	static void sHandleMigrationCursorReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleMigrationScanReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleAorFilterTimer(void *unused, su_timer_t *t, void *data);
+	static void sHandleReconnectTimer(void *unused, su_timer_t *t, void *data);
+	static void sHandlePendingTimer(void *unused, su_timer_t *t, void *data);
+	static void sHandleAorFilterScanReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sHandleQueued(redisAsyncContext *ac, redisReply *reply, RegistrarUserData *data);
+	static void sHandleClusterSlotsReply(redisAsyncContext *ac, void *r, void *privdata);
+	static void sClusterNodeConnectCallback(const redisAsyncContext *c, int status);
+	static void sClusterNodeDisconnectCallback(const redisAsyncContext *c, int status);
+	static void sReplicaConnectCallback(const redisAsyncContext *c, int status);
+	static void sReplicaDisconnectCallback(const redisAsyncContext *c, int status);
 };
 
 #endif
@@ -0,0 +1,421 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "registrardb-replication.hh"
+#include "common.hh"
+#include "log/logmanager.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <random>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Datagram format: the magic, then records until the end of the datagram, integers in network order.
+ *   'B' key(str) version(8) expiration(8) record(4 + n)   bind or clear of a key, the record being empty for a clear
+ *   'P' topic(str) uid(str)                                publication of a topic
+ *   'D' root(8) digests(8 x sBuckets)                      digests of the versions held by the sender
+ * with str a length(2) followed by the characters.
+ */
+static const char sMagic[4] = {'F', 'R', 'G', '1'};
+static const size_t sMaxDatagram = 1400;
+/* Largest UDP payload, for a record too large to share a datagram. */
+static const size_t sMaxLargeDatagram = 65507;
+/* Number of leaves of the hash tree, small enough for the digests to fit in a datagram. */
+static const size_t sBuckets = 128;
+
+/* FNV-1a 64 bits, for the digests to be the same on all the nodes whatever their build. */
+static uint64_t hash64(const string &value, uint64_t hash = 14695981039346656037ull) {
+	for (unsigned char c : value) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static size_t bucketOf(const string &key) {
+	return hash64(key) % sBuckets;
+}
+
+static uint64_t entryHash(const string &key, uint64_t version) {
+	uint64_t hash = hash64(key);
+	for (int i = 0; i < 8; ++i) {
+		hash ^= (version >> (8 * i)) & 0xff;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+RegistrarReplicator::RegistrarReplicator(su_root_t *root, ChangeFn onChange, LookupFn lookup, PublishFn onPublish)
+	: mRoot(root), mOnChange(onChange), mLookup(lookup), mOnPublish(onPublish), mSocket(-1), mWaitIndex(-1),
+	  mSyncTimer(NULL), mDigests(sBuckets, 0) {
+	random_device rd;
+	mNodeTag = (uint16_t)rd();
+}
+
+RegistrarReplicator::~RegistrarReplicator() {
+	if (mSyncTimer)
+		su_timer_destroy(mSyncTimer);
+	if (mWaitIndex != -1)
+		su_root_deregister(mRoot, mWaitIndex);
+	if (mSocket != -1)
+		close(mSocket);
+}
+
+bool RegistrarReplicator::start(int port, const list<string> &peers) {
+	int family = AF_UNSPEC;
+	for (const auto &name : peers) {
+		// host:port, [ipv6]:port, or a host alone for the same port as ours
+		string host = name;
+		string service;
+		size_t bracket = name.find(']');
+		size_t colon = name.rfind(':');
+		if (!name.empty() && name[0] == '[' && bracket != string::npos) {
+			host = name.substr(1, bracket - 1);
+			if (colon == bracket + 1)
+				service = name.substr(colon + 1);
+		} else if (colon != string::npos && name.find(':') == colon) {
+			host = name.substr(0, colon);
+			service = name.substr(colon + 1);
+		}
+		if (service.empty())
+			service = to_string(port);
+
+		struct addrinfo hints;
+		struct addrinfo *res = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = family;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_NUMERICSERV;
+		int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+		if (err != 0) {
+			LOGE("Cannot resolve the registrar replication peer %s: %s", name.c_str(), gai_strerror(err));
+			return false;
+		}
+		Peer peer;
+		peer.name = name;
+		memcpy(&peer.addr, res->ai_addr, res->ai_addrlen);
+		peer.addrLen = res->ai_addrlen;
+		// the peers share our socket, and thus the family of the first one
+		family = res->ai_family;
+		freeaddrinfo(res);
+		mPeers.push_back(peer);
+	}
+	if (mPeers.empty()) {
+		LOGE("No registrar replication peer");
+		return false;
+	}
+
+	mSocket = socket(family, SOCK_DGRAM, 0);
+	if (mSocket == -1) {
+		LOGE("Cannot create the registrar replication socket: %s", strerror(errno));
+		return false;
+	}
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) | O_NONBLOCK);
+	struct sockaddr_storage local;
+	socklen_t localLen;
+	memset(&local, 0, sizeof(local));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&local;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(port);
+		localLen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&local;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(port);
+		localLen = sizeof(*sin);
+	}
+	if (::bind(mSocket, (struct sockaddr *)&local, localLen) == -1) {
+		LOGE("Cannot bind the registrar replication socket to port %i: %s", port, strerror(errno));
+		return false;
+	}
+	su_wait_create(&mWait, mSocket, SU_WAIT_IN);
+	mWaitIndex = su_root_register(mRoot, &mWait, &RegistrarReplicator::sOnRead, this, su_pri_normal);
+	mSyncTimer = su_timer_create(su_root_task(mRoot), sSyncPeriod * 1000);
+	su_timer_set_for_ever(mSyncTimer, &RegistrarReplicator::sOnSync, this);
+	LOGI("Replicating the registrar records with %zu peers from port %i", mPeers.size(), port);
+	return true;
+}
+
+static void writeInt(string &out, uint64_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; --i)
+		out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void writeString(string &out, const string &value) {
+	size_t length = min(value.size(), (size_t)65535);
+	writeInt(out, length, 2);
+	out.append(value, 0, length);
+}
+
+static void writeChange(string &out, const string &key, uint64_t version, time_t expireAt, const string &record) {
+	out.push_back('B');
+	writeString(out, key);
+	writeInt(out, version, 8);
+	writeInt(out, (uint64_t)expireAt, 8);
+	writeInt(out, record.size(), 4);
+	out.append(record);
+}
+
+void RegistrarReplicator::send(const Peer &peer, const string &datagram) {
+	if (datagram.size() > sMaxLargeDatagram) {
+		LOGE("Registrar replication datagram of %zu bytes too large, not sent", datagram.size());
+		return;
+	}
+	if (sendto(mSocket, datagram.data(), datagram.size(), 0, (struct sockaddr *)&peer.addr, peer.addrLen) == -1)
+		LOGD("Cannot send to the registrar replication peer %s: %s", peer.name.c_str(), strerror(errno));
+}
+
+void RegistrarReplicator::sendToAll(const string &datagram) {
+	for (const auto &peer : mPeers)
+		send(peer, datagram);
+}
+
+void RegistrarReplicator::setEntry(const string &key, uint64_t version, time_t expireAt) {
+	uint64_t &digest = mDigests[bucketOf(key)];
+	auto it = mEntries.find(key);
+	if (it != mEntries.end()) {
+		digest ^= entryHash(key, it->second.version);
+		it->second = Entry{version, expireAt};
+	} else {
+		mEntries[key] = Entry{version, expireAt};
+	}
+	digest ^= entryHash(key, version);
+}
+
+void RegistrarReplicator::eraseEntry(unordered_map<string, Entry>::iterator it) {
+	mDigests[bucketOf(it->first)] ^= entryHash(it->first, it->second.version);
+	mEntries.erase(it);
+}
+
+/* The versions are milliseconds since the epoch followed by the tag of the node, increased if needed so that the
+ * versions of a key keep growing when the clocks of the nodes differ. */
+void RegistrarReplicator::change(const string &key, const string &record, time_t expireAt) {
+	uint64_t now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	uint64_t version = (now << 16) | mNodeTag;
+	auto it = mEntries.find(key);
+	if (it != mEntries.end() && it->second.version >= version)
+		version = it->second.version + 1;
+	setEntry(key, version, expireAt);
+
+	string datagram(sMagic, sizeof(sMagic));
+	writeChange(datagram, key, version, expireAt, record);
+	sendToAll(datagram);
+}
+
+void RegistrarReplicator::publish(const string &topic, const string &uid) {
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('P');
+	writeString(datagram, topic);
+	writeString(datagram, uid);
+	sendToAll(datagram);
+}
+
+/* Forgets the expired keys, then sends the digests to the peers. */
+void RegistrarReplicator::sync() {
+	time_t now = getCurrentTime();
+	for (auto it = mEntries.begin(); it != mEntries.end();) {
+		if (it->second.expireAt <= now)
+			eraseEntry(it++);
+		else
+			++it;
+	}
+	uint64_t root = 0;
+	for (uint64_t digest : mDigests)
+		root ^= digest;
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('D');
+	writeInt(datagram, root, 8);
+	for (uint64_t digest : mDigests)
+		writeInt(datagram, digest, 8);
+	sendToAll(datagram);
+}
+
+/* Sends the records of the given buckets, as the changes they were. */
+void RegistrarReplicator::sendBuckets(const Peer &peer, const vector<bool> &buckets) {
+	string datagram(sMagic, sizeof(sMagic));
+	string record;
+	size_t count = 0;
+	for (const auto &entry : mEntries) {
+		if (!buckets[bucketOf(entry.first)])
+			continue;
+		record.clear();
+		mLookup(entry.first, record);
+		size_t start = datagram.size();
+		writeChange(datagram, entry.first, entry.second.version, entry.second.expireAt, record);
+		++count;
+		if (datagram.size() > sMaxDatagram && start > sizeof(sMagic)) {
+			// the change goes to the next datagram
+			string change = datagram.substr(start);
+			datagram.resize(start);
+			send(peer, datagram);
+			datagram.assign(sMagic, sizeof(sMagic));
+			datagram += change;
+		}
+	}
+	if (datagram.size() > sizeof(sMagic))
+		send(peer, datagram);
+	LOGD("Sent %zu records to the registrar replication peer %s", count, peer.name.c_str());
+}
+
+namespace {
+
+/* Reads the records of a datagram, stopping at the first one that does not fit. */
+class DatagramReader {
+  public:
+	DatagramReader(const uint8_t *data, size_t size) : mData(data), mSize(size), mValid(true) {
+	}
+	bool valid() const {
+		return mValid;
+	}
+	bool atEnd() const {
+		return mSize == 0;
+	}
+	uint64_t readInt(int bytes) {
+		uint64_t value = 0;
+		if (!check(bytes))
+			return 0;
+		for (int i = 0; i < bytes; ++i)
+			value = (value << 8) | mData[i];
+		skip(bytes);
+		return value;
+	}
+	string readBytes(size_t length) {
+		if (!check(length))
+			return string();
+		string value((const char *)mData, length);
+		skip(length);
+		return value;
+	}
+	string readString() {
+		return readBytes(readInt(2));
+	}
+
+  private:
+	bool check(size_t bytes) {
+		if (mSize < bytes)
+			mValid = false;
+		return mValid;
+	}
+	void skip(size_t bytes) {
+		mData += bytes;
+		mSize -= bytes;
+	}
+	const uint8_t *mData;
+	size_t mSize;
+	bool mValid;
+};
+
+} // namespace
+
+void RegistrarReplicator::parse(const Peer &peer, const uint8_t *data, size_t size) {
+	if (size < sizeof(sMagic) || memcmp(data, sMagic, sizeof(sMagic)) != 0) {
+		LOGW("Invalid datagram from the registrar replication peer %s", peer.name.c_str());
+		return;
+	}
+	time_t now = getCurrentTime();
+	DatagramReader reader(data + sizeof(sMagic), size - sizeof(sMagic));
+	while (reader.valid() && !reader.atEnd()) {
+		int type = (int)reader.readInt(1);
+		if (type == 'B') {
+			string key = reader.readString();
+			uint64_t version = reader.readInt(8);
+			time_t expireAt = (time_t)reader.readInt(8);
+			string record = reader.readBytes(reader.readInt(4));
+			if (!reader.valid())
+				break;
+			// an expired key would come back after being forgotten
+			auto it = mEntries.find(key);
+			if (expireAt <= now || (it != mEntries.end() && it->second.version >= version))
+				continue;
+			setEntry(key, version, expireAt);
+			mOnChange(key, record);
+		} else if (type == 'P') {
+			string topic = reader.readString();
+			string uid = reader.readString();
+			if (reader.valid())
+				mOnPublish(topic, uid);
+		} else if (type == 'D') {
+			uint64_t root = reader.readInt(8);
+			vector<bool> differing(sBuckets, false);
+			for (size_t i = 0; i < sBuckets; ++i)
+				differing[i] = reader.readInt(8) != mDigests[i];
+			if (!reader.valid())
+				break;
+			uint64_t ourRoot = 0;
+			for (uint64_t digest : mDigests)
+				ourRoot ^= digest;
+			// the peer sends us its own records when it receives our digests
+			if (root != ourRoot)
+				sendBuckets(peer, differing);
+		} else {
+			LOGW("Unknown record in a datagram from the registrar replication peer %s", peer.name.c_str());
+			break;
+		}
+	}
+}
+
+/* The peers send from the port they listen on, so that several nodes may share a host. */
+static bool sameAddress(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+	if (a.ss_family != b.ss_family)
+		return false;
+	if (a.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)&a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)&b;
+		return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+	}
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *)&a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *)&b;
+	return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+void RegistrarReplicator::onRead() {
+	static uint8_t buffer[65536];
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		ssize_t size = recvfrom(mSocket, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &fromLen);
+		if (size < 0)
+			break;
+		auto peer = find_if(mPeers.begin(), mPeers.end(), [&](const Peer &p) { return sameAddress(from, p.addr); });
+		if (peer == mPeers.end()) {
+			LOGW("Ignoring a registrar replication datagram from an address which is not a peer");
+			continue;
+		}
+		parse(*peer, buffer, size);
+	}
+}
+
+void RegistrarReplicator::sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	static_cast<RegistrarReplicator *>(arg)->onRead();
+}
+
+void RegistrarReplicator::sOnSync(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<RegistrarReplicator *>(arg)->sync();
+}
@@ -0,0 +1,99 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef registrardb_replication_hh
+#define registrardb_replication_hh
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+
+#include <sofia-sip/su_wait.h>
+
+/*
+ * Replicates the records of the internal registrar between the nodes of a small cluster, each node keeping all of them
+ * in memory.
+ * Each bind or clear is sent at once to the peers, as a UDP datagram holding the key, a version and the serialized
+ * record: the highest version of a key wins. Every few seconds, each node also sends to its peers the digests of the
+ * versions it holds, as a two-level hash tree. A peer whose root differs sends back the records of the buckets whose
+ * digests differ, so that the nodes converge again after a partition or a lost datagram.
+ * SIP thread only.
+ */
+class RegistrarReplicator {
+  public:
+	/* record is the serialized record of key, empty when the key was cleared. */
+	typedef std::function<void(const std::string &key, const std::string &record)> ChangeFn;
+	/* Serializes the current record of key, returns false if there is none. */
+	typedef std::function<bool(const std::string &key, std::string &record)> LookupFn;
+	typedef std::function<void(const std::string &topic, const std::string &uid)> PublishFn;
+	/* Seconds between two exchanges of digests. */
+	static const int sSyncPeriod = 10;
+
+	/* Calls onChange with the records changed by the peers, and onPublish with the topics they publish. */
+	RegistrarReplicator(su_root_t *root, ChangeFn onChange, LookupFn lookup, PublishFn onPublish);
+	~RegistrarReplicator();
+	/* Listens on the given UDP port for the datagrams of the peers, each one given as host:port. */
+	bool start(int port, const std::list<std::string> &peers);
+	/* Sends a local bind or clear of key to the peers. expireAt is the latest expiration of the contacts of the record,
+	 * or of the cleared one, after which the key is forgotten. */
+	void change(const std::string &key, const std::string &record, time_t expireAt);
+	void publish(const std::string &topic, const std::string &uid);
+
+  private:
+	struct Peer {
+		std::string name;
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+	};
+	struct Entry {
+		uint64_t version;
+		time_t expireAt;
+	};
+	static void sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	static void sOnSync(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onRead();
+	void sync();
+	void send(const Peer &peer, const std::string &datagram);
+	void sendToAll(const std::string &datagram);
+	void setEntry(const std::string &key, uint64_t version, time_t expireAt);
+	void eraseEntry(std::unordered_map<std::string, Entry>::iterator it);
+	void sendBuckets(const Peer &peer, const std::vector<bool> &buckets);
+	void parse(const Peer &peer, const uint8_t *data, size_t size);
+
+	su_root_t *mRoot;
+	ChangeFn mOnChange;
+	LookupFn mLookup;
+	PublishFn mOnPublish;
+	int mSocket;
+	su_wait_t mWait;
+	int mWaitIndex;
+	su_timer_t *mSyncTimer;
+	std::vector<Peer> mPeers;
+	/* low bits of the versions of this node, so that two nodes never issue the same version for a key */
+	uint16_t mNodeTag;
+	std::unordered_map<std::string, Entry> mEntries;
+	std::vector<uint64_t> mDigests; /* per bucket, xor of the hashes of its keys and versions */
+};
+
+#endif
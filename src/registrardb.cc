@@ -29,15 +29,54 @@
 #include <ostream>
 #include <ctime>
 #include <cstdio>
+#include <strings.h>
 #include <algorithm>
 #include <iomanip>
+#include <unordered_map>
+#include <chrono>
 
 #include <sofia-sip/sip_protos.h>
 #include "recordserializer.hh"
+#include "tracing.hh"
 #include "module.hh"
 
 using namespace std;
 
+shared_ptr<const list<string>> SharedStringList::intern(const list<string> &strings) {
+	static const shared_ptr<const list<string>> sEmpty = make_shared<const list<string>>();
+	static unordered_map<string, weak_ptr<const list<string>>> sPool;
+	static size_t sPurgeThreshold = 1024;
+	static mutex sMutex;
+
+	if (strings.empty())
+		return sEmpty;
+
+	string key;
+	for (auto it = strings.cbegin(); it != strings.cend(); ++it) {
+		key += *it;
+		key += '\n';
+	}
+
+	lock_guard<mutex> lock(sMutex);
+	auto &entry = sPool[key];
+	shared_ptr<const list<string>> shared = entry.lock();
+	if (!shared) {
+		shared = make_shared<const list<string>>(strings);
+		entry = shared;
+	}
+	// Drop the values no longer used by any contact once in a while
+	if (sPool.size() > sPurgeThreshold) {
+		for (auto it = sPool.begin(); it != sPool.end();) {
+			if (it->second.expired())
+				it = sPool.erase(it);
+			else
+				++it;
+		}
+		sPurgeThreshold = max((size_t)1024, sPool.size() * 2);
+	}
+	return shared;
+}
+
 ostream &ExtendedContact::print(std::ostream &stream, time_t _now, time_t _offset) const {
 	time_t now = _now;
 	time_t offset = _offset;
@@ -72,10 +111,11 @@ void ExtendedContact::transferRegId(const std::shared_ptr<ExtendedContact> &oldE
 			std::strtoull(strRegid, NULL, 16) != oldEc->mRegId)
 		) {
 		std::ostringstream os;
-		url_t *sipUri = url_hdup(this->mHome.home(), this->mSipUri);
+		SofiaAutoHome home;
+		url_t *sipUri = url_hdup(home.home(), this->mSipUri);
 		os << "regid=" << std::hex << oldEc->mRegId;
-		sipUri->url_params = url_strip_param_string(su_strdup(this->mHome.home(), this->mSipUri->url_params), "regid");
-		url_param_add(this->mHome.home(), sipUri, os.str().c_str());
+		sipUri->url_params = url_strip_param_string(su_strdup(home.home(), this->mSipUri->url_params), "regid");
+		url_param_add(home.home(), sipUri, os.str().c_str());
 		this->setSipUri(sipUri);
 		this->mRegId = oldEc->mRegId;
 	}
@@ -121,19 +161,122 @@ sip_route_t *ExtendedContact::toSofiaRoute(su_home_t *home) const {
 	return rbegin;
 }
 
+struct Record::ContactsCache {
+	struct Entry {
+		std::shared_ptr<ExtendedContact> contact; // the contacts are replaced rather than modified when updated
+		sip_contact_t *header;
+		unsigned int generation;
+	};
+	SofiaAutoHome home;
+	unordered_map<const ExtendedContact *, Entry> entries;
+	unsigned int generation = 0;
+};
+
+struct Record::ContactsIndex {
+	typedef std::list<std::shared_ptr<ExtendedContact>>::iterator Position;
+	unordered_multimap<string, Position> byUniqueId;
+	unordered_multimap<string, Position> byCallId; // of the contacts without unique id
+	multimap<time_t, Position> byUpdatedTime;	   // the equal times in the order of the contacts
+	time_t earliestExpire = numeric_limits<time_t>::max();
+
+	void add(Position position) {
+		const ExtendedContact &ec = **position;
+		if (!ec.mUniqueId.empty())
+			byUniqueId.emplace(ec.mUniqueId, position);
+		else
+			byCallId.emplace(ec.mCallId, position);
+		byUpdatedTime.emplace_hint(byUpdatedTime.end(), ec.mUpdatedTime, position);
+		earliestExpire = min(earliestExpire, ec.mExpireAt);
+	}
+	template <typename _Map, typename _Key> static void remove(_Map &map, const _Key &key, Position position) {
+		auto range = map.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == position) {
+				map.erase(it);
+				return;
+			}
+		}
+	}
+	/* The positions of the contacts of the given key. */
+	static vector<Position> find(const unordered_multimap<string, Position> &map, const string &key) {
+		vector<Position> positions;
+		auto range = map.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it)
+			positions.push_back(it->second);
+		return positions;
+	}
+};
+
+/* The Contact header of toSofiaContact(), but the expires parameter. */
+static sip_contact_t *createContactWithoutExpires(su_home_t *home, const ExtendedContact &ec) {
+	if (ec.mQ != 0.f)
+		return sip_contact_create(home, (url_string_t *)ec.mSipUri, NULL);
+	ostringstream oss;
+	oss.setf(ios::fixed, ios::floatfield);
+	oss << std::setprecision(2) << std::setw(4);
+	oss << "q=" << ec.mQ;
+	return sip_contact_create(home, (url_string_t *)ec.mSipUri, oss.str().c_str(), NULL);
+}
+
 const sip_contact_t *Record::getContacts(su_home_t *home, time_t now) {
 	sip_contact_t *alist = NULL;
+	materialize();
+	if (!mContactsCache)
+		mContactsCache.reset(new ContactsCache());
+	ContactsCache &cache = *mContactsCache;
+	unsigned int generation = ++cache.generation;
 	for (auto it = mContacts.begin(); it != mContacts.end(); ++it) {
-		sip_contact_t *current = (*it)->toSofiaContact(home, now);
-		if (current && alist) {
+		time_t expire = (*it)->mExpireAt - now;
+		if (expire <= 0)
+			continue;
+		ContactsCache::Entry &entry = cache.entries[it->get()];
+		if (!entry.contact) {
+			// duplicated in a single block, to be freed alone
+			SofiaAutoHome tmp;
+			entry.contact = *it;
+			entry.header = sip_contact_dup(cache.home.home(), createContactWithoutExpires(tmp.home(), **it));
+		}
+		entry.generation = generation;
+		if (!entry.header)
+			continue;
+
+		// shallow copy of the cached header, with its own parameters: expires first, as added by toSofiaContact()
+		sip_contact_t *current = (sip_contact_t *)msg_header_copy_one(home, (msg_header_t *)entry.header);
+		if (!current)
+			continue;
+		size_t count = 0;
+		while (entry.header->m_params && entry.header->m_params[count])
+			++count;
+		msg_param_t *params = (msg_param_t *)su_zalloc(home, (count + 2) * sizeof(msg_param_t));
+		params[0] = su_sprintf(home, "expires=%ld", (long)expire);
+		for (size_t i = 0; i < count; ++i)
+			params[i + 1] = entry.header->m_params[i];
+		current->m_params = params;
+		current->m_expires = params[0] + strlen("expires=");
+		current->m_next = NULL;
+		msg_fragment_clear(current->m_common);
+
+		if (alist) {
 			current->m_next = alist;
 		}
 		alist = current;
 	}
+	// the headers of the contacts gone
+	if (cache.entries.size() > mContacts.size()) {
+		for (auto it = cache.entries.begin(); it != cache.entries.end();) {
+			if (it->second.generation != generation) {
+				su_free(cache.home.home(), it->second.header);
+				it = cache.entries.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
 	return alist;
 }
 
 bool Record::isInvalidRegister(const std::string &call_id, uint32_t cseq) {
+	materialize();
 	for (auto it = mContacts.begin(); it != mContacts.end(); ++it) {
 		shared_ptr<ExtendedContact> ec = (*it);
 		if ((0 == strcmp(ec->callId(), call_id.c_str())) && cseq <= ec->mCSeq) {
@@ -161,7 +304,20 @@ string Record::extractUniqueId(const sip_contact_t *contact) {
 }
 
 const shared_ptr<ExtendedContact> Record::extractContactByUniqueId(std::string uid) {
-	const auto contacts = getExtendedContacts();
+	// the field of a contact in the database is its unique id when it has one, parse only that contact
+	for (auto it = mSerializedContacts.begin(); it != mSerializedContacts.end(); ++it) {
+		if (it->uid == uid) {
+			SerializedContact contact = *it;
+			mSerializedContacts.erase(it);
+			parseUrlEncodedParams(mKey.c_str(), contact.uid.c_str(), contact.url.c_str());
+			break;
+		}
+	}
+	if (mContactsIndex) {
+		auto it = mContactsIndex->byUniqueId.find(uid);
+		return it != mContactsIndex->byUniqueId.end() ? *it->second : shared_ptr<ExtendedContact>();
+	}
+	const auto &contacts = mContacts;
 	for (auto it = contacts.begin(); it != contacts.end(); ++it) {
 		const shared_ptr<ExtendedContact> ec = *it;
 		if (ec && ec->mUniqueId.compare(uid) == 0) {
@@ -211,13 +367,20 @@ const shared_ptr<ExtendedContact> Record::extractContactByUniqueId(std::string u
  * Should first have checked the validity of the register with isValidRegister.
  */
 void Record::clean(time_t now, const std::shared_ptr<ContactUpdateListener> &listener) {
+	// the listener is given the expired contacts, which must be parsed
+	if (any_of(mSerializedContacts.begin(), mSerializedContacts.end(),
+			   [now](const SerializedContact &contact) { return now >= contact.expireAt; }))
+		materialize();
 	auto it = mContacts.begin();
 	while (it != mContacts.end()) {
 		shared_ptr<ExtendedContact> ec = (*it);
 		if (now >= ec->mExpireAt) {
 			if (listener)
 				listener->onContactUpdated(ec);
-			it = mContacts.erase(it);
+			if (mContactsIndex)
+				eraseIndexedContact(it++);
+			else
+				it = mContacts.erase(it);
 		} else {
 			++it;
 		}
@@ -230,11 +393,16 @@ time_t Record::latestExpire() const {
 		if ((*it)->mExpireAt > latest)
 			latest = (*it)->mExpireAt;
 	}
+	for (const auto &contact : mSerializedContacts) {
+		if (contact.expireAt > latest)
+			latest = contact.expireAt;
+	}
 	return latest;
 }
 
 time_t Record::latestExpire(const std::string &route) const {
 	time_t latest = 0;
+	materialize();
 	for (auto it = mContacts.begin(); it != mContacts.end(); ++it) {
 		if ((*it)->mPath.empty() || (*it)->mExpireAt <= latest)
 			continue;
@@ -267,46 +435,67 @@ string Record::defineKeyFromUrl(const url_t *url) {
 	return ostr.str();
 }
 
+void Record::buildContactsIndex(time_t now) {
+	mContactsIndex.reset(new ContactsIndex());
+	for (auto it = mContacts.begin(); it != mContacts.end();) {
+		if (now >= (*it)->mExpireAt) {
+			SLOGD << "Cleaning expired contact " << (*it)->mContactId;
+			it = mContacts.erase(it);
+		} else {
+			mContactsIndex->add(it++);
+		}
+	}
+}
+
+void Record::eraseIndexedContact(std::list<std::shared_ptr<ExtendedContact>>::iterator position) {
+	const ExtendedContact &ec = **position;
+	if (!ec.mUniqueId.empty())
+		ContactsIndex::remove(mContactsIndex->byUniqueId, ec.mUniqueId, position);
+	else
+		ContactsIndex::remove(mContactsIndex->byCallId, ec.mCallId, position);
+	ContactsIndex::remove(mContactsIndex->byUpdatedTime, ec.mUpdatedTime, position);
+	mContacts.erase(position);
+}
+
 void Record::insertOrUpdateBinding(const shared_ptr<ExtendedContact> &ec, const std::shared_ptr<ContactUpdateListener> &listener) {
-	// Try to locate an existing contact
-	shared_ptr<ExtendedContact> olderEc;
 	time_t now = getCurrentTime();
 
 	SLOGD << "Trying to insert new contact " << *ec;
 
 	if (sAssumeUniqueDomains && mIsDomain){
 		mContacts.clear();
+		mContactsIndex.reset();
 	}
-	for (auto it = mContacts.begin(); it != mContacts.end();) {
-		if (now >= (*it)->mExpireAt) {
-			SLOGD << "Cleaning expired contact " << (*it)->mContactId;
-			it = mContacts.erase(it);
-		} else if (!(*it)->mUniqueId.empty() && (*it)->mUniqueId == ec->mUniqueId) {
-			SLOGD << "Cleaning older line '" << ec->mUniqueId << "' for contact " << (*it)->mContactId;
-			ec->transferRegId((*it));
-			if (listener) listener->onContactUpdated(*it);
-			it = mContacts.erase(it);
-		} else if ((*it)->mUniqueId.empty() && (*it)->callId() && (*it)->mCallId == ec->mCallId) {
-			/*we don't accept to clean a contact from call-id if the unique id was set previously*/
-			SLOGD << "Cleaning same call id contact " << (*it)->mContactId << "(" << ec->mCallId << ")";
-			ec->transferRegId((*it));
-			if (listener) listener->onContactUpdated(*it);
-			it = mContacts.erase(it);
-		} else if (!olderEc || olderEc->mUpdatedTime > (*it)->mUpdatedTime) {
-			olderEc = (*it);
-			++it;
-		} else {
-			++it;
-		}
+	// the expired contacts are cleaned by the rebuild, once one of them is
+	if (!mContactsIndex || now >= mContactsIndex->earliestExpire)
+		buildContactsIndex(now);
+
+	// Try to locate an existing contact
+	vector<ContactsIndex::Position> replaced;
+	if (!ec->mUniqueId.empty())
+		replaced = ContactsIndex::find(mContactsIndex->byUniqueId, ec->mUniqueId);
+	for (auto position : replaced) {
+		SLOGD << "Cleaning older line '" << ec->mUniqueId << "' for contact " << (*position)->mContactId;
+		ec->transferRegId(*position);
+		if (listener) listener->onContactUpdated(*position);
+		eraseIndexedContact(position);
+	}
+	/*we don't accept to clean a contact from call-id if the unique id was set previously*/
+	for (auto position : ContactsIndex::find(mContactsIndex->byCallId, ec->mCallId)) {
+		SLOGD << "Cleaning same call id contact " << (*position)->mContactId << "(" << ec->mCallId << ")";
+		ec->transferRegId(*position);
+		if (listener) listener->onContactUpdated(*position);
+		eraseIndexedContact(position);
 	}
 
 	// If contact doesn't exist and there is space left
-	if (mContacts.size() < (unsigned int)sMaxContacts) {
-		mContacts.push_back(ec);
-	} else if (olderEc){ // no space
-		mContacts.remove(olderEc);
-		mContacts.push_back(ec);
+	if (mContacts.size() >= (unsigned int)sMaxContacts) {
+		if (mContacts.empty())
+			return;
+		// no space, the oldest is evicted
+		eraseIndexedContact(mContactsIndex->byUpdatedTime.begin()->second);
 	}
+	mContactsIndex->add(mContacts.insert(mContacts.end(), ec));
 }
 
 static void defineContactId(ostringstream &oss, const url_t *url, const char *transport) {
@@ -319,7 +508,7 @@ static void defineContactId(ostringstream &oss, const url_t *url, const char *tr
 		oss << ":" << url->url_port;
 }
 
-static uint64_t setAndGetRegid(url_t *url, SofiaAutoHome *home) {
+static uint64_t setAndGetRegid(url_t *url, su_home_t *home) {
 	char strRegid[32] = {0};
 	uint64_t regId;
 	if (url_param(url->url_params, "regid", strRegid, sizeof(strRegid) - 1) > 0) {
@@ -328,215 +517,286 @@ static uint64_t setAndGetRegid(url_t *url, SofiaAutoHome *home) {
 		ostringstream os;
 		regId = su_random64();
 		os << "regid=" << hex << regId;
-		url_param_add(home->home(), url, os.str().c_str());
+		url_param_add(home, url, os.str().c_str());
 	}
 	return regId;
 }
 
-string ExtendedContact::serializeAsUrlEncodedParams() {
-	url_t *url = url_hdup(mHome.home(), mSipUri);
-
-	// CallId
-	ostringstream oss;
-	oss << "callid=" << mCallId;
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// Q
-	/*if (mQ == 0.f) {
-		oss.str("");
-		oss.clear();
-		oss << "q=" << mQ;
-		url_param_add(mHome.home(), url, oss.str().c_str());
-	}*/
-
-	// Expire
-	oss.str("");
-	oss.clear();
-	time_t expire = mExpireAt - getCurrentTime();
-	oss << "expires=" << expire;
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// CSeq
-	oss.str("");
-	oss.clear();
-	oss << "cseq=" << mCSeq;
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// Updated at
-	oss.str("");
-	oss.clear();
-	oss << "updatedAt=" << mUpdatedTime;
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// Alias
-	oss.str("");
-	oss.clear();
-	oss << "alias=" << (mAlias ? "yes" : "no");
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// Used as route
-	oss.str("");
-	oss.clear();
-	oss << "usedAsRoute=" << (mUsedAsRoute ? "yes" : "no");
-	url_param_add(mHome.home(), url, oss.str().c_str());
-
-	// Path
-	//sip_path_t *path = path_fromstl(mHome.home(), mPath);
-	ostringstream oss_path;
-	for (auto it = mPath.begin(); it != mPath.end(); ++it) {
-		if (it != mPath.begin()) oss_path << ",";
-		oss_path << *it;
-	}
-
-	// AcceptHeaders
-	//sip_accept_t *accept = accept_fromstl(mHome.home(), mAcceptHeader);
-	ostringstream oss_accept;
-	for (auto it = mAcceptHeader.begin(); it != mAcceptHeader.end(); ++it) {
-		if (it != mAcceptHeader.begin()) oss_accept << ",";
-		oss_accept << *it;
+static uint64_t setAndGetRegid(ExtendedContact &ec) {
+	char strRegid[32] = {0};
+	if (url_param(ec.mSipUri->url_params, "regid", strRegid, sizeof(strRegid) - 1) > 0) {
+		return std::strtoull(strRegid, NULL, 16);
 	}
-
-	url->url_headers = sip_headers_as_url_query(mHome.home(), 
-		/*SIPTAG_PATH(path), SIPTAG_ACCEPT(accept),*/
-		SIPTAG_PATH_STR(oss_path.str().c_str()), SIPTAG_ACCEPT_STR(oss_accept.str().c_str()), 
-		TAG_END());
-
-	return ExtendedContact::urlToString(url);
+	SofiaAutoHome home;
+	url_t *url = url_hdup(home.home(), ec.mSipUri);
+	uint64_t regId = setAndGetRegid(url, home.home());
+	ec.setSipUri(url);
+	return regId;
 }
 
-static string getStringParam(url_t *url, const char *param) {
-	string extracted_param;
-	if (url_has_param(url, param)) {
-		char *buffer = new char[255];
-		isize_t result = url_param(url->url_params, param, buffer, 255);
-		if (result > 0) {
-			extracted_param = string(buffer);
+/* Appends the value of a header of the query of a url, escaped. */
+static void appendEscapedHeader(string &out, const char *name, const SharedStringList &values) {
+	static const char sHex[] = "0123456789ABCDEF";
+	if (values.empty())
+		return;
+	out += out.find('?') == string::npos ? '?' : '&';
+	out += name;
+	out += '=';
+	for (auto it = values.begin(); it != values.end(); ++it) {
+		if (it != values.begin())
+			out += ',';
+		for (const char *c = it->c_str(); *c; ++c) {
+			if (isalnum((unsigned char)*c) || strchr("-_.!~*'():@/", *c)) {
+				out += *c;
+			} else {
+				out += '%';
+				out += sHex[(unsigned char)*c >> 4];
+				out += sHex[*c & 0xf];
+			}
 		}
-		url->url_params = url_strip_param_string((char *)url->url_params, param);
-		delete[] buffer;
 	}
-	return extracted_param;
 }
 
-static int getIntParam(url_t *url, const char *param) {
-	int extracted_param = 0;
-	if (url_has_param(url, param)) {
-		char *buffer = new char[255];
-		isize_t result = url_param(url->url_params, param, buffer, 255);
-		if (result > 0) {
-			extracted_param = atoi(buffer);
-		}
-		url->url_params = url_strip_param_string((char *)url->url_params, param);
-		delete[] buffer;
+/* The contact uri followed by the fields of the contact as parameters, and its path and accept headers as headers, the
+ * way url_param_add() and sip_headers_as_url_query() used to build it: built directly into a string, the uri being
+ * only formatted once. */
+string ExtendedContact::serializeAsUrlEncodedParams() {
+	url_t uri = *mSipUri;
+	uri.url_headers = NULL;
+	uri.url_fragment = NULL;
+	char buffer[512];
+	isize_t len = url_e(buffer, sizeof(buffer), &uri);
+	string out;
+	if (len < (isize_t)sizeof(buffer)) {
+		out.reserve(len + 128);
+		out.assign(buffer, len);
+	} else {
+		out.resize(len + 1);
+		url_e(&out[0], len + 1, &uri);
+		out.resize(len);
+	}
+
+	out += ";callid=";
+	out += mCallId;
+	out += ";expires=";
+	out += to_string(mExpireAt - getCurrentTime());
+	out += ";cseq=";
+	out += to_string(mCSeq);
+	out += ";updatedAt=";
+	out += to_string(mUpdatedTime);
+	out += mAlias ? ";alias=yes" : ";alias=no";
+	out += mUsedAsRoute ? ";usedAsRoute=yes" : ";usedAsRoute=no";
+
+	appendEscapedHeader(out, "path", mPath);
+	appendEscapedHeader(out, "accept", mAcceptHeader);
+	if (mSipUri->url_fragment) {
+		out += '#';
+		out += mSipUri->url_fragment;
+	}
+	return out;
+}
+
+/* A contact serialized by ExtendedContact::serializeAsUrlEncodedParams(), split in a single pass. The first
+ * occurrence of each field is taken out of the parameters of the uri, as url_param() and url_strip_param_string()
+ * used to. */
+struct UrlEncodedContact {
+	string uri;
+	string callId;
+	int expires = 0;
+	unsigned long updatedAt = 0;
+	uint32_t cseq = 0;
+	bool alias = false;
+	bool usedAsRoute = false;
+	list<string> path;
+	list<string> accept;
+
+	UrlEncodedContact(const char *serialized);
+
+  private:
+	bool takeField(const char *param, size_t len);
+	static void splitHeader(const char *value, size_t len, list<string> &values);
+	unsigned int mTaken = 0;
+};
+
+UrlEncodedContact::UrlEncodedContact(const char *serialized) {
+	const char *end = serialized + strlen(serialized);
+	const char *query = strchr(serialized, '?');
+	const char *fragment = strchr(query ? query : serialized, '#');
+	const char *uriEnd = query ? query : fragment ? fragment : end;
+	const char *queryEnd = fragment ? fragment : end;
+
+	// the parameters follow the host, the user part possibly holding semicolons, and the call-id, always the first of
+	// the fields, at signs
+	const char *callId = strstr(serialized, ";callid=");
+	const char *userEnd = callId && callId < uriEnd ? callId : uriEnd;
+	const char *host = static_cast<const char *>(memchr(serialized, '@', userEnd - serialized));
+	if (!host)
+		host = serialized;
+	const char *params = static_cast<const char *>(memchr(host, ';', uriEnd - host));
+	if (!params)
+		params = uriEnd;
+	uri.reserve(uriEnd - serialized);
+	uri.assign(serialized, params);
+	while (params < uriEnd) {
+		const char *param = params + 1;
+		params = static_cast<const char *>(memchr(param, ';', uriEnd - param));
+		if (!params)
+			params = uriEnd;
+		if (!takeField(param, params - param))
+			uri.append(param - 1, params);
+	}
+
+	for (const char *header = query; header && header < queryEnd;) {
+		const char *name = header + 1;
+		header = static_cast<const char *>(memchr(name, '&', queryEnd - name));
+		if (!header)
+			header = queryEnd;
+		const char *value = static_cast<const char *>(memchr(name, '=', header - name));
+		if (!value)
+			continue;
+		size_t nameLen = value - name;
+		++value;
+		if (nameLen == 4 && strncasecmp(name, "path", 4) == 0)
+			splitHeader(value, header - value, path);
+		else if (nameLen == 6 && strncasecmp(name, "accept", 6) == 0)
+			splitHeader(value, header - value, accept);
 	}
-	return extracted_param;
+
+	if (fragment)
+		uri.append(fragment, end);
 }
 
-static int getUnsignedLongParam(url_t *url, const char *param) {
-	unsigned long extracted_param = 0;
-	if (url_has_param(url, param)) {
-		char *buffer = new char[255];
-		isize_t result = url_param(url->url_params, param, buffer, 255);
-		if (result > 0) {
-			extracted_param = (unsigned long) atoll(buffer);
-		}
-		url->url_params = url_strip_param_string((char *)url->url_params, param);
-		delete[] buffer;
+bool UrlEncodedContact::takeField(const char *param, size_t len) {
+	static const char *const sFields[] = {"callid", "expires", "updatedAt", "cseq", "alias", "usedAsRoute"};
+	const char *value = static_cast<const char *>(memchr(param, '=', len));
+	size_t nameLen = value ? value - param : len;
+	unsigned int i = 0;
+	while (i < sizeof(sFields) / sizeof(sFields[0]) &&
+		   (strlen(sFields[i]) != nameLen || strncasecmp(param, sFields[i], nameLen) != 0))
+		++i;
+	if (i == sizeof(sFields) / sizeof(sFields[0]) || (mTaken & (1 << i)))
+		return false;
+	mTaken |= 1 << i;
+	string field = value ? string(value + 1, param + len) : string();
+	switch (i) {
+		case 0:
+			callId = field;
+			break;
+		case 1:
+			expires = atoi(field.c_str());
+			break;
+		case 2:
+			updatedAt = (unsigned long)atoll(field.c_str());
+			break;
+		case 3:
+			cseq = atoi(field.c_str());
+			break;
+		case 4:
+			alias = field == "yes";
+			break;
+		case 5:
+			usedAsRoute = field == "yes";
+			break;
 	}
-	return extracted_param;
+	return true;
 }
 
-static bool getBoolParam(url_t *url, const char *param) {
-	bool extracted_param = false;
-	if (url_has_param(url, param)) {
-		char *buffer = new char[255];
-		isize_t result = url_param(url->url_params, param, buffer, 255);
-		if (result > 0) {
-			extracted_param = strcmp(buffer, "yes") == 0;
+/* Unescapes the value of a header and splits it at its commas. */
+void UrlEncodedContact::splitHeader(const char *value, size_t len, list<string> &values) {
+	string unescaped;
+	unescaped.reserve(len);
+	for (size_t i = 0; i < len; ++i) {
+		if (value[i] == '%' && i + 2 < len && isxdigit((unsigned char)value[i + 1]) &&
+			isxdigit((unsigned char)value[i + 2])) {
+			char hex[3] = {value[i + 1], value[i + 2], 0};
+			unescaped += (char)strtol(hex, NULL, 16);
+			i += 2;
+		} else {
+			unescaped += value[i];
 		}
-		url->url_params = url_strip_param_string((char *)url->url_params, param);
-		delete[] buffer;
 	}
-	return extracted_param;
+	if (unescaped.empty())
+		return;
+	size_t start = 0;
+	for (size_t comma; (comma = unescaped.find(',', start)) != string::npos; start = comma + 1)
+		values.push_back(unescaped.substr(start, comma - start));
+	values.push_back(unescaped.substr(start));
 }
 
 bool Record::updateFromUrlEncodedParams(const char *key, const char *uid, const char *full_url) {
-	bool result = false;
-	su_home_t home;
-	su_home_init(&home);
-
-	url_t *url = url_make(&home, full_url);
-
-	// CallId
-	string call_id = getStringParam(url, "callid");
-
-	// Expire
-	int globalExpire = getIntParam(url, "expires");
-
-	// Update time
-	unsigned long updatedAt = getUnsignedLongParam(url, "updatedAt");
-
-	// CSeq
-	uint32_t cseq = getIntParam(url, "cseq");
-
-	// Alias
-	bool alias = getBoolParam(url, "alias");
-
-	// Used as route
-	bool usedAsRoute = getBoolParam(url, "usedAsRoute");
-
-	// Path
-	list<string> path;
-	// Accept headers
-	list<string> acceptHeaders;
+	materialize();
+	return parseUrlEncodedParams(key, uid, full_url);
+}
 
-	char *headers = url_query_as_header_string(&home, url->url_headers);
-	char *line = NULL;
-	while ((line = strsep(&headers, "\n")) != NULL)
-	{
-		char *ptr;
-		strtok_r(line, ":", &ptr);
-		if (line) {
-			if (strcmp(line, "path") == 0 && ptr) {
-				char *item = NULL;
-				while ((item = strsep(&ptr, ",")) != NULL) {
-					path.push_back(item);
-				}
-			} else if (strcmp(line, "accept") == 0 && ptr) {
-				char *item = NULL;
-				while ((item = strsep(&ptr, ",")) != NULL) {
-					acceptHeaders.push_back(item);
-				}
-			}
+/* Value of a numeric parameter of a serialized contact, read without parsing the url. */
+static bool findSerializedParam(const char *url, const char *name, long &value) {
+	const char *end = strchr(url, '?');
+	if (!end)
+		end = url + strlen(url);
+	// the parameters follow the host
+	const char *params = url;
+	for (const char *p = url; p < end; ++p) {
+		if (*p == '@')
+			params = p;
+	}
+	size_t len = strlen(name);
+	for (const char *p = params; (p = strchr(p, ';')) != NULL && p < end; ++p) {
+		if (strncasecmp(p + 1, name, len) == 0 && p[1 + len] == '=') {
+			value = atol(p + 2 + len);
+			return true;
 		}
 	}
+	return false;
+}
 
-	char transport[20];
-	char *transportPtr = transport;
-	if (!url_param(url[0].url_params, "transport", transport, sizeof(transport) - 1)) {
-		transportPtr = NULL;
+bool Record::addSerializedContact(const char *uid, const char *full_url) {
+	long expires = 0, updatedAt = 0;
+	if (!findSerializedParam(full_url, "expires", expires) || !findSerializedParam(full_url, "updatedAt", updatedAt))
+		return updateFromUrlEncodedParams(mKey.c_str(), uid, full_url);
+	// same expiry as computed by the ExtendedContact
+	time_t expireAt = (time_t)updatedAt + expires;
+	if (getCurrentTime() >= expireAt)
+		return false;
+	mSerializedContacts.push_back({uid, full_url, expireAt});
+	return true;
+}
+
+void Record::parseSerializedContacts() {
+	vector<SerializedContact> contacts;
+	contacts.swap(mSerializedContacts);
+	for (const auto &contact : contacts) {
+		parseUrlEncodedParams(mKey.c_str(), contact.uid.c_str(), contact.url.c_str());
 	}
+}
 
-	url->url_headers = NULL;
-	sip_contact_t *contact = sip_contact_create(&home, (url_string_t*)url, NULL);
+bool Record::parseUrlEncodedParams(const char *key, const char *uid, const char *full_url) {
+	bool result = false;
+	SofiaAutoHome home;
+
+	UrlEncodedContact fields(full_url);
+	sip_contact_t *contact = sip_contact_create(home.home(), URL_STRING_MAKE(fields.uri.c_str()), NULL);
+	if (!contact) {
+		LOGE("Cannot parse the contact %s of %s", fields.uri.c_str(), key);
+		return false;
+	}
 
-	ExtendedContactCommon ecc(key, path, call_id, uid);
-	auto exc = make_shared<ExtendedContact>(ecc, contact, globalExpire, cseq, updatedAt, alias, acceptHeaders);
-	exc->mRegId = setAndGetRegid(exc->mSipUri, &exc->mHome);
-	exc->mUsedAsRoute = usedAsRoute;
+	ExtendedContactCommon ecc(key, fields.path, fields.callId, uid);
+	auto exc = make_shared<ExtendedContact>(ecc, contact, fields.expires, fields.cseq, fields.updatedAt, fields.alias,
+											fields.accept);
+	exc->mRegId = setAndGetRegid(*exc);
+	exc->mUsedAsRoute = fields.usedAsRoute;
 
 	if (getCurrentTime() < exc->mExpireAt) {
 		insertOrUpdateBinding(exc, nullptr);
 		result = true;
 	}
-
-	su_home_deinit(&home);
 	return result;
 }
 
 void Record::update(sip_contact_t *contacts, const sip_path_t *path, int globalExpire, const std::string &call_id,
 					uint32_t cseq, time_t now, bool alias, const std::list<std::string> accept, bool usedAsRoute,
 					const std::shared_ptr<ContactUpdateListener> &listener) {
+	materialize();
 	list<string> stlPath;
 
 	if (path != NULL) {
@@ -560,7 +820,7 @@ void Record::update(sip_contact_t *contacts, const sip_path_t *path, int globalE
 		defineContactId(contactId, contacts->m_url, transportPtr);
 		ExtendedContactCommon ecc(contactId.str().c_str(), stlPath, call_id, lineValuePtr);
 		auto exc = make_shared<ExtendedContact>(ecc, contacts, globalExpire, cseq, now, alias, accept);
-		exc->mRegId = setAndGetRegid(exc->mSipUri, &exc->mHome);
+		exc->mRegId = setAndGetRegid(*exc);
 		exc->mUsedAsRoute = usedAsRoute;
 		insertOrUpdateBinding(exc, listener);
 		contacts = contacts->m_next;
@@ -572,9 +832,11 @@ void Record::update(sip_contact_t *contacts, const sip_path_t *path, int globalE
 void Record::update(const ExtendedContactCommon &ecc, const char *sipuri, long expireAt, float q, uint32_t cseq,
 					time_t updated_time, bool alias, const std::list<std::string> accept, bool usedAsRoute,
 					const std::shared_ptr<ContactUpdateListener> &listener) {
+	materialize();
 	auto exct = make_shared<ExtendedContact>(ecc, sipuri, expireAt, q, cseq, updated_time, alias, accept);
-	url_t *sipUri = url_make(exct->mHome.home(), sipuri);
-	exct->mRegId = setAndGetRegid(sipUri, &exct->mHome);
+	SofiaAutoHome home;
+	url_t *sipUri = url_make(home.home(), sipuri);
+	exct->mRegId = setAndGetRegid(sipUri, home.home());
 	exct->mUsedAsRoute = usedAsRoute;
 	insertOrUpdateBinding(exct, listener);
 
@@ -582,6 +844,7 @@ void Record::update(const ExtendedContactCommon &ecc, const char *sipuri, long e
 }
 
 void Record::print(std::ostream &stream) const {
+	materialize();
 	stream << "Record contains " << mContacts.size() << " contacts";
 	time_t now = getCurrentTime();
 	time_t offset = getTimeOffset(now);
@@ -621,17 +884,141 @@ void Record::appendContactsFrom(Record *src) {
 	if (!src)
 		return;
 
+	materialize();
+	src->materialize();
+	mContactsIndex.reset();
 	for (auto it = src->mContacts.begin(); it != src->mContacts.end(); ++it) {
 		mContacts.push_back(*it);
 	}
 }
 
-RegistrarDb::LocalRegExpire::LocalRegExpire(string preferredRoute) {
+RegistrarDb::LocalRegExpire::LocalRegExpire(string preferredRoute) : mWheel(getCurrentTime()) {
 	mPreferedRoute = preferredRoute;
 }
 
 RegistrarDb::RegistrarDb(const string &preferredRoute)
-	: mLocalRegExpire(new LocalRegExpire(preferredRoute)), mUseGlobalDomain(false) {
+	: mLocalRegExpire(new LocalRegExpire(preferredRoute)), mUseGlobalDomain(false), mBindStats("bind"),
+	  mFetchStats("fetch"), mClearStats("clear") {
+}
+
+RegistrarDb::OperationStats::OperationStats(const string &name)
+	: name("registrardb " + name), p50(NULL), p99(NULL), inFlight(NULL) {
+	// not declared when the database is used without the proxy modules, as by the tools
+	GenericStruct *registrar =
+		dynamic_cast<GenericStruct *>(GenericManager::get()->getRoot()->find("module::Registrar"));
+	if (!registrar)
+		return;
+	p50 = registrar->get<StatCounter64>("registrardb-" + name + "-latency-p50");
+	p99 = registrar->get<StatCounter64>("registrardb-" + name + "-latency-p99");
+	inFlight = registrar->get<StatCounter64>("registrardb-" + name + "-in-flight");
+}
+
+class TimedRegistrarDbListener : public ContactUpdateListener {
+  public:
+	TimedRegistrarDbListener(const string &name, LatencyHistogram &latency, StatCounter64 *p50, StatCounter64 *p99,
+							 StatCounter64 *inFlight, const shared_ptr<ContactUpdateListener> &listener)
+		: mName(name), mLatency(latency), mP50(p50), mP99(p99), mInFlight(inFlight), mListener(listener),
+		  mStart(chrono::steady_clock::now()), mTrace(Trace::current()), mDone(false) {
+		++*mInFlight;
+	}
+	~TimedRegistrarDbListener() {
+		// dropped by the backend without any outcome
+		if (!mDone)
+			--*mInFlight;
+	}
+	void onRecordFound(Record *r) {
+		done();
+		mListener->onRecordFound(r);
+	}
+	void onError() {
+		done();
+		mListener->onError();
+	}
+	void onInvalid() {
+		done();
+		mListener->onInvalid();
+	}
+	void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+		mListener->onContactUpdated(ec);
+	}
+
+  private:
+	void done() {
+		if (mDone)
+			return;
+		mDone = true;
+		--*mInFlight;
+		mLatency.record(
+			chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - mStart).count());
+		// the percentiles are only refreshed from time to time, the stats are read far less often than updated
+		if ((mLatency.size() & 15) == 1) {
+			mP50->set(mLatency.percentile(0.5));
+			mP99->set(mLatency.percentile(0.99));
+		}
+		if (mTrace)
+			mTrace->addSpan(mName, mStart);
+	}
+
+	const string &mName;
+	LatencyHistogram &mLatency;
+	StatCounter64 *mP50;
+	StatCounter64 *mP99;
+	StatCounter64 *mInFlight;
+	shared_ptr<ContactUpdateListener> mListener;
+	chrono::steady_clock::time_point mStart;
+	shared_ptr<Trace> mTrace;
+	bool mDone;
+};
+
+shared_ptr<ContactUpdateListener> RegistrarDb::timed(OperationStats &stats,
+													 const shared_ptr<ContactUpdateListener> &listener) {
+	if (!listener || !stats.inFlight)
+		return listener;
+	return make_shared<TimedRegistrarDbListener>(stats.name, stats.latency, stats.p50, stats.p99, stats.inFlight,
+												 listener);
+}
+
+class RecordChangedListener : public ContactUpdateListener {
+  public:
+	RecordChangedListener(RegistrarDb *db, const string &key, const shared_ptr<ContactUpdateListener> &listener)
+		: mDb(db), mKey(key), mListener(listener) {
+	}
+	void onRecordFound(Record *r) {
+		mDb->notifyRecordChanged(mKey);
+		mListener->onRecordFound(r);
+	}
+	void onError() {
+		// the change may have been made before the error
+		mDb->notifyRecordChanged(mKey);
+		mListener->onError();
+	}
+	void onInvalid() {
+		mListener->onInvalid();
+	}
+	void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+		mListener->onContactUpdated(ec);
+	}
+
+  private:
+	RegistrarDb *mDb;
+	string mKey;
+	shared_ptr<ContactUpdateListener> mListener;
+};
+
+shared_ptr<ContactUpdateListener> RegistrarDb::changing(const string &key,
+														const shared_ptr<ContactUpdateListener> &listener) {
+	if (!listener || mRecordChangedCallbacks.empty())
+		return listener;
+	return make_shared<RecordChangedListener>(this, key, listener);
+}
+
+void RegistrarDb::addRecordChangedCallback(const RecordChangedCallback &callback) {
+	mRecordChangedCallbacks.push_back(callback);
+}
+
+void RegistrarDb::notifyRecordChanged(const string &key) {
+	for (const auto &callback : mRecordChangedCallbacks)
+		callback(key);
 }
 
 RegistrarDb::~RegistrarDb() {
@@ -651,6 +1038,10 @@ void RegistrarDb::unsubscribe(const std::string &topic) {
 	}
 }
 
+string RegistrarDb::regEventTopic(const url_t *aor) {
+	return "reg-event:" + Record::defineKeyFromUrl(aor);
+}
+
 void RegistrarDb::notifyContactListener(const std::string &key, const std::string &uid) {
 	LOGD("Notify topic = %s, uid = %s", key.c_str(), uid.c_str());
 	auto it = mContactListenersMap.find(key);
@@ -660,37 +1051,103 @@ void RegistrarDb::notifyContactListener(const std::string &key, const std::strin
 	}
 }
 
+static Tenant::Transport contactTransport(const url_t *uri) {
+	if (uri->url_type == url_sips)
+		return Tenant::Tls;
+	char transport[8];
+	if (!uri->url_params || url_param(uri->url_params, "transport", transport, sizeof(transport)) == 0)
+		return Tenant::Udp;
+	if (strcasecmp(transport, "udp") == 0)
+		return Tenant::Udp;
+	if (strcasecmp(transport, "tcp") == 0)
+		return Tenant::Tcp;
+	if (strcasecmp(transport, "tls") == 0)
+		return Tenant::Tls;
+	return Tenant::OtherTransport;
+}
+
+void RegistrarDb::LocalRegExpire::account(const Expire &expire, bool add) {
+	Tenant *tenant = expire.tenant;
+	if (!tenant)
+		return;
+	if (add)
+		tenant->count(tenant->registeredAors);
+	else
+		tenant->uncount(tenant->registeredAors);
+	for (int transport = 0; transport < Tenant::TransportCount; ++transport) {
+		if (!expire.contacts[transport])
+			continue;
+		if (add)
+			tenant->count(tenant->registeredContacts[transport], expire.contacts[transport]);
+		else
+			tenant->uncount(tenant->registeredContacts[transport], expire.contacts[transport]);
+	}
+}
+
 void RegistrarDb::LocalRegExpire::update(const Record &record) {
-	unique_lock<mutex> lock(mMutex);
 	time_t latest = record.latestExpire(mPreferedRoute);
+	lock_guard<mutex> lock(mWheelMutex);
+	Expire expire;
+	bool found = mRegMap.find(record.getKey(), expire);
+	if (found)
+		account(expire, false);
 	if (latest > 0) {
-		auto it = mRegMap.find(record.getKey());
-		if (it != mRegMap.end()) {
-			(*it).second = latest;
-		} else {
-			mRegMap.insert(make_pair(record.getKey(), latest));
+		expire.at = latest;
+		// A later expire is handled when the current wheel entry fires, only an earlier one needs a new entry
+		if (!found || latest < expire.scheduled) {
+			expire.scheduled = latest;
+			mWheel.schedule(latest, record.getKey());
 		}
-	} else {
+		const string &key = record.getKey();
+		size_t at = key.find('@');
+		expire.tenant = TenantStats::get()->find(at == string::npos ? key.c_str() : key.c_str() + at + 1);
+		for (auto &count : expire.contacts)
+			count = 0;
+		for (const auto &contact : record.getExtendedContacts()) {
+			if (!contact->mPath.empty() && *contact->mPath.begin() == mPreferedRoute)
+				++expire.contacts[contactTransport(contact->mSipUri)];
+		}
+		account(expire, true);
+		mRegMap.set(record.getKey(), expire);
+	} else if (found) {
 		mRegMap.erase(record.getKey());
 	}
 }
 
+void RegistrarDb::LocalRegExpire::remove(const string key) {
+	lock_guard<mutex> lock(mWheelMutex);
+	Expire expire;
+	if (mRegMap.erase(key, expire))
+		account(expire, false);
+}
+
+void RegistrarDb::LocalRegExpire::clearAll() {
+	lock_guard<mutex> lock(mWheelMutex);
+	mRegMap.forEach([](const string &key, const Expire &expire) { account(expire, false); });
+	mRegMap.clear();
+	mWheel.clear();
+}
+
 size_t RegistrarDb::LocalRegExpire::countActives() {
 	return mRegMap.size();
 }
-void RegistrarDb::LocalRegExpire::removeExpiredBefore(time_t before) {
-	unique_lock<mutex> lock(mMutex);
 
-	for (auto it = mRegMap.begin(); it != mRegMap.end();) {
-		// LOGE("> %s [%lu]", (*it).first.c_str(), (*it).second-before);
-		if ((*it).second <= before) {
-			auto prevIt = it;
-			++it;
-			mRegMap.erase(prevIt);
+/* Only the records whose wheel entry is due are examined. */
+void RegistrarDb::LocalRegExpire::removeExpiredBefore(time_t before) {
+	lock_guard<mutex> lock(mWheelMutex);
+	mWheel.advance(before, [this, before](const string &key, time_t when) {
+		Expire expire;
+		if (!mRegMap.find(key, expire) || expire.scheduled != when)
+			return; // removed, or superseded by an earlier entry
+		if (expire.at <= before) {
+			account(expire, false);
+			mRegMap.erase(key);
 		} else {
-			++it;
+			expire.scheduled = expire.at;
+			mRegMap.set(key, expire);
+			mWheel.schedule(expire.at, key);
 		}
-	}
+	});
 }
 
 int RegistrarDb::count_sip_contacts(const sip_contact_t *contact) {
@@ -732,8 +1189,18 @@ RegistrarDb *RegistrarDb::initialize(Agent *ag){
 	string dbImplementation = mr->get<ConfigString>("db-implementation")->read();
 	if ("internal" == dbImplementation) {
 		LOGI("RegistrarDB implementation is internal");
-		sUnique = new RegistrarDbInternal(ag->getPreferredRoute());
+		RegistrarDbInternal *internal = new RegistrarDbInternal(ag->getPreferredRoute());
+		sUnique = internal;
 		sUnique->mUseGlobalDomain = useGlobalDomain;
+		string snapshotFile = mr->get<ConfigString>("internal-snapshot-file")->read();
+		if (!snapshotFile.empty() &&
+			!internal->startPersistence(ag->getTimers(), snapshotFile,
+										mr->get<ConfigInt>("internal-snapshot-interval")->read()))
+			LOGE("The records of the registrar will be lost on restart");
+		list<string> peers = mr->get<ConfigStringList>("internal-replication-peers")->read();
+		if (!peers.empty() &&
+			!internal->startReplication(ag->getRoot(), mr->get<ConfigInt>("internal-replication-port")->read(), peers))
+			LOGF("Cannot replicate the records of the registrar");
 	}
 #ifdef ENABLE_REDIS
 	/* Previous implementations allowed "redis-sync" and "redis-async", whereas we now expect "redis".
@@ -747,6 +1214,26 @@ RegistrarDb *RegistrarDb::initialize(Agent *ag){
 		params.timeout = registrar->get<ConfigInt>("redis-server-timeout")->read();
 		params.auth = registrar->get<ConfigString>("redis-auth-password")->read();
 		params.mSlaveCheckTimeout = registrar->get<ConfigInt>("redis-slave-check-period")->read();
+		params.mBatchWindow = registrar->get<ConfigInt>("redis-batch-window")->read();
+		params.mBatchMaxSize = registrar->get<ConfigInt>("redis-batch-max-size")->read();
+		params.mFetchCacheSize = registrar->get<ConfigInt>("redis-fetch-cache-size")->read();
+		params.mFetchCacheTtl = registrar->get<ConfigInt>("redis-fetch-cache-ttl")->read();
+		params.mCluster = registrar->get<ConfigBoolean>("redis-cluster")->read();
+		params.mMigrationBudget = registrar->get<ConfigInt>("redis-migration-budget")->read();
+		params.mBindScript = registrar->get<ConfigBoolean>("redis-bind-script")->read();
+		params.mReplicaReads = registrar->get<ConfigBoolean>("redis-replica-reads")->read();
+		params.mReplicaMaxLag = registrar->get<ConfigInt>("redis-replica-max-lag")->read();
+		params.mAorFilterSize = registrar->get<ConfigInt>("redis-aor-filter-size")->read();
+		params.mAorFilterRebuildInterval = registrar->get<ConfigInt>("redis-aor-filter-rebuild-interval")->read();
+		params.mSubscriptionChannels = registrar->get<ConfigInt>("redis-subscription-channels")->read();
+		params.mReconnectMinDelay = registrar->get<ConfigInt>("redis-reconnect-min-delay")->read();
+		params.mReconnectMaxDelay = registrar->get<ConfigInt>("redis-reconnect-max-delay")->read();
+		params.mOutageBufferSize = registrar->get<ConfigInt>("redis-outage-buffer-size")->read();
+		params.mOutageBufferTimeout = registrar->get<ConfigInt>("redis-outage-buffer-timeout")->read();
+		params.mCompressionThreshold = registrar->get<ConfigInt>("redis-compression-threshold")->read();
+		params.mClientTracking = registrar->get<ConfigBoolean>("redis-client-tracking")->read();
+		params.mShards = registrar->get<ConfigStringList>("redis-shards")->read();
+		params.mShardDomains = registrar->get<ConfigStringList>("redis-shard-domains")->read();
 
 		sUnique = new RegistrarDbRedisAsync(ag, params);
 		sUnique->mUseGlobalDomain = useGlobalDomain;
@@ -771,7 +1258,7 @@ RegistrarDb *RegistrarDb::get() {
 }
 
 void RegistrarDb::clear(const sip_t *sip, const shared_ptr<ContactUpdateListener> &listener) {
-	doClear(sip, listener);
+	doClear(sip, timed(mClearStats, changing(Record::defineKeyFromUrl(sip->sip_from->a_url), listener)));
 }
 
 class RecursiveRegistrarDbListener : public ContactUpdateListener,
@@ -784,9 +1271,10 @@ class RecursiveRegistrarDbListener : public ContactUpdateListener,
 	int m_request;
 	int m_step;
 	const char *m_url;
-	static int sMaxStep;
 
   public:
+	static int sMaxStep;
+
 	RecursiveRegistrarDbListener(RegistrarDb *database, const shared_ptr<ContactUpdateListener> &original_listerner,
 								 const url_t *url, int step = sMaxStep)
 		: m_database(database), mOriginalListener(original_listerner), m_request(1), m_step(step) {
@@ -865,9 +1353,8 @@ class RecursiveRegistrarDbListener : public ContactUpdateListener,
 		 * Contact but still preserving
 		 * the last request uri that was found recursed through the alias mechanism.
 		*/
-		SofiaAutoHome home;
 		shared_ptr<ExtendedContact> newEc = make_shared<ExtendedContact>(*ec);
-		newEc->mSipUri = url_make(home.home(), uri);
+		newEc->setSipUri(uri);
 		newEc->mPath.push_back(uri);
 		// LOGD("transformContactUsedAsRoute(): path to %s added for %s", ec->mSipUri.c_str(), uri);
 		newEc->mUsedAsRoute = false;
@@ -911,25 +1398,190 @@ void RegistrarDb::fetch(const url_t *url, const std::shared_ptr<ContactUpdateLis
 		fetchWithDomain(url, listener, recursive);
 		return;
 	}
-	if(url_has_param(url, "gr")) {
-		stringstream gruu;
-		char *buffer = new char[255];
-		isize_t result = url_param(url->url_params, "gr", buffer, 255);
+	dispatchFetch(url, recursive ? make_shared<RecursiveRegistrarDbListener>(this, listener, url) : listener);
+}
+
+/* Fetches the whole record of the aor, or only the contact of its gruu if the url has one. */
+void RegistrarDb::dispatchFetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener) {
+	if (url_has_param(url, "gr")) {
+		char buffer[255];
+		isize_t result = url_param(url->url_params, "gr", buffer, sizeof(buffer));
 		if (result > 0) {
+			stringstream gruu;
 			gruu << "\"<" << buffer << ">\"";
-			doFetchForGruu(url, gruu.str(), recursive
-						   ? make_shared<RecursiveRegistrarDbListener>(this, listener, url)
-						   : listener);
+			doFetchForGruu(url, gruu.str(), timed(mFetchStats, listener));
 			return;
 		}
 	}
-	doFetch(url, recursive
-			? make_shared<RecursiveRegistrarDbListener>(this, listener, url)
-			: listener);
+	doFetch(url, timed(mFetchStats, listener));
+}
+
+/*
+ * Resolves several aors level by level: all the fetches of a level are issued before the backend is flushed, and the
+ * aliases they return make the next level, so that the cost of a fetch list is one round-trip per level of aliases
+ * instead of a chain of round-trips per aor. Each url is fetched once, which also stops alias loops.
+ */
+class MultiFetchRegistrarDbListener : public enable_shared_from_this<MultiFetchRegistrarDbListener> {
+  private:
+	struct Target {
+		const url_t *url;
+		const char *uri;
+		bool recursive; // follows the aliases and rewrites the contacts used as route
+		bool required; // an error on this target fails the whole fetch
+	};
+
+	class TargetListener : public ContactUpdateListener {
+	  public:
+		TargetListener(const shared_ptr<MultiFetchRegistrarDbListener> &owner, const Target &target)
+			: mOwner(owner), mTarget(target) {
+		}
+		void onRecordFound(Record *r) {
+			mOwner->onTargetFound(mTarget, r);
+		}
+		void onError() {
+			mOwner->onTargetError(mTarget);
+		}
+		void onInvalid() {
+			mOwner->onTargetError(mTarget);
+		}
+		void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+		}
+
+	  private:
+		shared_ptr<MultiFetchRegistrarDbListener> mOwner;
+		Target mTarget;
+	};
+
+	RegistrarDb *m_database;
+	shared_ptr<ContactUpdateListener> mOriginalListener;
+	Record mRecord;
+	su_home_t m_home;
+	vector<Target> mNextLevel;
+	set<string> mVisited;
+	int mStep;
+	int mPending;
+	bool mError;
+
+  public:
+	MultiFetchRegistrarDbListener(RegistrarDb *database, const shared_ptr<ContactUpdateListener> &listener, int step)
+		: m_database(database), mOriginalListener(listener), mRecord(NULL), mStep(step), mPending(0), mError(false) {
+		su_home_init(&m_home);
+	}
+
+	~MultiFetchRegistrarDbListener() {
+		su_home_deinit(&m_home);
+	}
+
+	su_home_t *home() {
+		return &m_home;
+	}
+
+	/* Adds a target to the next level, unless it was already fetched. */
+	void add(const url_t *url, bool recursive, bool required) {
+		const char *uri = url_as_string(&m_home, url);
+		if (!uri || !mVisited.insert(uri).second)
+			return;
+		mNextLevel.push_back(Target{url, uri, recursive, required});
+	}
+
+	void start() {
+		vector<Target> level;
+		level.swap(mNextLevel);
+		if (level.empty()) {
+			finish();
+			return;
+		}
+		SLOGD << "Step: " << mStep << "\tFetching " << level.size() << " aors";
+		// the replies can be notified before the loop completes, when they come from a cache
+		mPending = level.size() + 1;
+		for (const auto &target : level) {
+			m_database->dispatchFetch(target.url, make_shared<TargetListener>(shared_from_this(), target));
+		}
+		m_database->flushFetches();
+		onTargetDone();
+	}
+
+  private:
+	void onTargetFound(const Target &target, Record *r) {
+		if (r != NULL) {
+			for (auto ec : r->getExtendedContacts()) {
+				SLOGD << "Step: " << mStep << (ec->mAlias ? "\tFound alias " : "\tFound contact ") << target.uri
+					  << " -> " << ExtendedContact::urlToString(ec->mSipUri) << " usedAsRoute:" << ec->mUsedAsRoute;
+				if (target.recursive && !ec->mAlias && ec->mUsedAsRoute) {
+					ec = transformContactUsedAsRoute(target.uri, ec);
+				}
+				mRecord.pushContact(ec);
+				if (target.recursive && ec->mAlias && mStep > 0) {
+					sip_contact_t *contact = sip_contact_create(&m_home, (url_string_t *)ec->mSipUri, NULL);
+					if (contact) {
+						add(contact->m_url, true, false);
+					} else {
+						SLOGW << "Can't create sip_contact of " << ExtendedContact::urlToString(ec->mSipUri);
+					}
+				}
+			}
+		}
+		onTargetDone();
+	}
+
+	void onTargetError(const Target &target) {
+		SLOGW << "Step: " << mStep << "\tError during fetch of " << target.uri;
+		if (target.required)
+			mError = true;
+		onTargetDone();
+	}
+
+	void onTargetDone() {
+		if (--mPending != 0)
+			return;
+		if (mError || mNextLevel.empty()) {
+			finish();
+			return;
+		}
+		--mStep;
+		start();
+	}
+
+	void finish() {
+		mNextLevel.clear();
+		if (mError) {
+			mOriginalListener->onError();
+		} else if (mRecord.getExtendedContacts().empty()) {
+			SLOGD << "Step: " << mStep << "\tNo contact found";
+			mOriginalListener->onRecordFound(NULL);
+		} else {
+			SLOGD << "Step: " << mStep << "\tReturning collected records " << mRecord.getExtendedContacts().size();
+			mOriginalListener->onRecordFound(&mRecord);
+		}
+	}
+
+	/* Same as RecursiveRegistrarDbListener: keeps the uri found through the aliases as the request uri. */
+	shared_ptr<ExtendedContact> transformContactUsedAsRoute(const char *uri, const shared_ptr<ExtendedContact> &ec) {
+		shared_ptr<ExtendedContact> newEc = make_shared<ExtendedContact>(*ec);
+		newEc->setSipUri(uri);
+		newEc->mPath.push_back(uri);
+		newEc->mUsedAsRoute = false;
+		return newEc;
+	}
+};
+
+void RegistrarDb::fetchList(const vector<const url_t *> &urls, const shared_ptr<ContactUpdateListener> &listener,
+							bool includingDomains, bool recursive) {
+	auto multi = make_shared<MultiFetchRegistrarDbListener>(this, listener,
+															recursive ? RecursiveRegistrarDbListener::sMaxStep : 0);
+	for (auto url : urls) {
+		multi->add(url, recursive, true);
+		if (includingDomains) {
+			url_t *domainOnlyUrl = url_hdup(multi->home(), url);
+			domainOnlyUrl->url_user = NULL;
+			multi->add(domainOnlyUrl, false, false);
+		}
+	}
+	multi->start();
 }
 
 void RegistrarDb::fetchForGruu(const url_t *url, const std::string &gruu, const std::shared_ptr<ContactUpdateListener> &listener) {
-	doFetchForGruu(url, gruu, listener);
+	doFetchForGruu(url, gruu, timed(mFetchStats, listener));
 }
 
 void RegistrarDb::bind(const url_t *ifrom, sip_contact_t *icontact, const char *iid, uint32_t iseq,
@@ -964,7 +1616,8 @@ void RegistrarDb::bind(const url_t *ifrom, sip_contact_t *icontact, const char *
 		return;
 	}
 
-	doBind(ifrom, icontact, iid, iseq, ipath, acceptHeaders, usedAsRoute, expire, alias, version, listener);
+	doBind(ifrom, icontact, iid, iseq, ipath, acceptHeaders, usedAsRoute, expire, alias, version,
+		   timed(mBindStats, changing(Record::defineKeyFromUrl(ifrom), listener)));
 }
 void RegistrarDb::bind(const sip_t *sip, int globalExpire, bool alias, int version, const std::shared_ptr<ContactUpdateListener> &listener) {
 	bind(sip->sip_from->a_url, sip->sip_contact, sip->sip_call_id->i_id, sip->sip_cseq->cs_seq,
@@ -1038,6 +1691,8 @@ RecordSerializer *RecordSerializer::create(const string &name) {
 		return new RecordSerializerC();
 	} else if (name == "json") {
 		return new RecordSerializerJson();
+	} else if (name == "flat") {
+		return new RecordSerializerFlat();
 	}
 #if ENABLE_PROTOBUF
 	else if (name == "protobuf") {
@@ -26,8 +26,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <algorithm>
+#include <functional>
 #include <limits>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include <iosfwd>
 
 #include <sofia-sip/sip.h>
@@ -36,11 +39,68 @@
 #include "log/logmanager.hh"
 #include "agent.hh"
 #include "module.hh"
+#include "utils/shardedhashmap.hh"
+#include "utils/timerwheel.hh"
+#include "utils/latencyhistogram.hh"
+#include "utils/memorystats.hh"
+#include "tenantstats.hh"
 
 #define AOR_KEY_SIZE 128
 
 class ContactUpdateListener;
 
+/**
+ * Immutable list of strings, whose storage is shared by all the instances holding the same value.
+ * Registered contacts use few distinct paths and accept header lists, so they are interned instead of being
+ * duplicated in every contact.
+ */
+class SharedStringList {
+  public:
+	typedef std::list<std::string>::const_iterator const_iterator;
+
+	SharedStringList() : mList(intern(std::list<std::string>())) {
+	}
+	SharedStringList(const std::list<std::string> &strings) : mList(intern(strings)) {
+	}
+
+	const_iterator begin() const {
+		return mList->begin();
+	}
+	const_iterator end() const {
+		return mList->end();
+	}
+	const_iterator cbegin() const {
+		return mList->cbegin();
+	}
+	const_iterator cend() const {
+		return mList->cend();
+	}
+	size_t size() const {
+		return mList->size();
+	}
+	bool empty() const {
+		return mList->empty();
+	}
+	const std::string &front() const {
+		return mList->front();
+	}
+	const std::string &back() const {
+		return mList->back();
+	}
+	void push_back(const std::string &value) {
+		std::list<std::string> strings(*mList);
+		strings.push_back(value);
+		mList = intern(strings);
+	}
+	operator const std::list<std::string> &() const {
+		return *mList;
+	}
+
+  private:
+	static std::shared_ptr<const std::list<std::string>> intern(const std::list<std::string> &strings);
+	std::shared_ptr<const std::list<std::string>> mList;
+};
+
 struct ExtendedContactCommon {
 	std::string mContactId;
 	std::string mCallId;
@@ -60,25 +120,24 @@ struct ExtendedContactCommon {
 	}
 };
 
-struct ExtendedContact {
+struct ExtendedContact : public CountedObject<ObjectCounter::Contacts> {
 	class Record;
 	friend class Record;
 
 	std::string mContactId;
 	std::string mCallId;
 	std::string mUniqueId;
-	std::list<std::string> mPath; //list of urls as string (not enclosed with brakets)
-	url_t *mSipUri; // a single sip uri with his params (not enclosed with brakets)
+	SharedStringList mPath; //list of urls as string (not enclosed with brakets)
+	url_t *mSipUri; // a single sip uri with his params (not enclosed with brakets), read-only: use setSipUri()
 	float mQ;
 	time_t mExpireAt;
 	time_t mUpdatedTime;
 	uint32_t mCSeq;
 	bool mAlias;
-	std::list<std::string> mAcceptHeader;
+	SharedStringList mAcceptHeader;
 	bool mUsedAsRoute; /*whether the contact information shall be used as a route when forming a request, instead of
 						  replacing the request-uri*/
 	uint64_t mRegId; // a unique id shared with associate t_port
-	SofiaAutoHome mHome;
 
 	inline const char *callId() {
 		return mCallId.c_str();
@@ -119,9 +178,18 @@ struct ExtendedContact {
 		return std::string(url);
 	}
 
+	/* The uri is stored in a single block instead of a su_home, which costs much more than the uri itself. */
 	void setSipUri(const url_t *uri) {
-		if (mSipUri) su_free(mHome.home(), mSipUri);
-		mSipUri = url_hdup(mHome.home(), uri);
+		isize_t xtra = url_xtra(uri);
+		std::unique_ptr<char[]> buffer(new char[sizeof(url_t) + xtra]);
+		url_t *dst = reinterpret_cast<url_t *>(buffer.get());
+		url_dup(buffer.get() + sizeof(url_t), xtra, dst, uri);
+		mSipUriBuffer.swap(buffer);
+		mSipUri = dst;
+	}
+	void setSipUri(const char *uri) {
+		SofiaAutoHome home;
+		setSipUri(url_make(home.home(), uri));
 	}
 
 	std::string getUniqueId() {
@@ -136,9 +204,9 @@ struct ExtendedContact {
 					time_t updateTime, bool alias, const std::list<std::string> &acceptHeaders)
 		: mContactId(common.mContactId), mCallId(common.mCallId), mUniqueId(common.mUniqueId), mPath(common.mPath),
 			mSipUri(), mQ(0), mUpdatedTime(updateTime), mCSeq(cseq), mAlias(alias),mAcceptHeader(acceptHeaders),
-			mUsedAsRoute(false), mRegId(0), mHome() {
+			mUsedAsRoute(false), mRegId(0) {
 
-		mSipUri = url_hdup(mHome.home(), sip_contact->m_url);
+		setSipUri(sip_contact->m_url);
 
 		if (sip_contact->m_q) {
 			mQ = atof(sip_contact->m_q);
@@ -154,19 +222,32 @@ struct ExtendedContact {
 					time_t updateTime, bool alias, const std::list<std::string> &acceptHeaders)
 		: mContactId(common.mContactId), mCallId(common.mCallId), mUniqueId(common.mUniqueId), mPath(common.mPath),
 			mSipUri(), mQ(q), mExpireAt(expireAt), mUpdatedTime(updateTime), mCSeq(cseq), mAlias(alias),
-			mAcceptHeader(acceptHeaders), mUsedAsRoute(false), mRegId(0), mHome() {
-		mSipUri = url_make(mHome.home(), sipuri);
+			mAcceptHeader(acceptHeaders), mUsedAsRoute(false), mRegId(0) {
+		setSipUri(sipuri);
 	}
 
 	ExtendedContact(const url_t *url, const std::string &route)
-		: mContactId(), mCallId(), mUniqueId(), mPath({route}), mSipUri(), mQ(0), mExpireAt(LONG_MAX), mUpdatedTime(0),
-			mCSeq(0), mAlias(false), mAcceptHeader({}), mUsedAsRoute(false), mRegId(0), mHome() {
-		mSipUri = url_hdup(mHome.home(), url);
+		: mContactId(), mCallId(), mUniqueId(), mPath(std::list<std::string>(1, route)), mSipUri(), mQ(0),
+			mExpireAt(LONG_MAX), mUpdatedTime(0), mCSeq(0), mAlias(false), mAcceptHeader(), mUsedAsRoute(false),
+			mRegId(0) {
+		setSipUri(url);
 	}
 
+	ExtendedContact(const ExtendedContact &other)
+		: mContactId(other.mContactId), mCallId(other.mCallId), mUniqueId(other.mUniqueId), mPath(other.mPath),
+			mSipUri(), mQ(other.mQ), mExpireAt(other.mExpireAt), mUpdatedTime(other.mUpdatedTime),
+			mCSeq(other.mCSeq), mAlias(other.mAlias), mAcceptHeader(other.mAcceptHeader),
+			mUsedAsRoute(other.mUsedAsRoute), mRegId(other.mRegId) {
+		setSipUri(other.mSipUri);
+	}
+	ExtendedContact &operator=(const ExtendedContact &other) = delete;
+
 	std::ostream &print(std::ostream &stream, time_t _now = getCurrentTime(), time_t offset = 0) const;
 	sip_contact_t *toSofiaContact(su_home_t *home, time_t now) const;
 	sip_route_t *toSofiaRoute(su_home_t *home) const;
+
+  private:
+	std::unique_ptr<char[]> mSipUriBuffer;
 };
 
 template <typename TraitsT>
@@ -175,13 +256,37 @@ inline std::basic_ostream<char, TraitsT> &operator<<(std::basic_ostream<char, Tr
 	return strm;
 }
 
-class Record {
+class Record : public CountedObject<ObjectCounter::Records> {
 	friend class RegistrarDb;
 
   private:
+	/* Contact as serialized by ExtendedContact::serializeAsUrlEncodedParams(), not parsed yet. */
+	struct SerializedContact {
+		std::string uid;
+		std::string url;
+		time_t expireAt;
+	};
 	static void init();
 	void insertOrUpdateBinding(const std::shared_ptr<ExtendedContact> &ec, const std::shared_ptr<ContactUpdateListener> &listener);
+	bool parseUrlEncodedParams(const char *key, const char *uid, const char *full_url);
+	/* Parses the serialized contacts, before any access to the contacts. */
+	void materialize() const {
+		if (!mSerializedContacts.empty())
+			const_cast<Record *>(this)->parseSerializedContacts();
+	}
+	void parseSerializedContacts();
+	/* sip_contact_t of the contacts without their expires, built once per contact for getContacts(). */
+	struct ContactsCache;
+	/* Positions of the contacts by unique id, by call-id and by update time, so that a binding finds the contacts it
+	 * replaces and the contact it evicts without going through all of them. Dropped when the contacts are changed
+	 * otherwise, and rebuilt by the next binding. */
+	struct ContactsIndex;
+	void buildContactsIndex(time_t now);
+	void eraseIndexedContact(std::list<std::shared_ptr<ExtendedContact>>::iterator position);
 	std::list<std::shared_ptr<ExtendedContact>> mContacts;
+	std::vector<SerializedContact> mSerializedContacts;
+	std::unique_ptr<ContactsCache> mContactsCache;
+	std::unique_ptr<ContactsIndex> mContactsIndex;
 	std::string mKey;
 	bool mIsDomain; /*is a domain registration*/
   public:
@@ -191,11 +296,17 @@ class Record {
 	Record(const url_t *aor);
 	static std::string extractUniqueId(const sip_contact_t *contact);
 	const std::shared_ptr<ExtendedContact> extractContactByUniqueId(std::string uid);
+	/* The contacts not expired at now. They share the strings of the cache of the record: to be duplicated if they are
+	 * to outlive it or a change of its contacts. */
 	const sip_contact_t *getContacts(su_home_t *home, time_t now);
 	void pushContact(const std::shared_ptr<ExtendedContact> &ct) {
+		materialize();
+		mContactsIndex.reset();
 		mContacts.push_back(ct);
 	}
 	std::list<std::shared_ptr<ExtendedContact>>::iterator removeContact(const std::shared_ptr<ExtendedContact> &ct) {
+		materialize();
+		mContactsIndex.reset();
 		return mContacts.erase(find(mContacts.begin(), mContacts.end(), ct));
 	}
 	bool isInvalidRegister(const std::string &call_id, uint32_t cseq);
@@ -207,18 +318,24 @@ class Record {
 				time_t updated_time, bool alias, const std::list<std::string> accept, bool usedAsRoute,
 				const std::shared_ptr<ContactUpdateListener> &listener);
 	bool updateFromUrlEncodedParams(const char *key, const char *uid, const char *full_url);
+	/* Same as updateFromUrlEncodedParams() for the contacts read from the database, but the contact is only parsed
+	 * when the contacts are accessed, or alone when it is looked up by its unique id, so that the records fetched
+	 * for a single contact or for their expiry are not fully parsed. False if it is expired. */
+	bool addSerializedContact(const char *uid, const char *full_url);
 
 	void print(std::ostream &stream) const;
 	bool isEmpty() {
-		return mContacts.empty();
+		return mContacts.empty() && mSerializedContacts.empty();
 	}
 	const std::string &getKey() const {
 		return mKey;
 	}
 	int count() {
+		materialize();
 		return mContacts.size();
 	}
 	const std::list<std::shared_ptr<ExtendedContact>> &getExtendedContacts() const {
+		materialize();
 		return mContacts;
 	}
 	static int getMaxContacts() {
@@ -270,6 +387,8 @@ class ContactRegisteredListener {
  **/
 class RegistrarDb {
 	friend class ModuleRegistrar;
+	friend class MultiFetchRegistrarDbListener;
+	friend class RecordChangedListener;
 
   public:
 	static RegistrarDb *initialize(Agent *ag);
@@ -281,6 +400,10 @@ class RegistrarDb {
 	void fetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener, bool recursive = false);
 	void fetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener, bool includingDomains, bool recursive);
 	void fetchForGruu(const url_t *url, const std::string &gruu, const std::shared_ptr<ContactUpdateListener> &listener);
+	/* Fetches several aors, and the aliases they resolve to when recursive, in batches issued together. The contacts
+	 * are notified merged in a single record, NULL if none was found. Fails if one of the aors cannot be fetched. */
+	void fetchList(const std::vector<const url_t *> &urls, const std::shared_ptr<ContactUpdateListener> &listener,
+				   bool includingDomains, bool recursive);
 	void updateRemoteExpireTime(const std::string &key, time_t expireat);
 	unsigned long countLocalActiveRecords() {
 		return mLocalRegExpire->countActives();
@@ -290,28 +413,47 @@ class RegistrarDb {
 	virtual void subscribe(const std::string &topic, const std::shared_ptr<ContactRegisteredListener> &listener);
 	virtual void unsubscribe(const std::string &topic);
 	virtual void publish(const std::string &topic, const std::string &uid) = 0;
+	/* Topic on which the Registrar publishes every change of the bindings of an aor, for the RegEvent module. */
+	static std::string regEventTopic(const url_t *aor);
+	/* Called with the key of a record once its bindings were changed by this proxy, or by another one when the
+	 * backend is told about it. Callbacks are run from the main loop. */
+	typedef std::function<void(const std::string &key)> RecordChangedCallback;
+	void addRecordChangedCallback(const RecordChangedCallback &callback);
+	/* Commands sent to the backend and not answered yet, none for the backends answering at once. */
+	virtual size_t countPendingCommands() {
+		return 0;
+	}
 	bool useGlobalDomain()const{
 		return mUseGlobalDomain;
 	}
   protected:
 	class LocalRegExpire {
-		std::map<std::string, time_t> mRegMap;
-		std::mutex mMutex;
+		struct Expire {
+			Expire() : at(0), scheduled(0), tenant(NULL) {
+				for (auto &count : contacts)
+					count = 0;
+			}
+			time_t at; // latest expire of the contacts registered through this server
+			time_t scheduled; // deadline of the wheel entry watching this record
+			Tenant *tenant; // domain of the record, NULL when the accounting per domain is disabled
+			uint32_t contacts[Tenant::TransportCount]; // contacts registered through this server, at the last update
+		};
+		/* Adds the registrations of a record to the gauges of its domain, or removes them. */
+		static void account(const Expire &expire, bool add);
+		ShardedHashMap<std::string, Expire> mRegMap;
+		/* Each record has at most one live entry in the wheel; entries left over by updates are ignored when
+		 * they fire. */
+		TimerWheel<std::string> mWheel;
+		std::mutex mWheelMutex;
 		std::string mPreferedRoute;
 
 	  public:
-		void remove(const std::string key) {
-			std::lock_guard<std::mutex> lock(mMutex);
-			mRegMap.erase(key);
-		}
+		void remove(const std::string key);
 		void update(const Record &record);
 		size_t countActives();
 		void removeExpiredBefore(time_t before);
 		LocalRegExpire(std::string preferedRoute);
-		void clearAll() {
-			std::lock_guard<std::mutex> lock(mMutex);
-			mRegMap.clear();
-		}
+		void clearAll();
 	};
 	virtual void doBind(const url_t *ifrom, sip_contact_t *icontact, const char *iid, uint32_t iseq,
 					  const sip_path_t *ipath, std::list<std::string> acceptHeaders, bool usedAsRoute, int expire, int alias, int version, const std::shared_ptr<ContactUpdateListener> &listener) = 0;
@@ -319,17 +461,41 @@ class RegistrarDb {
 	virtual void doFetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener) = 0;
 	virtual void doFetchForGruu(const url_t *url, const std::string &gruu, const std::shared_ptr<ContactUpdateListener> &listener) = 0;
 	virtual void doMigration() = 0;
+	/* Sends the fetches issued so far without waiting for more, when the backend delays them to batch them. */
+	virtual void flushFetches() {
+	}
 
 	int count_sip_contacts(const sip_contact_t *contact);
 	bool errorOnTooMuchContactInBind(const sip_contact_t *sip_contact, const std::string &key,
 									 const std::shared_ptr<RegistrarDbListener> &listener);
 	void fetchWithDomain(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener, bool recursive);
+	void dispatchFetch(const url_t *url, const std::shared_ptr<ContactUpdateListener> &listener);
+	/* Durations, in microseconds, and count in progress of one kind of operation of the backend. */
+	struct OperationStats {
+		OperationStats(const std::string &name);
+		std::string name;
+		LatencyHistogram latency;
+		StatCounter64 *p50;
+		StatCounter64 *p99;
+		StatCounter64 *inFlight;
+	};
+	/* Wraps the listener of an operation to measure it until its outcome is notified. */
+	std::shared_ptr<ContactUpdateListener> timed(OperationStats &stats,
+												 const std::shared_ptr<ContactUpdateListener> &listener);
+	void notifyRecordChanged(const std::string &key);
+	/* Wraps the listener of a bind or a clear to notify the change of the record once it is done. */
+	std::shared_ptr<ContactUpdateListener> changing(const std::string &key,
+													const std::shared_ptr<ContactUpdateListener> &listener);
 	RegistrarDb(const std::string &preferedRoute);
 	virtual ~RegistrarDb();
-	std::map<std::string, Record *> mRecords;
+	ShardedHashMap<std::string, Record *> mRecords;
 	std::map<std::string, std::shared_ptr<ContactRegisteredListener>> mContactListenersMap;
+	std::vector<RecordChangedCallback> mRecordChangedCallbacks;
 	LocalRegExpire *mLocalRegExpire;
 	bool mUseGlobalDomain;
+	OperationStats mBindStats;
+	OperationStats mFetchStats;
+	OperationStats mClearStats;
 	static RegistrarDb *sUnique;
 };
 
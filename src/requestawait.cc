@@ -0,0 +1,178 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "requestawait.hh"
+#include "agent.hh"
+#include "registrardb.hh"
+
+#include <thread>
+
+#include <sofia-sip/sip_status.h>
+#include <sofia-sip/su_wait.h>
+
+using namespace std;
+
+/* State shared by the steps: the request, and whether the operation completed while it was being started. */
+class AwaitedStep {
+  public:
+	AwaitedStep(Agent *agent, const shared_ptr<RequestSipEvent> &ev)
+		: mAgent(agent), mEv(ev), mStarting(true), mCompleted(false) {
+	}
+	virtual ~AwaitedStep() {
+	}
+
+  protected:
+	/* To be called once the operation is started: suspends the request unless it completed meanwhile. */
+	void started() {
+		mStarting = false;
+		if (!mCompleted)
+			mEv->suspendProcessing();
+	}
+	/* Runs the continuation, then gives back the request to the modules following the one that awaited. */
+	void complete(const function<void()> &continuation) {
+		mCompleted = true;
+		if (mStarting) {
+			// the dispatch that started the operation goes on with the request
+			continuation();
+			return;
+		}
+		mEv->restartProcessing();
+		continuation();
+		if (mEv->isTerminated() || mEv->isSuspended())
+			return;
+		mEv->suspendProcessing();
+		mAgent->injectRequestEvent(mEv);
+	}
+
+	Agent *mAgent;
+	shared_ptr<RequestSipEvent> mEv;
+	bool mStarting;
+	bool mCompleted;
+};
+
+class AwaitedFetch : public AwaitedStep, public ContactUpdateListener {
+  public:
+	AwaitedFetch(Agent *agent, const shared_ptr<RequestSipEvent> &ev, const RequestAwait::FetchContinuation &then)
+		: AwaitedStep(agent, ev), mThen(then) {
+	}
+	void start(const url_t *url, bool recursive, const shared_ptr<AwaitedFetch> &self) {
+		RegistrarDb::get()->fetch(url, self, recursive);
+		started();
+	}
+	void onRecordFound(Record *r) {
+		complete([this, r]() { mThen(mEv, r); });
+	}
+	void onError() {
+		complete([this]() { mEv->reply(SIP_500_INTERNAL_SERVER_ERROR, TAG_END()); });
+	}
+	void onInvalid() {
+		complete([this]() { mEv->reply(400, "Replayed CSeq", TAG_END()); });
+	}
+	void onContactUpdated(const shared_ptr<ExtendedContact> &ec) {
+	}
+
+  private:
+	RequestAwait::FetchContinuation mThen;
+};
+
+/* The password may be found by a thread of the backend, the continuation is then posted to the main loop. */
+class AwaitedPassword : public AwaitedStep, public AuthDbListener {
+  public:
+	AwaitedPassword(Agent *agent, const shared_ptr<RequestSipEvent> &ev, const RequestAwait::PasswordContinuation &then)
+		: AwaitedStep(agent, ev), mThen(then), mMainThread(this_thread::get_id()), mResult(PENDING) {
+	}
+	void start(const string &user, const string &domain, const string &authUsername,
+			   const shared_ptr<AwaitedPassword> &self) {
+		// given to the database as a raw pointer, held until the result
+		mSelf = self;
+		AuthDbBackend::get()->getPassword(user, domain, authUsername, this);
+		started();
+	}
+	void onResult(AuthDbResult result, const string &passwd) {
+		mResult = result;
+		mPassword = passwd;
+		if (this_thread::get_id() == mMainThread) {
+			finish();
+			return;
+		}
+		su_msg_r msg = SU_MSG_R_INIT;
+		su_root_t *root = mAgent->getRoot();
+		if (su_msg_create(msg, su_root_task(root), su_root_task(root), &AwaitedPassword::sOnResult,
+						  sizeof(AwaitedPassword *)) == -1) {
+			LOGF("Cannot create the message of an awaited password");
+		}
+		*(AwaitedPassword **)su_msg_data(msg) = this;
+		if (su_msg_send(msg) == -1) {
+			LOGF("Cannot send the message of an awaited password to the main thread");
+		}
+	}
+
+  private:
+	static void sOnResult(su_root_magic_t *rm, su_msg_r msg, void *u) {
+		(*(AwaitedPassword **)su_msg_data(msg))->finish();
+	}
+	void finish() {
+		// released once done, the continuation being run from this object
+		shared_ptr<AwaitedPassword> self;
+		self.swap(mSelf);
+		complete([this]() { mThen(mEv, mResult, mPassword); });
+	}
+
+	RequestAwait::PasswordContinuation mThen;
+	thread::id mMainThread;
+	shared_ptr<AwaitedPassword> mSelf;
+	AuthDbResult mResult;
+	string mPassword;
+};
+
+class AwaitedSleep : public AwaitedStep {
+  public:
+	AwaitedSleep(Agent *agent, const shared_ptr<RequestSipEvent> &ev, const RequestAwait::Continuation &then)
+		: AwaitedStep(agent, ev), mThen(then) {
+	}
+	void start(unsigned int seconds, const shared_ptr<AwaitedSleep> &self) {
+		// the callback holds this object, the timer service releasing it once fired
+		mTimer = mAgent->getTimers()->schedule(seconds, [self]() {
+			self->complete([&self]() { self->mThen(self->mEv); });
+		});
+		started();
+	}
+
+  private:
+	RequestAwait::Continuation mThen;
+	shared_ptr<TimerService::Timer> mTimer;
+};
+
+void RequestAwait::fetch(Agent *agent, const shared_ptr<RequestSipEvent> &ev, const url_t *url, bool recursive,
+						 const FetchContinuation &then) {
+	auto step = make_shared<AwaitedFetch>(agent, ev, then);
+	step->start(url, recursive, step);
+}
+
+void RequestAwait::getPassword(Agent *agent, const shared_ptr<RequestSipEvent> &ev, const string &user,
+							   const string &domain, const string &authUsername, const PasswordContinuation &then) {
+	auto step = make_shared<AwaitedPassword>(agent, ev, then);
+	step->start(user, domain, authUsername, step);
+}
+
+void RequestAwait::sleep(Agent *agent, const shared_ptr<RequestSipEvent> &ev, unsigned int seconds,
+						 const Continuation &then) {
+	auto step = make_shared<AwaitedSleep>(agent, ev, then);
+	step->start(seconds, step);
+}
@@ -0,0 +1,68 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef requestawait_hh
+#define requestawait_hh
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sofia-sip/url.h>
+
+#include "authdb.hh"
+
+class Agent;
+class Record;
+class RequestSipEvent;
+
+/*
+ * Asynchronous steps of the processing of a request by a module, in place of a listener class per operation: the
+ * nearest to a co_await this C++11 code can have. The operation is started, the request suspended if it does not
+ * complete at once, and the continuation called with its result. Once the continuation returns, the request goes on
+ * with the modules following the one that awaited, unless the continuation replied or suspended it again:
+ *   RequestAwait::fetch(getAgent(), ev, url, false, [this](std::shared_ptr<RequestSipEvent> &ev, Record *r) {
+ *       if (!r) ev->reply(SIP_404_NOT_FOUND, TAG_END());
+ *   });
+ * An operation completing before returning, as the fetches of the internal registrar or the passwords found in the
+ * cache, does not suspend the request: the dispatch in progress goes on with it. A single object is allocated per
+ * step, holding the request, the continuation and the listener of the operation. The continuation is always called
+ * from the main loop.
+ */
+class RequestAwait {
+  public:
+	typedef std::function<void(std::shared_ptr<RequestSipEvent> &ev)> Continuation;
+	typedef std::function<void(std::shared_ptr<RequestSipEvent> &ev, Record *r)> FetchContinuation;
+	typedef std::function<void(std::shared_ptr<RequestSipEvent> &ev, AuthDbResult result, const std::string &password)>
+		PasswordContinuation;
+
+	/* Fetch of the contacts of url, the record being NULL if none. The request is answered with 500 on error and with
+	 * 400 on a replayed CSeq without calling the continuation. */
+	static void fetch(Agent *agent, const std::shared_ptr<RequestSipEvent> &ev, const url_t *url, bool recursive,
+					  const FetchContinuation &then);
+	/* Lookup of the password of a user in the authentication database. */
+	static void getPassword(Agent *agent, const std::shared_ptr<RequestSipEvent> &ev, const std::string &user,
+							const std::string &domain, const std::string &authUsername,
+							const PasswordContinuation &then);
+	/* Wait of seconds of the timer service, one second late at most. */
+	static void sleep(Agent *agent, const std::shared_ptr<RequestSipEvent> &ev, unsigned int seconds,
+					  const Continuation &then);
+};
+
+#endif
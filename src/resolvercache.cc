@@ -0,0 +1,210 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "resolvercache.hh"
+#include "common.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sofia-sip/hostdomain.h>
+#include <sofia-sip/sofia-resolv/sres_record.h>
+
+using namespace std;
+
+ResolverCache::ResolverCache(su_root_t *root, int idleTime, int negativeTtl)
+	: mIdleTime(idleTime), mNegativeTtl(max(negativeTtl, 1)), mCountHits(NULL), mCountMisses(NULL),
+	  mCountPrefetches(NULL) {
+	mCache = sres_cache_new(0);
+	mResolver = sres_resolver_create(root, NULL, SRESTAG_CACHE(mCache), TAG_END());
+	if (mResolver == NULL)
+		LOGE("Could not create the DNS prefetch resolver, the names used for routing won't be prefetched");
+	mTickTimer = su_timer_create(su_root_task(root), 1000);
+	su_timer_set_for_ever(mTickTimer, &ResolverCache::sOnTick, this);
+}
+
+ResolverCache::~ResolverCache() {
+	su_timer_destroy(mTickTimer);
+	if (mResolver)
+		sres_resolver_destroy(mResolver);
+	set<Query *> pending;
+	pending.swap(mPending);
+	for (auto query : pending)
+		delete query;
+	sres_cache_unref(mCache);
+}
+
+void ResolverCache::setStats(StatCounter64 *hits, StatCounter64 *misses, StatCounter64 *prefetches) {
+	mCountHits = hits;
+	mCountMisses = misses;
+	mCountPrefetches = prefetches;
+}
+
+/* The same lookups as sofia for the destination, following RFC 3263. */
+void ResolverCache::touch(const url_t *dest) {
+	if (mResolver == NULL || dest == NULL || dest->url_host == NULL)
+		return;
+	char maddr[256] = {0};
+	char transport[16] = {0};
+	url_param(dest->url_params, "maddr", maddr, sizeof(maddr) - 1);
+	url_param(dest->url_params, "transport", transport, sizeof(transport) - 1);
+	string host = maddr[0] ? maddr : dest->url_host;
+	if (host_is_ip_address(host.c_str()))
+		return;
+
+	time_t now = getCurrentTime();
+	bool sips = dest->url_type == url_sips;
+	if (dest->url_port == NULL || dest->url_port[0] == '\0') {
+		if (transport[0] == '\0') {
+			use(sres_type_naptr, host, now, true);
+			if (!sips) {
+				use(sres_type_srv, "_sip._udp." + host, now, true);
+				use(sres_type_srv, "_sip._tcp." + host, now, true);
+			}
+			use(sres_type_srv, "_sips._tcp." + host, now, true);
+		} else if (strcasecmp(transport, "udp") == 0) {
+			use(sres_type_srv, "_sip._udp." + host, now, true);
+		} else if (strcasecmp(transport, "tcp") == 0) {
+			use(sres_type_srv, (sips ? "_sips._tcp." : "_sip._tcp.") + host, now, true);
+		} else if (strcasecmp(transport, "tls") == 0) {
+			use(sres_type_srv, "_sips._tcp." + host, now, true);
+		}
+	}
+	// used when there is no SRV record, or when the port is given
+	use(sres_type_a, host, now, true);
+	use(sres_type_aaaa, host, now, true);
+}
+
+/* The names used by the routing are counted in the statistics, the ones they lead to are only kept warm. */
+void ResolverCache::use(uint16_t type, const string &domain, time_t lastUsed, bool counted) {
+	string key = to_string(type) + " " + domain;
+	auto it = mEntries.find(key);
+	if (it == mEntries.end()) {
+		if (counted && mCountMisses)
+			++(*mCountMisses);
+		Entry &entry = mEntries[key];
+		entry.type = type;
+		entry.domain = domain;
+		entry.lastUsed = lastUsed;
+		query(key, entry, getCurrentTime());
+		return;
+	}
+	Entry &entry = it->second;
+	entry.lastUsed = max(entry.lastUsed, lastUsed);
+	time_t now = getCurrentTime();
+	if (counted) {
+		StatCounter64 *counter = entry.expireAt > now ? mCountHits : mCountMisses;
+		if (counter)
+			++(*counter);
+	}
+	if (!entry.pending && entry.refreshAt <= now)
+		query(key, entry, now);
+}
+
+void ResolverCache::query(const string &key, Entry &entry, time_t now) {
+	Query *q = new Query{this, key};
+	if (sres_query(mResolver, &ResolverCache::sOnAnswer, (sres_context_t *)q, entry.type, entry.domain.c_str()) ==
+		NULL) {
+		LOGW("Could not query %s for the DNS cache", key.c_str());
+		delete q;
+		entry.refreshAt = now + mNegativeTtl;
+		return;
+	}
+	if (entry.expireAt != 0 && mCountPrefetches)
+		++(*mCountPrefetches);
+	entry.pending = true;
+	mPending.insert(q);
+}
+
+void ResolverCache::onAnswer(Query *q, sres_record_t **answers) {
+	auto it = mEntries.find(q->key);
+	if (it == mEntries.end()) {
+		// no longer used
+		if (answers)
+			sres_free_answers(mResolver, answers);
+		return;
+	}
+	Entry &entry = it->second;
+	time_t now = getCurrentTime();
+	entry.pending = false;
+	if (answers == NULL) {
+		// timeout: the previous answer stays valid until it expires
+		LOGD("No DNS answer for %s", q->key.c_str());
+		entry.refreshAt = now + mNegativeTtl;
+		return;
+	}
+
+	uint32_t ttl = 0;
+	bool found = false;
+	for (int i = 0; answers[i] != NULL; ++i) {
+		const sres_common_t *record = answers[i]->sr_record;
+		if (record->r_status != 0 || record->r_type != entry.type)
+			continue;
+		ttl = found ? min(ttl, record->r_ttl) : record->r_ttl;
+		found = true;
+		if (entry.type == sres_type_naptr) {
+			const sres_naptr_record_t *naptr = answers[i]->sr_naptr;
+			if (naptr->na_flags && strcasecmp(naptr->na_flags, "s") == 0 && naptr->na_services &&
+				strncasecmp(naptr->na_services, "SIP", 3) == 0 && naptr->na_replace)
+				use(sres_type_srv, naptr->na_replace, entry.lastUsed, false);
+		} else if (entry.type == sres_type_srv) {
+			const sres_srv_record_t *srv = answers[i]->sr_srv;
+			if (srv->srv_target && strcmp(srv->srv_target, ".") != 0) {
+				use(sres_type_a, srv->srv_target, entry.lastUsed, false);
+				use(sres_type_aaaa, srv->srv_target, entry.lastUsed, false);
+			}
+		}
+	}
+	sres_free_answers(mResolver, answers);
+
+	if (!found) {
+		// negative caching
+		entry.expireAt = now + mNegativeTtl;
+		entry.refreshAt = entry.expireAt;
+		return;
+	}
+	// refreshed ahead of the expiry, by a fifth of the TTL and at least one second
+	entry.expireAt = now + ttl;
+	entry.refreshAt = now + (ttl > 1 ? ttl - max<uint32_t>(ttl / 5, 1) : 1);
+}
+
+void ResolverCache::onTick() {
+	time_t now = getCurrentTime();
+	for (auto it = mEntries.begin(); it != mEntries.end();) {
+		Entry &entry = it->second;
+		if (entry.lastUsed + mIdleTime < now) {
+			// its pending answer, if any, will be ignored
+			it = mEntries.erase(it);
+			continue;
+		}
+		if (!entry.pending && entry.refreshAt <= now)
+			query(it->first, entry, now);
+		++it;
+	}
+}
+
+void ResolverCache::sOnAnswer(sres_context_t *context, sres_query_t *query, sres_record_t **answers) {
+	Query *q = (Query *)context;
+	q->self->mPending.erase(q);
+	q->self->onAnswer(q, answers);
+	delete q;
+}
+
+void ResolverCache::sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<ResolverCache *>(arg)->onTick();
+}
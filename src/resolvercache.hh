@@ -0,0 +1,91 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef resolvercache_hh
+#define resolvercache_hh
+
+#include <ctime>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <sofia-sip/sresolv.h>
+#include <sofia-sip/sofia-resolv/sres_cache.h>
+#include <sofia-sip/url.h>
+
+#include "configmanager.hh"
+
+/*
+ * DNS cache shared with the resolver of the SIP stack, kept warm for the names used by the outgoing routing.
+ * The names of a destination are the ones sofia looks up for it (NAPTR, SRV, A and AAAA), and the SRV and address
+ * records they lead to. Each of them is queried again when 80% of its TTL has elapsed, as long as the name was used
+ * during the idle time, so that the SIP stack always finds it in the cache. Names without records are queried again
+ * after the negative TTL only.
+ */
+class ResolverCache {
+  public:
+	ResolverCache(su_root_t *root, int idleTime, int negativeTtl);
+	~ResolverCache();
+
+	/* To be given to the SIP stack with SRESTAG_CACHE(). */
+	sres_cache_t *getCache() const {
+		return mCache;
+	}
+	/* Notes that the names of dest are used for routing, and resolves the ones not known yet. */
+	void touch(const url_t *dest);
+	void setStats(StatCounter64 *hits, StatCounter64 *misses, StatCounter64 *prefetches);
+	size_t size() const {
+		return mEntries.size();
+	}
+
+  private:
+	struct Entry {
+		Entry() : type(0), lastUsed(0), refreshAt(0), expireAt(0), pending(false) {
+		}
+		uint16_t type;
+		std::string domain;
+		time_t lastUsed;
+		time_t refreshAt;
+		time_t expireAt; // 0 until answered, then end of the validity of the answer, negative or not
+		bool pending;
+	};
+	struct Query {
+		ResolverCache *self;
+		std::string key;
+	};
+
+	void use(uint16_t type, const std::string &domain, time_t lastUsed, bool counted);
+	void query(const std::string &key, Entry &entry, time_t now);
+	void onAnswer(Query *query, sres_record_t **answers);
+	void onTick();
+	static void sOnAnswer(sres_context_t *context, sres_query_t *query, sres_record_t **answers);
+	static void sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+
+	sres_cache_t *mCache;
+	sres_resolver_t *mResolver;
+	su_timer_t *mTickTimer;
+	int mIdleTime;
+	int mNegativeTtl;
+	std::unordered_map<std::string, Entry> mEntries;
+	std::set<Query *> mPending;
+	StatCounter64 *mCountHits;
+	StatCounter64 *mCountMisses;
+	StatCounter64 *mCountPrefetches;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "responsehistory.hh"
+#include "common.hh"
+#include "registrardb.hh"
+
+using namespace std;
+
+static const time_t sRetention = 24 * 3600;
+
+static const string &keyOf(const ExtendedContact &contact) {
+	return contact.mUniqueId.empty() ? contact.mCallId : contact.mUniqueId;
+}
+
+ResponseHistory::ResponseHistory(unsigned int threshold, unsigned int probeInterval)
+	: mThreshold(threshold), mProbeInterval(probeInterval) {
+}
+
+ResponseHistory::Entry &ResponseHistory::get(const ExtendedContact &contact) {
+	Entry &entry = mEntries[keyOf(contact)];
+	if (entry.mRegisteredAt != contact.mUpdatedTime) {
+		entry = Entry();
+		entry.mRegisteredAt = contact.mUpdatedTime;
+	}
+	entry.mLastCall = getCurrentTime();
+	return entry;
+}
+
+const ResponseHistory::Entry *ResponseHistory::find(const ExtendedContact &contact) const {
+	auto it = mEntries.find(keyOf(contact));
+	if (it == mEntries.end() || it->second.mRegisteredAt != contact.mUpdatedTime)
+		return NULL;
+	return &it->second;
+}
+
+void ResponseHistory::onAnswered(const ExtendedContact &contact, chrono::milliseconds delay) {
+	Entry &entry = get(contact);
+	// moving average over the last calls, the first one giving the initial value
+	if (entry.mAnswered == 0)
+		entry.mRingingDelay = delay;
+	else
+		entry.mRingingDelay = (entry.mRingingDelay * 3 + delay) / 4;
+	++entry.mAnswered;
+	entry.mUnanswered = 0;
+}
+
+void ResponseHistory::onUnanswered(const ExtendedContact &contact) {
+	Entry &entry = get(contact);
+	if (++entry.mUnanswered == mThreshold) {
+		SLOGI << "Device " << keyOf(contact) << " left " << mThreshold << " calls unanswered, now unresponsive";
+		entry.mLastProbe = entry.mLastCall; // the probe interval starts now
+	}
+}
+
+bool ResponseHistory::isUnresponsive(const ExtendedContact &contact) const {
+	const Entry *entry = find(contact);
+	return entry && mThreshold > 0 && entry->mUnanswered >= mThreshold;
+}
+
+bool ResponseHistory::shouldSkip(const ExtendedContact &contact) {
+	if (!isUnresponsive(contact))
+		return false;
+	Entry &entry = get(contact);
+	if (entry.mLastCall >= entry.mLastProbe + (time_t)mProbeInterval) {
+		entry.mLastProbe = entry.mLastCall;
+		return false;
+	}
+	return true;
+}
+
+chrono::milliseconds ResponseHistory::getRingingDelay(const ExtendedContact &contact) const {
+	const Entry *entry = find(contact);
+	return entry ? entry->mRingingDelay : chrono::milliseconds(0);
+}
+
+void ResponseHistory::sweep(SweepBudget &budget) {
+	time_t now = getCurrentTime();
+	auto it = mEntries.begin();
+	if (mSweepCursor) {
+		// an iterator would not survive the rehashes of the table in the meantime, the key does
+		it = mEntries.find(*mSweepCursor);
+		if (it == mEntries.end())
+			it = mEntries.begin();
+	}
+	while (it != mEntries.end() && budget.next()) {
+		if (now >= it->second.mLastCall + sRetention)
+			it = mEntries.erase(it);
+		else
+			++it;
+	}
+	if (it == mEntries.end())
+		mSweepCursor.reset();
+	else
+		mSweepCursor.reset(new string(it->first));
+}
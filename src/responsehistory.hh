@@ -0,0 +1,83 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef responsehistory_hh
+#define responsehistory_hh
+
+#include "utils/sweepbudget.hh"
+
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+struct ExtendedContact;
+
+/*
+ * How the devices answered the calls forked to them, by unique id: the calls they rang for or answered, the
+ * consecutive calls they let go without any response, and the average time they took to ring.
+ * A device that let threshold calls in a row go unanswered is considered unresponsive until it answers again or
+ * registers again, either way its history starts over. The history is local to the proxy and forgotten after a day
+ * without calls.
+ */
+class ResponseHistory {
+  public:
+	ResponseHistory(unsigned int threshold, unsigned int probeInterval);
+
+	/* A call branch to the device got a ringing, success or failure response from it after delay. */
+	void onAnswered(const ExtendedContact &contact, std::chrono::milliseconds delay);
+	/* A call branch to the device ended without response from it, or timed out. */
+	void onUnanswered(const ExtendedContact &contact);
+	bool isUnresponsive(const ExtendedContact &contact) const;
+	/*
+	 * Whether a call may leave out the device, being unresponsive. Returns false once per probe interval, so that the
+	 * device is tried again from time to time.
+	 */
+	bool shouldSkip(const ExtendedContact &contact);
+	/* Average time the device takes to ring, zero when not known. */
+	std::chrono::milliseconds getRingingDelay(const ExtendedContact &contact) const;
+	/* Forgets the devices that were not called for a day, from where the previous slice stopped. */
+	void sweep(SweepBudget &budget);
+	size_t size() const {
+		return mEntries.size();
+	}
+
+  private:
+	struct Entry {
+		Entry() : mRegisteredAt(0), mLastCall(0), mLastProbe(0), mAnswered(0), mUnanswered(0), mRingingDelay(0) {
+		}
+		time_t mRegisteredAt; // registration of the device the history is about
+		time_t mLastCall;
+		time_t mLastProbe;
+		unsigned int mAnswered;
+		unsigned int mUnanswered; // consecutive
+		std::chrono::milliseconds mRingingDelay;
+	};
+
+	/* Entry of the current registration of the device, started over when it registered again. */
+	Entry &get(const ExtendedContact &contact);
+	const Entry *find(const ExtendedContact &contact) const;
+
+	std::unordered_map<std::string, Entry> mEntries;
+	std::unique_ptr<std::string> mSweepCursor;
+	unsigned int mThreshold;
+	unsigned int mProbeInterval;
+};
+
+#endif
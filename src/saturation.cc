@@ -0,0 +1,101 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "saturation.hh"
+
+#include <algorithm>
+#include <ctime>
+
+using namespace std;
+
+/* Period of the timer whose lag is measured: a timer of the main loop is late by the time taken to process what was
+ * ready before it. */
+static const chrono::milliseconds sTickInterval(100);
+
+/* Number of ticks over which the busy ratio and the largest lag are measured. */
+static const int sTicksPerWindow = 10;
+
+SaturationMonitor::SaturationMonitor(su_root_t *root, int maxDelay)
+	: mMaxDelay((uint64_t)max(1, maxDelay)), mWindowCpuStart(threadCpuTime()), mWindowMaxLag(0), mCountBusy(NULL),
+	  mCountLag(NULL), mCountHeadroom(NULL) {
+	for (int r = 0; r < ResourceCount; ++r)
+		mLoads[r] = 0;
+	mTimer = su_timer_create(su_root_task(root), sTickInterval.count());
+	mTickSetAt = mWindowStart = Clock::now();
+	su_timer_set(mTimer, &SaturationMonitor::sOnTick, this);
+}
+
+SaturationMonitor::~SaturationMonitor() {
+	su_timer_destroy(mTimer);
+}
+
+void SaturationMonitor::setStats(StatCounter64 *busy, StatCounter64 *lag, StatCounter64 *headroom) {
+	mCountBusy = busy;
+	mCountLag = lag;
+	mCountHeadroom = headroom;
+}
+
+void SaturationMonitor::setLoad(Resource resource, uint64_t load) {
+	mLoads[resource] = load;
+}
+
+uint64_t SaturationMonitor::getHeadroom() const {
+	uint64_t load = *max_element(mLoads, mLoads + ResourceCount);
+	return load < 1000 ? 1000 - load : 0;
+}
+
+chrono::nanoseconds SaturationMonitor::threadCpuTime() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return chrono::nanoseconds(0);
+	return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+}
+
+void SaturationMonitor::sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<SaturationMonitor *>(arg)->onTick();
+}
+
+/* The timer is set again from each tick rather than run at intervals, sofia catching up the missed intervals at once,
+ * which would hide the lag. */
+void SaturationMonitor::onTick() {
+	Clock::time_point now = Clock::now();
+	auto lag = chrono::duration_cast<chrono::microseconds>(now - mTickSetAt - sTickInterval);
+	mWindowMaxLag = max(mWindowMaxLag, lag);
+	if (now - mWindowStart >= sTicksPerWindow * sTickInterval)
+		refresh();
+	mTickSetAt = Clock::now();
+	su_timer_set(mTimer, &SaturationMonitor::sOnTick, this);
+}
+
+void SaturationMonitor::refresh() {
+	Clock::time_point now = Clock::now();
+	chrono::nanoseconds cpu = threadCpuTime();
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(now - mWindowStart);
+	mLoads[MainLoop] = elapsed.count() > 0 ? (uint64_t)((cpu - mWindowCpuStart).count() * 1000 / elapsed.count()) : 0;
+	// microseconds over milliseconds: in per mille
+	mLoads[MainLoopLag] = (uint64_t)mWindowMaxLag.count() / mMaxDelay;
+	if (mCountBusy)
+		mCountBusy->set(mLoads[MainLoop]);
+	if (mCountLag)
+		mCountLag->set((uint64_t)mWindowMaxLag.count());
+	if (mCountHeadroom)
+		mCountHeadroom->set(getHeadroom());
+	mWindowStart = now;
+	mWindowCpuStart = cpu;
+	mWindowMaxLag = chrono::microseconds(0);
+}
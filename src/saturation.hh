@@ -0,0 +1,76 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef saturation_hh
+#define saturation_hh
+
+#include <chrono>
+#include <cstdint>
+
+#include <sofia-sip/su_wait.h>
+
+#include "configmanager.hh"
+
+/*
+ * Saturation of the proxy, to base the autoscaling on: the SIP thread runs all the signaling, so it saturates while
+ * the total CPU usage of the machine still looks low. The load of each resource is expressed in per mille of its
+ * capacity, possibly above 1000: the busy time of the main loop and the lag of its timers are measured here every
+ * second, the other resources are reported by the modules using them, when they refresh their statistics. The
+ * headroom is what is left of the capacity of the most loaded resource.
+ */
+class SaturationMonitor {
+  public:
+	enum Resource { MainLoop, MainLoopLag, RelayThreads, ThreadPools, Redis, PushNotifications, ResourceCount };
+
+	/* maxDelay is the lag of the main loop, or wait in a thread pool, in milliseconds taken as a full load. */
+	SaturationMonitor(su_root_t *root, int maxDelay);
+	~SaturationMonitor();
+
+	/* The gauges of the busy ratio of the main loop in per mille, of its lag in microseconds and of the headroom. */
+	void setStats(StatCounter64 *busy, StatCounter64 *lag, StatCounter64 *headroom);
+	/* Load of a resource in per mille, kept until reported again. */
+	void setLoad(Resource resource, uint64_t load);
+	/* Load of a wait of waitMs milliseconds, relative to the maximum delay. */
+	uint64_t getDelayLoad(uint64_t waitMs) const {
+		return waitMs * 1000 / mMaxDelay;
+	}
+	/* In per mille, 0 once a resource is fully loaded. */
+	uint64_t getHeadroom() const;
+
+  private:
+	typedef std::chrono::steady_clock Clock;
+
+	static void sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onTick();
+	void refresh();
+	/* CPU time of the calling thread. */
+	static std::chrono::nanoseconds threadCpuTime();
+
+	su_timer_t *mTimer;
+	uint64_t mMaxDelay; // in milliseconds
+	uint64_t mLoads[ResourceCount];
+	Clock::time_point mTickSetAt;
+	Clock::time_point mWindowStart;
+	std::chrono::nanoseconds mWindowCpuStart;
+	std::chrono::microseconds mWindowMaxLag;
+	StatCounter64 *mCountBusy;
+	StatCounter64 *mCountLag;
+	StatCounter64 *mCountHeadroom;
+};
+
+#endif
@@ -19,7 +19,13 @@
 #include "sdp-modifier.hh"
 
 #include <sofia-sip/sip_protos.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <vector>
 #include <ortp/payloadtype.h>
 
 
@@ -303,22 +309,73 @@ list<PayloadType *> SdpModifier::readPayloads(){
 }
 
 
+/*
+ * The offers of the clients are few distinct ones, and the Transcoder module always intersects them with the same
+ * list: the positions of the matches are remembered for each pair of lists, keyed by their mime types and rates, so
+ * that the negotiation of a known offer compares no strings.
+ */
+namespace {
+class CommonPayloadsCache {
+public:
+	typedef std::vector<std::pair<size_t, size_t>> Matches;
+	bool find(const string &key, Matches &matches){
+		lock_guard<mutex> lock(mMutex);
+		auto it = mEntries.find(key);
+		if (it == mEntries.end()) return false;
+		matches = it->second;
+		return true;
+	}
+	void insert(const string &key, const Matches &matches){
+		lock_guard<mutex> lock(mMutex);
+		// forgotten at once when full: only unusual offers may fill it
+		if (mEntries.size() >= sMaxEntries) mEntries.clear();
+		mEntries[key] = matches;
+	}
+private:
+	static const size_t sMaxEntries = 1024;
+	mutex mMutex;
+	unordered_map<string, Matches> mEntries;
+};
+
+CommonPayloadsCache sCommonPayloadsCache;
+
+void appendPayloadsKey(string &key, const std::vector<PayloadType *> &payloads){
+	char rate[16];
+	for (auto pt : payloads){
+		for (const char *c = pt->mime_type; *c; ++c) key += (char)tolower((unsigned char)*c);
+		snprintf(rate, sizeof(rate), "/%i,", pt->clock_rate);
+		key += rate;
+	}
+	key += '|';
+}
+}
+
 std::list< PayloadType * > SdpModifier::findCommon(const std::list< PayloadType * > &offer, const std::list< PayloadType * > &answer, bool use_offer_numbering){
-	std::list< PayloadType * > ret;
-	for (auto e1=offer.cbegin();e1!=offer.cend();++e1){
-		PayloadType *pt1=*e1;
-		for(auto e2=answer.cbegin();e2!=answer.cend();++e2){
-			PayloadType *pt2=*e2;
-			if (strcasecmp(pt1->mime_type,pt2->mime_type)==0
-				&& pt1->clock_rate==pt2->clock_rate ){
-				PayloadType *found=payload_type_clone(pt2);
-			if (use_offer_numbering)
-				payload_type_set_number(found,payload_type_get_number(pt1));
-			else
-				payload_type_set_number(found,payload_type_get_number(pt2));
-			ret.push_back(found);
+	std::vector<PayloadType *> offered(offer.cbegin(), offer.cend());
+	std::vector<PayloadType *> answered(answer.cbegin(), answer.cend());
+	string key;
+	appendPayloadsKey(key, offered);
+	appendPayloadsKey(key, answered);
+	CommonPayloadsCache::Matches matches;
+	if (!sCommonPayloadsCache.find(key, matches)){
+		for (size_t i = 0; i < offered.size(); ++i){
+			for (size_t j = 0; j < answered.size(); ++j){
+				if (strcasecmp(offered[i]->mime_type, answered[j]->mime_type) == 0
+					&& offered[i]->clock_rate == answered[j]->clock_rate){
+					matches.emplace_back(i, j);
 				}
+			}
 		}
+		sCommonPayloadsCache.insert(key, matches);
+	}
+	std::list< PayloadType * > ret;
+	for (auto &match : matches){
+		PayloadType *found=payload_type_clone(answered[match.second]);
+		if (use_offer_numbering)
+			payload_type_set_number(found,payload_type_get_number(offered[match.first]));
+		else
+			payload_type_set_number(found,payload_type_get_number(answered[match.second]));
+		ret.push_back(found);
 	}
 	return ret;
 }
@@ -432,20 +489,18 @@ void SdpModifier::changeMediaConnection(sdp_media_t *mline, const char *relay_ip
 	}
 }
 
-void SdpModifier::addIceCandidate(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-			std::function< std::pair<std::string,int>(int )> getDestAddrFcn, std::function< MasqueradeContextPair(int )> getMasqueradeContexts, bool isOffer, bool forceRelay){
+void SdpModifier::addIceCandidate(const SdpRelayTable &relays, bool isOffer, bool forceRelay){
+	static const SdpRelayAddress sNoRelay;
 	char foundation[32];
 	sdp_media_t *mline=mSession->sdp_media;
 	uint64_t r;
 	int i;
-	string global_c_address;
-
-	if (mSession->sdp_connection && mSession->sdp_connection->c_address) global_c_address=mSession->sdp_connection->c_address;
 
 	r = (((uint64_t)random()) << 32) | (((uint64_t)random()) & 0xffffffff);
 	snprintf(foundation, sizeof(foundation), "%llx", (long long unsigned int)r);
 	for(i=0;mline!=NULL;mline=mline->m_next,++i){
-		MasqueradeContextPair mctxs = getMasqueradeContexts(i);
+		const SdpRelayAddress &relay = (size_t)i < relays.size() ? relays[i] : sNoRelay;
+		const MasqueradeContextPair &mctxs = relay.contexts;
 		bool needsCandidates = false;
 
 		if (mctxs.valid()){
@@ -463,25 +518,24 @@ void SdpModifier::addIceCandidate(std::function< std::pair<std::string,int>(int
 
 		if (needsCandidates) {
 			uint32_t priority;
-			auto relayAddr=getRelayAddrFcn(i);
-			auto destAddr=getDestAddrFcn(i);
 
 			if (forceRelay){
 				/* Masquerade c line and port for non-ICE clients.
 				 Ice-enabled targets don't need this.*/
-				changeMediaConnection(mline, relayAddr.first.c_str());
-				mline->m_port=(unsigned long)relayAddr.second;
-				changeRtcpAttr(mline, relayAddr.first, relayAddr.second + 1);
+				changeMediaConnection(mline, relay.relayIp.c_str());
+				mline->m_port=(unsigned long)relay.relayPort;
+				changeRtcpAttr(mline, relay.relayIp, relay.relayPort + 1);
 			}
 
 			for (uint16_t componentID=1; componentID<=2; componentID++) {
 
-				if (!hasIceCandidate(mline, relayAddr.first.c_str(), relayAddr.second + componentID - 1)) {
+				if (!hasIceCandidate(mline, relay.relayIp, relay.relayPort + componentID - 1)) {
 					priority = (65535 << 8) | (256 - componentID);
-					ostringstream candidate_line;
-					candidate_line << foundation << ' ' << componentID << " UDP " << priority << ' ' << relayAddr.first.c_str() << ' ' << relayAddr.second + componentID - 1
-						<< " typ relay raddr " << destAddr.first << " rport " << destAddr.second + componentID - 1;
-					addMediaAttribute(mline, "candidate", candidate_line.str().c_str());
+					// formatted in place, in the home the attribute belongs to
+					appendMediaAttribute(mline, "candidate",
+						su_sprintf(mHome, "%s %u UDP %u %s %i typ relay raddr %s rport %i", foundation,
+							(unsigned)componentID, priority, relay.relayIp.c_str(), relay.relayPort + componentID - 1,
+							relay.destIp.c_str(), relay.destPort + componentID - 1));
 				}
 			}
 			if (!mNortproxy.empty()) addMediaAttribute(mline, mNortproxy.c_str(), "yes");
@@ -489,14 +543,12 @@ void SdpModifier::addIceCandidate(std::function< std::pair<std::string,int>(int
 	}
 }
 
-void SdpModifier::addIceCandidateInOffer(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-			std::function< std::pair<std::string,int>(int )> getDestAddrFcn, std::function< MasqueradeContextPair(int )> getMasqueradeContexts, bool forceRelay){
-	addIceCandidate(getRelayAddrFcn, getDestAddrFcn, getMasqueradeContexts, true, forceRelay);
+void SdpModifier::addIceCandidateInOffer(const SdpRelayTable &relays, bool forceRelay){
+	addIceCandidate(relays, true, forceRelay);
 }
 
-void SdpModifier::addIceCandidateInAnswer(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-	std::function< std::pair<std::string,int>(int )> getDestAddrFcn, std::function< MasqueradeContextPair(int )> getMasqueradeContexts, bool forceRelay){
-	addIceCandidate(getRelayAddrFcn, getDestAddrFcn, getMasqueradeContexts, false, forceRelay);
+void SdpModifier::addIceCandidateInAnswer(const SdpRelayTable &relays, bool forceRelay){
+	addIceCandidate(relays, false, forceRelay);
 }
 
 void SdpModifier::iterate(function<void(int, const string &, int )> fct){
@@ -560,7 +612,8 @@ void SdpModifier::changeRtcpAttr(sdp_media_t *mline, const string & relayAddr, i
 	}
 }
 
-void SdpModifier::masquerade(function< pair<string,int>(int )> fct){
+void SdpModifier::masquerade(const SdpRelayTable &relays){
+	static const SdpRelayAddress sNoRelay;
 	sdp_media_t *mline=mSession->sdp_media;
 	int i;
 	string global_c_address;
@@ -573,21 +626,21 @@ void SdpModifier::masquerade(function< pair<string,int>(int )> fct){
 		if (hasMediaAttribute(mline, "candidate")) continue; /*only masquerade if ICE is not involved*/
 
 		if (hasMediaAttribute(mline,mNortproxy.c_str())) continue;
-		pair<string,int> relayAddr=fct(i);
+		const SdpRelayAddress &relay = (size_t)i < relays.size() ? relays[i] : sNoRelay;
 
 		if (mline->m_connections){
-			changeConnection(mline->m_connections, relayAddr.first.c_str());
+			changeConnection(mline->m_connections, relay.relayIp.c_str());
 		}else if (mSession->sdp_connection){
 			if (sdp_connection_translated){
 				// If the global connection has already been translated, add a media specific connection if needed
-				changeMediaConnection(mline,relayAddr.first.c_str());
+				changeMediaConnection(mline,relay.relayIp.c_str());
 			}else{
-				changeConnection(mSession->sdp_connection, relayAddr.first.c_str());
+				changeConnection(mSession->sdp_connection, relay.relayIp.c_str());
 				sdp_connection_translated = true;
 			}
 		}
-		mline->m_port=(unsigned long)relayAddr.second;
-		changeRtcpAttr(mline, relayAddr.first, relayAddr.second + 1);
+		mline->m_port=(unsigned long)relay.relayPort;
+		changeRtcpAttr(mline, relay.relayIp, relay.relayPort + 1);
 	}
 
 	if (sdp_connection_translated) {
@@ -602,12 +655,12 @@ void SdpModifier::masquerade(function< pair<string,int>(int )> fct){
 	}
 }
 
-void SdpModifier::masqueradeInOffer(std::function< std::pair<std::string,int>(int )> getAddrFcn){
-	masquerade(getAddrFcn);
+void SdpModifier::masqueradeInOffer(const SdpRelayTable &relays){
+	masquerade(relays);
 }
 
-void SdpModifier::masqueradeInAnswer( std::function< std::pair<std::string,int>(int )> getAddrFcn ) {
-	masquerade(getAddrFcn);
+void SdpModifier::masqueradeInAnswer(const SdpRelayTable &relays) {
+	masquerade(relays);
 }
 
 
@@ -625,18 +678,19 @@ bool SdpModifier::hasIceCandidate(sdp_media_t *mline, const string &addr, int po
 	sdp_attribute_t *candidate = mline->m_attributes;
 
 	while ((candidate = sdp_attribute_find(candidate,"candidate")) != NULL) {
-		string foundation, protocol, candidate_addr, type;
-		int componentID, candidate_port;
-		uint32_t priority;
-		istringstream stream(string(candidate->a_value));
-		stream >> foundation;
-		stream >> componentID;
-		stream >> protocol;
-		stream >> priority;
-		stream >> candidate_addr;
-		stream >> candidate_port;
-		stream >> type;
-		if ((candidate_port == port) && (addr.compare(candidate_addr) == 0)) return true;
+		/* foundation component-id transport priority connection-address port ... */
+		const char *field = candidate->a_value;
+		for (int skipped = 0; field && skipped < 4; ++skipped) {
+			field += strspn(field, " ");
+			field = strchr(field, ' ');
+		}
+		if (field) {
+			field += strspn(field, " ");
+			size_t length = strcspn(field, " ");
+			if (length == addr.size() && addr.compare(0, length, field, length) == 0 &&
+				atoi(field + length) == port)
+				return true;
+		}
 		candidate = candidate->a_next;
 	}
 	return false;
@@ -651,6 +705,15 @@ void SdpModifier::addAttribute(const char *name, const char *value) {
 	sdp_attribute_append(&mSession->sdp_attributes,a);
 }
 
+void SdpModifier::appendMediaAttribute(sdp_media_t *mline, const char *name, char *value)
+{
+	sdp_attribute_t *a=(sdp_attribute_t *)su_zalloc(mHome, sizeof(sdp_attribute_t));
+	a->a_size=sizeof(*a);
+	a->a_name=name;
+	a->a_value=value;
+	sdp_attribute_append(&mline->m_attributes,a);
+}
+
 void SdpModifier::addMediaAttribute(sdp_media_t *mline, const char *name, const char *value)
 {
 	sdp_attribute_t *a=(sdp_attribute_t *)su_alloc(mHome, sizeof(sdp_attribute_t));
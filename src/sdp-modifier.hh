@@ -23,6 +23,7 @@
 #include <string>
 #include <list>
 #include <memory>
+#include <vector>
 #include "ortp/payloadtype.h"
 
 
@@ -59,6 +60,21 @@ struct MasqueradeContextPair{
 	}
 };
 
+/* The relay of the stream of an mline: the address announced to the recipient of the SDP, the address of its sender
+ * and the ICE contexts of both. */
+struct SdpRelayAddress{
+	SdpRelayAddress() : relayPort(0), destPort(0), contexts(nullptr, nullptr){
+	}
+	std::string relayIp;
+	int relayPort;
+	std::string destIp;
+	int destPort;
+	MasqueradeContextPair contexts;
+};
+
+/* The relays of an offer or an answer by mline index, looked up once for all the changes made to the SDP. */
+typedef std::vector<SdpRelayAddress> SdpRelayTable;
+
 /**
  * Utility class used to do various changes in an existing SDP message.
 **/
@@ -76,34 +92,32 @@ class SdpModifier{
 		void changeAudioIpPort(const char *ip, int port);
 		void changeConnection(sdp_connection_t *c, const char *ip);
 		void changeMediaConnection(sdp_media_t *mline, const char *relay_ip);
-		void addIceCandidateInOffer(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-			std::function< std::pair<std::string,int>(int )> getDestAddrFcn,
-			std::function< MasqueradeContextPair(int )> getMasqueradeContexts,
-			bool forceRelay);
-		void addIceCandidateInAnswer(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-			std::function< std::pair<std::string,int>(int )> getDestAddrFcn, 
-			std::function< MasqueradeContextPair(int )> getMasqueradeContexts,
-			bool forceRelay);
+		void addIceCandidateInOffer(const SdpRelayTable &relays, bool forceRelay);
+		void addIceCandidateInAnswer(const SdpRelayTable &relays, bool forceRelay);
 		void iterateInOffer(std::function<void(int, const std::string &, int)>);
 		void iterateInAnswer(std::function<void(int, const std::string &, int)>);
-		void masqueradeInOffer(std::function< std::pair<std::string,int>(int )> getAddrFcn);
-		void masqueradeInAnswer(std::function< std::pair<std::string,int>(int )> getAddrFcn);
+		void masqueradeInOffer(const SdpRelayTable &relays);
+		void masqueradeInAnswer(const SdpRelayTable &relays);
 		void addAttribute(const char *name, const char *value);
 		bool hasAttribute(const char *name);
 		void addMediaAttribute(sdp_media_t *mline, const char *name, const char *value);
 		bool hasMediaAttribute(sdp_media_t *mline, const char *name);
 		bool hasIceCandidate(sdp_media_t *mline, const std::string &addr, int port);
 		int update(msg_t *msg, sip_t *sip);
+		void setNortproxy(const std::string &nortproxy){
+			mNortproxy = nortproxy;
+		}
 		void setPtime(int ptime);
 		virtual ~SdpModifier();
 		SdpModifier(su_home_t *home, std::string nortproxy);
 		sdp_session_t *mSession;
 		sip_t *mSip;
 	private:
-		void addIceCandidate(std::function< std::pair<std::string,int>(int )> getRelayAddrFcn,
-			std::function< std::pair<std::string,int>(int )> getDestAddrFcn, std::function< MasqueradeContextPair(int )> getMasqueradeContexts, bool isOffer, bool forceRelay);
+		void addIceCandidate(const SdpRelayTable &relays, bool isOffer, bool forceRelay);
 		void iterate(std::function<void(int, const std::string &, int)>);
-		void masquerade(std::function< std::pair<std::string,int>(int )> getAddrFcn);
+		void masquerade(const SdpRelayTable &relays);
+		/* Appends an attribute whose name is a literal and whose value is already allocated in mHome. */
+		void appendMediaAttribute(sdp_media_t *mline, const char *name, char *value);
 		void changeRtcpAttr(sdp_media_t *mline, const std::string & relayAddr, int port);
 		sdp_parser_t *mParser;
 		su_home_t *mHome;
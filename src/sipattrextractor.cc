@@ -76,6 +76,8 @@ static string addr_get(const string &key, size_t pos, const sip_addr_s *addr) {
 		throw invalid_argument("No address found in sip msg for " + key);
 	if (id == "uri")
 		return url_get(key, pos, addr->a_url);
+	if (id == "tag")
+		return cstring_or_empty_get(key, pos, addr->a_tag);
 	throw runtime_error("addr_get: unhandled arg '" + id + "' in " + key);
 }
 
@@ -121,6 +123,10 @@ static bool is_request(const sip_t *sip) {
 }
 
 std::string SipAttributes::get(const std::string &key) const {
+	Attribute attr = resolve(key);
+	if (attr != UnknownAttribute)
+		return get(attr);
+
 	size_t pos = 0;
 	string id = subKey(key, &pos);
 
@@ -150,3 +156,159 @@ bool SipAttributes::isTrue(const string &key) const {
 	}
 	throw runtime_error("unhandled true/false " + key);
 };
+
+static const struct {
+	const char *name;
+	SipAttributes::Attribute attr;
+} sAttributes[] = {{"from.uri.domain", SipAttributes::FromUriDomain},
+				   {"from.uri.user", SipAttributes::FromUriUser},
+				   {"from.uri.params", SipAttributes::FromUriParams},
+				   {"to.uri.domain", SipAttributes::ToUriDomain},
+				   {"to.uri.user", SipAttributes::ToUriUser},
+				   {"to.uri.params", SipAttributes::ToUriParams},
+				   {"request.uri.domain", SipAttributes::RequestUriDomain},
+				   {"request.uri.user", SipAttributes::RequestUriUser},
+				   {"request.uri.params", SipAttributes::RequestUriParams},
+				   {"request.mn", SipAttributes::RequestMethodName},
+				   {"request.method-name", SipAttributes::RequestMethodName},
+				   {"direction", SipAttributes::Direction},
+				   {"status.phrase", SipAttributes::StatusPhrase},
+				   {"status.code", SipAttributes::StatusCode},
+				   {"ua", SipAttributes::UserAgent},
+				   {"user-agent", SipAttributes::UserAgent},
+				   {"callid", SipAttributes::CallId},
+				   {"callid.hash", SipAttributes::CallIdHash}};
+
+SipAttributes::Attribute SipAttributes::resolve(const string &key) {
+	for (const auto &entry : sAttributes) {
+		if (key == entry.name)
+			return entry.attr;
+	}
+	return UnknownAttribute;
+}
+
+static const char *attribute_name(SipAttributes::Attribute attr) {
+	for (const auto &entry : sAttributes) {
+		if (entry.attr == attr)
+			return entry.name;
+	}
+	return "unknown";
+}
+
+static const url_t *addr_url(SipAttributes::Attribute attr, const sip_addr_s *addr) {
+	if (!addr)
+		throw invalid_argument(string("No address found in sip msg for ") + attribute_name(attr));
+	if (!addr->a_url)
+		throw invalid_argument(string("No url found in sip msg for ") + attribute_name(attr));
+	return addr->a_url;
+}
+
+static const url_t *request_url(SipAttributes::Attribute attr, const sip_request_t *req) {
+	if (!req)
+		throw invalid_argument(string("No request found in sip msg for ") + attribute_name(attr));
+	if (!req->rq_url)
+		throw invalid_argument(string("No url found in sip msg for ") + attribute_name(attr));
+	return req->rq_url;
+}
+
+static const char *attr_cstring(SipAttributes::Attribute attr, const char *str) {
+	if (!str)
+		throw invalid_argument(string("Null string found in sip msg for ") + attribute_name(attr));
+	return str;
+}
+
+static string attr_cstring_or_empty(const char *str) {
+	return str ? str : "";
+}
+
+/*
+ * Finds the field an attribute comes from, either a string or a number, throwing when it is missing.
+ */
+void SipAttributes::extract(Attribute attr, const char **source, int *number) const {
+	*number = 0;
+	switch (attr) {
+		case FromUriDomain:
+			*source = attr_cstring(attr, addr_url(attr, (sip_addr_s *)sip->sip_from)->url_host);
+			return;
+		case FromUriUser:
+			*source = attr_cstring(attr, addr_url(attr, (sip_addr_s *)sip->sip_from)->url_user);
+			return;
+		case FromUriParams:
+			*source = addr_url(attr, (sip_addr_s *)sip->sip_from)->url_params;
+			return;
+		case ToUriDomain:
+			*source = attr_cstring(attr, addr_url(attr, (sip_addr_s *)sip->sip_to)->url_host);
+			return;
+		case ToUriUser:
+			*source = attr_cstring(attr, addr_url(attr, (sip_addr_s *)sip->sip_to)->url_user);
+			return;
+		case ToUriParams:
+			*source = addr_url(attr, (sip_addr_s *)sip->sip_to)->url_params;
+			return;
+		case RequestUriDomain:
+			*source = attr_cstring(attr, request_url(attr, sip->sip_request)->url_host);
+			return;
+		case RequestUriUser:
+			*source = attr_cstring(attr, request_url(attr, sip->sip_request)->url_user);
+			return;
+		case RequestUriParams:
+			*source = request_url(attr, sip->sip_request)->url_params;
+			return;
+		case RequestMethodName:
+			if (!sip->sip_request)
+				throw invalid_argument(string("No request found in sip msg for ") + attribute_name(attr));
+			*source = attr_cstring(attr, sip->sip_request->rq_method_name);
+			return;
+		case Direction:
+			*source = is_request(sip) ? "request" : "response";
+			return;
+		case StatusPhrase:
+			if (!sip->sip_status)
+				throw invalid_argument(string("No status found in sip msg for ") + attribute_name(attr));
+			*source = attr_cstring(attr, sip->sip_status->st_phrase);
+			return;
+		case StatusCode:
+			if (!sip->sip_status)
+				throw invalid_argument(string("No status found in sip msg for ") + attribute_name(attr));
+			*source = NULL;
+			*number = sip->sip_status->st_status;
+			return;
+		case UserAgent:
+			if (!sip->sip_user_agent)
+				throw invalid_argument(string("No user-agent found in sip msg for ") + attribute_name(attr));
+			*source = attr_cstring(attr, sip->sip_user_agent->g_string);
+			return;
+		case CallId:
+			if (!sip->sip_call_id)
+				throw invalid_argument(string("No call-id found in sip msg for ") + attribute_name(attr));
+			*source = attr_cstring(attr, sip->sip_call_id->i_id);
+			return;
+		case CallIdHash:
+			if (!sip->sip_call_id)
+				throw invalid_argument(string("No call-id found in sip msg for ") + attribute_name(attr));
+			*source = NULL;
+			*number = sip->sip_call_id->i_hash;
+			return;
+		case UnknownAttribute:
+		case AttributeCount:
+			break;
+	}
+	throw runtime_error(string("unhandled attribute ") + attribute_name(attr));
+}
+
+const std::string &SipAttributes::get(Attribute attr) const {
+	const char *source;
+	int number;
+	extract(attr, &source, &number);
+	CachedValue &cached = mCache[attr];
+	if (cached.valid && cached.source == source && cached.number == number)
+		return cached.value;
+	if (attr == StatusCode || attr == CallIdHash)
+		cached.value = int_get(string(), 0, number);
+	else
+		cached.value = attr_cstring_or_empty(source);
+	cached.source = source;
+	cached.number = number;
+	cached.valid = true;
+	return cached.value;
+}
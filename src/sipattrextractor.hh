@@ -42,6 +42,49 @@ class SipAttributes {
 	}
 
 	std::string get(const std::string &arg) const;
+#ifndef NO_SOFIA
+	/* Attributes resolved once when an expression is parsed, so that evaluating it does not parse their names. */
+	enum Attribute {
+		UnknownAttribute,
+		FromUriDomain,
+		FromUriUser,
+		FromUriParams,
+		ToUriDomain,
+		ToUriUser,
+		ToUriParams,
+		RequestUriDomain,
+		RequestUriUser,
+		RequestUriParams,
+		RequestMethodName,
+		Direction,
+		StatusPhrase,
+		StatusCode,
+		UserAgent,
+		CallId,
+		CallIdHash,
+		AttributeCount
+	};
+	/* Returns UnknownAttribute for the names get() does not handle with a fixed accessor. */
+	static Attribute resolve(const std::string &arg);
+	/* The reference remains valid until the attribute is asked again after a change of the message. */
+	const std::string &get(Attribute attr) const;
+
+  private:
+	/*
+	 * Values extracted from the message, shared by the filters of all the modules processing it.
+	 * A value is extracted again when the field it comes from is no longer the same, as modules modify the message.
+	 */
+	struct CachedValue {
+		bool valid = false;
+		const char *source = NULL;
+		int number = 0;
+		std::string value;
+	};
+	void extract(Attribute attr, const char **source, int *number) const;
+	mutable CachedValue mCache[AttributeCount];
+
+  public:
+#endif
 
 	std::string getOrEmpty(const std::string &arg) const {
 		if (arg == "method_or_status") {
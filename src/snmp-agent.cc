@@ -22,10 +22,13 @@
 #include <functional>
 #include "snmp-agent.h"
 #include "configmanager.hh"
+#include "agent.hh"
 
 using namespace std;
 
 SnmpAgent::~SnmpAgent() {
+	if (mSnapshotTimer)
+		su_timer_destroy(mSnapshotTimer);
 	mTask.mKeepRunning = false;
 	LOGD("Waiting for the SNMP agent task to terminate");
 	mThread.join();
@@ -57,5 +60,16 @@ void SnmpAgent::SnmpAgentTask::operator()() {
 }
 
 SnmpAgent::SnmpAgent(Agent &agent, GenericManager &cm, map<string, string> &oset)
-	: mTask(agent, cm, oset), mThread(std::ref(mTask)) {
+	: mTask(agent, cm, oset), mSnapshotTimer(NULL) {
+	if (mTask.mKeepRunning) {
+		// published before the thread starts, so that its first reads are answered from a snapshot too
+		cm.publishSnmpSnapshot();
+		mSnapshotTimer = su_timer_create(su_root_task(agent.getRoot()), 1000);
+		su_timer_set_for_ever(mSnapshotTimer, &SnmpAgent::sOnSnapshotTimer, &cm);
+	}
+	mThread = thread(std::ref(mTask));
+}
+
+void SnmpAgent::sOnSnapshotTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<GenericManager *>(arg)->publishSnmpSnapshot();
 }
@@ -22,15 +22,24 @@
 #include <map>
 #include "common.hh"
 
+#include <sofia-sip/su_wait.h>
+
 class GenericManager;
 class Agent;
 
+/*
+ * Serves the configuration and the statistics over SNMP from its own thread. The reads are answered from snapshots of
+ * the values published every second by the main loop, so that a walk does not read the live entries and costs the main
+ * loop nothing more than the periodic copy.
+ */
 class SnmpAgent {
 public:
 	SnmpAgent(Agent& agent,GenericManager &cm, std::map<std::string,std::string> &oset);
 	virtual ~SnmpAgent();
 
 private:
+	static void sOnSnapshotTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+
 	class SnmpAgentTask {
 		friend class SnmpAgent;
 	public:
@@ -44,6 +53,7 @@ private:
 
 
 	SnmpAgentTask mTask;
+	su_timer_t *mSnapshotTimer;
 	std::thread mThread;
 };
 
@@ -24,9 +24,13 @@
 #include <unistd.h>
 #include <cerrno>
 #include <cstring>
+#include <netdb.h>
+#include <sys/time.h>
 
 #include "stats.hh"
 #include "log/logmanager.hh"
+#include "profiler.hh"
+#include "tenantstats.hh"
 #include "signal.h"
 
 Stats::Stats(const std::string &name) {
@@ -134,8 +138,14 @@ void Stats::parseAndAnswer(unsigned int socket, const std::string& query) {
 	std::string answer = "Error: unknown error";
 	int size = query_split.size();
 	
-	if (size < 2) {
+	if (size > 0 && strcmp("TENANTS", query_split.front().c_str()) == 0) {
+		answer = TenantStats::get()->print();
+	} else if (size < 2) {
 		answer = "Error: at least 2 arguments were expected, got " + std::to_string(size);
+	} else if (strcmp("PROFILE", query_split.front().c_str()) == 0) {
+		std::string error;
+		std::string path = Profiler::get()->start(atoi(query_split.at(1).c_str()), error);
+		answer = path.empty() ? "Error: " + error : "Profiling to " + path;
 	} else {
 		std::string command = query_split.front();
 		std::string arg = query_split.at(1);
@@ -258,3 +268,145 @@ Stats::~Stats() {
 		stop();
 	}
 }
+
+MetricsExporter::MetricsExporter(const std::string &address, int port)
+	: mAddress(address), mPort(port), mSocket(-1), mRunning(false) {
+}
+
+MetricsExporter::~MetricsExporter() {
+	stop();
+}
+
+void MetricsExporter::start() {
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+	int err = getaddrinfo(mAddress.c_str(), std::to_string(mPort).c_str(), &hints, &res);
+	if (err != 0) {
+		LOGE("Metrics exporter cannot use address %s: %s", mAddress.c_str(), gai_strerror(err));
+		return;
+	}
+	mSocket = socket(res->ai_family, SOCK_STREAM, 0);
+	int on = 1;
+	if (mSocket == -1 || setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+		::bind(mSocket, res->ai_addr, res->ai_addrlen) == -1 || listen(mSocket, 16) == -1) {
+		LOGE("Metrics exporter cannot listen on %s:%i: %s", mAddress.c_str(), mPort, std::strerror(errno));
+		if (mSocket != -1)
+			close(mSocket);
+		mSocket = -1;
+		freeaddrinfo(res);
+		return;
+	}
+	freeaddrinfo(res);
+	SLOGD << "Metrics exported on http://" << mAddress << ":" << mPort << "/metrics";
+	mRunning = true;
+	mThread = std::thread(&MetricsExporter::run, this);
+}
+
+void MetricsExporter::stop() {
+	if (mRunning) {
+		mRunning = false;
+		shutdown(mSocket, SHUT_RDWR); // wakes up accept()
+		mThread.join();
+	}
+	if (mSocket != -1) {
+		close(mSocket);
+		mSocket = -1;
+	}
+}
+
+void MetricsExporter::run() {
+	while (mRunning) {
+		int remote = accept(mSocket, NULL, NULL);
+		if (remote == -1) {
+			if (mRunning && errno != EINTR)
+				LOGE("Metrics exporter accept error %i : %s", errno, std::strerror(errno));
+			continue;
+		}
+		answer(remote);
+		close(remote);
+	}
+}
+
+void MetricsExporter::answer(int socket) {
+	// a scraper must not be able to stall the other ones
+	struct timeval timeout = {1, 0};
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char request[2048];
+	size_t length = 0;
+	while (length < sizeof(request) - 1) {
+		ssize_t n = recv(socket, request + length, sizeof(request) - 1 - length, 0);
+		if (n <= 0)
+			break;
+		length += n;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n"))
+			break;
+	}
+	request[length] = '\0';
+
+	std::string status = "200 OK";
+	std::string body;
+	if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+		body = print(GenericManager::get()->getRoot()) + TenantStats::get()->printMetrics();
+	} else if (strncmp(request, "GET ", 4) == 0) {
+		status = "404 Not Found";
+	} else {
+		status = "405 Method Not Allowed";
+	}
+	std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+						   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+	for (size_t sent = 0; sent < response.size();) {
+		ssize_t n = send(socket, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+}
+
+static std::string sanitizeMetricName(const std::string &name) {
+	std::string sanitized = name;
+	for (char &c : sanitized) {
+		if (!isalnum((unsigned char)c))
+			c = '_';
+	}
+	return sanitized;
+}
+
+static void printMetrics(GenericStruct *gstruct, const std::string &prefix, std::string &out) {
+	for (GenericEntry *entry : gstruct->getChildren()) {
+		if (!entry)
+			continue;
+		GenericStruct *child = dynamic_cast<GenericStruct *>(entry);
+		if (child) {
+			printMetrics(child, prefix + sanitizeMetricName(child->getName()) + "_", out);
+			continue;
+		}
+		StatCounter64 *counter = dynamic_cast<StatCounter64 *>(entry);
+		if (!counter)
+			continue;
+		std::string name = prefix + sanitizeMetricName(counter->getName());
+		std::string help;
+		for (char c : counter->getHelp()) {
+			if (c == '\\')
+				help += "\\\\";
+			else if (c == '\n')
+				help += "\\n";
+			else
+				help += c;
+		}
+		// some are gauges, set rather than incremented
+		out += "# HELP " + name + " " + help + "\n# TYPE " + name + " untyped\n" + name + " " +
+			   std::to_string(counter->read()) + "\n";
+	}
+}
+
+std::string MetricsExporter::print(GenericStruct *root) {
+	std::string out;
+	printMetrics(root, "flexisip_", out);
+	return out;
+}
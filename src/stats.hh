@@ -22,6 +22,8 @@
 #include <sys/un.h>
 #include <pthread.h>
 #include <string>
+#include <atomic>
+#include <thread>
 #include "configmanager.hh"
 
 class Stats {
@@ -46,4 +48,29 @@ class Stats {
 	int local_length;
 };
 
+/*
+ * HTTP server exporting all the statistics in the Prometheus text format, from its own thread: the counters are
+ * atomics, reading them never involves the SIP thread.
+ */
+class MetricsExporter {
+  public:
+	MetricsExporter(const std::string &address, int port);
+	~MetricsExporter();
+	void start();
+	void stop();
+
+	/* All the statistics of the tree, in the Prometheus text format. */
+	static std::string print(GenericStruct *root);
+
+  private:
+	void run();
+	void answer(int socket);
+
+	std::string mAddress;
+	int mPort;
+	int mSocket;
+	std::atomic<bool> mRunning;
+	std::thread mThread;
+};
+
 #endif
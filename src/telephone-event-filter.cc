@@ -24,10 +24,10 @@ TelephoneEventFilter::TelephoneEventFilter(int telephone_event_pt) : mTelephoneE
 
 bool TelephoneEventFilter::onIncomingTransfer(uint8_t *data, size_t size, const struct sockaddr *sockaddr,
 											  socklen_t addrlen) {
-	rtp_header_t *h = (rtp_header_t *)data;
-	if (size < sizeof(rtp_header_t))
+	RtpPacketInfo info = RtpPacketInfo::decode(data, size);
+	if (!info.isRtp())
 		return true;
-	if (h->paytype == mTelephoneEventPt) {
+	if (info.payloadType == mTelephoneEventPt) {
 		LOGD("Detected telephone event in stream, dropping.");
 		return false;
 	}
@@ -38,3 +38,23 @@ bool TelephoneEventFilter::onOutgoingTransfer(uint8_t *data, size_t size, const
 											  socklen_t addrlen) {
 	return true;
 }
+
+void TelephoneEventFilter::onIncomingBatch(RelayPacketBatch &batch, const struct sockaddr *sockaddr,
+										   socklen_t addrlen) {
+	int dropped = 0;
+	for (int k = 0; k < batch.size(); ++k) {
+		if (!batch.isKept(k))
+			continue;
+		const RtpPacketInfo &info = batch.info(k);
+		if (info.isRtp() && info.payloadType == mTelephoneEventPt) {
+			batch.drop(k);
+			++dropped;
+		}
+	}
+	if (dropped > 0)
+		LOGD("Detected telephone event in stream, dropping %i packets.", dropped);
+}
+
+void TelephoneEventFilter::onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const struct sockaddr *sockaddr,
+										   socklen_t addrlen) {
+}
@@ -26,6 +26,9 @@ class TelephoneEventFilter : public MediaFilter {
 	TelephoneEventFilter(int telephone_event_pt);
 	virtual bool onIncomingTransfer(uint8_t *data, size_t size, const struct sockaddr *sockaddr, socklen_t addrlen);
 	virtual bool onOutgoingTransfer(uint8_t *data, size_t size, const struct sockaddr *sockaddr, socklen_t addrlen);
+	virtual void onIncomingBatch(RelayPacketBatch &batch, const struct sockaddr *sockaddr, socklen_t addrlen);
+	virtual void onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const struct sockaddr *sockaddr,
+								 socklen_t addrlen);
 
   private:
 	int mTelephoneEventPt;
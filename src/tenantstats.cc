@@ -0,0 +1,141 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tenantstats.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <vector>
+
+using namespace std;
+
+const char *Tenant::transportName(Transport transport) {
+	static const char *names[TransportCount] = {"udp", "tcp", "tls", "other"};
+	return names[transport];
+}
+
+TenantStats *TenantStats::get() {
+	// never deleted, the tenants are referenced by objects living until the exit
+	static TenantStats *sInstance = new TenantStats();
+	return sInstance;
+}
+
+TenantStats::TenantStats() : mMaxDomains(0), mOther("other") {
+}
+
+void TenantStats::configure(unsigned int maxDomains) {
+	lock_guard<mutex> lock(mMutex);
+	// the tenants already accounted are kept, their pointers may be held
+	mMaxDomains = maxDomains;
+}
+
+Tenant *TenantStats::find(const char *domain) {
+	if (!domain || !*domain)
+		return NULL;
+	string key(domain);
+	transform(key.begin(), key.end(), key.begin(), ::tolower);
+	lock_guard<mutex> lock(mMutex);
+	if (mMaxDomains == 0)
+		return NULL;
+	auto it = mTenants.find(key);
+	if (it != mTenants.end())
+		return it->second.get();
+	if (mTenants.size() >= mMaxDomains)
+		return &mOther;
+	Tenant *tenant = new Tenant(key);
+	mTenants.emplace(key, unique_ptr<Tenant>(tenant));
+	return tenant;
+}
+
+static uint64_t load(const atomic<uint64_t> &counter) {
+	return counter.load(memory_order_relaxed);
+}
+
+string TenantStats::print() {
+	vector<const Tenant *> tenants;
+	{
+		lock_guard<mutex> lock(mMutex);
+		if (mMaxDomains == 0)
+			return "Error: the accounting per domain is disabled, see global/tenant-stats-max-domains";
+		for (const auto &tenant : mTenants)
+			tenants.push_back(tenant.second.get());
+	}
+	tenants.push_back(&mOther);
+	sort(tenants.begin(), tenants.end(), [](const Tenant *t1, const Tenant *t2) {
+		return load(t1->cpuMicroseconds) > load(t2->cpuMicroseconds);
+	});
+	string out = "domain cpu-us messages registrar-operations relayed-bytes pushes registered-aors registered-contacts\n";
+	for (const Tenant *tenant : tenants) {
+		uint64_t contacts = 0;
+		for (const auto &counter : tenant->registeredContacts)
+			contacts += load(counter);
+		out += tenant->domain + " " + to_string(load(tenant->cpuMicroseconds)) + " " +
+			   to_string(load(tenant->messages)) + " " + to_string(load(tenant->registrarOperations)) + " " +
+			   to_string(load(tenant->relayedBytes)) + " " + to_string(load(tenant->pushes)) + " " +
+			   to_string(load(tenant->registeredAors)) + " " + to_string(contacts) + "\n";
+	}
+	return out;
+}
+
+string TenantStats::printMetrics() {
+	vector<const Tenant *> tenants;
+	{
+		lock_guard<mutex> lock(mMutex);
+		if (mMaxDomains == 0)
+			return "";
+		for (const auto &tenant : mTenants)
+			tenants.push_back(tenant.second.get());
+	}
+	tenants.push_back(&mOther);
+	struct Metric {
+		const char *name;
+		const char *help;
+		atomic<uint64_t> Tenant::*counter;
+	};
+	static const Metric metrics[] = {
+		{"messages", "Number of SIP messages received from the domain.", &Tenant::messages},
+		{"registrar_operations", "Number of registrar database operations for the domain.",
+		 &Tenant::registrarOperations},
+		{"relayed_bytes", "Number of media bytes relayed for the calls of the domain.", &Tenant::relayedBytes},
+		{"pushes", "Number of push notifications sent for the domain.", &Tenant::pushes},
+		{"cpu_microseconds", "Time spent by the modules processing the messages of the domain, in microseconds.",
+		 &Tenant::cpuMicroseconds}};
+	string out;
+	for (const Metric &metric : metrics) {
+		string name = string("flexisip_tenant_") + metric.name;
+		out += "# HELP " + name + " " + metric.help + "\n# TYPE " + name + " counter\n";
+		// the domains were lowered and are host names: no quote nor backslash to escape
+		for (const Tenant *tenant : tenants)
+			out += name + "{domain=\"" + tenant->domain + "\"} " + to_string(load(tenant->*metric.counter)) + "\n";
+	}
+	out += "# HELP flexisip_tenant_registered_aors Number of aors of the domain registered through this server.\n"
+		   "# TYPE flexisip_tenant_registered_aors gauge\n";
+	for (const Tenant *tenant : tenants)
+		out += "flexisip_tenant_registered_aors{domain=\"" + tenant->domain + "\"} " +
+			   to_string(load(tenant->registeredAors)) + "\n";
+	out += "# HELP flexisip_tenant_registered_contacts Number of contacts of the domain registered through this server, "
+		   "by transport.\n# TYPE flexisip_tenant_registered_contacts gauge\n";
+	for (const Tenant *tenant : tenants) {
+		for (int transport = 0; transport < Tenant::TransportCount; ++transport) {
+			out += "flexisip_tenant_registered_contacts{domain=\"" + tenant->domain + "\",transport=\"" +
+				   Tenant::transportName((Tenant::Transport)transport) + "\"} " +
+				   to_string(load(tenant->registeredContacts[transport])) + "\n";
+		}
+	}
+	return out;
+}
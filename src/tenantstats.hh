@@ -0,0 +1,90 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef tenantstats_hh
+#define tenantstats_hh
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Load of a domain hosted by the server. The counters are relaxed atomics, updated from any thread through a pointer
+ * kept by the messages, relay sessions, push notifications and registrations of the domain: a tenant is never deleted.
+ */
+struct Tenant {
+	enum Transport { Udp, Tcp, Tls, OtherTransport, TransportCount };
+
+	Tenant(const std::string &idomain)
+		: domain(idomain), messages(0), registrarOperations(0), relayedBytes(0), pushes(0), cpuMicroseconds(0),
+		  registeredAors(0) {
+		for (auto &contacts : registeredContacts)
+			contacts = 0;
+	}
+	void count(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+	void uncount(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+		counter.fetch_sub(value, std::memory_order_relaxed);
+	}
+	static const char *transportName(Transport transport);
+
+	const std::string domain;
+	std::atomic<uint64_t> messages;
+	std::atomic<uint64_t> registrarOperations;
+	std::atomic<uint64_t> relayedBytes;
+	std::atomic<uint64_t> pushes;
+	/* time spent by the modules processing the messages of the domain, wall clock time of the main loop */
+	std::atomic<uint64_t> cpuMicroseconds;
+	/* gauges of the registrations through this server, maintained by the registrar database as they are bound and
+	 * expire: the aors with at least one contact, and their contacts by transport */
+	std::atomic<uint64_t> registeredAors;
+	std::atomic<uint64_t> registeredContacts[TransportCount];
+};
+
+/*
+ * Accounting of the load per domain, the domain of the From of the messages. The number of domains is bounded: past
+ * the maximum, the new domains share the tenant named "other", so that a flood of forged domains cannot grow the
+ * memory nor the statistics.
+ */
+class TenantStats {
+  public:
+	static TenantStats *get();
+
+	/* 0 disables the accounting. */
+	void configure(unsigned int maxDomains);
+	/* Tenant of the domain, NULL when the accounting is disabled or there is no domain. */
+	Tenant *find(const char *domain);
+	/* One line per tenant, the busiest first, for the statistics socket. */
+	std::string print();
+	/* The counters of the tenants in the Prometheus text format, labelled by domain. */
+	std::string printMetrics();
+
+  private:
+	TenantStats();
+
+	std::mutex mMutex;
+	unsigned int mMaxDomains;
+	std::unordered_map<std::string, std::unique_ptr<Tenant>> mTenants;
+	Tenant mOther;
+};
+
+#endif
@@ -22,6 +22,8 @@
 #include <stdexcept>
 #include <iostream>
 #include <cstring>
+#include <chrono>
+#include <cstdlib>
 
 using namespace std;
 
@@ -268,7 +270,43 @@ void do_cmd_test(int argc, char *argv[]) {
 	}
 }
 
+/*
+ * Times the parsing and the evaluation of filters like those of the modules, without logs.
+ */
+void do_bench(int iterations) {
+	log_boolean_expression_evaluation(false);
+	log_boolean_expression_parsing(false);
+	const char *exprs[] = {
+		"is_request && request.method-name == 'REGISTER'",
+		"is_response || !(ua contains 'Linphone/3.5.2') || ((request.method-name == 'INVITE') && "
+		"!(request.uri.user contains 'ip'))",
+		"(request.method-name in 'INVITE MESSAGE SUBSCRIBE REFER') && !(from.uri.domain regex '.*\\.example\\.org')",
+		"true && (from.uri.user nin 'alice bob carol') && ('a' == 'a' || from.uri.user == 'dave')"};
+	SipAttributes args("is_request=1|is_response=0|ua=Linphone/3.6.1|request.method-name=INVITE|"
+					   "request.uri.user=45645|from.uri.domain=sip.example.com|from.uri.user=eve");
+
+	for (auto expr : exprs) {
+		auto start = chrono::steady_clock::now();
+		shared_ptr<BooleanExpression> be;
+		for (int i = 0; i < iterations / 100 + 1; ++i)
+			be = BooleanExpression::parse(expr);
+		auto parsed = chrono::steady_clock::now();
+		size_t matches = 0;
+		for (int i = 0; i < iterations; ++i)
+			matches += be->eval(&args);
+		auto end = chrono::steady_clock::now();
+		cout << expr << endl
+			 << "  parse " << chrono::duration_cast<chrono::nanoseconds>(parsed - start).count() / (iterations / 100 + 1)
+			 << " ns, eval " << chrono::duration_cast<chrono::nanoseconds>(end - parsed).count() / iterations
+			 << " ns (" << matches << " matches)" << endl;
+	}
+}
+
 int main(int argc, char *argv[]) {
+	if (argc >= 2 && string(argv[1]) == "--bench") {
+		do_bench(argc == 3 ? atoi(argv[2]) : 1000000);
+		return 0;
+	}
 	log_boolean_expression_evaluation(true);
 	log_boolean_expression_parsing(true);
 	if (argc == 1) {
@@ -278,6 +316,7 @@ int main(int argc, char *argv[]) {
 
 	if (argc != 3 || string(argv[1]) == "-h" || string(argv[1]) == "--help") {
 		cout << argv[0] << " \"bool expr\" \"key1=val1|key2=val2|key3=0|key4=1\"" << endl;
+		cout << argv[0] << " --bench [iterations]" << endl;
 		return -1;
 	}
 
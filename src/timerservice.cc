@@ -0,0 +1,79 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "timerservice.hh"
+
+#include <chrono>
+
+using namespace std;
+
+TimerService::TimerService(su_root_t *root) : mWheel(now()) {
+	mTickTimer = su_timer_create(su_root_task(root), 1000);
+	su_timer_set_for_ever(mTickTimer, &TimerService::sOnTick, this);
+	mDeferTimer = su_timer_create(su_root_task(root), 0);
+}
+
+TimerService::~TimerService() {
+	su_timer_destroy(mTickTimer);
+	su_timer_destroy(mDeferTimer);
+}
+
+time_t TimerService::now() {
+	return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+shared_ptr<TimerService::Timer> TimerService::schedule(unsigned int delay, const Callback &fn) {
+	auto timer = make_shared<Timer>();
+	timer->mCallback = fn;
+	// the ticks are not aligned on the seconds of the clock
+	mWheel.schedule(now() + delay + 1, timer);
+	return timer;
+}
+
+shared_ptr<TimerService::Timer> TimerService::defer(const Callback &fn) {
+	auto timer = make_shared<Timer>();
+	timer->mCallback = fn;
+	if (mDeferred.empty())
+		su_timer_set_interval(mDeferTimer, &TimerService::sOnDeferred, this, (su_duration_t)0);
+	mDeferred.push_back(timer);
+	return timer;
+}
+
+void TimerService::fire(const weak_ptr<Timer> &timer) {
+	shared_ptr<Timer> t = timer.lock();
+	if (!t)
+		return; // given up
+	// moved out, as the callback may release the timer
+	Callback callback;
+	callback.swap(t->mCallback);
+	if (callback)
+		callback();
+}
+
+void TimerService::sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	TimerService *zis = static_cast<TimerService *>(arg);
+	zis->mWheel.advance(now(), [](const weak_ptr<Timer> &timer, time_t) { fire(timer); });
+}
+
+void TimerService::sOnDeferred(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	TimerService *zis = static_cast<TimerService *>(arg);
+	vector<weak_ptr<Timer>> deferred;
+	deferred.swap(zis->mDeferred);
+	for (auto &timer : deferred)
+		fire(timer);
+}
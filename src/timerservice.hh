@@ -0,0 +1,69 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef timerservice_hh
+#define timerservice_hh
+
+#include "utils/timerwheel.hh"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sofia-sip/su_wait.h>
+
+/*
+ * Coarse timers shared by the long-lived contexts (fork contexts, domain registrations): a TimerWheel advanced by a
+ * single su_timer ticking every second, plus a queue of calls deferred to the next iteration of the main loop.
+ * Scheduling a timer costs an entry in the wheel instead of one in sofia's timer heap, so that hundreds of thousands
+ * of contexts can wait for days without slowing down the servicing of su_root.
+ */
+class TimerService {
+  public:
+	typedef std::function<void()> Callback;
+	/* A scheduled call, given up when the last reference to it is released. One shot. */
+	class Timer {
+	  private:
+		friend class TimerService;
+		Callback mCallback;
+	};
+
+	TimerService(su_root_t *root);
+	~TimerService();
+
+	/* Calls fn in delay seconds, one second late at most but never early. */
+	std::shared_ptr<Timer> schedule(unsigned int delay, const Callback &fn);
+	/* Calls fn during the next iteration of the main loop. */
+	std::shared_ptr<Timer> defer(const Callback &fn);
+	size_t size() const {
+		return mWheel.size();
+	}
+
+  private:
+	static void sOnTick(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	static void sOnDeferred(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	static time_t now();
+	static void fire(const std::weak_ptr<Timer> &timer);
+
+	su_timer_t *mTickTimer;
+	su_timer_t *mDeferTimer;
+	TimerWheel<std::weak_ptr<Timer>> mWheel;
+	std::vector<std::weak_ptr<Timer>> mDeferred;
+};
+
+#endif
@@ -0,0 +1,338 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Opens and holds a number of TCP connections to a SIP proxy, and keeps them alive with CRLF pings as the clients do.
+ * Reports the resident memory of the proxy per connection, as read in /proc, and the CPU time the proxy spends
+ * answering the pings of all the connections, with the ratio of the pongs received.
+ * The connections are spread over the given local addresses, each allowing about 28000 of them towards one proxy
+ * address with the default range of ephemeral ports.
+ * Usage: flexisip_connection_bench host port connections proxy_pid [ping_interval_s [rounds [local_address ...]]]
+ */
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const char sPing[] = "\r\n\r\n";
+static const size_t sConnectBatch = 1000;
+// positions of the connections not established
+static const size_t sUnused = (size_t)-1;
+static const size_t sConnecting = (size_t)-2;
+
+struct ProcessUsage {
+	long rssKb = 0;
+	double cpuSeconds = 0;
+};
+
+static bool readUsage(int pid, ProcessUsage &usage) {
+	string base = "/proc/" + to_string(pid);
+	FILE *f = fopen((base + "/status").c_str(), "r");
+	if (!f)
+		return false;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			usage.rssKb = strtol(line + 6, NULL, 10);
+	}
+	fclose(f);
+	f = fopen((base + "/stat").c_str(), "r");
+	if (!f)
+		return false;
+	char buf[1024];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+	// the fields are counted after the command name, which may hold spaces
+	char *p = strrchr(buf, ')');
+	if (!p)
+		return false;
+	unsigned long utime = 0, stime = 0;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return false;
+	usage.cpuSeconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+	return true;
+}
+
+static void increaseFdLimit(size_t connections) {
+	struct rlimit lm;
+	if (getrlimit(RLIMIT_NOFILE, &lm) == -1)
+		return;
+	rlim_t wanted = connections + 64;
+	if (lm.rlim_cur >= wanted)
+		return;
+	lm.rlim_cur = lm.rlim_max >= wanted ? wanted : lm.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &lm) == -1 || lm.rlim_cur < wanted)
+		fprintf(stderr, "file descriptors limited to %lu, raise the hard limit\n", (unsigned long)lm.rlim_cur);
+}
+
+class Bench {
+  public:
+	Bench(const sockaddr_storage &proxy, socklen_t proxyLen, const vector<sockaddr_storage> &locals)
+		: mProxy(proxy), mProxyLen(proxyLen), mLocals(locals) {
+		mEpoll = epoll_create1(0);
+	}
+	~Bench() {
+		for (int fd : mFds)
+			close(fd);
+		close(mEpoll);
+	}
+
+	/* Opens the connections by batches, waiting for each batch to be established. */
+	size_t connectAll(size_t count) {
+		while (mFds.size() < count) {
+			size_t batch = min(sConnectBatch, count - mFds.size());
+			for (size_t i = 0; i < batch; ++i) {
+				if (open(mFds.size() + i) == -1) {
+					++mErrors;
+					break;
+				}
+			}
+			waitConnected(chrono::seconds(10));
+			if (mConnecting > 0 || mErrors > 0) {
+				fprintf(stderr, "%zu connections not established, %zu failed\n", mConnecting, mErrors);
+				return mFds.size();
+			}
+		}
+		return mFds.size();
+	}
+
+	/* Pings every connection, then reads the pongs until the next round. */
+	size_t pingRound(chrono::seconds interval) {
+		for (int fd : mFds) {
+			if (send(fd, sPing, sizeof(sPing) - 1, MSG_NOSIGNAL) < 0 && errno != EAGAIN)
+				++mErrors;
+		}
+		mPongs = 0;
+		auto deadline = Clock::now() + interval;
+		while (Clock::now() < deadline) {
+			int timeout = (int)chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+			poll(max(timeout, 0));
+		}
+		return mPongs;
+	}
+
+	size_t size() const {
+		return mFds.size();
+	}
+	size_t errors() const {
+		return mErrors;
+	}
+
+  private:
+	int open(size_t index) {
+		int fd = socket(mProxy.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd == -1) {
+			fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (!mLocals.empty()) {
+			const sockaddr_storage &local = mLocals[index % mLocals.size()];
+			socklen_t len = local.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+			if (bind(fd, (const sockaddr *)&local, len) == -1) {
+				fprintf(stderr, "bind() failed: %s\n", strerror(errno));
+				close(fd);
+				return -1;
+			}
+		}
+		if (connect(fd, (const sockaddr *)&mProxy, mProxyLen) == -1 && errno != EINPROGRESS) {
+			fprintf(stderr, "connect() failed: %s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		if ((size_t)fd >= mPositions.size())
+			mPositions.resize(fd + 1, sUnused);
+		mPositions[fd] = sConnecting;
+		++mConnecting;
+		epoll_event ev;
+		ev.events = EPOLLOUT | EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev);
+		return fd;
+	}
+
+	void waitConnected(chrono::seconds timeout) {
+		auto deadline = Clock::now() + timeout;
+		while (mConnecting > 0 && Clock::now() < deadline)
+			poll(100);
+	}
+
+	void poll(int timeout) {
+		epoll_event events[256];
+		int n = epoll_wait(mEpoll, events, 256, timeout);
+		for (int i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (events[i].events & EPOLLOUT) {
+				established(fd, events[i].events & (EPOLLERR | EPOLLHUP));
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				closed(fd);
+				continue;
+			}
+			char buf[512];
+			ssize_t len = recv(fd, buf, sizeof(buf), 0);
+			if (len <= 0) {
+				if (len == 0 || errno != EAGAIN)
+					closed(fd);
+				continue;
+			}
+			// a pong is a single CRLF
+			for (ssize_t k = 0; k + 1 < len; ++k) {
+				if (buf[k] == '\r' && buf[k + 1] == '\n') {
+					++mPongs;
+					++k;
+				}
+			}
+		}
+	}
+
+	void established(int fd, bool failed) {
+		if (fd >= (int)mPositions.size() || mPositions[fd] != sConnecting)
+			return;
+		--mConnecting;
+		if (failed) {
+			mPositions[fd] = sUnused;
+			++mErrors;
+			close(fd);
+			return;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(mEpoll, EPOLL_CTL_MOD, fd, &ev);
+		mPositions[fd] = mFds.size();
+		mFds.push_back(fd);
+	}
+
+	void closed(int fd) {
+		++mErrors;
+		epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, NULL);
+		size_t position = mPositions[fd];
+		if (position == sConnecting) {
+			--mConnecting;
+		} else if (position != sUnused) {
+			mFds[position] = mFds.back();
+			mPositions[mFds[position]] = position;
+			mFds.pop_back();
+		}
+		mPositions[fd] = sUnused;
+		close(fd);
+	}
+
+	sockaddr_storage mProxy;
+	socklen_t mProxyLen;
+	vector<sockaddr_storage> mLocals;
+	int mEpoll;
+	vector<int> mFds; // established connections
+	vector<size_t> mPositions; // by fd, in mFds or one of the states below
+	size_t mConnecting = 0;
+	size_t mPongs = 0;
+	size_t mErrors = 0;
+};
+
+static bool resolve(const char *host, const char *port, sockaddr_storage &addr, socklen_t &len) {
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res = NULL;
+	if (getaddrinfo(host, port, &hints, &res) != 0 || !res)
+		return false;
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s host port connections proxy_pid [ping_interval_s [rounds [local_address ...]]]\n",
+				argv[0]);
+		return 1;
+	}
+	size_t connections = strtoul(argv[3], NULL, 10);
+	int pid = atoi(argv[4]);
+	chrono::seconds interval(argc > 5 ? atoi(argv[5]) : 30);
+	int rounds = argc > 6 ? atoi(argv[6]) : 4;
+
+	sockaddr_storage proxy;
+	socklen_t proxyLen;
+	if (!resolve(argv[1], argv[2], proxy, proxyLen)) {
+		fprintf(stderr, "cannot resolve %s:%s\n", argv[1], argv[2]);
+		return 1;
+	}
+	vector<sockaddr_storage> locals;
+	for (int i = 7; i < argc; ++i) {
+		sockaddr_storage local;
+		socklen_t len;
+		if (!resolve(argv[i], "0", local, len)) {
+			fprintf(stderr, "cannot resolve %s\n", argv[i]);
+			return 1;
+		}
+		locals.push_back(local);
+	}
+	increaseFdLimit(connections);
+
+	ProcessUsage before, connected, after;
+	if (!readUsage(pid, before)) {
+		fprintf(stderr, "cannot read the usage of process %d\n", pid);
+		return 1;
+	}
+	Bench bench(proxy, proxyLen, locals);
+	auto start = Clock::now();
+	size_t opened = bench.connectAll(connections);
+	double connectSeconds = chrono::duration<double>(Clock::now() - start).count();
+	// lets the proxy settle, its first reads of the connections included
+	this_thread::sleep_for(chrono::seconds(1));
+	readUsage(pid, connected);
+	printf("%zu connections opened in %.1f s, proxy rss %ld kB -> %ld kB, %.0f bytes per connection\n", opened,
+		   connectSeconds, before.rssKb, connected.rssKb,
+		   opened ? 1024.0 * (connected.rssKb - before.rssKb) / opened : 0);
+
+	printf("%6s %12s %10s %14s %12s\n", "round", "connections", "pongs", "proxy cpu ms", "us per ping");
+	ProcessUsage last = connected;
+	for (int r = 0; r < rounds; ++r) {
+		size_t pongs = bench.pingRound(interval);
+		ProcessUsage now;
+		readUsage(pid, now);
+		double cpuMs = 1000 * (now.cpuSeconds - last.cpuSeconds);
+		printf("%6d %12zu %10zu %14.0f %12.2f\n", r + 1, bench.size(), pongs, cpuMs,
+			   bench.size() ? 1000 * cpuMs / bench.size() : 0);
+		last = now;
+	}
+	after = last;
+	printf("proxy rss after the rounds %ld kB, %zu errors\n", after.rssKb, bench.errors());
+	return 0;
+}
@@ -23,12 +23,15 @@
 #include <algorithm>
 
 #include "configmanager.hh"
+#include "eventlogs/eventlogindex.hh"
 
 #include <hiredis/hiredis.h>
 
 #include <sofia-sip/sip_protos.h>
 #include <sofia-sip/su_wait.h>
 
+#include <chrono>
+#include <ctime>
 #include <memory>
 
 using namespace std;
@@ -79,6 +82,11 @@ struct CTArgs {
 	RedisParameters redis;
 	string serializer;
 	string url;
+	// dump of the event logs of the user instead of its record
+	string events;
+	string kind;
+	string from;
+	string to;
 
 	static void usage(const char *app) {
 		CTArgs args;
@@ -88,6 +96,11 @@ struct CTArgs {
 			 << "-a auth "
 			 << "-s serializer[" << args.serializer << "] "
 			 << "sip_uri " << endl;
+		cout << app << " --events event_logs_dir "
+			 << "--kind kind[all] "
+			 << "--from YYYY-MM-DD[today] "
+			 << "--to YYYY-MM-DD[from] "
+			 << "sip_uri " << endl;
 	}
 
 	CTArgs() {
@@ -113,6 +126,14 @@ struct CTArgs {
 				redis.domain = argv[++i];
 			} else if (EQ1(i, "-a")) {
 				redis.auth = argv[++i];
+			} else if (EQ1(i, "--events")) {
+				events = argv[++i];
+			} else if (EQ1(i, "--kind")) {
+				kind = argv[++i];
+			} else if (EQ1(i, "--from")) {
+				from = argv[++i];
+			} else if (EQ1(i, "--to")) {
+				to = argv[++i];
 			} else if (EQ1(i, "-s")) {
 				serializer = argv[++i];
 				if (serializer != "protobuf" && serializer != "c" && serializer != "json") {
@@ -136,6 +157,53 @@ struct CTArgs {
 	}
 };
 
+/*
+ * Streams the events of the user from the segments of a FilesystemEventLogWriter, found through the index of each
+ * day, and reports the number of events and the time taken on stderr.
+ */
+static int dumpEvents(const CTArgs &args) {
+	su_home_t home;
+	su_home_init(&home);
+	url_t *url = url_make(&home, args.url.c_str());
+	if (url == NULL || url->url_host == NULL) {
+		cerr << "invalid aor : " << args.url << endl;
+		su_home_destroy(&home);
+		return -1;
+	}
+	string prefix = string("users/") + url->url_host + "/" + (url->url_user ? url->url_user : "anonymous") + "/";
+	if (!args.kind.empty())
+		prefix += args.kind + "\t";
+	su_home_destroy(&home);
+
+	string from = args.from;
+	if (from.empty()) {
+		char today[16];
+		time_t now = time(NULL);
+		struct tm tm;
+		localtime_r(&now, &tm);
+		strftime(today, sizeof(today), "%Y-%m-%d", &tm);
+		from = today;
+	}
+	string to = args.to.empty() ? from : args.to;
+
+	auto start = chrono::steady_clock::now();
+	string segmentsDir = args.events + "/segments";
+	size_t found = 0;
+	for (const string &day : EventLogIndex::listDays(segmentsDir)) {
+		if (day < from || day > to)
+			continue;
+		found += EventLogIndex::find(segmentsDir, day, prefix, [](const string &log, const string &event) {
+			cout << log.substr(log.rfind('/') + 1) << ": " << event;
+			if (event.empty() || event.back() != '\n')
+				cout << "\n";
+		});
+	}
+	cout.flush();
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+	cerr << found << " events found in " << elapsed << " ms" << endl;
+	return 0;
+}
+
 static void timerfunc(su_root_magic_t *magic, su_timer_t *t, Agent *arg) {
 	arg->idle();
 }
@@ -151,6 +219,8 @@ int main(int argc, char **argv) {
 	flexisip::log::preinit(flexisip_sUseSyslog, args.debug, 0, "dumper");
 	flexisip::log::initLogs(flexisip_sUseSyslog, "debug", "error", false, args.debug);
 	flexisip::log::updateFilter("%Severity% >= debug");
+	if (!args.events.empty())
+		return dumpEvents(args);
 
 	Record::sLineFieldNames = {"line"};
 	Record::sMaxContacts = 10;
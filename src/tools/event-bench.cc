@@ -0,0 +1,181 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Measures the per-message overhead of the event dispatch, without sofia: the allocation of an event and its going
+ * through a chain of modules, each one handed the event by reference as Module::process() does. Compares the event
+ * created with make_shared() and copied into the dispatch (as before), created from the PoolAllocator and copied
+ * into the dispatch, created from the PoolAllocator and referenced by the dispatch (as done now), and an intrusive,
+ * non-atomic reference count, for the record of what remains to be saved.
+ * Usage: flexisip_event_bench [number_of_modules ...]
+ */
+
+#include "../utils/objectpool.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 15;
+static const chrono::milliseconds sRepetitionDuration(10);
+
+/* Stand-in of a RequestSipEvent: owner of the message and of the agents, and state of the processing. */
+struct Event : public enable_shared_from_this<Event> {
+	shared_ptr<string> msg;
+	shared_ptr<string> incomingAgent;
+	void *currModule = nullptr;
+	int state = 0;
+	unsigned int refs = 0; // intrusive variant only
+};
+
+/* Stand-in of a module, going through a few accesses of the event as the onRequest() of the modules do. */
+struct BenchModule {
+	virtual ~BenchModule() {
+	}
+	virtual void process(shared_ptr<Event> &ev) {
+		ev->currModule = this;
+		ev->state += (int)ev->msg->size();
+	}
+	virtual void process(Event *ev) {
+		ev->currModule = this;
+		ev->state += (int)ev->msg->size();
+	}
+};
+
+static list<BenchModule *> sModules;
+static shared_ptr<string> sMsg = make_shared<string>("INVITE sip:bob@sip.example.org SIP/2.0");
+static shared_ptr<string> sAgent = make_shared<string>("agent");
+
+static void sendByValue(shared_ptr<Event> ev) {
+	for (auto module : sModules)
+		module->process(ev);
+}
+
+static void sendByReference(shared_ptr<Event> &ev) {
+	for (auto module : sModules)
+		module->process(ev);
+}
+
+static void intrusiveRelease(Event *ev) {
+	if (--ev->refs == 0) {
+		PoolAllocator<Event> allocator;
+		ev->~Event();
+		allocator.deallocate(ev, 1);
+	}
+}
+
+static void sendIntrusive(Event *ev) {
+	++ev->refs; // held by the dispatch, as the by value variant
+	for (auto module : sModules)
+		module->process(ev);
+	intrusiveRelease(ev);
+}
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Runs fn() repeatedly and prints its time per iteration. */
+template <typename _Fn> static void bench(const char *name, size_t modules, _Fn fn) {
+	size_t iterations = 1;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		if (Clock::now() - start >= sRepetitionDuration)
+			break;
+		iterations *= 2;
+	}
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	printf("%-28s %8zu %12.1f %12.1f\n", name, modules, median(samples), *min_element(samples.begin(), samples.end()));
+}
+
+static void benchModules(size_t count) {
+	vector<unique_ptr<BenchModule>> modules;
+	sModules.clear();
+	for (size_t i = 0; i < count; ++i) {
+		modules.emplace_back(new BenchModule());
+		sModules.push_back(modules.back().get());
+	}
+
+	bench("make_shared, by value", count, []() {
+		auto ev = make_shared<Event>();
+		ev->msg = sMsg;
+		ev->incomingAgent = sAgent;
+		sendByValue(ev);
+	});
+	bench("pooled, by value", count, []() {
+		auto ev = allocate_shared<Event>(PoolAllocator<Event>());
+		ev->msg = sMsg;
+		ev->incomingAgent = sAgent;
+		sendByValue(ev);
+	});
+	bench("pooled, by reference", count, []() {
+		auto ev = allocate_shared<Event>(PoolAllocator<Event>());
+		ev->msg = sMsg;
+		ev->incomingAgent = sAgent;
+		sendByReference(ev);
+	});
+	bench("pooled, intrusive", count, []() {
+		PoolAllocator<Event> allocator;
+		Event *ev = new (allocator.allocate(1)) Event();
+		ev->msg = sMsg;
+		ev->incomingAgent = sAgent;
+		++ev->refs;
+		sendIntrusive(ev);
+		intrusiveRelease(ev);
+	});
+}
+
+int main(int argc, char *argv[]) {
+	// the reference counts of shared_ptr are only atomic once a thread was started, as they are in the proxy
+	thread([]() {}).join();
+
+	vector<size_t> counts;
+	for (int i = 1; i < argc; ++i) {
+		counts.push_back(strtoul(argv[i], NULL, 10));
+	}
+	if (counts.empty()) {
+		counts = {5, 20};
+	}
+	printf("%-28s %8s %12s %12s\n", "dispatch", "modules", "median ns", "min ns");
+	for (auto count : counts) {
+		benchModules(count);
+	}
+	return 0;
+}
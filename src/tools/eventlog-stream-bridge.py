@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# -*- coding: UTF-8 -*-
+
+# Collector of the event logs streamed by flexisip (event-logs/logger=stream), forwarding them to a Kafka topic, one
+# JSON message per event, or printing them one per line without --kafka.
+# A frame is the size of the batch on 4 bytes, big endian, and the batch: the MessagePack maps of its events, LZ4
+# compressed behind the marker 'LZ4' 0x01 0x00 and their size on 4 bytes, little endian, when above the compression
+# threshold of flexisip. The frames cut by a connection loss are dropped, flexisip sending them again.
+# Requires the lz4 module for the compressed frames, and kafka-python with --kafka.
+
+import argparse
+import json
+import socket
+import struct
+import sys
+import threading
+
+LZ4_MARKER = b'LZ4\x01'
+
+
+def unpack(data, pos):
+    """Value at pos of the MessagePack types written by flexisip, and the position after it."""
+    b = ord(data[pos:pos + 1])
+    pos += 1
+    if b < 0x80:
+        return b, pos
+    if 0x80 <= b <= 0x8f:
+        result = {}
+        for _ in range(b & 0x0f):
+            key, pos = unpack(data, pos)
+            result[key], pos = unpack(data, pos)
+        return result, pos
+    if 0xa0 <= b <= 0xbf:
+        length = b & 0x1f
+        return data[pos:pos + length].decode('utf-8', 'replace'), pos + length
+    if b in (0xc2, 0xc3):
+        return b == 0xc3, pos
+    if b in (0xcc, 0xcd, 0xce, 0xcf):
+        size = {0xcc: 1, 0xcd: 2, 0xce: 4, 0xcf: 8}[b]
+        return int.from_bytes(data[pos:pos + size], 'big'), pos + size
+    if b in (0xd9, 0xda, 0xdb):
+        size = {0xd9: 1, 0xda: 2, 0xdb: 4}[b]
+        length = int.from_bytes(data[pos:pos + size], 'big')
+        pos += size
+        return data[pos:pos + length].decode('utf-8', 'replace'), pos + length
+    raise ValueError('unexpected MessagePack type 0x%02x' % b)
+
+
+def decode(batch):
+    if batch.startswith(LZ4_MARKER):
+        import lz4.block
+        block = batch[batch.index(b'\0') + 1:]
+        size = struct.unpack('<I', block[:4])[0]
+        batch = lz4.block.decompress(block[4:], uncompressed_size=size)
+    events = []
+    pos = 0
+    while pos < len(batch):
+        event, pos = unpack(batch, pos)
+        events.append(event)
+    return events
+
+
+def read_exactly(conn, size):
+    data = b''
+    while len(data) < size:
+        chunk = conn.recv(size - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def serve(conn, peer, output):
+    with conn:
+        while True:
+            header = read_exactly(conn, 4)
+            if header is None:
+                break
+            batch = read_exactly(conn, struct.unpack('>I', header)[0])
+            if batch is None:
+                break
+            try:
+                events = decode(batch)
+            except Exception as e:
+                sys.stderr.write('%s: invalid frame: %s\n' % (peer, e))
+                break
+            output(events)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Forward the event logs streamed by flexisip.')
+    parser.add_argument('--listen', default='127.0.0.1:9195', help='host:port to listen on')
+    parser.add_argument('--kafka', help='comma separated bootstrap servers of Kafka')
+    parser.add_argument('--topic', default='flexisip-events', help='Kafka topic of the events')
+    args = parser.parse_args()
+
+    lock = threading.Lock()
+    if args.kafka:
+        from kafka import KafkaProducer
+        producer = KafkaProducer(bootstrap_servers=args.kafka.split(','), compression_type='lz4', linger_ms=50)
+
+        def output(events):
+            for event in events:
+                producer.send(args.topic, json.dumps(event).encode('utf-8'))
+    else:
+        def output(events):
+            with lock:
+                for event in events:
+                    sys.stdout.write(json.dumps(event) + '\n')
+                sys.stdout.flush()
+
+    host, port = args.listen.rsplit(':', 1)
+    server = socket.socket(socket.AF_INET6 if ':' in host else socket.AF_INET)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind((host.strip('[]'), int(port)))
+    server.listen(16)
+    while True:
+        conn, peer = server.accept()
+        thread = threading.Thread(target=serve, args=(conn, peer, output))
+        thread.daemon = True
+        thread.start()
+
+
+if __name__ == '__main__':
+    main()
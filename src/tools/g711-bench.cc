@@ -0,0 +1,118 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Measures the audio kernels of the transcoder on 20ms frames, with the scalar code and with the best instruction set
+ * of the CPU: the G.711 conversions, the halving and doubling of the rate, and a call between PCMU and a 16kHz codec,
+ * which decodes and doubles a frame in one direction and halves and encodes one in the other.
+ * Each case is repeated, each repetition running enough iterations to last about 10ms after a warm up, and reported
+ * with the median and the lowest time per frame, and the frames per second at the median. The calls a core can
+ * convert follow from the call case, each call needing 50 frames per second.
+ * Usage: flexisip_g711_bench
+ */
+
+#include "../utils/audiokernels.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 15;
+static const chrono::milliseconds sRepetitionDuration(10);
+static const size_t sFrame = 160; // 20ms at 8kHz
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Runs fn() repeatedly, prints its time per iteration and returns the median. */
+template <typename _Fn> static double bench(const char *name, _Fn fn) {
+	size_t iterations = 1;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		if (Clock::now() - start >= sRepetitionDuration)
+			break;
+		iterations *= 2;
+	}
+
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	double med = median(samples);
+	printf("%-24s %12.1f %12.1f %14.0f\n", name, med, *min_element(samples.begin(), samples.end()),
+		   med > 0 ? 1e9 / med : 0);
+	return med;
+}
+
+/* Returns the calls per core. */
+static double benchIsa(AudioKernels::Isa isa) {
+	AudioKernels::setIsa(isa);
+	printf("\n%s\n", AudioKernels::getIsaName(isa));
+
+	// speech-like levels, most samples far below full scale
+	vector<int16_t> narrow(sFrame), wide(2 * sFrame), pcm(2 * sFrame);
+	for (size_t i = 0; i < wide.size(); ++i)
+		wide[i] = (int16_t)(6000 * sin(i * 0.11) + 2000 * sin(i * 0.73));
+	for (size_t i = 0; i < narrow.size(); ++i)
+		narrow[i] = wide[2 * i];
+	vector<uint8_t> ulaw(sFrame), alaw(sFrame);
+	AudioKernels::ulawEncode(narrow.data(), ulaw.data(), sFrame);
+	AudioKernels::alawEncode(narrow.data(), alaw.data(), sFrame);
+	vector<uint8_t> bytes(sFrame);
+	HalfbandResampler up(true), down(false);
+
+	bench("ulaw encode", [&]() { AudioKernels::ulawEncode(narrow.data(), bytes.data(), sFrame); });
+	bench("ulaw decode", [&]() { AudioKernels::ulawDecode(ulaw.data(), pcm.data(), sFrame); });
+	bench("alaw encode", [&]() { AudioKernels::alawEncode(narrow.data(), bytes.data(), sFrame); });
+	bench("alaw decode", [&]() { AudioKernels::alawDecode(alaw.data(), pcm.data(), sFrame); });
+	bench("8kHz to 16kHz", [&]() { up.process(narrow.data(), sFrame, pcm.data()); });
+	bench("16kHz to 8kHz", [&]() { down.process(wide.data(), 2 * sFrame, pcm.data()); });
+	double call = bench("pcmu to 16kHz call", [&]() {
+		AudioKernels::ulawDecode(ulaw.data(), narrow.data(), sFrame);
+		up.process(narrow.data(), sFrame, pcm.data());
+		size_t n = down.process(wide.data(), 2 * sFrame, narrow.data());
+		AudioKernels::ulawEncode(narrow.data(), bytes.data(), n);
+	});
+	return call > 0 ? 1e9 / call / 50 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	printf("%-24s %12s %12s %14s\n", "frame", "median ns", "min ns", "per second");
+	double scalar = benchIsa(AudioKernels::Scalar);
+	AudioKernels::Isa best = AudioKernels::detect();
+	double vectorized = best != AudioKernels::Scalar ? benchIsa(best) : scalar;
+	printf("\ncalls per core: %.0f with scalar code, %.0f with %s (x%.1f)\n", scalar, vectorized,
+		   AudioKernels::getIsaName(best), scalar > 0 ? vectorized / scalar : 0);
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compares the std::map previously used for the registrar records and local expire map with the ShardedHashMap,
+ * for insert, lookup and clean (removal of expired entries) at several table sizes.
+ * Usage: flexisip_hashmap_bench [number_of_records ...]
+ */
+
+#include "../utils/shardedhashmap.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double nsPerOp(Clock::time_point start, size_t count) {
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+	return count ? (double)elapsed / count : 0;
+}
+
+static void report(const char *impl, size_t count, double insert, double lookup, double clean) {
+	printf("%-16s %10zu %12.1f %12.1f %12.1f\n", impl, count, insert, lookup, clean);
+}
+
+/* Same locking pattern as the former LocalRegExpire: one mutex for the whole map. */
+static void benchStdMap(const vector<string> &keys, const vector<size_t> &lookups) {
+	map<string, time_t> m;
+	mutex mtx;
+	size_t found = 0;
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		lock_guard<mutex> lock(mtx);
+		m[keys[i]] = (time_t)i;
+	}
+	double insert = nsPerOp(start, keys.size());
+
+	start = Clock::now();
+	for (auto idx : lookups) {
+		lock_guard<mutex> lock(mtx);
+		found += m.find(keys[idx]) != m.end();
+	}
+	double lookup = nsPerOp(start, lookups.size());
+
+	// expire half of the entries
+	time_t before = (time_t)(keys.size() / 2);
+	start = Clock::now();
+	{
+		lock_guard<mutex> lock(mtx);
+		for (auto it = m.begin(); it != m.end();) {
+			if (it->second < before)
+				it = m.erase(it);
+			else
+				++it;
+		}
+	}
+	double clean = nsPerOp(start, keys.size());
+
+	if (found != lookups.size())
+		fprintf(stderr, "std::map: %zu keys not found\n", lookups.size() - found);
+	report("std::map", keys.size(), insert, lookup, clean);
+}
+
+static void benchSharded(const vector<string> &keys, const vector<size_t> &lookups) {
+	ShardedHashMap<string, time_t> m;
+	size_t found = 0;
+
+	auto start = Clock::now();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.set(keys[i], (time_t)i);
+	}
+	double insert = nsPerOp(start, keys.size());
+
+	start = Clock::now();
+	time_t value;
+	for (auto idx : lookups) {
+		found += m.find(keys[idx], value);
+	}
+	double lookup = nsPerOp(start, lookups.size());
+
+	time_t before = (time_t)(keys.size() / 2);
+	start = Clock::now();
+	m.eraseIf([before](const string &key, time_t expire) { return expire < before; });
+	double clean = nsPerOp(start, keys.size());
+
+	if (found != lookups.size())
+		fprintf(stderr, "ShardedHashMap: %zu keys not found\n", lookups.size() - found);
+	report("ShardedHashMap", keys.size(), insert, lookup, clean);
+}
+
+int main(int argc, char *argv[]) {
+	vector<size_t> sizes;
+	for (int i = 1; i < argc; ++i) {
+		sizes.push_back(strtoul(argv[i], NULL, 10));
+	}
+	if (sizes.empty()) {
+		sizes = {100000, 1000000, 5000000};
+	}
+
+	printf("%-16s %10s %12s %12s %12s\n", "implementation", "records", "insert ns", "lookup ns", "clean ns");
+	for (auto count : sizes) {
+		vector<string> keys;
+		keys.reserve(count);
+		for (size_t i = 0; i < count; ++i) {
+			keys.push_back("user" + to_string(i) + "@sip.example.org");
+		}
+		mt19937 rng(42);
+		uniform_int_distribution<size_t> dist(0, count - 1);
+		vector<size_t> lookups(count);
+		generate(lookups.begin(), lookups.end(), [&]() { return dist(rng); });
+
+		benchStdMap(keys, lookups);
+		benchSharded(keys, lookups);
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compares the parsing of PUBLISH bodies by PidfFastParser and by the xsd bindings, over a corpus of the bodies sent by
+ * the usual clients, or over the files given as arguments, one body per file.
+ * Each document is reported with the median time per parse of both, the speedup, and whether the fast path handled it
+ * and gave the same document as the bindings once serialized. The documents left to the bindings are timed the way
+ * PublishWorkers parses them, fast path attempt included.
+ * Usage: flexisip_pidf_bench [body_file ...]
+ */
+
+#include "../presence/pidf-fast-parser.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <xercesc/util/PlatformUtils.hpp>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 15;
+static const chrono::milliseconds sRepetitionDuration(10);
+
+static const pair<const char *, const char *> sCorpus[] = {
+	{"linphone-online", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+						"<presence xmlns=\"urn:ietf:params:xml:ns:pidf\" "
+						"xmlns:dm=\"urn:ietf:params:xml:ns:pidf:data-model\" "
+						"xmlns:rpid=\"urn:ietf:params:xml:ns:pidf:rpid\" entity=\"sip:alice@sip.example.org\">\n"
+						"  <tuple id=\"qmbd6c\">\n"
+						"    <status>\n"
+						"      <basic>open</basic>\n"
+						"    </status>\n"
+						"    <contact>sip:alice@sip.example.org</contact>\n"
+						"    <timestamp>2017-03-08T14:46:12Z</timestamp>\n"
+						"  </tuple>\n"
+						"  <dm:person id=\"d7c5ka\">\n"
+						"    <rpid:activities/>\n"
+						"  </dm:person>\n"
+						"</presence>\n"},
+	{"linphone-away", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+					  "<presence xmlns=\"urn:ietf:params:xml:ns:pidf\" "
+					  "xmlns:dm=\"urn:ietf:params:xml:ns:pidf:data-model\" "
+					  "xmlns:rpid=\"urn:ietf:params:xml:ns:pidf:rpid\" entity=\"sip:alice@sip.example.org\">\n"
+					  "  <tuple id=\"qmbd6c\">\n"
+					  "    <status>\n"
+					  "      <basic>open</basic>\n"
+					  "    </status>\n"
+					  "    <contact>sip:alice@sip.example.org</contact>\n"
+					  "    <timestamp>2017-03-08T14:46:12Z</timestamp>\n"
+					  "  </tuple>\n"
+					  "  <dm:person id=\"d7c5ka\">\n"
+					  "    <rpid:activities>\n"
+					  "      <rpid:away/>\n"
+					  "    </rpid:activities>\n"
+					  "  </dm:person>\n"
+					  "</presence>\n"},
+	{"linphone-offline", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+						 "<presence xmlns=\"urn:ietf:params:xml:ns:pidf\" entity=\"sip:alice@sip.example.org\">\n"
+						 "  <tuple id=\"qmbd6c\">\n"
+						 "    <status>\n"
+						 "      <basic>closed</basic>\n"
+						 "    </status>\n"
+						 "    <timestamp>2017-03-08T15:02:51Z</timestamp>\n"
+						 "  </tuple>\n"
+						 "</presence>\n"},
+	{"two-devices-notes",
+	 "<?xml version='1.0' encoding='utf-8'?>"
+	 "<presence xmlns='urn:ietf:params:xml:ns:pidf' xmlns:dm='urn:ietf:params:xml:ns:pidf:data-model' "
+	 "xmlns:r='urn:ietf:params:xml:ns:pidf:rpid' entity='sip:bob@sip.example.org'>"
+	 "<tuple id='a1'><status><basic>open</basic></status><contact priority='0.8'>sip:bob@10.0.0.2</contact>"
+	 "<note xml:lang='en'>In a meeting &amp; on the phone</note><timestamp>2017-03-08T14:46:12.5+01:00</timestamp>"
+	 "</tuple><tuple id='b2'><status><basic>open</basic></status><contact priority='0.5'>sip:bob@10.0.0.3</contact>"
+	 "</tuple><note>Back at 3pm</note><dm:person id='p1'><r:activities><r:meeting/><r:on-the-phone/>"
+	 "</r:activities></dm:person></presence>"},
+	// service descriptions are extensions, left to the bindings
+	{"oma-service", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+					"<presence xmlns=\"urn:ietf:params:xml:ns:pidf\" xmlns:op=\"urn:oma:xml:prs:pidf:oma-pres\" "
+					"entity=\"sip:carol@sip.example.org\">\n"
+					"  <tuple id=\"s1\">\n"
+					"    <status><basic>open</basic></status>\n"
+					"    <op:service-description><op:service-id>org.3gpp.urn:urn-7:3gpp-service.ims.icsi.mmtel"
+					"</op:service-id><op:version>1.0</op:version></op:service-description>\n"
+					"    <contact>sip:carol@sip.example.org</contact>\n"
+					"  </tuple>\n"
+					"</presence>\n"},
+};
+
+static unique_ptr<pidf::Presence> parseWithBindings(const string &body) {
+	try {
+		istringstream data(body);
+		return pidf::parsePresence(data, xml_schema::Flags::dont_validate);
+	} catch (const xml_schema::Exception &e) {
+		return nullptr;
+	}
+}
+
+static string serialize(const pidf::Presence &presence) {
+	ostringstream out;
+	xml_schema::NamespaceInfomap map;
+	map[""].name = "urn:ietf:params:xml:ns:pidf";
+	serializePresence(out, presence, map);
+	return out.str();
+}
+
+/* Median time per call of fn, in ns. */
+template <typename _Fn> static double bench(_Fn fn) {
+	// the number of iterations of a repetition is calibrated during the warm up
+	size_t iterations = 1;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		if (Clock::now() - start >= sRepetitionDuration)
+			break;
+		iterations *= 2;
+	}
+
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	sort(samples.begin(), samples.end());
+	return samples[samples.size() / 2];
+}
+
+int main(int argc, char *argv[]) {
+	vector<pair<string, string>> corpus;
+	for (int i = 1; i < argc; ++i) {
+		ifstream in(argv[i], ios::in | ios::binary);
+		if (!in.is_open()) {
+			fprintf(stderr, "Cannot open %s\n", argv[i]);
+			return 1;
+		}
+		corpus.emplace_back(argv[i], string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()));
+	}
+	if (corpus.empty()) {
+		for (const auto &body : sCorpus)
+			corpus.emplace_back(body.first, body.second);
+	}
+
+	xercesc::XMLPlatformUtils::Initialize();
+	printf("%-24s %8s %12s %12s %8s %9s\n", "document", "bytes", "bindings ns", "parse ns", "speedup", "fast path");
+	for (const auto &document : corpus) {
+		const string &body = document.second;
+		unique_ptr<pidf::Presence> reference = parseWithBindings(body);
+		if (!reference) {
+			printf("%-24s %8zu %12s\n", document.first.c_str(), body.size(), "invalid");
+			continue;
+		}
+		double bindings = bench([&]() { parseWithBindings(body); });
+		unique_ptr<pidf::Presence> fast = flexisip::PidfFastParser::parse(body);
+		const char *outcome = "no";
+		if (fast)
+			outcome = serialize(*fast) == serialize(*reference) ? "yes" : "MISMATCH";
+		double parse = bench([&]() {
+			if (!flexisip::PidfFastParser::parse(body))
+				parseWithBindings(body);
+		});
+		printf("%-24s %8zu %12.0f %12.0f %7.2fx %9s\n", document.first.c_str(), body.size(), bindings, parse,
+			   bindings / parse, outcome);
+	}
+	xercesc::XMLPlatformUtils::Terminate();
+	return 0;
+}
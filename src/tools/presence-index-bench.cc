@@ -0,0 +1,204 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compares the indexes of the presence server: the std::map by eTag and the std::list of listeners previously used,
+ * with the hash maps by eTag and the listener handles, for PUBLISH refreshes (eTag replaced in both indexes of the
+ * presentity), SUBSCRIBE refreshes (listener looked up among the ones of the presentity) and unsubscriptions.
+ * The subscriptions are skewed towards a few popular presentities.
+ * Usage: flexisip_presence_index_bench [number_of_presentities [number_of_subscriptions]]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double nsPerOp(Clock::time_point start, size_t count) {
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+	return count ? (double)elapsed / count : 0;
+}
+
+static void report(const char *impl, double setup, double publish, double refresh, double remove) {
+	printf("%-12s %14.1f %14.1f %14.1f %14.1f\n", impl, setup, publish, refresh, remove);
+}
+
+struct Workload {
+	vector<string> entities;
+	vector<size_t> subscriptions; // presentity of each subscription
+	vector<size_t> publishes;	 // presentities refreshing their PUBLISH
+	vector<size_t> refreshes;	 // subscriptions refreshed
+	vector<size_t> removals;	  // subscriptions terminated, all different
+};
+
+static string makeEtag(mt19937 &rng) {
+	static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	string etag(8, ' ');
+	for (auto &c : etag)
+		c = chars[rng() % (sizeof(chars) - 1)];
+	return etag;
+}
+
+/* Mimics PresenceServer and PresentityPresenceInformation, with hash maps and listener handles or not. */
+template <bool hashed> class Model {
+  public:
+	struct Presentity;
+	typedef typename conditional<hashed, unordered_map<string, int>, map<string, int>>::type ElementIndex;
+	typedef typename conditional<hashed, unordered_map<string, Presentity *>, map<string, Presentity *>>::type
+		EtagIndex;
+	struct Listener {
+		Presentity *subscribedTo = nullptr;
+		typename list<shared_ptr<Listener>>::iterator handle;
+	};
+	struct Presentity {
+		ElementIndex elements; // eTag -> element
+		list<shared_ptr<Listener>> listeners;
+		string etag;
+	};
+
+	void addListener(Presentity &p, const shared_ptr<Listener> &listener) {
+		if (hashed) {
+			if (listener->subscribedTo == &p)
+				return;
+			p.listeners.push_back(listener);
+			listener->subscribedTo = &p;
+			listener->handle = --p.listeners.end();
+			return;
+		}
+		for (auto &existing : p.listeners) {
+			if (existing == listener)
+				return;
+		}
+		p.listeners.push_back(listener);
+	}
+
+	void removeListener(Presentity &p, const shared_ptr<Listener> &listener) {
+		if (hashed) {
+			p.listeners.erase(listener->handle);
+			listener->subscribedTo = nullptr;
+		} else {
+			p.listeners.remove(listener);
+		}
+	}
+
+	void run(const char *name, const Workload &w) {
+		mt19937 rng(7);
+		unordered_map<string, Presentity> byEntity;
+		vector<Presentity *> presentities;
+		vector<shared_ptr<Listener>> listeners;
+
+		auto start = Clock::now();
+		for (auto &entity : w.entities) {
+			Presentity &p = byEntity[entity];
+			p.etag = makeEtag(rng);
+			p.elements[p.etag] = 1;
+			mEtags[p.etag] = &p;
+			presentities.push_back(&p);
+		}
+		for (auto idx : w.subscriptions) {
+			auto listener = make_shared<Listener>();
+			addListener(*presentities[idx], listener);
+			listeners.push_back(listener);
+		}
+		double setup = nsPerOp(start, w.entities.size() + w.subscriptions.size());
+
+		start = Clock::now();
+		for (auto idx : w.publishes) {
+			auto it = mEtags.find(presentities[idx]->etag);
+			Presentity *p = it->second;
+			string etag = makeEtag(rng);
+			mEtags.erase(it);
+			mEtags[etag] = p;
+			int element = p->elements[p->etag];
+			p->elements.erase(p->etag);
+			p->elements[etag] = element;
+			p->etag = etag;
+		}
+		double publish = nsPerOp(start, w.publishes.size());
+
+		start = Clock::now();
+		for (auto idx : w.refreshes) {
+			addListener(byEntity.find(w.entities[w.subscriptions[idx]])->second, listeners[idx]);
+		}
+		double refresh = nsPerOp(start, w.refreshes.size());
+
+		start = Clock::now();
+		for (auto idx : w.removals) {
+			removeListener(byEntity.find(w.entities[w.subscriptions[idx]])->second, listeners[idx]);
+		}
+		double remove = nsPerOp(start, w.removals.size());
+
+		report(name, setup, publish, refresh, remove);
+	}
+
+  private:
+	EtagIndex mEtags;
+};
+
+int main(int argc, char *argv[]) {
+	size_t presentityCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t subscriptionCount = argc > 2 ? strtoul(argv[2], NULL, 10) : 5 * presentityCount;
+	if (presentityCount == 0) {
+		fprintf(stderr, "Usage: %s [number_of_presentities [number_of_subscriptions]]\n", argv[0]);
+		return 1;
+	}
+	size_t opCount = min(presentityCount, (size_t)1000000);
+
+	Workload w;
+	mt19937 rng(42);
+	uniform_real_distribution<double> skew(0, 1);
+	uniform_int_distribution<size_t> presentity(0, presentityCount - 1);
+	uniform_int_distribution<size_t> subscription(0, subscriptionCount - 1);
+	for (size_t i = 0; i < presentityCount; ++i) {
+		w.entities.push_back("sip:user" + to_string(i) + "@sip.example.org");
+	}
+	for (size_t i = 0; i < subscriptionCount; ++i) {
+		double u = skew(rng);
+		w.subscriptions.push_back(min((size_t)(u * u * presentityCount), presentityCount - 1));
+	}
+	for (size_t i = 0; i < opCount; ++i) {
+		w.publishes.push_back(presentity(rng));
+		w.refreshes.push_back(subscription(rng));
+	}
+	vector<bool> removed(subscriptionCount, false);
+	for (size_t i = 0; i < opCount / 10; ++i) {
+		size_t idx = subscription(rng);
+		if (!removed[idx]) {
+			removed[idx] = true;
+			w.removals.push_back(idx);
+		}
+	}
+
+	printf("%zu presentities, %zu subscriptions, %zu PUBLISH and SUBSCRIBE refreshes, %zu removals\n",
+		   presentityCount, subscriptionCount, opCount, w.removals.size());
+	printf("%-12s %14s %14s %14s %14s\n", "indexes", "setup ns", "publish ns", "refresh ns", "remove ns");
+	Model<false>().run("map+list", w);
+	Model<true>().run("hash+handle", w);
+	return 0;
+}
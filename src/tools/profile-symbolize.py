@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+# -*- coding: UTF-8 -*-
+
+# Symbolizes a profile written by the profiler of flexisip, on a host with the same binaries, and prints its stacks in
+# the collapsed format of the flame graph tools: "thread;module;outermost;...;innermost count" per line.
+# The addresses are resolved by addr2line, with the mappings of the process recorded in the profile.
+
+import argparse
+import bisect
+import collections
+import subprocess
+import sys
+
+
+def parse(path):
+    sections = collections.defaultdict(list)
+    section = 'header'
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip('\n')
+            if line in ('stacks', 'maps', 'threads'):
+                section = line
+            elif line and not line.startswith('#'):
+                sections[section].append(line)
+    return sections
+
+
+def parse_maps(lines):
+    """Executable mappings of files as (start, end, offset, path), sorted by start."""
+    maps = []
+    for line in lines:
+        fields = line.split(None, 5)
+        if len(fields) < 6 or 'x' not in fields[1] or not fields[5].startswith('/'):
+            continue
+        start, end = [int(x, 16) for x in fields[0].split('-')]
+        maps.append((start, end, int(fields[2], 16), fields[5]))
+    maps.sort()
+    return maps
+
+
+def file_offset(maps, starts, addr):
+    i = bisect.bisect_right(starts, addr) - 1
+    if i < 0 or addr >= maps[i][1]:
+        return None, None
+    start, end, offset, path = maps[i]
+    return path, addr - start + offset
+
+
+def is_shared_object(path):
+    with open(path, 'rb') as f:
+        header = f.read(18)
+    # ET_DYN: shared objects and position independent executables, resolved by their offset
+    return len(header) == 18 and header[16:18] in (b'\x03\x00', b'\x00\x03')
+
+
+def symbolize(maps, addrs):
+    starts = [m[0] for m in maps]
+    by_file = collections.defaultdict(set)
+    located = {}
+    for addr in addrs:
+        path, offset = file_offset(maps, starts, addr)
+        if path is None:
+            continue
+        try:
+            relocatable = is_shared_object(path)
+        except IOError:
+            continue
+        located[addr] = (path, offset if relocatable else addr)
+        by_file[path].add(located[addr][1])
+    names = {}
+    for path, offsets in by_file.items():
+        offsets = sorted(offsets)
+        try:
+            out = subprocess.check_output(['addr2line', '-C', '-f', '-e', path] + ['%x' % o for o in offsets])
+        except (OSError, subprocess.CalledProcessError):
+            continue
+        lines = out.decode('utf-8', 'replace').split('\n')
+        for i, o in enumerate(offsets):
+            name = lines[2 * i] if 2 * i < len(lines) else '??'
+            names[(path, o)] = name if name != '??' else '%s+%x' % (path.split('/')[-1], o)
+    result = {}
+    for addr in addrs:
+        if addr in located:
+            result[addr] = names.get(located[addr], '??')
+        else:
+            result[addr] = '%x' % addr
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Symbolize a flexisip profile into collapsed stacks.')
+    parser.add_argument('profile', help='profile written by flexisip')
+    parser.add_argument('--no-threads', action='store_true', help='merge the stacks of all the threads')
+    args = parser.parse_args()
+
+    sections = parse(args.profile)
+    maps = parse_maps(sections['maps'])
+    threads = dict(line.split(' ', 1) for line in sections['threads'])
+    stacks = []
+    addrs = set()
+    for line in sections['stacks']:
+        fields = line.split()
+        count, tid, module = int(fields[0]), fields[1], fields[2]
+        pcs = [int(x, 16) for x in fields[3:]]
+        # the first two are the signal trampoline and the interrupted instruction, the others return addresses
+        pcs = pcs[:2] + [pc - 1 for pc in pcs[2:]]
+        addrs.update(pcs)
+        stacks.append((count, tid, module, pcs))
+    names = symbolize(maps, addrs)
+
+    collapsed = collections.Counter()
+    for count, tid, module, pcs in stacks:
+        frames = [names[pc] for pc in reversed(pcs[1:])]
+        name = threads.get(tid, '-')
+        prefix = [] if args.no_threads else ['%s-%s' % (name if name != '-' else 'thread', tid)]
+        if module != '-':
+            prefix.append('[%s]' % module)
+        collapsed[';'.join(prefix + frames)] += count
+    for stack, count in sorted(collapsed.items()):
+        sys.stdout.write('%s %d\n' % (stack, count))
+
+
+if __name__ == '__main__':
+    main()
@@ -21,10 +21,20 @@
 #include "pushnotification/googlepush.hh"
 #include "pushnotification/microsoftpush.hh"
 #include "pushnotification/firebasepush.hh"
+#include "pushnotification/genericpush.hh"
 #include "pushnotification/pushnotificationservice.hh"
+#include "utils/latencyhistogram.hh"
 
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
 #include <string>
+#include <sys/socket.h>
+#include <thread>
 
 #include <ortp/ortp.h>
 #include <sofia-sip/url.h>
@@ -35,7 +45,8 @@ static const int MAX_QUEUE_SIZE = 3000;
 // static const int PRINT_STATS_TIMEOUT = 3000;	/* In milliseconds. */
 
 struct PusherArgs {
-	PusherArgs() : debug(false){
+	PusherArgs() : debug(false), loadRate(0), duration(10), tokens(1000), clients(1), queueSize(MAX_QUEUE_SIZE),
+		mockPort(0), mockDelay(0) {
 	}
 	string prefix;
 	string pntype;
@@ -44,10 +55,23 @@ struct PusherArgs {
 	vector<string> pntok;
 	string apikey;
 	string packageSID;
+	// load mode
+	int loadRate;
+	int duration;
+	int tokens;
+	int clients;
+	int queueSize;
+	string url;
+	int mockPort;
+	int mockDelay;
 	void usage(const char *app) {
 		cout << app
 			 << " --pntype google|firebase|wp|w10|apple --appid id --key apikey(secretkey) --sid ms-app://value --prefix dir --debug --pntok id1 (id2 id3 ...)"
 			 << endl;
+		cout << app
+			 << " --load pushes_per_second [--duration seconds] [--tokens count] [--clients count] [--queue size]"
+				" --mock port [--mock-delay ms] | --url http://host:port/path/$token"
+			 << endl;
 	}
 
 	const char *parseUrlParams(const char *params) {
@@ -91,6 +115,22 @@ struct PusherArgs {
 					i++;
 					pntok.push_back(argv[i]);
 				}
+			} else if (EQ1(i, "--load")) {
+				loadRate = atoi(argv[++i]);
+			} else if (EQ1(i, "--duration")) {
+				duration = atoi(argv[++i]);
+			} else if (EQ1(i, "--tokens")) {
+				tokens = max(atoi(argv[++i]), 1);
+			} else if (EQ1(i, "--clients")) {
+				clients = max(atoi(argv[++i]), 1);
+			} else if (EQ1(i, "--queue")) {
+				queueSize = atoi(argv[++i]);
+			} else if (EQ1(i, "--url")) {
+				url = argv[++i];
+			} else if (EQ1(i, "--mock")) {
+				mockPort = atoi(argv[++i]);
+			} else if (EQ1(i, "--mock-delay")) {
+				mockDelay = atoi(argv[++i]);
 			} else if (EQ1(i, "--key")) {
 				apikey = argv[++i];
 			} else if (EQ1(i, "--raw")) {
@@ -161,6 +201,176 @@ static vector<shared_ptr<PushNotificationRequest>> createRequestFromArgs(const P
 	return result;
 }
 
+/*
+ * Load mode: pushes sent at a steady rate to a generic HTTP provider, by default a mock one answering every request
+ * with a 200 after a delay. The submitted, completed and failed pushes, the pushes queued or in flight and the latency
+ * percentiles are reported every second, then for the whole run.
+ */
+class MockProvider {
+  public:
+	MockProvider(int port, int delayMs) : mPort(port), mDelayMs(delayMs), mSocket(-1) {
+	}
+	~MockProvider() {
+		if (mSocket != -1) {
+			shutdown(mSocket, SHUT_RDWR);
+			mThread.join();
+			close(mSocket);
+		}
+	}
+	bool start() {
+		mSocket = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(mPort);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(mSocket, 128) == -1) {
+			cerr << "cannot listen on port " << mPort << ": " << strerror(errno) << endl;
+			close(mSocket);
+			mSocket = -1;
+			return false;
+		}
+		mThread = thread(&MockProvider::acceptLoop, this);
+		return true;
+	}
+
+  private:
+	void acceptLoop() {
+		int fd;
+		while ((fd = accept(mSocket, NULL, NULL)) != -1)
+			thread(&MockProvider::serve, fd, mDelayMs).detach();
+	}
+	/* Answers each request of a connection, the pushes carrying no body. */
+	static void serve(int fd, int delayMs) {
+		static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+		string pending;
+		char buf[4096];
+		ssize_t len;
+		while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+			pending.append(buf, len);
+			size_t end;
+			while ((end = pending.find("\r\n\r\n")) != string::npos) {
+				pending.erase(0, end + 4);
+				if (delayMs > 0)
+					this_thread::sleep_for(chrono::milliseconds(delayMs));
+				if (send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL) < 0)
+					break;
+			}
+		}
+		close(fd);
+	}
+
+	int mPort;
+	int mDelayMs;
+	int mSocket;
+	thread mThread;
+};
+
+struct LoadLatencies {
+	mutex lock;
+	LatencyHistogram interval; // since the last report
+	LatencyHistogram total;
+};
+
+/* Generic push recording its latency when answered, from the thread of its client. */
+class LoadPushRequest : public GenericPushNotificationRequest {
+  public:
+	LoadPushRequest(const PushInfo &pinfo, const url_t *url, LoadLatencies &latencies)
+		: GenericPushNotificationRequest(pinfo, url, "POST"), mLatencies(latencies) {
+	}
+	virtual string isValidResponse(const string &str) {
+		uint64_t us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - getSubmitTime()).count();
+		{
+			unique_lock<mutex> lock(mLatencies.lock);
+			mLatencies.interval.record(us);
+			mLatencies.total.record(us);
+		}
+		return GenericPushNotificationRequest::isValidResponse(str);
+	}
+
+  private:
+	LoadLatencies &mLatencies;
+};
+
+static int runLoad(const PusherArgs &args) {
+	unique_ptr<MockProvider> mock;
+	string url = args.url;
+	if (args.mockPort > 0) {
+		mock.reset(new MockProvider(args.mockPort, args.mockDelay));
+		if (!mock->start())
+			return -1;
+		url = "http://127.0.0.1:" + to_string(args.mockPort) + "/push/$token";
+	}
+	if (url.empty()) {
+		cerr << "load mode needs --mock or --url" << endl;
+		return -1;
+	}
+	su_home_t *home = su_home_new(sizeof(su_home_t));
+	url_t *providerUrl = url_make(home, url.c_str());
+	LoadLatencies latencies;
+	StatCounter64 countFailed("count-failed", "Failed pushes", 1);
+	StatCounter64 countSent("count-sent", "Sent pushes", 2);
+	uint64_t submitted = 0;
+	{
+		PushNotificationService service(args.queueSize, args.clients);
+		service.setStatCounters(&countFailed, &countSent);
+		service.setupGenericClient(providerUrl);
+
+		printf("%6s %10s %10s %10s %10s %10s %10s\n", "second", "submitted", "sent", "failed", "queued", "p50 ms",
+			   "p99 ms");
+		auto start = chrono::steady_clock::now();
+		auto nextReport = start + chrono::seconds(1);
+		uint64_t lastSubmitted = 0, lastSent = 0, lastFailed = 0;
+		int second = 0;
+		PushInfo pinfo;
+		pinfo.mType = "generic";
+		pinfo.mAppId = "generic";
+		pinfo.mFromName = "Pusher";
+		pinfo.mFromUri = "sip:toto@sip.linphone.org";
+		pinfo.mEvent = PushInfo::Message;
+		while (second < args.duration) {
+			auto now = chrono::steady_clock::now();
+			uint64_t due = (uint64_t)(chrono::duration<double>(now - start).count() * args.loadRate);
+			for (; submitted < due; ++submitted) {
+				pinfo.mDeviceToken = "load-token-" + to_string(submitted % args.tokens);
+				pinfo.mCallId = "load-" + to_string(submitted);
+				service.sendPush(make_shared<LoadPushRequest>(pinfo, providerUrl, latencies));
+			}
+			if (now >= nextReport) {
+				uint64_t sent = countSent.read(), failed = countFailed.read();
+				uint64_t p50, p99;
+				{
+					unique_lock<mutex> lock(latencies.lock);
+					p50 = latencies.interval.percentile(0.5);
+					p99 = latencies.interval.percentile(0.99);
+					latencies.interval = LatencyHistogram();
+				}
+				printf("%6d %10llu %10llu %10llu %10llu %10.2f %10.2f\n", ++second,
+					   (unsigned long long)(submitted - lastSubmitted), (unsigned long long)(sent - lastSent),
+					   (unsigned long long)(failed - lastFailed), (unsigned long long)(submitted - sent - failed),
+					   p50 / 1000.0, p99 / 1000.0);
+				lastSubmitted = submitted, lastSent = sent, lastFailed = failed;
+				nextReport += chrono::seconds(1);
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		// the pushes still queued are given 10 seconds to complete
+		auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+		while (countSent.read() + countFailed.read() < submitted && chrono::steady_clock::now() < deadline)
+			this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	uint64_t sent = countSent.read(), failed = countFailed.read();
+	printf("%llu pushes submitted at %d/s, %llu sent (%.0f/s), %llu failed, %llu not completed, latency p50 %.2f ms "
+		   "p99 %.2f ms\n",
+		   (unsigned long long)submitted, args.loadRate, (unsigned long long)sent,
+		   args.duration > 0 ? (double)sent / args.duration : 0.0, (unsigned long long)failed,
+		   (unsigned long long)(submitted - sent - failed), latencies.total.percentile(0.5) / 1000.0,
+		   latencies.total.percentile(0.99) / 1000.0);
+	su_home_unref(home);
+	return failed > 0 || sent + failed < submitted ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
 	int ret = 0;
 	PusherArgs args;
@@ -170,6 +380,9 @@ int main(int argc, char *argv[]) {
 	flexisip::log::initLogs(flexisip_sUseSyslog, args.debug ? "debug" : "error", "error", false, true);
 	flexisip::log::updateFilter("%Severity% >= debug");
 
+	if (args.loadRate > 0)
+		return runLoad(args);
+
 	{
 		PushNotificationService service(MAX_QUEUE_SIZE);
 
@@ -0,0 +1,151 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Measures the regex operator of the filters, evaluated by regexec() and by LinearRegex, on headers of growing sizes:
+ * usual filters on the URIs and the user agents, and patterns known to make the backtracking matchers explode on
+ * crafted headers that almost match.
+ * Each case is repeated, each repetition running enough evaluations to last about 10ms after a warm up, and reported
+ * with the median time per evaluation. A mismatch between the two results is reported as an error.
+ * Usage: flexisip_regex_bench
+ */
+
+#include "../utils/linearregex.hh"
+
+#include <regex.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 9;
+static const chrono::milliseconds sRepetitionDuration(10);
+
+struct Case {
+	const char *name;
+	const char *pattern;
+	string (*header)(size_t size);
+};
+
+static string repeat(const string &s, size_t size) {
+	string header;
+	while (header.size() < size)
+		header += s;
+	header.resize(size);
+	return header;
+}
+
+static string uri(size_t size) {
+	return "sip:" + repeat("alice.", size) + "@sip.example.org;transport=tls";
+}
+
+static string userAgent(size_t size) {
+	return "Linphone/3.10.2 (belle-sip/1.5.0) " + repeat("x", size);
+}
+
+static string almostNested(size_t size) {
+	return repeat("x", size);
+}
+
+static string almostAlternation(size_t size) {
+	return repeat("a", size) + "c";
+}
+
+static string almostInterval(size_t size) {
+	return repeat("ab", size) + "!";
+}
+
+static const Case sCases[] = {
+	{"uri domain", "^sip:[^@]+@sip\\.example\\.org(;.*)?$", uri},
+	{"user agent", "(Linphone|linphone)/[0-9]+\\.[0-9]+", userAgent},
+	{"nested +", "(x+x+)+y", almostNested},
+	{"alternation", "(a|aa)*b", almostAlternation},
+	{"interval", "((ab){1,3}|a|b)*c$", almostInterval},
+};
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Runs fn() repeatedly and returns the median time per evaluation in ns, stopping early for the slow ones. */
+template <typename _Fn> static double bench(_Fn fn) {
+	size_t iterations = 1;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = Clock::now() - start;
+		if (elapsed >= sRepetitionDuration) {
+			if (iterations == 1 && elapsed >= 10 * sRepetitionDuration)
+				return chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+			break;
+		}
+		iterations *= 2;
+	}
+
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	return median(samples);
+}
+
+int main(int argc, char *argv[]) {
+	static const size_t sizes[] = {16, 64, 256, 1024};
+	int errors = 0;
+	printf("%-14s %8s %16s %16s %10s\n", "case", "size", "regexec ns", "linear ns", "speedup");
+	for (const Case &c : sCases) {
+		regex_t preg;
+		if (regcomp(&preg, c.pattern, REG_NOSUB | REG_EXTENDED) != 0) {
+			fprintf(stderr, "%s: invalid pattern %s\n", c.name, c.pattern);
+			return 1;
+		}
+		LinearRegex linear;
+		string error;
+		if (!linear.compile(c.pattern, error)) {
+			fprintf(stderr, "%s: pattern %s not supported: %s\n", c.name, c.pattern, error.c_str());
+			return 1;
+		}
+		for (size_t size : sizes) {
+			string header = c.header(size);
+			bool expected = regexec(&preg, header.c_str(), 0, NULL, 0) == 0;
+			if (linear.search(header) != expected) {
+				fprintf(stderr, "%s: mismatch on a %zu bytes header\n", c.name, size);
+				++errors;
+			}
+			double posix = bench([&]() { regexec(&preg, header.c_str(), 0, NULL, 0); });
+			double lin = bench([&]() { linear.search(header); });
+			printf("%-14s %8zu %16.0f %16.0f %9.1fx\n", c.name, header.size(), posix, lin, lin > 0 ? posix / lin : 0);
+		}
+		regfree(&preg);
+	}
+	return errors ? 1 : 0;
+}
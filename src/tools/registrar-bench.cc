@@ -0,0 +1,202 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the registrar hot paths: Record::update, Record::clean, Record::extractUniqueId,
+ * Record::defineKeyFromUrl, ExtendedContact::toSofiaContact, Record::getContacts, the url-encoded contacts of
+ * RegistrarDbRedisAsync and the serialization and parsing of every available RecordSerializer, for records of several
+ * numbers of contacts.
+ * Each case is repeated, each repetition running enough iterations to last about 10ms after a warm up, and reported
+ * with the median and the lowest time per iteration, and the median absolute deviation relative to the median.
+ * Usage: flexisip_registrar_bench [number_of_contacts ...]
+ */
+
+#include "../log/logmanager.hh"
+#include "../recordserializer.hh"
+#include "../registrardb-internal.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 15;
+static const chrono::milliseconds sRepetitionDuration(10);
+
+/* Makes RegistrarDb::get() available to Record::defineKeyFromUrl(), without the proxy. */
+class BenchRegistrarDb : public RegistrarDbInternal {
+  public:
+	BenchRegistrarDb() : RegistrarDbInternal("") {
+		sUnique = this;
+	}
+};
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Runs fn(iteration) repeatedly and prints its time per iteration. */
+template <typename _Fn> static void bench(const char *name, size_t contacts, _Fn fn) {
+	// the number of iterations of a repetition is calibrated during the warm up
+	size_t iterations = 1;
+	size_t iteration = 0;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn(iteration++);
+		if (Clock::now() - start >= sRepetitionDuration)
+			break;
+		iterations *= 2;
+	}
+
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn(iteration++);
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	double med = median(samples);
+	vector<double> deviations;
+	for (double sample : samples)
+		deviations.push_back(fabs(sample - med));
+	double mad = med > 0 ? 100 * median(deviations) / med : 0;
+	printf("%-24s %8zu %12.1f %12.1f %7.1f%%\n", name, contacts, med,
+		   *min_element(samples.begin(), samples.end()), mad);
+}
+
+static sip_contact_t *makeContact(su_home_t *home, size_t index) {
+	return sip_contact_format(home, "<sip:user@10.0.%zu.%zu:5060;transport=tcp>;+sip.instance=\"<urn:uuid:%zu>\"",
+							  index / 250, index % 250 + 1, index);
+}
+
+/* Record of the given number of contacts, each from its own device and register. */
+static void fillRecord(Record &record, su_home_t *home, size_t contacts, time_t now) {
+	for (size_t i = 0; i < contacts; ++i) {
+		record.update(makeContact(home, i), NULL, 3600, "callid" + to_string(i), 1, now, false, list<string>(), false,
+					  NULL);
+	}
+}
+
+static void benchContacts(size_t contacts) {
+	SofiaAutoHome home;
+	time_t now = getCurrentTime();
+	Record record(NULL);
+	fillRecord(record, home.home(), contacts, now);
+	if ((size_t)record.count() != contacts)
+		fprintf(stderr, "record holds %d contacts instead of %zu\n", record.count(), contacts);
+
+	// refresh of one of the contacts, as done by a REGISTER of an existing device
+	sip_contact_t *refreshed = makeContact(home.home(), contacts / 2);
+	string callId = "callid" + to_string(contacts / 2);
+	bench("Record::update", contacts, [&](size_t i) {
+		record.update(refreshed, NULL, 3600, callId, i + 2, now, false, list<string>(), false, NULL);
+	});
+
+	// periodic cleaning of a record whose contacts are not expired
+	bench("Record::clean", contacts, [&](size_t) { record.clean(now, NULL); });
+
+	bench("toSofiaContact", contacts, [&](size_t) {
+		SofiaAutoHome iterationHome;
+		for (const auto &ec : record.getExtendedContacts())
+			ec->toSofiaContact(iterationHome.home(), now);
+	});
+
+	// Contact headers of the 200 OK of a REGISTER
+	bench("getContacts", contacts, [&](size_t) {
+		SofiaAutoHome iterationHome;
+		record.getContacts(iterationHome.home(), now);
+	});
+
+	// contacts as stored by RegistrarDbRedisAsync, one hash field each
+	bench("url-encoded serialize", contacts, [&](size_t) {
+		for (const auto &ec : record.getExtendedContacts())
+			ec->serializeAsUrlEncodedParams();
+	});
+	vector<pair<string, string>> fields;
+	for (const auto &ec : record.getExtendedContacts())
+		fields.emplace_back(ec->getUniqueId(), ec->serializeAsUrlEncodedParams());
+	bench("url-encoded parse", contacts, [&](size_t) {
+		Record parsed(NULL);
+		for (const auto &field : fields)
+			parsed.updateFromUrlEncodedParams("bench", field.first.c_str(), field.second.c_str());
+	});
+
+	for (const char *name : {"c", "json", "flat", "protobuf", "msgpack"}) {
+		unique_ptr<RecordSerializer> serializer(RecordSerializer::create(name));
+		if (!serializer)
+			continue; // not built in
+		string serialized;
+		if (!serializer->serialize(&record, serialized)) {
+			fprintf(stderr, "%s serializer failed\n", name);
+			continue;
+		}
+		string serializeName = string(name) + " serialize";
+		string parseName = string(name) + " parse";
+		bench(serializeName.c_str(), contacts, [&](size_t) {
+			string out;
+			serializer->serialize(&record, out);
+		});
+		bench(parseName.c_str(), contacts, [&](size_t) {
+			Record parsed(NULL);
+			serializer->parse(serialized, &parsed);
+		});
+	}
+}
+
+int main(int argc, char *argv[]) {
+	flexisip_sUseSyslog = false;
+	flexisip::log::preinit(flexisip_sUseSyslog, false, 0, "registrar-bench");
+	flexisip::log::initLogs(flexisip_sUseSyslog, "error", "error", false, false);
+	Record::sLineFieldNames = {"+sip.instance", "pn-tok", "line"};
+
+	vector<size_t> sizes;
+	for (int i = 1; i < argc; ++i) {
+		sizes.push_back(strtoul(argv[i], NULL, 10));
+	}
+	if (sizes.empty()) {
+		sizes = {1, 5, 20, 100};
+	}
+	Record::sMaxContacts = (int)*max_element(sizes.begin(), sizes.end());
+	BenchRegistrarDb registrar;
+
+	printf("%-24s %8s %12s %12s %8s\n", "operation", "contacts", "median ns", "min ns", "mad");
+
+	SofiaAutoHome home;
+	sip_contact_t *contact = makeContact(home.home(), 0);
+	bench("extractUniqueId", 1, [&](size_t) { Record::extractUniqueId(contact); });
+	const url_t *aor = url_make(home.home(), "sip:user@sip.example.org");
+	bench("defineKeyFromUrl", 1, [&](size_t) { Record::defineKeyFromUrl(aor); });
+
+	for (auto contacts : sizes) {
+		benchContacts(contacts);
+	}
+	return 0;
+}
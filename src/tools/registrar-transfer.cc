@@ -0,0 +1,451 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Bulk transfer of the registrar records of a Redis backend, walked with SCAN and read and written with pipelined
+ * commands, a batch of records per round-trip:
+ *   export: writes the records to a file, serialized with a RecordSerializer
+ *   import: writes the records of such a file into a Redis backend
+ *   copy:   copies the records from a Redis backend to another, without parsing them
+ * The progress and the throughput are reported every second on stderr. The records are stored as by
+ * RegistrarDbRedisAsync: one hash fs:<key> per record, holding the url-encoded contacts by unique id.
+ * The file starts with "flexisip-registrar-export: 1 <serializer>\n", followed by
+ * "<key length> <data length>\n<key><data>" per record.
+ * Usage: flexisip_registrar_transfer export|import|copy [options] [file], see --help
+ */
+
+#include "../log/logmanager.hh"
+#include "../recordserializer.hh"
+#include "../registrardb.hh"
+#include "../utils/compression.hh"
+
+#include <hiredis/hiredis.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const char *sMagic = "flexisip-registrar-export: 1";
+
+struct RedisServer {
+	string host = "localhost";
+	int port = 6379;
+	string auth;
+};
+
+struct TransferArgs {
+	string mode;
+	RedisServer source;
+	RedisServer target;
+	string serializer = "flat";
+	string file;
+	int batch = 500;
+	bool debug = false;
+
+	static void usage(const char *app) {
+		TransferArgs args;
+		cout << app << " export -t host[" << args.source.host << "] -p port[" << args.source.port << "] -a auth "
+			 << "-s serializer[" << args.serializer << "] -b batch[" << args.batch << "] --debug file" << endl;
+		cout << app << " import -T host[" << args.target.host << "] -P port[" << args.target.port << "] -A auth "
+			 << "-b batch[" << args.batch << "] --debug file" << endl;
+		cout << app << " copy -t host -p port -a auth -T host -P port -A auth -b batch[" << args.batch << "] --debug"
+			 << endl;
+	}
+
+	void parse(int argc, char **argv) {
+#define EQ0(i, name) (strcmp(name, argv[i]) == 0)
+#define EQ1(i, name) (strcmp(name, argv[i]) == 0 && argc > i + 1)
+		if (argc < 2 || (!EQ0(1, "export") && !EQ0(1, "import") && !EQ0(1, "copy"))) {
+			usage(*argv);
+			exit(argc < 2 || EQ0(1, "--help") || EQ0(1, "-h") ? 0 : -1);
+		}
+		mode = argv[1];
+		for (int i = 2; i < argc; ++i) {
+			if (EQ0(i, "--debug")) {
+				debug = true;
+			} else if (EQ0(i, "--help") || EQ0(i, "-h")) {
+				usage(*argv);
+				exit(0);
+			} else if (EQ1(i, "-t")) {
+				source.host = argv[++i];
+			} else if (EQ1(i, "-p")) {
+				source.port = atoi(argv[++i]);
+			} else if (EQ1(i, "-a")) {
+				source.auth = argv[++i];
+			} else if (EQ1(i, "-T")) {
+				target.host = argv[++i];
+			} else if (EQ1(i, "-P")) {
+				target.port = atoi(argv[++i]);
+			} else if (EQ1(i, "-A")) {
+				target.auth = argv[++i];
+			} else if (EQ1(i, "-s")) {
+				serializer = argv[++i];
+			} else if (EQ1(i, "-b")) {
+				batch = atoi(argv[++i]);
+			} else if (file.empty() && argv[i][0] != '-') {
+				file = argv[i];
+			} else {
+				cerr << "? arg" << i << " " << argv[i] << endl;
+				usage(*argv);
+				exit(-1);
+			}
+		}
+		if (mode != "copy" && file.empty()) {
+			cerr << "specify the file" << endl;
+			usage(*argv);
+			exit(-1);
+		}
+		if (batch <= 0)
+			batch = 1;
+	}
+};
+
+static redisContext *connect(const RedisServer &server) {
+	struct timeval timeout = {5, 0};
+	redisContext *context = redisConnectWithTimeout(server.host.c_str(), server.port, timeout);
+	if (context == NULL || context->err) {
+		cerr << "Cannot connect to redis " << server.host << ":" << server.port << ": "
+			 << (context ? context->errstr : "out of memory") << endl;
+		if (context)
+			redisFree(context);
+		return NULL;
+	}
+	if (!server.auth.empty()) {
+		redisReply *reply = (redisReply *)redisCommand(context, "AUTH %s", server.auth.c_str());
+		bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+		if (!ok)
+			cerr << "Authentication to redis " << server.host << " failed: " << (reply ? reply->str : context->errstr)
+				 << endl;
+		if (reply)
+			freeReplyObject(reply);
+		if (!ok) {
+			redisFree(context);
+			return NULL;
+		}
+	}
+	return context;
+}
+
+/* Reads the replies of the pipelined commands, false on a connection error. Error replies are counted. */
+static bool readReplies(redisContext *context, size_t count, vector<redisReply *> &replies, size_t &errors) {
+	for (size_t i = 0; i < count; ++i) {
+		void *reply = NULL;
+		if (redisGetReply(context, &reply) != REDIS_OK) {
+			cerr << "Redis error: " << context->errstr << endl;
+			for (auto r : replies)
+				freeReplyObject(r);
+			replies.clear();
+			return false;
+		}
+		redisReply *r = (redisReply *)reply;
+		if (r->type == REDIS_REPLY_ERROR) {
+			if (errors++ == 0)
+				cerr << "Redis error: " << r->str << endl;
+		}
+		replies.push_back(r);
+	}
+	return true;
+}
+
+static void freeReplies(vector<redisReply *> &replies) {
+	for (auto r : replies)
+		freeReplyObject(r);
+	replies.clear();
+}
+
+/* Prints the progress every second, and the summary at the end. */
+class Progress {
+  public:
+	Progress(const char *what) : mWhat(what), mStart(Clock::now()), mLast(mStart) {
+	}
+	void add(size_t records, size_t contacts) {
+		mRecords += records;
+		mContacts += contacts;
+		auto now = Clock::now();
+		if (now - mLast < chrono::seconds(1))
+			return;
+		double elapsed = chrono::duration<double>(now - mLast).count();
+		fprintf(stderr, "%zu records %s, %.0f records/s\n", mRecords, mWhat, (mRecords - mLastRecords) / elapsed);
+		mLast = now;
+		mLastRecords = mRecords;
+	}
+	void done(size_t errors) {
+		double elapsed = chrono::duration<double>(Clock::now() - mStart).count();
+		fprintf(stderr, "%zu records (%zu contacts) %s in %.1f s, %.0f records/s, %zu errors\n", mRecords, mContacts,
+				mWhat, elapsed, elapsed > 0 ? mRecords / elapsed : 0, errors);
+	}
+
+  private:
+	const char *mWhat;
+	Clock::time_point mStart;
+	Clock::time_point mLast;
+	size_t mRecords = 0;
+	size_t mContacts = 0;
+	size_t mLastRecords = 0;
+};
+
+/* Calls fn with each batch of record keys of the server, without the fs: prefix. */
+template <typename _Fn> static bool scan(redisContext *context, int batch, _Fn fn) {
+	string cursor = "0";
+	do {
+		redisReply *reply = (redisReply *)redisCommand(context, "SCAN %s MATCH fs:* COUNT %d", cursor.c_str(), batch);
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+			cerr << "SCAN failed: " << (reply ? (reply->str ? reply->str : "unexpected reply") : context->errstr)
+				 << endl;
+			if (reply)
+				freeReplyObject(reply);
+			return false;
+		}
+		cursor = reply->element[0]->str;
+		vector<string> keys;
+		redisReply *elements = reply->element[1];
+		for (size_t i = 0; i < elements->elements; ++i)
+			keys.emplace_back(elements->element[i]->str + 3);
+		freeReplyObject(reply);
+		if (!keys.empty() && !fn(keys))
+			return false;
+	} while (cursor != "0");
+	return true;
+}
+
+/* Queues the HMSET of the contacts and the expiry of a record, returns the number of commands queued. */
+static int appendRecord(redisContext *context, const string &key, const vector<pair<string, string>> &contacts,
+						const char *expireCommand, long long expire) {
+	vector<const char *> argv;
+	vector<size_t> argvlen;
+	string name = "fs:" + key;
+	argv.push_back("HMSET");
+	argvlen.push_back(5);
+	argv.push_back(name.c_str());
+	argvlen.push_back(name.size());
+	for (const auto &contact : contacts) {
+		argv.push_back(contact.first.c_str());
+		argvlen.push_back(contact.first.size());
+		argv.push_back(contact.second.c_str());
+		argvlen.push_back(contact.second.size());
+	}
+	redisAppendCommandArgv(context, (int)argv.size(), argv.data(), argvlen.data());
+	if (expire <= 0)
+		return 1;
+	redisAppendCommand(context, "%s %b %lld", expireCommand, name.data(), name.size(), expire);
+	return 2;
+}
+
+static int doExport(const TransferArgs &args) {
+	unique_ptr<RecordSerializer> serializer(RecordSerializer::create(args.serializer));
+	if (!serializer) {
+		cerr << "invalid serializer : " << args.serializer << endl;
+		return -1;
+	}
+	redisContext *context = connect(args.source);
+	if (!context)
+		return -1;
+	ofstream out(args.file, ios::out | ios::binary | ios::trunc);
+	if (!out) {
+		cerr << "Cannot create " << args.file << endl;
+		redisFree(context);
+		return -1;
+	}
+	out << sMagic << " " << args.serializer << "\n";
+
+	Progress progress("exported");
+	size_t errors = 0;
+	bool ok = scan(context, args.batch, [&](const vector<string> &keys) -> bool {
+		for (const string &key : keys)
+			redisAppendCommand(context, "HGETALL fs:%b", key.data(), key.size());
+		vector<redisReply *> replies;
+		if (!readReplies(context, keys.size(), replies, errors))
+			return false;
+		size_t contacts = 0;
+		for (size_t i = 0; i < keys.size(); ++i) {
+			redisReply *reply = replies[i];
+			if (reply->type != REDIS_REPLY_ARRAY || reply->elements == 0)
+				continue; // expired meanwhile
+			Record record(NULL);
+			for (size_t j = 0; j + 1 < reply->elements; j += 2) {
+				const redisReply *value = reply->element[j + 1];
+				string contact(value->str, value->len);
+				if (ValueCompression::isCompressed(value->str, value->len) &&
+					!ValueCompression::decompress(value->str, value->len, contact)) {
+					if (errors++ == 0)
+						cerr << "Cannot decompress a contact of fs:" << keys[i] << endl;
+					continue;
+				}
+				record.updateFromUrlEncodedParams(keys[i].c_str(), reply->element[j]->str, contact.c_str());
+			}
+			string data;
+			if (!serializer->serialize(&record, data)) {
+				if (errors++ == 0)
+					cerr << "Cannot serialize fs:" << keys[i] << endl;
+				continue;
+			}
+			contacts += record.count();
+			out << keys[i].size() << " " << data.size() << "\n" << keys[i] << data;
+		}
+		freeReplies(replies);
+		progress.add(keys.size(), contacts);
+		return (bool)out;
+	});
+	out.close();
+	redisFree(context);
+	if (!out) {
+		cerr << "Cannot write " << args.file << endl;
+		ok = false;
+	}
+	progress.done(errors);
+	return ok ? 0 : -1;
+}
+
+static int doImport(const TransferArgs &args) {
+	ifstream in(args.file, ios::in | ios::binary);
+	string header;
+	if (!getline(in, header) || header.compare(0, strlen(sMagic), sMagic) != 0 || header.size() <= strlen(sMagic) + 1) {
+		cerr << args.file << " is not a registrar export" << endl;
+		return -1;
+	}
+	string serializerName = header.substr(strlen(sMagic) + 1);
+	unique_ptr<RecordSerializer> serializer(RecordSerializer::create(serializerName));
+	if (!serializer) {
+		cerr << "serializer " << serializerName << " of " << args.file << " is not available" << endl;
+		return -1;
+	}
+	redisContext *context = connect(args.target);
+	if (!context)
+		return -1;
+
+	Progress progress("imported");
+	size_t errors = 0;
+	bool ok = true;
+	while (ok && in.peek() != EOF) {
+		size_t commands = 0, records = 0, contacts = 0;
+		for (; records < (size_t)args.batch && in.peek() != EOF; ++records) {
+			size_t keyLength, dataLength;
+			string key, data;
+			if (!(in >> keyLength >> dataLength) || in.get() != '\n') {
+				ok = false;
+				break;
+			}
+			key.resize(keyLength);
+			data.resize(dataLength);
+			if (!in.read(&key[0], keyLength) || !in.read(&data[0], dataLength)) {
+				ok = false;
+				break;
+			}
+			Record record(NULL);
+			if (!serializer->parse(data, &record)) {
+				if (errors++ == 0)
+					cerr << "Cannot parse the record of " << key << endl;
+				continue;
+			}
+			vector<pair<string, string>> serialized;
+			for (const auto &ec : record.getExtendedContacts())
+				serialized.emplace_back(ec->getUniqueId(), ec->serializeAsUrlEncodedParams());
+			if (serialized.empty())
+				continue;
+			contacts += serialized.size();
+			commands += appendRecord(context, key, serialized, "EXPIREAT", (long long)record.latestExpire());
+		}
+		if (!ok)
+			cerr << args.file << " is truncated" << endl;
+		vector<redisReply *> replies;
+		if (!readReplies(context, commands, replies, errors))
+			ok = false;
+		freeReplies(replies);
+		progress.add(records, contacts);
+	}
+	redisFree(context);
+	progress.done(errors);
+	return ok ? 0 : -1;
+}
+
+static int doCopy(const TransferArgs &args) {
+	redisContext *source = connect(args.source);
+	if (!source)
+		return -1;
+	redisContext *target = connect(args.target);
+	if (!target) {
+		redisFree(source);
+		return -1;
+	}
+
+	Progress progress("copied");
+	size_t errors = 0;
+	bool ok = scan(source, args.batch, [&](const vector<string> &keys) -> bool {
+		for (const string &key : keys) {
+			redisAppendCommand(source, "HGETALL fs:%b", key.data(), key.size());
+			redisAppendCommand(source, "PTTL fs:%b", key.data(), key.size());
+		}
+		vector<redisReply *> replies;
+		if (!readReplies(source, keys.size() * 2, replies, errors))
+			return false;
+		size_t commands = 0, contacts = 0;
+		for (size_t i = 0; i < keys.size(); ++i) {
+			redisReply *fields = replies[2 * i];
+			redisReply *ttl = replies[2 * i + 1];
+			if (fields->type != REDIS_REPLY_ARRAY || fields->elements == 0)
+				continue; // expired meanwhile
+			vector<pair<string, string>> serialized;
+			for (size_t j = 0; j + 1 < fields->elements; j += 2) {
+				serialized.emplace_back(string(fields->element[j]->str, fields->element[j]->len),
+										string(fields->element[j + 1]->str, fields->element[j + 1]->len));
+			}
+			contacts += serialized.size();
+			long long pttl = ttl->type == REDIS_REPLY_INTEGER ? ttl->integer : -1;
+			commands += appendRecord(target, keys[i], serialized, "PEXPIRE", pttl);
+		}
+		freeReplies(replies);
+		if (!readReplies(target, commands, replies, errors))
+			return false;
+		freeReplies(replies);
+		progress.add(keys.size(), contacts);
+		return true;
+	});
+	redisFree(source);
+	redisFree(target);
+	progress.done(errors);
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	TransferArgs args;
+	args.parse(argc, argv);
+
+	flexisip_sUseSyslog = false;
+	flexisip::log::preinit(flexisip_sUseSyslog, args.debug, 0, "registrar-transfer");
+	flexisip::log::initLogs(flexisip_sUseSyslog, args.debug ? "debug" : "error", "error", false, args.debug);
+	Record::sLineFieldNames = {"+sip.instance", "pn-tok", "line"};
+	Record::sMaxContacts = numeric_limits<int>::max();
+
+	if (args.mode == "export")
+		return doExport(args);
+	if (args.mode == "import")
+		return doImport(args);
+	return doCopy(args);
+}
@@ -0,0 +1,560 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays the SIP messages of a pcap capture through the modules of the proxy, as configured by the configuration
+ * file, back to back and in their order of capture, and measures the cost of each message and of each module.
+ * The messages are given to the agent as if received on its loopback transport, and those it sends or replies
+ * statelessly or by new outgoing transactions are counted and dropped rather than sent. The registrar database is the
+ * internal one, and it and the authentication database answer after the given latencies, to model the remote
+ * backends; the authentication database answers from the backend of the configuration.
+ * Reported are the processor time used by the agent for each message, and the latency until its last module or
+ * database operation, by method, then the time spent in each module and database operation, from the traces of the
+ * messages. UDP datagrams and TCP segments holding whole messages are replayed, over IPv4 or IPv6, from captures of
+ * Ethernet, Linux cooked, loopback or raw IP frames; the fragments, the messages split over several segments and the
+ * other packets are skipped.
+ * Usage: flexisip_replay_bench capture.pcap [config_file [registrardb_latency_ms [authdb_latency_ms]]]
+ */
+
+#include "../agent.hh"
+#include "../authdb.hh"
+#include "../configmanager.hh"
+#include "../log/logmanager.hh"
+#include "../registrardb-internal.hh"
+#include "../tracing.hh"
+
+#include <ortp/ortp.h>
+#include <sofia-sip/msg.h>
+#include <sofia-sip/msg_addr.h>
+#include <sofia-sip/sip_header.h>
+#include <sofia-sip/tport.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct CapturedMessage {
+	string data;
+	sockaddr_storage source;
+	socklen_t sourceLen;
+};
+
+/* Reader of the pcap files of any byte order and timestamp resolution. */
+class PcapReader {
+  public:
+	bool open(const string &path) {
+		mFile.open(path, ios::binary);
+		uint8_t header[24];
+		if (!mFile.read((char *)header, sizeof(header)))
+			return false;
+		uint32_t magic;
+		memcpy(&magic, header, 4);
+		if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+			mSwapped = false;
+		else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+			mSwapped = true;
+		else
+			return false;
+		mLinkType = read32(header + 20) & 0xfffffff;
+		return true;
+	}
+	/* The next frame, without its link header, and the version of its IP header. */
+	bool next(string &frame, int &ipVersion) {
+		uint8_t header[16];
+		while (mFile.read((char *)header, sizeof(header))) {
+			uint32_t length = read32(header + 8);
+			frame.resize(length);
+			if (length > 0 && !mFile.read(&frame[0], length))
+				return false;
+			size_t offset = 0;
+			uint16_t ethertype = 0;
+			const uint8_t *p = (const uint8_t *)frame.data();
+			switch (mLinkType) {
+				case 0: // BSD loopback, the family in the byte order of the host that captured
+					offset = 4;
+					break;
+				case 1: // Ethernet, possibly VLAN tagged
+					if (length < 14)
+						continue;
+					offset = 14;
+					ethertype = (p[12] << 8) | p[13];
+					while (ethertype == 0x8100 && length >= offset + 4) {
+						ethertype = (p[offset + 2] << 8) | p[offset + 3];
+						offset += 4;
+					}
+					break;
+				case 113: // Linux cooked
+					if (length < 16)
+						continue;
+					offset = 16;
+					ethertype = (p[14] << 8) | p[15];
+					break;
+				case 276: // Linux cooked v2
+					if (length < 20)
+						continue;
+					offset = 20;
+					ethertype = (p[0] << 8) | p[1];
+					break;
+				case 12:
+				case 101:
+				case 228:
+				case 229: // raw IP
+					break;
+				default:
+					return false;
+			}
+			if (ethertype != 0 && ethertype != 0x0800 && ethertype != 0x86dd)
+				continue;
+			if (length <= offset)
+				continue;
+			frame.erase(0, offset);
+			ipVersion = (uint8_t)frame[0] >> 4;
+			return true;
+		}
+		return false;
+	}
+  private:
+	uint32_t read32(const uint8_t *p) const {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return mSwapped ? __builtin_bswap32(v) : v;
+	}
+
+	ifstream mFile;
+	bool mSwapped = false;
+	uint32_t mLinkType = 0;
+};
+
+static bool isSipStartLine(const string &data, size_t pos) {
+	size_t eol = data.find("\r\n", pos);
+	if (eol == string::npos)
+		return false;
+	if (data.compare(pos, 8, "SIP/2.0 ") == 0)
+		return true;
+	return eol >= pos + 8 && data.compare(eol - 8, 8, " SIP/2.0") == 0;
+}
+
+/* The value of the Content-Length header of the headers between begin and end, 0 when there is none. */
+static size_t getContentLength(const string &data, size_t begin, size_t end) {
+	for (size_t line = begin; line < end;) {
+		size_t eol = data.find("\r\n", line);
+		if (eol == string::npos || eol > end)
+			eol = end;
+		size_t colon = data.find(':', line);
+		if (colon != string::npos && colon < eol) {
+			string name = data.substr(line, colon - line);
+			while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+				name.pop_back();
+			if (strcasecmp(name.c_str(), "Content-Length") == 0 || strcasecmp(name.c_str(), "l") == 0)
+				return strtoul(data.c_str() + colon + 1, NULL, 10);
+		}
+		line = eol + 2;
+	}
+	return 0;
+}
+
+/* Appends the whole SIP messages of the payload to messages, skipping the keep-alives between them. */
+static void splitMessages(const string &payload, const sockaddr_storage &source, socklen_t sourceLen,
+						  vector<CapturedMessage> &messages) {
+	size_t pos = 0;
+	while (pos < payload.size()) {
+		while (pos < payload.size() && (payload[pos] == '\r' || payload[pos] == '\n'))
+			++pos;
+		if (pos >= payload.size() || !isSipStartLine(payload, pos))
+			return;
+		size_t headersEnd = payload.find("\r\n\r\n", pos);
+		if (headersEnd == string::npos)
+			return;
+		size_t end = headersEnd + 4 + getContentLength(payload, pos, headersEnd);
+		if (end > payload.size())
+			return;
+		messages.push_back({payload.substr(pos, end - pos), source, sourceLen});
+		pos = end;
+	}
+}
+
+static bool readCapture(const string &path, vector<CapturedMessage> &messages, size_t &packets) {
+	PcapReader reader;
+	if (!reader.open(path))
+		return false;
+	string frame;
+	int version;
+	packets = 0;
+	while (reader.next(frame, version)) {
+		++packets;
+		const uint8_t *p = (const uint8_t *)frame.data();
+		size_t length = frame.size();
+		sockaddr_storage source;
+		memset(&source, 0, sizeof(source));
+		socklen_t sourceLen;
+		int protocol;
+		size_t offset;
+		if (version == 4 && length >= 20) {
+			size_t ihl = (p[0] & 0xf) * 4;
+			uint16_t fragment = (p[6] << 8) | p[7];
+			if ((fragment & 0x3fff) != 0 || length < ihl)
+				continue;
+			protocol = p[9];
+			offset = ihl;
+			sockaddr_in *sin = (sockaddr_in *)&source;
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, p + 12, 4);
+			sourceLen = sizeof(sockaddr_in);
+		} else if (version == 6 && length >= 40) {
+			protocol = p[6];
+			offset = 40;
+			sockaddr_in6 *sin6 = (sockaddr_in6 *)&source;
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, p + 8, 16);
+			sourceLen = sizeof(sockaddr_in6);
+		} else {
+			continue;
+		}
+		size_t payloadOffset;
+		if (protocol == IPPROTO_UDP && length >= offset + 8) {
+			payloadOffset = offset + 8;
+		} else if (protocol == IPPROTO_TCP && length >= offset + 20) {
+			payloadOffset = offset + (p[offset + 12] >> 4) * 4;
+		} else {
+			continue;
+		}
+		if (payloadOffset >= length)
+			continue;
+		uint16_t port = htons((p[offset] << 8) | p[offset + 1]);
+		if (version == 4)
+			((sockaddr_in *)&source)->sin_port = port;
+		else
+			((sockaddr_in6 *)&source)->sin6_port = port;
+		splitMessages(frame.substr(payloadOffset), source, sourceLen, messages);
+	}
+	return true;
+}
+
+/* Runs the functions posted to it after a fixed delay, in their order, from the main loop. */
+class Delayer {
+  public:
+	Delayer(su_root_t *root, unsigned int delayMs)
+		: mTimer(su_timer_create(su_root_task(root), 0)), mDelay(delayMs) {
+	}
+	~Delayer() {
+		su_timer_destroy(mTimer);
+	}
+	void post(const function<void()> &fn) {
+		mQueue.emplace_back(Clock::now() + mDelay, fn);
+		if (mQueue.size() == 1)
+			arm();
+	}
+	bool empty() const {
+		return mQueue.empty();
+	}
+
+  private:
+	void arm() {
+		auto wait = chrono::duration_cast<chrono::milliseconds>(mQueue.front().first - Clock::now()).count();
+		su_timer_set_interval(mTimer, &Delayer::sOnTimer, (su_timer_arg_t *)this, wait > 0 ? wait : 0);
+	}
+	static void sOnTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+		Delayer *zis = (Delayer *)arg;
+		auto now = Clock::now();
+		while (!zis->mQueue.empty() && zis->mQueue.front().first <= now) {
+			function<void()> fn = zis->mQueue.front().second;
+			zis->mQueue.pop_front();
+			fn();
+		}
+		if (!zis->mQueue.empty())
+			zis->arm();
+	}
+
+	su_timer_t *mTimer;
+	chrono::milliseconds mDelay;
+	deque<pair<Clock::time_point, function<void()>>> mQueue;
+};
+
+/* The internal registrar database, answering after the latency of the delayer. The arguments are copied, as they may
+ * belong to the caller. Clears are rare and not delayed, the request they come from being hard to copy. */
+class BenchRegistrarDb : public RegistrarDbInternal {
+  public:
+	BenchRegistrarDb(Agent *agent, Delayer &delayer)
+		: RegistrarDbInternal(agent->getPreferredRoute()), mDelayer(delayer) {
+		GenericStruct *router = GenericManager::get()->getRoot()->get<GenericStruct>("module::Router");
+		mUseGlobalDomain = router->get<ConfigBoolean>("use-global-domain")->read();
+		sUnique = this;
+	}
+
+  private:
+	void doBind(const url_t *ifrom, sip_contact_t *icontact, const char *iid, uint32_t iseq, const sip_path_t *ipath,
+				list<string> acceptHeaders, bool usedAsRoute, int expire, int alias, int version,
+				const shared_ptr<ContactUpdateListener> &listener) {
+		auto home = make_shared<SofiaAutoHome>();
+		url_t *from = url_hdup(home->home(), ifrom);
+		sip_contact_t *contact = sip_contact_dup(home->home(), icontact);
+		sip_path_t *path = ipath ? sip_path_dup(home->home(), ipath) : NULL;
+		bool hasId = iid != NULL;
+		string id = hasId ? iid : "";
+		// the home owns the copies until the call
+		mDelayer.post([this, home, from, contact, hasId, id, iseq, path, acceptHeaders, usedAsRoute, expire, alias,
+					   version, listener]() {
+			RegistrarDbInternal::doBind(from, contact, hasId ? id.c_str() : NULL, iseq, path, acceptHeaders,
+										usedAsRoute, expire, alias, version, listener);
+		});
+	}
+	void doFetch(const url_t *url, const shared_ptr<ContactUpdateListener> &listener) {
+		auto home = make_shared<SofiaAutoHome>();
+		url_t *copy = url_hdup(home->home(), url);
+		mDelayer.post([this, home, copy, listener]() { RegistrarDbInternal::doFetch(copy, listener); });
+	}
+	void doFetchForGruu(const url_t *url, const string &gruu, const shared_ptr<ContactUpdateListener> &listener) {
+		auto home = make_shared<SofiaAutoHome>();
+		url_t *copy = url_hdup(home->home(), url);
+		mDelayer.post(
+			[this, home, copy, gruu, listener]() { RegistrarDbInternal::doFetchForGruu(copy, gruu, listener); });
+	}
+
+	Delayer &mDelayer;
+};
+
+/* The authentication database of the configuration, answering after the latency of the delayer. */
+class BenchAuthDb : public AuthDbBackend {
+  public:
+	BenchAuthDb(AuthDbBackend *backend, Delayer &delayer) : mBackend(backend), mDelayer(delayer) {
+	}
+	void getUserWithPhoneFromBackend(const string &phone, const string &domain, AuthDbListener *listener) {
+		mDelayer.post([=]() { mBackend->getUserWithPhoneFromBackend(phone, domain, listener); });
+	}
+	void getPasswordFromBackend(const string &id, const string &domain, const string &authid,
+								AuthDbListener *listener) {
+		mDelayer.post([=]() { mBackend->getPasswordFromBackend(id, domain, authid, listener); });
+	}
+	void createAccount(const string &user, const string &domain, const string &authUsername, const string &password,
+					   int expires, const string &phoneAlias) {
+		mBackend->createAccount(user, domain, authUsername, password, expires, phoneAlias);
+	}
+
+  private:
+	AuthDbBackend *mBackend;
+	Delayer &mDelayer;
+};
+
+/* Stands for the transport the messages are received from: the replies are counted and dropped. */
+class ReplayIncomingAgent : public IncomingAgent {
+  public:
+	ReplayIncomingAgent(Agent *agent) : mAgent(agent), mSent(0) {
+	}
+	void send(const shared_ptr<MsgSip> &msg, url_string_t const *u, tag_type_t tag, tag_value_t value, ...) {
+		++mSent;
+	}
+	void reply(const shared_ptr<MsgSip> &msg, int status, char const *phrase, tag_type_t tag, tag_value_t value,
+			   ...) {
+		++mSent;
+	}
+	Agent *getAgent() {
+		return mAgent;
+	}
+	size_t getSent() const {
+		return mSent;
+	}
+
+  private:
+	Agent *mAgent;
+	size_t mSent;
+};
+
+/* Stands for the transport the responses are received from. */
+class ReplayOutgoingAgent : public OutgoingAgent {
+  public:
+	ReplayOutgoingAgent(Agent *agent) : mAgent(agent), mSent(0) {
+	}
+	void send(const shared_ptr<MsgSip> &msg, url_string_t const *u, tag_type_t tag, tag_value_t value, ...) {
+		++mSent;
+	}
+	Agent *getAgent() {
+		return mAgent;
+	}
+	size_t getSent() const {
+		return mSent;
+	}
+
+  private:
+	Agent *mAgent;
+	size_t mSent;
+};
+
+static double percentile(vector<double> values, double fraction) {
+	if (values.empty())
+		return 0;
+	sort(values.begin(), values.end());
+	size_t rank = min(values.size() - 1, (size_t)(fraction * values.size()));
+	return values[rank];
+}
+
+static double threadCpuUs() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct MessageCost {
+	vector<double> cpu;     // us of processor time of the agent for the message
+	vector<double> latency; // us until the end of the last span of its trace
+};
+
+struct SpanCost {
+	vector<double> durations; // us
+};
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s capture.pcap [config_file [registrardb_latency_ms [authdb_latency_ms]]]\n",
+				argv[0]);
+		return 1;
+	}
+	string captureFile = argv[1];
+	string configFile = argc > 2 ? argv[2] : "/dev/null";
+	unsigned int registrarLatency = argc > 3 ? atoi(argv[3]) : 1;
+	unsigned int authLatency = argc > 4 ? atoi(argv[4]) : 1;
+
+	flexisip_sUseSyslog = false;
+	flexisip::log::preinit(flexisip_sUseSyslog, false, 0, "replay-bench");
+	flexisip::log::initLogs(flexisip_sUseSyslog, "error", "error", false, false);
+	su_init();
+
+	vector<CapturedMessage> messages;
+	size_t packets;
+	if (!readCapture(captureFile, messages, packets)) {
+		fprintf(stderr, "Cannot read the pcap capture %s\n", captureFile.c_str());
+		return 1;
+	}
+	printf("%zu SIP messages in %zu IP packets of %s\n", messages.size(), packets, captureFile.c_str());
+
+	GenericManager *cfg = GenericManager::get();
+	if (cfg->load(configFile.c_str()) == -1) {
+		fprintf(stderr, "Cannot read the configuration file %s\n", configFile.c_str());
+		return 1;
+	}
+	su_root_t *root = su_root_create(NULL);
+	shared_ptr<Agent> agent = make_shared<Agent>(root);
+	agent->start("sip:127.0.0.1:0;transport=udp", "");
+	ortp_init();
+	agent->loadConfig(cfg);
+
+	Delayer registrarDelayer(root, registrarLatency);
+	Delayer authDelayer(root, authLatency);
+	new BenchRegistrarDb(agent.get(), registrarDelayer);
+	AuthDbBackend *authDb = AuthDbBackend::get();
+	if (authDb)
+		AuthDbBackend::set(new BenchAuthDb(authDb, authDelayer));
+	size_t dropped = 0;
+	agent->setOutgoingMessageFilter([&dropped](const shared_ptr<MsgSip> &ms) {
+		++dropped;
+		return false;
+	});
+	auto incoming = make_shared<ReplayIncomingAgent>(agent.get());
+	auto outgoing = make_shared<ReplayOutgoingAgent>(agent.get());
+	tport_t *tport = tport_primaries(nta_agent_tports(agent->getSofiaAgent()));
+
+	map<string, MessageCost> costs;
+	vector<pair<string, shared_ptr<Trace>>> traces;
+	size_t invalid = 0;
+	double totalCpu = 0;
+	auto start = Clock::now();
+	for (const auto &captured : messages) {
+		msg_t *msg = msg_make(sip_default_mclass(), 0, captured.data.data(), captured.data.size());
+		sip_t *sip = msg ? sip_object(msg) : NULL;
+		if (!sip || msg_has_error(msg) || (!sip->sip_request && !sip->sip_status)) {
+			++invalid;
+			if (msg)
+				msg_destroy(msg);
+			continue;
+		}
+		msg_set_address(msg, (su_sockaddr_t *)&captured.source, captured.sourceLen);
+		string name = sip->sip_request ? sip->sip_request->rq_method_name
+									   : "response " + to_string(sip->sip_status->st_status / 100) + "xx";
+		auto ms = make_shared<MsgSip>(msg);
+		msg_destroy(msg);
+		auto trace = make_shared<Trace>(name);
+		ms->setTrace(trace);
+
+		double cpu = threadCpuUs();
+		if (ms->getSip()->sip_request)
+			agent->processRequestEvent(make_shared<RequestSipEvent>(incoming, ms, tport));
+		else
+			agent->sendResponseEvent(make_shared<ResponseSipEvent>(outgoing, ms));
+		cpu = threadCpuUs() - cpu;
+		totalCpu += cpu;
+		costs[name].cpu.push_back(cpu);
+		traces.emplace_back(name, trace);
+		// the database operations due, and the other timers
+		su_root_step(root, 0);
+	}
+	// the database operations still in progress
+	while (!registrarDelayer.empty() || !authDelayer.empty())
+		su_root_step(root, 1);
+	double elapsed = chrono::duration_cast<chrono::microseconds>(Clock::now() - start).count();
+
+	map<string, SpanCost> spans;
+	for (const auto &trace : traces) {
+		int64_t end = 0;
+		for (const auto &span : trace.second->getSpans()) {
+			end = max(end, span.end);
+			if (span.end > span.begin)
+				spans[span.name].durations.push_back((span.end - span.begin) / 1e3);
+		}
+		costs[trace.first].latency.push_back(end / 1e3);
+	}
+
+	size_t replayed = traces.size();
+	printf("%zu messages replayed, %zu invalid, in %.1f ms with %.1f ms of processor time (%.0f messages per second)\n",
+		   replayed, invalid, elapsed / 1e3, totalCpu / 1e3, totalCpu > 0 ? replayed * 1e6 / totalCpu : 0);
+	printf("%zu messages sent and %zu replies dropped\n\n", dropped + outgoing->getSent(), incoming->getSent());
+
+	printf("%-24s %8s %12s %12s %12s %12s\n", "message", "count", "cpu p50 us", "cpu p99 us", "lat p50 us",
+		   "lat p99 us");
+	for (const auto &cost : costs) {
+		printf("%-24s %8zu %12.1f %12.1f %12.1f %12.1f\n", cost.first.c_str(), cost.second.cpu.size(),
+			   percentile(cost.second.cpu, 0.5), percentile(cost.second.cpu, 0.99),
+			   percentile(cost.second.latency, 0.5), percentile(cost.second.latency, 0.99));
+	}
+
+	printf("\n%-24s %8s %12s %12s %12s %12s\n", "module or operation", "count", "total ms", "mean us", "p50 us",
+		   "p99 us");
+	for (const auto &span : spans) {
+		const vector<double> &d = span.second.durations;
+		double total = 0;
+		for (double v : d)
+			total += v;
+		printf("%-24s %8zu %12.1f %12.1f %12.1f %12.1f\n", span.first.c_str(), d.size(), total / 1e3,
+			   total / d.size(), percentile(d, 0.5), percentile(d, 0.99));
+	}
+	return 0;
+}
@@ -0,0 +1,224 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the changes the MediaRelay makes to the SDP of a call: the ICE relay candidates added and the c lines and
+ * ports masqueraded, with the relay table of RelayedCall, on the offer of an INVITE and on the answers of its 200 OK,
+ * for audio, video and text streams offering ICE. The answers are those of one branch or of several forks, each with
+ * its own ICE contexts. The parsing of the SDPs alone is measured too, to be subtracted.
+ * Each case is repeated, each repetition running enough iterations to last about 10ms after a warm up, and reported
+ * with the median and the lowest time per call.
+ * Usage: flexisip_sdp_relay_bench [forks ...]
+ */
+
+#include "../log/logmanager.hh"
+#include "../sdp-modifier.hh"
+
+#include <sofia-sip/sip_header.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const int sRepetitions = 15;
+static const chrono::milliseconds sRepetitionDuration(10);
+
+static const char *sOffer = "v=0\r\n"
+							"o=alice 3356 1216 IN IP4 192.168.1.10\r\n"
+							"s=Talk\r\n"
+							"c=IN IP4 192.168.1.10\r\n"
+							"t=0 0\r\n"
+							"a=ice-pwd:31ec21eb38b2ec6d36e8dc7b\r\n"
+							"a=ice-ufrag:0a8e7d39\r\n"
+							"m=audio 7078 RTP/AVP 96 97 0 8 101\r\n"
+							"a=rtpmap:96 opus/48000/2\r\n"
+							"a=rtpmap:97 speex/16000\r\n"
+							"a=rtpmap:101 telephone-event/8000\r\n"
+							"a=rtcp:7079\r\n"
+							"a=candidate:1 1 UDP 2130706431 192.168.1.10 7078 typ host\r\n"
+							"a=candidate:1 2 UDP 2130706430 192.168.1.10 7079 typ host\r\n"
+							"a=candidate:2 1 UDP 1694498815 82.65.12.4 41230 typ srflx raddr 192.168.1.10 rport 7078\r\n"
+							"a=candidate:2 2 UDP 1694498814 82.65.12.4 41231 typ srflx raddr 192.168.1.10 rport 7079\r\n"
+							"m=video 9078 RTP/AVP 98 99\r\n"
+							"a=rtpmap:98 VP8/90000\r\n"
+							"a=rtpmap:99 H264/90000\r\n"
+							"a=fmtp:99 profile-level-id=42801F\r\n"
+							"a=rtcp:9079\r\n"
+							"a=candidate:1 1 UDP 2130706431 192.168.1.10 9078 typ host\r\n"
+							"a=candidate:1 2 UDP 2130706430 192.168.1.10 9079 typ host\r\n"
+							"a=candidate:2 1 UDP 1694498815 82.65.12.4 41232 typ srflx raddr 192.168.1.10 rport 9078\r\n"
+							"a=candidate:2 2 UDP 1694498814 82.65.12.4 41233 typ srflx raddr 192.168.1.10 rport 9079\r\n"
+							"m=text 11078 RTP/AVP 100\r\n"
+							"a=rtpmap:100 t140/1000\r\n"
+							"a=rtcp:11079\r\n"
+							"a=candidate:1 1 UDP 2130706431 192.168.1.10 11078 typ host\r\n"
+							"a=candidate:1 2 UDP 2130706430 192.168.1.10 11079 typ host\r\n";
+
+static const char *sAnswer = "v=0\r\n"
+							 "o=bob 1429 3587 IN IP4 10.0.0.42\r\n"
+							 "s=Talk\r\n"
+							 "c=IN IP4 10.0.0.42\r\n"
+							 "t=0 0\r\n"
+							 "a=ice-pwd:9c0d3e0d8d1f3f6a21b7cc51\r\n"
+							 "a=ice-ufrag:5c2f8e1a\r\n"
+							 "m=audio 7080 RTP/AVP 96 101\r\n"
+							 "a=rtpmap:96 opus/48000/2\r\n"
+							 "a=rtpmap:101 telephone-event/8000\r\n"
+							 "a=rtcp:7081\r\n"
+							 "a=candidate:1 1 UDP 2130706431 10.0.0.42 7080 typ host\r\n"
+							 "a=candidate:1 2 UDP 2130706430 10.0.0.42 7081 typ host\r\n"
+							 "m=video 9080 RTP/AVP 98\r\n"
+							 "a=rtpmap:98 VP8/90000\r\n"
+							 "a=rtcp:9081\r\n"
+							 "a=candidate:1 1 UDP 2130706431 10.0.0.42 9080 typ host\r\n"
+							 "a=candidate:1 2 UDP 2130706430 10.0.0.42 9081 typ host\r\n"
+							 "m=text 11080 RTP/AVP 100\r\n"
+							 "a=rtpmap:100 t140/1000\r\n"
+							 "a=rtcp:11081\r\n"
+							 "a=candidate:1 1 UDP 2130706431 10.0.0.42 11080 typ host\r\n"
+							 "a=candidate:1 2 UDP 2130706430 10.0.0.42 11081 typ host\r\n";
+
+static const int sStreams = 3;
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Runs fn() repeatedly and prints its time per iteration. */
+template <typename _Fn> static void bench(const char *name, size_t forks, _Fn fn) {
+	// the number of iterations of a repetition is calibrated during the warm up
+	size_t iterations = 1;
+	while (true) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		if (Clock::now() - start >= sRepetitionDuration)
+			break;
+		iterations *= 2;
+	}
+
+	vector<double> samples;
+	for (int r = 0; r < sRepetitions; ++r) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iterations; ++i)
+			fn();
+		auto elapsed = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+		samples.push_back((double)elapsed / iterations);
+	}
+	printf("%-24s %8zu %12.1f %12.1f\n", name, forks, median(samples), *min_element(samples.begin(), samples.end()));
+}
+
+/* The relay table RelayedCall::getRelayTable() gives for the streams, between two parties. */
+static SdpRelayTable makeRelays(int relayPort, const char *destIp, int destPort,
+								const vector<shared_ptr<SdpMasqueradeContext>> &offerer,
+								const vector<shared_ptr<SdpMasqueradeContext>> &offered) {
+	SdpRelayTable relays(sStreams);
+	for (int i = 0; i < sStreams; ++i) {
+		relays[i].relayIp = "203.0.113.5";
+		relays[i].relayPort = relayPort + 2 * i;
+		relays[i].destIp = destIp;
+		relays[i].destPort = destPort + 2000 * i;
+		relays[i].contexts = MasqueradeContextPair(offerer[i], offered[i]);
+	}
+	return relays;
+}
+
+static vector<shared_ptr<SdpMasqueradeContext>> makeContexts() {
+	vector<shared_ptr<SdpMasqueradeContext>> contexts;
+	for (int i = 0; i < sStreams; ++i)
+		contexts.push_back(make_shared<SdpMasqueradeContext>());
+	return contexts;
+}
+
+static void benchCall(size_t forks) {
+	su_home_t home;
+	su_home_init(&home);
+	sip_t offer;
+	memset(&offer, 0, sizeof(offer));
+	offer.sip_payload = sip_payload_create(&home, sOffer, strlen(sOffer));
+	sip_t answer;
+	memset(&answer, 0, sizeof(answer));
+	answer.sip_payload = sip_payload_create(&home, sAnswer, strlen(sAnswer));
+	auto noDestination = [](int, const string &, int) {};
+
+	bench("parse only", forks, [&]() {
+		su_home_t callHome;
+		su_home_init(&callHome);
+		for (size_t f = 0; f < 2 * forks; ++f) {
+			SdpModifier m(&callHome, "");
+			m.initFromSipMsg(f < forks ? &offer : &answer);
+		}
+		su_home_deinit(&callHome);
+	});
+
+	bench("offer and answers", forks, [&]() {
+		su_home_t callHome;
+		su_home_init(&callHome);
+		auto caller = makeContexts();
+		vector<vector<shared_ptr<SdpMasqueradeContext>>> callees;
+		for (size_t f = 0; f < forks; ++f) {
+			// each fork is given its copy of the INVITE, with the relay of its branch
+			SdpModifier m(&callHome, "");
+			m.initFromSipMsg(&offer);
+			m.iterateInOffer(noDestination);
+			callees.push_back(makeContexts());
+			SdpRelayTable relays = makeRelays(20000 + 10 * f, "192.168.1.10", 7078, caller, callees.back());
+			m.addIceCandidateInOffer(relays, false);
+			m.masqueradeInOffer(relays);
+		}
+		for (size_t f = 0; f < forks; ++f) {
+			SdpModifier m(&callHome, "");
+			m.initFromSipMsg(&answer);
+			m.iterateInAnswer(noDestination);
+			SdpRelayTable relays = makeRelays(30000, "10.0.0.42", 7080, caller, callees[f]);
+			m.addIceCandidateInAnswer(relays, false);
+			m.masqueradeInAnswer(relays);
+		}
+		su_home_deinit(&callHome);
+	});
+	su_home_deinit(&home);
+}
+
+int main(int argc, char *argv[]) {
+	flexisip_sUseSyslog = false;
+	flexisip::log::preinit(flexisip_sUseSyslog, false, 0, "sdp-relay-bench");
+	flexisip::log::initLogs(flexisip_sUseSyslog, "error", "error", false, false);
+
+	vector<size_t> forks;
+	for (int i = 1; i < argc; ++i) {
+		forks.push_back(strtoul(argv[i], NULL, 10));
+	}
+	if (forks.empty()) {
+		forks = {1, 3};
+	}
+	printf("%-24s %8s %12s %12s\n", "case", "forks", "ns/call", "min ns/call");
+	for (size_t f : forks)
+		benchCall(f);
+	return 0;
+}
@@ -16,6 +16,8 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "tool_utils.hh"
+#include <chrono>
+#include <cstdio>
 
 using namespace std;
 
@@ -97,11 +99,77 @@ int test_bind_without_ecc(ExtendedContactCommon &ecc, const unique_ptr<RecordSer
 	return 0;
 }
 
+/*
+ * Serializes and parses a record of 'count' contacts 'iterations' times with every available backend, and reports
+ * the time spent per contact and the size of the serialized record.
+ */
+static int bench(int count, int iterations) {
+	typedef chrono::steady_clock Clock;
+	const char *names[] = {"c", "json", "flat",
+#if ENABLE_PROTOBUF
+						   "protobuf",
+#endif
+#if ENABLE_MSGPACK
+						   "msgpack",
+#endif
+	};
+
+	Record::sMaxContacts = count;
+	time_t now = time(NULL);
+	Record initial(NULL);
+	list<string> paths{"<sip:edge1.example.org;lr>", "<sip:edge2.example.org;lr>"};
+	list<string> accept{"application/sdp", "text/plain"};
+	for (int i = 0; i < count; ++i) {
+		string line = "urn:uuid:00000000-0000-0000-0000-" + to_string(100000000000LL + i);
+		string contactId = "192.168.0." + to_string(i % 250) + ":" + to_string(5060 + i);
+		ExtendedContactCommon ecc(contactId.c_str(), paths, "callid-" + to_string(i), line.c_str());
+		string contact = "sip:user@" + contactId + ";transport=tcp;+sip.instance=" + line;
+		initial.update(ecc, contact.c_str(), now + 3600, 1, 100 + i, now, false, accept, false, NULL);
+	}
+
+	cout << "serializer  contacts  serialize ns/contact  parse ns/contact  bytes/record" << endl;
+	for (auto name : names) {
+		unique_ptr<RecordSerializer> serializer(RecordSerializer::create(name));
+		if (!serializer)
+			continue;
+		string serialized;
+		auto start = Clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			serializer->serialize(&initial, serialized);
+		}
+		double serializeNs =
+			chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count() / (double)iterations / count;
+
+		start = Clock::now();
+		for (int i = 0; i < iterations; ++i) {
+			Record final(NULL);
+			if (!serializer->parse(serialized, &final)) {
+				cerr << name << ": failed parsing" << endl;
+				return -1;
+			}
+		}
+		double parseNs =
+			chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count() / (double)iterations / count;
+
+		printf("%-10s  %8d  %20.1f  %16.1f  %12zu\n", name, count, serializeNs, parseNs, serialized.size());
+	}
+	return 0;
+}
+
 SofiaHome home;
 
 int main(int argc, char **argv) {
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		init_tests();
+		flexisip::log::updateFilter("%Severity% >= error");
+		int count = argc >= 3 ? atoi(argv[2]) : 10;
+		int iterations = argc >= 4 ? atoi(argv[3]) : 10000;
+		int ret = bench(count > 0 ? count : 1, iterations > 0 ? iterations : 1);
+		bctbx_uninit_logger();
+		return ret;
+	}
 	if (argc != 2) {
-		cerr << "bad usage" << endl;
+		cerr << "usage: " << argv[0] << " <c|json|flat|protobuf|msgpack> | bench [contacts] [iterations]" << endl;
 		exit(-1);
 	}
 	init_tests();
@@ -0,0 +1,135 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the startup of the proxy up to the loading of the modules: the construction of the global configuration,
+ * the reading of the configuration file, the construction of the agent with the declaration of the modules, and the
+ * strict reading of the file once the modules are declared. The declaration of the whole tree, as done by the dump
+ * of the default configuration, is measured on top, being what the deferred declaration of the modules saves.
+ * Each run happens in a child process, the configuration being a singleton, and the median and lowest time of each
+ * step are reported.
+ * Usage: flexisip_startup_bench [config_file [runs]]
+ */
+
+#include "../agent.hh"
+#include "../configmanager.hh"
+#include "../log/logmanager.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const char *sSteps[] = {"config root", "file read", "agent", "strict read", "full declaration"};
+static const size_t sStepCount = sizeof(sSteps) / sizeof(sSteps[0]);
+
+static double elapsedUs(Clock::time_point &start) {
+	auto now = Clock::now();
+	double us = chrono::duration_cast<chrono::nanoseconds>(now - start).count() / 1000.0;
+	start = now;
+	return us;
+}
+
+static size_t declareAll(const GenericStruct *st) {
+	size_t count = 0;
+	for (auto child : st->getChildren()) {
+		++count;
+		const GenericStruct *sub = dynamic_cast<const GenericStruct *>(child);
+		if (sub)
+			count += declareAll(sub);
+	}
+	return count;
+}
+
+/* One startup, in the calling process, writing the duration of each step to fd. */
+static void run(const string &configFile, int fd) {
+	double us[sStepCount];
+	Clock::time_point start = Clock::now();
+	GenericManager *cfg = GenericManager::get();
+	us[0] = elapsedUs(start);
+	cfg->load(configFile.c_str());
+	us[1] = elapsedUs(start);
+	su_root_t *root = su_root_create(NULL);
+	shared_ptr<Agent> agent = make_shared<Agent>(root);
+	us[2] = elapsedUs(start);
+	cfg->loadStrict();
+	us[3] = elapsedUs(start);
+	declareAll(cfg->getRoot());
+	us[4] = elapsedUs(start);
+	if (write(fd, us, sizeof(us)) != sizeof(us))
+		perror("write");
+}
+
+static double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+int main(int argc, char *argv[]) {
+	string configFile = argc > 1 ? argv[1] : "/dev/null";
+	int runs = argc > 2 ? atoi(argv[2]) : 15;
+	flexisip_sUseSyslog = false;
+	flexisip::log::preinit(flexisip_sUseSyslog, false, 0, "startup-bench");
+	flexisip::log::initLogs(flexisip_sUseSyslog, "error", "error", false, false);
+	su_init();
+
+	vector<vector<double>> samples(sStepCount);
+	for (int r = 0; r < runs; ++r) {
+		int fds[2];
+		if (pipe(fds) == -1) {
+			perror("pipe");
+			return 1;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			run(configFile, fds[1]);
+			_exit(0);
+		}
+		close(fds[1]);
+		double us[sStepCount];
+		bool ok = read(fds[0], us, sizeof(us)) == sizeof(us);
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		if (!ok) {
+			fprintf(stderr, "run %d failed\n", r);
+			continue;
+		}
+		for (size_t i = 0; i < sStepCount; ++i)
+			samples[i].push_back(us[i]);
+	}
+	if (samples[0].empty())
+		return 1;
+
+	printf("%-20s %12s %12s\n", "step", "median us", "min us");
+	for (size_t i = 0; i < sStepCount; ++i) {
+		printf("%-20s %12.1f %12.1f\n", sSteps[i], median(samples[i]),
+			   *min_element(samples[i].begin(), samples[i].end()));
+	}
+	return 0;
+}
@@ -64,7 +64,7 @@ bool compare(const ExtendedContact &ec1, bool alias, const ExtendedContactCommon
 	check("callid", ec1.mCallId, common.mCallId);
 	check("contactid", ec1.mContactId, common.mContactId);
 	check("line", ec1.mUniqueId, common.mUniqueId);
-	check("path", ec1.mPath, common.mPath);
+	check<std::list<std::string>>("path", ec1.mPath, common.mPath);
 	check("cseq", ec1.mCSeq, cseq);
 	check("mExpireAt", ec1.mExpireAt, expireat);
 	check("mQ", ec1.mQ, q);
@@ -0,0 +1,169 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tracing.hh"
+#include "log/logmanager.hh"
+
+#include <cstdio>
+#include <random>
+
+using namespace std;
+
+thread_local const shared_ptr<Trace> *Trace::sCurrent = NULL;
+
+Trace::Trace(const string &name)
+	: mId(0), mName(name), mStart(chrono::steady_clock::now()),
+	  mStartUnixNano(
+		  chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()) {
+}
+
+void Trace::addSpan(const string &name, chrono::steady_clock::time_point start) {
+	mSpans.push_back({name, elapsed(start), elapsed(chrono::steady_clock::now())});
+}
+
+void Trace::addEvent(const string &name) {
+	int64_t now = elapsed(chrono::steady_clock::now());
+	mSpans.push_back({name, now, now});
+}
+
+Tracer *Tracer::get() {
+	// never deleted, the traces may end during the exit
+	static Tracer *sInstance = new Tracer();
+	return sInstance;
+}
+
+Tracer::Tracer() : mSampleRate(0), mCounter(0), mRunning(false) {
+	random_device rd;
+	mIdSeed = (uint64_t(rd()) << 32) ^ rd();
+}
+
+void Tracer::start(unsigned int sampleRate, const string &path) {
+	stop();
+	if (sampleRate == 0)
+		return;
+	mOutput.open(path, ios::out | ios::app);
+	if (!mOutput.is_open()) {
+		LOGE("Cannot open trace file %s, tracing disabled", path.c_str());
+		return;
+	}
+	LOGI("Tracing one transaction out of %u in %s", sampleRate, path.c_str());
+	mRunning = true;
+	mThread = thread(&Tracer::run, this);
+	mSampleRate = sampleRate;
+}
+
+void Tracer::stop() {
+	mSampleRate = 0;
+	if (!mRunning)
+		return;
+	{
+		unique_lock<mutex> lock(mMutex);
+		mRunning = false;
+		mCond.notify_one();
+	}
+	mThread.join();
+	mOutput.close();
+}
+
+shared_ptr<Trace> Tracer::newTrace(const string &name) {
+	Trace *trace = new Trace(name);
+	trace->mId = mCounter;
+	return shared_ptr<Trace>(trace, [this](Trace *t) { finish(t); });
+}
+
+void Tracer::finish(Trace *trace) {
+	unique_ptr<Trace> finished(trace);
+	unique_lock<mutex> lock(mMutex);
+	if (!mRunning)
+		return; // tracing was stopped meanwhile
+	mFinished.push_back(move(finished));
+	mCond.notify_one();
+}
+
+void Tracer::run() {
+	unique_lock<mutex> lock(mMutex);
+	while (true) {
+		if (mFinished.empty()) {
+			if (!mRunning)
+				break;
+			mCond.wait(lock);
+			continue;
+		}
+		deque<unique_ptr<Trace>> finished;
+		finished.swap(mFinished);
+		lock.unlock();
+		for (auto &trace : finished)
+			write(*trace);
+		mOutput.flush();
+		lock.lock();
+	}
+}
+
+static string jsonEscape(const string &s) {
+	string escaped;
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			escaped += buf;
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+static string hexId(uint64_t id) {
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)id);
+	return buf;
+}
+
+void Tracer::write(const Trace &trace) {
+	string traceId = hexId(mIdSeed) + hexId(trace.mId);
+	// span ids only need to be unique within the trace
+	string rootSpanId = hexId((trace.mId << 16) | 1);
+	int64_t end = 0;
+	for (const auto &span : trace.mSpans)
+		end = max(end, span.end);
+
+	string spans;
+	string events;
+	uint64_t index = 2;
+	for (const auto &span : trace.mSpans) {
+		string begin = to_string(trace.mStartUnixNano + span.begin);
+		if (span.begin == span.end) {
+			events += string(events.empty() ? "" : ",") + "{\"timeUnixNano\":\"" + begin + "\",\"name\":\"" +
+					  jsonEscape(span.name) + "\"}";
+			continue;
+		}
+		spans += ",{\"traceId\":\"" + traceId + "\",\"spanId\":\"" + hexId((trace.mId << 16) | index++) +
+				 "\",\"parentSpanId\":\"" + rootSpanId + "\",\"name\":\"" + jsonEscape(span.name) +
+				 "\",\"kind\":1,\"startTimeUnixNano\":\"" + begin + "\",\"endTimeUnixNano\":\"" +
+				 to_string(trace.mStartUnixNano + span.end) + "\"}";
+	}
+	mOutput << "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\",\"value\":{"
+			   "\"stringValue\":\"flexisip\"}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"flexisip\"},\"spans\":["
+			<< "{\"traceId\":\"" << traceId << "\",\"spanId\":\"" << rootSpanId << "\",\"name\":\""
+			<< jsonEscape(trace.mName) << "\",\"kind\":2,\"startTimeUnixNano\":\"" << trace.mStartUnixNano
+			<< "\",\"endTimeUnixNano\":\"" << trace.mStartUnixNano + end << "\",\"events\":[" << events << "]}"
+			<< spans << "]}]}]}\n";
+}
@@ -0,0 +1,125 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef tracing_hh
+#define tracing_hh
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Timeline of a sampled transaction: the spans of the modules, of the registrar database operations and the
+ * instants of its key events, relative to its reception.
+ * Shared by the messages and transactions of the transaction, and written by the Tracer once the last of them is
+ * gone. Only updated from the main loop.
+ */
+class Trace {
+  public:
+	Trace(const std::string &name);
+
+	void addSpan(const std::string &name, std::chrono::steady_clock::time_point start);
+	void addEvent(const std::string &name);
+
+	/* Trace of the message processed by the current module, so that the asynchronous operations it starts can add
+	 * their spans to it; empty when the message is not sampled. */
+	static std::shared_ptr<Trace> current() {
+		return sCurrent ? *sCurrent : std::shared_ptr<Trace>();
+	}
+	/* Sets the current trace for the lifetime of the scope. */
+	class Scope {
+	  public:
+		Scope(const std::shared_ptr<Trace> &trace) : mPrevious(sCurrent) {
+			sCurrent = &trace;
+		}
+		~Scope() {
+			sCurrent = mPrevious;
+		}
+
+	  private:
+		const std::shared_ptr<Trace> *mPrevious;
+	};
+
+	struct Span {
+		std::string name;
+		int64_t begin; // nanoseconds since the reception
+		int64_t end;   // equals begin for events
+	};
+	const std::vector<Span> &getSpans() const {
+		return mSpans;
+	}
+
+  private:
+	friend class Tracer;
+	int64_t elapsed(std::chrono::steady_clock::time_point time) const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time - mStart).count();
+	}
+
+	uint64_t mId;
+	std::string mName;
+	std::chrono::steady_clock::time_point mStart;
+	uint64_t mStartUnixNano;
+	std::vector<Span> mSpans;
+	static thread_local const std::shared_ptr<Trace> *sCurrent;
+};
+
+/*
+ * Samples one transaction out of sample-rate, and appends the finished traces to a file from a background thread,
+ * one OTLP/JSON ExportTraceServiceRequest per line, as read by the OpenTelemetry collector otlpjsonfile receiver.
+ * Costs a counter increment per transaction when sampling is off.
+ */
+class Tracer {
+  public:
+	static Tracer *get();
+
+	void start(unsigned int sampleRate, const std::string &path);
+	/* Writes the pending traces and stops sampling. */
+	void stop();
+	/* Trace of a new transaction, empty when it is not sampled. */
+	std::shared_ptr<Trace> sample(const std::string &name) {
+		if (mSampleRate == 0 || ++mCounter % mSampleRate != 0)
+			return std::shared_ptr<Trace>();
+		return newTrace(name);
+	}
+
+  private:
+	Tracer();
+	std::shared_ptr<Trace> newTrace(const std::string &name);
+	void finish(Trace *trace);
+	void run();
+	void write(const Trace &trace);
+
+	unsigned int mSampleRate;
+	unsigned int mCounter;
+	uint64_t mIdSeed;
+	std::ofstream mOutput;
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::deque<std::unique_ptr<Trace>> mFinished;
+	std::thread mThread;
+	bool mRunning;
+};
+
+#endif
@@ -20,6 +20,8 @@
 #include "event.hh"
 #include "common.hh"
 #include "agent.hh"
+#include "utils/objectpool.hh"
+#include "tracing.hh"
 #include <algorithm>
 #include <sofia-sip/su_tagarg.h>
 #include <sofia-sip/su_random.h>
@@ -27,6 +29,8 @@
 
 using namespace std;
 
+std::atomic<int> Transaction::sPropertyTypeCount(0);
+
 IncomingAgent::~IncomingAgent() {
 }
 OutgoingAgent::~OutgoingAgent() {
@@ -49,7 +53,7 @@ OutgoingTransaction::OutgoingTransaction(Agent *agent)
 }
 
 shared_ptr<OutgoingTransaction> OutgoingTransaction::create(Agent *agent) {
-	return make_shared<OutgoingTransaction>(agent);
+	return allocate_shared<OutgoingTransaction>(PoolAllocator<OutgoingTransaction>(), agent);
 }
 
 OutgoingTransaction::~OutgoingTransaction() {
@@ -104,7 +108,7 @@ shared_ptr<MsgSip> OutgoingTransaction::getRequestMsg() {
 		return NULL;
 	}
 	msg_t *msg = nta_outgoing_getrequest(mOutgoing);
-	auto request = make_shared<MsgSip>(msg);
+	auto request = allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
 	msg_destroy(msg);
 	return request;
 }
@@ -116,6 +120,9 @@ void OutgoingTransaction::send(const shared_ptr<MsgSip> &ms, url_string_t const
 	LOGD("Message is sent through an outgoing transaction.");
 
 	if (!mOutgoing) {
+		if (mAgent->mOutgoingMessageFilter && !mAgent->mOutgoingMessageFilter(ms))
+			return;
+		mTrace = ms->getTrace();
 		msg_t *msg = msg_ref_create(ms->getMsg());
 		ta_start(ta, tag, value);
 		mOutgoing = nta_outgoing_mcreate(mAgent->mAgent, OutgoingTransaction::_callback, (nta_outgoing_magic_t *)this,
@@ -145,8 +152,13 @@ int OutgoingTransaction::_callback(nta_outgoing_magic_t *magic, nta_outgoing_t *
 	if (sip != NULL) {
 		msg_t *msg = nta_outgoing_getresponse(otr->mOutgoing);
 		auto oagent = dynamic_pointer_cast<OutgoingAgent>(otr->shared_from_this());
-		auto msgsip = make_shared<MsgSip>(msg);
-		shared_ptr<ResponseSipEvent> sipevent = make_shared<ResponseSipEvent>(oagent, msgsip);
+		auto msgsip = allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
+		if (otr->mTrace) {
+			msgsip->setTrace(otr->mTrace);
+			otr->mTrace->addEvent("response received " + to_string(sip->sip_status ? sip->sip_status->st_status : 0));
+		}
+		shared_ptr<ResponseSipEvent> sipevent =
+			allocate_shared<ResponseSipEvent>(PoolAllocator<ResponseSipEvent>(), oagent, msgsip);
 		msg_destroy(msg);
 
 		otr->mAgent->sendResponseEvent(sipevent);
@@ -166,6 +178,7 @@ void OutgoingTransaction::destroy() {
 		mOutgoing = NULL;
 		looseProperties();
 		mIncoming.reset();
+		mTrace.reset();
 		mSofiaRef.reset(); // This must be the last instruction of this function because it may destroy this
 						   // OutgoingTransaction.
 	}
@@ -176,7 +189,7 @@ IncomingTransaction::IncomingTransaction(Agent *agent) : Transaction(agent), mIn
 }
 
 shared_ptr<IncomingTransaction> IncomingTransaction::create(Agent *agent) {
-	return make_shared<IncomingTransaction>(agent);
+	return allocate_shared<IncomingTransaction>(PoolAllocator<IncomingTransaction>(), agent);
 }
 
 void IncomingTransaction::handle(const shared_ptr<MsgSip> &ms) {
@@ -202,7 +215,7 @@ shared_ptr<MsgSip> IncomingTransaction::createResponse(int status, char const *p
 			LOGE("IncomingTransaction::createResponse(): this=%p cannot create response.", this);
 			return shared_ptr<MsgSip>();
 		}
-		shared_ptr<MsgSip> ms = make_shared<MsgSip>(msg);
+		shared_ptr<MsgSip> ms = allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
 		msg_destroy(msg);
 		return ms;
 	}
@@ -246,7 +259,8 @@ int IncomingTransaction::_callback(nta_incoming_magic_t *magic, nta_incoming_t *
 	LOGD("IncomingTransaction callback %p", it);
 	if (sip != NULL) {
 		msg_t *msg = nta_incoming_getrequest_ackcancel(it->mIncoming);
-		auto ev = make_shared<RequestSipEvent>(it->shared_from_this(), make_shared<MsgSip>(msg));
+		auto ev = allocate_shared<RequestSipEvent>(PoolAllocator<RequestSipEvent>(), it->shared_from_this(),
+												   allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg));
 		msg_destroy(msg);
 		it->mAgent->sendRequestEvent(ev);
 		if (sip->sip_request && sip->sip_request->rq_method == sip_method_cancel) {
@@ -262,7 +276,7 @@ shared_ptr< MsgSip > IncomingTransaction::getLastResponse() {
 	shared_ptr< MsgSip > msgsip;
 	msg_t *msg = nta_incoming_getresponse(mIncoming); //warning: nta_incoming_getresponse() creates a new ref to the msg_t.
 	if (msg){
-		msgsip = make_shared<MsgSip>(msg);
+		msgsip = allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
 		msg_unref(msg); //MsgSip constructor takes a ref.
 	}
 	return msgsip;
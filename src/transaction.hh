@@ -25,6 +25,9 @@
 #include <sofia-sip/nta.h>
 #include <string>
 #include <map>
+#include <atomic>
+#include <memory>
+#include <tuple>
 
 class OutgoingTransaction;
 class IncomingTransaction;
@@ -56,11 +59,30 @@ class OutgoingAgent {
 class Transaction {
   protected:
 	Agent *mAgent;
-	typedef std::tuple<std::shared_ptr<void>, std::string> property_type;
+	struct Property {
+		std::string name;
+		std::shared_ptr<void> value;
+	};
+	/* The properties of the types registered first, that is those used by the modules, are stored in the slot of
+	 * their type, so that looking them up costs an indexed load and the comparison of their name. A property of the
+	 * type of another one already set, or of a type registered later, goes to the map. */
+	static const int sPropertySlots = 8;
+	Property mPropertySlots[sPropertySlots];
+	typedef std::tuple<std::shared_ptr<void>, int> property_type;
 	std::map<std::string, property_type> mProperties;
 	void looseProperties() {
+		for (auto &slot : mPropertySlots) {
+			slot.value.reset();
+			slot.name.clear();
+		}
 		mProperties.clear();
 	}
+	/* Small integer identifying T, given to each type on its first use as a property. */
+	template <typename T> static int propertyTypeId() {
+		static const int id = sPropertyTypeCount++;
+		return id;
+	}
+	static std::atomic<int> sPropertyTypeCount;
 
   public:
 	Transaction(Agent *agent) : mAgent(agent) {
@@ -73,30 +95,59 @@ class Transaction {
 		return mAgent;
 	}
 
+	/* Does not replace a property already set with the same name. */
 	template <typename T> void setProperty(const std::string &name, std::shared_ptr<T> value) {
-		std::string type_name = typeid(T).name();
-		property_type prop = make_tuple(std::static_pointer_cast<void>(value), type_name);
-		mProperties.insert(std::pair<std::string, property_type>(name, prop));
+		int id = propertyTypeId<T>();
+		if (id < sPropertySlots) {
+			Property &slot = mPropertySlots[id];
+			if (slot.value && slot.name == name)
+				return;
+			if (!slot.value && findSlot(name) == NULL && mProperties.find(name) == mProperties.end()) {
+				slot.name = name;
+				slot.value = std::static_pointer_cast<void>(value);
+				return;
+			}
+		}
+		if (findSlot(name) == NULL)
+			mProperties.insert(std::make_pair(name, property_type(std::static_pointer_cast<void>(value), id)));
 	}
 
 	template <typename T> std::shared_ptr<T> getProperty(const std::string &name) {
-		auto it = mProperties.find(name);
-		if (it != mProperties.end()) {
-			property_type &prop = it->second;
-			if (std::get<1>(prop) == typeid(T).name()) {
-				std::shared_ptr<T> tran = std::static_pointer_cast<T>(std::get<0>(prop));
-				return tran;
-			}
+		int id = propertyTypeId<T>();
+		if (id < sPropertySlots) {
+			Property &slot = mPropertySlots[id];
+			if (slot.value && slot.name == name)
+				return std::static_pointer_cast<T>(slot.value);
+		}
+		if (!mProperties.empty()) {
+			auto it = mProperties.find(name);
+			if (it != mProperties.end() && std::get<1>(it->second) == id)
+				return std::static_pointer_cast<T>(std::get<0>(it->second));
 		}
 		return std::shared_ptr<T>();
 	}
 
 	void removeProperty(const std::string &name) {
+		Property *slot = findSlot(name);
+		if (slot) {
+			slot->value.reset();
+			slot->name.clear();
+			return;
+		}
 		auto it = mProperties.find(name);
 		if (it != mProperties.end()) {
 			mProperties.erase(it);
 		}
 	}
+
+  private:
+	Property *findSlot(const std::string &name) {
+		for (auto &slot : mPropertySlots) {
+			if (slot.value && slot.name == name)
+				return &slot;
+		}
+		return NULL;
+	}
 };
 
 class OutgoingTransaction : public Transaction,
@@ -125,6 +176,7 @@ class OutgoingTransaction : public Transaction,
 	static std::shared_ptr<OutgoingTransaction> create(Agent *agent);
 	std::shared_ptr<OutgoingTransaction> mSofiaRef;
 	nta_outgoing_t *mOutgoing;
+	std::shared_ptr<Trace> mTrace; // of the request, given to its responses
 	std::string mBranchId;
 	SofiaAutoHome mHome;
 	virtual void send(const std::shared_ptr<MsgSip> &msg, url_string_t const *u, tag_type_t tag, tag_value_t value,
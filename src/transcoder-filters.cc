@@ -0,0 +1,321 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transcoder-filters.hh"
+#include "common.hh"
+#include "log/logmanager.hh"
+#include "utils/audiokernels.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <mediastreamer2/msqueue.h>
+
+using namespace std;
+
+namespace {
+
+const int sG711Rate = 8000;
+
+struct G711Encoder {
+	bool ulaw;
+	int ptime;
+	uint32_t ts;
+	MSBufferizer *bufferizer;
+	vector<int16_t> frame;
+};
+
+struct G711Decoder {
+	bool ulaw;
+};
+
+struct Resampler {
+	int inputRate;
+	int outputRate;
+	vector<unique_ptr<HalfbandResampler>> stages;
+	vector<int16_t> buffers[2];
+};
+
+void encInit(MSFilter *f, bool ulaw) {
+	G711Encoder *s = new G711Encoder();
+	s->ulaw = ulaw;
+	s->ptime = 20;
+	s->ts = 0;
+	s->bufferizer = ms_bufferizer_new();
+	f->data = s;
+}
+
+void ulawEncInit(MSFilter *f) {
+	encInit(f, true);
+}
+
+void alawEncInit(MSFilter *f) {
+	encInit(f, false);
+}
+
+void encUninit(MSFilter *f) {
+	G711Encoder *s = static_cast<G711Encoder *>(f->data);
+	ms_bufferizer_destroy(s->bufferizer);
+	delete s;
+}
+
+void encProcess(MSFilter *f) {
+	G711Encoder *s = static_cast<G711Encoder *>(f->data);
+	size_t samples = sG711Rate * s->ptime / 1000;
+	s->frame.resize(samples);
+	ms_bufferizer_put_from_queue(s->bufferizer, f->inputs[0]);
+	while (ms_bufferizer_get_avail(s->bufferizer) >= samples * 2) {
+		ms_bufferizer_read(s->bufferizer, (uint8_t *)s->frame.data(), samples * 2);
+		mblk_t *om = allocb(samples, 0);
+		if (s->ulaw)
+			AudioKernels::ulawEncode(s->frame.data(), om->b_wptr, samples);
+		else
+			AudioKernels::alawEncode(s->frame.data(), om->b_wptr, samples);
+		om->b_wptr += samples;
+		mblk_set_timestamp_info(om, s->ts);
+		s->ts += samples;
+		ms_queue_put(f->outputs[0], om);
+	}
+}
+
+int encSetPtime(MSFilter *f, void *arg) {
+	G711Encoder *s = static_cast<G711Encoder *>(f->data);
+	int ptime = *(int *)arg;
+	if (ptime < 10 || ptime > 140 || ptime % 10 != 0)
+		return -1;
+	s->ptime = ptime;
+	return 0;
+}
+
+int encGetPtime(MSFilter *f, void *arg) {
+	*(int *)arg = static_cast<G711Encoder *>(f->data)->ptime;
+	return 0;
+}
+
+int encAddFmtp(MSFilter *f, void *arg) {
+	char value[16];
+	if (fmtp_get_value((const char *)arg, "ptime", value, sizeof(value))) {
+		int ptime = atoi(value);
+		return encSetPtime(f, &ptime);
+	}
+	return 0;
+}
+
+int setSampleRate(MSFilter *f, void *arg) {
+	return *(int *)arg == sG711Rate ? 0 : -1;
+}
+
+int getSampleRate(MSFilter *f, void *arg) {
+	*(int *)arg = sG711Rate;
+	return 0;
+}
+
+int setBitrate(MSFilter *f, void *arg) {
+	// fixed at 64 kbit/s
+	return 0;
+}
+
+int getBitrate(MSFilter *f, void *arg) {
+	*(int *)arg = 64000;
+	return 0;
+}
+
+void decInit(MSFilter *f, bool ulaw) {
+	G711Decoder *s = new G711Decoder();
+	s->ulaw = ulaw;
+	f->data = s;
+}
+
+void ulawDecInit(MSFilter *f) {
+	decInit(f, true);
+}
+
+void alawDecInit(MSFilter *f) {
+	decInit(f, false);
+}
+
+void decUninit(MSFilter *f) {
+	delete static_cast<G711Decoder *>(f->data);
+}
+
+void decProcess(MSFilter *f) {
+	G711Decoder *s = static_cast<G711Decoder *>(f->data);
+	mblk_t *im;
+	while ((im = ms_queue_get(f->inputs[0])) != NULL) {
+		size_t samples = im->b_wptr - im->b_rptr;
+		mblk_t *om = allocb(samples * 2, 0);
+		mblk_meta_copy(im, om);
+		if (s->ulaw)
+			AudioKernels::ulawDecode(im->b_rptr, (int16_t *)om->b_wptr, samples);
+		else
+			AudioKernels::alawDecode(im->b_rptr, (int16_t *)om->b_wptr, samples);
+		om->b_wptr += samples * 2;
+		ms_queue_put(f->outputs[0], om);
+		freemsg(im);
+	}
+}
+
+int decAddFmtp(MSFilter *f, void *arg) {
+	// "plc=0" among others: these decoders never conceal losses
+	return 0;
+}
+
+int decHavePlc(MSFilter *f, void *arg) {
+	*(int *)arg = 0;
+	return 0;
+}
+
+/* The halvings or doublings giving outputRate from inputRate, none when there are no such. */
+int halfbandStages(int inputRate, int outputRate, bool &up) {
+	up = outputRate > inputRate;
+	int low = up ? inputRate : outputRate;
+	int high = up ? outputRate : inputRate;
+	if (low <= 0)
+		return 0;
+	if (high == 2 * low)
+		return 1;
+	if (high == 4 * low)
+		return 2;
+	return 0;
+}
+
+void resamplerInit(MSFilter *f) {
+	Resampler *s = new Resampler();
+	s->inputRate = s->outputRate = sG711Rate;
+	f->data = s;
+}
+
+void resamplerUninit(MSFilter *f) {
+	delete static_cast<Resampler *>(f->data);
+}
+
+void resamplerPreprocess(MSFilter *f) {
+	Resampler *s = static_cast<Resampler *>(f->data);
+	bool up;
+	int count = halfbandStages(s->inputRate, s->outputRate, up);
+	s->stages.clear();
+	for (int i = 0; i < count; ++i)
+		s->stages.emplace_back(new HalfbandResampler(up));
+	if (count == 0 && s->inputRate != s->outputRate)
+		LOGE("Half-band resampler cannot convert from %i Hz to %i Hz", s->inputRate, s->outputRate);
+}
+
+void resamplerProcess(MSFilter *f) {
+	Resampler *s = static_cast<Resampler *>(f->data);
+	mblk_t *im;
+	while ((im = ms_queue_get(f->inputs[0])) != NULL) {
+		if (s->stages.empty()) {
+			ms_queue_put(f->outputs[0], im);
+			continue;
+		}
+		const int16_t *in = (const int16_t *)im->b_rptr;
+		size_t count = (im->b_wptr - im->b_rptr) / 2;
+		for (size_t i = 0; i < s->stages.size(); ++i) {
+			vector<int16_t> &out = s->buffers[i % 2];
+			out.resize(s->stages[i]->maxOutput(count));
+			count = s->stages[i]->process(in, count, out.data());
+			in = out.data();
+		}
+		mblk_t *om = allocb(count * 2, 0);
+		mblk_meta_copy(im, om);
+		memcpy(om->b_wptr, in, count * 2);
+		om->b_wptr += count * 2;
+		ms_queue_put(f->outputs[0], om);
+		freemsg(im);
+	}
+}
+
+int resamplerSetInputRate(MSFilter *f, void *arg) {
+	static_cast<Resampler *>(f->data)->inputRate = *(int *)arg;
+	return 0;
+}
+
+int resamplerSetOutputRate(MSFilter *f, void *arg) {
+	static_cast<Resampler *>(f->data)->outputRate = *(int *)arg;
+	return 0;
+}
+
+MSFilterMethod sEncoderMethods[] = {{MS_FILTER_SET_SAMPLE_RATE, setSampleRate},
+									{MS_FILTER_GET_SAMPLE_RATE, getSampleRate},
+									{MS_FILTER_ADD_FMTP, encAddFmtp},
+									{MS_FILTER_SET_BITRATE, setBitrate},
+									{MS_FILTER_GET_BITRATE, getBitrate},
+									{MS_AUDIO_ENCODER_SET_PTIME, encSetPtime},
+									{MS_AUDIO_ENCODER_GET_PTIME, encGetPtime},
+									{0, NULL}};
+
+MSFilterMethod sDecoderMethods[] = {{MS_FILTER_SET_SAMPLE_RATE, setSampleRate},
+									{MS_FILTER_GET_SAMPLE_RATE, getSampleRate},
+									{MS_FILTER_ADD_FMTP, decAddFmtp},
+									{MS_DECODER_HAVE_PLC, decHavePlc},
+									{0, NULL}};
+
+MSFilterMethod sResamplerMethods[] = {{MS_FILTER_SET_SAMPLE_RATE, resamplerSetInputRate},
+									  {MS_FILTER_SET_OUTPUT_SAMPLE_RATE, resamplerSetOutputRate},
+									  {0, NULL}};
+
+MSFilterDesc sUlawEncoder = {MS_FILTER_PLUGIN_ID, "FlexisipUlawEnc", "Vectorized G.711 u-law encoder",
+							 MS_FILTER_ENCODER, "pcmu", 1, 1, ulawEncInit, NULL, encProcess, NULL, encUninit,
+							 sEncoderMethods, 0};
+
+MSFilterDesc sUlawDecoder = {MS_FILTER_PLUGIN_ID, "FlexisipUlawDec", "Vectorized G.711 u-law decoder",
+							 MS_FILTER_DECODER, "pcmu", 1, 1, ulawDecInit, NULL, decProcess, NULL, decUninit,
+							 sDecoderMethods, 0};
+
+MSFilterDesc sAlawEncoder = {MS_FILTER_PLUGIN_ID, "FlexisipAlawEnc", "Vectorized G.711 A-law encoder",
+							 MS_FILTER_ENCODER, "pcma", 1, 1, alawEncInit, NULL, encProcess, NULL, encUninit,
+							 sEncoderMethods, 0};
+
+MSFilterDesc sAlawDecoder = {MS_FILTER_PLUGIN_ID, "FlexisipAlawDec", "Vectorized G.711 A-law decoder",
+							 MS_FILTER_DECODER, "pcma", 1, 1, alawDecInit, NULL, decProcess, NULL, decUninit,
+							 sDecoderMethods, 0};
+
+MSFilterDesc sHalfbandResampler = {MS_FILTER_PLUGIN_ID, "FlexisipHalfbandResampler",
+								   "Vectorized resampler for ratios of 2 and 4", MS_FILTER_OTHER, NULL, 1, 1,
+								   resamplerInit, resamplerPreprocess, resamplerProcess, NULL, resamplerUninit,
+								   sResamplerMethods, 0};
+
+} // namespace
+
+void TranscoderFilters::registerIn(MSFactory *factory) {
+	const char *replaced[] = {"MSUlawEnc", "MSUlawDec", "MSAlawEnc", "MSAlawDec"};
+	for (const char *name : replaced)
+		ms_factory_enable_filter_from_name(factory, name, FALSE);
+	ms_factory_register_filter(factory, &sUlawEncoder);
+	ms_factory_register_filter(factory, &sUlawDecoder);
+	ms_factory_register_filter(factory, &sAlawEncoder);
+	ms_factory_register_filter(factory, &sAlawDecoder);
+	ms_factory_register_filter(factory, &sHalfbandResampler);
+	LOGI("Transcoder G.711 and resampling kernels use %s", AudioKernels::getIsaName(AudioKernels::getIsa()));
+}
+
+MSFilter *TranscoderFilters::createResampler(MSFactory *factory, int inputRate, int outputRate) {
+	bool up;
+	MSFilter *f;
+	if (halfbandStages(inputRate, outputRate, up) > 0)
+		f = ms_factory_create_filter_from_desc(factory, &sHalfbandResampler);
+	else
+		f = ms_factory_create_filter(factory, MS_RESAMPLE_ID);
+	if (f == NULL)
+		return NULL;
+	ms_filter_call_method(f, MS_FILTER_SET_SAMPLE_RATE, &inputRate);
+	ms_filter_call_method(f, MS_FILTER_SET_OUTPUT_SAMPLE_RATE, &outputRate);
+	return f;
+}
@@ -0,0 +1,39 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef transcoder_filters_hh
+#define transcoder_filters_hh
+
+#include <mediastreamer2/msfactory.h>
+#include <mediastreamer2/msfilter.h>
+
+/*
+ * Mediastreamer2 filters of the transcoder built on the vectorized kernels of utils/audiokernels.hh: PCMU and PCMA
+ * encoders and decoders, replacing those of mediastreamer2, and a resampler for the ratios of 2 and 4 between the
+ * rates of the codecs of both sides.
+ */
+class TranscoderFilters {
+  public:
+	/* Registers the filters in the factory, before the codecs of mediastreamer2 they replace. */
+	static void registerIn(MSFactory *factory);
+	/* A filter converting from inputRate to outputRate: the half-band resampler when it can, that of mediastreamer2
+	 * otherwise. */
+	static MSFilter *createResampler(MSFactory *factory, int inputRate, int outputRate);
+};
+
+#endif
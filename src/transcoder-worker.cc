@@ -0,0 +1,792 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "transcoder-worker.hh"
+#include "transcoder-filters.hh"
+#include "common.hh"
+#include "log/logmanager.hh"
+#include "utils/objectpool.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <random>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Datagram format: the magic, then a single message, integers in network order.
+ * From the proxy to the worker:
+ *   'H'                                                         request of a report
+ *   'O' seq(4) id(8) frontPort(2) backPort(2) addr(str) port(2) ptime(2) rc(1)     offer from addr:port
+ *   'A' seq(4) id(8) addr(str) port(2) ptime(2) rc(1) front(pts) back(pts)         answer from addr:port
+ *   'T' seq(4) id(8) dtmf(1)                                    tone to play towards the callee
+ *   'E' seq(4) id(8)                                            end of the call
+ * From the worker to the proxy:
+ *   'K' seq(4)                                                  acknowledgement of a command
+ *   'L' load(4) calls(4) minPort(2) maxPort(2) addr(str)        report, the load in per mille
+ *   'G' id(8)                                                   call no longer processed
+ * with str a length(2) followed by the characters, and pts a count(1) followed for each payload type by
+ * number(1) rate(4) channels(1) bits(1) bitrate(4) mime(str) recvFmtp(str) sendFmtp(str).
+ */
+static const char sMagic[4] = {'F', 'T', 'W', '1'};
+static const size_t sMaxDatagram = 1400;
+/* Milliseconds between two sendings of an unacknowledged command. */
+static const int sRetransmitPeriod = 200;
+static const int sMaxTries = 10;
+/* Timer ticks between two requests of reports. */
+static const int sPollTicks = 5;
+/* load percentages used for calls whose cost is not measured yet, as by the tickers */
+static const float sDefaultCallCost = 2.0f;
+static const float sMinCallCost = 0.5f;
+/* Milliseconds between two background tasks of the calls of a worker, and their number between two reports. */
+static const int sWorkerTimerPeriod = 20;
+static const int sWorkerReportTicks = 50;
+/* Seconds without RTP after which a worker drops a call. */
+static const int sInactivityPeriod = 180;
+
+static void writeInt(string &out, uint64_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; --i)
+		out.push_back((char)((value >> (8 * i)) & 0xff));
+}
+
+static void writeString(string &out, const char *value) {
+	size_t length = value ? min(strlen(value), (size_t)65535) : 0;
+	writeInt(out, length, 2);
+	if (length > 0)
+		out.append(value, length);
+}
+
+static void writePayloads(string &out, const list<PayloadType *> &payloads) {
+	size_t count = min(payloads.size(), (size_t)255);
+	writeInt(out, count, 1);
+	for (PayloadType *pt : payloads) {
+		if (count-- == 0)
+			break;
+		writeInt(out, (uint8_t)payload_type_get_number(pt), 1);
+		writeInt(out, (uint32_t)pt->clock_rate, 4);
+		writeInt(out, (uint8_t)pt->channels, 1);
+		writeInt(out, (uint8_t)pt->bits_per_sample, 1);
+		writeInt(out, (uint32_t)pt->normal_bitrate, 4);
+		writeString(out, pt->mime_type);
+		writeString(out, pt->recv_fmtp);
+		writeString(out, pt->send_fmtp);
+	}
+}
+
+namespace {
+
+/* Reads the fields of a datagram, becoming invalid at the first one that does not fit. */
+class DatagramReader {
+  public:
+	DatagramReader(const uint8_t *data, size_t size) : mData(data), mSize(size), mValid(true) {
+	}
+	bool valid() const {
+		return mValid;
+	}
+	uint64_t readInt(int bytes) {
+		uint64_t value = 0;
+		if (!check(bytes))
+			return 0;
+		for (int i = 0; i < bytes; ++i)
+			value = (value << 8) | mData[i];
+		skip(bytes);
+		return value;
+	}
+	string readString() {
+		size_t length = readInt(2);
+		if (!check(length))
+			return string();
+		string value((const char *)mData, length);
+		skip(length);
+		return value;
+	}
+	/* The payload types are allocated, to be given to a CallSide or destroyed. */
+	list<PayloadType *> readPayloads() {
+		list<PayloadType *> payloads;
+		int count = (int)readInt(1);
+		for (int i = 0; i < count && mValid; ++i) {
+			int number = (int)readInt(1);
+			int rate = (int)readInt(4);
+			int channels = (int)readInt(1);
+			int bits = (int)readInt(1);
+			int bitrate = (int)readInt(4);
+			string mime = readString();
+			string recvFmtp = readString();
+			string sendFmtp = readString();
+			if (!mValid)
+				break;
+			PayloadType *pt = payload_type_new();
+			pt->type = PAYLOAD_AUDIO_PACKETIZED;
+			pt->mime_type = ortp_strdup(mime.c_str());
+			pt->clock_rate = rate;
+			pt->channels = channels;
+			pt->bits_per_sample = bits;
+			pt->normal_bitrate = bitrate;
+			if (!recvFmtp.empty())
+				payload_type_set_recv_fmtp(pt, recvFmtp.c_str());
+			if (!sendFmtp.empty())
+				payload_type_set_send_fmtp(pt, sendFmtp.c_str());
+			payload_type_set_number(pt, number);
+			payloads.push_back(pt);
+		}
+		if (!mValid) {
+			for (PayloadType *pt : payloads)
+				payload_type_destroy(pt);
+			payloads.clear();
+		}
+		return payloads;
+	}
+
+  private:
+	bool check(size_t bytes) {
+		if (mSize < bytes)
+			mValid = false;
+		return mValid;
+	}
+	void skip(size_t bytes) {
+		mData += bytes;
+		mSize -= bytes;
+	}
+	const uint8_t *mData;
+	size_t mSize;
+	bool mValid;
+};
+
+} // namespace
+
+static bool sameAddress(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+	if (a.ss_family != b.ss_family)
+		return false;
+	if (a.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)&a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)&b;
+		return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+	}
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *)&a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *)&b;
+	return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+RemoteTranscodedCall::RemoteTranscodedCall(TranscoderWorkerPool *pool, sip_t *invite)
+	: CallContextBase(invite), mPool(pool), mId(pool->newCallId()), mWorker(-1), mFrontPort(0), mBackPort(0),
+	  mInfoCSeq(-1) {
+}
+
+RemoteTranscodedCall::~RemoteTranscodedCall() {
+	mPool->release(this);
+	clearInitialOffer();
+}
+
+void RemoteTranscodedCall::clearInitialOffer() {
+	for (PayloadType *pt : mInitialOffer)
+		payload_type_destroy(pt);
+	mInitialOffer.clear();
+}
+
+void RemoteTranscodedCall::setInitialOffer(list<PayloadType *> &payloads) {
+	clearInitialOffer();
+	mInitialOffer = payloads;
+}
+
+const list<PayloadType *> &RemoteTranscodedCall::getInitialOffer() const {
+	return mInitialOffer;
+}
+
+void RemoteTranscodedCall::playTone(sip_t *info) {
+	if (mWorker == -1) {
+		LOGW("Tone not played because the call has no transcoder worker.");
+		return;
+	}
+	if (mInfoCSeq != -1 && ((unsigned int)mInfoCSeq) == info->sip_cseq->cs_seq)
+		return;
+	mInfoCSeq = info->sip_cseq->cs_seq;
+	const char *p = strstr(info->sip_payload->pl_data, "Signal=");
+	if (p && p[strlen("Signal=")] != 0) {
+		LOGD("Intercepting dtmf in SIP info");
+		mPool->playTone(this, p[strlen("Signal=")]);
+	}
+}
+
+time_t RemoteTranscodedCall::getLastActivity() {
+	time_t lastReport = mPool->getLastReport(this);
+	time_t now = getCurrentTime();
+	if (lastReport + TranscoderWorkerPool::sLostAfter >= now)
+		return now;
+	return max(lastReport, CallContextBase::getLastActivity());
+}
+
+TranscoderWorkerPool::TranscoderWorkerPool(su_root_t *root, GoneFn onGone)
+	: mRoot(root), mOnGone(onGone), mSocket(-1), mWaitIndex(-1), mTimer(NULL), mTicks(0), mNextSeq(1), mNextId(1) {
+	random_device rd;
+	mIdTag = (uint64_t)rd() << 32;
+}
+
+TranscoderWorkerPool::~TranscoderWorkerPool() {
+	if (mTimer)
+		su_timer_destroy(mTimer);
+	if (mWaitIndex != -1)
+		su_root_deregister(mRoot, mWaitIndex);
+	if (mSocket != -1)
+		close(mSocket);
+}
+
+/* host:port or [ipv6]:port */
+bool TranscoderWorkerPool::resolve(const string &name, Worker &worker) {
+	string host = name;
+	string service;
+	size_t bracket = name.find(']');
+	size_t colon = name.rfind(':');
+	if (!name.empty() && name[0] == '[' && bracket != string::npos) {
+		host = name.substr(1, bracket - 1);
+		if (colon == bracket + 1)
+			service = name.substr(colon + 1);
+	} else if (colon != string::npos && name.find(':') == colon) {
+		host = name.substr(0, colon);
+		service = name.substr(colon + 1);
+	}
+	if (service.empty()) {
+		LOGE("Missing control port in the transcoder worker %s", name.c_str());
+		return false;
+	}
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = mWorkers.empty() ? AF_UNSPEC : mWorkers.front().addr.ss_family;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &res);
+	if (err != 0) {
+		LOGE("Cannot resolve the transcoder worker %s: %s", name.c_str(), gai_strerror(err));
+		return false;
+	}
+	worker.name = name;
+	worker.host = host;
+	memcpy(&worker.addr, res->ai_addr, res->ai_addrlen);
+	worker.addrLen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+bool TranscoderWorkerPool::start(const list<string> &workers) {
+	for (const auto &name : workers) {
+		Worker worker;
+		worker.lastReport = 0;
+		worker.alive = false;
+		worker.load = 0;
+		worker.calls = 0;
+		worker.recent = 0;
+		worker.minPort = worker.maxPort = worker.nextPort = 0;
+		// the workers share our socket, and thus the family of the first one
+		if (!resolve(name, worker))
+			return false;
+		mWorkers.push_back(worker);
+	}
+	if (mWorkers.empty()) {
+		LOGE("No transcoder worker");
+		return false;
+	}
+	mSocket = socket(mWorkers.front().addr.ss_family, SOCK_DGRAM, 0);
+	if (mSocket == -1) {
+		LOGE("Cannot create the transcoder control socket: %s", strerror(errno));
+		return false;
+	}
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) | O_NONBLOCK);
+	su_wait_create(&mWait, mSocket, SU_WAIT_IN);
+	mWaitIndex = su_root_register(mRoot, &mWait, &TranscoderWorkerPool::sOnRead, this, su_pri_normal);
+	mTimer = su_timer_create(su_root_task(mRoot), sRetransmitPeriod);
+	su_timer_set_for_ever(mTimer, &TranscoderWorkerPool::sOnTimer, this);
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('H');
+	for (const auto &worker : mWorkers)
+		send(worker, datagram);
+	LOGI("Transcoding with %zu workers", mWorkers.size());
+	return true;
+}
+
+void TranscoderWorkerPool::send(const Worker &worker, const string &datagram) {
+	if (sendto(mSocket, datagram.data(), datagram.size(), 0, (struct sockaddr *)&worker.addr, worker.addrLen) == -1)
+		LOGD("Cannot send to the transcoder worker %s: %s", worker.name.c_str(), strerror(errno));
+}
+
+/* The ports are even, RTCP using the next ones. */
+bool TranscoderWorkerPool::allocatePort(Worker &worker, int &port) {
+	int first = worker.minPort + (worker.minPort & 1);
+	int count = (worker.maxPort - first) / 2;
+	for (int i = 0; i < count; ++i) {
+		if (worker.nextPort < first || worker.nextPort + 1 > worker.maxPort)
+			worker.nextPort = first;
+		int candidate = worker.nextPort;
+		worker.nextPort += 2;
+		if (worker.usedPorts.insert(candidate).second) {
+			port = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TranscoderWorkerPool::assign(RemoteTranscodedCall *call) {
+	if (call->mWorker != -1)
+		return true;
+	int best = -1;
+	float bestLoad = 0;
+	for (size_t i = 0; i < mWorkers.size(); ++i) {
+		Worker &w = mWorkers[i];
+		int capacity = w.maxPort > w.minPort ? (w.maxPort - w.minPort) / 2 : 0;
+		if (!w.alive || capacity - (int)w.usedPorts.size() < 2)
+			continue;
+		float callCost = w.calls > 0 ? max(w.load / w.calls, sMinCallCost) : sDefaultCallCost;
+		float load = w.load + w.recent * callCost;
+		if (best == -1 || load < bestLoad) {
+			best = (int)i;
+			bestLoad = load;
+		}
+	}
+	if (best == -1) {
+		LOGE("No transcoder worker available");
+		return false;
+	}
+	Worker &worker = mWorkers[best];
+	int frontPort = 0, backPort = 0;
+	if (!allocatePort(worker, frontPort) || !allocatePort(worker, backPort)) {
+		if (frontPort)
+			worker.usedPorts.erase(frontPort);
+		LOGE("No free RTP port on the transcoder worker %s", worker.name.c_str());
+		return false;
+	}
+	worker.recent++;
+	call->mWorker = best;
+	call->mFrontPort = frontPort;
+	call->mBackPort = backPort;
+	call->mMediaAddress = worker.mediaAddress;
+	LOGD("Call %llx given to the transcoder worker %s, ports %i and %i", (unsigned long long)call->mId,
+		 worker.name.c_str(), frontPort, backPort);
+	return true;
+}
+
+string TranscoderWorkerPool::makeCommand(const RemoteTranscodedCall *call, char type, uint32_t &seq) {
+	seq = mNextSeq++;
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back(type);
+	writeInt(datagram, seq, 4);
+	writeInt(datagram, call->mId, 8);
+	return datagram;
+}
+
+void TranscoderWorkerPool::sendCommand(const RemoteTranscodedCall *call, uint32_t seq, const string &datagram) {
+	if (call->mWorker == -1)
+		return;
+	if (datagram.size() > sMaxDatagram) {
+		LOGE("Transcoder command of %zu bytes too large, not sent", datagram.size());
+		return;
+	}
+	mPending.push_back(Command{call->mWorker, call->mId, seq, datagram, 0});
+	send(mWorkers[call->mWorker], datagram);
+}
+
+void TranscoderWorkerPool::offer(RemoteTranscodedCall *call, const string &addr, int port, int ptime, bool rc) {
+	uint32_t seq;
+	string datagram = makeCommand(call, 'O', seq);
+	writeInt(datagram, call->mFrontPort, 2);
+	writeInt(datagram, call->mBackPort, 2);
+	writeString(datagram, addr.c_str());
+	writeInt(datagram, port, 2);
+	writeInt(datagram, ptime > 0 ? ptime : 0, 2);
+	writeInt(datagram, rc ? 1 : 0, 1);
+	sendCommand(call, seq, datagram);
+}
+
+void TranscoderWorkerPool::answer(RemoteTranscodedCall *call, const string &addr, int port, int ptime, bool rc,
+								  const list<PayloadType *> &front, const list<PayloadType *> &back) {
+	uint32_t seq;
+	string datagram = makeCommand(call, 'A', seq);
+	writeString(datagram, addr.c_str());
+	writeInt(datagram, port, 2);
+	writeInt(datagram, ptime > 0 ? ptime : 0, 2);
+	writeInt(datagram, rc ? 1 : 0, 1);
+	writePayloads(datagram, front);
+	writePayloads(datagram, back);
+	sendCommand(call, seq, datagram);
+}
+
+void TranscoderWorkerPool::playTone(RemoteTranscodedCall *call, char dtmf) {
+	uint32_t seq;
+	string datagram = makeCommand(call, 'T', seq);
+	writeInt(datagram, (uint8_t)dtmf, 1);
+	sendCommand(call, seq, datagram);
+}
+
+void TranscoderWorkerPool::release(RemoteTranscodedCall *call) {
+	if (call->mWorker == -1)
+		return;
+	// a command still sent again would bring the call back on the worker
+	mPending.remove_if([call](const Command &c) { return c.id == call->mId; });
+	uint32_t seq;
+	sendCommand(call, seq, makeCommand(call, 'E', seq));
+	Worker &worker = mWorkers[call->mWorker];
+	worker.usedPorts.erase(call->mFrontPort);
+	worker.usedPorts.erase(call->mBackPort);
+	call->mWorker = -1;
+}
+
+time_t TranscoderWorkerPool::getLastReport(const RemoteTranscodedCall *call) const {
+	return call->mWorker != -1 ? mWorkers[call->mWorker].lastReport : 0;
+}
+
+void TranscoderWorkerPool::parse(Worker &worker, const uint8_t *data, size_t size) {
+	if (size < sizeof(sMagic) + 1 || memcmp(data, sMagic, sizeof(sMagic)) != 0) {
+		LOGW("Invalid datagram from the transcoder worker %s", worker.name.c_str());
+		return;
+	}
+	DatagramReader reader(data + sizeof(sMagic), size - sizeof(sMagic));
+	int type = (int)reader.readInt(1);
+	if (type == 'K') {
+		uint32_t seq = (uint32_t)reader.readInt(4);
+		if (!reader.valid())
+			return;
+		int index = (int)(&worker - &mWorkers[0]);
+		mPending.remove_if([index, seq](const Command &c) { return c.worker == index && c.seq == seq; });
+	} else if (type == 'L') {
+		uint32_t load = (uint32_t)reader.readInt(4);
+		uint32_t calls = (uint32_t)reader.readInt(4);
+		int minPort = (int)reader.readInt(2);
+		int maxPort = (int)reader.readInt(2);
+		string address = reader.readString();
+		if (!reader.valid())
+			return;
+		if (!worker.alive)
+			LOGI("Transcoder worker %s is up", worker.name.c_str());
+		worker.alive = true;
+		worker.lastReport = getCurrentTime();
+		worker.load = load / 10.0f;
+		worker.calls = (int)calls;
+		worker.recent = 0;
+		worker.minPort = minPort;
+		worker.maxPort = maxPort;
+		// a worker without public address is reached at the address of its control port
+		worker.mediaAddress = address.empty() ? worker.host : address;
+	} else if (type == 'G') {
+		uint64_t id = reader.readInt(8);
+		if (reader.valid())
+			mOnGone(id);
+	} else {
+		LOGW("Unknown message from the transcoder worker %s", worker.name.c_str());
+	}
+}
+
+void TranscoderWorkerPool::onRead() {
+	static uint8_t buffer[sMaxDatagram];
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		ssize_t size = recvfrom(mSocket, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &fromLen);
+		if (size < 0)
+			break;
+		auto worker =
+			find_if(mWorkers.begin(), mWorkers.end(), [&](const Worker &w) { return sameAddress(from, w.addr); });
+		if (worker == mWorkers.end()) {
+			LOGW("Ignoring a transcoder datagram from an address which is not a worker");
+			continue;
+		}
+		parse(*worker, buffer, size);
+	}
+}
+
+void TranscoderWorkerPool::onTimer() {
+	for (auto it = mPending.begin(); it != mPending.end();) {
+		if (++it->tries > sMaxTries) {
+			LOGW("Transcoder worker %s does not acknowledge the command %u of call %llx",
+				 mWorkers[it->worker].name.c_str(), it->seq, (unsigned long long)it->id);
+			it = mPending.erase(it);
+			continue;
+		}
+		send(mWorkers[it->worker], it->datagram);
+		++it;
+	}
+	if (++mTicks % sPollTicks != 0)
+		return;
+	time_t now = getCurrentTime();
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('H');
+	for (auto &worker : mWorkers) {
+		if (worker.alive && worker.lastReport + sLostAfter < now) {
+			LOGW("Transcoder worker %s is lost", worker.name.c_str());
+			worker.alive = false;
+		}
+		send(worker, datagram);
+	}
+}
+
+void TranscoderWorkerPool::sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	static_cast<TranscoderWorkerPool *>(arg)->onRead();
+}
+
+void TranscoderWorkerPool::sOnTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<TranscoderWorkerPool *>(arg)->onTimer();
+}
+
+TranscoderWorker::TranscoderWorker(su_root_t *root, const GenericStruct *mc)
+	: mRoot(root), mFactory(NULL), mSocket(-1), mWaitIndex(-1), mTimer(NULL), mTicks(0) {
+	mCallParams.mJbNomSize = mc->get<ConfigInt>("jb-nom-size")->read();
+	mBindAddress = mc->get<ConfigString>("worker-bind-address")->read();
+	mPublicAddress = mc->get<ConfigString>("worker-public-address")->read();
+	mPort = mc->get<ConfigInt>("worker-port")->read();
+	string ports = mc->get<ConfigString>("worker-rtp-ports")->read();
+	if (sscanf(ports.c_str(), "%i-%i", &mMinPort, &mMaxPort) != 2 || mMinPort <= 0 || mMaxPort > 65535 ||
+		mMaxPort - mMinPort < 3)
+		LOGF("Invalid worker-rtp-ports '%s', expected min-max", ports.c_str());
+	mTickerManager.enableCpuAffinity(mc->get<ConfigBoolean>("ticker-cpu-affinity")->read());
+}
+
+TranscoderWorker::~TranscoderWorker() {
+	if (mTimer)
+		su_timer_destroy(mTimer);
+	if (mWaitIndex != -1)
+		su_root_deregister(mRoot, mWaitIndex);
+	if (mSocket != -1)
+		close(mSocket);
+	// the graphs of the calls are destroyed before their factory
+	mCalls.clear();
+	if (mFactory)
+		ms_factory_destroy(mFactory);
+}
+
+bool TranscoderWorker::start() {
+	mFactory = ms_factory_new_with_voip();
+	TranscoderFilters::registerIn(mFactory);
+	// a dual stack socket when possible, for the proxies to use either family
+	int family = AF_INET6;
+	mSocket = socket(family, SOCK_DGRAM, 0);
+	if (mSocket == -1) {
+		family = AF_INET;
+		mSocket = socket(family, SOCK_DGRAM, 0);
+	}
+	if (mSocket == -1) {
+		LOGE("Cannot create the transcoder worker socket: %s", strerror(errno));
+		return false;
+	}
+	fcntl(mSocket, F_SETFL, fcntl(mSocket, F_GETFL) | O_NONBLOCK);
+	struct sockaddr_storage local;
+	socklen_t localLen;
+	memset(&local, 0, sizeof(local));
+	if (family == AF_INET6) {
+		int off = 0;
+		setsockopt(mSocket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&local;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(mPort);
+		localLen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&local;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(mPort);
+		localLen = sizeof(*sin);
+	}
+	if (::bind(mSocket, (struct sockaddr *)&local, localLen) == -1) {
+		LOGE("Cannot bind the transcoder worker socket to port %i: %s", mPort, strerror(errno));
+		return false;
+	}
+	su_wait_create(&mWait, mSocket, SU_WAIT_IN);
+	mWaitIndex = su_root_register(mRoot, &mWait, &TranscoderWorker::sOnRead, this, su_pri_normal);
+	mTimer = su_timer_create(su_root_task(mRoot), sWorkerTimerPeriod);
+	su_timer_set_for_ever(mTimer, &TranscoderWorker::sOnTimer, this);
+	LOGI("Transcoder worker listening on port %i, RTP ports %i to %i", mPort, mMinPort, mMaxPort);
+	return true;
+}
+
+void TranscoderWorker::report(const struct sockaddr_storage &to, socklen_t toLen) {
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('L');
+	writeInt(datagram, (uint32_t)(mTickerManager.getAverageLoad() * 10), 4);
+	writeInt(datagram, mCalls.size(), 4);
+	writeInt(datagram, mMinPort, 2);
+	writeInt(datagram, mMaxPort, 2);
+	writeString(datagram, mPublicAddress.c_str());
+	sendto(mSocket, datagram.data(), datagram.size(), 0, (const struct sockaddr *)&to, toLen);
+}
+
+void TranscoderWorker::gone(uint64_t id, const Call &c) {
+	string datagram(sMagic, sizeof(sMagic));
+	datagram.push_back('G');
+	writeInt(datagram, id, 8);
+	sendto(mSocket, datagram.data(), datagram.size(), 0, (const struct sockaddr *)&c.proxy, c.proxyLen);
+}
+
+bool TranscoderWorker::applyOffer(Call &c, int frontPort, int backPort, const string &addr, int port, int ptime,
+								  bool rc) {
+	TranscodedCall *call = c.call.get();
+	// the previous sides are destroyed first, freeing the ports for the new ones
+	call->prepare(mCallParams);
+	if (!call->getFrontSide()->bindAudioPort(frontPort) || !call->getBackSide()->bindAudioPort(backPort)) {
+		LOGE("Cannot bind the RTP ports %i and %i of a transcoded call", frontPort, backPort);
+		return false;
+	}
+	call->getFrontSide()->setRemoteAddr(addr.c_str(), port);
+	if (ptime > 0)
+		call->getFrontSide()->setPtime(ptime);
+	call->getFrontSide()->enableRc(rc);
+	LOGD("Front side %s:%i <-> %s:%i", addr.c_str(), port, mBindAddress.c_str(), frontPort);
+	return true;
+}
+
+/* The commands for an unknown call are not acknowledged but the offer and end, so that they are sent again if they
+ * overtook the offer creating it. */
+void TranscoderWorker::parse(const struct sockaddr_storage &from, socklen_t fromLen, const uint8_t *data, size_t size) {
+	if (size < sizeof(sMagic) + 1 || memcmp(data, sMagic, sizeof(sMagic)) != 0) {
+		LOGW("Invalid datagram on the transcoder worker port");
+		return;
+	}
+	DatagramReader reader(data + sizeof(sMagic), size - sizeof(sMagic));
+	int type = (int)reader.readInt(1);
+	if (type == 'H') {
+		report(from, fromLen);
+		return;
+	}
+	uint32_t seq = (uint32_t)reader.readInt(4);
+	uint64_t id = reader.readInt(8);
+	if (!reader.valid() || (type != 'O' && type != 'A' && type != 'T' && type != 'E')) {
+		LOGW("Invalid command on the transcoder worker port");
+		return;
+	}
+	auto it = mCalls.find(id);
+	bool fresh = it == mCalls.end() || seq > it->second.lastSeq;
+	if (type == 'O') {
+		int frontPort = (int)reader.readInt(2);
+		int backPort = (int)reader.readInt(2);
+		string addr = reader.readString();
+		int port = (int)reader.readInt(2);
+		int ptime = (int)reader.readInt(2);
+		bool rc = reader.readInt(1) != 0;
+		if (!reader.valid())
+			return;
+		if (fresh) {
+			if (it == mCalls.end()) {
+				Call c;
+				c.call = allocate_shared<TranscodedCall>(PoolAllocator<TranscodedCall>(), mFactory, mBindAddress);
+				memcpy(&c.proxy, &from, fromLen);
+				c.proxyLen = fromLen;
+				it = mCalls.emplace(id, c).first;
+			}
+			it->second.lastSeq = seq;
+			if (!applyOffer(it->second, frontPort, backPort, addr, port, ptime, rc)) {
+				gone(id, it->second);
+				mCalls.erase(it);
+			}
+		}
+	} else if (type == 'A') {
+		string addr = reader.readString();
+		int port = (int)reader.readInt(2);
+		int ptime = (int)reader.readInt(2);
+		bool rc = reader.readInt(1) != 0;
+		list<PayloadType *> front = reader.readPayloads();
+		list<PayloadType *> back = reader.readPayloads();
+		if (!reader.valid() || it == mCalls.end()) {
+			for (PayloadType *pt : front)
+				payload_type_destroy(pt);
+			for (PayloadType *pt : back)
+				payload_type_destroy(pt);
+			return;
+		}
+		if (fresh) {
+			it->second.lastSeq = seq;
+			TranscodedCall *call = it->second.call.get();
+			if (call->isJoined())
+				call->unjoin();
+			LOGD("Backside remote address: %s:%i", addr.c_str(), port);
+			call->getBackSide()->setRemoteAddr(addr.c_str(), port);
+			if (ptime > 0)
+				call->getBackSide()->setPtime(ptime);
+			call->getBackSide()->assignPayloads(back);
+			call->getFrontSide()->assignPayloads(front);
+			call->getBackSide()->enableRc(rc);
+			call->join(mTickerManager.chooseOne());
+		} else {
+			for (PayloadType *pt : front)
+				payload_type_destroy(pt);
+			for (PayloadType *pt : back)
+				payload_type_destroy(pt);
+		}
+	} else if (type == 'T') {
+		char dtmf = (char)reader.readInt(1);
+		if (!reader.valid() || it == mCalls.end())
+			return;
+		if (fresh) {
+			it->second.lastSeq = seq;
+			TranscodedCall *call = it->second.call.get();
+			call->playTone(call->getFrontSide(), dtmf);
+		}
+	} else if (it != mCalls.end()) {
+		mCalls.erase(it);
+	}
+	string ack(sMagic, sizeof(sMagic));
+	ack.push_back('K');
+	writeInt(ack, seq, 4);
+	sendto(mSocket, ack.data(), ack.size(), 0, (const struct sockaddr *)&from, fromLen);
+}
+
+void TranscoderWorker::onRead() {
+	static uint8_t buffer[sMaxDatagram];
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t fromLen = sizeof(from);
+		ssize_t size = recvfrom(mSocket, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &fromLen);
+		if (size < 0)
+			break;
+		parse(from, fromLen, buffer, size);
+	}
+}
+
+/* Runs the background tasks of the calls, then once in a while publishes the calls of each ticker and drops the
+ * inactive calls. */
+void TranscoderWorker::onTimer() {
+	for (auto &entry : mCalls)
+		entry.second.call->doBgTasks();
+	if (++mTicks % sWorkerReportTicks != 0)
+		return;
+	map<MSTicker *, int> calls;
+	time_t now = getCurrentTime();
+	for (auto it = mCalls.begin(); it != mCalls.end();) {
+		TranscodedCall *call = it->second.call.get();
+		if (now - call->getLastActivity() > sInactivityPeriod) {
+			LOGI("Dropping the inactive transcoded call %llx", (unsigned long long)it->first);
+			gone(it->first, it->second);
+			it = mCalls.erase(it);
+			continue;
+		}
+		if (call->getTicker())
+			calls[call->getTicker()]++;
+		++it;
+	}
+	mTickerManager.update(calls);
+}
+
+void TranscoderWorker::sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg) {
+	static_cast<TranscoderWorker *>(arg)->onRead();
+}
+
+void TranscoderWorker::sOnTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg) {
+	static_cast<TranscoderWorker *>(arg)->onTimer();
+}
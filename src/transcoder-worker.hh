@@ -0,0 +1,205 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef transcoder_worker_hh
+#define transcoder_worker_hh
+
+#include "callcontext-transcoder.hh"
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <sys/socket.h>
+
+#include <sofia-sip/su_wait.h>
+
+/*
+ * The Transcoder module may delegate the media of its calls to transcoder workers: flexisip processes started with
+ * '--server transcoder-worker', on the same host or on others, so that transcoding neither slows down nor crashes the
+ * proxy. The proxy sends its commands to the control port of a worker as UDP datagrams, which the worker acknowledges;
+ * the unacknowledged ones are sent again. The proxy gives each call its RTP ports on the worker, from the range the
+ * worker announces, so that it rewrites the SDP without waiting for the worker.
+ */
+
+class TranscoderWorkerPool;
+
+/* The proxy side of a call whose media is processed by a transcoder worker. */
+class RemoteTranscodedCall : public CallContextBase {
+  public:
+	RemoteTranscodedCall(TranscoderWorkerPool *pool, sip_t *invite);
+	~RemoteTranscodedCall();
+	uint64_t getId() const {
+		return mId;
+	}
+	/* Address and ports given to the call on its worker, valid once TranscoderWorkerPool::assign() succeeded. */
+	const std::string &getMediaAddress() const {
+		return mMediaAddress;
+	}
+	int getFrontPort() const {
+		return mFrontPort;
+	}
+	int getBackPort() const {
+		return mBackPort;
+	}
+	void setInitialOffer(std::list<PayloadType *> &payloads);
+	const std::list<PayloadType *> &getInitialOffer() const;
+	void playTone(sip_t *info);
+	/* The worker tells when the call is inactive: the call only becomes so here when its worker is lost. */
+	virtual time_t getLastActivity();
+
+  private:
+	friend class TranscoderWorkerPool;
+	void clearInitialOffer();
+	TranscoderWorkerPool *mPool;
+	uint64_t mId;
+	int mWorker;
+	int mFrontPort;
+	int mBackPort;
+	std::string mMediaAddress;
+	std::list<PayloadType *> mInitialOffer;
+	int mInfoCSeq;
+};
+
+/* The workers of a proxy, and the control protocol on the proxy side. SIP thread only. */
+class TranscoderWorkerPool {
+  public:
+	/* Called with the id of a call the worker no longer processes. */
+	typedef std::function<void(uint64_t id)> GoneFn;
+	/* Seconds without report after which a worker is considered lost. */
+	static const int sLostAfter = 3;
+
+	TranscoderWorkerPool(su_root_t *root, GoneFn onGone);
+	~TranscoderWorkerPool();
+	/* Each worker given as host:port of its control port. */
+	bool start(const std::list<std::string> &workers);
+	uint64_t newCallId() {
+		return mIdTag | mNextId++;
+	}
+	/* Gives the call to the worker with the lowest estimated load, and two RTP ports there, once for all. Returns
+	 * false when no worker answers or has free ports. */
+	bool assign(RemoteTranscodedCall *call);
+	/* Prepares the call for a new offer received from addr:port. */
+	void offer(RemoteTranscodedCall *call, const std::string &addr, int port, int ptime, bool rc);
+	/* Starts the processing of the call with the answer received from addr:port. The payload types are those of the
+	 * front side, towards the offerer, and of the back side. */
+	void answer(RemoteTranscodedCall *call, const std::string &addr, int port, int ptime, bool rc,
+				const std::list<PayloadType *> &front, const std::list<PayloadType *> &back);
+	void playTone(RemoteTranscodedCall *call, char dtmf);
+	/* Ends the call on its worker and frees its ports. */
+	void release(RemoteTranscodedCall *call);
+	/* Time of the last report of the worker of the call, or 0. */
+	time_t getLastReport(const RemoteTranscodedCall *call) const;
+
+  private:
+	struct Worker {
+		std::string name;
+		std::string host;
+		struct sockaddr_storage addr;
+		socklen_t addrLen;
+		time_t lastReport;
+		bool alive;
+		float load; // average load of its tickers, in percent
+		int calls;
+		int recent; // calls given since the last report
+		std::string mediaAddress;
+		int minPort;
+		int maxPort;
+		int nextPort;
+		std::unordered_set<int> usedPorts;
+	};
+	struct Command {
+		int worker;
+		uint64_t id;
+		uint32_t seq;
+		std::string datagram;
+		int tries;
+	};
+	static void sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	static void sOnTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onRead();
+	void onTimer();
+	void send(const Worker &worker, const std::string &datagram);
+	std::string makeCommand(const RemoteTranscodedCall *call, char type, uint32_t &seq);
+	void sendCommand(const RemoteTranscodedCall *call, uint32_t seq, const std::string &datagram);
+	bool resolve(const std::string &name, Worker &worker);
+	bool allocatePort(Worker &worker, int &port);
+	void parse(Worker &worker, const uint8_t *data, size_t size);
+
+	su_root_t *mRoot;
+	GoneFn mOnGone;
+	int mSocket;
+	su_wait_t mWait;
+	int mWaitIndex;
+	su_timer_t *mTimer;
+	int mTicks;
+	std::vector<Worker> mWorkers;
+	std::list<Command> mPending;
+	uint32_t mNextSeq;
+	/* high bits of the ids of the calls of this proxy, so that those of several proxies sharing a worker differ */
+	uint64_t mIdTag;
+	uint32_t mNextId;
+};
+
+/* A transcoder worker: processes the media of the calls of the proxies that send it commands. SIP thread only. */
+class TranscoderWorker {
+  public:
+	/* Reads its settings from the configuration of the Transcoder module. */
+	TranscoderWorker(su_root_t *root, const GenericStruct *mc);
+	~TranscoderWorker();
+	bool start();
+
+  private:
+	struct Call {
+		std::shared_ptr<TranscodedCall> call;
+		struct sockaddr_storage proxy;
+		socklen_t proxyLen;
+		uint32_t lastSeq;
+	};
+	static void sOnRead(su_root_magic_t *magic, su_wait_t *w, su_wakeup_arg_t *arg);
+	static void sOnTimer(su_root_magic_t *magic, su_timer_t *t, su_timer_arg_t *arg);
+	void onRead();
+	void onTimer();
+	void report(const struct sockaddr_storage &to, socklen_t toLen);
+	void gone(uint64_t id, const Call &c);
+	void parse(const struct sockaddr_storage &from, socklen_t fromLen, const uint8_t *data, size_t size);
+	bool applyOffer(Call &c, int frontPort, int backPort, const std::string &addr, int port, int ptime, bool rc);
+
+	su_root_t *mRoot;
+	MSFactory *mFactory;
+	CallContextParams mCallParams;
+	std::string mBindAddress;
+	std::string mPublicAddress;
+	int mPort;
+	int mMinPort;
+	int mMaxPort;
+	int mSocket;
+	su_wait_t mWait;
+	int mWaitIndex;
+	su_timer_t *mTimer;
+	int mTicks;
+	TickerManager mTickerManager;
+	std::unordered_map<uint64_t, Call> mCalls;
+};
+
+#endif
@@ -0,0 +1,76 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "flexisip-config.h"
+#endif
+#include "allocationcounter.hh"
+
+#include <cstddef>
+
+#if defined(ENABLE_ALLOC_STATS) && defined(__GLIBC__)
+
+// static TLS of the executable: reading it never allocates, unlike a thread_local object
+static __thread uint64_t sAllocations = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+	++sAllocations;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	++sAllocations;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	++sAllocations;
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	++sAllocations;
+	return __libc_memalign(alignment, size);
+}
+}
+
+bool AllocationCounter::enabled() {
+	return true;
+}
+
+uint64_t AllocationCounter::get() {
+	return sAllocations;
+}
+
+#else
+
+bool AllocationCounter::enabled() {
+	return false;
+}
+
+uint64_t AllocationCounter::get() {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief Count of the heap allocations made by the calling thread, including those of the C libraries like sofia-sip.
+ *
+ * Only available when built with ENABLE_ALLOC_STATS on glibc, which replaces malloc() and its siblings by counting
+ * wrappers; get() always returns 0 otherwise.
+ */
+class AllocationCounter {
+  public:
+	static bool enabled();
+	static uint64_t get();
+};
@@ -0,0 +1,591 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "audiokernels.hh"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AUDIO_KERNELS_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AUDIO_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+/*
+ * Scalar G.711, as in mediastreamer2. The segment of a magnitude is the position of its highest bit above the 7th.
+ */
+static inline int valSeg(int val) {
+	int r = 0;
+	val >>= 7;
+	if (val & 0xf0) {
+		val >>= 4;
+		r += 4;
+	}
+	if (val & 0x0c) {
+		val >>= 2;
+		r += 2;
+	}
+	if (val & 0x02)
+		r += 1;
+	return r;
+}
+
+static inline uint8_t s16ToUlaw(int pcm) {
+	int mask;
+	if (pcm < 0) {
+		pcm = 0x84 - pcm;
+		mask = 0x7f;
+	} else {
+		pcm += 0x84;
+		mask = 0xff;
+	}
+	if (pcm > 0x7fff)
+		pcm = 0x7fff;
+	int seg = valSeg(pcm);
+	return (uint8_t)(((seg << 4) | ((pcm >> (seg + 3)) & 0xf)) ^ mask);
+}
+
+static inline int16_t ulawToS16(uint8_t u) {
+	u = ~u;
+	int t = (((u & 0xf) << 3) + 0x84) << ((u & 0x70) >> 4);
+	return (int16_t)((u & 0x80) ? 0x84 - t : t - 0x84);
+}
+
+static inline uint8_t s16ToAlaw(int pcm) {
+	int mask;
+	if (pcm >= 0) {
+		mask = 0xd5;
+	} else {
+		mask = 0x55;
+		pcm = -pcm;
+		if (pcm > 0x7fff)
+			pcm = 0x7fff;
+	}
+	int aval;
+	if (pcm < 256) {
+		aval = pcm >> 4;
+	} else {
+		int seg = valSeg(pcm);
+		aval = (seg << 4) | ((pcm >> (seg + 3)) & 0xf);
+	}
+	return (uint8_t)(aval ^ mask);
+}
+
+static inline int16_t alawToS16(uint8_t a) {
+	a ^= 0x55;
+	int t = a & 0x7f;
+	if (t < 16) {
+		t = (t << 4) + 8;
+	} else {
+		int seg = (t >> 4) & 0x07;
+		t = (((t & 0x0f) << 4) + 0x108) << (seg - 1);
+	}
+	return (int16_t)((a & 0x80) ? t : -t);
+}
+
+static void ulawEncodeScalar(const int16_t *in, uint8_t *out, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		out[i] = s16ToUlaw(in[i]);
+}
+
+static void ulawDecodeScalar(const uint8_t *in, int16_t *out, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		out[i] = ulawToS16(in[i]);
+}
+
+static void alawEncodeScalar(const int16_t *in, uint8_t *out, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		out[i] = s16ToAlaw(in[i]);
+}
+
+static void alawDecodeScalar(const uint8_t *in, int16_t *out, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		out[i] = alawToS16(in[i]);
+}
+
+static float dotScalar(const float *a, const float *b, size_t count) {
+	float sum = 0;
+	for (size_t i = 0; i < count; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+#ifdef AUDIO_KERNELS_X86
+/*
+ * The segment is counted by comparing the magnitude to the bounds of the segments, and the variable right shift of
+ * the mantissa is a multiplication by a power of two keeping the high half, the power being decreased for each bound
+ * reached. The variable left shift of the decoders is a multiplication by a power of two looked up by pshufb, in the
+ * low byte of each word.
+ */
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE41 static inline __m128i ulawEncode8(__m128i pcm) {
+	__m128i negative = _mm_cmplt_epi16(pcm, _mm_setzero_si128());
+	__m128i biased = _mm_min_epu16(_mm_adds_epu16(_mm_abs_epi16(pcm), _mm_set1_epi16(0x84)), _mm_set1_epi16(0x7fff));
+	__m128i seg = _mm_setzero_si128();
+	__m128i pow = _mm_set1_epi16(8192);
+	for (int k = 0; k < 7; ++k) {
+		__m128i reached = _mm_cmpgt_epi16(biased, _mm_set1_epi16((0x100 << k) - 1));
+		seg = _mm_sub_epi16(seg, reached);
+		pow = _mm_sub_epi16(pow, _mm_and_si128(reached, _mm_set1_epi16(4096 >> k)));
+	}
+	__m128i mant = _mm_and_si128(_mm_mulhi_epu16(biased, pow), _mm_set1_epi16(0xf));
+	__m128i mask = _mm_blendv_epi8(_mm_set1_epi16(0xff), _mm_set1_epi16(0x7f), negative);
+	return _mm_xor_si128(_mm_or_si128(_mm_slli_epi16(seg, 4), mant), mask);
+}
+
+SSE41 static inline __m128i alawEncode8(__m128i pcm) {
+	__m128i negative = _mm_cmplt_epi16(pcm, _mm_setzero_si128());
+	__m128i mag = _mm_min_epu16(_mm_abs_epi16(pcm), _mm_set1_epi16(0x7fff));
+	__m128i seg = _mm_setzero_si128();
+	__m128i pow = _mm_set1_epi16(4096);
+	for (int k = 0; k < 7; ++k) {
+		__m128i reached = _mm_cmpgt_epi16(mag, _mm_set1_epi16((0x100 << k) - 1));
+		seg = _mm_sub_epi16(seg, reached);
+		if (k > 0)
+			pow = _mm_sub_epi16(pow, _mm_and_si128(reached, _mm_set1_epi16(4096 >> k)));
+	}
+	__m128i mant = _mm_and_si128(_mm_mulhi_epu16(mag, pow), _mm_set1_epi16(0xf));
+	__m128i mask = _mm_blendv_epi8(_mm_set1_epi16(0xd5), _mm_set1_epi16(0x55), negative);
+	return _mm_xor_si128(_mm_or_si128(_mm_slli_epi16(seg, 4), mant), mask);
+}
+
+SSE41 static inline __m128i ulawDecode8(__m128i u) {
+	u = _mm_xor_si128(u, _mm_set1_epi16(0xff));
+	__m128i exp = _mm_and_si128(_mm_srli_epi16(u, 4), _mm_set1_epi16(7));
+	__m128i pow = _mm_and_si128(
+		_mm_shuffle_epi8(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0), exp),
+		_mm_set1_epi16(0xff));
+	__m128i t = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(u, _mm_set1_epi16(0xf)), 3), _mm_set1_epi16(0x84));
+	t = _mm_mullo_epi16(t, pow);
+	__m128i negative = _mm_cmpeq_epi16(_mm_and_si128(u, _mm_set1_epi16(0x80)), _mm_set1_epi16(0x80));
+	return _mm_blendv_epi8(_mm_sub_epi16(t, _mm_set1_epi16(0x84)), _mm_sub_epi16(_mm_set1_epi16(0x84), t), negative);
+}
+
+SSE41 static inline __m128i alawDecode8(__m128i a) {
+	a = _mm_xor_si128(a, _mm_set1_epi16(0x55));
+	__m128i seg = _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi16(7));
+	__m128i pow = _mm_and_si128(
+		_mm_shuffle_epi8(_mm_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64, 0, 0, 0, 0, 0, 0, 0, 0), seg), _mm_set1_epi16(0xff));
+	__m128i segmented = _mm_andnot_si128(_mm_cmpeq_epi16(seg, _mm_setzero_si128()), _mm_set1_epi16(0x100));
+	__m128i t = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0xf)), 4), _mm_set1_epi16(8));
+	t = _mm_mullo_epi16(_mm_add_epi16(t, segmented), pow);
+	__m128i positive = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x80)), _mm_set1_epi16(0x80));
+	return _mm_blendv_epi8(_mm_sub_epi16(_mm_setzero_si128(), t), t, positive);
+}
+
+SSE41 static void ulawEncodeSse41(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i r = ulawEncode8(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(r, r));
+	}
+	ulawEncodeScalar(in + i, out + i, count - i);
+}
+
+SSE41 static void alawEncodeSse41(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i r = alawEncode8(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(r, r));
+	}
+	alawEncodeScalar(in + i, out + i, count - i);
+}
+
+SSE41 static void ulawDecodeSse41(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i u = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(in + i)));
+		_mm_storeu_si128((__m128i *)(out + i), ulawDecode8(u));
+	}
+	ulawDecodeScalar(in + i, out + i, count - i);
+}
+
+SSE41 static void alawDecodeSse41(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(in + i)));
+		_mm_storeu_si128((__m128i *)(out + i), alawDecode8(a));
+	}
+	alawDecodeScalar(in + i, out + i, count - i);
+}
+
+SSE41 static float dotSse41(const float *a, const float *b, size_t count) {
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	for (size_t i = 0; i < count; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	__m128 sum = _mm_add_ps(sum0, sum1);
+	sum = _mm_hadd_ps(sum, sum);
+	sum = _mm_hadd_ps(sum, sum);
+	return _mm_cvtss_f32(sum);
+}
+
+/* The same as the SSE4.1 kernels on 16 samples, the 128 bit lanes of pshufb each holding the table. */
+AVX2 static inline __m256i ulawEncode16(__m256i pcm) {
+	__m256i negative = _mm256_cmpgt_epi16(_mm256_setzero_si256(), pcm);
+	__m256i biased = _mm256_min_epu16(_mm256_adds_epu16(_mm256_abs_epi16(pcm), _mm256_set1_epi16(0x84)),
+									  _mm256_set1_epi16(0x7fff));
+	__m256i seg = _mm256_setzero_si256();
+	__m256i pow = _mm256_set1_epi16(8192);
+	for (int k = 0; k < 7; ++k) {
+		__m256i reached = _mm256_cmpgt_epi16(biased, _mm256_set1_epi16((0x100 << k) - 1));
+		seg = _mm256_sub_epi16(seg, reached);
+		pow = _mm256_sub_epi16(pow, _mm256_and_si256(reached, _mm256_set1_epi16(4096 >> k)));
+	}
+	__m256i mant = _mm256_and_si256(_mm256_mulhi_epu16(biased, pow), _mm256_set1_epi16(0xf));
+	__m256i mask = _mm256_blendv_epi8(_mm256_set1_epi16(0xff), _mm256_set1_epi16(0x7f), negative);
+	return _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi16(seg, 4), mant), mask);
+}
+
+AVX2 static inline __m256i alawEncode16(__m256i pcm) {
+	__m256i negative = _mm256_cmpgt_epi16(_mm256_setzero_si256(), pcm);
+	__m256i mag = _mm256_min_epu16(_mm256_abs_epi16(pcm), _mm256_set1_epi16(0x7fff));
+	__m256i seg = _mm256_setzero_si256();
+	__m256i pow = _mm256_set1_epi16(4096);
+	for (int k = 0; k < 7; ++k) {
+		__m256i reached = _mm256_cmpgt_epi16(mag, _mm256_set1_epi16((0x100 << k) - 1));
+		seg = _mm256_sub_epi16(seg, reached);
+		if (k > 0)
+			pow = _mm256_sub_epi16(pow, _mm256_and_si256(reached, _mm256_set1_epi16(4096 >> k)));
+	}
+	__m256i mant = _mm256_and_si256(_mm256_mulhi_epu16(mag, pow), _mm256_set1_epi16(0xf));
+	__m256i mask = _mm256_blendv_epi8(_mm256_set1_epi16(0xd5), _mm256_set1_epi16(0x55), negative);
+	return _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi16(seg, 4), mant), mask);
+}
+
+AVX2 static inline __m256i ulawDecode16(__m256i u) {
+	u = _mm256_xor_si256(u, _mm256_set1_epi16(0xff));
+	__m256i exp = _mm256_and_si256(_mm256_srli_epi16(u, 4), _mm256_set1_epi16(7));
+	__m256i table = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32,
+									 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m256i pow = _mm256_and_si256(_mm256_shuffle_epi8(table, exp), _mm256_set1_epi16(0xff));
+	__m256i t =
+		_mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(u, _mm256_set1_epi16(0xf)), 3), _mm256_set1_epi16(0x84));
+	t = _mm256_mullo_epi16(t, pow);
+	__m256i negative = _mm256_cmpeq_epi16(_mm256_and_si256(u, _mm256_set1_epi16(0x80)), _mm256_set1_epi16(0x80));
+	return _mm256_blendv_epi8(_mm256_sub_epi16(t, _mm256_set1_epi16(0x84)),
+							  _mm256_sub_epi16(_mm256_set1_epi16(0x84), t), negative);
+}
+
+AVX2 static inline __m256i alawDecode16(__m256i a) {
+	a = _mm256_xor_si256(a, _mm256_set1_epi16(0x55));
+	__m256i seg = _mm256_and_si256(_mm256_srli_epi16(a, 4), _mm256_set1_epi16(7));
+	__m256i table = _mm256_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 4, 8, 16, 32, 64, 0,
+									 0, 0, 0, 0, 0, 0, 0);
+	__m256i pow = _mm256_and_si256(_mm256_shuffle_epi8(table, seg), _mm256_set1_epi16(0xff));
+	__m256i segmented =
+		_mm256_andnot_si256(_mm256_cmpeq_epi16(seg, _mm256_setzero_si256()), _mm256_set1_epi16(0x100));
+	__m256i t =
+		_mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0xf)), 4), _mm256_set1_epi16(8));
+	t = _mm256_mullo_epi16(_mm256_add_epi16(t, segmented), pow);
+	__m256i positive = _mm256_cmpeq_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x80)), _mm256_set1_epi16(0x80));
+	return _mm256_blendv_epi8(_mm256_sub_epi16(_mm256_setzero_si256(), t), t, positive);
+}
+
+/* Packs 16 words of 0 to 255 to 16 bytes. */
+AVX2 static inline void storePacked16(uint8_t *out, __m256i r) {
+	__m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+	_mm_storeu_si128((__m128i *)out, packed);
+}
+
+AVX2 static void ulawEncodeAvx2(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+		storePacked16(out + i, ulawEncode16(_mm256_loadu_si256((const __m256i *)(in + i))));
+	ulawEncodeScalar(in + i, out + i, count - i);
+}
+
+AVX2 static void alawEncodeAvx2(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+		storePacked16(out + i, alawEncode16(_mm256_loadu_si256((const __m256i *)(in + i))));
+	alawEncodeScalar(in + i, out + i, count - i);
+}
+
+AVX2 static void ulawDecodeAvx2(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), ulawDecode16(u));
+	}
+	ulawDecodeScalar(in + i, out + i, count - i);
+}
+
+AVX2 static void alawDecodeAvx2(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), alawDecode16(a));
+	}
+	alawDecodeScalar(in + i, out + i, count - i);
+}
+
+AVX2 static float dotAvx2(const float *a, const float *b, size_t count) {
+	__m256 sum = _mm256_setzero_ps();
+	for (size_t i = 0; i < count; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	half = _mm_hadd_ps(half, half);
+	half = _mm_hadd_ps(half, half);
+	return _mm_cvtss_f32(half);
+}
+#endif
+
+#ifdef AUDIO_KERNELS_NEON
+/* NEON has variable shifts and a count of leading zeros, giving the segments and mantissas directly. */
+static inline uint16x8_t ulawEncode8(int16x8_t pcm) {
+	uint16x8_t negative = vcltq_s16(pcm, vdupq_n_s16(0));
+	uint16x8_t biased = vminq_u16(vqaddq_u16(vreinterpretq_u16_s16(vqabsq_s16(pcm)), vdupq_n_u16(0x84)),
+								  vdupq_n_u16(0x7fff));
+	int16x8_t seg = vsubq_s16(vdupq_n_s16(8), vreinterpretq_s16_u16(vclzq_u16(biased)));
+	uint16x8_t mant = vandq_u16(vshlq_u16(biased, vnegq_s16(vaddq_s16(seg, vdupq_n_s16(3)))), vdupq_n_u16(0xf));
+	uint16x8_t mask = vbslq_u16(negative, vdupq_n_u16(0x7f), vdupq_n_u16(0xff));
+	return veorq_u16(vorrq_u16(vshlq_n_u16(vreinterpretq_u16_s16(seg), 4), mant), mask);
+}
+
+static inline uint16x8_t alawEncode8(int16x8_t pcm) {
+	uint16x8_t negative = vcltq_s16(pcm, vdupq_n_s16(0));
+	uint16x8_t mag = vreinterpretq_u16_s16(vqabsq_s16(pcm));
+	int16x8_t seg = vmaxq_s16(vsubq_s16(vdupq_n_s16(8), vreinterpretq_s16_u16(vclzq_u16(mag))), vdupq_n_s16(0));
+	// segments 0 and 1 both shift by 4
+	int16x8_t shift = vaddq_s16(vmaxq_s16(seg, vdupq_n_s16(1)), vdupq_n_s16(3));
+	uint16x8_t mant = vandq_u16(vshlq_u16(mag, vnegq_s16(shift)), vdupq_n_u16(0xf));
+	uint16x8_t mask = vbslq_u16(negative, vdupq_n_u16(0x55), vdupq_n_u16(0xd5));
+	return veorq_u16(vorrq_u16(vshlq_n_u16(vreinterpretq_u16_s16(seg), 4), mant), mask);
+}
+
+static inline int16x8_t ulawDecode8(uint16x8_t u) {
+	u = veorq_u16(u, vdupq_n_u16(0xff));
+	int16x8_t exp = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(u, 4), vdupq_n_u16(7)));
+	int16x8_t t = vreinterpretq_s16_u16(vaddq_u16(vshlq_n_u16(vandq_u16(u, vdupq_n_u16(0xf)), 3), vdupq_n_u16(0x84)));
+	t = vshlq_s16(t, exp);
+	uint16x8_t negative = vtstq_u16(u, vdupq_n_u16(0x80));
+	return vbslq_s16(negative, vsubq_s16(vdupq_n_s16(0x84), t), vsubq_s16(t, vdupq_n_s16(0x84)));
+}
+
+static inline int16x8_t alawDecode8(uint16x8_t a) {
+	a = veorq_u16(a, vdupq_n_u16(0x55));
+	int16x8_t seg = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(a, 4), vdupq_n_u16(7)));
+	uint16x8_t segmented = vtstq_s16(seg, seg);
+	int16x8_t t = vreinterpretq_s16_u16(vaddq_u16(vshlq_n_u16(vandq_u16(a, vdupq_n_u16(0xf)), 4), vdupq_n_u16(8)));
+	t = vaddq_s16(t, vreinterpretq_s16_u16(vandq_u16(segmented, vdupq_n_u16(0x100))));
+	t = vshlq_s16(t, vmaxq_s16(vsubq_s16(seg, vdupq_n_s16(1)), vdupq_n_s16(0)));
+	uint16x8_t positive = vtstq_u16(a, vdupq_n_u16(0x80));
+	return vbslq_s16(positive, t, vnegq_s16(t));
+}
+
+static void ulawEncodeNeon(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+		vst1_u8(out + i, vmovn_u16(ulawEncode8(vld1q_s16(in + i))));
+	ulawEncodeScalar(in + i, out + i, count - i);
+}
+
+static void alawEncodeNeon(const int16_t *in, uint8_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+		vst1_u8(out + i, vmovn_u16(alawEncode8(vld1q_s16(in + i))));
+	alawEncodeScalar(in + i, out + i, count - i);
+}
+
+static void ulawDecodeNeon(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+		vst1q_s16(out + i, ulawDecode8(vmovl_u8(vld1_u8(in + i))));
+	ulawDecodeScalar(in + i, out + i, count - i);
+}
+
+static void alawDecodeNeon(const uint8_t *in, int16_t *out, size_t count) {
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+		vst1q_s16(out + i, alawDecode8(vmovl_u8(vld1_u8(in + i))));
+	alawDecodeScalar(in + i, out + i, count - i);
+}
+
+static float dotNeon(const float *a, const float *b, size_t count) {
+	float32x4_t sum0 = vdupq_n_f32(0);
+	float32x4_t sum1 = vdupq_n_f32(0);
+	for (size_t i = 0; i < count; i += 8) {
+		sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+		sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+	}
+	float32x4_t sum = vaddq_f32(sum0, sum1);
+	float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+	return vget_lane_f32(vpadd_f32(half, half), 0);
+}
+#endif
+
+namespace {
+
+struct Kernels {
+	AudioKernels::Isa isa;
+	void (*ulawEncode)(const int16_t *, uint8_t *, size_t);
+	void (*ulawDecode)(const uint8_t *, int16_t *, size_t);
+	void (*alawEncode)(const int16_t *, uint8_t *, size_t);
+	void (*alawDecode)(const uint8_t *, int16_t *, size_t);
+	float (*dot)(const float *, const float *, size_t);
+};
+
+Kernels makeKernels(AudioKernels::Isa isa) {
+	switch (isa) {
+#ifdef AUDIO_KERNELS_X86
+		case AudioKernels::Sse41:
+			return Kernels{isa, ulawEncodeSse41, ulawDecodeSse41, alawEncodeSse41, alawDecodeSse41, dotSse41};
+		case AudioKernels::Avx2:
+			return Kernels{isa, ulawEncodeAvx2, ulawDecodeAvx2, alawEncodeAvx2, alawDecodeAvx2, dotAvx2};
+#endif
+#ifdef AUDIO_KERNELS_NEON
+		case AudioKernels::Neon:
+			return Kernels{isa, ulawEncodeNeon, ulawDecodeNeon, alawEncodeNeon, alawDecodeNeon, dotNeon};
+#endif
+		default:
+			return Kernels{AudioKernels::Scalar, ulawEncodeScalar, ulawDecodeScalar, alawEncodeScalar,
+						   alawDecodeScalar, dotScalar};
+	}
+}
+
+// chosen before main() runs, so that the MSTicker threads never race on it
+Kernels sKernels = makeKernels(AudioKernels::detect());
+
+} // namespace
+
+AudioKernels::Isa AudioKernels::detect() {
+#ifdef AUDIO_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return Avx2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return Sse41;
+#endif
+#ifdef AUDIO_KERNELS_NEON
+	return Neon;
+#endif
+	return Scalar;
+}
+
+AudioKernels::Isa AudioKernels::getIsa() {
+	return sKernels.isa;
+}
+
+void AudioKernels::setIsa(Isa isa) {
+	sKernels = makeKernels(isa);
+}
+
+const char *AudioKernels::getIsaName(Isa isa) {
+	switch (isa) {
+		case Sse41:
+			return "sse4.1";
+		case Avx2:
+			return "avx2";
+		case Neon:
+			return "neon";
+		default:
+			return "scalar";
+	}
+}
+
+void AudioKernels::ulawEncode(const int16_t *in, uint8_t *out, size_t count) {
+	sKernels.ulawEncode(in, out, count);
+}
+
+void AudioKernels::ulawDecode(const uint8_t *in, int16_t *out, size_t count) {
+	sKernels.ulawDecode(in, out, count);
+}
+
+void AudioKernels::alawEncode(const int16_t *in, uint8_t *out, size_t count) {
+	sKernels.alawEncode(in, out, count);
+}
+
+void AudioKernels::alawDecode(const uint8_t *in, int16_t *out, size_t count) {
+	sKernels.alawDecode(in, out, count);
+}
+
+float AudioKernels::dot(const float *a, const float *b, size_t count) {
+	return sKernels.dot(a, b, count);
+}
+
+/* Blackman windowed sinc cutting at a quarter of the higher rate, normalized to a gain of 1. */
+static vector<float> makeHalfbandFilter(size_t taps) {
+	vector<double> h(taps);
+	double sum = 0;
+	double center = (taps - 1) / 2.0;
+	for (size_t n = 0; n < taps; ++n) {
+		double x = n - center;
+		double sinc = x == 0 ? 1 : sin(M_PI * x / 2) / (M_PI * x / 2);
+		double window = 0.42 - 0.5 * cos(2 * M_PI * n / (taps - 1)) + 0.08 * cos(4 * M_PI * n / (taps - 1));
+		h[n] = sinc * window;
+		sum += h[n];
+	}
+	vector<float> coefs(taps);
+	for (size_t n = 0; n < taps; ++n)
+		coefs[n] = (float)(h[n] / sum);
+	return coefs;
+}
+
+static inline int16_t toS16(float value) {
+	long sample = lrintf(value);
+	return (int16_t)(sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample);
+}
+
+HalfbandResampler::HalfbandResampler(bool up) : mUp(up), mPhase(0) {
+	vector<float> h = makeHalfbandFilter(sTaps);
+	if (up) {
+		// the zeros inserted between the samples halve the gain
+		size_t phaseTaps = sTaps / 2;
+		for (int p = 0; p < 2; ++p) {
+			mCoefs[p].resize(phaseTaps);
+			for (size_t t = 0; t < phaseTaps; ++t)
+				mCoefs[p][t] = 2 * h[2 * (phaseTaps - 1 - t) + p];
+		}
+		mHistory = phaseTaps - 1;
+	} else {
+		mCoefs[0].assign(h.rbegin(), h.rend());
+		mHistory = sTaps - 1;
+	}
+	mWindow.assign(mHistory, 0);
+}
+
+size_t HalfbandResampler::process(const int16_t *in, size_t count, int16_t *out) {
+	mWindow.resize(mHistory + count);
+	for (size_t i = 0; i < count; ++i)
+		mWindow[mHistory + i] = in[i];
+	size_t written = 0;
+	if (mUp) {
+		size_t phaseTaps = mCoefs[0].size();
+		for (size_t i = 0; i < count; ++i) {
+			const float *window = &mWindow[i];
+			out[written++] = toS16(AudioKernels::dot(window, mCoefs[0].data(), phaseTaps));
+			out[written++] = toS16(AudioKernels::dot(window, mCoefs[1].data(), phaseTaps));
+		}
+	} else {
+		size_t i = mPhase;
+		for (; i < count; i += 2)
+			out[written++] = toS16(AudioKernels::dot(&mWindow[i], mCoefs[0].data(), sTaps));
+		mPhase = i - count;
+	}
+	mWindow.erase(mWindow.begin(), mWindow.begin() + count);
+	return written;
+}
@@ -0,0 +1,71 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * The audio conversions done by the transcoder for each frame of each call: G.711 A-law and u-law to and from linear
+ * 16 bit samples, and the halving and doubling of the sample rate.
+ * The kernels are vectorized with SSE4.1 or AVX2, chosen when first used from the CPU, or with NEON when built for it.
+ * The G.711 ones give the same bytes and samples as the scalar code of mediastreamer2, whatever the instruction set.
+ */
+class AudioKernels {
+  public:
+	enum Isa { Scalar, Sse41, Avx2, Neon };
+	/* The best instruction set of this CPU, among those built in. */
+	static Isa detect();
+	static Isa getIsa();
+	/* Forces the instruction set of the kernels, for the benchmarks. The set must be supported by the CPU. */
+	static void setIsa(Isa isa);
+	static const char *getIsaName(Isa isa);
+
+	static void ulawEncode(const int16_t *in, uint8_t *out, size_t count);
+	static void ulawDecode(const uint8_t *in, int16_t *out, size_t count);
+	static void alawEncode(const int16_t *in, uint8_t *out, size_t count);
+	static void alawDecode(const uint8_t *in, int16_t *out, size_t count);
+	/* Dot product of two float arrays, count being a multiple of 8. */
+	static float dot(const float *a, const float *b, size_t count);
+};
+
+/*
+ * Halves or doubles the sample rate of a stream of 16 bit samples, with a windowed sinc low-pass filter cutting at the
+ * lower Nyquist frequency. Chaining two of them gives a ratio of 4.
+ */
+class HalfbandResampler {
+  public:
+	explicit HalfbandResampler(bool up);
+	/* Converts count samples, writing 2 * count samples to out when doubling, count / 2 when halving, plus one when a
+	 * previous call left an odd sample. Returns the number of samples written. */
+	size_t process(const int16_t *in, size_t count, int16_t *out);
+	/* Samples written for count samples in, at most. */
+	size_t maxOutput(size_t count) const {
+		return mUp ? 2 * count : count / 2 + 1;
+	}
+
+  private:
+	static const size_t sTaps = 32; // of the filter at the higher rate, both phases of 16 taps when doubling
+	bool mUp;
+	std::vector<float> mWindow; // the last input samples, followed by those being converted
+	size_t mHistory;
+	size_t mPhase; // input samples to skip before the next output when halving
+	std::vector<float> mCoefs[2]; // reversed, per phase when doubling
+};
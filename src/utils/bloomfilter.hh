@@ -0,0 +1,94 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Set of strings in a bounded memory, which can tell that a string was never added.
+ *
+ * A string sets the bits of its hashes, and may have been added only when all of them are set: the answer is never
+ * wrong for an added string, and wrong for the others at the rate the filter was sized for until more strings than
+ * expected are added. Strings cannot be removed, the filter is rebuilt instead.
+ * The hashes are seeded at random, so that the collisions cannot be chosen by the senders.
+ * Not thread-safe.
+ */
+class BloomFilter {
+  public:
+	/* Sized for the given number of strings and rate of false positives. */
+	BloomFilter(size_t expected, double falsePositiveRate = 0.01) : mCount(0) {
+		double ln2 = std::log(2.0);
+		double bits = -(double)(expected ? expected : 1) * std::log(falsePositiveRate) / (ln2 * ln2);
+		mBits.assign(((size_t)bits + 63) / 64, 0);
+		mSize = mBits.size() * 64;
+		mHashes = std::max(1, (int)std::lround(mSize * ln2 / (expected ? expected : 1)));
+		std::random_device rd;
+		mSeed = (uint64_t(rd()) << 32) ^ rd();
+	}
+
+	void add(const std::string &key) {
+		uint64_t h1 = hash(key, mSeed);
+		uint64_t h2 = hash(key, ~mSeed) | 1;
+		for (int i = 0; i < mHashes; ++i) {
+			size_t bit = (h1 + i * h2) % mSize;
+			mBits[bit / 64] |= uint64_t(1) << (bit % 64);
+		}
+		++mCount;
+	}
+
+	/* False when the key was never added. */
+	bool mayContain(const std::string &key) const {
+		uint64_t h1 = hash(key, mSeed);
+		uint64_t h2 = hash(key, ~mSeed) | 1;
+		for (int i = 0; i < mHashes; ++i) {
+			size_t bit = (h1 + i * h2) % mSize;
+			if (!(mBits[bit / 64] & (uint64_t(1) << (bit % 64))))
+				return false;
+		}
+		return true;
+	}
+
+	/* Number of additions, the strings added several times being counted each time. */
+	size_t count() const {
+		return mCount;
+	}
+
+  private:
+	static uint64_t hash(const std::string &key, uint64_t seed) {
+		// FNV-1a, seeded
+		uint64_t h = 14695981039346656037ULL ^ seed;
+		for (unsigned char c : key) {
+			h ^= c;
+			h *= 1099511628211ULL;
+		}
+		return h ^ (h >> 29);
+	}
+
+	std::vector<uint64_t> mBits;
+	size_t mSize; // in bits
+	int mHashes;
+	size_t mCount;
+	uint64_t mSeed;
+};
@@ -0,0 +1,128 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "flexisip-config.h"
+
+#include "compression.hh"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+using namespace std;
+
+// never at the start of a url, a serialized record or a log
+static const char sMarker[] = {'L', 'Z', '4', 1};
+static const char sTextMarker[] = "LZ4:1:";
+// against the corrupted values
+static const uint32_t sMaxValueSize = 64 * 1024 * 1024;
+
+bool ValueCompression::isAvailable() {
+#ifdef HAVE_LZ4
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef HAVE_LZ4
+/* The size of the value, little endian, and the compressed value, empty if it is not made shorter. */
+static string compressBlock(const string &value) {
+	int bound = LZ4_compressBound((int)value.size());
+	string block(4 + bound, '\0');
+	uint32_t size = value.size();
+	for (int i = 0; i < 4; ++i)
+		block[i] = (char)(size >> (8 * i));
+	int len = LZ4_compress_default(value.data(), &block[4], (int)value.size(), bound);
+	if (len <= 0 || 4 + (size_t)len >= value.size())
+		return string();
+	block.resize(4 + len);
+	return block;
+}
+#endif
+
+string ValueCompression::compress(const string &value, size_t threshold, const string &prefix) {
+#ifdef HAVE_LZ4
+	if (value.size() < threshold)
+		return value;
+	string block = compressBlock(value);
+	if (block.empty() || sizeof(sMarker) + prefix.size() + 1 + block.size() >= value.size())
+		return value;
+	string compressed(sMarker, sizeof(sMarker));
+	compressed += prefix;
+	compressed += '\0';
+	compressed += block;
+	return compressed;
+#else
+	return value;
+#endif
+}
+
+string ValueCompression::compressAsText(const string &value, size_t threshold) {
+#ifdef HAVE_LZ4
+	static const char sBase64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	if (value.size() < threshold)
+		return value;
+	string block = compressBlock(value);
+	if (block.empty() || sizeof(sTextMarker) - 1 + (block.size() + 2) / 3 * 4 >= value.size())
+		return value;
+	string text(sTextMarker);
+	for (size_t i = 0; i < block.size(); i += 3) {
+		uint32_t n = (uint8_t)block[i] << 16;
+		if (i + 1 < block.size())
+			n |= (uint8_t)block[i + 1] << 8;
+		if (i + 2 < block.size())
+			n |= (uint8_t)block[i + 2];
+		text += sBase64[(n >> 18) & 63];
+		text += sBase64[(n >> 12) & 63];
+		text += i + 1 < block.size() ? sBase64[(n >> 6) & 63] : '=';
+		text += i + 2 < block.size() ? sBase64[n & 63] : '=';
+	}
+	return text;
+#else
+	return value;
+#endif
+}
+
+bool ValueCompression::isCompressed(const char *data, size_t len) {
+	return len >= sizeof(sMarker) && memcmp(data, sMarker, sizeof(sMarker)) == 0;
+}
+
+bool ValueCompression::decompress(const char *data, size_t len, string &value) {
+#ifdef HAVE_LZ4
+	if (!isCompressed(data, len))
+		return false;
+	const char *end = data + len;
+	const char *block = static_cast<const char *>(memchr(data, '\0', len));
+	if (!block || end - ++block < 4)
+		return false;
+	uint32_t size = 0;
+	for (int i = 0; i < 4; ++i)
+		size |= (uint32_t)(uint8_t)block[i] << (8 * i);
+	if (size > sMaxValueSize)
+		return false;
+	value.resize(size);
+	int decompressed = LZ4_decompress_safe(block + 4, &value[0], (int)(end - block - 4), (int)size);
+	return decompressed == (int)size;
+#else
+	return false;
+#endif
+}
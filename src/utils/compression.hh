@@ -0,0 +1,41 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*
+ * LZ4 compression of the large values stored by the proxy, behind a marker giving the version of the format, so that
+ * the values stored uncompressed, which never start with it, are still read as they are.
+ * Without lz4 at build time the values are stored uncompressed and the compressed ones cannot be read.
+ */
+class ValueCompression {
+  public:
+	static bool isAvailable();
+	/* The marker, the prefix, a NUL and the compressed value, or the value itself when shorter than threshold, when
+	 * compressing does not make it shorter, or without lz4. The prefix is kept in clear for the readers which only
+	 * need a few fields of the value, it must not hold any NUL. */
+	static std::string compress(const std::string &value, size_t threshold, const std::string &prefix = "");
+	/* Same as compress() without prefix, base64 encoded behind a textual marker, for the text columns of databases. */
+	static std::string compressAsText(const std::string &value, size_t threshold);
+	static bool isCompressed(const char *data, size_t len);
+	/* The value given by compress(), false if it is corrupted or cannot be decompressed. */
+	static bool decompress(const char *data, size_t len, std::string &value);
+};
@@ -0,0 +1,132 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Consistent hash ring of weighted nodes.
+ *
+ * Each node owns weight * virtualNodes points of a 32 bits ring, placed by hashing its name, and a key belongs to the
+ * node of the first point found clockwise from the hash of the key. The points of a node do not depend on the other
+ * nodes, so adding or removing a node only moves the keys of the points it gains or loses, and skipping a node while
+ * looking up only moves its own keys, to the nodes following its points.
+ * Not thread-safe.
+ */
+template <typename _Node> class HashRing {
+  public:
+	explicit HashRing(unsigned int virtualNodes = 100) : mVirtualNodes(virtualNodes ? virtualNodes : 1) {
+	}
+
+	/* Adds a node, or replaces the node of the same name. */
+	void add(const std::string &name, const _Node &node, unsigned int weight) {
+		remove(name);
+		mNodes.push_back(Node{name, node, weight});
+		rebuild();
+	}
+
+	bool remove(const std::string &name) {
+		for (auto it = mNodes.begin(); it != mNodes.end(); ++it) {
+			if (it->name == name) {
+				mNodes.erase(it);
+				rebuild();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void clear() {
+		mNodes.clear();
+		mPoints.clear();
+	}
+
+	/* Node of the key, skipping the nodes for which accept(node) is false. NULL if none is accepted. */
+	template <typename _Pred> const _Node *find(uint32_t key, _Pred accept) const {
+		if (mPoints.empty())
+			return NULL;
+		auto it = std::lower_bound(mPoints.begin(), mPoints.end(), mix(key),
+								   [](const Point &point, uint32_t h) { return point.first < h; });
+		for (size_t i = 0; i < mPoints.size(); ++i, ++it) {
+			if (it == mPoints.end())
+				it = mPoints.begin();
+			const Node &node = mNodes[it->second];
+			if (accept(node.value))
+				return &node.value;
+		}
+		return NULL;
+	}
+
+	const _Node *find(uint32_t key) const {
+		return find(key, [](const _Node &) { return true; });
+	}
+
+	size_t size() const {
+		return mNodes.size();
+	}
+
+	/* FNV-1a, which places the points of a node the same way on every platform. */
+	static uint32_t hash(const std::string &str) {
+		uint32_t h = 2166136261u;
+		for (unsigned char c : str) {
+			h ^= c;
+			h *= 16777619u;
+		}
+		return mix(h);
+	}
+
+  private:
+	struct Node {
+		std::string name;
+		_Node value;
+		unsigned int weight;
+	};
+	typedef std::pair<uint32_t, size_t> Point; // hash, index of the node
+
+	/* Finalizer of MurmurHash3, spreading keys whose hashes are poorly distributed. */
+	static uint32_t mix(uint32_t h) {
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35u;
+		h ^= h >> 16;
+		return h;
+	}
+
+	void rebuild() {
+		mPoints.clear();
+		for (size_t n = 0; n < mNodes.size(); ++n) {
+			unsigned int count = mNodes[n].weight * mVirtualNodes;
+			for (unsigned int i = 0; i < count; ++i)
+				mPoints.push_back(Point(hash(mNodes[n].name + "#" + std::to_string(i)), n));
+		}
+		// ties are broken by name, so that the ring does not depend on the order of insertion
+		std::sort(mPoints.begin(), mPoints.end(), [this](const Point &a, const Point &b) {
+			return a.first != b.first ? a.first < b.first : mNodes[a.second].name < mNodes[b.second].name;
+		});
+	}
+
+	unsigned int mVirtualNodes;
+	std::vector<Node> mNodes;
+	std::vector<Point> mPoints;
+};
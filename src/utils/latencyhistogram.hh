@@ -0,0 +1,76 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+/**
+ * @brief Histogram of durations in microseconds, with power of two buckets up to about 16 seconds.
+ *
+ * Percentiles are interpolated within their bucket. Once the histogram holds sMaxSamples samples, all the buckets are
+ * halved, so that the percentiles follow the recent durations rather than those since the start.
+ * Not thread-safe.
+ */
+class LatencyHistogram {
+  public:
+	LatencyHistogram() : mBuckets(), mCount(0) {
+	}
+
+	void record(uint64_t us) {
+		int i = 0;
+		while (i < sBuckets - 1 && (uint64_t(1) << i) <= us)
+			++i;
+		++mBuckets[i];
+		if (++mCount >= sMaxSamples) {
+			mCount = 0;
+			for (int j = 0; j < sBuckets; ++j) {
+				mBuckets[j] /= 2;
+				mCount += mBuckets[j];
+			}
+		}
+	}
+
+	/* Duration below which the given fraction (between 0 and 1) of the samples are, 0 when there is none. */
+	uint64_t percentile(double fraction) const {
+		if (mCount == 0)
+			return 0;
+		double rank = fraction * mCount;
+		uint64_t below = 0;
+		for (int i = 0; i < sBuckets; ++i) {
+			if (below + mBuckets[i] >= rank && mBuckets[i] > 0) {
+				// bucket i holds the durations from 2^(i-1) to 2^i, the first one those below 1
+				uint64_t low = i == 0 ? 0 : uint64_t(1) << (i - 1);
+				uint64_t high = uint64_t(1) << i;
+				return low + uint64_t((high - low) * (rank - below) / mBuckets[i]);
+			}
+			below += mBuckets[i];
+		}
+		return uint64_t(1) << (sBuckets - 1);
+	}
+
+	uint64_t size() const {
+		return mCount;
+	}
+
+  private:
+	static const int sBuckets = 25;
+	static const uint64_t sMaxSamples = 1 << 16;
+	uint64_t mBuckets[sBuckets];
+	uint64_t mCount;
+};
@@ -0,0 +1,485 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "linearregex.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+struct LinearRegex::Node {
+	enum Type { Empty, Chars, Concatenation, Alternation, Repetition, LineStart, LineEnd };
+	Type type;
+	CharSet chars;
+	vector<Node> children;
+	int min, max; // of a repetition, max being -1 when not bounded
+
+	Node() : type(Empty), min(0), max(0) {
+	}
+};
+
+/*
+ * Parser of the POSIX extended syntax, as read by regcomp() with REG_EXTENDED and without REG_NEWLINE: the dot and the
+ * negated brackets match the newlines, ^ and $ only match at the ends of the input, and are only supported at the ends
+ * of the pattern.
+ */
+class LinearRegex::Parser {
+  public:
+	Parser(const string &pattern) : mPattern(pattern), mPos(0) {
+	}
+
+	bool parse(Node &node, string &error) {
+		bool ok = parseAlternation(node);
+		if (ok && mPos < mPattern.size())
+			ok = fail("unmatched )");
+		if (!ok)
+			error = mError;
+		return ok;
+	}
+
+  private:
+	bool fail(const string &error) {
+		mError = error;
+		return false;
+	}
+	bool atEnd() const {
+		return mPos >= mPattern.size();
+	}
+	char peek() const {
+		return mPattern[mPos];
+	}
+
+	bool parseAlternation(Node &node) {
+		if (!parseConcatenation(node))
+			return false;
+		if (atEnd() || peek() != '|')
+			return true;
+		Node first;
+		swap(first, node);
+		node.type = Node::Alternation;
+		node.children.push_back(first);
+		while (!atEnd() && peek() == '|') {
+			++mPos;
+			node.children.push_back(Node());
+			if (!parseConcatenation(node.children.back()))
+				return false;
+		}
+		return true;
+	}
+
+	bool parseConcatenation(Node &node) {
+		Node concatenation;
+		concatenation.type = Node::Concatenation;
+		while (!atEnd() && peek() != '|' && peek() != ')') {
+			concatenation.children.push_back(Node());
+			if (!parseRepetition(concatenation.children.back()))
+				return false;
+		}
+		if (concatenation.children.size() == 1)
+			swap(node, concatenation.children.front());
+		else if (!concatenation.children.empty())
+			swap(node, concatenation);
+		else
+			node = Node();
+		return true;
+	}
+
+	bool parseRepetition(Node &node) {
+		if (!parseAtom(node))
+			return false;
+		while (!atEnd() && strchr("*+?{", peek())) {
+			if (node.type == Node::LineStart || node.type == Node::LineEnd)
+				return fail("repeated anchor");
+			int min = 0, max = -1;
+			char c = peek();
+			if (c == '+')
+				min = 1;
+			else if (c == '?')
+				max = 1;
+			else if (c == '{' && !parseInterval(min, max))
+				return false;
+			if (c != '{')
+				++mPos;
+			Node repetition;
+			repetition.type = Node::Repetition;
+			repetition.min = min;
+			repetition.max = max;
+			repetition.children.push_back(Node());
+			swap(repetition.children.front(), node);
+			swap(node, repetition);
+		}
+		return true;
+	}
+
+	bool parseNumber(int &number) {
+		size_t start = mPos;
+		number = 0;
+		while (!atEnd() && isdigit((unsigned char)peek()) && number <= 0xffff)
+			number = number * 10 + (mPattern[mPos++] - '0');
+		return mPos > start;
+	}
+
+	bool parseInterval(int &min, int &max) {
+		++mPos;
+		if (!parseNumber(min))
+			return fail("invalid interval");
+		max = min;
+		if (!atEnd() && peek() == ',') {
+			++mPos;
+			if (!parseNumber(max))
+				max = -1;
+		}
+		if (atEnd() || peek() != '}' || (max >= 0 && max < min))
+			return fail("invalid interval");
+		++mPos;
+		return true;
+	}
+
+	bool parseAtom(Node &node) {
+		char c = mPattern[mPos++];
+		node.type = Node::Chars;
+		switch (c) {
+			case '(':
+				if (!parseAlternation(node))
+					return false;
+				if (atEnd() || peek() != ')')
+					return fail("unmatched (");
+				++mPos;
+				return true;
+			case '.':
+				node.chars.set();
+				node.chars.reset(0);
+				return true;
+			case '[':
+				return parseBracket(node.chars);
+			// regexec() matches the anchors inside the pattern around the newlines of the input too
+			case '^':
+				if (mPos != 1)
+					return fail("^ inside the pattern");
+				node.type = Node::LineStart;
+				return true;
+			case '$':
+				if (mPos != mPattern.size())
+					return fail("$ inside the pattern");
+				node.type = Node::LineEnd;
+				return true;
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+				return fail("repetition without operand");
+			case '\\':
+				if (atEnd())
+					return fail("trailing backslash");
+				return parseEscape(mPattern[mPos++], node.chars);
+			default:
+				node.chars.set((unsigned char)c);
+				return true;
+		}
+	}
+
+	bool parseEscape(char c, CharSet &chars) {
+		switch (c) {
+			case 'w':
+			case 'W':
+				for (int i = 0; i < 256; ++i)
+					chars.set(i, isalnum(i) || i == '_');
+				break;
+			case 's':
+			case 'S':
+				for (int i = 0; i < 256; ++i)
+					chars.set(i, isspace(i) != 0);
+				break;
+			default:
+				// back-references, word boundaries and the like
+				if (isalnum((unsigned char)c))
+					return fail(string("unsupported escape \\") + c);
+				chars.set((unsigned char)c);
+				return true;
+		}
+		if (isupper((unsigned char)c))
+			chars.flip();
+		return true;
+	}
+
+	bool parseClass(CharSet &chars) {
+		size_t end = mPattern.find(":]", mPos + 2);
+		if (end == string::npos)
+			return fail("unmatched [:");
+		string name = mPattern.substr(mPos + 2, end - mPos - 2);
+		static const struct {
+			const char *name;
+			int (*is)(int);
+		} sClasses[] = {{"alpha", isalpha}, {"digit", isdigit},   {"alnum", isalnum}, {"upper", isupper},
+						{"lower", islower}, {"space", isspace},   {"blank", isblank}, {"punct", ispunct},
+						{"print", isprint}, {"graph", isgraph},   {"cntrl", iscntrl}, {"xdigit", isxdigit}};
+		for (const auto &cls : sClasses) {
+			if (name == cls.name) {
+				for (int i = 0; i < 256; ++i) {
+					if (cls.is(i))
+						chars.set(i);
+				}
+				mPos = end + 2;
+				return true;
+			}
+		}
+		return fail("unknown class [:" + name + ":]");
+	}
+
+	bool parseBracket(CharSet &chars) {
+		bool negated = !atEnd() && peek() == '^';
+		if (negated)
+			++mPos;
+		for (bool first = true;; first = false) {
+			if (atEnd())
+				return fail("unmatched [");
+			unsigned char c = peek();
+			if (c == ']' && !first) {
+				++mPos;
+				break;
+			}
+			if (c == '[' && mPos + 1 < mPattern.size() && strchr(":.=", mPattern[mPos + 1])) {
+				if (mPattern[mPos + 1] != ':')
+					return fail("unsupported collating element");
+				if (!parseClass(chars))
+					return false;
+				continue;
+			}
+			++mPos;
+			if (mPos + 1 < mPattern.size() && peek() == '-' && mPattern[mPos + 1] != ']') {
+				unsigned char last = mPattern[mPos + 1];
+				if (last == '[' || last < c)
+					return fail("unsupported range");
+				for (int i = c; i <= last; ++i)
+					chars.set(i);
+				mPos += 2;
+			} else {
+				chars.set(c);
+			}
+		}
+		if (negated) {
+			chars.flip();
+			chars.reset(0);
+		}
+		return true;
+	}
+
+	const string &mPattern;
+	size_t mPos;
+	string mError;
+};
+
+LinearRegex::LinearRegex() : mGeneration(0) {
+}
+
+bool LinearRegex::compile(const string &pattern, string &error) {
+	mProgram.clear();
+	mSets.clear();
+	Node root;
+	if (!Parser(pattern).parse(root, error))
+		return false;
+	if (!emit(root)) {
+		mProgram.clear();
+		error = "pattern too large";
+		return false;
+	}
+	addInstruction(Match);
+	mVisited.assign(mProgram.size(), 0);
+	mGeneration = 0;
+	clearStates();
+	return true;
+}
+
+int LinearRegex::addInstruction(Opcode op, int x, int y) {
+	Instruction instruction;
+	instruction.op = op;
+	instruction.x = x;
+	instruction.y = y;
+	mProgram.push_back(instruction);
+	return mProgram.size() - 1;
+}
+
+bool LinearRegex::emit(const Node &node) {
+	if (mProgram.size() > sMaxInstructions)
+		return false;
+	switch (node.type) {
+		case Node::Empty:
+			break;
+		case Node::Chars:
+			mSets.push_back(node.chars);
+			addInstruction(Char, mSets.size() - 1);
+			break;
+		case Node::LineStart:
+			addInstruction(LineStart);
+			break;
+		case Node::LineEnd:
+			addInstruction(LineEnd);
+			break;
+		case Node::Concatenation:
+			for (const auto &child : node.children) {
+				if (!emit(child))
+					return false;
+			}
+			break;
+		case Node::Alternation: {
+			vector<int> jumps;
+			for (size_t i = 0; i + 1 < node.children.size(); ++i) {
+				int split = addInstruction(Split, mProgram.size() + 1);
+				if (!emit(node.children[i]))
+					return false;
+				jumps.push_back(addInstruction(Jump));
+				mProgram[split].y = mProgram.size();
+			}
+			if (!emit(node.children.back()))
+				return false;
+			for (int jump : jumps)
+				mProgram[jump].x = mProgram.size();
+			break;
+		}
+		case Node::Repetition: {
+			const Node &child = node.children.front();
+			for (int i = 0; i < node.min; ++i) {
+				if (!emit(child))
+					return false;
+			}
+			if (node.max < 0) {
+				int split = addInstruction(Split, mProgram.size() + 1);
+				if (!emit(child))
+					return false;
+				addInstruction(Jump, split);
+				mProgram[split].y = mProgram.size();
+				break;
+			}
+			vector<int> splits;
+			for (int i = node.min; i < node.max; ++i) {
+				splits.push_back(addInstruction(Split, mProgram.size() + 1));
+				if (!emit(child))
+					return false;
+			}
+			for (int split : splits)
+				mProgram[split].y = mProgram.size();
+			break;
+		}
+	}
+	return mProgram.size() <= sMaxInstructions;
+}
+
+bool LinearRegex::closure(const Threads &threads, bool atStart, bool atEnd, vector<int> *chars) {
+	if (++mGeneration == 0) {
+		fill(mVisited.begin(), mVisited.end(), 0);
+		mGeneration = 1;
+	}
+	bool matches = false;
+	vector<int> pending(threads);
+	while (!pending.empty()) {
+		int pc = pending.back();
+		pending.pop_back();
+		if (mVisited[pc] == mGeneration)
+			continue;
+		mVisited[pc] = mGeneration;
+		const Instruction &instruction = mProgram[pc];
+		switch (instruction.op) {
+			case Char:
+				if (chars)
+					chars->push_back(pc);
+				break;
+			case Split:
+				pending.push_back(instruction.y);
+				pending.push_back(instruction.x);
+				break;
+			case Jump:
+				pending.push_back(instruction.x);
+				break;
+			case LineStart:
+				if (atStart)
+					pending.push_back(pc + 1);
+				break;
+			case LineEnd:
+				if (atEnd)
+					pending.push_back(pc + 1);
+				break;
+			case Match:
+				matches = true;
+				break;
+		}
+	}
+	if (chars)
+		sort(chars->begin(), chars->end());
+	return matches;
+}
+
+int LinearRegex::addState(const Threads &threads, bool atStart) {
+	State state;
+	state.threads = threads;
+	state.matches = closure(threads, atStart, false, &state.chars);
+	state.matchesAtEnd = state.matches || closure(threads, atStart, true, NULL);
+	mStates.push_back(move(state));
+	mTransitions.resize(mStates.size() * 256, -1);
+	int id = mStates.size() - 1;
+	if (!atStart)
+		mStateIds[threads] = id;
+	return id;
+}
+
+void LinearRegex::clearStates() {
+	mStates.clear();
+	mStateIds.clear();
+	mTransitions.clear();
+	addState(Threads(1, 0), true);
+}
+
+int LinearRegex::step(int state, unsigned char c) {
+	Threads threads;
+	for (int pc : mStates[state].chars) {
+		if (mSets[mProgram[pc].x].test(c))
+			threads.push_back(pc + 1);
+	}
+	// the search goes on from each position of the input
+	threads.push_back(0);
+	sort(threads.begin(), threads.end());
+	threads.erase(unique(threads.begin(), threads.end()), threads.end());
+	int next;
+	auto it = mStateIds.find(threads);
+	if (it != mStateIds.end()) {
+		next = it->second;
+	} else if (mStates.size() >= sMaxStates) {
+		// the current state is dropped along with the others, the transition not being cached
+		clearStates();
+		return addState(threads, false);
+	} else {
+		next = addState(threads, false);
+	}
+	mTransitions[state * 256 + c] = next;
+	return next;
+}
+
+bool LinearRegex::search(const char *input, size_t length) {
+	if (mProgram.empty())
+		return false;
+	int state = 0;
+	for (size_t i = 0; i < length; ++i) {
+		if (mStates[state].matches)
+			return true;
+		unsigned char c = input[i];
+		int next = mTransitions[state * 256 + c];
+		state = next >= 0 ? next : step(state, c);
+	}
+	return mStates[state].matchesAtEnd;
+}
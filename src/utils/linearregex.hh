@@ -0,0 +1,83 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <bitset>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * POSIX extended regular expression matched in a time linear in the length of the input, whatever the pattern: the
+ * pattern is compiled into an automaton whose states are all followed at once (Thompson's construction), the sets of
+ * states met being cached as the states of a deterministic automaton built along the matches. It only tells whether
+ * the pattern matches somewhere in the input, as regexec() with REG_NOSUB.
+ * The back-references, the word boundaries and the collating elements cannot be matched this way: compile() rejects
+ * them, the caller falling back to regcomp(). Bytes are matched, not multibyte characters.
+ * A LinearRegex is not thread-safe, its cache being filled by the matches.
+ */
+class LinearRegex {
+  public:
+	LinearRegex();
+
+	/* Returns false with an error for the patterns that are invalid or not supported. */
+	bool compile(const std::string &pattern, std::string &error);
+	/* Whether the pattern matches somewhere in the input. */
+	bool search(const char *input, size_t length);
+	bool search(const std::string &input) {
+		return search(input.data(), input.size());
+	}
+
+  private:
+	typedef std::bitset<256> CharSet;
+	enum Opcode { Char, Split, Jump, LineStart, LineEnd, Match };
+	struct Instruction {
+		Opcode op;
+		int x, y; // index of the set of a char, targets of a split or of a jump
+	};
+	struct Node;
+	class Parser;
+	/* Instructions reached after a char is consumed, sorted, before the ones not consuming any are followed. */
+	typedef std::vector<int> Threads;
+	struct State {
+		Threads threads;
+		std::vector<int> chars; // instructions consuming a char once the others are followed
+		bool matches;			// before the end of the input
+		bool matchesAtEnd;
+	};
+
+	bool emit(const Node &node);
+	int addInstruction(Opcode op, int x = 0, int y = 0);
+	/* Follows the instructions not consuming a char from the threads, filling the ones consuming a char. Returns
+	 * whether the match is reached. */
+	bool closure(const Threads &threads, bool atStart, bool atEnd, std::vector<int> *chars);
+	int addState(const Threads &threads, bool atStart);
+	int step(int state, unsigned char c);
+	void clearStates();
+
+	std::vector<Instruction> mProgram;
+	std::vector<CharSet> mSets;
+	std::vector<State> mStates; // the first one being the start of the input
+	std::map<Threads, int> mStateIds;
+	std::vector<int> mTransitions; // 256 per state, the next state on each byte, -1 when not computed yet
+	std::vector<unsigned> mVisited; // generation of the last visit of each instruction by closure()
+	unsigned mGeneration;
+	static const size_t sMaxInstructions = 20000;
+	static const size_t sMaxStates = 1000; // the cache being cleared when full
+};
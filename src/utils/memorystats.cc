@@ -0,0 +1,75 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifdef HAVE_CONFIG_H
+#include "flexisip-config.h"
+#endif
+#include "memorystats.hh"
+
+#ifdef HAVE_JEMALLOC
+#include <jemalloc/jemalloc.h>
+#endif
+
+using namespace std;
+
+atomic<uint64_t> ObjectCounter::sCounts[TypeCount];
+
+const char *ObjectCounter::getName(Type type) {
+	static const char *sNames[TypeCount] = {"records",		 "contacts",		"fork-contexts", "fork-message-contexts",
+											"call-contexts", "relay-sessions", "presentities"};
+	return sNames[type];
+}
+
+#ifdef HAVE_JEMALLOC
+
+bool HeapStats::enabled() {
+	return true;
+}
+
+bool HeapStats::read() {
+	// the statistics are a snapshot taken when the epoch is advanced
+	uint64_t epoch = 1;
+	size_t size = sizeof(epoch);
+	if (mallctl("epoch", &epoch, &size, &epoch, sizeof(epoch)) != 0)
+		return false;
+	size_t value;
+	size = sizeof(value);
+	if (mallctl("stats.allocated", &value, &size, NULL, 0) != 0)
+		return false;
+	allocated = value;
+	if (mallctl("stats.active", &value, &size, NULL, 0) != 0)
+		return false;
+	active = value;
+	if (mallctl("stats.resident", &value, &size, NULL, 0) != 0)
+		return false;
+	resident = value;
+	return true;
+}
+
+#else
+
+bool HeapStats::enabled() {
+	return false;
+}
+
+bool HeapStats::read() {
+	return false;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Live objects of the long-lived types, to tell which subsystem holds the memory and to spot a leak, such as
+ * fork contexts piling up, without valgrind.
+ *
+ * The objects are counted by their constructors and destructors: the count is right whatever their allocation,
+ * std::make_shared() included. A type is counted by deriving from CountedObject<ObjectCounter::Type>.
+ */
+class ObjectCounter {
+  public:
+	enum Type {
+		Records,
+		Contacts,
+		ForkContexts,
+		ForkMessageContexts,
+		CallContexts,
+		RelaySessions,
+		Presentities,
+		TypeCount
+	};
+
+	static uint64_t get(Type type) {
+		return sCounts[type].load(std::memory_order_relaxed);
+	}
+	/* As used in the names of the statistics, such as fork-contexts. */
+	static const char *getName(Type type);
+
+  private:
+	template <Type _Type> friend class CountedObject;
+	// relaxed atomics, the relay sessions being destroyed from the relay thread
+	static std::atomic<uint64_t> sCounts[TypeCount];
+};
+
+template <ObjectCounter::Type _Type> class CountedObject {
+  protected:
+	CountedObject() {
+		ObjectCounter::sCounts[_Type].fetch_add(1, std::memory_order_relaxed);
+	}
+	CountedObject(const CountedObject &) {
+		ObjectCounter::sCounts[_Type].fetch_add(1, std::memory_order_relaxed);
+	}
+	~CountedObject() {
+		ObjectCounter::sCounts[_Type].fetch_sub(1, std::memory_order_relaxed);
+	}
+};
+
+/**
+ * @brief Statistics of the heap, only available when built with jemalloc (ENABLE_JEMALLOC): read() returns false
+ * otherwise.
+ */
+class HeapStats {
+  public:
+	uint64_t allocated; // bytes allocated by the application
+	uint64_t active;	// bytes of the pages holding allocations
+	uint64_t resident;	// bytes of the pages mapped in memory, the allocator metadata included
+
+	static bool enabled();
+	bool read();
+};
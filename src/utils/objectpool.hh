@@ -0,0 +1,100 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+
+/**
+ * @brief Allocator recycling the memory of the objects of a type, for those created and destroyed for each message or
+ * each call.
+ *
+ * Freed blocks are kept in a free list of the thread freeing them, up to sMaxFree blocks, and reused by the following
+ * allocations of that thread. Blocks migrate between threads when an object is freed by another thread than the one
+ * that allocated it, which needs no locking. Only single objects are pooled: arrays go to the heap.
+ * Meant for std::allocate_shared(), so that the control block and the object share the pooled block:
+ *   auto ms = std::allocate_shared<MsgSip>(PoolAllocator<MsgSip>(), msg);
+ */
+template <typename _Type> class PoolAllocator {
+  public:
+	typedef _Type value_type;
+
+	PoolAllocator() {
+	}
+	template <typename _Other> PoolAllocator(const PoolAllocator<_Other> &) {
+	}
+
+	_Type *allocate(size_t n) {
+		if (n != 1)
+			return static_cast<_Type *>(::operator new(n * sizeof(_Type)));
+		FreeList &list = freeList();
+		if (list.head) {
+			Block *block = list.head;
+			list.head = block->next;
+			--list.size;
+			return reinterpret_cast<_Type *>(block);
+		}
+		return static_cast<_Type *>(::operator new(sizeof(Slot)));
+	}
+
+	void deallocate(_Type *p, size_t n) {
+		if (n != 1) {
+			::operator delete(p);
+			return;
+		}
+		FreeList &list = freeList();
+		if (list.size >= sMaxFree) {
+			::operator delete(p);
+			return;
+		}
+		Block *block = reinterpret_cast<Block *>(p);
+		block->next = list.head;
+		list.head = block;
+		++list.size;
+	}
+
+	template <typename _Other> bool operator==(const PoolAllocator<_Other> &) const {
+		return true;
+	}
+	template <typename _Other> bool operator!=(const PoolAllocator<_Other> &) const {
+		return false;
+	}
+
+  private:
+	struct Block {
+		Block *next;
+	};
+	union Slot {
+		Block block;
+		typename std::aligned_storage<sizeof(_Type), alignof(_Type)>::type object;
+	};
+	// trivially destructible, so that objects freed during the exit, after the thread local destructors, can still
+	// use it; the free blocks of a thread are not given back when it ends, the threads living as long as the process
+	struct FreeList {
+		Block *head;
+		size_t size;
+	};
+	static FreeList &freeList() {
+		static thread_local FreeList list = {nullptr, 0};
+		return list;
+	}
+
+	static const size_t sMaxFree = 1024;
+};
@@ -0,0 +1,106 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "portallocator.hh"
+
+using namespace std;
+
+PortAllocator::PortAllocator(int minPort, int maxPort) : mUsed(0), mCursor(0) {
+	mMinPort = (minPort + 1) & ~1;
+	mCapacity = maxPort > mMinPort ? (maxPort - mMinPort + 1) / 2 : 0;
+	size_t words = (mCapacity + 63) / 64;
+	mPairs.assign(words, 0);
+	mFreeWords.assign((words + 63) / 64, 0);
+	for (size_t w = 0; w < words; ++w)
+		mFreeWords[w / 64] |= 1ULL << (w % 64);
+	// the pairs past the capacity in the last word are never free
+	if (mCapacity % 64)
+		mPairs[words - 1] = ~0ULL << (mCapacity % 64);
+}
+
+void PortAllocator::setUsed(size_t pair) {
+	size_t w = pair / 64;
+	mPairs[w] |= 1ULL << (pair % 64);
+	if (mPairs[w] == ~0ULL)
+		mFreeWords[w / 64] &= ~(1ULL << (w % 64));
+	++mUsed;
+}
+
+void PortAllocator::setFree(size_t pair) {
+	size_t w = pair / 64;
+	mPairs[w] &= ~(1ULL << (pair % 64));
+	mFreeWords[w / 64] |= 1ULL << (w % 64);
+	--mUsed;
+}
+
+int PortAllocator::allocate() {
+	lock_guard<mutex> lock(mMutex);
+	if (mUsed == mCapacity)
+		return -1;
+	size_t words = mPairs.size();
+	size_t start = mCursor / 64;
+	// the word of the cursor, from the cursor only
+	uint64_t free = ~mPairs[start] & (~0ULL << (mCursor % 64));
+	size_t w = start;
+	if (free == 0) {
+		// the next word with a free pair, wrapping around to the word of the cursor
+		size_t summaries = mFreeWords.size();
+		size_t from = (start + 1) % words;
+		w = words;
+		for (size_t k = 0; k <= summaries && w == words; ++k) {
+			size_t s = (from / 64 + k) % summaries;
+			uint64_t bits = mFreeWords[s];
+			if (k == 0)
+				bits &= ~0ULL << (from % 64);
+			if (bits)
+				w = s * 64 + __builtin_ctzll(bits);
+		}
+		if (w == words)
+			return -1;
+		free = ~mPairs[w];
+	}
+	size_t pair = w * 64 + __builtin_ctzll(free);
+	setUsed(pair);
+	mCursor = (pair + 1) % mCapacity;
+	return mMinPort + (int)pair * 2;
+}
+
+bool PortAllocator::reserve(int port) {
+	if (!isInRange(port))
+		return false;
+	size_t pair = (port - mMinPort) / 2;
+	lock_guard<mutex> lock(mMutex);
+	if (mPairs[pair / 64] & (1ULL << (pair % 64)))
+		return false;
+	setUsed(pair);
+	return true;
+}
+
+void PortAllocator::release(int port) {
+	if (!isInRange(port))
+		return;
+	size_t pair = (port - mMinPort) / 2;
+	lock_guard<mutex> lock(mMutex);
+	if (mPairs[pair / 64] & (1ULL << (pair % 64)))
+		setFree(pair);
+}
+
+size_t PortAllocator::getUsed() const {
+	lock_guard<mutex> lock(mMutex);
+	return mUsed;
+}
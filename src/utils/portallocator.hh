@@ -0,0 +1,61 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+ * Allocates the pairs of ports of a range, an even RTP port and the next one for RTCP, from a bitmap of the pairs in
+ * use. A second bitmap tells which words of the first have a free pair, so that the next free pair is found with a
+ * few bit scans whatever the occupancy, rather than by trying to bind random ports. Thread safe.
+ */
+class PortAllocator {
+  public:
+	/* The pairs whose both ports are within [minPort, maxPort]. */
+	PortAllocator(int minPort, int maxPort);
+	/* The RTP port of the next free pair after the last one allocated, or -1 if all are in use. */
+	int allocate();
+	/* Marks the pair of port as in use, for ports chosen elsewhere. Returns false if it already was, or is out of the
+	 * range. */
+	bool reserve(int port);
+	/* Gives the pair of port back. Ports out of the range are ignored. */
+	void release(int port);
+	size_t getCapacity() const {
+		return mCapacity;
+	}
+	size_t getUsed() const;
+
+  private:
+	bool isInRange(int port) const {
+		return port >= mMinPort && (port & 1) == 0 && (size_t)(port - mMinPort) / 2 < mCapacity;
+	}
+	void setUsed(size_t pair);
+	void setFree(size_t pair);
+
+	mutable std::mutex mMutex;
+	int mMinPort; // rounded up to an even port
+	size_t mCapacity;
+	size_t mUsed;
+	size_t mCursor; // pair to start the next search from, so that a released port is not given again at once
+	std::vector<uint64_t> mPairs; // a bit set per pair in use
+	std::vector<uint64_t> mFreeWords; // a bit set per word of mPairs with a free pair
+};
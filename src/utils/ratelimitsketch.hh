@@ -0,0 +1,102 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/**
+ * @brief Token buckets for an unbounded set of keys in a bounded memory: a count-min sketch of leaky buckets.
+ *
+ * Each key maps to one cell of each row. A cell holds the level of a bucket that drains at the given rate, and the
+ * level of a key is the lowest of its cells: colliding keys can only make a key look busier than it is, never less.
+ * Only the cells at that lowest level are raised (conservative update), which limits the overestimation.
+ * The hashes are seeded at random, so that the collisions cannot be chosen by the senders.
+ * Not thread-safe.
+ */
+class RateLimitSketch {
+  public:
+	/* Allows rate tokens per second, and burst tokens at once. */
+	RateLimitSketch(double rate, double burst, size_t width = 8192, size_t depth = 4)
+		: mRate(rate / 1000), mBurst(burst), mWidth(width), mDepth(depth), mCells(width * depth) {
+		std::random_device rd;
+		mSeed = (uint64_t(rd()) << 32) ^ rd();
+	}
+
+	/* Takes a token from the bucket of the key at the given time in milliseconds, false when it is empty. */
+	bool take(const void *key, size_t len, uint64_t nowMs) {
+		uint64_t h1 = hash(key, len, mSeed);
+		uint64_t h2 = hash(key, len, ~mSeed) | 1;
+		uint32_t now = (uint32_t)nowMs;
+		float lowest = mBurst;
+		for (size_t row = 0; row < mDepth; ++row) {
+			Cell &cell = cellOf(row, h1, h2);
+			// unsigned difference, used for the wraparound of the 32 bits timestamps
+			double level = cell.level - (uint32_t)(now - cell.last) * mRate;
+			cell.level = level > 0 ? (float)level : 0;
+			cell.last = now;
+			if (cell.level < lowest)
+				lowest = cell.level;
+		}
+		if (lowest + 1 > mBurst)
+			return false;
+		for (size_t row = 0; row < mDepth; ++row) {
+			Cell &cell = cellOf(row, h1, h2);
+			if (cell.level < lowest + 1)
+				cell.level = lowest + 1;
+		}
+		return true;
+	}
+
+	/* Seconds until the bucket of an empty key has a token again, rounded up. */
+	unsigned int retryAfter() const {
+		return mRate > 0 ? (unsigned int)(1 / (mRate * 1000)) + 1 : 1;
+	}
+
+  private:
+	struct Cell {
+		float level;
+		uint32_t last;
+	};
+
+	Cell &cellOf(size_t row, uint64_t h1, uint64_t h2) {
+		// double hashing gives the depth independent indexes out of two hashes
+		return mCells[row * mWidth + (h1 + row * h2) % mWidth];
+	}
+
+	static uint64_t hash(const void *key, size_t len, uint64_t seed) {
+		// FNV-1a, seeded
+		const uint8_t *bytes = (const uint8_t *)key;
+		uint64_t h = 14695981039346656037ULL ^ seed;
+		for (size_t i = 0; i < len; ++i) {
+			h ^= bytes[i];
+			h *= 1099511628211ULL;
+		}
+		return h ^ (h >> 29);
+	}
+
+	double mRate; // per millisecond
+	float mBurst;
+	size_t mWidth;
+	size_t mDepth;
+	std::vector<Cell> mCells;
+	uint64_t mSeed;
+};
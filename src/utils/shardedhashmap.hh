@@ -0,0 +1,233 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Hash table split in independent shards, each one being an open-addressing (linear probing) table protected
+ * by its own mutex.
+ *
+ * Operations only lock the shard owning the key, and whole-table operations (size(), forEach(), eraseIf()) lock the
+ * shards one after another, so that a long sweep never blocks the entire table.
+ * Values are returned by copy: store pointers or small values.
+ */
+template <typename _Key, typename _Value, typename _Hash = std::hash<_Key>> class ShardedHashMap {
+  public:
+	explicit ShardedHashMap(unsigned int shardBits = 4) : mShardBits(shardBits) {
+		for (size_t i = 0; i < (size_t(1) << mShardBits); ++i) {
+			mShards.push_back(std::unique_ptr<Shard>(new Shard()));
+		}
+	}
+
+	bool find(const _Key &key, _Value &value) const {
+		uint64_t h = mHash(key);
+		Shard &shard = shardFor(h);
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		size_t pos = shard.findSlot(key, h);
+		if (pos == Shard::npos)
+			return false;
+		value = shard.mSlots[pos].value;
+		return true;
+	}
+
+	bool contains(const _Key &key) const {
+		uint64_t h = mHash(key);
+		Shard &shard = shardFor(h);
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		return shard.findSlot(key, h) != Shard::npos;
+	}
+
+	/* Inserts the value, or replaces the existing one. Returns true if the key was not present. */
+	bool set(const _Key &key, const _Value &value) {
+		uint64_t h = mHash(key);
+		Shard &shard = shardFor(h);
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		return shard.set(key, h, value);
+	}
+
+	bool erase(const _Key &key) {
+		_Value unused;
+		return erase(key, unused);
+	}
+
+	/* Removes the key and gives back the value it was associated with. */
+	bool erase(const _Key &key, _Value &oldValue) {
+		uint64_t h = mHash(key);
+		Shard &shard = shardFor(h);
+		std::lock_guard<std::mutex> lock(shard.mMutex);
+		size_t pos = shard.findSlot(key, h);
+		if (pos == Shard::npos)
+			return false;
+		oldValue = shard.mSlots[pos].value;
+		shard.eraseSlot(pos);
+		return true;
+	}
+
+	size_t size() const {
+		size_t count = 0;
+		for (auto &shard : mShards) {
+			std::lock_guard<std::mutex> lock(shard->mMutex);
+			count += shard->mCount;
+		}
+		return count;
+	}
+
+	void clear() {
+		for (auto &shard : mShards) {
+			std::lock_guard<std::mutex> lock(shard->mMutex);
+			shard->mSlots.clear();
+			shard->mCount = 0;
+			shard->mUsed = 0;
+		}
+	}
+
+	/* Calls fn(key, value) for every element. fn must not access the map. */
+	template <typename _Fn> void forEach(_Fn fn) const {
+		for (auto &shard : mShards) {
+			std::lock_guard<std::mutex> lock(shard->mMutex);
+			for (auto &slot : shard->mSlots) {
+				if (slot.state == Shard::Full)
+					fn(slot.key, slot.value);
+			}
+		}
+	}
+
+	/* Removes the elements for which pred(key, value) returns true, and returns how many were removed.
+	 * pred must not access the map. */
+	template <typename _Pred> size_t eraseIf(_Pred pred) {
+		size_t removed = 0;
+		for (auto &shard : mShards) {
+			std::lock_guard<std::mutex> lock(shard->mMutex);
+			for (size_t i = 0; i < shard->mSlots.size(); ++i) {
+				auto &slot = shard->mSlots[i];
+				if (slot.state == Shard::Full && pred(slot.key, slot.value)) {
+					shard->eraseSlot(i);
+					++removed;
+				}
+			}
+		}
+		return removed;
+	}
+
+  private:
+	struct Slot {
+		Slot() : state(0), key(), value() {
+		}
+		uint8_t state;
+		_Key key;
+		_Value value;
+	};
+
+	struct Shard {
+		enum { Empty = 0, Full = 1, Deleted = 2 };
+		static const size_t npos = size_t(-1);
+
+		Shard() : mCount(0), mUsed(0) {
+		}
+
+		size_t findSlot(const _Key &key, uint64_t h) const {
+			if (mSlots.empty())
+				return npos;
+			size_t mask = mSlots.size() - 1;
+			for (size_t i = h & mask, n = 0; n < mSlots.size(); i = (i + 1) & mask, ++n) {
+				const Slot &slot = mSlots[i];
+				if (slot.state == Empty)
+					return npos;
+				if (slot.state == Full && slot.key == key)
+					return i;
+			}
+			return npos;
+		}
+
+		bool set(const _Key &key, uint64_t h, const _Value &value) {
+			size_t pos = findSlot(key, h);
+			if (pos != npos) {
+				mSlots[pos].value = value;
+				return false;
+			}
+			// Keep the load factor (including tombstones) under 3/4
+			if ((mUsed + 1) * 4 > mSlots.size() * 3)
+				rehash();
+			size_t mask = mSlots.size() - 1;
+			pos = h & mask;
+			while (mSlots[pos].state == Full)
+				pos = (pos + 1) & mask;
+			if (mSlots[pos].state == Empty)
+				++mUsed;
+			Slot &slot = mSlots[pos];
+			slot.state = Full;
+			slot.key = key;
+			slot.value = value;
+			++mCount;
+			return true;
+		}
+
+		void eraseSlot(size_t pos) {
+			Slot &slot = mSlots[pos];
+			slot.state = Deleted;
+			slot.key = _Key();
+			slot.value = _Value();
+			--mCount;
+		}
+
+		/* Grows the table so that it is at most half full, dropping the tombstones. */
+		void rehash() {
+			size_t capacity = 16;
+			while (capacity < (mCount + 1) * 2)
+				capacity *= 2;
+			std::vector<Slot> old;
+			old.swap(mSlots);
+			mSlots.resize(capacity);
+			mUsed = mCount;
+			size_t mask = capacity - 1;
+			_Hash hash;
+			for (auto &slot : old) {
+				if (slot.state != Full)
+					continue;
+				size_t pos = (uint64_t)hash(slot.key) & mask;
+				while (mSlots[pos].state == Full)
+					pos = (pos + 1) & mask;
+				mSlots[pos].state = Full;
+				std::swap(mSlots[pos].key, slot.key);
+				std::swap(mSlots[pos].value, slot.value);
+			}
+		}
+
+		mutable std::mutex mMutex;
+		std::vector<Slot> mSlots;
+		size_t mCount; // number of elements
+		size_t mUsed;  // number of non empty slots (elements and tombstones)
+	};
+
+	Shard &shardFor(uint64_t h) const {
+		if (mShardBits == 0)
+			return *mShards[0];
+		// Fibonacci hashing: use the high bits for the shard, the low bits select the slot in the shard
+		return *mShards[(h * UINT64_C(11400714819323198485)) >> (64 - mShardBits)];
+	}
+
+	unsigned int mShardBits;
+	std::vector<std::unique_ptr<Shard>> mShards;
+	_Hash mHash;
+};
@@ -0,0 +1,217 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sipprescan.hh"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#define SIP_PRESCAN_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIP_PRESCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+/* The control characters other than the tabulation and the line ends, and DEL. */
+static inline bool isForbidden(unsigned char c) {
+	return (c < 0x20 && c != '\t' && c != '\r' && c != '\n') || c == 0x7f;
+}
+
+/*
+ * Returns the offset of the first line feed of [p, end), end - p when there is none, or -1 when a forbidden character
+ * comes first.
+ */
+static ptrdiff_t findLineEnd(const char *p, const char *end) {
+	const char *s = p;
+#if defined(SIP_PRESCAN_SSE2)
+	const __m128i lf = _mm_set1_epi8('\n'), tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+	const __m128i space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f), minusOne = _mm_set1_epi8(-1);
+	for (; end - s >= 16; s += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		__m128i isLf = _mm_cmpeq_epi8(v, lf);
+		// signed comparisons, the bytes above 0x7f being negative
+		__m128i control = _mm_and_si128(_mm_cmplt_epi8(v, space), _mm_cmpgt_epi8(v, minusOne));
+		__m128i allowed = _mm_or_si128(_mm_or_si128(isLf, _mm_cmpeq_epi8(v, tab)), _mm_cmpeq_epi8(v, cr));
+		__m128i bad = _mm_or_si128(_mm_andnot_si128(allowed, control), _mm_cmpeq_epi8(v, del));
+		unsigned lfMask = _mm_movemask_epi8(isLf), badMask = _mm_movemask_epi8(bad);
+		if (lfMask | badMask) {
+			int first = __builtin_ctz(lfMask | badMask);
+			if (badMask & (1u << first))
+				return -1;
+			return s - p + first;
+		}
+	}
+#elif defined(SIP_PRESCAN_NEON)
+	for (; end - s >= 16; s += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)s);
+		uint8x16_t isLf = vceqq_u8(v, vdupq_n_u8('\n'));
+		uint8x16_t allowed = vorrq_u8(vorrq_u8(isLf, vceqq_u8(v, vdupq_n_u8('\t'))), vceqq_u8(v, vdupq_n_u8('\r')));
+		uint8x16_t bad =
+			vorrq_u8(vbicq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), allowed), vceqq_u8(v, vdupq_n_u8(0x7f)));
+		// 4 bits per byte, NEON having no movemask
+		uint64_t lfBits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(isLf), 4)), 0);
+		uint64_t badBits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(bad), 4)), 0);
+		if (lfBits | badBits) {
+			int first = __builtin_ctzll(lfBits | badBits) / 4;
+			if ((badBits >> (4 * first)) & 0xf)
+				return -1;
+			return s - p + first;
+		}
+	}
+#endif
+	for (; s < end; ++s) {
+		if (*s == '\n')
+			return s - p;
+		if (isForbidden(*s))
+			return -1;
+	}
+	return end - p;
+}
+
+static inline bool isTokenChar(unsigned char c) {
+	return isalnum(c) || (c && strchr("-.!%*_+`'~", c));
+}
+
+static inline bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static bool isNamed(const char *name, size_t length, const char *full, const char *compact) {
+	return (length == strlen(full) && strncasecmp(name, full, length) == 0) ||
+		   (compact && length == 1 && tolower((unsigned char)name[0]) == compact[0]);
+}
+
+static bool checkStartLine(const char *p, const char *end) {
+	static const size_t sVersionLength = 7; // SIP/2.0
+	if ((size_t)(end - p) > sVersionLength && strncasecmp(p, "SIP/2.0", sVersionLength) == 0 &&
+		p[sVersionLength] == ' ') {
+		p += sVersionLength + 1;
+		if (end - p < 3 || !isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1]) ||
+			!isdigit((unsigned char)p[2]))
+			return false;
+		return end - p == 3 || p[3] == ' ';
+	}
+	const char *method = p;
+	while (p < end && isTokenChar(*p))
+		++p;
+	if (p == method || p == end || *p != ' ')
+		return false;
+	const char *uri = ++p;
+	while (p < end && *p != ' ')
+		++p;
+	if (p == uri || p == end)
+		return false;
+	++p;
+	return (size_t)(end - p) == sVersionLength && strncasecmp(p, "SIP/2.0", sVersionLength) == 0;
+}
+
+/* Returns the value, or -1 when it is not a number. */
+static long parseContentLength(const char *p, const char *end) {
+	while (p < end && isBlank(*p))
+		++p;
+	long value = 0;
+	const char *digits = p;
+	while (p < end && isdigit((unsigned char)*p) && p - digits < 10)
+		value = value * 10 + (*p++ - '0');
+	while (p < end && isBlank(*p))
+		++p;
+	return p == digits || p != end ? -1 : value;
+}
+
+static const struct {
+	const char *name;
+	const char *compact;
+} sRequiredHeaders[] = {{"Via", "v"}, {"From", "f"}, {"To", "t"}, {"Call-ID", "i"}, {"CSeq", NULL}};
+static const size_t sRequiredCount = sizeof(sRequiredHeaders) / sizeof(sRequiredHeaders[0]);
+
+const char *SipPrescan::check(const char *data, size_t size, const Limits &limits) {
+	if (size > limits.maxSize)
+		return "message too large";
+	const char *p = data, *end = data + size;
+	// the line ends before a message are ignored, as the keep-alives
+	while (p < end && (*p == '\r' || *p == '\n'))
+		++p;
+	if (p == end || !isalpha((unsigned char)*p))
+		return NULL;
+
+	size_t headers = 0;
+	unsigned found = 0;
+	long contentLength = -1;
+	for (bool startLine = true;; startLine = false) {
+		ptrdiff_t n = findLineEnd(p, end);
+		if (n < 0)
+			return "control character in the headers";
+		if (p + n == end)
+			return "incomplete headers";
+		const char *next = p + n + 1;
+		const char *last = p + n;
+		if (last > p && last[-1] == '\r')
+			--last;
+		if (startLine) {
+			if (!checkStartLine(p, last))
+				return "invalid start line";
+		} else if (last == p) {
+			p = next;
+			break;
+		} else if (isBlank(*p)) {
+			// folded value of the previous header
+			if (headers == 0)
+				return "invalid header line";
+		} else {
+			if (++headers > limits.maxHeaders)
+				return "too many headers";
+			const char *name = p;
+			while (p < last && isTokenChar(*p))
+				++p;
+			size_t nameLength = p - name;
+			while (p < last && isBlank(*p))
+				++p;
+			if (nameLength == 0 || p == last || *p != ':')
+				return "invalid header line";
+			++p;
+			for (size_t i = 0; i < sRequiredCount; ++i) {
+				if (isNamed(name, nameLength, sRequiredHeaders[i].name, sRequiredHeaders[i].compact))
+					found |= 1u << i;
+			}
+			if (isNamed(name, nameLength, "Content-Length", "l")) {
+				long value = parseContentLength(p, last);
+				if (value < 0)
+					return "invalid Content-Length";
+				if (contentLength >= 0 && value != contentLength)
+					return "conflicting Content-Length";
+				contentLength = value;
+			}
+		}
+		p = next;
+	}
+
+	static const char *sMissing[] = {"no Via", "no From", "no To", "no Call-ID", "no CSeq"};
+	for (size_t i = 0; i < sRequiredCount; ++i) {
+		if (!(found & (1u << i)))
+			return sMissing[i];
+	}
+	if (contentLength > end - p)
+		return "truncated body";
+	return NULL;
+}
@@ -0,0 +1,39 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+/*
+ * Check of the raw bytes of a SIP message received in a datagram, before sofia-sip parses it: the size, the start
+ * line, the syntax of the header lines and their number, the presence of the headers the SanityChecker requires, and
+ * a Content-Length matching the body received. The lines are split 16 bytes at a time with SSE2 or NEON, looking for
+ * the line feeds and the control characters in the same pass.
+ * The datagrams not starting with a letter, such as the keep-alives and the STUN requests, are left to sofia-sip.
+ */
+class SipPrescan {
+  public:
+	struct Limits {
+		size_t maxSize;
+		size_t maxHeaders;
+	};
+
+	/* Returns the reason to drop the message, NULL when it is accepted. */
+	static const char *check(const char *data, size_t size, const Limits &limits);
+};
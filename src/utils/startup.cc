@@ -0,0 +1,106 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "startup.hh"
+#include "log/logmanager.hh"
+
+#include <exception>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+Startup *Startup::get() {
+	static Startup sInstance;
+	return &sInstance;
+}
+
+Startup::Startup() : mStart(steady_clock::now()), mReady(false) {
+}
+
+void Startup::step(const string &name, const function<void()> &function) {
+	steady_clock::time_point start = steady_clock::now();
+	function();
+	done(name, start, false);
+}
+
+void Startup::background(const string &name, const function<void()> &function) {
+	lock_guard<mutex> lock(mMutex);
+	mPending.push_back(name);
+	steady_clock::time_point start = steady_clock::now();
+	mThreads.emplace_back([this, name, function, start]() {
+		try {
+			function();
+		} catch (const exception &e) {
+			SLOGE << "Startup: " << name << " failed: " << e.what();
+		}
+		done(name, start, true);
+	});
+}
+
+void Startup::done(const string &name, steady_clock::time_point start, bool inBackground) {
+	long ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+	lock_guard<mutex> lock(mMutex);
+	mSteps.emplace_back(name, ms);
+	if (inBackground) {
+		mPending.remove(name);
+		if (mReady)
+			LOGN("Startup: %s done in the background in %ld ms", name.c_str(), ms);
+	}
+}
+
+void Startup::ready() {
+	lock_guard<mutex> lock(mMutex);
+	mReady = true;
+	ostringstream steps;
+	for (const auto &step : mSteps) {
+		// the steps below the millisecond would only hide the others
+		if (step.second > 0)
+			steps << (steps.tellp() > 0 ? ", " : "") << step.first << " " << step.second << " ms";
+	}
+	long ms = duration_cast<milliseconds>(steady_clock::now() - mStart).count();
+	string details = steps.tellp() > 0 ? " (" + steps.str() + ")" : "";
+	LOGN("Startup: ready to handle the requests after %ld ms%s", ms, details.c_str());
+	if (!mPending.empty()) {
+		ostringstream pending;
+		for (const auto &name : mPending)
+			pending << (pending.tellp() > 0 ? ", " : "") << name;
+		LOGN("Startup: still in the background: %s", pending.str().c_str());
+	}
+}
+
+void Startup::wait() {
+	list<thread> threads;
+	{
+		lock_guard<mutex> lock(mMutex);
+		threads.swap(mThreads);
+	}
+	for (auto &thread : threads)
+		thread.join();
+}
+
+void Startup::parallel(size_t count, const function<void(size_t)> &function) {
+	vector<thread> threads;
+	threads.reserve(count);
+	for (size_t i = 0; i < count; ++i)
+		threads.emplace_back(function, i);
+	for (auto &thread : threads)
+		thread.join();
+}
@@ -0,0 +1,62 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/*
+ * Steps of the startup of the server, timed and reported once it is ready to handle the requests. The steps on the
+ * critical path, the transports and the registrar, run on the main thread; those only needed later, such as the
+ * connections to the databases, run in the background while the main loop already handles the requests, the requests
+ * needing them waiting for them.
+ */
+class Startup {
+  public:
+	static Startup *get();
+
+	/* Runs the step on the calling thread. */
+	void step(const std::string &name, const std::function<void()> &function);
+	/* Runs the step on a thread of its own, joined by wait(). */
+	void background(const std::string &name, const std::function<void()> &function);
+	/* Reports the steps done, the server being about to handle the requests. */
+	void ready();
+	/* Waits for the end of the background steps, before the exit. */
+	void wait();
+
+	/* Runs function(0) to function(count - 1) on as many threads, for independent blocking operations. */
+	static void parallel(size_t count, const std::function<void(size_t)> &function);
+
+  private:
+	Startup();
+	void done(const std::string &name, std::chrono::steady_clock::time_point start, bool inBackground);
+
+	std::chrono::steady_clock::time_point mStart;
+	std::mutex mMutex;
+	std::list<std::pair<std::string, long>> mSteps; // name and duration in ms, in their order of completion
+	std::list<std::string> mPending;				 // background steps still running
+	std::list<std::thread> mThreads;
+	bool mReady;
+};
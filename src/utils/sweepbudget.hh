@@ -0,0 +1,53 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * @brief Bound of a slice of an incremental sweep of a table, in time spent.
+ *
+ * The sweep calls next() before examining each item and stops, keeping where it was, once it returns false. The clock
+ * is only read every sCheckInterval items, the budget may thus be exceeded by the time of examining that many items.
+ */
+class SweepBudget {
+  public:
+	SweepBudget(std::chrono::microseconds budget)
+		: mDeadline(std::chrono::steady_clock::now() + budget), mCount(0), mExhausted(false) {
+	}
+
+	/* Whether another item can be examined. */
+	bool next() {
+		if (mExhausted)
+			return false;
+		if (++mCount % sCheckInterval == 0 && std::chrono::steady_clock::now() >= mDeadline)
+			mExhausted = true;
+		return !mExhausted;
+	}
+	bool exhausted() const {
+		return mExhausted;
+	}
+
+  private:
+	static const size_t sCheckInterval = 32;
+	std::chrono::steady_clock::time_point mDeadline;
+	size_t mCount;
+	bool mExhausted;
+};
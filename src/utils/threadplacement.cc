@@ -0,0 +1,139 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "threadplacement.hh"
+#include "log/logmanager.hh"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const char *sSubsystemNames[ThreadPlacement::SubsystemCount] = {"sip", "relay", "transcoder", "db"};
+// from numaif.h, not to depend on libnuma
+static const int sMpolPreferred = 1;
+
+vector<vector<int>> ThreadPlacement::sNodeCpus;
+int ThreadPlacement::sNodes[SubsystemCount] = {-1, -1, -1, -1};
+
+/* Parses a cpulist of /sys, such as 0-7,16-23. */
+static vector<int> parseCpuList(const string &list) {
+	vector<int> cpus;
+	stringstream ss(list);
+	string range;
+	while (getline(ss, range, ',')) {
+		if (range.empty())
+			continue;
+		size_t dash = range.find('-');
+		int first = atoi(range.c_str());
+		int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+static string printCpuList(const vector<int> &cpus) {
+	ostringstream out;
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		size_t j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+			++j;
+		out << (i ? "," : "") << cpus[i];
+		if (j > i)
+			out << "-" << cpus[j];
+		i = j;
+	}
+	return out.str();
+}
+
+void ThreadPlacement::configure(const list<string> &entries) {
+	if (entries.empty())
+		return;
+	for (int node = 0;; ++node) {
+		ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		string line;
+		if (!in.is_open() || !getline(in, line))
+			break;
+		sNodeCpus.push_back(parseCpuList(line));
+	}
+	if (sNodeCpus.empty()) {
+		LOGE("Cannot read the NUMA topology from /sys/devices/system/node, thread-placement ignored");
+		return;
+	}
+	for (size_t node = 0; node < sNodeCpus.size(); ++node)
+		LOGI("NUMA node %zu: CPUs %s", node, printCpuList(sNodeCpus[node]).c_str());
+
+	for (const auto &entry : entries) {
+		size_t equal = entry.find('=');
+		int subsystem = 0;
+		while (subsystem < SubsystemCount && entry.compare(0, equal, sSubsystemNames[subsystem]) != 0)
+			++subsystem;
+		char *end = NULL;
+		long node = equal == string::npos ? -1 : strtol(entry.c_str() + equal + 1, &end, 10);
+		if (subsystem == SubsystemCount || node < 0 || *end != '\0' || entry.size() == equal + 1) {
+			LOGE("Invalid thread-placement entry '%s', subsystem=node expected with subsystem among sip, relay, "
+				 "transcoder and db",
+				 entry.c_str());
+			continue;
+		}
+		if ((size_t)node >= sNodeCpus.size() || sNodeCpus[node].empty()) {
+			LOGE("Cannot place %s on NUMA node %ld, which has no CPU", sSubsystemNames[subsystem], node);
+			continue;
+		}
+		sNodes[subsystem] = (int)node;
+		LOGI("Threads of %s placed on NUMA node %ld", sSubsystemNames[subsystem], node);
+	}
+}
+
+void ThreadPlacement::placeCurrentThread(Subsystem subsystem) {
+	int node = sNodes[subsystem];
+	if (node < 0)
+		return;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : sNodeCpus[node])
+		CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		LOGW("Cannot pin a thread of %s to NUMA node %i: %s", sSubsystemNames[subsystem], node, strerror(errno));
+	unsigned long mask[4] = {0};
+	if (node < (int)(sizeof(mask) * 8)) {
+		mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+		if (syscall(SYS_set_mempolicy, sMpolPreferred, mask, sizeof(mask) * 8) == -1)
+			LOGW("Cannot prefer the memory of NUMA node %i for %s: %s", node, sSubsystemNames[subsystem],
+				 strerror(errno));
+	}
+#endif
+}
+
+const vector<int> &ThreadPlacement::getCpus(Subsystem subsystem) {
+	static const vector<int> none;
+	int node = sNodes[subsystem];
+	return node < 0 ? none : sNodeCpus[node];
+}
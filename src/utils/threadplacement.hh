@@ -0,0 +1,46 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+
+/*
+ * Placement of the threads of the subsystems on the NUMA nodes, read from the thread-placement setting at startup.
+ * A thread placed on a node is pinned to its CPUs and allocates its memory from it first, so that the malloc arena
+ * of the thread and the pages it touches are local. The topology is read from /sys, without libnuma.
+ * The threads started by a placed thread inherit its placement until they place themselves.
+ */
+class ThreadPlacement {
+  public:
+	enum Subsystem { Sip, Relay, Transcoder, Db, SubsystemCount };
+
+	/* Parses the subsystem=node entries and reports the topology and the placements. Before starting any thread. */
+	static void configure(const std::list<std::string> &entries);
+	/* Places the calling thread, if its subsystem is placed. */
+	static void placeCurrentThread(Subsystem subsystem);
+	/* CPUs of the node of the subsystem, empty if not placed. */
+	static const std::vector<int> &getCpus(Subsystem subsystem);
+
+  private:
+	static std::vector<std::vector<int>> sNodeCpus; // by node
+	static int sNodes[SubsystemCount];				 // node of each subsystem, -1 if not placed
+};
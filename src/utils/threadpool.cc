@@ -20,49 +20,91 @@
 #include "log/logmanager.hh"
 
 using namespace std;
+using namespace std::chrono;
 
 // Constructor.
-ThreadPool::ThreadPool(unsigned int threads, unsigned int max_queue_size)
-	: max_queue_size(max_queue_size), terminate(false), stopped(false) {
-	SLOGD << "[POOL] Init with " << threads << " threads and queue size " << max_queue_size;
+ThreadPool::ThreadPool(unsigned int threads, unsigned int max_queue_size, const function<void()> &onThreadStart)
+	: ThreadPool(threads, threads, max_queue_size, onThreadStart) {
+}
+
+ThreadPool::ThreadPool(unsigned int min_threads, unsigned int max_threads, unsigned int max_queue_size,
+					   const function<void()> &onThreadStart)
+	: max_queue_size(max_queue_size), min_threads(min_threads), max_threads(max(min_threads, max_threads)),
+	  idle_timeout(30000), onThreadStart(onThreadStart), queued(0), busy(0), executed(0), rejected(0), wait_total_ms(0),
+	  wait_count(0), wait_max_ms(0), terminate(false), stopped(false) {
+	SLOGD << "[POOL] Init with " << min_threads << " to " << this->max_threads << " threads and queue size "
+		  << max_queue_size;
 
 	// Create number of required threads and add them to the thread pool vector.
-	for (unsigned int i = 0; i < threads; i++) {
-		threadPool.emplace_back(thread(&ThreadPool::Invoke, this));
+	unique_lock<mutex> lock(tasksMutex);
+	for (unsigned int i = 0; i < min_threads; i++) {
+		addThread();
 	}
 }
 
-bool ThreadPool::Enqueue(function<void()> f) {
+void ThreadPool::addThread() {
+	thread t(&ThreadPool::Invoke, this);
+	thread::id id = t.get_id();
+	threadPool[id] = move(t);
+}
+
+void ThreadPool::joinRetired() {
+	vector<thread> threads;
+	{
+		unique_lock<mutex> lock(tasksMutex);
+		threads.swap(retired);
+	}
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+}
+
+bool ThreadPool::Enqueue(function<void()> f, Priority priority) {
 	bool enqueued = false;
+	uint64_t rejectedCount = 0;
+	bool hasRetired = false;
 	// Scope based locking.
 	{
 		// Put unique lock on task mutex.
 		unique_lock<mutex> lock(tasksMutex);
 
 		// Push task into queue.
-		if (tasks.size() < max_queue_size) {
-
-			//SLOGE << "[POOL] Enqueue(" << tasks.size() << ")";
-
-			tasks.push(f);
+		if (queued < max_queue_size) {
+			tasks[priority].push_back(Task{f, steady_clock::now()});
+			++queued;
 			enqueued = true;
+			// rather than waiting for a busy thread for an unknown time
+			if (!terminate && busy == threadPool.size() && threadPool.size() < max_threads) {
+				SLOGD << "[POOL] All threads busy, adding a thread to the " << threadPool.size();
+				addThread();
+			}
+		} else {
+			rejectedCount = ++rejected;
 		}
+		hasRetired = !retired.empty();
 	}
 
 	// Wake up one thread if the task was successfully queued
 	if (enqueued)
 		condition.notify_one();
+	else if ((rejectedCount & (rejectedCount - 1)) == 0)
+		// 1st, 2nd, 4th, 8th... so that a flood doesn't flood the logs too
+		SLOGW << "[POOL] Queue full (" << max_queue_size << " tasks), " << rejectedCount << " tasks rejected so far";
+	if (hasRetired)
+		joinRetired();
 
 	return enqueued;
 }
 
 bool ThreadPool::conditionCheck() const {
-	return !tasks.empty() || terminate;
+	return queued > 0 || terminate;
 }
 
 void ThreadPool::Invoke() {
+	if (onThreadStart)
+		onThreadStart();
 
-	function<void()> task;
+	Task task;
 	while (true) {
 		// Scope based locking.
 		{
@@ -72,30 +114,68 @@ void ThreadPool::Invoke() {
 			auto predicate = std::bind(&ThreadPool::conditionCheck, this);
 
 			// Wait until queue is not empty or termination signal is sent.
-			condition.wait(lock, predicate);
+			if (!condition.wait_for(lock, idle_timeout, predicate)) {
+				if (!terminate && threadPool.size() > min_threads) {
+					SLOGD << "[POOL] Idle thread leaving, " << threadPool.size() - 1 << " remaining";
+					auto self = threadPool.find(this_thread::get_id());
+					retired.push_back(move(self->second));
+					threadPool.erase(self);
+					return;
+				}
+				continue;
+			}
 
 			// If termination signal received and queue is empty then exit else continue clearing the queue.
-			if (terminate && tasks.empty()) {
+			if (terminate && queued == 0) {
 				SLOGD << "[POOL] Terminate thread";
 				return;
 			}
 
-			// Get next task in the queue.
-			task = tasks.front();
-
-			// Remove it from the queue.
-			tasks.pop();
-			//SLOGE << "[POOL] Pop task " << tasks.size();
+			// Get next task in the queue, by order of priority.
+			for (int i = 0; i < sPriorities; ++i) {
+				if (!tasks[i].empty()) {
+					task = move(tasks[i].front());
+					tasks[i].pop_front();
+					break;
+				}
+			}
+			--queued;
+			++busy;
+
+			uint64_t waitMs = duration_cast<milliseconds>(steady_clock::now() - task.queuedAt).count();
+			wait_total_ms += waitMs;
+			++wait_count;
+			if (waitMs > wait_max_ms)
+				wait_max_ms = waitMs;
 		}
 
 		// Execute the task.
-		//SLOGE << "[POOL] Task()";
-		task();
+		task.function();
+		task.function = nullptr;
+
+		unique_lock<mutex> lock(tasksMutex);
+		--busy;
+		++executed;
 	}
 }
 
+ThreadPool::Metrics ThreadPool::getMetrics() {
+	unique_lock<mutex> lock(tasksMutex);
+	Metrics metrics;
+	metrics.queued = queued;
+	metrics.threads = threadPool.size();
+	metrics.busy = busy;
+	metrics.executed = executed;
+	metrics.rejected = rejected;
+	metrics.maxWaitMs = wait_max_ms;
+	metrics.averageWaitMs = wait_count ? wait_total_ms / wait_count : 0;
+	wait_total_ms = wait_count = wait_max_ms = 0;
+	return metrics;
+}
+
 void ThreadPool::ShutDown() {
 	SLOGD << "[POOL] Shutdown";
+	map<thread::id, thread> threads;
 	// Scope based locking.
 	{
 		// Put unique lock on task mutex.
@@ -108,13 +188,15 @@ void ThreadPool::ShutDown() {
 	// Wake up all threads.
 	condition.notify_all();
 
-	// Join all threads.
-	for (auto it = threadPool.begin(); it != threadPool.end(); ++it) {
-		it->join();
+	// Join all threads. Threads are no longer added nor removed once terminate is set, but an idle one may be leaving.
+	{
+		unique_lock<mutex> lock(tasksMutex);
+		threads.swap(threadPool);
 	}
-
-	// Empty workers vector.
-	threadPool.empty();
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		it->second.join();
+	}
+	joinRetired();
 
 	// Indicate that the pool has been shut down.
 	stopped = true;
@@ -21,24 +21,51 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <map>
 #include <queue>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
 #include <functional>
+#include <chrono>
+#include <cstdint>
 #include <unistd.h>
 
+/*
+ * Pool of threads running the queued tasks by order of priority, then of arrival.
+ *
+ * The number of threads varies between a minimum and a maximum: a thread is added when a task is queued while all the
+ * threads are busy, and a thread idle for longer than the idle timeout exits, as long as the minimum is kept. Tasks
+ * are refused once max_queue_size of them are waiting.
+ */
 class ThreadPool {
   public:
-	// Constructor.
-	ThreadPool(unsigned int threads, unsigned int max_queue_size);
+	enum Priority { High, Normal, Low };
+
+	struct Metrics {
+		size_t queued;			  // tasks waiting
+		size_t threads;			  // running threads
+		size_t busy;			  // threads running a task
+		uint64_t executed;		  // tasks run since the creation of the pool
+		uint64_t rejected;		  // tasks refused because the queue was full
+		uint64_t maxWaitMs;		  // longest wait of a task in the queue, since the previous call to getMetrics()
+		uint64_t averageWaitMs;	  // average wait of the tasks started since the previous call to getMetrics()
+	};
+
+	// Constructor, with a fixed amount of threads. onThreadStart is called by each thread before its first task.
+	ThreadPool(unsigned int threads, unsigned int max_queue_size,
+			   const std::function<void()> &onThreadStart = nullptr);
+	// Constructor, with a number of threads adapting to the load.
+	ThreadPool(unsigned int min_threads, unsigned int max_threads, unsigned int max_queue_size,
+			   const std::function<void()> &onThreadStart = nullptr);
 
 	// Destructor.
 	~ThreadPool();
 
 	// Adds task to a task queue.
-	bool Enqueue(std::function<void()> f);
+	bool Enqueue(std::function<void()> f, Priority priority = Normal);
 
 	// set pool size (only allowed if not yet populated)
 	void setPoolSize(int threads);
@@ -46,12 +73,23 @@ class ThreadPool {
 	// Shut down the pool.
 	void ShutDown();
 
+	Metrics getMetrics();
+
   private:
-	// Thread pool storage.
-	std::vector<std::thread> threadPool;
+	static const int sPriorities = 3;
+	struct Task {
+		std::function<void()> function;
+		std::chrono::steady_clock::time_point queuedAt;
+	};
+
+	// Thread pool storage, by thread id so that a thread leaving the pool can find itself.
+	std::map<std::thread::id, std::thread> threadPool;
 
-	// Queue to keep track of incoming tasks.
-	std::queue<std::function<void()>> tasks;
+	// Threads which left the pool, to be joined.
+	std::vector<std::thread> retired;
+
+	// Queues to keep track of incoming tasks, one per priority.
+	std::deque<Task> tasks[sPriorities];
 
 	// Task queue mutex.
 	std::mutex tasksMutex;
@@ -62,6 +100,21 @@ class ThreadPool {
 	// Maximum amount of tasks to be enqueued
 	unsigned int max_queue_size;
 
+	unsigned int min_threads;
+	unsigned int max_threads;
+	std::chrono::milliseconds idle_timeout;
+
+	// Called by each thread when it starts, such as for its placement.
+	std::function<void()> onThreadStart;
+
+	size_t queued;
+	size_t busy;
+	uint64_t executed;
+	uint64_t rejected;
+	uint64_t wait_total_ms;
+	uint64_t wait_count;
+	uint64_t wait_max_ms;
+
 	// Indicates that pool needs to be shut down.
 	bool terminate;
 
@@ -71,5 +124,10 @@ class ThreadPool {
 	// Function that will be invoked by our threads.
 	void Invoke();
 
+	// Starts a thread, with tasksMutex held.
+	void addThread();
+
+	void joinRetired();
+
 	bool conditionCheck() const;
 };
@@ -0,0 +1,125 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <ctime>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Hierarchical timing wheel with a resolution of one second.
+ *
+ * Four levels of 64 slots cover about 194 days; later deadlines are kept aside and re-inserted when the highest
+ * level wraps. Advancing the wheel only touches the slots of the elapsed seconds and the entries cascading from the
+ * upper levels, so its cost is proportional to the number of entries actually due, not to the number scheduled.
+ * Entries cannot be cancelled: owners are expected to check, when an entry fires, whether it is still relevant.
+ * Not thread-safe.
+ */
+template <typename _Value> class TimerWheel {
+  public:
+	explicit TimerWheel(time_t now = 0) : mCurrent(now), mCount(0) {
+	}
+
+	/* Schedules value to be delivered by the first advance() reaching 'when'. */
+	void schedule(time_t when, const _Value &value) {
+		insert(Entry(when, value), mCurrent + 1);
+		++mCount;
+	}
+
+	/* Moves the wheel up to 'now', calling fn(value, when) for every entry due. fn may schedule new entries. */
+	template <typename _Fn> size_t advance(time_t now, _Fn fn) {
+		size_t fired = 0;
+		if (mCount == 0) {
+			if (now > mCurrent) mCurrent = now;
+			return 0;
+		}
+		while (mCurrent < now) {
+			++mCurrent;
+			for (int level = sLevels - 1; level > 0; --level) {
+				if ((mCurrent & ((time_t(1) << (sBits * level)) - 1)) == 0) {
+					cascade(level);
+				}
+			}
+			std::vector<Entry> due;
+			due.swap(mSlots[0][mCurrent & sMask]);
+			mCount -= due.size();
+			for (auto &entry : due) {
+				fn(entry.second, entry.first);
+				++fired;
+			}
+			if (mCount == 0) {
+				mCurrent = now;
+				break;
+			}
+		}
+		return fired;
+	}
+
+	size_t size() const {
+		return mCount;
+	}
+
+	void clear() {
+		for (int level = 0; level < sLevels; ++level) {
+			for (int i = 0; i < sSlots; ++i) {
+				mSlots[level][i].clear();
+			}
+		}
+		mOverflow.clear();
+		mCount = 0;
+	}
+
+  private:
+	typedef std::pair<time_t, _Value> Entry;
+	static const int sLevels = 4;
+	static const int sBits = 6;
+	static const int sSlots = 1 << sBits;
+	static const time_t sMask = sSlots - 1;
+
+	/* Entries due before 'earliest' are placed on the 'earliest' tick. */
+	void insert(const Entry &entry, time_t earliest) {
+		time_t when = entry.first > earliest ? entry.first : earliest;
+		for (int level = 0; level < sLevels; ++level) {
+			// Smallest level whose upper block is shared by 'when' and the current time
+			if (((when ^ mCurrent) >> (sBits * (level + 1))) == 0) {
+				mSlots[level][(when >> (sBits * level)) & sMask].push_back(entry);
+				return;
+			}
+		}
+		mOverflow.push_back(entry);
+	}
+
+	void cascade(int level) {
+		std::vector<Entry> entries;
+		entries.swap(mSlots[level][(mCurrent >> (sBits * level)) & sMask]);
+		if (level == sLevels - 1 && (mCurrent & ((time_t(1) << (sBits * sLevels)) - 1)) == 0) {
+			entries.insert(entries.end(), mOverflow.begin(), mOverflow.end());
+			mOverflow.clear();
+		}
+		// The slot of the current tick has not been processed yet
+		for (auto &entry : entries) {
+			insert(entry, mCurrent);
+		}
+	}
+
+	std::vector<Entry> mSlots[sLevels][sSlots];
+	std::vector<Entry> mOverflow;
+	time_t mCurrent;
+	size_t mCount;
+};
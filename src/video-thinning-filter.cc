@@ -0,0 +1,147 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "video-thinning-filter.hh"
+#include "common.hh"
+
+using namespace std;
+
+#define TYPE_IDR 5
+#define TYPE_SPS 7
+#define TYPE_PPS 8
+#define TYPE_STAP_A 24
+
+// interarrival jitter considered as congestion, in ms at the 90kHz clock of video
+static const uint32_t sJitterThreshold = 50;
+// seconds without congestion before thinning one level less
+static const time_t sRecoveryTime = 5;
+
+VideoThinningFilter::VideoThinningFilter(int maxBitrate, int lossThreshold)
+	: mMaxBitrate(maxBitrate), mLossThreshold(lossThreshold), mLevel(All), mCapLevel(All), mLossLevel(All), mSsrc(0),
+	  mFrameTimestamp(0), mFrameStarted(false), mLastCongestion(0), mWindowStart(0) {
+	mWindowBytes[0] = mWindowBytes[1] = mWindowBytes[2] = 0;
+}
+
+void VideoThinningFilter::readReports(const uint8_t *data, size_t size) {
+	RtcpReportBlock blocks[4];
+	uint32_t srNtp;
+	int count = RtcpReportBlock::decode(data, size, blocks, 4, &srNtp);
+	time_t now = getCurrentTime();
+	for (int k = 0; k < count; ++k) {
+		if (mSsrc == 0 || blocks[k].ssrc != mSsrc)
+			continue; // about another stream
+		int loss = 100 * blocks[k].fractionLost / 256;
+		uint32_t jitter = blocks[k].jitter / 90;
+		Level level = mLossLevel;
+		if (loss >= 2 * mLossThreshold) {
+			level = KeyFramesOnly;
+			mLastCongestion = now;
+		} else if (loss >= mLossThreshold || jitter >= sJitterThreshold) {
+			if (level < ReferenceOnly)
+				level = ReferenceOnly;
+			mLastCongestion = now;
+		} else if (level > All && now - mLastCongestion >= sRecoveryTime) {
+			level = (Level)(level - 1);
+			mLastCongestion = now; // one level at a time
+		}
+		if (level != mLossLevel) {
+			LOGD("VideoThinningFilter[%p]: %i%% lost, %ums of jitter, thinning level %i", this, loss, jitter, level);
+			mLossLevel = level;
+		}
+	}
+}
+
+void VideoThinningFilter::updateCapLevel(time_t now) {
+	if (mWindowStart == 0) {
+		mWindowStart = now;
+		return;
+	}
+	if (now == mWindowStart)
+		return;
+	// the bitrate of each level, as the bytes of all the frames are counted whatever is sent
+	uint64_t bits = 0;
+	uint64_t allowed = (uint64_t)mMaxBitrate * 1000 * (now - mWindowStart);
+	Level level = KeyFramesOnly;
+	for (int l = KeyFramesOnly; l >= All; --l) {
+		bits += 8 * mWindowBytes[l];
+		if (bits > allowed)
+			break;
+		level = (Level)l;
+	}
+	if (level != mCapLevel) {
+		LOGD("VideoThinningFilter[%p]: thinning level %i to stay below %i kbit/s", this, level, mMaxBitrate);
+		mCapLevel = level;
+	}
+	mWindowStart = now;
+	mWindowBytes[0] = mWindowBytes[1] = mWindowBytes[2] = 0;
+}
+
+bool VideoThinningFilter::keep(const RtpPacketInfo &info, size_t size) {
+	if (!info.isRtp())
+		return true;
+	mSsrc = info.ssrc;
+	// the level from which the packet is dropped
+	int dropFrom;
+	switch (info.nalType) {
+		case TYPE_IDR:
+		case TYPE_SPS:
+		case TYPE_PPS:
+		case TYPE_STAP_A:
+			dropFrom = KeyFramesOnly + 1; // never
+			break;
+		default:
+			dropFrom = info.nalRefIdc != 0 ? KeyFramesOnly : ReferenceOnly;
+			break;
+	}
+	if (mMaxBitrate > 0) {
+		updateCapLevel(getCurrentTime());
+		mWindowBytes[dropFrom - 1] += size;
+	}
+	if (!mFrameStarted || info.timestamp != mFrameTimestamp) {
+		mFrameStarted = true;
+		mFrameTimestamp = info.timestamp;
+		Level target = mCapLevel > mLossLevel ? mCapLevel : mLossLevel;
+		// after dropping reference frames, the stream can only be resumed from a key frame
+		if (target > mLevel || mLevel < KeyFramesOnly || dropFrom > KeyFramesOnly)
+			mLevel = target;
+	}
+	return mLevel < dropFrom;
+}
+
+bool VideoThinningFilter::onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
+	if (RtcpReportBlock::isRtcp(data, size))
+		readReports(data, size);
+	return true;
+}
+
+bool VideoThinningFilter::onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen) {
+	if (RtcpReportBlock::isRtcp(data, size))
+		return true;
+	return keep(RtpPacketInfo::decode(data, size), size);
+}
+
+void VideoThinningFilter::onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr,
+										  socklen_t addrlen) {
+	for (int k = 0; k < batch.size(); ++k) {
+		if (!selected[k] || RtcpReportBlock::isRtcp(batch.data(k), batch.length(k)))
+			continue;
+		if (!keep(batch.info(k), batch.length(k)))
+			selected[k] = false;
+	}
+}
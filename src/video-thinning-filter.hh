@@ -0,0 +1,60 @@
+/*
+	Flexisip, a flexible SIP proxy server with media capabilities.
+	Copyright (C) 2010-2015  Belledonne Communications SARL, All rights reserved.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef videothinningfilter_hh
+#define videothinningfilter_hh
+
+#include "mediarelay.hh"
+
+/*
+ * Thins the H264 video sent to one destination of a relayed stream, from the RTCP receiver reports of the destination
+ * and a bitrate cap: the frames no other frame refers to are dropped first, then all but the key frames.
+ * The level only changes at the start of a frame, and the frames in between are only sent again from a key frame on,
+ * so that the decoder of the destination never gets a frame whose references were dropped.
+ */
+class VideoThinningFilter : public MediaFilter {
+  public:
+	enum Level { All, ReferenceOnly, KeyFramesOnly };
+
+	/* maxBitrate in kbit/s, 0 for no cap; lossThreshold in percent of lost packets. */
+	VideoThinningFilter(int maxBitrate, int lossThreshold);
+	/// Reads the RTCP reports of the destination, always transfered.
+	bool onIncomingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
+	bool onOutgoingTransfer(uint8_t *data, size_t size, const sockaddr *addr, socklen_t addrlen);
+	void onOutgoingBatch(RelayPacketBatch &batch, bool *selected, const sockaddr *addr, socklen_t addrlen);
+
+  private:
+	bool keep(const RtpPacketInfo &info, size_t size);
+	void readReports(const uint8_t *data, size_t size);
+	void updateCapLevel(time_t now);
+	int mMaxBitrate;
+	int mLossThreshold;
+	Level mLevel;
+	Level mCapLevel;
+	Level mLossLevel;
+	uint32_t mSsrc;
+	uint32_t mFrameTimestamp;
+	bool mFrameStarted;
+	time_t mLastCongestion;
+	/* bytes to send since mWindowStart, per last level at which they are sent */
+	time_t mWindowStart;
+	uint64_t mWindowBytes[3];
+};
+
+#endif
@@ -0,0 +1,204 @@
+#!/bin/bash
+
+# Memory regression harness: plays the registration and call workloads at a fixed scale on a fresh flexisip each, and
+# records the RSS, the heap when built with jemalloc, the heap allocations per operation when counted, and the live
+# objects of each subsystem, as read from the metrics exporter. Writes them in OUTPUT, as JSON.
+# When BASELINE names the output of a previous build, fails if the memory per binding or per call grew by more than
+# MAX_GROWTH_PERCENT.
+#
+# Workloads:
+#   register  REGISTER of NB_AORS users, from invite.xml, measured once they are all bound
+#   call      NB_CALLS calls relayed by the MediaRelay to registered users, measured while they are all established
+
+usage() {
+	echo "Usage: $0 [workload...]"
+	echo "Workloads: register call (default: all)"
+	echo "Environment: FLEXISIP SIPP NB_AORS REG_RATE NB_CALLS CALL_RATE SETTLE_TIME BASELINE MAX_GROWTH_PERCENT OUTPUT"
+	exit 1
+}
+
+FLEXISIP=${FLEXISIP:=/opt/belledonne-communications/bin/flexisip}
+SIPP=${SIPP:=sipp}
+
+NB_AORS=${NB_AORS:=100000}
+# registrations per second, all of them being done well before the 120s of their expiry
+REG_RATE=${REG_RATE:=5000}
+NB_CALLS=${NB_CALLS:=10000}
+CALL_RATE=${CALL_RATE:=500}
+# seconds left to flexisip to free what a workload no longer holds before measuring
+SETTLE_TIME=${SETTLE_TIME:=5}
+MAX_GROWTH_PERCENT=${MAX_GROWTH_PERCENT:=10}
+OUTPUT=$(realpath "${OUTPUT:=memory.json}")
+[ -n "$BASELINE" ] && BASELINE=$(realpath "$BASELINE")
+
+FLEXISIP_PORT=50060
+METRICS_PORT=50080
+UAC_PORT=5070
+# the port of the contacts of register_users.xml
+UAS_PORT=5063
+WORK_DIR=$(pwd)/memory-work
+
+WORKLOADS="$@"
+[ -z "$WORKLOADS" ] && WORKLOADS="register call"
+for workload in $WORKLOADS; do
+	case $workload in
+		register|call) ;;
+		*) usage ;;
+	esac
+done
+
+command -v "$SIPP" > /dev/null || { echo "sipp not found, set SIPP"; exit 1; }
+command -v curl > /dev/null || { echo "curl not found"; exit 1; }
+[ -x "$FLEXISIP" ] || { echo "flexisip not found at $FLEXISIP, set FLEXISIP"; exit 1; }
+[[ $FLEXISIP == */* ]] && FLEXISIP=$(realpath "$FLEXISIP")
+[[ $SIPP == */* ]] && SIPP=$(realpath "$SIPP")
+
+cd "$(dirname "$0")"
+ulimit -n 65000
+
+SIPP_COMMONS="-i 127.0.0.1 -nostdin -trace_err -set domain localhost -set ua memory-harness"
+FLEXISIP_PID=
+UAS_PID=
+
+start_flexisip() {
+	"$FLEXISIP" -c flexisip.conf -t sip:127.0.0.1:$FLEXISIP_PORT --set global/debug=false \
+		--set global/metrics-http-port=$METRICS_PORT "$@" &> "$WORK_DIR/$WORKLOAD/flexisip.log" &
+	FLEXISIP_PID=$!
+	sleep 2
+	if ! kill -0 $FLEXISIP_PID 2> /dev/null; then
+		echo "Error launching flexisip, see $WORK_DIR/$WORKLOAD/flexisip.log"
+		exit 1
+	fi
+}
+
+stop_all() {
+	[ -n "$UAS_PID" ] && kill $UAS_PID 2> /dev/null
+	[ -n "$FLEXISIP_PID" ] && kill -9 $FLEXISIP_PID 2> /dev/null
+	wait 2> /dev/null
+	FLEXISIP_PID=
+	UAS_PID=
+}
+trap 'stop_all; exit 1' 1 2 3 15
+
+rss_kb() {
+	awk '/^VmRSS/ { print $2 }' /proc/$FLEXISIP_PID/status 2> /dev/null || echo 0
+}
+
+# saves the metrics of flexisip in a file named after the point of the workload
+snapshot() {
+	curl -s "http://127.0.0.1:$METRICS_PORT/metrics" > "$WORK_DIR/$WORKLOAD/$1.metrics"
+	echo "rss_kb $(rss_kb)" >> "$WORK_DIR/$WORKLOAD/$1.metrics"
+}
+
+# value of a metric in a snapshot, 0 when not exported, such as the heap without jemalloc
+metric() {
+	awk -v name="$2" '$1 == name { value = $2 } END { print value ? value : 0 }' "$WORK_DIR/$WORKLOAD/$1.metrics"
+}
+
+# sum of a list of metrics between two snapshots, divided by a count
+per_unit() {
+	local before=$1 after=$2 count=$3 total=0 name
+	shift 3
+	for name in "$@"; do
+		total=$((total + $(metric $after $name) - $(metric $before $name)))
+	done
+	awk -v total=$total -v count=$count 'BEGIN { printf "%.1f", count > 0 ? total / count : 0 }'
+}
+
+# live objects of each subsystem in a snapshot, as a JSON object
+live_objects() {
+	awk '$1 ~ /^flexisip_global_count_live_/ { name = substr($1, 28); list = list (list ? "," : "") "\"" name "\":" $2 }
+		END { print "{" list "}" }' "$WORK_DIR/$WORKLOAD/$1.metrics"
+}
+
+# common part of the results of a workload: memory of the units added between two snapshots
+results() {
+	local before=$1 after=$2 count=$3 unit=$4
+	echo "\"rss_before_kb\":$(metric $before rss_kb),\"rss_after_kb\":$(metric $after rss_kb)," \
+		"\"bytes_per_$unit\":$(awk -v b=$(metric $before rss_kb) -v a=$(metric $after rss_kb) -v n=$count \
+			'BEGIN { printf "%.1f", n > 0 ? (a - b) * 1024 / n : 0 }')," \
+		"\"heap_bytes_per_$unit\":$(per_unit $before $after $count flexisip_global_heap_allocated_bytes)," \
+		"\"live_objects\":$(live_objects $after)"
+}
+
+run_register() {
+	start_flexisip
+	snapshot idle
+	"$SIPP" 127.0.0.1:$FLEXISIP_PORT $SIPP_COMMONS -sf invite.xml -p $UAC_PORT -inf users.csv -m $NB_AORS \
+		-r $REG_RATE -l $REG_RATE > "$WORK_DIR/$WORKLOAD/sipp.log" 2>&1
+	sleep $SETTLE_TIME
+	snapshot registered
+	RESULTS="$RESULTS${RESULTS:+,}\"register\":{\"aors\":$NB_AORS,$(results idle registered $NB_AORS binding)"
+	RESULTS="$RESULTS,\"allocations_per_register\":$(per_unit idle registered $NB_AORS \
+		flexisip_global_count_allocations_request_register)}"
+	stop_all
+}
+
+run_call() {
+	start_flexisip --set module::MediaRelay/enabled=true
+	"$SIPP" 127.0.0.1:$FLEXISIP_PORT $SIPP_COMMONS -sf ../register_users.xml -p $UAC_PORT -m $NB_CALLS \
+		-r $REG_RATE -set expire 3600 > "$WORK_DIR/$WORKLOAD/register.log" 2>&1
+	UAS_PID=$("$SIPP" 127.0.0.1:$FLEXISIP_PORT $SIPP_COMMONS -sf ../uas.xml -p $UAS_PORT -mi 127.0.0.1 -bg |
+		grep -o '[0-9]\+' | tail -1)
+	sleep $SETTLE_TIME
+	snapshot registered
+
+	# the calls are held until the last one is established, and a bit more to measure them
+	local ramp=$(((NB_CALLS + CALL_RATE - 1) / CALL_RATE))
+	local hold=$(((ramp + 2 * SETTLE_TIME) * 1000))
+	"$SIPP" 127.0.0.1:$FLEXISIP_PORT $SIPP_COMMONS -sf call.xml -p $UAC_PORT -m $NB_CALLS -r $CALL_RATE \
+		-l $NB_CALLS -d $hold > "$WORK_DIR/$WORKLOAD/sipp.log" 2>&1 &
+	local sipp_pid=$!
+	sleep $((ramp + SETTLE_TIME))
+	snapshot established
+	wait $sipp_pid
+	sleep $SETTLE_TIME
+	snapshot ended
+	RESULTS="$RESULTS${RESULTS:+,}\"call\":{\"calls\":$NB_CALLS,$(results registered established $NB_CALLS call)"
+	RESULTS="$RESULTS,\"allocations_per_call\":$(per_unit registered ended $NB_CALLS \
+		flexisip_global_count_allocations_request_invite flexisip_global_count_allocations_request_ack \
+		flexisip_global_count_allocations_request_bye flexisip_global_count_allocations_response)"
+	# what the calls left behind them, a leak showing here
+	RESULTS="$RESULTS,\"rss_ended_kb\":$(metric ended rss_kb),\"live_objects_ended\":$(live_objects ended)}"
+	stop_all
+}
+
+# value of a key of the results of a workload, as written in a JSON file
+json_value() {
+	grep -o "\"$2\":{[^}]*" "$1" | grep -o "\"$3\":[0-9.]*" | head -1 | cut -d: -f2
+}
+
+# compares a value of the results with the baseline, returns 1 when it grew past the threshold
+check() {
+	local workload=$1 key=$2 base current
+	base=$(json_value "$BASELINE" $workload $key)
+	current=$(json_value "$OUTPUT" $workload $key)
+	[ -z "$base" ] || [ -z "$current" ] && return 0
+	if awk -v b=$base -v c=$current -v max=$MAX_GROWTH_PERCENT 'BEGIN { exit !(b > 0 && c > b * (1 + max / 100)) }'; then
+		echo "$workload: $key regressed from $base to $current (more than $MAX_GROWTH_PERCENT%)"
+		return 1
+	fi
+	echo "$workload: $key $current (baseline $base)"
+	return 0
+}
+
+rm -rf "$WORK_DIR"
+RESULTS=""
+for WORKLOAD in $WORKLOADS; do
+	mkdir -p "$WORK_DIR/$WORKLOAD"
+	run_$WORKLOAD
+done
+
+VERSION=$("$FLEXISIP" --version 2>&1 | tail -1 | sed 's/.*version: *//; s/"/\\"/g')
+echo "{\"version\":\"$VERSION\",\"date\":\"$(date -u '+%Y-%m-%dT%H:%M:%SZ')\",$RESULTS}" > "$OUTPUT"
+echo "Results written in $OUTPUT"
+
+[ -z "$BASELINE" ] && exit 0
+STATUS=0
+for WORKLOAD in $WORKLOADS; do
+	case $WORKLOAD in
+		register) check register bytes_per_binding || STATUS=1 ;;
+		call) check call bytes_per_call || STATUS=1 ;;
+	esac
+done
+exit $STATUS
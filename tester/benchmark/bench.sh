@@ -0,0 +1,181 @@
+#!/bin/bash
+
+# Throughput benchmark: for each scenario, starts a fresh flexisip, then plays the scenario with sipp at increasing
+# rates until a step is no longer sustained, that is until a call fails or the p99 response time exceeds MAX_P99_MS.
+# Writes the max sustained rate, its p99 response time and the peak RSS of flexisip of each scenario in OUTPUT, as
+# JSON, so that two versions can be compared.
+#
+# Scenarios:
+#   register  REGISTER of a new user at each call
+#   message   MESSAGE to a registered user, answered by a sipp user agent server
+#   invite    INVITE, ACK and BYE to a registered user
+#   fork      same as invite, the callees being registered on two user agent servers, one answering, one ringing
+
+usage() {
+	echo "Usage: $0 [scenario...]"
+	echo "Scenarios: register message invite fork (default: all)"
+	echo "Environment: FLEXISIP SIPP FLEXISIP_CONFIG START_RATE RATE_STEP MAX_RATE STEP_DURATION NB_USERS MAX_P99_MS OUTPUT"
+	exit 1
+}
+
+FLEXISIP=${FLEXISIP:=/opt/belledonne-communications/bin/flexisip}
+SIPP=${SIPP:=sipp}
+FLEXISIP_CONFIG=$(realpath "${FLEXISIP_CONFIG:=$(dirname "$0")/flexisip.conf}")
+
+# rates in calls per second, duration of each rate in seconds
+START_RATE=${START_RATE:=100}
+RATE_STEP=${RATE_STEP:=100}
+MAX_RATE=${MAX_RATE:=5000}
+STEP_DURATION=${STEP_DURATION:=20}
+# number of callees of the message, invite and fork scenarios
+NB_USERS=${NB_USERS:=1000}
+# p99 response time above which a rate is not sustained
+MAX_P99_MS=${MAX_P99_MS:=200}
+OUTPUT=$(realpath "${OUTPUT:=results.json}")
+
+FLEXISIP_PORT=50060
+UAC_PORT=5070
+UAS_PORT=5063
+UAS_RINGING_PORT=5065
+# logs and sipp statistics of each step
+WORK_DIR=$(pwd)/bench-work
+
+SCENARIOS="$@"
+[ -z "$SCENARIOS" ] && SCENARIOS="register message invite fork"
+for scenario in $SCENARIOS; do
+	case $scenario in
+		register|message|invite|fork) ;;
+		*) usage ;;
+	esac
+done
+
+command -v "$SIPP" > /dev/null || { echo "sipp not found, set SIPP"; exit 1; }
+[ -x "$FLEXISIP" ] || { echo "flexisip not found at $FLEXISIP, set FLEXISIP"; exit 1; }
+[[ $FLEXISIP == */* ]] && FLEXISIP=$(realpath "$FLEXISIP")
+[[ $SIPP == */* ]] && SIPP=$(realpath "$SIPP")
+
+cd "$(dirname "$0")"
+ulimit -n 65000
+
+FLEXISIP_PID=
+UAS_PIDS=
+
+start_flexisip() {
+	"$FLEXISIP" -c "$FLEXISIP_CONFIG" -t sip:127.0.0.1:$FLEXISIP_PORT &> "$WORK_DIR/$1/flexisip.log" &
+	FLEXISIP_PID=$!
+	sleep 2
+	if ! kill -0 $FLEXISIP_PID 2> /dev/null; then
+		echo "Error launching flexisip, see $WORK_DIR/$1/flexisip.log"
+		exit 1
+	fi
+}
+
+# sipp -bg prints the pid of the background process
+start_uas() {
+	local pid
+	pid=$("$SIPP" 127.0.0.1:$FLEXISIP_PORT -i 127.0.0.1 -nostdin -bg -sf "$1" -p $2 -mi 127.0.0.1 -trace_err | grep -o '[0-9]\+' | tail -1)
+	UAS_PIDS="$UAS_PIDS $pid"
+}
+
+register_callees() {
+	"$SIPP" 127.0.0.1:$FLEXISIP_PORT -i 127.0.0.1 -nostdin -sf register-callee.xml -p $UAC_PORT -inf "$WORK_DIR/users.csv" \
+		-set uas_port $1 -m $NB_USERS -r 500 -trace_err > /dev/null
+}
+
+stop_all() {
+	[ -n "$UAS_PIDS" ] && kill $UAS_PIDS 2> /dev/null
+	[ -n "$FLEXISIP_PID" ] && kill -9 $FLEXISIP_PID 2> /dev/null
+	wait 2> /dev/null
+	FLEXISIP_PID=
+	UAS_PIDS=
+}
+trap 'stop_all; exit 1' 1 2 3 15
+
+rss_kb() {
+	awk '/^VmRSS/ { print $2 }' /proc/$FLEXISIP_PID/status 2> /dev/null || echo 0
+}
+
+# value of a column of the last line of a sipp statistics file
+stat_column() {
+	awk -F';' -v name="$2" 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == name) col = i } END { print col ? $col + 0 : 0 }' "$1"
+}
+
+# p99 of the response times in milliseconds recorded by sipp -trace_rtt
+p99_ms() {
+	awk -F';' 'NR > 1 && $2 != "" { print $2 }' "$@" | sort -n |
+		awk '{ v[NR] = $1 } END { if (NR == 0) { print 0; exit } i = int(NR * 0.99); if (i < NR * 0.99) i++; printf "%.3f\n", v[i] }'
+}
+
+# plays one rate, prints "successful failed p99"
+run_step() {
+	local dir=$1 rate=$2 file=$3
+	shift 3
+	mkdir -p "$dir"
+	(cd "$dir" && "$SIPP" 127.0.0.1:$FLEXISIP_PORT -i 127.0.0.1 -nostdin -sf "$OLDPWD/$file" -p $UAC_PORT "$@" \
+		-r $rate -m $((rate * STEP_DURATION)) -l $((rate * 10)) -trace_err -trace_stat -stf stat.csv -fd 1 \
+		-trace_rtt -rtt_freq $rate > sipp.log 2>&1)
+	echo "$(stat_column "$dir/stat.csv" 'SuccessfulCall(C)') $(stat_column "$dir/stat.csv" 'FailedCall(C)')" \
+		"$(p99_ms "$dir"/*_rtt.csv)"
+}
+
+run_scenario() {
+	local scenario=$1 file options
+	mkdir -p "$WORK_DIR/$scenario"
+	start_flexisip $scenario
+	case $scenario in
+		register)
+			file=register.xml
+			;;
+		message|invite|fork)
+			file=$scenario.xml
+			[ $scenario = fork ] && file=invite.xml
+			options="-inf $WORK_DIR/users.csv"
+			start_uas uas.xml $UAS_PORT
+			register_callees $UAS_PORT
+			if [ $scenario = fork ]; then
+				start_uas uas-ringing.xml $UAS_RINGING_PORT
+				register_callees $UAS_RINGING_PORT
+			fi
+			;;
+	esac
+
+	local rate=$START_RATE best_rate=0 best_p99=0 peak_rss=0 steps=""
+	while [ $rate -le $MAX_RATE ]; do
+		local result successful failed p99 rss sustained=false
+		result=$(run_step "$WORK_DIR/$scenario/$rate" $rate $file $options)
+		read successful failed p99 <<< "$result"
+		rss=$(rss_kb)
+		[ "$rss" -gt "$peak_rss" ] && peak_rss=$rss
+		if [ "$failed" -eq 0 ] && [ "$successful" -gt 0 ] && awk -v p="$p99" -v max=$MAX_P99_MS 'BEGIN { exit !(p <= max) }'; then
+			sustained=true
+		fi
+		echo "$scenario: rate=$rate successful=$successful failed=$failed p99=${p99}ms rss=${rss}kB sustained=$sustained"
+		steps="$steps${steps:+,}{\"rate\":$rate,\"successful\":$successful,\"failed\":$failed,\"p99_ms\":$p99,\"rss_kb\":$rss,\"sustained\":$sustained}"
+		if [ $sustained = false ] || ! kill -0 $FLEXISIP_PID 2> /dev/null; then
+			break
+		fi
+		best_rate=$rate
+		best_p99=$p99
+		rate=$((rate + RATE_STEP))
+	done
+	stop_all
+
+	RESULTS="$RESULTS${RESULTS:+,}{\"scenario\":\"$scenario\",\"max_rate\":$best_rate,\"p99_ms\":$best_p99,\"peak_rss_kb\":$peak_rss,\"steps\":[$steps]}"
+}
+
+rm -rf "$WORK_DIR"
+mkdir -p "$WORK_DIR"
+{
+	echo "SEQUENTIAL"
+	for i in $(seq 1 $NB_USERS); do echo "callee$i;"; done
+} > "$WORK_DIR/users.csv"
+
+RESULTS=""
+for scenario in $SCENARIOS; do
+	run_scenario $scenario
+done
+
+VERSION=$("$FLEXISIP" --version 2>&1 | tail -1 | sed 's/.*version: *//; s/"/\\"/g')
+echo "{\"version\":\"$VERSION\",\"date\":\"$(date -u '+%Y-%m-%dT%H:%M:%SZ')\",\"step_duration\":$STEP_DURATION," \
+	"\"max_p99_ms\":$MAX_P99_MS,\"scenarios\":[$RESULTS]}" > "$OUTPUT"
+echo "Results written in $OUTPUT"